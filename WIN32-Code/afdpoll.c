@@ -0,0 +1,626 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A readiness backend for Windows that doesn't call select().
+ *
+ * Under Winsock, the kernel driver for sockets (AFD) answers a poll
+ * request that names a socket and the conditions we want to hear about,
+ * and completes it once one of them holds.  We open our own handle on the
+ * driver, tie it to an I/O completion port, and keep one such request
+ * outstanding per socket we're watching.  Waiting for events is then one
+ * call to GetQueuedCompletionStatus(Ex), however many sockets there are,
+ * and adding or removing an event touches only its own socket.
+ *
+ * A poll request is one-shot, so after one completes we send it again at
+ * the start of the next dispatch if the socket is still wanted.  That
+ * gives the same level-triggered behavior as select().  When what we want
+ * to hear about a socket changes while its request is outstanding, we
+ * cancel the request, and send a new one once the cancellation completes.
+ *
+ * None of this is documented, but it is how Winsock's own select() and
+ * WSAPoll() work, and what wepoll and libuv use.  If we can't open the
+ * driver, init fails and the base falls back to the "win32" backend.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <winternl.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "event2/util.h"
+#include "event-config.h"
+#include "util-internal.h"
+#include "log-internal.h"
+#include "mm-internal.h"
+#include "event2/event.h"
+#include "event-internal.h"
+#include "evmap-internal.h"
+#include "evthread-internal.h"
+
+#ifndef STATUS_SUCCESS
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#endif
+#ifndef STATUS_PENDING
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#endif
+#ifndef STATUS_CANCELLED
+#define STATUS_CANCELLED ((NTSTATUS)0xC0000120L)
+#endif
+#ifndef STATUS_NOT_FOUND
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#endif
+#ifndef FILE_OPEN
+#define FILE_OPEN 0x00000001
+#endif
+#ifndef FILE_SKIP_SET_EVENT_ON_HANDLE
+#define FILE_SKIP_SET_EVENT_ON_HANDLE 0x2
+#endif
+
+/* Ways of finding the socket that the driver knows about underneath one
+ * that a layered service provider has wrapped. */
+#define SIO_BASE_HANDLE 0x48000022
+#define SIO_BSP_HANDLE_POLL 0x4800001D
+#define SIO_BSP_HANDLE_SELECT 0x4800001C
+
+#define IOCTL_AFD_POLL 0x00012024
+
+#define AFD_POLL_RECEIVE 0x0001
+#define AFD_POLL_RECEIVE_EXPEDITED 0x0002
+#define AFD_POLL_SEND 0x0004
+#define AFD_POLL_DISCONNECT 0x0008
+#define AFD_POLL_ABORT 0x0010
+#define AFD_POLL_LOCAL_CLOSE 0x0020
+#define AFD_POLL_ACCEPT 0x0080
+#define AFD_POLL_CONNECT_FAIL 0x0100
+
+/* What select() would count as readable, writable, or both. */
+#define AFD_READ_EVENTS (AFD_POLL_RECEIVE | AFD_POLL_RECEIVE_EXPEDITED | \
+	AFD_POLL_DISCONNECT | AFD_POLL_ACCEPT)
+#define AFD_WRITE_EVENTS AFD_POLL_SEND
+#define AFD_ERROR_EVENTS (AFD_POLL_ABORT | AFD_POLL_CONNECT_FAIL)
+
+struct afd_poll_handle_info {
+	HANDLE handle;
+	ULONG events;
+	NTSTATUS status;
+};
+
+struct afd_poll_info {
+	LARGE_INTEGER timeout;
+	ULONG n_handles;
+	ULONG exclusive;
+	struct afd_poll_handle_info handles[1];
+};
+
+typedef NTSTATUS (NTAPI *NtCreateFile_fn)(PHANDLE, ACCESS_MASK,
+    POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PLARGE_INTEGER, ULONG, ULONG,
+    ULONG, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *NtDeviceIoControlFile_fn)(HANDLE, HANDLE, PVOID,
+    PVOID, PIO_STATUS_BLOCK, ULONG, PVOID, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *NtCancelIoFileEx_fn)(HANDLE, PIO_STATUS_BLOCK,
+    PIO_STATUS_BLOCK);
+typedef ULONG (WINAPI *RtlNtStatusToDosError_fn)(NTSTATUS);
+
+static NtCreateFile_fn nt_create_file = NULL;
+static NtDeviceIoControlFile_fn nt_device_io_control_file = NULL;
+static NtCancelIoFileEx_fn nt_cancel_io_file_ex = NULL;
+static RtlNtStatusToDosError_fn rtl_nt_status_to_dos_error = NULL;
+
+/* Laid out like Vista's OVERLAPPED_ENTRY, which older headers lack. */
+struct afd_entry {
+	ULONG_PTR completion_key;
+	IO_STATUS_BLOCK *iosb;
+	ULONG_PTR internal;
+	DWORD n_bytes;
+};
+typedef BOOL (WINAPI *GetQueuedCompletionStatusEx_fn)(HANDLE,
+    struct afd_entry *, ULONG, ULONG *, DWORD, BOOL);
+static GetQueuedCompletionStatusEx_fn get_queued_status_ex = NULL;
+
+/* One socket that we're watching, or have been. */
+struct afd_sock {
+	/* Must be first: completions hand us back a pointer to it. */
+	IO_STATUS_BLOCK iosb;
+	struct afd_poll_info info;
+
+	evutil_socket_t fd;
+	/* The socket the driver knows about, underneath any LSPs. */
+	SOCKET base_sock;
+	/* What we want to hear about: EV_READ and EV_WRITE. */
+	short wanted;
+	/* The AFD_POLL_* flags of the outstanding request, if any. */
+	ULONG polling;
+	unsigned pending : 1;
+	unsigned cancelled : 1;
+	unsigned in_update_queue : 1;
+	/* The fd has no events any more; free this once nothing is
+	 * outstanding. */
+	unsigned dead : 1;
+
+	TAILQ_ENTRY(afd_sock) update_next;
+	TAILQ_ENTRY(afd_sock) all_next;
+};
+
+struct afd_fdinfo {
+	struct afd_sock *sock;
+};
+
+TAILQ_HEAD(afd_sock_list, afd_sock);
+
+struct afdop {
+	HANDLE iocp;
+	HANDLE afd;
+	/* Sockets whose requests need to be sent, changed, or cancelled. */
+	struct afd_sock_list update_queue;
+	struct afd_sock_list all;
+	struct afd_entry *entries;
+	int n_entries;
+	unsigned signals_are_broken : 1;
+};
+
+static void *afd_init(struct event_base *);
+static int afd_add(struct event_base *, evutil_socket_t, short old,
+    short events, void *);
+static int afd_del(struct event_base *, evutil_socket_t, short old,
+    short events, void *);
+static int afd_dispatch(struct event_base *, struct timeval *);
+static void afd_dealloc(struct event_base *);
+
+const struct eventop afdops = {
+	"afd",
+	afd_init,
+	afd_add,
+	afd_del,
+	afd_dispatch,
+	afd_dealloc,
+	0, /* doesn't need reinit */
+	EV_FEATURE_O1,
+	sizeof(struct afd_fdinfo),
+};
+
+#define INITIAL_NENTRIES 64
+#define MAX_NENTRIES 4096
+
+static int
+load_functions(void)
+{
+	HMODULE ntdll = GetModuleHandle(TEXT("ntdll.dll"));
+	HMODULE kernel32 = GetModuleHandle(TEXT("kernel32.dll"));
+
+	if (nt_create_file)
+		return 0;
+	if (!ntdll)
+		return -1;
+	nt_device_io_control_file = (NtDeviceIoControlFile_fn)
+	    GetProcAddress(ntdll, "NtDeviceIoControlFile");
+	nt_cancel_io_file_ex = (NtCancelIoFileEx_fn)
+	    GetProcAddress(ntdll, "NtCancelIoFileEx");
+	rtl_nt_status_to_dos_error = (RtlNtStatusToDosError_fn)
+	    GetProcAddress(ntdll, "RtlNtStatusToDosError");
+	if (kernel32)
+		get_queued_status_ex = (GetQueuedCompletionStatusEx_fn)
+		    GetProcAddress(kernel32, "GetQueuedCompletionStatusEx");
+	if (!nt_device_io_control_file || !nt_cancel_io_file_ex ||
+	    !rtl_nt_status_to_dos_error)
+		return -1;
+	/* Set this last: it says the others are ready. */
+	nt_create_file = (NtCreateFile_fn)GetProcAddress(ntdll, "NtCreateFile");
+	return nt_create_file ? 0 : -1;
+}
+
+/* Open a handle on the socket driver of our own, to send poll requests
+ * through.  The part of the name after \Device\Afd doesn't matter. */
+static HANDLE
+open_afd(void)
+{
+	static WCHAR name_buf[] = L"\\Device\\Afd\\Libevent";
+	UNICODE_STRING name;
+	OBJECT_ATTRIBUTES attr;
+	IO_STATUS_BLOCK iosb;
+	HANDLE h;
+	NTSTATUS status;
+
+	name.Length = sizeof(name_buf) - sizeof(WCHAR);
+	name.MaximumLength = sizeof(name_buf);
+	name.Buffer = name_buf;
+	InitializeObjectAttributes(&attr, &name, 0, NULL, NULL);
+
+	status = nt_create_file(&h, SYNCHRONIZE, &attr, &iosb, NULL, 0,
+	    FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN, 0, NULL, 0);
+	if (status != STATUS_SUCCESS) {
+		SetLastError(rtl_nt_status_to_dos_error(status));
+		return INVALID_HANDLE_VALUE;
+	}
+	return h;
+}
+
+static SOCKET
+get_base_socket(evutil_socket_t fd)
+{
+	static const DWORD ioctls[] = {
+		SIO_BASE_HANDLE, SIO_BSP_HANDLE_POLL, SIO_BSP_HANDLE_SELECT
+	};
+	SOCKET base_sock;
+	DWORD n;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		if (WSAIoctl(fd, ioctls[i], NULL, 0, &base_sock,
+			sizeof(base_sock), &n, NULL, NULL) != SOCKET_ERROR &&
+		    base_sock != INVALID_SOCKET)
+			return base_sock;
+	}
+	return INVALID_SOCKET;
+}
+
+static void *
+afd_init(struct event_base *base)
+{
+	struct afdop *afdop;
+
+	if (load_functions() < 0)
+		return NULL;
+	if (!(afdop = mm_calloc(1, sizeof(struct afdop))))
+		return NULL;
+	afdop->iocp = NULL;
+	afdop->afd = INVALID_HANDLE_VALUE;
+	TAILQ_INIT(&afdop->update_queue);
+	TAILQ_INIT(&afdop->all);
+
+	afdop->n_entries = get_queued_status_ex ? INITIAL_NENTRIES : 1;
+	if (!(afdop->entries = mm_calloc(afdop->n_entries,
+		    sizeof(struct afd_entry))))
+		goto err;
+	if (!(afdop->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE,
+		    NULL, 0, 1)))
+		goto err;
+	if ((afdop->afd = open_afd()) == INVALID_HANDLE_VALUE)
+		goto err;
+	if (!CreateIoCompletionPort(afdop->afd, afdop->iocp, 0, 0))
+		goto err;
+	/* Nobody waits on the handle itself; don't bother signalling it. */
+	SetFileCompletionNotificationModes(afdop->afd,
+	    FILE_SKIP_SET_EVENT_ON_HANDLE);
+
+	if (evsig_init(base) < 0)
+		afdop->signals_are_broken = 1;
+
+	return afdop;
+err:
+	event_debug(("%s: can't use the socket driver: error %lu", __func__,
+		(unsigned long)GetLastError()));
+	if (afdop->afd != INVALID_HANDLE_VALUE)
+		CloseHandle(afdop->afd);
+	if (afdop->iocp)
+		CloseHandle(afdop->iocp);
+	if (afdop->entries)
+		mm_free(afdop->entries);
+	mm_free(afdop);
+	return NULL;
+}
+
+static void
+queue_update(struct afdop *afdop, struct afd_sock *sock)
+{
+	if (!sock->in_update_queue) {
+		TAILQ_INSERT_TAIL(&afdop->update_queue, sock, update_next);
+		sock->in_update_queue = 1;
+	}
+}
+
+static void
+free_sock(struct afdop *afdop, struct afd_sock *sock)
+{
+	if (sock->in_update_queue)
+		TAILQ_REMOVE(&afdop->update_queue, sock, update_next);
+	TAILQ_REMOVE(&afdop->all, sock, all_next);
+	mm_free(sock);
+}
+
+static ULONG
+afd_events_for(short wanted)
+{
+	ULONG events = 0;
+	if (wanted & EV_READ)
+		events |= AFD_READ_EVENTS | AFD_ERROR_EVENTS;
+	if (wanted & EV_WRITE)
+		events |= AFD_WRITE_EVENTS | AFD_ERROR_EVENTS;
+	return events;
+}
+
+static int
+afd_add(struct event_base *base, evutil_socket_t fd, short old, short events,
+    void *_fdinfo)
+{
+	struct afdop *afdop = base->evbase;
+	struct afd_fdinfo *fdinfo = _fdinfo;
+	struct afd_sock *sock = fdinfo->sock;
+
+	if ((events & EV_SIGNAL) && afdop->signals_are_broken)
+		return (-1);
+	if (!(events & (EV_READ|EV_WRITE)))
+		return (0);
+
+	if (!sock) {
+		SOCKET base_sock = get_base_socket(fd);
+		if (base_sock == INVALID_SOCKET) {
+			event_warnx("%s: %d doesn't look like a socket",
+			    __func__, (int)fd);
+			return (-1);
+		}
+		if (!(sock = mm_calloc(1, sizeof(struct afd_sock))))
+			return (-1);
+		sock->fd = fd;
+		sock->base_sock = base_sock;
+		TAILQ_INSERT_TAIL(&afdop->all, sock, all_next);
+		fdinfo->sock = sock;
+	}
+	sock->dead = 0;
+	sock->wanted = (old | events) & (EV_READ|EV_WRITE);
+	queue_update(afdop, sock);
+
+	event_debug(("%s: watching %d for %d", __func__, (int)fd,
+		(int)sock->wanted));
+	return (0);
+}
+
+static int
+afd_del(struct event_base *base, evutil_socket_t fd, short old, short events,
+    void *_fdinfo)
+{
+	struct afdop *afdop = base->evbase;
+	struct afd_fdinfo *fdinfo = _fdinfo;
+	struct afd_sock *sock = fdinfo->sock;
+
+	if (!sock || !(events & (EV_READ|EV_WRITE)))
+		return (0);
+
+	sock->wanted = old & ~events & (EV_READ|EV_WRITE);
+	if (!sock->wanted) {
+		/* The evmap entry may go away, or be reused for another
+		 * socket with the same number; forget it. */
+		fdinfo->sock = NULL;
+		sock->dead = 1;
+		if (!sock->pending) {
+			free_sock(afdop, sock);
+			return (0);
+		}
+	}
+	queue_update(afdop, sock);
+
+	event_debug(("%s: watching %d for %d", __func__, (int)fd,
+		(int)sock->wanted));
+	return (0);
+}
+
+static int
+send_poll(struct afdop *afdop, struct afd_sock *sock, ULONG events)
+{
+	NTSTATUS status;
+
+	sock->info.timeout.QuadPart = _I64_MAX;
+	sock->info.n_handles = 1;
+	sock->info.exclusive = FALSE;
+	sock->info.handles[0].handle = (HANDLE)sock->base_sock;
+	sock->info.handles[0].events = events;
+	sock->info.handles[0].status = 0;
+	sock->iosb.Status = STATUS_PENDING;
+
+	status = nt_device_io_control_file(afdop->afd, NULL, NULL,
+	    &sock->iosb, &sock->iosb, IOCTL_AFD_POLL,
+	    &sock->info, sizeof(sock->info),
+	    &sock->info, sizeof(sock->info));
+	if (status != STATUS_SUCCESS && status != STATUS_PENDING) {
+		event_warnx("%s: can't poll %d: error %lu", __func__,
+		    (int)sock->fd,
+		    (unsigned long)rtl_nt_status_to_dos_error(status));
+		return (-1);
+	}
+	/* Either way, the result comes through the completion port. */
+	sock->pending = 1;
+	sock->cancelled = 0;
+	sock->polling = events;
+	return (0);
+}
+
+/* Bring the requests outstanding for each socket in the update queue in
+ * line with what we want to hear about it. */
+static void
+apply_updates(struct event_base *base, struct afdop *afdop)
+{
+	struct afd_sock *sock;
+	IO_STATUS_BLOCK cancel_iosb;
+	ULONG want;
+
+	while ((sock = TAILQ_FIRST(&afdop->update_queue))) {
+		TAILQ_REMOVE(&afdop->update_queue, sock, update_next);
+		sock->in_update_queue = 0;
+
+		want = sock->dead ? 0 : afd_events_for(sock->wanted);
+		if (sock->pending) {
+			/* An outstanding request that asks for just what we
+			 * want, or is already going away, can stay. */
+			if (sock->cancelled || sock->polling == want)
+				continue;
+			/* Otherwise cancel it; when the cancellation
+			 * completes, the socket comes back here. */
+			if (nt_cancel_io_file_ex(afdop->afd, &sock->iosb,
+				&cancel_iosb) != STATUS_NOT_FOUND)
+				sock->cancelled = 1;
+			continue;
+		}
+		if (sock->dead) {
+			free_sock(afdop, sock);
+			continue;
+		}
+		if (want && send_poll(afdop, sock, want) < 0) {
+			/* Tell whoever is waiting on it, so that they find
+			 * out what's wrong when they use it. */
+			evmap_io_active(base, sock->fd, sock->wanted);
+		}
+	}
+}
+
+static void
+handle_completion(struct event_base *base, struct afdop *afdop,
+    struct afd_sock *sock)
+{
+	ULONG got;
+	short res = 0;
+
+	sock->pending = 0;
+	sock->cancelled = 0;
+	sock->polling = 0;
+
+	if (sock->dead) {
+		free_sock(afdop, sock);
+		return;
+	}
+
+	if (sock->iosb.Status == STATUS_CANCELLED) {
+		/* We asked for this; send the request we want now. */
+		queue_update(afdop, sock);
+		return;
+	} else if (!NT_SUCCESS(sock->iosb.Status)) {
+		/* Something went wrong with the socket; let whoever is
+		 * watching it find out what. */
+		res = sock->wanted;
+	} else if (sock->info.n_handles >= 1) {
+		got = sock->info.handles[0].events;
+		if (got & AFD_POLL_LOCAL_CLOSE) {
+			/* Somebody closed the socket out from under us.
+			 * Don't poll it again unless it's added again. */
+			sock->wanted = 0;
+			return;
+		}
+		if (got & (AFD_READ_EVENTS | AFD_ERROR_EVENTS))
+			res |= EV_READ;
+		if (got & (AFD_WRITE_EVENTS | AFD_ERROR_EVENTS))
+			res |= EV_WRITE;
+		res &= sock->wanted;
+	}
+
+	/* Poll requests are one-shot; send another next time. */
+	queue_update(afdop, sock);
+	if (res)
+		evmap_io_active(base, sock->fd, res);
+}
+
+static int
+afd_dispatch(struct event_base *base, struct timeval *tv)
+{
+	struct afdop *afdop = base->evbase;
+	struct afd_entry *entries = afdop->entries;
+	DWORD ms = INFINITE;
+	ULONG n = 0;
+	ULONG i;
+	BOOL ok;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	apply_updates(base, afdop);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	if (tv != NULL)
+		ms = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+
+	if (get_queued_status_ex) {
+		ok = get_queued_status_ex(afdop->iocp, entries,
+		    afdop->n_entries, &n, ms, FALSE);
+	} else {
+		OVERLAPPED *o = NULL;
+		ok = GetQueuedCompletionStatus(afdop->iocp,
+		    &entries[0].n_bytes, &entries[0].completion_key, &o, ms);
+		entries[0].iosb = (IO_STATUS_BLOCK *)o;
+		/* A failed poll request still has a completion for us. */
+		if (o) {
+			ok = TRUE;
+			n = 1;
+		}
+	}
+
+	if (!ok) {
+		DWORD err = GetLastError();
+		evsig_process(base);
+		if (err == WAIT_TIMEOUT)
+			return (0);
+		event_warnx("%s: GetQueuedCompletionStatus: error %lu",
+		    __func__, (unsigned long)err);
+		return (-1);
+	}
+	if (base->sig.evsig_caught)
+		evsig_process(base);
+
+	event_debug(("%s: %lu completions", __func__, (unsigned long)n));
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	for (i = 0; i < n; ++i) {
+		/* The status block is the first thing in the socket. */
+		struct afd_sock *sock = (struct afd_sock *)entries[i].iosb;
+		if (sock)
+			handle_completion(base, afdop, sock);
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	if (n == (ULONG)afdop->n_entries && afdop->n_entries < MAX_NENTRIES &&
+	    get_queued_status_ex) {
+		/* We used all the space we had; next time, take more. */
+		int new_n = afdop->n_entries * 2;
+		struct afd_entry *new_entries = mm_realloc(afdop->entries,
+		    new_n * sizeof(struct afd_entry));
+		if (new_entries) {
+			afdop->entries = new_entries;
+			afdop->n_entries = new_n;
+		}
+	}
+
+	return (0);
+}
+
+static void
+afd_dealloc(struct event_base *base)
+{
+	struct afdop *afdop = base->evbase;
+	struct afd_sock *sock;
+
+	evsig_dealloc(base);
+	/* Closing the driver handle ends every request sent through it, so
+	 * nothing can write to the sockets once we've freed them. */
+	CloseHandle(afdop->afd);
+	CloseHandle(afdop->iocp);
+	while ((sock = TAILQ_FIRST(&afdop->all))) {
+		TAILQ_REMOVE(&afdop->all, sock, all_next);
+		mm_free(sock);
+	}
+	mm_free(afdop->entries);
+	memset(afdop, 0, sizeof(*afdop));
+	mm_free(afdop);
+}
@@ -35,12 +35,14 @@
 #include <io.h>
 #endif
 
-#ifdef _EVENT_HAVE_VASPRINTF
-/* If we have vasprintf, we need to define this before we include stdio.h. */
+#if defined(_EVENT_HAVE_VASPRINTF) || defined(_EVENT_HAVE_SPLICE)
+/* If we have vasprintf or splice, we need to define this before we include
+ * stdio.h or fcntl.h. */
 #define _GNU_SOURCE
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef _EVENT_HAVE_SYS_TIME_H
 #include <sys/time.h>
@@ -66,6 +68,10 @@
 #include <sys/sendfile.h>
 #endif
 
+#ifdef _EVENT_HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -88,6 +94,9 @@
 #include "util-internal.h"
 #include "evthread-internal.h"
 #include "evbuffer-internal.h"
+#include "event-internal.h"
+#include "evpool-internal.h"
+#include "probes-internal.h"
 
 /* some systems do not have MAP_FAILED */
 #ifndef MAP_FAILED
@@ -106,6 +115,22 @@
 #define SENDFILE_IS_MACOSX	1
 #endif
 
+/* splice support */
+#if defined(_EVENT_HAVE_SPLICE) && defined(__linux__)
+#define USE_SPLICE		1
+#endif
+
+/* spilling to a file: we need a temporary file, and a way to stream it back */
+#if defined(_EVENT_HAVE_MKSTEMP) && defined(_EVENT_HAVE_SYS_UIO_H) && \
+    (defined(USE_SENDFILE) || defined(_EVENT_HAVE_MMAP))
+#define USE_SPILL		1
+#endif
+
+/* lock-free single-producer/single-consumer mode needs memory barriers */
+#if defined(EVTHREAD_HAVE_ATOMICS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
+#define USE_SPSC		1
+#endif
+
 #ifdef USE_SENDFILE
 static int use_sendfile = 1;
 #endif
@@ -113,6 +138,15 @@ static int use_sendfile = 1;
 static int use_mmap = 1;
 #endif
 
+/* vector scanning support; everything else uses libc's memchr */
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define USE_SSE2_SCAN		1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON_SCAN		1
+#endif
+
 
 /* Mask of user-selectable callback flags. */
 #define EVBUFFER_CB_USER_FLAGS      0xffff
@@ -128,6 +162,11 @@ static int use_mmap = 1;
 
 /* Flag set if the callback is using the cb_obsolete function pointer  */
 #define EVBUFFER_CB_OBSOLETE           0x00040000
+/* Flag set if the callback only runs when the length crosses its threshold */
+#define EVBUFFER_CB_THRESHOLD          0x00080000
+/* Flag set on threshold callbacks while the length is at or above the
+ * threshold. */
+#define EVBUFFER_CB_ABOVE              0x00100000
 
 /* evbuffer_chain support */
 #define CHAIN_SPACE_PTR(ch) ((ch)->buffer + (ch)->misalign + (ch)->off)
@@ -137,14 +176,541 @@ static int use_mmap = 1;
 #define CHAIN_PINNED(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_ANY) != 0)
 #define CHAIN_PINNED_R(ch)  (((ch)->flags & EVBUFFER_MEM_PINNED_R) != 0)
 
+/* evbuffer_add() makes each new chain twice as big as the last one, up to
+ * this size. */
+#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
+
+/* Before a writev(), we merge runs of chains holding at most this many
+ * bytes apiece rather than give each of them an iovec of its own. */
+#define EVBUFFER_COALESCE_MAX 512
+
+/* True iff ch is an ordinary chain that owns all its memory. */
+#define CHAIN_PLAIN(ch) (((ch)->flags & ~EVBUFFER_POOLED) == 0)
+/* True iff we may copy the data out of ch and free it. */
+#define CHAIN_COPYABLE(ch) (((ch)->flags & (EVBUFFER_SENDFILE|	\
+	    EVBUFFER_SPLICE|EVBUFFER_SPILL|EVBUFFER_MEM_PINNED_ANY)) == 0)
+
 static void evbuffer_chain_align(struct evbuffer_chain *chain);
 static void evbuffer_deferred_callback(struct deferred_cb *cb, void *arg);
 
+/* Chains that don't come from a pool are kept, once freed, in a cache for
+ * the thread that freed them, so that reading into a buffer and draining
+ * it again doesn't go through mm_malloc() every time.  Each thread's
+ * cache holds chains of the sizes evbuffer_chain_new() rounds to, from
+ * MIN_BUFFER_SIZE up to CHAIN_CACHE_MAX_SIZE, and at most
+ * chain_cache_max_bytes of them in all.  Nothing frees a thread's cache
+ * when the thread exits, so the cache is off until the user sets a limit.
+ * When the limit is lowered, each thread trims its own cache the next time
+ * it frees a chain.
+ *
+ * We need a thread-local variable for this, unless there are no threads.
+ */
+#if defined(_EVENT_HAVE___THREAD)
+#define USE_CHAIN_CACHE
+#define CHAIN_CACHE_THREAD_LOCAL __thread
+#elif defined(_EVENT_DISABLE_THREAD_SUPPORT)
+#define USE_CHAIN_CACHE
+#define CHAIN_CACHE_THREAD_LOCAL
+#endif
+
+#ifdef USE_CHAIN_CACHE
+#define CHAIN_CACHE_N_CLASSES 9
+#define CHAIN_CACHE_MAX_SIZE (MIN_BUFFER_SIZE << (CHAIN_CACHE_N_CLASSES - 1))
+
+struct evbuffer_chain_cache {
+	/* Free chains of size MIN_BUFFER_SIZE << i, linked through next. */
+	struct evbuffer_chain *chains[CHAIN_CACHE_N_CLASSES];
+	/* Total size of the chains held, headers included. */
+	size_t n_bytes;
+};
+
+static CHAIN_CACHE_THREAD_LOCAL struct evbuffer_chain_cache chain_cache;
+static size_t chain_cache_max_bytes = 0;
+
+/* Return the cache class for chains of to_alloc bytes, or -1 if we don't
+ * cache chains of that size. */
+static inline int
+chain_cache_class(size_t to_alloc)
+{
+	int i;
+	for (i = 0; i < CHAIN_CACHE_N_CLASSES; ++i) {
+		if (to_alloc == ((size_t)MIN_BUFFER_SIZE << i))
+			return i;
+	}
+	return -1;
+}
+
+/* Take a chain of to_alloc bytes from this thread's cache, or return NULL
+ * if it has none. */
+static inline struct evbuffer_chain *
+chain_cache_get(size_t to_alloc)
+{
+	struct evbuffer_chain *chain;
+	int cls;
+
+	if (to_alloc > CHAIN_CACHE_MAX_SIZE ||
+	    (cls = chain_cache_class(to_alloc)) < 0)
+		return NULL;
+	if ((chain = chain_cache.chains[cls]) != NULL) {
+		chain_cache.chains[cls] = chain->next;
+		chain_cache.n_bytes -= to_alloc;
+	}
+	return chain;
+}
+
+/* Put a plain heap-allocated chain in this thread's cache if it fits
+ * there.  Returns 0 if it did, and -1 if the caller should free it. */
+static inline int
+chain_cache_put(struct evbuffer_chain *chain)
+{
+	size_t size = chain->buffer_len + EVBUFFER_CHAIN_SIZE;
+	int cls;
+
+	/* The limit may have been lowered by another thread. */
+	if (chain_cache.n_bytes > chain_cache_max_bytes)
+		evbuffer_trim_chain_cache(chain_cache_max_bytes);
+	if (size > CHAIN_CACHE_MAX_SIZE ||
+	    chain_cache.n_bytes + size > chain_cache_max_bytes ||
+	    (cls = chain_cache_class(size)) < 0 ||
+	    (chain->flags & EVBUFFER_POOLED))
+		return -1;
+	chain->next = chain_cache.chains[cls];
+	chain_cache.chains[cls] = chain;
+	chain_cache.n_bytes += size;
+	return 0;
+}
+#endif
+
+int
+evbuffer_set_chain_cache_limit(size_t max_bytes)
+{
+#ifdef USE_CHAIN_CACHE
+	chain_cache_max_bytes = max_bytes;
+	evbuffer_trim_chain_cache(max_bytes);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+size_t
+evbuffer_trim_chain_cache(size_t keep_bytes)
+{
+	size_t freed = 0;
+#ifdef USE_CHAIN_CACHE
+	int i;
+	/* Give back the biggest chains first. */
+	for (i = CHAIN_CACHE_N_CLASSES - 1; i >= 0; --i) {
+		const size_t size = (size_t)MIN_BUFFER_SIZE << i;
+		while (chain_cache.n_bytes > keep_bytes &&
+		    chain_cache.chains[i]) {
+			struct evbuffer_chain *chain = chain_cache.chains[i];
+			chain_cache.chains[i] = chain->next;
+			chain_cache.n_bytes -= size;
+			freed += size;
+			mm_free(chain);
+		}
+	}
+#endif
+	return freed;
+}
+
+size_t
+evbuffer_get_chain_cache_size(void)
+{
+#ifdef USE_CHAIN_CACHE
+	return chain_cache.n_bytes;
+#else
+	return 0;
+#endif
+}
+
+/* Large chains can come, if the user asks, from 2 MB regions mapped with
+ * huge pages instead of from mm_malloc(), so that going over one takes a
+ * single TLB entry rather than hundreds.  They're the sizes from
+ * HUGE_CHAIN_MIN_SIZE to HUGE_CHAIN_REGION_SIZE that evbuffer_chain_new()
+ * rounds to.  A region is cut up into chains of one size when that size
+ * runs out, and freed chains wait on the freelist for their size, shared
+ * by all threads.  Regions are never unmapped, since we'd have to know
+ * that all of their chains were free.
+ */
+#if defined(_EVENT_HAVE_MMAP) && defined(MAP_ANONYMOUS)
+#define USE_HUGE_CHAINS
+#endif
+
+#ifdef USE_HUGE_CHAINS
+#define HUGE_CHAIN_REGION_SIZE (2*1024*1024)
+#define HUGE_CHAIN_N_CLASSES 4
+#define HUGE_CHAIN_MIN_SIZE \
+	(HUGE_CHAIN_REGION_SIZE >> (HUGE_CHAIN_N_CLASSES - 1))
+
+/* Free chains of size HUGE_CHAIN_MIN_SIZE << i, linked through next. */
+static struct evbuffer_chain *huge_chains[HUGE_CHAIN_N_CLASSES];
+/* How much we have mapped, and may map. */
+static size_t huge_chain_mapped;
+static size_t huge_chain_max_bytes;
+/* Protects all of the above but huge_chain_max_bytes. */
+static void *huge_chain_lock;
+
+/* Return the class for huge chains of to_alloc bytes, or -1 if they
+ * aren't huge. */
+static inline int
+huge_chain_class(size_t to_alloc)
+{
+	int i;
+	for (i = 0; i < HUGE_CHAIN_N_CLASSES; ++i) {
+		if (to_alloc == ((size_t)HUGE_CHAIN_MIN_SIZE << i))
+			return i;
+	}
+	return -1;
+}
+
+/* Map a new region, aligned to its size so that it can sit in one huge
+ * page.  Return NULL on failure. */
+static char *
+huge_chain_map_region(void)
+{
+	char *p, *region;
+	size_t lead;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, HUGE_CHAIN_REGION_SIZE, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+	/* There are no huge pages set aside for us: map twice as much as
+	 * we need, keep an aligned region of it, and ask for the region to
+	 * be backed by transparent huge pages. */
+	p = mmap(NULL, 2 * HUGE_CHAIN_REGION_SIZE, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	lead = (HUGE_CHAIN_REGION_SIZE -
+	    ((size_t)p & (HUGE_CHAIN_REGION_SIZE - 1))) &
+	    (HUGE_CHAIN_REGION_SIZE - 1);
+	region = p + lead;
+	if (lead)
+		munmap(p, lead);
+	munmap(region + HUGE_CHAIN_REGION_SIZE, HUGE_CHAIN_REGION_SIZE - lead);
+#ifdef MADV_HUGEPAGE
+	madvise(region, HUGE_CHAIN_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	return region;
+}
+
+/* Take a huge chain of to_alloc bytes from its freelist, mapping a new
+ * region for it if we may.  Return NULL if to_alloc isn't a huge size or
+ * we can't. */
 static struct evbuffer_chain *
-evbuffer_chain_new(size_t size)
+huge_chain_get(size_t to_alloc)
+{
+	struct evbuffer_chain *chain;
+	char *region;
+	size_t off;
+	int cls;
+
+	if ((cls = huge_chain_class(to_alloc)) < 0)
+		return NULL;
+
+	EVLOCK_LOCK(huge_chain_lock, EVTHREAD_WRITE);
+	if (huge_chains[cls] == NULL &&
+	    huge_chain_mapped + HUGE_CHAIN_REGION_SIZE <=
+	    huge_chain_max_bytes &&
+	    (region = huge_chain_map_region()) != NULL) {
+		huge_chain_mapped += HUGE_CHAIN_REGION_SIZE;
+		for (off = HUGE_CHAIN_REGION_SIZE; off > 0; ) {
+			off -= to_alloc;
+			chain = (struct evbuffer_chain *)(region + off);
+			chain->next = huge_chains[cls];
+			huge_chains[cls] = chain;
+		}
+	}
+	if ((chain = huge_chains[cls]) != NULL)
+		huge_chains[cls] = chain->next;
+	EVLOCK_UNLOCK(huge_chain_lock, EVTHREAD_WRITE);
+
+	return chain;
+}
+
+/* Put a chain from huge_chain_get() back on its freelist. */
+static void
+huge_chain_put(struct evbuffer_chain *chain)
+{
+	int cls = huge_chain_class(chain->mem_len);
+
+	assert(cls >= 0);
+	EVLOCK_LOCK(huge_chain_lock, EVTHREAD_WRITE);
+	chain->next = huge_chains[cls];
+	huge_chains[cls] = chain;
+	EVLOCK_UNLOCK(huge_chain_lock, EVTHREAD_WRITE);
+}
+#endif
+
+int
+evbuffer_set_huge_chain_limit(size_t max_bytes)
+{
+#ifdef USE_HUGE_CHAINS
+	if (huge_chain_lock == NULL)
+		EVTHREAD_ALLOC_LOCK(huge_chain_lock,
+		    EVTHREAD_LOCK_CATEGORY_EVBUFFER);
+	huge_chain_max_bytes = max_bytes;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+size_t
+evbuffer_get_huge_chain_mapped(void)
+{
+	size_t mapped = 0;
+#ifdef USE_HUGE_CHAINS
+	EVLOCK_LOCK(huge_chain_lock, EVTHREAD_WRITE);
+	mapped = huge_chain_mapped;
+	EVLOCK_UNLOCK(huge_chain_lock, EVTHREAD_WRITE);
+#endif
+	return mapped;
+}
+
+/* Memory accounting.  Every chain is charged, when we make it, the bytes
+ * the allocator gave it, to the global total and to the memory group of
+ * its evbuffer.  Moving the chain to an evbuffer in another group moves
+ * the charge along; freeing it takes it back.  The charges happen in the
+ * middle of buffer operations, so crossing a group threshold only marks
+ * the group: we tell its callback and members once the operation is done,
+ * from evbuffer_invoke_callbacks() or when a buffer is freed. */
+
+/* Bytes of memory held by all chains in all evbuffers. */
+static size_t evbuffer_total_mem;
+
+static void
+evbuffer_mem_group_destroy(struct evbuffer_mem_group *group)
+{
+	EVTHREAD_FREE_LOCK(group->lock);
+	mm_free(group);
+}
+
+static void
+evbuffer_mem_group_charge(struct evbuffer_mem_group *group, size_t len)
+{
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	group->allocated += len;
+	if (!group->over && group->high && group->allocated > group->high) {
+		group->over = 1;
+		group->notify_pending = 1;
+	}
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+}
+
+static void
+evbuffer_mem_group_uncharge(struct evbuffer_mem_group *group, size_t len)
+{
+	int dead;
+
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	group->allocated -= len;
+	if (group->over && group->allocated <= group->low) {
+		group->over = 0;
+		group->notify_pending = 1;
+	}
+	dead = group->refcnt == 0 && group->allocated == 0;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+
+	if (dead)
+		evbuffer_mem_group_destroy(group);
+}
+
+/* Drop a reference to group, taken along with a buffer. */
+static void
+evbuffer_mem_group_decref(struct evbuffer_mem_group *group)
+{
+	int dead;
+
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	dead = --group->refcnt == 0 && group->allocated == 0;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+
+	if (dead)
+		evbuffer_mem_group_destroy(group);
+}
+
+/* If group crossed a threshold since we last looked, tell its members and
+ * its callback.  The caller must hold a reference to group. */
+static void
+evbuffer_mem_group_notify(struct evbuffer_mem_group *group)
+{
+	struct evbuffer_mem_group_member *member;
+	evbuffer_mem_group_cb cb;
+	void *cbarg;
+	int over;
+
+	/* Racy, but a crossing we miss here is seen by the next look. */
+	if (!group->notify_pending)
+		return;
+
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	if (!group->notify_pending) {
+		EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+		return;
+	}
+	group->notify_pending = 0;
+	over = group->over;
+	cb = group->cb;
+	cbarg = group->cbarg;
+	TAILQ_FOREACH(member, &group->members, next)
+		event_deferred_cb_schedule(member->base, &member->deferred);
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+
+	if (cb)
+		cb(group, over, cbarg);
+}
+
+static inline void
+evbuffer_chain_charge(struct evbuffer_chain *chain,
+    struct evbuffer_mem_group *group)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	EVATOMIC_ADD(&evbuffer_total_mem, chain->mem_len);
+#else
+	evbuffer_total_mem += chain->mem_len;
+#endif
+	if ((chain->group = group) != NULL)
+		evbuffer_mem_group_charge(group, chain->mem_len);
+}
+
+static inline void
+evbuffer_chain_uncharge(struct evbuffer_chain *chain)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	EVATOMIC_ADD(&evbuffer_total_mem, -chain->mem_len);
+#else
+	evbuffer_total_mem -= chain->mem_len;
+#endif
+	if (chain->group) {
+		evbuffer_mem_group_uncharge(chain->group, chain->mem_len);
+		chain->group = NULL;
+	}
+}
+
+/* Charge the chains from first up to (not including) stop to group
+ * instead of whatever they were charged to. */
+static void
+evbuffer_chains_recharge(struct evbuffer_chain *first,
+    struct evbuffer_chain *stop, struct evbuffer_mem_group *group)
 {
 	struct evbuffer_chain *chain;
+
+	for (chain = first; chain != stop; chain = chain->next) {
+		if (chain->group == group)
+			continue;
+		if (chain->group)
+			evbuffer_mem_group_uncharge(chain->group,
+			    chain->mem_len);
+		if ((chain->group = group) != NULL)
+			evbuffer_mem_group_charge(group, chain->mem_len);
+	}
+}
+
+struct evbuffer_mem_group *
+evbuffer_mem_group_new(size_t high, size_t low, evbuffer_mem_group_cb cb,
+    void *arg)
+{
+	struct evbuffer_mem_group *group;
+
+	if (low > high)
+		return (NULL);
+	if ((group = mm_calloc(1, sizeof(struct evbuffer_mem_group))) == NULL)
+		return (NULL);
+
+	group->high = high;
+	group->low = low;
+	group->cb = cb;
+	group->cbarg = arg;
+	group->refcnt = 1;
+	TAILQ_INIT(&group->members);
+	EVTHREAD_ALLOC_LOCK(group->lock, EVTHREAD_LOCK_CATEGORY_EVBUFFER);
+
+	return (group);
+}
+
+void
+evbuffer_mem_group_free(struct evbuffer_mem_group *group)
+{
+	/* The buffers in the group keep it around, but stop telling. */
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	group->cb = NULL;
+	group->cbarg = NULL;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+	evbuffer_mem_group_decref(group);
+}
+
+size_t
+evbuffer_mem_group_get_allocated(struct evbuffer_mem_group *group)
+{
+	size_t result;
+
+	EVLOCK_LOCK(group->lock, EVTHREAD_READ);
+	result = group->allocated;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_READ);
+	return (result);
+}
+
+int
+evbuffer_mem_group_is_over(struct evbuffer_mem_group *group)
+{
+	int result;
+
+	EVLOCK_LOCK(group->lock, EVTHREAD_READ);
+	result = group->over;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_READ);
+	return (result);
+}
+
+size_t
+evbuffer_get_total_allocated(void)
+{
+	return (evbuffer_total_mem);
+}
+
+void
+_evbuffer_mem_group_add_member(struct evbuffer_mem_group *group,
+    struct evbuffer_mem_group_member *member)
+{
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	TAILQ_INSERT_TAIL(&group->members, member, next);
+	++group->refcnt;
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+}
+
+void
+_evbuffer_mem_group_remove_member(struct evbuffer_mem_group *group,
+    struct evbuffer_mem_group_member *member)
+{
+	EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+	TAILQ_REMOVE(&group->members, member, next);
+	EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+	/* Nobody can schedule it now. */
+	event_deferred_cb_cancel(member->base, &member->deferred);
+	evbuffer_mem_group_decref(group);
+}
+
+/* Give back the memory of a chain from evbuffer_chain_new(). */
+static inline void
+evbuffer_chain_free_mem(struct evbuffer_chain *chain)
+{
+	if (chain->flags & EVBUFFER_POOLED)
+		ev_pool_free(chain);
+	else
+		mm_free(chain);
+}
+
+static struct evbuffer_chain *
+evbuffer_chain_new(struct evbuffer *buf, size_t size)
+{
+	struct evbuffer_chain *chain = NULL;
 	size_t to_alloc;
+	unsigned flags = 0;
 
 	size += EVBUFFER_CHAIN_SIZE;
 
@@ -153,13 +719,30 @@ evbuffer_chain_new(size_t size)
 	while (to_alloc < size)
 		to_alloc <<= 1;
 
-	/* we get everything in one chunk */
-	if ((chain = mm_malloc(to_alloc)) == NULL)
+#ifdef USE_HUGE_CHAINS
+	if (huge_chain_max_bytes && to_alloc >= HUGE_CHAIN_MIN_SIZE &&
+	    (chain = huge_chain_get(to_alloc)) != NULL)
+		flags = EVBUFFER_HUGE;
+#endif
+#ifdef USE_CHAIN_CACHE
+	if (chain == NULL && buf->pool == NULL)
+		chain = chain_cache_get(to_alloc);
+#endif
+	/* we get everything in one chunk; the pool may give us more room
+	 * than we asked for. */
+	if (chain == NULL && buf->pool &&
+	    (chain = ev_pool_alloc(buf->pool, to_alloc, &to_alloc)) != NULL)
+		flags = EVBUFFER_POOLED;
+	if (chain == NULL && (chain = mm_malloc(to_alloc)) == NULL)
 		return (NULL);
 
 	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	chain->flags = flags;
 
 	chain->buffer_len = to_alloc - EVBUFFER_CHAIN_SIZE;
+	chain->refcnt = 1;
+	chain->mem_len = to_alloc;
+	evbuffer_chain_charge(chain, buf->mem_group);
 
 	/* this way we can manipulate the buffer to different addresses,
 	 * which is required for mmap for example.
@@ -169,6 +752,22 @@ evbuffer_chain_new(size_t size)
 	return (chain);
 }
 
+#ifdef USE_SPILL
+static void evbuffer_spill(struct evbuffer *buf);
+#endif
+
+/* Forget buf's spill chain, because it is about to leave buf. */
+static inline void
+evbuffer_spill_disown(struct evbuffer *buf)
+{
+	if (buf->spill_chain) {
+		struct evbuffer_chain_spill *info = EVBUFFER_CHAIN_EXTRA(
+			struct evbuffer_chain_spill, buf->spill_chain);
+		info->owner = NULL;
+		buf->spill_chain = NULL;
+	}
+}
+
 static inline void
 evbuffer_chain_free(struct evbuffer_chain *chain)
 {
@@ -176,8 +775,29 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 		chain->flags |= EVBUFFER_DANGLING;
 		return;
 	}
+	assert(chain->refcnt > 0);
+	if (--chain->refcnt > 0)
+		return;	/* another evbuffer still shares this chain */
+	evbuffer_chain_uncharge(chain);
 	if (chain->flags & (EVBUFFER_MMAP|EVBUFFER_SENDFILE|
-		EVBUFFER_REFERENCE)) {
+		EVBUFFER_REFERENCE|EVBUFFER_MULTICAST|EVBUFFER_SPLICE|
+		EVBUFFER_FILESEGMENT)) {
+		if (chain->flags & EVBUFFER_SPILL) {
+			struct evbuffer_chain_spill *info =
+			    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_spill,
+				chain);
+			if (info->owner)
+				info->owner->spill_chain = NULL;
+		}
+		if (chain->flags & EVBUFFER_MULTICAST) {
+			struct evbuffer_multicast_parent *info =
+			    EVBUFFER_CHAIN_EXTRA(
+				    struct evbuffer_multicast_parent,
+				    chain);
+			EVBUFFER_LOCK(info->source, EVTHREAD_WRITE);
+			evbuffer_chain_free(info->parent);
+			_evbuffer_decref_and_unlock(info->source);
+		}
 		if (chain->flags & EVBUFFER_REFERENCE) {
 			struct evbuffer_chain_reference *info =
 			    EVBUFFER_CHAIN_EXTRA(
@@ -188,6 +808,14 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 				    chain->buffer_len,
 				    info->extra);
 		}
+		if (chain->flags & EVBUFFER_FILESEGMENT) {
+			/* the segment owns the fd and the mapping */
+			struct evbuffer_chain_file_segment *info =
+			    EVBUFFER_CHAIN_EXTRA(
+				    struct evbuffer_chain_file_segment,
+				    chain);
+			evbuffer_file_segment_free(info->segment);
+		}
 #ifdef _EVENT_HAVE_MMAP
 		if (chain->flags & EVBUFFER_MMAP) {
 			struct evbuffer_chain_fd *info =
@@ -195,13 +823,15 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 				chain);
 			if (munmap(chain->buffer, chain->buffer_len) == -1)
 				event_warn("%s: munmap failed", __func__);
-			if (close(info->fd) == -1)
+			/* the mapping of a spill chain outlives its fd */
+			if (info->fd != -1 && close(info->fd) == -1)
 				event_warn("%s: close(%d) failed",
 				    __func__, info->fd);
 		}
 #endif
 #ifdef USE_SENDFILE
-		if (chain->flags & EVBUFFER_SENDFILE) {
+		if ((chain->flags & (EVBUFFER_SENDFILE|EVBUFFER_FILESEGMENT))
+		    == EVBUFFER_SENDFILE) {
 			struct evbuffer_chain_fd *info =
 			    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_fd,
 				chain);
@@ -209,9 +839,28 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 				event_warn("%s: close(%d) failed",
 				    __func__, info->fd);
 		}
+#endif
+#ifdef USE_SPLICE
+		if (chain->flags & EVBUFFER_SPLICE) {
+			struct evbuffer_chain_pipe *info =
+			    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe,
+				chain);
+			close(info->fds[0]);
+			close(info->fds[1]);
+		}
 #endif
 	}
-	mm_free(chain);
+#ifdef USE_HUGE_CHAINS
+	else if (chain->flags & EVBUFFER_HUGE) {
+		huge_chain_put(chain);
+		return;
+	}
+#endif
+#ifdef USE_CHAIN_CACHE
+	else if (chain_cache_put(chain) == 0)
+		return;
+#endif
+	evbuffer_chain_free_mem(chain);
 }
 
 static inline void
@@ -262,6 +911,7 @@ evbuffer_new(void)
 
 	TAILQ_INIT(&buffer->callbacks);
 	buffer->refcnt = 1;
+	buffer->spill_fd = -1;
 
 	return (buffer);
 }
@@ -286,17 +936,64 @@ evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base)
 	return 0;
 }
 
+int
+evbuffer_use_base_pool(struct evbuffer *buffer, struct event_base *base)
+{
+	if (base == NULL || base->pool == NULL || buffer->spsc)
+		return -1;
+
+	EVBUFFER_LOCK(buffer, EVTHREAD_WRITE);
+	/* Chains remember their own pool, so the ones we already have can
+	 * stay where they are. */
+	if (buffer->pool != base->pool) {
+		if (buffer->pool)
+			ev_pool_decref(buffer->pool);
+		ev_pool_incref(base->pool);
+		buffer->pool = base->pool;
+	}
+	EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
+	return 0;
+}
+
+int
+evbuffer_set_mem_group(struct evbuffer *buf, struct evbuffer_mem_group *group)
+{
+	struct evbuffer_mem_group *old;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if ((old = buf->mem_group) == group) {
+		EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+		return 0;
+	}
+	if (group) {
+		EVLOCK_LOCK(group->lock, EVTHREAD_WRITE);
+		++group->refcnt;
+		EVLOCK_UNLOCK(group->lock, EVTHREAD_WRITE);
+	}
+	/* The memory we hold now counts against the new group. */
+	evbuffer_chains_recharge(buf->first, NULL, group);
+	buf->mem_group = group;
+	if (group)
+		evbuffer_mem_group_notify(group);
+	if (old) {
+		evbuffer_mem_group_notify(old);
+		evbuffer_mem_group_decref(old);
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
 int
 evbuffer_enable_locking(struct evbuffer *buf, void *lock)
 {
 #ifdef _EVENT_DISABLE_THREAD_SUPPORT
         return -1;
 #else
-        if (buf->lock)
+        if (buf->lock || buf->spsc)
                 return -1;
 
         if (!lock) {
-                EVTHREAD_ALLOC_LOCK(lock);
+                EVTHREAD_ALLOC_LOCK(lock, EVTHREAD_LOCK_CATEGORY_EVBUFFER);
                 if (!lock)
                         return -1;
                 buf->lock = lock;
@@ -310,6 +1007,115 @@ evbuffer_enable_locking(struct evbuffer *buf, void *lock)
 #endif
 }
 
+int
+evbuffer_enable_spsc(struct evbuffer *buf)
+{
+#ifndef USE_SPSC
+	return -1;
+#else
+	struct evbuffer_spsc *sp;
+
+	/* Chains shared with a pool or another buffer could be touched
+	 * behind our back; so we only start from nothing. */
+	if (buf->lock || buf->spsc || buf->pool || buf->first)
+		return -1;
+	if ((sp = mm_calloc(1, sizeof(struct evbuffer_spsc))) == NULL)
+		return -1;
+	/* Both sides always have a chain, so they never race to make the
+	 * first one. */
+	if ((sp->head = evbuffer_chain_new(buf, 0)) == NULL) {
+		mm_free(sp);
+		return -1;
+	}
+	sp->tail = sp->head;
+	buf->spsc = sp;
+	return 0;
+#endif
+}
+
+#ifdef USE_SPSC
+/* The producer's side of evbuffer_add().  We fill the tail chain and link
+ * a new one if we need it; the consumer won't look past the bytes that
+ * n_added counts, so none of this is visible until we bump it. */
+static int
+evbuffer_spsc_add(struct evbuffer *buf, const void *data_in, size_t datlen)
+{
+	struct evbuffer_spsc *sp = buf->spsc;
+	struct evbuffer_chain *chain = sp->tail, *tmp = NULL;
+	const unsigned char *data = data_in;
+	size_t n = chain->buffer_len - chain->off, to_alloc;
+
+	if (n < datlen) {
+		to_alloc = chain->buffer_len;
+		if (to_alloc <= EVBUFFER_CHAIN_MAX_AUTO_SIZE/2)
+			to_alloc <<= 1;
+		if (datlen - n > to_alloc)
+			to_alloc = datlen - n;
+		if ((tmp = evbuffer_chain_new(buf, to_alloc)) == NULL)
+			return -1;
+	} else {
+		n = datlen;
+	}
+
+	memcpy(chain->buffer + chain->off, data, n);
+	chain->off += n;
+	if (tmp) {
+		memcpy(tmp->buffer, data + n, datlen - n);
+		tmp->off = datlen - n;
+		/* We never touch chain again, so the consumer may free it
+		 * once it has drained it. */
+		chain->next = tmp;
+		sp->tail = tmp;
+	}
+
+	EVATOMIC_BARRIER();
+	sp->n_added += datlen;
+	return 0;
+}
+
+/* The consumer's side of evbuffer_remove() and, with data_out NULL,
+ * evbuffer_drain(). */
+static int
+evbuffer_spsc_remove(struct evbuffer *buf, void *data_out, size_t datlen)
+{
+	struct evbuffer_spsc *sp = buf->spsc;
+	struct evbuffer_chain *chain;
+	char *data = data_out;
+	size_t avail, n;
+
+	avail = sp->n_added - sp->n_removed;
+	EVATOMIC_BARRIER();
+	if (datlen > avail)
+		datlen = avail;
+
+	for (n = datlen; n; ) {
+		size_t len;
+		chain = sp->head;
+		if (sp->read_pos == chain->off) {
+			/* We want more than head has, so the producer has
+			 * linked a next chain and moved on. */
+			sp->head = chain->next;
+			sp->read_pos = 0;
+			evbuffer_chain_free(chain);
+			continue;
+		}
+		len = chain->off - sp->read_pos;
+		if (len > n)
+			len = n;
+		if (data) {
+			memcpy(data, chain->buffer + sp->read_pos, len);
+			data += len;
+		}
+		sp->read_pos += len;
+		n -= len;
+	}
+
+	EVATOMIC_BARRIER();
+	sp->n_removed += datlen;
+	return (int)datlen;
+}
+#endif
+
 static void
 evbuffer_run_callbacks(struct evbuffer *buffer)
 {
@@ -345,6 +1151,14 @@ evbuffer_run_callbacks(struct evbuffer *buffer)
 				cbent->flags |= EVBUFFER_CB_CALL_ON_UNSUSPEND;
 			else
 #endif
+			if ((cbent->flags & EVBUFFER_CB_THRESHOLD)) {
+				/* Only run it if the length is now on the
+				 * other side of its threshold. */
+				int above = new_size >= cbent->threshold;
+				if (!above == !(cbent->flags & EVBUFFER_CB_ABOVE))
+					continue;
+				cbent->flags ^= EVBUFFER_CB_ABOVE;
+			}
                         if ((cbent->flags & EVBUFFER_CB_OBSOLETE))
                                 cbent->cb.cb_obsolete(buffer,
                                         info.orig_size, new_size, cbent->cbarg);
@@ -357,6 +1171,13 @@ evbuffer_run_callbacks(struct evbuffer *buffer)
 static inline void
 evbuffer_invoke_callbacks(struct evbuffer *buffer)
 {
+#ifdef USE_SPILL
+	if (buffer->spill_threshold &&
+	    buffer->total_len > buffer->spill_threshold)
+		evbuffer_spill(buffer);
+#endif
+	if (buffer->mem_group)
+		evbuffer_mem_group_notify(buffer->mem_group);
 	if (buffer->deferred_cbs) {
 		if (buffer->deferred.queued)
 			return;
@@ -379,6 +1200,39 @@ evbuffer_deferred_callback(struct deferred_cb *cb, void *arg)
 	_evbuffer_decref_and_unlock(buffer);
 }
 
+struct evbuffer_chain *
+_evbuffer_chain_new(struct evbuffer *buf, size_t size)
+{
+	return evbuffer_chain_new(buf, size);
+}
+
+void
+_evbuffer_chain_free(struct evbuffer_chain *chain)
+{
+	evbuffer_chain_free(chain);
+}
+
+void
+_evbuffer_chain_append(struct evbuffer *buf, struct evbuffer_chain *chain)
+{
+	ASSERT_EVBUFFER_LOCKED(buf);
+	/* evbuffer_chain_insert can only drop an empty last chain when
+	 * something comes before it. */
+	if (buf->first && buf->first == buf->last && buf->last->off == 0 &&
+	    !CHAIN_PINNED(buf->last)) {
+		evbuffer_chain_free(buf->first);
+		buf->first = buf->last = NULL;
+	}
+	evbuffer_chain_insert(buf, chain);
+	buf->n_add_for_cb += chain->off;
+}
+
+void
+_evbuffer_invoke_callbacks(struct evbuffer *buf)
+{
+	evbuffer_invoke_callbacks(buf);
+}
+
 static void
 evbuffer_remove_all_callbacks(struct evbuffer *buffer)
 {
@@ -405,13 +1259,36 @@ _evbuffer_decref_and_unlock(struct evbuffer *buffer)
 		next = chain->next;
 		evbuffer_chain_free(chain);
 	}
+	if (buffer->spsc) {
+		for (chain = buffer->spsc->head; chain != NULL; chain = next) {
+			next = chain->next;
+			evbuffer_chain_free(chain);
+		}
+		mm_free(buffer->spsc);
+	}
 	evbuffer_remove_all_callbacks(buffer);
 	if (buffer->deferred_cbs)
 		event_deferred_cb_cancel(buffer->ev_base, &buffer->deferred);
+#ifdef WIN32
+	if (buffer->is_overlapped)
+		_evbuffer_overlapped_free_reads(buffer);
+#endif
+#ifdef USE_SPILL
+	if (buffer->spill_fd != -1)
+		close(buffer->spill_fd);
+#endif
+	if (buffer->spill_dir)
+		mm_free(buffer->spill_dir);
+	if (buffer->mem_group) {
+		evbuffer_mem_group_notify(buffer->mem_group);
+		evbuffer_mem_group_decref(buffer->mem_group);
+	}
 
 	EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
         if (buffer->own_lock)
                 EVTHREAD_FREE_LOCK(buffer->lock);
+	if (buffer->pool)
+		ev_pool_decref(buffer->pool);
 	mm_free(buffer);
 }
 
@@ -439,6 +1316,9 @@ evbuffer_get_length(const struct evbuffer *buffer)
 {
         size_t result;
 
+	if (buffer->spsc)
+		return buffer->spsc->n_added - buffer->spsc->n_removed;
+
         EVBUFFER_LOCK(buffer, EVTHREAD_READ);
 
 	result = (buffer->total_len);
@@ -548,6 +1428,7 @@ done:
 
 #define ZERO_CHAIN(dst) do { \
                 ASSERT_EVBUFFER_LOCKED(dst);    \
+		evbuffer_spill_disown(dst);	\
 		(dst)->first = NULL;		\
 		(dst)->last = NULL;		\
 		(dst)->previous_to_last = NULL; \
@@ -602,6 +1483,9 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
+	if (inbuf->mem_group != outbuf->mem_group)
+		evbuffer_chains_recharge(inbuf->first, NULL,
+		    outbuf->mem_group);
 	if (out_total_len == 0) {
 		COPY_CHAIN(outbuf, inbuf);
 	} else {
@@ -613,11 +1497,93 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
         inbuf->n_del_for_cb += in_total_len;
         outbuf->n_add_for_cb += in_total_len;
 
-	evbuffer_invoke_callbacks(inbuf);
+	evbuffer_invoke_callbacks(inbuf);
+	evbuffer_invoke_callbacks(outbuf);
+
+done:
+        EVBUFFER_UNLOCK2(inbuf, outbuf);
+	return result;
+}
+
+int
+evbuffer_add_buffer_reference(struct evbuffer *outbuf, struct evbuffer *inbuf)
+{
+	struct evbuffer_chain *chain, *tmp, *first = NULL, *last = NULL;
+	size_t in_total_len;
+	int result = -1;
+
+	EVBUFFER_LOCK2(inbuf, outbuf);
+	in_total_len = inbuf->total_len;
+
+	if (outbuf == inbuf || outbuf->freeze_end)
+		goto done;
+	if (in_total_len == 0) {
+		result = 0;
+		goto done;
+	}
+
+	/* Make all the new chains first, so that we can give up without
+	 * having changed anything. */
+	for (chain = inbuf->first; chain; chain = chain->next) {
+		if (chain->off == 0)
+			continue;
+		if (chain->flags &
+		    (EVBUFFER_SENDFILE|EVBUFFER_SPLICE|EVBUFFER_SPILL)) {
+			/* There's no memory to share, or it is a spill
+			 * chain that we might still extend. */
+			goto err;
+		}
+		tmp = evbuffer_chain_new(outbuf,
+		    sizeof(struct evbuffer_multicast_parent));
+		if (tmp == NULL) {
+			event_warn("%s: out of memory", __func__);
+			goto err;
+		}
+		if (last)
+			last->next = tmp;
+		else
+			first = tmp;
+		last = tmp;
+	}
+
+	for (chain = inbuf->first, tmp = first; chain; chain = chain->next) {
+		struct evbuffer_multicast_parent *info;
+		struct evbuffer_chain *next;
+		if (chain->off == 0)
+			continue;
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent,
+		    tmp);
+		/* The shared memory mustn't change under the readers. */
+		chain->flags |= EVBUFFER_IMMUTABLE;
+		++chain->refcnt;
+		++inbuf->refcnt;
+		info->source = inbuf;
+		info->parent = chain;
+
+		tmp->flags |= EVBUFFER_MULTICAST | EVBUFFER_IMMUTABLE;
+		tmp->buffer = chain->buffer;
+		tmp->buffer_len = chain->buffer_len;
+		tmp->misalign = chain->misalign;
+		tmp->off = chain->off;
+
+		next = tmp->next;
+		tmp->next = NULL;
+		evbuffer_chain_insert(outbuf, tmp);
+		tmp = next;
+	}
+
+	outbuf->n_add_for_cb += in_total_len;
 	evbuffer_invoke_callbacks(outbuf);
+	result = 0;
+	goto done;
 
+err:
+	for (tmp = first; tmp; tmp = first) {
+		first = tmp->next;
+		evbuffer_chain_free(tmp);
+	}
 done:
-        EVBUFFER_UNLOCK2(inbuf, outbuf);
+	EVBUFFER_UNLOCK2(inbuf, outbuf);
 	return result;
 }
 
@@ -640,6 +1606,9 @@ evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
+	if (inbuf->mem_group != outbuf->mem_group)
+		evbuffer_chains_recharge(inbuf->first, NULL,
+		    outbuf->mem_group);
 	if (out_total_len == 0) {
 		COPY_CHAIN(outbuf, inbuf);
 	} else {
@@ -665,6 +1634,13 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
         size_t old_len;
 	int result = 0;
 
+#ifdef USE_SPSC
+	if (buf->spsc) {
+		evbuffer_spsc_remove(buf, NULL, len);
+		return 0;
+	}
+#endif
+
         EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
         old_len = buf->total_len;
 
@@ -728,6 +1704,11 @@ evbuffer_remove(struct evbuffer *buf, void *data_out, size_t datlen)
 	size_t nread;
         int result = 0;
 
+#ifdef USE_SPSC
+	if (buf->spsc)
+		return evbuffer_spsc_remove(buf, data_out, datlen);
+#endif
+
         EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
 
         chain = buf->first;
@@ -824,7 +1805,11 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 	}
 
 	if (nread) {
-		/* we can remove the chain */
+		/* we can remove the chain; the spill chain may go too */
+		evbuffer_spill_disown(src);
+		if (src->mem_group != dst->mem_group)
+			evbuffer_chains_recharge(src->first, chain,
+			    dst->mem_group);
 		if (dst->first == NULL) {
 			dst->first = src->first;
 		} else {
@@ -910,7 +1895,8 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		tmp->off = size;
 		size -= old_off;
 		chain = chain->next;
-	} else if (chain->buffer_len - chain->misalign >= (size_t)size) {
+	} else if (!(chain->flags & EVBUFFER_IMMUTABLE) &&
+	    chain->buffer_len - chain->misalign >= (size_t)size) {
 		/* already have enough space in the first chain */
 		size_t old_off = chain->off;
 		buffer = chain->buffer + chain->misalign + chain->off;
@@ -919,7 +1905,7 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		size -= old_off;
 		chain = chain->next;
 	} else {
-		if ((tmp = evbuffer_chain_new(size)) == NULL) {
+		if ((tmp = evbuffer_chain_new(buf, size)) == NULL) {
 			event_warn("%s: out of memory\n", __func__);
 			goto done;
 		}
@@ -962,6 +1948,70 @@ done:
         return result;
 }
 
+int
+evbuffer_shrink(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain, *next, *prev = NULL, *pprev = NULL;
+	struct evbuffer_chain *tmp;
+	size_t to_alloc;
+	int result = 0;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+
+	for (chain = buf->first; chain != NULL; chain = next) {
+		next = chain->next;
+		if (!CHAIN_PLAIN(chain) || chain->refcnt > 1) {
+			pprev = prev;
+			prev = chain;
+			continue;
+		}
+
+		if (chain->off == 0) {
+			/* an empty chain gives back all of its memory */
+			if (prev)
+				prev->next = next;
+			else
+				buf->first = next;
+			evbuffer_chain_free(chain);
+			continue;
+		}
+
+		/* see whether evbuffer_chain_new() would give us a smaller
+		 * chain for what is left */
+		to_alloc = MIN_BUFFER_SIZE;
+		while (to_alloc < chain->off + EVBUFFER_CHAIN_SIZE)
+			to_alloc <<= 1;
+		if (to_alloc >= chain->mem_len) {
+			pprev = prev;
+			prev = chain;
+			continue;
+		}
+		if ((tmp = evbuffer_chain_new(buf, chain->off)) == NULL) {
+			result = -1;
+			pprev = prev;
+			prev = chain;
+			continue;
+		}
+		memcpy(tmp->buffer, chain->buffer + chain->misalign,
+		    chain->off);
+		tmp->off = chain->off;
+		tmp->next = next;
+		if (prev)
+			prev->next = tmp;
+		else
+			buf->first = tmp;
+		evbuffer_chain_free(chain);
+		pprev = prev;
+		prev = tmp;
+	}
+
+	buf->last = prev;
+	buf->previous_to_last = pprev;
+
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return result;
+}
+
 /*
  * Reads a line terminated by either '\r\n', '\n\r' or '\r' or '\n'.
  * The returned buffer needs to be freed by the called.
@@ -972,6 +2022,108 @@ evbuffer_readline(struct evbuffer *buffer)
 	return evbuffer_readln(buffer, NULL, EVBUFFER_EOL_ANY);
 }
 
+/* Return the first byte in [p, p+n) that is either a or b, or NULL. */
+static const unsigned char *
+evbuffer_memchr2(const unsigned char *p, size_t n,
+    unsigned char a, unsigned char b)
+{
+	const unsigned char *q;
+#if defined(USE_SSE2_SCAN)
+	const __m128i va = _mm_set1_epi8((char)a);
+	const __m128i vb = _mm_set1_epi8((char)b);
+	for (; n >= 16; p += 16, n -= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int mask = _mm_movemask_epi8(_mm_or_si128(
+			    _mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#elif defined(USE_NEON_SCAN)
+	const uint8x16_t va = vdupq_n_u8(a);
+	const uint8x16_t vb = vdupq_n_u8(b);
+	for (; n >= 16; p += 16, n -= 16) {
+		uint8x16_t v = vld1q_u8(p);
+		if (vmaxvq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb))))
+			break;
+	}
+#endif
+	/* two bounded memchr calls are still much faster than a loop */
+	q = memchr(p, a, n);
+	if (q)
+		n = q - p;
+	if (n && (p = memchr(p, b, n)) != NULL)
+		return p;
+	return q;
+}
+
+/* Return the first place in [s, s+n) where all len bytes of what occur,
+ * or NULL.  len must not be 0. */
+static const unsigned char *
+evbuffer_memmem_scalar(const unsigned char *s, size_t n,
+    const unsigned char *what, size_t len)
+{
+	const unsigned char *p;
+	while (n >= len) {
+		p = memchr(s, what[0], n - len + 1);
+		if (p == NULL)
+			return NULL;
+		if (!memcmp(p + 1, what + 1, len - 1))
+			return p;
+		n -= p + 1 - s;
+		s = p + 1;
+	}
+	return NULL;
+}
+
+static const unsigned char *
+evbuffer_memmem(const unsigned char *s, size_t n,
+    const unsigned char *what, size_t len)
+{
+#if defined(USE_SSE2_SCAN) || defined(USE_NEON_SCAN)
+	/* Look for the first and the last byte of the needle at once; that
+	 * throws out nearly every candidate without calling memcmp. */
+	if (len >= 2 && n >= len) {
+		const unsigned char *p;
+		size_t i = 0;
+#if defined(USE_SSE2_SCAN)
+		const __m128i vf = _mm_set1_epi8((char)what[0]);
+		const __m128i vl = _mm_set1_epi8((char)what[len-1]);
+		for (; i + len - 1 + 16 <= n; i += 16) {
+			__m128i f = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i l = _mm_loadu_si128(
+				(const __m128i *)(s + i + len - 1));
+			int mask = _mm_movemask_epi8(_mm_and_si128(
+				    _mm_cmpeq_epi8(f, vf),
+				    _mm_cmpeq_epi8(l, vl)));
+			while (mask) {
+				p = s + i + __builtin_ctz(mask);
+				if (!memcmp(p + 1, what + 1, len - 2))
+					return p;
+				mask &= mask - 1;
+			}
+		}
+#else
+		const uint8x16_t vf = vdupq_n_u8(what[0]);
+		const uint8x16_t vl = vdupq_n_u8(what[len-1]);
+		for (; i + len - 1 + 16 <= n; i += 16) {
+			uint8x16_t m = vandq_u8(
+				vceqq_u8(vld1q_u8(s + i), vf),
+				vceqq_u8(vld1q_u8(s + i + len - 1), vl));
+			if (vmaxvq_u8(m)) {
+				p = evbuffer_memmem_scalar(s + i,
+				    16 + len - 1, what, len);
+				if (p)
+					return p;
+			}
+		}
+#endif
+		s += i;
+		n -= i;
+	}
+#endif
+	return evbuffer_memmem_scalar(s, n, what, len);
+}
+
 struct evbuffer_iterator {
 	struct evbuffer_chain *chain;
 	int off;
@@ -985,13 +2137,13 @@ evbuffer_strchr(struct evbuffer_iterator *it, const char chr)
 	int count = 0;
 	while (chain != NULL) {
 		char *buffer = (char *)chain->buffer + chain->misalign;
-		for (; i < chain->off; ++i, ++count) {
-			if (buffer[i] == chr) {
-				it->chain = chain;
-				it->off = i;
-				return (count);
-			}
+		char *p = memchr(buffer + i, chr, chain->off - i);
+		if (p != NULL) {
+			it->chain = chain;
+			it->off = p - buffer;
+			return (count + (p - buffer) - i);
 		}
+		count += chain->off - i;
 		i = 0;
 		chain = chain->next;
 	}
@@ -999,24 +2151,23 @@ evbuffer_strchr(struct evbuffer_iterator *it, const char chr)
 	return (-1);
 }
 
+/* Like evbuffer_strchr, but stops at either of two characters. */
 static inline int
-evbuffer_strpbrk(struct evbuffer_iterator *it, const char *chrset)
+evbuffer_strchr2(struct evbuffer_iterator *it, const char a, const char b)
 {
 	struct evbuffer_chain *chain = it->chain;
 	unsigned i = it->off;
 	int count = 0;
 	while (chain != NULL) {
-		char *buffer = (char *)chain->buffer + chain->misalign;
-		for (; i < chain->off; ++i, ++count) {
-			const char *p = chrset;
-			while (*p) {
-				if (buffer[i] == *p++) {
-					it->chain = chain;
-					it->off = i;
-					return (count);
-				}
-			}
+		const unsigned char *buffer = chain->buffer + chain->misalign;
+		const unsigned char *p = evbuffer_memchr2(buffer + i,
+		    chain->off - i, (unsigned char)a, (unsigned char)b);
+		if (p != NULL) {
+			it->chain = chain;
+			it->off = p - buffer;
+			return (count + (p - buffer) - i);
 		}
+		count += chain->off - i;
 		i = 0;
 		chain = chain->next;
 	}
@@ -1092,7 +2243,7 @@ evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
 	 * characters we are going to drain afterwards. */
 	switch (eol_style) {
 	case EVBUFFER_EOL_ANY:
-		count = evbuffer_strpbrk(&it, "\r\n");
+		count = evbuffer_strchr2(&it, '\r', '\n');
 		if (count == -1)
 			goto done;
 
@@ -1151,8 +2302,6 @@ done:
         return result;
 }
 
-#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
-
 /* Adds data to an event buffer */
 
 int
@@ -1163,6 +2312,11 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 	size_t remain, to_alloc;
         int result = -1;
 
+#ifdef USE_SPSC
+	if (buf->spsc)
+		return evbuffer_spsc_add(buf, data_in, datlen);
+#endif
+
         EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
 
 	if (buf->freeze_end) {
@@ -1211,7 +2365,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 		to_alloc <<= 1;
 	if (datlen > to_alloc)
 		to_alloc = datlen;
-	tmp = evbuffer_chain_new(to_alloc);
+	tmp = evbuffer_chain_new(buf, to_alloc);
 	if (tmp == NULL)
 		goto done;
 
@@ -1283,7 +2437,7 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 	}
 
 	/* we need to add another chain */
-	if ((tmp = evbuffer_chain_new(datlen)) == NULL)
+	if ((tmp = evbuffer_chain_new(buf, datlen)) == NULL)
 		goto done;
 	buf->first = tmp;
 	if (buf->previous_to_last == NULL)
@@ -1332,7 +2486,7 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 
 	if (chain == NULL ||
 	    (chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ANY))) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new(buf, datlen);
 		if (chain == NULL)
 			goto err;
 
@@ -1357,7 +2511,7 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 
 	/* figure out how much space we need */
 	length = chain->buffer_len - chain->misalign + datlen;
-	tmp = evbuffer_chain_new(length);
+	tmp = evbuffer_chain_new(buf, length);
 	if (tmp == NULL)
 		goto err;
 	/* copy the data over that we had so far */
@@ -1381,6 +2535,24 @@ err:
 	return result;
 }
 
+int
+_evbuffer_is_in_memory(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	int result = 1;
+
+	EVBUFFER_LOCK(buf, EVTHREAD_READ);
+	for (chain = buf->first; chain; chain = chain->next) {
+		if (chain->flags &
+		    (EVBUFFER_SENDFILE|EVBUFFER_SPLICE|EVBUFFER_SPILL)) {
+			result = 0;
+			break;
+		}
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_READ);
+	return result;
+}
+
 /* Make sure that datlen bytes are available for writing in the last two
  * chains.  Never copies or moves data. */
 int
@@ -1392,7 +2564,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
         ASSERT_EVBUFFER_LOCKED(buf);
 
 	if (chain == NULL || (chain->flags & EVBUFFER_IMMUTABLE)) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new(buf, datlen);
 		if (chain == NULL)
 			return (-1);
 
@@ -1425,7 +2597,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 		/* If there are no bytes on this chain, free it and
 		   replace it with a better one. */
 		/* XXX round up. */
-		tmp = evbuffer_chain_new(datlen-avail_in_prev);
+		tmp = evbuffer_chain_new(buf, datlen-avail_in_prev);
 		if (tmp == NULL)
 			return -1;
 		/* XXX write functions to in new chains */
@@ -1440,7 +2612,7 @@ _evbuffer_expand_fast(struct evbuffer *buf, size_t datlen)
 		/* Add a new chunk big enough to hold what won't fit
 		 * in chunk. */
 		/*XXX round this up. */
-		tmp = evbuffer_chain_new(datlen-avail);
+		tmp = evbuffer_chain_new(buf, datlen-avail);
 		if (tmp == NULL)
 			return (-1);
 
@@ -1541,6 +2713,198 @@ _evbuffer_read_setup_vecs(struct evbuffer *buf, ev_ssize_t howmuch,
 	return nvecs;
 }
 
+#ifdef _EVBUFFER_IOVEC_IS_NATIVE
+/* How many chains an adaptive read may fill at once. */
+#define EVBUFFER_ADAPTIVE_MAX_VECS 8
+/* The biggest chain that an adaptive read adds; chains this size still fit
+ * in the chain cache. */
+#define EVBUFFER_ADAPTIVE_CHAIN_SIZE (64*1024)
+
+/* Make sure that there are at least howmuch bytes of space at the end of
+ * buf, spread over at most EVBUFFER_ADAPTIVE_MAX_VECS chains, and point
+ * vecs at it.  Unlike _evbuffer_expand_fast(), we add as many chains as we
+ * need rather than one big one.  buf must have a last chain.  Returns the
+ * number of vecs filled in, or -1 on failure. */
+static int
+evbuffer_read_setup_adaptive(struct evbuffer *buf, size_t howmuch,
+    struct iovec *vecs, struct evbuffer_chain **chainp)
+{
+	struct evbuffer_chain *chain = buf->last;
+	size_t space = 0;
+	int nvecs = 0;
+
+	if (chain->off == 0 && buf->previous_to_last &&
+	    CHAIN_SPACE_LEN(buf->previous_to_last)) {
+		/* The last chain is empty, so it's safe to use the space at
+		 * the end of the one before it too. */
+		chain = buf->previous_to_last;
+	}
+	*chainp = chain;
+
+	for (; chain; chain = chain->next) {
+		if (!CHAIN_SPACE_LEN(chain))
+			continue;
+		vecs[nvecs].iov_base = CHAIN_SPACE_PTR(chain);
+		vecs[nvecs].iov_len = CHAIN_SPACE_LEN(chain);
+		space += vecs[nvecs].iov_len;
+		if (++nvecs == EVBUFFER_ADAPTIVE_MAX_VECS || space >= howmuch)
+			return (nvecs);
+	}
+
+	while (space < howmuch && nvecs < EVBUFFER_ADAPTIVE_MAX_VECS) {
+		size_t want = howmuch - space;
+		if (want > EVBUFFER_ADAPTIVE_CHAIN_SIZE - EVBUFFER_CHAIN_SIZE)
+			want = EVBUFFER_ADAPTIVE_CHAIN_SIZE -
+			    EVBUFFER_CHAIN_SIZE;
+		if ((chain = evbuffer_chain_new(buf, want)) == NULL)
+			break;
+		/* Don't use evbuffer_chain_insert(): it would free the empty
+		 * chain we just put at the end. */
+		buf->previous_to_last = buf->last;
+		buf->last->next = chain;
+		buf->last = chain;
+		vecs[nvecs].iov_base = CHAIN_SPACE_PTR(chain);
+		vecs[nvecs].iov_len = CHAIN_SPACE_LEN(chain);
+		space += vecs[nvecs].iov_len;
+		++nvecs;
+	}
+	return (nvecs ? nvecs : -1);
+}
+
+/* Put the n bytes that a read left in the space found by
+ * evbuffer_read_setup_adaptive() into the chains that hold them.  Then free
+ * the chains that the setup added and the read didn't need, keeping one
+ * empty chain at the end to read into next time.  old_last and old_prev
+ * are buf->last and buf->previous_to_last from before the setup. */
+static void
+evbuffer_read_commit_adaptive(struct evbuffer *buf,
+    struct evbuffer_chain *chain, size_t n,
+    struct evbuffer_chain *old_last, struct evbuffer_chain *old_prev)
+{
+	struct evbuffer_chain *prev, *empty, *next;
+
+	buf->total_len += n;
+	for (; chain && n; chain = chain->next) {
+		size_t space = CHAIN_SPACE_LEN(chain);
+		if (space > n)
+			space = n;
+		chain->off += space;
+		n -= space;
+	}
+
+	/* The chains we added are all after old_last, and the ones that
+	 * got data come first. */
+	prev = old_last;
+	empty = old_last->next;
+	while (empty && empty->off) {
+		old_prev = prev;
+		prev = empty;
+		empty = empty->next;
+	}
+	if (empty == NULL)
+		return;
+	if (prev->off == 0) {
+		/* old_last was empty already; we don't need another. */
+		prev->next = NULL;
+		buf->last = prev;
+		buf->previous_to_last = old_prev;
+	} else {
+		next = empty->next;
+		empty->next = NULL;
+		buf->last = empty;
+		buf->previous_to_last = prev;
+		empty = next;
+	}
+	for (; empty; empty = next) {
+		next = empty->next;
+		evbuffer_chain_free(empty);
+	}
+}
+
+/* Decide how much the next adaptive read of buf asks for, now that a read
+ * whose space was limited only by read_estimate returned n bytes. */
+static void
+evbuffer_read_adjust_estimate(struct evbuffer *buf, size_t n)
+{
+	if (n >= buf->read_estimate) {
+		/* The peer is streaming; read more at a time. */
+		if (buf->read_estimate < EVBUFFER_ADAPTIVE_READ_MAX)
+			buf->read_estimate <<= 1;
+		buf->read_shrink_pending = 0;
+	} else if (n <= buf->read_estimate / 2) {
+		if (buf->read_shrink_pending &&
+		    buf->read_estimate > EVBUFFER_ADAPTIVE_READ_MIN) {
+			buf->read_estimate >>= 1;
+			buf->read_shrink_pending = 0;
+		} else {
+			buf->read_shrink_pending = 1;
+		}
+	} else {
+		buf->read_shrink_pending = 0;
+	}
+}
+
+static int
+evbuffer_read_adaptive(struct evbuffer *buf, evutil_socket_t fd,
+    int howmuch)
+{
+	struct iovec vecs[EVBUFFER_ADAPTIVE_MAX_VECS];
+	struct evbuffer_chain *chain, *old_last, *old_prev;
+	size_t want = buf->read_estimate;
+	int nvecs, limited = 0;
+	ev_ssize_t n;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+
+	if (howmuch >= 0 && (size_t)howmuch < want) {
+		want = howmuch;
+		limited = 1;
+	}
+	if (buf->last == NULL &&
+	    evbuffer_expand(buf, want < EVBUFFER_ADAPTIVE_CHAIN_SIZE ?
+		want : EVBUFFER_ADAPTIVE_CHAIN_SIZE) == -1)
+		return (-1);
+	old_last = buf->last;
+	old_prev = buf->previous_to_last;
+	if ((nvecs = evbuffer_read_setup_adaptive(buf, want, vecs, &chain))
+	    == -1)
+		return (-1);
+	/* Read no more than we meant to, even when there is more room, so
+	 * that a full read really tells us the peer had more to send. */
+	{
+		size_t total = 0;
+		int i;
+		for (i = 0; i < nvecs; ++i) {
+			if (total + vecs[i].iov_len >= want) {
+				vecs[i].iov_len = want - total;
+				nvecs = i + 1;
+				break;
+			}
+			total += vecs[i].iov_len;
+		}
+	}
+
+	n = readv(fd, vecs, nvecs);
+	evbuffer_read_commit_adaptive(buf, chain, n > 0 ? n : 0,
+	    old_last, old_prev);
+	if (n > 0 && !limited)
+		evbuffer_read_adjust_estimate(buf, n);
+	return (n);
+}
+#endif
+
+int
+evbuffer_set_adaptive_read(struct evbuffer *buf, int enable)
+{
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	buf->adaptive_read = enable != 0;
+	buf->read_shrink_pending = 0;
+	buf->read_estimate = EVBUFFER_MAX_READ;
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return 0;
+}
+
+
 /* TODO(niels): should this function return ev_ssize_t and take ev_ssize_t
  * as howmuch? */
 int
@@ -1566,6 +2930,16 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 		goto done;
 	}
 
+#ifdef _EVBUFFER_IOVEC_IS_NATIVE
+	if (buf->adaptive_read) {
+		if ((result = evbuffer_read_adaptive(buf, fd, howmuch)) > 0) {
+			buf->n_add_for_cb += result;
+			evbuffer_invoke_callbacks(buf);
+		}
+		goto done;
+	}
+#endif
+
 #if defined(FIONREAD)
 #ifdef WIN32
 	if (ioctlsocket(fd, FIONREAD, &lng) == -1 || (n=lng) == 0) {
@@ -1683,15 +3057,202 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	buf->total_len += n;
         buf->n_add_for_cb += n;
 
+	/* Tell someone about changes in this buffer */
+	evbuffer_invoke_callbacks(buf);
+        result = n;
+done:
+        EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	EV_PROBE3(buffer__read, buf, fd, result);
+	return result;
+}
+
+#ifdef USE_SPLICE
+/* How much a new pipe for a splice chain holds, unless the kernel says. */
+#define EVBUFFER_SPLICE_PIPE_SIZE 65536
+
+static struct evbuffer_chain *
+evbuffer_splice_chain_new(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_pipe *info;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		return (NULL);
+	if (evutil_make_socket_nonblocking(fds[0]) == -1 ||
+	    evutil_make_socket_nonblocking(fds[1]) == -1 ||
+	    (chain = evbuffer_chain_new(buf,
+		sizeof(struct evbuffer_chain_pipe))) == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		return (NULL);
+	}
+
+	chain->flags |= EVBUFFER_SPLICE | EVBUFFER_IMMUTABLE;
+	chain->buffer = NULL;	/* no reading possible */
+	chain->buffer_len = 0;
+
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe, chain);
+	info->fds[0] = fds[0];
+	info->fds[1] = fds[1];
+	info->in_pipe = 0;
+	info->capacity = EVBUFFER_SPLICE_PIPE_SIZE;
+#ifdef F_GETPIPE_SZ
+	{
+		int sz = fcntl(fds[1], F_GETPIPE_SZ);
+		if (sz > 0)
+			info->capacity = sz;
+	}
+#endif
+	return (chain);
+}
+#endif
+
+int
+evbuffer_read_splice(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
+{
+#ifdef USE_SPLICE
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_pipe *info;
+	ev_ssize_t n;
+	size_t space;
+	int is_new = 0;
+	int result;
+
+        EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+
+	if (buf->freeze_end) {
+		result = -1;
+		goto done;
+	}
+
+	/* Keep filling the pipe at the end of the buffer until it's full. */
+	chain = buf->last;
+	if (chain != NULL && (chain->flags & EVBUFFER_SPLICE) &&
+	    !CHAIN_PINNED(chain)) {
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe, chain);
+		if (info->in_pipe >= info->capacity)
+			chain = NULL;
+	} else {
+		chain = NULL;
+	}
+	if (chain == NULL) {
+		if ((chain = evbuffer_splice_chain_new(buf)) == NULL) {
+			result = evbuffer_read(buf, fd, howmuch);
+			goto done;
+		}
+		is_new = 1;
+	}
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe, chain);
+
+	space = info->capacity - info->in_pipe;
+	if (howmuch < 0 || (size_t)howmuch > space)
+		howmuch = space;
+
+	n = splice(fd, NULL, info->fds[1], NULL, howmuch,
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n <= 0) {
+		int err = errno;
+		if (is_new)
+			evbuffer_chain_free(chain);
+		if (n == -1 && (err == EINVAL || err == ENOSYS)) {
+			/* splice() can't read this fd; fall back to copying. */
+			result = evbuffer_read(buf, fd, howmuch);
+			goto done;
+		}
+		errno = err;
+		result = n;
+		goto done;
+	}
+
+	info->in_pipe += n;
+	chain->buffer_len += n;
+	chain->off += n;
+	if (is_new)
+		evbuffer_chain_insert(buf, chain);
+	else
+		buf->total_len += n;
+        buf->n_add_for_cb += n;
+
 	/* Tell someone about changes in this buffer */
 	evbuffer_invoke_callbacks(buf);
         result = n;
 done:
         EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
 	return result;
+#else
+	return evbuffer_read(buf, fd, howmuch);
+#endif
 }
 
 #ifdef USE_IOVEC_IMPL
+/* If the first howmuch bytes of buf take more than NUM_IOVEC chains, copy
+ * runs of small chains among them into bigger ones, so that one writev()
+ * can send more of them. */
+static void
+evbuffer_coalesce(struct evbuffer *buf, size_t howmuch)
+{
+	struct evbuffer_chain *chain, *end, *prev, *tmp, *next;
+	size_t left, run_len;
+	int n, run_n, had_last, had_ptl;
+
+	/* Usually the chains fit, and there is nothing to do. */
+	n = 0;
+	for (chain = buf->first, left = howmuch;
+	     chain && left && n <= NUM_IOVEC; chain = chain->next, ++n)
+		left -= left < chain->off ? left : chain->off;
+	if (n <= NUM_IOVEC)
+		return;
+
+	prev = NULL;
+	chain = buf->first;
+	for (n = 0, left = howmuch; chain && left && n < NUM_IOVEC; ++n) {
+		/* Find the run of small chains starting here. */
+		run_len = 0;
+		run_n = 0;
+		for (end = chain; end && run_len < left &&
+			 CHAIN_COPYABLE(end) &&
+			 end->off <= EVBUFFER_COALESCE_MAX &&
+			 run_len + end->off <= EVBUFFER_CHAIN_MAX_AUTO_SIZE;
+		     end = end->next) {
+			run_len += end->off;
+			++run_n;
+		}
+		if (run_n < 2 ||
+		    (tmp = evbuffer_chain_new(buf, run_len)) == NULL) {
+			left -= left < chain->off ? left : chain->off;
+			prev = chain;
+			chain = chain->next;
+			continue;
+		}
+
+		had_last = had_ptl = 0;
+		for (; chain != end; chain = next) {
+			next = chain->next;
+			memcpy(tmp->buffer + tmp->off,
+			    chain->buffer + chain->misalign, chain->off);
+			tmp->off += chain->off;
+			had_last |= chain == buf->last;
+			had_ptl |= chain == buf->previous_to_last;
+			evbuffer_chain_free(chain);
+		}
+		tmp->next = end;
+		if (prev)
+			prev->next = tmp;
+		else
+			buf->first = tmp;
+		if (had_last) {
+			buf->last = tmp;
+			buf->previous_to_last = prev;
+		} else if (had_ptl) {
+			buf->previous_to_last = tmp;
+		}
+
+		left -= left < run_len ? left : run_len;
+		prev = tmp;
+	}
+}
+
 static inline int
 evbuffer_write_iovec(struct evbuffer *buffer, evutil_socket_t fd,
 ssize_t howmuch)
@@ -1712,6 +3273,11 @@ ssize_t howmuch)
 		/* we cannot write the file info via writev */
 		if (chain->flags & EVBUFFER_SENDFILE)
 			break;
+#endif
+#ifdef USE_SPLICE
+		/* nor the data in a pipe */
+		if (chain->flags & EVBUFFER_SPLICE)
+			break;
 #endif
 		iov[i].IOV_PTR_FIELD = chain->buffer + chain->misalign;
 		if ((size_t)howmuch >= chain->off) {
@@ -1761,22 +3327,70 @@ evbuffer_write_sendfile(struct evbuffer *buffer, evutil_socket_t fd,
 	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
 		return (-1);
 
-	return (len);
-#elif defined(SENDFILE_IS_FREEBSD)
-	res = sendfile(info->fd, fd, chain->misalign, len, NULL, &len, 0);
-	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
-		return (-1);
+	return (len);
+#elif defined(SENDFILE_IS_FREEBSD)
+	res = sendfile(info->fd, fd, chain->misalign, len, NULL, &len, 0);
+	if (res == -1 && !EVUTIL_ERR_RW_RETRIABLE(errno))
+		return (-1);
+
+	return (len);
+#elif defined(SENDFILE_IS_LINUX)
+	/* TODO(niels): implement splice */
+	res = sendfile(fd, info->fd, &offset,
+	    (size_t)howmuch < chain->off ? (size_t)howmuch : chain->off);
+	/* On EAGAIN or EINTR this is -1 like any other failed write; a 0
+	 * would look like EOF to our callers. */
+	return (res);
+#endif
+}
+#endif
+
+#ifdef USE_SPLICE
+/* Throw away the bytes that were drained from a splice chain but are still
+ * at the front of its pipe. */
+static int
+evbuffer_splice_discard(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_pipe *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe, chain);
+	char tmp[4096];
+
+	while (info->in_pipe > chain->off) {
+		size_t len = info->in_pipe - chain->off;
+		ev_ssize_t res;
+		if (len > sizeof(tmp))
+			len = sizeof(tmp);
+		if ((res = read(info->fds[0], tmp, len)) <= 0)
+			return (-1);
+		info->in_pipe -= res;
+	}
+	return (0);
+}
+
+static inline int
+evbuffer_write_splice(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch)
+{
+	struct evbuffer_chain *chain = buffer->first;
+	struct evbuffer_chain_pipe *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pipe, chain);
+	unsigned flags = SPLICE_F_MOVE|SPLICE_F_NONBLOCK;
+	size_t len = chain->off;
+	ev_ssize_t res;
+
+        ASSERT_EVBUFFER_LOCKED(buffer);
 
-	return (len);
-#elif defined(SENDFILE_IS_LINUX)
-	/* TODO(niels): implement splice */
-	res = sendfile(fd, info->fd, &offset, chain->off);
-	if (res == -1 && EVUTIL_ERR_RW_RETRIABLE(errno)) {
-		/* if this is EGAIN or EINTR return 0; otherwise, -1 */
-		return (0);
-	}
+	if (evbuffer_splice_discard(chain) == -1)
+		return (-1);
+	if ((size_t)howmuch < len)
+		len = howmuch;
+	if (len < buffer->total_len)
+		flags |= SPLICE_F_MORE;
+
+	res = splice(info->fds[0], NULL, fd, NULL, len, flags);
+	if (res > 0)
+		info->in_pipe -= res;
 	return (res);
-#endif
 }
 #endif
 
@@ -1796,14 +3410,24 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 		howmuch = buffer->total_len;
 
 	{
-#ifdef USE_SENDFILE
+#if defined(USE_SENDFILE) || defined(USE_SPLICE)
 		struct evbuffer_chain *chain = buffer->first;
+#endif
+#ifdef USE_SENDFILE
 		if (chain != NULL && (chain->flags & EVBUFFER_SENDFILE))
 			n = evbuffer_write_sendfile(buffer, fd, howmuch);
 		else
 #endif
+#ifdef USE_SPLICE
+		if (chain != NULL && (chain->flags & EVBUFFER_SPLICE))
+			n = evbuffer_write_splice(buffer, fd, howmuch);
+		else
+#endif
 #ifdef USE_IOVEC_IMPL
-		n = evbuffer_write_iovec(buffer, fd, howmuch);
+		{
+			evbuffer_coalesce(buffer, howmuch);
+			n = evbuffer_write_iovec(buffer, fd, howmuch);
+		}
 #elif defined(WIN32)
 		/* XXX(nickm) Don't disable this code until we know if
 		 * the WSARecv code above works. */
@@ -1820,6 +3444,7 @@ evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
 
 done:
         EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
+	EV_PROBE3(buffer__write, buffer, fd, n);
 	return (n);
 }
 
@@ -1834,12 +3459,18 @@ evbuffer_find(struct evbuffer *buffer, const unsigned char *what, size_t len)
 {
         unsigned char *search;
         struct evbuffer_ptr ptr;
+	struct evbuffer_chain *chain;
 
         EVBUFFER_LOCK(buffer, EVTHREAD_WRITE);
 
         ptr = evbuffer_search(buffer, (const char *)what, len, NULL);
+	chain = ptr._internal.chain;
         if (ptr.pos < 0) {
                 search = NULL;
+        } else if (chain && ptr._internal.pos_in_chain + len <= chain->off) {
+		/* The match is already contiguous; no need to move it. */
+		search = chain->buffer + chain->misalign +
+		    ptr._internal.pos_in_chain;
         } else {
                 search = evbuffer_pullup(buffer, ptr.pos + len);
 		if (search)
@@ -1954,29 +3585,45 @@ evbuffer_search(struct evbuffer *buffer, const char *what, size_t len, const str
         first = what[0];
 
         while (chain) {
-                const unsigned char *start_at =
-                    chain->buffer + chain->misalign +
-                    pos._internal.pos_in_chain;
-                p = memchr(start_at, first,
-                    chain->off - pos._internal.pos_in_chain);
-                if (p) {
-                        pos.pos += p - start_at;
-                        pos._internal.pos_in_chain += p - start_at;
+                const unsigned char *data = chain->buffer + chain->misalign;
+                size_t off = pos._internal.pos_in_chain;
+
+                /* First look for a match that lies wholly in this chain. */
+                if (chain->off - off >= len) {
+                        p = evbuffer_memmem(data + off, chain->off - off,
+                            (const unsigned char *)what, len);
+                        if (p) {
+                                pos.pos += p - (data + off);
+                                pos._internal.pos_in_chain = p - data;
+                                goto done;
+                        }
+                        pos.pos += chain->off - off - len + 1;
+                        off = chain->off - len + 1;
+                }
+
+                /* Whatever is left of the chain is too short to hold the
+                 * needle, so a match would have to run on into the next
+                 * chain. */
+                while (off < chain->off) {
+                        p = memchr(data + off, first, chain->off - off);
+                        if (!p)
+                                break;
+                        pos.pos += p - (data + off);
+                        off = p - data;
+                        if ((size_t)pos.pos + len > buffer->total_len)
+                                goto not_found;
+                        pos._internal.pos_in_chain = off;
                         if (!evbuffer_ptr_memcmp(buffer, &pos, what, len))
                                 goto done;
                         ++pos.pos;
-                        ++pos._internal.pos_in_chain;
-                        if (pos._internal.pos_in_chain == chain->off) {
-                                chain = pos._internal.chain = chain->next;
-                                pos._internal.pos_in_chain = 0;
-                        }
-                } else {
-                        pos.pos += chain->off - pos._internal.pos_in_chain;
-                        chain = pos._internal.chain = chain->next;
-                        pos._internal.pos_in_chain = 0;
+                        ++off;
                 }
+                pos.pos += chain->off - off;
+                chain = pos._internal.chain = chain->next;
+                pos._internal.pos_in_chain = 0;
         }
 
+not_found:
         pos.pos = -1;
         pos._internal.chain = NULL;
 done:
@@ -2097,6 +3744,81 @@ evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
 	return (res);
 }
 
+/* Append n in the given base to buf, after a '-' if neg is set.  If point
+ * is nonzero, put a '.' before the last point digits, padding with zeros
+ * so that there is a digit before it.  We count the digits first, so that
+ * we can write them backwards straight into space reserved for them. */
+static int
+evbuffer_add_digits(struct evbuffer *buf, ev_uint64_t n, unsigned base,
+    int neg, int point)
+{
+	static const char digits[] = "0123456789abcdef";
+	struct evbuffer_iovec vec;
+	ev_uint64_t m;
+	int n_digits = 1, len, i, result = -1;
+	char *p;
+
+	for (m = n; m >= base; m /= base)
+		++n_digits;
+	if (n_digits <= point)
+		n_digits = point + 1;
+	len = n_digits + (neg != 0) + (point != 0);
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (evbuffer_reserve_space(buf, len, &vec, 1) < 1)
+		goto done;
+
+	p = (char *)vec.iov_base + len;
+	for (i = 0; i < n_digits; ++i) {
+		if (point && i == point)
+			*--p = '.';
+		*--p = digits[n % base];
+		n /= base;
+	}
+	if (neg)
+		*--p = '-';
+
+	vec.iov_len = len;
+	if (evbuffer_commit_space(buf, &vec, 1) == 0)
+		result = len;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return result;
+}
+
+int
+evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t n)
+{
+	return evbuffer_add_digits(buf, n, 10, 0, 0);
+}
+
+int
+evbuffer_add_int(struct evbuffer *buf, ev_int64_t n)
+{
+	/* negate as unsigned, so that the most negative number works */
+	if (n < 0)
+		return evbuffer_add_digits(buf, -(ev_uint64_t)n, 10, 1, 0);
+	return evbuffer_add_digits(buf, n, 10, 0, 0);
+}
+
+int
+evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t n)
+{
+	return evbuffer_add_digits(buf, n, 16, 0, 0);
+}
+
+int
+evbuffer_add_fixed(struct evbuffer *buf, ev_int64_t n, int decimals)
+{
+	/* 2^64 has 20 digits; there is no point in more zeros than that */
+	if (decimals < 0 || decimals > 19)
+		return -1;
+	if (n < 0)
+		return evbuffer_add_digits(buf, -(ev_uint64_t)n, 10, 1,
+		    decimals);
+	return evbuffer_add_digits(buf, n, 10, 0, decimals);
+}
+
 int
 evbuffer_add_reference(struct evbuffer *outbuf,
     const void *data, size_t datlen,
@@ -2106,7 +3828,8 @@ evbuffer_add_reference(struct evbuffer *outbuf,
 	struct evbuffer_chain_reference *info;
 	int result = -1;
 
-	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_reference));
+	chain = evbuffer_chain_new(outbuf,
+	    sizeof(struct evbuffer_chain_reference));
 	if (!chain)
 		return (-1);
 	chain->flags |= EVBUFFER_REFERENCE | EVBUFFER_IMMUTABLE;
@@ -2122,7 +3845,8 @@ evbuffer_add_reference(struct evbuffer *outbuf,
 	if (outbuf->freeze_end) {
 		/* don't call chain_free; we do not want to actually invoke
 		 * the cleanup function */
-		mm_free(chain);
+		evbuffer_chain_uncharge(chain);
+		evbuffer_chain_free_mem(chain);
 		goto done;
 	}
 	evbuffer_chain_insert(outbuf, chain);
@@ -2156,7 +3880,8 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 
 #if defined(USE_SENDFILE)
 	if (use_sendfile) {
-		chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_fd));
+		chain = evbuffer_chain_new(outbuf,
+		    sizeof(struct evbuffer_chain_fd));
 		if (chain == NULL) {
 			event_warn("%s: out of memory\n", __func__);
 			return (-1);
@@ -2173,7 +3898,8 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 
                 EVBUFFER_LOCK(outbuf, EVTHREAD_WRITE);
 		if (outbuf->freeze_end) {
-			mm_free(chain);
+			evbuffer_chain_uncharge(chain);
+			evbuffer_chain_free_mem(chain);
 			ok = 0;
 		} else {
 			outbuf->n_add_for_cb += length;
@@ -2200,7 +3926,8 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 			    __func__, fd, 0, (size_t)(offset + length));
 			return (-1);
 		}
-		chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_fd));
+		chain = evbuffer_chain_new(outbuf,
+		    sizeof(struct evbuffer_chain_fd));
 		if (chain == NULL) {
 			event_warn("%s: out of memory\n", __func__);
 			munmap(mapped, length);
@@ -2282,6 +4009,430 @@ evbuffer_add_file(struct evbuffer *outbuf, int fd,
 }
 
 
+/* Give seg its contents, if it isn't going to use sendfile: map them if we
+ * can, or else read them into memory. */
+static int
+evbuffer_file_segment_load(struct evbuffer_file_segment *seg)
+{
+	const off_t offset = seg->file_offset, length = seg->length;
+	char *mem;
+	off_t pos = 0;
+	ev_ssize_t n;
+
+	if (length == 0)
+		return 0;	/* nothing to load */
+	if ((off_t)(size_t)length != length)
+		return -1;	/* too big for our address space */
+
+#if defined(_EVENT_HAVE_MMAP)
+	if (use_mmap && !(seg->flags & EVBUF_FS_DISABLE_MMAP)) {
+		/* mmap wants an offset that is a multiple of the page size */
+		off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+		void *mapped = mmap(NULL, length + (offset - start), PROT_READ,
+#ifdef MAP_NOCACHE
+		    MAP_NOCACHE |
+#endif
+		    MAP_FILE | MAP_PRIVATE,
+		    seg->fd, start);
+		if (mapped == MAP_FAILED) {
+			event_warn("%s: mmap(%d, %d, %zu) failed",
+			    __func__, seg->fd, (int)start,
+			    (size_t)(length + (offset - start)));
+			return -1;
+		}
+		seg->mapping = mapped;
+		seg->mapping_len = length + (offset - start);
+		seg->contents = (char *)mapped + (offset - start);
+		seg->is_mapping = 1;
+		return 0;
+	}
+#endif
+
+	if ((mem = mm_malloc(length)) == NULL)
+		return -1;
+	if (lseek(seg->fd, offset, SEEK_SET) == -1)
+		goto err;
+	while (pos < length) {
+		n = read(seg->fd, mem + pos, (size_t)(length - pos));
+		if (n <= 0)
+			goto err;	/* the file is shorter than we were told */
+		pos += n;
+	}
+	seg->contents = mem;
+	return 0;
+err:
+	mm_free(mem);
+	return -1;
+}
+
+struct evbuffer_file_segment *
+evbuffer_file_segment_new(int fd, off_t offset, off_t length, unsigned flags)
+{
+	struct evbuffer_file_segment *seg;
+
+	if (offset < 0)
+		return NULL;
+	if (length < 0) {
+		struct stat st;
+		if (fstat(fd, &st) == -1 || st.st_size < offset)
+			return NULL;
+		length = st.st_size - offset;
+	}
+
+	if ((seg = mm_calloc(1, sizeof(struct evbuffer_file_segment))) == NULL)
+		return NULL;
+	seg->refcnt = 1;
+	seg->flags = flags;
+	seg->fd = fd;
+	seg->file_offset = offset;
+	seg->length = length;
+
+#if defined(USE_SENDFILE)
+	if (use_sendfile && !(flags & EVBUF_FS_DISABLE_SENDFILE))
+		seg->can_sendfile = 1;
+	else
+#endif
+	if (evbuffer_file_segment_load(seg) == -1) {
+		mm_free(seg);
+		return NULL;
+	}
+
+	if (!(flags & EVBUF_FS_DISABLE_LOCKING))
+		EVTHREAD_ALLOC_LOCK(seg->lock, EVTHREAD_LOCK_CATEGORY_EVBUFFER);
+	return seg;
+}
+
+void
+evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
+{
+	int refcnt;
+
+	EVLOCK_LOCK(seg->lock, 0);
+	refcnt = --seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+	if (refcnt > 0)
+		return;
+	assert(refcnt == 0);
+
+#if defined(_EVENT_HAVE_MMAP)
+	if (seg->is_mapping) {
+		if (munmap(seg->mapping, seg->mapping_len) == -1)
+			event_warn("%s: munmap failed", __func__);
+	} else
+#endif
+	if (seg->contents)
+		mm_free((char *)seg->contents);
+
+	if ((seg->flags & EVBUF_FS_CLOSE_ON_FREE) && seg->fd >= 0) {
+		if (close(seg->fd) == -1)
+			event_warn("%s: close(%d) failed", __func__, seg->fd);
+	}
+
+	EVTHREAD_FREE_LOCK(seg->lock);
+	mm_free(seg);
+}
+
+int
+evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_file_segment *info;
+	int ok = 1;
+
+	if (offset < 0 || offset > seg->length)
+		return -1;
+	if (length < 0)
+		length = seg->length - offset;
+	else if (length > seg->length - offset)
+		return -1;
+
+	chain = evbuffer_chain_new(buf,
+	    sizeof(struct evbuffer_chain_file_segment));
+	if (chain == NULL) {
+		event_warn("%s: out of memory", __func__);
+		return (-1);
+	}
+
+	chain->flags |= EVBUFFER_FILESEGMENT | EVBUFFER_IMMUTABLE;
+	if (seg->can_sendfile) {
+		chain->flags |= EVBUFFER_SENDFILE;
+		chain->buffer = NULL;	/* no reading possible */
+		chain->misalign = seg->file_offset + offset;
+	} else {
+		chain->buffer = (unsigned char *)seg->contents;
+		chain->misalign = offset;
+	}
+	chain->off = length;
+	chain->buffer_len = chain->misalign + length;
+
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+	info->fd_info.fd = seg->fd;
+	info->segment = seg;
+	EVLOCK_LOCK(seg->lock, 0);
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (buf->freeze_end) {
+		evbuffer_chain_free(chain);
+		ok = 0;
+	} else {
+		buf->n_add_for_cb += length;
+		evbuffer_chain_insert(buf, chain);
+		evbuffer_invoke_callbacks(buf);
+	}
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+
+	return ok ? 0 : -1;
+}
+
+#ifdef USE_SPILL
+/* Once there is a spill chain, don't write out less than this after it. */
+#define EVBUFFER_SPILL_BATCH (64*1024)
+/* Start a new spill file once the current one gets this big, so that the
+ * disk space of the old one is freed once its data has been written out. */
+#define EVBUFFER_SPILL_FILE_MAX ((off_t)1 << 30)
+
+/* Plain chains full of our own memory are the only ones we move out. */
+#define CHAIN_SPILLABLE(ch) \
+	(CHAIN_PLAIN(ch) && (ch)->refcnt == 1 && (ch)->off != 0)
+
+static int
+evbuffer_spill_open(struct evbuffer *buf)
+{
+	const char *dir = buf->spill_dir;
+	char path[1024];
+	int fd;
+
+	if (dir == NULL && (dir = getenv("TMPDIR")) == NULL)
+		dir = "/tmp";
+	evutil_snprintf(path, sizeof(path), "%s/libevent-spill-XXXXXX", dir);
+	if ((fd = mkstemp(path)) == -1) {
+		event_warn("%s: mkstemp(%s) failed", __func__, path);
+		return (-1);
+	}
+	unlink(path);
+#ifdef _EVENT_HAVE_SETFD
+	fcntl(fd, F_SETFD, 1);
+#endif
+
+	if (buf->spill_fd != -1)
+		close(buf->spill_fd);
+	buf->spill_fd = fd;
+	buf->spill_off = 0;
+	evbuffer_spill_disown(buf);
+	return (0);
+}
+
+/* Make a chain for the len bytes at offset in buf's spill file. */
+static struct evbuffer_chain *
+evbuffer_spill_chain_new(struct evbuffer *buf, off_t offset, size_t len)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_spill *info;
+
+	chain = evbuffer_chain_new(buf, sizeof(struct evbuffer_chain_spill));
+	if (chain == NULL)
+		return (NULL);
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_spill, chain);
+	info->owner = NULL;
+
+#if defined(USE_SENDFILE)
+	/* each sendfile chain closes its own fd */
+	if ((info->fd_info.fd = dup(buf->spill_fd)) == -1) {
+		event_warn("%s: dup failed", __func__);
+		evbuffer_chain_free(chain);
+		return (NULL);
+	}
+	chain->flags |= EVBUFFER_SENDFILE | EVBUFFER_IMMUTABLE | EVBUFFER_SPILL;
+	chain->buffer = NULL;	/* no reading possible */
+	chain->misalign = offset;
+	chain->off = len;
+	chain->buffer_len = offset + len;
+#else
+	{
+		/* mmap wants an offset that is a multiple of the page size */
+		off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+		void *mapped = mmap(NULL, len + (offset - start), PROT_READ,
+		    MAP_FILE | MAP_PRIVATE, buf->spill_fd, start);
+		if (mapped == MAP_FAILED) {
+			event_warn("%s: mmap failed", __func__);
+			evbuffer_chain_free(chain);
+			return (NULL);
+		}
+		/* the mapping keeps the file around; we need no fd */
+		info->fd_info.fd = -1;
+		chain->flags |= EVBUFFER_MMAP | EVBUFFER_IMMUTABLE |
+		    EVBUFFER_SPILL;
+		chain->buffer = mapped;
+		chain->buffer_len = len + (offset - start);
+		chain->misalign = offset - start;
+		chain->off = len;
+	}
+#endif
+	return (chain);
+}
+
+/* Write the run of spillable chains after prev out to the spill file, and
+ * put a spill chain in their place.  Returns the spill chain, or NULL if we
+ * couldn't write the file. */
+static struct evbuffer_chain *
+evbuffer_spill_run(struct evbuffer *buf, struct evbuffer_chain *prev)
+{
+	struct iovec iov[NUM_IOVEC];
+	struct evbuffer_chain *first = prev->next, *chain, *spill;
+	struct evbuffer_chain *last = NULL, *next;
+	size_t len = 0, written = 0;
+	off_t start;
+	int i = 0, n = 0;
+
+	for (chain = first; chain && CHAIN_SPILLABLE(chain) &&
+		 n < NUM_IOVEC; chain = chain->next) {
+		iov[n].iov_base = chain->buffer + chain->misalign;
+		iov[n].iov_len = chain->off;
+		len += chain->off;
+		last = chain;
+		++n;
+	}
+	/* chain is now the first one that stays where it is */
+
+	if ((buf->spill_chain == NULL ||
+		buf->spill_off >= EVBUFFER_SPILL_FILE_MAX) &&
+	    evbuffer_spill_open(buf) == -1)
+		return (NULL);
+
+	start = buf->spill_off;
+	while (written < len) {
+		ev_ssize_t res = writev(buf->spill_fd, iov + i, n - i);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			event_warn("%s: writev failed", __func__);
+			lseek(buf->spill_fd, start, SEEK_SET);
+			return (NULL);
+		}
+		written += res;
+		while (i < n && (size_t)res >= iov[i].iov_len)
+			res -= iov[i++].iov_len;
+		if (res) {
+			iov[i].iov_base = (char *)iov[i].iov_base + res;
+			iov[i].iov_len -= res;
+		}
+	}
+
+#ifdef USE_SENDFILE
+	if (buf->spill_chain == prev) {
+		/* The file data right before this is ours; just say that
+		 * there is more of it. */
+		spill = prev;
+		spill->off += len;
+		spill->buffer_len += len;
+	} else
+#endif
+	{
+		struct evbuffer_chain_spill *info;
+		if ((spill = evbuffer_spill_chain_new(buf, start, len)) == NULL) {
+			lseek(buf->spill_fd, start, SEEK_SET);
+			return (NULL);
+		}
+		evbuffer_spill_disown(buf);
+		info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_spill, spill);
+		info->owner = buf;
+		buf->spill_chain = spill;
+		prev->next = spill;
+	}
+	buf->spill_off += len;
+
+	/* Free the chains we wrote out.  If they ran to the end of the
+	 * buffer, keep the last one, empty, for the data that comes next. */
+	if (chain == NULL) {
+		last->misalign = last->off = 0;
+		chain = last;
+		buf->last = last;
+		buf->previous_to_last = spill;
+	} else if (buf->last == chain) {
+		buf->previous_to_last = spill;
+	}
+	for (next = first; next != chain; next = first) {
+		first = next->next;
+		evbuffer_chain_free(next);
+	}
+	spill->next = chain;
+
+	return (spill);
+}
+
+/* Move the data of buf past its first spill_threshold bytes to the spill
+ * file.  Called with buf locked, when it has grown past the threshold. */
+static void
+evbuffer_spill(struct evbuffer *buf)
+{
+	struct evbuffer_chain *prev, *chain;
+	size_t n;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+	if (buf->freeze_start || buf->freeze_end)
+		return;
+
+	if ((prev = buf->spill_chain) != NULL) {
+		/* The head is on disk already; write out what has been
+		 * added after it, once there is enough to bother. */
+		size_t batch = buf->spill_threshold < EVBUFFER_SPILL_BATCH ?
+		    buf->spill_threshold : EVBUFFER_SPILL_BATCH;
+		for (n = 0, chain = prev->next; chain; chain = chain->next)
+			n += chain->off;
+		if (n < batch)
+			return;
+	} else {
+		/* Keep the chains that fit in spill_threshold bytes in
+		 * memory, so that the next write doesn't touch the disk. */
+		if ((prev = buf->first) == NULL)
+			return;
+		for (n = prev->off; prev->next &&
+			 n + prev->next->off <= buf->spill_threshold;
+		     prev = prev->next)
+			n += prev->next->off;
+	}
+
+	while (prev->next) {
+		if (!CHAIN_SPILLABLE(prev->next)) {
+			prev = prev->next;
+			continue;
+		}
+		if ((prev = evbuffer_spill_run(buf, prev)) == NULL) {
+			event_warnx("%s: couldn't spill to disk; keeping "
+			    "the data in memory", __func__);
+			buf->spill_threshold = 0;
+			return;
+		}
+	}
+}
+#endif
+
+int
+evbuffer_set_spill(struct evbuffer *buf, size_t threshold, const char *dir)
+{
+#ifdef USE_SPILL
+	char *dir_copy = NULL;
+
+	if (dir && (dir_copy = mm_strdup(dir)) == NULL)
+		return (-1);
+
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (buf->spill_dir)
+		mm_free(buf->spill_dir);
+	buf->spill_dir = dir_copy;
+	buf->spill_threshold = threshold;
+	if (threshold && buf->total_len > threshold)
+		evbuffer_spill(buf);
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
 void
 evbuffer_setcb(struct evbuffer *buffer, evbuffer_cb cb, void *cbarg)
 {
@@ -2314,6 +4465,48 @@ evbuffer_add_cb(struct evbuffer *buffer, evbuffer_cb_func cb, void *cbarg)
 	return e;
 }
 
+static void
+evbuffer_cb_set_threshold_(struct evbuffer *buffer,
+    struct evbuffer_cb_entry *cb, size_t threshold)
+{
+	cb->threshold = threshold;
+	if (buffer->total_len >= threshold)
+		cb->flags |= EVBUFFER_CB_ABOVE;
+	else
+		cb->flags &= ~EVBUFFER_CB_ABOVE;
+}
+
+struct evbuffer_cb_entry *
+evbuffer_add_threshold_cb(struct evbuffer *buffer, size_t threshold,
+    evbuffer_cb_func cb, void *cbarg)
+{
+	struct evbuffer_cb_entry *e;
+	if (! (e = mm_calloc(1, sizeof(struct evbuffer_cb_entry))))
+		return NULL;
+	EVBUFFER_LOCK(buffer, EVTHREAD_WRITE);
+	e->cb.cb_func = cb;
+	e->cbarg = cbarg;
+	e->flags = EVBUFFER_CB_ENABLED | EVBUFFER_CB_THRESHOLD;
+	evbuffer_cb_set_threshold_(buffer, e, threshold);
+	TAILQ_INSERT_HEAD(&buffer->callbacks, e, next);
+	EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
+	return e;
+}
+
+int
+evbuffer_cb_set_threshold(struct evbuffer *buffer,
+    struct evbuffer_cb_entry *cb, size_t threshold)
+{
+	int result = -1;
+	EVBUFFER_LOCK(buffer, EVTHREAD_WRITE);
+	if (cb->flags & EVBUFFER_CB_THRESHOLD) {
+		evbuffer_cb_set_threshold_(buffer, cb, threshold);
+		result = 0;
+	}
+	EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
+	return result;
+}
+
 int
 evbuffer_remove_cb_entry(struct evbuffer *buffer,
 			 struct evbuffer_cb_entry *ent)
@@ -2349,6 +4542,11 @@ evbuffer_cb_set_flags(struct evbuffer *buffer,
 	/* the user isn't allowed to mess with these. */
 	flags &= ~EVBUFFER_CB_INTERNAL_FLAGS;
         EVBUFFER_LOCK(buffer, EVTHREAD_WRITE);
+	/* A threshold callback didn't see crossings while it was disabled;
+	 * measure from where the buffer is now. */
+	if ((cb->flags & EVBUFFER_CB_THRESHOLD) &&
+	    !(cb->flags & EVBUFFER_CB_ENABLED) && (flags & EVBUFFER_CB_ENABLED))
+		evbuffer_cb_set_threshold_(buffer, cb, cb->threshold);
 	cb->flags |= flags;
         EVBUFFER_UNLOCK(buffer, EVTHREAD_WRITE);
 	return 0;
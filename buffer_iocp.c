@@ -64,6 +64,26 @@ struct buffer_overlapped {
 	WSABUF buffers[MAX_WSABUFS];
 };
 
+/** One of the overlapped reads we keep posted on an evbuffer.  Each read
+    goes into a chain of its own, which joins the buffer once the read is
+    done; if it comes back nearly empty, we copy the data out instead and
+    keep the chain for the next read.
+ **/
+struct buffer_read {
+	struct event_overlapped event_overlapped;
+
+	/** The buffer itself. */
+	struct evbuffer_overlapped *buf;
+	/** The chain we're reading into, or NULL if we gave it to the
+	 * buffer. */
+	struct evbuffer_chain *chain;
+	/** How many bytes the read came back with, once it's done. */
+	ev_ssize_t n_read;
+	/** True iff the read has finished but isn't in the buffer yet. */
+	unsigned done : 1;
+	WSABUF buffer;
+};
+
 /** An evbuffer that can handle overlapped IO. */
 struct evbuffer_overlapped {
 	struct evbuffer buffer;
@@ -71,10 +91,21 @@ struct evbuffer_overlapped {
 	evutil_socket_t fd;
 	/** True iff we have scheduled a write. */
 	unsigned write_in_progress : 1;
-	/** True iff we have scheduled a read. */
-	unsigned read_in_progress : 1;
+	/** True iff a read came back with nothing: the connection is closed,
+	 * so we shouldn't post any more. */
+	unsigned read_eof : 1;
+
+	/** How many reads we keep posted, and how big each one is. */
+	int n_reads;
+	size_t read_size;
+	/** The reads, used as a ring: reads[read_head] is the oldest posted
+	 * one, and the n_reads_posted-1 after it are posted as well. */
+	struct buffer_read reads[EVBUFFER_OVERLAPPED_MAX_READS];
+	int read_head;
+	int n_reads_posted;
+	/** How many bytes the posted reads have room for, in all. */
+	size_t read_bytes_posted;
 
-	struct buffer_overlapped read_info;
 	struct buffer_overlapped write_info;
 };
 
@@ -113,32 +144,47 @@ pin_release(struct event_overlapped *eo, unsigned flag)
 static void
 read_completed(struct event_overlapped *eo, uintptr_t _, ev_ssize_t nBytes)
 {
-	struct buffer_overlapped *buf_o = upcast_overlapped(eo);
-	struct evbuffer_overlapped *buf = buf_o->buf;
+	struct buffer_read *rd =
+	    EVUTIL_UPCAST(eo, struct buffer_read, event_overlapped);
+	struct evbuffer_overlapped *buf = rd->buf;
 	struct evbuffer *evbuf = &buf->buffer;
-
-	struct evbuffer_iovec iov[2];
-	int n_vec;
+	int n_reaped = 0;
 
 	EVBUFFER_LOCK(evbuf, EVTHREAD_WRITE);
-	buf->read_in_progress = 0;
-	evbuffer_unfreeze(evbuf, 0);
-
-	iov[0].iov_base = buf_o->buffers[0].buf;
-	if (nBytes <= buf_o->buffers[0].len) {
-		iov[0].iov_len = nBytes;
-		n_vec = 1;
-	} else {
-		iov[0].iov_len = buf_o->buffers[0].len;
-		iov[1].iov_base = buf_o->buffers[1].buf;
-		iov[1].iov_len = nBytes - iov[0].iov_len;
-		n_vec = 2;
+	rd->done = 1;
+	rd->n_read = nBytes;
+
+	/* The reads on a socket finish in the order we posted them, but the
+	 * port's threads can get to their completions in any order.  Move
+	 * every finished read at the head of the ring into the buffer, so
+	 * that the data goes in the right order, and the callbacks run once
+	 * for all of them. */
+	if (buf->reads[buf->read_head].done)
+		evbuffer_unfreeze(evbuf, 0);
+	while (buf->n_reads_posted && buf->reads[buf->read_head].done) {
+		rd = &buf->reads[buf->read_head];
+		if (rd->n_read <= 0) {
+			buf->read_eof = 1;
+		} else if ((size_t)rd->n_read <= rd->chain->buffer_len / 4) {
+			/* Not worth a whole chain; copy it, and keep the
+			 * chain to read into again. */
+			evbuffer_add(evbuf, rd->chain->buffer, rd->n_read);
+		} else {
+			rd->chain->off = rd->n_read;
+			_evbuffer_chain_append(evbuf, rd->chain);
+			rd->chain = NULL;
+		}
+		rd->done = 0;
+		buf->read_bytes_posted -= rd->buffer.len;
+		buf->read_head = (buf->read_head + 1) % buf->n_reads;
+		--buf->n_reads_posted;
+		++n_reaped;
+	}
+	if (n_reaped) {
+		if (buf->n_reads_posted)
+			evbuffer_freeze(evbuf, 0);
+		_evbuffer_invoke_callbacks(evbuf);
 	}
-
-	if (evbuffer_commit_space(evbuf, iov, n_vec) < 0)
-		assert(0); /* XXXX fail nicer. */
-
-	pin_release(eo, EVBUFFER_MEM_PINNED_R);
 
 	_evbuffer_decref_and_unlock(evbuf);
 }
@@ -172,6 +218,8 @@ evbuffer_overlapped_new(evutil_socket_t fd)
 
 	evo->buffer.is_overlapped = 1;
 	evo->fd = fd;
+	evo->n_reads = EVBUFFER_OVERLAPPED_DEFAULT_READS;
+	evo->read_size = EVBUFFER_OVERLAPPED_DEFAULT_READ_SIZE;
 
 	return &evo->buffer;
 }
@@ -244,69 +292,134 @@ done:
 	return r;
 }
 
-int
-evbuffer_launch_read(struct evbuffer *buf, size_t at_most)
+/** Post one more read on buf_o, for up to 'howmuch' bytes.  Return 0 on
+ * success, -1 on failure. */
+static int
+post_read(struct evbuffer_overlapped *buf_o, size_t howmuch)
 {
-	struct evbuffer_overlapped *buf_o = upcast_evbuffer(buf);
-	int r = -1, i;
-	int nvecs;
-	int npin=0;
-	struct evbuffer_chain *chain=NULL;
+	struct evbuffer *buf = &buf_o->buffer;
+	struct buffer_read *rd;
 	DWORD bytesRead;
 	DWORD flags = 0;
-	struct evbuffer_iovec vecs[MAX_WSABUFS];
 
-	if (!buf_o)
+	rd = &buf_o->reads[(buf_o->read_head + buf_o->n_reads_posted) %
+	    buf_o->n_reads];
+	if (rd->chain && rd->chain->buffer_len < howmuch &&
+	    rd->chain->buffer_len < buf_o->read_size) {
+		_evbuffer_chain_free(rd->chain);
+		rd->chain = NULL;
+	}
+	if (!rd->chain && !(rd->chain = _evbuffer_chain_new(buf, howmuch)))
 		return -1;
-	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
-	if (buf->freeze_end || buf_o->read_in_progress)
-		goto done;
+	if (howmuch > rd->chain->buffer_len)
+		howmuch = rd->chain->buffer_len;
 
-	if (_evbuffer_expand_fast(buf, at_most) == -1)
-		goto done;
-	evbuffer_freeze(buf, 0);
+	event_overlapped_init(&rd->event_overlapped, read_completed);
+	rd->buf = buf_o;
+	rd->done = 0;
+	rd->chain->off = rd->chain->misalign = 0;
+	rd->buffer.buf = (char *)rd->chain->buffer;
+	rd->buffer.len = (ULONG)howmuch;
 
-	/* XXX we could move much of this into the constructor. */
-	memset(&buf_o->read_info, 0, sizeof(buf_o->read_info));
-	buf_o->read_info.buf = buf_o;
-	buf_o->read_info.event_overlapped.cb = read_completed;
-
-	nvecs = _evbuffer_read_setup_vecs(buf, at_most,
-	    vecs, &chain, 1);
-	for (i=0;i<nvecs;++i) {
-		WSABUF_FROM_EVBUFFER_IOV(
-			&buf_o->read_info.buffers[i],
-			&vecs[i]);
-	}
-
-	buf_o->read_info.n_buffers = nvecs;
-	buf_o->read_info.first_pinned = chain;
-	npin=0;
-	for ( ; chain; chain = chain->next) {
-		_evbuffer_chain_pin(chain, EVBUFFER_MEM_PINNED_R);
-		++npin;
-	}
-	assert(npin == nvecs);
+	if (!buf_o->n_reads_posted)
+		evbuffer_freeze(buf, 0);
+	++buf_o->n_reads_posted;
+	buf_o->read_bytes_posted += howmuch;
 
 	_evbuffer_incref(buf);
-	if (WSARecv(buf_o->fd, buf_o->read_info.buffers, nvecs, &bytesRead, &flags, &buf_o->read_info.event_overlapped.overlapped, NULL)) {
+	if (WSARecv(buf_o->fd, &rd->buffer, 1, &bytesRead, &flags,
+		&rd->event_overlapped.overlapped, NULL)) {
 		int error = WSAGetLastError();
 		if (error != WSA_IO_PENDING) {
 			/* An actual error. */
-			pin_release(&buf_o->read_info.event_overlapped, EVBUFFER_MEM_PINNED_R);
-			evbuffer_unfreeze(buf, 0);
+			--buf_o->n_reads_posted;
+			buf_o->read_bytes_posted -= howmuch;
+			if (!buf_o->n_reads_posted)
+				evbuffer_unfreeze(buf, 0);
 			evbuffer_free(buf); /* decref */
-			goto done;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+evbuffer_launch_read(struct evbuffer *buf, size_t at_most)
+{
+	struct evbuffer_overlapped *buf_o = upcast_evbuffer(buf);
+	int r = -1;
+
+	if (!buf_o)
+		return -1;
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (buf->freeze_end && !buf_o->n_reads_posted)
+		goto done;
+
+	/* Keep up to n_reads posted, but only for as much as we were asked
+	 * to read in all. */
+	while (!buf_o->read_eof &&
+	    buf_o->n_reads_posted < buf_o->n_reads &&
+	    buf_o->read_bytes_posted < at_most) {
+		size_t howmuch = at_most - buf_o->read_bytes_posted;
+		if (howmuch > buf_o->read_size)
+			howmuch = buf_o->read_size;
+		if (post_read(buf_o, howmuch) < 0) {
+			if (!buf_o->n_reads_posted)
+				goto done;
+			break;
 		}
 	}
 
-	buf_o->read_in_progress = 1;
 	r = 0;
 done:
 	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
 	return r;
 }
 
+int
+_evbuffer_overlapped_set_reads(struct evbuffer *buf, int n_reads,
+    size_t read_size)
+{
+	struct evbuffer_overlapped *buf_o = upcast_evbuffer(buf);
+	int i, r = -1;
+
+	if (!buf_o || n_reads < 1 || n_reads > EVBUFFER_OVERLAPPED_MAX_READS ||
+	    read_size == 0)
+		return -1;
+	EVBUFFER_LOCK(buf, EVTHREAD_WRITE);
+	if (buf_o->n_reads_posted)
+		goto done;
+	for (i = 0; i < buf_o->n_reads; ++i) {
+		if (buf_o->reads[i].chain) {
+			_evbuffer_chain_free(buf_o->reads[i].chain);
+			buf_o->reads[i].chain = NULL;
+		}
+	}
+	buf_o->n_reads = n_reads;
+	buf_o->read_size = read_size;
+	buf_o->read_head = 0;
+	r = 0;
+done:
+	EVBUFFER_UNLOCK(buf, EVTHREAD_WRITE);
+	return r;
+}
+
+void
+_evbuffer_overlapped_free_reads(struct evbuffer *buf)
+{
+	struct evbuffer_overlapped *buf_o = upcast_evbuffer(buf);
+	int i;
+
+	/* Every posted read holds a reference, so none can be posted now. */
+	assert(buf_o->n_reads_posted == 0);
+	for (i = 0; i < buf_o->n_reads; ++i) {
+		if (buf_o->reads[i].chain) {
+			_evbuffer_chain_free(buf_o->reads[i].chain);
+			buf_o->reads[i].chain = NULL;
+		}
+	}
+}
+
 evutil_socket_t
 _evbuffer_overlapped_get_fd(struct evbuffer *buf)
 {
@@ -34,8 +34,69 @@ extern "C" {
 #include "evutil.h"
 #include "defer-internal.h"
 #include "evthread-internal.h"
+#include "evbuffer-internal.h"
+#include "ratelim-internal.h"
 #include "event2/thread.h"
 
+/** The rate limiting state of one bufferevent; see
+ * bufferevent_set_rate_limit() and bufferevent_add_to_rate_limit_group(). */
+struct bufferevent_rate_limit {
+	/** Our place in group->members, if we are in a group. */
+	TAILQ_ENTRY(bufferevent_private) next_in_group;
+	/** The group we are in, or NULL. */
+	struct bufferevent_rate_limit_group *group;
+
+	/** Our own buckets, if cfg is set. */
+	struct ev_token_bucket limit;
+	struct ev_token_bucket_cfg *cfg;
+	/** Timer to refill our own buckets after they ran dry. */
+	struct event refill_bucket_event;
+
+	/** Scheduled by the group when it has refilled its buckets and we
+	 * were waiting for it. */
+	struct deferred_cb group_deferred;
+};
+
+/** What a bufferevent needs to give back its buffers' memory once it has
+ * been idle; see bufferevent_set_idle_release(). */
+struct bufferevent_idle_release {
+	/** How long both buffers must stay empty, as given to
+	 * event_add(): a common timeout if the base would give us one. */
+	const struct timeval *timeout;
+	struct timeval idle;
+	/** Threshold callbacks that tell us when each buffer goes empty or
+	 * stops being empty. */
+	struct evbuffer_cb_entry *input_cb;
+	struct evbuffer_cb_entry *output_cb;
+	/** Pending while both buffers are empty. */
+	struct event timer;
+};
+
+/** What a socket bufferevent needs to enforce timeout_read and
+ * timeout_write: a timer for each, and when we last read and wrote.  The
+ * timers are only checked against last_read and last_write when they
+ * fire. */
+struct bufferevent_socket_timeouts {
+	struct event read_timer;
+	struct event write_timer;
+	struct timeval last_read;
+	struct timeval last_write;
+};
+
+/** Deferred callbacks that a socket bufferevent needs only for some of its
+ * options. */
+struct bufferevent_socket_deferred {
+	/** Used to uncork the socket at the end of a loop iteration, for
+	 * BEV_OPT_CORK. */
+	struct deferred_cb uncork;
+	/** Used to flush output at the end of a batch of callbacks, for
+	 * BEV_OPT_OPTIMISTIC_WRITE and BEV_OPT_EDGE_TRIGGERED. */
+	struct deferred_cb flush;
+	/** Used to go on reading for BEV_OPT_EDGE_TRIGGERED when no edge is
+	 * coming. */
+	struct deferred_cb read;
+};
+
 /** Parts of the bufferevent structure that are shared among all bufferevent
  * types, but not exposed in bufferevent_struct.h. */
 struct bufferevent_private {
@@ -45,8 +106,12 @@ struct bufferevent_private {
 	/** Evbuffer callback to enforce watermarks on input. */
 	struct evbuffer_cb_entry *read_watermarks_cb;
 
-	/** If set, read is suspended until evbuffer some. */
-	unsigned read_suspended : 1;
+	/** If nonzero, read is suspended, for the BEV_SUSPEND_* reasons
+	 * set in it. */
+	short read_suspended;
+	/** If nonzero, write is suspended, for the BEV_SUSPEND_* reasons
+	 * set in it. */
+	short write_suspended;
 	/** If set, we should free the lock when we free the bufferevent. */
 	unsigned own_lock : 1;
 
@@ -58,26 +123,98 @@ struct bufferevent_private {
 	unsigned writecb_pending : 1;
 	/** Flag: set if we are currently busy connecting. */
 	unsigned connecting : 1;
+	/** Flag: set if we have corked our socket for BEV_OPT_CORK. */
+	unsigned corked : 1;
+	/** Flags for BEV_OPT_EDGE_TRIGGERED: set if the socket may still
+	 * have data for us (or room for our output) that we didn't take, so
+	 * no new edge is coming and we have to try again ourselves. */
+	unsigned et_readable : 1;
+	unsigned et_writable : 1;
+	/** Flag: set if BEV_OPT_NOTSENT_LOWAT took effect on our socket, so
+	 * that it is reported writable only while the kernel holds less than
+	 * the threshold of unsent data. */
+	unsigned notsent_lowat : 1;
 	/** Set to the events pending if we have deferred callbacks and
 	 * an events callback is pending. */
 	short eventcb_pending;
 	/** Set to the current socket errno if we have deferred callbacks and
 	 * an events callback is pending. */
 	int errno_pending;
+	/** The DNS error code for bufferevent_socket_connect_hostname */
+	int dns_error;
 	/** Used to implement deferred callbacks */
 	struct deferred_cb deferred;
+	/** For socket bufferevents: set if they were constructed with an
+	 * option that needs one of these callbacks. */
+	struct bufferevent_socket_deferred *socket_deferred;
 
 	/** The options this bufferevent was constructed with */
 	enum bufferevent_options options;
 
+	/** For socket bufferevents: what to set on every socket we get, if
+	 * they were constructed with any settings. */
+	struct bufferevent_socket_settings *socket_settings;
+
 	/** Current reference count for this bufferevent. */
 	int refcnt;
 
 	/** Lock for this bufferevent.  Shared by the inbuf and the outbuf.
 	 * If NULL, locking is disabled. */
 	void *lock;
+
+	/** The memory group that our buffers are in, if it was set with
+	 * bufferevent_set_mem_group().  While it is over its threshold we
+	 * don't read. */
+	struct evbuffer_mem_group *mem_group;
+	/** How mem_group tells us about its crossings. */
+	struct evbuffer_mem_group_member mem_member;
+
+	/** Rate limiting state, if this bufferevent has a rate limit or is
+	 * in a rate limit group. */
+	struct bufferevent_rate_limit *rate_limiting;
+
+	/** Set if the buffers' memory is to be freed once they have been
+	 * empty for a while. */
+	struct bufferevent_idle_release *idle_release;
+
+	/** For socket bufferevents: set once we have started reading or
+	 * writing with a timeout. */
+	struct bufferevent_socket_timeouts *timeouts;
+};
+
+/** A group of bufferevents that share a pair of token buckets; see
+ * bufferevent_rate_limit_group_new(). */
+struct bufferevent_rate_limit_group {
+	/** The bufferevents in this group, in the order they get to go
+	 * after the buckets are refilled. */
+	TAILQ_HEAD(rlim_group_member_list, bufferevent_private) members;
+	int n_members;
+
+	struct ev_token_bucket rate_limit;
+	struct ev_token_bucket_cfg rate_limit_cfg;
+
+	/** True iff the group has run dry, and its members must wait for
+	 * the next tick. */
+	unsigned read_suspended : 1;
+	unsigned write_suspended : 1;
+
+	/** The smallest share we hand a member, so that a big group doesn't
+	 * do lots of tiny reads and writes. */
+	ev_ssize_t min_share;
+
+	/** Timer that refills the buckets every tick. */
+	struct event master_refill_event;
+	void *lock;
 };
 
+/** Reasons for read_suspended and write_suspended: the input buffer is
+ * over its high watermark, the memory group is over its threshold, our
+ * own rate limit has run dry, or our group's has. */
+#define BEV_SUSPEND_WM	0x01
+#define BEV_SUSPEND_MEM	0x02
+#define BEV_SUSPEND_BW	0x04
+#define BEV_SUSPEND_BW_GROUP 0x08
+
 /** Possible operations for a control callback. */
 enum bufferevent_ctrl_op {
 	BEV_CTRL_SET_FD,
@@ -140,16 +277,34 @@ struct bufferevent_ops {
 extern const struct bufferevent_ops bufferevent_ops_socket;
 extern const struct bufferevent_ops bufferevent_ops_filter;
 extern const struct bufferevent_ops bufferevent_ops_pair;
+extern const struct bufferevent_ops bufferevent_ops_pair_xthread;
+extern const struct bufferevent_ops bufferevent_ops_openssl;
 
 /** Initialize the shared parts of a bufferevent. */
 int bufferevent_init_common(struct bufferevent_private *, struct event_base *, const struct bufferevent_ops *, enum bufferevent_options options);
 
+/** For internal use: temporarily stop all reads on bufev, for the
+ * BEV_SUSPEND_* reason what. */
+void bufferevent_suspend_read(struct bufferevent *bufev, short what);
+/** For internal use: drop the BEV_SUSPEND_* reason what for not reading on
+ * bufev, and start reading again if no other reason is left. */
+void bufferevent_unsuspend_read(struct bufferevent *bufev, short what);
+
+/** For internal use: temporarily stop all writes on bufev, for the
+ * BEV_SUSPEND_* reason what. */
+void bufferevent_suspend_write(struct bufferevent *bufev, short what);
+/** For internal use: drop the BEV_SUSPEND_* reason what for not writing on
+ * bufev, and start writing again if no other reason is left. */
+void bufferevent_unsuspend_write(struct bufferevent *bufev, short what);
+
 /** For internal use: temporarily stop all reads on bufev, because its
  * read buffer is too full. */
-void bufferevent_wm_suspend_read(struct bufferevent *bufev);
-/** For internal use: temporarily stop all reads on bufev, because its
- * read buffer is too full. */
-void bufferevent_wm_unsuspend_read(struct bufferevent *bufev);
+#define bufferevent_wm_suspend_read(b) \
+	bufferevent_suspend_read((b), BEV_SUSPEND_WM)
+/** For internal use: start reading again on bufev, unless something other
+ * than its read buffer being too full stopped it. */
+#define bufferevent_wm_unsuspend_read(b) \
+	bufferevent_unsuspend_read((b), BEV_SUSPEND_WM)
 
 /** Internal: Set up locking on a bufferevent.  If lock is set, use it.
  * Otherwise, use a new lock. */
@@ -170,6 +325,19 @@ void _bufferevent_run_writecb(struct bufferevent *bufev);
  * it to run with events "what".  Otherwise just run the eventcb. */
 void _bufferevent_run_eventcb(struct bufferevent *bufev, short what);
 
+/** Internal: return how many bytes bufev may read or write right now,
+ * given its rate limits; EV_SSIZE_MAX if it has none.  Never negative. */
+ev_ssize_t _bufferevent_get_read_max(struct bufferevent_private *bufev);
+ev_ssize_t _bufferevent_get_write_max(struct bufferevent_private *bufev);
+/** Internal: take bytes read or written from bufev's buckets, and stop
+ * reading or writing if they run dry. */
+int _bufferevent_decrement_read_buckets(struct bufferevent_private *bufev,
+    ev_ssize_t bytes);
+int _bufferevent_decrement_write_buckets(struct bufferevent_private *bufev,
+    ev_ssize_t bytes);
+/** Internal: release bufev's rate limiting state as it is freed. */
+void _bufferevent_free_rate_limiting(struct bufferevent_private *bufev);
+
 /* =========
  * These next functions implement timeouts for bufferevents that aren't doing
  * anything else with ev_read and ev_write, to handle timeouts.
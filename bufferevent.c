@@ -60,56 +60,92 @@
 #include "util-internal.h"
 
 void
-bufferevent_wm_suspend_read(struct bufferevent *bufev)
+bufferevent_suspend_read(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	BEV_LOCK(bufev);
-	if (!bufev_private->read_suspended) {
+	if (!bufev_private->read_suspended)
 		bufev->be_ops->disable(bufev, EV_READ);
-		bufev_private->read_suspended = 1;
-	}
+	bufev_private->read_suspended |= what;
 	BEV_UNLOCK(bufev);
 }
 
 void
-bufferevent_wm_unsuspend_read(struct bufferevent *bufev)
+bufferevent_unsuspend_read(struct bufferevent *bufev, short what)
 {
 	struct bufferevent_private *bufev_private =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 
 	BEV_LOCK(bufev);
-	if (bufev_private->read_suspended) {
-		bufev_private->read_suspended = 0;
-		if (bufev->enabled & EV_READ)
+	if (bufev_private->read_suspended & what) {
+		bufev_private->read_suspended &= ~what;
+		if (!bufev_private->read_suspended &&
+		    (bufev->enabled & EV_READ))
 			bufev->be_ops->enable(bufev, EV_READ);
 	}
 	BEV_UNLOCK(bufev);
 }
 
+void
+bufferevent_suspend_write(struct bufferevent *bufev, short what)
+{
+	struct bufferevent_private *bufev_private =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	BEV_LOCK(bufev);
+	if (!bufev_private->write_suspended)
+		bufev->be_ops->disable(bufev, EV_WRITE);
+	bufev_private->write_suspended |= what;
+	BEV_UNLOCK(bufev);
+}
+
+void
+bufferevent_unsuspend_write(struct bufferevent *bufev, short what)
+{
+	struct bufferevent_private *bufev_private =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	BEV_LOCK(bufev);
+	if (bufev_private->write_suspended & what) {
+		bufev_private->write_suspended &= ~what;
+		if (!bufev_private->write_suspended &&
+		    (bufev->enabled & EV_WRITE))
+			bufev->be_ops->enable(bufev, EV_WRITE);
+	}
+	BEV_UNLOCK(bufev);
+}
+
 /* Callback to implement watermarks on the input buffer.  Only enabled
- * if the watermark is set. */
+ * if the watermark is set; it's a threshold callback on the high-water
+ * mark, so it only runs when the input length crosses it. */
 static void
 bufferevent_inbuf_wm_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *cbinfo,
     void *arg)
 {
 	struct bufferevent *bufev = arg;
-        size_t size;
 
-	size = evbuffer_get_length(buf);
+	if (evbuffer_get_length(buf) >= bufev->wm_read.high)
+		bufferevent_wm_suspend_read(bufev);
+	else
+		bufferevent_wm_unsuspend_read(bufev);
+}
 
-	if (cbinfo->n_added > cbinfo->n_deleted) {
-		/* Data got added.  If it put us over the watermark, stop
-		 * reading. */
-		if (size >= bufev->wm_read.high)
-			bufferevent_wm_suspend_read(bufev);
-	} else {
-		/* Data got removed.  If it puts us under the watermark,
-		   stop reading. */
-		if (size < bufev->wm_read.high)
-			bufferevent_wm_unsuspend_read(bufev);
+/* Called from the base after our memory group crossed a threshold. */
+static void
+bufferevent_mem_group_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bufev_private = arg;
+	struct bufferevent *bufev = &bufev_private->bev;
+
+	BEV_LOCK(bufev);
+	if (bufev_private->mem_group) {
+		if (evbuffer_mem_group_is_over(bufev_private->mem_group))
+			bufferevent_suspend_read(bufev, BEV_SUSPEND_MEM);
+		else
+			bufferevent_unsuspend_read(bufev, BEV_SUSPEND_MEM);
 	}
+	BEV_UNLOCK(bufev);
 }
 
 static void
@@ -215,6 +251,10 @@ bufferevent_init_common(struct bufferevent_private *bufev_private,
 		}
 	}
 
+	/* This fails harmlessly if the base keeps no pool. */
+	evbuffer_use_base_pool(bufev->input, base);
+	evbuffer_use_base_pool(bufev->output, base);
+
 	bufev_private->refcnt = 1;
 	bufev->ev_base = base;
 
@@ -323,6 +363,8 @@ bufferevent_enable(struct bufferevent *bufev, short event)
 	BEV_LOCK(bufev);
 	if (bufev_private->read_suspended)
 		impl_events &= ~EV_READ;
+	if (bufev_private->write_suspended)
+		impl_events &= ~EV_WRITE;
 
 	bufev->enabled |= event;
 
@@ -423,15 +465,20 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 
 			if (bufev_private->read_watermarks_cb == NULL) {
 				bufev_private->read_watermarks_cb =
-				    evbuffer_add_cb(bufev->input,
+				    evbuffer_add_threshold_cb(bufev->input,
+						    highmark,
 						    bufferevent_inbuf_wm_cb,
 						    bufev);
+			} else {
+				evbuffer_cb_set_threshold(bufev->input,
+				    bufev_private->read_watermarks_cb,
+				    highmark);
 			}
 			evbuffer_cb_set_flags(bufev->input,
 					      bufev_private->read_watermarks_cb,
 					      EVBUFFER_CB_ENABLED);
 
-			if (evbuffer_get_length(bufev->input) > highmark)
+			if (evbuffer_get_length(bufev->input) >= highmark)
 				bufferevent_wm_suspend_read(bufev);
 			else if (evbuffer_get_length(bufev->input) < highmark)
 				bufferevent_wm_unsuspend_read(bufev);
@@ -447,6 +494,145 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 	BEV_UNLOCK(bufev);
 }
 
+int
+bufferevent_set_mem_group(struct bufferevent *bufev,
+    struct evbuffer_mem_group *group)
+{
+	struct bufferevent_private *bufev_private =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	BEV_LOCK(bufev);
+	if (bufev_private->mem_group == group) {
+		BEV_UNLOCK(bufev);
+		return 0;
+	}
+	if (bufev_private->mem_group) {
+		_evbuffer_mem_group_remove_member(bufev_private->mem_group,
+		    &bufev_private->mem_member);
+		bufev_private->mem_group = NULL;
+		bufferevent_unsuspend_read(bufev, BEV_SUSPEND_MEM);
+	}
+
+	evbuffer_set_mem_group(bufev->input, group);
+	evbuffer_set_mem_group(bufev->output, group);
+
+	if (group) {
+		bufev_private->mem_group = group;
+		bufev_private->mem_member.base = bufev->ev_base;
+		event_deferred_cb_init(&bufev_private->mem_member.deferred,
+		    bufferevent_mem_group_deferred_cb, bufev_private);
+		_evbuffer_mem_group_add_member(group,
+		    &bufev_private->mem_member);
+		if (evbuffer_mem_group_is_over(group))
+			bufferevent_suspend_read(bufev, BEV_SUSPEND_MEM);
+	}
+	BEV_UNLOCK(bufev);
+	return 0;
+}
+
+/* The buffers have both been empty for the idle interval: hand back what
+ * they hold. */
+static void
+bufferevent_idle_release_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_private *bufev_private = arg;
+	struct bufferevent *bufev = &bufev_private->bev;
+
+	BEV_LOCK(bufev);
+	if (evbuffer_get_length(bufev->input) == 0 &&
+	    evbuffer_get_length(bufev->output) == 0) {
+		evbuffer_shrink(bufev->input);
+		evbuffer_shrink(bufev->output);
+	}
+	BEV_UNLOCK(bufev);
+}
+
+/* Start the idle timer if both buffers are empty, and stop it if not. */
+static void
+bufferevent_idle_release_check(struct bufferevent_private *bufev_private)
+{
+	struct bufferevent *bufev = &bufev_private->bev;
+	struct bufferevent_idle_release *ir = bufev_private->idle_release;
+
+	if (evbuffer_get_length(bufev->input) == 0 &&
+	    evbuffer_get_length(bufev->output) == 0)
+		event_add(&ir->timer, ir->timeout);
+	else
+		event_del(&ir->timer);
+}
+
+/* Threshold callback on each buffer: it just went empty or stopped being
+ * empty. */
+static void
+bufferevent_idle_buffer_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *cbinfo, void *arg)
+{
+	bufferevent_idle_release_check(arg);
+}
+
+static void
+bufferevent_free_idle_release(struct bufferevent_private *bufev_private)
+{
+	struct bufferevent *bufev = &bufev_private->bev;
+	struct bufferevent_idle_release *ir = bufev_private->idle_release;
+
+	event_del(&ir->timer);
+	if (ir->input_cb)
+		evbuffer_remove_cb_entry(bufev->input, ir->input_cb);
+	if (ir->output_cb)
+		evbuffer_remove_cb_entry(bufev->output, ir->output_cb);
+	mm_free(ir);
+	bufev_private->idle_release = NULL;
+}
+
+int
+bufferevent_set_idle_release(struct bufferevent *bufev,
+    const struct timeval *idle)
+{
+	struct bufferevent_private *bufev_private =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	struct bufferevent_idle_release *ir;
+	int r = -1;
+
+	BEV_LOCK(bufev);
+	if (!idle) {
+		if (bufev_private->idle_release)
+			bufferevent_free_idle_release(bufev_private);
+		r = 0;
+		goto done;
+	}
+	if (idle->tv_sec < 0 || idle->tv_usec < 0 || !bufev->ev_base)
+		goto done;
+
+	if (!(ir = bufev_private->idle_release)) {
+		if (!(ir = mm_calloc(1, sizeof(*ir))))
+			goto done;
+		evtimer_assign(&ir->timer, bufev->ev_base,
+		    bufferevent_idle_release_cb, bufev_private);
+		bufev_private->idle_release = ir;
+		ir->input_cb = evbuffer_add_threshold_cb(bufev->input, 1,
+		    bufferevent_idle_buffer_cb, bufev_private);
+		ir->output_cb = evbuffer_add_threshold_cb(bufev->output, 1,
+		    bufferevent_idle_buffer_cb, bufev_private);
+		if (!ir->input_cb || !ir->output_cb) {
+			bufferevent_free_idle_release(bufev_private);
+			goto done;
+		}
+	}
+
+	/* Every bufferevent with the same interval can share one timeout
+	 * queue, which makes rescheduling the timer O(1). */
+	ir->idle = *idle;
+	ir->timeout = event_base_init_common_timeout(bufev->ev_base, idle);
+	if (!ir->timeout)
+		ir->timeout = &ir->idle;
+	bufferevent_idle_release_check(bufev_private);
+	r = 0;
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
 int
 bufferevent_flush(struct bufferevent *bufev,
     short iotype,
@@ -475,6 +661,14 @@ _bufferevent_decref_and_unlock(struct bufferevent *bufev)
 	if (bufev->be_ops->destruct)
 		bufev->be_ops->destruct(bufev);
 
+	if (bufev_private->mem_group)
+		_evbuffer_mem_group_remove_member(bufev_private->mem_group,
+		    &bufev_private->mem_member);
+	if (bufev_private->rate_limiting)
+		_bufferevent_free_rate_limiting(bufev_private);
+	if (bufev_private->idle_release)
+		bufferevent_free_idle_release(bufev_private);
+
 	/* evbuffer will free the callbacks */
 	evbuffer_free(bufev->input);
 	evbuffer_free(bufev->output);
@@ -515,7 +709,7 @@ bufferevent_enable_locking(struct bufferevent *bufev, void *lock)
 		return -1;
 
 	if (!lock) {
-		EVTHREAD_ALLOC_LOCK(lock);
+		EVTHREAD_ALLOC_LOCK(lock, EVTHREAD_LOCK_CATEGORY_BUFFEREVENT);
 		if (!lock)
 			return -1;
 		BEV_UPCAST(bufev)->lock = lock;
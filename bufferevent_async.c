@@ -79,7 +79,6 @@ const struct bufferevent_ops bufferevent_ops_async = {
 
 struct bufferevent_async {
 	struct bufferevent_private bev;
-	unsigned read_in_progress : 1;
 	unsigned write_in_progress : 1;
 };
 
@@ -119,9 +118,8 @@ bev_async_consider_reading(struct bufferevent_async *b)
 	size_t cur_size;
 	size_t read_high;
 	size_t at_most;
-	/* Don't read if there is a read in progress, or we do not
-	 * want to read. */
-	if (b->read_in_progress || !(b->bev.bev.enabled&EV_READ))
+	/* Don't read if we do not want to read. */
+	if (!(b->bev.bev.enabled&EV_READ))
 		return;
 
 	/* Don't read if we're full */
@@ -132,13 +130,13 @@ bev_async_consider_reading(struct bufferevent_async *b)
 			return;
 		at_most = read_high - cur_size;
 	} else {
-		at_most = 16384; /* FIXME totally magic. */
+		at_most = EV_SIZE_MAX;
 	}
 
+	/* This tops up the reads we have posted; it won't post more than the
+	 * buffer was set up to keep in flight. */
 	if (evbuffer_launch_read(b->bev.bev.input, at_most)) {
 		assert(0);
-	} else {
-		b->read_in_progress = 1;
 	}
 }
 
@@ -184,11 +182,7 @@ be_async_inbuf_callback(struct evbuffer *buf,
 	 * the inbuf and were not reading before, we may want to read now */
 
 	BEV_LOCK(bev);
-	if (cbinfo->n_added) {
-		/* XXXX can't detect 0-length read completion */
-		bev_async->read_in_progress = 0;
-	}
-
+	/* XXXX can't detect 0-length read completion */
 	if (cbinfo->n_added || cbinfo->n_deleted)
 		bev_async_consider_reading(bev_async);
 
@@ -245,11 +239,6 @@ be_async_flush(struct bufferevent *bev, short what,
 	return 0;
 }
 
-/*FIXME export this */
-struct bufferevent *
-bufferevent_async_new(struct event_base *base,
-    evutil_socket_t fd, enum bufferevent_options options);
-
 struct bufferevent *
 bufferevent_async_new(struct event_base *base,
     evutil_socket_t fd, enum bufferevent_options options)
@@ -297,6 +286,19 @@ err:
 	return NULL;
 }
 
+int
+bufferevent_async_set_reads(struct bufferevent *bev, int n_reads,
+    size_t read_size)
+{
+	int r;
+	if (!upcast(bev))
+		return -1;
+	BEV_LOCK(bev);
+	r = _evbuffer_overlapped_set_reads(bev->input, n_reads, read_size);
+	BEV_UNLOCK(bev);
+	return r;
+}
+
 static int
 be_async_ctrl(struct bufferevent *bev, enum bufferevent_ctrl_op op,
     union bufferevent_ctrl_data *data)
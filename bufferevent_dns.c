@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Connecting a socket bufferevent to a hostname.
+ *
+ * We look up the A and AAAA records in parallel with evdns, then race
+ * connection attempts against the answers in the style of RFC 6555 / RFC
+ * 8305 ("Happy Eyeballs"): IPv6 and IPv4 addresses are tried alternately,
+ * a new attempt is started whenever the previous one fails or has been
+ * outstanding for BEV_DNS_ATTEMPT_DELAY_MSEC, and the first socket to
+ * connect is handed to the bufferevent.  All the others are closed.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _EVENT_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef _EVENT_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef _EVENT_HAVE_NETINET_IN6_H
+#include <netinet/in6.h>
+#endif
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "event2/util.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_struct.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/dns.h"
+#include "defer-internal.h"
+#include "bufferevent-internal.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+
+/* How long to wait for the AAAA answer once the A answer has arrived. */
+#define BEV_DNS_RESOLUTION_DELAY_MSEC 50
+/* How long to give one connection attempt before starting the next. */
+#define BEV_DNS_ATTEMPT_DELAY_MSEC 250
+/* How many addresses of each family we are willing to try. */
+#define BEV_DNS_MAX_ADDRS 8
+
+/* One outstanding connect() attempt. */
+struct bev_dns_attempt {
+	evutil_socket_t fd;
+	struct event ev;
+	struct bev_dns_connect *conn;
+};
+
+/* State for one bufferevent_socket_connect_hostname() call.  It lives
+ * until both lookups have reported back, even if a connection wins first,
+ * since evdns will still invoke our callbacks. */
+struct bev_dns_connect {
+	struct bufferevent *bev;
+	ev_uint16_t port;
+
+	/* Number of lookups we have not heard back from yet. */
+	int lookups_pending;
+	/* Set once the AAAA lookup has answered (or was never launched). */
+	unsigned ipv6_done : 1;
+	/* Set once we have started trying addresses. */
+	unsigned started : 1;
+	/* Set once we have connected or given up; bev is no longer ours. */
+	unsigned finished : 1;
+	/* Family of the address we tried most recently. */
+	int last_family;
+	/* First DNS error we saw, if any. */
+	int dns_error;
+	/* Socket error from the most recent failed attempt. */
+	int socket_error;
+
+	struct in_addr ipv4[BEV_DNS_MAX_ADDRS];
+	int n_ipv4, next_ipv4;
+#ifdef _EVENT_HAVE_STRUCT_IN6_ADDR
+	struct in6_addr ipv6[BEV_DNS_MAX_ADDRS];
+#endif
+	int n_ipv6, next_ipv6;
+
+	struct bev_dns_attempt attempts[2*BEV_DNS_MAX_ADDRS];
+	int n_attempts;
+	int n_running;
+
+	/* Used both for the resolution delay and the attempt delay. */
+	struct event timer;
+};
+
+static void bev_dns_try_next(struct bev_dns_connect *conn);
+
+static void
+bev_dns_arm_timer(struct bev_dns_connect *conn, int msec)
+{
+	struct timeval tv;
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	event_add(&conn->timer, &tv);
+}
+
+static void
+bev_dns_connect_free(struct bev_dns_connect *conn)
+{
+	event_del(&conn->timer);
+	mm_free(conn);
+}
+
+/* Close every attempt except 'keep', and stop the timer.  Must be called
+ * with the bufferevent locked. */
+static void
+bev_dns_close_attempts(struct bev_dns_connect *conn,
+    struct bev_dns_attempt *keep)
+{
+	int i;
+	for (i = 0; i < conn->n_attempts; ++i) {
+		struct bev_dns_attempt *a = &conn->attempts[i];
+		if (a == keep || a->fd < 0)
+			continue;
+		event_del(&a->ev);
+		EVUTIL_CLOSESOCKET(a->fd);
+		a->fd = -1;
+	}
+	if (keep)
+		event_del(&keep->ev);
+	conn->n_running = 0;
+	event_del(&conn->timer);
+}
+
+/* We are done with the bufferevent: release our reference to it, and free
+ * ourself unless evdns still owes us a callback.  Must be called with the
+ * bufferevent locked; unlocks it. */
+static void
+bev_dns_finish(struct bev_dns_connect *conn)
+{
+	struct bufferevent *bev = conn->bev;
+
+	conn->finished = 1;
+	conn->bev = NULL;
+	if (!conn->lookups_pending)
+		bev_dns_connect_free(conn);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Hand the connected socket 'fd' over to the bufferevent. */
+static void
+bev_dns_succeed(struct bev_dns_connect *conn, evutil_socket_t fd)
+{
+	struct bufferevent *bev = conn->bev;
+	struct bufferevent_private *bev_p = BEV_UPCAST(bev);
+	short what = EV_WRITE;
+
+	bufferevent_setfd(bev, fd);
+	if ((bev->enabled & EV_READ) && !bev_p->read_suspended)
+		what |= EV_READ;
+	/* Let the socket's write callback report BEV_EVENT_CONNECTED, just
+	 * as it does after bufferevent_socket_connect(). */
+	bev_p->connecting = 1;
+	if (bev->be_ops->enable(bev, what) < 0) {
+		bev_p->connecting = 0;
+		_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+	}
+	bev_dns_finish(conn);
+}
+
+static void
+bev_dns_fail(struct bev_dns_connect *conn)
+{
+	struct bufferevent *bev = conn->bev;
+
+	bev_dns_close_attempts(conn, NULL);
+	BEV_UPCAST(bev)->dns_error = conn->dns_error;
+	if (conn->socket_error)
+		EVUTIL_SET_SOCKET_ERROR(conn->socket_error);
+	_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+	bev_dns_finish(conn);
+}
+
+static void
+bev_dns_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bev_dns_attempt *a = arg;
+	struct bev_dns_connect *conn = a->conn;
+	struct bufferevent *bev = conn->bev;
+	int e = 0;
+#ifdef WIN32
+	int elen = sizeof(e);
+#else
+	socklen_t elen = sizeof(e);
+#endif
+
+	BEV_LOCK(bev);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)&e, &elen) < 0)
+		e = evutil_socket_geterror(fd);
+	if (e == 0) {
+		bev_dns_close_attempts(conn, a);
+		a->fd = -1;
+		bev_dns_succeed(conn, fd);
+		return;
+	}
+	if (EVUTIL_ERR_CONNECT_RETRIABLE(e)) {
+		BEV_UNLOCK(bev);
+		return;
+	}
+
+	event_del(&a->ev);
+	EVUTIL_CLOSESOCKET(a->fd);
+	a->fd = -1;
+	--conn->n_running;
+	conn->socket_error = e;
+	/* Don't wait out the attempt delay: try the next address now. */
+	event_del(&conn->timer);
+	bev_dns_try_next(conn);
+}
+
+/* Pick the next address to try, alternating between families and starting
+ * with IPv6.  Returns the socklen, or 0 if no address is available. */
+static int
+bev_dns_next_addr(struct bev_dns_connect *conn, struct sockaddr_storage *ss)
+{
+	int want_v6 = conn->last_family != AF_INET6;
+
+	if (want_v6 && conn->next_ipv6 >= conn->n_ipv6)
+		want_v6 = 0;
+	else if (!want_v6 && conn->next_ipv4 >= conn->n_ipv4)
+		want_v6 = 1;
+
+	memset(ss, 0, sizeof(*ss));
+#ifdef _EVENT_HAVE_STRUCT_SOCKADDR_IN6
+	if (want_v6 && conn->next_ipv6 < conn->n_ipv6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(conn->port);
+		sin6->sin6_addr = conn->ipv6[conn->next_ipv6++];
+		conn->last_family = AF_INET6;
+		return sizeof(*sin6);
+	}
+#endif
+	if (conn->next_ipv4 < conn->n_ipv4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(conn->port);
+		sin->sin_addr = conn->ipv4[conn->next_ipv4++];
+		conn->last_family = AF_INET;
+		return sizeof(*sin);
+	}
+	return 0;
+}
+
+/* Start connecting to the next address, if we have one.  If we are out of
+ * addresses and attempts, report failure.  Must be called with the
+ * bufferevent locked; unlocks it. */
+static void
+bev_dns_try_next(struct bev_dns_connect *conn)
+{
+	struct bufferevent *bev = conn->bev;
+	struct sockaddr_storage ss;
+	int socklen;
+
+	conn->started = 1;
+	while ((socklen = bev_dns_next_addr(conn, &ss))) {
+		struct bev_dns_attempt *a = &conn->attempts[conn->n_attempts];
+		evutil_socket_t fd;
+		int e;
+
+		if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) < 0) {
+			conn->socket_error = evutil_socket_geterror(fd);
+			continue;
+		}
+		if (evutil_make_socket_nonblocking(fd) < 0) {
+			conn->socket_error = evutil_socket_geterror(fd);
+			EVUTIL_CLOSESOCKET(fd);
+			continue;
+		}
+		if (connect(fd, (struct sockaddr *)&ss, socklen) == 0) {
+			bev_dns_close_attempts(conn, NULL);
+			bev_dns_succeed(conn, fd);
+			return;
+		}
+		e = evutil_socket_geterror(fd);
+		if (!EVUTIL_ERR_CONNECT_RETRIABLE(e)) {
+			conn->socket_error = e;
+			EVUTIL_CLOSESOCKET(fd);
+			continue;
+		}
+
+		a->fd = fd;
+		a->conn = conn;
+		event_assign(&a->ev, bev->ev_base, fd, EV_WRITE|EV_PERSIST,
+		    bev_dns_attempt_cb, a);
+		event_add(&a->ev, NULL);
+		++conn->n_attempts;
+		++conn->n_running;
+		bev_dns_arm_timer(conn, BEV_DNS_ATTEMPT_DELAY_MSEC);
+		BEV_UNLOCK(bev);
+		return;
+	}
+
+	if (conn->n_running || conn->lookups_pending) {
+		/* Wait for an attempt to finish or more answers to arrive. */
+		BEV_UNLOCK(bev);
+		return;
+	}
+	bev_dns_fail(conn);
+}
+
+static void
+bev_dns_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bev_dns_connect *conn = arg;
+	BEV_LOCK(conn->bev);
+	bev_dns_try_next(conn);
+}
+
+static void
+bev_dns_lookup_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct bev_dns_connect *conn = arg;
+	struct bufferevent *bev;
+	int i;
+
+	--conn->lookups_pending;
+	if (conn->finished) {
+		if (!conn->lookups_pending)
+			bev_dns_connect_free(conn);
+		return;
+	}
+	bev = conn->bev;
+	BEV_LOCK(bev);
+
+	if (result != DNS_ERR_NONE) {
+		if (!conn->dns_error)
+			conn->dns_error = result;
+	} else if (type == DNS_IPv4_A) {
+		const struct in_addr *in = addresses;
+		for (i = 0; i < count && conn->n_ipv4 < BEV_DNS_MAX_ADDRS; ++i)
+			conn->ipv4[conn->n_ipv4++] = in[i];
+#ifdef _EVENT_HAVE_STRUCT_IN6_ADDR
+	} else if (type == DNS_IPv6_AAAA) {
+		const struct in6_addr *in6 = addresses;
+		for (i = 0; i < count && conn->n_ipv6 < BEV_DNS_MAX_ADDRS; ++i)
+			conn->ipv6[conn->n_ipv6++] = in6[i];
+#endif
+	}
+	if (type == DNS_IPv6_AAAA)
+		conn->ipv6_done = 1;
+
+	if (conn->n_running && evtimer_pending(&conn->timer, NULL)) {
+		/* The new addresses join the queue behind the running
+		 * attempt; the attempt timer will get to them. */
+		BEV_UNLOCK(bev);
+	} else if (!conn->ipv6_done && !conn->started) {
+		/* We have IPv4 answers but no IPv6 answer yet: give the AAAA
+		 * lookup a moment before we commit to IPv4. */
+		bev_dns_arm_timer(conn, BEV_DNS_RESOLUTION_DELAY_MSEC);
+		BEV_UNLOCK(bev);
+	} else {
+		event_del(&conn->timer);
+		bev_dns_try_next(conn);
+	}
+}
+
+/* Try to parse 'hostname' as a numeric address, and connect to it
+ * directly if we can.  Returns 1 if we handled it, 0 if it needs a lookup,
+ * and -1 on error. */
+static int
+bev_dns_connect_numeric(struct bufferevent *bev, int family,
+    const char *hostname, int port)
+{
+	struct sockaddr_in sin;
+#ifdef _EVENT_HAVE_STRUCT_SOCKADDR_IN6
+	struct sockaddr_in6 sin6;
+#endif
+
+	if (family != AF_INET6) {
+		memset(&sin, 0, sizeof(sin));
+		if (evutil_inet_pton(AF_INET, hostname, &sin.sin_addr) == 1) {
+			sin.sin_family = AF_INET;
+			sin.sin_port = htons(port);
+			if (bufferevent_socket_connect(bev,
+				(struct sockaddr *)&sin, sizeof(sin)) < 0)
+				return -1;
+			return 1;
+		}
+	}
+#ifdef _EVENT_HAVE_STRUCT_SOCKADDR_IN6
+	if (family != AF_INET) {
+		memset(&sin6, 0, sizeof(sin6));
+		if (evutil_inet_pton(AF_INET6, hostname, &sin6.sin6_addr) == 1) {
+			sin6.sin6_family = AF_INET6;
+			sin6.sin6_port = htons(port);
+			if (bufferevent_socket_connect(bev,
+				(struct sockaddr *)&sin6, sizeof(sin6)) < 0)
+				return -1;
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+int
+bufferevent_socket_connect_hostname(struct bufferevent *bev,
+    struct evdns_base *evdns_base, int family, const char *hostname, int port)
+{
+	struct bev_dns_connect *conn;
+	struct evdns_request *r4 = NULL, *r6 = NULL;
+	int r;
+
+	if (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC)
+		return -1;
+	if (port < 1 || port > 65535)
+		return -1;
+
+	BEV_LOCK(bev);
+	BEV_UPCAST(bev)->dns_error = 0;
+	if (bufferevent_getfd(bev) >= 0) {
+		/* We make our own sockets; refuse to clobber one. */
+		BEV_UNLOCK(bev);
+		return -1;
+	}
+
+	if ((r = bev_dns_connect_numeric(bev, family, hostname, port))) {
+		BEV_UNLOCK(bev);
+		return r < 0 ? -1 : 0;
+	}
+
+	if (!(conn = mm_calloc(1, sizeof(struct bev_dns_connect)))) {
+		BEV_UNLOCK(bev);
+		return -1;
+	}
+	conn->bev = bev;
+	conn->port = (ev_uint16_t)port;
+	conn->ipv6_done = 1;
+	evtimer_assign(&conn->timer, bev->ev_base, bev_dns_timer_cb, conn);
+
+	/* Keep the bufferevent alive until we have connected or failed. */
+	bufferevent_incref(bev);
+
+	/* evdns may answer from its cache before we return, so count both
+	 * lookups as pending before launching either. */
+	conn->lookups_pending = (family == AF_UNSPEC) ? 2 : 1;
+	if (family != AF_INET) {
+		conn->ipv6_done = 0;
+		r6 = evdns_base_resolve_ipv6(evdns_base, hostname, 0,
+		    bev_dns_lookup_cb, conn);
+		if (!r6) {
+			--conn->lookups_pending;
+			conn->ipv6_done = 1;
+		}
+	}
+	if (family != AF_INET6) {
+		r4 = evdns_base_resolve_ipv4(evdns_base, hostname, 0,
+		    bev_dns_lookup_cb, conn);
+		if (!r4)
+			--conn->lookups_pending;
+	}
+
+	if (!r4 && !r6) {
+		/* Nothing was launched, so no callback will ever arrive. */
+		conn->bev = NULL;
+		mm_free(conn);
+		_bufferevent_decref_and_unlock(bev);
+		return -1;
+	}
+
+	BEV_UNLOCK(bev);
+	return 0;
+}
+
+int
+bufferevent_socket_get_dns_error(struct bufferevent *bev)
+{
+	int err;
+
+	BEV_LOCK(bev);
+	err = BEV_UPCAST(bev)->dns_error;
+	BEV_UNLOCK(bev);
+
+	return err;
+}
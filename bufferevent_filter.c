@@ -91,6 +91,10 @@ struct bufferevent_filtered {
 	bufferevent_filter_cb process_in;
         /** Output filter */
 	bufferevent_filter_cb process_out;
+        /** Input filter that inspects data in place, or NULL. */
+	bufferevent_inspect_filter_cb inspect_in;
+        /** Output filter that inspects data in place, or NULL. */
+	bufferevent_inspect_filter_cb inspect_out;
 
         /** User-supplied argument to the filters. */
 	void *context;
@@ -161,13 +165,62 @@ be_null_filter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t lim,
 		return BEV_ERROR;
 }
 
-struct bufferevent *
-bufferevent_filter_new(struct bufferevent *underlying,
-		       bufferevent_filter_cb input_filter,
-		       bufferevent_filter_cb output_filter,
-		       enum bufferevent_options options,
-		       void (*free_context)(void *),
-		       void *ctx)
+/* How many extents of its source buffer we show an inspecting filter at
+ * once. */
+#define BEV_INSPECT_N_VEC 16
+
+/* Run one round of filtering from src into dst, with whichever kind of
+ * filter we were given. */
+static enum bufferevent_filter_result
+be_filter_call(struct bufferevent_filtered *bevf,
+    bufferevent_filter_cb process, bufferevent_inspect_filter_cb inspect,
+    struct evbuffer *src, struct evbuffer *dst, ev_ssize_t limit,
+    enum bufferevent_flush_mode state)
+{
+	struct evbuffer_iovec vec[BEV_INSPECT_N_VEC];
+	enum bufferevent_filter_result res;
+	size_t n_pass = 0, total = 0;
+	int i, n_vec;
+
+	if (!inspect)
+		return process(src, dst, limit, state, bevf->context);
+
+	n_vec = evbuffer_peek(src, limit, NULL, vec, BEV_INSPECT_N_VEC);
+	if (n_vec > BEV_INSPECT_N_VEC)
+		n_vec = BEV_INSPECT_N_VEC;
+	/* Don't show the filter more than the limit lets it pass. */
+	for (i = 0; i < n_vec; ++i) {
+		if (limit >= 0 && total + vec[i].iov_len > (size_t)limit) {
+			vec[i].iov_len = (size_t)limit - total;
+			n_vec = i + 1;
+		}
+		total += vec[i].iov_len;
+	}
+
+	res = inspect(vec, n_vec, &n_pass, state, bevf->context);
+	if (res == BEV_ERROR)
+		return res;
+	if (n_pass > total)
+		return BEV_ERROR;
+	if (n_pass) {
+		if (evbuffer_remove_buffer(src, dst, n_pass) != (int)n_pass)
+			return BEV_ERROR;
+	} else if (res == BEV_OK) {
+		/* Nothing passed: don't let our callers spin. */
+		res = BEV_NEED_MORE;
+	}
+	return res;
+}
+
+static struct bufferevent *
+bufferevent_filter_new_impl(struct bufferevent *underlying,
+			    bufferevent_filter_cb input_filter,
+			    bufferevent_filter_cb output_filter,
+			    bufferevent_inspect_filter_cb inspect_in,
+			    bufferevent_inspect_filter_cb inspect_out,
+			    enum bufferevent_options options,
+			    void (*free_context)(void *),
+			    void *ctx)
 {
 	struct bufferevent_filtered *bufev_f;
 	enum bufferevent_options tmp_options = options & ~BEV_OPT_THREADSAFE;
@@ -198,6 +251,8 @@ bufferevent_filter_new(struct bufferevent *underlying,
 	bufev_f->underlying = underlying;
 	bufev_f->process_in = input_filter;
 	bufev_f->process_out = output_filter;
+	bufev_f->inspect_in = inspect_in;
+	bufev_f->inspect_out = inspect_out;
 	bufev_f->free_context = free_context;
 	bufev_f->context = ctx;
 
@@ -212,6 +267,32 @@ bufferevent_filter_new(struct bufferevent *underlying,
 	return downcast(bufev_f);
 }
 
+struct bufferevent *
+bufferevent_filter_new(struct bufferevent *underlying,
+		       bufferevent_filter_cb input_filter,
+		       bufferevent_filter_cb output_filter,
+		       enum bufferevent_options options,
+		       void (*free_context)(void *),
+		       void *ctx)
+{
+	return bufferevent_filter_new_impl(underlying,
+	    input_filter, output_filter, NULL, NULL,
+	    options, free_context, ctx);
+}
+
+struct bufferevent *
+bufferevent_filter_new_inspect(struct bufferevent *underlying,
+			       bufferevent_inspect_filter_cb input_filter,
+			       bufferevent_inspect_filter_cb output_filter,
+			       enum bufferevent_options options,
+			       void (*free_context)(void *),
+			       void *ctx)
+{
+	return bufferevent_filter_new_impl(underlying,
+	    NULL, NULL, input_filter, output_filter,
+	    options, free_context, ctx);
+}
+
 static void
 be_filter_destruct(struct bufferevent *bev)
 {
@@ -264,8 +345,8 @@ be_filter_process_input(struct bufferevent_filtered *bevf,
                         limit = bev->wm_read.high -
                             evbuffer_get_length(bev->input);
 
-		res = bevf->process_in(bevf->underlying->input,
-                    bev->input, limit, state, bevf->context);
+		res = be_filter_call(bevf, bevf->process_in, bevf->inspect_in,
+                    bevf->underlying->input, bev->input, limit, state);
 
 		if (res == BEV_OK)
 			*processed_out = 1;
@@ -317,11 +398,12 @@ be_filter_process_output(struct bufferevent_filtered *bevf,
                                 limit = bevf->underlying->wm_write.high -
                                     evbuffer_get_length(bevf->underlying->output);
 
-                        res = bevf->process_out(downcast(bevf)->output,
+                        res = be_filter_call(bevf,
+                            bevf->process_out, bevf->inspect_out,
+                            downcast(bevf)->output,
                             bevf->underlying->output,
                             limit,
-                            state,
-                            bevf->context);
+                            state);
 
                         if (res == BEV_OK)
                                 processed = *processed_out = 1;
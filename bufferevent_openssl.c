@@ -0,0 +1,1337 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef _EVENT_HAVE_STDARG_H
+#include <stdarg.h>
+#endif
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+#include "event2/util.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_struct.h"
+#include "event2/bufferevent_ssl.h"
+#include "event2/buffer.h"
+#include "event2/event.h"
+
+#include "mm-internal.h"
+#include "bufferevent-internal.h"
+#include "log-internal.h"
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/*
+ * Define an OpenSSL bio that targets a bufferevent.
+ */
+
+/* As we write to the BIO, data goes straight onto the end of the underlying
+ * bufferevent's output buffer; as we read from it, it comes straight off the
+ * front of that bufferevent's input buffer.  OpenSSL never sees an
+ * intermediate buffer of ours.  It would be a little simpler to use a BIO
+ * pair and copy in and out of it, but that would cost us a copy of every
+ * byte and another 34k or so of buffers per connection.
+ *
+ * The BIO's data pointer is the underlying bufferevent.  We never free it
+ * from here: the TLS bufferevent takes care of that when it is freed.
+ */
+
+/* Called to initialize a new BIO */
+static int
+bio_bufferevent_new(BIO *b)
+{
+	BIO_set_init(b, 0);
+	BIO_set_data(b, NULL);
+	return 1;
+}
+
+/* Called to uninitialize the BIO. */
+static int
+bio_bufferevent_free(BIO *b)
+{
+	if (!b)
+		return 0;
+	BIO_set_init(b, 0);
+	BIO_set_data(b, NULL);
+	return 1;
+}
+
+/* Called to extract data from the BIO. */
+static int
+bio_bufferevent_read(BIO *b, char *out, int outlen)
+{
+	int r = 0;
+	struct evbuffer *input;
+
+	BIO_clear_retry_flags(b);
+
+	if (!out)
+		return 0;
+	if (!BIO_get_data(b))
+		return -1;
+
+	input = bufferevent_get_input(BIO_get_data(b));
+	if (evbuffer_get_length(input) == 0) {
+		/* If there's no data to read, say so. */
+		BIO_set_retry_read(b);
+		return -1;
+	} else {
+		r = evbuffer_remove(input, out, outlen);
+	}
+
+	return r;
+}
+
+/* Called to write data into the BIO */
+static int
+bio_bufferevent_write(BIO *b, const char *in, int inlen)
+{
+	struct bufferevent *bufev = BIO_get_data(b);
+	struct evbuffer *output;
+	size_t outlen;
+
+	BIO_clear_retry_flags(b);
+
+	if (!bufev)
+		return -1;
+
+	output = bufferevent_get_output(bufev);
+	outlen = evbuffer_get_length(output);
+
+	/* Copy only as much data onto the output buffer as can fit under the
+	 * high-water mark. */
+	if (bufev->wm_write.high && bufev->wm_write.high <= (outlen+inlen)) {
+		if (bufev->wm_write.high <= outlen) {
+			/* If no data can fit, we'll need to retry later. */
+			BIO_set_retry_write(b);
+			return -1;
+		}
+		inlen = bufev->wm_write.high - outlen;
+	}
+
+	assert(inlen > 0);
+	evbuffer_add(output, in, inlen);
+	return inlen;
+}
+
+/* Called to handle various requests */
+static long
+bio_bufferevent_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	struct bufferevent *bufev = BIO_get_data(b);
+	long ret = 1;
+
+	switch (cmd) {
+	case BIO_CTRL_GET_CLOSE:
+		ret = BIO_get_shutdown(b);
+		break;
+	case BIO_CTRL_SET_CLOSE:
+		BIO_set_shutdown(b, (int)num);
+		break;
+	case BIO_CTRL_PENDING:
+		ret = evbuffer_get_length(bufferevent_get_input(bufev)) != 0;
+		break;
+	case BIO_CTRL_WPENDING:
+		ret = evbuffer_get_length(bufferevent_get_output(bufev)) != 0;
+		break;
+	/* XXXX These two are given a special-case treatment because
+	 * of cargo-cultism.  I should come up with a better reason. */
+	case BIO_CTRL_DUP:
+	case BIO_CTRL_FLUSH:
+		ret = 1;
+		break;
+	default:
+		ret = 0;
+		break;
+	}
+	return ret;
+}
+
+/* Called to write a string to the BIO */
+static int
+bio_bufferevent_puts(BIO *b, const char *s)
+{
+	return bio_bufferevent_write(b, s, strlen(s));
+}
+
+/* Method table for the bufferevent BIO */
+static BIO_METHOD *methods_bufferevent = NULL;
+
+/* Return the method table for the bufferevents BIO */
+static BIO_METHOD *
+BIO_s_bufferevent(void)
+{
+	if (methods_bufferevent == NULL) {
+		methods_bufferevent = BIO_meth_new(
+		    BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+		    "bufferevent");
+		if (methods_bufferevent == NULL)
+			return NULL;
+		BIO_meth_set_write(methods_bufferevent, bio_bufferevent_write);
+		BIO_meth_set_read(methods_bufferevent, bio_bufferevent_read);
+		BIO_meth_set_puts(methods_bufferevent, bio_bufferevent_puts);
+		BIO_meth_set_ctrl(methods_bufferevent, bio_bufferevent_ctrl);
+		BIO_meth_set_create(methods_bufferevent, bio_bufferevent_new);
+		BIO_meth_set_destroy(methods_bufferevent,
+		    bio_bufferevent_free);
+	}
+	return methods_bufferevent;
+}
+
+/* Create a new BIO to wrap communication around a bufferevent.  If
+ * close_flag is true, freeing the BIO is allowed to free the bufferevent;
+ * we never ask for that. */
+static BIO *
+BIO_new_bufferevent(struct bufferevent *bufferevent, int close_flag)
+{
+	BIO *result;
+	BIO_METHOD *methods;
+	if (!bufferevent)
+		return NULL;
+	if (!(methods = BIO_s_bufferevent()))
+		return NULL;
+	if (!(result = BIO_new(methods)))
+		return NULL;
+	BIO_set_init(result, 1);
+	BIO_set_data(result, bufferevent);
+	BIO_set_shutdown(result, close_flag ? 1 : 0);
+	return result;
+}
+
+/* --------------------
+   Now, here's the openssl-based implementation of bufferevent.
+
+   The implementation comes in two flavors: one that connects its SSL object
+   to an underlying bufferevent using a BIO_bufferevent, and one that has the
+   SSL object connect to a socket directly.  The latter should generally be
+   faster, except on Windows, where your best bet is using a
+   bufferevent_async.
+
+   Either way, we read decrypted data straight into free space at the end
+   of the input buffer with evbuffer_reserve_space(), and hand the chains of
+   the output buffer to SSL_write() where they are, with evbuffer_peek().
+
+   XXXX Lots of what's here is duplicated from bufferevent_sock.c; we should
+   factor it out.
+   -------------------- */
+
+struct bufferevent_openssl {
+	/* Shared fields with common bufferevet implementation code.
+	   If we were set up with an underlying bufferevent, we use the
+	   events here as timers only.  If we have an SSL, then we use
+	   the events as socket events.
+	 */
+	struct bufferevent_private bev;
+	/* An underlying bufferevent that we're directing our output to.
+	   If it's NULL, then we're connected to an fd, not an evbuffer. */
+	struct bufferevent *underlying;
+	/* The SSL object doing our encryption. */
+	SSL *ssl;
+
+	/* A callback that's invoked when data arrives on our outbuf so we
+	   know to write data to the SSL. */
+	struct evbuffer_cb_entry *outbuf_cb;
+
+	/* Used to catch up on reading and writing that we can't start from
+	   the place where we notice it needs doing. */
+	struct deferred_cb deferred_consider;
+
+	/* When we next get available space, we should say "we have space"
+	 * and write last_write bytes: OpenSSL insists that a retried
+	 * SSL_write() be given the same arguments as the one that failed. */
+	int last_write;
+
+	/* OpenSSL error codes that we have not yet reported. */
+#define NUM_ERRORS 3
+	unsigned long errors[NUM_ERRORS];
+
+	/* When we next get data, we should try to write.  (We set this when
+	 * SSL_read() asks to write, and it stays set until we manage to.) */
+	unsigned read_blocked_on_write : 1;
+	/* When we next get space, we should try to read. */
+	unsigned write_blocked_on_read : 1;
+	/* One of the BUFFEREVENT_SSL_* states. */
+	unsigned state : 2;
+	/* How many of errors[] are in use. */
+	unsigned n_errors : 2;
+};
+
+static int be_openssl_enable(struct bufferevent *, short);
+static int be_openssl_disable(struct bufferevent *, short);
+static void be_openssl_destruct(struct bufferevent *);
+static void be_openssl_adj_timeouts(struct bufferevent *);
+static int be_openssl_flush(struct bufferevent *bufev,
+    short iotype, enum bufferevent_flush_mode mode);
+static int be_openssl_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
+
+const struct bufferevent_ops bufferevent_ops_openssl = {
+	"ssl",
+	evutil_offsetof(struct bufferevent_openssl, bev),
+	be_openssl_enable,
+	be_openssl_disable,
+	be_openssl_destruct,
+	be_openssl_adj_timeouts,
+	be_openssl_flush,
+	be_openssl_ctrl,
+};
+
+/* Given a bufferevent, return a pointer to the bufferevent_openssl that
+ * contains it, if any. */
+static inline struct bufferevent_openssl *
+upcast(struct bufferevent *bev)
+{
+	struct bufferevent_openssl *bev_o;
+	if (bev->be_ops != &bufferevent_ops_openssl)
+		return NULL;
+	bev_o = (void*)( ((char*)bev) -
+			 evutil_offsetof(struct bufferevent_openssl, bev.bev));
+	assert(bev_o->bev.bev.be_ops == &bufferevent_ops_openssl);
+	return bev_o;
+}
+
+static inline void
+put_error(struct bufferevent_openssl *bev_ssl, unsigned long err)
+{
+	if (bev_ssl->n_errors == NUM_ERRORS)
+		return;
+	/* The error type according to openssl is "unsigned long", but
+	   openssl never uses more than 32 bits of it.  It _can't_ use more
+	   than 32 bits of it, since it needs to report errors on systems
+	   where long is only 32 bits.
+	 */
+	bev_ssl->errors[bev_ssl->n_errors++] = err;
+}
+
+/* Have the base communications channel (either the underlying bufferevent or
+ * ev_read and ev_write) start reading.  Take the read-blocked-on-write flag
+ * into account. */
+static int
+start_reading(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->underlying) {
+		if (bev_ssl->underlying->enabled & EV_READ)
+			return 0;
+		return bufferevent_enable(bev_ssl->underlying, EV_READ);
+	} else {
+		struct bufferevent *bev = &bev_ssl->bev.bev;
+		if (event_pending(&bev->ev_read, EV_READ, NULL))
+			return 0;
+		if (evutil_timerisset(&bev->timeout_read))
+			return event_add(&bev->ev_read, &bev->timeout_read);
+		return event_add(&bev->ev_read, NULL);
+	}
+}
+
+/* Have the base communications channel (either the underlying bufferevent or
+ * ev_read and ev_write) start writing.  Take the write-blocked-on-read flag
+ * into account. */
+static int
+start_writing(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->underlying) {
+		/* The underlying bufferevent tells us when it has drained;
+		 * there's nothing to start. */
+		return 0;
+	} else {
+		struct bufferevent *bev = &bev_ssl->bev.bev;
+		if (event_pending(&bev->ev_write, EV_WRITE, NULL))
+			return 0;
+		if (evutil_timerisset(&bev->timeout_write))
+			return event_add(&bev->ev_write, &bev->timeout_write);
+		return event_add(&bev->ev_write, NULL);
+	}
+}
+
+static void
+stop_reading(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->write_blocked_on_read)
+		return;
+	if (bev_ssl->underlying) {
+		if (bev_ssl->underlying->enabled & EV_READ)
+			bufferevent_disable(bev_ssl->underlying, EV_READ);
+	} else {
+		event_del(&bev_ssl->bev.bev.ev_read);
+	}
+}
+
+static void
+stop_writing(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->read_blocked_on_write)
+		return;
+	if (!bev_ssl->underlying)
+		event_del(&bev_ssl->bev.bev.ev_write);
+}
+
+static int
+set_rbow(struct bufferevent_openssl *bev_ssl)
+{
+	if (!bev_ssl->underlying)
+		stop_reading(bev_ssl);
+	bev_ssl->read_blocked_on_write = 1;
+	return start_writing(bev_ssl);
+}
+
+static int
+set_wbor(struct bufferevent_openssl *bev_ssl)
+{
+	if (!bev_ssl->underlying)
+		stop_writing(bev_ssl);
+	bev_ssl->write_blocked_on_read = 1;
+	return start_reading(bev_ssl);
+}
+
+static int
+clear_rbow(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	int r = 0;
+	bev_ssl->read_blocked_on_write = 0;
+	if (!(bev->enabled & EV_WRITE) ||
+	    evbuffer_get_length(bev->output) == 0)
+		stop_writing(bev_ssl);
+	if ((bev->enabled & EV_READ) && !bev_ssl->bev.read_suspended)
+		r = start_reading(bev_ssl);
+	return r;
+}
+
+static int
+clear_wbor(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	int r = 0;
+	bev_ssl->write_blocked_on_read = 0;
+	if (!(bev->enabled & EV_READ) || bev_ssl->bev.read_suspended)
+		stop_reading(bev_ssl);
+	if ((bev->enabled & EV_WRITE) && !bev_ssl->bev.write_suspended &&
+	    evbuffer_get_length(bev->output))
+		r = start_writing(bev_ssl);
+	return r;
+}
+
+/* The connection went away, cleanly or otherwise: say so, and stop
+ * listening to the channel under it. */
+static void
+conn_closed(struct bufferevent_openssl *bev_ssl, int errcode, int ret)
+{
+	int event = BEV_EVENT_ERROR;
+	int dirty_shutdown = 0;
+	unsigned long err;
+
+	switch (errcode) {
+	case SSL_ERROR_ZERO_RETURN:
+		/* Possibly a clean shutdown. */
+		if (SSL_get_shutdown(bev_ssl->ssl) & SSL_RECEIVED_SHUTDOWN)
+			event = BEV_EVENT_EOF;
+		else
+			dirty_shutdown = 1;
+		break;
+	case SSL_ERROR_SYSCALL:
+		/* IO error; possibly a dirty shutdown. */
+		if (ret == 0 && ERR_peek_error() == 0)
+			dirty_shutdown = 1;
+		break;
+	case SSL_ERROR_SSL:
+		/* Protocol error; but newer OpenSSLs report a peer that
+		 * just closed the connection this way too. */
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+		if (ERR_GET_REASON(ERR_peek_error()) ==
+		    SSL_R_UNEXPECTED_EOF_WHILE_READING)
+			dirty_shutdown = 1;
+#endif
+		break;
+	case SSL_ERROR_WANT_X509_LOOKUP:
+		/* XXXX handle this. */
+		break;
+	case SSL_ERROR_NONE:
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	case SSL_ERROR_WANT_CONNECT:
+	case SSL_ERROR_WANT_ACCEPT:
+	default:
+		/* should be impossible; treat as normal error. */
+		event_warnx("BUG: Unexpected OpenSSL error code %d", errcode);
+		break;
+	}
+
+	while ((err = ERR_get_error())) {
+		put_error(bev_ssl, err);
+	}
+
+	/* The peer went away without saying goodbye.  That's what most
+	 * peers do; call it an EOF. */
+	if (dirty_shutdown)
+		event = BEV_EVENT_EOF;
+
+	bev_ssl->read_blocked_on_write = 0;
+	bev_ssl->write_blocked_on_read = 0;
+	stop_reading(bev_ssl);
+	stop_writing(bev_ssl);
+
+	_bufferevent_run_eventcb(&bev_ssl->bev.bev, event);
+}
+
+#define READ_DEFAULT 16384
+
+/* Try to read up to n_to_read bytes from the SSL into the input buffer.
+ * Returns 1 if it might be worth trying again, 0 if we blocked, -1 if the
+ * connection is done. */
+static int
+do_read(struct bufferevent_openssl *bev_ssl, int n_to_read)
+{
+	/* Requires lock */
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	struct evbuffer *input = bev->input;
+	int r = 0, n, i, n_used = 0, nread = 0, blocked = 0, err = 0;
+	ev_ssize_t atmost;
+	struct evbuffer_iovec space[2];
+
+	atmost = _bufferevent_get_read_max(&bev_ssl->bev);
+	if (n_to_read > atmost)
+		n_to_read = (int)atmost;
+	if (n_to_read <= 0)
+		return 0;
+
+	evbuffer_unfreeze(input, 0);
+	n = evbuffer_reserve_space(input, n_to_read, space, 2);
+	if (n < 0) {
+		evbuffer_freeze(input, 0);
+		return -1;
+	}
+
+	for (i=0; i<n; ++i) {
+		if (bev_ssl->bev.read_suspended)
+			break;
+		r = SSL_read(bev_ssl->ssl, space[i].iov_base,
+		    (int)space[i].iov_len);
+		if (r>0) {
+			if (bev_ssl->read_blocked_on_write)
+				clear_rbow(bev_ssl);
+			++n_used;
+			nread += r;
+			space[i].iov_len = r;
+		} else {
+			err = SSL_get_error(bev_ssl->ssl, r);
+			switch (err) {
+			case SSL_ERROR_WANT_READ:
+				/* Can't read until underlying has more data. */
+				if (bev_ssl->read_blocked_on_write)
+					clear_rbow(bev_ssl);
+				blocked = 1;
+				break;
+			case SSL_ERROR_WANT_WRITE:
+				/* This read operation requires a write, and the
+				 * underlying is full */
+				if (!bev_ssl->read_blocked_on_write)
+					set_rbow(bev_ssl);
+				blocked = 1;
+				break;
+			default:
+				blocked = -1;
+				break;
+			}
+			break;
+		}
+	}
+
+	if (n_used)
+		evbuffer_commit_space(input, space, n_used);
+	evbuffer_freeze(input, 0);
+
+	if (n_used) {
+		_bufferevent_decrement_read_buckets(&bev_ssl->bev, nread);
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		if (evbuffer_get_length(input) >= bev->wm_read.low &&
+		    bev->readcb)
+			_bufferevent_run_readcb(bev);
+	}
+	if (blocked < 0) {
+		/* Hand over what we got before telling about the close. */
+		conn_closed(bev_ssl, err, r);
+		return -1;
+	}
+
+	return !blocked;
+}
+
+#define WRITE_FRAME 15000
+
+/* Try to hand up to atmost bytes of the output buffer to the SSL, a chain
+ * at a time and without copying it.  Returns as do_read(). */
+static int
+do_write(struct bufferevent_openssl *bev_ssl, int atmost)
+{
+	int i, r = 0, n, n_written = 0, blocked = 0, err = 0;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	struct evbuffer *output = bev->output;
+	struct evbuffer_iovec space[8];
+	ev_ssize_t writemax;
+
+	if (bev_ssl->last_write > 0)
+		atmost = bev_ssl->last_write;
+	else {
+		writemax = _bufferevent_get_write_max(&bev_ssl->bev);
+		if (atmost > writemax)
+			atmost = (int)writemax;
+	}
+	if (atmost <= 0)
+		return 0;
+
+	n = evbuffer_peek(output, atmost, NULL, space, 8);
+	if (n < 0)
+		return -1;
+
+	if (n > 8)
+		n = 8;
+	for (i=0; i < n; ++i) {
+		if (bev_ssl->bev.write_suspended)
+			break;
+
+		/* SSL_write will (reasonably) return 0 if we tell it to
+		   send 0 data.  Skip this case so we don't interpret the
+		   result as an error */
+		if (space[i].iov_len == 0)
+			continue;
+
+		r = SSL_write(bev_ssl->ssl, space[i].iov_base,
+		    (int)space[i].iov_len);
+		if (r > 0) {
+			if (bev_ssl->write_blocked_on_read)
+				clear_wbor(bev_ssl);
+			n_written += r;
+			bev_ssl->last_write = -1;
+		} else {
+			err = SSL_get_error(bev_ssl->ssl, r);
+			switch (err) {
+			case SSL_ERROR_WANT_WRITE:
+				/* Can't write until underlying has more space. */
+				if (bev_ssl->write_blocked_on_read)
+					clear_wbor(bev_ssl);
+				bev_ssl->last_write = (int)space[i].iov_len;
+				blocked = 1;
+				break;
+			case SSL_ERROR_WANT_READ:
+				/* This write operation requires a read, and the
+				 * underlying is empty */
+				if (!bev_ssl->write_blocked_on_read)
+					set_wbor(bev_ssl);
+				bev_ssl->last_write = (int)space[i].iov_len;
+				blocked = 1;
+				break;
+			default:
+				bev_ssl->last_write = -1;
+				blocked = -1;
+				break;
+			}
+			break;
+		}
+	}
+	if (n_written) {
+		evbuffer_unfreeze(output, 1);
+		evbuffer_drain(output, n_written);
+		evbuffer_freeze(output, 1);
+		_bufferevent_decrement_write_buckets(&bev_ssl->bev, n_written);
+		BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
+		if (evbuffer_get_length(output) <= bev->wm_write.low &&
+		    bev->writecb)
+			_bufferevent_run_writecb(bev);
+	}
+	if (blocked < 0) {
+		conn_closed(bev_ssl, err, r);
+		return -1;
+	}
+	return !blocked;
+}
+
+/* Return how many bytes we may read into our input buffer before we
+ * reach its high watermark, or READ_DEFAULT if that's less. */
+static int
+bytes_to_read(struct bufferevent_openssl *bev)
+{
+	struct evbuffer *input = bev->bev.bev.input;
+	struct event_watermark *wm = &bev->bev.bev.wm_read;
+	int result = READ_DEFAULT;
+
+	if (wm->high) {
+		size_t len = evbuffer_get_length(input);
+		if (len >= wm->high)
+			return 0;
+		if (wm->high - len < (size_t)result)
+			result = (int)(wm->high - len);
+	}
+	return result;
+}
+
+/* Things look readable.  Read from the SSL until we block or we hit our
+ * high-water mark.
+ */
+static void
+consider_reading(struct bufferevent_openssl *bev_ssl)
+{
+	int r, n_to_read;
+
+	while ((bev_ssl->bev.bev.enabled & EV_READ) &&
+	    !bev_ssl->bev.read_suspended) {
+		n_to_read = bytes_to_read(bev_ssl);
+		if (n_to_read == 0) {
+			bufferevent_wm_suspend_read(&bev_ssl->bev.bev);
+			break;
+		}
+		r = do_read(bev_ssl, n_to_read);
+		if (r <= 0)
+			break;
+	}
+
+	if (!bev_ssl->underlying) {
+		/* Should be redundant, but let's avoid busy-looping */
+		if (bev_ssl->bev.read_suspended ||
+		    !(bev_ssl->bev.bev.enabled & EV_READ))
+			stop_reading(bev_ssl);
+	}
+}
+
+/* Return 1 iff the output buffer of the bufferevent under bev_ssl is at or
+ * over its high watermark, so that there's no point in encrypting more. */
+static int
+underlying_writebuf_full(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *u = bev_ssl->underlying;
+	return u && u->wm_write.high &&
+	    evbuffer_get_length(u->output) >= u->wm_write.high;
+}
+
+static void
+consider_writing(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+	int r;
+
+	while ((bev->enabled & EV_WRITE) &&
+	    !bev_ssl->bev.write_suspended &&
+	    evbuffer_get_length(bev->output) &&
+	    !underlying_writebuf_full(bev_ssl)) {
+		r = do_write(bev_ssl, WRITE_FRAME);
+		if (r <= 0)
+			break;
+	}
+
+	if (!bev_ssl->underlying) {
+		if (evbuffer_get_length(bev->output) == 0 ||
+		    !(bev->enabled & EV_WRITE) ||
+		    bev_ssl->bev.write_suspended)
+			stop_writing(bev_ssl);
+		else if (!bev_ssl->write_blocked_on_read)
+			start_writing(bev_ssl);
+	}
+}
+
+/* Called once the handshake is done: tell the user, then start doing what
+ * they asked for in the meantime. */
+static void
+handshake_done(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	bev_ssl->state = BUFFEREVENT_SSL_OPEN;
+	if (bev_ssl->read_blocked_on_write) {
+		bev_ssl->read_blocked_on_write = 0;
+		stop_writing(bev_ssl);
+	}
+	if (!(bev->enabled & EV_READ) || bev_ssl->bev.read_suspended)
+		stop_reading(bev_ssl);
+	_bufferevent_run_eventcb(bev, BEV_EVENT_CONNECTED);
+	/* Data may have been written while we were busy, and the handshake
+	 * may have left application data in the SSL. */
+	consider_writing(bev_ssl);
+	consider_reading(bev_ssl);
+}
+
+static int
+do_handshake(struct bufferevent_openssl *bev_ssl)
+{
+	int r;
+
+	switch (bev_ssl->state) {
+	default:
+	case BUFFEREVENT_SSL_OPEN:
+		assert(0);
+		return -1;
+	case BUFFEREVENT_SSL_CONNECTING:
+	case BUFFEREVENT_SSL_ACCEPTING:
+		r = SSL_do_handshake(bev_ssl->ssl);
+		break;
+	}
+
+	if (r==1) {
+		handshake_done(bev_ssl);
+		return 1;
+	} else {
+		int err = SSL_get_error(bev_ssl->ssl, r);
+		switch (err) {
+		case SSL_ERROR_WANT_WRITE:
+			/* The socket or the underlying output buffer is
+			 * full; come back when it has drained. */
+			if (!bev_ssl->read_blocked_on_write)
+				set_rbow(bev_ssl);
+			return 0;
+		case SSL_ERROR_WANT_READ:
+			if (bev_ssl->read_blocked_on_write) {
+				bev_ssl->read_blocked_on_write = 0;
+				stop_writing(bev_ssl);
+			}
+			start_reading(bev_ssl);
+			return 0;
+		default:
+			conn_closed(bev_ssl, err, r);
+			return -1;
+		}
+	}
+}
+
+/* Called from the base, the deferred callback, or the underlying
+ * bufferevent when there may be something to read: handshake, or read,
+ * and write if a write was waiting on this. */
+static void
+be_openssl_on_readable(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->state != BUFFEREVENT_SSL_OPEN) {
+		do_handshake(bev_ssl);
+		return;
+	}
+	if (bev_ssl->write_blocked_on_read)
+		consider_writing(bev_ssl);
+	consider_reading(bev_ssl);
+}
+
+/* As be_openssl_on_readable(), for when there may be room to write. */
+static void
+be_openssl_on_writable(struct bufferevent_openssl *bev_ssl)
+{
+	if (bev_ssl->state != BUFFEREVENT_SSL_OPEN) {
+		do_handshake(bev_ssl);
+		return;
+	}
+	if (bev_ssl->read_blocked_on_write)
+		consider_reading(bev_ssl);
+	consider_writing(bev_ssl);
+}
+
+/* Called when the underlying bufferevent has read. */
+static void
+be_openssl_readcb(struct bufferevent *bev_base, void *ctx)
+{
+	struct bufferevent_openssl *bev_ssl = ctx;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	BEV_LOCK(bev);
+	bufferevent_incref(bev);
+	be_openssl_on_readable(bev_ssl);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Called when the underlying bufferevent has drained. */
+static void
+be_openssl_writecb(struct bufferevent *bev_base, void *ctx)
+{
+	struct bufferevent_openssl *bev_ssl = ctx;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	BEV_LOCK(bev);
+	bufferevent_incref(bev);
+	be_openssl_on_writable(bev_ssl);
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Called when the underlying bufferevent has given us an event. */
+static void
+be_openssl_eventcb(struct bufferevent *bev_base, short what, void *ctx)
+{
+	struct bufferevent_openssl *bev_ssl = ctx;
+	int event = 0;
+
+	if (what & BEV_EVENT_EOF) {
+		/* A peer that closes without a TLS close_notify is a dirty
+		 * shutdown, but the data we got from it is still good. */
+		event = BEV_EVENT_EOF;
+	} else if (what & BEV_EVENT_ERROR) {
+		event = BEV_EVENT_ERROR;
+	} else if (what & BEV_EVENT_TIMEOUT) {
+		/* We sure didn't set this.  Propagate it to the user. */
+		event = what;
+	} else if (what & BEV_EVENT_CONNECTED) {
+		/* Ignore it.  We're saying SSL_connect() already, which will
+		   eat it. */
+	}
+	if (event)
+		_bufferevent_run_eventcb(&bev_ssl->bev.bev, event);
+}
+
+/* Called from the base when our socket is readable, or when reading timed
+ * out. */
+static void
+be_openssl_readeventcb(evutil_socket_t fd, short what, void *ptr)
+{
+	struct bufferevent_openssl *bev_ssl = ptr;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	BEV_LOCK(bev);
+	bufferevent_incref(bev);
+	if (what == EV_TIMEOUT) {
+		event_del(&bev->ev_read);
+		_bufferevent_run_eventcb(bev,
+		    BEV_EVENT_TIMEOUT|BEV_EVENT_READING);
+	} else {
+		be_openssl_on_readable(bev_ssl);
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Called from the base when our socket is writable, or when writing timed
+ * out. */
+static void
+be_openssl_writeeventcb(evutil_socket_t fd, short what, void *ptr)
+{
+	struct bufferevent_openssl *bev_ssl = ptr;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	BEV_LOCK(bev);
+	bufferevent_incref(bev);
+	if (what == EV_TIMEOUT) {
+		event_del(&bev->ev_write);
+		_bufferevent_run_eventcb(bev,
+		    BEV_EVENT_TIMEOUT|BEV_EVENT_WRITING);
+	} else {
+		be_openssl_on_writable(bev_ssl);
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+/* Catch up on whatever a data-bearing call asked for, once the current
+ * callbacks are done. */
+static void
+be_openssl_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	BEV_LOCK(bev);
+	if (bev_ssl->state == BUFFEREVENT_SSL_OPEN) {
+		consider_writing(bev_ssl);
+		consider_reading(bev_ssl);
+	}
+	_bufferevent_decref_and_unlock(bev);
+}
+
+static void
+be_openssl_consider_later(struct bufferevent_openssl *bev_ssl)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	if (!bev_ssl->deferred_consider.queued) {
+		bufferevent_incref(bev);
+		event_deferred_cb_schedule(bev->ev_base,
+		    &bev_ssl->deferred_consider);
+	}
+}
+
+static void
+be_openssl_outbuf_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *cbinfo, void *arg)
+{
+	struct bufferevent_openssl *bev_ssl = arg;
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	if (cbinfo->n_added && bev_ssl->state == BUFFEREVENT_SSL_OPEN &&
+	    (bev->enabled & EV_WRITE) && !bev_ssl->bev.write_suspended &&
+	    !bev_ssl->write_blocked_on_read) {
+		if (bev_ssl->underlying)
+			be_openssl_consider_later(bev_ssl);
+		else
+			start_writing(bev_ssl);
+	}
+}
+
+static int
+be_openssl_enable(struct bufferevent *bev, short events)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	int r1 = 0, r2 = 0;
+
+	if (bev_ssl->state != BUFFEREVENT_SSL_OPEN)
+		return 0;
+
+	if (events & EV_READ)
+		r1 = start_reading(bev_ssl);
+	if ((events & EV_WRITE) && evbuffer_get_length(bev->output))
+		r2 = start_writing(bev_ssl);
+
+	if (bev_ssl->underlying) {
+		_bufferevent_generic_adj_timeouts(bev);
+		if (((events & EV_READ) &&
+			(SSL_pending(bev_ssl->ssl) ||
+			 evbuffer_get_length(bev_ssl->underlying->input))) ||
+		    ((events & EV_WRITE) && evbuffer_get_length(bev->output)))
+			be_openssl_consider_later(bev_ssl);
+	} else if ((events & EV_READ) && SSL_pending(bev_ssl->ssl)) {
+		/* The socket won't tell us about data that OpenSSL has
+		 * already read. */
+		event_active(&bev->ev_read, EV_READ, 1);
+	}
+
+	return (r1 < 0 || r2 < 0) ? -1 : 0;
+}
+
+static int
+be_openssl_disable(struct bufferevent *bev, short events)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	if (bev_ssl->state != BUFFEREVENT_SSL_OPEN)
+		return 0;
+
+	if (events & EV_READ)
+		stop_reading(bev_ssl);
+	if (events & EV_WRITE)
+		stop_writing(bev_ssl);
+
+	if (bev_ssl->underlying)
+		_bufferevent_generic_adj_timeouts(bev);
+	return 0;
+}
+
+static void
+be_openssl_destruct(struct bufferevent *bev)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	evutil_socket_t fd = -1;
+
+	if (bev_ssl->underlying) {
+		_bufferevent_del_generic_timeout_cbs(bev);
+	} else {
+		fd = event_get_fd(&bev->ev_read);
+		event_del(&bev->ev_read);
+		event_del(&bev->ev_write);
+	}
+
+	if (bev_ssl->bev.options & BEV_OPT_CLOSE_ON_FREE) {
+		SSL_free(bev_ssl->ssl);
+		if (bev_ssl->underlying)
+			bufferevent_free(bev_ssl->underlying);
+		else if (fd >= 0)
+			EVUTIL_CLOSESOCKET(fd);
+	} else if (bev_ssl->underlying) {
+		/* The SSL and the underlying bufferevent outlive us; don't
+		 * leave them pointing at freed memory. */
+		bufferevent_setcb(bev_ssl->underlying, NULL, NULL, NULL, NULL);
+	}
+}
+
+static void
+be_openssl_adj_timeouts(struct bufferevent *bev)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+
+	if (bev_ssl->underlying) {
+		_bufferevent_generic_adj_timeouts(bev);
+	} else {
+		if (event_pending(&bev->ev_read, EV_READ, NULL)) {
+			event_del(&bev->ev_read);
+			start_reading(bev_ssl);
+		}
+		if (event_pending(&bev->ev_write, EV_WRITE, NULL)) {
+			event_del(&bev->ev_write);
+			start_writing(bev_ssl);
+		}
+	}
+}
+
+static int
+be_openssl_flush(struct bufferevent *bufev,
+    short iotype, enum bufferevent_flush_mode mode)
+{
+	/* We have no buffers of our own: everything is either in the
+	 * evbuffers or inside OpenSSL. */
+	return 0;
+}
+
+static void
+be_openssl_setfd(struct bufferevent_openssl *bev_ssl, evutil_socket_t fd)
+{
+	struct bufferevent *bev = &bev_ssl->bev.bev;
+
+	event_del(&bev->ev_read);
+	event_del(&bev->ev_write);
+	event_assign(&bev->ev_read, bev->ev_base, fd,
+	    EV_READ|EV_PERSIST, be_openssl_readeventcb, bev_ssl);
+	event_assign(&bev->ev_write, bev->ev_base, fd,
+	    EV_WRITE|EV_PERSIST, be_openssl_writeeventcb, bev_ssl);
+}
+
+static int
+be_openssl_ctrl(struct bufferevent *bev,
+    enum bufferevent_ctrl_op op, union bufferevent_ctrl_data *data)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bev);
+	switch (op) {
+	case BEV_CTRL_SET_FD:
+		if (bev_ssl->underlying)
+			return -1;
+		{
+			BIO *bio;
+			bio = BIO_new_socket(data->fd, BIO_NOCLOSE);
+			if (!bio)
+				return -1;
+			SSL_set_bio(bev_ssl->ssl, bio, bio);
+		}
+		be_openssl_setfd(bev_ssl, data->fd);
+		if (bev_ssl->state != BUFFEREVENT_SSL_OPEN)
+			start_reading(bev_ssl);
+		else if (bev->enabled & EV_READ)
+			start_reading(bev_ssl);
+		if (bev_ssl->state == BUFFEREVENT_SSL_OPEN &&
+		    (bev->enabled & EV_WRITE) &&
+		    evbuffer_get_length(bev->output))
+			start_writing(bev_ssl);
+		return 0;
+	case BEV_CTRL_GET_FD:
+		if (bev_ssl->underlying)
+			return -1;
+		data->fd = event_get_fd(&bev->ev_read);
+		return 0;
+	case BEV_CTRL_GET_UNDERLYING:
+		if (!bev_ssl->underlying)
+			return -1;
+		data->ptr = bev_ssl->underlying;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+struct ssl_st *
+bufferevent_openssl_get_ssl(struct bufferevent *bufev)
+{
+	struct bufferevent_openssl *bev_ssl = upcast(bufev);
+	if (!bev_ssl)
+		return NULL;
+	return bev_ssl->ssl;
+}
+
+static struct bufferevent *
+bufferevent_openssl_new_impl(struct event_base *base,
+    struct bufferevent *underlying,
+    evutil_socket_t fd,
+    SSL *ssl,
+    enum bufferevent_ssl_state state,
+    enum bufferevent_options options)
+{
+	struct bufferevent_openssl *bev_ssl;
+	struct bufferevent_private *bev_p;
+	enum bufferevent_options tmp_options = options & ~BEV_OPT_THREADSAFE;
+
+	if (underlying != NULL && fd >= 0)
+		return NULL; /* Only one can be set. */
+	if (state != BUFFEREVENT_SSL_OPEN &&
+	    state != BUFFEREVENT_SSL_CONNECTING &&
+	    state != BUFFEREVENT_SSL_ACCEPTING)
+		return NULL;
+
+	if (!(bev_ssl = mm_calloc(1, sizeof(struct bufferevent_openssl))))
+		return NULL;
+
+	bev_p = &bev_ssl->bev;
+
+	if (bufferevent_init_common(bev_p, base,
+		&bufferevent_ops_openssl, tmp_options) < 0) {
+		mm_free(bev_ssl);
+		return NULL;
+	}
+
+	/* Don't explode if we decide to realloc a chunk we're writing from in
+	 * the output buffer, and let OpenSSL give its buffers back whenever
+	 * the connection goes quiet. */
+	SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+	    SSL_MODE_RELEASE_BUFFERS);
+
+	bev_ssl->underlying = underlying;
+	bev_ssl->ssl = ssl;
+	bev_ssl->last_write = -1;
+
+	bev_ssl->outbuf_cb = evbuffer_add_cb(bev_p->bev.output,
+	    be_openssl_outbuf_cb, bev_ssl);
+	event_deferred_cb_init(&bev_ssl->deferred_consider,
+	    be_openssl_deferred_cb, bev_ssl);
+
+	if (options & BEV_OPT_THREADSAFE) {
+		void *lock = underlying ? BEV_UPCAST(underlying)->lock : NULL;
+		if (underlying && !lock) {
+			bufferevent_enable_locking(underlying, NULL);
+			lock = BEV_UPCAST(underlying)->lock;
+		}
+		bufferevent_enable_locking(&bev_ssl->bev.bev, lock);
+	}
+
+	if (underlying) {
+		_bufferevent_init_generic_timeout_cbs(&bev_ssl->bev.bev);
+	} else {
+		be_openssl_setfd(bev_ssl, fd);
+	}
+
+	bev_ssl->state = state;
+
+	evbuffer_freeze(bev_p->bev.input, 0);
+	evbuffer_freeze(bev_p->bev.output, 1);
+
+	switch (state) {
+	case BUFFEREVENT_SSL_ACCEPTING:
+		SSL_set_accept_state(bev_ssl->ssl);
+		break;
+	case BUFFEREVENT_SSL_CONNECTING:
+		SSL_set_connect_state(bev_ssl->ssl);
+		break;
+	case BUFFEREVENT_SSL_OPEN:
+		break;
+	}
+
+	if (underlying) {
+		bufferevent_setcb(underlying,
+		    be_openssl_readcb, be_openssl_writecb, be_openssl_eventcb,
+		    bev_ssl);
+		bufferevent_enable(underlying, EV_READ|EV_WRITE);
+		if (state == BUFFEREVENT_SSL_OPEN)
+			bufferevent_disable(underlying, EV_READ);
+	}
+
+	if (state != BUFFEREVENT_SSL_OPEN) {
+		/* The client speaks first; get its hello out now.  The
+		 * server just waits to hear from the client. */
+		if (underlying)
+			bufferevent_enable(underlying, EV_READ);
+		else
+			start_reading(bev_ssl);
+		if (state == BUFFEREVENT_SSL_CONNECTING)
+			do_handshake(bev_ssl);
+	}
+
+	return &bev_ssl->bev.bev;
+}
+
+struct bufferevent *
+bufferevent_openssl_filter_new(struct event_base *base,
+    struct bufferevent *underlying,
+    SSL *ssl,
+    enum bufferevent_ssl_state state,
+    enum bufferevent_options options)
+{
+	int close_flag = 0; /* We take care of the underlying ourselves. */
+	BIO *bio;
+	if (!underlying)
+		return NULL;
+	if (!(bio = BIO_new_bufferevent(underlying, close_flag)))
+		return NULL;
+
+	SSL_set_bio(ssl, bio, bio);
+
+	return bufferevent_openssl_new_impl(
+		base, underlying, -1, ssl, state, options);
+}
+
+struct bufferevent *
+bufferevent_openssl_socket_new(struct event_base *base,
+    evutil_socket_t fd,
+    SSL *ssl,
+    enum bufferevent_ssl_state state,
+    enum bufferevent_options options)
+{
+	/* Does the SSL already have an fd? */
+	BIO *bio = SSL_get_wbio(ssl);
+	long have_fd = -1;
+
+	if (bio)
+		have_fd = BIO_get_fd(bio, NULL);
+
+	if (have_fd >= 0) {
+		/* The SSL is already configured with an fd. */
+		if (fd < 0) {
+			/* We should learn the fd from the SSL. */
+			fd = (evutil_socket_t) have_fd;
+		} else if (have_fd == (long)fd) {
+			/* We already know the fd from the SSL; do nothing */
+		} else {
+			/* We specified an fd different from that of the SSL.
+			   This is probably an error on our part.  Fail. */
+			return NULL;
+		}
+		(void) BIO_set_close(bio, 0);
+	} else {
+		/* The SSL isn't configured with a BIO with an fd. */
+		if (fd >= 0) {
+			/* ... and we have an fd we want to use. */
+			bio = BIO_new_socket(fd, 0);
+			SSL_set_bio(ssl, bio, bio);
+		} else {
+			/* Leave the fd unset. */
+		}
+	}
+
+	return bufferevent_openssl_new_impl(
+		base, NULL, fd, ssl, state, options);
+}
+
+unsigned long
+bufferevent_get_openssl_error(struct bufferevent *bev)
+{
+	unsigned long err = 0;
+	struct bufferevent_openssl *bev_ssl;
+	BEV_LOCK(bev);
+	bev_ssl = upcast(bev);
+	if (bev_ssl && bev_ssl->n_errors) {
+		err = bev_ssl->errors[--bev_ssl->n_errors];
+	}
+	BEV_UNLOCK(bev);
+	return err;
+}
@@ -40,8 +40,10 @@
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/event.h"
+#include "event2/event_struct.h"
 #include "defer-internal.h"
 #include "bufferevent-internal.h"
+#include "evthread-internal.h"
 #include "mm-internal.h"
 #include "util-internal.h"
 
@@ -276,3 +278,374 @@ const struct bufferevent_ops bufferevent_ops_pair = {
 	be_pair_flush,
 	NULL, /* ctrl */
 };
+
+/*
+ * Pairs whose ends live on different event_bases, for passing data between
+ * threads.  Each direction is a single-producer/single-consumer queue of
+ * batches: the writing end moves its whole output buffer into a new batch
+ * (which relinks chains rather than copying) and links it at the tail; the
+ * reading end unlinks batches from the head in its own thread.  Neither
+ * side takes a lock to move data.  The reader's base is only woken when
+ * its queue goes from idle to busy.
+ */
+
+#if defined(EVTHREAD_HAVE_ATOMICS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
+#define USE_PAIR_XTHREAD 1
+#endif
+
+#ifdef USE_PAIR_XTHREAD
+/* One batch of data on its way to the reading end. */
+struct pair_xt_batch {
+	struct pair_xt_batch *next;
+	/* The data, or NULL once the reader has taken it. */
+	struct evbuffer *buf;
+	/* Set if the writing end finished or went away after this. */
+	unsigned eof : 1;
+};
+
+/* One direction of a cross-thread pair.  head is always a batch the
+ * reader has already taken, so the queue is never empty and the two sides
+ * never touch the same pointer. */
+struct pair_xt_queue {
+	/** Owned by the reader. */
+	struct pair_xt_batch *head;
+	/** Keep the two sides' fields on different cache lines. */
+	char pad[64];
+	/** Owned by the writer. */
+	struct pair_xt_batch *tail;
+	/** Nonzero if the reader has been woken and hasn't looked yet. */
+	int wakeup_pending;
+};
+
+/* State shared by the two ends of a cross-thread pair. */
+struct pair_xt_shared {
+	/** queue[i] carries data to end i. */
+	struct pair_xt_queue queue[2];
+	/** wakeup[i] runs on end i's base to take what queue[i] holds. */
+	struct event wakeup[2];
+	/** closed[i] is set once end i is gone; guarded by lock. */
+	int closed[2];
+	/** Held only to wake a reader, and to stop waking it when it goes
+	 * away: never while moving data. */
+	void *lock;
+	/** Number of ends still using this. */
+	int refcnt;
+};
+
+struct bufferevent_pair_xt {
+	struct bufferevent_private bev;
+	struct pair_xt_shared *shared;
+	/** Which end we are: 0 or 1. */
+	int side;
+};
+
+static inline struct bufferevent_pair_xt *
+upcast_xt(struct bufferevent *bev)
+{
+	struct bufferevent_pair_xt *bev_xt;
+	if (bev->be_ops != &bufferevent_ops_pair_xthread)
+		return NULL;
+	bev_xt = EVUTIL_UPCAST(bev, struct bufferevent_pair_xt, bev.bev);
+	return bev_xt;
+}
+
+#define downcast_xt(bev_xt) (&(bev_xt)->bev.bev)
+
+static void
+pair_xt_shared_free(struct pair_xt_shared *sh)
+{
+	int i;
+	for (i = 0; i < 2; ++i) {
+		struct pair_xt_batch *b, *next;
+		for (b = sh->queue[i].head; b; b = next) {
+			next = b->next;
+			if (b->buf)
+				evbuffer_free(b->buf);
+			mm_free(b);
+		}
+	}
+	EVTHREAD_FREE_LOCK(sh->lock);
+	mm_free(sh);
+}
+
+/* Wake up end 'side' so that it looks at its queue, unless it is already
+ * due to look or has gone away. */
+static void
+pair_xt_wake(struct pair_xt_shared *sh, int side)
+{
+	if (EVATOMIC_XCHG(&sh->queue[side].wakeup_pending, 1))
+		return;
+	EVLOCK_LOCK(sh->lock, EVTHREAD_WRITE);
+	if (!sh->closed[side])
+		event_active(&sh->wakeup[side], EV_READ, 1);
+	EVLOCK_UNLOCK(sh->lock, EVTHREAD_WRITE);
+}
+
+/* Link a batch holding everything in 'buf' (which may be NULL) onto the
+ * queue towards our partner, and wake it.  Returns -1 if we are out of
+ * memory. */
+static int
+pair_xt_push(struct bufferevent_pair_xt *bev_xt, struct evbuffer *buf,
+    int eof)
+{
+	struct pair_xt_shared *sh = bev_xt->shared;
+	struct pair_xt_queue *q = &sh->queue[!bev_xt->side];
+	struct pair_xt_batch *b;
+
+	if (!(b = mm_calloc(1, sizeof(struct pair_xt_batch))))
+		return -1;
+	if (buf && evbuffer_get_length(buf)) {
+		if (!(b->buf = evbuffer_new())) {
+			mm_free(b);
+			return -1;
+		}
+		evbuffer_add_buffer(b->buf, buf);
+	}
+	b->eof = eof ? 1 : 0;
+
+	/* Everything in b must be visible before b is. */
+	EVATOMIC_BARRIER();
+	q->tail->next = b;
+	q->tail = b;
+
+	pair_xt_wake(sh, !bev_xt->side);
+	return 0;
+}
+
+/* Send our output to our partner, if we are writing. */
+static void
+pair_xt_send(struct bufferevent_pair_xt *bev_xt)
+{
+	struct bufferevent *bev = downcast_xt(bev_xt);
+
+	if (!(bev->enabled & EV_WRITE) || !evbuffer_get_length(bev->output))
+		return;
+
+	evbuffer_unfreeze(bev->output, 1);
+	if (pair_xt_push(bev_xt, bev->output, 0) < 0) {
+		evbuffer_freeze(bev->output, 1);
+		_bufferevent_run_eventcb(bev, BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+		return;
+	}
+	evbuffer_freeze(bev->output, 1);
+
+	BEV_RESET_GENERIC_WRITE_TIMEOUT(bev);
+	if (bev->writecb && evbuffer_get_length(bev->output) <= bev->wm_write.low)
+		_bufferevent_run_writecb(bev);
+}
+
+/* Take what our partner has sent us, as far as our high watermark lets
+ * us.  Runs in our own thread. */
+static void
+pair_xt_receive(struct bufferevent_pair_xt *bev_xt)
+{
+	struct bufferevent *bev = downcast_xt(bev_xt);
+	struct pair_xt_queue *q = &bev_xt->shared->queue[bev_xt->side];
+	struct pair_xt_batch *next;
+	int got_data = 0, got_eof = 0;
+
+	if (!(bev->enabled & EV_READ) || bev_xt->bev.read_suspended)
+		return;
+
+	evbuffer_unfreeze(bev->input, 0);
+	while ((next = q->head->next)) {
+		if (bev_xt->bev.read_suspended ||
+		    (bev->wm_read.high &&
+			evbuffer_get_length(bev->input) >= bev->wm_read.high))
+			break;
+		/* Don't look inside next before we have seen it linked. */
+		EVATOMIC_BARRIER();
+		mm_free(q->head);
+		q->head = next;
+		if (next->buf) {
+			evbuffer_add_buffer(bev->input, next->buf);
+			evbuffer_free(next->buf);
+			next->buf = NULL;
+			got_data = 1;
+		}
+		if (next->eof) {
+			got_eof = 1;
+			break;
+		}
+	}
+	evbuffer_freeze(bev->input, 0);
+
+	if (got_data) {
+		BEV_RESET_GENERIC_READ_TIMEOUT(bev);
+		if (evbuffer_get_length(bev->input) >= bev->wm_read.low &&
+		    bev->readcb)
+			_bufferevent_run_readcb(bev);
+	}
+	if (got_eof)
+		_bufferevent_run_eventcb(bev, BEV_EVENT_READING|BEV_EVENT_EOF);
+}
+
+static void
+pair_xt_wakeup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_pair_xt *bev_xt = arg;
+	struct bufferevent *bev = downcast_xt(bev_xt);
+
+	BEV_LOCK(bev);
+	/* Anything linked after this will wake us again. */
+	EVATOMIC_AND(&bev_xt->shared->queue[bev_xt->side].wakeup_pending, 0);
+	pair_xt_receive(bev_xt);
+	BEV_UNLOCK(bev);
+}
+
+static void
+be_pair_xt_outbuf_cb(struct evbuffer *outbuf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct bufferevent_pair_xt *bev_xt = arg;
+
+	if (info->n_added > info->n_deleted)
+		pair_xt_send(bev_xt);
+}
+
+static int
+be_pair_xt_enable(struct bufferevent *bev, short events)
+{
+	struct bufferevent_pair_xt *bev_xt = upcast_xt(bev);
+
+	_bufferevent_generic_adj_timeouts(bev);
+
+	if (events & EV_READ)
+		pair_xt_receive(bev_xt);
+	if (events & EV_WRITE)
+		pair_xt_send(bev_xt);
+	return 0;
+}
+
+static int
+be_pair_xt_disable(struct bufferevent *bev, short events)
+{
+	_bufferevent_generic_adj_timeouts(bev);
+	return 0;
+}
+
+static void
+be_pair_xt_destruct(struct bufferevent *bev)
+{
+	struct bufferevent_pair_xt *bev_xt = upcast_xt(bev);
+	struct pair_xt_shared *sh = bev_xt->shared;
+
+	_bufferevent_del_generic_timeout_cbs(bev);
+	if (!sh)
+		return;
+
+	/* Tell our partner we're gone, then make sure nobody wakes us. */
+	pair_xt_push(bev_xt, NULL, 1);
+	EVLOCK_LOCK(sh->lock, EVTHREAD_WRITE);
+	sh->closed[bev_xt->side] = 1;
+	event_del(&sh->wakeup[bev_xt->side]);
+	EVLOCK_UNLOCK(sh->lock, EVTHREAD_WRITE);
+
+	if (EVATOMIC_ADD(&sh->refcnt, -1) == 1)
+		pair_xt_shared_free(sh);
+	bev_xt->shared = NULL;
+}
+
+static int
+be_pair_xt_flush(struct bufferevent *bev, short iotype,
+    enum bufferevent_flush_mode mode)
+{
+	struct bufferevent_pair_xt *bev_xt = upcast_xt(bev);
+
+	if (mode == BEV_NORMAL)
+		return 0;
+
+	if (iotype & EV_READ)
+		pair_xt_receive(bev_xt);
+	if (iotype & EV_WRITE)
+		pair_xt_send(bev_xt);
+	if (mode == BEV_FINISHED && (iotype & EV_WRITE))
+		pair_xt_push(bev_xt, NULL, 1);
+	return 0;
+}
+
+const struct bufferevent_ops bufferevent_ops_pair_xthread = {
+	"pair_xthread",
+	evutil_offsetof(struct bufferevent_pair_xt, bev),
+	be_pair_xt_enable,
+	be_pair_xt_disable,
+	be_pair_xt_destruct,
+	_bufferevent_generic_adj_timeouts,
+	be_pair_xt_flush,
+	NULL, /* ctrl */
+};
+
+static struct bufferevent_pair_xt *
+bufferevent_pair_xt_elt_new(struct event_base *base,
+    enum bufferevent_options options, struct pair_xt_shared *sh, int side)
+{
+	struct bufferevent_pair_xt *bev_xt;
+	struct bufferevent *bev;
+
+	if (!(bev_xt = mm_calloc(1, sizeof(struct bufferevent_pair_xt))))
+		return NULL;
+	if (bufferevent_init_common(&bev_xt->bev, base,
+		&bufferevent_ops_pair_xthread, options)) {
+		mm_free(bev_xt);
+		return NULL;
+	}
+	bev = downcast_xt(bev_xt);
+	if (!evbuffer_add_cb(bev->output, be_pair_xt_outbuf_cb, bev_xt)) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+	_bufferevent_init_generic_timeout_cbs(bev);
+	evbuffer_freeze(bev->input, 0);
+	evbuffer_freeze(bev->output, 1);
+
+	bev_xt->shared = sh;
+	bev_xt->side = side;
+	event_assign(&sh->wakeup[side], base, -1, 0,
+	    pair_xt_wakeup_cb, bev_xt);
+	++sh->refcnt;
+	return bev_xt;
+}
+#endif
+
+int
+bufferevent_pair_new_xthread(struct event_base *base0,
+    struct event_base *base1, enum bufferevent_options options,
+    struct bufferevent *pair[2])
+{
+#ifndef USE_PAIR_XTHREAD
+	return -1;
+#else
+	struct pair_xt_shared *sh;
+	struct bufferevent_pair_xt *bev0 = NULL, *bev1 = NULL;
+	int i;
+
+	if (!base0 || !base1)
+		return -1;
+	if (!(sh = mm_calloc(1, sizeof(struct pair_xt_shared))))
+		return -1;
+	for (i = 0; i < 2; ++i) {
+		sh->queue[i].head = mm_calloc(1, sizeof(struct pair_xt_batch));
+		if (!sh->queue[i].head)
+			goto err;
+		sh->queue[i].tail = sh->queue[i].head;
+	}
+	EVTHREAD_ALLOC_LOCK(sh->lock, EVTHREAD_LOCK_CATEGORY_BUFFEREVENT);
+
+	/* Each end runs its callbacks later, in its own loop, as a
+	 * same-base pair does. */
+	options |= BEV_OPT_DEFER_CALLBACKS;
+	if (!(bev0 = bufferevent_pair_xt_elt_new(base0, options, sh, 0)))
+		goto err;
+	if (!(bev1 = bufferevent_pair_xt_elt_new(base1, options, sh, 1))) {
+		bufferevent_free(downcast_xt(bev0));
+		return -1;
+	}
+
+	pair[0] = downcast_xt(bev0);
+	pair[1] = downcast_xt(bev1);
+	return 0;
+err:
+	pair_xt_shared_free(sh);
+	return -1;
+#endif
+}
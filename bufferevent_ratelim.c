@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "event2/util.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_struct.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "defer-internal.h"
+#include "ratelim-internal.h"
+#include "bufferevent-internal.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+
+/* The smallest share of a group's buckets we hand out by default. */
+#define RATELIM_MIN_SHARE 64
+
+#define LOCK_GROUP(g) EVLOCK_LOCK((g)->lock, EVTHREAD_WRITE)
+#define UNLOCK_GROUP(g) EVLOCK_UNLOCK((g)->lock, EVTHREAD_WRITE)
+
+/* Return limit after n_ticks refills of rate, but no more than maximum. */
+static ev_ssize_t
+ev_token_bucket_refill(ev_ssize_t limit, size_t rate, size_t maximum,
+    ev_uint32_t n_ticks)
+{
+	size_t room = (size_t)((ev_ssize_t)maximum - limit);
+
+	if (room / n_ticks < rate)
+		return (ev_ssize_t)maximum;
+	return limit + (ev_ssize_t)(rate * n_ticks);
+}
+
+void
+ev_token_bucket_init(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, ev_uint32_t current_tick,
+    int reinitialize)
+{
+	if (reinitialize) {
+		bucket->read_limit = (ev_ssize_t)cfg->read_maximum;
+		bucket->write_limit = (ev_ssize_t)cfg->write_maximum;
+	} else {
+		if (bucket->read_limit > (ev_ssize_t)cfg->read_maximum)
+			bucket->read_limit = (ev_ssize_t)cfg->read_maximum;
+		if (bucket->write_limit > (ev_ssize_t)cfg->write_maximum)
+			bucket->write_limit = (ev_ssize_t)cfg->write_maximum;
+	}
+	bucket->last_updated = current_tick;
+}
+
+int
+ev_token_bucket_update(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, ev_uint32_t current_tick)
+{
+	ev_uint32_t n_ticks = current_tick - bucket->last_updated;
+
+	/* Nothing to do if no tick has passed, or if the clock went
+	 * backwards (and the difference wrapped around). */
+	if (n_ticks == 0 || n_ticks > 0x7fffffff)
+		return 0;
+
+	bucket->read_limit = ev_token_bucket_refill(bucket->read_limit,
+	    cfg->read_rate, cfg->read_maximum, n_ticks);
+	bucket->write_limit = ev_token_bucket_refill(bucket->write_limit,
+	    cfg->write_rate, cfg->write_maximum, n_ticks);
+	bucket->last_updated = current_tick;
+	return 1;
+}
+
+ev_uint32_t
+ev_token_bucket_get_tick(const struct timeval *tv,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	ev_uint64_t msec = (ev_uint64_t)tv->tv_sec * 1000 +
+	    tv->tv_usec / 1000;
+	return (ev_uint32_t)(msec / cfg->msec_per_tick);
+}
+
+static ev_uint32_t
+ev_token_bucket_get_tick_now(const struct ev_token_bucket_cfg *cfg)
+{
+	struct timeval now;
+	evutil_gettimeofday(&now, NULL);
+	return ev_token_bucket_get_tick(&now, cfg);
+}
+
+struct ev_token_bucket_cfg *
+ev_token_bucket_cfg_new(size_t read_rate, size_t read_burst,
+    size_t write_rate, size_t write_burst,
+    const struct timeval *tick_len)
+{
+	struct ev_token_bucket_cfg *r;
+	struct timeval one_second;
+
+	if (!tick_len) {
+		one_second.tv_sec = 1;
+		one_second.tv_usec = 0;
+		tick_len = &one_second;
+	}
+	if (read_rate < 1 || write_rate < 1 ||
+	    read_rate > read_burst || write_rate > write_burst ||
+	    read_burst > (size_t)EV_SSIZE_MAX ||
+	    write_burst > (size_t)EV_SSIZE_MAX)
+		return NULL;
+
+	if ((r = mm_calloc(1, sizeof(struct ev_token_bucket_cfg))) == NULL)
+		return NULL;
+	r->read_rate = read_rate;
+	r->read_maximum = read_burst;
+	r->write_rate = write_rate;
+	r->write_maximum = write_burst;
+	memcpy(&r->tick_timeout, tick_len, sizeof(struct timeval));
+	r->msec_per_tick = (tick_len->tv_sec * 1000) + tick_len->tv_usec / 1000;
+	if (r->msec_per_tick == 0)
+		r->msec_per_tick = 1;
+	return r;
+}
+
+void
+ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg)
+{
+	mm_free(cfg);
+}
+
+/* Called when our own buckets ran dry a tick ago: see whether we can go
+ * on, or have to wait another tick. */
+static void
+_bev_refill_callback(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_private *bev = arg;
+	struct bufferevent_rate_limit *rlim;
+	int again = 0;
+
+	BEV_LOCK(&bev->bev);
+	rlim = bev->rate_limiting;
+	if (!rlim || !rlim->cfg)
+		goto done;
+
+	ev_token_bucket_update(&rlim->limit, rlim->cfg,
+	    ev_token_bucket_get_tick_now(rlim->cfg));
+
+	if (bev->read_suspended & BEV_SUSPEND_BW) {
+		if (rlim->limit.read_limit > 0)
+			bufferevent_unsuspend_read(&bev->bev, BEV_SUSPEND_BW);
+		else
+			again = 1;
+	}
+	if (bev->write_suspended & BEV_SUSPEND_BW) {
+		if (rlim->limit.write_limit > 0)
+			bufferevent_unsuspend_write(&bev->bev, BEV_SUSPEND_BW);
+		else
+			again = 1;
+	}
+	if (again)
+		event_add(&rlim->refill_bucket_event, &rlim->cfg->tick_timeout);
+done:
+	BEV_UNLOCK(&bev->bev);
+}
+
+/* Called from the base once our group has refilled its buckets. */
+static void
+_bev_group_deferred_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bev = arg;
+	struct bufferevent_rate_limit_group *g;
+	int read_suspended, write_suspended;
+
+	BEV_LOCK(&bev->bev);
+	if (bev->rate_limiting && (g = bev->rate_limiting->group)) {
+		LOCK_GROUP(g);
+		read_suspended = g->read_suspended;
+		write_suspended = g->write_suspended;
+		UNLOCK_GROUP(g);
+		if (!read_suspended)
+			bufferevent_unsuspend_read(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+		if (!write_suspended)
+			bufferevent_unsuspend_write(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+	}
+	BEV_UNLOCK(&bev->bev);
+}
+
+/* Refill a group's buckets once a tick, and wake up its members if it had
+ * run dry. */
+static void
+_bev_group_refill_callback(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_rate_limit_group *g = arg;
+	struct bufferevent_private *bev;
+	int wake = 0;
+
+	LOCK_GROUP(g);
+	ev_token_bucket_update(&g->rate_limit, &g->rate_limit_cfg,
+	    ev_token_bucket_get_tick_now(&g->rate_limit_cfg));
+
+	if (g->read_suspended && g->rate_limit.read_limit > 0) {
+		g->read_suspended = 0;
+		wake = 1;
+	}
+	if (g->write_suspended && g->rate_limit.write_limit > 0) {
+		g->write_suspended = 0;
+		wake = 1;
+	}
+	if (wake) {
+		/* We can't take our members' locks while we hold the group's,
+		 * so they find out from their deferred callbacks. */
+		TAILQ_FOREACH(bev, &g->members, rate_limiting->next_in_group) {
+			event_deferred_cb_schedule(bev->bev.ev_base,
+			    &bev->rate_limiting->group_deferred);
+		}
+		/* Whoever went first this time goes last next time. */
+		bev = TAILQ_FIRST(&g->members);
+		if (bev) {
+			TAILQ_REMOVE(&g->members, bev,
+			    rate_limiting->next_in_group);
+			TAILQ_INSERT_TAIL(&g->members, bev,
+			    rate_limiting->next_in_group);
+		}
+	}
+	UNLOCK_GROUP(g);
+}
+
+/* Return bev's rate limiting state, creating it if it has none. */
+static struct bufferevent_rate_limit *
+_bufferevent_get_rate_limiting(struct bufferevent_private *bev)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+
+	if (rlim)
+		return rlim;
+	if ((rlim = mm_calloc(1, sizeof(struct bufferevent_rate_limit)))
+	    == NULL)
+		return NULL;
+	evtimer_assign(&rlim->refill_bucket_event, bev->bev.ev_base,
+	    _bev_refill_callback, bev);
+	event_deferred_cb_init(&rlim->group_deferred,
+	    _bev_group_deferred_cb, bev);
+	bev->rate_limiting = rlim;
+	return rlim;
+}
+
+/* Take bev out of its group, if any.  Needs the lock on bev. */
+static void
+_bufferevent_leave_group(struct bufferevent_private *bev, int unsuspend)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	struct bufferevent_rate_limit_group *g;
+
+	if (!rlim || !(g = rlim->group))
+		return;
+
+	LOCK_GROUP(g);
+	rlim->group = NULL;
+	--g->n_members;
+	TAILQ_REMOVE(&g->members, bev, rate_limiting->next_in_group);
+	UNLOCK_GROUP(g);
+
+	event_deferred_cb_cancel(bev->bev.ev_base, &rlim->group_deferred);
+	if (unsuspend) {
+		bufferevent_unsuspend_read(&bev->bev, BEV_SUSPEND_BW_GROUP);
+		bufferevent_unsuspend_write(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	}
+}
+
+int
+bufferevent_set_rate_limit(struct bufferevent *bev,
+    struct ev_token_bucket_cfg *cfg)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+	struct bufferevent_rate_limit *rlim;
+	int r = 0;
+
+	BEV_LOCK(bev);
+	if (cfg == NULL) {
+		if ((rlim = bevp->rate_limiting) && rlim->cfg) {
+			rlim->cfg = NULL;
+			event_del(&rlim->refill_bucket_event);
+			bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW);
+			bufferevent_unsuspend_write(bev, BEV_SUSPEND_BW);
+		}
+		goto done;
+	}
+
+	if ((rlim = _bufferevent_get_rate_limiting(bevp)) == NULL) {
+		r = -1;
+		goto done;
+	}
+	if (rlim->cfg == cfg)
+		goto done;
+
+	/* A new limit starts out full; a changed one keeps what is left,
+	 * up to its new maximum. */
+	ev_token_bucket_init(&rlim->limit, cfg,
+	    ev_token_bucket_get_tick_now(cfg), rlim->cfg == NULL);
+	rlim->cfg = cfg;
+
+	if (rlim->limit.read_limit > 0)
+		bufferevent_unsuspend_read(bev, BEV_SUSPEND_BW);
+	else
+		bufferevent_suspend_read(bev, BEV_SUSPEND_BW);
+	if (rlim->limit.write_limit > 0)
+		bufferevent_unsuspend_write(bev, BEV_SUSPEND_BW);
+	else
+		bufferevent_suspend_write(bev, BEV_SUSPEND_BW);
+	if (bevp->read_suspended & BEV_SUSPEND_BW ||
+	    bevp->write_suspended & BEV_SUSPEND_BW)
+		event_add(&rlim->refill_bucket_event, &cfg->tick_timeout);
+	else
+		event_del(&rlim->refill_bucket_event);
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+struct bufferevent_rate_limit_group *
+bufferevent_rate_limit_group_new(struct event_base *base,
+    const struct ev_token_bucket_cfg *cfg)
+{
+	struct bufferevent_rate_limit_group *g;
+
+	if ((g = mm_calloc(1, sizeof(struct bufferevent_rate_limit_group)))
+	    == NULL)
+		return NULL;
+	memcpy(&g->rate_limit_cfg, cfg, sizeof(g->rate_limit_cfg));
+	TAILQ_INIT(&g->members);
+	ev_token_bucket_init(&g->rate_limit, cfg,
+	    ev_token_bucket_get_tick_now(cfg), 1);
+	g->min_share = RATELIM_MIN_SHARE;
+
+	event_assign(&g->master_refill_event, base, -1, EV_PERSIST,
+	    _bev_group_refill_callback, g);
+	if (event_add(&g->master_refill_event, &cfg->tick_timeout) < 0) {
+		mm_free(g);
+		return NULL;
+	}
+	EVTHREAD_ALLOC_LOCK(g->lock, EVTHREAD_LOCK_CATEGORY_BUFFEREVENT);
+	return g;
+}
+
+void
+bufferevent_rate_limit_group_free(struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_private *bev;
+
+	/* Each member has to be locked before the group, so we let go of
+	 * the group between members. */
+	for (;;) {
+		LOCK_GROUP(g);
+		bev = TAILQ_FIRST(&g->members);
+		UNLOCK_GROUP(g);
+		if (!bev)
+			break;
+		bufferevent_remove_from_rate_limit_group(&bev->bev);
+	}
+	event_del(&g->master_refill_event);
+	EVTHREAD_FREE_LOCK(g->lock);
+	mm_free(g);
+}
+
+int
+bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
+    struct bufferevent_rate_limit_group *g)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+	struct bufferevent_rate_limit *rlim;
+	int read_suspended, write_suspended;
+	int r = 0;
+
+	BEV_LOCK(bev);
+	if ((rlim = _bufferevent_get_rate_limiting(bevp)) == NULL) {
+		r = -1;
+		goto done;
+	}
+	if (rlim->group == g)
+		goto done;
+	_bufferevent_leave_group(bevp, 1);
+
+	LOCK_GROUP(g);
+	rlim->group = g;
+	++g->n_members;
+	TAILQ_INSERT_TAIL(&g->members, bevp, rate_limiting->next_in_group);
+	read_suspended = g->read_suspended;
+	write_suspended = g->write_suspended;
+	UNLOCK_GROUP(g);
+
+	if (read_suspended)
+		bufferevent_suspend_read(bev, BEV_SUSPEND_BW_GROUP);
+	if (write_suspended)
+		bufferevent_suspend_write(bev, BEV_SUSPEND_BW_GROUP);
+done:
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+int
+bufferevent_remove_from_rate_limit_group(struct bufferevent *bev)
+{
+	BEV_LOCK(bev);
+	_bufferevent_leave_group(BEV_UPCAST(bev), 1);
+	BEV_UNLOCK(bev);
+	return 0;
+}
+
+void
+_bufferevent_free_rate_limiting(struct bufferevent_private *bev)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+
+	_bufferevent_leave_group(bev, 0);
+	event_del(&rlim->refill_bucket_event);
+	mm_free(rlim);
+	bev->rate_limiting = NULL;
+}
+
+/* Return how much bev may read (or write) right now; this can be negative
+ * if it has overdrawn its own bucket.  Needs the lock on bev. */
+static ev_ssize_t
+_bufferevent_get_rlim_max(struct bufferevent_private *bev, int is_write)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	struct bufferevent_rate_limit_group *g;
+	ev_ssize_t max_so_far = EV_SSIZE_MAX, share;
+
+	if (!rlim)
+		return max_so_far;
+
+	if (rlim->cfg) {
+		ev_token_bucket_update(&rlim->limit, rlim->cfg,
+		    ev_token_bucket_get_tick_now(rlim->cfg));
+		max_so_far = is_write ? rlim->limit.write_limit :
+		    rlim->limit.read_limit;
+	}
+
+	if ((g = rlim->group)) {
+		LOCK_GROUP(g);
+		if (is_write ? g->write_suspended : g->read_suspended) {
+			share = 0;
+		} else {
+			share = (is_write ? g->rate_limit.write_limit :
+			    g->rate_limit.read_limit) / g->n_members;
+			if (share < g->min_share)
+				share = g->min_share;
+		}
+		UNLOCK_GROUP(g);
+		if (share < max_so_far)
+			max_so_far = share;
+	}
+	return max_so_far;
+}
+
+/* As _bufferevent_get_rlim_max, but never negative.  If bev may not do
+ * anything at all, make sure it is suspended until it may. */
+static ev_ssize_t
+_bufferevent_get_max(struct bufferevent_private *bev, int is_write)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	ev_ssize_t max_so_far = _bufferevent_get_rlim_max(bev, is_write);
+	void (*suspend)(struct bufferevent *, short) = is_write ?
+	    bufferevent_suspend_write : bufferevent_suspend_read;
+
+	if (max_so_far > 0)
+		return max_so_far;
+
+	if (rlim->cfg && (is_write ? rlim->limit.write_limit :
+		rlim->limit.read_limit) <= 0) {
+		suspend(&bev->bev, BEV_SUSPEND_BW);
+		if (!evtimer_pending(&rlim->refill_bucket_event, NULL))
+			event_add(&rlim->refill_bucket_event,
+			    &rlim->cfg->tick_timeout);
+	}
+	if (rlim->group)
+		suspend(&bev->bev, BEV_SUSPEND_BW_GROUP);
+	return 0;
+}
+
+ev_ssize_t
+_bufferevent_get_read_max(struct bufferevent_private *bev)
+{
+	if (!bev->rate_limiting)
+		return EV_SSIZE_MAX;
+	return _bufferevent_get_max(bev, 0);
+}
+
+ev_ssize_t
+_bufferevent_get_write_max(struct bufferevent_private *bev)
+{
+	if (!bev->rate_limiting)
+		return EV_SSIZE_MAX;
+	return _bufferevent_get_max(bev, 1);
+}
+
+int
+_bufferevent_decrement_read_buckets(struct bufferevent_private *bev,
+    ev_ssize_t bytes)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	struct bufferevent_rate_limit_group *g;
+	int r = 0;
+
+	if (!rlim)
+		return 0;
+
+	if (rlim->cfg) {
+		rlim->limit.read_limit -= bytes;
+		if (rlim->limit.read_limit <= 0) {
+			bufferevent_suspend_read(&bev->bev, BEV_SUSPEND_BW);
+			if (!evtimer_pending(&rlim->refill_bucket_event, NULL) &&
+			    event_add(&rlim->refill_bucket_event,
+				&rlim->cfg->tick_timeout) < 0)
+				r = -1;
+		}
+	}
+
+	if ((g = rlim->group)) {
+		int suspend = 0;
+		LOCK_GROUP(g);
+		g->rate_limit.read_limit -= bytes;
+		if (g->rate_limit.read_limit <= 0) {
+			/* The other members find out when they next ask how
+			 * much they may read. */
+			g->read_suspended = 1;
+			suspend = 1;
+		}
+		UNLOCK_GROUP(g);
+		if (suspend)
+			bufferevent_suspend_read(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+	}
+	return r;
+}
+
+int
+_bufferevent_decrement_write_buckets(struct bufferevent_private *bev,
+    ev_ssize_t bytes)
+{
+	struct bufferevent_rate_limit *rlim = bev->rate_limiting;
+	struct bufferevent_rate_limit_group *g;
+	int r = 0;
+
+	if (!rlim)
+		return 0;
+
+	if (rlim->cfg) {
+		rlim->limit.write_limit -= bytes;
+		if (rlim->limit.write_limit <= 0) {
+			bufferevent_suspend_write(&bev->bev, BEV_SUSPEND_BW);
+			if (!evtimer_pending(&rlim->refill_bucket_event, NULL) &&
+			    event_add(&rlim->refill_bucket_event,
+				&rlim->cfg->tick_timeout) < 0)
+				r = -1;
+		}
+	}
+
+	if ((g = rlim->group)) {
+		int suspend = 0;
+		LOCK_GROUP(g);
+		g->rate_limit.write_limit -= bytes;
+		if (g->rate_limit.write_limit <= 0) {
+			g->write_suspended = 1;
+			suspend = 1;
+		}
+		UNLOCK_GROUP(g);
+		if (suspend)
+			bufferevent_suspend_write(&bev->bev,
+			    BEV_SUSPEND_BW_GROUP);
+	}
+	return r;
+}
+
+ev_ssize_t
+bufferevent_get_max_to_read(struct bufferevent *bev)
+{
+	ev_ssize_t r;
+	BEV_LOCK(bev);
+	r = _bufferevent_get_rlim_max(BEV_UPCAST(bev), 0);
+	BEV_UNLOCK(bev);
+	return r;
+}
+
+ev_ssize_t
+bufferevent_get_max_to_write(struct bufferevent *bev)
+{
+	ev_ssize_t r;
+	BEV_LOCK(bev);
+	r = _bufferevent_get_rlim_max(BEV_UPCAST(bev), 1);
+	BEV_UNLOCK(bev);
+	return r;
+}
@@ -35,12 +35,14 @@
 #ifdef _EVENT_HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/queue.h>
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #ifdef _EVENT_HAVE_STDARG_H
 #include <stdarg.h>
 #endif
@@ -55,6 +57,12 @@
 #ifdef _EVENT_HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef _EVENT_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 
 #include "event2/util.h"
 #include "event2/bufferevent.h"
@@ -62,10 +70,12 @@
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
+#include "event2/event_struct.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
 #include "util-internal.h"
+#include "event-internal.h"
 
 /* prototypes */
 static int be_socket_enable(struct bufferevent *, short);
@@ -76,6 +86,38 @@ static int be_socket_flush(struct bufferevent *, short, enum bufferevent_flush_m
 static int be_socket_ctrl(struct bufferevent *, enum bufferevent_ctrl_op, union bufferevent_ctrl_data *);
 
 static void be_socket_setfd(struct bufferevent *, evutil_socket_t);
+static void be_socket_uncork_cb(struct deferred_cb *, void *);
+static void be_socket_flush_later_cb(struct deferred_cb *, void *);
+static void be_socket_read_later_cb(struct deferred_cb *, void *);
+static void bufferevent_readcb(evutil_socket_t, short, void *);
+static void bufferevent_writecb(evutil_socket_t, short, void *);
+static void bufferevent_read_timer_cb(evutil_socket_t, short, void *);
+static void bufferevent_write_timer_cb(evutil_socket_t, short, void *);
+
+/* With BEV_OPT_EDGE_TRIGGERED, how many reads or writes we do for one
+ * callback before we let everybody else have a turn. */
+#define BEV_ET_MAX_IO_PER_CB 16
+
+/* The options that need a struct bufferevent_socket_deferred. */
+#define BEV_SOCKET_DEFERRED_OPTIONS \
+	(BEV_OPT_CORK|BEV_OPT_OPTIMISTIC_WRITE|BEV_OPT_EDGE_TRIGGERED)
+/* The options that need a deferred flush. */
+#define BEV_SOCKET_FLUSH_OPTIONS \
+	(BEV_OPT_OPTIMISTIC_WRITE|BEV_OPT_EDGE_TRIGGERED)
+
+/* The flags for the socket events on a bufferevent with these options. */
+#define BEV_SOCKET_EV_FLAGS(options)					\
+	(EV_PERSIST | (((options) & BEV_OPT_EDGE_TRIGGERED) ? EV_ET : 0))
+
+#if defined(TCP_CORK)
+#define BEV_CORK_OPTION TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define BEV_CORK_OPTION TCP_NOPUSH
+#endif
+
+/* How many unsent bytes BEV_OPT_NOTSENT_LOWAT lets the kernel hold by
+ * default. */
+#define BEV_NOTSENT_LOWAT_DEFAULT 16384
 
 const struct bufferevent_ops bufferevent_ops_socket = {
 	"socket",
@@ -88,13 +130,264 @@ const struct bufferevent_ops bufferevent_ops_socket = {
 	be_socket_ctrl,
 };
 
+/* Stop the timer, if any, for reading or writing (as what says) on
+ * bufev_p. */
+static void
+be_socket_del_timer(struct bufferevent_private *bufev_p, short what)
+{
+	if (bufev_p->timeouts == NULL)
+		return;
+	if (what == EV_READ)
+		event_del(&bufev_p->timeouts->read_timer);
+	else
+		event_del(&bufev_p->timeouts->write_timer);
+}
+
+/* Return bufev's timers, setting them up the first time it needs them. */
+static struct bufferevent_socket_timeouts *
+be_socket_get_timeouts(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	struct bufferevent_socket_timeouts *t = bufev_p->timeouts;
+
+	if (t != NULL)
+		return t;
+	if ((t = mm_calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	evtimer_assign(&t->read_timer, bufev->ev_base,
+	    bufferevent_read_timer_cb, bufev);
+	evtimer_assign(&t->write_timer, bufev->ev_base,
+	    bufferevent_write_timer_cb, bufev);
+	event_priority_set(&t->read_timer, bufev->ev_read.ev_pri);
+	event_priority_set(&t->write_timer, bufev->ev_read.ev_pri);
+	bufev_p->timeouts = t;
+	return t;
+}
+
+/* Start reading or writing (as what says) on bufev.  Rather than give the
+ * I/O event a timeout that we would have to move every time it fires, we
+ * start a timer and note the time; the readcb and writecb note the time
+ * again whenever they make progress, and the timer checks when it goes off.
+ */
 static int
-be_socket_add(struct event *ev, const struct timeval *tv)
+be_socket_add(struct bufferevent *bufev, short what)
 {
-	if (tv->tv_sec == 0 && tv->tv_usec == 0)
-		return event_add(ev, NULL);
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	struct bufferevent_socket_timeouts *t;
+	struct event *ev;
+	const struct timeval *tv;
+
+	if (what == EV_READ) {
+		ev = &bufev->ev_read;
+		tv = &bufev->timeout_read;
+	} else {
+		ev = &bufev->ev_write;
+		tv = &bufev->timeout_write;
+	}
+
+	if (event_add(ev, NULL) == -1)
+		return -1;
+	if (!evutil_timerisset(tv)) {
+		be_socket_del_timer(bufev_p, what);
+		return 0;
+	}
+	if ((t = be_socket_get_timeouts(bufev)) == NULL)
+		return -1;
+	if (what == EV_READ) {
+		event_base_gettime_cached(bufev->ev_base, &t->last_read);
+		return event_add(&t->read_timer, tv);
+	} else {
+		event_base_gettime_cached(bufev->ev_base, &t->last_write);
+		return event_add(&t->write_timer, tv);
+	}
+}
+
+/* Stop reading or writing (as what says) on bufev. */
+static int
+be_socket_del(struct bufferevent *bufev, short what)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	be_socket_del_timer(bufev_p, what);
+	if (what == EV_READ)
+		return event_del(&bufev->ev_read);
 	else
-		return event_add(ev, tv);
+		return event_del(&bufev->ev_write);
+}
+
+/* Called when a timer from be_socket_add() goes off.  Returns 1 if nothing
+ * has happened for tv since *last; otherwise re-arms timer for the rest of
+ * the timeout and returns 0. */
+static int
+be_socket_timed_out(struct bufferevent *bufev, struct event *timer,
+    const struct timeval *tv, const struct timeval *last)
+{
+	struct timeval now, deadline;
+
+	event_base_gettime_cached(bufev->ev_base, &now);
+	evutil_timeradd(last, tv, &deadline);
+	if (evutil_timercmp(&now, &deadline, <)) {
+		evutil_timersub(&deadline, &now, &deadline);
+		event_add(timer, &deadline);
+		return 0;
+	}
+	return 1;
+}
+
+/* Apply the socket settings and options of bufev to fd, its new socket.
+ * Failure (say, because it isn't a TCP socket) just leaves the system's
+ * defaults. */
+static void
+be_socket_apply_settings(struct bufferevent *bufev, evutil_socket_t fd)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+	const struct bufferevent_socket_settings *st = bufev_p->socket_settings;
+
+	bufev_p->notsent_lowat = 0;
+	if (fd < 0)
+		return;
+
+	if (st && st->sndbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&st->sndbuf,
+		    sizeof(st->sndbuf));
+	if (st && st->rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&st->rcvbuf,
+		    sizeof(st->rcvbuf));
+	if (st && st->nodelay) {
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on,
+		    sizeof(on));
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if (bufev_p->options & BEV_OPT_NOTSENT_LOWAT) {
+		int lowat = st && st->notsent_lowat > 0 ?
+		    st->notsent_lowat : BEV_NOTSENT_LOWAT_DEFAULT;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			(void*)&lowat, sizeof(lowat)) == 0)
+			bufev_p->notsent_lowat = 1;
+	}
+#endif
+}
+
+/* Cork or uncork the socket under bufev.  Failure (say, because it isn't
+ * a TCP socket) just means we don't get to batch. */
+static void
+be_socket_set_cork(struct bufferevent *bufev, int on)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+#ifdef BEV_CORK_OPTION
+	evutil_socket_t fd = event_get_fd(&bufev->ev_write);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, BEV_CORK_OPTION, (void*)&on,
+		    sizeof(on));
+#endif
+	bufev_p->corked = on ? 1 : 0;
+}
+
+/* Uncork the socket under bufev once the current loop iteration is done,
+ * unless more output shows up before then. */
+static void
+be_socket_uncork_later(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (!bufev_p->socket_deferred->uncork.queued) {
+		bufferevent_incref(bufev);
+		event_deferred_cb_schedule(bufev->ev_base,
+		    &bufev_p->socket_deferred->uncork);
+	}
+}
+
+static void
+be_socket_uncork_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bufev_p = arg;
+	struct bufferevent *bufev = &bufev_p->bev;
+
+	BEV_LOCK(bufev);
+	/* If somebody wrote more in the meantime, bufferevent_writecb will
+	 * get back to us once that has gone out too. */
+	if (bufev_p->corked && evbuffer_get_length(bufev->output) == 0)
+		be_socket_set_cork(bufev, 0);
+	_bufferevent_decref_and_unlock(bufev);
+}
+
+/* Arrange to write bufev's output at the end of the current batch of
+ * callbacks, for BEV_OPT_OPTIMISTIC_WRITE. */
+static void
+be_socket_flush_later(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (!bufev_p->socket_deferred->flush.queued) {
+		bufferevent_incref(bufev);
+		event_deferred_cb_schedule(bufev->ev_base,
+		    &bufev_p->socket_deferred->flush);
+	}
+}
+
+/* Write out whatever the current batch of callbacks left in bufev's output
+ * buffer, for BEV_OPT_OPTIMISTIC_WRITE.  bufferevent_writecb() adds the
+ * write event itself if the socket would not take everything. */
+static void
+be_socket_flush_later_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bufev_p = arg;
+	struct bufferevent *bufev = &bufev_p->bev;
+	evutil_socket_t fd;
+
+	BEV_LOCK(bufev);
+	fd = event_get_fd(&bufev->ev_write);
+	if (fd >= 0 &&
+	    (bufev->enabled & EV_WRITE) &&
+	    !bufev_p->write_suspended &&
+	    !bufev_p->connecting &&
+	    evbuffer_get_length(bufev->output) &&
+	    (bufev_p->et_writable ||
+		!event_pending(&bufev->ev_write, EV_WRITE, NULL)))
+		bufferevent_writecb(fd, EV_WRITE, bufev);
+	_bufferevent_decref_and_unlock(bufev);
+}
+
+/* Arrange to go on reading from bufev's socket at the end of the current
+ * batch of callbacks, for BEV_OPT_EDGE_TRIGGERED: we stopped reading
+ * before the socket ran dry, so it won't tell us about that data again. */
+static void
+be_socket_read_later(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (!bufev_p->socket_deferred->read.queued) {
+		bufferevent_incref(bufev);
+		event_deferred_cb_schedule(bufev->ev_base,
+		    &bufev_p->socket_deferred->read);
+	}
+}
+
+static void
+be_socket_read_later_cb(struct deferred_cb *_, void *arg)
+{
+	struct bufferevent_private *bufev_p = arg;
+	struct bufferevent *bufev = &bufev_p->bev;
+	evutil_socket_t fd;
+
+	BEV_LOCK(bufev);
+	fd = event_get_fd(&bufev->ev_read);
+	if (fd >= 0 &&
+	    bufev_p->et_readable &&
+	    (bufev->enabled & EV_READ) &&
+	    !bufev_p->read_suspended &&
+	    event_pending(&bufev->ev_read, EV_READ, NULL))
+		bufferevent_readcb(fd, EV_READ, bufev);
+	_bufferevent_decref_and_unlock(bufev);
 }
 
 static void
@@ -103,13 +396,39 @@ bufferevent_socket_outbuf_cb(struct evbuffer *buf,
     void *arg)
 {
 	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	/* Output written before bufferevent_socket_connect() has nowhere to
+	 * go yet; connecting will start writing it. */
+	if (event_get_fd(&bufev->ev_write) < 0)
+		return;
 
 	if (cbinfo->n_added &&
 	    (bufev->enabled & EV_WRITE) &&
+	    !bufev_p->write_suspended &&
+	    (bufev_p->options & BEV_OPT_EDGE_TRIGGERED)) {
+		/* The write event stays added, but the timeout only runs
+		 * while there's output.  If the socket had room left over,
+		 * no edge is coming to tell us so: use it ourselves. */
+		if (!event_pending(&bufev->ev_write, EV_WRITE, NULL) ||
+		    (evutil_timerisset(&bufev->timeout_write) &&
+			(bufev_p->timeouts == NULL ||
+			 !evtimer_pending(&bufev_p->timeouts->write_timer,
+			     NULL))))
+			be_socket_add(bufev, EV_WRITE);
+		if (bufev_p->et_writable && !bufev_p->connecting)
+			be_socket_flush_later(bufev);
+	} else if (cbinfo->n_added &&
+	    (bufev->enabled & EV_WRITE) &&
+	    !bufev_p->write_suspended &&
 	    !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
 		/* Somebody added data to the buffer, and we would like to
 		 * write, and we were not writing.  So, start writing. */
-		be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+		if (bufev_p->options & BEV_OPT_OPTIMISTIC_WRITE)
+			be_socket_flush_later(bufev);
+		else
+			be_socket_add(bufev, EV_WRITE);
 	}
 }
 
@@ -117,10 +436,16 @@ static void
 bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 {
 	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	struct evbuffer *input;
 	int res = 0;
 	short what = BEV_EVENT_READING;
-	int howmuch = -1;
+	int howmuch;
+	ev_ssize_t readmax;
+	int edge = (bufev_p->options & BEV_OPT_EDGE_TRIGGERED) != 0;
+	int n_reads = 0;
+	ev_ssize_t total = 0;
 
 	if (event == EV_TIMEOUT) {
 		what |= BEV_EVENT_TIMEOUT;
@@ -128,54 +453,101 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 	}
 
 	input = bufev->input;
-
-	/*
-	 * If we have a high watermark configured then we don't want to
-	 * read more data than would make us reach the watermark.
-	 */
-	if (bufev->wm_read.high != 0) {
-		howmuch = bufev->wm_read.high - evbuffer_get_length(input);
-		/* we somehow lowered the watermark, stop reading */
-		if (howmuch <= 0) {
-			bufferevent_wm_suspend_read(bufev);
-			return;
+	if (edge)
+		bufev_p->et_readable = 1;
+
+	/* Level-triggered, we read once and let the backend tell us if
+	 * there's more.  Edge-triggered, it won't, so we keep reading until
+	 * the socket runs dry or we have to stop. */
+	do {
+		/*
+		 * If we have a high watermark configured then we don't want
+		 * to read more data than would make us reach the watermark.
+		 */
+		howmuch = -1;
+		if (bufev->wm_read.high != 0) {
+			howmuch = bufev->wm_read.high -
+			    evbuffer_get_length(input);
+			/* we somehow lowered the watermark, stop reading */
+			if (howmuch <= 0) {
+				bufferevent_wm_suspend_read(bufev);
+				goto done;
+			}
 		}
-	}
 
-	evbuffer_unfreeze(input, 0);
-	res = evbuffer_read(input, fd, howmuch);
-	evbuffer_freeze(input, 0);
+		/* Don't read more than our rate limit lets us. */
+		readmax = _bufferevent_get_read_max(bufev_p);
+		if (readmax == 0)
+			goto done;
+		if (readmax < INT_MAX && (howmuch < 0 || howmuch > readmax))
+			howmuch = (int)readmax;
+
+		evbuffer_unfreeze(input, 0);
+		if (bufev_p->options & BEV_OPT_SPLICE)
+			res = evbuffer_read_splice(input, fd, howmuch);
+		else
+			res = evbuffer_read(input, fd, howmuch);
+		evbuffer_freeze(input, 0);
+
+		if (res == -1) {
+			int err = evutil_socket_geterror(fd);
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				bufev_p->et_readable = 0;
+				goto done;
+			}
+			/* error case */
+			what |= BEV_EVENT_ERROR;
+		} else if (res == 0) {
+			/* eof case */
+			what |= BEV_EVENT_EOF;
+		}
 
-	if (res == -1) {
-		int err = evutil_socket_geterror(fd);
-		if (EVUTIL_ERR_RW_RETRIABLE(err))
-			goto reschedule;
-		/* error case */
-		what |= BEV_EVENT_ERROR;
-	} else if (res == 0) {
-		/* eof case */
-		what |= BEV_EVENT_EOF;
-	}
+		if (res <= 0)
+			goto error;
 
-	if (res <= 0)
-		goto error;
+		if (bufev_p->timeouts &&
+		    evutil_timerisset(&bufev->timeout_read))
+			event_base_gettime_cached(bufev->ev_base,
+			    &bufev_p->timeouts->last_read);
+		_bufferevent_decrement_read_buckets(bufev_p, res);
+		total += res;
+	} while (edge && ++n_reads < BEV_ET_MAX_IO_PER_CB &&
+	    (bufev->enabled & EV_READ) && !bufev_p->read_suspended);
 
+	/* We stopped only to be fair; come back for the rest. */
+	if (edge && n_reads == BEV_ET_MAX_IO_PER_CB)
+		be_socket_read_later(bufev);
 
+ done:
 	/* Invoke the user callback - must always be called last */
-	if (evbuffer_get_length(input) >= bufev->wm_read.low &&
+	if (total &&
+	    evbuffer_get_length(input) >= bufev->wm_read.low &&
             bufev->readcb != NULL)
 		_bufferevent_run_readcb(bufev);
 
 	return;
 
- reschedule:
-	return;
-
  error:
-	event_del(&bufev->ev_read);
+	be_socket_del(bufev, EV_READ);
+	if (total && bufev->readcb != NULL &&
+	    evbuffer_get_length(bufev->input) >= bufev->wm_read.low)
+		_bufferevent_run_readcb(bufev);
 	_bufferevent_run_eventcb(bufev, what);
 }
 
+static void
+bufferevent_read_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (be_socket_timed_out(bufev, &bufev_p->timeouts->read_timer,
+		&bufev->timeout_read, &bufev_p->timeouts->last_read))
+		bufferevent_readcb(event_get_fd(&bufev->ev_read), EV_TIMEOUT,
+		    bufev);
+}
+
 static void
 bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 {
@@ -184,88 +556,266 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	int res = 0;
 	short what = BEV_EVENT_WRITING;
+	ev_ssize_t writemax;
+	int edge = (bufev_p->options & BEV_OPT_EDGE_TRIGGERED) != 0;
+	int n_writes = 0;
+	int notsent_wait;
+	size_t written = 0;
 
 	if (event == EV_TIMEOUT) {
 		what |= BEV_EVENT_TIMEOUT;
 		goto error;
 	}
+	if (edge)
+		bufev_p->et_writable = 1;
 	if (bufev_p->connecting) {
 		bufev_p->connecting = 0;
 		_bufferevent_run_eventcb(bufev, BEV_EVENT_CONNECTED);
 		if (!(bufev->enabled & EV_WRITE)) {
-			event_del(&bufev->ev_write);
+			be_socket_del(bufev, EV_WRITE);
 			return;
 		}
 	}
 
-	if (evbuffer_get_length(bufev->output)) {
-	    evbuffer_unfreeze(bufev->output, 1);
-	    res = evbuffer_write(bufev->output, fd);
-	    evbuffer_freeze(bufev->output, 1);
-	    if (res == -1) {
+	/* As in bufferevent_readcb: edge-triggered, keep writing until the
+	 * socket is full or we run out. */
+	while (evbuffer_get_length(bufev->output)) {
+		/* Don't write more than our rate limit lets us. */
+		writemax = _bufferevent_get_write_max(bufev_p);
+		if (writemax == 0) {
+			if (n_writes)
+				break;
+			goto reschedule;
+		}
+
+		if ((bufev_p->options & BEV_OPT_CORK) && !bufev_p->corked)
+			be_socket_set_cork(bufev, 1);
+		evbuffer_unfreeze(bufev->output, 1);
+		res = evbuffer_write_atmost(bufev->output, fd,
+		    writemax == EV_SSIZE_MAX ? -1 : writemax);
+		evbuffer_freeze(bufev->output, 1);
+		if (res == -1) {
 			int err = evutil_socket_geterror(fd);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				bufev_p->et_writable = 0;
+				if (n_writes)
+					break;
 				goto reschedule;
-		    what |= BEV_EVENT_ERROR;
-	    } else if (res == 0) {
-		    /* eof case */
-		    what |= BEV_EVENT_EOF;
-	    }
-	    if (res <= 0)
-		    goto error;
+			}
+			what |= BEV_EVENT_ERROR;
+		} else if (res == 0) {
+			/* eof case */
+			what |= BEV_EVENT_EOF;
+		}
+		if (res <= 0)
+			goto error;
+		written += res;
+		if (bufev_p->timeouts &&
+		    evutil_timerisset(&bufev->timeout_write))
+			event_base_gettime_cached(bufev->ev_base,
+			    &bufev_p->timeouts->last_write);
+		_bufferevent_decrement_write_buckets(bufev_p, res);
+
+		if (!edge || bufev_p->write_suspended)
+			break;
+		if (++n_writes == BEV_ET_MAX_IO_PER_CB) {
+			/* Let everybody else have a turn first. */
+			if (evbuffer_get_length(bufev->output))
+				be_socket_flush_later(bufev);
+			break;
+		}
 	}
 
-	if (evbuffer_get_length(bufev->output) == 0)
-		event_del(&bufev->ev_write);
+	/* With TCP_NOTSENT_LOWAT, what we just wrote may all still be in
+	 * the kernel.  The socket is reported writable again once most of it
+	 * is gone: hold the user callback until then. */
+	notsent_wait = bufev_p->notsent_lowat && written &&
+	    bufev->writecb != NULL &&
+	    evbuffer_get_length(bufev->output) <= bufev->wm_write.low;
+
+	if (evbuffer_get_length(bufev->output) == 0) {
+		if (notsent_wait) {
+			if (!edge &&
+			    !event_pending(&bufev->ev_write, EV_WRITE, NULL))
+				be_socket_add(bufev, EV_WRITE);
+		} else if (edge)
+			be_socket_del_timer(bufev_p, EV_WRITE);
+		else
+			be_socket_del(bufev, EV_WRITE);
+		if (bufev_p->corked)
+			be_socket_uncork_later(bufev);
+	} else if (!bufev_p->write_suspended &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+		/* We were called to write optimistically, and the socket did
+		 * not take it all: wait until it can. */
+		be_socket_add(bufev, EV_WRITE);
+	}
 
 	/*
 	 * Invoke the user callback if our buffer is drained or below the
 	 * low watermark.
 	 */
-	if (bufev->writecb != NULL &&
+	if (bufev->writecb != NULL && !notsent_wait &&
 	    evbuffer_get_length(bufev->output) <= bufev->wm_write.low)
 		_bufferevent_run_writecb(bufev);
 
 	return;
 
  reschedule:
-	if (evbuffer_get_length(bufev->output) == 0)
-		event_del(&bufev->ev_write);
+	if (evbuffer_get_length(bufev->output) == 0) {
+		if (edge)
+			be_socket_del_timer(bufev_p, EV_WRITE);
+		else
+			be_socket_del(bufev, EV_WRITE);
+	} else if (!event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		be_socket_add(bufev, EV_WRITE);
 	return;
 
  error:
-	event_del(&bufev->ev_write);
+	be_socket_del(bufev, EV_WRITE);
 	_bufferevent_run_eventcb(bufev, what);
 }
 
+static void
+bufferevent_write_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
+
+	if (be_socket_timed_out(bufev, &bufev_p->timeouts->write_timer,
+		&bufev->timeout_write, &bufev_p->timeouts->last_write))
+		bufferevent_writecb(event_get_fd(&bufev->ev_write), EV_TIMEOUT,
+		    bufev);
+}
+
 struct bufferevent *
 bufferevent_socket_new(struct event_base *base, evutil_socket_t fd,
     enum bufferevent_options options)
+{
+	return bufferevent_socket_new_with_settings(base, fd, options, NULL);
+}
+
+struct bufferevent *
+bufferevent_socket_new_with_settings(struct event_base *base,
+    evutil_socket_t fd, enum bufferevent_options options,
+    const struct bufferevent_socket_settings *settings)
 {
 	struct bufferevent_private *bufev_p;
 	struct bufferevent *bufev;
 
+	if ((options & BEV_OPT_EDGE_TRIGGERED) &&
+	    (!base || !(event_base_get_features(base) & EV_FEATURE_ET)))
+		options &= ~BEV_OPT_EDGE_TRIGGERED;
+
 	if ((bufev_p = mm_calloc(1, sizeof(struct bufferevent_private)))== NULL)
 		return NULL;
+	if ((options & BEV_SOCKET_DEFERRED_OPTIONS) &&
+	    (bufev_p->socket_deferred = mm_calloc(1,
+		sizeof(struct bufferevent_socket_deferred))) == NULL)
+		goto error;
+	/* Settings that are all defaults need no room. */
+	if (settings && (settings->sndbuf || settings->rcvbuf ||
+		settings->nodelay || settings->notsent_lowat)) {
+		if ((bufev_p->socket_settings = mm_malloc(
+			    sizeof(struct bufferevent_socket_settings))) == NULL)
+			goto error;
+		*bufev_p->socket_settings = *settings;
+	}
 
 	if (bufferevent_init_common(bufev_p, base, &bufferevent_ops_socket,
-				    options) < 0) {
-		mm_free(bufev_p);
-		return NULL;
-	}
+				    options) < 0)
+		goto error;
 	bufev = &bufev_p->bev;
+	be_socket_apply_settings(bufev, fd);
 
 	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
+	    EV_READ|BEV_SOCKET_EV_FLAGS(options), bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	    EV_WRITE|BEV_SOCKET_EV_FLAGS(options), bufferevent_writecb, bufev);
 
 	evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb, bufev);
+	if (options & BEV_OPT_CORK)
+		event_deferred_cb_init(&bufev_p->socket_deferred->uncork,
+		    be_socket_uncork_cb, bufev_p);
+	if (options & BEV_SOCKET_FLUSH_OPTIONS)
+		event_deferred_cb_init(&bufev_p->socket_deferred->flush,
+		    be_socket_flush_later_cb, bufev_p);
+	if (options & BEV_OPT_EDGE_TRIGGERED)
+		event_deferred_cb_init(&bufev_p->socket_deferred->read,
+		    be_socket_read_later_cb, bufev_p);
 
 	evbuffer_freeze(bufev->input, 0);
 	evbuffer_freeze(bufev->output, 1);
 
 	return bufev;
+
+ error:
+	if (bufev_p->socket_settings)
+		mm_free(bufev_p->socket_settings);
+	if (bufev_p->socket_deferred)
+		mm_free(bufev_p->socket_deferred);
+	mm_free(bufev_p);
+	return NULL;
+}
+
+/* For BEV_OPT_TCP_FASTOPEN: start connecting fd to sa, and send as much of
+ * the first chain of bev's output as the kernel will put in the SYN.
+ * Return 1 if the connect is under way, or 0 if the caller should fall back
+ * to a plain connect(). */
+static int
+be_socket_connect_fastopen(struct bufferevent *bev, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen)
+{
+#if defined(MSG_FASTOPEN) || defined(CONNECT_DATA_IDEMPOTENT)
+	struct evbuffer_iovec v;
+	ev_ssize_t n;
+
+	if (evbuffer_peek(bev->output, -1, NULL, &v, 1) < 1)
+		return 0;
+#ifdef MSG_FASTOPEN
+	{
+		int flags = MSG_FASTOPEN;
+#ifdef MSG_NOSIGNAL
+		/* Without fast open, this is a send() on an unconnected
+		 * socket. */
+		flags |= MSG_NOSIGNAL;
+#endif
+		n = sendto(fd, v.iov_base, v.iov_len, flags, sa, socklen);
+	}
+#else
+	{
+		sa_endpoints_t endpoints;
+		struct iovec iov;
+		size_t len = 0;
+
+		memset(&endpoints, 0, sizeof(endpoints));
+		endpoints.sae_dstaddr = sa;
+		endpoints.sae_dstaddrlen = socklen;
+		iov.iov_base = v.iov_base;
+		iov.iov_len = v.iov_len;
+		n = connectx(fd, &endpoints, SAE_ASSOCID_ANY,
+		    CONNECT_RESUME_ON_READ_WRITE | CONNECT_DATA_IDEMPOTENT,
+		    &iov, 1, &len, NULL);
+		if (n == 0 || EVUTIL_ERR_CONNECT_RETRIABLE(errno))
+			n = len;
+	}
+#endif
+	if (n < 0) {
+		int e = evutil_socket_geterror(fd);
+		/* Without a cookie from the server, the kernel sends a plain
+		 * SYN, and the data goes out once we're connected. */
+		return EVUTIL_ERR_CONNECT_RETRIABLE(e);
+	}
+	if (n > 0) {
+		evbuffer_unfreeze(bev->output, 1);
+		evbuffer_drain(bev->output, n);
+		evbuffer_freeze(bev->output, 1);
+	}
+	return 1;
+#else
+	return 0;
+#endif
 }
 
 int
@@ -294,13 +844,21 @@ bufferevent_socket_connect(struct bufferevent *bev,
 		be_socket_setfd(bev, fd);
 	}
 
-	if (connect(fd, sa, socklen)<0) {
+	if ((bufev_p->options & BEV_OPT_TCP_FASTOPEN) &&
+	    be_socket_connect_fastopen(bev, fd, sa, socklen)) {
+		/* It's under way, perhaps with some of our output already. */
+		bufev_p->connecting = 1;
+		if (! be_socket_enable(bev, EV_WRITE))
+			return 0;
+		bufev_p->connecting = 0;
+		_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
+	} else if (connect(fd, sa, socklen)<0) {
 		int e = evutil_socket_geterror(fd);
 		if (EVUTIL_ERR_CONNECT_RETRIABLE(e)) {
-			if (! be_socket_enable(bev, EV_WRITE)) {
-				bufev_p->connecting = 1;
+			bufev_p->connecting = 1;
+			if (! be_socket_enable(bev, EV_WRITE))
 				return 0;
-			}
+			bufev_p->connecting = 0;
 		}
 		_bufferevent_run_eventcb(bev, BEV_EVENT_ERROR);
 		/* do something about the error? */
@@ -342,12 +900,31 @@ bufferevent_new(evutil_socket_t fd,
 static int
 be_socket_enable(struct bufferevent *bufev, short event)
 {
+	struct bufferevent_private *bufev_p =
+	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	if (event & EV_READ) {
-		if (be_socket_add(&bufev->ev_read,&bufev->timeout_read) == -1)
+		if (be_socket_add(bufev, EV_READ) == -1)
 			return -1;
+		/* If we stopped reading before the socket ran dry, it has
+		 * no news for us; go on by ourselves. */
+		if (bufev_p->et_readable)
+			be_socket_read_later(bufev);
 	}
-	if (event & EV_WRITE) {
-		if (be_socket_add(&bufev->ev_write,&bufev->timeout_write) == -1)
+	if ((event & EV_WRITE) &&
+	    (bufev_p->options & BEV_OPT_EDGE_TRIGGERED) &&
+	    !bufev_p->connecting) {
+		if (be_socket_add(bufev, EV_WRITE) == -1)
+			return -1;
+		if (bufev_p->et_writable && evbuffer_get_length(bufev->output))
+			be_socket_flush_later(bufev);
+	} else if ((event & EV_WRITE) &&
+	    (bufev_p->options & BEV_OPT_OPTIMISTIC_WRITE) &&
+	    !bufev_p->connecting) {
+		/* Don't poll for writability until a write comes up short. */
+		if (evbuffer_get_length(bufev->output))
+			be_socket_flush_later(bufev);
+	} else if (event & EV_WRITE) {
+		if (be_socket_add(bufev, EV_WRITE) == -1)
 			return -1;
 	}
 	return 0;
@@ -359,12 +936,12 @@ be_socket_disable(struct bufferevent *bufev, short event)
 	struct bufferevent_private *bufev_p =
 	    EVUTIL_UPCAST(bufev, struct bufferevent_private, bev);
 	if (event & EV_READ) {
-		if (event_del(&bufev->ev_read) == -1)
+		if (be_socket_del(bufev, EV_READ) == -1)
 			return -1;
 	}
 	/* Don't actually disable the write if we are trying to connect. */
 	if ((event & EV_WRITE) && ! bufev_p->connecting) {
-		if (event_del(&bufev->ev_write) == -1)
+		if (be_socket_del(bufev, EV_WRITE) == -1)
 			return -1;
 	}
 	return 0;
@@ -380,8 +957,20 @@ be_socket_destruct(struct bufferevent *bufev)
 
 	fd = event_get_fd(&bufev->ev_read);
 
-	event_del(&bufev->ev_read);
-	event_del(&bufev->ev_write);
+	be_socket_del(bufev, EV_READ);
+	be_socket_del(bufev, EV_WRITE);
+	if (bufev_p->timeouts) {
+		mm_free(bufev_p->timeouts);
+		bufev_p->timeouts = NULL;
+	}
+	if (bufev_p->socket_deferred) {
+		mm_free(bufev_p->socket_deferred);
+		bufev_p->socket_deferred = NULL;
+	}
+	if (bufev_p->socket_settings) {
+		mm_free(bufev_p->socket_settings);
+		bufev_p->socket_settings = NULL;
+	}
 
 	if (bufev_p->options & BEV_OPT_CLOSE_ON_FREE)
 		EVUTIL_CLOSESOCKET(fd);
@@ -391,9 +980,9 @@ static void
 be_socket_adj_timeouts(struct bufferevent *bufev)
 {
 	if (event_pending(&bufev->ev_read, EV_READ, NULL))
-		be_socket_add(&bufev->ev_read, &bufev->timeout_read);
+		be_socket_add(bufev, EV_READ);
 	if (event_pending(&bufev->ev_write, EV_WRITE, NULL))
-		be_socket_add(&bufev->ev_write, &bufev->timeout_write);
+		be_socket_add(bufev, EV_WRITE);
 }
 
 static int
@@ -410,13 +999,18 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 	BEV_LOCK(bufev);
 	assert(bufev->be_ops == &bufferevent_ops_socket);
 
-	event_del(&bufev->ev_read);
-	event_del(&bufev->ev_write);
+	be_socket_del(bufev, EV_READ);
+	be_socket_del(bufev, EV_WRITE);
+	BEV_UPCAST(bufev)->corked = 0;
+	BEV_UPCAST(bufev)->et_readable = BEV_UPCAST(bufev)->et_writable = 0;
+	be_socket_apply_settings(bufev, fd);
 
 	event_assign(&bufev->ev_read, bufev->ev_base, fd,
-	    EV_READ|EV_PERSIST, bufferevent_readcb, bufev);
+	    EV_READ|BEV_SOCKET_EV_FLAGS(BEV_UPCAST(bufev)->options),
+	    bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
-	    EV_WRITE|EV_PERSIST, bufferevent_writecb, bufev);
+	    EV_WRITE|BEV_SOCKET_EV_FLAGS(BEV_UPCAST(bufev)->options),
+	    bufferevent_writecb, bufev);
 	BEV_UNLOCK(bufev);
 }
 
@@ -434,6 +1028,25 @@ bufferevent_priority_set(struct bufferevent *bufev, int priority)
 		goto done;
 	if (event_priority_set(&bufev->ev_write, priority) == -1)
 		goto done;
+	if (BEV_UPCAST(bufev)->timeouts) {
+		event_priority_set(&BEV_UPCAST(bufev)->timeouts->read_timer,
+		    priority);
+		event_priority_set(&BEV_UPCAST(bufev)->timeouts->write_timer,
+		    priority);
+	}
+	/* Deferred callbacks run at the same priority as the events that
+	 * scheduled them. */
+	event_deferred_cb_set_priority(bufev->ev_base,
+	    &BEV_UPCAST(bufev)->deferred, priority);
+	if (BEV_UPCAST(bufev)->options & BEV_OPT_CORK)
+		event_deferred_cb_set_priority(bufev->ev_base,
+		    &BEV_UPCAST(bufev)->socket_deferred->uncork, priority);
+	if (BEV_UPCAST(bufev)->options & BEV_SOCKET_FLUSH_OPTIONS)
+		event_deferred_cb_set_priority(bufev->ev_base,
+		    &BEV_UPCAST(bufev)->socket_deferred->flush, priority);
+	if (BEV_UPCAST(bufev)->options & BEV_OPT_EDGE_TRIGGERED)
+		event_deferred_cb_set_priority(bufev->ev_base,
+		    &BEV_UPCAST(bufev)->socket_deferred->read, priority);
 
 	r = 0;
 done:
@@ -458,6 +1071,14 @@ bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 		goto done;
 
 	res = event_base_set(base, &bufev->ev_write);
+	if (res == -1)
+		goto done;
+
+	if (BEV_UPCAST(bufev)->timeouts) {
+		event_base_set(base, &BEV_UPCAST(bufev)->timeouts->read_timer);
+		event_base_set(base,
+		    &BEV_UPCAST(bufev)->timeouts->write_timer);
+	}
 done:
 	BEV_UNLOCK(bufev);
 	return res;
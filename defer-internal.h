@@ -37,13 +37,23 @@ struct deferred_cb;
 
 typedef void (*deferred_cb_fn)(struct deferred_cb *, void *);
 
+/** Values for deferred_cb.queued */
+#define DEFERRED_CB_QUEUED 1
+#define DEFERRED_CB_IN_BATCH 2
+
 /** A deferred_cb is a callback that can be scheduled to run as part of
  * an event_base's event_loop, rather than running immediately. */
 struct deferred_cb {
 	/** Links to the adjacent active (pending) deferred_cb objects. */
 	TAILQ_ENTRY (deferred_cb) (cb_next);
-	/** True iff this deferred_cb is pending in an event_base. */
-	unsigned queued : 1;
+	/** Nonzero iff this deferred_cb is pending in an event_base and has
+	 * not started running yet: DEFERRED_CB_QUEUED if it is waiting for
+	 * the next round, DEFERRED_CB_IN_BATCH if the round that will run it
+	 * has begun. */
+	unsigned queued : 2;
+	/** The priority to run at, like an event's; or -1 to run at the
+	 * event_base's default priority. */
+	int pri;
 	/** The function to execute when the callback runs. */
 	deferred_cb_fn cb;
 	/** The function's second argument. */
@@ -66,6 +76,15 @@ void event_deferred_cb_cancel(struct event_base *, struct deferred_cb *);
    Activate a deferred_cb if it is not currently scheduled in an event_base.
  */
 void event_deferred_cb_schedule(struct event_base *, struct deferred_cb *);
+/**
+   Set the priority at which a deferred_cb runs: it runs along with the
+   active events of that priority, after those of every lower-numbered one.
+   Priorities past the last one the event_base has are clamped to the last;
+   -1 means the event_base's default priority.  If the deferred_cb is
+   already scheduled, it moves to the end of its new priority.
+ */
+void event_deferred_cb_set_priority(struct event_base *, struct deferred_cb *,
+    int);
 
 #ifdef __cplusplus
 }
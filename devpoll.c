@@ -47,10 +47,13 @@
 
 #include "event2/event.h"
 #include "event2/event_struct.h"
+#include "event2/thread.h"
 #include "event-internal.h"
 #include "evsignal-internal.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
+#include "changelist-internal.h"
+#include "evthread-internal.h"
 
 struct devpollop {
 	struct pollfd *events;
@@ -61,21 +64,21 @@ struct devpollop {
 };
 
 static void *devpoll_init	(struct event_base *);
-static int devpoll_add(struct event_base *, int fd, short old, short events, void *);
-static int devpoll_del(struct event_base *, int fd, short old, short events, void *);
 static int devpoll_dispatch	(struct event_base *, struct timeval *);
 static void devpoll_dealloc	(struct event_base *);
 
+/* Changes are recorded in base->changelist, and their net result is
+ * written to /dev/poll in one pwrite() just before each DP_POLL. */
 const struct eventop devpollops = {
 	"devpoll",
 	devpoll_init,
-	devpoll_add,
-	devpoll_del,
+	event_changelist_add,
+	event_changelist_del,
 	devpoll_dispatch,
 	devpoll_dealloc,
 	1, /* need reinit */
 	EV_FEATURE_FDS|EV_FEATURE_O1,
-	0
+	EVENT_CHANGELIST_FDINFO_SIZE
 };
 
 #define NEVENT	32000
@@ -161,6 +164,69 @@ devpoll_init(struct event_base *base)
 	return (devpollop);
 }
 
+/* Queue the pollfds that give /dev/poll the net effect of one changelist
+ * entry. */
+static int
+devpoll_apply_one_change(struct devpollop *devpollop,
+    const struct event_change *ch)
+{
+	int want = 0, had = 0;
+
+	if (!ch->read_change && !ch->write_change)
+		return (0); /* The changes cancelled each other out. */
+
+	if ((ch->read_change & EV_CHANGE_ADD) ||
+	    ((ch->old_events & EV_READ) && !(ch->read_change & EV_CHANGE_DEL)))
+		want |= POLLIN;
+	if ((ch->write_change & EV_CHANGE_ADD) ||
+	    ((ch->old_events & EV_WRITE) &&
+		!(ch->write_change & EV_CHANGE_DEL)))
+		want |= POLLOUT;
+	if (ch->old_events & EV_READ)
+		had |= POLLIN;
+	if (ch->old_events & EV_WRITE)
+		had |= POLLOUT;
+
+	/*
+	 * The /dev/poll driver ORs any new events with the existing events
+	 * that it has cached for the fd, and the only way to remove one is
+	 * to use POLLREMOVE by itself.  This removes ALL events for the fd,
+	 * so if we still want some of them we must re-add them after it.
+	 */
+	if (had & ~want) {
+		if (devpoll_queue(devpollop, ch->fd, POLLREMOVE) != 0)
+			return (-1);
+	}
+	if (want) {
+		if (devpoll_queue(devpollop, ch->fd, want) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static int
+devpoll_apply_changes(struct event_base *base)
+{
+	struct event_changelist *changelist = &base->changelist;
+	struct devpollop *devpollop = base->evbase;
+	int i, r = 0;
+
+	for (i = 0; i < changelist->n_changes; ++i) {
+		if (devpoll_apply_one_change(devpollop,
+			&changelist->changes[i]) < 0)
+			r = -1;
+	}
+
+	if (devpollop->nchanges && devpoll_commit(devpollop) < 0) {
+		event_warn("pwrite: /dev/poll");
+		devpollop->nchanges = 0;
+		r = -1;
+	}
+
+	return (r);
+}
+
 static int
 devpoll_dispatch(struct event_base *base, struct timeval *tv)
 {
@@ -169,8 +235,10 @@ devpoll_dispatch(struct event_base *base, struct timeval *tv)
 	struct dvpoll dvp;
 	int i, res, timeout = -1;
 
-	if (devpollop->nchanges)
-		devpoll_commit(devpollop);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	devpoll_apply_changes(base);
+	event_changelist_remove_all(&base->changelist, base);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 
 	if (tv != NULL)
 		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
@@ -220,79 +288,13 @@ devpoll_dispatch(struct event_base *base, struct timeval *tv)
 }
 
 
-static int
-devpoll_add(struct event_base *base, int fd, short old, short events, void *p)
-{
-	struct devpollop *devpollop = base->evbase;
-	int res;
-	(void)p;
-
-	/*
-	 * It's not necessary to OR the existing read/write events that we
-	 * are currently interested in with the new event we are adding.
-	 * The /dev/poll driver ORs any new events with the existing events
-	 * that it has cached for the fd.
-	 */
-
-	res = 0;
-	if (events & EV_READ)
-		res |= POLLIN;
-	if (events & EV_WRITE)
-		res |= POLLOUT;
-
-	if (devpoll_queue(devpollop, fd, res) != 0)
-		return(-1);
-
-	return (0);
-}
-
-static int
-devpoll_del(struct event_base *base, int fd, short old, short events, void *p)
-{
-	struct devpollop *devpollop = base->evbase;
-	int res;
-	(void)p;
-
-	res = 0;
-	if (events & EV_READ)
-		res |= POLLIN;
-	if (events & EV_WRITE)
-		res |= POLLOUT;
-
-	/*
-	 * The only way to remove an fd from the /dev/poll monitored set is
-	 * to use POLLREMOVE by itself.  This removes ALL events for the fd
-	 * provided so if we care about two events and are only removing one
-	 * we must re-add the other event after POLLREMOVE.
-	 */
-
-	if (devpoll_queue(devpollop, fd, POLLREMOVE) != 0)
-		return(-1);
-
-	if ((res & (POLLIN|POLLOUT)) != (POLLIN|POLLOUT)) {
-		/*
-		 * We're not deleting all events, so we must resubmit the
-		 * event that we are still interested in if one exists.
-		 */
-
-		if ((res & POLLIN) && (old & EV_WRITE)) {
-			/* Deleting read, still care about write */
-			devpoll_queue(devpollop, fd, POLLOUT);
-		} else if ((res & POLLOUT) && (old & EV_READ)) {
-			/* Deleting write, still care about read */
-			devpoll_queue(devpollop, fd, POLLIN);
-		}
-	}
-
-	return (0);
-}
-
 static void
 devpoll_dealloc(struct event_base *base)
 {
 	struct devpollop *devpollop = base->evbase;
 
 	evsig_dealloc(base);
+	event_changelist_freemem(&base->changelist);
 	if (devpollop->events)
 		mm_free(devpollop->events);
 	if (devpollop->changes)
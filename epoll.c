@@ -38,6 +38,10 @@
 #endif
 #include <sys/queue.h>
 #include <sys/epoll.h>
+#if defined(_EVENT_HAVE_SYS_TIMERFD_H) && defined(_EVENT_HAVE_TIMERFD_CREATE)
+#include <sys/timerfd.h>
+#define USING_TIMERFD
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,11 +56,22 @@
 #include "evsignal-internal.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
+#include "changelist-internal.h"
+#include "event2/thread.h"
+#include "evthread-internal.h"
 
 struct epollop {
 	struct epoll_event *events;
 	int nevents;
 	int epfd;
+#ifdef USING_TIMERFD
+	/* If we want precise timeouts, a timerfd in the epoll set that we arm
+	 * for the next timeout; -1 otherwise. */
+	int timerfd;
+	/* True if timerfd might fire: we need to disarm it before waiting
+	 * with the coarse timeout again. */
+	int timerfd_armed;
+#endif
 };
 
 static void *epoll_init	(struct event_base *);
@@ -77,6 +92,20 @@ const struct eventop epollops = {
 	0
 };
 
+/* Same backend, but record fd changes in base->changelist and apply their
+ * net result just before each call to epoll_wait(). */
+static const struct eventop epollops_changelist = {
+	"epoll (with changelist)",
+	epoll_init,
+	event_changelist_add,
+	event_changelist_del,
+	epoll_dispatch,
+	epoll_dealloc,
+	1, /* need reinit */
+	EV_FEATURE_ET|EV_FEATURE_O1,
+	EVENT_CHANGELIST_FDINFO_SIZE
+};
+
 #ifdef _EVENT_HAVE_SETFD
 #define FD_CLOSEONEXEC(x) do { \
         if (fcntl(x, F_SETFD, 1) == -1) \
@@ -136,11 +165,139 @@ epoll_init(struct event_base *base)
 	}
 	epollop->nevents = nfiles;
 
+#ifdef USING_TIMERFD
+	epollop->timerfd = -1;
+	if ((base->flags & EVENT_BASE_FLAG_PRECISE_TIMER) != 0 ||
+	    ((base->flags & EVENT_BASE_FLAG_IGNORE_ENV) == 0 &&
+		getenv("EVENT_PRECISE_TIMER") != NULL)) {
+		int fd;
+		/* The timer is only ever armed with relative times, so any
+		 * clock that doesn't jump will do. */
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (fd >= 0) {
+			struct epoll_event epev = {0, {0}};
+			epev.data.fd = fd;
+			epev.events = EPOLLIN;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+				event_warn("epoll_ctl(timerfd)");
+				close(fd);
+			} else {
+				epollop->timerfd = fd;
+			}
+		} else if (errno != EINVAL && errno != ENOSYS) {
+			/* EINVAL and ENOSYS mean that the kernel is too old for
+			 * timerfd or its flags; fall back to the coarse timeout
+			 * quietly. */
+			event_warn("timerfd_create");
+		}
+	}
+#endif
+
+	if ((base->flags & EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST) != 0 ||
+	    ((base->flags & EVENT_BASE_FLAG_IGNORE_ENV) == 0 &&
+		getenv("EVENT_EPOLL_USE_CHANGELIST") != NULL))
+		base->evsel = &epollops_changelist;
+
 	evsig_init(base);
 
 	return (epollop);
 }
 
+static const char *
+epoll_op_to_string(int op)
+{
+	return op == EPOLL_CTL_ADD?"ADD":
+	    op == EPOLL_CTL_DEL?"DEL":
+	    op == EPOLL_CTL_MOD?"MOD":
+	    "???";
+}
+
+/* Tell epoll about the net effect of one changelist entry. */
+static int
+epoll_apply_one_change(struct epollop *epollop,
+    const struct event_change *ch)
+{
+	struct epoll_event epev = {0, {0}};
+	int op, events = 0;
+	int want_read, want_write;
+
+	if (!ch->read_change && !ch->write_change)
+		return (0); /* The changes cancelled each other out. */
+
+	want_read = (ch->read_change & EV_CHANGE_ADD) ||
+	    ((ch->old_events & EV_READ) &&
+		!(ch->read_change & EV_CHANGE_DEL));
+	want_write = (ch->write_change & EV_CHANGE_ADD) ||
+	    ((ch->old_events & EV_WRITE) &&
+		!(ch->write_change & EV_CHANGE_DEL));
+
+	if (want_read)
+		events |= EPOLLIN;
+	if (want_write)
+		events |= EPOLLOUT;
+	if ((ch->read_change | ch->write_change) & EV_CHANGE_ET)
+		events |= EPOLLET;
+
+	if (!want_read && !want_write)
+		op = EPOLL_CTL_DEL;
+	else if (ch->old_events)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_ADD;
+
+	epev.data.fd = ch->fd;
+	epev.events = events;
+	if (epoll_ctl(epollop->epfd, op, ch->fd, &epev) == 0)
+		return (0);
+
+	if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+		/* The fd was closed and a new one opened with the same
+		 * number since we last told epoll about it, so there is
+		 * nothing to modify.  Add it instead. */
+		if (epoll_ctl(epollop->epfd, EPOLL_CTL_ADD, ch->fd,
+			&epev) == -1) {
+			event_warn("Epoll MOD(%d) on %d retried as ADD; "
+			    "that failed too", (int)epev.events, ch->fd);
+			return (-1);
+		}
+	} else if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+		/* We dup()ed the fd, or closed and reopened it without
+		 * removing its events: it is already known to epoll. */
+		if (epoll_ctl(epollop->epfd, EPOLL_CTL_MOD, ch->fd,
+			&epev) == -1) {
+			event_warn("Epoll ADD(%d) on %d retried as MOD; "
+			    "that failed too", (int)epev.events, ch->fd);
+			return (-1);
+		}
+	} else if (op == EPOLL_CTL_DEL &&
+	    (errno == ENOENT || errno == EBADF || errno == EPERM)) {
+		/* The fd was closed before we got around to deleting it,
+		 * and epoll already forgot about it. */
+	} else {
+		event_warn("Epoll %s(%d) on fd %d failed.",
+		    epoll_op_to_string(op), (int)epev.events, ch->fd);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+epoll_apply_changes(struct event_base *base)
+{
+	struct event_changelist *changelist = &base->changelist;
+	struct epollop *epollop = base->evbase;
+	int i, r = 0;
+
+	for (i = 0; i < changelist->n_changes; ++i) {
+		if (epoll_apply_one_change(epollop,
+			&changelist->changes[i]) < 0)
+			r = -1;
+	}
+
+	return (r);
+}
+
 static int
 epoll_dispatch(struct event_base *base, struct timeval *tv)
 {
@@ -148,6 +305,39 @@ epoll_dispatch(struct event_base *base, struct timeval *tv)
 	struct epoll_event *events = epollop->events;
 	int i, res, timeout = -1;
 
+	if (base->evsel == &epollops_changelist) {
+		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		epoll_apply_changes(base);
+		event_changelist_remove_all(&base->changelist, base);
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	}
+
+#ifdef USING_TIMERFD
+	if (epollop->timerfd >= 0) {
+		struct itimerspec is;
+		is.it_interval.tv_sec = 0;
+		is.it_interval.tv_nsec = 0;
+		if (tv == NULL || (tv->tv_usec % 1000) == 0) {
+			/* Nothing to wait for, or a whole number of msec that
+			 * epoll_wait can do by itself. */
+			is.it_value.tv_sec = 0;
+			is.it_value.tv_nsec = 0;
+		} else {
+			is.it_value.tv_sec = tv->tv_sec;
+			is.it_value.tv_nsec = tv->tv_usec * 1000;
+		}
+		if (is.it_value.tv_nsec || epollop->timerfd_armed) {
+			/* Setting the timer also resets its expiration count,
+			 * so we never have to read from it. */
+			if (timerfd_settime(epollop->timerfd, 0, &is, NULL) < 0)
+				event_warn("timerfd_settime");
+			epollop->timerfd_armed = is.it_value.tv_nsec != 0;
+		}
+		if (epollop->timerfd_armed)
+			tv = NULL; /* the timerfd will wake us up */
+	}
+#endif
+
 	if (tv != NULL)
 		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
 
@@ -177,6 +367,11 @@ epoll_dispatch(struct event_base *base, struct timeval *tv)
 		int what = events[i].events;
 		short res = 0;
 
+#ifdef USING_TIMERFD
+		if (events[i].data.fd == epollop->timerfd)
+			continue; /* the loop will find the timeout itself */
+#endif
+
 		if (what & (EPOLLHUP|EPOLLERR)) {
 			res = EV_READ | EV_WRITE;
 		} else {
@@ -266,10 +461,15 @@ epoll_dealloc(struct event_base *base)
 	struct epollop *epollop = base->evbase;
 
 	evsig_dealloc(base);
+	event_changelist_freemem(&base->changelist);
 	if (epollop->events)
 		mm_free(epollop->events);
 	if (epollop->epfd >= 0)
 		close(epollop->epfd);
+#ifdef USING_TIMERFD
+	if (epollop->timerfd >= 0)
+		close(epollop->timerfd);
+#endif
 
 	memset(epollop, 0, sizeof(struct epollop));
 	mm_free(epollop);
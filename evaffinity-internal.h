@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVAFFINITY_INTERNAL_H_
+#define _EVAFFINITY_INTERNAL_H_
+
+/** @file evaffinity-internal.h
+ *
+ * An ev_affinity is a set of CPUs that a thread can be bound to: either a
+ * single CPU, or all the CPUs of one NUMA node.  event_base_new_with_config()
+ * binds the thread that builds a base to the base's CPUs for as long as it
+ * takes, so that with the usual first-touch policy the memory for the
+ * base's backend ends up on the right node; the loop can then bind the
+ * thread that runs it as well.
+ *
+ * This is only implemented where we have sched_setaffinity().
+ **/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ev_affinity;
+
+/** Make an affinity for cpu, or if cpu is negative, for every CPU on NUMA
+    node numa_node.  Returns NULL (with a warning) if there is no such CPU
+    or node, or if this platform can't bind threads to CPUs. */
+struct ev_affinity *ev_affinity_new(int cpu, int numa_node);
+/** Release an affinity from ev_affinity_new() or ev_affinity_bind(). */
+void ev_affinity_free(struct ev_affinity *aff);
+
+/** Bind the calling thread to the CPUs in aff.  If saved is provided,
+    set *saved to an affinity that ev_affinity_bind() can be called with
+    later to undo this.  Returns 0 on success and -1 on failure. */
+int ev_affinity_bind(const struct ev_affinity *aff,
+    struct ev_affinity **saved);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVAFFINITY_INTERNAL_H_ */
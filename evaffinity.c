@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#ifdef _EVENT_HAVE_SCHED_SETAFFINITY
+/* CPU_SET and friends are GNU extensions. */
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event2/util.h"
+#include "evaffinity-internal.h"
+#include "log-internal.h"
+#include "mm-internal.h"
+
+#ifdef _EVENT_HAVE_SCHED_SETAFFINITY
+
+struct ev_affinity {
+	cpu_set_t cpus;
+};
+
+/* Add the CPUs of numa_node to cpus, from the node's cpulist in sysfs,
+ * which looks like "0-3,8-11".  Returns the number of CPUs added, or -1 if
+ * there is no such node. */
+static int
+ev_affinity_add_node(cpu_set_t *cpus, int numa_node)
+{
+	char path[64], buf[1024];
+	char *cp;
+	FILE *f;
+	int n = 0;
+
+	evutil_snprintf(path, sizeof(path),
+	    "/sys/devices/system/node/node%d/cpulist", numa_node);
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fclose(f);
+		return (-1);
+	}
+	fclose(f);
+
+	cp = buf;
+	while (*cp && *cp != '\n') {
+		char *end;
+		long lo, hi, i;
+		lo = hi = strtol(cp, &end, 10);
+		if (end == cp || lo < 0)
+			return (-1);
+		cp = end;
+		if (*cp == '-') {
+			++cp;
+			hi = strtol(cp, &end, 10);
+			if (end == cp || hi < lo)
+				return (-1);
+			cp = end;
+		}
+		for (i = lo; i <= hi && i < CPU_SETSIZE; ++i) {
+			CPU_SET(i, cpus);
+			++n;
+		}
+		if (*cp == ',')
+			++cp;
+	}
+	return (n);
+}
+
+struct ev_affinity *
+ev_affinity_new(int cpu, int numa_node)
+{
+	struct ev_affinity *aff;
+
+	if (cpu >= CPU_SETSIZE) {
+		event_warnx("%s: no CPU %d", __func__, cpu);
+		return (NULL);
+	}
+	if ((aff = mm_calloc(1, sizeof(struct ev_affinity))) == NULL)
+		return (NULL);
+
+	CPU_ZERO(&aff->cpus);
+	if (cpu >= 0) {
+		CPU_SET(cpu, &aff->cpus);
+	} else if (numa_node < 0 ||
+	    ev_affinity_add_node(&aff->cpus, numa_node) <= 0) {
+		event_warnx("%s: no CPUs found for NUMA node %d",
+		    __func__, numa_node);
+		mm_free(aff);
+		return (NULL);
+	}
+	return (aff);
+}
+
+int
+ev_affinity_bind(const struct ev_affinity *aff, struct ev_affinity **saved)
+{
+	struct ev_affinity *old = NULL;
+
+	if (saved) {
+		if ((old = mm_calloc(1, sizeof(struct ev_affinity))) == NULL)
+			return (-1);
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &old->cpus) < 0) {
+			event_warn("%s: sched_getaffinity", __func__);
+			mm_free(old);
+			return (-1);
+		}
+	}
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &aff->cpus) < 0) {
+		event_warn("%s: sched_setaffinity", __func__);
+		if (old)
+			mm_free(old);
+		return (-1);
+	}
+	if (saved)
+		*saved = old;
+	return (0);
+}
+
+#else
+
+struct ev_affinity *
+ev_affinity_new(int cpu, int numa_node)
+{
+	event_warnx("%s: binding threads to CPUs is not supported here",
+	    __func__);
+	return (NULL);
+}
+
+int
+ev_affinity_bind(const struct ev_affinity *aff, struct ev_affinity **saved)
+{
+	return (-1);
+}
+
+#endif
+
+void
+ev_affinity_free(struct ev_affinity *aff)
+{
+	if (aff)
+		mm_free(aff);
+}
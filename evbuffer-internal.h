@@ -33,8 +33,11 @@ extern "C" {
 
 #include "event-config.h"
 #include "event2/util.h"
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "util-internal.h"
 #include "defer-internal.h"
+#include "evthread-internal.h"
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -59,6 +62,10 @@ struct evbuffer_cb_entry {
 	void *cbarg;
         /** Currently set flags on this callback. */
 	ev_uint32_t flags;
+        /** If EVBUFFER_CB_THRESHOLD is set in flags, the buffer length that
+            this callback watches: it only runs when the length moves from
+            below this value to at-or-above it, or back. */
+	size_t threshold;
 #if 0
         /** Size of the evbuffer before this callback was suspended, or 0
             if this callback is not suspended. */
@@ -67,6 +74,74 @@ struct evbuffer_cb_entry {
 };
 
 struct evbuffer_chain;
+struct ev_pool;
+
+/** Something that wants to hear when a memory group crosses one of its
+ * thresholds.  Its deferred callback is scheduled on its base; it should
+ * ask evbuffer_mem_group_is_over() what the state is once it runs. */
+struct evbuffer_mem_group_member {
+	TAILQ_ENTRY(evbuffer_mem_group_member) next;
+	struct event_base *base;
+	struct deferred_cb deferred;
+};
+
+/** A set of evbuffers whose chain memory we add up; see
+ * evbuffer_mem_group_new(). */
+struct evbuffer_mem_group {
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	void *lock;
+#endif
+	/** Bytes of memory held by the chains charged to this group. */
+	size_t allocated;
+	size_t high, low;
+	/** True iff allocated went over high, and hasn't come back down to
+	 * low since. */
+	unsigned over : 1;
+	/** True iff over changed and we haven't told anybody yet. */
+	unsigned notify_pending : 1;
+
+	evbuffer_mem_group_cb cb;
+	void *cbarg;
+
+	/** One for whoever made the group, plus one for each evbuffer and
+	 * member in it.  We free it once this is 0 and no chain is charged to it. */
+	int refcnt;
+
+	TAILQ_HEAD(evbuffer_mem_group_members, evbuffer_mem_group_member)
+	    members;
+};
+
+/** Tell member about group's threshold crossings from now on.  The member
+ * holds a reference to group until it is removed. */
+void _evbuffer_mem_group_add_member(struct evbuffer_mem_group *group,
+    struct evbuffer_mem_group_member *member);
+/** Stop telling member about group, and cancel any pending callback. */
+void _evbuffer_mem_group_remove_member(struct evbuffer_mem_group *group,
+    struct evbuffer_mem_group_member *member);
+
+/** The chains of an evbuffer in single-producer/single-consumer mode; see
+ * evbuffer_enable_spsc().  The consumer owns head, read_pos and n_removed,
+ * and the producer owns tail and n_added; each side only reads the other's
+ * fields.  Chains here have misalign 0, and the producer only ever grows
+ * the off of tail. */
+struct evbuffer_spsc {
+	/** The chain we remove from next. */
+	struct evbuffer_chain *head;
+	/** How many bytes at the start of head are already removed. */
+	size_t read_pos;
+	/** How many bytes the consumer has removed, ever. */
+	size_t n_removed;
+
+	/** Keep the two sides' fields on different cache lines. */
+	char pad[64];
+
+	/** The chain we add to next. */
+	struct evbuffer_chain *tail;
+	/** How many bytes the producer has added, ever.  Everything written
+	 * before this is bumped is visible to a consumer that reads it. */
+	size_t n_added;
+};
+
 struct evbuffer {
 	/** The first chain in this buffer's linked list of chains. */
 	struct evbuffer_chain *first;
@@ -114,11 +189,45 @@ struct evbuffer {
 	/** True iff this buffer is set up for overlapped IO. */
 	unsigned is_overlapped : 1;
 #endif
+	/** True iff evbuffer_read() should size its reads from what recent
+	 * reads returned, rather than asking the kernel with FIONREAD. */
+	unsigned adaptive_read : 1;
+	/** True iff the last adaptive read came back much smaller than we
+	 * asked for; a second one in a row shrinks read_estimate. */
+	unsigned read_shrink_pending : 1;
+
+	/** How many bytes the next adaptive read will ask for. */
+	size_t read_estimate;
+
+	/** If nonzero, how many bytes this buffer may keep in memory before
+	 * evbuffer_set_spill() moves the rest out to a file. */
+	size_t spill_threshold;
+	/** Where to make spill files, or NULL for the default. */
+	char *spill_dir;
+	/** The unlinked temporary file we spill to, or -1. */
+	int spill_fd;
+	/** How many bytes we have written to spill_fd. */
+	off_t spill_off;
+	/** The last chain holding data from spill_fd, if it is still in this
+	 * buffer.  Everything after it goes to the file too. */
+	struct evbuffer_chain *spill_chain;
 
 	/** An event_base associated with this evbuffer.  Used to implement
 	 * deferred callbacks. */
 	struct event_base *ev_base;
 
+	/** If set, the pool that new chains for this buffer come from.  We
+	 * hold a reference to it. */
+	struct ev_pool *pool;
+
+	/** If set, the memory group that this buffer's chains are charged
+	 * to.  We hold a reference to it. */
+	struct evbuffer_mem_group *mem_group;
+
+	/** If set, this buffer is in single-producer/single-consumer mode,
+	 * and its chains are here instead of in first and last. */
+	struct evbuffer_spsc *spsc;
+
 	/** For debugging: how many times have we acquired the lock for this
 	 * evbuffer? */
         int lock_count;
@@ -155,6 +264,15 @@ struct evbuffer_chain {
 
 	/** Set if special handling is required for this chain */
 	unsigned flags;
+	/** Number of references to this chain: one from the evbuffer that
+	 * holds it, plus one from each chain that evbuffer_add_buffer_reference()
+	 * made to share its memory.  We only free the chain once this hits 0. */
+	int refcnt;
+	/** The memory group this chain is charged to, if any. */
+	struct evbuffer_mem_group *group;
+	/** How many bytes of memory we charged for this chain, header
+	 * included. */
+	size_t mem_len;
 #define EVBUFFER_MMAP		0x0001  /**< memory in buffer is mmaped */
 #define EVBUFFER_SENDFILE	0x0002  /**< a chain used for sendfile */
 #define EVBUFFER_REFERENCE	0x0004	/**< a chain with a mem reference */
@@ -167,6 +285,19 @@ struct evbuffer_chain {
 	/** a chain that should be freed, but can't be freed until it is
 	 * un-pinned. */
 #define EVBUFFER_DANGLING	0x0040
+	/** a chain that shares the memory of a chain in another evbuffer */
+#define EVBUFFER_MULTICAST	0x0080
+	/** a chain whose data is in a kernel pipe, for splice() */
+#define EVBUFFER_SPLICE		0x0100
+	/** a chain whose data evbuffer_set_spill() moved out to a file */
+#define EVBUFFER_SPILL		0x0200
+	/** a chain carved from a huge-page region; see
+	 * evbuffer_set_huge_chain_limit() */
+#define EVBUFFER_HUGE		0x0400
+	/** a chain that refers to an evbuffer_file_segment */
+#define EVBUFFER_FILESEGMENT	0x0800
+	/** a chain allocated from the buffer's object pool */
+#define EVBUFFER_POOLED		0x1000
 
 	/** Usually points to the read-write memory belonging to this
 	 * buffer allocated as part of the evbuffer_chain allocation.
@@ -185,6 +316,55 @@ struct evbuffer_chain_fd {
 	int fd;	/**< the fd associated with this chain */
 };
 
+/** for a splice chain: the pipe holding its data.  Draining the chain only
+ * lowers off; the drained bytes stay at the front of the pipe, and are read
+ * and thrown away before the next splice out of it. */
+struct evbuffer_chain_pipe {
+	int fds[2];	/**< read and write ends of the pipe */
+	size_t in_pipe;	/**< how many bytes are in the pipe */
+	size_t capacity; /**< how many bytes the pipe can hold */
+};
+
+/** for a spill chain: the sendfile or mmap fd info, and the evbuffer whose
+ * spill_chain this is, if any.  Only that one chain has an owner, so that
+ * freeing it can clear the evbuffer's pointer. */
+struct evbuffer_chain_spill {
+	struct evbuffer_chain_fd fd_info;
+	struct evbuffer *owner;
+};
+
+/** A file segment; see evbuffer_file_segment_new(). */
+struct evbuffer_file_segment {
+	/** Lock for refcnt, or NULL. */
+	void *lock;
+	/** One for the user, plus one for each chain that refers to us. */
+	int refcnt;
+	/** The EVBUF_FS_* flags we were made with. */
+	unsigned flags;
+	/** True iff our chains are sent with sendfile(). */
+	unsigned can_sendfile : 1;
+	/** True iff contents points into a mapping of our own. */
+	unsigned is_mapping : 1;
+	/** The file. */
+	int fd;
+	/** Where in the file we start, and how many bytes we have. */
+	off_t file_offset;
+	off_t length;
+	/** The page-aligned mapping that contents is in, if is_mapping. */
+	void *mapping;
+	size_t mapping_len;
+	/** Our data, if we aren't using sendfile(): in mapping, or in memory
+	 * that we allocated. */
+	const char *contents;
+};
+
+/** for a file segment chain: the fd info for sendfile, which must come
+ * first, and the segment, which we hold a reference to. */
+struct evbuffer_chain_file_segment {
+	struct evbuffer_chain_fd fd_info;
+	struct evbuffer_file_segment *segment;
+};
+
 /** callback for a reference buffer; lets us know what to do with it when
  * we're done with it. */
 struct evbuffer_chain_reference {
@@ -192,6 +372,13 @@ struct evbuffer_chain_reference {
 	void *extra;
 };
 
+/** for a multicast chain: the chain whose memory it shares, and the evbuffer
+ * that the chain was in.  We hold a reference to both. */
+struct evbuffer_multicast_parent {
+	struct evbuffer *source;
+	struct evbuffer_chain *parent;
+};
+
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
 /** Return a pointer to extra data allocated along with an evbuffer. */
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -206,6 +393,18 @@ struct evbuffer_chain_reference {
 	do {                                            \
 		assert((buffer)->lock_count == 0);	\
 	} while (0)
+#ifdef EVTHREAD_HAVE_ATOMICS
+/* Several readers may hold the lock at once, so count atomically. */
+#define _EVBUFFER_INCREMENT_LOCK_COUNT(buffer)				\
+	do {								\
+		EVATOMIC_ADD(&((struct evbuffer*)(buffer))->lock_count, 1); \
+	} while (0)
+#define _EVBUFFER_DECREMENT_LOCK_COUNT(buffer)				\
+	do {								\
+		ASSERT_EVBUFFER_LOCKED(buffer);				\
+		EVATOMIC_ADD(&((struct evbuffer*)(buffer))->lock_count, -1); \
+	} while (0)
+#else
 #define _EVBUFFER_INCREMENT_LOCK_COUNT(buffer)                 \
 	do {                                                   \
 		((struct evbuffer*)(buffer))->lock_count++;    \
@@ -215,6 +414,7 @@ struct evbuffer_chain_reference {
 		ASSERT_EVBUFFER_LOCKED(buffer);		      \
 		((struct evbuffer*)(buffer))->lock_count--;   \
 	} while (0)
+#endif
 
 #define EVBUFFER_LOCK(buffer, mode)					\
 	do {								\
@@ -253,10 +453,31 @@ void _evbuffer_chain_unpin(struct evbuffer_chain *chain, unsigned flag);
  * releases the lock before freeing it and the buffer. */
 void _evbuffer_decref_and_unlock(struct evbuffer *buffer);
 
+/** Allocate a chain that can hold at least size bytes, the way buf would,
+ * without adding it to buf. */
+struct evbuffer_chain *_evbuffer_chain_new(struct evbuffer *buf, size_t size);
+/** Free a chain that no evbuffer holds. */
+void _evbuffer_chain_free(struct evbuffer_chain *chain);
+/** Add a chain, along with any data in it, to the end of buf.  The caller
+ * must hold the lock on buf, and invoke its callbacks afterwards. */
+void _evbuffer_chain_append(struct evbuffer *buf, struct evbuffer_chain *chain);
+/** Run or schedule the callbacks on buf for whatever changed since they
+ * last ran. */
+void _evbuffer_invoke_callbacks(struct evbuffer *buf);
+#ifdef WIN32
+/** Free the read chains an overlapped evbuffer keeps for itself.  Called when
+ * the buffer is freed. */
+void _evbuffer_overlapped_free_reads(struct evbuffer *buf);
+#endif
+
 /** As evbuffer_expand, but does not guarantee that the newly allocated memory
  * is contiguous.  Instead, it may be split across two chunks. */
 int _evbuffer_expand_fast(struct evbuffer *, size_t);
 
+/** Return true iff all the data in buf is in memory, where evbuffer_peek()
+ * can see it; that is, none of it is in a file we haven't read yet. */
+int _evbuffer_is_in_memory(struct evbuffer *buf);
+
 /** Helper: prepares for a readv/WSARecv call by expanding the buffer to
  * hold enough memory to read 'howmuch' bytes in possibly noncontiguous memory.
  * Sets up the one or two iovecs in 'vecs' to point to the free memory and its
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVCLOCK_INTERNAL_H_
+#define _EVCLOCK_INTERNAL_H_
+
+/** @file evclock-internal.h
+ *
+ * The clocks other than the default that an event_base can keep time
+ * with.  Each counts from the same point as CLOCK_MONOTONIC, so a base
+ * that can't have the one it asked for can fall back to the default
+ * without anything else noticing.
+ **/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "event2/event.h"
+
+struct timeval;
+
+/** Return source if this machine has it, or EVENT_CLOCK_DEFAULT if not. */
+enum event_clock_source ev_clock_probe(enum event_clock_source source);
+
+/** Read the clock that source names into tp.  source must have come back
+    from ev_clock_probe(), and must not be EVENT_CLOCK_DEFAULT. */
+int ev_clock_gettime(enum event_clock_source source, struct timeval *tp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVCLOCK_INTERNAL_H_ */
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "event2/event.h"
+#include "event2/util.h"
+#include "evthread-internal.h"
+#include "evclock-internal.h"
+
+#if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+#define EV_CLOCK_HAVE_COARSE
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && \
+    defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC) && \
+    defined(EVTHREAD_HAVE_ATOMICS)
+#define EV_CLOCK_HAVE_TSC
+#endif
+
+#ifdef EV_CLOCK_HAVE_COARSE
+/* The coarsest tick we'll put up with; the request is for "about a
+ * millisecond", and most kernels tick every 1 to 4. */
+#define COARSE_MAX_RES_NSEC 10000000
+
+static int
+coarse_probe(void)
+{
+	struct timespec ts;
+	return clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0 &&
+	    ts.tv_sec == 0 && ts.tv_nsec <= COARSE_MAX_RES_NSEC &&
+	    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0;
+}
+
+static int
+coarse_gettime(struct timeval *tp)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == -1)
+		return (-1);
+	tp->tv_sec = ts.tv_sec;
+	tp->tv_usec = ts.tv_nsec / 1000;
+	return (0);
+}
+#endif
+
+#ifdef EV_CLOCK_HAVE_TSC
+/*
+ * The TSC clock maps the timestamp counter onto CLOCK_MONOTONIC: ns =
+ * anchor.ns + (tsc - anchor.tsc) * tsc_mult / 2^32.  About once a second
+ * of cycles we read CLOCK_MONOTONIC again and move the anchor there, and
+ * refine tsc_mult over everything since the first anchor, so that error
+ * never builds up past a second's worth of drift.
+ *
+ * The anchor and tsc_mult are guarded by a sequence counter: the writer
+ * makes tsc_seq odd while it changes them, and readers retry if tsc_seq
+ * was odd or changed while they read, so they never see half of an
+ * update however many resyncs happen meanwhile.  Only the thread that wins
+ * tsc_resyncing writes.
+ */
+struct tsc_anchor {
+	ev_uint64_t tsc;
+	ev_uint64_t ns;
+};
+
+static struct tsc_anchor tsc_anchor;
+static volatile unsigned tsc_seq;
+static int tsc_resyncing;
+/* Nanoseconds per cycle, times 2^32. */
+static ev_uint64_t tsc_mult;
+/* Cycles between resyncs. */
+static ev_uint64_t tsc_resync_cycles;
+/* How far, in cycles, another CPU's TSC may be behind the anchor before we
+ * stop treating it as the same instant and resync. */
+static ev_uint64_t tsc_skew_cycles;
+/* The first anchor. */
+static struct tsc_anchor tsc_first;
+/* 0 if we haven't looked yet, 1 if the TSC is usable, -1 if not, and 2
+ * while some thread is calibrating it. */
+static int tsc_state;
+
+static inline ev_uint64_t
+tsc_read(void)
+{
+	unsigned lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((ev_uint64_t)hi << 32) | lo;
+}
+
+static ev_uint64_t
+tsc_mono_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (ev_uint64_t)1000000000 + ts.tv_nsec;
+}
+
+/* Return true iff the CPU promises that the TSC ticks at a constant rate
+ * whatever the power state. */
+static int
+tsc_is_invariant(void)
+{
+	unsigned a, b, c, d;
+
+	__asm__ __volatile__("cpuid"
+	    : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (0x80000000));
+	if (a < 0x80000007)
+		return 0;
+	__asm__ __volatile__("cpuid"
+	    : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (0x80000007));
+	return (d & (1 << 8)) != 0;
+}
+
+static int
+tsc_calibrate(void)
+{
+	ev_uint64_t t0, t1, n0, n1;
+	struct timespec ts;
+
+	if (!tsc_is_invariant() || clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return -1;
+
+	/* A millisecond is enough to start with; every resync makes the
+	 * rate more exact. */
+	t0 = tsc_read();
+	n0 = tsc_mono_ns();
+	do {
+		n1 = tsc_mono_ns();
+	} while (n1 - n0 < 1000000);
+	t1 = tsc_read();
+	if (t1 <= t0)
+		return -1;
+
+	tsc_mult = ((n1 - n0) << 32) / (t1 - t0);
+	tsc_resync_cycles = (t1 - t0) * 1000;
+	tsc_skew_cycles = t1 - t0;
+	tsc_first.tsc = t0;
+	tsc_first.ns = n0;
+	tsc_anchor.tsc = t1;
+	tsc_anchor.ns = n1;
+	return 0;
+}
+
+static int
+tsc_probe(void)
+{
+	if (EVATOMIC_CAS(&tsc_state, 0, 2)) {
+		EVATOMIC_BARRIER();
+		tsc_state = tsc_calibrate() == 0 ? 1 : -1;
+	}
+	while (tsc_state == 2)
+		EVATOMIC_BARRIER();
+	return tsc_state == 1;
+}
+
+/* Read CLOCK_MONOTONIC, and make it the new anchor if nobody else is. */
+static ev_uint64_t
+tsc_resync(void)
+{
+	ev_uint64_t ns = tsc_mono_ns(), t = tsc_read();
+
+	if (!EVATOMIC_CAS(&tsc_resyncing, 0, 1))
+		return ns;
+	++tsc_seq;
+	EVATOMIC_BARRIER();
+	if (t > tsc_first.tsc && ns > tsc_first.ns)
+		tsc_mult = (ev_uint64_t)((double)(ns - tsc_first.ns) /
+		    (double)(t - tsc_first.tsc) * 4294967296.0);
+	tsc_anchor.tsc = t;
+	tsc_anchor.ns = ns;
+	EVATOMIC_BARRIER();
+	++tsc_seq;
+	EVATOMIC_BARRIER();
+	tsc_resyncing = 0;
+	return ns;
+}
+
+static int
+tsc_gettime(struct timeval *tp)
+{
+	struct tsc_anchor a;
+	ev_uint64_t t, mult, ns;
+	unsigned seq;
+
+	do {
+		while ((seq = tsc_seq) & 1)
+			EVATOMIC_BARRIER();
+		EVATOMIC_BARRIER();
+		a = tsc_anchor;
+		mult = tsc_mult;
+		EVATOMIC_BARRIER();
+	} while (seq != tsc_seq);
+	t = tsc_read();
+
+	/* A counter a little behind the anchor means another CPU's TSC is a
+	 * little behind ours: call it the anchor's time rather than resync.
+	 * One far behind or too far ahead means we'd be wrong or overflow. */
+	if (t < a.tsc && a.tsc - t <= tsc_skew_cycles)
+		ns = a.ns;
+	else if (t < a.tsc || t - a.tsc >= tsc_resync_cycles)
+		ns = tsc_resync();
+	else
+		ns = a.ns + (((t - a.tsc) * mult) >> 32);
+	tp->tv_sec = ns / 1000000000;
+	tp->tv_usec = (ns % 1000000000) / 1000;
+	return (0);
+}
+#endif
+
+enum event_clock_source
+ev_clock_probe(enum event_clock_source source)
+{
+	switch (source) {
+#ifdef EV_CLOCK_HAVE_COARSE
+	case EVENT_CLOCK_COARSE:
+		if (coarse_probe())
+			return source;
+		break;
+#endif
+#ifdef EV_CLOCK_HAVE_TSC
+	case EVENT_CLOCK_TSC:
+		if (tsc_probe())
+			return source;
+		break;
+#endif
+	default:
+		break;
+	}
+	return EVENT_CLOCK_DEFAULT;
+}
+
+int
+ev_clock_gettime(enum event_clock_source source, struct timeval *tp)
+{
+	switch (source) {
+#ifdef EV_CLOCK_HAVE_COARSE
+	case EVENT_CLOCK_COARSE:
+		return coarse_gettime(tp);
+#endif
+#ifdef EV_CLOCK_HAVE_TSC
+	case EVENT_CLOCK_TSC:
+		return tsc_gettime(tp);
+#endif
+	default:
+		return (-1);
+	}
+}
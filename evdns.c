@@ -34,15 +34,10 @@
  * Version: 0.1b
  */
 
-#include <sys/types.h>
 #ifdef HAVE_CONFIG_H
 #include "event-config.h"
 #endif
 
-#ifdef DNS_USE_FTIME_FOR_ID
-#include <sys/timeb.h>
-#endif
-
 #ifndef _EVENT_DNS_USE_CPU_CLOCK_FOR_ID
 #ifndef _EVENT_DNS_USE_GETTIMEOFDAY_FOR_ID
 #ifndef DNS_USE_OPENSSL_FOR_ID
@@ -55,10 +50,16 @@
 #endif
 
 /* #define _POSIX_C_SOURCE 200507 */
+/* for strtok_r, and for recvmmsg and sendmmsg, which have to be defined
+ * before any system header */
 #define _GNU_SOURCE
-/* for strtok_r */
 #define _REENTRANT
 
+#include <sys/types.h>
+#ifdef DNS_USE_FTIME_FOR_ID
+#include <sys/timeb.h>
+#endif
+
 #ifdef _EVENT_DNS_USE_CPU_CLOCK_FOR_ID
 #ifdef DNS_USE_OPENSSL_FOR_ID
 #error Multiple id options selected
@@ -97,6 +98,7 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/queue.h>
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -117,6 +119,8 @@
 #include "ipv6-internal.h"
 #include "util-internal.h"
 #include "evthread-internal.h"
+#include "event-internal.h"
+#include "ht-internal.h"
 #ifdef WIN32
 #include <ctype.h>
 #include <windows.h>
@@ -126,6 +130,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #endif
 
 #ifdef _EVENT_HAVE_NETINET_IN6_H
@@ -175,22 +180,41 @@ struct evdns_request {
 	unsigned int request_len;
 	int reissue_count;
 	int tx_count;  /* the number of times that this packet has been sent */
+	struct timeval tx_time;  /* when we last sent it */
 	unsigned int request_type; /* TYPE_PTR or TYPE_A */
 	void *user_pointer;  /* the pointer given to us for this request */
 	evdns_callback_type user_callback;
 	struct nameserver *ns;	/* the server which we last sent it */
+	/* the socket of ns whose id space trans_id is taken from, if any */
+	struct nameserver_socket *sock;
 
 	/* elements used by the searching code */
 	int search_index;
 	struct search_state *search_state;
 	char *search_origname;	/* needs to be free()ed */
 	int search_flags;
+	/* set iff this looks up one of several search names at once */
+	struct search_fanout *fanout;
+	int fanout_index;  /* which of the fanout's names this is */
 
 	/* these objects are kept in a circular list */
 	struct evdns_request *next, *prev;
 
 	struct event timeout_event;
 
+	/* elements used by the answer cache and to share queries */
+	char *cache_name;  /* the lowercased name the user asked for */
+	int cache_search;  /* true iff the name went through the search list */
+	/* set only on handles that have no query of their own, once their
+	 * answer is pending */
+	struct deferred_reply_callback *cache_cb;
+	HT_ENTRY(evdns_request) query_node;
+	char in_query_map;  /* true iff this is in base->queries */
+	/* a circular list of handles waiting on this request's answer */
+	struct evdns_request *waiters;
+	/* for one of those handles: the request it waits on */
+	struct evdns_request *lead;
+
 	u16 trans_id;  /* the transaction id */
 	char request_appended;	/* true if the request pointer is data which follows this struct */
 	char transmit_me;  /* needs to be transmitted */
@@ -216,12 +240,72 @@ struct reply {
 	} data;
 };
 
+/* A cached answer, or a cached failure, for one lookup. */
+struct evdns_cache_entry {
+	HT_ENTRY(evdns_cache_entry) node;
+	TAILQ_ENTRY(evdns_cache_entry) lru;
+	char *name;  /* lowercased; stored after the struct */
+	u16 type;
+	u16 search;  /* true iff the name went through the search list */
+	u32 err;  /* DNS_ERR_NONE if reply holds an answer */
+	time_t expires;  /* in seconds of the event_base's clock */
+	struct reply reply;
+};
+
+/* One name-to-address line of a hosts file; a line with several names
+ * gives one entry per name. */
+struct hosts_entry {
+	/* in base->hosts_addrs iff it is the first entry for its address */
+	HT_ENTRY(hosts_entry) addr_node;
+	struct hosts_entry *next;  /* the next entry for the same name */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[1];  /* as the file spells it; allocated to fit */
+};
+
+/* Every hosts file entry for one name, in the order they appeared. */
+struct hosts_name {
+	HT_ENTRY(hosts_name) node;
+	char *name;  /* lowercased; stored after the struct */
+	struct hosts_entry *head;
+	struct hosts_entry **tail;
+};
+
+/* We keep each nameserver socket at most this full, so that a random
+ * transaction id is free in it at least half the time; once all of a
+ * nameserver's sockets are that full, it gets another one. */
+#define NAMESERVER_SOCKET_MAX_INFLIGHT 32768
+
+/* One of a nameserver's connected UDP sockets.  Each has its own space of
+ * transaction ids. */
+struct nameserver_socket {
+	evutil_socket_t fd;
+	struct event event;
+	struct nameserver *ns;
+	/* The requests holding an id on this socket, indexed by id; this
+	 * has an entry for each of the 65536 ids. */
+	struct evdns_request **reqs;
+	int n_inflight;  /* the number of entries set in reqs */
+	char choked;  /* true if we have an EAGAIN from this socket */
+	char write_waiting;  /* true if we are waiting for EV_WRITE events */
+};
+
 struct nameserver {
-	evutil_socket_t socket;	 /* a connected UDP socket */
+	/* Our sockets to this server.  The first one is opened when the
+	 * server is added and the rest as they are needed. */
+	struct nameserver_socket **sockets;
+	int n_sockets;
 	struct sockaddr_storage address;
+	socklen_t addrlen;
 	int failed_times;  /* number of times which we have given this server a chance */
 	int timedout;  /* number of times in a row a request has timed out */
-	struct event event;
+	/* Smoothed round trip time and its mean deviation, in usec, from
+	 * the replies to requests we only sent once.  srtt is -1 until we
+	 * have seen such a reply. */
+	int srtt;
+	int rttvar;
+	/* Smoothed fraction of our requests that time out, out of 65536. */
+	int loss;
 	/* these objects are kept in a circular list */
 	struct nameserver *next, *prev;
 	struct event timeout_event;  /* used to keep the timeout for */
@@ -230,14 +314,61 @@ struct nameserver {
 	/* Outstanding probe request for this nameserver, if any */
 	struct evdns_request *probe_request;
 	char state;  /* zero if we think that this server is down */
-	char choked;  /* true if we have an EAGAIN from this server's socket */
-	char write_waiting;  /* true if we are waiting for EV_WRITE events */
 	struct evdns_base *base;
 };
 
 
 /* Represents a local port where we're listening for DNS requests. Right now, */
 /* only UDP is supported. */
+/* Structures used to implement name compression: an open-addressed hash
+ * table from each name suffix we have written to where it starts in the
+ * message, so that a later name ending the same way can point at it.  The
+ * suffixes are not copied; the names they are part of must outlive the
+ * table's use.  The slots are kept between messages. */
+struct dnslabel_entry { const char *v; unsigned hash; int pos; };
+struct dnslabel_table {
+	int n_labels; /* number of current entries */
+	int n_slots; /* size of labels: 0, or a power of two */
+	struct dnslabel_entry *labels;
+};
+
+/* The longest response we send over UDP. */
+#define SERVER_RESPONSE_MAX 512
+/* How many sent response buffers a server port keeps for reuse. */
+#define SERVER_FREE_RESPONSES_MAX 64
+
+/* An encoded response that a server port keeps to answer the same question
+ * with again. */
+struct server_answer_entry {
+	HT_ENTRY(server_answer_entry) node;
+	TAILQ_ENTRY(server_answer_entry) lru;
+	char *name;  /* lowercased; stored after the struct */
+	u16 type;
+	u16 dns_question_class;
+	time_t expires;
+	size_t response_len;
+	u8 *response;  /* stored after the name */
+};
+
+/* How many datagrams we read or write with one system call, where the
+ * system lets us. */
+#define EVDNS_BATCH_SIZE 32
+/* The longest DNS message over UDP that we read. */
+#define EVDNS_MAX_PACKET 1500
+
+/* Room to read a batch of datagrams into, allocated the first time a
+ * socket is read, and reused after that. */
+struct evdns_packet_arena {
+	u8 packets[EVDNS_BATCH_SIZE][EVDNS_MAX_PACKET];
+	int lens[EVDNS_BATCH_SIZE];
+	struct sockaddr_storage addrs[EVDNS_BATCH_SIZE];
+	socklen_t addrlens[EVDNS_BATCH_SIZE];
+#ifdef _EVENT_HAVE_RECVMMSG
+	struct iovec iov[EVDNS_BATCH_SIZE];
+	struct mmsghdr msgs[EVDNS_BATCH_SIZE];
+#endif
+};
+
 struct evdns_server_port {
 	evutil_socket_t socket; /* socket we use to read queries and write replies. */
 	int refcnt; /* reference count. */
@@ -249,6 +380,23 @@ struct evdns_server_port {
 	/* circular list of replies that we want to write. */
 	struct server_request *pending_replies;
 	struct event_base *event_base;
+	char reading; /* Are we reading requests?  Replies wait till we're done. */
+	char write_waiting; /* Are we asking for EV_WRITE? */
+	struct evdns_packet_arena *arena; /* what we read requests into */
+	/* name compression state, reused for each response */
+	struct dnslabel_table labels;
+	/* sent response buffers, each SERVER_RESPONSE_MAX long, linked
+	 * through their first bytes */
+	void *free_responses;
+	int n_free_responses;
+
+	/* encoded answers by question; see evdns_server_port_set_answer_cache */
+	HT_HEAD(server_answer_map, server_answer_entry) answers;
+	/* the same, least recently used first */
+	TAILQ_HEAD(server_answer_lru, server_answer_entry) answers_lru;
+	int n_answers;
+	int answers_max; /* 0 if we don't keep answers */
+	int answers_seconds; /* how long to keep each */
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -300,16 +448,14 @@ struct server_request {
 };
 
 struct evdns_base {
-	/* An array of n_req_heads circular lists for inflight requests.
-	 * Each inflight request req is in req_heads[req->trans_id % n_req_heads].
-	 */
-	struct evdns_request **req_heads;
+	/* A circular list of requests that are inflight.  To find one by
+	 * its transaction id, look in the reqs table of its socket. */
+	struct evdns_request *req_inflight_head;
 	/* A circular list of requests that we're waiting to send, but haven't
 	 * sent yet because there are too many requests inflight */
 	struct evdns_request *req_waiting_head;
 	/* A circular list of nameservers. */
 	struct nameserver *server_head;
-	int n_req_heads;
 
 	struct event_base *event_base;
 
@@ -339,6 +485,39 @@ struct evdns_base {
 	socklen_t global_outgoing_addrlen;
 
 	struct search_state *global_search_state;
+	/** How many search-list names to look up at once; 1 or less means
+	 * one after another. */
+	int global_search_parallel;
+
+	/** How many times nameserver_pick has run. */
+	unsigned n_nameserver_picks;
+
+	/** Requests with a query out, by name and type, so that identical
+	 * lookups can wait on them instead of sending their own. */
+	HT_HEAD(evdns_query_map, evdns_request) queries;
+
+	/** Cached answers and failures, by name and type. */
+	HT_HEAD(evdns_cache_map, evdns_cache_entry) cache;
+	/** Cached entries, least recently used first. */
+	TAILQ_HEAD(evdns_cache_lru, evdns_cache_entry) cache_lru;
+	int cache_n_entries;
+	/** Most entries we will cache; 0 turns the cache off. */
+	int cache_max_entries;
+	/** Seconds to remember NXDOMAIN and SERVFAIL answers for. */
+	int cache_negative_ttl;
+
+	/** Hosts file entries by lowercased name, and by address. */
+	HT_HEAD(evdns_hosts_name_map, hosts_name) hosts;
+	HT_HEAD(evdns_hosts_addr_map, hosts_entry) hosts_addrs;
+	/** The hosts file they came from, to reread when it changes. */
+	char *hosts_fname;
+	time_t hosts_mtime;
+	off_t hosts_size;
+	/** When we last looked at whether it changed. */
+	time_t hosts_checked;
+
+	/** What we read replies from the nameservers into. */
+	struct evdns_packet_arena *arena;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -348,20 +527,135 @@ struct evdns_base {
 
 static struct evdns_base *current_base = NULL;
 
+static inline unsigned
+hash_evdns_request(struct evdns_request *req)
+{
+	return ht_string_hash(req->cache_name) ^ (req->request_type << 1) ^
+	    req->cache_search;
+}
+
+static inline int
+eq_evdns_request(struct evdns_request *a, struct evdns_request *b)
+{
+	return a->request_type == b->request_type &&
+	    a->cache_search == b->cache_search &&
+	    !strcmp(a->cache_name, b->cache_name);
+}
+
+HT_PROTOTYPE(evdns_query_map, evdns_request, query_node, hash_evdns_request,
+    eq_evdns_request);
+HT_GENERATE(evdns_query_map, evdns_request, query_node, hash_evdns_request,
+    eq_evdns_request, 0.5, mm_malloc, mm_realloc, mm_free);
+
+static inline unsigned
+hash_evdns_cache_entry(struct evdns_cache_entry *e)
+{
+	return ht_string_hash(e->name) ^ (e->type << 1) ^ e->search;
+}
+
+static inline int
+eq_evdns_cache_entry(struct evdns_cache_entry *a, struct evdns_cache_entry *b)
+{
+	return a->type == b->type && a->search == b->search &&
+	    !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_cache_map, evdns_cache_entry, node, hash_evdns_cache_entry,
+    eq_evdns_cache_entry);
+HT_GENERATE(evdns_cache_map, evdns_cache_entry, node, hash_evdns_cache_entry,
+    eq_evdns_cache_entry, 0.5, mm_malloc, mm_realloc, mm_free);
+
+static inline unsigned
+hash_hosts_name(struct hosts_name *n)
+{
+	return ht_string_hash(n->name);
+}
+
+static inline int
+eq_hosts_name(struct hosts_name *a, struct hosts_name *b)
+{
+	return !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_hosts_name_map, hosts_name, node, hash_hosts_name,
+    eq_hosts_name);
+HT_GENERATE(evdns_hosts_name_map, hosts_name, node, hash_hosts_name,
+    eq_hosts_name, 0.5, mm_malloc, mm_realloc, mm_free);
+
+/* Set *len to the length of the address in e, and return it. */
+static inline const unsigned char *
+hosts_entry_addr(const struct hosts_entry *e, size_t *len)
+{
+	if (e->addr.ss_family == AF_INET6) {
+		*len = 16;
+		return (const unsigned char *)
+		    &((const struct sockaddr_in6 *)&e->addr)->sin6_addr;
+	}
+	*len = 4;
+	return (const unsigned char *)
+	    &((const struct sockaddr_in *)&e->addr)->sin_addr;
+}
+
+static inline unsigned
+hash_hosts_entry(struct hosts_entry *e)
+{
+	size_t i, len;
+	const unsigned char *a = hosts_entry_addr(e, &len);
+	unsigned h = e->addr.ss_family;
+	for (i = 0; i < len; ++i)
+		h = (1000003*h) ^ a[i];
+	return h;
+}
+
+static inline int
+eq_hosts_entry(struct hosts_entry *a, struct hosts_entry *b)
+{
+	size_t len;
+	const unsigned char *aa = hosts_entry_addr(a, &len);
+	return a->addr.ss_family == b->addr.ss_family &&
+	    !memcmp(aa, hosts_entry_addr(b, &len), len);
+}
+
+HT_PROTOTYPE(evdns_hosts_addr_map, hosts_entry, addr_node, hash_hosts_entry,
+    eq_hosts_entry);
+HT_GENERATE(evdns_hosts_addr_map, hosts_entry, addr_node, hash_hosts_entry,
+    eq_hosts_entry, 0.5, mm_malloc, mm_realloc, mm_free);
+
+static inline unsigned
+hash_server_answer_entry(struct server_answer_entry *e)
+{
+	return ht_string_hash(e->name) ^ (e->type << 1) ^
+	    (e->dns_question_class << 17);
+}
+
+static inline int
+eq_server_answer_entry(struct server_answer_entry *a,
+    struct server_answer_entry *b)
+{
+	return a->type == b->type &&
+	    a->dns_question_class == b->dns_question_class &&
+	    !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(server_answer_map, server_answer_entry, node,
+    hash_server_answer_entry, eq_server_answer_entry);
+HT_GENERATE(server_answer_map, server_answer_entry, node,
+    hash_server_answer_entry, eq_server_answer_entry, 0.5, mm_malloc,
+    mm_realloc, mm_free);
+
 /* Given a pointer to an evdns_server_request, get the corresponding */
 /* server_request. */
 #define TO_SERVER_REQUEST(base_ptr)					\
 	((struct server_request*)					\
 	  (((char*)(base_ptr) - evutil_offsetof(struct server_request, base))))
 
-#define REQ_HEAD(base, id) ((base)->req_heads[id % (base)->n_req_heads])
-
 /* These are the timeout values for nameservers. If we find a nameserver is down */
 /* we try to probe it at intervals as given below. Values are in seconds. */
 static const struct timeval global_nameserver_timeouts[] = {{10, 0}, {60, 0}, {300, 0}, {900, 0}, {3600, 0}};
 static const int global_nameserver_timeouts_length = sizeof(global_nameserver_timeouts)/sizeof(struct timeval);
 
 static struct nameserver *nameserver_pick(struct evdns_base *base);
+static void nameserver_note_reply(struct evdns_request *req);
 static void evdns_request_insert(struct evdns_request *req, struct evdns_request **head);
 static void evdns_request_remove(struct evdns_request *req, struct evdns_request **head);
 static void nameserver_ready_callback(evutil_socket_t fd, short events, void *arg);
@@ -370,15 +664,23 @@ static int evdns_request_transmit(struct evdns_request *req);
 static void nameserver_send_probe(struct nameserver *const ns);
 static void search_request_finished(struct evdns_request *const);
 static int search_try_next(struct evdns_request *const req);
+static void search_fanout_done(struct evdns_request *req, u32 ttl, u32 err, struct reply *reply);
+static void search_fanout_detach(struct evdns_request *req);
+static struct evdns_request *evdns_hosts_lookup(struct evdns_base *base, int type, const char *name, evdns_callback_type callback, void *ptr);
+static struct evdns_request *evdns_hosts_lookup_reverse(struct evdns_base *base, const struct sockaddr *sa, socklen_t len, evdns_callback_type callback, void *ptr);
 static struct evdns_request *search_request_new(struct evdns_base *base, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg);
 static void evdns_requests_pump_waiting_queue(struct evdns_base *base);
-static u16 transaction_id_pick(struct evdns_base *base);
+static int request_assign_id(struct evdns_request *req, struct nameserver *ns);
+static void request_release_id(struct evdns_request *req);
 static struct evdns_request *request_new(struct evdns_base *base, int type, const char *name, int flags, evdns_callback_type callback, void *ptr);
 static void request_submit(struct evdns_request *const req);
 
 static int server_request_free(struct server_request *req);
 static void server_request_free_answers(struct server_request *req);
 static void server_port_free(struct evdns_server_port *port);
+static void server_port_flush(struct evdns_server_port *port);
+static int server_answer_lookup(struct server_request *req);
+static void server_answer_trim(struct evdns_server_port *port, int n);
 static void server_port_ready_callback(evutil_socket_t fd, short events, void *arg);
 static int evdns_base_resolv_conf_parse_impl(struct evdns_base *base, int flags, const char *const filename);
 static int evdns_base_set_option_impl(struct evdns_base *base,
@@ -506,24 +808,12 @@ _evdns_log(int warn, const char *fmt, ...)
 
 #define log _evdns_log
 
-/* This walks the list of inflight requests to find the */
-/* one with a matching transaction id. Returns NULL on */
-/* failure */
+/* This finds the inflight request with a given transaction id on a */
+/* given socket. Returns NULL on failure */
 static struct evdns_request *
-request_find_from_trans_id(struct evdns_base *base, u16 trans_id) {
-	struct evdns_request *req = REQ_HEAD(base, trans_id);
-	struct evdns_request *const started_at = req;
-
-	ASSERT_LOCKED(base);
-
-	if (req) {
-		do {
-			if (req->trans_id == trans_id) return req;
-			req = req->next;
-		} while (req != started_at);
-	}
-
-	return NULL;
+request_find_from_trans_id(struct nameserver_socket *s, u16 trans_id) {
+	ASSERT_LOCKED(s->ns->base);
+	return s->reqs[trans_id];
 }
 
 /* a libevent callback function which is called when a nameserver */
@@ -571,9 +861,8 @@ nameserver_probe_failed(struct nameserver *const ns) {
 /* many packets have timed out etc */
 static void
 nameserver_failed(struct nameserver *const ns, const char *msg) {
-	struct evdns_request *req, *started_at;
+	struct evdns_request *req;
 	struct evdns_base *base = ns->base;
-	int i;
 
 	ASSERT_LOCKED(base);
 	/* if this nameserver has already been marked as failed */
@@ -606,18 +895,16 @@ nameserver_failed(struct nameserver *const ns, const char *msg) {
 	/* trying to reassign requests to one */
 	if (!base->global_good_nameservers) return;
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		req = started_at = base->req_heads[i];
-		if (req) {
-			do {
-				if (req->tx_count == 0 && req->ns == ns) {
-					/* still waiting to go out, can be moved */
-					/* to another server */
-					req->ns = nameserver_pick(base);
-				}
-				req = req->next;
-			} while (req != started_at);
-		}
+	if ((req = base->req_inflight_head)) {
+		do {
+			if (req->tx_count == 0 && req->ns == ns) {
+				/* still waiting to go out, can be moved */
+				/* to another server */
+				(void) request_assign_id(req,
+				    nameserver_pick(base));
+			}
+			req = req->next;
+		} while (req != base->req_inflight_head);
 	}
 }
 
@@ -658,6 +945,18 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 	log(EVDNS_LOG_DEBUG, "Removing timeout for request %lx",
 	    (unsigned long) req);
 	search_request_finished(req);
+	request_release_id(req);
+	if (req->in_query_map)
+		HT_REMOVE(evdns_query_map, &base->queries, req);
+	if (req->cache_name)
+		mm_free(req->cache_name);
+	while (req->waiters) {
+		/* Only left here when the base is freed without failing its
+		 * requests. */
+		struct evdns_request *w = req->waiters;
+		evdns_request_remove(w, &req->waiters);
+		mm_free(w);
+	}
 	if (was_inflight) {
 		evtimer_del(&req->timeout_event);
 		base->global_requests_inflight--;
@@ -687,17 +986,20 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 static int
 request_reissue(struct evdns_request *req) {
 	const struct nameserver *const last_ns = req->ns;
+	struct nameserver *ns;
 	ASSERT_LOCKED(req->base);
 	/* the last nameserver should have been marked as failing */
 	/* by the caller of this function, therefore pick will try */
 	/* not to return it */
-	req->ns = nameserver_pick(req->base);
-	if (req->ns == last_ns) {
+	ns = nameserver_pick(req->base);
+	if (ns == last_ns) {
 		/* ... but pick did return it */
 		/* not a lot of point in trying again with the */
 		/* same server */
 		return 1;
 	}
+	if (request_assign_id(req, ns) < 0)
+		return 1;
 
 	req->reissue_count++;
 	req->tx_count = 0;
@@ -710,25 +1012,31 @@ request_reissue(struct evdns_request *req) {
 /* requests from the waiting queue if it can. */
 static void
 evdns_requests_pump_waiting_queue(struct evdns_base *base) {
+	int pumped = 0;
 	ASSERT_LOCKED(base);
 	while (base->global_requests_inflight < base->global_max_requests_inflight &&
 		   base->global_requests_waiting) {
 		struct evdns_request *req;
+		struct nameserver *ns;
 		/* move a request from the waiting queue to the inflight queue */
 		assert(base->req_waiting_head);
 		req = base->req_waiting_head;
+		if (!(ns = nameserver_pick(base)) ||
+		    request_assign_id(req, ns) < 0)
+			break;
 		evdns_request_remove(req, &base->req_waiting_head);
 
 		base->global_requests_waiting--;
 		base->global_requests_inflight++;
 
-		req->ns = nameserver_pick(base);
-		request_trans_id_set(req, transaction_id_pick(base));
-
-		evdns_request_insert(req, &REQ_HEAD(base, req->trans_id));
+		evdns_request_insert(req, &base->req_inflight_head);
 		evdns_request_transmit(req);
-		evdns_transmit(base);
+		pumped = 1;
 	}
+	/* Walking every inflight request is costly once there are many of
+	 * them, so retry the ones that could not go out just once. */
+	if (pumped)
+		evdns_transmit(base);
 }
 
 /* TODO(nickm) document */
@@ -740,6 +1048,8 @@ struct deferred_reply_callback {
 	u32 err;
 	evdns_callback_type user_callback;
 	struct reply reply;
+	/* a cache hit's handle, to be freed once the callback has run */
+	struct evdns_request *handle;
 };
 
 static void
@@ -780,16 +1090,109 @@ reply_run_callback(struct deferred_cb *d, void *user_pointer)
 		assert(0);
 	}
 
+	if (cb->handle)
+		mm_free(cb->handle);
 	mm_free(cb);
 }
 
+/*
+ * The answer cache.  Lookups are keyed on the name the user asked for, so
+ * an answer found through the search list is cached under the short name.
+ */
+
+static time_t
+evdns_cache_now(struct evdns_base *base)
+{
+	struct timeval tv;
+	event_base_gettime_cached(base->event_base, &tv);
+	return tv.tv_sec;
+}
+
 static void
-reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
+evdns_cache_entry_free(struct evdns_base *base, struct evdns_cache_entry *e)
+{
+	HT_REMOVE(evdns_cache_map, &base->cache, e);
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	--base->cache_n_entries;
+	mm_free(e);
+}
+
+/* Evict least recently used entries until at most max are left. */
+static void
+evdns_cache_trim(struct evdns_base *base, int max)
+{
+	struct evdns_cache_entry *e;
+	ASSERT_LOCKED(base);
+	while (base->cache_n_entries > max &&
+	    (e = TAILQ_FIRST(&base->cache_lru)) != NULL)
+		evdns_cache_entry_free(base, e);
+}
+
+/* Copy name into buf, lowercased.  Returns -1 if it does not fit. */
+static int
+evdns_cache_lower(char *buf, size_t buflen, const char *name)
+{
+	size_t i, len = strlen(name);
+	if (len >= buflen)
+		return -1;
+	for (i = 0; i <= len; ++i)
+		buf[i] = EVUTIL_TOLOWER(name[i]);
+	return 0;
+}
+
+/* Remember the outcome of req, if it is one worth caching. */
+static void
+evdns_cache_store(struct evdns_request *req, u32 ttl, u32 err,
+    struct reply *reply)
+{
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry *e, *old;
+	size_t len;
+
+	ASSERT_LOCKED(base);
+	if (base->cache_max_entries <= 0)
+		return;
+	if (err == DNS_ERR_NONE) {
+		if (!reply || !ttl)
+			return;
+	} else if (err == DNS_ERR_NOTEXIST || err == DNS_ERR_SERVERFAILED) {
+		if (base->cache_negative_ttl <= 0)
+			return;
+		ttl = base->cache_negative_ttl;
+	} else {
+		return;
+	}
+
+	len = strlen(req->cache_name);
+	if (!(e = mm_malloc(sizeof(*e) + len + 1)))
+		return;
+	e->name = (char *)(e + 1);
+	memcpy(e->name, req->cache_name, len + 1);
+	e->type = req->request_type;
+	e->search = req->cache_search;
+	e->err = err;
+	e->expires = evdns_cache_now(base) + ttl;
+	if (reply)
+		memcpy(&e->reply, reply, sizeof(struct reply));
+
+	if ((old = HT_FIND(evdns_cache_map, &base->cache, e)) != NULL)
+		evdns_cache_entry_free(base, old);
+	HT_INSERT(evdns_cache_map, &base->cache, e);
+	TAILQ_INSERT_TAIL(&base->cache_lru, e, lru);
+	++base->cache_n_entries;
+	evdns_cache_trim(base, base->cache_max_entries);
+}
+
+/* Schedule req's own callback, and nobody else's. */
+static struct deferred_reply_callback *
+reply_schedule_one(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
 {
 	struct deferred_reply_callback *d = mm_calloc(1, sizeof(*d));
 
 	ASSERT_LOCKED(req->base);
 
+	if (d == NULL)
+		return (NULL);
 	d->request_type = req->request_type;
 	d->user_callback = req->user_callback;
 	d->ttl = ttl;
@@ -802,6 +1205,180 @@ reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struc
 	event_deferred_cb_init(&d->deferred, reply_run_callback,
 	    req->user_pointer);
 	event_deferred_cb_schedule(req->base->event_base, &d->deferred);
+	return (d);
+}
+
+/* Deliver the outcome of req to its callback and to every handle waiting
+ * on it, and cache it if we should. */
+static struct deferred_reply_callback *
+reply_schedule_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *reply)
+{
+	struct deferred_reply_callback *d = NULL;
+
+	ASSERT_LOCKED(req->base);
+
+	if (req->cache_name)
+		evdns_cache_store(req, ttl, err, reply);
+
+	/* A request whose own caller canceled it only runs on for its
+	 * waiters. */
+	if (req->user_callback)
+		d = reply_schedule_one(req, ttl, err, reply);
+
+	while (req->waiters) {
+		struct evdns_request *w = req->waiters;
+		evdns_request_remove(w, &req->waiters);
+		w->lead = NULL;
+		if (!(w->cache_cb = reply_schedule_one(w, ttl, err, reply))) {
+			mm_free(w);
+			continue;
+		}
+		w->cache_cb->handle = w;
+	}
+	return (d);
+}
+
+/* Return a handle for a lookup whose answer we already have, with its
+ * callback scheduled to get that answer, or NULL on error. */
+static struct evdns_request *
+request_answer_now(struct evdns_base *base, int type,
+    evdns_callback_type callback, void *ptr, u32 ttl, u32 err,
+    struct reply *reply)
+{
+	struct evdns_request *req;
+
+	ASSERT_LOCKED(base);
+	if (!(req = mm_calloc(1, sizeof(struct evdns_request))))
+		return NULL;
+	req->base = base;
+	req->request_type = type;
+	req->user_callback = callback;
+	req->user_pointer = ptr;
+	if (!(req->cache_cb = reply_schedule_one(req, ttl, err, reply))) {
+		mm_free(req);
+		return NULL;
+	}
+	req->cache_cb->handle = req;
+	return req;
+}
+
+/* If the cache has a live entry for name, schedule the callback with it
+ * and return a handle for it.  Otherwise return NULL. */
+static struct evdns_request *
+evdns_cache_lookup(struct evdns_base *base, int type, const char *name,
+    int search, evdns_callback_type callback, void *ptr)
+{
+	char buf[HOST_NAME_MAX];
+	struct evdns_cache_entry key, *e;
+	struct evdns_request *req;
+	time_t now;
+
+	ASSERT_LOCKED(base);
+	if (base->cache_max_entries <= 0 ||
+	    evdns_cache_lower(buf, sizeof(buf), name) < 0)
+		return NULL;
+	key.name = buf;
+	key.type = type;
+	key.search = search;
+	if ((e = HT_FIND(evdns_cache_map, &base->cache, &key)) == NULL)
+		return NULL;
+	now = evdns_cache_now(base);
+	if (e->expires <= now) {
+		evdns_cache_entry_free(base, e);
+		return NULL;
+	}
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	TAILQ_INSERT_TAIL(&base->cache_lru, e, lru);
+
+	req = request_answer_now(base, type, callback, ptr,
+	    (u32)(e->expires - now), e->err,
+	    e->err == DNS_ERR_NONE ? &e->reply : NULL);
+	if (req)
+		log(EVDNS_LOG_DEBUG, "Answered %s from the cache", name);
+	return req;
+}
+
+/* If an identical lookup already has a query out, return a handle that
+ * waits on its answer.  Otherwise return NULL. */
+static struct evdns_request *
+evdns_query_join(struct evdns_base *base, int type, const char *name,
+    int search, evdns_callback_type callback, void *ptr)
+{
+	char buf[HOST_NAME_MAX];
+	struct evdns_request key, *lead, *req;
+
+	ASSERT_LOCKED(base);
+	if (evdns_cache_lower(buf, sizeof(buf), name) < 0)
+		return NULL;
+	key.cache_name = buf;
+	key.request_type = type;
+	key.cache_search = search;
+	if ((lead = HT_FIND(evdns_query_map, &base->queries, &key)) == NULL)
+		return NULL;
+
+	if (!(req = mm_calloc(1, sizeof(struct evdns_request))))
+		return NULL;
+	req->base = base;
+	req->request_type = type;
+	req->user_callback = callback;
+	req->user_pointer = ptr;
+	req->lead = lead;
+	evdns_request_insert(req, &lead->waiters);
+	log(EVDNS_LOG_DEBUG, "Sharing the query already out for %s", name);
+	return req;
+}
+
+/* Record the name the user asked req for, so that its outcome can be
+ * cached and identical lookups can wait on it. */
+static void
+evdns_request_set_name(struct evdns_request *req, const char *name,
+    int search)
+{
+	char buf[HOST_NAME_MAX];
+	if (evdns_cache_lower(buf, sizeof(buf), name) < 0)
+		return;
+	if (!(req->cache_name = mm_strdup(buf)))
+		return;
+	req->cache_search = search;
+	HT_INSERT(evdns_query_map, &req->base->queries, req);
+	req->in_query_map = 1;
+}
+
+/* req is being replaced by newreq as a search goes on: move the lookup's
+ * name, and whoever waits on it, over to newreq. */
+static void
+evdns_request_hand_over(struct evdns_request *req, struct evdns_request *newreq)
+{
+	struct evdns_request *w;
+
+	ASSERT_LOCKED(req->base);
+	if (req->in_query_map) {
+		HT_REMOVE(evdns_query_map, &req->base->queries, req);
+		req->in_query_map = 0;
+	}
+	newreq->cache_name = req->cache_name;
+	newreq->cache_search = req->cache_search;
+	req->cache_name = NULL;
+	if (newreq->cache_name) {
+		HT_INSERT(evdns_query_map, &newreq->base->queries, newreq);
+		newreq->in_query_map = 1;
+	}
+	if ((newreq->waiters = req->waiters) != NULL) {
+		w = newreq->waiters;
+		do {
+			w->lead = newreq;
+			w = w->next;
+		} while (w != newreq->waiters);
+		req->waiters = NULL;
+	}
+}
+
+void
+evdns_base_clear_cache(struct evdns_base *base)
+{
+	EVDNS_LOCK(base);
+	evdns_cache_trim(base, 0);
+	EVDNS_UNLOCK(base);
 }
 
 /* this processes a parsed reply packet */
@@ -855,6 +1432,11 @@ reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *
 			nameserver_up(req->ns);
 		}
 
+		if (req->fanout) {
+			/* the search decides what this miss means */
+			search_fanout_done(req, 0, error, NULL);
+			return;
+		}
 		if (req->search_state && req->request_type != TYPE_PTR) {
 			/* if we have a list of domains to search in,
 			 * try the next one */
@@ -864,19 +1446,23 @@ reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *
 				/* the user callback will be made when
 				 * that request (or a */
 				/* child of it) finishes. */
-				request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+				request_finished(req, &req->base->req_inflight_head);
 				return;
 			}
 		}
 
 		/* all else failed. Pass the failure up */
 		reply_schedule_callback(req, 0, error, NULL);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		request_finished(req, &req->base->req_inflight_head);
 	} else {
 		/* all ok, tell the user */
-		reply_schedule_callback(req, ttl, 0, reply);
 		nameserver_up(req->ns);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		if (req->fanout) {
+			search_fanout_done(req, ttl, 0, reply);
+			return;
+		}
+		reply_schedule_callback(req, ttl, 0, reply);
+		request_finished(req, &req->base->req_inflight_head);
 	}
 }
 
@@ -938,7 +1524,7 @@ name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
 
 /* parses a raw request from a nameserver */
 static int
-reply_parse(struct evdns_base *base, u8 *packet, int length) {
+reply_parse(struct evdns_base *base, struct nameserver_socket *s, u8 *packet, int length) {
 	int j = 0, k = 0;  /* index into packet */
 	u16 _t;	 /* used by the macros */
 	u32 _t32;  /* used by the macros */
@@ -963,7 +1549,7 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 	(void) authority; /* suppress "unused variable" warnings. */
 	(void) additional; /* suppress "unused variable" warnings. */
 
-	req = request_find_from_trans_id(base, trans_id);
+	req = request_find_from_trans_id(s, trans_id);
 	if (!req) return -1;
 	assert(req->base == base);
 
@@ -971,6 +1557,7 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 
 	/* If it's not an answer, it doesn't correspond to any request. */
 	if (!(flags & 0x8000)) return -1;  /* must be an answer */
+	nameserver_note_reply(req);
 	if (flags & 0x020f) {
 		/* there was an error */
 		goto err;
@@ -1163,6 +1750,11 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port, struct soc
 		return -1;
 	}
 
+	if (port->answers_max && server_answer_lookup(server_req)) {
+		evdns_server_request_respond(&(server_req->base), 0);
+		return 0;
+	}
+
 	port->user_callback(&(server_req->base), port->user_data);
 
 	return 0;
@@ -1271,33 +1863,216 @@ evdns_set_random_bytes_fn(void (*fn)(char *, size_t))
 	trans_id_function = trans_id_from_random_bytes_fn;
 }
 
-/* Try to choose a strong transaction id which isn't already in flight */
-static u16
-transaction_id_pick(struct evdns_base *base) {
+/* Open another socket to ns.  Returns NULL on failure. */
+static struct nameserver_socket *
+nameserver_socket_open(struct nameserver *ns)
+{
+	struct evdns_base *base = ns->base;
+	struct nameserver_socket *s, **sockets;
+
 	ASSERT_LOCKED(base);
-	for (;;) {
-		u16 trans_id = trans_id_function();
+	sockets = mm_realloc(ns->sockets,
+	    (ns->n_sockets + 1) * sizeof(struct nameserver_socket *));
+	if (!sockets)
+		return NULL;
+	ns->sockets = sockets;
+	if (!(s = mm_calloc(1, sizeof(struct nameserver_socket))))
+		return NULL;
+	if (!(s->reqs = mm_calloc(65536, sizeof(struct evdns_request *))))
+		goto err;
+	s->ns = ns;
 
-		if (trans_id == 0xffff) continue;
-		/* now check to see if that id is already inflight */
-		if (request_find_from_trans_id(base, trans_id) == NULL)
-			return trans_id;
+	s->fd = socket(ns->address.ss_family, SOCK_DGRAM, 0);
+	if (s->fd < 0)
+		goto err;
+	evutil_make_socket_nonblocking(s->fd);
+	if (base->global_outgoing_addrlen &&
+	    bind(s->fd, (struct sockaddr*)&base->global_outgoing_address,
+		base->global_outgoing_addrlen) < 0) {
+		log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
+		goto err;
 	}
+	if (connect(s->fd, (struct sockaddr*)&ns->address,
+		ns->addrlen) != 0)
+		goto err;
+	event_assign(&s->event, base->event_base, s->fd, EV_READ | EV_PERSIST,
+	    nameserver_ready_callback, s);
+	if (event_add(&s->event, NULL) < 0)
+		goto err;
+
+	ns->sockets[ns->n_sockets++] = s;
+	log(EVDNS_LOG_DEBUG, "Opened socket %d to nameserver %s",
+	    ns->n_sockets, debug_ntop((struct sockaddr *)&ns->address));
+	return s;
+err:
+	if (s->fd >= 0)
+		CLOSE_SOCKET(s->fd);
+	if (s->reqs)
+		mm_free(s->reqs);
+	mm_free(s);
+	return NULL;
 }
 
-/* choose a namesever to use. This function will try to ignore */
-/* nameservers which we think are down and load balance across the rest */
-/* by updating the server_head global each time. */
-static struct nameserver *
-nameserver_pick(struct evdns_base *base) {
-	struct nameserver *started_at = base->server_head, *picked;
-	ASSERT_LOCKED(base);
-	if (!base->server_head) return NULL;
+/* Close all the sockets of ns.  Requests holding ids on them must have
+ * let go of them already. */
+static void
+nameserver_sockets_free(struct nameserver *ns)
+{
+	int i;
+	for (i = 0; i < ns->n_sockets; ++i) {
+		struct nameserver_socket *s = ns->sockets[i];
+		(void) event_del(&s->event);
+		CLOSE_SOCKET(s->fd);
+		mm_free(s->reqs);
+		mm_free(s);
+	}
+	if (ns->sockets)
+		mm_free(ns->sockets);
+	ns->sockets = NULL;
+	ns->n_sockets = 0;
+}
+
+/* Give req to ns, with a random transaction id that is free on one of
+ * its sockets.  Returns -1 if we could not open a socket that had room,
+ * in which case req keeps whatever it had. */
+static int
+request_assign_id(struct evdns_request *req, struct nameserver *ns)
+{
+	struct nameserver_socket *s = NULL;
+	u16 trans_id;
+	int i;
 
-	/* if we don't have any good nameservers then there's no */
-	/* point in trying to find one. */
-	if (!base->global_good_nameservers) {
-		base->server_head = base->server_head->next;
+	ASSERT_LOCKED(req->base);
+	for (i = 0; i < ns->n_sockets; ++i) {
+		if (ns->sockets[i]->n_inflight < NAMESERVER_SOCKET_MAX_INFLIGHT) {
+			s = ns->sockets[i];
+			break;
+		}
+	}
+	if (!s && !(s = nameserver_socket_open(ns)))
+		return -1;
+
+	request_release_id(req);
+	do {
+		trans_id = trans_id_function();
+	} while (trans_id == 0xffff || s->reqs[trans_id]);
+	s->reqs[trans_id] = req;
+	++s->n_inflight;
+	req->sock = s;
+	req->ns = ns;
+	request_trans_id_set(req, trans_id);
+	return 0;
+}
+
+/* Give back the transaction id of req, if it has one. */
+static void
+request_release_id(struct evdns_request *req)
+{
+	struct nameserver_socket *s = req->sock;
+	if (!s)
+		return;
+	assert(s->reqs[req->trans_id] == req);
+	s->reqs[req->trans_id] = NULL;
+	--s->n_inflight;
+	req->sock = NULL;
+}
+
+/* Send one request in this many to the next server in turn rather than to
+ * the fastest one, so that we notice when another becomes faster. */
+#define NAMESERVER_EXPLORE_EVERY 16
+/* However fast a server has been, give it at least this long to reply. */
+#define NAMESERVER_MIN_TIMEOUT_USEC 100000
+
+/* Take note that the server of req has answered it. */
+static void
+nameserver_note_reply(struct evdns_request *req)
+{
+	struct nameserver *ns = req->ns;
+	struct timeval now;
+	int rtt, delta;
+
+	ASSERT_LOCKED(req->base);
+	ns->loss -= ns->loss >> 3;
+	/* If we sent it more than once, we can't tell which send this
+	 * answers. */
+	if (req->tx_count != 1)
+		return;
+	event_base_gettime_cached(req->base->event_base, &now);
+	evutil_timersub(&now, &req->tx_time, &now);
+	if (now.tv_sec < 0 || now.tv_sec > 60)
+		return;
+	rtt = now.tv_sec * 1000000 + now.tv_usec;
+	if (ns->srtt < 0) {
+		ns->srtt = rtt;
+		ns->rttvar = rtt / 2;
+	} else {
+		delta = rtt - ns->srtt;
+		ns->srtt += delta / 8;
+		ns->rttvar += ((delta < 0 ? -delta : delta) - ns->rttvar) / 4;
+	}
+}
+
+/* Take note that a request to ns has timed out. */
+static void
+nameserver_note_timeout(struct nameserver *ns)
+{
+	ns->loss += (65536 - ns->loss) >> 3;
+	/* Back off, or we would keep timing out requests to a server that
+	 * has become slower and never get a reply we can measure. */
+	if (ns->srtt >= 0 && ns->rttvar < 30000000)
+		ns->rttvar = ns->rttvar * 2 + NAMESERVER_MIN_TIMEOUT_USEC / 4;
+}
+
+/* Set *tv to how long to wait for a reply to req before we send it again:
+ * a little over the round trip time of its server, doubled for each time
+ * we have sent it already, and no longer than the configured timeout. */
+static void
+request_timeout_get(struct evdns_request *req, struct timeval *tv)
+{
+	const struct timeval *max = &req->base->global_timeout;
+	const struct nameserver *ns = req->ns;
+	ev_int64_t usec;
+
+	if (ns->srtt < 0 || req->tx_count > 20) {
+		*tv = *max;
+		return;
+	}
+	usec = ns->srtt + 4 * (ev_int64_t)ns->rttvar;
+	if (usec < NAMESERVER_MIN_TIMEOUT_USEC)
+		usec = NAMESERVER_MIN_TIMEOUT_USEC;
+	usec <<= req->tx_count;
+	if (usec >= max->tv_sec * (ev_int64_t)1000000 + max->tv_usec) {
+		*tv = *max;
+		return;
+	}
+	tv->tv_sec = (long)(usec / 1000000);
+	tv->tv_usec = (long)(usec % 1000000);
+}
+
+/* How long we expect a request to ns to take, counting the timeouts it
+ * loses requests to.  -1 if we have not measured it yet, so that we will. */
+static ev_int64_t
+nameserver_score(const struct nameserver *ns, const struct timeval *timeout)
+{
+	if (ns->srtt < 0)
+		return -1;
+	return ns->srtt + ((ns->loss *
+		(timeout->tv_sec * (ev_int64_t)1000000 + timeout->tv_usec)) >> 16);
+}
+
+/* choose a namesever to use. This function will try to ignore */
+/* nameservers which we think are down and load balance across the rest */
+/* by updating the server_head global each time. */
+static struct nameserver *
+nameserver_pick_next(struct evdns_base *base) {
+	struct nameserver *started_at = base->server_head, *picked;
+	ASSERT_LOCKED(base);
+	if (!base->server_head) return NULL;
+
+	/* if we don't have any good nameservers then there's no */
+	/* point in trying to find one. */
+	if (!base->global_good_nameservers) {
+		base->server_head = base->server_head->next;
 		return base->server_head;
 	}
 
@@ -1323,113 +2098,268 @@ nameserver_pick(struct evdns_base *base) {
 	}
 }
 
+/* choose a nameserver to use: the good one we expect to answer soonest, */
+/* or now and then the next one in turn. */
+static struct nameserver *
+nameserver_pick(struct evdns_base *base) {
+	struct nameserver *ns, *best = NULL;
+	ev_int64_t score, best_score = 0;
+	ASSERT_LOCKED(base);
+	if (!base->server_head) return NULL;
+
+	if (!base->global_good_nameservers ||
+	    ++base->n_nameserver_picks % NAMESERVER_EXPLORE_EVERY == 0)
+		return nameserver_pick_next(base);
+
+	ns = base->server_head;
+	do {
+		if (ns->state) {
+			score = nameserver_score(ns, &base->global_timeout);
+			if (!best || score < best_score) {
+				best = ns;
+				best_score = score;
+			}
+		}
+		ns = ns->next;
+	} while (ns != base->server_head);
+	return best;
+}
+
+static struct evdns_packet_arena *
+evdns_packet_arena_new(void)
+{
+	struct evdns_packet_arena *a = mm_calloc(1, sizeof(*a));
+#ifdef _EVENT_HAVE_RECVMMSG
+	int i;
+	if (!a)
+		return NULL;
+	for (i = 0; i < EVDNS_BATCH_SIZE; ++i) {
+		a->iov[i].iov_base = a->packets[i];
+		a->iov[i].iov_len = EVDNS_MAX_PACKET;
+		a->msgs[i].msg_hdr.msg_name = &a->addrs[i];
+		a->msgs[i].msg_hdr.msg_iov = &a->iov[i];
+		a->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+	return a;
+}
+
+/* Read as many datagrams from fd as are waiting, up to EVDNS_BATCH_SIZE,
+ * into a.  Returns how many we read, or -1 if we read none; a short batch
+ * means there are no more for now. */
+static int
+evdns_packets_recv(evutil_socket_t fd, struct evdns_packet_arena *a)
+{
+	int i, n;
+#ifdef _EVENT_HAVE_RECVMMSG
+	for (i = 0; i < EVDNS_BATCH_SIZE; ++i)
+		a->msgs[i].msg_hdr.msg_namelen = sizeof(a->addrs[i]);
+	n = recvmmsg(fd, a->msgs, EVDNS_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	for (i = 0; i < n; ++i) {
+		a->lens[i] = a->msgs[i].msg_len;
+		a->addrlens[i] = a->msgs[i].msg_hdr.msg_namelen;
+	}
+	return n;
+#else
+	for (n = 0; n < EVDNS_BATCH_SIZE; ++n) {
+		a->addrlens[n] = sizeof(a->addrs[n]);
+		i = recvfrom(fd, (void*)a->packets[n], EVDNS_MAX_PACKET, 0,
+		    (struct sockaddr*)&a->addrs[n], &a->addrlens[n]);
+		if (i < 0)
+			return n ? n : -1;
+		a->lens[n] = i;
+	}
+	return n;
+#endif
+}
+
 /* this is called when a namesever socket is ready for reading */
 static void
-nameserver_read(struct nameserver *ns) {
-	struct sockaddr_storage ss;
-	socklen_t addrlen = sizeof(ss);
-	u8 packet[1500];
-	ASSERT_LOCKED(ns->base);
+nameserver_read(struct nameserver_socket *s) {
+	struct nameserver *ns = s->ns;
+	struct evdns_base *base = ns->base;
+	int i, n;
+	ASSERT_LOCKED(base);
 
-	for (;;) {
-		const int r = recvfrom(ns->socket, packet, sizeof(packet), 0,
-		    (struct sockaddr*)&ss, &addrlen);
-		if (r < 0) {
-			int err = evutil_socket_geterror(ns->socket);
+	if (!base->arena && !(base->arena = evdns_packet_arena_new()))
+		return;
+	do {
+		n = evdns_packets_recv(s->fd, base->arena);
+		if (n < 0) {
+			int err = evutil_socket_geterror(s->fd);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
 			nameserver_failed(ns,
 			    evutil_socket_error_to_string(err));
 			return;
 		}
-		if (!sockaddr_eq((struct sockaddr*)&ss,
-			(struct sockaddr*)&ns->address, 0)) {
-			log(EVDNS_LOG_WARN, "Address mismatch on received "
-			    "DNS packet.  Apparent source was %s",
-			    debug_ntop((struct sockaddr*)&ss));
-			return;
+		for (i = 0; i < n; ++i) {
+			struct sockaddr *sa =
+			    (struct sockaddr*)&base->arena->addrs[i];
+			if (!sockaddr_eq(sa,
+				(struct sockaddr*)&ns->address, 0)) {
+				log(EVDNS_LOG_WARN, "Address mismatch on "
+				    "received DNS packet.  Apparent source "
+				    "was %s", debug_ntop(sa));
+				continue;
+			}
+			ns->timedout = 0;
+			reply_parse(base, s, base->arena->packets[i],
+			    base->arena->lens[i]);
 		}
-
-		ns->timedout = 0;
-		reply_parse(ns->base, packet, r);
-	}
+	} while (n == EVDNS_BATCH_SIZE);
 }
 
-/* Read a packet from a DNS client on a server port s, parse it, and */
+/* Read packets from DNS clients on a server port s, parse them, and */
 /* act accordingly. */
 static void
 server_port_read(struct evdns_server_port *s) {
-	u8 packet[1500];
-	struct sockaddr_storage addr;
-	socklen_t addrlen;
-	int r;
+	struct evdns_packet_arena *a;
+	int i, n;
 	ASSERT_LOCKED(s);
 
-	for (;;) {
-		addrlen = sizeof(struct sockaddr_storage);
-		r = recvfrom(s->socket, packet, sizeof(packet), 0,
-					 (struct sockaddr*) &addr, &addrlen);
-		if (r < 0) {
+	if (!s->arena && !(s->arena = evdns_packet_arena_new()))
+		return;
+	a = s->arena;
+	/* Replies made while we read wait, to be sent together after. */
+	s->reading = 1;
+	do {
+		n = evdns_packets_recv(s->socket, a);
+		if (n < 0) {
 			int err = evutil_socket_geterror(s->socket);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				return;
-			log(EVDNS_LOG_WARN, "Error %s (%d) while reading request.",
-				evutil_socket_error_to_string(err), err);
-			return;
+			if (!EVUTIL_ERR_RW_RETRIABLE(err))
+				log(EVDNS_LOG_WARN, "Error %s (%d) while "
+				    "reading request.",
+				    evutil_socket_error_to_string(err), err);
+			break;
 		}
-		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen);
+		for (i = 0; i < n; ++i)
+			request_parse(a->packets[i], a->lens[i], s,
+			    (struct sockaddr*)&a->addrs[i], a->addrlens[i]);
+	} while (n == EVDNS_BATCH_SIZE && !s->closing);
+	s->reading = 0;
+
+	if (s->pending_replies && !s->write_waiting)
+		server_port_flush(s);
+}
+
+/* Ask for EV_WRITE on a server port iff waiting is true. */
+static void
+server_port_write_waiting(struct evdns_server_port *port, char waiting)
+{
+	ASSERT_LOCKED(port);
+	if (port->write_waiting == waiting)
+		return;
+
+	port->write_waiting = waiting;
+	(void) event_del(&port->event);
+	event_assign(&port->event, port->event_base, port->socket,
+	    (port->closing ? 0 : EV_READ) | (waiting ? EV_WRITE : 0) |
+	    EV_PERSIST, server_port_ready_callback, port);
+	if (event_add(&port->event, NULL) < 0) {
+		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server.");
+		/* ???? Do more? */
 	}
 }
 
+/* Add req to the end of port's pending replies. */
+static void
+server_port_queue_reply(struct evdns_server_port *port,
+    struct server_request *req)
+{
+	if (port->pending_replies) {
+		req->prev_pending = port->pending_replies->prev_pending;
+		req->next_pending = port->pending_replies;
+		req->prev_pending->next_pending =
+			req->next_pending->prev_pending = req;
+	} else {
+		req->prev_pending = req->next_pending = req;
+		port->pending_replies = req;
+	}
+}
+
+/* Send as many of port's pending replies as we can with one call.
+ * Returns how many went, failures included, or -1 if the socket can't
+ * take any now. */
+static int
+server_port_send_batch(struct evdns_server_port *port)
+{
+	struct server_request *req = port->pending_replies;
+	int r;
+#ifdef _EVENT_HAVE_SENDMMSG
+	struct mmsghdr msgs[EVDNS_BATCH_SIZE];
+	struct iovec iov[EVDNS_BATCH_SIZE];
+	int n = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	do {
+		iov[n].iov_base = req->response;
+		iov[n].iov_len = req->response_len;
+		msgs[n].msg_hdr.msg_name = &req->addr;
+		msgs[n].msg_hdr.msg_namelen = req->addrlen;
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		req = req->next_pending;
+	} while (++n < EVDNS_BATCH_SIZE && req != port->pending_replies);
+	r = sendmmsg(port->socket, msgs, n, 0);
+#else
+	r = sendto(port->socket, req->response, req->response_len, 0,
+	    (struct sockaddr*) &req->addr, req->addrlen);
+	if (r >= 0)
+		r = 1;
+#endif
+	if (r < 0) {
+		int err = evutil_socket_geterror(port->socket);
+		if (EVUTIL_ERR_RW_RETRIABLE(err))
+			return -1;
+		/* the first one failed; drop it and carry on */
+		log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
+		r = 1;
+	}
+	return r;
+}
+
 /* Try to write all pending replies on a given DNS server port. */
 static void
 server_port_flush(struct evdns_server_port *port)
 {
 	ASSERT_LOCKED(port);
 	while (port->pending_replies) {
-		struct server_request *req = port->pending_replies;
-		int r = sendto(port->socket, req->response, req->response_len, 0,
-			   (struct sockaddr*) &req->addr, req->addrlen);
-		if (r < 0) {
-			int err = evutil_socket_geterror(port->socket);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				return;
-			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
-		}
-		if (server_request_free(req)) {
-			/* we released the last reference to req->port. */
+		int i, n = server_port_send_batch(port);
+		if (n < 0) {
+			port->choked = 1;
+			server_port_write_waiting(port, 1);
 			return;
 		}
+		for (i = 0; i < n; ++i) {
+			if (server_request_free(port->pending_replies)) {
+				/* we released the last reference to the
+				 * port. */
+				return;
+			}
+		}
 	}
 
 	/* We have no more pending requests; stop listening for 'writeable' events. */
-	(void) event_del(&port->event);
-	event_assign(&port->event, port->event_base,
-				 port->socket, EV_READ | EV_PERSIST,
-				 server_port_ready_callback, port);
-
-	if (event_add(&port->event, NULL) < 0) {
-		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server.");
-		/* ???? Do more? */
-	}
+	server_port_write_waiting(port, 0);
 }
 
 /* set if we are waiting for the ability to write to this server. */
 /* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
 /* we stop these events. */
 static void
-nameserver_write_waiting(struct nameserver *ns, char waiting) {
-	ASSERT_LOCKED(ns->base);
-	if (ns->write_waiting == waiting) return;
-
-	ns->write_waiting = waiting;
-	(void) event_del(&ns->event);
-	event_assign(&ns->event, ns->base->event_base,
-	    ns->socket, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
-	    nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
+nameserver_write_waiting(struct nameserver_socket *s, char waiting) {
+	ASSERT_LOCKED(s->ns->base);
+	if (s->write_waiting == waiting) return;
+
+	s->write_waiting = waiting;
+	(void) event_del(&s->event);
+	event_assign(&s->event, s->ns->base->event_base,
+	    s->fd, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
+	    nameserver_ready_callback, s);
+	if (event_add(&s->event, NULL) < 0) {
 	  log(EVDNS_LOG_WARN, "Error from libevent when adding event for %s",
-	      debug_ntop((struct sockaddr *)&ns->address));
+	      debug_ntop((struct sockaddr *)&s->ns->address));
 	  /* ???? Do more? */
 	}
 }
@@ -1438,20 +2368,21 @@ nameserver_write_waiting(struct nameserver *ns, char waiting) {
 /* a nameserver socket is ready for writing or reading */
 static void
 nameserver_ready_callback(evutil_socket_t fd, short events, void *arg) {
-	struct nameserver *ns = (struct nameserver *) arg;
+	struct nameserver_socket *s = (struct nameserver_socket *) arg;
+	struct evdns_base *base = s->ns->base;
 	(void)fd;
 
-	EVDNS_LOCK(ns->base);
+	EVDNS_LOCK(base);
 	if (events & EV_WRITE) {
-		ns->choked = 0;
-		if (!evdns_transmit(ns->base)) {
-			nameserver_write_waiting(ns, 0);
+		s->choked = 0;
+		if (!evdns_transmit(base)) {
+			nameserver_write_waiting(s, 0);
 		}
 	}
 	if (events & EV_READ) {
-		nameserver_read(ns);
+		nameserver_read(s);
 	}
-	EVDNS_UNLOCK(ns->base);
+	EVDNS_UNLOCK(base);
 }
 
 /* a callback function. Called by libevent when the kernel says that */
@@ -1462,6 +2393,8 @@ server_port_ready_callback(evutil_socket_t fd, short events, void *arg) {
 	(void) fd;
 
 	EVDNS_LOCK(port);
+	/* Keep the port around even if the user closes it meanwhile. */
+	++port->refcnt;
 	if (events & EV_WRITE) {
 		port->choked = 0;
 		server_port_flush(port);
@@ -1469,45 +2402,52 @@ server_port_ready_callback(evutil_socket_t fd, short events, void *arg) {
 	if (events & EV_READ) {
 		server_port_read(port);
 	}
+	if (--port->refcnt == 0) {
+		EVDNS_UNLOCK(port);
+		server_port_free(port);
+		return;
+	}
 	EVDNS_UNLOCK(port);
 }
 
-/* This is an inefficient representation; only use it via the dnslabel_table_*
- * functions, so that is can be safely replaced with something smarter later. */
-#define MAX_LABELS 128
-/* Structures used to implement name compression */
-struct dnslabel_entry { char *v; off_t pos; };
-struct dnslabel_table {
-	int n_labels; /* number of current entries */
-	/* map from name to position in message */
-	struct dnslabel_entry labels[MAX_LABELS];
-};
-
 /* Initialize dnslabel_table. */
 static void
 dnslabel_table_init(struct dnslabel_table *table)
 {
-	table->n_labels = 0;
+	table->n_labels = table->n_slots = 0;
+	table->labels = NULL;
 }
 
-/* Free all storage held by table, but not the table itself. */
+/* Forget every entry in table, but keep its storage for the next message. */
 static void
 dnslabel_clear(struct dnslabel_table *table)
 {
-	int i;
-	for (i = 0; i < table->n_labels; ++i)
-		mm_free(table->labels[i].v);
+	if (table->n_labels)
+		memset(table->labels, 0,
+		    table->n_slots * sizeof(struct dnslabel_entry));
 	table->n_labels = 0;
 }
 
+/* Free all storage held by table, but not the table itself. */
+static void
+dnslabel_table_free(struct dnslabel_table *table)
+{
+	mm_free(table->labels);
+	dnslabel_table_init(table);
+}
+
 /* return the position of the label in the current message, or -1 if the label */
 /* hasn't been used yet. */
 static int
-dnslabel_table_get_pos(const struct dnslabel_table *table, const char *label)
+dnslabel_table_get_pos(const struct dnslabel_table *table, const char *label,
+    unsigned hash)
 {
-	int i;
-	for (i = 0; i < table->n_labels; ++i) {
-		if (!strcmp(label, table->labels[i].v))
+	int i, mask = table->n_slots - 1;
+	if (!table->n_labels)
+		return -1;
+	for (i = hash & mask; table->labels[i].v; i = (i + 1) & mask) {
+		if (table->labels[i].hash == hash &&
+		    !strcmp(label, table->labels[i].v))
 			return table->labels[i].pos;
 	}
 	return -1;
@@ -1515,19 +2455,39 @@ dnslabel_table_get_pos(const struct dnslabel_table *table, const char *label)
 
 /* remember that we've used the label at position pos */
 static int
-dnslabel_table_add(struct dnslabel_table *table, const char *label, off_t pos)
-{
-	char *v;
-	int p;
-	if (table->n_labels == MAX_LABELS)
-		return (-1);
-	v = mm_strdup(label);
-	if (v == NULL)
-		return (-1);
-	p = table->n_labels++;
-	table->labels[p].v = v;
-	table->labels[p].pos = pos;
-
+dnslabel_table_add(struct dnslabel_table *table, const char *label,
+    unsigned hash, off_t pos)
+{
+	int i, mask;
+	if (pos > 0x3fff)
+		return (-1); /* too far in for a pointer to reach */
+	if ((table->n_labels + 1) * 2 > table->n_slots) {
+		int n_slots = table->n_slots ? table->n_slots * 2 : 64;
+		struct dnslabel_entry *labels =
+		    mm_calloc(n_slots, sizeof(struct dnslabel_entry));
+		if (labels == NULL)
+			return (-1);
+		mask = n_slots - 1;
+		for (i = 0; i < table->n_slots; ++i) {
+			int k;
+			if (!table->labels[i].v)
+				continue;
+			for (k = table->labels[i].hash & mask; labels[k].v;
+			     k = (k + 1) & mask)
+				;
+			labels[k] = table->labels[i];
+		}
+		mm_free(table->labels);
+		table->labels = labels;
+		table->n_slots = n_slots;
+	}
+	mask = table->n_slots - 1;
+	for (i = hash & mask; table->labels[i].v; i = (i + 1) & mask)
+		;
+	table->labels[i].v = label;
+	table->labels[i].hash = hash;
+	table->labels[i].pos = pos;
+	++table->n_labels;
 	return (0);
 }
 
@@ -1569,7 +2529,9 @@ dnsname_to_labels(u8 *const buf, size_t buf_len, off_t j,
 
 	for (;;) {
 		const char *const start = name;
-		if (table && (ref = dnslabel_table_get_pos(table, name)) >= 0) {
+		const unsigned hash = table ? ht_string_hash(name) : 0;
+		if (table &&
+		    (ref = dnslabel_table_get_pos(table, name, hash)) >= 0) {
 			APPEND16(ref | 0xc000);
 			return j;
 		}
@@ -1578,7 +2540,7 @@ dnsname_to_labels(u8 *const buf, size_t buf_len, off_t j,
 			const unsigned int label_len = end - start;
 			if (label_len > 63) return -1;
 			if ((size_t)(j+label_len+1) > buf_len) return -2;
-			if (table) dnslabel_table_add(table, start, j);
+			if (table) dnslabel_table_add(table, start, hash, j);
 			buf[j++] = label_len;
 
 			memcpy(buf + j, start, end - start);
@@ -1589,7 +2551,7 @@ dnsname_to_labels(u8 *const buf, size_t buf_len, off_t j,
 			const unsigned int label_len = name - start;
 			if (label_len > 63) return -1;
 			if ((size_t)(j+label_len+1) > buf_len) return -2;
-			if (table) dnslabel_table_add(table, start, j);
+			if (table) dnslabel_table_add(table, start, hash, j);
 			buf[j++] = label_len;
 
 			memcpy(buf + j, start, name - start);
@@ -1667,6 +2629,9 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 	port->user_data = user_data;
 	port->pending_replies = NULL;
 	port->event_base = base;
+	dnslabel_table_init(&port->labels);
+	HT_INIT(server_answer_map, &port->answers);
+	TAILQ_INIT(&port->answers_lru);
 
 	event_assign(&port->event, port->event_base,
 				 port->socket, EV_READ | EV_PERSIST,
@@ -1675,7 +2640,7 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 		mm_free(port);
 		return NULL;
 	}
-	EVTHREAD_ALLOC_LOCK(port->lock);
+	EVTHREAD_ALLOC_LOCK(port->lock, EVTHREAD_LOCK_CATEGORY_EVDNS);
 	return port;
 }
 
@@ -1698,6 +2663,29 @@ evdns_close_server_port(struct evdns_server_port *port)
 	}
 }
 
+/* exported function */
+void
+evdns_server_port_set_answer_cache(struct evdns_server_port *port,
+    int max_answers, int seconds)
+{
+	EVDNS_LOCK(port);
+	if (max_answers < 0 || seconds <= 0)
+		max_answers = 0;
+	port->answers_max = max_answers;
+	port->answers_seconds = seconds;
+	server_answer_trim(port, max_answers);
+	EVDNS_UNLOCK(port);
+}
+
+/* exported function */
+void
+evdns_server_port_clear_answer_cache(struct evdns_server_port *port)
+{
+	EVDNS_LOCK(port);
+	server_answer_trim(port, 0);
+	EVDNS_UNLOCK(port);
+}
+
 /* exported function */
 int
 evdns_server_request_add_reply(struct evdns_server_request *_req, int section, const char *name, int type, int class, int ttl, int datalen, int is_name, const char *data)
@@ -1829,26 +2817,166 @@ evdns_server_request_set_flags(struct evdns_server_request *exreq, int flags)
 	req->base.flags |= flags;
 }
 
+/* Get a SERVER_RESPONSE_MAX-long buffer to build a response in. */
+static void *
+server_port_get_response(struct evdns_server_port *port)
+{
+	void *buf = port->free_responses;
+	if (buf) {
+		memcpy(&port->free_responses, buf, sizeof(void *));
+		--port->n_free_responses;
+		return buf;
+	}
+	return mm_malloc(SERVER_RESPONSE_MAX);
+}
+
+/* Give back a buffer from server_port_get_response() once it's sent. */
+static void
+server_port_put_response(struct evdns_server_port *port, void *buf)
+{
+	if (port->n_free_responses == SERVER_FREE_RESPONSES_MAX) {
+		mm_free(buf);
+		return;
+	}
+	memcpy(buf, &port->free_responses, sizeof(void *));
+	port->free_responses = buf;
+	++port->n_free_responses;
+}
+
+static void
+server_answer_entry_free(struct evdns_server_port *port,
+    struct server_answer_entry *e)
+{
+	HT_REMOVE(server_answer_map, &port->answers, e);
+	TAILQ_REMOVE(&port->answers_lru, e, lru);
+	--port->n_answers;
+	mm_free(e);
+}
+
+/* Drop the least recently used answers until at most n are left. */
+static void
+server_answer_trim(struct evdns_server_port *port, int n)
+{
+	while (port->n_answers > n)
+		server_answer_entry_free(port, TAILQ_FIRST(&port->answers_lru));
+}
+
+/* Remember the response just built for req, if it has one question. */
+static void
+server_answer_store(struct server_request *req)
+{
+	struct evdns_server_port *port = req->port;
+	struct evdns_server_question *q;
+	struct server_answer_entry *e, *old;
+	struct timeval now;
+	size_t namelen;
+
+	ASSERT_LOCKED(port);
+	if (req->base.nquestions != 1)
+		return;
+	q = req->base.questions[0];
+	namelen = strlen(q->name);
+	if (!(e = mm_malloc(sizeof(*e) + namelen + 1 + req->response_len)))
+		return;
+	e->name = (char *)(e + 1);
+	evdns_cache_lower(e->name, namelen + 1, q->name);
+	e->type = q->type;
+	e->dns_question_class = q->dns_question_class;
+	event_base_gettime_cached(port->event_base, &now);
+	e->expires = now.tv_sec + port->answers_seconds;
+	e->response = (u8 *)e->name + namelen + 1;
+	e->response_len = req->response_len;
+	memcpy(e->response, req->response, req->response_len);
+
+	if ((old = HT_FIND(server_answer_map, &port->answers, e)))
+		server_answer_entry_free(port, old);
+	server_answer_trim(port, port->answers_max - 1);
+	HT_INSERT(server_answer_map, &port->answers, e);
+	TAILQ_INSERT_TAIL(&port->answers_lru, e, lru);
+	++port->n_answers;
+}
+
+/* If we kept a response to req's question, make a copy of it req's
+ * response, patched with req's id, RD and CD flags, and spelling of the
+ * question name.  Returns 1 if we did, and 0 if req must be answered the
+ * usual way. */
+static int
+server_answer_lookup(struct server_request *req)
+{
+	struct evdns_server_port *port = req->port;
+	struct server_answer_entry key, *e;
+	const char *name;
+	char buf[256];
+	struct timeval now;
+	u8 *response;
+	u16 id;
+	int j;
+
+	ASSERT_LOCKED(port);
+	if (req->base.nquestions != 1)
+		return 0;
+	name = req->base.questions[0]->name;
+	if (evdns_cache_lower(buf, sizeof(buf), name) < 0)
+		return 0;
+	key.name = buf;
+	key.type = req->base.questions[0]->type;
+	key.dns_question_class = req->base.questions[0]->dns_question_class;
+	if (!(e = HT_FIND(server_answer_map, &port->answers, &key)))
+		return 0;
+	event_base_gettime_cached(port->event_base, &now);
+	if (e->expires <= now.tv_sec) {
+		server_answer_entry_free(port, e);
+		return 0;
+	}
+	if (!(response = server_port_get_response(port)))
+		return 0;
+	TAILQ_REMOVE(&port->answers_lru, e, lru);
+	TAILQ_INSERT_TAIL(&port->answers_lru, e, lru);
+
+	memcpy(response, e->response, e->response_len);
+	id = htons(req->trans_id);
+	memcpy(response, &id, 2);
+	response[2] = (response[2] & ~0x01) | ((req->base.flags >> 8) & 0x01);
+	response[3] = (response[3] & ~0x10) | (req->base.flags & 0x10);
+	/* The question comes first, and is never compressed: copy the
+	 * asker's spelling over each of its labels. */
+	for (j = 12; *name && j < (int)e->response_len && response[j]; ) {
+		int len = response[j++];
+		if (j + len > (int)e->response_len)
+			break;
+		memcpy(response + j, name, len);
+		j += len;
+		name += len;
+		if (*name == '.')
+			++name;
+	}
+	req->response = (char *)response;
+	req->response_len = e->response_len;
+	return 1;
+}
+
 static int
 evdns_server_request_format_response(struct server_request *req, int err)
 {
-	unsigned char buf[1500];
-	size_t buf_len = sizeof(buf);
+	struct evdns_server_port *port = req->port;
+	struct dnslabel_table *table = &port->labels;
+	unsigned char *buf;
+	size_t buf_len = SERVER_RESPONSE_MAX;
 	off_t j = 0, r;
 	u16 _t;
 	u32 _t32;
 	int i;
 	u16 flags;
-	struct dnslabel_table table;
 
 	if (err < 0 || err > 15) return -1;
+	if (!(buf = server_port_get_response(port)))
+		return -1;
 
 	/* Set response bit and error code; copy OPCODE and RD fields from
 	 * question; copy RA and AA if set by caller. */
 	flags = req->base.flags;
 	flags |= (0x8000 | err);
 
-	dnslabel_table_init(&table);
 	APPEND16(req->trans_id);
 	APPEND16(flags);
 	APPEND16(req->base.nquestions);
@@ -1859,9 +2987,10 @@ evdns_server_request_format_response(struct server_request *req, int err)
 	/* Add questions. */
 	for (i=0; i < req->base.nquestions; ++i) {
 		const char *s = req->base.questions[i]->name;
-		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), &table);
+		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), table);
 		if (j < 0) {
-			dnslabel_clear(&table);
+			dnslabel_clear(table);
+			server_port_put_response(port, buf);
 			return (int) j;
 		}
 		APPEND16(req->base.questions[i]->type);
@@ -1878,7 +3007,7 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		else
 			item = req->additional;
 		while (item) {
-			r = dnsname_to_labels(buf, buf_len, j, item->name, strlen(item->name), &table);
+			r = dnsname_to_labels(buf, buf_len, j, item->name, strlen(item->name), table);
 			if (r < 0)
 				goto overflow;
 			j = r;
@@ -1890,7 +3019,7 @@ evdns_server_request_format_response(struct server_request *req, int err)
 				off_t len_idx = j, name_start;
 				j += 2;
 				name_start = j;
-				r = dnsname_to_labels(buf, buf_len, j, item->data, strlen(item->data), &table);
+				r = dnsname_to_labels(buf, buf_len, j, item->data, strlen(item->data), table);
 				if (r < 0)
 					goto overflow;
 				j = r;
@@ -1907,22 +3036,19 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		}
 	}
 
-	if (j > 512) {
+	if (0) {
 overflow:
-		j = 512;
-		buf[3] |= 0x02; /* set the truncated bit. */
+		/* Everything before j was written; blank the rest. */
+		if (j < (off_t)buf_len)
+			memset(buf + j, 0, buf_len - j);
+		j = buf_len;
+		buf[2] |= 0x02; /* set the truncated bit. */
 	}
 
+	req->response = (char *)buf;
 	req->response_len = j;
-
-	if (!(req->response = mm_malloc(req->response_len))) {
-		server_request_free_answers(req);
-		dnslabel_clear(&table);
-		return (-1);
-	}
-	memcpy(req->response, buf, req->response_len);
 	server_request_free_answers(req);
-	dnslabel_clear(&table);
+	dnslabel_clear(table);
 	return (0);
 }
 
@@ -1935,50 +3061,55 @@ evdns_server_request_respond(struct evdns_server_request *_req, int err)
 	int r = -1;
 
 	EVDNS_LOCK(port);
+	/* Freeing req may drop the last other reference to the port. */
+	++port->refcnt;
 	if (!req->response) {
 		if ((r = evdns_server_request_format_response(req, err))<0)
 			goto done;
+		if (port->answers_max)
+			server_answer_store(req);
+	}
+
+	if (port->reading) {
+		/* This goes out with the rest of the batch. */
+		server_port_queue_reply(port, req);
+		r = 0;
+		goto done;
+	}
+	if (port->pending_replies) {
+		/* Others are waiting; this one waits behind them. */
+		server_port_queue_reply(port, req);
+		r = 1;
+		if (!port->write_waiting)
+			server_port_flush(port);
+		goto done;
 	}
 
 	r = sendto(port->socket, req->response, req->response_len, 0,
 			   (struct sockaddr*) &req->addr, req->addrlen);
 	if (r<0) {
 		int sock_err = evutil_socket_geterror(port->socket);
-		if (EVUTIL_ERR_RW_RETRIABLE(sock_err))
+		if (!EVUTIL_ERR_RW_RETRIABLE(sock_err)) {
+			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(sock_err), sock_err);
+			server_request_free(req);
+			r = -1;
 			goto done;
-
-		if (port->pending_replies) {
-			req->prev_pending = port->pending_replies->prev_pending;
-			req->next_pending = port->pending_replies;
-			req->prev_pending->next_pending =
-				req->next_pending->prev_pending = req;
-		} else {
-			req->prev_pending = req->next_pending = req;
-			port->pending_replies = req;
-			port->choked = 1;
-
-			(void) event_del(&port->event);
-			event_assign(&port->event, port->event_base, port->socket, (port->closing?0:EV_READ) | EV_WRITE | EV_PERSIST, server_port_ready_callback, port);
-
-			if (event_add(&port->event, NULL) < 0) {
-				log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server");
-			}
-
 		}
 
+		server_port_queue_reply(port, req);
+		port->choked = 1;
+		server_port_write_waiting(port, 1);
 		r = 1;
 		goto done;
 	}
-	if (server_request_free(req)) {
-		r = 0;
-		goto done;
-	}
-
-	if (port->pending_replies)
-		server_port_flush(port);
-
+	server_request_free(req);
 	r = 0;
 done:
+	if (--port->refcnt == 0) {
+		EVDNS_UNLOCK(port);
+		server_port_free(port);
+		return r;
+	}
 	EVDNS_UNLOCK(port);
 	return r;
 }
@@ -2026,11 +3157,15 @@ server_request_free(struct server_request *req)
 		EVDNS_LOCK(req->port);
 		lock=1;
 		if (req->port->pending_replies == req) {
-			if (req->next_pending)
+			if (req->next_pending && req->next_pending != req)
 				req->port->pending_replies = req->next_pending;
 			else
 				req->port->pending_replies = NULL;
 		}
+		if (req->response) {
+			server_port_put_response(req->port, req->response);
+			req->response = NULL;
+		}
 		rc = --req->port->refcnt;
 	}
 
@@ -2064,11 +3199,23 @@ server_port_free(struct evdns_server_port *port)
 	assert(port);
 	assert(!port->refcnt);
 	assert(!port->pending_replies);
+	/* Delete the event while its fd is still open, or the backend
+	 * cannot forget it and the next socket to get that fd inherits it. */
+	(void) event_del(&port->event);
 	if (port->socket > 0) {
 		CLOSE_SOCKET(port->socket);
 		port->socket = -1;
 	}
-	(void) event_del(&port->event);
+	if (port->arena)
+		mm_free(port->arena);
+	dnslabel_table_free(&port->labels);
+	while (port->free_responses) {
+		void *buf = port->free_responses;
+		memcpy(&port->free_responses, buf, sizeof(void *));
+		mm_free(buf);
+	}
+	server_answer_trim(port, 0);
+	HT_CLEAR(server_answer_map, &port->answers);
 	EVTHREAD_FREE_LOCK(port->lock);
 	mm_free(port);
 }
@@ -2101,12 +3248,14 @@ evdns_server_request_get_requesting_addr(struct evdns_server_request *_req, stru
 static void
 evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	struct evdns_request *const req = (struct evdns_request *) arg;
+	struct evdns_base *base = req->base;
 	(void) fd;
 	(void) events;
 
 	log(EVDNS_LOG_DEBUG, "Request %lx timed out", (unsigned long) arg);
-	EVDNS_LOCK(req->base);
+	EVDNS_LOCK(base);
 
+	nameserver_note_timeout(req->ns);
 	req->ns->timedout++;
 	if (req->ns->timedout > req->base->global_max_nameserver_timeout) {
 		req->ns->timedout = 0;
@@ -2115,14 +3264,19 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 
 	if (req->tx_count >= req->base->global_max_retransmits) {
 		/* this request has failed */
-		reply_schedule_callback(req, 0, DNS_ERR_TIMEOUT, NULL);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id));
+		if (req->fanout) {
+			search_fanout_done(req, 0, DNS_ERR_TIMEOUT, NULL);
+		} else {
+			reply_schedule_callback(req, 0, DNS_ERR_TIMEOUT, NULL);
+			request_finished(req, &base->req_inflight_head);
+		}
 	} else {
 		/* retransmit it */
 		(void) evtimer_del(&req->timeout_event);
 		evdns_request_transmit(req);
 	}
-	EVDNS_UNLOCK(req->base);
+	/* req may be gone by now */
+	EVDNS_UNLOCK(base);
 }
 
 /* try to send a request to a given server. */
@@ -2132,12 +3286,12 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 /*   1 temporary failure */
 /*   2 other failure */
 static int
-evdns_request_transmit_to(struct evdns_request *req, struct nameserver *server) {
+evdns_request_transmit_to(struct evdns_request *req, struct nameserver_socket *s) {
 	int r;
 	ASSERT_LOCKED(req->base);
-	r = send(server->socket, req->request, req->request_len, 0);
+	r = send(s->fd, req->request, req->request_len, 0);
 	if (r < 0) {
-		int err = evutil_socket_geterror(server->socket);
+		int err = evutil_socket_geterror(s->fd);
 		if (EVUTIL_ERR_RW_RETRIABLE(err))
 			return 1;
 		nameserver_failed(req->ns, evutil_socket_error_to_string(err));
@@ -2157,6 +3311,7 @@ evdns_request_transmit_to(struct evdns_request *req, struct nameserver *server)
 /*   1 failed */
 static int
 evdns_request_transmit(struct evdns_request *req) {
+	struct timeval timeout;
 	int retcode = 0, r;
 
 	ASSERT_LOCKED(req->base);
@@ -2165,18 +3320,18 @@ evdns_request_transmit(struct evdns_request *req) {
 	req->transmit_me = 1;
 	if (req->trans_id == 0xffff) abort();
 
-	if (req->ns->choked) {
+	if (req->sock->choked) {
 		/* don't bother trying to write to a socket */
 		/* which we have had EAGAIN from */
 		return 1;
 	}
 
-	r = evdns_request_transmit_to(req, req->ns);
+	r = evdns_request_transmit_to(req, req->sock);
 	switch (r) {
 	case 1:
 		/* temp failure */
-		req->ns->choked = 1;
-		nameserver_write_waiting(req->ns, 1);
+		req->sock->choked = 1;
+		nameserver_write_waiting(req->sock, 1);
 		return 1;
 	case 2:
 		/* failed to transmit the request entirely. */
@@ -2187,7 +3342,9 @@ evdns_request_transmit(struct evdns_request *req) {
 		/* all ok */
 		log(EVDNS_LOG_DEBUG,
 		    "Setting timeout for request %lx", (unsigned long) req);
-		if (evtimer_add(&req->timeout_event, &req->base->global_timeout) < 0) {
+		event_base_gettime_cached(req->base->event_base, &req->tx_time);
+		request_timeout_get(req, &timeout);
+		if (evtimer_add(&req->timeout_event, &timeout) < 0) {
 			log(EVDNS_LOG_WARN,
 		      "Error from libevent when adding timer for request %lx",
 				(unsigned long) req);
@@ -2234,10 +3391,13 @@ nameserver_send_probe(struct nameserver *const ns) {
 
 	req = request_new(ns->base, TYPE_A, "google.com", DNS_QUERY_NO_SEARCH, nameserver_probe_callback, ns);
 	if (!req) return;
-	ns->probe_request = req;
 	/* we force this into the inflight queue no matter what */
-	request_trans_id_set(req, transaction_id_pick(ns->base));
-	req->ns = ns;
+	if (request_assign_id(req, ns) < 0) {
+		request_release_id(req);
+		mm_free(req);
+		return;
+	}
+	ns->probe_request = req;
 	request_submit(req);
 }
 
@@ -2247,22 +3407,19 @@ nameserver_send_probe(struct nameserver *const ns) {
 static int
 evdns_transmit(struct evdns_base *base) {
 	char did_try_to_transmit = 0;
-	int i;
+	struct evdns_request *req;
 
 	ASSERT_LOCKED(base);
-	for (i = 0; i < base->n_req_heads; ++i) {
-		if (base->req_heads[i]) {
-			struct evdns_request *const started_at = base->req_heads[i], *req = started_at;
-			/* first transmit all the requests which are currently waiting */
-			do {
-				if (req->transmit_me) {
-					did_try_to_transmit = 1;
-					evdns_request_transmit(req);
-				}
+	if ((req = base->req_inflight_head)) {
+		/* first transmit all the requests which are currently waiting */
+		do {
+			if (req->transmit_me) {
+				did_try_to_transmit = 1;
+				evdns_request_transmit(req);
+			}
 
-				req = req->next;
-			} while (req != started_at);
-		}
+			req = req->next;
+		} while (req != base->req_inflight_head);
 	}
 
 	return did_try_to_transmit;
@@ -2299,7 +3456,6 @@ int
 evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 {
 	struct nameserver *server, *started_at;
-	int i;
 
 	EVDNS_LOCK(base);
 	server = base->server_head;
@@ -2310,11 +3466,9 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 	}
 	while (1) {
 		struct nameserver *next = server->next;
-		(void) event_del(&server->event);
 		if (evtimer_initialized(&server->timeout_event))
 			(void) evtimer_del(&server->timeout_event);
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
+		nameserver_sockets_free(server);
 		mm_free(server);
 		if (next == started_at)
 			break;
@@ -2323,31 +3477,25 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 	base->server_head = NULL;
 	base->global_good_nameservers = 0;
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		struct evdns_request *req, *req_started_at;
-		req = req_started_at = base->req_heads[i];
-		while (req) {
-			struct evdns_request *next = req->next;
-			req->tx_count = req->reissue_count = 0;
-			req->ns = NULL;
-			/* ???? What to do about searches? */
-			(void) evtimer_del(&req->timeout_event);
-			req->trans_id = 0;
-			req->transmit_me = 0;
-
-			base->global_requests_waiting++;
-			evdns_request_insert(req, &base->req_waiting_head);
-			/* We want to insert these suspended elements at the front of
-			 * the waiting queue, since they were pending before any of
-			 * the waiting entries were added.  This is a circular list,
-			 * so we can just shift the start back by one.*/
-			base->req_waiting_head = base->req_waiting_head->prev;
-
-			if (next == req_started_at)
-				break;
-			req = next;
-		}
-		base->req_heads[i] = NULL;
+	while (base->req_inflight_head) {
+		struct evdns_request *req = base->req_inflight_head;
+		evdns_request_remove(req, &base->req_inflight_head);
+		req->tx_count = req->reissue_count = 0;
+		req->ns = NULL;
+		/* The sockets holding the ids are gone already. */
+		req->sock = NULL;
+		/* ???? What to do about searches? */
+		(void) evtimer_del(&req->timeout_event);
+		req->trans_id = 0;
+		req->transmit_me = 0;
+
+		base->global_requests_waiting++;
+		evdns_request_insert(req, &base->req_waiting_head);
+		/* We want to insert these suspended elements at the front of
+		 * the waiting queue, since they were pending before any of
+		 * the waiting entries were added.  This is a circular list,
+		 * so we can just shift the start back by one.*/
+		base->req_waiting_head = base->req_waiting_head->prev;
 	}
 
 	base->global_requests_inflight = 0;
@@ -2407,32 +3555,14 @@ _evdns_nameserver_add_impl(struct evdns_base *base, const struct sockaddr *addre
 
 	evtimer_assign(&ns->timeout_event, ns->base->event_base, nameserver_prod_callback, ns);
 
-	ns->socket = socket(PF_INET, SOCK_DGRAM, 0);
-	if (ns->socket < 0) { err = 1; goto out1; }
-	evutil_make_socket_nonblocking(ns->socket);
-
-	if (base->global_outgoing_addrlen) {
-		if (bind(ns->socket,
-			(struct sockaddr*)&base->global_outgoing_address,
-			base->global_outgoing_addrlen) < 0) {
-			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
-			err = 2;
-			goto out2;
-		}
-	}
-
-	if (connect(ns->socket, address, addrlen) != 0) {
-		err = 2;
-		goto out2;
-	}
-
 	memcpy(&ns->address, address, addrlen);
-	ns->state = 1;
-	event_assign(&ns->event, ns->base->event_base, ns->socket, EV_READ | EV_PERSIST, nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
+	ns->addrlen = addrlen;
+	ns->srtt = -1;
+	if (!nameserver_socket_open(ns)) {
 		err = 2;
-		goto out2;
+		goto out1;
 	}
+	ns->state = 1;
 
 	log(EVDNS_LOG_DEBUG, "Added nameserver %s", debug_ntop(address));
 
@@ -2453,9 +3583,8 @@ _evdns_nameserver_add_impl(struct evdns_base *base, const struct sockaddr *addre
 
 	return 0;
 
-out2:
-	CLOSE_SOCKET(ns->socket);
 out1:
+	nameserver_sockets_free(ns);
 	mm_free(ns);
 	log(EVDNS_LOG_WARN, "Unable to add nameserver %s: error %d", debug_ntop(address), err);
 	return err;
@@ -2576,7 +3705,7 @@ request_new(struct evdns_base *base, int type, const char *name, int flags,
 
 	const size_t name_len = strlen(name);
 	const size_t request_max_len = evdns_request_len(name_len);
-	const u16 trans_id = issuing_now ? transaction_id_pick(base) : 0xffff;
+	struct nameserver *ns;
 	/* the request data is alloced in a single block with the header */
 	struct evdns_request *const req =
 	    mm_malloc(sizeof(struct evdns_request) + request_max_len);
@@ -2618,19 +3747,22 @@ request_new(struct evdns_base *base, int type, const char *name, int flags,
 	req->request = ((u8 *) req) + sizeof(struct evdns_request);
 	/* denotes that the request data shouldn't be free()ed */
 	req->request_appended = 1;
-	rlen = evdns_request_data_build(name, name_len, trans_id,
+	rlen = evdns_request_data_build(name, name_len, 0xffff,
 	    type, CLASS_INET, req->request, request_max_len);
 	if (rlen < 0)
 		goto err1;
 
 	req->request_len = rlen;
-	req->trans_id = trans_id;
+	req->trans_id = 0xffff;
 	req->tx_count = 0;
 	req->request_type = type;
 	req->user_pointer = user_ptr;
 	req->user_callback = callback;
-	req->ns = issuing_now ? nameserver_pick(base) : NULL;
+	req->ns = NULL;
 	req->next = req->prev = NULL;
+	/* if we can't give it an id now, it waits for one */
+	if (issuing_now && (ns = nameserver_pick(base)))
+		(void) request_assign_id(req, ns);
 
 	return req;
 err1:
@@ -2645,7 +3777,7 @@ request_submit(struct evdns_request *const req) {
 	if (req->ns) {
 		/* if it has a nameserver assigned then this is going */
 		/* straight into the inflight queue */
-		evdns_request_insert(req, &REQ_HEAD(base, req->trans_id));
+		evdns_request_insert(req, &base->req_inflight_head);
 		base->global_requests_inflight++;
 		evdns_request_transmit(req);
 	} else {
@@ -2662,10 +3794,38 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *req)
 		base = req->base;
 
 	EVDNS_LOCK(base);
+	if (req->cache_cb) {
+		/* This was answered from the cache; the request never
+		 * went out, so swap the pending answer for the cancel. */
+		event_deferred_cb_cancel(base->event_base,
+		    &req->cache_cb->deferred);
+		mm_free(req->cache_cb);
+		req->cache_cb = NULL;
+		reply_schedule_one(req, 0, DNS_ERR_CANCEL, NULL);
+		mm_free(req);
+		EVDNS_UNLOCK(base);
+		return;
+	}
+	if (req->lead) {
+		/* This waits on another request's query; stop waiting. */
+		evdns_request_remove(req, &req->lead->waiters);
+		reply_schedule_one(req, 0, DNS_ERR_CANCEL, NULL);
+		mm_free(req);
+		EVDNS_UNLOCK(base);
+		return;
+	}
+	if (req->waiters) {
+		/* Others still want this answer, so the query keeps going;
+		 * only this caller hears that it was canceled. */
+		reply_schedule_one(req, 0, DNS_ERR_CANCEL, NULL);
+		req->user_callback = NULL;
+		EVDNS_UNLOCK(base);
+		return;
+	}
 	reply_schedule_callback(req, 0, DNS_ERR_CANCEL, NULL);
 	if (req->ns) {
 		/* remove from inflight queue */
-		request_finished(req, &REQ_HEAD(base, req->trans_id));
+		request_finished(req, &base->req_inflight_head);
 	} else {
 		/* remove from global_waiting head */
 		request_finished(req, &base->req_waiting_head);
@@ -2678,8 +3838,17 @@ struct evdns_request *
 evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
     evdns_callback_type callback, void *ptr) {
 	struct evdns_request *req;
+	int search = !(flags & DNS_QUERY_NO_SEARCH);
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
 	EVDNS_LOCK(base);
+	if ((req = evdns_hosts_lookup(base, TYPE_A, name, callback, ptr)) ||
+	    (req = evdns_cache_lookup(base, TYPE_A, name, search, callback,
+		    ptr)) ||
+	    (req = evdns_query_join(base, TYPE_A, name, search, callback,
+		    ptr))) {
+		EVDNS_UNLOCK(base);
+		return req;
+	}
 	if (flags & DNS_QUERY_NO_SEARCH) {
 		req =
 			request_new(base, TYPE_A, name, flags, callback, ptr);
@@ -2688,6 +3857,8 @@ evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
 	} else {
 		req = search_request_new(base, TYPE_A, name, flags, callback, ptr);
 	}
+	if (req)
+		evdns_request_set_name(req, name, search);
 	EVDNS_UNLOCK(base);
 	return req;
 }
@@ -2707,8 +3878,17 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
     evdns_callback_type callback, void *ptr)
 {
 	struct evdns_request *req;
+	int search = !(flags & DNS_QUERY_NO_SEARCH);
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
 	EVDNS_LOCK(base);
+	if ((req = evdns_hosts_lookup(base, TYPE_AAAA, name, callback, ptr)) ||
+	    (req = evdns_cache_lookup(base, TYPE_AAAA, name, search, callback,
+		    ptr)) ||
+	    (req = evdns_query_join(base, TYPE_AAAA, name, search, callback,
+		    ptr))) {
+		EVDNS_UNLOCK(base);
+		return req;
+	}
 	if (flags & DNS_QUERY_NO_SEARCH) {
 		req = request_new(base, TYPE_AAAA, name, flags, callback, ptr);
 		if (req)
@@ -2716,6 +3896,8 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
 	} else {
 		req = search_request_new(base,TYPE_AAAA, name, flags, callback, ptr);
 	}
+	if (req)
+		evdns_request_set_name(req, name, search);
 	EVDNS_UNLOCK(base);
 	return req;
 }
@@ -2729,6 +3911,7 @@ int evdns_resolve_ipv6(const char *name, int flags,
 struct evdns_request *
 evdns_base_resolve_reverse(struct evdns_base *base, const struct in_addr *in, int flags, evdns_callback_type callback, void *ptr) {
 	char buf[32];
+	struct sockaddr_in sin;
 	struct evdns_request *req;
 	u32 a;
 	assert(in);
@@ -2739,10 +3922,22 @@ evdns_base_resolve_reverse(struct evdns_base *base, const struct in_addr *in, in
 			(int)(u8)((a>>16)&0xff),
 			(int)(u8)((a>>24)&0xff));
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s (reverse)", buf);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = *in;
 	EVDNS_LOCK(base);
+	if ((req = evdns_hosts_lookup_reverse(base, (struct sockaddr *)&sin,
+		    sizeof(sin), callback, ptr)) ||
+	    (req = evdns_cache_lookup(base, TYPE_PTR, buf, 0, callback, ptr)) ||
+	    (req = evdns_query_join(base, TYPE_PTR, buf, 0, callback, ptr))) {
+		EVDNS_UNLOCK(base);
+		return (req);
+	}
 	req = request_new(base, TYPE_PTR, buf, flags, callback, ptr);
-	if (req)
+	if (req) {
 		request_submit(req);
+		evdns_request_set_name(req, buf, 0);
+	}
 	EVDNS_UNLOCK(base);
 	return (req);
 }
@@ -2757,6 +3952,7 @@ evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *
 	/* 32 nybbles, 32 periods, "ip6.arpa", NUL. */
 	char buf[73];
 	char *cp;
+	struct sockaddr_in6 sin6;
 	struct evdns_request *req;
 	int i;
 	assert(in);
@@ -2771,10 +3967,22 @@ evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *
 	assert(cp + strlen("ip6.arpa") < buf+sizeof(buf));
 	memcpy(cp, "ip6.arpa", strlen("ip6.arpa")+1);
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s (reverse)", buf);
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = *in;
 	EVDNS_LOCK(base);
+	if ((req = evdns_hosts_lookup_reverse(base, (struct sockaddr *)&sin6,
+		    sizeof(sin6), callback, ptr)) ||
+	    (req = evdns_cache_lookup(base, TYPE_PTR, buf, 0, callback, ptr)) ||
+	    (req = evdns_query_join(base, TYPE_PTR, buf, 0, callback, ptr))) {
+		EVDNS_UNLOCK(base);
+		return (req);
+	}
 	req = request_new(base, TYPE_PTR, buf, flags, callback, ptr);
-	if (req)
+	if (req) {
 		request_submit(req);
+		evdns_request_set_name(req, buf, 0);
+	}
 	EVDNS_UNLOCK(base);
 	return (req);
 }
@@ -2939,25 +4147,278 @@ search_make_new(const struct search_state *const state, int n, const char *const
 	const char need_to_append_dot = base_name[base_len - 1] == '.' ? 0 : 1;
 	struct search_domain *dom;
 
-	for (dom = state->head; dom; dom = dom->next) {
-		if (!n--) {
-			/* this is the postfix we want */
-			/* the actual postfix string is kept at the end of the structure */
-			const u8 *const postfix = ((u8 *) dom) + sizeof(struct search_domain);
-			const int postfix_len = dom->len;
-			char *const newname = (char *) mm_malloc(base_len + need_to_append_dot + postfix_len + 1);
-			if (!newname) return NULL;
-			memcpy(newname, base_name, base_len);
-			if (need_to_append_dot) newname[base_len] = '.';
-			memcpy(newname + base_len + need_to_append_dot, postfix, postfix_len);
-			newname[base_len + need_to_append_dot + postfix_len] = 0;
-			return newname;
+	for (dom = state->head; dom; dom = dom->next) {
+		if (!n--) {
+			/* this is the postfix we want */
+			/* the actual postfix string is kept at the end of the structure */
+			const u8 *const postfix = ((u8 *) dom) + sizeof(struct search_domain);
+			const int postfix_len = dom->len;
+			char *const newname = (char *) mm_malloc(base_len + need_to_append_dot + postfix_len + 1);
+			if (!newname) return NULL;
+			memcpy(newname, base_name, base_len);
+			if (need_to_append_dot) newname[base_len] = '.';
+			memcpy(newname + base_len + need_to_append_dot, postfix, postfix_len);
+			newname[base_len + need_to_append_dot + postfix_len] = 0;
+			return newname;
+		}
+	}
+
+	/* we ran off the end of the list and still didn't find the requested string */
+	abort();
+	return NULL; /* unreachable; stops warnings in some compilers. */
+}
+
+/* Looking up several names of a search at once.
+ *
+ * Candidate i is the i'th name that a one-at-a-time search would try.
+ * Up to max_out of them are looked up at a time, in order.  The answer
+ * that counts is that of the first candidate not to miss, so the search
+ * belongs to the request for candidate best, the lowest-numbered one
+ * still out: it holds the user's callback, the name the user asked for,
+ * and anyone waiting on it, and passes them on if it misses. */
+
+#define SEARCH_CAND_PENDING 0
+#define SEARCH_CAND_MISS 1  /* failed; the next candidate may do better */
+#define SEARCH_CAND_FOUND 2
+#define SEARCH_CAND_FATAL 3  /* failed; so does the whole search */
+
+struct search_candidate {
+	struct evdns_request *req;  /* set while it is being looked up */
+	u8 state;  /* one of SEARCH_CAND_* */
+	u32 err;
+	u32 ttl;
+	struct reply *reply;  /* what it found, if it did before best */
+};
+
+struct search_fanout {
+	struct search_state *state;
+	char *origname;
+	int type;
+	int flags;
+	int raw_first;  /* true iff origname itself is tried first */
+	int n;  /* how many candidates are still worth trying */
+	int next;  /* the next candidate to send */
+	int best;  /* every candidate before this one has missed */
+	int n_out;  /* how many candidates are out */
+	int max_out;
+	struct search_candidate *c;
+};
+
+/* Return the name to look up for candidate i of f, or NULL on error. */
+static char *
+search_fanout_name(const struct search_fanout *f, int i)
+{
+	if (f->raw_first) {
+		if (i == 0)
+			return mm_strdup(f->origname);
+		--i;
+	} else if (i == f->state->num_domains) {
+		return mm_strdup(f->origname);
+	}
+	return search_make_new(f->state, i, f->origname);
+}
+
+/* Send candidates, in order, until max_out of them are out. */
+static void
+search_fanout_launch(struct search_fanout *f, struct evdns_base *base)
+{
+	ASSERT_LOCKED(base);
+	while (f->next < f->n && f->n_out < f->max_out) {
+		const int i = f->next++;
+		char *name = search_fanout_name(f, i);
+		struct evdns_request *req = NULL;
+		if (name) {
+			log(EVDNS_LOG_DEBUG, "Search: now trying %s (%d)",
+			    name, i);
+			req = request_new(base, f->type, name, f->flags,
+			    NULL, NULL);
+			mm_free(name);
+		}
+		if (!req) {
+			f->c[i].state = SEARCH_CAND_FATAL;
+			f->c[i].err = DNS_ERR_UNKNOWN;
+			f->n = i + 1;
+			break;
+		}
+		req->fanout = f;
+		req->fanout_index = i;
+		f->c[i].req = req;
+		++f->n_out;
+		request_submit(req);
+	}
+}
+
+/* Stop looking up candidate from and every one after it; none of them
+ * can matter any more. */
+static void
+search_fanout_cancel_from(struct search_fanout *f, int from)
+{
+	int i;
+	for (i = from; i < f->n; ++i) {
+		struct evdns_request *req = f->c[i].req;
+		if (f->c[i].reply) {
+			mm_free(f->c[i].reply);
+			f->c[i].reply = NULL;
+		}
+		if (!req)
+			continue;
+		f->c[i].req = NULL;
+		--f->n_out;
+		req->fanout = NULL;
+		request_finished(req, req->ns ?
+		    &req->base->req_inflight_head :
+		    &req->base->req_waiting_head);
+	}
+	if (from < f->n)
+		f->n = from;
+}
+
+/* Free f, once none of its candidates is out. */
+static void
+search_fanout_free(struct search_fanout *f)
+{
+	int i;
+	assert(f->n_out == 0);
+	for (i = 0; i < f->n; ++i) {
+		if (f->c[i].reply)
+			mm_free(f->c[i].reply);
+	}
+	search_state_decref(f->state);
+	mm_free(f->origname);
+	mm_free(f->c);
+	mm_free(f);
+}
+
+/* Start a search that looks up several of its names at once.  Returns
+ * the request for the first name, which is the one to cancel. */
+static struct evdns_request *
+search_fanout_new(struct evdns_base *base, int type, const char *const name,
+    int flags, evdns_callback_type user_callback, void *user_arg)
+{
+	struct search_state *state = base->global_search_state;
+	struct search_fanout *f;
+	struct evdns_request *req;
+
+	ASSERT_LOCKED(base);
+	if (!(f = mm_calloc(1, sizeof(struct search_fanout))))
+		return NULL;
+	f->n = state->num_domains + 1;
+	if (!(f->c = mm_calloc(f->n, sizeof(struct search_candidate)))) {
+		mm_free(f);
+		return NULL;
+	}
+	if (!(f->origname = mm_strdup(name))) {
+		mm_free(f->c);
+		mm_free(f);
+		return NULL;
+	}
+	f->state = state;
+	state->refcount++;
+	f->type = type;
+	f->flags = flags;
+	f->raw_first = string_num_dots(name) >= state->ndots;
+	f->max_out = base->global_search_parallel;
+
+	search_fanout_launch(f, base);
+	if (!(req = f->c[0].req)) {
+		search_fanout_cancel_from(f, 0);
+		search_fanout_free(f);
+		return NULL;
+	}
+	req->user_callback = user_callback;
+	req->user_pointer = user_arg;
+	return req;
+}
+
+/* req, one of the candidates of a search, has finished with the given
+ * outcome.  Work out what that means for the search, and free req. */
+static void
+search_fanout_done(struct evdns_request *req, u32 ttl, u32 err,
+    struct reply *reply)
+{
+	struct search_fanout *f = req->fanout;
+	struct evdns_base *base = req->base;
+	const int i = req->fanout_index;
+	struct search_candidate *c = &f->c[i];
+	int b;
+
+	ASSERT_LOCKED(base);
+	c->req = NULL;
+	--f->n_out;
+	req->fanout = NULL;
+	c->err = err;
+	c->ttl = ttl;
+	if (err == DNS_ERR_NONE) {
+		c->state = SEARCH_CAND_FOUND;
+		if (i != f->best) {
+			/* Keep it until everything before it has missed. */
+			if ((c->reply = mm_malloc(sizeof(struct reply))))
+				memcpy(c->reply, reply, sizeof(struct reply));
+			else
+				c->state = SEARCH_CAND_FATAL;
+			c->err = c->reply ? DNS_ERR_NONE : DNS_ERR_UNKNOWN;
 		}
+	} else if (err == DNS_ERR_TIMEOUT) {
+		/* A one-at-a-time search gives up here too. */
+		c->state = SEARCH_CAND_FATAL;
+	} else {
+		c->state = SEARCH_CAND_MISS;
 	}
+	if (c->state != SEARCH_CAND_MISS)
+		search_fanout_cancel_from(f, i + 1);
 
-	/* we ran off the end of the list and still didn't find the requested string */
-	abort();
-	return NULL; /* unreachable; stops warnings in some compilers. */
+	if (i != f->best) {
+		/* Someone before this one is still out and owns the search. */
+		search_fanout_launch(f, base);
+		request_finished(req, &base->req_inflight_head);
+		return;
+	}
+
+	for (b = i; b < f->n && f->c[b].state == SEARCH_CAND_MISS; ++b)
+		;
+	if (b < f->n && f->c[b].state == SEARCH_CAND_PENDING)
+		search_fanout_launch(f, base);
+	if (b < f->n && f->c[b].req) {
+		/* The next candidate still out takes the search over. */
+		struct evdns_request *owner = f->c[b].req;
+		owner->user_callback = req->user_callback;
+		owner->user_pointer = req->user_pointer;
+		req->user_callback = NULL;
+		evdns_request_hand_over(req, owner);
+		f->best = b;
+		request_finished(req, &base->req_inflight_head);
+		return;
+	}
+
+	/* The search is over: b found something or failed it, or every
+	 * candidate missed and the last one says why. */
+	if (b == f->n)
+		b = f->n - 1;
+	c = &f->c[b];
+	reply_schedule_callback(req, c->ttl, c->err,
+	    c->err != DNS_ERR_NONE ? NULL : (b == i ? reply : c->reply));
+	search_fanout_cancel_from(f, i + 1);
+	search_fanout_free(f);
+	request_finished(req, &base->req_inflight_head);
+}
+
+/* req, one of the candidates of a search, is being freed by someone
+ * other than the search, as when it is canceled or its base goes away. */
+static void
+search_fanout_detach(struct evdns_request *req)
+{
+	struct search_fanout *f = req->fanout;
+	const int i = req->fanout_index;
+
+	ASSERT_LOCKED(req->base);
+	req->fanout = NULL;
+	f->c[i].req = NULL;
+	--f->n_out;
+	f->c[i].state = SEARCH_CAND_FATAL;
+	f->c[i].err = DNS_ERR_CANCEL;
+	search_fanout_cancel_from(f, i + 1);
+	if (i == f->best)
+		search_fanout_free(f);
 }
 
 static struct evdns_request *
@@ -2969,6 +4430,9 @@ search_request_new(struct evdns_base *base, int type, const char *const name, in
 		 base->global_search_state->num_domains) {
 		/* we have some domains to search */
 		struct evdns_request *req;
+		if (base->global_search_parallel > 1)
+			return search_fanout_new(base, type, name, flags,
+			    user_callback, user_arg);
 		if (string_num_dots(name) >= base->global_search_state->ndots) {
 			req = request_new(base, type, name, flags, user_callback, user_arg);
 			if (!req) return NULL;
@@ -3017,6 +4481,7 @@ search_try_next(struct evdns_request *const req) {
 				newreq = request_new(base, req->request_type, req->search_origname, req->search_flags, req->user_callback, req->user_pointer);
 				log(EVDNS_LOG_DEBUG, "Search: trying raw query %s", req->search_origname);
 				if (newreq) {
+					evdns_request_hand_over(req, newreq);
 					request_submit(newreq);
 					return 0;
 				}
@@ -3036,6 +4501,7 @@ search_try_next(struct evdns_request *const req) {
 		newreq->search_flags = req->search_flags;
 		newreq->search_index = req->search_index;
 		newreq->search_state->refcount++;
+		evdns_request_hand_over(req, newreq);
 		request_submit(newreq);
 		return 0;
 	}
@@ -3045,6 +4511,8 @@ search_try_next(struct evdns_request *const req) {
 static void
 search_request_finished(struct evdns_request *const req) {
 	ASSERT_LOCKED(req->base);
+	if (req->fanout)
+		search_fanout_detach(req);
 	if (req->search_state) {
 		search_state_decref(req->search_state);
 		req->search_state = NULL;
@@ -3115,32 +4583,9 @@ strtoint_clipped(const char *const str, int min, int max)
 static int
 evdns_base_set_max_requests_inflight(struct evdns_base *base, int maxinflight)
 {
-	int old_n_heads = base->n_req_heads, n_heads;
-	struct evdns_request **old_heads = base->req_heads, **new_heads, *req;
-	int i;
-
 	ASSERT_LOCKED(base);
 	if (maxinflight < 1)
 		maxinflight = 1;
-	n_heads = (maxinflight+4) / 5;
-	assert(n_heads > 0);
-	new_heads = mm_malloc(n_heads * sizeof(struct evdns_request*));
-	if (!new_heads)
-		return (-1);
-	for (i=0; i < n_heads; ++i)
-		new_heads[i] = NULL;
-	if (old_heads) {
-		for (i = 0; i < old_n_heads; ++i) {
-			while (old_heads[i]) {
-				req = old_heads[i];
-				evdns_request_remove(req, &old_heads[i]);
-				evdns_request_insert(req, &new_heads[req->trans_id % n_heads]);
-			}
-		}
-		mm_free(old_heads);
-	}
-	base->req_heads = new_heads;
-	base->n_req_heads = n_heads;
 	base->global_max_requests_inflight = maxinflight;
 	return (0);
 }
@@ -3170,6 +4615,12 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		if (!base->global_search_state) base->global_search_state = search_state_new();
 		if (!base->global_search_state) return -1;
 		base->global_search_state->ndots = ndots;
+	} else if (!strncmp(option, "search-parallel:", 16)) {
+		const int n = strtoint(val);
+		if (n == -1) return -1;
+		if (!(flags & DNS_OPTION_SEARCH)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting search fan-out to %d", n);
+		base->global_search_parallel = n;
 	} else if (!strncmp(option, "timeout:", 8)) {
 		const int timeout = strtoint(val);
 		if (timeout == -1) return -1;
@@ -3184,7 +4635,7 @@ evdns_base_set_option_impl(struct evdns_base *base,
 			maxtimeout);
 		base->global_max_nameserver_timeout = maxtimeout;
 	} else if (!strncmp(option, "max-inflight:", 13)) {
-		const int maxinflight = strtoint_clipped(val, 1, 65000);
+		const int maxinflight = strtoint_clipped(val, 1, INT_MAX);
 		if (maxinflight == -1) return -1;
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		log(EVDNS_LOG_DEBUG, "Setting maximum inflight requests to %d",
@@ -3210,6 +4661,19 @@ evdns_base_set_option_impl(struct evdns_base *base,
 			(struct sockaddr*)&base->global_outgoing_address, &len))
 			return -1;
 		base->global_outgoing_addrlen = len;
+	} else if (!strncmp(option, "cache-size:", 11)) {
+		const int size = strtoint(val);
+		if (size == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache size to %d", size);
+		base->cache_max_entries = size;
+		evdns_cache_trim(base, size);
+	} else if (!strncmp(option, "cache-negative-ttl:", 19)) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting negative cache TTL to %d", ttl);
+		base->cache_negative_ttl = ttl;
 	}
 	return 0;
 }
@@ -3548,6 +5012,588 @@ evdns_config_windows_nameservers(struct evdns_base *base)
 }
 #endif
 
+/* Forget every entry read from a hosts file. */
+static void
+evdns_hosts_clear(struct evdns_base *base)
+{
+	struct hosts_name **np, *n;
+	struct hosts_entry *e, *next;
+	ASSERT_LOCKED(base);
+	HT_CLEAR(evdns_hosts_addr_map, &base->hosts_addrs);
+	for (np = HT_START(evdns_hosts_name_map, &base->hosts); np; ) {
+		n = *np;
+		np = HT_NEXT_RMV(evdns_hosts_name_map, &base->hosts, np);
+		for (e = n->head; e; e = next) {
+			next = e->next;
+			mm_free(e);
+		}
+		mm_free(n);
+	}
+}
+
+/* Parse the address on one hosts file line into ss; return its length, or
+ * 0 if it isn't an address we understand. */
+static socklen_t
+evdns_hosts_parse_addr(const char *s, struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (evutil_inet_pton(AF_INET, s,
+		&((struct sockaddr_in *)ss)->sin_addr) == 1) {
+		ss->ss_family = AF_INET;
+		return sizeof(struct sockaddr_in);
+	}
+	if (evutil_inet_pton(AF_INET6, s,
+		&((struct sockaddr_in6 *)ss)->sin6_addr) == 1) {
+		ss->ss_family = AF_INET6;
+		return sizeof(struct sockaddr_in6);
+	}
+	return 0;
+}
+
+/* Add the entries from one hosts file line to base. */
+static void
+evdns_hosts_parse_line(struct evdns_base *base, char *line)
+{
+	static const char *const delims = " \t\r";
+	struct sockaddr_storage ss;
+	socklen_t len;
+	char *strtok_state;
+	char *token, *comment;
+	char buf[HOST_NAME_MAX];
+
+	if ((comment = strchr(line, '#')))
+		*comment = '\0';
+	if (!(token = strtok_r(line, delims, &strtok_state)))
+		return;
+	if (!(len = evdns_hosts_parse_addr(token, &ss)))
+		return;
+	while ((token = strtok_r(NULL, delims, &strtok_state))) {
+		size_t n = strlen(token);
+		struct hosts_name key, *name;
+		struct hosts_entry *e;
+
+		if (evdns_cache_lower(buf, sizeof(buf), token) < 0)
+			continue;
+		key.name = buf;
+		if (!(name = HT_FIND(evdns_hosts_name_map, &base->hosts,
+			    &key))) {
+			if (!(name = mm_malloc(sizeof(*name) + n + 1)))
+				return;
+			name->name = (char *)(name + 1);
+			memcpy(name->name, buf, n + 1);
+			name->head = NULL;
+			name->tail = &name->head;
+			HT_INSERT(evdns_hosts_name_map, &base->hosts, name);
+		}
+		if (!(e = mm_malloc(sizeof(*e) + n)))
+			return;
+		e->next = NULL;
+		memcpy(&e->addr, &ss, len);
+		e->addrlen = len;
+		memcpy(e->name, token, n + 1);
+		*name->tail = e;
+		name->tail = &e->next;
+		/* The first name given for an address is the one a reverse
+		 * lookup finds. */
+		if (!HT_FIND(evdns_hosts_addr_map, &base->hosts_addrs, e))
+			HT_INSERT(evdns_hosts_addr_map, &base->hosts_addrs, e);
+	}
+}
+
+/* Replace base's hosts file entries with those in hosts_fname, and
+ * remember which file that was so we can tell when it changes. */
+static int
+evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname)
+{
+	struct stat st;
+	char *buf, *start, *newline;
+	int fd, n, r;
+	int err = 0;
+
+	ASSERT_LOCKED(base);
+	if (hosts_fname != base->hosts_fname) {
+		char *fname = mm_strdup(hosts_fname);
+		if (!fname)
+			return -1;
+		if (base->hosts_fname)
+			mm_free(base->hosts_fname);
+		base->hosts_fname = fname;
+	}
+	base->hosts_checked = evdns_cache_now(base);
+	base->hosts_mtime = 0;
+	base->hosts_size = 0;
+	evdns_hosts_clear(base);
+	fd = open(hosts_fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	/* hosts files can be long, but not this long */
+	if (fstat(fd, &st) || st.st_size > 16*1024*1024) {
+		err = -1;
+		goto out1;
+	}
+	base->hosts_mtime = st.st_mtime;
+	base->hosts_size = st.st_size;
+	if (!(buf = mm_malloc((size_t)st.st_size + 1))) {
+		err = -1;
+		goto out1;
+	}
+	n = 0;
+	while (n < st.st_size &&
+	    (r = read(fd, buf+n, (size_t)st.st_size-n)) > 0)
+		n += r;
+	buf[n] = '\0';
+
+	for (start = buf; start; start = newline) {
+		if ((newline = strchr(start, '\n')))
+			*newline++ = '\0';
+		evdns_hosts_parse_line(base, start);
+	}
+
+	mm_free(buf);
+out1:
+	close(fd);
+	return err;
+}
+
+/* exported function */
+int
+evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname)
+{
+	int r;
+	if (!hosts_fname)
+		hosts_fname = "/etc/hosts";
+	EVDNS_LOCK(base);
+	r = evdns_base_load_hosts_impl(base, hosts_fname);
+	EVDNS_UNLOCK(base);
+	return r;
+}
+
+/* Reread the hosts file if it has changed since we read it.  We look at
+ * most once a second, so that a lookup rarely costs a stat(). */
+static void
+evdns_hosts_refresh(struct evdns_base *base)
+{
+	struct stat st;
+	time_t now;
+
+	ASSERT_LOCKED(base);
+	if (!base->hosts_fname)
+		return;
+	now = evdns_cache_now(base);
+	if (now == base->hosts_checked)
+		return;
+	base->hosts_checked = now;
+	if (stat(base->hosts_fname, &st) < 0)
+		st.st_mtime = st.st_size = 0;
+	if (st.st_mtime != base->hosts_mtime || st.st_size != base->hosts_size) {
+		log(EVDNS_LOG_DEBUG, "Rereading %s", base->hosts_fname);
+		evdns_base_load_hosts_impl(base, base->hosts_fname);
+	}
+}
+
+/* Return the hosts file entries for name, or NULL if there are none. */
+static struct hosts_name *
+evdns_hosts_find(struct evdns_base *base, const char *name)
+{
+	char buf[HOST_NAME_MAX];
+	struct hosts_name key;
+
+	ASSERT_LOCKED(base);
+	evdns_hosts_refresh(base);
+	if (HT_EMPTY(&base->hosts) ||
+	    evdns_cache_lower(buf, sizeof(buf), name) < 0)
+		return NULL;
+	key.name = buf;
+	return HT_FIND(evdns_hosts_name_map, &base->hosts, &key);
+}
+
+/* If the hosts file has addresses of the given type for name, schedule
+ * the callback with them and return a handle for it.  Otherwise return
+ * NULL, and the nameservers get asked. */
+static struct evdns_request *
+evdns_hosts_lookup(struct evdns_base *base, int type, const char *name,
+    evdns_callback_type callback, void *ptr)
+{
+	struct hosts_name *n;
+	struct hosts_entry *e;
+	struct reply reply;
+	u32 count = 0;
+
+	if (!(n = evdns_hosts_find(base, name)))
+		return NULL;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = type;
+	reply.have_answer = 1;
+	for (e = n->head; e && count < MAX_ADDRS; e = e->next) {
+		if (type == TYPE_A && e->addr.ss_family == AF_INET)
+			reply.data.a.addresses[count++] =
+			    ((struct sockaddr_in *)&e->addr)->sin_addr.s_addr;
+		else if (type == TYPE_AAAA && e->addr.ss_family == AF_INET6)
+			reply.data.aaaa.addresses[count++] =
+			    ((struct sockaddr_in6 *)&e->addr)->sin6_addr;
+	}
+	if (!count)
+		return NULL;
+	if (type == TYPE_A)
+		reply.data.a.addrcount = count;
+	else
+		reply.data.aaaa.addrcount = count;
+	log(EVDNS_LOG_DEBUG, "Answered %s from the hosts file", name);
+	return request_answer_now(base, type, callback, ptr, 0,
+	    DNS_ERR_NONE, &reply);
+}
+
+/* If the hosts file names the address in sa, schedule the callback with
+ * that name and return a handle for it.  Otherwise return NULL. */
+static struct evdns_request *
+evdns_hosts_lookup_reverse(struct evdns_base *base, const struct sockaddr *sa,
+    socklen_t len, evdns_callback_type callback, void *ptr)
+{
+	struct hosts_entry key, *e;
+	struct reply reply;
+
+	ASSERT_LOCKED(base);
+	evdns_hosts_refresh(base);
+	if (HT_EMPTY(&base->hosts_addrs))
+		return NULL;
+	memcpy(&key.addr, sa, len);
+	if (!(e = HT_FIND(evdns_hosts_addr_map, &base->hosts_addrs, &key)))
+		return NULL;
+	memset(&reply, 0, sizeof(reply));
+	reply.type = TYPE_PTR;
+	reply.have_answer = 1;
+	strlcpy(reply.data.ptr.name, e->name, sizeof(reply.data.ptr.name));
+	log(EVDNS_LOG_DEBUG, "Answered %s from the hosts file", e->name);
+	return request_answer_now(base, TYPE_PTR, callback, ptr, 0,
+	    DNS_ERR_NONE, &reply);
+}
+
+/* An evdns_getaddrinfo() in progress.  Answers we have without asking a
+ * nameserver are delivered through the deferred callback; otherwise we
+ * wait for an A and an AAAA lookup, and the request lives until both have
+ * called back, even once it has been canceled. */
+struct evdns_getaddrinfo_request {
+	struct evdns_base *base;
+	/* what to fill the results in with */
+	int socktype;
+	int protocol;
+	ev_uint16_t port;
+
+	evdns_getaddrinfo_cb user_cb;
+	void *user_data;
+
+	int lookups_pending;
+	/* the answers so far, IPv4 addresses first */
+	struct addrinfo *ipv4_res;
+	struct addrinfo *ipv6_res;
+	int err;
+
+	/* for answers that need no lookup */
+	struct deferred_cb deferred;
+	struct addrinfo *res;
+
+	unsigned canceled : 1;
+};
+
+/* exported function */
+void
+evdns_freeaddrinfo(struct addrinfo *ai)
+{
+	struct addrinfo *next;
+	for (; ai; ai = next) {
+		next = ai->ai_next;
+		mm_free(ai);
+	}
+}
+
+/* Append the results for one address at *tail: one entry if the caller
+ * asked for a socket type, and one each for TCP and UDP otherwise.
+ * Returns -1 if we ran out of memory. */
+static int
+evdns_getaddrinfo_add(struct evdns_getaddrinfo_request *data,
+    struct addrinfo ***tail, const struct sockaddr *sa, socklen_t len)
+{
+	static const int types[2][2] = {
+		{ SOCK_STREAM, IPPROTO_TCP }, { SOCK_DGRAM, IPPROTO_UDP } };
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		struct addrinfo *ai;
+		if (data->socktype && i)
+			break;
+		if (!(ai = mm_calloc(1, sizeof(*ai) + len)))
+			return -1;
+		ai->ai_family = sa->sa_family;
+		ai->ai_socktype = data->socktype ? data->socktype : types[i][0];
+		ai->ai_protocol = data->socktype ? data->protocol : types[i][1];
+		ai->ai_addrlen = len;
+		ai->ai_addr = (struct sockaddr *)(ai + 1);
+		memcpy(ai->ai_addr, sa, len);
+		if (sa->sa_family == AF_INET)
+			((struct sockaddr_in *)ai->ai_addr)->sin_port =
+			    htons(data->port);
+		else
+			((struct sockaddr_in6 *)ai->ai_addr)->sin6_port =
+			    htons(data->port);
+		**tail = ai;
+		*tail = &ai->ai_next;
+	}
+	return 0;
+}
+
+static void
+evdns_getaddrinfo_free(struct evdns_getaddrinfo_request *data)
+{
+	evdns_freeaddrinfo(data->ipv4_res);
+	evdns_freeaddrinfo(data->ipv6_res);
+	evdns_freeaddrinfo(data->res);
+	mm_free(data);
+}
+
+/* Deliver an answer we had without asking a nameserver. */
+static void
+evdns_getaddrinfo_deferred_cb(struct deferred_cb *d, void *arg)
+{
+	struct evdns_getaddrinfo_request *data = arg;
+	struct addrinfo *res = data->res;
+
+	data->res = NULL;
+	data->user_cb(data->err, res, data->user_data);
+	evdns_getaddrinfo_free(data);
+}
+
+/* Called when the A or the AAAA lookup is done; once both are, hands the
+ * caller everything they found. */
+static void
+evdns_getaddrinfo_lookup_done(struct evdns_getaddrinfo_request *data,
+    int family, int result, int count, void *addresses)
+{
+	struct addrinfo **tail;
+	struct addrinfo *res;
+	int i;
+
+	EVDNS_LOCK(data->base);
+	--data->lookups_pending;
+	if (data->canceled) {
+		int done = !data->lookups_pending;
+		EVDNS_UNLOCK(data->base);
+		if (done)
+			evdns_getaddrinfo_free(data);
+		return;
+	}
+	EVDNS_UNLOCK(data->base);
+
+	if (result == DNS_ERR_NONE && family == AF_INET) {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		for (tail = &data->ipv4_res, i = 0; i < count; ++i) {
+			sin.sin_addr.s_addr = ((ev_uint32_t *)addresses)[i];
+			if (evdns_getaddrinfo_add(data, &tail,
+				(struct sockaddr *)&sin, sizeof(sin)) < 0)
+				break;
+		}
+	} else if (result == DNS_ERR_NONE) {
+		struct sockaddr_in6 sin6;
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		for (tail = &data->ipv6_res, i = 0; i < count; ++i) {
+			memcpy(&sin6.sin6_addr,
+			    &((struct in6_addr *)addresses)[i],
+			    sizeof(struct in6_addr));
+			if (evdns_getaddrinfo_add(data, &tail,
+				(struct sockaddr *)&sin6, sizeof(sin6)) < 0)
+				break;
+		}
+	} else if (!data->err) {
+		data->err = result;
+	}
+
+	if (data->lookups_pending)
+		return;
+
+	for (tail = &data->ipv4_res; *tail; tail = &(*tail)->ai_next)
+		;
+	*tail = data->ipv6_res;
+	res = data->ipv4_res;
+	data->ipv4_res = data->ipv6_res = NULL;
+	if (res)
+		data->user_cb(DNS_ERR_NONE, res, data->user_data);
+	else
+		data->user_cb(data->err ? data->err : DNS_ERR_NOTEXIST, NULL,
+		    data->user_data);
+	evdns_getaddrinfo_free(data);
+}
+
+static void
+evdns_getaddrinfo_ipv4_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	evdns_getaddrinfo_lookup_done(arg, AF_INET, result, count, addresses);
+}
+
+static void
+evdns_getaddrinfo_ipv6_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	evdns_getaddrinfo_lookup_done(arg, AF_INET6, result, count, addresses);
+}
+
+/* Fill in data->res with the answers for nodename that need no lookup:
+ * the wildcard or loopback address for a NULL name, the name itself when
+ * it is a numeric address, or the hosts file entries for it.  Returns 1
+ * if that settled the matter, and 0 if we have to ask a nameserver. */
+static int
+evdns_getaddrinfo_local(struct evdns_getaddrinfo_request *data,
+    const char *nodename, int family, int flags)
+{
+	struct evdns_base *base = data->base;
+	struct addrinfo **tail = &data->res;
+	struct sockaddr_storage ss;
+	struct hosts_name *n;
+	struct hosts_entry *e;
+	socklen_t len;
+
+	ASSERT_LOCKED(base);
+	if (!nodename) {
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		memset(&sin6, 0, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		if (!(flags & AI_PASSIVE)) {
+			sin.sin_addr.s_addr = htonl(0x7f000001);
+			sin6.sin6_addr.s6_addr[15] = 1;
+		}
+		if (family != AF_INET6 && evdns_getaddrinfo_add(data, &tail,
+			(struct sockaddr *)&sin, sizeof(sin)) < 0)
+			data->err = DNS_ERR_UNKNOWN;
+		else if (family != AF_INET && evdns_getaddrinfo_add(data,
+			&tail, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)
+			data->err = DNS_ERR_UNKNOWN;
+		return 1;
+	}
+
+	if ((len = evdns_hosts_parse_addr(nodename, &ss))) {
+		if (family != AF_UNSPEC && family != ss.ss_family)
+			data->err = DNS_ERR_NOTEXIST;
+		else if (evdns_getaddrinfo_add(data, &tail,
+			(struct sockaddr *)&ss, len) < 0)
+			data->err = DNS_ERR_UNKNOWN;
+		return 1;
+	}
+	if (flags & AI_NUMERICHOST) {
+		data->err = DNS_ERR_NOTEXIST;
+		return 1;
+	}
+
+	if (!(n = evdns_hosts_find(base, nodename)))
+		return 0;
+	/* IPv4 entries first, as with answers from a nameserver */
+	if (family != AF_INET6) {
+		for (e = n->head; e; e = e->next) {
+			if (e->addr.ss_family == AF_INET &&
+			    evdns_getaddrinfo_add(data, &tail,
+				(struct sockaddr *)&e->addr, e->addrlen) < 0)
+				data->err = DNS_ERR_UNKNOWN;
+		}
+	}
+	if (family != AF_INET) {
+		for (e = n->head; e; e = e->next) {
+			if (e->addr.ss_family == AF_INET6 &&
+			    evdns_getaddrinfo_add(data, &tail,
+				(struct sockaddr *)&e->addr, e->addrlen) < 0)
+				data->err = DNS_ERR_UNKNOWN;
+		}
+	}
+	return data->res != NULL || data->err;
+}
+
+/* exported function */
+struct evdns_getaddrinfo_request *
+evdns_getaddrinfo(struct evdns_base *base, const char *nodename,
+    const char *servname, const struct addrinfo *hints,
+    evdns_getaddrinfo_cb cb, void *arg)
+{
+	struct evdns_getaddrinfo_request *data;
+	int family = hints ? hints->ai_family : AF_UNSPEC;
+	int flags = hints ? hints->ai_flags : 0;
+	long port = 0;
+
+	if (servname) {
+		char *end;
+		port = strtol(servname, &end, 10);
+		if (!*servname || *end || port < 0 || port > 65535)
+			return NULL;
+	}
+	if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)
+		return NULL;
+
+	if (!(data = mm_calloc(1, sizeof(*data))))
+		return NULL;
+	data->base = base;
+	data->socktype = hints ? hints->ai_socktype : 0;
+	data->protocol = hints ? hints->ai_protocol : 0;
+	data->port = (ev_uint16_t)port;
+	data->user_cb = cb;
+	data->user_data = arg;
+
+	EVDNS_LOCK(base);
+	if (evdns_getaddrinfo_local(data, nodename, family, flags)) {
+		if (data->err) {
+			evdns_freeaddrinfo(data->res);
+			data->res = NULL;
+		}
+		event_deferred_cb_init(&data->deferred,
+		    evdns_getaddrinfo_deferred_cb, data);
+		event_deferred_cb_schedule(base->event_base, &data->deferred);
+		EVDNS_UNLOCK(base);
+		return data;
+	}
+
+	/* Count both lookups as pending before starting either, so that
+	 * neither callback thinks it is the last. */
+	data->lookups_pending = (family == AF_UNSPEC) ? 2 : 1;
+	if (family != AF_INET6) {
+		if (!evdns_base_resolve_ipv4(base, nodename, 0,
+			evdns_getaddrinfo_ipv4_cb, data))
+			--data->lookups_pending;
+	}
+	if (family != AF_INET) {
+		if (!evdns_base_resolve_ipv6(base, nodename, 0,
+			evdns_getaddrinfo_ipv6_cb, data))
+			--data->lookups_pending;
+	}
+	if (!data->lookups_pending) {
+		EVDNS_UNLOCK(base);
+		mm_free(data);
+		return NULL;
+	}
+	EVDNS_UNLOCK(base);
+	return data;
+}
+
+/* exported function */
+void
+evdns_getaddrinfo_cancel(struct evdns_getaddrinfo_request *data)
+{
+	struct evdns_base *base = data->base;
+
+	EVDNS_LOCK(base);
+	if (!data->lookups_pending) {
+		event_deferred_cb_cancel(base->event_base, &data->deferred);
+		EVDNS_UNLOCK(base);
+		evdns_getaddrinfo_free(data);
+		return;
+	}
+	/* A lookup may have answered already with its callback still
+	 * queued, so we can't safely cancel them; let them finish (their
+	 * answers still go in the cache) and free ourselves after the last. */
+	data->canceled = 1;
+	EVDNS_UNLOCK(base);
+}
+
 struct evdns_base *
 evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 {
@@ -3558,12 +5604,10 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	memset(base, 0, sizeof(struct evdns_base));
 	base->req_waiting_head = NULL;
 
-	EVTHREAD_ALLOC_LOCK(base->lock);
+	EVTHREAD_ALLOC_LOCK(base->lock, EVTHREAD_LOCK_CATEGORY_EVDNS);
 	EVDNS_LOCK(base);
 
-	/* Set max requests inflight and allocate req_heads. */
-	base->req_heads = NULL;
-
+	base->req_inflight_head = NULL;
 	evdns_base_set_max_requests_inflight(base, 64);
 
 	base->server_head = NULL;
@@ -3579,12 +5623,20 @@ evdns_base_new(struct event_base *event_base, int initialize_nameservers)
 	base->global_search_state = NULL;
 	base->global_randomize_case = 1;
 
+	HT_INIT(evdns_query_map, &base->queries);
+	HT_INIT(evdns_cache_map, &base->cache);
+	TAILQ_INIT(&base->cache_lru);
+	HT_INIT(evdns_hosts_name_map, &base->hosts);
+	HT_INIT(evdns_hosts_addr_map, &base->hosts_addrs);
+
 	if (initialize_nameservers) {
 		int r;
 #ifdef WIN32
 		r = evdns_config_windows_nameservers(base);
 #else
 		r = evdns_base_resolv_conf_parse(base, DNS_OPTIONS_ALL, "/etc/resolv.conf");
+		/* having no hosts file is fine */
+		evdns_base_load_hosts(base, NULL);
 #endif
 		if (r == -1) {
 			evdns_base_free(base, 0);
@@ -3632,18 +5684,15 @@ evdns_base_free(struct evdns_base *base, int fail_requests)
 {
 	struct nameserver *server, *server_next;
 	struct search_domain *dom, *dom_next;
-	int i;
 
 	/* TODO(nickm) we might need to refcount here. */
 
 	EVDNS_LOCK(base);
 
-	for (i = 0; i < base->n_req_heads; ++i) {
-		while (base->req_heads[i]) {
-			if (fail_requests)
-				reply_schedule_callback(base->req_heads[i], 0, DNS_ERR_SHUTDOWN, NULL);
-			request_finished(base->req_heads[i], &REQ_HEAD(base, base->req_heads[i]->trans_id));
-		}
+	while (base->req_inflight_head) {
+		if (fail_requests)
+			reply_schedule_callback(base->req_inflight_head, 0, DNS_ERR_SHUTDOWN, NULL);
+		request_finished(base->req_inflight_head, &base->req_inflight_head);
 	}
 	while (base->req_waiting_head) {
 		if (fail_requests)
@@ -3654,9 +5703,7 @@ evdns_base_free(struct evdns_base *base, int fail_requests)
 
 	for (server = base->server_head; server; server = server_next) {
 		server_next = server->next;
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
-		(void) event_del(&server->event);
+		nameserver_sockets_free(server);
 		if (server->state == 0)
 			(void) event_del(&server->timeout_event);
 		mm_free(server);
@@ -3674,6 +5721,17 @@ evdns_base_free(struct evdns_base *base, int fail_requests)
 		mm_free(base->global_search_state);
 		base->global_search_state = NULL;
 	}
+
+	evdns_hosts_clear(base);
+	HT_CLEAR(evdns_hosts_name_map, &base->hosts);
+	HT_CLEAR(evdns_hosts_addr_map, &base->hosts_addrs);
+	if (base->hosts_fname)
+		mm_free(base->hosts_fname);
+	if (base->arena)
+		mm_free(base->arena);
+	HT_CLEAR(evdns_query_map, &base->queries);
+	evdns_cache_trim(base, 0);
+	HT_CLEAR(evdns_cache_map, &base->cache);
 	EVDNS_UNLOCK(base);
 	EVTHREAD_FREE_LOCK(base->lock);
 
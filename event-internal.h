@@ -38,6 +38,12 @@ extern "C" {
 #include "evsignal-internal.h"
 #include "mm-internal.h"
 
+struct event_change;
+struct ev_pool;
+struct event_once;
+struct event_signal_run;
+struct ev_affinity;
+
 /* map union members back */
 
 /* mutually exclusive */
@@ -48,7 +54,14 @@ extern "C" {
 
 /* used only by signals */
 #define ev_ncalls	_ev.ev_signal.ev_ncalls
-#define ev_pncalls	_ev.ev_signal.ev_pncalls
+
+/* Set in ev_flags of an event that event_new() took from its base's object
+ * pool, rather than from mm_malloc().  event_assign() clears it, so an event
+ * from event_new() must not be passed to event_assign() again. */
+#define EVLIST_X_POOLED 0x1000
+
+/* Most unused event_base_once() structures that a base keeps around. */
+#define EVENT_ONCE_FREELIST_MAX 256
 
 /* Possible event closures. */
 #define EV_CLOSURE_NONE 0
@@ -106,6 +119,34 @@ struct event_signal_map {
 	int nentries;
 };
 
+/* List of 'changes' since the last call to eventop.dispatch.  Only maintained
+ * if the backend is using changesets. */
+struct event_changelist {
+	struct event_change *changes;
+	int n_changes;
+	int changes_size;
+};
+
+/** A list of events waiting on a given 'common' timeout value.  Ordinarily,
+ * events waiting for a timeout wait on a minheap.  Sometimes, however, a
+ * queue can be faster.
+ **/
+struct common_timeout_list {
+	/* List of events currently waiting in the queue. */
+	struct event_list events;
+	/* 'magic' timeval used to indicate the duration of events in this
+	 * queue. */
+	struct timeval duration;
+	/* Event that triggers whenever one of the events in the queue is
+	 * ready to activate */
+	struct event timeout_event;
+	/* The event_base that this timeout list is part of */
+	struct event_base *base;
+};
+
+/** A list of deferred callbacks, linked through cb_next. */
+TAILQ_HEAD(deferred_cb_list, deferred_cb);
+
 struct event_base {
 	/** Function pointers and other data to describe this event_base's
 	 * backend. */
@@ -113,6 +154,10 @@ struct event_base {
 	/** Pointer to backend-specific data. */
 	void *evbase;
 
+	/** List of changes to tell backend about at next dispatch.  Only used
+	 * by the O(1) backends. */
+	struct event_changelist changelist;
+
 	/* signal handling info */
 	const struct eventop *evsigsel;
 	void *evsigbase;
@@ -121,9 +166,20 @@ struct event_base {
 	int event_count;		/**< counts number of total events */
 	int event_count_active;		/**< counts number of active events */
 
+	/** Flags that this base was configured with */
+	enum event_base_config_flag flags;
+
+	/** Copied from the event_config: how many fds to size the fd tables
+	 * for, including the backend's, or 0.  Backends may look at this from
+	 * their init(). */
+	int size_hint_fds;
+
 	int event_gotterm;		/**< Set to terminate loop once done
 					 * processing events. */
 	int event_break;		/**< Set to exit loop immediately */
+	/** Signal events whose callbacks are being run in a loop right now,
+	 * innermost first, so that event_del() can cut the loop short. */
+	struct event_signal_run *running_signals;
 
 	/* Active event management. */
 	/** An array of nactivequeues queues for active events (ones that
@@ -132,10 +188,80 @@ struct event_base {
 	 */
 	struct event_list **activequeues;
 	int nactivequeues;
-
-	/** Deferred callback management: a list of deferred callbacks to
-	 * run active the active events. */
-	TAILQ_HEAD (deferred_cb_list, deferred_cb) deferred_cb_list;
+	/** If set, an array of nactivequeues weights: how many callbacks to
+	 * run from each priority on each pass before moving on to the next.
+	 * NULL for strict priorities. */
+	int *priority_weights;
+
+	/** Copied from the event_config: how long to run callbacks before
+	 * going back to the backend (tv_sec is -1 for no limit)... */
+	struct timeval max_dispatch_time;
+	/** ...how many callbacks to run before going back... */
+	int max_dispatch_callbacks;
+	/** ...and the first priority that those limits apply to. */
+	int limit_callbacks_after_prio;
+	/** Number of times that one of the limits above cut a round of
+	 * callbacks short. */
+	unsigned long n_dispatch_limit_hits;
+
+	/** Copied from the event_config: how long to spin before blocking
+	 * (tv_sec is -1 to never spin)... */
+	struct timeval busy_poll_interval;
+	/** ...and the SO_BUSY_POLL value to set on each new fd, or 0. */
+	int busy_poll_sock_usec;
+	/** When the current spin started, or cleared if we aren't
+	 * spinning. */
+	struct timeval busy_poll_start;
+
+	/** Copied from the event_config: how late, in microseconds, a
+	 * timeout may fire so that it can share a wakeup, or 0. */
+	ev_uint64_t timer_slack_usec;
+
+	/** If the base was configured to bind its loop thread, the CPUs to
+	 * bind it to; otherwise NULL. */
+	struct ev_affinity *loop_affinity;
+	/** True once the loop has bound a thread to loop_affinity... */
+	int loop_affinity_bound;
+	/** ...and the ID of that thread. */
+	unsigned long loop_affinity_thread;
+
+	/** True iff we should update stats as we go. */
+	int stats_enabled;
+	/** Counters reported by event_base_get_stats() */
+	struct event_base_stats stats;
+
+	/** Called with each callback that runs for at least
+	 * slow_cb_threshold; NULL if nobody asked. */
+	event_slow_callback_cb slow_cb;
+	void *slow_cb_arg;
+	struct timeval slow_cb_threshold;
+	/** How many evthread watchdogs are watching this base.  While there
+	 * are any, the loop bumps running_cb_seq just before and just after
+	 * each callback, so it is odd while one runs, and sets running_cb
+	 * and running_cb_fd to say which. */
+	int n_watchdogs;
+	volatile unsigned running_cb_seq;
+	void *volatile running_cb;
+	volatile evutil_socket_t running_cb_fd;
+
+	/** Where event_new() and friends get memory from, if this base was
+	 * made with EVENT_BASE_FLAG_OBJECT_POOL; NULL otherwise. */
+	struct ev_pool *pool;
+	/** Structures that event_base_once() has finished with, kept for its
+	 * next call so that it doesn't have to allocate: at most
+	 * EVENT_ONCE_FREELIST_MAX of them.  Unused when pool is set. */
+	struct event_once *once_freelist;
+	int n_once_free;
+
+	/** Deferred callback management: an array of nactivequeues lists of
+	 * deferred callbacks, one per priority, each run after the active
+	 * events of the same priority. */
+	struct deferred_cb_list *deferred_queues;
+	/** Deferred callbacks that the current round has taken off one of
+	 * deferred_queues as a batch and not yet started.  Protected by
+	 * th_deferred_lock as well as th_base_lock, so that the loop can take
+	 * them one at a time without touching th_base_lock. */
+	struct deferred_cb_list deferred_cb_batch;
 
 	/** Mapping from file descriptors to enabled events */
 	struct event_io_map io;
@@ -143,15 +269,27 @@ struct event_base {
 	/** Mapping from signal numbers to enabled events. */
 	struct event_signal_map sigmap;
 
-	/** All events that have been enabled (added) in this event_base */
-	struct event_list eventqueue;
-
 	struct timeval event_tv;
 
 	/** Priority queue of events with timeouts. */
 	struct min_heap timeheap;
 
+	/** An array of common_timeout_list* for all of the common timeout
+	 * values we know. */
+	struct common_timeout_list **common_timeout_queues;
+	/** The number of entries used in common_timeout_queues */
+	int n_common_timeouts;
+	/** The total size of common_timeout_queues. */
+	int n_common_timeouts_allocated;
+
 	struct timeval tv_cache;
+	/** The clock that gettime() reads, if not the default. */
+	enum event_clock_source clock_source;
+	/** The time of day minus the time by our clock, as of
+	 * last_updated_clock_diff (by our clock, in seconds), if our clock
+	 * is monotonic. */
+	struct timeval tv_clock_diff;
+	time_t last_updated_clock_diff;
 
 #ifndef _EVENT_DISABLE_THREAD_SUPPORT
 	/* threading support */
@@ -159,6 +297,9 @@ struct event_base {
 	unsigned long th_owner_id;
 	/** A lock to prevent conflicting accesses to this event_base */
 	void *th_base_lock;
+	/** A lock for deferred_cb_batch.  When both are needed, take
+	 * th_base_lock first. */
+	void *th_deferred_lock;
 #endif
 
 #ifdef WIN32
@@ -168,7 +309,17 @@ struct event_base {
 	/* Notify main thread to wake up break, etc. */
 	int th_notify_fd[2];
 	struct event th_notify;
+	/** Function to wake up the loop.  Usually writes to th_notify_fd, but
+	 * a backend can set this from its init() to use a mechanism of its
+	 * own, in which case th_notify_fd stays unused. */
 	int (*th_notify_fn)(struct event_base *base);
+	/** True if we have written to th_notify_fd and the loop has not yet
+	 * drained it: further notifications would be redundant. */
+	int is_notify_pending;
+	/** Stack of events activated from other threads and not yet moved to
+	 * activequeues, linked through ev_xthread_next.  Pushed without the
+	 * lock; only taken apart while holding it. */
+	struct event *th_xthread_active;
 };
 
 struct event_config_entry {
@@ -184,6 +335,38 @@ struct event_config {
 
 	enum event_method_feature require_features;
         enum event_base_config_flag flags;
+
+	/** Longest time to spend running callbacks before checking the
+	 * backend again; tv_sec is -1 if there is no limit. */
+	struct timeval max_dispatch_interval;
+	/** Most callbacks to run before checking the backend again. */
+	int max_dispatch_callbacks;
+	/** Events at priorities lower than this are exempt from the two
+	 * limits above. */
+	int limit_callbacks_after_prio;
+
+	/** How long to poll without blocking before we block; tv_sec is -1
+	 * if we never spin. */
+	struct timeval busy_poll_interval;
+	/** The SO_BUSY_POLL value to set on each fd, or 0 for none. */
+	int busy_poll_sock_usec;
+
+	/** CPU to build the base on and maybe run its loop on, or -1... */
+	int cpu;
+	/** ...or else a NUMA node, or -1. */
+	int numa_node;
+	/** True if the loop should bind its thread to cpu or numa_node. */
+	int bind_loop;
+
+	/** How many fds and pending timeouts to size the base for, or 0. */
+	int size_hint_fds;
+	int size_hint_timers;
+
+	/** The clock the base should keep time with. */
+	enum event_clock_source clock_source;
+
+	/** How late timeouts may fire; cleared for no slack. */
+	struct timeval timer_slack;
 };
 
 /* Internal use only: Functions that might be missing from <sys/queue.h> */
@@ -207,6 +390,10 @@ int _evsig_set_handler(struct event_base *base, int evsignal,
 			  void (*fn)(int));
 int _evsig_restore_handler(struct event_base *base, int evsignal);
 
+/** Called by the loop once it has consumed a wakeup from th_notify_fn, so
+    that the next notification wakes it again. */
+void evthread_notify_clear_pending(struct event_base *base);
+
 #ifdef __cplusplus
 }
 #endif
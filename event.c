@@ -60,6 +60,7 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <limits.h>
 
 #include "event2/event.h"
 #include "event2/event_struct.h"
@@ -71,6 +72,11 @@
 #include "event2/util.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
+#include "changelist-internal.h"
+#include "evpool-internal.h"
+#include "evaffinity-internal.h"
+#include "evclock-internal.h"
+#include "probes-internal.h"
 
 #ifdef _EVENT_HAVE_EVENT_PORTS
 extern const struct eventop evportops;
@@ -84,6 +90,9 @@ extern const struct eventop pollops;
 #ifdef _EVENT_HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+extern const struct eventop iouringops;
+#endif
 #ifdef _EVENT_HAVE_WORKING_KQUEUE
 extern const struct eventop kqops;
 #endif
@@ -92,6 +101,7 @@ extern const struct eventop devpollops;
 #endif
 #ifdef WIN32
 extern const struct eventop win32ops;
+extern const struct eventop afdops;
 #endif
 
 /* In order of preference */
@@ -105,6 +115,9 @@ static const struct eventop *eventops[] = {
 #ifdef _EVENT_HAVE_EPOLL
 	&epollops,
 #endif
+#ifdef _EVENT_HAVE_IO_URING
+	&iouringops,
+#endif
 #ifdef _EVENT_HAVE_DEVPOLL
 	&devpollops,
 #endif
@@ -115,6 +128,7 @@ static const struct eventop *eventops[] = {
 	&selectops,
 #endif
 #ifdef WIN32
+	&afdops,
 	&win32ops,
 #endif
 	NULL
@@ -127,7 +141,7 @@ static int use_monotonic;
 
 /* Prototypes */
 static inline int event_add_internal(struct event *ev,
-    const struct timeval *tv);
+    const struct timeval *tv, int tv_is_absolute);
 static inline int event_del_internal(struct event *ev);
 static inline void event_active_internal(struct event *ev, int res,short count);
 
@@ -135,7 +149,10 @@ static void	event_queue_insert(struct event_base *, struct event *, int);
 static void	event_queue_remove(struct event_base *, struct event *, int);
 static int	event_haveevents(struct event_base *);
 
-static void	event_process_active(struct event_base *);
+static void	event_process_active(struct event_base *,
+		    const struct timeval *);
+static int	event_base_init_pool(struct event_base *);
+static void	event_once_freelist_clear(struct event_base *);
 
 static int	timeout_next(struct event_base *, struct timeval **);
 static void	timeout_process(struct event_base *);
@@ -145,6 +162,9 @@ static void	event_signal_closure(struct event_base *, struct event *ev);
 static void	event_persist_closure(struct event_base *, struct event *ev);
 
 static int evthread_notify_base(struct event_base *base);
+static void event_drain_xthread_active(struct event_base *base);
+static void event_cancel_xthread_active(struct event_base *base,
+    struct event *ev);
 
 static void
 detect_monotonic(void)
@@ -157,13 +177,12 @@ detect_monotonic(void)
 #endif
 }
 
+/* Like gettime, but never use the time cache. */
 static int
-gettime(struct event_base *base, struct timeval *tp)
+gettime_nocache(struct event_base *base, struct timeval *tp)
 {
-	if (base->tv_cache.tv_sec) {
-		*tp = base->tv_cache;
-		return (0);
-	}
+	if (base->clock_source != EVENT_CLOCK_DEFAULT)
+		return (ev_clock_gettime(base->clock_source, tp));
 
 #if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
 	if (use_monotonic) {
@@ -181,6 +200,386 @@ gettime(struct event_base *base, struct timeval *tp)
 	return (evutil_gettimeofday(tp, NULL));
 }
 
+static int
+gettime(struct event_base *base, struct timeval *tp)
+{
+	if (base->tv_cache.tv_sec) {
+		*tp = base->tv_cache;
+		return (0);
+	}
+
+	return (gettime_nocache(base, tp));
+}
+
+/* How often, in seconds of our clock, to find out again how far it is from
+ * the time of day. */
+#define CLOCK_SYNC_INTERVAL 5
+
+/* Refill the time cache, and now and then the offset from our clock to the
+ * time of day. */
+static void
+update_time_cache(struct event_base *base)
+{
+	struct timeval tv;
+
+	base->tv_cache.tv_sec = 0;
+	gettime(base, &base->tv_cache);
+	if (use_monotonic && (!base->last_updated_clock_diff ||
+		base->tv_cache.tv_sec >=
+		base->last_updated_clock_diff + CLOCK_SYNC_INTERVAL)) {
+		evutil_gettimeofday(&tv, NULL);
+		evutil_timersub(&tv, &base->tv_cache, &base->tv_clock_diff);
+		base->last_updated_clock_diff = base->tv_cache.tv_sec;
+	}
+}
+
+int
+event_base_gettime_cached(struct event_base *base, struct timeval *tv)
+{
+	int r;
+	if (!base)
+		base = current_base;
+	if (!base || !tv)
+		return (-1);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	r = gettime(base, tv);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return r;
+}
+
+int
+event_base_gettimeofday_cached(struct event_base *base, struct timeval *tv)
+{
+	if (!base)
+		base = current_base;
+	if (!base || !tv)
+		return (-1);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (!base->tv_cache.tv_sec) {
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		return (evutil_gettimeofday(tv, NULL));
+	}
+	if (use_monotonic)
+		evutil_timeradd(&base->tv_cache, &base->tv_clock_diff, tv);
+	else
+		*tv = base->tv_cache;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+enum event_clock_source
+event_base_get_clock_source(struct event_base *base)
+{
+	return base->clock_source;
+}
+
+/* Statistics.  Everything here is only called when base->stats_enabled is
+ * set, so that collecting nothing costs a single test. */
+
+/* Record that the dispatch started at start has returned, and that the
+ * events it found are now on the active queues. */
+static void
+event_stats_iteration_done(struct event_base *base,
+    const struct timeval *start)
+{
+	struct event_base_stats *st = &base->stats;
+
+	struct timeval diff;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	++st->n_iterations;
+	/* The time cache was filled in right after dispatch returned. */
+	evutil_timersub(&base->tv_cache, start, &diff);
+	if (diff.tv_sec >= 0)
+		evutil_timeradd(&st->time_in_dispatch, &diff,
+		    &st->time_in_dispatch);
+	st->n_active_total += base->event_count_active;
+	if (base->event_count_active > st->max_active_per_iteration)
+		st->max_active_per_iteration = base->event_count_active;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
+/* Record that a callback (deferred iff is_deferred) took elapsed. */
+static void
+event_stats_callback_done(struct event_base *base,
+    const struct timeval *elapsed, int is_deferred)
+{
+	struct event_base_stats *st = &base->stats;
+	long usec = elapsed->tv_sec * 1000000L + elapsed->tv_usec;
+	int bucket = 0;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	evutil_timeradd(&st->time_in_callbacks, elapsed,
+	    &st->time_in_callbacks);
+	if (is_deferred)
+		++st->n_deferred_callbacks;
+	else
+		++st->n_callbacks;
+	while (usec > 0 && bucket < EVENT_STATS_HISTOGRAM_SIZE - 1) {
+		usec >>= 1;
+		++bucket;
+	}
+	++st->callback_usec_histogram[bucket];
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
+/* What event_callback_starting() did, so that event_callback_finished()
+ * can undo it. */
+#define EVENT_CB_TIMED 0x01
+#define EVENT_CB_WATCHED 0x02
+
+/* Called just before the loop runs callback (for fd, or -1): note the time
+ * if anyone wants to know how long it takes, and tell any watchdog that it
+ * is running.  Costs a few tests when nobody is interested. */
+static int
+event_callback_starting(struct event_base *base, struct timeval *start,
+    void *callback, evutil_socket_t fd)
+{
+	int what = 0;
+
+	if (base->stats_enabled || base->slow_cb) {
+		gettime_nocache(base, start);
+		what |= EVENT_CB_TIMED;
+	}
+	if (base->n_watchdogs) {
+		base->running_cb = callback;
+		base->running_cb_fd = fd;
+		++base->running_cb_seq;
+		what |= EVENT_CB_WATCHED;
+	}
+	return what;
+}
+
+/* Called when a callback that event_callback_starting() returned what for
+ * has returned. */
+static void
+event_callback_finished(struct event_base *base, int what,
+    const struct timeval *start, int is_deferred, void *callback,
+    evutil_socket_t fd)
+{
+	struct timeval now, elapsed;
+
+	if (what & EVENT_CB_WATCHED)
+		++base->running_cb_seq;
+	if (!(what & EVENT_CB_TIMED))
+		return;
+
+	gettime_nocache(base, &now);
+	evutil_timersub(&now, start, &elapsed);
+	if (elapsed.tv_sec < 0) {
+		/* the clock went backwards */
+		evutil_timerclear(&elapsed);
+	}
+	if (base->stats_enabled)
+		event_stats_callback_done(base, &elapsed, is_deferred);
+	if (base->slow_cb &&
+	    evutil_timercmp(&elapsed, &base->slow_cb_threshold, >=))
+		base->slow_cb(base, callback, fd, &elapsed,
+		    base->slow_cb_arg);
+}
+
+int
+event_base_set_slow_callback_cb(struct event_base *base,
+    const struct timeval *threshold, event_slow_callback_cb cb, void *arg)
+{
+	if (base == NULL || (cb && threshold == NULL))
+		return (-1);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (cb)
+		base->slow_cb_threshold = *threshold;
+	base->slow_cb_arg = arg;
+	base->slow_cb = cb;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+int
+event_base_enable_stats(struct event_base *base, int enable)
+{
+	if (base == NULL)
+		return (-1);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	base->stats_enabled = enable != 0;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+int
+event_base_get_stats(struct event_base *base, struct event_base_stats *stats)
+{
+	if (base == NULL || stats == NULL)
+		return (-1);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	*stats = base->stats;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (0);
+}
+
+void
+event_base_reset_stats(struct event_base *base)
+{
+	if (base == NULL)
+		return;
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	memset(&base->stats, 0, sizeof(base->stats));
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
+/* Common timeouts are special timeouts that are handled as queues rather
+ * than in the minheap.  This is more efficient than the minheap if we happen
+ * to know that we're going to get several thousands of timeout events all
+ * with the same timeout value.
+ *
+ * Since all our timeout handling code assumes timevals can be copied,
+ * assigned, etc, we can't use "magic pointer" to encode these common
+ * timeouts.  Searching through a list to see if every timeout is common could
+ * also get inefficient.  Instead, we take advantage of the fact that tv_usec
+ * is 32 bits long, but only uses 20 of those bits (since it can never be over
+ * 999999.)  We use the top bits to encode 4 bites of magic number, and 8 bits
+ * of index into the event_base's aray of common timeouts.
+ */
+
+#define MICROSECONDS_MASK	0x000fffff
+#define COMMON_TIMEOUT_IDX_MASK 0x0ff00000
+#define COMMON_TIMEOUT_IDX_SHIFT 20
+#define COMMON_TIMEOUT_MASK	0xf0000000
+#define COMMON_TIMEOUT_MAGIC	0x50000000
+#define MAX_COMMON_TIMEOUTS	256
+
+#define COMMON_TIMEOUT_IDX(tv) \
+	(((tv)->tv_usec & COMMON_TIMEOUT_IDX_MASK)>>COMMON_TIMEOUT_IDX_SHIFT)
+
+/** Return true iff if 'tv' is a common timeout in 'base' */
+static inline int
+is_common_timeout(const struct timeval *tv,
+    const struct event_base *base)
+{
+	int idx;
+	if ((tv->tv_usec & COMMON_TIMEOUT_MASK) != COMMON_TIMEOUT_MAGIC)
+		return 0;
+	idx = COMMON_TIMEOUT_IDX(tv);
+	return idx < base->n_common_timeouts;
+}
+
+/** Requires that 'tv' is a common timeout.  Return the corresponding
+ * common_timeout_list. */
+static inline struct common_timeout_list *
+get_common_timeout_list(struct event_base *base, const struct timeval *tv)
+{
+	return base->common_timeout_queues[COMMON_TIMEOUT_IDX(tv)];
+}
+
+/* Add the timeout for the first event in given common timeout list to the
+ * event_base's minheap. */
+static void
+common_timeout_schedule(struct common_timeout_list *ctl,
+    const struct timeval *now, struct event *head)
+{
+	struct timeval timeout = head->ev_timeout;
+	timeout.tv_usec &= MICROSECONDS_MASK;
+	event_add_internal(&ctl->timeout_event, &timeout, 1);
+}
+
+/* Callback: invoked when the timeout for a common timeout queue triggers.
+ * This means that (at least) the first event in that queue should be run,
+ * and the timeout should be rescheduled if there are more events. */
+static void
+common_timeout_callback(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval now;
+	struct common_timeout_list *ctl = arg;
+	struct event_base *base = ctl->base;
+	struct event *ev = NULL;
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	gettime(base, &now);
+	while (1) {
+		ev = TAILQ_FIRST(&ctl->events);
+		if (!ev || ev->ev_timeout.tv_sec > now.tv_sec ||
+		    (ev->ev_timeout.tv_sec == now.tv_sec &&
+			(ev->ev_timeout.tv_usec&MICROSECONDS_MASK) > now.tv_usec))
+			break;
+		event_del_internal(ev);
+		event_active_internal(ev, EV_TIMEOUT, 1);
+	}
+	if (ev)
+		common_timeout_schedule(ctl, &now, ev);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
+const struct timeval *
+event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration)
+{
+	int i;
+	struct timeval tv;
+	const struct timeval *result=NULL;
+	struct common_timeout_list *new_ctl;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (duration->tv_usec > 1000000) {
+		memcpy(&tv, duration, sizeof(struct timeval));
+		if (is_common_timeout(duration, base))
+			tv.tv_usec &= MICROSECONDS_MASK;
+		tv.tv_sec += tv.tv_usec / 1000000;
+		tv.tv_usec %= 1000000;
+		duration = &tv;
+	}
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		const struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		if (duration->tv_sec == ctl->duration.tv_sec &&
+		    duration->tv_usec ==
+		    (ctl->duration.tv_usec & MICROSECONDS_MASK)) {
+			assert(is_common_timeout(&ctl->duration, base));
+			result = &ctl->duration;
+			goto done;
+		}
+	}
+	if (base->n_common_timeouts == MAX_COMMON_TIMEOUTS) {
+		event_warnx("%s: Too many common timeouts already in use; "
+		    "we only support %d per event_base", __func__,
+		    MAX_COMMON_TIMEOUTS);
+		goto done;
+	}
+	if (base->n_common_timeouts_allocated == base->n_common_timeouts) {
+		int n = base->n_common_timeouts < 16 ? 16 :
+		    base->n_common_timeouts*2;
+		struct common_timeout_list **newqueues =
+		    mm_realloc(base->common_timeout_queues,
+			n*sizeof(struct common_timeout_list *));
+		if (!newqueues) {
+			event_warn("%s: realloc",__func__);
+			goto done;
+		}
+		base->n_common_timeouts_allocated = n;
+		base->common_timeout_queues = newqueues;
+	}
+	new_ctl = mm_calloc(1, sizeof(struct common_timeout_list));
+	if (!new_ctl) {
+		event_warn("%s: calloc",__func__);
+		goto done;
+	}
+	TAILQ_INIT(&new_ctl->events);
+	new_ctl->duration.tv_sec = duration->tv_sec;
+	new_ctl->duration.tv_usec =
+	    duration->tv_usec | COMMON_TIMEOUT_MAGIC |
+	    (base->n_common_timeouts << COMMON_TIMEOUT_IDX_SHIFT);
+	evtimer_assign(&new_ctl->timeout_event, base,
+	    common_timeout_callback, new_ctl);
+	new_ctl->timeout_event.ev_flags |= EVLIST_INTERNAL;
+	event_priority_set(&new_ctl->timeout_event, 0);
+	new_ctl->base = base;
+	base->common_timeout_queues[base->n_common_timeouts++] = new_ctl;
+	result = &new_ctl->duration;
+
+done:
+	if (result)
+		assert(is_common_timeout(result, base));
+
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return result;
+}
+
 struct event_base *
 event_init(void)
 {
@@ -230,8 +629,8 @@ event_base_get_features(struct event_base *base)
 	return base->evsel->features;
 }
 
-struct event_base *
-event_base_new_with_config(struct event_config *cfg)
+static struct event_base *
+event_base_create(struct event_config *cfg)
 {
 	int i;
 	struct event_base *base;
@@ -241,19 +640,50 @@ event_base_new_with_config(struct event_config *cfg)
 		event_err(1, "%s: calloc", __func__);
 
 	detect_monotonic();
+	if (cfg && use_monotonic)
+		base->clock_source = ev_clock_probe(cfg->clock_source);
 	gettime(base, &base->event_tv);
 
-	min_heap_ctor(&base->timeheap);
-	TAILQ_INIT(&base->eventqueue);
-	TAILQ_INIT(&base->deferred_cb_list);
+	if (cfg && (cfg->flags & EVENT_BASE_FLAG_KEYED_TIMEHEAP))
+		min_heap_ctor_keyed(&base->timeheap);
+	else
+		min_heap_ctor(&base->timeheap);
+	TAILQ_INIT(&base->deferred_cb_batch);
 	base->sig.ev_signal_pair[0] = -1;
 	base->sig.ev_signal_pair[1] = -1;
 
 	evmap_io_initmap(&base->io);
 	evmap_signal_initmap(&base->sigmap);
+	event_changelist_init(&base->changelist);
 
 	base->evbase = NULL;
 
+	if (cfg) {
+		base->flags = cfg->flags;
+		base->max_dispatch_time = cfg->max_dispatch_interval;
+		base->max_dispatch_callbacks = cfg->max_dispatch_callbacks;
+		base->limit_callbacks_after_prio =
+		    cfg->limit_callbacks_after_prio;
+		base->busy_poll_interval = cfg->busy_poll_interval;
+		base->busy_poll_sock_usec = cfg->busy_poll_sock_usec;
+		base->size_hint_fds = cfg->size_hint_fds;
+		base->timer_slack_usec =
+		    cfg->timer_slack.tv_sec * (ev_uint64_t)1000000 +
+		    cfg->timer_slack.tv_usec;
+	} else {
+		base->max_dispatch_time.tv_sec = -1;
+		base->max_dispatch_callbacks = INT_MAX;
+		base->limit_callbacks_after_prio = 1;
+		base->busy_poll_interval.tv_sec = -1;
+	}
+
+	if (cfg && (cfg->flags & EVENT_BASE_FLAG_OBJECT_POOL)) {
+		if (event_base_init_pool(base) < 0) {
+			event_base_free(base);
+			return NULL;
+		}
+	}
+
 	should_check_environment =
 	    !(cfg && (cfg->flags & EVENT_BASE_FLAG_IGNORE_ENV));
 
@@ -294,13 +724,28 @@ event_base_new_with_config(struct event_config *cfg)
 	/* allocate a single active event queue */
 	event_base_priority_init(base, 1);
 
+	/* These are only hints: if we can't preallocate, the tables will
+	 * just grow later as usual. */
+	if (base->size_hint_fds > 0) {
+		(void) evmap_io_reserve(base, base->size_hint_fds);
+		if (base->evsel->add == event_changelist_add)
+			(void) event_changelist_reserve(&base->changelist,
+			    base->size_hint_fds);
+	}
+	if (cfg && cfg->size_hint_timers > 0)
+		(void) min_heap_reserve(&base->timeheap,
+		    cfg->size_hint_timers);
+
 	/* prepare for threading */
 	base->th_notify_fd[0] = -1;
 	base->th_notify_fd[1] = -1;
 
 	if (!cfg || !(cfg->flags & EVENT_BASE_FLAG_NOLOCK)) {
 		int r;
-		EVTHREAD_ALLOC_LOCK(base->th_base_lock);
+		EVTHREAD_ALLOC_LOCK(base->th_base_lock,
+		    EVTHREAD_LOCK_CATEGORY_BASE);
+		EVTHREAD_ALLOC_LOCK(base->th_deferred_lock,
+		    EVTHREAD_LOCK_CATEGORY_BASE);
 		r = evthread_make_base_notifiable(base);
 		if (r<0) {
 			event_base_free(base);
@@ -311,6 +756,53 @@ event_base_new_with_config(struct event_config *cfg)
 	return (base);
 }
 
+struct event_base *
+event_base_new_with_config(struct event_config *cfg)
+{
+	struct ev_affinity *aff = NULL, *saved = NULL;
+	struct event_base *base;
+
+	if (cfg && (cfg->cpu >= 0 || cfg->numa_node >= 0)) {
+		/* Build the base on the CPUs it's meant for, so that its
+		 * memory gets allocated on their node. */
+		if ((aff = ev_affinity_new(cfg->cpu, cfg->numa_node)) == NULL)
+			return (NULL);
+		if (ev_affinity_bind(aff, &saved) < 0) {
+			ev_affinity_free(aff);
+			return (NULL);
+		}
+	}
+
+	base = event_base_create(cfg);
+
+	if (saved) {
+		if (ev_affinity_bind(saved, NULL) < 0)
+			event_warnx("%s: couldn't restore the thread's "
+			    "CPU affinity", __func__);
+		ev_affinity_free(saved);
+	}
+	if (base && aff && cfg->bind_loop) {
+		base->loop_affinity = aff;
+		aff = NULL;
+	}
+	ev_affinity_free(aff);
+
+	return (base);
+}
+
+/* evmap_foreach_event() callback for event_base_free(): delete ev unless
+ * it is one of the base's own events, and count it. */
+static int
+event_base_free_event(struct event_base *base, struct event *ev, void *arg)
+{
+	int *n_deleted = arg;
+	if (!(ev->ev_flags & EVLIST_INTERNAL)) {
+		event_del(ev);
+		++*n_deleted;
+	}
+	return 0;
+}
+
 void
 event_base_free(struct event_base *base)
 {
@@ -335,18 +827,31 @@ event_base_free(struct event_base *base)
 	}
 
 	/* Delete all non-internal events. */
-	for (ev = TAILQ_FIRST(&base->eventqueue); ev; ) {
-		struct event *next = TAILQ_NEXT(ev, ev_next);
-		if (!(ev->ev_flags & EVLIST_INTERNAL)) {
-			event_del(ev);
-			++n_deleted;
-		}
-		ev = next;
-	}
+	evmap_foreach_event(base, event_base_free_event, &n_deleted);
 	while ((ev = min_heap_top(&base->timeheap)) != NULL) {
 		event_del(ev);
 		++n_deleted;
 	}
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		event_del(&ctl->timeout_event); /* Internal; doesn't count */
+		for (ev = TAILQ_FIRST(&ctl->events); ev; ) {
+			struct event *next = TAILQ_NEXT(ev,
+			    ev_timeout_pos.ev_next_with_common_timeout);
+			if (!(ev->ev_flags & EVLIST_INTERNAL)) {
+				event_del(ev);
+				++n_deleted;
+			}
+			ev = next;
+		}
+		mm_free(ctl);
+	}
+	if (base->common_timeout_queues)
+		mm_free(base->common_timeout_queues);
+
+	/* Anything other threads activated is about to be deleted below. */
+	event_drain_xthread_active(base);
 
 	for (i = 0; i < base->nactivequeues; ++i) {
 		for (ev = TAILQ_FIRST(base->activequeues[i]); ev; ) {
@@ -375,13 +880,22 @@ event_base_free(struct event_base *base)
 	for (i = 0; i < base->nactivequeues; ++i)
 		mm_free(base->activequeues[i]);
 	mm_free(base->activequeues);
-
-	assert(TAILQ_EMPTY(&base->eventqueue));
+	mm_free(base->deferred_queues);
+	if (base->priority_weights)
+		mm_free(base->priority_weights);
 
 	evmap_io_clear(&base->io);
 	evmap_signal_clear(&base->sigmap);
 
+	event_once_freelist_clear(base);
+	ev_affinity_free(base->loop_affinity);
+
 	EVTHREAD_FREE_LOCK(base->th_base_lock);
+	EVTHREAD_FREE_LOCK(base->th_deferred_lock);
+
+	/* Objects still allocated from the pool keep it alive. */
+	if (base->pool)
+		ev_pool_decref(base->pool);
 
 	mm_free(base);
 }
@@ -392,7 +906,6 @@ event_reinit(struct event_base *base)
 {
 	const struct eventop *evsel = base->evsel;
 	int res = 0;
-	struct event *ev;
 
 	/* check if this event mechanism requires reinit */
 	if (!evsel->need_reinit)
@@ -417,18 +930,8 @@ event_reinit(struct event_base *base)
 		event_errx(1, "%s: could not reinitialize event mechanism",
 		    __func__);
 
-	evmap_io_clear(&base->io);
-	evmap_signal_clear(&base->sigmap);
-
-	TAILQ_FOREACH(ev, &base->eventqueue, ev_next) {
-		if (ev->ev_events & (EV_READ|EV_WRITE)) {
-			if (evmap_io_add(base, ev->ev_fd, ev) == -1)
-				res = -1;
-		} else if (ev->ev_events & EV_SIGNAL) {
-			if (evmap_signal_add(base, ev->ev_fd, ev) == -1)
-				res = -1;
-		}
-	}
+	if (evmap_reinit(base) == -1)
+		res = -1;
 
 	return (res);
 }
@@ -478,6 +981,12 @@ event_config_new(void)
 		return (NULL);
 
 	TAILQ_INIT(&cfg->entries);
+	cfg->max_dispatch_interval.tv_sec = -1;
+	cfg->max_dispatch_callbacks = INT_MAX;
+	cfg->limit_callbacks_after_prio = 1;
+	cfg->busy_poll_interval.tv_sec = -1;
+	cfg->cpu = -1;
+	cfg->numa_node = -1;
 
 	return (cfg);
 }
@@ -540,6 +1049,85 @@ event_config_require_features(struct event_config *cfg,
 	return (0);
 }
 
+int
+event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority)
+{
+	if (!cfg)
+		return (-1);
+	if (max_interval)
+		cfg->max_dispatch_interval = *max_interval;
+	else
+		cfg->max_dispatch_interval.tv_sec = -1;
+	cfg->max_dispatch_callbacks =
+	    max_callbacks >= 0 ? max_callbacks : INT_MAX;
+	if (min_priority < 0)
+		min_priority = 0;
+	cfg->limit_callbacks_after_prio = min_priority;
+	return (0);
+}
+
+int
+event_config_set_busy_poll(struct event_config *cfg,
+    const struct timeval *spin_interval, int socket_busy_poll_usec)
+{
+	if (!cfg || socket_busy_poll_usec < 0)
+		return (-1);
+	if (spin_interval)
+		cfg->busy_poll_interval = *spin_interval;
+	else
+		cfg->busy_poll_interval.tv_sec = -1;
+	cfg->busy_poll_sock_usec = socket_busy_poll_usec;
+	return (0);
+}
+
+int
+event_config_set_size_hints(struct event_config *cfg, int max_fds,
+    int max_timers)
+{
+	if (!cfg || max_fds < 0 || max_timers < 0)
+		return (-1);
+	cfg->size_hint_fds = max_fds;
+	cfg->size_hint_timers = max_timers;
+	return (0);
+}
+
+int
+event_config_set_timer_slack(struct event_config *cfg,
+    const struct timeval *slack)
+{
+	if (!cfg || (slack && (slack->tv_sec < 0 || slack->tv_usec < 0 ||
+		    slack->tv_usec >= 1000000)))
+		return (-1);
+	if (slack)
+		cfg->timer_slack = *slack;
+	else
+		evutil_timerclear(&cfg->timer_slack);
+	return (0);
+}
+
+int
+event_config_set_clock_source(struct event_config *cfg,
+    enum event_clock_source source)
+{
+	if (!cfg || source < EVENT_CLOCK_DEFAULT || source > EVENT_CLOCK_TSC)
+		return (-1);
+	cfg->clock_source = source;
+	return (0);
+}
+
+int
+event_config_set_cpu_affinity(struct event_config *cfg, int cpu,
+    int numa_node, int bind_loop)
+{
+	if (!cfg || cpu < -1 || numa_node < -1)
+		return (-1);
+	cfg->cpu = cpu;
+	cfg->numa_node = numa_node;
+	cfg->bind_loop = bind_loop != 0;
+	return (0);
+}
+
 int
 event_priority_init(int npriorities)
 {
@@ -558,11 +1146,18 @@ event_base_priority_init(struct event_base *base, int npriorities)
 	if (npriorities == base->nactivequeues)
 		return (0);
 
+	/* The weights were for the old set of priorities. */
+	if (base->priority_weights) {
+		mm_free(base->priority_weights);
+		base->priority_weights = NULL;
+	}
+
 	if (base->nactivequeues) {
 		for (i = 0; i < base->nactivequeues; ++i) {
 			mm_free(base->activequeues[i]);
 		}
 		mm_free(base->activequeues);
+		mm_free(base->deferred_queues);
 	}
 
 	/* Allocate our priority queues */
@@ -572,14 +1167,47 @@ event_base_priority_init(struct event_base *base, int npriorities)
 	    npriorities * sizeof(struct event_list *));
 	if (base->activequeues == NULL)
 		event_err(1, "%s: calloc", __func__);
+	base->deferred_queues = (struct deferred_cb_list *)mm_calloc(
+	    npriorities, sizeof(struct deferred_cb_list));
+	if (base->deferred_queues == NULL)
+		event_err(1, "%s: calloc", __func__);
 
 	for (i = 0; i < base->nactivequeues; ++i) {
 		base->activequeues[i] = mm_malloc(sizeof(struct event_list));
 		if (base->activequeues[i] == NULL)
 			event_err(1, "%s: malloc", __func__);
 		TAILQ_INIT(base->activequeues[i]);
+		TAILQ_INIT(&base->deferred_queues[i]);
+	}
+
+	return (0);
+}
+
+int
+event_base_priority_set_weights(struct event_base *base, const int *weights,
+    int n_weights)
+{
+	int *w = NULL;
+	int i;
+
+	if (weights) {
+		if (n_weights != base->nactivequeues)
+			return (-1);
+		for (i = 0; i < n_weights; ++i) {
+			if (weights[i] < 1)
+				return (-1);
+		}
+		if ((w = mm_malloc(n_weights * sizeof(int))) == NULL)
+			return (-1);
+		memcpy(w, weights, n_weights * sizeof(int));
 	}
 
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (base->priority_weights)
+		mm_free(base->priority_weights);
+	base->priority_weights = w;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
 	return (0);
 }
 
@@ -589,30 +1217,85 @@ event_haveevents(struct event_base *base)
 	return (base->event_count > 0);
 }
 
+/* A persistent event's relative timeout is kept in 64 bits, not a whole
+ * struct timeval: the seconds go in the high half and tv_usec, which may
+ * carry common-timeout bits, in the low half. */
+static inline void
+event_io_timeout_set(struct event *ev, const struct timeval *tv)
+{
+	ev_uint64_t sec = tv->tv_sec < 0 ? 0 : (ev_uint64_t)tv->tv_sec;
+	if (sec > 0xffffffffU)
+		sec = 0xffffffffU;
+	ev->ev_io_timeout = (sec << 32) | (ev_uint32_t)tv->tv_usec;
+}
+
+static inline void
+event_io_timeout_get(const struct event *ev, struct timeval *tv)
+{
+	tv->tv_sec = (time_t)(ev->ev_io_timeout >> 32);
+	tv->tv_usec = (int)(ev_uint32_t)ev->ev_io_timeout;
+}
+
 static void
 event_persist_closure(struct event_base *base, struct event *ev)
 {
 	/* reschedule the persistent event if we have a timeout */
-	if (ev->ev_io_timeout.tv_sec || ev->ev_io_timeout.tv_usec)
-		event_add(ev, &ev->ev_io_timeout);
+	if (ev->ev_io_timeout) {
+		struct timeval tv;
+		event_io_timeout_get(ev, &tv);
+		event_add(ev, &tv);
+	}
 	(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
 }
 
+/* A signal event whose callback event_signal_closure() is calling once per
+ * time the signal arrived.  Lives on that function's stack, and is linked
+ * from base->running_signals while it runs. */
+struct event_signal_run {
+	struct event *ev;
+	short ncalls;
+	struct event_signal_run *prev;
+};
+
 static void
 event_signal_closure(struct event_base *base, struct event *ev)
 {
-	short ncalls;
+	struct event_signal_run run;
 
 	/* Allows deletes to work */
-	ncalls = ev->ev_ncalls;
-	ev->ev_pncalls = &ncalls;
-	while (ncalls) {
-		ncalls--;
-		ev->ev_ncalls = ncalls;
+	run.ev = ev;
+	run.ncalls = ev->ev_ncalls;
+	run.prev = base->running_signals;
+	base->running_signals = &run;
+	while (run.ncalls) {
+		run.ncalls--;
+		ev->ev_ncalls = run.ncalls;
 		(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
 		if (base->event_break)
-			return;
+			break;
 	}
+	base->running_signals = run.prev;
+}
+
+/* If event_signal_closure() is partway through calling ev's callback
+ * ev_ncalls times, make this call the last. */
+static void
+event_signal_stop_calls(struct event_base *base, struct event *ev)
+{
+	struct event_signal_run *run;
+	for (run = base->running_signals; run; run = run->prev) {
+		if (run->ev == ev)
+			run->ncalls = 0;
+	}
+}
+
+/* Refresh the time cache, and return true iff it is now at or past
+ * endtime.  Callbacks that run after this see the refreshed time. */
+static int
+event_past_endtime(struct event_base *base, const struct timeval *endtime)
+{
+	update_time_cache(base);
+	return evutil_timercmp(&base->tv_cache, endtime, >=);
 }
 
 /*
@@ -621,13 +1304,21 @@ event_signal_closure(struct event_base *base, struct event *ev)
   when it's invoked.  Returns -1 if we get a signal or an event_break that
   means we should stop processing any active events now.  Otherwise returns
   the number of non-internal events that we processed.
+
+  We stop early, leaving events on the queue, once we have run
+  max_to_process non-internal callbacks, or once the time is past endtime
+  (if endtime is non-NULL).
 */
 static int
 event_process_active_single_queue(struct event_base *base,
-    struct event_list *activeq)
+    struct event_list *activeq,
+    int max_to_process, const struct timeval *endtime)
 {
 	struct event *ev;
-	int count = 0;
+	struct timeval cb_start;
+	void *cb_fn;
+	evutil_socket_t cb_fd;
+	int count = 0, what;
 
 	assert(activeq != NULL);
 
@@ -646,9 +1337,16 @@ event_process_active_single_queue(struct event_base *base,
 			ev->ev_res & EV_WRITE ? "EV_WRITE " : " ",
 			ev->ev_callback));
 
+		/* The callback may free ev, so remember who it was. */
+		cb_fn = (void *)ev->ev_callback;
+		cb_fd = ev->ev_fd;
+
 		EVBASE_RELEASE_LOCK(base,
 		    EVTHREAD_WRITE, th_base_lock);
 
+		EV_PROBE4(callback__start, base, ev, ev->ev_fd, ev->ev_res);
+		what = event_callback_starting(base, &cb_start, cb_fn, cb_fd);
+
 		switch (ev->ev_closure) {
 		case EV_CLOSURE_SIGNAL:
 			event_signal_closure(base, ev);
@@ -663,31 +1361,122 @@ event_process_active_single_queue(struct event_base *base,
 			break;
 		}
 
+		if (what)
+			event_callback_finished(base, what, &cb_start, 0,
+			    cb_fn, cb_fd);
+		EV_PROBE2(callback__done, base, ev);
+
 		if (base->event_break)
 			return -1;
 		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+		if (count >= max_to_process)
+			return count;
+		if (endtime && event_past_endtime(base, endtime))
+			return count;
 	}
 	return count;
 }
 
+/* Return the queue in base->deferred_queues that cb runs from. */
+static inline struct deferred_cb_list *
+event_deferred_cb_queue(struct event_base *base, struct deferred_cb *cb)
+{
+	int pri = cb->pri;
+	if (pri < 0)
+		pri = base->nactivequeues / 2;
+	else if (pri >= base->nactivequeues)
+		pri = base->nactivequeues - 1;
+	return &base->deferred_queues[pri];
+}
+
+/* Put whatever is left of the current batch of deferred callbacks back at
+ * the front of their queues, ahead of anything deferred since the batch
+ * began.  Requires th_base_lock. */
+static void
+event_deferred_cb_requeue_batch(struct event_base *base)
+{
+	struct deferred_cb *cb;
+
+	EVLOCK_LOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+	while ((cb = TAILQ_LAST(&base->deferred_cb_batch, deferred_cb_list))) {
+		TAILQ_REMOVE(&base->deferred_cb_batch, cb, cb_next);
+		TAILQ_INSERT_HEAD(event_deferred_cb_queue(base, cb), cb,
+		    cb_next);
+		cb->queued = DEFERRED_CB_QUEUED;
+		++base->event_count_active;
+	}
+	EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+}
+
+/* Run the deferred callbacks of priority pri that are queued when we start.
+ * We move them all to deferred_cb_batch at once, and then take them off it
+ * one by one with only th_deferred_lock held, so that we don't fight over
+ * th_base_lock with other threads around every callback.  Callbacks
+ * deferred while this runs wait for the next round.  If we stop early
+ * because of max_to_process or endtime, the rest go back on their queue and
+ * we set *stopped.  Requires th_base_lock; returns with it held and the
+ * number of callbacks run, unless the loop was told to break, in which case
+ * we return -1. */
 static int
-event_process_deferred_callbacks(struct event_base *base)
+event_process_deferred_callbacks(struct event_base *base, int pri,
+    int max_to_process, const struct timeval *endtime, int *stopped)
 {
-	int count = 0;
+	struct deferred_cb_list *queue = &base->deferred_queues[pri];
+	int count = 0, hit_limit = 0, what;
 	struct deferred_cb *cb;
+	struct timeval cb_start;
+	void *cb_fn;
 
-	while ((cb = TAILQ_FIRST(&base->deferred_cb_list))) {
-		cb->queued = 0;
-		TAILQ_REMOVE(&base->deferred_cb_list, cb, cb_next);
+	*stopped = 0;
+	if (TAILQ_EMPTY(queue))
+		return 0;
+
+	EVLOCK_LOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+	while ((cb = TAILQ_FIRST(queue))) {
+		TAILQ_REMOVE(queue, cb, cb_next);
+		TAILQ_INSERT_TAIL(&base->deferred_cb_batch, cb, cb_next);
+		cb->queued = DEFERRED_CB_IN_BATCH;
 		--base->event_count_active;
-		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	}
+	EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 
+	for (;;) {
+		EVLOCK_LOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+		if ((cb = TAILQ_FIRST(&base->deferred_cb_batch)) == NULL) {
+			EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+			break;
+		}
+		if (count && (count >= max_to_process ||
+			(endtime && event_past_endtime(base, endtime)))) {
+			EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+			hit_limit = 1;
+			break;
+		}
+		TAILQ_REMOVE(&base->deferred_cb_batch, cb, cb_next);
+		cb->queued = 0;
+		EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+
+		cb_fn = (void *)cb->cb;
+		what = event_callback_starting(base, &cb_start, cb_fn, -1);
 		cb->cb(cb, cb->arg);
+		if (what)
+			event_callback_finished(base, what, &cb_start, 1,
+			    cb_fn, -1);
 		++count;
-		if (base->event_break)
+		if (base->event_break) {
+			EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+			event_deferred_cb_requeue_batch(base);
+			EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 			return -1;
+		}
+	}
 
-		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (hit_limit) {
+		*stopped = 1;
+		event_deferred_cb_requeue_batch(base);
 	}
 	return count;
 }
@@ -696,32 +1485,170 @@ event_process_deferred_callbacks(struct event_base *base)
  * Active events are stored in priority queues.  Lower priorities are always
  * process before higher priorities.  Low priority events can starve high
  * priority ones.
+ *
+ * If the base was configured with event_config_set_max_dispatch_interval(),
+ * queues at or after limit_callbacks_after_prio only run until the callback
+ * or time budget is used up; whatever is left stays active, and we go back
+ * to the backend (without blocking) before running it.
+ *
+ * If the base has priority weights, we instead make one pass over all the
+ * queues, running at most priority_weights[i] callbacks from queue i, so
+ * that busy high priorities can delay low ones by only one pass.
+ *
+ * Deferred callbacks of each priority run right after the active events of
+ * that priority, and count against the same limits.
  */
 
+/* Helper for event_process_active: make one weighted pass over the active
+ * queues.  Returns -1 if the loop was told to break (and the lock is already
+ * released), or 0. */
+static int
+event_process_active_weighted(struct event_base *base,
+    const struct timeval *endtime, const struct timeval *deadline)
+{
+	const int limit_after_prio = base->limit_callbacks_after_prio;
+	int budget = base->max_dispatch_callbacks;
+	int i, c, w, stopped;
+
+	for (i = 0; i < base->nactivequeues; ++i) {
+		struct event_list *activeq = base->activequeues[i];
+		struct deferred_cb_list *deferq = &base->deferred_queues[i];
+		if (TAILQ_FIRST(activeq) == NULL && TAILQ_EMPTY(deferq))
+			continue;
+		w = base->priority_weights[i];
+		c = 0;
+		if (TAILQ_FIRST(activeq) != NULL) {
+			if (i < limit_after_prio) {
+				if (deadline &&
+				    event_past_endtime(base, deadline))
+					break;
+				c = event_process_active_single_queue(base,
+				    activeq, w, deadline);
+			} else {
+				if (budget <= 0 || (endtime &&
+					event_past_endtime(base, endtime))) {
+					++base->n_dispatch_limit_hits;
+					break;
+				}
+				c = event_process_active_single_queue(base,
+				    activeq, w < budget ? w : budget, endtime);
+			}
+			if (c < 0)
+				return -1; /* already unlocked */
+			if (i >= limit_after_prio) {
+				budget -= c;
+				if (c < w && TAILQ_FIRST(activeq) != NULL) {
+					/* Stopped by the dispatch limits,
+					 * not by the weight. */
+					++base->n_dispatch_limit_hits;
+					break;
+				}
+			}
+		}
+		if (c >= w || TAILQ_EMPTY(deferq))
+			continue;
+		w -= c;
+		if (i < limit_after_prio) {
+			if (deadline && event_past_endtime(base, deadline))
+				break;
+			c = event_process_deferred_callbacks(base, i, w,
+			    deadline, &stopped);
+		} else {
+			if (budget <= 0 ||
+			    (endtime && event_past_endtime(base, endtime))) {
+				++base->n_dispatch_limit_hits;
+				break;
+			}
+			c = event_process_deferred_callbacks(base, i,
+			    w < budget ? w : budget, endtime, &stopped);
+		}
+		if (c < 0)
+			return -1; /* already unlocked */
+		if (i >= limit_after_prio) {
+			budget -= c;
+			if (stopped && c < w) {
+				++base->n_dispatch_limit_hits;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
 static void
-event_process_active(struct event_base *base)
+event_process_active(struct event_base *base, const struct timeval *deadline)
 {
 	struct event_list *activeq = NULL;
-	int i, c;
+	struct deferred_cb_list *deferq;
+	struct timeval tv;
+	const struct timeval *endtime = NULL;
+	const int maxcb = base->max_dispatch_callbacks;
+	const int limit_after_prio = base->limit_callbacks_after_prio;
+	int i, c, d, stopped;
 
 	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 
+	if (base->max_dispatch_time.tv_sec >= 0) {
+		gettime(base, &tv);
+		evutil_timeradd(&base->max_dispatch_time, &tv, &tv);
+		endtime = &tv;
+	}
+	/* The loop's deadline bounds every priority, limited or not. */
+	if (deadline && (!endtime || evutil_timercmp(deadline, endtime, <)))
+		endtime = deadline;
+
+	if (base->priority_weights) {
+		if (event_process_active_weighted(base, endtime, deadline) < 0)
+			return; /* already unlocked */
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		return;
+	}
+
 	for (i = 0; i < base->nactivequeues; ++i) {
-		if (TAILQ_FIRST(base->activequeues[i]) != NULL) {
-			activeq = base->activequeues[i];
-			c = event_process_active_single_queue(base, activeq);
+		activeq = base->activequeues[i];
+		deferq = &base->deferred_queues[i];
+		c = 0;
+		if (TAILQ_FIRST(activeq) != NULL) {
+			if (i < limit_after_prio)
+				c = event_process_active_single_queue(base,
+				    activeq, INT_MAX, deadline);
+			else
+				c = event_process_active_single_queue(base,
+				    activeq, maxcb, endtime);
 			if (c < 0)
 				return; /* already unlocked */
-			else if (c > 0)
-				break; /* Processed a real event; do not
-					* consider lower-priority events */
-			/* If we get here, all of the events we processed
-			 * were internal.  Continue. */
+			if (TAILQ_FIRST(activeq) != NULL) {
+				/* We ran out of budget. */
+				++base->n_dispatch_limit_hits;
+				break;
+			}
+		}
+		if (!TAILQ_EMPTY(deferq)) {
+			if (i >= limit_after_prio && c >= maxcb) {
+				++base->n_dispatch_limit_hits;
+				break;
+			}
+			if (i < limit_after_prio)
+				d = event_process_deferred_callbacks(base, i,
+				    INT_MAX, deadline, &stopped);
+			else
+				d = event_process_deferred_callbacks(base, i,
+				    maxcb - c, endtime, &stopped);
+			if (d < 0)
+				return; /* already unlocked */
+			if (stopped) {
+				++base->n_dispatch_limit_hits;
+				break;
+			}
+			c += d;
 		}
+		if (c > 0)
+			break; /* Processed a real event; do not
+				* consider lower-priority events */
+		/* If we get here, all of the events we processed
+		 * were internal.  Continue. */
 	}
 
-	event_process_deferred_callbacks(base);
-
 	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 }
 
@@ -741,6 +1668,16 @@ event_base_dispatch(struct event_base *event_base)
   return (event_base_loop(event_base, 0));
 }
 
+unsigned long
+event_base_get_n_dispatch_limit_hits(struct event_base *base)
+{
+	unsigned long n;
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	n = base->n_dispatch_limit_hits;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	return (n);
+}
+
 const char *
 event_base_get_method(struct event_base *base)
 {
@@ -803,16 +1740,53 @@ event_loop(int flags)
 	return event_base_loop(current_base, flags);
 }
 
-int
-event_base_loop(struct event_base *base, int flags)
+/* Bind the thread running base's loop to base->loop_affinity, unless we
+ * already bound this thread. */
+static void
+event_bind_loop_thread(struct event_base *base)
+{
+	unsigned long id = EVTHREAD_GET_ID();
+
+	if (base->loop_affinity_bound && base->loop_affinity_thread == id)
+		return;
+	/* If it fails, ev_affinity_bind() warns; don't repeat that on
+	 * every call. */
+	(void) ev_affinity_bind(base->loop_affinity, NULL);
+	base->loop_affinity_bound = 1;
+	base->loop_affinity_thread = id;
+}
+
+/* Return true if the loop should poll without blocking rather than block,
+ * because it has spun for less than busy_poll_interval so far. */
+static int
+event_busy_poll_spinning(struct event_base *base)
+{
+	struct timeval now, end;
+
+	if (base->busy_poll_interval.tv_sec < 0)
+		return (0);
+
+	gettime(base, &now);
+	if (!evutil_timerisset(&base->busy_poll_start)) {
+		base->busy_poll_start = now;
+		return (1);
+	}
+	evutil_timeradd(&base->busy_poll_start, &base->busy_poll_interval,
+	    &end);
+	return evutil_timercmp(&now, &end, <);
+}
+
+/* The body of event_base_loop() and event_base_loop_timed().  If deadline
+ * is set, we don't wait past it, and we return once it has passed. */
+static int
+event_base_loop_impl(struct event_base *base, int flags,
+    const struct timeval *deadline)
 {
 	const struct eventop *evsel = base->evsel;
 	struct timeval tv;
 	struct timeval *tv_p;
-	int res, done;
-
-	/* clear time cache */
-	base->tv_cache.tv_sec = 0;
+	struct timeval dispatch_start;
+	int res, done, spinning;
 
 	if (base->sig.ev_signal_added)
 		evsig_base = base;
@@ -822,6 +1796,9 @@ event_base_loop(struct event_base *base, int flags)
 	base->th_owner_id = EVTHREAD_GET_ID();
 #endif
 
+	if (base->loop_affinity)
+		event_bind_loop_thread(base);
+
 	while (!done) {
 		/* Terminate the loop if we have been asked to */
 		if (base->event_gotterm) {
@@ -836,9 +1813,20 @@ event_base_loop(struct event_base *base, int flags)
 
 		timeout_correct(base, &tv);
 
+		/* Don't go to sleep on events that other threads have
+		 * activated while we weren't looking. */
+		event_drain_xthread_active(base);
+
 		tv_p = &tv;
+		spinning = 0;
 		if (!base->event_count_active && !(flags & EVLOOP_NONBLOCK)) {
 			timeout_next(base, &tv_p);
+			if (event_busy_poll_spinning(base)) {
+				/* keep spinning instead of blocking */
+				spinning = 1;
+				tv_p = &tv;
+				evutil_timerclear(&tv);
+			}
 		} else {
 			/*
 			 * if we have active events, we just poll new events
@@ -847,6 +1835,20 @@ event_base_loop(struct event_base *base, int flags)
 			evutil_timerclear(&tv);
 		}
 
+		if (deadline) {
+			/* Don't wait past the deadline. */
+			struct timeval now, left;
+			gettime(base, &now);
+			if (evutil_timercmp(&now, deadline, <))
+				evutil_timersub(deadline, &now, &left);
+			else
+				evutil_timerclear(&left);
+			if (!tv_p || evutil_timercmp(&left, tv_p, <)) {
+				tv = left;
+				tv_p = &tv;
+			}
+		}
+
 		/* If we have no events, we just exit */
 		if (!event_haveevents(base) && !base->event_count_active) {
 			event_debug(("%s: no events registered.", __func__));
@@ -859,20 +1861,36 @@ event_base_loop(struct event_base *base, int flags)
 		/* clear time cache */
 		base->tv_cache.tv_sec = 0;
 
+		if (base->stats_enabled)
+			gettime_nocache(base, &dispatch_start);
+
+		EV_PROBE2(dispatch__start, base, tv_p);
 		res = evsel->dispatch(base, tv_p);
+		EV_PROBE2(dispatch__done, base, res);
 
 		if (res == -1)
 			return (-1);
-		gettime(base, &base->tv_cache);
+		update_time_cache(base);
 
 		timeout_process(base);
+		event_drain_xthread_active(base);
+
+		/* Start a new spin the next time we run out of work. */
+		if (!spinning || base->event_count_active)
+			evutil_timerclear(&base->busy_poll_start);
+
+		if (base->stats_enabled)
+			event_stats_iteration_done(base, &dispatch_start);
 
 		if (base->event_count_active) {
-			event_process_active(base);
+			event_process_active(base, deadline);
 			if (!base->event_count_active && (flags & EVLOOP_ONCE))
 				done = 1;
 		} else if (flags & EVLOOP_NONBLOCK)
 			done = 1;
+
+		if (deadline && event_past_endtime(base, deadline))
+			done = 1;
 	}
 
 	/* clear time cache */
@@ -882,6 +1900,35 @@ event_base_loop(struct event_base *base, int flags)
 	return (0);
 }
 
+int
+event_base_loop(struct event_base *base, int flags)
+{
+	/* clear time cache */
+	base->tv_cache.tv_sec = 0;
+
+	return event_base_loop_impl(base, flags, NULL);
+}
+
+int
+event_base_loop_timed(struct event_base *base, const struct timeval *budget,
+    int flags)
+{
+	struct timeval deadline;
+
+	if (budget == NULL)
+		return event_base_loop(base, flags);
+	if (budget->tv_sec < 0 || budget->tv_usec < 0 ||
+	    budget->tv_usec >= 1000000)
+		return (-1);
+
+	/* clear time cache */
+	base->tv_cache.tv_sec = 0;
+
+	gettime(base, &deadline);
+	evutil_timeradd(&deadline, budget, &deadline);
+	return event_base_loop_impl(base, flags, &deadline);
+}
+
 /* Sets up an event for processing once */
 
 struct event_once {
@@ -889,17 +1936,108 @@ struct event_once {
 
 	void (*cb)(evutil_socket_t, short, void *);
 	void *arg;
+	/* Next entry on the base's once_freelist, when this one is on it. */
+	struct event_once *next_free;
 };
 
+/* Sizes of the objects that an EVENT_BASE_FLAG_OBJECT_POOL base pools:
+ * events (including the ones event_base_once() makes), and the common
+ * evbuffer chain allocations. */
+static int
+event_base_init_pool(struct event_base *base)
+{
+	size_t sizes[4];
+	sizes[0] = sizeof(struct event_once);
+	sizes[1] = 256;
+	sizes[2] = 4096;
+	sizes[3] = 16384;
+
+	base->pool = ev_pool_new(sizes, 4,
+	    !(base->flags & EVENT_BASE_FLAG_NOLOCK));
+	return base->pool ? 0 : -1;
+}
+
+int
+event_base_get_pool_stats(struct event_base *base,
+    struct event_base_pool_stats *stats)
+{
+	if (base == NULL || base->pool == NULL || stats == NULL)
+		return (-1);
+	ev_pool_get_stats(base->pool, stats);
+	return (0);
+}
+
+/* Get a struct event_once for base: from its pool if it has one, or else
+ * from its freelist or the heap. */
+static struct event_once *
+event_once_alloc(struct event_base *base)
+{
+	struct event_once *eonce = NULL;
+
+	/* The pool's smallest class always holds a struct event_once. */
+	if (base && base->pool)
+		return ev_pool_alloc(base->pool, sizeof(struct event_once),
+		    NULL);
+	if (base) {
+		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		if ((eonce = base->once_freelist) != NULL) {
+			base->once_freelist = eonce->next_free;
+			--base->n_once_free;
+		}
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		if (eonce)
+			return (eonce);
+	}
+	return mm_malloc(sizeof(struct event_once));
+}
+
+/* Give back a struct event_once that came from event_once_alloc(base).
+ * The freelist is only for bases without a pool: the pool keeps its own. */
+static void
+event_once_release(struct event_base *base, struct event_once *eonce)
+{
+	if (base && base->pool) {
+		ev_pool_free(eonce);
+		return;
+	}
+	if (base) {
+		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		if (base->n_once_free < EVENT_ONCE_FREELIST_MAX) {
+			eonce->next_free = base->once_freelist;
+			base->once_freelist = eonce;
+			++base->n_once_free;
+			eonce = NULL;
+		}
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	}
+	if (eonce)
+		mm_free(eonce);
+}
+
+/* Free everything on base's once_freelist. */
+static void
+event_once_freelist_clear(struct event_base *base)
+{
+	struct event_once *eonce, *next;
+
+	for (eonce = base->once_freelist; eonce; eonce = next) {
+		next = eonce->next_free;
+		mm_free(eonce);
+	}
+	base->once_freelist = NULL;
+	base->n_once_free = 0;
+}
+
 /* One-time callback, it deletes itself */
 
 static void
 event_once_cb(evutil_socket_t fd, short events, void *arg)
 {
 	struct event_once *eonce = arg;
+	struct event_base *base = eonce->ev.ev_base;
 
 	(*eonce->cb)(fd, events, eonce->arg);
-	mm_free(eonce);
+	event_once_release(base, eonce);
 }
 
 /* not threadsafe, event scheduled once. */
@@ -911,6 +2049,31 @@ event_once(evutil_socket_t fd, short events,
 	return event_base_once(current_base, fd, events, callback, arg, tv);
 }
 
+/* Set up ev to run callback once, the way event_base_once() describes.
+ * Returns -1 for a combination of events that can't fire just once. */
+static int
+event_once_setup(struct event_base *base, struct event *ev,
+    evutil_socket_t fd, short events,
+    void (*callback)(evutil_socket_t, short, void *), void *arg)
+{
+	/* We cannot support signals that just fire once, or persistent
+	 * events. */
+	if (events & (EV_SIGNAL|EV_PERSIST))
+		return (-1);
+
+	if (events == EV_TIMEOUT) {
+		evtimer_assign(ev, base, callback, arg);
+	} else if (events & (EV_READ|EV_WRITE)) {
+		events &= EV_READ|EV_WRITE;
+
+		event_assign(ev, base, fd, events, callback, arg);
+	} else {
+		/* Bad event combination */
+		return (-1);
+	}
+	return (0);
+}
+
 /* Schedules an event once */
 int
 event_base_once(struct event_base *base, evutil_socket_t fd, short events,
@@ -919,46 +2082,57 @@ event_base_once(struct event_base *base, evutil_socket_t fd, short events,
 {
 	struct event_once *eonce;
 	struct timeval etv;
-	int res = 0;
-
-	/* We cannot support signals that just fire once, or persistent
-	 * events. */
-	if (events & (EV_SIGNAL|EV_PERSIST))
-		return (-1);
+	int res;
 
-	if ((eonce = mm_calloc(1, sizeof(struct event_once))) == NULL)
+	eonce = event_once_alloc(base);
+	if (eonce == NULL)
 		return (-1);
+	memset(eonce, 0, sizeof(struct event_once));
 
 	eonce->cb = callback;
 	eonce->arg = arg;
 
-	if (events == EV_TIMEOUT) {
-		if (tv == NULL) {
-			evutil_timerclear(&etv);
-			tv = &etv;
-		}
-
-		evtimer_assign(&eonce->ev, base, event_once_cb, eonce);
-	} else if (events & (EV_READ|EV_WRITE)) {
-		events &= EV_READ|EV_WRITE;
-
-		event_assign(&eonce->ev, base, fd, events, event_once_cb, eonce);
-	} else {
-		/* Bad event combination */
-		mm_free(eonce);
+	if (event_once_setup(base, &eonce->ev, fd, events, event_once_cb,
+		eonce) < 0) {
+		event_once_release(base, eonce);
 		return (-1);
 	}
 
-	if (res == 0)
-		res = event_add(&eonce->ev, tv);
+	if (events == EV_TIMEOUT && tv == NULL) {
+		evutil_timerclear(&etv);
+		tv = &etv;
+	}
+
+	res = event_add(&eonce->ev, tv);
 	if (res != 0) {
-		mm_free(eonce);
+		event_once_release(base, eonce);
 		return (res);
 	}
 
 	return (0);
 }
 
+int
+event_base_once_assign(struct event_base *base, struct event *storage,
+    evutil_socket_t fd, short events,
+    void (*callback)(evutil_socket_t, short, void *),
+    void *arg, const struct timeval *tv)
+{
+	struct timeval etv;
+
+	if (storage == NULL)
+		return (-1);
+	if (event_once_setup(base, storage, fd, events, callback, arg) < 0)
+		return (-1);
+
+	if (events == EV_TIMEOUT && tv == NULL) {
+		evutil_timerclear(&etv);
+		tv = &etv;
+	}
+
+	return event_add(storage, tv);
+}
+
 void
 event_set(struct event *ev, evutil_socket_t fd, short events,
 	  void (*callback)(evutil_socket_t, short, void *), void *arg)
@@ -973,7 +2147,8 @@ event_set(struct event *ev, evutil_socket_t fd, short events,
 	ev->ev_res = 0;
 	ev->ev_flags = EVLIST_INIT;
 	ev->ev_ncalls = 0;
-	ev->ev_pncalls = NULL;
+	ev->ev_xthread_next = NULL;
+	ev->ev_xthread_res = 0;
 
 	if (events & EV_SIGNAL) {
 		if ((events & (EV_READ|EV_WRITE)) != 0)
@@ -982,7 +2157,7 @@ event_set(struct event *ev, evutil_socket_t fd, short events,
 		ev->ev_closure = EV_CLOSURE_SIGNAL;
 	} else {
 		if (events & EV_PERSIST) {
-			timerclear(&ev->ev_io_timeout);
+			ev->ev_io_timeout = 0;
 			ev->ev_closure = EV_CLOSURE_PERSIST;
 		} else {
 			ev->ev_closure = EV_CLOSURE_NONE;
@@ -1000,7 +2175,7 @@ int
 event_base_set(struct event_base *base, struct event *ev)
 {
 	/* Only innocent events may be assigned to a different base */
-	if (ev->ev_flags != EVLIST_INIT)
+	if ((ev->ev_flags & ~EVLIST_X_POOLED) != EVLIST_INIT)
 		return (-1);
 
 	ev->ev_base = base;
@@ -1021,10 +2196,18 @@ struct event *
 event_new(struct event_base *base, evutil_socket_t fd, short events, void (*cb)(evutil_socket_t, short, void *), void *arg)
 {
 	struct event *ev;
-	ev = mm_malloc(sizeof(struct event));
+	const int pooled = base && base->pool;
+
+	/* The pool's smallest class always holds a struct event. */
+	if (pooled)
+		ev = ev_pool_alloc(base->pool, sizeof(struct event), NULL);
+	else
+		ev = mm_malloc(sizeof(struct event));
 	if (ev == NULL)
 		return (NULL);
 	event_assign(ev, base, fd, events, cb, arg);
+	if (pooled)
+		ev->ev_flags |= EVLIST_X_POOLED;
 
 	return (ev);
 }
@@ -1034,7 +2217,10 @@ event_free(struct event *ev)
 {
 	/* make sure that this event won't be coming back to haunt us. */
 	event_del(ev);
-	mm_free(ev);
+	if (ev->ev_flags & EVLIST_X_POOLED)
+		ev_pool_free(ev);
+	else
+		mm_free(ev);
 }
 
 /*
@@ -1069,6 +2255,8 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 		flags |= (ev->ev_events & (EV_READ|EV_WRITE|EV_SIGNAL));
 	if (ev->ev_flags & EVLIST_ACTIVE)
 		flags |= ev->ev_res;
+	/* activated by another thread, but not yet seen by the loop */
+	flags |= (short)ev->ev_xthread_res;
 	if (ev->ev_flags & EVLIST_TIMEOUT)
 		flags |= EV_TIMEOUT;
 
@@ -1076,8 +2264,10 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 
 	/* See if there is a timeout that we should report */
 	if (tv != NULL && (flags & event & EV_TIMEOUT)) {
+		struct timeval tmp = ev->ev_timeout;
 		gettime(ev->ev_base, &now);
-		evutil_timersub(&ev->ev_timeout, &now, &res);
+		tmp.tv_usec &= MICROSECONDS_MASK;
+		evutil_timersub(&tmp, &now, &res);
 		/* correctly remap to real time */
 		evutil_gettimeofday(&now, NULL);
 		evutil_timeradd(&now, &res, tv);
@@ -1118,13 +2308,73 @@ event_add(struct event *ev, const struct timeval *tv)
 
 	EVBASE_ACQUIRE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
 
-	res = event_add_internal(ev, tv);
+	res = event_add_internal(ev, tv, 0);
 
 	EVBASE_RELEASE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
 
 	return (res);
 }
 
+/* Return the base that all n_events events share, or NULL if they don't
+ * or there are none. */
+static struct event_base *
+event_many_get_base(struct event **events, int n_events)
+{
+	struct event_base *base;
+	int i;
+
+	if (n_events <= 0 || !events[0])
+		return NULL;
+	base = events[0]->ev_base;
+	for (i = 1; i < n_events; ++i) {
+		if (!events[i] || events[i]->ev_base != base)
+			return NULL;
+	}
+	return base;
+}
+
+int
+event_add_many(struct event **events, int n_events,
+    const struct timeval *tv)
+{
+	struct event_base *base;
+	int i, res = 0;
+#ifndef EVMAP_USE_HT
+	evutil_socket_t max_fd = -1;
+#endif
+
+	if (n_events == 0)
+		return (0);
+	if ((base = event_many_get_base(events, n_events)) == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	/* Grow the heap and the fd map once for everything.  If that fails,
+	 * event_add_internal() will try again, and report it, per event. */
+	if (tv && !is_common_timeout(tv, base))
+		(void) min_heap_reserve(&base->timeheap,
+		    min_heap_size(&base->timeheap) + n_events);
+#ifndef EVMAP_USE_HT
+	for (i = 0; i < n_events; ++i) {
+		if ((events[i]->ev_events & (EV_READ|EV_WRITE)) &&
+		    events[i]->ev_fd > max_fd)
+			max_fd = events[i]->ev_fd;
+	}
+	if (max_fd >= 0)
+		(void) evmap_io_reserve(base, max_fd + 1);
+#endif
+
+	for (i = 0; i < n_events; ++i) {
+		if (event_add_internal(events[i], tv, 0) == -1)
+			res = -1;
+	}
+
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (res);
+}
+
 static int
 evthread_notify_base_default(struct event_base *base)
 {
@@ -1153,20 +2403,60 @@ evthread_notify_base_eventfd(struct event_base *base)
 }
 #endif
 
+/* Wake up the thread running base's loop, unless a wakeup is already on its
+ * way.  The flag is cleared by the drain callback once it has emptied the
+ * notification fd. */
 static int
 evthread_notify_base(struct event_base *base)
 {
 	if (!base->th_notify_fn)
 		return -1;
-	return base->th_notify_fn(base);
+#ifdef EVTHREAD_HAVE_ATOMICS
+	if (!EVATOMIC_CAS(&base->is_notify_pending, 0, 1))
+		return 0;
+#else
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (base->is_notify_pending) {
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		return 0;
+	}
+	base->is_notify_pending = 1;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+#endif
+	if (base->th_notify_fn(base) < 0) {
+		/* Nothing is on its way after all. */
+		evthread_notify_clear_pending(base);
+		return -1;
+	}
+	return 0;
+}
+
+void
+evthread_notify_clear_pending(struct event_base *base)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	/* A full barrier: whatever was queued before a notifier saw the flag
+	 * set must be visible to the loop once it sees the flag clear. */
+	EVATOMIC_AND(&base->is_notify_pending, 0);
+#else
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	base->is_notify_pending = 0;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+#endif
 }
 
+/* Implementation function to add an event.  Works just like event_add,
+ * except: 1) it requires that we have the lock.  2) if tv_is_absolute is set,
+ * we treat tv as an absolute time, not as an interval to add to the current
+ * time */
 static inline int
-event_add_internal(struct event *ev, const struct timeval *tv)
+event_add_internal(struct event *ev, const struct timeval *tv,
+    int tv_is_absolute)
 {
 	struct event_base *base = ev->ev_base;
 	int res = 0;
 
+	EV_PROBE5(event__add, base, ev, ev->ev_fd, ev->ev_events, tv);
 	event_debug((
 		 "event_add: event: %p, %s%s%scall %p",
 		 ev,
@@ -1181,7 +2471,8 @@ event_add_internal(struct event *ev, const struct timeval *tv)
 	 * prepare for timeout insertion further below, if we get a
 	 * failure on any step, we should not change any state.
 	 */
-	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT)) {
+	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT) &&
+	    !is_common_timeout(tv, base)) {
 		if (min_heap_reserve(&base->timeheap,
 			1 + min_heap_size(&base->timeheap)) == -1)
 			return (-1);  /* ENOMEM == errno */
@@ -1203,13 +2494,16 @@ event_add_internal(struct event *ev, const struct timeval *tv)
 	 */
 	if (res != -1 && tv != NULL) {
 		struct timeval now;
+		int common_timeout;
 
 		/*
 		 * for persistent timeout events, we remember the
 		 * timeout value and re-add the event.
+		 *
+		 * If tv_is_absolute, this was already set.
 		 */
-		if (ev->ev_closure == EV_CLOSURE_PERSIST)
-			ev->ev_io_timeout = *tv;
+		if (ev->ev_closure == EV_CLOSURE_PERSIST && !tv_is_absolute)
+			event_io_timeout_set(ev, tv);
 
 		/*
 		 * we already reserved memory above for the case where we
@@ -1227,23 +2521,40 @@ event_add_internal(struct event *ev, const struct timeval *tv)
 				/* See if we are just active executing
 				 * this event in a loop
 				 */
-				if (ev->ev_ncalls && ev->ev_pncalls) {
-					/* Abort loop */
-					*ev->ev_pncalls = 0;
-				}
+				if (ev->ev_ncalls)
+					event_signal_stop_calls(base, ev);
 			}
 
 			event_queue_remove(base, ev, EVLIST_ACTIVE);
 		}
 
 		gettime(base, &now);
-		evutil_timeradd(&now, tv, &ev->ev_timeout);
+
+		common_timeout = is_common_timeout(tv, base);
+		if (tv_is_absolute) {
+			ev->ev_timeout = *tv;
+		} else if (common_timeout) {
+			struct timeval tmp = *tv;
+			tmp.tv_usec &= MICROSECONDS_MASK;
+			evutil_timeradd(&now, &tmp, &ev->ev_timeout);
+			ev->ev_timeout.tv_usec |=
+			    (tv->tv_usec & ~MICROSECONDS_MASK);
+		} else {
+			evutil_timeradd(&now, tv, &ev->ev_timeout);
+		}
 
 		event_debug((
 			 "event_add: timeout in %d seconds, call %p",
 			 (int)tv->tv_sec, ev->ev_callback));
 
 		event_queue_insert(base, ev, EVLIST_TIMEOUT);
+		if (common_timeout) {
+			struct common_timeout_list *ctl =
+			    get_common_timeout_list(base, &ev->ev_timeout);
+			if (ev == TAILQ_FIRST(&ctl->events)) {
+				common_timeout_schedule(ctl, &now, ev);
+			}
+		}
 	}
 
 	/* if we are not in the right thread, we need to wake up the loop */
@@ -1267,12 +2578,36 @@ event_del(struct event *ev)
 	return (res);
 }
 
+int
+event_del_many(struct event **events, int n_events)
+{
+	struct event_base *base;
+	int i, res = 0;
+
+	if (n_events == 0)
+		return (0);
+	if ((base = event_many_get_base(events, n_events)) == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	for (i = 0; i < n_events; ++i) {
+		if (event_del_internal(events[i]) == -1)
+			res = -1;
+	}
+
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (res);
+}
+
 static inline int
 event_del_internal(struct event *ev)
 {
 	struct event_base *base;
 	int res = 0;
 
+	EV_PROBE3(event__del, ev->ev_base, ev, ev->ev_fd);
 	event_debug(("event_del: %p, callback %p",
 		 ev, ev->ev_callback));
 
@@ -1286,15 +2621,18 @@ event_del_internal(struct event *ev)
 
 	/* See if we are just active executing this event in a loop */
 	if (ev->ev_events & EV_SIGNAL) {
-		if (ev->ev_ncalls && ev->ev_pncalls) {
-			/* Abort loop */
-			*ev->ev_pncalls = 0;
-		}
+		if (ev->ev_ncalls)
+			event_signal_stop_calls(base, ev);
 	}
 
 	if (ev->ev_flags & EVLIST_TIMEOUT)
 		event_queue_remove(base, ev, EVLIST_TIMEOUT);
 
+	/* If another thread has activated ev, make that visible so we can
+	 * cancel it along with everything else. */
+	if (ev->ev_xthread_res)
+		event_cancel_xthread_active(base, ev);
+
 	if (ev->ev_flags & EVLIST_ACTIVE)
 		event_queue_remove(base, ev, EVLIST_ACTIVE);
 
@@ -1313,14 +2651,105 @@ event_del_internal(struct event *ev)
 	return (res);
 }
 
+#ifdef EVTHREAD_HAVE_ATOMICS
+/* Bit in ev_xthread_res meaning that the event is on th_xthread_active, so
+ * that an event with res==0 still counts as queued. */
+#define EV_XTHREAD_QUEUED 0x10000
+
+/* Activate ev from a thread other than the one running its base's loop,
+ * without taking the base lock: push ev onto th_xthread_active, and let the
+ * loop move it to the active queues.  If ev is already queued, just add res
+ * to what it will be activated with. */
+static void
+event_active_xthread(struct event *ev, int res)
+{
+	struct event_base *base = ev->ev_base;
+	struct event *head;
+
+	if (EVATOMIC_OR(&ev->ev_xthread_res, res | EV_XTHREAD_QUEUED) != 0)
+		return;
+
+	do {
+		head = base->th_xthread_active;
+		ev->ev_xthread_next = head;
+	} while (!EVATOMIC_CAS(&base->th_xthread_active, head, ev));
+
+	evthread_notify_base(base);
+}
+#endif
+
+/* Move every event on th_xthread_active to the active queues, in the order
+ * they were activated. */
+static void
+event_drain_xthread_active(struct event_base *base)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	struct event *ev, *next, *fifo = NULL;
+	int res;
+
+	if (base->th_xthread_active == NULL)
+		return;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	ev = EVATOMIC_XCHG(&base->th_xthread_active, NULL);
+
+	/* The stack is newest-first. */
+	for (; ev; ev = next) {
+		next = ev->ev_xthread_next;
+		ev->ev_xthread_next = fifo;
+		fifo = ev;
+	}
+
+	for (ev = fifo; ev; ev = next) {
+		next = ev->ev_xthread_next;
+		ev->ev_xthread_next = NULL;
+		/* Once this clears QUEUED, other threads may push ev again. */
+		res = EVATOMIC_AND(&ev->ev_xthread_res, 0) & ~EV_XTHREAD_QUEUED;
+		event_active_internal(ev, res, 1);
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+#endif
+}
+
+/* Move ev, which another thread has activated, to the active queues along
+ * with everything else on th_xthread_active.  That thread sets
+ * EV_XTHREAD_QUEUED before it pushes ev, so if ev isn't there yet, wait
+ * for the push: otherwise ev would be activated after event_del() returns,
+ * and touched after event_free().  The push takes no lock and is only a
+ * few instructions, so this waits only as long as the other thread is
+ * preempted in between. */
+static void
+event_cancel_xthread_active(struct event_base *base, struct event *ev)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	event_drain_xthread_active(base);
+	while (ev->ev_xthread_res & EV_XTHREAD_QUEUED) {
+		EVATOMIC_BARRIER();
+		event_drain_xthread_active(base);
+	}
+#endif
+}
+
 void
 event_active(struct event *ev, int res, short ncalls)
 {
+#ifdef EVTHREAD_HAVE_ATOMICS
+	if (EVBASE_USING_LOCKS(ev->ev_base) && !EVBASE_IN_THREAD(ev->ev_base) &&
+	    !(ev->ev_events & EV_SIGNAL)) {
+		event_active_xthread(ev, res);
+		return;
+	}
+#endif
+
 	EVBASE_ACQUIRE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
 
 	event_active_internal(ev, res, ncalls);
 
 	EVBASE_RELEASE_LOCK(ev->ev_base, EVTHREAD_WRITE, th_base_lock);
+
+	/* if we are not in the right thread, we need to wake up the loop */
+	if (!EVBASE_IN_THREAD(ev->ev_base))
+		evthread_notify_base(ev->ev_base);
 }
 
 
@@ -1339,10 +2768,8 @@ event_active_internal(struct event *ev, int res, short ncalls)
 
 	ev->ev_res = res;
 
-	if (ev->ev_events & EV_SIGNAL) {
+	if (ev->ev_events & EV_SIGNAL)
 		ev->ev_ncalls = ncalls;
-		ev->ev_pncalls = NULL;
-	}
 
 	event_queue_insert(base, ev, EVLIST_ACTIVE);
 }
@@ -1351,6 +2778,7 @@ void
 event_deferred_cb_init(struct deferred_cb *cb, deferred_cb_fn fn, void *arg)
 {
 	memset(cb, 0, sizeof(struct deferred_cb));
+	cb->pri = -1;
 	cb->cb = fn;
 	cb->arg = arg;
 }
@@ -1362,10 +2790,18 @@ event_deferred_cb_cancel(struct event_base *base, struct deferred_cb *cb)
 		base = current_base;
 
 	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
-	if (cb->queued) {
-		TAILQ_REMOVE(&base->deferred_cb_list, cb, cb_next);
+	if (cb->queued == DEFERRED_CB_QUEUED) {
+		TAILQ_REMOVE(event_deferred_cb_queue(base, cb), cb, cb_next);
 		--base->event_count_active;
 		cb->queued = 0;
+	} else if (cb->queued == DEFERRED_CB_IN_BATCH) {
+		/* The loop may be about to take it out of the batch. */
+		EVLOCK_LOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+		if (cb->queued == DEFERRED_CB_IN_BATCH) {
+			TAILQ_REMOVE(&base->deferred_cb_batch, cb, cb_next);
+			cb->queued = 0;
+		}
+		EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
 	}
 	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 }
@@ -1373,12 +2809,23 @@ event_deferred_cb_cancel(struct event_base *base, struct deferred_cb *cb)
 void
 event_deferred_cb_schedule(struct event_base *base, struct deferred_cb *cb)
 {
+	int queued;
+
 	if (!base)
 		base = current_base;
 	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
-	if (!cb->queued) {
-		cb->queued = 1;
-		TAILQ_INSERT_TAIL(&base->deferred_cb_list, cb, cb_next);
+	queued = cb->queued;
+	if (queued == DEFERRED_CB_IN_BATCH) {
+		/* If the loop has just taken it out of the batch to run it,
+		 * it has to go in the next round. */
+		EVLOCK_LOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+		queued = cb->queued;
+		EVLOCK_UNLOCK(base->th_deferred_lock, EVTHREAD_WRITE);
+	}
+	if (!queued) {
+		cb->queued = DEFERRED_CB_QUEUED;
+		TAILQ_INSERT_TAIL(event_deferred_cb_queue(base, cb), cb,
+		    cb_next);
 		++base->event_count_active;
 		if (!EVBASE_IN_THREAD(base))
 			evthread_notify_base(base);
@@ -1386,6 +2833,29 @@ event_deferred_cb_schedule(struct event_base *base, struct deferred_cb *cb)
 	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 }
 
+void
+event_deferred_cb_set_priority(struct event_base *base,
+    struct deferred_cb *cb, int pri)
+{
+	if (!base)
+		base = current_base;
+
+	if (pri < 0)
+		pri = -1;
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (cb->queued == DEFERRED_CB_QUEUED) {
+		TAILQ_REMOVE(event_deferred_cb_queue(base, cb), cb, cb_next);
+		cb->pri = pri;
+		TAILQ_INSERT_TAIL(event_deferred_cb_queue(base, cb), cb,
+		    cb_next);
+	} else {
+		/* If it is in the current batch, this takes effect if it
+		 * gets put back. */
+		cb->pri = pri;
+	}
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+}
+
 static int
 timeout_next(struct event_base *base, struct timeval **tv_p)
 {
@@ -1413,7 +2883,23 @@ timeout_next(struct event_base *base, struct timeval **tv_p)
 		goto out;
 	}
 
-	evutil_timersub(&ev->ev_timeout, &now, tv);
+	if (base->timer_slack_usec) {
+		/* Sleep until the last multiple of the slack that is no more
+		 * than the slack past the first timeout.  That timeout isn't
+		 * kept waiting longer than it allows, everything due by then
+		 * fires in the same wakeup, and bases that share a clock
+		 * line their wakeups up. */
+		struct timeval wake;
+		ev_uint64_t usec;
+		usec = ev->ev_timeout.tv_sec * (ev_uint64_t)1000000 +
+		    ev->ev_timeout.tv_usec + base->timer_slack_usec;
+		usec -= usec % base->timer_slack_usec;
+		wake.tv_sec = (time_t)(usec / 1000000);
+		wake.tv_usec = (long)(usec % 1000000);
+		evutil_timersub(&wake, &now, tv);
+	} else {
+		evutil_timersub(&ev->ev_timeout, &now, tv);
+	}
 
 	assert(tv->tv_sec >= 0);
 	assert(tv->tv_usec >= 0);
@@ -1433,9 +2919,8 @@ out:
 static void
 timeout_correct(struct event_base *base, struct timeval *tv)
 {
-	struct event **pev;
-	unsigned int size;
 	struct timeval off;
+	int i;
 
 	if (use_monotonic)
 		return;
@@ -1458,11 +2943,19 @@ timeout_correct(struct event_base *base, struct timeval *tv)
 	 * We can modify the key element of the node without destroying
 	 * the key, beause we apply it to all in the right order.
 	 */
-	pev = base->timeheap.p;
-	size = base->timeheap.n;
-	for (; size-- > 0; ++pev) {
-		struct timeval *ev_tv = &(**pev).ev_timeout;
-		evutil_timersub(ev_tv, &off, ev_tv);
+	min_heap_shift_keys(&base->timeheap, &off);
+	for (i=0; i<base->n_common_timeouts; ++i) {
+		struct event *ev;
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		TAILQ_FOREACH(ev, &ctl->events,
+		    ev_timeout_pos.ev_next_with_common_timeout) {
+			struct timeval *ev_tv = &ev->ev_timeout;
+			ev_tv->tv_usec &= MICROSECONDS_MASK;
+			evutil_timersub(ev_tv, &off, ev_tv);
+			ev_tv->tv_usec |= COMMON_TIMEOUT_MAGIC |
+			    (i<<COMMON_TIMEOUT_IDX_SHIFT);
+		}
 	}
 	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
 }
@@ -1508,7 +3001,8 @@ event_queue_remove(struct event_base *base, struct event *ev, int queue)
 	ev->ev_flags &= ~queue;
 	switch (queue) {
 	case EVLIST_INSERTED:
-		TAILQ_REMOVE(&base->eventqueue, ev, ev_next);
+		/* Inserted events are found through base->io and
+		 * base->sigmap; there is no list of them to update. */
 		break;
 	case EVLIST_ACTIVE:
 		base->event_count_active--;
@@ -1516,13 +3010,53 @@ event_queue_remove(struct event_base *base, struct event *ev, int queue)
 		    ev, ev_active_next);
 		break;
 	case EVLIST_TIMEOUT:
-		min_heap_erase(&base->timeheap, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    get_common_timeout_list(base, &ev->ev_timeout);
+			TAILQ_REMOVE(&ctl->events, ev,
+			    ev_timeout_pos.ev_next_with_common_timeout);
+		} else {
+			min_heap_erase(&base->timeheap, ev);
+		}
 		break;
 	default:
 		event_errx(1, "%s: unknown queue %x", __func__, queue);
 	}
 }
 
+/* Add 'ev' to the common timeout list in 'ev'. */
+static void
+insert_common_timeout_inorder(struct common_timeout_list *ctl,
+    struct event *ev)
+{
+	struct event *e;
+	/* By all logic, we should just be able to append 'ev' to the end of
+	 * ctl->events, since the timeout on each 'ev' is set to {the common
+	 * timeout} + {the time when we add the event}, and so the events
+	 * should arrive in order of their timeeouts.  But just in case
+	 * there's some wacky threading issue going on, we do a search from
+	 * the end of 'ev' to find the right insertion point.
+	 */
+	for (e = TAILQ_LAST(&ctl->events, event_list); e;
+	    e = TAILQ_PREV(e, event_list,
+		ev_timeout_pos.ev_next_with_common_timeout)) {
+		/* This timercmp is a little sneaky, since both ev and e have
+		 * magic values in tv_usec.  Fortunately, they ought to have
+		 * the _same_ magic values in tv_usec.  Let's assert for that.
+		 */
+		assert(
+			COMMON_TIMEOUT_IDX(&e->ev_timeout) ==
+			COMMON_TIMEOUT_IDX(&ev->ev_timeout));
+		if (evutil_timercmp(&ev->ev_timeout, &e->ev_timeout, >=)) {
+			TAILQ_INSERT_AFTER(&ctl->events, e, ev,
+			    ev_timeout_pos.ev_next_with_common_timeout);
+			return;
+		}
+	}
+	TAILQ_INSERT_HEAD(&ctl->events, ev,
+	    ev_timeout_pos.ev_next_with_common_timeout);
+}
+
 void
 event_queue_insert(struct event_base *base, struct event *ev, int queue)
 {
@@ -1541,7 +3075,6 @@ event_queue_insert(struct event_base *base, struct event *ev, int queue)
 	ev->ev_flags |= queue;
 	switch (queue) {
 	case EVLIST_INSERTED:
-		TAILQ_INSERT_TAIL(&base->eventqueue, ev, ev_next);
 		break;
 	case EVLIST_ACTIVE:
 		base->event_count_active++;
@@ -1549,7 +3082,12 @@ event_queue_insert(struct event_base *base, struct event *ev, int queue)
 		    ev,ev_active_next);
 		break;
 	case EVLIST_TIMEOUT: {
-		min_heap_push(&base->timeheap, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    get_common_timeout_list(base, &ev->ev_timeout);
+			insert_common_timeout_inorder(ctl, ev);
+		} else
+			min_heap_push(&base->timeheap, ev);
 		break;
 	}
 	default:
@@ -1678,6 +3216,7 @@ evthread_notify_drain_eventfd(int fd, short what, void *arg)
 	ev_uint64_t msg;
 
 	read(fd, (void*) &msg, sizeof(msg));
+	evthread_notify_clear_pending(arg);
 }
 #endif
 
@@ -1692,6 +3231,7 @@ evthread_notify_drain_default(evutil_socket_t fd, short what, void *arg)
 	while (read(fd, (char*)buf, sizeof(buf)) > 0)
 		;
 #endif
+	evthread_notify_clear_pending(arg);
 }
 
 void
@@ -1713,7 +3253,9 @@ evthread_make_base_notifiable(struct event_base *base)
 	if (!base)
 		return -1;
 
-	if (base->th_notify_fd[0] >= 0)
+	/* Already notifiable, either through th_notify_fd or because the
+	 * backend set up a wakeup mechanism of its own in its init(). */
+	if (base->th_notify_fd[0] >= 0 || base->th_notify_fn)
 		return 0;
 
 #if defined(_EVENT_HAVE_EVENTFD) && defined(_EVENT_HAVE_SYS_EVENTFD_H)
@@ -1778,27 +3320,32 @@ evthread_set_lock_create_callbacks(void *(*alloc_fn)(void),
 #endif
 }
 
+static int
+event_base_dump_event(struct event_base *base, struct event *e, void *arg)
+{
+	FILE *output = arg;
+	fprintf(output, "  %p [fd %ld]%s%s%s%s%s\n",
+			(void*)e, (long)e->ev_fd,
+			(e->ev_events&EV_READ)?" Read":"",
+			(e->ev_events&EV_WRITE)?" Write":"",
+			(e->ev_events&EV_SIGNAL)?" Signal":"",
+			(e->ev_events&EV_TIMEOUT)?" Timeout":"",
+			(e->ev_events&EV_PERSIST)?" Persist":"");
+	return 0;
+}
+
 void
 event_base_dump_events(struct event_base *base, FILE *output)
 {
 	struct event *e;
 	int i;
 	fprintf(output, "Inserted events:\n");
-	TAILQ_FOREACH(e, &base->eventqueue, ev_next) {
-		fprintf(output, "  %p [fd %ld]%s%s%s%s%s\n",
-				(void*)e, (long)e->ev_fd,
-				(e->ev_events&EV_READ)?" Read":"",
-				(e->ev_events&EV_WRITE)?" Write":"",
-				(e->ev_events&EV_SIGNAL)?" Signal":"",
-				(e->ev_events&EV_TIMEOUT)?" Timeout":"",
-				(e->ev_events&EV_PERSIST)?" Persist":"");
-
-	}
+	evmap_foreach_event(base, event_base_dump_event, output);
 	for (i = 0; i < base->nactivequeues; ++i) {
 		if (TAILQ_EMPTY(base->activequeues[i]))
 			continue;
 		fprintf(output, "Active events [priority %d]:\n", i);
-		TAILQ_FOREACH(e, &base->eventqueue, ev_next) {
+		TAILQ_FOREACH(e, base->activequeues[i], ev_active_next) {
 			fprintf(output, "  %p [fd %ld]%s%s%s%s\n",
 					(void*)e, (long)e->ev_fd,
 					(e->ev_res&EV_READ)?" Read active":"",
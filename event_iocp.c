@@ -52,38 +52,125 @@ handle_entry(OVERLAPPED *o, ULONG_PTR completion_key, DWORD nBytes)
 	eo->cb(eo, completion_key, nBytes);
 }
 
+/** How many completions a thread takes off the port at once, when it can,
+ * unless told otherwise; and the most it can be told to take. */
+#define DEFAULT_BATCH 64
+#define MAX_BATCH 1024
+
+/** How long a thread beyond a port's minimum waits for a completion before
+ * it decides it isn't needed and exits. */
+#define IDLE_THREAD_MSEC 10000
+
+/* Laid out like Vista's OVERLAPPED_ENTRY, which older headers lack. */
+struct iocp_entry {
+	ULONG_PTR completion_key;
+	OVERLAPPED *overlapped;
+	ULONG_PTR internal;
+	DWORD n_bytes;
+};
+typedef BOOL (WINAPI *GetQueuedCompletionStatusEx_fn)(HANDLE,
+    struct iocp_entry *, ULONG, ULONG *, DWORD, BOOL);
+
+/* GetQueuedCompletionStatusEx, if this Windows has it. */
+static GetQueuedCompletionStatusEx_fn get_queued_status_ex = NULL;
+
+static int start_thread(struct event_iocp_port *port);
+
+/* Take up to max completions off port p, waiting up to ms for the first.
+ * Return how many we got, or -1 if we timed out or failed. */
+static int
+dequeue(HANDLE p, struct iocp_entry *entries, ULONG max, DWORD ms)
+{
+	ULONG n;
+	if (get_queued_status_ex && max > 1) {
+		if (!get_queued_status_ex(p, entries, max, &n, ms, FALSE))
+			return -1;
+		return (int)n;
+	}
+	if (!GetQueuedCompletionStatus(p, &entries[0].n_bytes,
+		&entries[0].completion_key, &entries[0].overlapped, ms)) {
+		/* With an overlapped, this is an operation that failed,
+		 * and its callback needs to hear about it. */
+		if (!entries[0].overlapped)
+			return -1;
+	}
+	return 1;
+}
+
 static void
 loop(void *_port)
 {
 	struct event_iocp_port *port = _port;
-	OVERLAPPED *overlapped;
-	ULONG_PTR key;
-	DWORD bytes;
-	long ms = port->ms;
+	struct iocp_entry one_entry, *entries;
+	ULONG max = port->batch_size;
 	HANDLE p = port->port;
+	DWORD err;
+	int i, n;
+
+	if (max == 1 || !(entries = mm_calloc(max, sizeof(*entries)))) {
+		entries = &one_entry;
+		max = 1;
+	}
+
+	EnterCriticalSection(&port->lock);
+	while (!port->shutdown) {
+		DWORD ms = port->ms <= 0 ? INFINITE : port->ms;
+		int extra = port->n_live_threads > port->min_threads;
+		if (extra && (ms == INFINITE || ms > IDLE_THREAD_MSEC))
+			ms = IDLE_THREAD_MSEC;
+		++port->n_waiting;
+		LeaveCriticalSection(&port->lock);
 
-	if (ms <= 0)
-		ms = INFINITE;
+		n = dequeue(p, entries, max, ms);
+		err = n < 0 ? GetLastError() : 0;
 
-	while (GetQueuedCompletionStatus(p, &bytes, &key,
-		&overlapped, ms)) {
 		EnterCriticalSection(&port->lock);
-		if (port->shutdown) {
-			if (--port->n_live_threads == 0)
-				ReleaseSemaphore(port->shutdownSemaphore, 1, NULL);
-			LeaveCriticalSection(&port->lock);
-			return;
+		--port->n_waiting;
+		if (port->shutdown)
+			break;
+		if (n < 0) {
+			if (err != WAIT_TIMEOUT) {
+				event_warnx("GetQueuedCompletionStatus exited "
+				    "with no event.");
+				break;
+			}
+			if (port->n_live_threads > port->min_threads)
+				break;
+			continue;
 		}
+		/* If nobody is left waiting and these callbacks block,
+		 * completions would pile up: get some help. */
+		if (port->n_waiting == 0 &&
+		    port->n_live_threads < port->max_threads)
+			start_thread(port);
 		LeaveCriticalSection(&port->lock);
 
-		if (key != NOTIFICATION_KEY)
-			handle_entry(overlapped, key, bytes);
+		for (i = 0; i < n; ++i) {
+			if (entries[i].completion_key != NOTIFICATION_KEY)
+				handle_entry(entries[i].overlapped,
+				    entries[i].completion_key,
+				    entries[i].n_bytes);
+		}
+
+		EnterCriticalSection(&port->lock);
 	}
-	event_warnx("GetQueuedCompletionStatus exited with no event.");
-	EnterCriticalSection(&port->lock);
 	if (--port->n_live_threads == 0)
 		ReleaseSemaphore(port->shutdownSemaphore, 1, NULL);
 	LeaveCriticalSection(&port->lock);
+	if (entries != &one_entry)
+		mm_free(entries);
+}
+
+/* Start another thread on port.  Must hold port->lock once there are any
+ * threads. */
+static int
+start_thread(struct event_iocp_port *port)
+{
+	uintptr_t th = _beginthread(loop, 0, port);
+	if (th == (uintptr_t)-1)
+		return -1;
+	++port->n_live_threads;
+	return 0;
 }
 
 int
@@ -91,7 +178,8 @@ event_iocp_port_associate(struct event_iocp_port *port, evutil_socket_t fd,
     uintptr_t key)
 {
 	HANDLE h;
-	h = CreateIoCompletionPort((HANDLE)fd, port->port, key, port->n_threads);
+	h = CreateIoCompletionPort((HANDLE)fd, port->port, key,
+	    port->min_threads);
 	if (!h)
 		return -1;
 	return 0;
@@ -99,18 +187,51 @@ event_iocp_port_associate(struct event_iocp_port *port, evutil_socket_t fd,
 
 struct event_iocp_port *
 event_iocp_port_launch(void)
+{
+	return event_iocp_port_launch_with_limits(0, 0, 0);
+}
+
+struct event_iocp_port *
+event_iocp_port_launch_with_limits(int min_threads, int max_threads,
+    int batch_size)
 {
 	struct event_iocp_port *port;
 	int i;
 
+	if (!get_queued_status_ex) {
+		HMODULE kernel32 = GetModuleHandle(TEXT("kernel32.dll"));
+		if (kernel32)
+			get_queued_status_ex = (GetQueuedCompletionStatusEx_fn)
+			    GetProcAddress(kernel32,
+				"GetQueuedCompletionStatusEx");
+	}
+
+	if (min_threads <= 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		min_threads = info.dwNumberOfProcessors;
+		if (min_threads < 2)
+			min_threads = 2;
+	}
+	if (max_threads <= 0)
+		max_threads = 2 * min_threads;
+	if (max_threads < min_threads)
+		max_threads = min_threads;
+	if (batch_size <= 0)
+		batch_size = DEFAULT_BATCH;
+	else if (batch_size > MAX_BATCH)
+		batch_size = MAX_BATCH;
+
 	if (!(port = mm_calloc(1, sizeof(struct event_iocp_port))))
 		return NULL;
-	port->n_threads = 2;
-	port->threads = calloc(port->n_threads, sizeof(HANDLE));
-	if (!port->threads)
-		goto err;
+	port->min_threads = min_threads;
+	port->max_threads = max_threads;
+	port->batch_size = batch_size;
 
-	port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, port->n_threads);
+	/* Windows lets min_threads run at once; the others are for when
+	 * callbacks block. */
+	port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0,
+	    port->min_threads);
 	port->ms = -1;
 	if (!port->port)
 		goto err;
@@ -119,22 +240,26 @@ event_iocp_port_launch(void)
 	if (!port->shutdownSemaphore)
 		goto err;
 
-	for (i=0; i<port->n_threads; ++i) {
-		uintptr_t th = _beginthread(loop, 0, port);
-		if (th == (uintptr_t)-1)
-			goto err;
-		port->threads[i] = (HANDLE)th;
-		++port->n_live_threads;
-	}
-
 	InitializeCriticalSection(&port->lock);
 
+	EnterCriticalSection(&port->lock);
+	for (i=0; i<port->min_threads; ++i) {
+		if (start_thread(port) < 0)
+			break;
+	}
+	/* Make do with however many threads we got, if any. */
+	if (i && i < port->min_threads)
+		port->min_threads = i;
+	LeaveCriticalSection(&port->lock);
+	if (!i) {
+		DeleteCriticalSection(&port->lock);
+		goto err;
+	}
+
 	return port;
 err:
 	if (port->port)
 		CloseHandle(port->port);
-	if (port->threads)
-		mm_free(port->threads);
 	if (port->shutdownSemaphore)
 		CloseHandle(port->shutdownSemaphore);
 	mm_free(port);
@@ -147,15 +272,15 @@ _event_iocp_port_unlock_and_free(struct event_iocp_port *port)
 	DeleteCriticalSection(&port->lock);
 	CloseHandle(port->port);
 	CloseHandle(port->shutdownSemaphore);
-	mm_free(port->threads);
 	mm_free(port);
 }
 
+/* Wake up every thread on port.  Must hold port->lock. */
 static int
 event_iocp_notify_all(struct event_iocp_port *port)
 {
 	int i, r, ok=1;
-	for (i=0; i<port->n_threads; ++i) {
+	for (i=0; i<port->n_live_threads; ++i) {
 		r = PostQueuedCompletionStatus(port->port, 0, NOTIFICATION_KEY,
 		    NULL);
 		if (!r)
@@ -170,8 +295,8 @@ event_iocp_shutdown(struct event_iocp_port *port, long waitMsec)
 	int n;
 	EnterCriticalSection(&port->lock);
 	port->shutdown = 1;
-	LeaveCriticalSection(&port->lock);
 	event_iocp_notify_all(port);
+	LeaveCriticalSection(&port->lock);
 
 	WaitForSingleObject(port->shutdownSemaphore, waitMsec);
 	EnterCriticalSection(&port->lock);
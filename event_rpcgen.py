@@ -60,8 +60,21 @@ class Struct:
 class StructCCode(Struct):
     """ Knows how to generate C code for a struct """
 
-    def __init__(self, name):
+    def __init__(self, name, arena=False, stream=False):
         Struct.__init__(self, name)
+        self._arena = arena
+        self._stream = stream
+
+    def Arena(self):
+        """True if everything in the struct is allocated from an arena."""
+        return self._arena
+
+    def Stream(self):
+        """True if the struct can be unmarshaled a piece at a time, with
+        the elements of its arrays handed to callbacks."""
+        if not self._stream:
+            return False
+        return len([e for e in self._entries if e.Array()]) > 0
 
     def PrintTags(self, file):
         """Prints the tag definitions for a structure."""
@@ -90,7 +103,12 @@ class StructCCode(Struct):
         print >>file, '};\n'
 
         print >>file, 'struct %s {' % self._name
-        print >>file, '  struct %s_access_ *base;\n' % self._name
+        if self._arena:
+            print >>file, '  struct %s_access_ *base;' % self._name
+            print >>file, '  struct evtag_arena *_arena;'
+            print >>file, '  int _owns_arena;\n'
+        else:
+            print >>file, '  struct %s_access_ *base;\n' % self._name
         for entry in self._entries:
             dcl = entry.Declaration()
             self.PrintIndented(file, '  ', dcl)
@@ -104,6 +122,7 @@ class StructCCode(Struct):
 void %(name)s_free(struct %(name)s *);
 void %(name)s_clear(struct %(name)s *);
 void %(name)s_marshal(struct evbuffer *, const struct %(name)s *);
+ev_uint32_t %(name)s_marshal_length(const struct %(name)s *);
 int %(name)s_unmarshal(struct %(name)s *, struct evbuffer *);
 int %(name)s_complete(struct %(name)s *);
 void evtag_marshal_%(name)s(struct evbuffer *, ev_uint32_t,
@@ -111,6 +130,15 @@ void evtag_marshal_%(name)s(struct evbuffer *, ev_uint32_t,
 int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
     struct %(name)s *);""" % { 'name' : self._name }
 
+        if self._arena:
+            print >>file, \
+"""struct %(name)s *%(name)s_new_with_arena(struct evtag_arena *);
+int evtag_unmarshal_%(name)s_pinned(struct evbuffer *, ev_uint32_t,
+    struct %(name)s *);""" % { 'name' : self._name }
+
+        if self.Stream():
+            self.PrintStreamDeclaration(file)
+
 
         # Write a setting function of every variable
         for entry in self._entries:
@@ -137,16 +165,19 @@ int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
         print >>file, '};\n'
 
         # Creation
-        print >>file, (
-            'struct %(name)s *\n'
-            '%(name)s_new(void)\n'
-            '{\n'
-            '  struct %(name)s *tmp;\n'
-            '  if ((tmp = malloc(sizeof(struct %(name)s))) == NULL) {\n'
-            '    event_warn("%%s: malloc", __func__);\n'
-            '    return (NULL);\n'
-            '  }\n'
-            '  tmp->base = &__%(name)s_base;\n') % { 'name' : self._name }
+        if self._arena:
+            self.PrintArenaNew(file)
+        else:
+            print >>file, (
+                'struct %(name)s *\n'
+                '%(name)s_new(void)\n'
+                '{\n'
+                '  struct %(name)s *tmp;\n'
+                '  if ((tmp = malloc(sizeof(struct %(name)s))) == NULL) {\n'
+                '    event_warn("%%s: malloc", __func__);\n'
+                '    return (NULL);\n'
+                '  }\n'
+                '  tmp->base = &__%(name)s_base;\n') % { 'name' : self._name }
 
         for entry in self._entries:
             self.PrintIndented(file, '  ', entry.CodeInitialize('tmp'))
@@ -188,11 +219,17 @@ int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
                         '{'
                         ) % { 'name' : self._name }
 
-        for entry in self._entries:
-            self.PrintIndented(file, '  ', entry.CodeFree('tmp'))
+        if self._arena:
+            # the entries and the struct itself all live in the arena
+            print >>file, ('  if (tmp->_owns_arena)\n'
+                           '    evtag_arena_free(tmp->_arena);\n'
+                           '}\n')
+        else:
+            for entry in self._entries:
+                self.PrintIndented(file, '  ', entry.CodeFree('tmp'))
 
-        print >>file, ('  free(tmp);\n'
-                       '}\n')
+            print >>file, ('  free(tmp);\n'
+                           '}\n')
 
         # Marshaling
         print >>file, ('void\n'
@@ -215,38 +252,67 @@ int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
 
         print >>file, '}\n'
 
-        # Unmarshaling
-        print >>file, ('int\n'
-                       '%(name)s_unmarshal(struct %(name)s *tmp, '
-                       ' struct evbuffer *evbuf)\n'
+        # Computing the marshaled length
+        print >>file, ('ev_uint32_t\n'
+                       '%(name)s_marshal_length(const struct %(name)s *tmp)\n'
                        '{\n'
-                       '  ev_uint32_t tag;\n'
-                       '  while (evbuffer_get_length(evbuf) > 0) {\n'
-                       '    if (evtag_peek(evbuf, &tag) == -1)\n'
-                       '      return (-1);\n'
-                       '    switch (tag) {\n'
-                       ) % { 'name' : self._name }
+                       '  ev_uint32_t len = 0;') % { 'name' : self._name }
         for entry in self._entries:
-            print >>file, '      case %s:\n' % self.EntryTagName(entry)
-            if not entry.Array():
-                print >>file, (
-                    '        if (tmp->%s_set)\n'
-                    '          return (-1);'
-                    ) % (entry.Name())
-
+            indent = '  '
+            if entry.Optional():
+                indent += '  '
+                print >>file, '  if (tmp->%s_set) {' % entry.Name()
             self.PrintIndented(
-                file, '        ',
-                entry.CodeUnmarshal('evbuf',
-                                    self.EntryTagName(entry),
-                                    entry.GetVarName('tmp'),
-                                    entry.GetVarLen('tmp')))
-
-            print >>file, ( '        tmp->%s_set = 1;\n' % entry.Name() +
-                            '        break;\n' )
+                file, indent,
+                entry.CodeMarshalLength(self.EntryTagName(entry),
+                                        entry.GetVarName('tmp'),
+                                        entry.GetVarLen('tmp')))
+            if entry.Optional():
+                print >>file, '  }'
+
+        print >>file, ('  return (len);\n'
+                       '}\n')
+
+        # Unmarshaling
+        if self._arena:
+            # Only unmarshal len bytes; nested structs are parsed
+            # straight out of the buffer of the struct containing them.
+            print >>file, ('static int\n'
+                           '%(name)s_unmarshal_bounded(struct %(name)s *tmp,'
+                           ' struct evbuffer *evbuf,\n'
+                           '    size_t len)\n'
+                           '{\n'
+                           '  ev_uint32_t tag;\n'
+                           '  size_t end;\n'
+                           '  if (evbuffer_get_length(evbuf) < len)\n'
+                           '    return (-1);\n'
+                           '  end = evbuffer_get_length(evbuf) - len;\n'
+                           '  while (evbuffer_get_length(evbuf) > end) {\n'
+                           '    if (evtag_peek(evbuf, &tag) == -1)\n'
+                           '      return (-1);\n'
+                           '    switch (tag) {\n'
+                           ) % { 'name' : self._name }
+        else:
+            print >>file, ('int\n'
+                           '%(name)s_unmarshal(struct %(name)s *tmp, '
+                           ' struct evbuffer *evbuf)\n'
+                           '{\n'
+                           '  ev_uint32_t tag;\n'
+                           '  while (evbuffer_get_length(evbuf) > 0) {\n'
+                           '    if (evtag_peek(evbuf, &tag) == -1)\n'
+                           '      return (-1);\n'
+                           '    switch (tag) {\n'
+                           ) % { 'name' : self._name }
+        for entry in self._entries:
+            self.PrintUnmarshalCase(file, entry)
+            print >>file, '        break;\n'
         print >>file, ( '      default:\n'
                         '        return -1;\n'
                         '    }\n'
                         '  }\n' )
+        if self._arena:
+            print >>file, ( '  if (evbuffer_get_length(evbuf) != end)\n'
+                            '    return (-1);' )
         # Check if it was decoded completely
         print >>file, ( '  if (%(name)s_complete(tmp) == -1)\n'
                         '    return (-1);'
@@ -256,6 +322,27 @@ int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
         print >>file, ( '  return (0);\n'
                         '}\n')
 
+        if self._arena:
+            print >>file, (
+                'int\n'
+                '%(name)s_unmarshal(struct %(name)s *tmp, '
+                'struct evbuffer *evbuf)\n'
+                '{\n'
+                '  size_t len = evbuffer_get_length(evbuf);\n'
+                '  struct evbuffer *pinned;\n'
+                '  int res;\n'
+                '\n'
+                '  if ((pinned = evtag_arena_pin(tmp->_arena, evbuf, len))'
+                ' == NULL)\n'
+                '    return (-1);\n'
+                '  res = %(name)s_unmarshal_bounded(tmp, pinned, len);\n'
+                '  evbuffer_free(pinned);\n'
+                '  return (res);\n'
+                '}\n' ) % { 'name' : self._name }
+
+        if self.Stream():
+            self.PrintStreamUnmarshal(file)
+
         # Checking if a structure has all the required data
         print >>file, (
             'int\n'
@@ -278,41 +365,190 @@ int evtag_unmarshal_%(name)s(struct evbuffer *, ev_uint32_t,
             '}\n' )
 
         # Complete message unmarshaling
+        if self._arena:
+            self.PrintArenaTagUnmarshal(file)
+        else:
+            print >>file, (
+                'int\n'
+                'evtag_unmarshal_%(name)s(struct evbuffer *evbuf, '
+                'ev_uint32_t need_tag, struct %(name)s *msg)\n'
+                '{\n'
+                '  ev_uint32_t tag;\n'
+                '  int res = -1;\n'
+                '\n'
+                '  struct evbuffer *tmp = evbuffer_new();\n'
+                '\n'
+                '  if (evtag_unmarshal(evbuf, &tag, tmp) == -1'
+                ' || tag != need_tag)\n'
+                '    goto error;\n'
+                '\n'
+                '  if (%(name)s_unmarshal(msg, tmp) == -1)\n'
+                '    goto error;\n'
+                '\n'
+                '  res = 0;\n'
+                '\n'
+                ' error:\n'
+                '  evbuffer_free(tmp);\n'
+                '  return (res);\n'
+                '}\n' ) % { 'name' : self._name }
+
+        # Complete message marshaling; knowing the length up front
+        # lets the payload go straight into evbuf
+        print >>file, (
+            'void\n'
+            'evtag_marshal_%(name)s(struct evbuffer *evbuf, ev_uint32_t tag, '
+            'const struct %(name)s *msg)\n'
+            '{\n'
+            '  evtag_marshal_header(evbuf, tag, %(name)s_marshal_length(msg));\n'
+            '  %(name)s_marshal(evbuf, msg);\n'
+            '}\n' ) % { 'name' : self._name }
+
+    def PrintUnmarshalCase(self, file, entry):
+        """Prints the code that unmarshals one record of entry from evbuf
+        into tmp, up to the break."""
+        print >>file, '      case %s:\n' % self.EntryTagName(entry)
+        if not entry.Array():
+            print >>file, (
+                '        if (tmp->%s_set)\n'
+                '          return (-1);'
+                ) % (entry.Name())
+
+        self.PrintIndented(
+            file, '        ',
+            entry.CodeUnmarshal('evbuf',
+                                self.EntryTagName(entry),
+                                entry.GetVarName('tmp'),
+                                entry.GetVarLen('tmp')))
+
+        print >>file, '        tmp->%s_set = 1;' % entry.Name()
+
+    def PrintStreamDeclaration(self, file):
+        """Prints the callbacks and the function for unmarshaling a struct
+        a piece at a time."""
+        print >>file, 'struct %s_stream_cbs {' % self._name
+        for entry in self._entries:
+            if not entry.Array():
+                continue
+            print >>file, '  int (*%s)(struct %s *, %s, void *);' % (
+                entry.Name(), self._name, entry._ctype)
+        print >>file, '};'
+        print >>file, (
+            'int %(name)s_unmarshal_stream(struct %(name)s *, '
+            'struct evbuffer *,\n'
+            '    const struct %(name)s_stream_cbs *, void *);'
+            ) % { 'name' : self._name }
+
+    def PrintStreamUnmarshal(self, file):
+        """Prints a function that unmarshals the complete records at the
+        front of a buffer, and leaves the rest for the next call.  Each
+        element of an array with a callback goes to the callback as soon
+        as it is decoded, and is freed right after, so that the array
+        never has more than one element."""
+        print >>file, (
+            'int\n'
+            '%(name)s_unmarshal_stream(struct %(name)s *tmp, '
+            'struct evbuffer *evbuf,\n'
+            '    const struct %(name)s_stream_cbs *cbs, void *arg)\n'
+            '{\n'
+            '  ev_uint32_t tag, len;\n'
+            '  int res;\n'
+            '  while (evtag_peek_record(evbuf, &tag, &len, NULL) != -1) {\n'
+            '    switch (tag) {\n'
+            ) % { 'name' : self._name }
+        for entry in self._entries:
+            self.PrintUnmarshalCase(file, entry)
+            if entry.Array():
+                elem = 'tmp->%(name)s_data[tmp->%(name)s_length - 1]' % {
+                    'name' : entry.Name() }
+                print >>file, (
+                    '        if (cbs->%(name)s != NULL) {\n'
+                    '          res = cbs->%(name)s(tmp, %(elem)s, arg);'
+                    ) % { 'name' : entry.Name(), 'elem' : elem }
+                self.PrintIndented(file, '          ',
+                                   entry._entry.CodeArrayFree(elem))
+                print >>file, (
+                    '          --tmp->%(name)s_length;\n'
+                    '          if (res == -1)\n'
+                    '            return (-1);\n'
+                    '        }'
+                    ) % { 'name' : entry.Name() }
+            print >>file, '        break;\n'
+        print >>file, ( '      default:\n'
+                        '        return -1;\n'
+                        '    }\n'
+                        '  }\n'
+                        '  return (0);\n'
+                        '}\n' )
+
+    def PrintArenaNew(self, file):
+        """Prints the constructors of a struct that lives in an arena,
+        up to the point where its entries get initialized."""
+        print >>file, (
+            'struct %(name)s *\n'
+            '%(name)s_new(void)\n'
+            '{\n'
+            '  return (%(name)s_new_with_arena(NULL));\n'
+            '}\n'
+            '\n'
+            'struct %(name)s *\n'
+            '%(name)s_new_with_arena(struct evtag_arena *arena)\n'
+            '{\n'
+            '  struct %(name)s *tmp;\n'
+            '  int owns_arena = 0;\n'
+            '  if (arena == NULL) {\n'
+            '    if ((arena = evtag_arena_new()) == NULL) {\n'
+            '      event_warn("%%s: evtag_arena_new", __func__);\n'
+            '      return (NULL);\n'
+            '    }\n'
+            '    owns_arena = 1;\n'
+            '  }\n'
+            '  tmp = evtag_arena_alloc(arena, sizeof(struct %(name)s));\n'
+            '  if (tmp == NULL) {\n'
+            '    event_warn("%%s: evtag_arena_alloc", __func__);\n'
+            '    if (owns_arena)\n'
+            '      evtag_arena_free(arena);\n'
+            '    return (NULL);\n'
+            '  }\n'
+            '  tmp->base = &__%(name)s_base;\n'
+            '  tmp->_arena = arena;\n'
+            '  tmp->_owns_arena = owns_arena;\n') % { 'name' : self._name }
+
+    def PrintArenaTagUnmarshal(self, file):
+        """Prints the tagged unmarshaling functions of a struct that lives
+        in an arena: one for any buffer, and one for buffers that are
+        already pinned to the arena, as when a struct contains another."""
         print >>file, (
             'int\n'
             'evtag_unmarshal_%(name)s(struct evbuffer *evbuf, '
             'ev_uint32_t need_tag, struct %(name)s *msg)\n'
             '{\n'
             '  ev_uint32_t tag;\n'
-            '  int res = -1;\n'
-            '\n'
-            '  struct evbuffer *tmp = evbuffer_new();\n'
+            '  struct evbuffer *pinned;\n'
+            '  int len, res;\n'
             '\n'
-            '  if (evtag_unmarshal(evbuf, &tag, tmp) == -1'
+            '  if ((len = evtag_unmarshal_header(evbuf, &tag)) == -1'
             ' || tag != need_tag)\n'
-            '    goto error;\n'
-            '\n'
-            '  if (%(name)s_unmarshal(msg, tmp) == -1)\n'
-            '    goto error;\n'
-            '\n'
-            '  res = 0;\n'
-            '\n'
-            ' error:\n'
-            '  evbuffer_free(tmp);\n'
+            '    return (-1);\n'
+            '  if ((pinned = evtag_arena_pin(msg->_arena, evbuf, len))'
+            ' == NULL)\n'
+            '    return (-1);\n'
+            '  res = %(name)s_unmarshal_bounded(msg, pinned, len);\n'
+            '  evbuffer_free(pinned);\n'
             '  return (res);\n'
-            '}\n' ) % { 'name' : self._name }
-
-        # Complete message marshaling
-        print >>file, (
-            'void\n'
-            'evtag_marshal_%(name)s(struct evbuffer *evbuf, ev_uint32_t tag, '
-            'const struct %(name)s *msg)\n'
+            '}\n'
+            '\n'
+            'int\n'
+            'evtag_unmarshal_%(name)s_pinned(struct evbuffer *evbuf, '
+            'ev_uint32_t need_tag,\n'
+            '    struct %(name)s *msg)\n'
             '{\n'
-            '  struct evbuffer *_buf = evbuffer_new();\n'
-            '  assert(_buf != NULL);\n'
-            '  %(name)s_marshal(_buf, msg);\n'
-            '  evtag_marshal_buffer(evbuf, tag, _buf);\n '
-            '  evbuffer_free(_buf);\n'
+            '  ev_uint32_t tag;\n'
+            '  int len;\n'
+            '\n'
+            '  if ((len = evtag_unmarshal_header(evbuf, &tag)) == -1'
+            ' || tag != need_tag)\n'
+            '    return (-1);\n'
+            '  return (%(name)s_unmarshal_bounded(msg, evbuf, len));\n'
             '}\n' ) % { 'name' : self._name }
 
 class Entry:
@@ -398,6 +634,10 @@ class Entry:
 
         return mapping
 
+    def Arena(self):
+        """True if the entry's memory comes from the arena of its struct."""
+        return self._struct.Arena()
+
     def GetVarName(self, var):
         return '%(var)s->%(name)s_data' % self.GetTranslation({ 'var' : var })
 
@@ -554,6 +794,9 @@ class EntryBytes(Entry):
             buf, tag_name, var_name, var_len)]
         return code
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        return [ 'len += evtag_length(%s, %s);' % (tag_name, var_len) ]
+
     def CodeClear(self, structname):
         code = [ '%s->%s_set = 0;' % (structname, self.Name()),
                  'memset(%s->%s_data, 0, sizeof(%s->%s_data));' % (
@@ -621,6 +864,10 @@ class EntryInt(Entry):
             self._marshal_type, buf, tag_name, var_name)]
         return code
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        return [ 'len += evtag_length(%s, evtag_%s_length(%s));' % (
+            tag_name, self._marshal_type, var_name) ]
+
     def Declaration(self):
         dcl  = ['%s %s_data;' % (self._ctype, self._name)]
 
@@ -641,29 +888,39 @@ class EntryString(Entry):
     def GetInitializer(self):
         return "NULL"
 
+    def CodeStrdup(self, structname, string):
+        if self.Arena():
+            return 'evtag_arena_strdup(%s->_arena, %s)' % (structname, string)
+        return 'strdup(%s)' % string
+
     def CodeArrayFree(self, varname):
+        if self.Arena():
+            return []
         code = [
             'if (%(var)s != NULL) free(%(var)s);' ]
 
         return TranslateList(code, { 'var' : varname })
 
     def CodeArrayAssign(self, varname, srcvar):
-        code = [
-            'if (%(var)s != NULL)',
-            '  free(%(var)s);',
-            '%(var)s = strdup(%(srcvar)s);',
+        code = []
+        if not self.Arena():
+            code += [
+                'if (%(var)s != NULL)',
+                '  free(%(var)s);' ]
+        code += [
+            '%(var)s = %(strdup)s;',
             'if (%(var)s == NULL) {',
             '  event_warnx("%%s: strdup", __func__);',
             '  return (-1);',
             '}' ]
 
         return TranslateList(code, { 'var' : varname,
-                                     'srcvar' : srcvar })
+                                     'strdup' : self.CodeStrdup('msg', srcvar) })
 
     def CodeArrayAdd(self, varname, value):
         code = [
             'if (%(value)s != NULL) {',
-            '  %(var)s = strdup(%(value)s);',
+            '  %(var)s = %(strdup)s;',
             '  if (%(var)s == NULL) {',
             '    goto error;',
             '  }',
@@ -672,7 +929,8 @@ class EntryString(Entry):
             '}' ]
 
         return TranslateList(code, { 'var' : varname,
-                                     'value' : value })
+                                     'value' : value,
+                                     'strdup' : self.CodeStrdup('msg', value) })
 
     def GetVarLen(self, var):
         return 'strlen(%s)' % self.GetVarName(var)
@@ -685,19 +943,31 @@ class EntryString(Entry):
         code = """int
 %(parent_name)s_%(name)s_assign(struct %(parent_name)s *msg,
     const %(ctype)s value)
-{
+{"""
+        if not self.Arena():
+            code += """
   if (msg->%(name)s_data != NULL)
-    free(msg->%(name)s_data);
-  if ((msg->%(name)s_data = strdup(value)) == NULL)
+    free(msg->%(name)s_data);"""
+        code += """
+  if ((msg->%(name)s_data = %(strdup)s) == NULL)
     return (-1);
   msg->%(name)s_set = 1;
   return (0);
-}""" % self.GetTranslation()
+}"""
+        code = code % self.GetTranslation({
+            'strdup' : self.CodeStrdup('msg', 'value') })
 
         return code.split('\n')
 
     def CodeUnmarshal(self, buf, tag_name, var_name, var_len):
-        code = ['if (evtag_unmarshal_string(%(buf)s, %(tag)s, &%(var)s) == -1) {',
+        if self.Arena():
+            code = ['if (evtag_unmarshal_string_arena(%(buf)s, %(tag)s, '
+                    'tmp->_arena,',
+                    '    &%(var)s) == -1) {']
+        else:
+            code = ['if (evtag_unmarshal_string(%(buf)s, %(tag)s, '
+                    '&%(var)s) == -1) {']
+        code += [
                 '  event_warnx("%%s: failed to unmarshal %(name)s", __func__);',
                 '  return (-1);',
                 '}'
@@ -713,9 +983,15 @@ class EntryString(Entry):
             buf, tag_name, var_name)]
         return code
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        return [ 'len += evtag_length(%s, strlen(%s));' % (
+            tag_name, var_name) ]
+
     def CodeClear(self, structname):
-        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()),
-                 '  free (%s->%s_data);' % (structname, self.Name()),
+        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()) ]
+        if not self.Arena():
+            code += [ '  free (%s->%s_data);' % (structname, self.Name()) ]
+        code += [
                  '  %s->%s_data = NULL;' % (structname, self.Name()),
                  '  %s->%s_set = 0;' % (structname, self.Name()),
                  '}'
@@ -728,6 +1004,8 @@ class EntryString(Entry):
         return code
 
     def CodeFree(self, name):
+        if self.Arena():
+            return []
         code  = ['if (%s->%s_data != NULL)' % (name, self._name),
                  '    free (%s->%s_data);' % (name, self._name)]
 
@@ -755,15 +1033,27 @@ class EntryStruct(Entry):
     def GetVarLen(self, var):
         return '-1'
 
+    def CodeNew(self, structname):
+        """Returns an expression that creates a new struct for the entry
+        of structname."""
+        if self.Arena():
+            return '%s_new_with_arena(%s->_arena)' % (
+                self._refname, structname)
+        return '%s_new()' % self._refname
+
     def CodeArrayAdd(self, varname, value):
         code = [
-            '%(varname)s = %(refname)s_new();',
+            '%(varname)s = %(new)s;',
             'if (%(varname)s == NULL)',
             '  goto error;' ]
 
-        return TranslateList(code, self.GetTranslation({ 'varname' : varname }))
+        return TranslateList(code, self.GetTranslation({
+            'varname' : varname,
+            'new' : self.CodeNew('msg') }))
 
     def CodeArrayFree(self, var):
+        if self.Arena():
+            return []
         code = [ '%(refname)s_free(%(var)s);' % self.GetTranslation(
             { 'var' : var }) ]
         return code
@@ -804,7 +1094,7 @@ class EntryStruct(Entry):
             self._struct.Name(), self._ctype),
                  '{',
                  '  if (msg->%s_set != 1) {' % name,
-                 '    msg->%s_data = %s_new();' % (name, self._refname),
+                 '    msg->%s_data = %s;' % (name, self.CodeNew('msg')),
                  '    if (msg->%s_data == NULL)' % name,
                  '      return (-1);',
                  '    msg->%s_set = 1;' % name,
@@ -825,7 +1115,7 @@ class EntryStruct(Entry):
      %(refname)s_clear(msg->%(name)s_data);
      msg->%(name)s_set = 0;
    } else {
-     msg->%(name)s_data = %(refname)s_new();
+     msg->%(name)s_data = %(new)s;
      if (msg->%(name)s_data == NULL) {
        event_warn("%%s: %(refname)s_new()", __func__);
        goto error;
@@ -851,7 +1141,7 @@ class EntryStruct(Entry):
      msg->%(name)s_data = NULL;
    }
    return (-1);
-}""" % self.GetTranslation()
+}""" % self.GetTranslation({ 'new' : self.CodeNew('msg') })
         return code.split('\n')
 
     def CodeComplete(self, structname, var_name):
@@ -864,10 +1154,11 @@ class EntryStruct(Entry):
             'var' : var_name }))
 
     def CodeUnmarshal(self, buf, tag_name, var_name, var_len):
-        code = ['%(var)s = %(refname)s_new();',
+        # in an arena, the buffer is pinned already
+        code = ['%(var)s = %(new)s;',
                 'if (%(var)s == NULL)',
                 '  return (-1);',
-                'if (evtag_unmarshal_%(refname)s(%(buf)s, %(tag)s, '
+                'if (evtag_unmarshal_%(refname)s%(pinned)s(%(buf)s, %(tag)s, '
                 '%(var)s) == -1) {',
                   '  event_warnx("%%s: failed to unmarshal %(name)s", __func__);',
                 '  return (-1);',
@@ -876,7 +1167,9 @@ class EntryStruct(Entry):
         code = '\n'.join(code) % self.GetTranslation({
             'buf' : buf,
             'tag' : tag_name,
-            'var' : var_name })
+            'var' : var_name,
+            'new' : self.CodeNew('tmp'),
+            'pinned' : self.Arena() and '_pinned' or '' })
         return code.split('\n')
 
     def CodeMarshal(self, buf, tag_name, var_name, var_len):
@@ -884,10 +1177,16 @@ class EntryStruct(Entry):
             self._refname, buf, tag_name, var_name)]
         return code
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        return [ 'len += evtag_length(%s, %s_marshal_length(%s));' % (
+            tag_name, self._refname, var_name) ]
+
     def CodeClear(self, structname):
-        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()),
-                 '  %s_free(%s->%s_data);' % (
-            self._refname, structname, self.Name()),
+        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()) ]
+        if not self.Arena():
+            code += [ '  %s_free(%s->%s_data);' % (
+                self._refname, structname, self.Name()) ]
+        code += [
                  '  %s->%s_data = NULL;' % (structname, self.Name()),
                  '  %s->%s_set = 0;' % (structname, self.Name()),
                  '}'
@@ -900,6 +1199,8 @@ class EntryStruct(Entry):
         return code
 
     def CodeFree(self, name):
+        if self.Arena():
+            return []
         code  = ['if (%s->%s_data != NULL)' % (name, self._name),
                  '    %s_free(%s->%s_data); ' % (
             self._refname, name, self._name)]
@@ -945,10 +1246,16 @@ class EntryVarBytes(Entry):
                  'const %s value, ev_uint32_t len)' % (
             self._struct.Name(), name,
             self._struct.Name(), self._ctype),
-                 '{',
+                 '{' ]
+        if self.Arena():
+            code += [
+                 '  msg->%s_data = evtag_arena_alloc(msg->_arena, len);' % name ]
+        else:
+            code += [
                  '  if (msg->%s_data != NULL)' % name,
                  '    free (msg->%s_data);' % name,
-                 '  msg->%s_data = malloc(len);' % name,
+                 '  msg->%s_data = malloc(len);' % name ]
+        code += [
                  '  if (msg->%s_data == NULL)' % name,
                  '    return (-1);',
                  '  msg->%s_set = 1;' % name,
@@ -974,6 +1281,21 @@ class EntryVarBytes(Entry):
         return code
 
     def CodeUnmarshal(self, buf, tag_name, var_name, var_len):
+        if self.Arena():
+            # point into the pinned buffer instead of copying
+            code = ['if (evtag_unmarshal_ref(%(buf)s, %(tag)s, &%(var)s, '
+                    '&%(varlen)s) == -1) {',
+                    '  event_warnx("%%s: failed to unmarshal %(name)s", '
+                    '__func__);',
+                    '  return (-1);',
+                    '}'
+                    ]
+            return TranslateList(code, self.GetTranslation({
+                'buf' : buf,
+                'tag' : tag_name,
+                'var' : var_name,
+                'varlen' : var_len }))
+
         code = ['if (evtag_payload_length(%(buf)s, &%(varlen)s) == -1)',
                 '  return (-1);',
                 # We do not want DoS opportunities
@@ -999,9 +1321,14 @@ class EntryVarBytes(Entry):
             buf, tag_name, var_name, var_len)]
         return code
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        return [ 'len += evtag_length(%s, %s);' % (tag_name, var_len) ]
+
     def CodeClear(self, structname):
-        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()),
-                 '  free (%s->%s_data);' % (structname, self.Name()),
+        code = [ 'if (%s->%s_set == 1) {' % (structname, self.Name()) ]
+        if not self.Arena():
+            code += [ '  free (%s->%s_data);' % (structname, self.Name()) ]
+        code += [
                  '  %s->%s_data = NULL;' % (structname, self.Name()),
                  '  %s->%s_length = 0;' % (structname, self.Name()),
                  '  %s->%s_set = 0;' % (structname, self.Name()),
@@ -1016,6 +1343,8 @@ class EntryVarBytes(Entry):
         return code
 
     def CodeFree(self, name):
+        if self.Arena():
+            return []
         code  = ['if (%s->%s_data != NULL)' % (name, self._name),
                  '    free (%s->%s_data); ' % (name, self._name)]
 
@@ -1122,7 +1451,7 @@ class EntryArray(Entry):
             '    int tobe_allocated = msg->%(name)s_num_allocated;',
             '    %(ctype)s* new_data = NULL;',
             '    tobe_allocated = !tobe_allocated ? 1 : tobe_allocated << 1;',
-            '    new_data = (%(ctype)s*) realloc(msg->%(name)s_data,',
+            '    new_data = (%(ctype)s*) %(realloc)s,',
             '        tobe_allocated * sizeof(%(ctype)s));',
             '    if (new_data == NULL)',
             '      goto error;',
@@ -1130,7 +1459,15 @@ class EntryArray(Entry):
             '    msg->%(name)s_num_allocated = tobe_allocated;',
             '  }' ]
 
-        code = TranslateList(code, self.GetTranslation())
+        if self.Arena():
+            realloc = ('evtag_arena_realloc(msg->_arena, '
+                       'msg->%(name)s_data,\n'
+                       '        msg->%(name)s_num_allocated * '
+                       'sizeof(%(ctype)s)')
+        else:
+            realloc = 'realloc(msg->%(name)s_data'
+        code = TranslateList(code, self.GetTranslation({
+            'realloc' : realloc % self.GetTranslation() }))
 
         code += map(lambda x: '  ' + x, codearrayadd)
 
@@ -1186,6 +1523,12 @@ class EntryArray(Entry):
         code += [ '--%(var)s->%(name)s_length;' % translate ]
         code = TranslateList(code, translate)
 
+        # ... and allocates the element itself, so drop the one _add made
+        if not self._optaddarg:
+            code += self._entry.CodeArrayFree(
+                '%(var)s->%(name)s_data[%(var)s->%(name)s_length]' %
+                translate)
+
         self._index = '%(var)s->%(name)s_length' % translate
         code += self._entry.CodeUnmarshal(buf, tag_name,
                                         self._entry.GetVarName(var_name),
@@ -1212,6 +1555,22 @@ class EntryArray(Entry):
 
         return code.split('\n')
 
+    def CodeMarshalLength(self, tag_name, var_name, var_len):
+        code = ['{',
+                '  int i;',
+                '  for (i = 0; i < %(var)s->%(name)s_length; ++i) {' ]
+
+        self._index = 'i'
+        code += map(lambda x: '    ' + x,
+                    self._entry.CodeMarshalLength(
+                        tag_name, self._entry.GetVarName(var_name),
+                        self._entry.GetVarLen(var_name)))
+        code += ['  }',
+                 '}'
+                 ]
+
+        return TranslateList(code, self.GetTranslation({ 'var' : var_name }))
+
     def CodeClear(self, structname):
         translate = self.GetTranslation({ 'structname' : structname })
         codearrayfree = self._entry.CodeArrayFree(
@@ -1232,8 +1591,10 @@ class EntryArray(Entry):
             code += [
                 '  }' ]
 
+        if not self.Arena():
+            code += TranslateList([
+                 '  free(%(structname)s->%(name)s_data);' ], translate)
         code += TranslateList([
-                 '  free(%(structname)s->%(name)s_data);',
                  '  %(structname)s->%(name)s_data = NULL;',
                  '  %(structname)s->%(name)s_set = 0;',
                  '  %(structname)s->%(name)s_length = 0;',
@@ -1250,6 +1611,8 @@ class EntryArray(Entry):
         return code
 
     def CodeFree(self, structname):
+        if self.Arena():
+            return []
         code = self.CodeClear(structname);
 
         code += TranslateList([
@@ -1507,8 +1870,9 @@ def Parse(factory, file):
     return entities
 
 class CCodeGenerator:
-    def __init__(self):
-        pass
+    def __init__(self, arena=False, stream=False):
+        self._arena = arena
+        self._stream = stream
 
     def GuardName(self, name):
         name = '_'.join(name.split('.'))
@@ -1540,6 +1904,8 @@ class CCodeGenerator:
             pre += '\n'
 
         pre += '#include <event2/rpc.h>'
+        if self._arena:
+            pre += '\n#include <event2/tag.h>'
 
         return pre
 
@@ -1586,7 +1952,7 @@ class CCodeGenerator:
         return '.'.join(filename.split('.')[:-1]) + '.gen.c'
 
     def Struct(self, name):
-        return StructCCode(name)
+        return StructCCode(name, self._arena, self._stream)
 
     def EntryBytes(self, entry_type, name, tag, fixed_length):
         return EntryBytes(entry_type, name, tag, fixed_length)
@@ -1645,11 +2011,29 @@ def Generate(factory, filename):
     impl_fp.close()
 
 def main(argv):
+    # --arena: allocate each message and everything in it from one
+    # evtag_arena, and have unmarshaled bytes point into the input
+    # --stream: also generate X_unmarshal_stream() for structs with
+    # arrays, which hands array elements to callbacks one at a time
+    arena = False
+    stream = False
+    while len(argv) > 1 and argv[1] in ('--arena', '--stream'):
+        if argv[1] == '--arena':
+            arena = True
+        else:
+            stream = True
+        argv = argv[:1] + argv[2:]
+
+    if arena and stream:
+        # an arena keeps every element until the message is freed
+        print >>sys.stderr, '--arena and --stream cannot be combined.'
+        sys.exit(1)
+
     if len(argv) < 2 or not argv[1]:
         print >>sys.stderr, 'Need RPC description file as first argument.'
         sys.exit(1)
 
-    Generate(CCodeGenerator(), argv[1])
+    Generate(CCodeGenerator(arena, stream), argv[1])
 
 if __name__ == '__main__':
     main(sys.argv)
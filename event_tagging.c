@@ -166,41 +166,99 @@ evtag_encode_tag(struct evbuffer *evbuf, ev_uint32_t tag)
 	return (bytes);
 }
 
+/*
+ * Decoding works directly on the memory of the first chain of a buffer,
+ * which almost always holds all of what is being decoded.  Only when that
+ * runs out in the middle of a number do we pull up enough of the buffer
+ * to decode it and try again.
+ */
+
+/* returned by the span decoders when the data ends before the number does */
+#define EVTAG_SHORT -2
+
+/* the most bytes that a tag or an encoded integer can take up */
+#define EVTAG_MAX_TAG_LEN 5
+#define EVTAG_MAX_INT_LEN 5
+
+/* Sets *pdata to the first contiguous bytes of evbuf and returns how
+ * many there are. */
+static size_t
+evtag_span(struct evbuffer *evbuf, ev_uint8_t **pdata)
+{
+	struct evbuffer_iovec v;
+
+	if (evbuffer_peek(evbuf, -1, NULL, &v, 1) < 1) {
+		*pdata = NULL;
+		return (0);
+	}
+	*pdata = v.iov_base;
+	return (v.iov_len);
+}
+
+/* Makes the first maxlen bytes of evbuf contiguous, or all of them if
+ * there are fewer; sets *pdata to them and returns how many there are. */
+static size_t
+evtag_span_pullup(struct evbuffer *evbuf, size_t maxlen, ev_uint8_t **pdata)
+{
+	size_t len = evbuffer_get_length(evbuf);
+
+	if (len > maxlen)
+		len = maxlen;
+	if ((*pdata = evbuffer_pullup(evbuf, len)) == NULL)
+		return (0);
+	return (len);
+}
+
+/* Returns true iff a decoder that came up short on the first avail bytes
+ * of evbuf should try again with more of it. */
+#define EVTAG_RETRY(res, avail, evbuf)					\
+	((res) == EVTAG_SHORT && (avail) < evbuffer_get_length(evbuf))
+
 static int
-decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
+decode_tag_span(ev_uint32_t *ptag, const ev_uint8_t *data, size_t len)
 {
 	ev_uint32_t number = 0;
-	int len = evbuffer_get_length(evbuf);
-	ev_uint8_t *data;
-	int count = 0, shift = 0, done = 0;
+	int count = 0, shift = 0;
 
 	/*
 	 * the encoding of a number is at most one byte more than its
 	 * storage size.  however, it may also be much smaller.
 	 */
-	data = evbuffer_pullup(
-		evbuf, len < sizeof(number) + 1 ? len : sizeof(number) + 1);
-
-	while (count++ < len) {
-		ev_uint8_t lower = *data++;
+	while (count < EVTAG_MAX_TAG_LEN) {
+		ev_uint8_t lower;
+		if ((size_t)count == len)
+			return (EVTAG_SHORT);
+		lower = data[count++];
 		number |= (lower & 0x7f) << shift;
 		shift += 7;
 
 		if (!(lower & 0x80)) {
-			done = 1;
-			break;
+			if (ptag != NULL)
+				*ptag = number;
+			return (count);
 		}
 	}
 
-	if (!done)
+	return (-1);
+}
+
+static int
+decode_tag_internal(ev_uint32_t *ptag, struct evbuffer *evbuf, int dodrain)
+{
+	ev_uint8_t *data;
+	size_t avail = evtag_span(evbuf, &data);
+	int count = decode_tag_span(ptag, data, avail);
+
+	if (EVTAG_RETRY(count, avail, evbuf)) {
+		avail = evtag_span_pullup(evbuf, EVTAG_MAX_TAG_LEN, &data);
+		count = decode_tag_span(ptag, data, avail);
+	}
+	if (count < 0)
 		return (-1);
 
 	if (dodrain)
 		evbuffer_drain(evbuf, count);
 
-	if (ptag != NULL)
-		*ptag = number;
-
 	return (count);
 }
 
@@ -234,6 +292,35 @@ evtag_marshal_buffer(struct evbuffer *evbuf, ev_uint32_t tag,
 	evbuffer_add_buffer(evbuf, data);
 }
 
+void
+evtag_marshal_header(struct evbuffer *evbuf, ev_uint32_t tag, ev_uint32_t len)
+{
+	evtag_encode_tag(evbuf, tag);
+	encode_int(evbuf, len);
+}
+
+/* Computing how much space marshaled data takes up */
+
+ev_uint32_t
+evtag_int_length(ev_uint32_t integer)
+{
+	ev_uint8_t data[5];
+	return (encode_int_internal(data, integer));
+}
+
+ev_uint32_t
+evtag_int64_length(ev_uint64_t integer)
+{
+	ev_uint8_t data[9];
+	return (encode_int64_internal(data, integer));
+}
+
+ev_uint32_t
+evtag_length(ev_uint32_t tag, ev_uint32_t len)
+{
+	return (evtag_encode_tag(NULL, tag) + evtag_int_length(len) + len);
+}
+
 /* Marshaling for integers */
 void
 evtag_marshal_int(struct evbuffer *evbuf, ev_uint32_t tag, ev_uint32_t integer)
@@ -273,24 +360,19 @@ evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag, struct timeval *t
 	evtag_marshal(evbuf, tag, data, len);
 }
 
-#define DECODE_INT_INTERNAL(number, maxnibbles, pnumber, evbuf, offset) \
+#define DECODE_INT_SPAN(number, maxnibbles, pnumber, data, len)	\
 do {									\
-	ev_uint8_t *data;						\
-	int len = evbuffer_get_length(evbuf) - offset;			\
-	int nibbles = 0;						\
+	int nibbles, need;						\
 									\
-	if (len <= 0)							\
-		return (-1);						\
-									\
-	/* XXX(niels): faster? */					\
-	data = evbuffer_pullup(evbuf, offset + 1) + offset;		\
+	if (len == 0)							\
+		return (EVTAG_SHORT);					\
 									\
 	nibbles = ((data[0] & 0xf0) >> 4) + 1;				\
-	if (nibbles > maxnibbles || (nibbles >> 1) + 1 > len)		\
+	if (nibbles > maxnibbles)					\
 		return (-1);						\
-	len = (nibbles >> 1) + 1;					\
-									\
-	data = evbuffer_pullup(evbuf, offset + len) + offset;		\
+	need = (nibbles >> 1) + 1;					\
+	if ((size_t)need > len)						\
+		return (EVTAG_SHORT);					\
 									\
 	while (nibbles > 0) {						\
 		number <<= 4;						\
@@ -303,11 +385,24 @@ do {									\
 									\
 	*pnumber = number;						\
 									\
-	return (len);							\
+	return (need);							\
 } while (0)
 
+static int
+decode_int_span(ev_uint32_t *pnumber, const ev_uint8_t *data, size_t len)
+{
+	ev_uint32_t number = 0;
+	DECODE_INT_SPAN(number, 8, pnumber, data, len);
+}
+
+static int
+decode_int64_span(ev_uint64_t *pnumber, const ev_uint8_t *data, size_t len)
+{
+	ev_uint64_t number = 0;
+	DECODE_INT_SPAN(number, 16, pnumber, data, len);
+}
+
 /* Internal: decode an integer from an evbuffer, without draining it.
- *  Only integers up to 32-bits are supported.
  *
  * @param evbuf the buffer to read from
  * @param offset an index into the buffer at which we should start reading.
@@ -318,15 +413,84 @@ do {									\
 static int
 decode_int_internal(ev_uint32_t *pnumber, struct evbuffer *evbuf, int offset)
 {
-	ev_uint32_t number = 0;
-	DECODE_INT_INTERNAL(number, 8, pnumber, evbuf, offset);
+	ev_uint8_t *data;
+	size_t avail = evtag_span(evbuf, &data);
+	int res = EVTAG_SHORT;
+
+	if (avail > (size_t)offset)
+		res = decode_int_span(pnumber, data + offset, avail - offset);
+	if (EVTAG_RETRY(res, avail, evbuf)) {
+		avail = evtag_span_pullup(evbuf, offset + EVTAG_MAX_INT_LEN,
+		    &data);
+		if (avail > (size_t)offset)
+			res = decode_int_span(pnumber, data + offset,
+			    avail - offset);
+	}
+
+	return (res < 0 ? -1 : res);
 }
 
+/* Decodes a tag and the length that follows it from contiguous memory. */
 static int
-decode_int64_internal(ev_uint64_t *pnumber, struct evbuffer *evbuf, int offset)
+decode_header_span(ev_uint32_t *ptag, ev_uint32_t *plength,
+    const ev_uint8_t *data, size_t len)
 {
-	ev_uint64_t number = 0;
-	DECODE_INT_INTERNAL(number, 16, pnumber, evbuf, offset);
+	int tag_len, int_len;
+
+	if ((tag_len = decode_tag_span(ptag, data, len)) < 0)
+		return (tag_len);
+	if ((int_len = decode_int_span(plength, data + tag_len,
+		    len - tag_len)) < 0)
+		return (int_len);
+
+	return (tag_len + int_len);
+}
+
+/* Internal: decode the header of a tagged record in one pass, without
+ * draining it.  Returns the length of the header, or -1 on error. */
+static int
+decode_header_internal(ev_uint32_t *ptag, ev_uint32_t *plength,
+    struct evbuffer *evbuf)
+{
+	ev_uint8_t *data;
+	size_t avail = evtag_span(evbuf, &data);
+	int res = decode_header_span(ptag, plength, data, avail);
+
+	if (EVTAG_RETRY(res, avail, evbuf)) {
+		avail = evtag_span_pullup(evbuf,
+		    EVTAG_MAX_TAG_LEN + EVTAG_MAX_INT_LEN, &data);
+		res = decode_header_span(ptag, plength, data, avail);
+	}
+
+	return (res < 0 ? -1 : res);
+}
+
+int
+evtag_peek_record(struct evbuffer *evbuf, ev_uint32_t *ptag,
+    ev_uint32_t *plength, ev_uint8_t **ppayload)
+{
+	int header_len;
+
+	if ((header_len = decode_header_internal(ptag, plength, evbuf)) == -1)
+		return (-1);
+	if (evbuffer_get_length(evbuf) - header_len < *plength)
+		return (-1);
+
+	if (ppayload != NULL) {
+		ev_uint8_t *data;
+		size_t avail = evtag_span(evbuf, &data);
+		if (avail >= (size_t)header_len + *plength)
+			*ppayload = data + header_len;
+		else if (*plength == 0)
+			*ppayload = NULL;
+		else if ((data = evbuffer_pullup(evbuf,
+			      header_len + *plength)) != NULL)
+			*ppayload = data + header_len;
+		else
+			return (-1);
+	}
+
+	return (header_len);
 }
 
 int
@@ -348,17 +512,12 @@ evtag_peek(struct evbuffer *evbuf, ev_uint32_t *ptag)
 int
 evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 {
-	int res, len;
-
-	len = decode_tag_internal(NULL, evbuf, 0 /* dodrain */);
-	if (len == -1)
-		return (-1);
+	int len;
 
-	res = decode_int_internal(plength, evbuf, len);
-	if (res == -1)
+	if ((len = decode_header_internal(NULL, plength, evbuf)) == -1)
 		return (-1);
 
-	*plength += res + len;
+	*plength += len;
 
 	return (0);
 }
@@ -366,14 +525,7 @@ evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 int
 evtag_payload_length(struct evbuffer *evbuf, ev_uint32_t *plength)
 {
-	int res, len;
-
-	len = decode_tag_internal(NULL, evbuf, 0 /* dodrain */);
-	if (len == -1)
-		return (-1);
-
-	res = decode_int_internal(plength, evbuf, len);
-	if (res == -1)
+	if (decode_header_internal(NULL, plength, evbuf) == -1)
 		return (-1);
 
 	return (0);
@@ -385,14 +537,11 @@ int
 evtag_unmarshal_header(struct evbuffer *evbuf, ev_uint32_t *ptag)
 {
 	ev_uint32_t len;
+	int header_len;
 
-	if (decode_tag_internal(ptag, evbuf, 1 /* dodrain */) == -1)
-		return (-1);
-	if (evtag_decode_int(&len, evbuf) == -1)
-		return (-1);
-
-	if (evbuffer_get_length(evbuf) < len)
+	if ((header_len = evtag_peek_record(evbuf, ptag, &len, NULL)) == -1)
 		return (-1);
+	evbuffer_drain(evbuf, header_len);
 
 	return (len);
 }
@@ -413,71 +562,56 @@ evtag_consume(struct evbuffer *evbuf)
 int
 evtag_unmarshal(struct evbuffer *src, ev_uint32_t *ptag, struct evbuffer *dst)
 {
-	int len;
+	ev_uint32_t len;
+	ev_uint8_t *payload;
+	int header_len;
 
-	if ((len = evtag_unmarshal_header(src, ptag)) == -1)
+	if ((header_len = evtag_peek_record(src, ptag, &len, &payload)) == -1)
 		return (-1);
 
-	if (evbuffer_add(dst, evbuffer_pullup(src, len), len) == -1)
+	if (len && evbuffer_add(dst, payload, len) == -1)
 		return (-1);
 
-	evbuffer_drain(src, len);
+	evbuffer_drain(src, header_len + len);
 
 	return (len);
 }
 
-/* Marshaling for integers */
+/* Marshaling for integers; the whole record is decoded in one pass */
+
+#define UNMARSHAL_INT_INTERNAL(span_fn, evbuf, need_tag, pinteger)	\
+do {									\
+	ev_uint32_t tag;						\
+	ev_uint32_t len;						\
+	ev_uint8_t *payload;						\
+	int header_len, result;						\
+									\
+	header_len = evtag_peek_record(evbuf, &tag, &len, &payload);	\
+	if (header_len == -1)						\
+		return (-1);						\
+	if (need_tag != tag)						\
+		return (-1);						\
+									\
+	result = span_fn(pinteger, payload, len);			\
+	evbuffer_drain(evbuf, header_len + len);			\
+	if (result < 0 || (size_t)result > len) /* XXX Should this be != rather than > ?*/ \
+		return (-1);						\
+	else								\
+		return result;						\
+} while (0)
 
 int
 evtag_unmarshal_int(struct evbuffer *evbuf, ev_uint32_t need_tag,
     ev_uint32_t *pinteger)
 {
-	ev_uint32_t tag;
-	ev_uint32_t len;
-	int result;
-
-	if (decode_tag_internal(&tag, evbuf, 1 /* dodrain */) == -1)
-		return (-1);
-	if (need_tag != tag)
-		return (-1);
-	if (evtag_decode_int(&len, evbuf) == -1)
-		return (-1);
-
-	if (evbuffer_get_length(evbuf) < len)
-		return (-1);
-
-	result = decode_int_internal(pinteger, evbuf, 0);
-	evbuffer_drain(evbuf, len);
-	if (result < 0 || (size_t)result > len) /* XXX Should this be != rather than > ?*/
-		return (-1);
-	else
-		return result;
+	UNMARSHAL_INT_INTERNAL(decode_int_span, evbuf, need_tag, pinteger);
 }
 
 int
 evtag_unmarshal_int64(struct evbuffer *evbuf, ev_uint32_t need_tag,
     ev_uint64_t *pinteger)
 {
-	ev_uint32_t tag;
-	ev_uint32_t len;
-	int result;
-
-	if (decode_tag_internal(&tag, evbuf, 1 /* dodrain */) == -1)
-		return (-1);
-	if (need_tag != tag)
-		return (-1);
-	if (evtag_decode_int(&len, evbuf) == -1)
-		return (-1);
-
-	if (evbuffer_get_length(evbuf) < len)
-		return (-1);
-
-	result = decode_int64_internal(pinteger, evbuf, 0);
-	evbuffer_drain(evbuf, len);
-	if (result < 0 || (size_t)result > len) /* XXX Should this be != rather than > ?*/
-		return (-1);
-	else
-		return result;
+	UNMARSHAL_INT_INTERNAL(decode_int64_span, evbuf, need_tag, pinteger);
 }
 
 /* Unmarshal a fixed length tag */
@@ -548,3 +682,215 @@ evtag_unmarshal_timeval(struct evbuffer *evbuf, ev_uint32_t need_tag,
 	evbuffer_drain(evbuf, len);
 	return result;
 }
+
+/*
+ * Arenas.  Memory comes out of a list of blocks, newest first, and is only
+ * given back when the whole arena is freed.  Buffers that have been pinned
+ * to the arena are kept alive until then as well, so that data unmarshaled
+ * from them can point into them instead of being copied.
+ */
+
+#define EVTAG_ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+#define EVTAG_ARENA_MIN_BLOCK 512
+#define EVTAG_ARENA_MAX_BLOCK 65536
+
+struct evtag_arena_block {
+	struct evtag_arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+#define EVTAG_ARENA_BLOCK_DATA(b)					\
+	((char *)(b) + EVTAG_ARENA_ALIGN(sizeof(struct evtag_arena_block)))
+
+struct evtag_arena_pinned {
+	struct evtag_arena_pinned *next;
+	struct evbuffer *buf;
+};
+
+struct evtag_arena {
+	struct evtag_arena_block *blocks;
+	struct evtag_arena_pinned *pinned;
+	size_t next_size;
+};
+
+struct evtag_arena *
+evtag_arena_new(void)
+{
+	struct evtag_arena *arena;
+
+	if ((arena = mm_calloc(1, sizeof(struct evtag_arena))) == NULL)
+		return (NULL);
+	arena->next_size = EVTAG_ARENA_MIN_BLOCK;
+
+	return (arena);
+}
+
+void
+evtag_arena_free(struct evtag_arena *arena)
+{
+	struct evtag_arena_block *block;
+	struct evtag_arena_pinned *pinned;
+
+	/* the list of pinned buffers lives in the blocks */
+	for (pinned = arena->pinned; pinned != NULL; pinned = pinned->next)
+		evbuffer_free(pinned->buf);
+	while ((block = arena->blocks) != NULL) {
+		arena->blocks = block->next;
+		mm_free(block);
+	}
+	mm_free(arena);
+}
+
+void *
+evtag_arena_alloc(struct evtag_arena *arena, size_t size)
+{
+	struct evtag_arena_block *block = arena->blocks;
+	void *result;
+
+	size = EVTAG_ARENA_ALIGN(size);
+	if (block == NULL || block->size - block->used < size) {
+		size_t block_size = arena->next_size;
+		if (block_size < size)
+			block_size = size;
+		block = mm_malloc(
+		    EVTAG_ARENA_ALIGN(sizeof(struct evtag_arena_block)) +
+		    block_size);
+		if (block == NULL)
+			return (NULL);
+		block->size = block_size;
+		block->used = 0;
+		if (block_size == size && arena->blocks != NULL) {
+			/* this block is full already; keep filling the
+			 * current one */
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = arena->blocks;
+			arena->blocks = block;
+			if (arena->next_size < EVTAG_ARENA_MAX_BLOCK)
+				arena->next_size <<= 1;
+		}
+	}
+
+	result = EVTAG_ARENA_BLOCK_DATA(block) + block->used;
+	block->used += size;
+
+	return (result);
+}
+
+void *
+evtag_arena_realloc(struct evtag_arena *arena, void *ptr, size_t oldsize,
+    size_t size)
+{
+	struct evtag_arena_block *block = arena->blocks;
+	void *result;
+
+	/* the most recent allocation can grow in place */
+	if (ptr != NULL && block != NULL && size >= oldsize &&
+	    (char *)ptr + EVTAG_ARENA_ALIGN(oldsize) ==
+	    EVTAG_ARENA_BLOCK_DATA(block) + block->used) {
+		size_t grow = EVTAG_ARENA_ALIGN(size) -
+		    EVTAG_ARENA_ALIGN(oldsize);
+		if (grow <= block->size - block->used) {
+			block->used += grow;
+			return (ptr);
+		}
+	}
+
+	if ((result = evtag_arena_alloc(arena, size)) == NULL)
+		return (NULL);
+	if (ptr != NULL)
+		memcpy(result, ptr, oldsize < size ? oldsize : size);
+
+	return (result);
+}
+
+char *
+evtag_arena_strdup(struct evtag_arena *arena, const char *string)
+{
+	size_t len = strlen(string);
+	char *result;
+
+	if ((result = evtag_arena_alloc(arena, len + 1)) == NULL)
+		return (NULL);
+	memcpy(result, string, len + 1);
+
+	return (result);
+}
+
+struct evbuffer *
+evtag_arena_pin(struct evtag_arena *arena, struct evbuffer *src, size_t len)
+{
+	struct evtag_arena_pinned *pinned;
+	struct evbuffer *result;
+	unsigned char *data;
+
+	if (evbuffer_get_length(src) < len)
+		return (NULL);
+	if ((result = evbuffer_new()) == NULL)
+		return (NULL);
+	if (len == 0)
+		return (result);
+
+	if ((pinned = evtag_arena_alloc(arena, sizeof(*pinned))) == NULL ||
+	    (pinned->buf = evbuffer_new()) == NULL)
+		goto error;
+	pinned->next = arena->pinned;
+	arena->pinned = pinned;
+
+	/* Moving whole chains costs nothing; the data only gets copied
+	 * if it has to be made contiguous. */
+	if (evbuffer_remove_buffer(src, pinned->buf, len) != (int)len ||
+	    (data = evbuffer_pullup(pinned->buf, -1)) == NULL ||
+	    evbuffer_add_reference(result, data, len, NULL, NULL) == -1)
+		goto error;
+
+	return (result);
+
+error:
+	evbuffer_free(result);
+	return (NULL);
+}
+
+int
+evtag_unmarshal_string_arena(struct evbuffer *evbuf, ev_uint32_t need_tag,
+    struct evtag_arena *arena, char **pstring)
+{
+	ev_uint32_t tag;
+	int tag_len;
+
+	if ((tag_len = evtag_unmarshal_header(evbuf, &tag)) == -1 ||
+	    tag != need_tag)
+		return (-1);
+
+	if ((*pstring = evtag_arena_alloc(arena, tag_len + 1)) == NULL)
+		return (-1);
+	evbuffer_remove(evbuf, *pstring, tag_len);
+	(*pstring)[tag_len] = '\0';
+
+	return (0);
+}
+
+int
+evtag_unmarshal_ref(struct evbuffer *evbuf, ev_uint32_t need_tag,
+    ev_uint8_t **pdata, ev_uint32_t *plen)
+{
+	ev_uint32_t tag;
+	int tag_len;
+
+	if ((tag_len = evtag_unmarshal_header(evbuf, &tag)) == -1 ||
+	    tag != need_tag)
+		return (-1);
+
+	/* a buffer from evtag_arena_pin() is a single reference, so
+	 * this never copies, and the data stays put once drained */
+	if (tag_len && (*pdata = evbuffer_pullup(evbuf, tag_len)) == NULL)
+		return (-1);
+	if (!tag_len)
+		*pdata = NULL;
+	*plen = tag_len;
+	evbuffer_drain(evbuf, tag_len);
+
+	return (0);
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#ifdef _EVENT_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/event_struct.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "event-internal.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+#include "log-internal.h"
+
+/* A connection waiting to be picked up by one of the group's loops. */
+struct group_handoff {
+	TAILQ_ENTRY(group_handoff) next;
+	evutil_socket_t fd;
+	struct sockaddr_storage ss;
+	int socklen;
+	event_base_group_fd_cb cb;
+	void *arg;
+};
+
+struct group_member {
+	struct event_base_group *group;
+	int idx;
+	struct event_base *base;
+	pthread_t thread;
+	int thread_started;
+
+	/* Activated from other threads to tell the loop to drain pending. */
+	struct event handoff_ev;
+	/* Keeps the loop running while the base has nothing else to do. */
+	struct event keepalive_ev;
+
+	pthread_mutex_t lock;
+	TAILQ_HEAD(group_handoffq, group_handoff) pending;
+	int n_pending;
+};
+
+/* An evconnlistener created by event_base_group_new_listener(). */
+struct group_listener {
+	TAILQ_ENTRY(group_listener) next;
+	struct event_base_group *group;
+	struct evconnlistener *listener;
+	event_base_group_fd_cb cb;
+	void *arg;
+};
+
+struct event_base_group {
+	struct group_member *members;
+	int n_members;
+
+	pthread_mutex_t lock;
+	/* Where to start looking on the next pick, so that ties rotate. */
+	int next_member;
+	TAILQ_HEAD(group_listenerq, group_listener) listeners;
+};
+
+static void
+group_handoff_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct group_member *m = arg;
+	struct group_handoffq q;
+	struct group_handoff *h;
+
+	/* Take the whole batch at once, so that producers only contend
+	 * with us for a moment. */
+	TAILQ_INIT(&q);
+	pthread_mutex_lock(&m->lock);
+	while ((h = TAILQ_FIRST(&m->pending)) != NULL) {
+		TAILQ_REMOVE(&m->pending, h, next);
+		TAILQ_INSERT_TAIL(&q, h, next);
+	}
+	m->n_pending = 0;
+	pthread_mutex_unlock(&m->lock);
+
+	while ((h = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, h, next);
+		h->cb(m->base, m->idx, h->fd, (struct sockaddr *)&h->ss,
+		    h->socklen, h->arg);
+		mm_free(h);
+	}
+}
+
+static void
+group_keepalive_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static void *
+group_member_thread(void *arg)
+{
+	struct group_member *m = arg;
+	event_base_dispatch(m->base);
+	return NULL;
+}
+
+struct event_base_group *
+event_base_group_new(int n_bases, struct event_config *cfg)
+{
+	struct event_base_group *group;
+	struct timeval one_day = { 24*60*60, 0 };
+	int i;
+
+	if (n_bases < 1)
+		return NULL;
+	if (_evthread_locking_fn == NULL || _evthread_id_fn == NULL) {
+		event_warnx("%s: threading must be enabled before creating "
+		    "a base group", __func__);
+		return NULL;
+	}
+	if (cfg && (cfg->flags & EVENT_BASE_FLAG_NOLOCK)) {
+		event_warnx("%s: base group members need locking", __func__);
+		return NULL;
+	}
+
+	if ((group = mm_calloc(1, sizeof(struct event_base_group))) == NULL)
+		return NULL;
+	group->members = mm_calloc(n_bases, sizeof(struct group_member));
+	if (group->members == NULL) {
+		mm_free(group);
+		return NULL;
+	}
+	pthread_mutex_init(&group->lock, NULL);
+	TAILQ_INIT(&group->listeners);
+
+	for (i = 0; i < n_bases; ++i) {
+		struct group_member *m = &group->members[i];
+		m->group = group;
+		m->idx = i;
+		pthread_mutex_init(&m->lock, NULL);
+		TAILQ_INIT(&m->pending);
+		++group->n_members;
+
+		if (cfg)
+			m->base = event_base_new_with_config(cfg);
+		else
+			m->base = event_base_new();
+		if (m->base == NULL)
+			goto err;
+
+		event_assign(&m->handoff_ev, m->base, -1, 0,
+		    group_handoff_cb, m);
+		event_assign(&m->keepalive_ev, m->base, -1, EV_PERSIST,
+		    group_keepalive_cb, m);
+		event_add(&m->keepalive_ev, &one_day);
+	}
+
+	for (i = 0; i < n_bases; ++i) {
+		struct group_member *m = &group->members[i];
+		if (pthread_create(&m->thread, NULL, group_member_thread, m))
+			goto err;
+		m->thread_started = 1;
+	}
+
+	return group;
+err:
+	event_base_group_free(group);
+	return NULL;
+}
+
+void
+event_base_group_free(struct event_base_group *group)
+{
+	struct group_listener *gl;
+	struct group_handoff *h;
+	int i;
+
+	for (i = 0; i < group->n_members; ++i) {
+		struct group_member *m = &group->members[i];
+		if (m->thread_started)
+			event_base_loopbreak(m->base);
+	}
+	for (i = 0; i < group->n_members; ++i) {
+		struct group_member *m = &group->members[i];
+		if (m->thread_started)
+			pthread_join(m->thread, NULL);
+	}
+
+	/* Now that no loop is running, nothing can be accepting or picking
+	 * up connections behind our back. */
+	while ((gl = TAILQ_FIRST(&group->listeners)) != NULL) {
+		TAILQ_REMOVE(&group->listeners, gl, next);
+		evconnlistener_free(gl->listener);
+		mm_free(gl);
+	}
+
+	for (i = 0; i < group->n_members; ++i) {
+		struct group_member *m = &group->members[i];
+		/* Whatever was never picked up gets closed. */
+		while ((h = TAILQ_FIRST(&m->pending)) != NULL) {
+			TAILQ_REMOVE(&m->pending, h, next);
+			EVUTIL_CLOSESOCKET(h->fd);
+			mm_free(h);
+		}
+		if (m->base) {
+			event_del(&m->handoff_ev);
+			event_del(&m->keepalive_ev);
+			event_base_free(m->base);
+		}
+		pthread_mutex_destroy(&m->lock);
+	}
+
+	pthread_mutex_destroy(&group->lock);
+	mm_free(group->members);
+	mm_free(group);
+}
+
+int
+event_base_group_get_n_bases(struct event_base_group *group)
+{
+	return group->n_members;
+}
+
+struct event_base *
+event_base_group_get_base(struct event_base_group *group, int idx)
+{
+	if (idx < 0 || idx >= group->n_members)
+		return NULL;
+	return group->members[idx].base;
+}
+
+/* Return the member with the fewest events, counting connections that have
+ * been handed to it but not yet picked up.  We read event_count without
+ * taking the base lock: a slightly stale count only makes the choice a
+ * little less balanced. */
+static struct group_member *
+group_pick_least_loaded(struct event_base_group *group)
+{
+	struct group_member *best = NULL;
+	int best_load = 0;
+	int i, start;
+
+	pthread_mutex_lock(&group->lock);
+	start = group->next_member;
+	group->next_member = (start + 1) % group->n_members;
+	pthread_mutex_unlock(&group->lock);
+
+	for (i = 0; i < group->n_members; ++i) {
+		struct group_member *m =
+		    &group->members[(start + i) % group->n_members];
+		int load = m->base->event_count + m->n_pending;
+		if (best == NULL || load < best_load) {
+			best = m;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+int
+event_base_group_least_loaded(struct event_base_group *group)
+{
+	return group_pick_least_loaded(group)->idx;
+}
+
+int
+event_base_group_hand_off(struct event_base_group *group, int idx,
+    evutil_socket_t fd, const struct sockaddr *sa, int socklen,
+    event_base_group_fd_cb cb, void *arg)
+{
+	struct group_member *m;
+	struct group_handoff *h;
+
+	if (idx >= group->n_members)
+		return -1;
+	if (socklen < 0 || socklen > (int)sizeof(h->ss))
+		return -1;
+	if (idx < 0)
+		m = group_pick_least_loaded(group);
+	else
+		m = &group->members[idx];
+
+	if ((h = mm_calloc(1, sizeof(struct group_handoff))) == NULL)
+		return -1;
+	h->fd = fd;
+	if (sa)
+		memcpy(&h->ss, sa, socklen);
+	h->socklen = socklen;
+	h->cb = cb;
+	h->arg = arg;
+
+	pthread_mutex_lock(&m->lock);
+	TAILQ_INSERT_TAIL(&m->pending, h, next);
+	++m->n_pending;
+	pthread_mutex_unlock(&m->lock);
+
+	event_active(&m->handoff_ev, EV_READ, 1);
+	return m->idx;
+}
+
+static void
+group_listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct group_listener *gl = arg;
+	if (event_base_group_hand_off(gl->group, -1, fd, sa, socklen,
+		gl->cb, gl->arg) < 0) {
+		event_warnx("%s: couldn't hand off connection", __func__);
+		EVUTIL_CLOSESOCKET(fd);
+	}
+}
+
+struct evconnlistener *
+event_base_group_new_listener(struct event_base_group *group,
+    event_base_group_fd_cb cb, void *arg, unsigned flags, int backlog,
+    const struct sockaddr *sa, int socklen)
+{
+	struct group_listener *gl;
+
+	if ((gl = mm_calloc(1, sizeof(struct group_listener))) == NULL)
+		return NULL;
+	gl->group = group;
+	gl->cb = cb;
+	gl->arg = arg;
+
+	gl->listener = evconnlistener_new_bind(group->members[0].base,
+	    group_listener_cb, gl, flags, backlog, sa, socklen);
+	if (gl->listener == NULL) {
+		mm_free(gl);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&group->lock);
+	TAILQ_INSERT_TAIL(&group->listeners, gl, next);
+	pthread_mutex_unlock(&group->lock);
+
+	return gl->listener;
+}
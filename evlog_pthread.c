@@ -0,0 +1,116 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/* Protects everything below. */
+static pthread_mutex_t drainer_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when it is time for the drainer to stop. */
+static pthread_cond_t drainer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t drainer_thread;
+static int drainer_running;
+static int drainer_stopping;
+static int drainer_interval_msec;
+
+static void *
+drainer_main(void *arg)
+{
+	struct timeval now;
+	struct timespec ts;
+	long usec;
+
+	pthread_mutex_lock(&drainer_lock);
+	while (!drainer_stopping) {
+		pthread_mutex_unlock(&drainer_lock);
+		event_log_ring_drain(NULL);
+		pthread_mutex_lock(&drainer_lock);
+
+		evutil_gettimeofday(&now, NULL);
+		usec = now.tv_usec + drainer_interval_msec * 1000L;
+		ts.tv_sec = now.tv_sec + usec / 1000000;
+		ts.tv_nsec = (usec % 1000000) * 1000;
+		if (!drainer_stopping)
+			pthread_cond_timedwait(&drainer_cond, &drainer_lock,
+			    &ts);
+	}
+	pthread_mutex_unlock(&drainer_lock);
+
+	/* Don't leave anything behind that was logged before we stopped. */
+	event_log_ring_drain(NULL);
+	return NULL;
+}
+
+int
+evthread_log_drainer_start(int interval_msec)
+{
+	int r = -1;
+
+	if (interval_msec < 1)
+		return -1;
+	pthread_mutex_lock(&drainer_lock);
+	if (!drainer_running) {
+		drainer_interval_msec = interval_msec;
+		drainer_stopping = 0;
+		if (pthread_create(&drainer_thread, NULL, drainer_main,
+			NULL) == 0) {
+			drainer_running = 1;
+			r = 0;
+		}
+	}
+	pthread_mutex_unlock(&drainer_lock);
+	return r;
+}
+
+void
+evthread_log_drainer_stop(void)
+{
+	pthread_mutex_lock(&drainer_lock);
+	if (!drainer_running) {
+		pthread_mutex_unlock(&drainer_lock);
+		return;
+	}
+	drainer_stopping = 1;
+	pthread_cond_signal(&drainer_cond);
+	pthread_mutex_unlock(&drainer_lock);
+
+	pthread_join(drainer_thread, NULL);
+
+	pthread_mutex_lock(&drainer_lock);
+	drainer_running = 0;
+	pthread_mutex_unlock(&drainer_lock);
+}
@@ -48,6 +48,15 @@ void evmap_signal_initmap(struct event_signal_map* ctx);
 void evmap_io_clear(struct event_io_map* ctx);
 void evmap_signal_clear(struct event_signal_map* ctx);
 
+/** Make room in base's fd map for fds 0 through nfds-1, so that adding
+    events for them does not have to grow the map.
+
+	@param base the event_base whose map to grow
+	@param nfds the number of fds to make room for
+	@return 0 on success, -1 on failure
+ */
+int evmap_io_reserve(struct event_base *base, int nfds);
+
 /** Add an IO event (some combination of EV_READ or EV_WRITE) to an
 	event_base's list of events on a given file descriptor, and tell the
 	underlying eventops about the fd if its state has changed.
@@ -80,4 +89,21 @@ void evmap_signal_active(struct event_base *base, int fd, int ncalls);
 
 void *evmap_io_get_fdinfo(struct event_io_map *ctx, evutil_socket_t fd);
 
+typedef int (*evmap_event_foreach_fn)(struct event_base *, struct event *,
+    void *);
+/** Call fn on every event in base's io and signal maps, stopping at the
+	first nonzero value it returns and returning that.  fn may delete the
+	event it is given, but no other.
+ */
+int evmap_foreach_event(struct event_base *base, evmap_event_foreach_fn fn,
+    void *arg);
+
+/** Tell base's freshly reinitialized backend about every fd and signal
+	that still has inserted events, as after a fork.  Events in the maps
+	that are no longer EVLIST_INSERTED are dropped from them.
+
+	@return 0 on success, -1 if re-adding any event failed.
+ */
+int evmap_reinit(struct event_base *base);
+
 #endif /* _EVMAP_H_ */
@@ -53,12 +53,20 @@
 #include "event-internal.h"
 #include "evmap-internal.h"
 #include "mm-internal.h"
+#include "changelist-internal.h"
 
 /** An entry for an evmap_io list: notes all the events that want to read or
 	write on a given fd, and the number of each.
+
+	Nearly every fd has exactly one event, and hardly ever more than a
+	few, so the events are kept on a singly-linked list through
+	ev_io_next: walking it to remove one is cheaper than giving every
+	event a back pointer.
   */
 struct evmap_io {
-	struct event_list events;
+	/* The events on this fd, in the order they were added. */
+	struct event *events;
+	unsigned int nevents;
 	unsigned int nread;
 	unsigned int nwrite;
 };
@@ -66,7 +74,8 @@ struct evmap_io {
 /* An entry for an evmap_signal list: notes all the events that want to know
    when a signal triggers. */
 struct evmap_signal {
-	struct event_list events;
+	/* Linked through ev_signal_next, in the order they were added. */
+	struct event *events;
 };
 
 /* On some platforms, fds start at 0 and increment by 1 as they are
@@ -218,6 +227,17 @@ evmap_make_space(struct event_signal_map *map, int slot, int msize)
 	return (0);
 }
 
+int
+evmap_io_reserve(struct event_base *base, int nfds)
+{
+#ifndef EVMAP_USE_HT
+	if (nfds > 0)
+		return evmap_make_space(&base->io, nfds - 1,
+		    sizeof(struct evmap_io *));
+#endif
+	return (0);
+}
+
 void
 evmap_signal_initmap(struct event_signal_map *ctx)
 {
@@ -247,11 +267,38 @@ evmap_signal_clear(struct event_signal_map *ctx)
 static void
 evmap_io_init(struct evmap_io *entry)
 {
-	TAILQ_INIT(&entry->events);
+	entry->events = NULL;
+	entry->nevents = 0;
 	entry->nread = 0;
 	entry->nwrite = 0;
 }
 
+/** Add ev to the end of the events on ctx. */
+static inline void
+evmap_io_insert(struct evmap_io *ctx, struct event *ev)
+{
+	struct event **evp = &ctx->events;
+	while (*evp)
+		evp = &(*evp)->ev_io_next;
+	ev->ev_io_next = NULL;
+	*evp = ev;
+	++ctx->nevents;
+}
+
+/** Remove ev from the events on ctx. */
+static inline void
+evmap_io_remove(struct evmap_io *ctx, struct event *ev)
+{
+	struct event **evp = &ctx->events;
+	assert(ctx->nevents > 0);
+	while (*evp != ev) {
+		assert(*evp != NULL);
+		evp = &(*evp)->ev_io_next;
+	}
+	*evp = ev->ev_io_next;
+	--ctx->nevents;
+}
+
 
 int
 evmap_io_add(struct event_base *base, int fd, struct event *ev)
@@ -294,6 +341,10 @@ evmap_io_add(struct event_base *base, int fd, struct event *ev)
 
 	if (res) {
 		void *extra = ((char*)ctx) + sizeof(struct evmap_io);
+		/* Not every fd is a socket, so failing here is fine. */
+		if (!old && base->busy_poll_sock_usec > 0)
+			(void) evutil_make_socket_busy_poll(ev->ev_fd,
+			    base->busy_poll_sock_usec);
 		/* XXX(niels): we cannot mix edge-triggered and
 		 * level-triggered, we should probably assert on
 		 * this. */
@@ -304,7 +355,7 @@ evmap_io_add(struct event_base *base, int fd, struct event *ev)
 
 	ctx->nread = nread;
 	ctx->nwrite = nwrite;
-	TAILQ_INSERT_TAIL(&ctx->events, ev, ev_io_next);
+	evmap_io_insert(ctx, ev);
 
 	return (0);
 }
@@ -356,7 +407,7 @@ evmap_io_del(struct event_base *base, int fd, struct event *ev)
 
 	ctx->nread = nread;
 	ctx->nwrite = nwrite;
-	TAILQ_REMOVE(&ctx->events, ev, ev_io_next);
+	evmap_io_remove(ctx, ev);
 
 	return (0);
 }
@@ -374,7 +425,7 @@ evmap_io_active(struct event_base *base, int fd, short events)
 	GET_IO_SLOT(ctx, io, fd, evmap_io);
 
 	assert(ctx);
-	TAILQ_FOREACH(ev, &ctx->events, ev_io_next) {
+	for (ev = ctx->events; ev; ev = ev->ev_io_next) {
 		if (ev->ev_events & events)
 			event_active(ev, ev->ev_events & events, 1);
 	}
@@ -385,7 +436,7 @@ evmap_io_active(struct event_base *base, int fd, short events)
 static void
 evmap_signal_init(struct evmap_signal *entry)
 {
-	TAILQ_INIT(&entry->events);
+	entry->events = NULL;
 }
 
 
@@ -395,6 +446,7 @@ evmap_signal_add(struct event_base *base, int sig, struct event *ev)
 	const struct eventop *evsel = base->evsigsel;
 	struct event_signal_map *map = &base->sigmap;
 	struct evmap_signal *ctx = NULL;
+	struct event **evp;
 
 	if (sig >= map->nentries) {
 		if (evmap_make_space(
@@ -403,12 +455,16 @@ evmap_signal_add(struct event_base *base, int sig, struct event *ev)
 	}
 	GET_SIGNAL_SLOT_AND_CTOR(ctx, map, sig, evmap_signal, evmap_signal_init, 0);
 
-	if (TAILQ_EMPTY(&ctx->events)) {
+	if (ctx->events == NULL) {
 		if (evsel->add(base, EVENT_SIGNAL(ev), 0, EV_SIGNAL, NULL) == -1)
 			return (-1);
 	}
 
-	TAILQ_INSERT_TAIL(&ctx->events, ev, ev_signal_next);
+	evp = &ctx->events;
+	while (*evp)
+		evp = &(*evp)->ev_signal_next;
+	ev->ev_signal_next = NULL;
+	*evp = ev;
 
 	return (0);
 }
@@ -419,18 +475,24 @@ evmap_signal_del(struct event_base *base, int sig, struct event *ev)
 	const struct eventop *evsel = base->evsigsel;
 	struct event_signal_map *map = &base->sigmap;
 	struct evmap_signal *ctx;
+	struct event **evp;
 
 	if (sig >= map->nentries)
 		return (-1);
 
 	GET_SIGNAL_SLOT(ctx, map, sig, evmap_signal);
 
-	if (TAILQ_FIRST(&ctx->events) == TAILQ_LAST(&ctx->events, event_list)) {
+	if (ctx->events == ev && ev->ev_signal_next == NULL) {
 		if (evsel->del(base, EVENT_SIGNAL(ev), 0, EV_SIGNAL, NULL) == -1)
 			return (-1);
 	}
 
-	TAILQ_REMOVE(&ctx->events, ev, ev_signal_next);
+	evp = &ctx->events;
+	while (*evp != ev) {
+		assert(*evp != NULL);
+		evp = &(*evp)->ev_signal_next;
+	}
+	*evp = ev->ev_signal_next;
 
 	return (0);
 }
@@ -445,7 +507,7 @@ evmap_signal_active(struct event_base *base, int sig, int ncalls)
 	assert(sig < map->nentries);
 	GET_SIGNAL_SLOT(ctx, map, sig, evmap_signal);
 
-	TAILQ_FOREACH(ev, &ctx->events, ev_signal_next)
+	for (ev = ctx->events; ev; ev = ev->ev_signal_next)
 		event_active(ev, EV_SIGNAL, ncalls);
 }
 
@@ -459,3 +521,309 @@ evmap_io_get_fdinfo(struct event_io_map *map, evutil_socket_t fd)
 	else
 		return NULL;
 }
+
+/* iterating over every event in the maps */
+
+static int
+evmap_io_foreach_event(struct event_base *base, struct evmap_io *ctx,
+    evmap_event_foreach_fn fn, void *arg)
+{
+	struct event *ev, *next;
+	int r;
+	for (ev = ctx->events; ev; ev = next) {
+		next = ev->ev_io_next;
+		if ((r = fn(base, ev, arg)))
+			return r;
+	}
+	return 0;
+}
+
+int
+evmap_foreach_event(struct event_base *base, evmap_event_foreach_fn fn,
+    void *arg)
+{
+	struct event_io_map *io = &base->io;
+	struct event_signal_map *sigmap = &base->sigmap;
+	struct evmap_signal *sctx;
+	struct event *ev, *next;
+	int i, r;
+
+#ifdef EVMAP_USE_HT
+	struct event_map_entry **ent;
+	HT_FOREACH(ent, event_io_map, io) {
+		if ((r = evmap_io_foreach_event(base, &(*ent)->ent.evmap_io,
+			    fn, arg)))
+			return r;
+	}
+#else
+	for (i = 0; i < io->nentries; ++i) {
+		struct evmap_io *ctx;
+		GET_IO_SLOT(ctx, io, i, evmap_io);
+		if (ctx && (r = evmap_io_foreach_event(base, ctx, fn, arg)))
+			return r;
+	}
+#endif
+
+	for (i = 0; i < sigmap->nentries; ++i) {
+		GET_SIGNAL_SLOT(sctx, sigmap, i, evmap_signal);
+		if (!sctx)
+			continue;
+		for (ev = sctx->events; ev; ev = next) {
+			next = ev->ev_signal_next;
+			if ((r = fn(base, ev, arg)))
+				return r;
+		}
+	}
+	return 0;
+}
+
+/* Empty ctx, then add back every event on it that is still inserted.
+ * The backend's fdinfo for the fd is zeroed first, since whatever it
+ * pointed into went away with the old backend. */
+static int
+evmap_io_reinit(struct event_base *base, struct evmap_io *ctx)
+{
+	struct event *ev, *next;
+	int res = 0;
+
+	ev = ctx->events;
+	evmap_io_init(ctx);
+	memset(((char*)ctx) + sizeof(struct evmap_io), 0,
+	    base->evsel->fdinfo_len);
+	for (; ev; ev = next) {
+		next = ev->ev_io_next;
+		if (!(ev->ev_flags & EVLIST_INSERTED))
+			continue;
+		if (evmap_io_add(base, ev->ev_fd, ev) == -1)
+			res = -1;
+	}
+	return res;
+}
+
+int
+evmap_reinit(struct event_base *base)
+{
+	struct event_io_map *io = &base->io;
+	struct event_signal_map *sigmap = &base->sigmap;
+	struct evmap_signal *sctx;
+	struct event *ev, *next;
+	int i, res = 0;
+
+#ifdef EVMAP_USE_HT
+	struct event_map_entry **ent;
+	HT_FOREACH(ent, event_io_map, io) {
+		if (evmap_io_reinit(base, &(*ent)->ent.evmap_io) == -1)
+			res = -1;
+	}
+#else
+	for (i = 0; i < io->nentries; ++i) {
+		struct evmap_io *ctx;
+		GET_IO_SLOT(ctx, io, i, evmap_io);
+		if (ctx && evmap_io_reinit(base, ctx) == -1)
+			res = -1;
+	}
+#endif
+
+	for (i = 0; i < sigmap->nentries; ++i) {
+		GET_SIGNAL_SLOT(sctx, sigmap, i, evmap_signal);
+		if (!sctx)
+			continue;
+		ev = sctx->events;
+		sctx->events = NULL;
+		for (; ev; ev = next) {
+			next = ev->ev_signal_next;
+			if (!(ev->ev_flags & EVLIST_INSERTED))
+				continue;
+			if (evmap_signal_add(base, ev->ev_fd, ev) == -1)
+				res = -1;
+		}
+	}
+	return res;
+}
+
+/* code specific to changelists */
+
+/* The fdinfo that a changelist-based backend stores for each fd: where in
+ * base->changelist the pending change for that fd lives, if anywhere. */
+struct event_changelist_fdinfo {
+	int idxplus1; /* this is the index +1, so that memset(0) will make it
+		       * a no-such-element */
+};
+
+void
+event_changelist_init(struct event_changelist *changelist)
+{
+	changelist->changes = NULL;
+	changelist->changes_size = 0;
+	changelist->n_changes = 0;
+}
+
+void
+event_changelist_remove_all(struct event_changelist *changelist,
+    struct event_base *base)
+{
+	int i;
+
+	for (i = 0; i < changelist->n_changes; ++i) {
+		struct event_change *ch = &changelist->changes[i];
+		struct event_changelist_fdinfo *fdinfo =
+		    evmap_io_get_fdinfo(&base->io, ch->fd);
+		assert(fdinfo->idxplus1 == i + 1);
+		fdinfo->idxplus1 = 0;
+	}
+
+	changelist->n_changes = 0;
+}
+
+void
+event_changelist_freemem(struct event_changelist *changelist)
+{
+	if (changelist->changes)
+		mm_free(changelist->changes);
+	event_changelist_init(changelist); /* zero it all out. */
+}
+
+int
+event_changelist_reserve(struct event_changelist *changelist, int n)
+{
+	struct event_change *new_changes;
+
+	if (n <= changelist->changes_size)
+		return (0);
+
+	new_changes = mm_realloc(changelist->changes,
+	    n * sizeof(struct event_change));
+	if (new_changes == NULL)
+		return (-1);
+
+	changelist->changes = new_changes;
+	changelist->changes_size = n;
+
+	return (0);
+}
+
+/** Increase the size of 'changelist' to hold more changes. */
+static int
+event_changelist_grow(struct event_changelist *changelist)
+{
+	int new_size;
+	struct event_change *new_changes;
+	if (changelist->changes_size < 64)
+		new_size = 64;
+	else
+		new_size = changelist->changes_size * 2;
+
+	new_changes = mm_realloc(changelist->changes,
+	    new_size * sizeof(struct event_change));
+
+	if (new_changes == NULL)
+		return (-1);
+
+	changelist->changes = new_changes;
+	changelist->changes_size = new_size;
+
+	return (0);
+}
+
+/** Return a pointer to the changelist entry for the file descriptor or signal
+ * 'fd', whose fdinfo is 'fdinfo'.  If none exists, construct it, setting its
+ * old_events field to old_events.
+ */
+static struct event_change *
+event_changelist_get_or_construct(struct event_changelist *changelist,
+    evutil_socket_t fd,
+    short old_events,
+    struct event_changelist_fdinfo *fdinfo)
+{
+	struct event_change *change;
+
+	if (fdinfo->idxplus1 == 0) {
+		int idx;
+		assert(changelist->n_changes <= changelist->changes_size);
+
+		if (changelist->n_changes == changelist->changes_size) {
+			if (event_changelist_grow(changelist) < 0)
+				return NULL;
+		}
+
+		idx = changelist->n_changes++;
+		change = &changelist->changes[idx];
+		fdinfo->idxplus1 = idx + 1;
+
+		memset(change, 0, sizeof(struct event_change));
+		change->fd = fd;
+		change->old_events = old_events;
+	} else {
+		change = &changelist->changes[fdinfo->idxplus1 - 1];
+		assert(change->fd == fd);
+	}
+	return change;
+}
+
+int
+event_changelist_add(struct event_base *base, evutil_socket_t fd, short old, short events,
+    void *p)
+{
+	struct event_changelist *changelist = &base->changelist;
+	struct event_changelist_fdinfo *fdinfo = p;
+	struct event_change *change;
+
+	change = event_changelist_get_or_construct(changelist, fd, old, fdinfo);
+	if (!change)
+		return -1;
+
+	/* An add replaces any previous delete, but doesn't result in a no-op,
+	 * since the delete might fail (because the fd had been closed since
+	 * the last add, for instance. */
+
+	if (events & (EV_READ|EV_SIGNAL)) {
+		change->read_change = EV_CHANGE_ADD |
+		    (events & (EV_ET|EV_PERSIST|EV_SIGNAL));
+	}
+	if (events & EV_WRITE) {
+		change->write_change = EV_CHANGE_ADD |
+		    (events & (EV_ET|EV_PERSIST|EV_SIGNAL));
+	}
+
+	return (0);
+}
+
+int
+event_changelist_del(struct event_base *base, evutil_socket_t fd, short old, short events,
+    void *p)
+{
+	struct event_changelist *changelist = &base->changelist;
+	struct event_changelist_fdinfo *fdinfo = p;
+	struct event_change *change;
+
+	change = event_changelist_get_or_construct(changelist, fd, old, fdinfo);
+	if (!change)
+		return -1;
+
+	/* A delete removes any previous add, rather than replacing it:
+	   on those platforms where "add, delete, dispatch" is not the same
+	   as "no-op, dispatch", we want the no-op behavior.
+
+	   If we have a no-op item, we could remove it it from the list
+	   entirely, but really there's not much point: skipping the no-op
+	   change when we do the dispatch later is far cheaper than rejuggling
+	   the array now.
+	 */
+
+	if (events & (EV_READ|EV_SIGNAL)) {
+		if (!(change->old_events & (EV_READ | EV_SIGNAL)) &&
+		    (change->read_change & EV_CHANGE_ADD))
+			change->read_change = 0;
+		else
+			change->read_change = EV_CHANGE_DEL;
+	}
+	if (events & EV_WRITE) {
+		if (!(change->old_events & EV_WRITE) &&
+		    (change->write_change & EV_CHANGE_ADD))
+			change->write_change = 0;
+		else
+			change->write_change = EV_CHANGE_DEL;
+	}
+
+	return (0);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVPOOL_INTERNAL_H_
+#define _EVPOOL_INTERNAL_H_
+
+/** @file evpool-internal.h
+ *
+ * An ev_pool hands out fixed-size objects carved from larger slabs, and
+ * keeps freed objects on a per-size free list for reuse, so that objects
+ * that come and go quickly don't have to go through mm_malloc() each time.
+ *
+ * Every object from ev_pool_alloc() carries a small header that records
+ * where it came from, so it must be released with ev_pool_free(), and
+ * ev_pool_free() works without being told the pool.  When the pool can't
+ * serve a request, users fall back to plain mm_malloc() memory, which has
+ * no header; they keep a flag of their own to tell the two apart.  A pool stays alive
+ * until its owner has released it and every object from it is freed.
+ **/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+struct ev_pool;
+struct event_base_pool_stats;
+
+/** Create a new pool holding a reference for the caller.  sizes lists
+    the n_sizes object sizes that the pool keeps slabs for; a request
+    is served from the first listed size that can hold it.  If
+    use_lock is true, the pool is safe to use from several threads at
+    once.  Returns NULL on failure. */
+struct ev_pool *ev_pool_new(const size_t *sizes, int n_sizes, int use_lock);
+/** Add a reference to a pool. */
+void ev_pool_incref(struct ev_pool *pool);
+/** Drop a reference to a pool; the pool is freed once it has no
+    references and no outstanding objects. */
+void ev_pool_decref(struct ev_pool *pool);
+
+/** Allocate an object of at least size bytes from pool.  If size_out is
+    provided, set it to the number of usable bytes in the object, which can
+    be more than size.  Returns NULL if pool has no slab size big enough,
+    or is out of memory; the caller may then use mm_malloc() instead, and
+    must remember which of the two the object came from. */
+void *ev_pool_alloc(struct ev_pool *pool, size_t size, size_t *size_out);
+/** Release an object returned by ev_pool_alloc().  Only objects from a
+    pool carry the header that this reads. */
+void ev_pool_free(void *ptr);
+
+/** Fill *stats with the occupancy of pool. */
+void ev_pool_get_stats(struct ev_pool *pool,
+    struct event_base_pool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVPOOL_INTERNAL_H_ */
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "event2/event.h"
+#include "event2/thread.h"
+#include "evpool-internal.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
+
+/* Put in front of every object we hand out.  The union makes sure that
+ * whatever follows the header is aligned well enough for any type. */
+union ev_pool_hdr {
+	struct {
+		/* The pool whose slab holds this object. */
+		struct ev_pool *pool;
+		/* Index of the object's class in pool->classes. */
+		int cls;
+	} h;
+	double _align_d;
+	ev_uint64_t _align_u;
+	void *_align_p;
+};
+
+/* A block of memory holding many objects of one class.  Slabs are only
+ * freed along with the pool. */
+union ev_pool_slab {
+	union ev_pool_slab *next;
+	union ev_pool_hdr _align;
+};
+
+/* About how many bytes to ask for when a class runs out of objects. */
+#define EV_POOL_SLAB_BYTES 16384
+/* The fewest objects to put in a slab, however big they are. */
+#define EV_POOL_MIN_PER_SLAB 4
+
+struct ev_pool_class {
+	/* Usable bytes per object. */
+	size_t size;
+	/* Distance between objects in a slab, header included. */
+	size_t stride;
+	/* Freed objects waiting for reuse, linked through their first
+	 * usable bytes. */
+	union ev_pool_hdr *free_list;
+	union ev_pool_slab *slabs;
+
+	unsigned long n_slabs;
+	unsigned long n_objects;
+	unsigned long n_in_use;
+	ev_uint64_t n_allocs;
+};
+
+struct ev_pool {
+#ifndef _EVENT_DISABLE_THREAD_SUPPORT
+	void *lock;
+#endif
+	/* One for each holder, plus one for each object handed out. */
+	int refcnt;
+	ev_uint64_t n_unpooled;
+	int n_classes;
+	struct ev_pool_class classes[EVENT_POOL_MAX_CLASSES];
+};
+
+#define FREE_LIST_NEXT(hdr) (*(union ev_pool_hdr **)((hdr) + 1))
+
+struct ev_pool *
+ev_pool_new(const size_t *sizes, int n_sizes, int use_lock)
+{
+	struct ev_pool *pool;
+	int i;
+
+	if (n_sizes < 0 || n_sizes > EVENT_POOL_MAX_CLASSES)
+		return NULL;
+	if ((pool = mm_calloc(1, sizeof(struct ev_pool))) == NULL)
+		return NULL;
+
+	pool->refcnt = 1;
+	pool->n_classes = n_sizes;
+	for (i = 0; i < n_sizes; ++i) {
+		struct ev_pool_class *cls = &pool->classes[i];
+		const size_t align = sizeof(union ev_pool_hdr);
+		size_t size = sizes[i];
+		/* Freed objects have to hold a free-list pointer. */
+		if (size < sizeof(void *))
+			size = sizeof(void *);
+		cls->size = sizes[i];
+		cls->stride = align + (size + align - 1) / align * align;
+	}
+
+	if (use_lock)
+		EVTHREAD_ALLOC_LOCK(pool->lock, EVTHREAD_LOCK_CATEGORY_OTHER);
+
+	return pool;
+}
+
+static void
+ev_pool_destroy(struct ev_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->n_classes; ++i) {
+		union ev_pool_slab *slab, *next;
+		for (slab = pool->classes[i].slabs; slab; slab = next) {
+			next = slab->next;
+			mm_free(slab);
+		}
+	}
+	EVTHREAD_FREE_LOCK(pool->lock);
+	mm_free(pool);
+}
+
+void
+ev_pool_incref(struct ev_pool *pool)
+{
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	++pool->refcnt;
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+}
+
+void
+ev_pool_decref(struct ev_pool *pool)
+{
+	int refcnt;
+
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	refcnt = --pool->refcnt;
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+
+	if (refcnt == 0)
+		ev_pool_destroy(pool);
+}
+
+/* Carve a new slab into objects for cls.  Called with the pool locked. */
+static int
+ev_pool_grow(struct ev_pool *pool, int idx)
+{
+	struct ev_pool_class *cls = &pool->classes[idx];
+	union ev_pool_slab *slab;
+	unsigned char *p;
+	size_t n, i;
+
+	n = EV_POOL_SLAB_BYTES / cls->stride;
+	if (n < EV_POOL_MIN_PER_SLAB)
+		n = EV_POOL_MIN_PER_SLAB;
+
+	if ((slab = mm_malloc(sizeof(union ev_pool_slab) + n * cls->stride))
+	    == NULL)
+		return -1;
+	slab->next = cls->slabs;
+	cls->slabs = slab;
+	++cls->n_slabs;
+	cls->n_objects += n;
+
+	p = (unsigned char *)(slab + 1);
+	for (i = 0; i < n; ++i, p += cls->stride) {
+		union ev_pool_hdr *hdr = (union ev_pool_hdr *)p;
+		hdr->h.pool = pool;
+		hdr->h.cls = idx;
+		FREE_LIST_NEXT(hdr) = cls->free_list;
+		cls->free_list = hdr;
+	}
+	return 0;
+}
+
+void *
+ev_pool_alloc(struct ev_pool *pool, size_t size, size_t *size_out)
+{
+	union ev_pool_hdr *hdr;
+	int i;
+
+	for (i = 0; i < pool->n_classes; ++i) {
+		if (pool->classes[i].size >= size)
+			break;
+	}
+
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	if (i < pool->n_classes) {
+		struct ev_pool_class *cls = &pool->classes[i];
+		if (cls->free_list || ev_pool_grow(pool, i) == 0) {
+			hdr = cls->free_list;
+			cls->free_list = FREE_LIST_NEXT(hdr);
+			++cls->n_in_use;
+			++cls->n_allocs;
+			++pool->refcnt;
+			EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+			if (size_out)
+				*size_out = cls->size;
+			return hdr + 1;
+		}
+	}
+	++pool->n_unpooled;
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+	return NULL;
+}
+
+void
+ev_pool_free(void *ptr)
+{
+	union ev_pool_hdr *hdr;
+	struct ev_pool *pool;
+	struct ev_pool_class *cls;
+	int refcnt;
+
+	if (ptr == NULL)
+		return;
+	hdr = (union ev_pool_hdr *)ptr - 1;
+	pool = hdr->h.pool;
+
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	cls = &pool->classes[hdr->h.cls];
+	FREE_LIST_NEXT(hdr) = cls->free_list;
+	cls->free_list = hdr;
+	--cls->n_in_use;
+	refcnt = --pool->refcnt;
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+
+	if (refcnt == 0)
+		ev_pool_destroy(pool);
+}
+
+void
+ev_pool_get_stats(struct ev_pool *pool, struct event_base_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	EVLOCK_LOCK(pool->lock, EVTHREAD_WRITE);
+	stats->n_classes = pool->n_classes;
+	for (i = 0; i < pool->n_classes; ++i) {
+		struct ev_pool_class *cls = &pool->classes[i];
+		stats->classes[i].object_size = cls->size;
+		stats->classes[i].n_slabs = cls->n_slabs;
+		stats->classes[i].n_objects = cls->n_objects;
+		stats->classes[i].n_in_use = cls->n_in_use;
+		stats->classes[i].n_allocs = cls->n_allocs;
+	}
+	stats->n_unpooled = pool->n_unpooled;
+	EVLOCK_UNLOCK(pool->lock, EVTHREAD_WRITE);
+}
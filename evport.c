@@ -47,6 +47,13 @@
  * necessary when large fd's come in. reassociate() takes care of maintaining
  * the proper file-descriptor/event-port associations.
  *
+ * The port dissociates an fd when it reports an event on it, so every fd
+ * that fired needs port_associate again before it can fire again.  We put
+ * those on ed_pending and leave them alone until the start of the next
+ * dispatch, so that adds and deletes made by the callbacks in between
+ * only change fdi_what, and we make at most one call per fd: none at all
+ * if its events were all deleted.
+ *
  * As in the select(2) implementation, signals are handled by evsignal.
  */
 
@@ -84,11 +91,12 @@
 
 
 /*
- * EVENTS_PER_GETN is the maximum number of events to retrieve from port_getn on
- * any particular call. You can speed things up by increasing this, but it will
- * (obviously) require more memory.
+ * INITIAL_EVENTS_PER_GETN is the number of events we retrieve from port_getn
+ * at first.  Whenever a call fills the list, we double it for next time, up
+ * to MAX_EVENTS_PER_GETN, so that busy bases need fewer calls per event.
  */
-#define EVENTS_PER_GETN 8
+#define INITIAL_EVENTS_PER_GETN 32
+#define MAX_EVENTS_PER_GETN 4096
 
 /*
  * Per-file-descriptor information about what events we're subscribed to. These
@@ -97,6 +105,7 @@
 
 struct fd_info {
 	short fdi_what;		/* combinations of EV_READ and EV_WRITE */
+	short fdi_fired;	/* true iff this fd is on ed_pending */
 };
 
 #define FDI_HAS_READ(fdi)  ((fdi)->fdi_what & EV_READ)
@@ -109,8 +118,11 @@ struct evport_data {
 	int 		ed_port;	/* event port for system events  */
 	int		ed_nevents;	/* number of allocated fdi's 	 */
 	struct fd_info *ed_fds;		/* allocated fdi table 		 */
-	/* fdi's that we need to reassoc */
-	int ed_pending[EVENTS_PER_GETN]; /* fd's with pending events */
+	port_event_t *ed_pevtlist;	/* events from port_getn	 */
+	int ed_npevts;			/* size of ed_pevtlist		 */
+	/* fd's that fired last time, which we need to reassoc */
+	int *ed_pending;		/* same size as ed_pevtlist	 */
+	int ed_npending;
 };
 
 static void*	evport_init	(struct event_base *);
@@ -138,7 +150,7 @@ static void*
 evport_init(struct event_base *base)
 {
 	struct evport_data *evpd;
-	int i;
+	int nfds;
 
 	if (!(evpd = mm_calloc(1, sizeof(struct evport_data))))
 		return (NULL);
@@ -151,15 +163,26 @@ evport_init(struct event_base *base)
 	/*
 	 * Initialize file descriptor structure
 	 */
-	evpd->ed_fds = mm_calloc(DEFAULT_NFDS, sizeof(struct fd_info));
-	if (evpd->ed_fds == NULL) {
+	nfds = base->size_hint_fds > DEFAULT_NFDS ?
+	    base->size_hint_fds : DEFAULT_NFDS;
+	evpd->ed_fds = mm_calloc(nfds, sizeof(struct fd_info));
+	evpd->ed_pevtlist = mm_calloc(INITIAL_EVENTS_PER_GETN,
+	    sizeof(port_event_t));
+	evpd->ed_pending = mm_calloc(INITIAL_EVENTS_PER_GETN, sizeof(int));
+	if (evpd->ed_fds == NULL || evpd->ed_pevtlist == NULL ||
+	    evpd->ed_pending == NULL) {
+		if (evpd->ed_fds)
+			mm_free(evpd->ed_fds);
+		if (evpd->ed_pevtlist)
+			mm_free(evpd->ed_pevtlist);
+		if (evpd->ed_pending)
+			mm_free(evpd->ed_pending);
 		close(evpd->ed_port);
 		mm_free(evpd);
 		return (NULL);
 	}
-	evpd->ed_nevents = DEFAULT_NFDS;
-	for (i = 0; i < EVENTS_PER_GETN; i++)
-		evpd->ed_pending[i] = -1;
+	evpd->ed_nevents = nfds;
+	evpd->ed_npevts = INITIAL_EVENTS_PER_GETN;
 
 	evsig_init(base);
 
@@ -180,6 +203,8 @@ check_evportop(struct evport_data *evpd)
 	assert(evpd->ed_nevents > 0);
 	assert(evpd->ed_port > 0);
 	assert(evpd->ed_fds > 0);
+	assert(evpd->ed_npending >= 0);
+	assert(evpd->ed_npending <= evpd->ed_npevts);
 }
 
 /*
@@ -262,12 +287,12 @@ evport_dispatch(struct event_base *base, struct timeval *tv)
 {
 	int i, res;
 	struct evport_data *epdp = base->evbase;
-	port_event_t pevtlist[EVENTS_PER_GETN];
+	port_event_t *pevtlist = epdp->ed_pevtlist;
 
 	/*
 	 * port_getn will block until it has at least nevents events. It will
 	 * also return how many it's given us (which may be more than we asked
-	 * for, as long as it's less than our maximum (EVENTS_PER_GETN)) in
+	 * for, as long as it's less than our maximum (ed_npevts)) in
 	 * nevents.
 	 */
 	int nevents = 1;
@@ -286,24 +311,21 @@ evport_dispatch(struct event_base *base, struct timeval *tv)
 	}
 
 	/*
-	 * Before doing anything else, we need to reassociate the events we hit
-	 * last time which need reassociation. See comment at the end of the
-	 * loop below.
+	 * Before doing anything else, we need to reassociate the fds that
+	 * fired last time and that still have events, now that the callbacks
+	 * have had their say. See comment at the end of the loop below.
 	 */
-	for (i = 0; i < EVENTS_PER_GETN; ++i) {
-		struct fd_info *fdi = NULL;
-		if (epdp->ed_pending[i] != -1) {
-			fdi = &(epdp->ed_fds[epdp->ed_pending[i]]);
-		}
+	for (i = 0; i < epdp->ed_npending; ++i) {
+		int fd = epdp->ed_pending[i];
+		struct fd_info *fdi = &epdp->ed_fds[fd];
 
-		if (fdi != NULL && FDI_HAS_EVENTS(fdi)) {
-			int fd = epdp->ed_pending[i];
+		fdi->fdi_fired = 0;
+		if (FDI_HAS_EVENTS(fdi))
 			reassociate(epdp, fdi, fd);
-			epdp->ed_pending[i] = -1;
-		}
 	}
+	epdp->ed_npending = 0;
 
-	if ((res = port_getn(epdp->ed_port, pevtlist, EVENTS_PER_GETN,
+	if ((res = port_getn(epdp->ed_port, pevtlist, epdp->ed_npevts,
 		    (unsigned int *) &nevents, ts_p)) == -1) {
 		if (errno == EINTR || errno == EAGAIN) {
 			evsig_process(base);
@@ -328,7 +350,6 @@ evport_dispatch(struct event_base *base, struct timeval *tv)
 
 		check_evportop(epdp);
 		check_event(pevt);
-		epdp->ed_pending[i] = fd;
 
 		/*
 		 * Figure out what kind of event it was
@@ -343,9 +364,42 @@ evport_dispatch(struct event_base *base, struct timeval *tv)
 		assert(epdp->ed_nevents > fd);
 		fdi = &(epdp->ed_fds[fd]);
 
+		/*
+		 * The port has dissociated the fd; remember to associate
+		 * it again next time if it still has events then.
+		 */
+		if (!fdi->fdi_fired) {
+			fdi->fdi_fired = 1;
+			epdp->ed_pending[epdp->ed_npending++] = fd;
+		}
+
 		evmap_io_active(base, fd, res);
 	} /* end of all events gotten */
 
+	if (nevents == epdp->ed_npevts &&
+	    epdp->ed_npevts < MAX_EVENTS_PER_GETN) {
+		/*
+		 * We used all the space we had; next time, ask for more.
+		 * The pending list has to hold one entry per event, so it
+		 * grows along with the event list.
+		 */
+		int new_npevts = epdp->ed_npevts * 2;
+		port_event_t *new_pevtlist;
+		int *new_pending;
+
+		new_pending = mm_realloc(epdp->ed_pending,
+		    new_npevts * sizeof(int));
+		if (new_pending) {
+			epdp->ed_pending = new_pending;
+			new_pevtlist = mm_realloc(epdp->ed_pevtlist,
+			    new_npevts * sizeof(port_event_t));
+			if (new_pevtlist) {
+				epdp->ed_pevtlist = new_pevtlist;
+				epdp->ed_npevts = new_npevts;
+			}
+		}
+	}
+
 	check_evportop(epdp);
 
 	return (0);
@@ -384,6 +438,10 @@ evport_add(struct event_base *base, int fd, short old, short events, void *p)
 	fdi = &evpd->ed_fds[fd];
 	fdi->fdi_what |= events;
 
+	/* If it fired, the next dispatch will associate it for us. */
+	if (fdi->fdi_fired)
+		return (0);
+
 	return reassociate(evpd, fdi, fd);
 }
 
@@ -396,48 +454,40 @@ evport_del(struct event_base *base, int fd, short old, short events, void *p)
 {
 	struct evport_data *evpd = base->evbase;
 	struct fd_info *fdi;
-	int i;
-	int associated = 1;
 	(void)p;
 
 	check_evportop(evpd);
 
-	if (evpd->ed_nevents < fd) {
+	if (fd >= evpd->ed_nevents) {
 		return (-1);
 	}
 
-	for (i = 0; i < EVENTS_PER_GETN; ++i) {
-		if (evpd->ed_pending[i] == fd) {
-			associated = 0;
-			break;
-		}
-	}
-
 	fdi = &evpd->ed_fds[fd];
 	if (events & EV_READ)
 		fdi->fdi_what &= ~EV_READ;
 	if (events & EV_WRITE)
 		fdi->fdi_what &= ~EV_WRITE;
 
-	if (associated) {
-		if (!FDI_HAS_EVENTS(fdi) &&
-		    port_dissociate(evpd->ed_port, PORT_SOURCE_FD, fd) == -1) {
-			/*
-			 * Ignre EBADFD error the fd could have been closed
-			 * before event_del() was called.
-			 */
-			if (errno != EBADFD) {
-				event_warn("port_dissociate");
-				return (-1);
-			}
-		} else {
-			if (FDI_HAS_EVENTS(fdi)) {
-				return (reassociate(evpd, fdi, fd));
-			}
+	/*
+	 * If it fired, the port has already dissociated it, and the next
+	 * dispatch will associate it again only if it has events left.
+	 */
+	if (fdi->fdi_fired)
+		return (0);
+
+	if (!FDI_HAS_EVENTS(fdi) &&
+	    port_dissociate(evpd->ed_port, PORT_SOURCE_FD, fd) == -1) {
+		/*
+		 * Ignre EBADFD error the fd could have been closed
+		 * before event_del() was called.
+		 */
+		if (errno != EBADFD) {
+			event_warn("port_dissociate");
+			return (-1);
 		}
 	} else {
-		if ((fdi->fdi_what & (EV_READ|EV_WRITE)) == 0) {
-			evpd->ed_pending[i] = -1;
+		if (FDI_HAS_EVENTS(fdi)) {
+			return (reassociate(evpd, fdi, fd));
 		}
 	}
 	return 0;
@@ -455,5 +505,9 @@ evport_dealloc(struct event_base *base)
 
 	if (evpd->ed_fds)
 		mm_free(evpd->ed_fds);
+	if (evpd->ed_pevtlist)
+		mm_free(evpd->ed_pevtlist);
+	if (evpd->ed_pending)
+		mm_free(evpd->ed_pending);
 	mm_free(evpd);
 }
@@ -28,12 +28,56 @@
 #define _EVRPC_INTERNAL_H_
 
 #include "http-internal.h"
+#include "defer-internal.h"
 
 struct evrpc;
 struct evrpc_request_wrapper;
+struct bufferevent;
 
 #define EVRPC_URI_PREFIX "/.rpc."
 
+/*
+ * Framed rpcs skip HTTP: each request and reply is a single tagged
+ * frame on a bufferevent, whose payload holds the fields below.  The
+ * id lets replies come back in any order.
+ */
+#define EVRPC_FRAME_REQUEST	1	/* id, name, data */
+#define EVRPC_FRAME_REPLY	2	/* id, status, data */
+
+#define EVRPC_FRAME_ID		1
+#define EVRPC_FRAME_NAME	2
+#define EVRPC_FRAME_STATUS	3	/* 0 on success */
+#define EVRPC_FRAME_DATA	4
+
+/* we refuse frames larger than this and drop the connection */
+#define EVRPC_FRAME_MAX		(16*1024*1024)
+
+/*
+ * A batch is an rpc of its own under a name that no rpc declared with
+ * EVRPC_HEADER can have.  Its request holds a name and a data field for
+ * each call; its reply holds a status and a data field for each call,
+ * in the same order.  The fields use the frame tags above.
+ */
+#define EVRPC_BATCH_NAME	".batch"
+
+/* one call of a batch that a base received */
+struct evrpc_batch_call {
+	char *name;
+
+	/* the marshaled request, and then the marshaled reply */
+	struct evbuffer *data;
+	ev_uint32_t status;
+};
+
+/* the request, and also the reply, of a batch that a base received */
+struct evrpc_batch_msg {
+	struct evrpc_batch_call *calls;
+	int n_calls;
+
+	/* the number of calls that have not been answered yet */
+	int n_pending;
+};
+
 struct evrpc_hook {
 	TAILQ_ENTRY(evrpc_hook) (next);
 
@@ -68,6 +112,46 @@ struct _evrpc_hooks {
 #define output_hooks common.out_hooks
 #define paused_requests common.pause_requests
 
+TAILQ_HEAD(evrpc_requestq, evrpc_request_wrapper);
+
+/* a bufferevent that carries framed rpcs for a base or a pool */
+struct evrpc_frame_conn {
+	TAILQ_ENTRY(evrpc_frame_conn) next;
+
+	/* NULL once the connection has been closed */
+	struct bufferevent *bev;
+
+	/* exactly one of these is set, depending on which side we are */
+	struct evrpc_base *base;
+	struct evrpc_pool *pool;
+
+	/* the id for the next request that we send */
+	ev_uint32_t next_id;
+
+	/* requests that we sent, or are about to send, on this connection */
+	struct evrpc_requestq requests;
+
+	/* the number of requests not yet answered */
+	int n_pending;
+};
+
+TAILQ_HEAD(evrpc_frame_connq, evrpc_frame_conn);
+
+struct evrpc_req_generic;
+TAILQ_HEAD(evrpc_reqstateq, evrpc_req_generic);
+
+/* an event base on which the callbacks of offloaded rpcs run */
+struct evrpc_worker {
+	struct event_base *base;
+
+	/* requests handed to this base that it hasn't picked up yet */
+	struct evrpc_reqstateq pending;
+	void *lock;
+
+	/* made active to pick up pending requests in this base's thread */
+	struct event pickup_ev;
+};
+
 struct evrpc_base {
 	struct _evrpc_hooks common;
 
@@ -76,6 +160,14 @@ struct evrpc_base {
 
 	/* a list of all RPCs registered with us */
 	TAILQ_HEAD(evrpc_list, evrpc) registered_rpcs;
+
+	/* bufferevents on which we receive framed rpcs */
+	struct evrpc_frame_connq frame_connections;
+
+	/* worker bases for offloaded rpcs, which get them in turn */
+	struct evrpc_worker **workers;
+	int n_workers;
+	int next_worker;
 };
 
 struct evrpc_req_generic;
@@ -89,9 +181,19 @@ struct evrpc_pool {
 
 	struct evconq connections;
 
+	/* bufferevents over which we can send framed rpcs */
+	struct evrpc_frame_connq frame_connections;
+
 	int timeout;
 
-	TAILQ_HEAD(evrpc_requestq, evrpc_request_wrapper) (requests);
+	/* the most requests to have outstanding on one connection */
+	int max_pending;
+
+	/* requests waiting for a connection */
+	struct evrpc_requestq requests;
+
+	/* requests handed to one of the evhttp connections */
+	struct evrpc_requestq outstanding;
 };
 
 struct evrpc_hook_ctx {
@@ -157,6 +259,25 @@ struct evrpc_req_generic {
 	 * Temporary data store for marshaled data
 	 */
 	struct evbuffer* rpc_data;
+
+	/*
+	 * for framed rpcs, the connection and id on which we need to
+	 * answer and the marshaled request.
+	 */
+	struct evrpc_frame_conn *frame_conn;
+	ev_uint32_t frame_id;
+	struct evbuffer *frame_input;
+
+	/* for a call that arrived in a batch, the state of the batch and
+	 * which of its calls we are; such calls skip the hooks */
+	struct evrpc_req_generic *batch;
+	int batch_index;
+
+	/* for an offloaded rpc, the base that it came in on, which sends
+	 * the reply once the worker has marshaled it */
+	struct event_base *home_base;
+	struct deferred_cb deferred;
+	TAILQ_ENTRY(evrpc_req_generic) next;
 };
 
 /* the client side of an rpc request */
@@ -199,6 +320,30 @@ struct evrpc_request_wrapper {
 
 	/* marshals the reply into a buffer */
 	int (*reply_unmarshal)(void *, struct evbuffer*);
+
+	/* for framed rpcs: the connection on which the request is being
+	 * sent, and our id for it there */
+	struct evrpc_frame_conn *frame_conn;
+	ev_uint32_t frame_id;
+	int frame_sent;
+
+	/* the marshaled request until it has been sent, then the marshaled
+	 * reply along with the status that the server sent with it */
+	struct evbuffer *frame_data;
+	ev_uint32_t frame_status;
+
+	/* set on the request that carries a batch; the request owns it */
+	struct evrpc_batch *batch;
+};
+
+/* calls that a client packs into a single request */
+struct evrpc_batch {
+	struct evrpc_pool *pool;
+
+	/* the calls in the order that they were added; they are never
+	 * queued on the pool, but get their replies from the batch */
+	struct evrpc_requestq calls;
+	int n_calls;
 };
 
 #endif /* _EVRPC_INTERNAL_H_ */
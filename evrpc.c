@@ -63,17 +63,35 @@
 #include "evrpc-internal.h"
 #include "event2/http.h"
 #include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_struct.h"
 #include "event2/tag.h"
 #include "event2/http_struct.h"
 #include "event2/http_compat.h"
 #include "event2/util.h"
+#include "event2/thread.h"
 #include "util-internal.h"
+#include "evthread-internal.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 
+static struct evrpc *evrpc_register_object(const char *name,
+    void *(*req_new)(void), void (*req_free)(void *),
+    int (*req_unmarshal)(void *, struct evbuffer *),
+    void *(*rpl_new)(void), void (*rpl_free)(void *),
+    int (*rpl_complete)(void *),
+    void (*rpl_marshal)(struct evbuffer *, void *));
+static void *evrpc_batch_msg_new(void);
+static void evrpc_batch_msg_free(void *);
+static int evrpc_batch_request_unmarshal(void *, struct evbuffer *);
+static int evrpc_batch_reply_complete(void *);
+static void evrpc_batch_reply_marshal(struct evbuffer *, void *);
+static void evrpc_batch_dispatch(struct evrpc_req_generic *, void *);
+
 struct evrpc_base *
 evrpc_init(struct evhttp *http_server)
 {
+	struct evrpc *rpc;
 	struct evrpc_base* base = mm_calloc(1, sizeof(struct evrpc_base));
 	if (base == NULL)
 		return (NULL);
@@ -87,20 +105,43 @@ evrpc_init(struct evhttp *http_server)
 
 	TAILQ_INIT(&base->paused_requests);
 
+	TAILQ_INIT(&base->frame_connections);
+
 	base->http_server = http_server;
 
+	/* every base answers batches of its rpcs */
+	rpc = evrpc_register_object(EVRPC_BATCH_NAME,
+	    evrpc_batch_msg_new, evrpc_batch_msg_free,
+	    evrpc_batch_request_unmarshal,
+	    evrpc_batch_msg_new, evrpc_batch_msg_free,
+	    evrpc_batch_reply_complete, evrpc_batch_reply_marshal);
+	if (rpc == NULL) {
+		mm_free(base);
+		return (NULL);
+	}
+	evrpc_register_rpc(base, rpc, evrpc_batch_dispatch, NULL);
+
 	return (base);
 }
 
+static void evrpc_frame_conn_close(struct evrpc_frame_conn *conn);
+static void evrpc_worker_free(struct evrpc_worker *worker);
+
 void
 evrpc_free(struct evrpc_base *base)
 {
 	struct evrpc *rpc;
 	struct evrpc_hook *hook;
 	struct evrpc_hook_ctx *pause;
+	struct evrpc_frame_conn *conn;
+	int i, r;
 
+	while ((conn = TAILQ_FIRST(&base->frame_connections)) != NULL) {
+		evrpc_frame_conn_close(conn);
+	}
 	while ((rpc = TAILQ_FIRST(&base->registered_rpcs)) != NULL) {
-		assert(evrpc_unregister_rpc(base, rpc->uri));
+		r = evrpc_unregister_rpc(base, rpc->uri);
+		assert(r == 0);
 	}
 	while ((pause = TAILQ_FIRST(&base->paused_requests)) != NULL) {
 		TAILQ_REMOVE(&base->paused_requests, pause, next);
@@ -112,6 +153,10 @@ evrpc_free(struct evrpc_base *base)
 	while ((hook = TAILQ_FIRST(&base->output_hooks)) != NULL) {
 		assert(evrpc_remove_hook(base, EVRPC_OUTPUT, hook));
 	}
+	for (i = 0; i < base->n_workers; ++i)
+		evrpc_worker_free(base->workers[i]);
+	if (base->workers != NULL)
+		mm_free(base->workers);
 	mm_free(base);
 }
 
@@ -199,6 +244,9 @@ evrpc_process_hooks(struct evrpc_hook_list *head, void *ctx,
 
 static void evrpc_pool_schedule(struct evrpc_pool *pool);
 static void evrpc_request_cb(struct evhttp_request *, void *);
+static int evrpc_frame_send(struct evrpc_frame_conn *conn, ev_uint32_t type,
+    ev_uint32_t id, const char *name, ev_uint32_t status,
+    struct evbuffer *data);
 
 /*
  * Registers a new RPC with the HTTP server.   The evrpc object is expected
@@ -235,10 +283,11 @@ evrpc_register_rpc(struct evrpc_base *base, struct evrpc *rpc,
 
 	TAILQ_INSERT_TAIL(&base->registered_rpcs, rpc, next);
 
-	evhttp_set_cb(base->http_server,
-	    constructed_uri,
-	    evrpc_request_cb,
-	    rpc);
+	if (base->http_server != NULL)
+		evhttp_set_cb(base->http_server,
+		    constructed_uri,
+		    evrpc_request_cb,
+		    rpc);
 
 	mm_free(constructed_uri);
 
@@ -262,13 +311,15 @@ evrpc_unregister_rpc(struct evrpc_base *base, const char *name)
 	}
 	TAILQ_REMOVE(&base->registered_rpcs, rpc, next);
 
+	/* name may be the uri that we are about to free */
+	registered_uri = evrpc_construct_uri(name);
+
 	mm_free((char *)rpc->uri);
 	mm_free(rpc);
 
-        registered_uri = evrpc_construct_uri(name);
-
 	/* remove the http server callback */
-	assert(evhttp_del_cb(base->http_server, registered_uri) == 0);
+	if (base->http_server != NULL)
+		assert(evhttp_del_cb(base->http_server, registered_uri) == 0);
 
 	mm_free(registered_uri);
 	return (0);
@@ -276,8 +327,37 @@ evrpc_unregister_rpc(struct evrpc_base *base, const char *name)
 
 static int evrpc_pause_request(void *vbase, void *ctx,
     void (*cb)(void *, enum EVRPC_HOOK_RESULT));
+static void evrpc_request_start(struct evrpc_req_generic *);
 static void evrpc_request_cb_closure(void *, enum EVRPC_HOOK_RESULT);
 
+/* returns the buffer that holds the marshaled request */
+static struct evbuffer *
+evrpc_reqstate_input(struct evrpc_req_generic *rpc_state)
+{
+	return (rpc_state->frame_input != NULL ?
+	    rpc_state->frame_input : rpc_state->http_req->input_buffer);
+}
+
+static void evrpc_batch_call_done(struct evrpc_req_generic *, ev_uint32_t);
+
+/* tells the client that its rpc failed and frees the request state */
+static void
+evrpc_reqstate_fail(struct evrpc_req_generic *rpc_state)
+{
+	struct evhttp_request *req = rpc_state->http_req;
+
+	if (rpc_state->batch != NULL) {
+		evrpc_batch_call_done(rpc_state, 1);
+		return;
+	}
+	if (req == NULL)
+		evrpc_frame_send(rpc_state->frame_conn, EVRPC_FRAME_REPLY,
+		    rpc_state->frame_id, NULL, 1, NULL);
+	evrpc_reqstate_free(rpc_state);
+	if (req != NULL)
+		evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+}
+
 static void
 evrpc_request_cb(struct evhttp_request *req, void *arg)
 {
@@ -296,16 +376,32 @@ evrpc_request_cb(struct evhttp_request *req, void *arg)
 	rpc_state->http_req = req;
 	rpc_state->rpc_data = NULL;
 
+	evrpc_request_start(rpc_state);
+	return;
+
+error:
+	evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+	return;
+}
+
+/* runs the input hooks on a newly received request */
+static void
+evrpc_request_start(struct evrpc_req_generic *rpc_state)
+{
+	struct evrpc *rpc = rpc_state->rpc;
+	struct evhttp_request *req = rpc_state->http_req;
+
 	if (TAILQ_FIRST(&rpc->base->input_hooks) != NULL) {
 		int hook_res;
 
-		evrpc_hook_associate_meta(&rpc_state->hook_meta, req->evcon);
+		evrpc_hook_associate_meta(&rpc_state->hook_meta,
+		    req != NULL ? req->evcon : NULL);
 
 		/*
 		 * allow hooks to modify the outgoing request
 		 */
 		hook_res = evrpc_process_hooks(&rpc->base->input_hooks,
-		    rpc_state, req, req->input_buffer);
+		    rpc_state, req, evrpc_reqstate_input(rpc_state));
 		switch (hook_res) {
 		case EVRPC_TERMINATE:
 			goto error;
@@ -326,18 +422,78 @@ evrpc_request_cb(struct evhttp_request *req, void *arg)
 	return;
 
 error:
-	if (rpc_state != NULL)
-		evrpc_reqstate_free(rpc_state);
-	evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+	evrpc_reqstate_fail(rpc_state);
 	return;
 }
 
+/* returns the base that the request came in on, or NULL if it is gone */
+static struct event_base *
+evrpc_reqstate_base(struct evrpc_req_generic *rpc_state)
+{
+	if (rpc_state->batch != NULL)
+		rpc_state = rpc_state->batch;
+	if (rpc_state->http_req != NULL)
+		return (rpc_state->http_req->evcon->base);
+	if (rpc_state->frame_conn->bev != NULL)
+		return (rpc_state->frame_conn->bev->ev_base);
+	return (NULL);
+}
+
+static void evrpc_request_done_deferred(struct deferred_cb *, void *);
+
+/* runs the callbacks of the requests that were handed to a worker */
+static void
+evrpc_worker_pickup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evrpc_worker *worker = arg;
+	struct evrpc_reqstateq pending;
+	struct evrpc_req_generic *rpc_state;
+
+	TAILQ_INIT(&pending);
+	EVLOCK_LOCK(worker->lock, 0);
+	while ((rpc_state = TAILQ_FIRST(&worker->pending)) != NULL) {
+		TAILQ_REMOVE(&worker->pending, rpc_state, next);
+		TAILQ_INSERT_TAIL(&pending, rpc_state, next);
+	}
+	EVLOCK_UNLOCK(worker->lock, 0);
+
+	while ((rpc_state = TAILQ_FIRST(&pending)) != NULL) {
+		TAILQ_REMOVE(&pending, rpc_state, next);
+		rpc_state->rpc->cb(rpc_state, rpc_state->rpc->cb_arg);
+	}
+}
+
+/* gives the rpc to the user, on the next worker base if it is offloaded */
+static void
+evrpc_run_cb(struct evrpc_req_generic *rpc_state)
+{
+	struct evrpc *rpc = rpc_state->rpc;
+	struct evrpc_base *base = rpc->base;
+	struct evrpc_worker *worker;
+
+	if (!rpc->offload || base->n_workers == 0 ||
+	    (rpc_state->home_base = evrpc_reqstate_base(rpc_state)) == NULL) {
+		rpc->cb(rpc_state, rpc->cb_arg);
+		return;
+	}
+
+	event_deferred_cb_init(&rpc_state->deferred,
+	    evrpc_request_done_deferred, rpc_state);
+
+	worker = base->workers[base->next_worker];
+	base->next_worker = (base->next_worker + 1) % base->n_workers;
+
+	EVLOCK_LOCK(worker->lock, 0);
+	TAILQ_INSERT_TAIL(&worker->pending, rpc_state, next);
+	EVLOCK_UNLOCK(worker->lock, 0);
+	event_active(&worker->pickup_ev, EV_READ, 1);
+}
+
 static void
 evrpc_request_cb_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 {
 	struct evrpc_req_generic *rpc_state = arg;
 	struct evrpc *rpc = rpc_state->rpc;
-	struct evhttp_request *req = rpc_state->http_req;
 
 	if (hook_res == EVRPC_TERMINATE)
 		goto error;
@@ -348,7 +504,7 @@ evrpc_request_cb_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 		goto error;
 
 	if (rpc->request_unmarshal(
-		    rpc_state->request, req->input_buffer) == -1) {
+		    rpc_state->request, evrpc_reqstate_input(rpc_state)) == -1) {
 		/* we failed to parse the request; that's a bummer */
 		goto error;
 	}
@@ -360,14 +516,12 @@ evrpc_request_cb_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 		goto error;
 
 	/* give the rpc to the user; they can deal with it */
-	rpc->cb(rpc_state, rpc->cb_arg);
+	evrpc_run_cb(rpc_state);
 
 	return;
 
 error:
-	if (rpc_state != NULL)
-		evrpc_reqstate_free(rpc_state);
-	evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+	evrpc_reqstate_fail(rpc_state);
 	return;
 }
 
@@ -388,35 +542,81 @@ evrpc_reqstate_free(struct evrpc_req_generic* rpc_state)
 		rpc->reply_free(rpc_state->reply);
 	if (rpc_state->rpc_data != NULL)
 		evbuffer_free(rpc_state->rpc_data);
+	if (rpc_state->frame_input != NULL)
+		evbuffer_free(rpc_state->frame_input);
+	if (rpc_state->frame_conn != NULL) {
+		struct evrpc_frame_conn *conn = rpc_state->frame_conn;
+		/* a closed connection waits for its last request to go */
+		if (--conn->n_pending == 0 && conn->bev == NULL)
+			mm_free(conn);
+	}
 	mm_free(rpc_state);
 }
 
 static void
 evrpc_request_done_closure(void *, enum EVRPC_HOOK_RESULT);
 
+static void evrpc_request_reply(struct evrpc_req_generic *);
+
 void
 evrpc_request_done(struct evrpc_req_generic *rpc_state)
 {
-	struct evhttp_request *req = rpc_state->http_req;
 	struct evrpc *rpc = rpc_state->rpc;
 
+	/* on error, we leave rpc_data NULL */
 	if (rpc->reply_complete(rpc_state->reply) == -1) {
 		/* the reply was not completely filled in.  error out */
-		goto error;
+		goto done;
 	}
 
 	if ((rpc_state->rpc_data = evbuffer_new()) == NULL) {
 		/* out of memory */
-		goto error;
+		goto done;
 	}
 
 	/* serialize the reply */
 	rpc->reply_marshal(rpc_state->rpc_data, rpc_state->reply);
 
-	if (TAILQ_FIRST(&rpc->base->output_hooks) != NULL) {
+done:
+	/* a worker leaves the hooks and the sending to the home base */
+	if (rpc_state->home_base != NULL) {
+		event_deferred_cb_schedule(rpc_state->home_base,
+		    &rpc_state->deferred);
+		return;
+	}
+
+	if (rpc_state->rpc_data == NULL)
+		evrpc_reqstate_fail(rpc_state);
+	else
+		evrpc_request_reply(rpc_state);
+}
+
+static void
+evrpc_request_done_deferred(struct deferred_cb *cb, void *arg)
+{
+	struct evrpc_req_generic *rpc_state = arg;
+
+	rpc_state->home_base = NULL;
+	if (rpc_state->rpc_data == NULL)
+		evrpc_reqstate_fail(rpc_state);
+	else
+		evrpc_request_reply(rpc_state);
+}
+
+/* runs the output hooks on the marshaled reply and sends it */
+static void
+evrpc_request_reply(struct evrpc_req_generic *rpc_state)
+{
+	struct evhttp_request *req = rpc_state->http_req;
+	struct evrpc *rpc = rpc_state->rpc;
+
+	/* the hooks see the reply to a batch as a whole */
+	if (rpc_state->batch == NULL &&
+	    TAILQ_FIRST(&rpc->base->output_hooks) != NULL) {
 		int hook_res;
 
-		evrpc_hook_associate_meta(&rpc_state->hook_meta, req->evcon);
+		evrpc_hook_associate_meta(&rpc_state->hook_meta,
+		    req != NULL ? req->evcon : NULL);
 
 		/* do hook based tweaks to the request */
 		hook_res = evrpc_process_hooks(&rpc->base->output_hooks,
@@ -442,9 +642,7 @@ evrpc_request_done(struct evrpc_req_generic *rpc_state)
 	return;
 
 error:
-	if (rpc_state != NULL)
-		evrpc_reqstate_free(rpc_state);
-	evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+	evrpc_reqstate_fail(rpc_state);
 	return;
 }
 
@@ -457,6 +655,18 @@ evrpc_request_done_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 	if (hook_res == EVRPC_TERMINATE)
 		goto error;
 
+	if (rpc_state->batch != NULL) {
+		evrpc_batch_call_done(rpc_state, 0);
+		return;
+	}
+
+	if (req == NULL) {
+		evrpc_frame_send(rpc_state->frame_conn, EVRPC_FRAME_REPLY,
+		    rpc_state->frame_id, NULL, 0, rpc_state->rpc_data);
+		evrpc_reqstate_free(rpc_state);
+		return;
+	}
+
 	/* on success, we are going to transmit marshaled binary data */
 	if (evhttp_find_header(req->output_headers, "Content-Type") == NULL) {
 		evhttp_add_header(req->output_headers,
@@ -469,12 +679,183 @@ evrpc_request_done_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 	return;
 
 error:
-	if (rpc_state != NULL)
-		evrpc_reqstate_free(rpc_state);
-	evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Error");
+	evrpc_reqstate_fail(rpc_state);
+	return;
+}
+
+/*
+ * Batches on the server: the batch goes through the hooks like any other
+ * rpc, and then each of its calls goes straight to its registered rpc.
+ * The batch is answered once all of them have been.
+ */
+
+static void *
+evrpc_batch_msg_new(void)
+{
+	return (mm_calloc(1, sizeof(struct evrpc_batch_msg)));
+}
+
+static void
+evrpc_batch_msg_free(void *arg)
+{
+	struct evrpc_batch_msg *msg = arg;
+	int i;
+
+	for (i = 0; i < msg->n_calls; ++i) {
+		if (msg->calls[i].name != NULL)
+			mm_free(msg->calls[i].name);
+		if (msg->calls[i].data != NULL)
+			evbuffer_free(msg->calls[i].data);
+	}
+	if (msg->calls != NULL)
+		mm_free(msg->calls);
+	mm_free(msg);
+}
+
+static int
+evrpc_batch_request_unmarshal(void *arg, struct evbuffer *evbuf)
+{
+	struct evrpc_batch_msg *msg = arg;
+	struct evrpc_batch_call *call;
+	int n_alloc = 0;
+	ev_uint32_t tag;
+
+	while (evbuffer_get_length(evbuf) > 0) {
+		if (msg->n_calls == n_alloc) {
+			int n = n_alloc ? n_alloc * 2 : 8;
+			struct evrpc_batch_call *calls = mm_realloc(msg->calls,
+			    n * sizeof(struct evrpc_batch_call));
+			if (calls == NULL)
+				return (-1);
+			msg->calls = calls;
+			n_alloc = n;
+		}
+
+		call = &msg->calls[msg->n_calls++];
+		memset(call, 0, sizeof(*call));
+		if (evtag_unmarshal_string(evbuf, EVRPC_FRAME_NAME,
+			&call->name) == -1 ||
+		    (call->data = evbuffer_new()) == NULL ||
+		    evtag_unmarshal(evbuf, &tag, call->data) == -1 ||
+		    tag != EVRPC_FRAME_DATA)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static int
+evrpc_batch_reply_complete(void *arg)
+{
+	struct evrpc_batch_msg *msg = arg;
+	return (msg->n_pending == 0 ? 0 : -1);
+}
+
+static void
+evrpc_batch_reply_marshal(struct evbuffer *evbuf, void *arg)
+{
+	struct evrpc_batch_msg *msg = arg;
+	int i;
+
+	for (i = 0; i < msg->n_calls; ++i) {
+		struct evrpc_batch_call *call = &msg->calls[i];
+		evtag_marshal_int(evbuf, EVRPC_FRAME_STATUS, call->status);
+		if (call->data != NULL)
+			evtag_marshal_buffer(evbuf, EVRPC_FRAME_DATA,
+			    call->data);
+		else
+			evtag_marshal(evbuf, EVRPC_FRAME_DATA, NULL, 0);
+	}
+}
+
+/* one more call of the batch has been answered */
+static void
+evrpc_batch_call_finished(struct evrpc_req_generic *batch_state)
+{
+	struct evrpc_batch_msg *reply = batch_state->reply;
+
+	if (--reply->n_pending == 0)
+		evrpc_request_done(batch_state);
+}
+
+/* records the answer to one call of a batch and frees its state */
+static void
+evrpc_batch_call_done(struct evrpc_req_generic *rpc_state,
+    ev_uint32_t status)
+{
+	struct evrpc_req_generic *batch_state = rpc_state->batch;
+	struct evrpc_batch_msg *reply = batch_state->reply;
+	struct evrpc_batch_call *call = &reply->calls[rpc_state->batch_index];
+
+	call->status = status;
+	if (status == 0) {
+		call->data = rpc_state->rpc_data;
+		rpc_state->rpc_data = NULL;
+	}
+	evrpc_reqstate_free(rpc_state);
+
+	evrpc_batch_call_finished(batch_state);
+}
+
+/* hands call i of a batch to its rpc */
+static void
+evrpc_batch_call_start(struct evrpc_req_generic *batch_state, int i)
+{
+	struct evrpc_batch_msg *request = batch_state->request;
+	struct evrpc_batch_msg *reply = batch_state->reply;
+	struct evrpc_batch_call *call = &request->calls[i];
+	struct evrpc_req_generic *rpc_state = NULL;
+	struct evrpc *rpc;
+
+	/* find the right rpc; batches do not nest */
+	TAILQ_FOREACH(rpc, &batch_state->rpc->base->registered_rpcs, next) {
+		if (strcmp(rpc->uri, call->name) == 0)
+			break;
+	}
+	if (rpc == NULL || rpc->cb == evrpc_batch_dispatch ||
+	    evbuffer_get_length(call->data) <= 0)
+		goto error;
+
+	rpc_state = mm_calloc(1, sizeof(struct evrpc_req_generic));
+	if (rpc_state == NULL)
+		goto error;
+	rpc_state->rpc = rpc;
+	/* the rpc may look at the headers of the batch, but not answer it */
+	rpc_state->http_req = batch_state->http_req;
+	rpc_state->frame_input = call->data;
+	call->data = NULL;
+	rpc_state->batch = batch_state;
+	rpc_state->batch_index = i;
+
+	evrpc_request_cb_closure(rpc_state, EVRPC_CONTINUE);
 	return;
+
+error:
+	reply->calls[i].status = 1;
+	evrpc_batch_call_finished(batch_state);
 }
 
+static void
+evrpc_batch_dispatch(struct evrpc_req_generic *batch_state, void *arg)
+{
+	struct evrpc_batch_msg *request = batch_state->request;
+	struct evrpc_batch_msg *reply = batch_state->reply;
+	int i;
+
+	reply->calls = mm_calloc(request->n_calls,
+	    sizeof(struct evrpc_batch_call));
+	if (reply->calls == NULL) {
+		evrpc_reqstate_fail(batch_state);
+		return;
+	}
+	reply->n_calls = request->n_calls;
+
+	/* the calls may be answered before we have started all of them */
+	reply->n_pending = request->n_calls + 1;
+	for (i = 0; i < request->n_calls; ++i)
+		evrpc_batch_call_start(batch_state, i);
+	evrpc_batch_call_finished(batch_state);
+}
 
 /* Client implementation of RPC site */
 
@@ -489,7 +870,9 @@ evrpc_pool_new(struct event_base *base)
 		return (NULL);
 
 	TAILQ_INIT(&pool->connections);
+	TAILQ_INIT(&pool->frame_connections);
 	TAILQ_INIT(&pool->requests);
+	TAILQ_INIT(&pool->outstanding);
 
 	TAILQ_INIT(&pool->paused_requests);
 
@@ -505,8 +888,14 @@ evrpc_pool_new(struct event_base *base)
 static void
 evrpc_request_wrapper_free(struct evrpc_request_wrapper *request)
 {
+	if (request->batch != NULL)
+		evrpc_batch_free(request->batch);
 	if (request->hook_meta != NULL)
 		evrpc_hook_context_free(request->hook_meta);
+	if (request->frame_data != NULL)
+		evbuffer_free(request->frame_data);
+	if (request->evcon != NULL)
+		TAILQ_REMOVE(&request->pool->outstanding, request, next);
 	mm_free(request->name);
 	mm_free(request);
 }
@@ -515,6 +904,7 @@ void
 evrpc_pool_free(struct evrpc_pool *pool)
 {
 	struct evhttp_connection *connection;
+	struct evrpc_frame_conn *conn;
 	struct evrpc_request_wrapper *request;
 	struct evrpc_hook_ctx *pause;
 	struct evrpc_hook *hook;
@@ -534,6 +924,23 @@ evrpc_pool_free(struct evrpc_pool *pool)
 		evhttp_connection_free(connection);
 	}
 
+	/* the connections dropped their requests without telling us */
+	while ((request = TAILQ_FIRST(&pool->outstanding)) != NULL) {
+		event_del(&request->ev_timeout);
+		evrpc_request_wrapper_free(request);
+	}
+
+	while ((conn = TAILQ_FIRST(&pool->frame_connections)) != NULL) {
+		while ((request = TAILQ_FIRST(&conn->requests)) != NULL) {
+			TAILQ_REMOVE(&conn->requests, request, next);
+			event_del(&request->ev_timeout);
+			evrpc_request_wrapper_free(request);
+		}
+		TAILQ_REMOVE(&pool->frame_connections, conn, next);
+		bufferevent_free(conn->bev);
+		mm_free(conn);
+	}
+
 	while ((hook = TAILQ_FIRST(&pool->input_hooks)) != NULL) {
 		assert(evrpc_remove_hook(pool, EVRPC_INPUT, hook));
 	}
@@ -575,12 +982,7 @@ evrpc_pool_add_connection(struct evrpc_pool *pool,
 	 * connections.
 	 */
 
-	if (TAILQ_FIRST(&pool->requests) != NULL) {
-		struct evrpc_request_wrapper *request =
-		    TAILQ_FIRST(&pool->requests);
-		TAILQ_REMOVE(&pool->requests, request, next);
-		evrpc_schedule_request(connection, request);
-	}
+	evrpc_pool_schedule(pool);
 }
 
 void
@@ -604,20 +1006,72 @@ evrpc_pool_set_timeout(struct evrpc_pool *pool, int timeout_in_secs)
 static void evrpc_reply_done(struct evhttp_request *, void *);
 static void evrpc_request_timeout(evutil_socket_t, short, void *);
 
+void
+evrpc_pool_set_max_pending(struct evrpc_pool *pool, int max_pending)
+{
+	pool->max_pending = max_pending;
+
+	/* there may be room for more requests now */
+	evrpc_pool_schedule(pool);
+}
+
+/* returns the number of requests that connection is working on */
+static int
+evrpc_pool_count_pending(struct evrpc_pool *pool,
+    struct evhttp_connection *connection)
+{
+	struct evrpc_request_wrapper *ctx;
+	int n = 0;
+	TAILQ_FOREACH(ctx, &pool->outstanding, next) {
+		if (ctx->evcon == connection)
+			++n;
+	}
+
+	return (n);
+}
+
 /*
- * Finds a connection object associated with the pool that is currently
- * idle and can be used to make a request.
+ * Finds the connection associated with the pool that has the fewest
+ * outstanding requests and room for another one, preferring the first
+ * one on a tie.  Sets either *pevcon or *pconn, depending on its kind;
+ * returns -1 if every connection is full.
  */
-static struct evhttp_connection *
-evrpc_pool_find_connection(struct evrpc_pool *pool)
+static int
+evrpc_pool_find_connection(struct evrpc_pool *pool,
+    struct evhttp_connection **pevcon, struct evrpc_frame_conn **pconn)
 {
 	struct evhttp_connection *connection;
+	struct evrpc_frame_conn *conn;
+	int max_pending = pool->max_pending;
+	int best = -1, n;
+
+	*pevcon = NULL;
+	*pconn = NULL;
+
+	/* by default, an http connection makes one request at a time */
 	TAILQ_FOREACH(connection, &pool->connections, next) {
-		if (TAILQ_FIRST(&connection->requests) == NULL)
-			return (connection);
+		n = evrpc_pool_count_pending(pool, connection);
+		if (n >= (max_pending > 0 ? max_pending : 1))
+			continue;
+		if (best == -1 || n < best) {
+			best = n;
+			*pevcon = connection;
+		}
 	}
 
-	return (NULL);
+	/* and a bufferevent makes as many as we like */
+	TAILQ_FOREACH(conn, &pool->frame_connections, next) {
+		n = conn->n_pending;
+		if (max_pending > 0 && n >= max_pending)
+			continue;
+		if (best == -1 || n < best) {
+			best = n;
+			*pevcon = NULL;
+			*pconn = conn;
+		}
+	}
+
+	return (best == -1 ? -1 : 0);
 }
 
 /*
@@ -625,6 +1079,7 @@ evrpc_pool_find_connection(struct evrpc_pool *pool)
  */
 
 static void evrpc_schedule_request_closure(void *ctx, enum EVRPC_HOOK_RESULT);
+static void evrpc_schedule_frame_closure(void *ctx, enum EVRPC_HOOK_RESULT);
 
 /*
  * We assume that the ctx is no longer queued on the pool.
@@ -645,6 +1100,7 @@ evrpc_schedule_request(struct evhttp_connection *connection,
 
 	/* we need to know the connection that we might have to abort */
 	ctx->evcon = connection;
+	TAILQ_INSERT_TAIL(&pool->outstanding, ctx, next);
 
 	/* if we get paused we also need to know the request */
 	ctx->req = req;
@@ -732,61 +1188,177 @@ error:
 	evrpc_request_wrapper_free(ctx);
 }
 
-/* we just queue the paused request on the pool under the req object */
-static int
-evrpc_pause_request(void *vbase, void *ctx,
-    void (*cb)(void *, enum EVRPC_HOOK_RESULT))
+/* removes a framed request from the connection that it was sent on */
+static void
+evrpc_frame_request_unlink(struct evrpc_request_wrapper *ctx)
 {
-	struct _evrpc_hooks *base = vbase;
-	struct evrpc_hook_ctx *pause = mm_malloc(sizeof(*pause));
-	if (pause == NULL)
-		return (-1);
-
-	pause->ctx = ctx;
-	pause->cb = cb;
-
-	TAILQ_INSERT_TAIL(&base->pause_requests, pause, next);
-	return (0);
+	struct evrpc_frame_conn *conn = ctx->frame_conn;
+	if (conn == NULL)
+		return;
+	TAILQ_REMOVE(&conn->requests, ctx, next);
+	--conn->n_pending;
+	ctx->frame_conn = NULL;
 }
 
-int
-evrpc_resume_request(void *vbase, void *ctx, enum EVRPC_HOOK_RESULT res)
+/*
+ * Like evrpc_schedule_request(), but for a bufferevent that carries
+ * framed rpcs.  The output hooks see a NULL evhttp_request.
+ */
+static int
+evrpc_schedule_frame_request(struct evrpc_frame_conn *conn,
+    struct evrpc_request_wrapper *ctx)
 {
-	struct _evrpc_hooks *base = vbase;
-	struct evrpc_pause_list *head = &base->pause_requests;
-	struct evrpc_hook_ctx *pause;
-
-	TAILQ_FOREACH(pause, head, next) {
-		if (pause->ctx == ctx)
-			break;
-	}
+	struct evrpc_pool *pool = ctx->pool;
+	struct evrpc_status status;
 
-	if (pause == NULL)
-		return (-1);
+	if ((ctx->frame_data = evbuffer_new()) == NULL)
+		goto error;
 
-	(*pause->cb)(pause->ctx, res);
-	TAILQ_REMOVE(head, pause, next);
-	return (0);
-}
+	/* serialize the request data into the output buffer */
+	ctx->request_marshal(ctx->frame_data, ctx->request);
 
-int
-evrpc_make_request(struct evrpc_request_wrapper *ctx)
-{
-	struct evrpc_pool *pool = ctx->pool;
+	/* the reply finds us by our id on this connection */
+	ctx->frame_conn = conn;
+	ctx->frame_id = conn->next_id++;
+	TAILQ_INSERT_TAIL(&conn->requests, ctx, next);
+	++conn->n_pending;
 
-	/* initialize the event structure for this rpc */
-	evtimer_assign(&ctx->ev_timeout, pool->base, evrpc_request_timeout, ctx);
+	if (TAILQ_FIRST(&pool->output_hooks) != NULL) {
+		int hook_res;
 
-	/* we better have some available connections on the pool */
-	assert(TAILQ_FIRST(&pool->connections) != NULL);
+		evrpc_hook_associate_meta(&ctx->hook_meta, NULL);
 
-	/*
-	 * if no connection is available, we queue the request on the pool,
-	 * the next time a connection is empty, the rpc will be send on that.
-	 */
-	TAILQ_INSERT_TAIL(&pool->requests, ctx, next);
+		/* apply hooks to the outgoing request */
+		hook_res = evrpc_process_hooks(&pool->output_hooks,
+		    ctx, NULL, ctx->frame_data);
 
-	evrpc_pool_schedule(pool);
+		switch (hook_res) {
+		case EVRPC_TERMINATE:
+			goto error;
+		case EVRPC_PAUSE:
+			/* we need to be explicitly resumed */
+			if (evrpc_pause_request(pool, ctx,
+				evrpc_schedule_frame_closure) == -1)
+				goto error;
+			return (0);
+		case EVRPC_CONTINUE:
+			/* we can just continue */
+			break;
+		default:
+			assert(hook_res == EVRPC_TERMINATE ||
+			    hook_res == EVRPC_CONTINUE ||
+			    hook_res == EVRPC_PAUSE);
+		}
+	}
+
+	evrpc_schedule_frame_closure(ctx, EVRPC_CONTINUE);
+	return (0);
+
+error:
+	evrpc_frame_request_unlink(ctx);
+	memset(&status, 0, sizeof(status));
+	status.error = EVRPC_STATUS_ERR_UNSTARTED;
+	(*ctx->cb)(&status, ctx->request, ctx->reply, ctx->cb_arg);
+	evrpc_request_wrapper_free(ctx);
+	return (-1);
+}
+
+static void
+evrpc_schedule_frame_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
+{
+	struct evrpc_request_wrapper *ctx = arg;
+	struct evrpc_frame_conn *conn = ctx->frame_conn;
+	struct evrpc_pool *pool = ctx->pool;
+	struct evrpc_status status;
+
+	/* the connection may have failed while we were paused */
+	if (hook_res == EVRPC_TERMINATE || conn == NULL)
+		goto error;
+
+	if (evrpc_frame_send(conn, EVRPC_FRAME_REQUEST, ctx->frame_id,
+		ctx->name, 0, ctx->frame_data) == -1)
+		goto error;
+	evbuffer_free(ctx->frame_data);
+	ctx->frame_data = NULL;
+	ctx->frame_sent = 1;
+
+	if (pool->timeout > 0) {
+		/*
+		 * a timeout after which the whole rpc is going to be aborted.
+		 */
+		struct timeval tv;
+		evutil_timerclear(&tv);
+		tv.tv_sec = pool->timeout;
+		evtimer_add(&ctx->ev_timeout, &tv);
+	}
+
+	return;
+
+error:
+	evrpc_frame_request_unlink(ctx);
+	memset(&status, 0, sizeof(status));
+	status.error = EVRPC_STATUS_ERR_UNSTARTED;
+	(*ctx->cb)(&status, ctx->request, ctx->reply, ctx->cb_arg);
+	evrpc_request_wrapper_free(ctx);
+}
+
+/* we just queue the paused request on the pool under the req object */
+static int
+evrpc_pause_request(void *vbase, void *ctx,
+    void (*cb)(void *, enum EVRPC_HOOK_RESULT))
+{
+	struct _evrpc_hooks *base = vbase;
+	struct evrpc_hook_ctx *pause = mm_malloc(sizeof(*pause));
+	if (pause == NULL)
+		return (-1);
+
+	pause->ctx = ctx;
+	pause->cb = cb;
+
+	TAILQ_INSERT_TAIL(&base->pause_requests, pause, next);
+	return (0);
+}
+
+int
+evrpc_resume_request(void *vbase, void *ctx, enum EVRPC_HOOK_RESULT res)
+{
+	struct _evrpc_hooks *base = vbase;
+	struct evrpc_pause_list *head = &base->pause_requests;
+	struct evrpc_hook_ctx *pause;
+
+	TAILQ_FOREACH(pause, head, next) {
+		if (pause->ctx == ctx)
+			break;
+	}
+
+	if (pause == NULL)
+		return (-1);
+
+	TAILQ_REMOVE(head, pause, next);
+	(*pause->cb)(pause->ctx, res);
+	mm_free(pause);
+	return (0);
+}
+
+int
+evrpc_make_request(struct evrpc_request_wrapper *ctx)
+{
+	struct evrpc_pool *pool = ctx->pool;
+
+	/* initialize the event structure for this rpc */
+	evtimer_assign(&ctx->ev_timeout, pool->base, evrpc_request_timeout, ctx);
+
+	/* we better have some available connections on the pool */
+	assert(TAILQ_FIRST(&pool->connections) != NULL ||
+	    TAILQ_FIRST(&pool->frame_connections) != NULL);
+
+	/*
+	 * if no connection is available, we queue the request on the pool,
+	 * the next time a connection is empty, the rpc will be send on that.
+	 */
+	TAILQ_INSERT_TAIL(&pool->requests, ctx, next);
+
+	evrpc_pool_schedule(pool);
 
 	return (0);
 }
@@ -822,19 +1394,26 @@ evrpc_make_request_ctx(
 	ctx->request_marshal = req_marshal;
 	ctx->reply_clear = rpl_clear;
 	ctx->reply_unmarshal = rpl_unmarshal;
+	ctx->req = NULL;
+	ctx->frame_conn = NULL;
+	ctx->frame_id = 0;
+	ctx->frame_sent = 0;
+	ctx->frame_data = NULL;
+	ctx->frame_status = 0;
+	ctx->batch = NULL;
 
 	return (ctx);
 }
 
 static void
 evrpc_reply_done_closure(void *, enum EVRPC_HOOK_RESULT);
+static void evrpc_reply_process(struct evrpc_request_wrapper *,
+    struct evbuffer *);
 
 static void
 evrpc_reply_done(struct evhttp_request *req, void *arg)
 {
 	struct evrpc_request_wrapper *ctx = arg;
-	struct evrpc_pool *pool = ctx->pool;
-	int hook_res = EVRPC_CONTINUE;
 
 	/* cancel any timeout we might have scheduled */
 	event_del(&ctx->ev_timeout);
@@ -847,12 +1426,23 @@ evrpc_reply_done(struct evhttp_request *req, void *arg)
 		return;
 	}
 
+	evrpc_reply_process(ctx, req->input_buffer);
+}
+
+/* runs the input hooks on the reply in evbuf and hands it to the user */
+static void
+evrpc_reply_process(struct evrpc_request_wrapper *ctx, struct evbuffer *evbuf)
+{
+	struct evhttp_request *req = ctx->req;
+	struct evrpc_pool *pool = ctx->pool;
+	int hook_res = EVRPC_CONTINUE;
+
 	if (TAILQ_FIRST(&pool->input_hooks) != NULL) {
 		evrpc_hook_associate_meta(&ctx->hook_meta, ctx->evcon);
 
 		/* apply hooks to the incoming request */
 		hook_res = evrpc_process_hooks(&pool->input_hooks,
-		    ctx, req, req->input_buffer);
+		    ctx, req, evbuf);
 
 		switch (hook_res) {
 		case EVRPC_TERMINATE:
@@ -896,12 +1486,16 @@ evrpc_reply_done_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 	status.http_req = req;
 
 	/* we need to get the reply now */
-	if (req == NULL) {
+	if (req == NULL && ctx->frame_data == NULL) {
 		status.error = EVRPC_STATUS_ERR_TIMEOUT;
 	} else if (hook_res == EVRPC_TERMINATE) {
 		status.error = EVRPC_STATUS_ERR_HOOKABORTED;
+	} else if (ctx->frame_status != 0) {
+		/* the server could not answer */
+		status.error = EVRPC_STATUS_ERR_BADPAYLOAD;
 	} else {
-		res = ctx->reply_unmarshal(ctx->reply, req->input_buffer);
+		res = ctx->reply_unmarshal(ctx->reply, req != NULL ?
+		    req->input_buffer : ctx->frame_data);
 		if (res == -1)
 			status.error = EVRPC_STATUS_ERR_BADPAYLOAD;
 	}
@@ -927,16 +1521,19 @@ evrpc_reply_done_closure(void *arg, enum EVRPC_HOOK_RESULT hook_res)
 static void
 evrpc_pool_schedule(struct evrpc_pool *pool)
 {
-	struct evrpc_request_wrapper *ctx = TAILQ_FIRST(&pool->requests);
+	struct evrpc_request_wrapper *ctx;
 	struct evhttp_connection *evcon;
+	struct evrpc_frame_conn *conn;
 
-	/* if no requests are pending, we have no work */
-	if (ctx == NULL)
-		return;
-
-	if ((evcon = evrpc_pool_find_connection(pool)) != NULL) {
+	/* hand out requests until we run out of them or of room */
+	while ((ctx = TAILQ_FIRST(&pool->requests)) != NULL) {
+		if (evrpc_pool_find_connection(pool, &evcon, &conn) == -1)
+			return;
 		TAILQ_REMOVE(&pool->requests, ctx, next);
-		evrpc_schedule_request(evcon, ctx);
+		if (evcon != NULL)
+			evrpc_schedule_request(evcon, ctx);
+		else
+			evrpc_schedule_frame_request(conn, ctx);
 	}
 }
 
@@ -945,6 +1542,14 @@ evrpc_request_timeout(evutil_socket_t fd, short what, void *arg)
 {
 	struct evrpc_request_wrapper *ctx = arg;
 	struct evhttp_connection *evcon = ctx->evcon;
+
+	if (ctx->frame_conn != NULL) {
+		/* a late reply will not find us and gets dropped */
+		evrpc_frame_request_unlink(ctx);
+		evrpc_reply_done_closure(ctx, EVRPC_CONTINUE);
+		return;
+	}
+
 	assert(evcon != NULL);
 
 	evhttp_connection_fail(evcon, EVCON_HTTP_TIMEOUT);
@@ -1046,6 +1651,326 @@ evrpc_hook_get_connection(void *ctx)
 	return (req->hook_meta != NULL ? req->hook_meta->evcon : NULL);
 }
 
+/*
+ * Framed rpcs over bufferevents
+ */
+
+static int
+evrpc_frame_send(struct evrpc_frame_conn *conn, ev_uint32_t type,
+    ev_uint32_t id, const char *name, ev_uint32_t status,
+    struct evbuffer *data)
+{
+	struct evbuffer *frame;
+
+	/* the peer has gone away; nobody is left to tell */
+	if (conn->bev == NULL)
+		return (0);
+
+	if ((frame = evbuffer_new()) == NULL)
+		return (-1);
+
+	evtag_marshal_int(frame, EVRPC_FRAME_ID, id);
+	if (name != NULL)
+		evtag_marshal_string(frame, EVRPC_FRAME_NAME, name);
+	else
+		evtag_marshal_int(frame, EVRPC_FRAME_STATUS, status);
+	if (data != NULL) {
+		evtag_marshal_buffer(frame, EVRPC_FRAME_DATA, data);
+	} else {
+		evtag_marshal(frame, EVRPC_FRAME_DATA, NULL, 0);
+	}
+
+	evtag_marshal_buffer(bufferevent_get_output(conn->bev), type, frame);
+	evbuffer_free(frame);
+
+	return (0);
+}
+
+/* a framed request arrived; look up its rpc and start working on it */
+static void
+evrpc_frame_request(struct evrpc_frame_conn *conn, ev_uint32_t id,
+    const char *name, struct evbuffer *data)
+{
+	struct evrpc *rpc;
+	struct evrpc_req_generic *rpc_state = NULL;
+
+	/* find the right rpc; linear search might be slow */
+	TAILQ_FOREACH(rpc, &conn->base->registered_rpcs, next) {
+		if (strcmp(rpc->uri, name) == 0)
+			break;
+	}
+	if (rpc == NULL || evbuffer_get_length(data) <= 0)
+		goto error;
+
+	rpc_state = mm_calloc(1, sizeof(struct evrpc_req_generic));
+	if (rpc_state == NULL)
+		goto error;
+	rpc_state->rpc = rpc;
+	rpc_state->frame_conn = conn;
+	rpc_state->frame_id = id;
+	rpc_state->frame_input = data;
+	++conn->n_pending;
+
+	evrpc_request_start(rpc_state);
+	return;
+
+error:
+	evbuffer_free(data);
+	evrpc_frame_send(conn, EVRPC_FRAME_REPLY, id, NULL, 1, NULL);
+}
+
+/* a framed reply arrived; hand it to the request with the same id */
+static void
+evrpc_frame_reply(struct evrpc_frame_conn *conn, ev_uint32_t id,
+    ev_uint32_t status, struct evbuffer *data)
+{
+	struct evrpc_request_wrapper *ctx;
+
+	TAILQ_FOREACH(ctx, &conn->requests, next) {
+		if (ctx->frame_id == id && ctx->frame_sent)
+			break;
+	}
+	if (ctx == NULL) {
+		/* we gave up on this request already */
+		evbuffer_free(data);
+		return;
+	}
+
+	/* cancel any timeout we might have scheduled */
+	event_del(&ctx->ev_timeout);
+
+	evrpc_frame_request_unlink(ctx);
+	ctx->req = NULL;
+	ctx->frame_data = data;
+	ctx->frame_status = status;
+
+	evrpc_reply_process(ctx, data);
+}
+
+/* parses a frame of the given type and acts on it */
+static int
+evrpc_frame_dispatch(struct evrpc_frame_conn *conn, ev_uint32_t type,
+    struct evbuffer *frame)
+{
+	struct evbuffer *data = NULL;
+	ev_uint32_t id, tag, status = 0;
+	char *name = NULL;
+
+	if (evtag_unmarshal_int(frame, EVRPC_FRAME_ID, &id) == -1)
+		return (-1);
+
+	if (type == EVRPC_FRAME_REQUEST && conn->base != NULL) {
+		if (evtag_unmarshal_string(frame, EVRPC_FRAME_NAME,
+			&name) == -1)
+			return (-1);
+	} else if (type == EVRPC_FRAME_REPLY && conn->pool != NULL) {
+		if (evtag_unmarshal_int(frame, EVRPC_FRAME_STATUS,
+			&status) == -1)
+			return (-1);
+	} else {
+		return (-1);
+	}
+
+	if ((data = evbuffer_new()) == NULL ||
+	    evtag_unmarshal(frame, &tag, data) == -1 ||
+	    tag != EVRPC_FRAME_DATA) {
+		if (data != NULL)
+			evbuffer_free(data);
+		if (name != NULL)
+			mm_free(name);
+		return (-1);
+	}
+
+	if (name != NULL) {
+		evrpc_frame_request(conn, id, name, data);
+		mm_free(name);
+	} else {
+		evrpc_frame_reply(conn, id, status, data);
+	}
+
+	return (0);
+}
+
+/*
+ * Gives up on a connection.  A pool fails the requests that are waiting
+ * for their replies on it.  A base keeps the connection around until
+ * the requests it received have been answered, but drops the answers.
+ */
+static void
+evrpc_frame_conn_close(struct evrpc_frame_conn *conn)
+{
+	struct evrpc_request_wrapper *ctx;
+
+	bufferevent_free(conn->bev);
+	conn->bev = NULL;
+
+	if (conn->base != NULL) {
+		TAILQ_REMOVE(&conn->base->frame_connections, conn, next);
+		if (conn->n_pending == 0)
+			mm_free(conn);
+		return;
+	}
+
+	TAILQ_REMOVE(&conn->pool->frame_connections, conn, next);
+	while ((ctx = TAILQ_FIRST(&conn->requests)) != NULL) {
+		evrpc_frame_request_unlink(ctx);
+		/* requests paused before sending fail when they resume */
+		if (ctx->frame_sent) {
+			event_del(&ctx->ev_timeout);
+			ctx->req = NULL;
+			evrpc_reply_done_closure(ctx, EVRPC_CONTINUE);
+		}
+	}
+	mm_free(conn);
+}
+
+static void
+evrpc_frame_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evrpc_frame_conn *conn = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer *frame;
+	ev_uint32_t len, type;
+
+	while (evtag_peek_length(input, &len) != -1) {
+		if (len > EVRPC_FRAME_MAX)
+			goto error;
+		if (evbuffer_get_length(input) < len)
+			break;
+
+		if ((frame = evbuffer_new()) == NULL)
+			goto error;
+		if (evtag_unmarshal(input, &type, frame) == -1 ||
+		    evrpc_frame_dispatch(conn, type, frame) == -1) {
+			evbuffer_free(frame);
+			goto error;
+		}
+		evbuffer_free(frame);
+	}
+
+	return;
+
+error:
+	event_warnx("%s: received a malformed rpc frame", __func__);
+	evrpc_frame_conn_close(conn);
+}
+
+static void
+evrpc_frame_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct evrpc_frame_conn *conn = arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT))
+		evrpc_frame_conn_close(conn);
+}
+
+static struct evrpc_frame_conn *
+evrpc_frame_conn_new(struct bufferevent *bev)
+{
+	struct evrpc_frame_conn *conn = mm_calloc(1, sizeof(*conn));
+	if (conn == NULL)
+		return (NULL);
+
+	conn->bev = bev;
+	TAILQ_INIT(&conn->requests);
+
+	/* we rely on the tagging sub system */
+	evtag_init();
+
+	bufferevent_setcb(bev, evrpc_frame_readcb, NULL,
+	    evrpc_frame_eventcb, conn);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	return (conn);
+}
+
+int
+evrpc_add_bufferevent(struct evrpc_base *base, struct bufferevent *bev)
+{
+	struct evrpc_frame_conn *conn = evrpc_frame_conn_new(bev);
+	if (conn == NULL)
+		return (-1);
+
+	conn->base = base;
+	TAILQ_INSERT_TAIL(&base->frame_connections, conn, next);
+
+	/* the peer may have sent something already */
+	if (evbuffer_get_length(bufferevent_get_input(bev)) > 0)
+		evrpc_frame_readcb(bev, conn);
+
+	return (0);
+}
+
+int
+evrpc_add_worker_base(struct evrpc_base *base, struct event_base *ev_base)
+{
+	struct evrpc_worker *worker, **workers;
+
+	workers = mm_realloc(base->workers,
+	    (base->n_workers + 1) * sizeof(struct evrpc_worker *));
+	if (workers == NULL)
+		return (-1);
+	base->workers = workers;
+
+	if ((worker = mm_calloc(1, sizeof(struct evrpc_worker))) == NULL)
+		return (-1);
+	worker->base = ev_base;
+	TAILQ_INIT(&worker->pending);
+	EVTHREAD_ALLOC_LOCK(worker->lock, EVTHREAD_LOCK_CATEGORY_OTHER);
+	event_assign(&worker->pickup_ev, ev_base, -1, 0,
+	    evrpc_worker_pickup_cb, worker);
+
+	base->workers[base->n_workers++] = worker;
+	return (0);
+}
+
+static void
+evrpc_worker_free(struct evrpc_worker *worker)
+{
+	struct evrpc_req_generic *rpc_state;
+
+	event_del(&worker->pickup_ev);
+	while ((rpc_state = TAILQ_FIRST(&worker->pending)) != NULL) {
+		TAILQ_REMOVE(&worker->pending, rpc_state, next);
+		evrpc_reqstate_free(rpc_state);
+	}
+	EVTHREAD_FREE_LOCK(worker->lock);
+	mm_free(worker);
+}
+
+int
+evrpc_set_rpc_offload(struct evrpc_base *base, const char *name, int offload)
+{
+	struct evrpc *rpc;
+
+	TAILQ_FOREACH(rpc, &base->registered_rpcs, next) {
+		if (strcmp(rpc->uri, name) == 0)
+			break;
+	}
+	/* the batch rpc only fans out, which is cheap */
+	if (rpc == NULL || rpc->cb == evrpc_batch_dispatch)
+		return (-1);
+
+	rpc->offload = offload;
+	return (0);
+}
+
+int
+evrpc_pool_add_bufferevent(struct evrpc_pool *pool, struct bufferevent *bev)
+{
+	struct evrpc_frame_conn *conn = evrpc_frame_conn_new(bev);
+	if (conn == NULL)
+		return (-1);
+
+	conn->pool = pool;
+	TAILQ_INSERT_TAIL(&pool->frame_connections, conn, next);
+
+	/* send any requests that were waiting for a connection */
+	evrpc_pool_schedule(pool);
+
+	return (0);
+}
+
 int
 evrpc_send_request_generic(struct evrpc_pool *pool,
     void *request, void *reply,
@@ -1070,6 +1995,174 @@ error:
 	return (-1);
 }
 
+/*
+ * Batches on the client: the batch is sent as a single request, which
+ * has the batch as both its request and its reply.  When that request
+ * completes, each call gets its own reply and callback.
+ */
+
+struct evrpc_batch *
+evrpc_batch_new(struct evrpc_pool *pool)
+{
+	struct evrpc_batch *batch = mm_calloc(1, sizeof(struct evrpc_batch));
+	if (batch == NULL)
+		return (NULL);
+
+	batch->pool = pool;
+	TAILQ_INIT(&batch->calls);
+
+	return (batch);
+}
+
+void
+evrpc_batch_free(struct evrpc_batch *batch)
+{
+	struct evrpc_request_wrapper *ctx;
+
+	while ((ctx = TAILQ_FIRST(&batch->calls)) != NULL) {
+		TAILQ_REMOVE(&batch->calls, ctx, next);
+		evrpc_request_wrapper_free(ctx);
+	}
+	mm_free(batch);
+}
+
+int
+evrpc_batch_add_generic(struct evrpc_batch *batch,
+    void *request, void *reply,
+    void (*cb)(struct evrpc_status *, void *, void *, void *),
+    void *cb_arg,
+    const char *rpcname,
+    void (*req_marshal)(struct evbuffer *, void *),
+    void (*rpl_clear)(void *),
+    int (*rpl_unmarshal)(void *, struct evbuffer *))
+{
+	struct evrpc_status status;
+	struct evrpc_request_wrapper *ctx;
+	ctx = evrpc_make_request_ctx(batch->pool, request, reply,
+	    rpcname, req_marshal, rpl_clear, rpl_unmarshal, cb, cb_arg);
+	if (ctx == NULL)
+		goto error;
+	TAILQ_INSERT_TAIL(&batch->calls, ctx, next);
+	++batch->n_calls;
+	return (0);
+error:
+	memset(&status, 0, sizeof(status));
+	status.error = EVRPC_STATUS_ERR_UNSTARTED;
+	(*(cb))(&status, request, reply, cb_arg);
+	return (-1);
+}
+
+static void
+evrpc_batch_marshal(struct evbuffer *evbuf, void *arg)
+{
+	struct evrpc_batch *batch = arg;
+	struct evrpc_request_wrapper *ctx;
+	struct evbuffer *data;
+
+	if ((data = evbuffer_new()) == NULL)
+		return;
+
+	TAILQ_FOREACH(ctx, &batch->calls, next) {
+		evtag_marshal_string(evbuf, EVRPC_FRAME_NAME, ctx->name);
+		ctx->request_marshal(data, ctx->request);
+		evtag_marshal_buffer(evbuf, EVRPC_FRAME_DATA, data);
+	}
+	evbuffer_free(data);
+}
+
+static void
+evrpc_batch_clear(void *arg)
+{
+	struct evrpc_batch *batch = arg;
+	struct evrpc_request_wrapper *ctx;
+
+	TAILQ_FOREACH(ctx, &batch->calls, next) {
+		if (ctx->frame_data != NULL) {
+			evbuffer_free(ctx->frame_data);
+			ctx->frame_data = NULL;
+		}
+		ctx->frame_status = 0;
+	}
+}
+
+/* gives every call its status and marshaled reply */
+static int
+evrpc_batch_unmarshal(void *arg, struct evbuffer *evbuf)
+{
+	struct evrpc_batch *batch = arg;
+	struct evrpc_request_wrapper *ctx;
+	ev_uint32_t tag;
+
+	TAILQ_FOREACH(ctx, &batch->calls, next) {
+		if (evtag_unmarshal_int(evbuf, EVRPC_FRAME_STATUS,
+			&ctx->frame_status) == -1 ||
+		    (ctx->frame_data = evbuffer_new()) == NULL ||
+		    evtag_unmarshal(evbuf, &tag, ctx->frame_data) == -1 ||
+		    tag != EVRPC_FRAME_DATA)
+			return (-1);
+	}
+
+	/* the server answered calls that we did not make */
+	if (evbuffer_get_length(evbuf) > 0)
+		return (-1);
+
+	return (0);
+}
+
+static void
+evrpc_batch_done(struct evrpc_status *status, void *request, void *reply,
+    void *arg)
+{
+	struct evrpc_batch *batch = arg;
+	struct evrpc_request_wrapper *ctx;
+	struct evrpc_status call_status;
+
+	TAILQ_FOREACH(ctx, &batch->calls, next) {
+		call_status = *status;
+		if (call_status.error == EVRPC_STATUS_ERR_NONE &&
+		    (ctx->frame_status != 0 ||
+			ctx->reply_unmarshal(ctx->reply,
+			    ctx->frame_data) == -1))
+			call_status.error = EVRPC_STATUS_ERR_BADPAYLOAD;
+
+		if (call_status.error != EVRPC_STATUS_ERR_NONE) {
+			/* clear everything that we might have written */
+			ctx->reply_clear(ctx->reply);
+		}
+
+		(*ctx->cb)(&call_status, ctx->request, ctx->reply,
+		    ctx->cb_arg);
+	}
+
+	/* the request that carried the batch frees it */
+}
+
+int
+evrpc_batch_send(struct evrpc_batch *batch)
+{
+	struct evrpc_status status;
+	struct evrpc_request_wrapper *ctx;
+
+	if (batch->n_calls == 0) {
+		evrpc_batch_free(batch);
+		return (0);
+	}
+
+	ctx = evrpc_make_request_ctx(batch->pool, batch, batch,
+	    EVRPC_BATCH_NAME, evrpc_batch_marshal, evrpc_batch_clear,
+	    evrpc_batch_unmarshal, evrpc_batch_done, batch);
+	if (ctx == NULL)
+		goto error;
+	ctx->batch = batch;
+	return (evrpc_make_request(ctx));
+error:
+	memset(&status, 0, sizeof(status));
+	status.error = EVRPC_STATUS_ERR_UNSTARTED;
+	evrpc_batch_done(&status, batch, batch, batch);
+	evrpc_batch_free(batch);
+	return (-1);
+}
+
 /** Takes a request object and fills it in with the right magic */
 static struct evrpc *
 evrpc_register_object(const char *name,
@@ -34,6 +34,10 @@
 
 typedef void (*ev_sighandler_t)(int);
 
+#if defined(_EVENT_HAVE_SIGNALFD) && defined(_EVENT_HAVE_SYS_SIGNALFD_H)
+#define EVSIG_USE_SIGNALFD
+#endif
+
 struct evsig_info {
 	struct event ev_signal;
 	evutil_socket_t ev_signal_pair[2];
@@ -46,6 +50,16 @@ struct evsig_info {
 	ev_sighandler_t **sh_old;
 #endif
 	int sh_old_max;
+#ifdef EVSIG_USE_SIGNALFD
+	/* True if ev_signal_pair[1] is a signalfd that we read signals from,
+	 * rather than a socket that our signal handler writes to. */
+	int use_signalfd;
+	/* The signals that the signalfd is watching and that we have blocked. */
+	sigset_t signalfd_mask;
+	/* The signals in signalfd_mask that were already blocked before we
+	 * added them, and so should stay blocked when we remove them. */
+	sigset_t signalfd_preblocked;
+#endif
 };
 int evsig_init(struct event_base *);
 void evsig_process(struct event_base *);
@@ -31,6 +31,7 @@ extern "C" {
 #endif
 
 #include "event-config.h"
+#include <event2/thread.h>
 #include "util-internal.h"
 
 struct event_base;
@@ -42,11 +43,39 @@ extern void (*_evthread_locking_fn)(int mode, void *lock);
 extern unsigned long (*_evthread_id_fn)(void);
 extern void *(*_evthread_lock_alloc_fn)(void);
 extern void (*_evthread_lock_free_fn)(void *);
+/* True iff evthread_enable_lock_profiling() has replaced the functions
+   above with ones that keep count. */
+extern int _evthread_lock_profiling;
+
+/** Allocate a lock that counts toward the given EVTHREAD_LOCK_CATEGORY_*;
+    used by EVTHREAD_ALLOC_LOCK when lock profiling is on. */
+void *_evthread_prof_lock_alloc(int category);
 
 /** True iff the given event_base is set up to use locking */
 #define EVBASE_USING_LOCKS(base)			\
 	(base != NULL && (base)->th_base_lock != NULL)
 
+#if defined(_EVENT_HAVE_SYNC_BUILTINS)
+/** Defined iff we have lock-free atomic operations on int- and pointer-sized
+    values.  Each of these acts as a full memory barrier, except for
+    EVATOMIC_XCHG, which only acquires. */
+#define EVTHREAD_HAVE_ATOMICS
+/** If *p is oldv, set it to newv; return true iff we did. */
+#define EVATOMIC_CAS(p, oldv, newv)				\
+	__sync_bool_compare_and_swap((p), (oldv), (newv))
+/** Set *p to v and return the old value of *p. */
+#define EVATOMIC_XCHG(p, v) __sync_lock_test_and_set((p), (v))
+/** Set *p to *p|v and return the old value of *p. */
+#define EVATOMIC_OR(p, v) __sync_fetch_and_or((p), (v))
+/** Set *p to *p&v and return the old value of *p. */
+#define EVATOMIC_AND(p, v) __sync_fetch_and_and((p), (v))
+/** Add v to *p and return the old value of *p. */
+#define EVATOMIC_ADD(p, v) __sync_fetch_and_add((p), (v))
+/** Don't let any load or store move across this point, in either the
+    compiler or the CPU. */
+#define EVATOMIC_BARRIER() __sync_synchronize()
+#endif
+
 /** Return the ID of the current thread, or 1 if threading isn't enabled. */
 #define EVTHREAD_GET_ID() \
 	(_evthread_id_fn ? _evthread_id_fn() : 1)
@@ -58,10 +87,13 @@ extern void (*_evthread_lock_free_fn)(void *);
 	(base)->th_owner_id == _evthread_id_fn())
 
 /** Allocate a new lock, and store it in lockvar, a void*.  Sets lockvar to
-    NULL if locking is not enabled. */
-#define EVTHREAD_ALLOC_LOCK(lockvar)		\
-	((lockvar) = _evthread_lock_alloc_fn ?	\
-	    _evthread_lock_alloc_fn() : NULL)
+    NULL if locking is not enabled.  category is the EVTHREAD_LOCK_CATEGORY_*
+    under which lock profiling counts the lock. */
+#define EVTHREAD_ALLOC_LOCK(lockvar, category)			\
+	((lockvar) = !_evthread_lock_alloc_fn ? NULL :		\
+	    _evthread_lock_profiling ?				\
+	    _evthread_prof_lock_alloc(category) :		\
+	    _evthread_lock_alloc_fn())
 
 /** Free a given lock, if it is present and locking is enabled. */
 #define EVTHREAD_FREE_LOCK(lockvar)				\
@@ -135,7 +167,7 @@ extern void (*_evthread_lock_free_fn)(void *);
 #else /* _EVENT_DISABLE_THREAD_SUPPORT */
 
 #define EVTHREAD_GET_ID()	1
-#define EVTHREAD_ALLOC_LOCK(lockvar) _EVUTIL_NIL_STMT
+#define EVTHREAD_ALLOC_LOCK(lockvar, category) _EVUTIL_NIL_STMT
 #define EVTHREAD_FREE_LOCK(lockvar) _EVUTIL_NIL_STMT
 
 #define EVLOCK_LOCK(lockvar, mode) _EVUTIL_NIL_STMT
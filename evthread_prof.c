@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <string.h>
+#include <time.h>
+
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "evthread-internal.h"
+#include "mm-internal.h"
+
+int _evthread_lock_profiling = 0;
+
+#if !defined(_EVENT_DISABLE_THREAD_SUPPORT) && defined(EVTHREAD_HAVE_ATOMICS)
+
+/* A lock that keeps count of how it is used.  The counters are only
+ * touched by the thread that holds the lock. */
+struct prof_lock {
+	TAILQ_ENTRY(prof_lock) next;
+	/* The lock we hand to the real locking function. */
+	void *lock;
+	int category;
+	/* How many threads hold the lock or are waiting for it; changed
+	 * atomically. */
+	int n_wanting;
+	/* The thread that holds the lock, and how many times over. */
+	unsigned long owner;
+	int depth;
+
+	ev_uint64_t n_acquired;
+	ev_uint64_t n_contended;
+	ev_uint64_t wait_usec;
+};
+
+/* Every prof_lock that exists, and what the freed ones counted; both are
+ * protected by prof_registry_lock. */
+static TAILQ_HEAD(prof_lockq, prof_lock) prof_locks =
+    TAILQ_HEAD_INITIALIZER(prof_locks);
+static struct evthread_lock_stats prof_freed[EVTHREAD_LOCK_N_CATEGORIES];
+static void *prof_registry_lock;
+
+/* The functions we wrap. */
+static void (*prof_locking_fn)(int mode, void *lock);
+static void (*prof_free_fn)(void *lock);
+
+static void
+prof_gettime(struct timeval *tv)
+{
+#if defined(_EVENT_HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
+	evutil_gettimeofday(tv, NULL);
+}
+
+static void
+prof_locking(int mode, void *_lock)
+{
+	struct prof_lock *pl = _lock;
+	struct timeval start, end, diff;
+	unsigned long self;
+
+	/* We keep one owner per lock, so we can't let readers share it. */
+	if (mode & EVTHREAD_READ)
+		mode = (mode & ~EVTHREAD_READ) | EVTHREAD_WRITE;
+
+	if (mode & EVTHREAD_UNLOCK) {
+		if (--pl->depth == 0) {
+			pl->owner = 0;
+			EVATOMIC_ADD(&pl->n_wanting, -1);
+		}
+		prof_locking_fn(mode, pl->lock);
+		return;
+	}
+
+	self = _evthread_id_fn();
+	if (pl->owner == self) {
+		/* Nobody else can have it; we do. */
+		prof_locking_fn(mode, pl->lock);
+		++pl->depth;
+		++pl->n_acquired;
+		return;
+	}
+	if (EVATOMIC_ADD(&pl->n_wanting, 1) == 0) {
+		prof_locking_fn(mode, pl->lock);
+	} else {
+		/* Someone else has it, or is about to: time the wait. */
+		prof_gettime(&start);
+		prof_locking_fn(mode, pl->lock);
+		prof_gettime(&end);
+		evutil_timersub(&end, &start, &diff);
+		++pl->n_contended;
+		pl->wait_usec += diff.tv_sec * (ev_uint64_t)1000000 +
+		    diff.tv_usec;
+	}
+	pl->owner = self;
+	pl->depth = 1;
+	++pl->n_acquired;
+}
+
+void *
+_evthread_prof_lock_alloc(int category)
+{
+	struct prof_lock *pl;
+
+	if (category < 0 || category >= EVTHREAD_LOCK_N_CATEGORIES)
+		category = EVTHREAD_LOCK_CATEGORY_OTHER;
+	if ((pl = mm_calloc(1, sizeof(struct prof_lock))) == NULL)
+		return NULL;
+	if ((pl->lock = _evthread_lock_alloc_fn()) == NULL) {
+		mm_free(pl);
+		return NULL;
+	}
+	pl->category = category;
+
+	prof_locking_fn(EVTHREAD_LOCK|EVTHREAD_WRITE, prof_registry_lock);
+	TAILQ_INSERT_TAIL(&prof_locks, pl, next);
+	prof_locking_fn(EVTHREAD_UNLOCK|EVTHREAD_WRITE, prof_registry_lock);
+	return pl;
+}
+
+static void
+prof_lock_free(void *_lock)
+{
+	struct prof_lock *pl = _lock;
+	struct evthread_lock_stats *st = &prof_freed[pl->category];
+
+	prof_locking_fn(EVTHREAD_LOCK|EVTHREAD_WRITE, prof_registry_lock);
+	TAILQ_REMOVE(&prof_locks, pl, next);
+	st->n_acquired += pl->n_acquired;
+	st->n_contended += pl->n_contended;
+	st->wait_usec += pl->wait_usec;
+	prof_locking_fn(EVTHREAD_UNLOCK|EVTHREAD_WRITE, prof_registry_lock);
+
+	prof_free_fn(pl->lock);
+	mm_free(pl);
+}
+
+int
+evthread_enable_lock_profiling(void)
+{
+	if (_evthread_lock_profiling)
+		return 0;
+	if (!_evthread_locking_fn || !_evthread_id_fn ||
+	    !_evthread_lock_alloc_fn || !_evthread_lock_free_fn)
+		return -1;
+	if ((prof_registry_lock = _evthread_lock_alloc_fn()) == NULL)
+		return -1;
+
+	prof_locking_fn = _evthread_locking_fn;
+	prof_free_fn = _evthread_lock_free_fn;
+	_evthread_locking_fn = prof_locking;
+	_evthread_lock_free_fn = prof_lock_free;
+	_evthread_lock_profiling = 1;
+	return 0;
+}
+
+int
+evthread_get_lock_stats(int category, struct evthread_lock_stats *stats)
+{
+	struct prof_lock *pl;
+
+	if (!_evthread_lock_profiling || category < 0 ||
+	    category >= EVTHREAD_LOCK_N_CATEGORIES)
+		return -1;
+
+	prof_locking_fn(EVTHREAD_LOCK|EVTHREAD_READ, prof_registry_lock);
+	*stats = prof_freed[category];
+	stats->n_locks = 0;
+	TAILQ_FOREACH(pl, &prof_locks, next) {
+		if (pl->category != category)
+			continue;
+		++stats->n_locks;
+		stats->n_acquired += pl->n_acquired;
+		stats->n_contended += pl->n_contended;
+		stats->wait_usec += pl->wait_usec;
+	}
+	prof_locking_fn(EVTHREAD_UNLOCK|EVTHREAD_READ, prof_registry_lock);
+	return 0;
+}
+
+void
+evthread_reset_lock_stats(void)
+{
+	struct prof_lock *pl;
+
+	if (!_evthread_lock_profiling)
+		return;
+
+	/* A lock that is being taken right now may keep a count from
+	 * before; that's close enough. */
+	prof_locking_fn(EVTHREAD_LOCK|EVTHREAD_WRITE, prof_registry_lock);
+	memset(prof_freed, 0, sizeof(prof_freed));
+	TAILQ_FOREACH(pl, &prof_locks, next) {
+		pl->n_acquired = pl->n_contended = pl->wait_usec = 0;
+	}
+	prof_locking_fn(EVTHREAD_UNLOCK|EVTHREAD_WRITE, prof_registry_lock);
+}
+
+#else /* no threads or no atomics */
+
+void *
+_evthread_prof_lock_alloc(int category)
+{
+	return NULL;
+}
+
+int
+evthread_enable_lock_profiling(void)
+{
+	return -1;
+}
+
+int
+evthread_get_lock_stats(int category, struct evthread_lock_stats *stats)
+{
+	return -1;
+}
+
+void
+evthread_reset_lock_stats(void)
+{
+}
+
+#endif
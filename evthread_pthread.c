@@ -30,10 +30,12 @@
 /* With glibc we need to define this to get PTHREAD_MUTEX_RECURSIVE. */
 #define _GNU_SOURCE
 #include <pthread.h>
+#include <unistd.h>
 
 struct event_base;
 #include <event2/thread.h>
 
+#include "evthread-internal.h"
 #include "mm-internal.h"
 
 static pthread_mutexattr_t attr_recursive;
@@ -80,6 +82,163 @@ evthread_posix_get_id(void)
 	return r.id;
 }
 
+#ifdef EVTHREAD_HAVE_ATOMICS
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SPIN_PAUSE() __asm__ __volatile__("pause")
+#else
+#define SPIN_PAUSE() EVATOMIC_BARRIER()
+#endif
+
+/* How many times to look at a busy lock before going to sleep on it; 0 on
+ * a single CPU, where the holder can't run while we spin. */
+static int rwlock_spin_count;
+
+/* A recursive lock that any number of threads asking for EVTHREAD_READ may
+ * hold at once.  Readers get in whenever no thread holds the lock
+ * exclusively; since our READ sections are short, we don't hold them back
+ * for a waiting writer. */
+struct evthread_posix_rwlock {
+	/* -1 if some thread holds the lock exclusively, otherwise the number
+	 * of shared holds.  Changed atomically. */
+	int state;
+	/* The thread that holds the lock exclusively, and how many times
+	 * over.  Only that thread changes them. */
+	unsigned long owner;
+	int depth;
+	/* How many threads are asleep on cond, or about to be.  Changed
+	 * atomically, with mutex held. */
+	int n_waiting;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void *
+evthread_posix_rwlock_create(void)
+{
+	struct evthread_posix_rwlock *lock =
+	    mm_calloc(1, sizeof(struct evthread_posix_rwlock));
+	if (!lock)
+		return NULL;
+	if (pthread_mutex_init(&lock->mutex, NULL)) {
+		mm_free(lock);
+		return NULL;
+	}
+	if (pthread_cond_init(&lock->cond, NULL)) {
+		pthread_mutex_destroy(&lock->mutex);
+		mm_free(lock);
+		return NULL;
+	}
+	return lock;
+}
+
+static void
+evthread_posix_rwlock_free(void *_lock)
+{
+	struct evthread_posix_rwlock *lock = _lock;
+	pthread_cond_destroy(&lock->cond);
+	pthread_mutex_destroy(&lock->mutex);
+	mm_free(lock);
+}
+
+/* Try once to take lock shared or exclusively; return true iff we did. */
+static int
+evthread_posix_rwlock_try(struct evthread_posix_rwlock *lock, int shared)
+{
+	int s = lock->state;
+	if (!shared)
+		return s == 0 && EVATOMIC_CAS(&lock->state, 0, -1);
+	while (s >= 0) {
+		if (EVATOMIC_CAS(&lock->state, s, s + 1))
+			return 1;
+		s = lock->state;
+	}
+	return 0;
+}
+
+static void
+evthread_posix_rwlock_lock(int mode, void *_lock)
+{
+	struct evthread_posix_rwlock *lock = _lock;
+	unsigned long self = evthread_posix_get_id();
+	int shared = (mode & EVTHREAD_READ) != 0;
+	int i;
+
+	if (0 == (mode & EVTHREAD_LOCK)) {
+		if (lock->owner == self) {
+			/* Whatever mode was asked for, we took it as a
+			 * nested exclusive hold. */
+			if (--lock->depth)
+				return;
+			lock->owner = 0;
+			EVATOMIC_CAS(&lock->state, -1, 0);
+		} else {
+			EVATOMIC_ADD(&lock->state, -1);
+		}
+		/* Our atomic op above is a full barrier, so either a waiter
+		 * sees the lock free or we see the waiter. */
+		if (lock->n_waiting) {
+			pthread_mutex_lock(&lock->mutex);
+			pthread_cond_broadcast(&lock->cond);
+			pthread_mutex_unlock(&lock->mutex);
+		}
+		return;
+	}
+
+	if (lock->owner == self) {
+		/* A thread holding the lock exclusively may take it again in
+		 * any mode.  Note that the reverse doesn't work: asking for
+		 * it exclusively while holding it shared will deadlock. */
+		++lock->depth;
+		return;
+	}
+
+	for (i = 0; i <= rwlock_spin_count; ++i) {
+		if (evthread_posix_rwlock_try(lock, shared))
+			goto done;
+		SPIN_PAUSE();
+	}
+	pthread_mutex_lock(&lock->mutex);
+	EVATOMIC_ADD(&lock->n_waiting, 1);
+	while (!evthread_posix_rwlock_try(lock, shared))
+		pthread_cond_wait(&lock->cond, &lock->mutex);
+	EVATOMIC_ADD(&lock->n_waiting, -1);
+	pthread_mutex_unlock(&lock->mutex);
+done:
+	if (!shared) {
+		lock->owner = self;
+		lock->depth = 1;
+	}
+}
+
+int
+evthread_use_pthreads_rwlocks(void)
+{
+	long n_cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	/* About as long as it takes to run a short critical section. */
+	rwlock_spin_count = n_cpus > 1 ? 100 : 0;
+
+	evthread_set_lock_create_callbacks(
+	    evthread_posix_rwlock_create,
+	    evthread_posix_rwlock_free);
+	evthread_set_locking_callback(evthread_posix_rwlock_lock);
+	evthread_set_id_callback(evthread_posix_get_id);
+	return 0;
+}
+
+#else
+
+int
+evthread_use_pthreads_rwlocks(void)
+{
+	return -1;
+}
+
+#endif
+
 int
 evthread_use_pthreads(void)
 {
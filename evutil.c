@@ -204,6 +204,17 @@ evutil_make_listen_socket_reuseable(evutil_socket_t sock)
 #endif
 }
 
+int
+evutil_make_socket_busy_poll(evutil_socket_t sock, int usec)
+{
+#ifdef SO_BUSY_POLL
+	return setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (void*) &usec,
+	    (socklen_t)sizeof(usec));
+#else
+	return -1;
+#endif
+}
+
 ev_int64_t
 evutil_strtoll(const char *s, char **endptr, int base)
 {
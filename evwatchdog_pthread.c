@@ -0,0 +1,166 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "event-internal.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
+
+struct evthread_watchdog {
+	struct event_base *base;
+	struct timeval limit;
+	event_slow_callback_cb cb;
+	void *arg;
+
+	/* Protects stopping. */
+	pthread_mutex_t lock;
+	/* Signaled when it is time to stop. */
+	pthread_cond_t cond;
+	int stopping;
+	pthread_t thread;
+};
+
+static void *
+watchdog_main(void *arg)
+{
+	struct evthread_watchdog *wd = arg;
+	struct event_base *base = wd->base;
+	struct timeval now, period, wake, seen_at, stuck;
+	struct timespec ts;
+	unsigned seq, last_seq = 0;
+	int reported = 0;
+
+	/* Look twice per limit, so that we notice a stuck callback no later
+	 * than half a limit after it has been stuck for one. */
+	period.tv_sec = wd->limit.tv_sec / 2;
+	period.tv_usec = (wd->limit.tv_sec % 2) * 500000 +
+	    wd->limit.tv_usec / 2;
+	if (!period.tv_sec && period.tv_usec < 1000)
+		period.tv_usec = 1000;
+	evutil_timerclear(&seen_at);
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stopping) {
+		evutil_gettimeofday(&now, NULL);
+		evutil_timeradd(&now, &period, &wake);
+		ts.tv_sec = wake.tv_sec;
+		ts.tv_nsec = wake.tv_usec * 1000;
+		pthread_cond_timedwait(&wd->cond, &wd->lock, &ts);
+		if (wd->stopping)
+			break;
+
+		seq = base->running_cb_seq;
+		evutil_gettimeofday(&now, NULL);
+		if (!(seq & 1) || seq != last_seq) {
+			/* Between callbacks, or in a new one since we last
+			 * looked: start counting from here. */
+			last_seq = seq;
+			seen_at = now;
+			reported = 0;
+			continue;
+		}
+		evutil_timersub(&now, &seen_at, &stuck);
+		if (reported || evutil_timercmp(&stuck, &wd->limit, <))
+			continue;
+
+		/* Once per stuck callback is plenty. */
+		reported = 1;
+		pthread_mutex_unlock(&wd->lock);
+		wd->cb(base, base->running_cb, base->running_cb_fd, &stuck,
+		    wd->arg);
+		pthread_mutex_lock(&wd->lock);
+	}
+	pthread_mutex_unlock(&wd->lock);
+	return NULL;
+}
+
+struct evthread_watchdog *
+evthread_watchdog_new(struct event_base *base, const struct timeval *limit,
+    event_slow_callback_cb cb, void *arg)
+{
+	struct evthread_watchdog *wd;
+
+	if (base == NULL || limit == NULL || cb == NULL ||
+	    (!limit->tv_sec && !limit->tv_usec))
+		return NULL;
+	if ((wd = mm_calloc(1, sizeof(struct evthread_watchdog))) == NULL)
+		return NULL;
+	wd->base = base;
+	wd->limit = *limit;
+	wd->cb = cb;
+	wd->arg = arg;
+	pthread_mutex_init(&wd->lock, NULL);
+	pthread_cond_init(&wd->cond, NULL);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	++base->n_watchdogs;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	if (pthread_create(&wd->thread, NULL, watchdog_main, wd)) {
+		EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		--base->n_watchdogs;
+		EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+		pthread_cond_destroy(&wd->cond);
+		pthread_mutex_destroy(&wd->lock);
+		mm_free(wd);
+		return NULL;
+	}
+	return wd;
+}
+
+void
+evthread_watchdog_free(struct evthread_watchdog *wd)
+{
+	struct event_base *base = wd->base;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->stopping = 1;
+	pthread_cond_signal(&wd->cond);
+	pthread_mutex_unlock(&wd->lock);
+	pthread_join(wd->thread, NULL);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	--base->n_watchdogs;
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	pthread_cond_destroy(&wd->cond);
+	pthread_mutex_destroy(&wd->lock);
+	mm_free(wd);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include "defer-internal.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
+#include "log-internal.h"
+
+struct workq_base;
+
+/* One piece of submitted work. */
+struct workq_item {
+	TAILQ_ENTRY(workq_item) next;
+	struct workq_base *wb;
+	evthread_work_fn work_fn;
+	evthread_work_fn done_fn;
+	void *arg;
+};
+
+TAILQ_HEAD(workq_itemq, workq_item);
+
+/* A base that has submitted work, and the work that has finished but whose
+ * done_fn has not run yet. */
+struct workq_base {
+	TAILQ_ENTRY(workq_base) next;
+	struct evthread_workqueue *wq;
+	struct event_base *base;
+	/* Runs every done_fn that is waiting; scheduled by whoever makes
+	 * done go from empty to not. */
+	struct deferred_cb deferred;
+	struct workq_itemq done;
+};
+
+struct evthread_workqueue {
+	/* Protects everything below, and the done queue of every base. */
+	pthread_mutex_t lock;
+	/* Signaled when there is work, or when it is time to stop. */
+	pthread_cond_t cond;
+	struct workq_itemq pending;
+	TAILQ_HEAD(workq_baseq, workq_base) bases;
+	int stopping;
+
+	pthread_t *threads;
+	int n_threads;
+};
+
+static void
+workq_done_cb(struct deferred_cb *cb, void *arg)
+{
+	struct workq_base *wb = arg;
+	struct evthread_workqueue *wq = wb->wq;
+	struct workq_itemq q;
+	struct workq_item *item;
+
+	/* Take the whole batch at once, so that the workers only contend
+	 * with us for a moment. */
+	TAILQ_INIT(&q);
+	pthread_mutex_lock(&wq->lock);
+	while ((item = TAILQ_FIRST(&wb->done)) != NULL) {
+		TAILQ_REMOVE(&wb->done, item, next);
+		TAILQ_INSERT_TAIL(&q, item, next);
+	}
+	pthread_mutex_unlock(&wq->lock);
+
+	while ((item = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, item, next);
+		if (item->done_fn)
+			item->done_fn(item->arg);
+		mm_free(item);
+	}
+}
+
+static void *
+workq_thread(void *arg)
+{
+	struct evthread_workqueue *wq = arg;
+	struct workq_item *item;
+	struct workq_base *wb;
+	int first;
+
+	pthread_mutex_lock(&wq->lock);
+	while (!wq->stopping) {
+		if ((item = TAILQ_FIRST(&wq->pending)) == NULL) {
+			pthread_cond_wait(&wq->cond, &wq->lock);
+			continue;
+		}
+		TAILQ_REMOVE(&wq->pending, item, next);
+		pthread_mutex_unlock(&wq->lock);
+
+		item->work_fn(item->arg);
+
+		wb = item->wb;
+		pthread_mutex_lock(&wq->lock);
+		first = TAILQ_EMPTY(&wb->done);
+		TAILQ_INSERT_TAIL(&wb->done, item, next);
+		if (first) {
+			/* Only the first of a batch wakes the base up; the
+			 * rest ride along. */
+			pthread_mutex_unlock(&wq->lock);
+			event_deferred_cb_schedule(wb->base, &wb->deferred);
+			pthread_mutex_lock(&wq->lock);
+		}
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+struct evthread_workqueue *
+evthread_workqueue_new(int n_threads)
+{
+	struct evthread_workqueue *wq;
+	int i;
+
+	if (n_threads < 1)
+		return NULL;
+	if (_evthread_locking_fn == NULL || _evthread_id_fn == NULL) {
+		event_warnx("%s: threading must be enabled before creating "
+		    "a work queue", __func__);
+		return NULL;
+	}
+
+	if ((wq = mm_calloc(1, sizeof(struct evthread_workqueue))) == NULL)
+		return NULL;
+	if ((wq->threads = mm_calloc(n_threads, sizeof(pthread_t))) == NULL) {
+		mm_free(wq);
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	TAILQ_INIT(&wq->pending);
+	TAILQ_INIT(&wq->bases);
+
+	for (i = 0; i < n_threads; ++i) {
+		if (pthread_create(&wq->threads[i], NULL, workq_thread, wq))
+			break;
+		++wq->n_threads;
+	}
+	if (wq->n_threads < n_threads) {
+		evthread_workqueue_free(wq);
+		return NULL;
+	}
+
+	return wq;
+}
+
+void
+evthread_workqueue_free(struct evthread_workqueue *wq)
+{
+	struct workq_base *wb;
+	struct workq_item *item;
+	int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stopping = 1;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+	for (i = 0; i < wq->n_threads; ++i)
+		pthread_join(wq->threads[i], NULL);
+
+	/* Nothing runs behind our back any more.  Work that never started,
+	 * and completions that were never delivered, are dropped. */
+	while ((item = TAILQ_FIRST(&wq->pending)) != NULL) {
+		TAILQ_REMOVE(&wq->pending, item, next);
+		mm_free(item);
+	}
+	while ((wb = TAILQ_FIRST(&wq->bases)) != NULL) {
+		TAILQ_REMOVE(&wq->bases, wb, next);
+		event_deferred_cb_cancel(wb->base, &wb->deferred);
+		while ((item = TAILQ_FIRST(&wb->done)) != NULL) {
+			TAILQ_REMOVE(&wb->done, item, next);
+			mm_free(item);
+		}
+		mm_free(wb);
+	}
+
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+	mm_free(wq->threads);
+	mm_free(wq);
+}
+
+int
+evthread_workqueue_submit(struct evthread_workqueue *wq,
+    struct event_base *base, evthread_work_fn work_fn,
+    evthread_work_fn done_fn, void *arg)
+{
+	struct workq_base *wb;
+	struct workq_item *item;
+
+	if (base == NULL || work_fn == NULL)
+		return -1;
+	if ((item = mm_calloc(1, sizeof(struct workq_item))) == NULL)
+		return -1;
+	item->work_fn = work_fn;
+	item->done_fn = done_fn;
+	item->arg = arg;
+
+	pthread_mutex_lock(&wq->lock);
+	/* A program has few bases, so a list will do. */
+	TAILQ_FOREACH(wb, &wq->bases, next) {
+		if (wb->base == base)
+			break;
+	}
+	if (wb == NULL) {
+		if ((wb = mm_calloc(1, sizeof(struct workq_base))) == NULL) {
+			pthread_mutex_unlock(&wq->lock);
+			mm_free(item);
+			return -1;
+		}
+		wb->wq = wq;
+		wb->base = base;
+		event_deferred_cb_init(&wb->deferred, workq_done_cb, wb);
+		TAILQ_INIT(&wb->done);
+		TAILQ_INSERT_TAIL(&wq->bases, wb, next);
+	}
+	item->wb = wb;
+	TAILQ_INSERT_TAIL(&wq->pending, item, next);
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	return 0;
+}
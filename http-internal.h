@@ -11,11 +11,22 @@
 #define _HTTP_INTERNAL_H_
 
 #include "event2/event_struct.h"
+#include "event2/http.h"
 #include "util-internal.h"
+#include "ht-internal.h"
 
 #define HTTP_CONNECT_TIMEOUT	45
 #define HTTP_WRITE_TIMEOUT	50
 #define HTTP_READ_TIMEOUT	50
+#define HTTP_POOL_IDLE_TIMEOUT	60
+#define HTTP_POOL_MAX_IDLE	32
+#define HTTP_POOL_MAX_PER_HOST	6
+#define HTTP_FILE_CACHE_SIZE	64
+#define HTTP_FILE_RECHECK	1
+#define HTTP_FILE_GZIP_MAX	(1024*1024)
+/* a proxied response stops reading from the server while more than this
+ * is waiting to go to the client, and starts again below half of it */
+#define HTTP_PROXY_MAX_BUFFERED	(64*1024)
 
 #define HTTP_PREFIX		"http://"
 #define HTTP_DEFAULTPORT	80
@@ -24,7 +35,8 @@ enum message_read_status {
 	ALL_DATA_READ = 1,
 	MORE_DATA_EXPECTED = 0,
 	DATA_CORRUPTED = -1,
-	REQUEST_CANCELED = -2
+	REQUEST_CANCELED = -2,
+	DATA_TOO_LONG = -3
 };
 
 enum evhttp_connection_error {
@@ -32,7 +44,9 @@ enum evhttp_connection_error {
 	EVCON_HTTP_EOF,
 	EVCON_HTTP_INVALID_HEADER,
 	EVCON_HTTP_BUFFER_ERROR,
-	EVCON_HTTP_REQUEST_CANCEL
+	EVCON_HTTP_REQUEST_CANCEL,
+	EVCON_HTTP_HEADERS_TOO_LARGE,
+	EVCON_HTTP_BODY_TOO_LARGE
 };
 
 struct evbuffer;
@@ -54,6 +68,9 @@ enum evhttp_connection_state {
 };
 
 struct event_base;
+struct evhttp_pool_host;
+struct evhttp_compressor;
+struct evhttp_proxy;
 
 struct evhttp_connection {
 	/* we use tailq only if they were created for an http server */
@@ -70,6 +87,10 @@ struct evhttp_connection {
 	char *address;			/* address to connect to */
 	u_short port;
 
+	/* if set, used to look address up without blocking */
+	struct evdns_base *dns_base;
+	struct evdns_getaddrinfo_request *resolving;
+
 	int flags;
 #define EVHTTP_CON_INCOMING	0x0001	/* only one request on it ever */
 #define EVHTTP_CON_OUTGOING	0x0002  /* multiple requests possible */
@@ -83,8 +104,16 @@ struct evhttp_connection {
 
 	/* for server connections, the http server they are connected with */
 	struct evhttp *http_server;
+	/* ...and the worker base they're on, or NULL for the server's own */
+	struct evhttp_worker *http_worker;
 
 	TAILQ_HEAD(evcon_requestq, evhttp_request) requests;
+	/* how many requests we may send before their responses arrive */
+	int pipeline_depth;
+	/* how many of the requests at the head of 'requests' we've sent */
+	int n_in_flight;
+	/* made active to read a response that came in with the last one */
+	struct event read_more_ev;
 	
 	void (*cb)(struct evhttp_connection *, void *);
 	void *cb_arg;
@@ -93,39 +122,297 @@ struct evhttp_connection {
 	void *closecb_arg;
 
 	struct event_base *base;
+
+	/* for connections in an evhttp_pool, the host they're for */
+	struct evhttp_pool_host *pool_host;
+	TAILQ_ENTRY(evhttp_connection) pool_next;
+	/* in the pool's list of idle connections iff pool_idle is set, or
+	 * in its server's iff server_idle is */
+	TAILQ_ENTRY(evhttp_connection) idle_next;
+	int pool_idle;
+	int server_idle;
+	/* when a server connection last finished a response */
+	struct timeval idle_since;
+	/* frees a pooled connection once it's been idle for too long */
+	struct event idle_ev;
+
+	/* compresses the chunks of the response we're sending, if any */
+	struct evhttp_compressor *compressor;
+
+	/* true if the user has asked us to stop reading the body for now */
+	int read_paused;
+	/* how much of the body of the request we're reading we've read */
+	ev_int64_t body_size;
+	/* the most of a body a chunk callback is handed at once; 0 for no
+	 * limit */
+	size_t chunk_delivery_size;
+
+	/* a finished request of a server connection, emptied out to take
+	 * the next one */
+	struct evhttp_request *spare_req;
+
+	/* if the server keeps stats, when the first byte of the request
+	 * we're on came in, and how much we've written in answer */
+	struct timeval stats_start;
+	ev_uint64_t stats_bytes_out;
+	/* counts what goes into the output buffer */
+	struct evbuffer_cb_entry *stats_cb;
+
+	/* for server connections, the proxy streaming a response into the
+	 * request we're answering, if any */
+	struct evhttp_proxy *proxy;
 };
 
 struct evhttp_cb {
 	TAILQ_ENTRY(evhttp_cb) next;
+	/* in callbacks_by_uri, unless this is a prefix callback */
+	HT_ENTRY(evhttp_cb) node;
 
 	char *what;
+	/* true iff this matches every URI that starts with 'what' */
+	int prefix;
 
 	void (*cb)(struct evhttp_request *req, void *);
 	void *cbarg;
+	/* if set, the callback gets the request as soon as its headers are
+	 * in, and this gets each piece of the body as it arrives */
+	void (*chunk_cb)(struct evhttp_request *req, void *);
+
+	struct evhttp_route_stats stats;
+};
+
+/* Every evkeyval that evhttp puts on a header list is the start of one of
+ * these.  Lists the user built may hold plain evkeyvals, so only functions
+ * that free or change entries may look past kv. */
+struct evhttp_header {
+	struct evkeyval kv;
+	/* the store whose arena holds this header, its key, and its value; or
+	 * NULL if all three were allocated on their own */
+	struct evhttp_header_store *store;
+	/* hash of the lowercased key, if store is set */
+	unsigned hash;
+};
+
+/* A block of header storage in an evhttp_header_store. */
+struct evhttp_header_chunk {
+	struct evhttp_header_chunk *next;
+	size_t size;
+	size_t used;
+	/* size bytes of storage follow */
+};
+
+/* must be a power of two */
+#define EVHTTP_HEADER_INDEX_SIZE 32
+
+/* A request's input headers, and where we are in parsing them.  The
+ * headers, keys and values are carved out of a few large chunks that all go
+ * away together, and the first header with each name is found through a
+ * small open-addressed table. */
+struct evhttp_header_store {
+	struct evkeyvalq headers;
+
+	/* the chunk we're allocating from comes first */
+	struct evhttp_header_chunk *chunks;
+
+	/* the first header with each name, by hash of the lowercased name */
+	struct evhttp_header *index[EVHTTP_HEADER_INDEX_SIZE];
+	int n_indexed;
+	/* true if some name didn't fit in index, or headers holds a header
+	 * from outside the store, so that a miss there doesn't mean the name
+	 * isn't in headers */
+	int index_overflow;
+	/* the last header we added to headers; if headers doesn't end with
+	 * it, someone has added headers that aren't indexed */
+	struct evhttp_header *last;
+
+	/* how many bytes at the start of the input we've already searched
+	 * for the end of the line that we're waiting on */
+	size_t scan_off;
+
+	/* how many bytes of first line and headers we've parsed, and how
+	 * many headers */
+	size_t headers_size;
+	int n_headers;
 };
 
 /* both the http server as well as the rpc system need to queue connections */
 TAILQ_HEAD(evconq, evhttp_connection);
 
+/* The connections in an evhttp_pool to one address and port. */
+struct evhttp_pool_host {
+	HT_ENTRY(evhttp_pool_host) node;
+	struct evhttp_pool *pool;
+
+	char *address;
+	u_short port;
+
+	struct evconq connections;
+	int n_connections;
+};
+
+HT_HEAD(evhttp_pool_map, evhttp_pool_host);
+
+struct evhttp_pool {
+	struct event_base *base;
+	struct evhttp_pool_map hosts;
+
+	/* connections with no requests, least recently used first */
+	struct evconq idle;
+	int n_idle;
+
+	int max_idle;
+	int max_per_host;
+	int idle_timeout;
+};
+
+/* A file that an evhttp_file_server keeps open, with what it knows about
+ * it. */
+struct evhttp_file {
+	HT_ENTRY(evhttp_file) node;
+	TAILQ_ENTRY(evhttp_file) next;
+
+	/* the decoded path below the server's root */
+	char *path;
+	int fd;
+
+	/* what fstat said when we opened it */
+	ev_int64_t size;
+	time_t mtime;
+	ev_uint64_t ino;
+	/* when we last made sure that the file is still the same */
+	time_t checked;
+
+	const char *content_type;
+	char etag[40];
+	char last_modified[32];
+
+	/* the file gzipped, once someone has asked for it that way; its
+	 * ETag is etag with "-gz" inside the quotes */
+	struct evbuffer *gzipped;
+	char gzip_etag[44];
+};
+
+HT_HEAD(evhttp_file_map, evhttp_file);
+
+struct evhttp_file_server {
+	/* the URIs we serve start with prefix, and the rest of them names a
+	 * file below root */
+	char *prefix;
+	size_t prefix_len;
+	char *root;
+
+	struct evhttp_file_map files;
+	/* the files in 'files', least recently used first */
+	TAILQ_HEAD(evhttp_fileq, evhttp_file) lru;
+	int n_files;
+	int max_files;
+};
+
+HT_HEAD(evhttp_cb_map, evhttp_cb);
+
+/* A node in the radix tree of prefix callbacks.  The path from the root
+ * spells out a prefix; cb is its callback, if it has one. */
+struct evhttp_route_node {
+	/* the part of the prefix on the edge into this node */
+	char *label;
+	size_t label_len;
+	struct evhttp_cb *cb;
+
+	/* no two of these have labels that start with the same byte */
+	struct evhttp_route_node *children;
+	struct evhttp_route_node *next_sibling;
+};
+
 /* each bound socket is stored in one of these */
 struct evhttp_bound_socket {
 	TAILQ_ENTRY(evhttp_bound_socket) (next);
 
-	struct event  bind_ev;
+	struct evconnlistener *listener;
+};
+
+struct evhttp_pending_socket;
+
+/* The Date header for the responses on one base, made again only when the
+ * base's cached time moves on to another second. */
+struct evhttp_date_cache {
+	time_t refreshed;
+	char date[32];
+};
+
+/* The connections of a server on one base that are waiting for another
+ * request, longest waiting first.  One timer closes them as their time
+ * runs out, rather than one for each connection. */
+struct evhttp_idle_list {
+	struct evconq conns;
+	/* how many connections the server has on this base, idle or not */
+	int n_connections;
+	struct event reap_ev;
+	struct evhttp *http;
 };
 
+/* The start of a response, formatted ahead of time. */
+struct evhttp_header_block {
+	int code;
+	char *reason;
+
+	/* the status line for HTTP/1.1, and then the headers, each ending
+	 * in CRLF */
+	char *data;
+	size_t len;
+	/* where the headers start in data */
+	size_t headers_off;
+	/* true iff the headers include a Content-Type */
+	int has_content_type;
+};
+
+/* Another event base that serves some of an evhttp's connections. */
+struct evhttp_worker {
+	struct evhttp *http;
+	struct event_base *base;
+
+	/* connections on this base; only touched from its thread */
+	struct evconq connections;
+
+	/* sockets accepted for this base that it hasn't picked up yet */
+	TAILQ_HEAD(evhttp_pendingq, evhttp_pending_socket) pending;
+	void *lock;
+
+	/* made active to pick up pending sockets in this base's thread */
+	struct event pickup_ev;
+
+	struct evhttp_date_cache date;
+	struct evhttp_idle_list idle;
+};
+
+HT_HEAD(evhttp_vhost_map, evhttp);
+
 struct evhttp {
 	TAILQ_ENTRY(evhttp) next;
 
 	TAILQ_HEAD(boundq, evhttp_bound_socket) sockets;
 
 	TAILQ_HEAD(httpcbq, evhttp_cb) callbacks;
+	/* the callbacks in 'callbacks' for exact URIs, by URI */
+	struct evhttp_cb_map callbacks_by_uri;
+	/* the callbacks in 'callbacks' for prefixes; NULL if there are none */
+	struct evhttp_route_node *prefix_routes;
         struct evconq connections;
 
 	TAILQ_HEAD(vhostsq, evhttp) virtualhosts;			       
+	/* the vhosts in 'virtualhosts' without a wildcard, by host */
+	struct evhttp_vhost_map vhosts_by_host;
+	/* the "*.domain" vhosts in 'virtualhosts', by ".domain" */
+	struct evhttp_vhost_map vhosts_by_suffix;
+	/* the other vhosts in 'virtualhosts', in the order they were added */
+	TAILQ_HEAD(wildcardq, evhttp) wildcard_vhosts;
 
 	/* NULL if this server is not a vhost */
         char *vhost_pattern;
+	/* what this vhost is indexed under in its parent; NULL if it's in
+	 * the parent's wildcard_vhosts instead */
+	const char *vhost_key;
+	HT_ENTRY(evhttp) vhost_node;
+	TAILQ_ENTRY(evhttp) next_wildcard;
 
         int timeout;
 
@@ -133,6 +420,37 @@ struct evhttp {
 	void *gencbarg;
 
 	struct event_base *base;
+
+	/* bases to hand accepted connections to in turn, if any */
+	struct evhttp_worker **workers;
+	int n_workers;
+	int next_worker;
+
+	/* for the connections on base */
+	struct evhttp_date_cache date;
+	struct evhttp_idle_list idle;
+
+	/* how many connections we keep on each base; -1 for no limit */
+	int max_connections;
+
+	/* limits on what a client may send us; -1 for none */
+	ev_ssize_t max_headers_size;
+	int max_header_count;
+	ev_ssize_t max_body_size;
+	/* what our connections' chunk_delivery_size starts as */
+	size_t chunk_delivery_size;
+
+	/* true iff we count the requests on our connections */
+	int stats_enabled;
+	/* for requests that no callback took */
+	struct evhttp_route_stats unrouted_stats;
+	/* protects our stats, which requests on worker bases also update */
+	void *stats_lock;
+
+	/* zlib level to compress response bodies at, or 0 not to */
+	int compress_level;
+	/* bodies shorter than this aren't worth compressing */
+	size_t compress_min_size;
 };
 
 /* resets the connection; can be reused for more requests */
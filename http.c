@@ -64,6 +64,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -78,6 +79,9 @@
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef _EVENT_HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #undef timeout_pending
 #undef timeout_initialized
@@ -88,13 +92,19 @@
 #include "event2/buffer.h"
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_compat.h"
+#include "event2/listener.h"
+#include "event2/thread.h"
 #include "event2/http_struct.h"
 #include "event2/http_compat.h"
 #include "event2/util.h"
+#include "event2/dns.h"
 #include "log-internal.h"
 #include "util-internal.h"
 #include "http-internal.h"
 #include "mm-internal.h"
+#include "evthread-internal.h"
+#include "event-internal.h"
+#include "evbuffer-internal.h"
 
 #ifndef _EVENT_HAVE_GETNAMEINFO
 #define NI_MAXSERV 32
@@ -193,7 +203,7 @@ fake_freeaddrinfo(struct addrinfo *ai)
 extern int debug;
 
 static int socket_connect(evutil_socket_t kefd, const char *address, unsigned short port);
-static evutil_socket_t bind_socket_ai(struct addrinfo *, int reuse);
+static evutil_socket_t bind_socket_ai(int family, struct addrinfo *, int reuse);
 static evutil_socket_t bind_socket(const char *, ev_uint16_t, int reuse);
 static void name_from_addr(struct sockaddr *, socklen_t, char **, char **);
 static int evhttp_associate_new_request_with_connection(
@@ -203,6 +213,27 @@ static void evhttp_connection_start_detectclose(
 static void evhttp_connection_stop_detectclose(
 	struct evhttp_connection *evcon);
 static void evhttp_request_dispatch(struct evhttp_connection* evcon);
+static void evhttp_connection_read_next(struct evhttp_connection *evcon);
+static void evhttp_pool_connection_idle(struct evhttp_connection *evcon);
+static void evhttp_pool_remove_connection(struct evhttp_connection *evcon);
+static void evhttp_compressor_free(struct evhttp_connection *evcon);
+static void evhttp_proxy_client_gone(struct evhttp_proxy *proxy);
+static void evhttp_connection_server_busy(struct evhttp_connection *evcon);
+static int evhttp_request_recycle(struct evhttp_request *req);
+static void evhttp_stats_start(struct evhttp_connection *evcon);
+static void evhttp_stats_record(struct evhttp_connection *evcon,
+    struct evhttp_request *req);
+static ev_ssize_t evhttp_next_line(struct evhttp_request *req,
+    struct evbuffer *buffer);
+static const char *evhttp_pullup_line(struct evbuffer *buffer, ev_ssize_t n,
+    size_t *lenp);
+static int evhttp_hexval(char c);
+static void evhttp_route_body(struct evhttp_connection *evcon,
+    struct evhttp_request *req);
+static enum message_read_status evhttp_parse_limited(
+	struct evhttp_connection *evcon, struct evhttp_request *req,
+	enum message_read_status (*parse)(struct evhttp_request *,
+	    struct evbuffer *));
 static void evhttp_read_firstline(struct evhttp_connection *evcon,
 				  struct evhttp_request *req);
 static void evhttp_read_header(struct evhttp_connection *evcon,
@@ -388,19 +419,57 @@ evhttp_connected(struct evhttp_connection *evcon)
 /*
  * Create the headers needed for an HTTP request
  */
+/* Append "HTTP/major.minor" to buf. */
+static void
+evhttp_add_version(struct evbuffer *buf, int major, int minor)
+{
+	evbuffer_add(buf, "HTTP/", 5);
+	evbuffer_add_int(buf, major);
+	evbuffer_add(buf, ".", 1);
+	evbuffer_add_int(buf, minor);
+}
+
+/* Append "key: value\r\n" to buf, all in one piece of reserved space. */
+static void
+evhttp_add_header_line(struct evbuffer *buf,
+    const char *key, const char *value)
+{
+	size_t key_len = strlen(key), value_len = strlen(value);
+	struct evbuffer_iovec vec;
+	char *p;
+
+	if (evbuffer_reserve_space(buf, key_len + value_len + 4, &vec, 1) < 1)
+		return;
+	p = vec.iov_base;
+	memcpy(p, key, key_len);
+	p += key_len;
+	*p++ = ':';
+	*p++ = ' ';
+	memcpy(p, value, value_len);
+	p += value_len;
+	*p++ = '\r';
+	*p++ = '\n';
+	vec.iov_len = p - (char *)vec.iov_base;
+	evbuffer_commit_space(buf, &vec, 1);
+}
+
 static void
 evhttp_make_header_request(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
 	const char *method;
 
 	evhttp_remove_header(req->output_headers, "Proxy-Connection");
 
 	/* Generate request line */
 	method = evhttp_method(req->type);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "%s %s HTTP/%d.%d\r\n",
-	    method, req->uri, req->major, req->minor);
+	evbuffer_add(output, method, strlen(method));
+	evbuffer_add(output, " ", 1);
+	evbuffer_add(output, req->uri, strlen(req->uri));
+	evbuffer_add(output, " ", 1);
+	evhttp_add_version(output, req->major, req->minor);
+	evbuffer_add(output, "\r\n", 2);
 
 	/* Add the content length on a post or put request if missing */
 	if ((req->type == EVHTTP_REQ_POST || req->type == EVHTTP_REQ_PUT) &&
@@ -433,38 +502,69 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 	    && evutil_strncasecmp(connection, "keep-alive", 10) == 0);
 }
 
-static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+/* Write t into date the way HTTP headers want it.  Returns 0 on success
+ * and -1 if it didn't fit. */
+static int
+evhttp_format_date(time_t t, char *date, size_t len)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
-		char date[50];
 #ifndef WIN32
-		struct tm cur;
+	struct tm cur;
 #endif
-		struct tm *cur_p;
-		time_t t = time(NULL);
+	struct tm *cur_p;
 #ifdef WIN32
-		cur_p = gmtime(&t);
+	cur_p = gmtime(&t);
 #else
-		gmtime_r(&t, &cur);
-		cur_p = &cur;
+	gmtime_r(&t, &cur);
+	cur_p = &cur;
 #endif
-		if (strftime(date, sizeof(date),
-			"%a, %d %b %Y %H:%M:%S GMT", cur_p) != 0) {
-			evhttp_add_header(headers, "Date", date);
+	if (strftime(date, len, "%a, %d %b %Y %H:%M:%S GMT", cur_p) == 0)
+		return (-1);
+	return (0);
+}
+
+/* Write a Date header for a response on evcon to output, unless the user
+ * gave one.  A server formats the date for each of its bases at most once
+ * a second. */
+static void
+evhttp_maybe_add_date_line(struct evhttp_connection *evcon,
+    struct evkeyvalq *headers, struct evbuffer *output)
+{
+	struct evhttp_date_cache *cache, tmp;
+	struct timeval now;
+
+	if (evhttp_find_header(headers, "Date") != NULL)
+		return;
+
+	if (evcon->http_worker != NULL) {
+		cache = &evcon->http_worker->date;
+	} else if (evcon->http_server != NULL) {
+		cache = &evcon->http_server->date;
+	} else {
+		cache = &tmp;
+		tmp.date[0] = '\0';
+	}
+
+	event_base_gettime_cached(evcon->base, &now);
+	if (cache->date[0] == '\0' || cache->refreshed != now.tv_sec) {
+		if (evhttp_format_date(time(NULL), cache->date,
+			sizeof(cache->date)) == -1) {
+			cache->date[0] = '\0';
+			return;
 		}
+		cache->refreshed = now.tv_sec;
 	}
+	evhttp_add_header_line(output, "Date", cache->date);
 }
 
 static void
-evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
-    long content_length)
+evhttp_maybe_add_content_length_line(struct evkeyvalq *headers,
+    struct evbuffer *output, long content_length)
 {
 	if (evhttp_find_header(headers, "Transfer-Encoding") == NULL &&
 	    evhttp_find_header(headers,	"Content-Length") == NULL) {
 		char len[12];
 		evutil_snprintf(len, sizeof(len), "%ld", content_length);
-		evhttp_add_header(headers, "Content-Length", len);
+		evhttp_add_header_line(output, "Content-Length", len);
 	}
 }
 
@@ -474,17 +574,31 @@ evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
 
 static void
 evhttp_make_header_response(struct evhttp_connection *evcon,
-    struct evhttp_request *req)
+    struct evhttp_request *req, const struct evhttp_header_block *block)
 {
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "HTTP/%d.%d %d %s\r\n",
-	    req->major, req->minor, req->response_code,
-	    req->response_code_line);
+
+	if (block != NULL && req->major == 1 && req->minor == 1) {
+		/* the block has our status line already */
+		evbuffer_add(output, block->data, block->len);
+	} else {
+		evhttp_add_version(output, req->major, req->minor);
+		evbuffer_add(output, " ", 1);
+		evbuffer_add_int(output, req->response_code);
+		evbuffer_add(output, " ", 1);
+		evbuffer_add(output, req->response_code_line,
+		    strlen(req->response_code_line));
+		evbuffer_add(output, "\r\n", 2);
+		if (block != NULL)
+			evbuffer_add(output, block->data + block->headers_off,
+			    block->len - block->headers_off);
+	}
 
 	if (req->major == 1) {
 		if (req->minor == 1)
-			evhttp_maybe_add_date_header(req->output_headers);
+			evhttp_maybe_add_date_line(evcon, req->output_headers,
+			    output);
 
 		/*
 		 * if the protocol is 1.0; and the connection was keep-alive
@@ -501,14 +615,15 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 			 * user did not give it, this is required for
 			 * persistent connections to work.
 			 */
-			evhttp_maybe_add_content_length_header(
-				req->output_headers,
+			evhttp_maybe_add_content_length_line(
+				req->output_headers, output,
 				(long)evbuffer_get_length(req->output_buffer));
 		}
 	}
 
 	/* Potentially add headers for unidentified content. */
-	if (evhttp_response_needs_body(req)) {
+	if (evhttp_response_needs_body(req) &&
+	    (block == NULL || !block->has_content_type)) {
 		if (evhttp_find_header(req->output_headers,
 			"Content-Type") == NULL) {
 			evhttp_add_header(req->output_headers,
@@ -525,8 +640,11 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 	}
 }
 
-void
-evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
+/* Write the head of req, and its body if it has one, to evcon.  Responses
+ * may start with a preformatted block. */
+static void
+evhttp_make_header_block(struct evhttp_connection *evcon,
+    struct evhttp_request *req, const struct evhttp_header_block *block)
 {
 	struct evkeyval *header;
 	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
@@ -538,12 +656,11 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	if (req->kind == EVHTTP_REQUEST) {
 		evhttp_make_header_request(evcon, req);
 	} else {
-		evhttp_make_header_response(evcon, req);
+		evhttp_make_header_response(evcon, req, block);
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
-		    header->key, header->value);
+		evhttp_add_header_line(output, header->key, header->value);
 	}
 	evbuffer_add(output, "\r\n", 2);
 
@@ -556,6 +673,12 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 }
 
+void
+evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
+	evhttp_make_header_block(evcon, req, NULL);
+}
+
 static int
 evhttp_connection_incoming_fail(struct evhttp_request *req,
     enum evhttp_connection_error error)
@@ -570,6 +693,12 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		 * connection open and we timeout on the read.
 		 */
 		return (-1);
+	case EVCON_HTTP_HEADERS_TOO_LARGE:
+		evhttp_send_error(req, 431, "Request Header Fields Too Large");
+		break;
+	case EVCON_HTTP_BODY_TOO_LARGE:
+		evhttp_send_error(req, 413, "Request Entity Too Large");
+		break;
 	case EVCON_HTTP_INVALID_HEADER:
 	case EVCON_HTTP_BUFFER_ERROR:
 	case EVCON_HTTP_REQUEST_CANCEL:
@@ -590,10 +719,70 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 	return (0);
 }
 
+/* Return true iff req may be sent again if we don't hear back about it,
+ * and may have other requests sent behind it before it's answered. */
+static int
+evhttp_request_can_pipeline(struct evhttp_request *req)
+{
+	return (req->type != EVHTTP_REQ_POST && req->type != EVHTTP_REQ_PUT &&
+	    !evhttp_is_connection_close(req->flags, req->output_headers));
+}
+
+/* Stands in for the callback of a request that was canceled after it was
+ * sent, so that its response can be read and thrown away. */
+static void
+evhttp_request_discard_cb(struct evhttp_request *req, void *arg)
+{
+}
+
+/*
+ * The connection is going away with its n_in_flight requests sent but not
+ * answered.  Move the ones that we mustn't send again onto failed; the rest
+ * stay queued, and get sent again on the next connection.
+ */
+static void
+evhttp_connection_take_unsafe(struct evhttp_connection *evcon,
+    struct evcon_requestq *failed)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests), *next;
+	int i;
+
+	for (i = 0; req != NULL && i < evcon->n_in_flight; ++i, req = next) {
+		next = TAILQ_NEXT(req, next);
+		if (evhttp_request_can_pipeline(req) &&
+		    req->cb != evhttp_request_discard_cb) {
+			req->kind = EVHTTP_REQUEST;
+			continue;
+		}
+		TAILQ_REMOVE(&evcon->requests, req, next);
+		req->evcon = NULL;
+		TAILQ_INSERT_TAIL(failed, req, next);
+	}
+	evcon->n_in_flight = 0;
+}
+
+/* Tell whoever made the requests on failed that they failed.  The callbacks
+ * might free the connection, so these must not be on it any more. */
+static void
+evhttp_fail_requests(struct evcon_requestq *failed)
+{
+	struct evhttp_request *req;
+
+	while ((req = TAILQ_FIRST(failed)) != NULL) {
+		void (*cb)(struct evhttp_request *, void *) = req->cb;
+		void *cb_arg = req->cb_arg;
+
+		TAILQ_REMOVE(failed, req, next);
+		evhttp_request_free(req);
+		(*cb)(NULL, cb_arg);
+	}
+}
+
 void
 evhttp_connection_fail(struct evhttp_connection *evcon,
     enum evhttp_connection_error error)
 {
+	struct evcon_requestq failed;
 	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
 	void (*cb)(struct evhttp_request *, void *);
 	void *cb_arg;
@@ -627,11 +816,15 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 
 	TAILQ_REMOVE(&evcon->requests, req, next);
 	evhttp_request_free(req);
+	if (evcon->n_in_flight > 0)
+		--evcon->n_in_flight;
 
 	/* do not fail all requests; the next request is going to get
 	 * send over a new connection.   when a user cancels a request,
 	 * all other pending requests should be processed as normal
 	 */
+	TAILQ_INIT(&failed);
+	evhttp_connection_take_unsafe(evcon, &failed);
 
 	/* reset the connection */
 	evhttp_connection_reset(evcon);
@@ -639,10 +832,13 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	/* We are trying the next request that was queued on us */
 	if (TAILQ_FIRST(&evcon->requests) != NULL)
 		evhttp_connection_connect(evcon);
+	else
+		evhttp_pool_connection_idle(evcon);
 
 	/* inform the user */
 	if (cb != NULL)
 		(*cb)(NULL, cb_arg);
+	evhttp_fail_requests(&failed);
 }
 
 static void
@@ -667,12 +863,18 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 {
 	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
+	struct evcon_requestq failed;
+
+	TAILQ_INIT(&failed);
+	evcon->read_paused = 0;
 
 	if (con_outgoing) {
 		/* idle or close the connection */
 	        int need_close;
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		req->evcon = NULL;
+		if (evcon->n_in_flight > 0)
+			--evcon->n_in_flight;
 
 		evcon->state = EVCON_IDLE;
 
@@ -681,8 +883,10 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		    evhttp_is_connection_close(req->flags, req->output_headers);
 
 		/* check if we got asked to close the connection */
-		if (need_close)
+		if (need_close) {
+			evhttp_connection_take_unsafe(evcon, &failed);
 			evhttp_connection_reset(evcon);
+		}
 
 		if (TAILQ_FIRST(&evcon->requests) != NULL) {
 			/*
@@ -691,6 +895,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 			 */
 			if (!evhttp_connected(evcon))
 				evhttp_connection_connect(evcon);
+			else if (evcon->n_in_flight > 0)
+				evhttp_connection_read_next(evcon);
 			else
 				evhttp_request_dispatch(evcon);
 		} else if (!need_close) {
@@ -700,6 +906,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 			 */
 			evhttp_connection_start_detectclose(evcon);
 		}
+		if (TAILQ_FIRST(&evcon->requests) == NULL)
+			evhttp_pool_connection_idle(evcon);
 	} else {
 		/*
 		 * incoming connection - we need to leave the request on the
@@ -717,10 +925,88 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	if (con_outgoing && ((req->flags & EVHTTP_USER_OWNED) == 0)) {
 		evhttp_request_free(req);
 	}
+
+	evhttp_fail_requests(&failed);
+}
+
+/* Return true iff evcon has read more of a request body than its server
+ * allows. */
+static int
+evhttp_body_too_long(struct evhttp_connection *evcon)
+{
+	struct evhttp *http = evcon->http_server;
+
+	return (http != NULL && http->max_body_size >= 0 &&
+	    evcon->body_size > http->max_body_size);
+}
+
+/*
+ * Parses the chunk-size at the start of the len-byte size line p, which may
+ * be followed by chunk extensions.  Returns -1 if there isn't one, or if it
+ * doesn't fit in 63 bits.
+ */
+static ev_int64_t
+evhttp_parse_chunk_size(const char *p, size_t len)
+{
+	ev_int64_t size = 0;
+	size_t i;
+
+	for (i = 0; i < len && EVUTIL_ISXDIGIT(p[i]); ++i) {
+		if (size >> 59)
+			return (-1);
+		size = (size << 4) | evhttp_hexval(p[i]);
+	}
+	if (i == 0 || (i < len && p[i] != ' ' && p[i] != '\t' && p[i] != ';'))
+		return (-1);
+	return (size);
+}
+
+/*
+ * Moves up to n bytes of body from buf to the input buffer of req.  If req
+ * has a chunk callback, they are handed to it at most the connection's
+ * chunk_delivery_size at a time, for as long as it doesn't pause us.
+ * Sets *moved to how much was moved.
+ *   return MORE_DATA_EXPECTED:
+ *     all went well
+ *   return REQUEST_CANCELED:
+ *     the request was freed by its chunk callback
+ */
+static enum message_read_status
+evhttp_deliver_body(struct evhttp_request *req, struct evbuffer *buf,
+    size_t n, size_t *moved)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	size_t piece;
+
+	*moved = 0;
+	if (req->chunk_cb == NULL) {
+		evbuffer_remove_buffer(buf, req->input_buffer, n);
+		*moved = n;
+		return (MORE_DATA_EXPECTED);
+	}
+
+	while (*moved < n && !evcon->read_paused) {
+		piece = n - *moved;
+		if (evcon->chunk_delivery_size &&
+		    piece > evcon->chunk_delivery_size)
+			piece = evcon->chunk_delivery_size;
+		evbuffer_remove_buffer(buf, req->input_buffer, piece);
+		*moved += piece;
+
+		req->flags |= EVHTTP_REQ_DEFER_FREE;
+		(*req->chunk_cb)(req, req->cb_arg);
+		evbuffer_drain(req->input_buffer,
+		    evbuffer_get_length(req->input_buffer));
+		req->flags &= ~EVHTTP_REQ_DEFER_FREE;
+		if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0)
+			return (REQUEST_CANCELED);
+	}
+	return (MORE_DATA_EXPECTED);
 }
 
 /*
- * Handles reading from a chunked request.
+ * Handles reading from a chunked request.  The data of a chunk is moved
+ * on as it arrives, not once the whole chunk is in.
  *   return ALL_DATA_READ:
  *     all data has been read
  *   return MORE_DATA_EXPECTED:
@@ -734,28 +1020,29 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 static enum message_read_status
 evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 {
-	int len;
+	enum message_read_status status;
+	size_t len, moved;
 
 	while ((len = evbuffer_get_length(buf)) > 0) {
 		if (req->ntoread < 0) {
 			/* Read chunk size */
 			ev_int64_t ntoread;
-			char *p = evbuffer_readln(buf, NULL, EVBUFFER_EOL_CRLF);
-			char *endp;
-			int error;
-			if (p == NULL)
+			const char *line;
+			ev_ssize_t n;
+			size_t linelen;
+
+			if ((n = evhttp_next_line(req, buf)) == -1)
 				break;
+			if ((line = evhttp_pullup_line(buf, n, &linelen)) == NULL)
+				return (DATA_CORRUPTED);
 			/* the last chunk is on a new line? */
-			if (strlen(p) == 0) {
-				mm_free(p);
+			if (linelen == 0) {
+				evbuffer_drain(buf, n);
 				continue;
 			}
-			ntoread = evutil_strtoll(p, &endp, 16);
-			error = (*p == '\0' ||
-			    (*endp != '\0' && *endp != ' ') ||
-			    ntoread < 0);
-			mm_free(p);
-			if (error) {
+			ntoread = evhttp_parse_chunk_size(line, linelen);
+			evbuffer_drain(buf, n);
+			if (ntoread < 0) {
 				/* could not get chunk size */
 				return (DATA_CORRUPTED);
 			}
@@ -764,26 +1051,23 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 				/* Last chunk */
 				return (ALL_DATA_READ);
 			}
+			req->evcon->body_size += ntoread;
+			if (evhttp_body_too_long(req->evcon))
+				return (DATA_TOO_LONG);
 			continue;
 		}
 
-		/* don't have enough to complete a chunk; wait for more */
-		if (len < req->ntoread)
-			return (MORE_DATA_EXPECTED);
-
-		/* Completed chunk */
-		/* XXXX fixme: what if req->ntoread is > SIZE_T_MAX? */
-		evbuffer_remove_buffer(buf, req->input_buffer, (size_t)req->ntoread);
-		req->ntoread = -1;
-		if (req->chunk_cb != NULL) {
-			req->flags |= EVHTTP_REQ_DEFER_FREE;
-			(*req->chunk_cb)(req, req->cb_arg);
-			evbuffer_drain(req->input_buffer,
-			    evbuffer_get_length(req->input_buffer));
-			req->flags &= ~EVHTTP_REQ_DEFER_FREE;
-			if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
-				return (REQUEST_CANCELED);
-			}
+		if ((ev_int64_t)len > req->ntoread)
+			len = (size_t)req->ntoread;
+		status = evhttp_deliver_body(req, buf, len, &moved);
+		req->ntoread -= moved;
+		if (req->ntoread == 0)
+			req->ntoread = -1;
+		if (status != MORE_DATA_EXPECTED)
+			return (status);
+		if (moved < len) {
+			/* the user paused us */
+			break;
 		}
 	}
 
@@ -793,12 +1077,13 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 static void
 evhttp_read_trailer(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
-	struct evbuffer *buf = bufferevent_get_input(evcon->bufev);
-
-	switch (evhttp_parse_headers(req, buf)) {
+	switch (evhttp_parse_limited(evcon, req, evhttp_parse_headers)) {
 	case DATA_CORRUPTED:
 		evhttp_connection_fail(evcon, EVCON_HTTP_INVALID_HEADER);
 		break;
+	case DATA_TOO_LONG:
+		evhttp_connection_fail(evcon, EVCON_HTTP_HEADERS_TOO_LARGE);
+		break;
 	case ALL_DATA_READ:
 		bufferevent_disable(evcon->bufev, EV_READ);
 		evhttp_connection_done(evcon);
@@ -816,6 +1101,10 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	struct evbuffer *buf = bufferevent_get_input(evcon->bufev);
 
+	/* whatever is in buf waits there until the user resumes us */
+	if (evcon->read_paused)
+		return;
+
 	if (req->chunked) {
 		switch (evhttp_handle_chunked_read(req, buf)) {
 		case ALL_DATA_READ:
@@ -828,6 +1117,10 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 			evhttp_connection_fail(evcon,
 			    EVCON_HTTP_INVALID_HEADER);
 			return;
+		case DATA_TOO_LONG:
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_BODY_TOO_LARGE);
+			return;
 		case REQUEST_CANCELED:
 			/* request canceled */
 			evhttp_request_free(req);
@@ -838,25 +1131,27 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		}
 	} else if (req->ntoread < 0) {
 		/* Read until connection close. */
+		evcon->body_size += evbuffer_get_length(buf);
+		if (evhttp_body_too_long(evcon)) {
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_BODY_TOO_LARGE);
+			return;
+		}
 		evbuffer_add_buffer(req->input_buffer, buf);
 	} else if (req->chunk_cb != NULL ||
 	    evbuffer_get_length(buf) >= req->ntoread) {
 		/* We've postponed moving the data until now, but we're
-		 * about to use it. */
-		req->ntoread -= evbuffer_get_length(buf);
-		evbuffer_add_buffer(req->input_buffer, buf);
-	}
-
-	if (evbuffer_get_length(req->input_buffer) > 0 && req->chunk_cb != NULL) {
-		req->flags |= EVHTTP_REQ_DEFER_FREE;
-		(*req->chunk_cb)(req, req->cb_arg);
-		req->flags &= ~EVHTTP_REQ_DEFER_FREE;
-		evbuffer_drain(req->input_buffer,
-		    evbuffer_get_length(req->input_buffer));
-		if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
+		 * about to use it.  Anything past the body belongs to the
+		 * next pipelined response. */
+		size_t n = evbuffer_get_length(buf), moved;
+		if ((ev_int64_t)n > req->ntoread)
+			n = (size_t)req->ntoread;
+		if (evhttp_deliver_body(req, buf, n, &moved) ==
+		    REQUEST_CANCELED) {
 			evhttp_request_free(req);
 			return;
 		}
+		req->ntoread -= moved;
 	}
 
 	if (req->ntoread == 0) {
@@ -867,7 +1162,8 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	/* Read more! */
-	bufferevent_enable(evcon->bufev, EV_READ);
+	if (!evcon->read_paused)
+		bufferevent_enable(evcon->bufev, EV_READ);
 }
 
 /*
@@ -882,6 +1178,17 @@ evhttp_read_cb(struct bufferevent *bufev, void *arg)
 
 	switch (evcon->state) {
 	case EVCON_READING_FIRSTLINE:
+		if (evcon->server_idle) {
+			/* the next request is arriving */
+			evhttp_connection_server_busy(evcon);
+			if (evcon->timeout != -1)
+				evhttp_connection_set_timeout(evcon,
+				    evcon->timeout);
+		}
+		if (evcon->http_server != NULL &&
+		    evcon->http_server->stats_enabled &&
+		    !evutil_timerisset(&evcon->stats_start))
+			evhttp_stats_start(evcon);
 		evhttp_read_firstline(evcon, req);
 		/* note the request may have been freed in
 		 * evhttp_read_body */
@@ -939,19 +1246,40 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 			(*evcon->closecb)(evcon, evcon->closecb_arg);
 	}
 
+	/* stop streaming into a response that can't be sent any more */
+	if (evcon->proxy != NULL)
+		evhttp_proxy_client_gone(evcon->proxy);
+
 	/* remove all requests that might be queued on this connection */
 	while ((req = TAILQ_FIRST(&evcon->requests)) != NULL) {
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		evhttp_request_free(req);
 	}
-
-	if (evcon->http_server != NULL) {
+	if (evcon->spare_req != NULL)
+		evhttp_request_free(evcon->spare_req);
+
+	if (evcon->pool_host != NULL) {
+		evhttp_pool_remove_connection(evcon);
+	} else if (evcon->http_worker != NULL) {
+		evhttp_connection_server_busy(evcon);
+		--evcon->http_worker->idle.n_connections;
+		TAILQ_REMOVE(&evcon->http_worker->connections, evcon, next);
+	} else if (evcon->http_server != NULL) {
 		struct evhttp *http = evcon->http_server;
+		evhttp_connection_server_busy(evcon);
+		--http->idle.n_connections;
 		TAILQ_REMOVE(&http->connections, evcon, next);
 	}
 
 	if (event_initialized(&evcon->retry_ev))
 		event_del(&evcon->retry_ev);
+	if (event_initialized(&evcon->read_more_ev))
+		event_del(&evcon->read_more_ev);
+
+	if (evcon->resolving != NULL)
+		evdns_getaddrinfo_cancel(evcon->resolving);
+
+	evhttp_compressor_free(evcon);
 
 	if (evcon->bufev != NULL)
 		bufferevent_free(evcon->bufev);
@@ -987,6 +1315,92 @@ evhttp_connection_set_local_port(struct evhttp_connection *evcon,
 	evcon->bind_port = port;
 }
 
+void
+evhttp_connection_set_dns_base(struct evhttp_connection *evcon,
+    struct evdns_base *dns_base)
+{
+	assert(evcon->state == EVCON_DISCONNECTED);
+	evcon->dns_base = dns_base;
+}
+
+static void
+evhttp_read_more_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	struct evbuffer *input = bufferevent_get_input(evcon->bufev);
+
+	if ((evcon->state == EVCON_READING_FIRSTLINE ||
+		evcon->state == EVCON_READING_BODY) &&
+	    TAILQ_FIRST(&evcon->requests) != NULL &&
+	    evbuffer_get_length(input) > 0)
+		evhttp_read_cb(evcon->bufev, evcon);
+}
+
+/* Parse whatever is in evcon's input buffer from the loop, since no read
+ * callback is coming for it. */
+static void
+evhttp_connection_read_more(struct evhttp_connection *evcon)
+{
+	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev)) > 0) {
+		if (!event_initialized(&evcon->read_more_ev))
+			event_assign(&evcon->read_more_ev, evcon->base, -1, 0,
+			    evhttp_read_more_cb, evcon);
+		event_active(&evcon->read_more_ev, EV_READ, 1);
+	}
+}
+
+/* We're done with one response on a pipelined connection, and more are on
+ * the way. */
+static void
+evhttp_connection_read_next(struct evhttp_connection *evcon)
+{
+	evcon->state = EVCON_READING_FIRSTLINE;
+	bufferevent_enable(evcon->bufev, EV_READ);
+
+	/* The next response may have come in with the last one; we parse it
+	 * once the callback for the last one has run. */
+	evhttp_connection_read_more(evcon);
+
+	evhttp_request_dispatch(evcon);
+}
+
+/* Send as many of the queued requests as the pipeline depth allows,
+ * without waiting for any responses. */
+static void
+evhttp_request_dispatch_pipelined(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	int i;
+
+	/* skip the ones we've sent */
+	for (i = 0; req != NULL && i < evcon->n_in_flight; ++i) {
+		if (!evhttp_request_can_pipeline(req))
+			return;
+		req = TAILQ_NEXT(req, next);
+	}
+	if (req == NULL || evcon->n_in_flight >= evcon->pipeline_depth)
+		return;
+
+	if (evcon->flags & EVHTTP_CON_CLOSEDETECT) {
+		evcon->flags &= ~EVHTTP_CON_CLOSEDETECT;
+		evhttp_connection_stop_detectclose(evcon);
+	}
+
+	for (; req != NULL && evcon->n_in_flight < evcon->pipeline_depth;
+	     req = TAILQ_NEXT(req, next)) {
+		evhttp_make_header(evcon, req);
+		req->kind = EVHTTP_RESPONSE;
+		++evcon->n_in_flight;
+		if (!evhttp_request_can_pipeline(req))
+			break;
+	}
+
+	if (evcon->state == EVCON_IDLE)
+		evcon->state = EVCON_READING_FIRSTLINE;
+	evcon->cb = NULL;
+	bufferevent_enable(evcon->bufev, EV_READ|EV_WRITE);
+}
+
 static void
 evhttp_request_dispatch(struct evhttp_connection* evcon)
 {
@@ -996,6 +1410,11 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 	if (req == NULL)
 		return;
 
+	if (evcon->pipeline_depth > 1) {
+		evhttp_request_dispatch_pipelined(evcon);
+		return;
+	}
+
 	/* delete possible close detection events */
 	evhttp_connection_stop_detectclose(evcon);
 
@@ -1003,6 +1422,7 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 	assert(evcon->state == EVCON_IDLE);
 
 	evcon->state = EVCON_WRITING;
+	evcon->n_in_flight = 1;
 
 	/* Create the header from the store arguments */
 	evhttp_make_header(evcon, req);
@@ -1018,6 +1438,11 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 
 	bufferevent_disable(evcon->bufev, EV_READ|EV_WRITE);
 
+	if (evcon->resolving != NULL) {
+		evdns_getaddrinfo_cancel(evcon->resolving);
+		evcon->resolving = NULL;
+	}
+
 	if (evcon->fd != -1) {
 		/* inform interested parties about connection close */
 		if (evhttp_connected(evcon) && evcon->closecb != NULL)
@@ -1033,6 +1458,14 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 	tmp = bufferevent_get_input(evcon->bufev);
 	evbuffer_drain(tmp, evbuffer_get_length(tmp));
 
+	evhttp_compressor_free(evcon);
+
+	/* whatever we sent is lost; it gets sent again if it's sent at all */
+	evcon->n_in_flight = 0;
+	evcon->read_paused = 0;
+	if (event_initialized(&evcon->read_more_ev))
+		event_del(&evcon->read_more_ev);
+
 	evcon->state = EVCON_DISCONNECTED;
 }
 
@@ -1132,6 +1565,7 @@ evhttp_error_cb(struct bufferevent *bufev, short what, void *arg)
 		 */
 		assert(evcon->state == EVCON_IDLE);
 		evhttp_connection_reset(evcon);
+		evhttp_pool_connection_idle(evcon);
 		return;
 	}
 
@@ -1218,177 +1652,460 @@ evhttp_valid_response_code(int code)
 
 /* Parses the status line of a web server */
 
+/* Return true iff the len bytes at s are the string lit. */
+#define EVHTTP_TOKEN_IS(s, len, lit) \
+	((len) == sizeof(lit) - 1 && !memcmp((s), (lit), sizeof(lit) - 1))
+
 static int
-evhttp_parse_response_line(struct evhttp_request *req, char *line)
+evhttp_parse_http_version(struct evhttp_request *req, const char *version,
+    size_t len)
 {
-	char *protocol;
-	char *number;
-	char *readable;
-
-	protocol = strsep(&line, " ");
-	if (line == NULL)
-		return (-1);
-	number = strsep(&line, " ");
-	if (line == NULL)
-		return (-1);
-	readable = line;
-
-	if (strcmp(protocol, "HTTP/1.0") == 0) {
+	if (EVHTTP_TOKEN_IS(version, len, "HTTP/1.0")) {
 		req->major = 1;
 		req->minor = 0;
-	} else if (strcmp(protocol, "HTTP/1.1") == 0) {
+	} else if (EVHTTP_TOKEN_IS(version, len, "HTTP/1.1")) {
 		req->major = 1;
 		req->minor = 1;
 	} else {
-		event_debug(("%s: bad protocol \"%s\"",
-			__func__, protocol));
+		return (-1);
+	}
+	return (0);
+}
+
+/* Parse the len bytes at line, which are not NUL-terminated. */
+static int
+evhttp_parse_response_line(struct evhttp_request *req, const char *line,
+    size_t len)
+{
+	const char *end = line + len;
+	const char *number, *readable;
+	char code[16];
+
+	if ((number = memchr(line, ' ', len)) == NULL)
+		return (-1);
+	++number;
+	if ((readable = memchr(number, ' ', end - number)) == NULL)
+		return (-1);
+	++readable;
+
+	if (evhttp_parse_http_version(req, line, number - 1 - line) == -1) {
+		event_debug(("%s: bad protocol \"%.*s\"",
+			__func__, (int)(number - 1 - line), line));
 		return (-1);
 	}
 
-	req->response_code = atoi(number);
+	if ((size_t)(readable - number) > sizeof(code))
+		return (-1);
+	memcpy(code, number, readable - 1 - number);
+	code[readable - 1 - number] = '\0';
+	req->response_code = atoi(code);
 	if (!evhttp_valid_response_code(req->response_code)) {
 		event_debug(("%s: bad response code \"%s\"",
-			__func__, number));
+			__func__, code));
 		return (-1);
 	}
 
-	if ((req->response_code_line = mm_strdup(readable)) == NULL)
-		event_err(1, "%s: strdup", __func__);
+	if ((req->response_code_line = mm_malloc(end - readable + 1)) == NULL)
+		event_err(1, "%s: malloc", __func__);
+	memcpy(req->response_code_line, readable, end - readable);
+	req->response_code_line[end - readable] = '\0';
 
 	return (0);
 }
 
-/* Parse the first line of a HTTP request */
-
+/* Parse the len bytes at line, which are not NUL-terminated. */
 static int
-evhttp_parse_request_line(struct evhttp_request *req, char *line)
+evhttp_parse_request_line(struct evhttp_request *req, const char *line,
+    size_t len)
 {
-	char *method;
-	char *uri;
-	char *version;
+	const char *end = line + len;
+	const char *uri, *version;
+	size_t method_len, uri_len;
 
 	/* Parse the request line */
-	method = strsep(&line, " ");
-	if (line == NULL)
+	if ((uri = memchr(line, ' ', len)) == NULL)
 		return (-1);
-	uri = strsep(&line, " ");
-	if (line == NULL)
+	method_len = uri++ - line;
+	if ((version = memchr(uri, ' ', end - uri)) == NULL)
 		return (-1);
-	version = strsep(&line, " ");
-	if (line != NULL)
+	uri_len = version++ - uri;
+	if (memchr(version, ' ', end - version) != NULL)
 		return (-1);
 
 	/* First line */
-	if (strcmp(method, "GET") == 0) {
+	if (EVHTTP_TOKEN_IS(line, method_len, "GET")) {
 		req->type = EVHTTP_REQ_GET;
-	} else if (strcmp(method, "POST") == 0) {
+	} else if (EVHTTP_TOKEN_IS(line, method_len, "POST")) {
 		req->type = EVHTTP_REQ_POST;
-	} else if (strcmp(method, "HEAD") == 0) {
+	} else if (EVHTTP_TOKEN_IS(line, method_len, "HEAD")) {
 		req->type = EVHTTP_REQ_HEAD;
-	} else if (strcmp(method, "PUT") == 0) {
-                req->type = EVHTTP_REQ_PUT;
-	} else if (strcmp(method, "DELETE") == 0) {
-                req->type = EVHTTP_REQ_DELETE;
+	} else if (EVHTTP_TOKEN_IS(line, method_len, "PUT")) {
+		req->type = EVHTTP_REQ_PUT;
+	} else if (EVHTTP_TOKEN_IS(line, method_len, "DELETE")) {
+		req->type = EVHTTP_REQ_DELETE;
 	} else {
-		event_debug(("%s: bad method %s on request %p from %s",
-			__func__, method, req, req->remote_host));
+		event_debug(("%s: bad method %.*s on request %p from %s",
+			__func__, (int)method_len, line, req,
+			req->remote_host));
 		return (-1);
 	}
 
-	if (strcmp(version, "HTTP/1.0") == 0) {
-		req->major = 1;
-		req->minor = 0;
-	} else if (strcmp(version, "HTTP/1.1") == 0) {
-		req->major = 1;
-		req->minor = 1;
-	} else {
-		event_debug(("%s: bad version %s on request %p from %s",
-			__func__, version, req, req->remote_host));
+	if (evhttp_parse_http_version(req, version, end - version) == -1) {
+		event_debug(("%s: bad version %.*s on request %p from %s",
+			__func__, (int)(end - version), version, req,
+			req->remote_host));
 		return (-1);
 	}
 
-	if ((req->uri = mm_strdup(uri)) == NULL) {
-		event_debug(("%s: evhttp_decode_uri", __func__));
+	if ((req->uri = mm_malloc(uri_len + 1)) == NULL) {
+		event_debug(("%s: malloc", __func__));
 		return (-1);
 	}
+	memcpy(req->uri, uri, uri_len);
+	req->uri[uri_len] = '\0';
 
 	/* determine if it's a proxy request */
-	if (strlen(req->uri) > 0 && req->uri[0] != '/')
+	if (uri_len > 0 && req->uri[0] != '/')
 		req->flags |= EVHTTP_PROXY_REQUEST;
 
 	return (0);
 }
 
-const char *
-evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+/* A hash of s that ignores case. */
+static inline unsigned
+evhttp_strcasehash(const char *s)
 {
-	struct evkeyval *header;
-
-	TAILQ_FOREACH(header, headers, next) {
-		if (evutil_strcasecmp(header->key, key) == 0)
-			return (header->value);
+	const unsigned char *cp = (const unsigned char *)s;
+	unsigned h = (unsigned char)EVUTIL_TOLOWER(*cp) << 7;
+	while (*cp) {
+		h = (1000003*h) ^ (unsigned char)EVUTIL_TOLOWER(*cp);
+		++cp;
 	}
+	h ^= (unsigned)(cp - (const unsigned char *)s);
+	return h;
+}
 
-	return (NULL);
+#define EVHTTP_HEADER(p) EVUTIL_UPCAST((p), struct evhttp_header, kv)
+
+/* Return the store that holds req's input headers. */
+static inline struct evhttp_header_store *
+evhttp_request_header_store(const struct evhttp_request *req)
+{
+	return EVUTIL_UPCAST(req->input_headers, struct evhttp_header_store,
+	    headers);
 }
 
-void
-evhttp_clear_headers(struct evkeyvalq *headers)
+#define EVHTTP_HEADER_CHUNK_SIZE 2048
+#define EVHTTP_HEADER_ALIGN(n) \
+	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/* Carve len bytes out of store's chunks, adding a chunk if need be. */
+static void *
+evhttp_header_store_alloc(struct evhttp_header_store *store, size_t len)
 {
-	struct evkeyval *header;
+	struct evhttp_header_chunk *chunk = store->chunks;
+	size_t size = EVHTTP_HEADER_CHUNK_SIZE - sizeof(*chunk);
+	void *result;
+
+	len = EVHTTP_HEADER_ALIGN(len);
+	if (chunk != NULL && chunk->size - chunk->used >= len) {
+		result = (char *)(chunk + 1) + chunk->used;
+		chunk->used += len;
+		return (result);
+	}
 
-	for (header = TAILQ_FIRST(headers);
-	    header != NULL;
-	    header = TAILQ_FIRST(headers)) {
-		TAILQ_REMOVE(headers, header, next);
-		mm_free(header->key);
-		mm_free(header->value);
-		mm_free(header);
+	if (size < len)
+		size = len;
+	if ((chunk = mm_malloc(sizeof(*chunk) + size)) == NULL)
+		return (NULL);
+	chunk->size = size;
+	chunk->used = len;
+	if (len > EVHTTP_HEADER_CHUNK_SIZE / 2 && store->chunks != NULL) {
+		/* Keep allocating from the chunk we had. */
+		chunk->next = store->chunks->next;
+		store->chunks->next = chunk;
+	} else {
+		chunk->next = store->chunks;
+		store->chunks = chunk;
 	}
+	return (chunk + 1);
 }
 
-/*
- * Returns 0,  if the header was successfully removed.
- * Returns -1, if the header could not be found.
- */
-
-int
-evhttp_remove_header(struct evkeyvalq *headers, const char *key)
+/* Return the slot in store's index that holds the header named key, or
+ * the empty slot where it would go. */
+static struct evhttp_header **
+evhttp_header_index_slot(struct evhttp_header_store *store,
+    const char *key, unsigned hash)
 {
-	struct evkeyval *header;
+	unsigned i = hash & (EVHTTP_HEADER_INDEX_SIZE - 1);
+	struct evhttp_header *header;
 
-	TAILQ_FOREACH(header, headers, next) {
-		if (evutil_strcasecmp(header->key, key) == 0)
+	while ((header = store->index[i]) != NULL) {
+		if (header->hash == hash &&
+		    !evutil_strcasecmp(header->kv.key, key))
 			break;
+		i = (i + 1) & (EVHTTP_HEADER_INDEX_SIZE - 1);
 	}
+	return (&store->index[i]);
+}
 
-	if (header == NULL)
-		return (-1);
+static void
+evhttp_header_index_add(struct evhttp_header_store *store,
+    struct evhttp_header *header)
+{
+	struct evhttp_header **slot =
+	    evhttp_header_index_slot(store, header->kv.key, header->hash);
+
+	/* An earlier header with this name wins. */
+	if (*slot != NULL)
+		return;
+	/* Leave some slots empty so that probes stay short and end. */
+	if (store->n_indexed >= EVHTTP_HEADER_INDEX_SIZE * 3 / 4) {
+		store->index_overflow = 1;
+		return;
+	}
+	*slot = header;
+	++store->n_indexed;
+}
+
+static void
+evhttp_header_index_rebuild(struct evhttp_header_store *store)
+{
+	struct evkeyval *kv;
+
+	memset(store->index, 0, sizeof(store->index));
+	store->n_indexed = 0;
+	store->index_overflow = 0;
+	store->last = NULL;
+	TAILQ_FOREACH(kv, &store->headers, next) {
+		struct evhttp_header *header = EVHTTP_HEADER(kv);
+		if (header->store == store) {
+			evhttp_header_index_add(store, header);
+			store->last = header;
+		} else {
+			store->index_overflow = 1;
+		}
+	}
+}
+
+/* Forget all of store's headers and free its chunks. */
+static void
+evhttp_header_store_clear(struct evhttp_header_store *store)
+{
+	struct evhttp_header_chunk *chunk;
+
+	while ((chunk = store->chunks) != NULL) {
+		store->chunks = chunk->next;
+		mm_free(chunk);
+	}
+	TAILQ_INIT(&store->headers);
+	memset(store->index, 0, sizeof(store->index));
+	store->n_indexed = 0;
+	store->index_overflow = 0;
+	store->last = NULL;
+}
+
+/* As evhttp_header_store_clear, but keep a chunk to allocate the next
+ * request's headers from, and start counting them again. */
+static void
+evhttp_header_store_reset(struct evhttp_header_store *store)
+{
+	struct evhttp_header_chunk *chunk, *keep = NULL;
+
+	while ((chunk = store->chunks) != NULL) {
+		store->chunks = chunk->next;
+		if (keep == NULL && chunk->size ==
+		    EVHTTP_HEADER_CHUNK_SIZE - sizeof(*chunk))
+			keep = chunk;
+		else
+			mm_free(chunk);
+	}
+	if (keep != NULL) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+	store->chunks = keep;
+	TAILQ_INIT(&store->headers);
+	memset(store->index, 0, sizeof(store->index));
+	store->n_indexed = 0;
+	store->index_overflow = 0;
+	store->last = NULL;
+	store->scan_off = 0;
+	store->headers_size = 0;
+	store->n_headers = 0;
+}
+
+/* Add a header made from key_len bytes of key and value_len bytes of value
+ * to the end of headers, allocating it from store unless store is NULL. */
+static struct evhttp_header *
+evhttp_header_append(struct evkeyvalq *headers,
+    struct evhttp_header_store *store,
+    const char *key, size_t key_len, const char *value, size_t value_len)
+{
+	struct evhttp_header *header;
+
+	if (store != NULL) {
+		header = evhttp_header_store_alloc(store,
+		    sizeof(*header) + key_len + value_len + 2);
+		if (header == NULL)
+			return (NULL);
+		header->kv.key = (char *)(header + 1);
+		header->kv.value = header->kv.key + key_len + 1;
+	} else {
+		if ((header = mm_malloc(sizeof(*header))) == NULL)
+			return (NULL);
+		header->kv.key = mm_malloc(key_len + 1);
+		header->kv.value = mm_malloc(value_len + 1);
+		if (header->kv.key == NULL || header->kv.value == NULL) {
+			if (header->kv.key != NULL)
+				mm_free(header->kv.key);
+			if (header->kv.value != NULL)
+				mm_free(header->kv.value);
+			mm_free(header);
+			return (NULL);
+		}
+	}
+	memcpy(header->kv.key, key, key_len);
+	header->kv.key[key_len] = '\0';
+	memcpy(header->kv.value, value, value_len);
+	header->kv.value[value_len] = '\0';
+	header->store = store;
+
+	if (store != NULL) {
+		/* Headers that aren't ours may have gone on since the last
+		 * one we added. */
+		if (TAILQ_LAST(headers, evkeyvalq) !=
+		    (store->last != NULL ? &store->last->kv : NULL))
+			store->index_overflow = 1;
+		header->hash = evhttp_strcasehash(header->kv.key);
+		evhttp_header_index_add(store, header);
+		store->last = header;
+	}
+	TAILQ_INSERT_TAIL(headers, &header->kv, next);
+
+	return (header);
+}
+
+const char *
+evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+{
+	struct evkeyval *header;
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (evutil_strcasecmp(header->key, key) == 0)
+			return (header->value);
+	}
+
+	return (NULL);
+}
+
+/* As evhttp_find_header on req's input headers, but through the index of
+ * its header store when the index is known to cover them all. */
+static const char *
+evhttp_find_input_header(const struct evhttp_request *req, const char *key)
+{
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+	struct evhttp_header *found;
+
+	found = *evhttp_header_index_slot(store, key, evhttp_strcasehash(key));
+	if (found != NULL)
+		return (found->kv.value);
+	if (!store->index_overflow && TAILQ_LAST(&store->headers, evkeyvalq) ==
+	    (store->last != NULL ? &store->last->kv : NULL))
+		return (NULL);
+	return (evhttp_find_header(&store->headers, key));
+}
+
+/* Remove and free every header in headers that isn't in a header store.
+ * Returns the store that holds the rest, if any. */
+static struct evhttp_header_store *
+evhttp_clear_unstored_headers(struct evkeyvalq *headers)
+{
+	struct evhttp_header_store *store = NULL;
+	struct evkeyval *header, *next;
+
+	for (header = TAILQ_FIRST(headers); header != NULL; header = next) {
+		next = TAILQ_NEXT(header, next);
+		if (EVHTTP_HEADER(header)->store != NULL) {
+			store = EVHTTP_HEADER(header)->store;
+			continue;
+		}
+		TAILQ_REMOVE(headers, header, next);
+		mm_free(header->key);
+		mm_free(header->value);
+		mm_free(EVHTTP_HEADER(header));
+	}
+	return (store);
+}
+
+void
+evhttp_clear_headers(struct evkeyvalq *headers)
+{
+	struct evhttp_header_store *store;
+
+	if ((store = evhttp_clear_unstored_headers(headers)) != NULL)
+		evhttp_header_store_clear(store);
+}
+
+/*
+ * Returns 0,  if the header was successfully removed.
+ * Returns -1, if the header could not be found.
+ */
+
+int
+evhttp_remove_header(struct evkeyvalq *headers, const char *key)
+{
+	struct evhttp_header_store *store;
+	struct evkeyval *header;
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (evutil_strcasecmp(header->key, key) == 0)
+			break;
+	}
+
+	if (header == NULL)
+		return (-1);
 
 	/* Free and remove the header that we found */
 	TAILQ_REMOVE(headers, header, next);
+	if ((store = EVHTTP_HEADER(header)->store) != NULL) {
+		/* Its storage goes when the rest of the store does. */
+		evhttp_header_index_rebuild(store);
+		return (0);
+	}
 	mm_free(header->key);
 	mm_free(header->value);
-	mm_free(header);
+	mm_free(EVHTTP_HEADER(header));
 
 	return (0);
 }
 
+/* Return true iff every CR or LF in the len bytes at value starts a
+ * continuation line. */
 static int
-evhttp_header_is_valid_value(const char *value)
+evhttp_header_is_valid_value_len(const char *value, size_t len)
 {
-	const char *p = value;
+	const char *p, *end = value + len;
 
-	while ((p = strpbrk(p, "\r\n")) != NULL) {
+	for (p = value; p < end; ++p) {
+		if (*p != '\r' && *p != '\n')
+			continue;
 		/* we really expect only one new line */
-		p += strspn(p, "\r\n");
+		while (p < end && (*p == '\r' || *p == '\n'))
+			++p;
 		/* we expect a space or tab for continuation */
-		if (*p != ' ' && *p != '\t')
+		if (p == end || (*p != ' ' && *p != '\t'))
 			return (0);
 	}
 	return (1);
 }
 
+static int
+evhttp_header_is_valid_value(const char *value)
+{
+	return evhttp_header_is_valid_value_len(value, strlen(value));
+}
+
 int
 evhttp_add_header(struct evkeyvalq *headers,
     const char *key, const char *value)
@@ -1413,24 +2130,11 @@ static int
 evhttp_add_header_internal(struct evkeyvalq *headers,
     const char *key, const char *value)
 {
-	struct evkeyval *header = mm_calloc(1, sizeof(struct evkeyval));
-	if (header == NULL) {
-		event_warn("%s: calloc", __func__);
+	if (evhttp_header_append(headers, NULL,
+		key, strlen(key), value, strlen(value)) == NULL) {
+		event_warn("%s: malloc", __func__);
 		return (-1);
 	}
-	if ((header->key = mm_strdup(key)) == NULL) {
-		mm_free(header);
-		event_warn("%s: strdup", __func__);
-		return (-1);
-	}
-	if ((header->value = mm_strdup(value)) == NULL) {
-		mm_free(header->key);
-		mm_free(header);
-		event_warn("%s: strdup", __func__);
-		return (-1);
-	}
-
-	TAILQ_INSERT_TAIL(headers, header, next);
 
 	return (0);
 }
@@ -1445,111 +2149,183 @@ evhttp_add_header_internal(struct evkeyvalq *headers,
  *   ALL_DATA_READ       when all headers have been read.
  */
 
+/*
+ * Return the length, including the LF, of the first line in buffer; or -1
+ * if it isn't all there yet.  Lines are parsed where they sit in the buffer
+ * and drained once we're done with them.  The search resumes where the last
+ * one for this request gave up, so a line that trickles in isn't scanned
+ * over and over.
+ */
+static ev_ssize_t
+evhttp_next_line(struct evhttp_request *req, struct evbuffer *buffer)
+{
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+	size_t len = evbuffer_get_length(buffer);
+	struct evbuffer_ptr ptr;
+
+	if (store->scan_off > len)
+		store->scan_off = 0;
+	if (evbuffer_ptr_set(buffer, &ptr, store->scan_off,
+		EVBUFFER_PTR_SET) == -1)
+		return (-1);
+	ptr = evbuffer_search(buffer, "\n", 1, &ptr);
+	if (ptr.pos < 0) {
+		store->scan_off = len;
+		return (-1);
+	}
+	store->scan_off = 0;
+	return (ptr.pos + 1);
+}
+
+/* Make the n bytes at the start of buffer contiguous and return them, with
+ * *lenp set to their length without the line ending. */
+static const char *
+evhttp_pullup_line(struct evbuffer *buffer, ev_ssize_t n, size_t *lenp)
+{
+	/* Lines tend to arrive in one chain, so this rarely copies. */
+	const char *line = (const char *)evbuffer_pullup(buffer, n);
+	size_t len = (size_t)n - 1;
+
+	if (line != NULL && len && line[len - 1] == '\r')
+		--len;
+	*lenp = len;
+	return (line);
+}
+
 enum message_read_status
 evhttp_parse_firstline(struct evhttp_request *req, struct evbuffer *buffer)
 {
-	char *line;
 	enum message_read_status status = ALL_DATA_READ;
+	const char *line;
+	ev_ssize_t n;
+	size_t len;
 
-	line = evbuffer_readln(buffer, NULL, EVBUFFER_EOL_CRLF);
-	if (line == NULL)
+	if ((n = evhttp_next_line(req, buffer)) == -1)
 		return (MORE_DATA_EXPECTED);
+	if ((line = evhttp_pullup_line(buffer, n, &len)) == NULL)
+		return (DATA_CORRUPTED);
 
 	switch (req->kind) {
 	case EVHTTP_REQUEST:
-		if (evhttp_parse_request_line(req, line) == -1)
+		if (evhttp_parse_request_line(req, line, len) == -1)
 			status = DATA_CORRUPTED;
 		break;
 	case EVHTTP_RESPONSE:
-		if (evhttp_parse_response_line(req, line) == -1)
+		if (evhttp_parse_response_line(req, line, len) == -1)
 			status = DATA_CORRUPTED;
 		break;
 	default:
 		status = DATA_CORRUPTED;
 	}
 
-	mm_free(line);
+	evbuffer_drain(buffer, n);
 	return (status);
 }
 
 static int
-evhttp_append_to_last_header(struct evkeyvalq *headers, const char *line)
+evhttp_append_to_last_header(struct evkeyvalq *headers, const char *line,
+    size_t line_len)
 {
 	struct evkeyval *header = TAILQ_LAST(headers, evkeyvalq);
+	struct evhttp_header_store *store;
 	char *newval;
-	size_t old_len, line_len;
+	size_t old_len;
 
 	if (header == NULL)
 		return (-1);
 
 	old_len = strlen(header->value);
-	line_len = strlen(line);
 
-	newval = mm_realloc(header->value, old_len + line_len + 1);
-	if (newval == NULL)
-		return (-1);
+	if ((store = EVHTTP_HEADER(header)->store) != NULL) {
+		newval = evhttp_header_store_alloc(store,
+		    old_len + line_len + 1);
+		if (newval == NULL)
+			return (-1);
+		memcpy(newval, header->value, old_len);
+	} else {
+		newval = mm_realloc(header->value, old_len + line_len + 1);
+		if (newval == NULL)
+			return (-1);
+	}
 
-	memcpy(newval + old_len, line, line_len + 1);
+	memcpy(newval + old_len, line, line_len);
+	newval[old_len + line_len] = '\0';
 	header->value = newval;
 
 	return (0);
 }
 
+/*
+ * Headers are copied straight out of the buffer into the request's header
+ * store, so that a typical request costs one allocation for all of them.
+ */
 enum message_read_status
 evhttp_parse_headers(struct evhttp_request *req, struct evbuffer* buffer)
 {
-	char *line;
 	enum message_read_status status = MORE_DATA_EXPECTED;
-
 	struct evkeyvalq* headers = req->input_headers;
-	while ((line = evbuffer_readln(buffer, NULL, EVBUFFER_EOL_CRLF))
-	       != NULL) {
-		char *skey, *svalue;
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+	ev_ssize_t n;
+
+	while ((n = evhttp_next_line(req, buffer)) != -1) {
+		const char *line, *colon, *value;
+		size_t len, key_len;
 
-		if (*line == '\0') { /* Last header - Done */
+		if ((line = evhttp_pullup_line(buffer, n, &len)) == NULL)
+			return (DATA_CORRUPTED);
+
+		if (len == 0) { /* Last header - Done */
 			status = ALL_DATA_READ;
-			mm_free(line);
+			evbuffer_drain(buffer, n);
 			break;
 		}
 
 		/* Check if this is a continuation line */
 		if (*line == ' ' || *line == '\t') {
-			if (evhttp_append_to_last_header(headers, line) == -1)
+			if (evhttp_append_to_last_header(headers, line,
+				len) == -1)
 				goto error;
-			mm_free(line);
+			evbuffer_drain(buffer, n);
 			continue;
 		}
 
 		/* Processing of header lines */
-		svalue = line;
-		skey = strsep(&svalue, ":");
-		if (svalue == NULL)
+		if ((colon = memchr(line, ':', len)) == NULL)
 			goto error;
+		key_len = colon - line;
+		value = colon + 1;
+		while (value < line + len && *value == ' ')
+			++value;
 
-		svalue += strspn(svalue, " ");
+		/* drop illegal headers */
+		if (memchr(line, '\r', key_len) != NULL ||
+		    !evhttp_header_is_valid_value_len(value,
+			line + len - value))
+			goto error;
 
-		if (evhttp_add_header(headers, skey, svalue) == -1)
+		if (evhttp_header_append(headers, store,
+			line, key_len, value, line + len - value) == NULL)
 			goto error;
+		++store->n_headers;
 
-		mm_free(line);
+		evbuffer_drain(buffer, n);
 	}
 
 	return (status);
 
  error:
-	mm_free(line);
+	evbuffer_drain(buffer, n);
 	return (DATA_CORRUPTED);
 }
 
 static int
 evhttp_get_body_length(struct evhttp_request *req)
 {
-	struct evkeyvalq *headers = req->input_headers;
 	const char *content_length;
 	const char *connection;
 
-	content_length = evhttp_find_header(headers, "Content-Length");
-	connection = evhttp_find_header(headers, "Connection");
+	content_length = evhttp_find_input_header(req, "Content-Length");
+	connection = evhttp_find_input_header(req, "Connection");
 
 	if (content_length == NULL && connection == NULL)
 		req->ntoread = -1;
@@ -1585,14 +2361,17 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	const char *xfer_enc;
 
+	evcon->body_size = 0;
 	/* If this is a request without a body, then we are done */
 	if (req->kind == EVHTTP_REQUEST &&
 	    (req->type != EVHTTP_REQ_POST && req->type != EVHTTP_REQ_PUT)) {
 		evhttp_connection_done(evcon);
 		return;
 	}
+	if (req->kind == EVHTTP_REQUEST)
+		evhttp_route_body(evcon, req);
 	evcon->state = EVCON_READING_BODY;
-	xfer_enc = evhttp_find_header(req->input_headers, "Transfer-Encoding");
+	xfer_enc = evhttp_find_input_header(req, "Transfer-Encoding");
 	if (xfer_enc != NULL && evutil_strcasecmp(xfer_enc, "chunked") == 0) {
 		req->chunked = 1;
 		req->ntoread = -1;
@@ -1602,19 +2381,63 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 			    EVCON_HTTP_INVALID_HEADER);
 			return;
 		}
+		/* turn it away before we read any of it */
+		if (req->ntoread > 0) {
+			evcon->body_size = req->ntoread;
+			if (evhttp_body_too_long(evcon)) {
+				evhttp_connection_fail(evcon,
+				    EVCON_HTTP_BODY_TOO_LARGE);
+				return;
+			}
+		}
 	}
 	evhttp_read_body(evcon, req);
 	/* note the request may have been freed in evhttp_read_body */
 }
 
+/* Parse the start of a request or response with parse(), and add what
+ * it used up to the size of req's headers.  Returns DATA_TOO_LONG once
+ * those headers, with whatever's buffered of the rest of them, are more
+ * than the server allows. */
+static enum message_read_status
+evhttp_parse_limited(struct evhttp_connection *evcon,
+    struct evhttp_request *req,
+    enum message_read_status (*parse)(struct evhttp_request *,
+	struct evbuffer *))
+{
+	struct evbuffer *input = bufferevent_get_input(evcon->bufev);
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+	struct evhttp *http = evcon->http_server;
+	size_t before = evbuffer_get_length(input), size;
+	enum message_read_status res;
+
+	res = (*parse)(req, input);
+	store->headers_size += before - evbuffer_get_length(input);
+	if (http == NULL || res == DATA_CORRUPTED)
+		return (res);
+
+	size = store->headers_size;
+	if (res == MORE_DATA_EXPECTED)
+		size += evbuffer_get_length(input);
+	if ((http->max_headers_size >= 0 &&
+		size > (size_t)http->max_headers_size) ||
+	    (http->max_header_count >= 0 &&
+		store->n_headers > http->max_header_count))
+		return (DATA_TOO_LONG);
+	return (res);
+}
+
 static void
 evhttp_read_firstline(struct evhttp_connection *evcon,
 		      struct evhttp_request *req)
 {
 	enum message_read_status res;
 
-	res = evhttp_parse_firstline(req, bufferevent_get_input(evcon->bufev));
-	if (res == DATA_CORRUPTED) {
+	res = evhttp_parse_limited(evcon, req, evhttp_parse_firstline);
+	if (res == DATA_TOO_LONG) {
+		evhttp_connection_fail(evcon, EVCON_HTTP_HEADERS_TOO_LARGE);
+		return;
+	} else if (res == DATA_CORRUPTED) {
 		/* Error while reading, terminate */
 		event_debug(("%s: bad header lines on %d\n",
 			__func__, evcon->fd));
@@ -1636,8 +2459,11 @@ evhttp_read_header(struct evhttp_connection *evcon,
 	enum message_read_status res;
 	int fd = evcon->fd;
 
-	res = evhttp_parse_headers(req, bufferevent_get_input(evcon->bufev));
-	if (res == DATA_CORRUPTED) {
+	res = evhttp_parse_limited(evcon, req, evhttp_parse_headers);
+	if (res == DATA_TOO_LONG) {
+		evhttp_connection_fail(evcon, EVCON_HTTP_HEADERS_TOO_LARGE);
+		return;
+	} else if (res == DATA_CORRUPTED) {
 		/* Error while reading, terminate */
 		event_debug(("%s: bad header lines on %d\n", __func__, fd));
 		evhttp_connection_fail(evcon, EVCON_HTTP_INVALID_HEADER);
@@ -1776,6 +2602,20 @@ evhttp_connection_set_retries(struct evhttp_connection *evcon,
 	evcon->retry_max = retry_max;
 }
 
+void
+evhttp_connection_set_chunk_delivery_size(struct evhttp_connection *evcon,
+    size_t size)
+{
+	evcon->chunk_delivery_size = size;
+}
+
+void
+evhttp_connection_set_pipeline_depth(struct evhttp_connection *evcon,
+    int depth)
+{
+	evcon->pipeline_depth = depth;
+}
+
 void
 evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *cbarg)
@@ -1792,96 +2632,691 @@ evhttp_connection_get_peer(struct evhttp_connection *evcon,
 	*port = evcon->port;
 }
 
-int
-evhttp_connection_connect(struct evhttp_connection *evcon)
+/*
+ * Keep-alive connection pools.
+ */
+
+static inline unsigned
+hash_evhttp_pool_host(struct evhttp_pool_host *host)
 {
-	if (evcon->state == EVCON_CONNECTING)
-		return (0);
+	return evhttp_strcasehash(host->address) ^ host->port;
+}
 
-	evhttp_connection_reset(evcon);
+static inline int
+eq_evhttp_pool_host(struct evhttp_pool_host *a, struct evhttp_pool_host *b)
+{
+	return a->port == b->port && !evutil_strcasecmp(a->address, b->address);
+}
 
-	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
-	evcon->flags |= EVHTTP_CON_OUTGOING;
+HT_PROTOTYPE(evhttp_pool_map, evhttp_pool_host, node, hash_evhttp_pool_host,
+    eq_evhttp_pool_host);
+HT_GENERATE(evhttp_pool_map, evhttp_pool_host, node, hash_evhttp_pool_host,
+    eq_evhttp_pool_host, 0.5, mm_malloc, mm_realloc, mm_free);
 
-	evcon->fd = bind_socket(
-		evcon->bind_address, evcon->bind_port, 0 /*reuse*/);
-	if (evcon->fd == -1) {
-		event_debug(("%s: failed to bind to \"%s\"",
-			__func__, evcon->bind_address));
-		return (-1);
-	}
+struct evhttp_pool *
+evhttp_pool_new(struct event_base *base)
+{
+	struct evhttp_pool *pool;
 
-	if (socket_connect(evcon->fd, evcon->address, evcon->port) == -1) {
-		event_sock_warn(evcon->fd, "%s: connection to \"%s\" failed",
-		    __func__, evcon->address);
-		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
-		return (-1);
+	if ((pool = mm_calloc(1, sizeof(struct evhttp_pool))) == NULL) {
+		event_warn("%s: calloc failed", __func__);
+		return (NULL);
 	}
 
-	/* Set up a callback for successful connection setup */
-	bufferevent_setfd(evcon->bufev, evcon->fd);
-	bufferevent_setcb(evcon->bufev,
-	    NULL /* evhttp_read_cb */,
-	    evhttp_connection_cb,
-	    evhttp_error_cb, evcon);
-	bufferevent_settimeout(evcon->bufev, 0,
-	    evcon->timeout != -1 ? evcon->timeout : HTTP_CONNECT_TIMEOUT);
-	/* make sure that we get a write callback */
-	bufferevent_enable(evcon->bufev, EV_WRITE);
+	pool->base = base;
+	HT_INIT(evhttp_pool_map, &pool->hosts);
+	TAILQ_INIT(&pool->idle);
+	pool->max_idle = HTTP_POOL_MAX_IDLE;
+	pool->max_per_host = HTTP_POOL_MAX_PER_HOST;
+	pool->idle_timeout = HTTP_POOL_IDLE_TIMEOUT;
 
-	evcon->state = EVCON_CONNECTING;
+	return (pool);
+}
 
-	return (0);
+void
+evhttp_pool_free(struct evhttp_pool *pool)
+{
+	struct evhttp_pool_host **hostp;
+	struct evhttp_connection *evcon;
+
+	/* freeing the last connection to a host frees the host too */
+	while ((hostp = HT_START(evhttp_pool_map, &pool->hosts)) != NULL) {
+		while ((evcon = TAILQ_FIRST(&(*hostp)->connections)) != NULL)
+			evhttp_connection_free(evcon);
+	}
+	HT_CLEAR(evhttp_pool_map, &pool->hosts);
+
+	mm_free(pool);
 }
 
-/*
- * Starts an HTTP request on the provided evhttp_connection object.
- * If the connection object is not connected to the web server already,
- * this will start the connection.
- */
+void
+evhttp_pool_set_max_idle(struct evhttp_pool *pool, int max_idle)
+{
+	pool->max_idle = max_idle;
+}
 
-int
-evhttp_make_request(struct evhttp_connection *evcon,
-    struct evhttp_request *req,
-    enum evhttp_cmd_type type, const char *uri)
+void
+evhttp_pool_set_max_per_host(struct evhttp_pool *pool, int max_per_host)
 {
-	/* We are making a request */
-	req->kind = EVHTTP_REQUEST;
-	req->type = type;
-	if (req->uri != NULL)
-		mm_free(req->uri);
-	if ((req->uri = mm_strdup(uri)) == NULL)
-		event_err(1, "%s: strdup", __func__);
+	pool->max_per_host = max_per_host;
+}
 
-	/* Set the protocol version if it is not supplied */
-	if (!req->major && !req->minor) {
-		req->major = 1;
-		req->minor = 1;
-	}
+void
+evhttp_pool_set_idle_timeout(struct evhttp_pool *pool, int timeout_in_secs)
+{
+	pool->idle_timeout = timeout_in_secs;
+}
 
-	assert(req->evcon == NULL);
-	req->evcon = evcon;
-	assert(!(req->flags & EVHTTP_REQ_OWN_CONNECTION));
+/* Take a pooled connection off the idle list, and cancel its expiry. */
+static void
+evhttp_pool_connection_busy(struct evhttp_connection *evcon)
+{
+	struct evhttp_pool *pool = evcon->pool_host->pool;
 
-	TAILQ_INSERT_TAIL(&evcon->requests, req, next);
+	if (evcon->pool_idle) {
+		TAILQ_REMOVE(&pool->idle, evcon, idle_next);
+		evcon->pool_idle = 0;
+		--pool->n_idle;
+	}
+	event_del(&evcon->idle_ev);
+}
 
-	/* If the connection object is not connected; make it so */
-	if (!evhttp_connected(evcon))
-		return (evhttp_connection_connect(evcon));
+/* Close a pooled connection from the event loop.  We may be in one of its
+ * bufferevent's callbacks, so we can't free it right here. */
+static void
+evhttp_pool_connection_expire(struct evhttp_connection *evcon)
+{
+	evhttp_pool_connection_busy(evcon);
+	event_active(&evcon->idle_ev, EV_TIMEOUT, 1);
+}
 
-	/*
-	 * If it's connected already and we are the first in the queue,
-	 * then we can dispatch this request immediately.  Otherwise, it
-	 * will be dispatched once the pending requests are completed.
-	 */
-	if (TAILQ_FIRST(&evcon->requests) == req)
-		evhttp_request_dispatch(evcon);
+static void
+evhttp_pool_idle_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
 
-	return (0);
+	if (TAILQ_FIRST(&evcon->requests) == NULL)
+		evhttp_connection_free(evcon);
 }
 
-void
-evhttp_cancel_request(struct evhttp_request *req)
+/* Called when a connection runs out of requests.  If it's pooled and still
+ * open, keep it for the next request to its host; otherwise drop it. */
+static void
+evhttp_pool_connection_idle(struct evhttp_connection *evcon)
+{
+	struct evhttp_pool *pool;
+	struct timeval tv;
+
+	if (evcon->pool_host == NULL)
+		return;
+	pool = evcon->pool_host->pool;
+
+	if (evcon->state != EVCON_IDLE) {
+		evhttp_pool_connection_expire(evcon);
+		return;
+	}
+
+	evhttp_pool_connection_busy(evcon);
+	TAILQ_INSERT_TAIL(&pool->idle, evcon, idle_next);
+	evcon->pool_idle = 1;
+	++pool->n_idle;
+
+	evutil_timerclear(&tv);
+	tv.tv_sec = pool->idle_timeout;
+	event_add(&evcon->idle_ev, &tv);
+
+	if (pool->n_idle > pool->max_idle)
+		evhttp_pool_connection_expire(TAILQ_FIRST(&pool->idle));
+}
+
+static void
+evhttp_pool_remove_connection(struct evhttp_connection *evcon)
+{
+	struct evhttp_pool_host *host = evcon->pool_host;
+
+	evhttp_pool_connection_busy(evcon);
+	TAILQ_REMOVE(&host->connections, evcon, pool_next);
+	evcon->pool_host = NULL;
+
+	if (--host->n_connections == 0) {
+		HT_REMOVE(evhttp_pool_map, &host->pool->hosts, host);
+		mm_free(host->address);
+		mm_free(host);
+	}
+}
+
+/* How busy a pooled connection is: two for every request queued on it, and
+ * one more if it has to connect first.  We stop counting at max. */
+static int
+evhttp_pool_connection_load(struct evhttp_connection *evcon, int max)
+{
+	struct evhttp_request *req;
+	int load = evhttp_connected(evcon) ? 0 : 1;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		if ((load += 2) >= max)
+			break;
+	}
+	return (load);
+}
+
+int
+evhttp_pool_make_request(struct evhttp_pool *pool,
+    const char *address, unsigned short port, struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_pool_host key, *host;
+	struct evhttp_connection *evcon, *best = NULL;
+	int load, best_load = INT_MAX;
+
+	key.address = (char *)address;
+	key.port = port;
+	host = HT_FIND(evhttp_pool_map, &pool->hosts, &key);
+
+	if (host != NULL) {
+		TAILQ_FOREACH(evcon, &host->connections, pool_next) {
+			load = evhttp_pool_connection_load(evcon, best_load);
+			if (load < best_load) {
+				best = evcon;
+				best_load = load;
+			}
+		}
+	}
+
+	/* Only open another connection if every one we have is busy. */
+	if (best_load > 1 &&
+	    (host == NULL || host->n_connections < pool->max_per_host)) {
+		if ((evcon = evhttp_connection_base_new(pool->base,
+			    address, port)) == NULL)
+			return (-1);
+		if (host == NULL) {
+			if ((host = mm_calloc(1, sizeof(*host))) == NULL ||
+			    (host->address = mm_strdup(address)) == NULL) {
+				event_warn("%s: calloc failed", __func__);
+				if (host != NULL)
+					mm_free(host);
+				evhttp_connection_free(evcon);
+				return (-1);
+			}
+			host->pool = pool;
+			host->port = port;
+			TAILQ_INIT(&host->connections);
+			HT_INSERT(evhttp_pool_map, &pool->hosts, host);
+		}
+		evcon->pool_host = host;
+		TAILQ_INSERT_TAIL(&host->connections, evcon, pool_next);
+		++host->n_connections;
+		evtimer_assign(&evcon->idle_ev, pool->base, evhttp_pool_idle_cb,
+		    evcon);
+		best = evcon;
+	}
+
+	if (best == NULL)
+		return (-1);
+
+	evhttp_pool_connection_busy(best);
+	return (evhttp_make_request(best, req, type, uri));
+}
+
+/*
+ * Reverse proxying.
+ */
+
+/* A request that a server received, and is forwarding to another server. */
+struct evhttp_proxy {
+	/* the request we're answering; NULL once its connection is gone */
+	struct evhttp_request *client_req;
+	/* the request we made; NULL once it's done */
+	struct evhttp_request *server_req;
+	/* watches the client's output drain while we've paused the server */
+	struct evbuffer_cb_entry *drain_cb;
+	/* true once we've sent the client the start of the response */
+	int started;
+	/* true while we've stopped reading from the server */
+	int paused;
+};
+
+/* Headers that describe one connection rather than the message, which a
+ * proxy doesn't pass on. */
+static const char *evhttp_hop_by_hop_headers[] = {
+	"Connection", "Keep-Alive", "Proxy-Authenticate",
+	"Proxy-Authorization", "Proxy-Connection", "TE", "Trailer",
+	"Transfer-Encoding", "Upgrade", NULL
+};
+
+/* Add the headers in src that a proxy passes on to dst.  Content-Length
+ * goes too if keep_length is set, and so does X-Forwarded-For unless
+ * we're about to replace it. */
+static void
+evhttp_proxy_copy_headers(struct evkeyvalq *dst,
+    const struct evkeyvalq *src, int keep_length)
+{
+	const struct evkeyval *header;
+	int i;
+
+	TAILQ_FOREACH(header, src, next) {
+		for (i = 0; evhttp_hop_by_hop_headers[i] != NULL; ++i)
+			if (!evutil_strcasecmp(header->key,
+				evhttp_hop_by_hop_headers[i]))
+				break;
+		if (evhttp_hop_by_hop_headers[i] != NULL)
+			continue;
+		if (!keep_length &&
+		    (!evutil_strcasecmp(header->key, "Content-Length") ||
+			!evutil_strcasecmp(header->key, "X-Forwarded-For")))
+			continue;
+		evhttp_add_header(dst, header->key, header->value);
+	}
+}
+
+/* Set up the headers of server_req, which forwards req to evcon. */
+static int
+evhttp_proxy_request_headers(struct evhttp_request *server_req,
+    struct evhttp_request *req, struct evhttp_connection *evcon)
+{
+	struct evkeyvalq *headers = server_req->output_headers;
+	const char *forwarded;
+	char *value;
+	size_t len;
+
+	evhttp_proxy_copy_headers(headers, req->input_headers, 0);
+
+	/* an HTTP/1.0 client might not have said which host it wanted */
+	if (evhttp_find_header(headers, "Host") == NULL) {
+		len = strlen(evcon->address) + 7;
+		if ((value = mm_malloc(len)) == NULL)
+			return (-1);
+		if (evcon->port == HTTP_DEFAULTPORT)
+			evutil_snprintf(value, len, "%s", evcon->address);
+		else
+			evutil_snprintf(value, len, "%s:%d", evcon->address,
+			    (int)evcon->port);
+		evhttp_add_header(headers, "Host", value);
+		mm_free(value);
+	}
+
+	if (req->remote_host != NULL) {
+		forwarded = evhttp_find_input_header(req, "X-Forwarded-For");
+		if (forwarded == NULL) {
+			evhttp_add_header(headers, "X-Forwarded-For",
+			    req->remote_host);
+		} else {
+			len = strlen(forwarded) + strlen(req->remote_host) + 3;
+			if ((value = mm_malloc(len)) == NULL)
+				return (-1);
+			evutil_snprintf(value, len, "%s, %s", forwarded,
+			    req->remote_host);
+			evhttp_add_header(headers, "X-Forwarded-For", value);
+			mm_free(value);
+		}
+	}
+
+	len = evbuffer_get_length(req->input_buffer);
+	if (len > 0 || req->type == EVHTTP_REQ_POST ||
+	    req->type == EVHTTP_REQ_PUT) {
+		char size[22];
+		evutil_snprintf(size, sizeof(size), "%ld", (long)len);
+		evhttp_add_header(headers, "Content-Length", size);
+	}
+
+	return (0);
+}
+
+/* Let go of the client's connection, and free proxy unless the request to
+ * the server still refers to it. */
+static void
+evhttp_proxy_detach_client(struct evhttp_proxy *proxy)
+{
+	struct evhttp_connection *evcon;
+
+	if (proxy->client_req != NULL) {
+		evcon = proxy->client_req->evcon;
+		if (proxy->drain_cb != NULL)
+			evbuffer_remove_cb_entry(
+				bufferevent_get_output(evcon->bufev),
+				proxy->drain_cb);
+		evcon->proxy = NULL;
+		proxy->client_req = NULL;
+	}
+	if (proxy->server_req == NULL)
+		mm_free(proxy);
+}
+
+/* The connection to the client is going away: stop asking the server. */
+static void
+evhttp_proxy_client_gone(struct evhttp_proxy *proxy)
+{
+	struct evhttp_request *server_req = proxy->server_req;
+
+	proxy->server_req = NULL;
+	evhttp_proxy_detach_client(proxy);
+	/* this doesn't invoke the request's callbacks */
+	if (server_req != NULL)
+		evhttp_cancel_request(server_req);
+}
+
+/* Reads from the server again once the client has taken most of what we
+ * gave it. */
+static void
+evhttp_proxy_drain_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct evhttp_proxy *proxy = arg;
+
+	if (!proxy->paused || info->n_deleted == 0 ||
+	    evbuffer_get_length(buf) > HTTP_PROXY_MAX_BUFFERED / 2)
+		return;
+	proxy->paused = 0;
+	evhttp_request_resume(proxy->server_req);
+}
+
+static void
+evhttp_proxy_response_headers(struct evhttp_request *req,
+    struct evhttp_request *server_req)
+{
+	/* a length the server gave still holds, since the body goes on
+	 * unchanged; without one, an HTTP/1.1 reply is chunked */
+	evhttp_proxy_copy_headers(req->output_headers,
+	    server_req->input_headers, 1);
+}
+
+static void
+evhttp_proxy_chunk_cb(struct evhttp_request *server_req, void *arg)
+{
+	struct evhttp_proxy *proxy = arg;
+	struct evhttp_request *req = proxy->client_req;
+	struct evbuffer *output;
+
+	if (req == NULL)
+		return;
+
+	if (!proxy->started) {
+		proxy->started = 1;
+		evhttp_proxy_response_headers(req, server_req);
+		evhttp_send_reply_start(req, server_req->response_code,
+		    server_req->response_code_line != NULL ?
+		    server_req->response_code_line : "");
+	}
+
+	/* moves the chains along rather than copying them */
+	evhttp_send_reply_chunk(req, server_req->input_buffer);
+
+	output = bufferevent_get_output(req->evcon->bufev);
+	if (!proxy->paused &&
+	    evbuffer_get_length(output) > HTTP_PROXY_MAX_BUFFERED) {
+		/* the client can't keep up; hold the server back */
+		proxy->paused = 1;
+		if (proxy->drain_cb == NULL)
+			proxy->drain_cb = evbuffer_add_cb(output,
+			    evhttp_proxy_drain_cb, proxy);
+		evhttp_request_pause(server_req);
+	}
+}
+
+static void
+evhttp_proxy_done_cb(struct evhttp_request *server_req, void *arg)
+{
+	struct evhttp_proxy *proxy = arg;
+	struct evhttp_request *req = proxy->client_req;
+	int started = proxy->started;
+
+	proxy->server_req = NULL;
+	if (req == NULL) {
+		mm_free(proxy);
+		return;
+	}
+	evhttp_proxy_detach_client(proxy);
+
+	if (server_req == NULL || server_req->response_code == 0) {
+		if (!started)
+			evhttp_send_error(req, 502, "Bad Gateway");
+		else
+			/* closing the connection is the only way to tell
+			 * the client it won't get the rest */
+			evhttp_connection_free(req->evcon);
+	} else if (started) {
+		evhttp_send_reply_end(req);
+	} else {
+		/* the response had no body to stream */
+		evhttp_proxy_response_headers(req, server_req);
+		evhttp_send_reply(req, server_req->response_code,
+		    server_req->response_code_line != NULL ?
+		    server_req->response_code_line : "",
+		    server_req->input_buffer);
+	}
+}
+
+int
+evhttp_proxy_request(struct evhttp_request *req,
+    struct evhttp_connection *evcon, const char *uri)
+{
+	struct evhttp_proxy *proxy;
+	struct evhttp_request *server_req;
+
+	if (req->evcon == NULL || req->evcon->proxy != NULL)
+		return (-1);
+
+	if ((proxy = mm_calloc(1, sizeof(struct evhttp_proxy))) == NULL) {
+		event_warn("%s: calloc failed", __func__);
+		return (-1);
+	}
+	if ((server_req = evhttp_request_new(evhttp_proxy_done_cb,
+		    proxy)) == NULL) {
+		mm_free(proxy);
+		return (-1);
+	}
+	evhttp_request_set_chunked_cb(server_req, evhttp_proxy_chunk_cb);
+	if (evhttp_proxy_request_headers(server_req, req, evcon) == -1) {
+		evhttp_request_free(server_req);
+		mm_free(proxy);
+		return (-1);
+	}
+	evbuffer_add_buffer(server_req->output_buffer, req->input_buffer);
+
+	proxy->client_req = req;
+	proxy->server_req = server_req;
+	req->evcon->proxy = proxy;
+
+	if (evhttp_make_request(evcon, server_req, req->type,
+		uri != NULL ? uri : req->uri) == -1) {
+		/* give the body back, so the caller can still use it */
+		evbuffer_add_buffer(req->input_buffer,
+		    server_req->output_buffer);
+		/* it's left queued on evcon; take it off */
+		evhttp_proxy_client_gone(proxy);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Waits for the connect started on evcon->fd to finish. */
+static void
+evhttp_connection_wait_connected(struct evhttp_connection *evcon)
+{
+	/* Set up a callback for successful connection setup */
+	bufferevent_setfd(evcon->bufev, evcon->fd);
+	bufferevent_setcb(evcon->bufev,
+	    NULL /* evhttp_read_cb */,
+	    evhttp_connection_cb,
+	    evhttp_error_cb, evcon);
+	bufferevent_settimeout(evcon->bufev, 0,
+	    evcon->timeout != -1 ? evcon->timeout : HTTP_CONNECT_TIMEOUT);
+	/* make sure that we get a write callback */
+	bufferevent_enable(evcon->bufev, EV_WRITE);
+
+	evcon->state = EVCON_CONNECTING;
+}
+
+/* Starts connecting to the first address in ai that takes a connect. */
+static int
+evhttp_connection_connect_ai(struct evhttp_connection *evcon,
+    struct addrinfo *ai)
+{
+	for (; ai != NULL; ai = ai->ai_next) {
+		if (evcon->bind_address != NULL || evcon->bind_port != 0)
+			evcon->fd = bind_socket(
+				evcon->bind_address, evcon->bind_port, 0);
+		else
+			evcon->fd = bind_socket_ai(ai->ai_family, NULL, 0);
+		if (evcon->fd == -1) {
+			event_debug(("%s: failed to bind to \"%s\"",
+				__func__, evcon->bind_address));
+			return (-1);
+		}
+
+		if (connect(evcon->fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+		    EVUTIL_ERR_CONNECT_RETRIABLE(
+			    evutil_socket_geterror(evcon->fd))) {
+			evhttp_connection_wait_connected(evcon);
+			return (0);
+		}
+		event_sock_warn(evcon->fd, "%s: connection to \"%s\" failed",
+		    __func__, evcon->address);
+		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
+	}
+
+	return (-1);
+}
+
+static void
+evhttp_connection_resolved_cb(int result, struct addrinfo *ai, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	int res;
+
+	evcon->resolving = NULL;
+	if (result != DNS_ERR_NONE) {
+		event_debug(("%s: could not resolve \"%s\": %s",
+			__func__, evcon->address, evdns_err_to_string(result)));
+		evhttp_connection_cb_cleanup(evcon);
+		return;
+	}
+
+	res = evhttp_connection_connect_ai(evcon, ai);
+	evdns_freeaddrinfo(ai);
+	if (res == -1)
+		evhttp_connection_cb_cleanup(evcon);
+}
+
+int
+evhttp_connection_connect(struct evhttp_connection *evcon)
+{
+	if (evcon->state == EVCON_CONNECTING)
+		return (0);
+
+	evhttp_connection_reset(evcon);
+
+	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
+	evcon->flags |= EVHTTP_CON_OUTGOING;
+
+	if (evcon->dns_base != NULL) {
+		struct addrinfo hints;
+		char strport[8];
+
+		memset(&hints, 0, sizeof(hints));
+		/* bind_socket() only does IPv4 */
+		hints.ai_family = (evcon->bind_address != NULL ||
+		    evcon->bind_port != 0) ? AF_INET : AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		evutil_snprintf(strport, sizeof(strport), "%d", evcon->port);
+		evcon->resolving = evdns_getaddrinfo(evcon->dns_base,
+		    evcon->address, strport, &hints,
+		    evhttp_connection_resolved_cb, evcon);
+		if (evcon->resolving == NULL)
+			return (-1);
+		evcon->state = EVCON_CONNECTING;
+		return (0);
+	}
+
+	evcon->fd = bind_socket(
+		evcon->bind_address, evcon->bind_port, 0 /*reuse*/);
+	if (evcon->fd == -1) {
+		event_debug(("%s: failed to bind to \"%s\"",
+			__func__, evcon->bind_address));
+		return (-1);
+	}
+
+	if (socket_connect(evcon->fd, evcon->address, evcon->port) == -1) {
+		event_sock_warn(evcon->fd, "%s: connection to \"%s\" failed",
+		    __func__, evcon->address);
+		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
+		return (-1);
+	}
+
+	evhttp_connection_wait_connected(evcon);
+
+	return (0);
+}
+
+/*
+ * Starts an HTTP request on the provided evhttp_connection object.
+ * If the connection object is not connected to the web server already,
+ * this will start the connection.
+ */
+
+int
+evhttp_make_request(struct evhttp_connection *evcon,
+    struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	/* We are making a request */
+	req->kind = EVHTTP_REQUEST;
+	req->type = type;
+	if (req->uri != NULL)
+		mm_free(req->uri);
+	if ((req->uri = mm_strdup(uri)) == NULL)
+		event_err(1, "%s: strdup", __func__);
+
+	/* Set the protocol version if it is not supplied */
+	if (!req->major && !req->minor) {
+		req->major = 1;
+		req->minor = 1;
+	}
+
+	assert(req->evcon == NULL);
+	req->evcon = evcon;
+	assert(!(req->flags & EVHTTP_REQ_OWN_CONNECTION));
+
+	TAILQ_INSERT_TAIL(&evcon->requests, req, next);
+
+	/* If the connection object is not connected; make it so */
+	if (!evhttp_connected(evcon))
+		return (evhttp_connection_connect(evcon));
+
+	/*
+	 * If it's connected already and we are the first in the queue,
+	 * then we can dispatch this request immediately.  Otherwise, it
+	 * will be dispatched once the pending requests are completed,
+	 * unless there's room for it in the pipeline now.
+	 */
+	if (TAILQ_FIRST(&evcon->requests) == req ||
+	    evcon->pipeline_depth > 1)
+		evhttp_request_dispatch(evcon);
+
+	return (0);
+}
+
+/* Return true iff req has been sent on evcon without being answered. */
+static int
+evhttp_request_in_flight(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp_request *cur;
+	int i = 0;
+
+	TAILQ_FOREACH(cur, &evcon->requests, next) {
+		if (i++ >= evcon->n_in_flight)
+			break;
+		if (cur == req)
+			return (1);
+	}
+	return (0);
+}
+
+void
+evhttp_cancel_request(struct evhttp_request *req)
 {
 	struct evhttp_connection *evcon = req->evcon;
 	if (evcon != NULL) {
@@ -1895,6 +3330,13 @@ evhttp_cancel_request(struct evhttp_request *req)
 
 			/* connection fail freed the request */
 			return;
+		} else if (evhttp_request_in_flight(evcon, req)) {
+			/* its response is on the way; let it come, so that
+			 * the ones behind it still line up */
+			req->cb = evhttp_request_discard_cb;
+			req->chunk_cb = NULL;
+			req->flags &= ~EVHTTP_USER_OWNED;
+			return;
 		} else {
 			/* otherwise, we can just remove it from the
 			 * queue
@@ -1920,66 +3362,503 @@ evhttp_start_read(struct evhttp_connection *evcon)
 	evcon->state = EVCON_READING_FIRSTLINE;
 }
 
+/* The idle list of the base that evcon, a server connection, is on. */
+static struct evhttp_idle_list *
+evhttp_connection_idle_list(struct evhttp_connection *evcon)
+{
+	if (evcon->http_worker != NULL)
+		return (&evcon->http_worker->idle);
+	return (&evcon->http_server->idle);
+}
+
+/* Wait for the first connection on idle to time out, if any of them can. */
+static void
+evhttp_idle_list_schedule(struct evhttp_idle_list *idle)
+{
+	struct evhttp_connection *evcon = TAILQ_FIRST(&idle->conns);
+	struct timeval now, tv;
+
+	if (evcon == NULL || idle->http->timeout == -1)
+		return;
+
+	event_base_gettime_cached(evcon->base, &now);
+	tv = evcon->idle_since;
+	tv.tv_sec += idle->http->timeout;
+	if (evutil_timercmp(&tv, &now, >))
+		evutil_timersub(&tv, &now, &tv);
+	else
+		evutil_timerclear(&tv);
+	event_add(&idle->reap_ev, &tv);
+}
+
+static void
+evhttp_idle_reap_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_idle_list *idle = arg;
+	struct evhttp_connection *evcon;
+	struct timeval now, expires;
+
+	while ((evcon = TAILQ_FIRST(&idle->conns)) != NULL) {
+		event_base_gettime_cached(evcon->base, &now);
+		expires = evcon->idle_since;
+		expires.tv_sec += idle->http->timeout;
+		if (evutil_timercmp(&expires, &now, >))
+			break;
+		event_debug(("%s: closing idle connection on %d",
+			__func__, evcon->fd));
+		evhttp_connection_free(evcon);
+	}
+	evhttp_idle_list_schedule(idle);
+}
+
+/* Put evcon, a server connection that's waiting for another request, at
+ * the back of its base's idle list.  Its bufferevent doesn't need timeouts
+ * meanwhile, since the list's timer closes it if nothing comes. */
+static void
+evhttp_connection_server_idle(struct evhttp_connection *evcon)
+{
+	struct evhttp_idle_list *idle = evhttp_connection_idle_list(evcon);
+
+	/* a pipelined request is already here */
+	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev)) > 0)
+		return;
+
+	if (evcon->timeout != -1)
+		bufferevent_set_timeouts(evcon->bufev, NULL, NULL);
+	event_base_gettime_cached(evcon->base, &evcon->idle_since);
+	TAILQ_INSERT_TAIL(&idle->conns, evcon, idle_next);
+	evcon->server_idle = 1;
+
+	if (!event_initialized(&idle->reap_ev))
+		evtimer_assign(&idle->reap_ev, evcon->base,
+		    evhttp_idle_reap_cb, idle);
+	if (!evtimer_pending(&idle->reap_ev, NULL))
+		evhttp_idle_list_schedule(idle);
+}
+
+/* Take evcon off its base's idle list, if it's there. */
+static void
+evhttp_connection_server_busy(struct evhttp_connection *evcon)
+{
+	if (evcon->server_idle) {
+		TAILQ_REMOVE(&evhttp_connection_idle_list(evcon)->conns, evcon,
+		    idle_next);
+		evcon->server_idle = 0;
+	}
+}
+
+static void
+evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+{
+	int need_close;
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	TAILQ_REMOVE(&evcon->requests, req, next);
+
+	need_close =
+	    (req->minor == 0 &&
+		!evhttp_is_connection_keepalive(req->input_headers))||
+	    evhttp_is_connection_close(req->flags, req->input_headers) ||
+	    evhttp_is_connection_close(req->flags, req->output_headers);
+
+	assert(req->flags & EVHTTP_REQ_OWN_CONNECTION);
+	if (evutil_timerisset(&evcon->stats_start))
+		evhttp_stats_record(evcon, req);
+	if (need_close || evcon->spare_req != NULL ||
+	    evhttp_request_recycle(req) == -1)
+		evhttp_request_free(req);
+	else
+		evcon->spare_req = req;
+
+	if (need_close) {
+		evhttp_connection_free(evcon);
+		return;
+	}
+
+	/* we have a persistent connection; try to accept another request. */
+	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
+		evhttp_connection_free(evcon);
+		return;
+	}
+	evhttp_connection_server_idle(evcon);
+}
+
+/*
+ * Returns an error page.
+ */
+
+void
+evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+{
+#define ERR_FORMAT "<HTML><HEAD>\n" \
+	    "<TITLE>%d %s</TITLE>\n" \
+	    "</HEAD><BODY>\n" \
+	    "<H1>Method Not Implemented</H1>\n" \
+	    "Invalid method in request<P>\n" \
+	    "</BODY></HTML>\n"
+
+	struct evbuffer *buf = evbuffer_new();
+
+	/* close the connection on error */
+	evhttp_add_header(req->output_headers, "Connection", "close");
+
+	evhttp_response_code(req, error, reason);
+
+	evbuffer_add_printf(buf, ERR_FORMAT, error, reason);
+
+	evhttp_send_page(req, buf);
+
+	evbuffer_free(buf);
+#undef ERR_FORMAT
+}
+
+/*
+ * Compressing response bodies.
+ */
+
+#ifdef _EVENT_HAVE_LIBZ
+struct evhttp_compressor {
+	z_stream z;
+	/* what we've compressed and not yet sent */
+	struct evbuffer *out;
+};
+#endif
+
+/* Return true iff the q-value at p is zero. */
+static int
+evhttp_qvalue_is_zero(const char *p)
+{
+	if (*p++ != '0')
+		return (0);
+	if (*p == '.')
+		while (*++p == '0')
+			;
+	return (*p == '\0' || *p == ',' || *p == ';' || *p == ' ' ||
+	    *p == '\t');
+}
+
+/* Work out from a request's Accept-Encoding which encoding to compress the
+ * response with: "gzip", "deflate", or NULL if the client takes neither. */
+static const char *
+evhttp_choose_encoding(struct evkeyvalq *headers)
+{
+	const char *p = evhttp_find_header(headers, "Accept-Encoding");
+	const char *name;
+	int gzip = -1, deflate = -1, any = -1, ok;
+	size_t len;
+
+	if (p == NULL)
+		return (NULL);
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			++p;
+		name = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+			++p;
+		len = p - name;
+
+		/* the only parameter we care about is "q=0" */
+		ok = 1;
+		while (*p && *p != ',') {
+			if (*p++ != ';')
+				continue;
+			while (*p == ' ' || *p == '\t')
+				++p;
+			if ((*p == 'q' || *p == 'Q') && p[1] == '=' &&
+			    evhttp_qvalue_is_zero(p + 2))
+				ok = 0;
+		}
+
+		if ((len == 4 && !evutil_strncasecmp(name, "gzip", 4)) ||
+		    (len == 6 && !evutil_strncasecmp(name, "x-gzip", 6)))
+			gzip = ok;
+		else if (len == 7 && !evutil_strncasecmp(name, "deflate", 7))
+			deflate = ok;
+		else if (len == 1 && *name == '*')
+			any = ok;
+	}
+
+	if (gzip == 1 || (gzip == -1 && any == 1))
+		return ("gzip");
+	if (deflate == 1 || (deflate == -1 && any == 1))
+		return ("deflate");
+	return (NULL);
+}
+
+/* Return true iff a body with the len-byte Content-Type at type is likely
+ * to get smaller when it's compressed.  No type at all means text/html. */
+static int
+evhttp_is_compressible_type(const char *type, size_t len)
+{
+	static const char *types[] = { "application/javascript",
+		"application/x-javascript", "application/ecmascript",
+		"application/json", "application/xml", NULL };
+	size_t n;
+	int i;
+
+	if (type == NULL)
+		return (1);
+	/* leave out the parameters */
+	for (n = 0; n < len && type[n] != ';' && type[n] != ' '; ++n)
+		;
+
+	if (n > 5 && !evutil_strncasecmp(type, "text/", 5))
+		return (1);
+	if ((n > 4 && !evutil_strncasecmp(type + n - 4, "+xml", 4)) ||
+	    (n > 5 && !evutil_strncasecmp(type + n - 5, "+json", 5)))
+		return (1);
+	for (i = 0; types[i] != NULL; ++i) {
+		if (strlen(types[i]) == n &&
+		    !evutil_strncasecmp(type, types[i], n))
+			return (1);
+	}
+	return (0);
+}
+
+/* Find the value of the header called key among the ones that the response
+ * to req will have, and set *lenp to its length; or return NULL. */
+static const char *
+evhttp_response_header(struct evhttp_request *req,
+    const struct evhttp_header_block *block, const char *key, size_t *lenp)
+{
+	const char *p, *eol, *end;
+	size_t keylen = strlen(key);
+
+	if ((p = evhttp_find_header(req->output_headers, key)) != NULL) {
+		*lenp = strlen(p);
+		return (p);
+	}
+	if (block == NULL)
+		return (NULL);
+
+	/* each header in the block is "key: value\r\n" */
+	end = block->data + block->len;
+	for (p = block->data + block->headers_off; p < end; p = eol + 2) {
+		if ((eol = memchr(p, '\r', end - p)) == NULL)
+			break;
+		if ((size_t)(eol - p) > keylen && p[keylen] == ':' &&
+		    !evutil_strncasecmp(p, key, keylen)) {
+			p += keylen + 1;
+			while (p < eol && (*p == ' ' || *p == '\t'))
+				++p;
+			*lenp = eol - p;
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+/* Decide whether to compress the response to req, whose body is len bytes
+ * long, or -1 if we don't know how long yet.  Returns the encoding to use
+ * or NULL.  A response that we would compress for some clients says so in
+ * a Vary header, whatever this one takes. */
+static const char *
+evhttp_response_encoding(struct evhttp_request *req,
+    const struct evhttp_header_block *block, ev_ssize_t len)
+{
+	struct evhttp *http = req->evcon->http_server;
+	const char *type;
+	size_t type_len = 0;
+
+	/* we can't compress a body whose length the user has promised */
+	if (http == NULL || http->compress_level == 0 ||
+	    !evhttp_response_needs_body(req) ||
+	    (len >= 0 && (size_t)len < http->compress_min_size) ||
+	    evhttp_find_header(req->output_headers, "Content-Length") ||
+	    evhttp_response_header(req, block, "Content-Encoding", &type_len))
+		return (NULL);
+
+	type = evhttp_response_header(req, block, "Content-Type", &type_len);
+	if (!evhttp_is_compressible_type(type, type_len))
+		return (NULL);
+
+	if (evhttp_response_header(req, block, "Vary", &type_len) == NULL)
+		evhttp_add_header(req->output_headers, "Vary",
+		    "Accept-Encoding");
+	return (evhttp_choose_encoding(req->input_headers));
+}
+
+#ifdef _EVENT_HAVE_LIBZ
+/* Start a zlib stream that writes the given Content-Encoding. */
+static int
+evhttp_deflate_init(z_stream *z, const char *encoding, int level)
+{
+	/* 16 more bits of window ask for a gzip header and trailer */
+	int bits = strcmp(encoding, "gzip") ? MAX_WBITS : MAX_WBITS + 16;
+
+	memset(z, 0, sizeof(*z));
+	if (deflateInit2(z, level, Z_DEFLATED, bits, 8,
+		Z_DEFAULT_STRATEGY) != Z_OK)
+		return (-1);
+	return (0);
+}
+
+/* Compress all of src, if it isn't NULL, onto the end of dst, and then
+ * flush the stream as flush says.  Leaves src alone.  Returns 0 on success
+ * and -1 on failure. */
+static int
+evhttp_deflate_buffer(z_stream *z, struct evbuffer *dst,
+    struct evbuffer *src, int flush)
+{
+	struct evbuffer_iovec *in = NULL, out;
+	size_t len = src != NULL ? evbuffer_get_length(src) : 0;
+	int i, n = 0, r = -1;
+
+	if (len > 0) {
+		n = evbuffer_peek(src, len, NULL, NULL, 0);
+		if ((in = mm_calloc(n, sizeof(*in))) == NULL)
+			return (-1);
+		evbuffer_peek(src, len, NULL, in, n);
+	}
+
+	/* every chain but the last goes in without a flush */
+	i = 0;
+	do {
+		if (i < n) {
+			z->next_in = in[i].iov_base;
+			z->avail_in = (uInt)in[i].iov_len;
+		}
+		do {
+			if (evbuffer_reserve_space(dst, 4096, &out, 1) < 1)
+				goto done;
+			z->next_out = out.iov_base;
+			z->avail_out = (uInt)out.iov_len;
+			if (deflate(z, i + 1 < n ? Z_NO_FLUSH : flush) ==
+			    Z_STREAM_ERROR)
+				goto done;
+			out.iov_len -= z->avail_out;
+			evbuffer_commit_space(dst, &out, 1);
+		} while (z->avail_out == 0);
+	} while (++i < n);
+	r = 0;
+
+done:
+	if (in != NULL)
+		mm_free(in);
+	return (r);
+}
+#endif
+
+/* Compress the body of a response we're about to send all at once, if we
+ * should.  If anything goes wrong, the body goes out as it is. */
+static void
+evhttp_compress_body(struct evhttp_request *req,
+    const struct evhttp_header_block *block)
+{
+#ifdef _EVENT_HAVE_LIBZ
+	struct evbuffer *body = req->output_buffer, *out;
+	const char *encoding;
+	z_stream z;
+
+	if (!_evbuffer_is_in_memory(body) ||
+	    (encoding = evhttp_response_encoding(req, block,
+		evbuffer_get_length(body))) == NULL)
+		return;
+
+	if ((out = evbuffer_new()) == NULL)
+		return;
+	if (evhttp_deflate_init(&z, encoding,
+		req->evcon->http_server->compress_level) == -1) {
+		evbuffer_free(out);
+		return;
+	}
+	if (evhttp_deflate_buffer(&z, out, body, Z_FINISH) == 0) {
+		evbuffer_drain(body, evbuffer_get_length(body));
+		evbuffer_add_buffer(body, out);
+		evhttp_add_header(req->output_headers, "Content-Encoding",
+		    encoding);
+	}
+	deflateEnd(&z);
+	evbuffer_free(out);
+#endif
+}
+
+/* Set up evcon to compress the chunks of the response to req, if we
+ * should.  We can't tell how big the body will be, so it doesn't have to
+ * be any size. */
 static void
-evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+evhttp_compress_start(struct evhttp_request *req)
 {
-	int need_close;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	TAILQ_REMOVE(&evcon->requests, req, next);
-
-	need_close =
-	    (req->minor == 0 &&
-		!evhttp_is_connection_keepalive(req->input_headers))||
-	    evhttp_is_connection_close(req->flags, req->input_headers) ||
-	    evhttp_is_connection_close(req->flags, req->output_headers);
+#ifdef _EVENT_HAVE_LIBZ
+	struct evhttp_connection *evcon = req->evcon;
+	struct evhttp_compressor *compressor;
+	const char *encoding;
 
-	assert(req->flags & EVHTTP_REQ_OWN_CONNECTION);
-	evhttp_request_free(req);
+	if ((encoding = evhttp_response_encoding(req, NULL, -1)) == NULL)
+		return;
 
-	if (need_close) {
-		evhttp_connection_free(evcon);
+	if ((compressor = mm_calloc(1, sizeof(*compressor))) == NULL)
+		return;
+	if ((compressor->out = evbuffer_new()) == NULL) {
+		mm_free(compressor);
 		return;
 	}
-
-	/* we have a persistent connection; try to accept another request. */
-	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
-		evhttp_connection_free(evcon);
+	if (evhttp_deflate_init(&compressor->z, encoding,
+		evcon->http_server->compress_level) == -1) {
+		evbuffer_free(compressor->out);
+		mm_free(compressor);
+		return;
 	}
+	evcon->compressor = compressor;
+	evhttp_add_header(req->output_headers, "Content-Encoding", encoding);
+#endif
 }
 
-/*
- * Returns an error page.
- */
-
-void
-evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+/* Compress the next chunk of a response, or finish the stream if databuf is
+ * NULL, and return the buffer that holds the result. */
+static struct evbuffer *
+evhttp_compress_chunk(struct evhttp_connection *evcon,
+    struct evbuffer *databuf)
 {
-#define ERR_FORMAT "<HTML><HEAD>\n" \
-	    "<TITLE>%d %s</TITLE>\n" \
-	    "</HEAD><BODY>\n" \
-	    "<H1>Method Not Implemented</H1>\n" \
-	    "Invalid method in request<P>\n" \
-	    "</BODY></HTML>\n"
-
-	struct evbuffer *buf = evbuffer_new();
-
-	/* close the connection on error */
-	evhttp_add_header(req->output_headers, "Connection", "close");
-
-	evhttp_response_code(req, error, reason);
+#ifdef _EVENT_HAVE_LIBZ
+	struct evhttp_compressor *compressor = evcon->compressor;
+
+	/* flush each chunk, so the client sees it as soon as we'd have sent
+	 * it uncompressed */
+	if (evhttp_deflate_buffer(&compressor->z, compressor->out, databuf,
+		databuf != NULL ? Z_SYNC_FLUSH : Z_FINISH) == -1)
+		event_errx(1, "%s: deflate failed", __func__);
+	if (databuf != NULL)
+		evbuffer_drain(databuf, evbuffer_get_length(databuf));
+	return (compressor->out);
+#else
+	return (databuf);
+#endif
+}
 
-	evbuffer_add_printf(buf, ERR_FORMAT, error, reason);
+static void
+evhttp_compressor_free(struct evhttp_connection *evcon)
+{
+#ifdef _EVENT_HAVE_LIBZ
+	struct evhttp_compressor *compressor = evcon->compressor;
 
-	evhttp_send_page(req, buf);
+	if (compressor == NULL)
+		return;
+	deflateEnd(&compressor->z);
+	evbuffer_free(compressor->out);
+	mm_free(compressor);
+	evcon->compressor = NULL;
+#endif
+}
 
-	evbuffer_free(buf);
-#undef ERR_FORMAT
+int
+evhttp_set_compression(struct evhttp *http, int level, size_t min_size)
+{
+#ifdef _EVENT_HAVE_LIBZ
+	if (level < 0 || level > 9)
+		return (-1);
+	http->compress_level = level;
+	http->compress_min_size = min_size;
+	return (0);
+#else
+	return (level == 0 ? 0 : -1);
+#endif
 }
 
 /* Requires that headers and response code are already set up */
 
 static inline void
-evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+evhttp_send_block(struct evhttp_request *req,
+    const struct evhttp_header_block *block, struct evbuffer *databuf)
 {
 	struct evhttp_connection *evcon = req->evcon;
 
@@ -1989,12 +3868,20 @@ evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
 	if (databuf != NULL)
 		evbuffer_add_buffer(req->output_buffer, databuf);
 
+	evhttp_compress_body(req, block);
+
 	/* Adds headers to the response */
-	evhttp_make_header(evcon, req);
+	evhttp_make_header_block(evcon, req, block);
 
 	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
 }
 
+static inline void
+evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	evhttp_send_block(req, NULL, databuf);
+}
+
 void
 evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
     struct evbuffer *databuf)
@@ -2004,11 +3891,89 @@ evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
 	evhttp_send(req, databuf);
 }
 
+struct evhttp_header_block *
+evhttp_header_block_new(int code, const char *reason,
+    const struct evkeyvalq *headers)
+{
+	static const char *managed[] = { "Connection", "Content-Length",
+		"Date", "Transfer-Encoding", NULL };
+	struct evhttp_header_block *block;
+	const struct evkeyval *header;
+	struct evbuffer *buf;
+	int i, has_content_type = 0;
+
+	if (!evhttp_header_is_valid_value(reason))
+		return (NULL);
+	if (headers != NULL) {
+		TAILQ_FOREACH(header, headers, next) {
+			if (!evhttp_header_is_valid_value(header->value) ||
+			    strpbrk(header->key, ":\r\n") != NULL)
+				return (NULL);
+			for (i = 0; managed[i] != NULL; ++i)
+				if (!evutil_strcasecmp(header->key,
+					managed[i]))
+					return (NULL);
+			if (!evutil_strcasecmp(header->key, "Content-Type"))
+				has_content_type = 1;
+		}
+	}
+
+	if ((block = mm_calloc(1, sizeof(*block))) == NULL)
+		return (NULL);
+	if ((block->reason = mm_strdup(reason)) == NULL ||
+	    (buf = evbuffer_new()) == NULL) {
+		if (block->reason != NULL)
+			mm_free(block->reason);
+		mm_free(block);
+		return (NULL);
+	}
+
+	evbuffer_add_printf(buf, "HTTP/1.1 %d %s\r\n", code, reason);
+	block->headers_off = evbuffer_get_length(buf);
+	if (headers != NULL) {
+		TAILQ_FOREACH(header, headers, next)
+			evhttp_add_header_line(buf, header->key,
+			    header->value);
+	}
+
+	block->len = evbuffer_get_length(buf);
+	if ((block->data = mm_malloc(block->len)) == NULL) {
+		evbuffer_free(buf);
+		mm_free(block->reason);
+		mm_free(block);
+		return (NULL);
+	}
+	evbuffer_remove(buf, block->data, block->len);
+	evbuffer_free(buf);
+
+	block->code = code;
+	block->has_content_type = has_content_type;
+	return (block);
+}
+
+void
+evhttp_header_block_free(struct evhttp_header_block *block)
+{
+	mm_free(block->data);
+	mm_free(block->reason);
+	mm_free(block);
+}
+
+void
+evhttp_send_reply_block(struct evhttp_request *req,
+    const struct evhttp_header_block *block, struct evbuffer *databuf)
+{
+	evhttp_response_code(req, block->code, block->reason);
+
+	evhttp_send_block(req, block, databuf);
+}
+
 void
 evhttp_send_reply_start(struct evhttp_request *req, int code,
     const char *reason)
 {
 	evhttp_response_code(req, code, reason);
+	evhttp_compress_start(req);
 	if (evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
 	    req->major == 1 && req->minor == 1 &&
 	    evhttp_response_needs_body(req)) {
@@ -2025,17 +3990,15 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
 	evhttp_write_buffer(req->evcon, NULL, NULL);
 }
 
-void
-evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
+static void
+evhttp_write_chunk(struct evhttp_request *req, struct evbuffer *databuf)
 {
 	struct evbuffer *output = bufferevent_get_output(req->evcon->bufev);
 	if (evbuffer_get_length(databuf) == 0)
 		return;
-	if (!evhttp_response_needs_body(req))
-		return;
 	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
-				    (unsigned)evbuffer_get_length(databuf));
+		evbuffer_add_hex(output, evbuffer_get_length(databuf));
+		evbuffer_add(output, "\r\n", 2);
 	}
 	evbuffer_add_buffer(output, databuf);
 	if (req->chunked) {
@@ -2044,12 +4007,29 @@ evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
 	evhttp_write_buffer(req->evcon, NULL, NULL);
 }
 
+void
+evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	if (evbuffer_get_length(databuf) == 0)
+		return;
+	if (!evhttp_response_needs_body(req))
+		return;
+	if (req->evcon->compressor != NULL)
+		databuf = evhttp_compress_chunk(req->evcon, databuf);
+	evhttp_write_chunk(req, databuf);
+}
+
 void
 evhttp_send_reply_end(struct evhttp_request *req)
 {
 	struct evhttp_connection *evcon = req->evcon;
 	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
 
+	if (evcon->compressor != NULL) {
+		evhttp_write_chunk(req, evhttp_compress_chunk(evcon, NULL));
+		evhttp_compressor_free(evcon);
+	}
+
 	if (req->chunked) {
 		evbuffer_add(output, "0\r\n\r\n", 5);
 		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
@@ -2082,14 +4062,497 @@ evhttp_send_page(struct evhttp_request *req, struct evbuffer *databuf)
 		req->minor = 1;
 	}
 
-	if (req->kind != EVHTTP_RESPONSE)
-		evhttp_response_code(req, 200, "OK");
+	if (req->kind != EVHTTP_RESPONSE)
+		evhttp_response_code(req, 200, "OK");
+
+	evhttp_clear_headers(req->output_headers);
+	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
+	evhttp_add_header(req->output_headers, "Connection", "close");
+
+	evhttp_send(req, databuf);
+}
+
+/*
+ * Serving static files.
+ */
+
+static inline unsigned
+hash_evhttp_file(struct evhttp_file *file)
+{
+	return ht_string_hash(file->path);
+}
+
+static inline int
+eq_evhttp_file(struct evhttp_file *a, struct evhttp_file *b)
+{
+	return !strcmp(a->path, b->path);
+}
+
+HT_PROTOTYPE(evhttp_file_map, evhttp_file, node, hash_evhttp_file,
+    eq_evhttp_file);
+HT_GENERATE(evhttp_file_map, evhttp_file, node, hash_evhttp_file,
+    eq_evhttp_file, 0.5, mm_malloc, mm_realloc, mm_free);
+
+static const struct {
+	const char *ext;
+	const char *type;
+} evhttp_content_types[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "txt", "text/plain" },
+	{ "xml", "text/xml" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "svg", "image/svg+xml" },
+	{ "ico", "image/x-icon" },
+	{ "pdf", "application/pdf" },
+	{ NULL, NULL }
+};
+
+static const char *
+evhttp_guess_content_type(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	int i;
+
+	if (ext != NULL && strchr(ext, '/') == NULL) {
+		for (i = 0; evhttp_content_types[i].ext; ++i) {
+			if (!evutil_strcasecmp(ext + 1,
+				evhttp_content_types[i].ext))
+				return (evhttp_content_types[i].type);
+		}
+	}
+	return ("application/octet-stream");
+}
+
+struct evhttp_file_server *
+evhttp_file_server_new(const char *prefix, const char *root, int max_cached)
+{
+	struct evhttp_file_server *server;
+
+	if ((server = mm_calloc(1, sizeof(*server))) == NULL) {
+		event_warn("%s: calloc failed", __func__);
+		return (NULL);
+	}
+	if ((server->prefix = mm_strdup(prefix)) == NULL ||
+	    (server->root = mm_strdup(root)) == NULL) {
+		event_warn("%s: strdup failed", __func__);
+		if (server->prefix != NULL)
+			mm_free(server->prefix);
+		mm_free(server);
+		return (NULL);
+	}
+	server->prefix_len = strlen(prefix);
+	HT_INIT(evhttp_file_map, &server->files);
+	TAILQ_INIT(&server->lru);
+	server->max_files = max_cached > 0 ? max_cached : HTTP_FILE_CACHE_SIZE;
+
+	return (server);
+}
+
+static void
+evhttp_file_free(struct evhttp_file_server *server, struct evhttp_file *file)
+{
+	HT_REMOVE(evhttp_file_map, &server->files, file);
+	TAILQ_REMOVE(&server->lru, file, next);
+	--server->n_files;
+
+	close(file->fd);
+	if (file->gzipped != NULL)
+		evbuffer_free(file->gzipped);
+	mm_free(file->path);
+	mm_free(file);
+}
+
+void
+evhttp_file_server_free(struct evhttp_file_server *server)
+{
+	struct evhttp_file *file;
+
+	while ((file = TAILQ_FIRST(&server->lru)) != NULL)
+		evhttp_file_free(server, file);
+	HT_CLEAR(evhttp_file_map, &server->files);
+
+	mm_free(server->prefix);
+	mm_free(server->root);
+	mm_free(server);
+}
+
+/* Work out which file below the server's root a URI names, and put its
+ * path relative to the root in path.  Returns 0 on success and -1 if the
+ * URI doesn't name a file we may serve. */
+static int
+evhttp_file_server_path(struct evhttp_file_server *server, const char *uri,
+    char *path, size_t len)
+{
+	size_t n = strcspn(uri, "?#"), i;
+	int j;
+
+	if (n < server->prefix_len ||
+	    strncmp(uri, server->prefix, server->prefix_len))
+		return (-1);
+	uri += server->prefix_len;
+	n -= server->prefix_len;
+	if (n + sizeof("index.html") > len)
+		return (-1);
+
+	j = evhttp_decode_uri_internal(uri, n, path, 0);
+	if (strlen(path) != (size_t)j)
+		return (-1);	/* a %00 */
+
+	/* Nothing may climb out of the root. */
+#ifdef WIN32
+	if (strchr(path, '\\') || strchr(path, ':'))
+		return (-1);
+#endif
+	for (i = 0; path[i]; i += strcspn(path + i, "/")) {
+		while (path[i] == '/')
+			++i;
+		if (path[i] == '.' && path[i+1] == '.' &&
+		    (path[i+2] == '/' || path[i+2] == '\0'))
+			return (-1);
+	}
+
+	if (j == 0 || path[j-1] == '/')
+		strcpy(path + j, "index.html");
+	return (0);
+}
+
+/* Open the file at path below the server's root, and note what we need to
+ * answer requests for it. */
+static struct evhttp_file *
+evhttp_file_open(struct evhttp_file_server *server, const char *path,
+    time_t now)
+{
+	struct evhttp_file *file;
+	struct stat st;
+	char *full;
+	size_t len = strlen(server->root) + strlen(path) + 2;
+	int fd;
+
+	if ((full = mm_malloc(len)) == NULL)
+		return (NULL);
+	evutil_snprintf(full, len, "%s/%s", server->root, path);
+	fd = open(full, O_RDONLY);
+	mm_free(full);
+	if (fd == -1)
+		return (NULL);
+#ifdef _EVENT_HAVE_SETFD
+	fcntl(fd, F_SETFD, 1);
+#endif
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (file = mm_calloc(1, sizeof(*file))) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	if ((file->path = mm_strdup(path)) == NULL) {
+		mm_free(file);
+		close(fd);
+		return (NULL);
+	}
+
+	file->fd = fd;
+	file->size = st.st_size;
+	file->mtime = st.st_mtime;
+	file->ino = st.st_ino;
+	file->checked = now;
+	file->content_type = evhttp_guess_content_type(path);
+	evutil_snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx\"",
+	    (unsigned long long)file->size, (unsigned long long)file->mtime);
+	evutil_snprintf(file->gzip_etag, sizeof(file->gzip_etag),
+	    "\"%llx-%llx-gz\"",
+	    (unsigned long long)file->size, (unsigned long long)file->mtime);
+	if (evhttp_format_date(file->mtime, file->last_modified,
+		sizeof(file->last_modified)) == -1)
+		file->last_modified[0] = '\0';
+
+	/* make room for it */
+	if (server->n_files >= server->max_files)
+		evhttp_file_free(server, TAILQ_FIRST(&server->lru));
+	HT_INSERT(evhttp_file_map, &server->files, file);
+	TAILQ_INSERT_TAIL(&server->lru, file, next);
+	++server->n_files;
+
+	return (file);
+}
+
+/* Find the file at path, opening it if we don't have it open yet, or if it
+ * has changed since we opened it. */
+static struct evhttp_file *
+evhttp_file_get(struct evhttp_file_server *server, const char *path,
+    time_t now)
+{
+	struct evhttp_file key, *file;
+
+	key.path = (char *)path;
+	if ((file = HT_FIND(evhttp_file_map, &server->files, &key)) == NULL)
+		return (evhttp_file_open(server, path, now));
+
+	if (now - file->checked >= HTTP_FILE_RECHECK) {
+		struct stat st;
+		size_t len = strlen(server->root) + strlen(path) + 2;
+		char *full = mm_malloc(len);
+		int same = 0;
+
+		if (full != NULL) {
+			evutil_snprintf(full, len, "%s/%s", server->root, path);
+			same = stat(full, &st) == 0 &&
+			    (ev_uint64_t)st.st_ino == file->ino &&
+			    st.st_size == file->size &&
+			    st.st_mtime == file->mtime;
+			mm_free(full);
+		}
+		if (!same) {
+			evhttp_file_free(server, file);
+			return (evhttp_file_open(server, path, now));
+		}
+		file->checked = now;
+	}
+
+	TAILQ_REMOVE(&server->lru, file, next);
+	TAILQ_INSERT_TAIL(&server->lru, file, next);
+	return (file);
+}
+
+/* Parse the value of a Range header for a file of size bytes.  Returns 1
+ * and sets *startp and *lenp if it asks for one range we can send, -1 if
+ * none of what it asks for is in the file, and 0 if we should ignore it
+ * and send the whole file. */
+static int
+evhttp_parse_range(const char *range, ev_int64_t size,
+    ev_int64_t *startp, ev_int64_t *lenp)
+{
+	ev_int64_t start, end;
+	char *endp;
+
+	if (strncmp(range, "bytes=", 6) || strchr(range, ','))
+		return (0);
+	range += 6;
+
+	if (*range == '-') {
+		/* the last so many bytes */
+		if (!EVUTIL_ISDIGIT(range[1]))
+			return (0);
+		end = evutil_strtoll(range + 1, &endp, 10);
+		if (*endp != '\0')
+			return (0);
+		if (end == 0 || size == 0)
+			return (-1);
+		if (end > size)
+			end = size;
+		*startp = size - end;
+		*lenp = end;
+		return (1);
+	}
+
+	if (!EVUTIL_ISDIGIT(*range))
+		return (0);
+	start = evutil_strtoll(range, &endp, 10);
+	if (*endp++ != '-')
+		return (0);
+	if (*endp == '\0') {
+		end = size - 1;
+	} else {
+		if (!EVUTIL_ISDIGIT(*endp))
+			return (0);
+		end = evutil_strtoll(endp, &endp, 10);
+		if (*endp != '\0' || end < start)
+			return (0);
+		if (end >= size)
+			end = size - 1;
+	}
+	if (start >= size)
+		return (-1);
+	*startp = start;
+	*lenp = end - start + 1;
+	return (1);
+}
+
+#ifdef _EVENT_HAVE_LIBZ
+/* Make the gzipped copy of file, if we haven't already.  Returns 0 on
+ * success and -1 on failure. */
+static int
+evhttp_file_gzip(struct evhttp_file *file, int level)
+{
+	struct evbuffer *raw, *out = NULL;
+	struct evbuffer_iovec v;
+	ev_int64_t off;
+	ev_ssize_t n;
+	z_stream z;
+	int r = -1;
+
+	if (file->gzipped != NULL)
+		return (0);
+
+	/* Nothing else cares where the fd's offset is: the evbuffers that
+	 * send the file say where to send from. */
+	if ((raw = evbuffer_new()) == NULL)
+		return (-1);
+	if (evbuffer_reserve_space(raw, (ev_ssize_t)file->size, &v, 1) < 1 ||
+	    lseek(file->fd, 0, SEEK_SET) == -1)
+		goto done;
+	for (off = 0; off < file->size; off += n) {
+		n = read(file->fd, (char *)v.iov_base + off,
+		    (size_t)(file->size - off));
+		if (n <= 0)
+			goto done;
+	}
+	v.iov_len = (size_t)file->size;
+	evbuffer_commit_space(raw, &v, 1);
+
+	if ((out = evbuffer_new()) == NULL ||
+	    evhttp_deflate_init(&z, "gzip", level) == -1)
+		goto done;
+	r = evhttp_deflate_buffer(&z, out, raw, Z_FINISH);
+	deflateEnd(&z);
+	if (r == 0) {
+		file->gzipped = out;
+		out = NULL;
+	}
+
+done:
+	evbuffer_free(raw);
+	if (out != NULL)
+		evbuffer_free(out);
+	return (r);
+}
+#endif
+
+/* Return true iff we should answer req with the gzipped copy of file,
+ * making it if need be.  Files that some clients would get gzipped get a
+ * Vary header whatever happens. */
+static int
+evhttp_file_want_gzip(struct evhttp_request *req, struct evhttp_file *file)
+{
+#ifdef _EVENT_HAVE_LIBZ
+	struct evhttp *http = req->evcon->http_server;
+	const char *encoding;
+
+	if (http == NULL || http->compress_level == 0 || file->size == 0 ||
+	    file->size < (ev_int64_t)http->compress_min_size ||
+	    file->size > HTTP_FILE_GZIP_MAX ||
+	    !evhttp_is_compressible_type(file->content_type,
+		strlen(file->content_type)))
+		return (0);
+	evhttp_add_header(req->output_headers, "Vary", "Accept-Encoding");
+
+	/* a Range is of the file as it is on disk */
+	if (evhttp_find_input_header(req, "Range") != NULL)
+		return (0);
+	encoding = evhttp_choose_encoding(req->input_headers);
+	if (encoding == NULL || strcmp(encoding, "gzip"))
+		return (0);
+	return (evhttp_file_gzip(file, http->compress_level) == 0);
+#else
+	return (0);
+#endif
+}
+
+void
+evhttp_file_server_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_file_server *server = arg;
+	struct evkeyvalq *headers = req->output_headers;
+	struct evhttp_file *file;
+	struct timeval now;
+	const char *range, *tag, *etag;
+	char path[1024], buf[64];
+	ev_int64_t start = 0, len;
+	int code = HTTP_OK, fd, gzip;
+	const char *reason = "OK";
+
+	if (req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD) {
+		evhttp_send_error(req, 405, "Method Not Allowed");
+		return;
+	}
+
+	event_base_gettime_cached(req->evcon->base, &now);
+	if (evhttp_file_server_path(server, req->uri, path, sizeof(path)) ||
+	    (file = evhttp_file_get(server, path, now.tv_sec)) == NULL) {
+		evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+		return;
+	}
+
+	gzip = evhttp_file_want_gzip(req, file);
+	etag = gzip ? file->gzip_etag : file->etag;
+
+	evhttp_add_header(headers, "Content-Type", file->content_type);
+	if (gzip)
+		evhttp_add_header(headers, "Content-Encoding", "gzip");
+	evhttp_add_header(headers, "ETag", etag);
+	if (file->last_modified[0])
+		evhttp_add_header(headers, "Last-Modified",
+		    file->last_modified);
+	evhttp_add_header(headers, "Accept-Ranges", "bytes");
+
+	if ((tag = evhttp_find_input_header(req, "If-None-Match")) != NULL ?
+	    !strcmp(tag, etag) :
+	    ((tag = evhttp_find_input_header(req,
+		    "If-Modified-Since")) != NULL &&
+		!strcmp(tag, file->last_modified))) {
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+		return;
+	}
+
+	len = gzip ? (ev_int64_t)evbuffer_get_length(file->gzipped) :
+	    file->size;
+	if ((range = evhttp_find_input_header(req, "Range")) &&
+	    ((tag = evhttp_find_input_header(req, "If-Range")) ==
+		NULL || !strcmp(tag, file->etag))) {
+		switch (evhttp_parse_range(range, file->size, &start, &len)) {
+		case -1:
+			evutil_snprintf(buf, sizeof(buf), "bytes */%lld",
+			    (long long)file->size);
+			evhttp_add_header(headers, "Content-Range", buf);
+			evhttp_send_reply(req, 416,
+			    "Requested Range Not Satisfiable", NULL);
+			return;
+		case 1:
+			evutil_snprintf(buf, sizeof(buf),
+			    "bytes %lld-%lld/%lld", (long long)start,
+			    (long long)(start + len - 1),
+			    (long long)file->size);
+			evhttp_add_header(headers, "Content-Range", buf);
+			code = 206;
+			reason = "Partial Content";
+			break;
+		default:
+			break;
+		}
+	}
 
-	evhttp_clear_headers(req->output_headers);
-	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
-	evhttp_add_header(req->output_headers, "Connection", "close");
+	if (gzip && req->type == EVHTTP_REQ_GET) {
+		if (evbuffer_add_buffer_reference(req->output_buffer,
+			file->gzipped) == -1) {
+			evhttp_send_error(req, HTTP_SERVUNAVAIL,
+			    "Service Unavailable");
+			return;
+		}
+	} else if (req->type == EVHTTP_REQ_GET && len > 0) {
+		/* The evbuffer closes the fd it's given, so it gets its
+		 * own. */
+		if ((fd = dup(file->fd)) == -1) {
+			evhttp_send_error(req, HTTP_SERVUNAVAIL,
+			    "Service Unavailable");
+			return;
+		}
+		if (evbuffer_add_file(req->output_buffer, fd, (off_t)start,
+			(size_t)len) == -1) {
+			close(fd);
+			evhttp_send_error(req, HTTP_SERVUNAVAIL,
+			    "Service Unavailable");
+			return;
+		}
+	}
+	evutil_snprintf(buf, sizeof(buf), "%lld", (long long)len);
+	evhttp_add_header(headers, "Content-Length", buf);
 
-	evhttp_send(req, databuf);
+	evhttp_send_reply(req, code, reason, NULL);
 }
 
 static const char uri_chars[256] = {
@@ -2237,12 +4700,299 @@ evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
 	mm_free(line);
 }
 
+int
+evhttp_query_next(const char *uri, const char **pos,
+    struct evhttp_query_param *param)
+{
+	const char *p = *pos, *end, *eq;
+
+	if (p == NULL) {
+		if (uri == NULL || (p = strchr(uri, '?')) == NULL)
+			return (0);
+		++p;
+	}
+
+	for (; *p != '\0'; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, "&");
+		eq = memchr(p, '=', end - p);
+		/* like evhttp_parse_query(), we want key=value */
+		if (eq == NULL)
+			continue;
+		param->key = p;
+		param->key_len = eq - p;
+		param->value = eq + 1;
+		param->value_len = end - (eq + 1);
+		*pos = *end ? end + 1 : end;
+		return (1);
+	}
+
+	*pos = p;
+	return (0);
+}
+
+static int
+evhttp_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	return (EVUTIL_TOLOWER(c) - 'a' + 10);
+}
+
+size_t
+evhttp_query_decode(const char *value, size_t len, char *buf,
+    size_t buflen)
+{
+	size_t i, j;
+	char c;
+
+	for (i = j = 0; i < len; ++i, ++j) {
+		c = value[i];
+		if (c == '+') {
+			c = ' ';
+		} else if (c == '%' && i + 2 < len &&
+		    EVUTIL_ISXDIGIT(value[i+1]) &&
+		    EVUTIL_ISXDIGIT(value[i+2])) {
+			c = (char)((evhttp_hexval(value[i+1]) << 4) |
+			    evhttp_hexval(value[i+2]));
+			i += 2;
+		}
+		if (j + 1 < buflen)
+			buf[j] = c;
+	}
+	if (buflen > 0)
+		buf[j < buflen ? j : buflen - 1] = '\0';
+
+	return (j);
+}
+
+ev_ssize_t
+evhttp_query_get(const char *uri, const char *key, char *buf, size_t buflen)
+{
+	struct evhttp_query_param param;
+	const char *pos = NULL;
+	size_t key_len = strlen(key);
+
+	while (evhttp_query_next(uri, &pos, &param)) {
+		if (param.key_len == key_len &&
+		    !memcmp(param.key, key, key_len))
+			return (evhttp_query_decode(param.value,
+				param.value_len, buf, buflen));
+	}
+	return (-1);
+}
+
+static inline unsigned
+hash_evhttp_cb(struct evhttp_cb *cb)
+{
+	return ht_string_hash(cb->what);
+}
+
+static inline int
+eq_evhttp_cb(struct evhttp_cb *a, struct evhttp_cb *b)
+{
+	return !strcmp(a->what, b->what);
+}
+
+HT_PROTOTYPE(evhttp_cb_map, evhttp_cb, node, hash_evhttp_cb, eq_evhttp_cb);
+HT_GENERATE(evhttp_cb_map, evhttp_cb, node, hash_evhttp_cb, eq_evhttp_cb,
+    0.5, mm_malloc, mm_realloc, mm_free);
+
+/* Host names are case-insensitive, so vhost keys hash and compare that
+ * way too. */
+static inline unsigned
+hash_evhttp_vhost(struct evhttp *vhost)
+{
+	return evhttp_strcasehash(vhost->vhost_key);
+}
+
+static inline int
+eq_evhttp_vhost(struct evhttp *a, struct evhttp *b)
+{
+	return !evutil_strcasecmp(a->vhost_key, b->vhost_key);
+}
+
+HT_PROTOTYPE(evhttp_vhost_map, evhttp, vhost_node, hash_evhttp_vhost,
+    eq_evhttp_vhost);
+HT_GENERATE(evhttp_vhost_map, evhttp, vhost_node, hash_evhttp_vhost,
+    eq_evhttp_vhost, 0.5, mm_malloc, mm_realloc, mm_free);
+
+/* Make a radix tree node whose edge is labelled with the first len bytes
+ * of label, followed by the first more_len bytes of more. */
+static struct evhttp_route_node *
+route_node_new(const char *label, size_t len, const char *more,
+    size_t more_len)
+{
+	struct evhttp_route_node *node;
+	if ((node = mm_calloc(1, sizeof(*node) + len + more_len + 1)) == NULL)
+		return (NULL);
+	node->label = (char *)(node + 1);
+	memcpy(node->label, label, len);
+	memcpy(node->label + len, more, more_len);
+	node->label[len + more_len] = '\0';
+	node->label_len = len + more_len;
+	return (node);
+}
+
+static void
+route_node_free(struct evhttp_route_node *node)
+{
+	struct evhttp_route_node *child;
+	while ((child = node->children) != NULL) {
+		node->children = child->next_sibling;
+		route_node_free(child);
+	}
+	mm_free(node);
+}
+
+/* Return the child of node whose label starts with c, and make *linkp
+ * point at the pointer to it. */
+static struct evhttp_route_node *
+route_child(struct evhttp_route_node *node, char c,
+    struct evhttp_route_node ***linkp)
+{
+	struct evhttp_route_node **link = &node->children;
+	while (*link && (*link)->label[0] != c)
+		link = &(*link)->next_sibling;
+	if (linkp)
+		*linkp = link;
+	return (*link);
+}
+
+/* Give prefix the callback cb in the tree under root.  Return -1 if prefix
+ * has one already or we're out of memory. */
+static int
+route_insert(struct evhttp_route_node *root, const char *prefix,
+    struct evhttp_cb *cb)
+{
+	struct evhttp_route_node *node = root, *child, *mid, **link;
+	size_t n;
+
+	while (*prefix) {
+		child = route_child(node, *prefix, &link);
+		if (child == NULL) {
+			child = route_node_new(prefix, strlen(prefix),
+			    NULL, 0);
+			if (child == NULL)
+				return (-1);
+			child->cb = cb;
+			*link = child;
+			return (0);
+		}
+		for (n = 1; n < child->label_len && prefix[n] == child->label[n];
+		     ++n)
+			;
+		if (n < child->label_len) {
+			/* The prefix ends or turns off partway along the
+			 * edge: split it there. */
+			if ((mid = route_node_new(child->label, n, NULL, 0)) == NULL)
+				return (-1);
+			mid->next_sibling = child->next_sibling;
+			mid->children = child;
+			child->next_sibling = NULL;
+			memmove(child->label, child->label + n,
+			    child->label_len - n + 1);
+			child->label_len -= n;
+			*link = mid;
+			child = mid;
+		}
+		prefix += n;
+		node = child;
+	}
+	if (node->cb != NULL)
+		return (-1);
+	node->cb = cb;
+	return (0);
+}
+
+/* Fold node's only child into it, where *link points to node.  Return -1
+ * if we're out of memory, which only costs us a longer path. */
+static int
+route_merge(struct evhttp_route_node **link)
+{
+	struct evhttp_route_node *node = *link, *child = node->children;
+	struct evhttp_route_node *merged;
+
+	if ((merged = route_node_new(node->label, node->label_len,
+		    child->label, child->label_len)) == NULL)
+		return (-1);
+	merged->cb = child->cb;
+	merged->children = child->children;
+	merged->next_sibling = node->next_sibling;
+	*link = merged;
+	mm_free(child);
+	mm_free(node);
+	return (0);
+}
+
+/* Take away the callback for prefix in the tree under root, and return it,
+ * or NULL if there was none. */
 static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+route_remove(struct evhttp_route_node *root, const char *prefix)
 {
+	struct evhttp_route_node *node = root, *parent = NULL, *child;
+	struct evhttp_route_node **link = NULL, **parent_link = NULL;
 	struct evhttp_cb *cb;
+
+	while (*prefix) {
+		struct evhttp_route_node **next_link;
+		child = route_child(node, *prefix, &next_link);
+		if (child == NULL ||
+		    strncmp(child->label, prefix, child->label_len))
+			return (NULL);
+		prefix += child->label_len;
+		parent = node;
+		parent_link = link;
+		link = next_link;
+		node = child;
+	}
+	if ((cb = node->cb) == NULL)
+		return (NULL);
+	node->cb = NULL;
+
+	/* Keep the tree compressed: no node without a callback has fewer
+	 * than two children, except the root. */
+	if (node == root)
+		return (cb);
+	if (node->children == NULL) {
+		*link = node->next_sibling;
+		mm_free(node);
+		if (parent != root && parent->cb == NULL &&
+		    parent->children && parent->children->next_sibling == NULL)
+			route_merge(parent_link);
+	} else if (node->children->next_sibling == NULL) {
+		route_merge(link);
+	}
+	return (cb);
+}
+
+/* Return the callback for the longest prefix of the len bytes at path that
+ * has one, or NULL. */
+static struct evhttp_cb *
+route_lookup(struct evhttp_route_node *root, const char *path, size_t len)
+{
+	struct evhttp_route_node *node = root;
+	struct evhttp_cb *best = root->cb;
+
+	while (len) {
+		node = route_child(node, *path, NULL);
+		if (node == NULL || node->label_len > len ||
+		    memcmp(node->label, path, node->label_len))
+			break;
+		path += node->label_len;
+		len -= node->label_len;
+		if (node->cb)
+			best = node->cb;
+	}
+	return (best);
+}
+
+static struct evhttp_cb *
+evhttp_dispatch_callback(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_cb *cb = NULL, key;
 	size_t offset = 0;
-	char *translated;
+	char buf[256];
+	char *translated = buf;
 
 	/* Test for different URLs */
 	char *p = req->uri;
@@ -2250,134 +5000,449 @@ evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
 		++p;
 	offset = (size_t)(p - req->uri);
 
-	if ((translated = mm_malloc(offset + 1)) == NULL)
+	/* Most paths fit on the stack. */
+	if (offset >= sizeof(buf) &&
+	    (translated = mm_malloc(offset + 1)) == NULL)
 		return (NULL);
 	offset = evhttp_decode_uri_internal(req->uri, offset,
 	    translated, 0 /* always_decode_plus */);
 
-	TAILQ_FOREACH(cb, callbacks, next) {
-		int res = 0;
-		res = ((strncmp(cb->what, translated, offset) == 0) &&
-		    (cb->what[offset] == '\0'));
+	/* A %00 can't match anything. */
+	if (strlen(translated) == offset) {
+		key.what = translated;
+		cb = HT_FIND(evhttp_cb_map, &http->callbacks_by_uri, &key);
+		if (cb == NULL && http->prefix_routes != NULL)
+			cb = route_lookup(http->prefix_routes, translated,
+			    offset);
+	}
+
+	if (translated != buf)
+		mm_free(translated);
+	return (cb);
+}
+
+static int
+prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+{
+	char c;
+
+	while (1) {
+		switch (c = *pattern++) {
+		case '\0':
+			return *name == '\0';
 
-		if (res) {
-			mm_free(translated);
-			return (cb);
+		case '*':
+			do {
+				if (prefix_suffix_match(pattern, name,
+					ignorecase))
+					return (1);
+			} while (*name++ != '\0');
+			return (0);
+		default:
+			if (c != *name) {
+				if (!ignorecase ||
+				    EVUTIL_TOLOWER(c) != EVUTIL_TOLOWER(*name))
+					return (0);
+			}
+			++name;
 		}
 	}
+	/* NOTREACHED */
+}
+
+/* Return the key under which http should index a vhost with pattern, and
+ * set *mapp to the map to index it in; or return NULL if the pattern has
+ * to be matched by hand. */
+static const char *
+vhost_index_key(struct evhttp *http, const char *pattern,
+    struct evhttp_vhost_map **mapp)
+{
+	if (pattern[0] == '*' && pattern[1] == '.' &&
+	    strchr(pattern + 1, '*') == NULL) {
+		*mapp = &http->vhosts_by_suffix;
+		return (pattern + 1);
+	} else if (strchr(pattern, '*') == NULL) {
+		*mapp = &http->vhosts_by_host;
+		return (pattern);
+	}
+	return (NULL);
+}
+
+/* Find the vhost of http that should handle requests for hostname.  An
+ * exact match wins, then the "*.domain" with the longest domain, then
+ * whichever other pattern was added first. */
+static struct evhttp *
+evhttp_find_vhost(struct evhttp *http, const char *hostname)
+{
+	struct evhttp key, *vhost;
+	const char *p;
+
+	key.vhost_key = hostname;
+	if ((vhost = HT_FIND(evhttp_vhost_map, &http->vhosts_by_host, &key)))
+		return (vhost);
+
+	for (p = strchr(hostname, '.'); p; p = strchr(p + 1, '.')) {
+		key.vhost_key = p;
+		vhost = HT_FIND(evhttp_vhost_map, &http->vhosts_by_suffix,
+		    &key);
+		if (vhost)
+			return (vhost);
+	}
 
-	mm_free(translated);
+	TAILQ_FOREACH(vhost, &http->wildcard_vhosts, next_wildcard) {
+		if (prefix_suffix_match(vhost->vhost_pattern, hostname,
+			1 /* ignorecase */))
+			return (vhost);
+	}
 	return (NULL);
 }
 
+static void
+evhttp_handle_request(struct evhttp_request *req, void *arg)
+{
+	struct evhttp *http = arg;
+	struct evhttp_cb *cb = NULL;
+	const char *hostname;
+
+	if (req->uri == NULL) {
+		evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+		return;
+	}
+
+	/* handle potential virtual hosts */
+	hostname = evhttp_find_input_header(req, "Host");
+	if (hostname != NULL) {
+		struct evhttp *vhost = evhttp_find_vhost(http, hostname);
+		if (vhost != NULL) {
+			evhttp_handle_request(req, vhost);
+			return;
+		}
+	}
+
+	if ((cb = evhttp_dispatch_callback(http, req)) != NULL) {
+		(*cb->cb)(req, cb->cbarg);
+		return;
+	}
+
+	/* Generic call back */
+	if (http->gencb) {
+		(*http->gencb)(req, http->gencbarg);
+		return;
+	} else {
+		/* We need to send a 404 here */
+#define ERR_FORMAT "<html><head>" \
+		    "<title>404 Not Found</title>" \
+		    "</head><body>" \
+		    "<h1>Not Found</h1>" \
+		    "<p>The requested URL %s was not found on this server.</p>"\
+		    "</body></html>\n"
+
+		char *escaped_html = evhttp_htmlescape(req->uri);
+		struct evbuffer *buf = evbuffer_new();
+
+		evhttp_response_code(req, HTTP_NOTFOUND, "Not Found");
+
+		evbuffer_add_printf(buf, ERR_FORMAT, escaped_html);
+
+		mm_free(escaped_html);
+
+		evhttp_send_page(req, buf);
+
+		evbuffer_free(buf);
+#undef ERR_FORMAT
+	}
+}
+
+/* If req is for a callback that takes its body as it arrives, give the
+ * request to that callback now instead of once the body is in. */
+/* Find the callback that req is for, as evhttp_handle_request() would,
+ * among those of *http and its vhosts; and set *http to the server whose
+ * callback it is, or that gets the request if none is. */
+static struct evhttp_cb *
+evhttp_route(struct evhttp **http, struct evhttp_request *req)
+{
+	struct evhttp *vhost;
+	const char *hostname;
+
+	if (req->uri == NULL)
+		return (NULL);
+
+	hostname = evhttp_find_input_header(req, "Host");
+	while (hostname != NULL &&
+	    (vhost = evhttp_find_vhost(*http, hostname)) != NULL)
+		*http = vhost;
+
+	return (evhttp_dispatch_callback(*http, req));
+}
+
+static void
+evhttp_route_body(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
+	struct evhttp *http = evcon->http_server;
+	struct evhttp_cb *cb;
+
+	if (http == NULL)
+		return;
+
+	cb = evhttp_route(&http, req);
+	if (cb != NULL && cb->chunk_cb != NULL) {
+		req->cb = cb->cb;
+		req->cb_arg = cb->cbarg;
+		req->chunk_cb = cb->chunk_cb;
+	}
+}
+
+/* Statistics.  Nothing here is called unless the server that accepted the
+ * connection has stats_enabled set. */
+
+static void
+evhttp_stats_output_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	evcon->stats_bytes_out += info->n_added;
+}
+
+/* Note that a request has started to arrive on evcon. */
+static void
+evhttp_stats_start(struct evhttp_connection *evcon)
+{
+	evutil_gettimeofday(&evcon->stats_start, NULL);
+	evcon->stats_bytes_out = 0;
+	if (evcon->stats_cb == NULL)
+		evcon->stats_cb = evbuffer_add_cb(
+			bufferevent_get_output(evcon->bufev),
+			evhttp_stats_output_cb, evcon);
+}
+
+/* Count req, whose response evcon has just finished writing, under the
+ * route it went to. */
+static void
+evhttp_stats_record(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp *http = evcon->http_server;
+	struct evhttp_cb *cb = evhttp_route(&http, req);
+	struct evhttp_route_stats *st = cb ? &cb->stats : &http->unrouted_stats;
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+	struct timeval now, diff;
+	long usec;
+	int bucket = 0;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &evcon->stats_start, &diff);
+	if (diff.tv_sec < 0) {
+		/* the clock went backwards */
+		evutil_timerclear(&diff);
+	}
+	usec = diff.tv_sec * 1000000L + diff.tv_usec;
+	while (usec > 0 && bucket < EVHTTP_STATS_HISTOGRAM_SIZE - 1) {
+		usec >>= 1;
+		++bucket;
+	}
+
+	EVLOCK_LOCK(http->stats_lock, 0);
+	++st->n_requests;
+	st->bytes_in += store->headers_size + evcon->body_size;
+	st->bytes_out += evcon->stats_bytes_out;
+	++st->usec_histogram[bucket];
+	EVLOCK_UNLOCK(http->stats_lock, 0);
+
+	evutil_timerclear(&evcon->stats_start);
+}
+
+int
+evhttp_enable_stats(struct evhttp *http, int enable)
+{
+	if (http == NULL)
+		return (-1);
+	http->stats_enabled = enable != 0;
+	return (0);
+}
+
+int
+evhttp_get_route_stats(struct evhttp *http, const char *path,
+    struct evhttp_route_stats *stats)
+{
+	struct evhttp_route_stats *st = NULL;
+	struct evhttp_cb *cb;
+
+	if (path == NULL) {
+		st = &http->unrouted_stats;
+	} else {
+		TAILQ_FOREACH(cb, &http->callbacks, next) {
+			if (!strcmp(cb->what, path)) {
+				st = &cb->stats;
+				break;
+			}
+		}
+		if (st == NULL)
+			return (-1);
+	}
+
+	EVLOCK_LOCK(http->stats_lock, 0);
+	*stats = *st;
+	EVLOCK_UNLOCK(http->stats_lock, 0);
+	return (0);
+}
 
-static int
-prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+void
+evhttp_reset_stats(struct evhttp *http)
 {
-	char c;
+	struct evhttp_cb *cb;
 
-	while (1) {
-		switch (c = *pattern++) {
-		case '\0':
-			return *name == '\0';
+	EVLOCK_LOCK(http->stats_lock, 0);
+	memset(&http->unrouted_stats, 0, sizeof(http->unrouted_stats));
+	TAILQ_FOREACH(cb, &http->callbacks, next)
+		memset(&cb->stats, 0, sizeof(cb->stats));
+	EVLOCK_UNLOCK(http->stats_lock, 0);
+}
 
-		case '*':
-			while (*name != '\0') {
-				if (prefix_suffix_match(pattern, name,
-					ignorecase))
-					return (1);
-				++name;
-			}
-			return (0);
-		default:
-			if (c != *name) {
-				if (!ignorecase ||
-				    EVUTIL_TOLOWER(c) != EVUTIL_TOLOWER(*name))
-					return (0);
-			}
-			++name;
-		}
+ev_uint64_t
+evhttp_route_stats_percentile(const struct evhttp_route_stats *stats,
+    int percent)
+{
+	ev_uint64_t rank, seen = 0;
+	int i;
+
+	if (stats->n_requests == 0)
+		return (0);
+	if (percent < 0)
+		percent = 0;
+	else if (percent > 100)
+		percent = 100;
+
+	/* the rank of the request at the percentile, counting from 1 */
+	rank = (stats->n_requests * percent + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < EVHTTP_STATS_HISTOGRAM_SIZE - 1; ++i) {
+		seen += stats->usec_histogram[i];
+		if (seen >= rank)
+			break;
 	}
-	/* NOTREACHED */
+	return ((ev_uint64_t)1 << i);
 }
 
 static void
-evhttp_handle_request(struct evhttp_request *req, void *arg)
+evhttp_stats_add_line(struct evbuffer *buf, const char *name,
+    const struct evhttp_route_stats *st)
+{
+	evbuffer_add_printf(buf, "%s requests=%llu in=%llu out=%llu "
+	    "p50=%llu p99=%llu\n", name,
+	    (unsigned long long)st->n_requests,
+	    (unsigned long long)st->bytes_in,
+	    (unsigned long long)st->bytes_out,
+	    (unsigned long long)evhttp_route_stats_percentile(st, 50),
+	    (unsigned long long)evhttp_route_stats_percentile(st, 99));
+}
+
+static void
+evhttp_stats_cb(struct evhttp_request *req, void *arg)
 {
 	struct evhttp *http = arg;
-	struct evhttp_cb *cb = NULL;
-	const char *hostname;
+	struct evhttp_route_stats st;
+	struct evhttp_cb *cb;
+	struct evbuffer *buf;
 
-	if (req->uri == NULL) {
-		evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+	if ((buf = evbuffer_new()) == NULL) {
+		evhttp_send_error(req, HTTP_SERVUNAVAIL, "Out of memory");
 		return;
 	}
 
-	/* handle potential virtual hosts */
-	hostname = evhttp_find_header(req->input_headers, "Host");
-	if (hostname != NULL) {
-		struct evhttp *vhost;
-		TAILQ_FOREACH(vhost, &http->virtualhosts, next) {
-			if (prefix_suffix_match(vhost->vhost_pattern, hostname,
-				1 /* ignorecase */)) {
-				evhttp_handle_request(req, vhost);
-				return;
-			}
-		}
-	}
-
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
-		(*cb->cb)(req, cb->cbarg);
-		return;
+	/* copy each route's counts out before formatting them, so that we
+	 * don't hold the lock while we do */
+	TAILQ_FOREACH(cb, &http->callbacks, next) {
+		EVLOCK_LOCK(http->stats_lock, 0);
+		st = cb->stats;
+		EVLOCK_UNLOCK(http->stats_lock, 0);
+		evhttp_stats_add_line(buf, cb->what, &st);
 	}
+	EVLOCK_LOCK(http->stats_lock, 0);
+	st = http->unrouted_stats;
+	EVLOCK_UNLOCK(http->stats_lock, 0);
+	evhttp_stats_add_line(buf, "-", &st);
+
+	evhttp_add_header(req->output_headers, "Content-Type", "text/plain");
+	evhttp_add_header(req->output_headers, "Cache-Control", "no-cache");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
 
-	/* Generic call back */
-	if (http->gencb) {
-		(*http->gencb)(req, http->gencbarg);
-		return;
-	} else {
-		/* We need to send a 404 here */
-#define ERR_FORMAT "<html><head>" \
-		    "<title>404 Not Found</title>" \
-		    "</head><body>" \
-		    "<h1>Not Found</h1>" \
-		    "<p>The requested URL %s was not found on this server.</p>"\
-		    "</body></html>\n"
-
-		char *escaped_html = evhttp_htmlescape(req->uri);
-		struct evbuffer *buf = evbuffer_new();
-
-		evhttp_response_code(req, HTTP_NOTFOUND, "Not Found");
+int
+evhttp_set_stats_cb(struct evhttp *http, const char *path)
+{
+	return (evhttp_set_cb(http, path, evhttp_stats_cb, http));
+}
 
-		evbuffer_add_printf(buf, ERR_FORMAT, escaped_html);
+/* A socket accepted in the server's thread, waiting for a worker base to
+ * pick it up in its own. */
+struct evhttp_pending_socket {
+	TAILQ_ENTRY(evhttp_pending_socket) next;
+	evutil_socket_t fd;
+	socklen_t socklen;
+	struct sockaddr_storage ss;
+};
 
-		mm_free(escaped_html);
+static void evhttp_get_request_on(struct evhttp *, struct evhttp_worker *,
+    evutil_socket_t, struct sockaddr *, socklen_t);
 
-		evhttp_send_page(req, buf);
+/* Serve every socket that's been handed to a worker base so far. */
+static void
+evhttp_worker_pickup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_worker *worker = arg;
+	struct evhttp_pendingq pending;
+	struct evhttp_pending_socket *ps;
+
+	TAILQ_INIT(&pending);
+	EVLOCK_LOCK(worker->lock, 0);
+	while ((ps = TAILQ_FIRST(&worker->pending)) != NULL) {
+		TAILQ_REMOVE(&worker->pending, ps, next);
+		TAILQ_INSERT_TAIL(&pending, ps, next);
+	}
+	EVLOCK_UNLOCK(worker->lock, 0);
 
-		evbuffer_free(buf);
-#undef ERR_FORMAT
+	while ((ps = TAILQ_FIRST(&pending)) != NULL) {
+		TAILQ_REMOVE(&pending, ps, next);
+		evhttp_get_request_on(worker->http, worker, ps->fd,
+		    (struct sockaddr *)&ps->ss, ps->socklen);
+		mm_free(ps);
 	}
 }
 
 static void
-accept_socket(evutil_socket_t fd, short what, void *arg)
+accept_socket_cb(struct evconnlistener *listener, evutil_socket_t nfd,
+    struct sockaddr *sa, int salen, void *arg)
 {
 	struct evhttp *http = arg;
-	struct sockaddr_storage ss;
-	socklen_t addrlen = sizeof(ss);
-	evutil_socket_t nfd;
+	struct evhttp_worker *worker;
+	struct evhttp_pending_socket *ps;
 
-	if ((nfd = accept(fd, (struct sockaddr *)&ss, &addrlen)) == -1) {
-		int err = evutil_socket_geterror(fd);
-		if (! EVUTIL_ERR_ACCEPT_RETRIABLE(err))
-			event_warn("%s: bad accept", __func__);
+	if (!http->n_workers) {
+		evhttp_get_request(http, nfd, sa, salen);
 		return;
 	}
-	if (evutil_make_socket_nonblocking(nfd) < 0)
-		return;
 
-	evhttp_get_request(http, nfd, (struct sockaddr *)&ss, addrlen);
+	worker = http->workers[http->next_worker];
+	http->next_worker = (http->next_worker + 1) % http->n_workers;
+
+	if ((ps = mm_malloc(sizeof(struct evhttp_pending_socket))) == NULL ||
+	    salen > (int)sizeof(ps->ss)) {
+		event_warn("%s: malloc", __func__);
+		if (ps)
+			mm_free(ps);
+		EVUTIL_CLOSESOCKET(nfd);
+		return;
+	}
+	ps->fd = nfd;
+	ps->socklen = salen;
+	memcpy(&ps->ss, sa, salen);
+
+	EVLOCK_LOCK(worker->lock, 0);
+	TAILQ_INSERT_TAIL(&worker->pending, ps, next);
+	EVLOCK_UNLOCK(worker->lock, 0);
+	event_active(&worker->pickup_ev, EV_READ, 1);
 }
 
 int
@@ -2408,22 +5473,25 @@ int
 evhttp_accept_socket(struct evhttp *http, evutil_socket_t fd)
 {
 	struct evhttp_bound_socket *bound;
-	struct event *ev;
-	int res;
+	unsigned flags = LEV_OPT_CLOSE_ON_FREE;
+
+#ifndef WIN32
+	/* Keep a spare fd for turning clients away when we run out. */
+	flags |= LEV_OPT_RESERVE_FD;
+#endif
+
+	/* The listener accepts until it would block. */
+	if (evutil_make_socket_nonblocking(fd) < 0)
+		return (-1);
 
 	bound = mm_malloc(sizeof(struct evhttp_bound_socket));
 	if (bound == NULL)
 		return (-1);
 
-	ev = &bound->bind_ev;
-
-	/* Schedule the socket for accepting */
-	event_assign(ev, http->base,
-	    fd, EV_READ | EV_PERSIST, accept_socket, http);
-
-	res = event_add(ev, NULL);
-
-	if (res == -1) {
+	/* fd is already listening */
+	bound->listener = evconnlistener_new(http->base, accept_socket_cb,
+	    http, flags, 0, fd);
+	if (bound->listener == NULL) {
 		mm_free(bound);
 		return (-1);
 	}
@@ -2433,6 +5501,67 @@ evhttp_accept_socket(struct evhttp *http, evutil_socket_t fd)
 	return (0);
 }
 
+int
+evhttp_add_worker_base(struct evhttp *http, struct event_base *base)
+{
+	struct evhttp_worker *worker, **workers;
+
+	workers = mm_realloc(http->workers,
+	    (http->n_workers + 1) * sizeof(struct evhttp_worker *));
+	if (workers == NULL)
+		return (-1);
+	http->workers = workers;
+
+	if ((worker = mm_calloc(1, sizeof(struct evhttp_worker))) == NULL)
+		return (-1);
+	worker->http = http;
+	worker->base = base;
+	TAILQ_INIT(&worker->connections);
+	TAILQ_INIT(&worker->idle.conns);
+	worker->idle.http = http;
+	TAILQ_INIT(&worker->pending);
+	EVTHREAD_ALLOC_LOCK(worker->lock, EVTHREAD_LOCK_CATEGORY_OTHER);
+	event_assign(&worker->pickup_ev, base, -1, 0,
+	    evhttp_worker_pickup_cb, worker);
+
+	http->workers[http->n_workers++] = worker;
+	return (0);
+}
+
+static void
+evhttp_worker_free(struct evhttp_worker *worker)
+{
+	struct evhttp_pending_socket *ps;
+	struct evhttp_connection *evcon;
+
+	event_del(&worker->pickup_ev);
+	while ((ps = TAILQ_FIRST(&worker->pending)) != NULL) {
+		TAILQ_REMOVE(&worker->pending, ps, next);
+		EVUTIL_CLOSESOCKET(ps->fd);
+		mm_free(ps);
+	}
+	while ((evcon = TAILQ_FIRST(&worker->connections)) != NULL) {
+		/* evhttp_connection_free removes the connection */
+		evhttp_connection_free(evcon);
+	}
+	if (event_initialized(&worker->idle.reap_ev))
+		event_del(&worker->idle.reap_ev);
+	EVTHREAD_FREE_LOCK(worker->lock);
+	mm_free(worker);
+}
+
+void
+evhttp_serve_socket(struct evhttp *http, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen)
+{
+	if (evutil_make_socket_nonblocking(fd) < 0) {
+		EVUTIL_CLOSESOCKET(fd);
+		return;
+	}
+
+	evhttp_get_request(http, fd, sa, (socklen_t)socklen);
+}
+
 static struct evhttp*
 evhttp_new_object(void)
 {
@@ -2444,11 +5573,22 @@ evhttp_new_object(void)
 	}
 
 	http->timeout = -1;
+	http->max_headers_size = -1;
+	http->max_header_count = -1;
+	http->max_body_size = -1;
+	http->max_connections = -1;
+	EVTHREAD_ALLOC_LOCK(http->stats_lock, EVTHREAD_LOCK_CATEGORY_OTHER);
 
 	TAILQ_INIT(&http->sockets);
 	TAILQ_INIT(&http->callbacks);
+	HT_INIT(evhttp_cb_map, &http->callbacks_by_uri);
 	TAILQ_INIT(&http->connections);
+	TAILQ_INIT(&http->idle.conns);
+	http->idle.http = http;
 	TAILQ_INIT(&http->virtualhosts);
+	HT_INIT(evhttp_vhost_map, &http->vhosts_by_host);
+	HT_INIT(evhttp_vhost_map, &http->vhosts_by_suffix);
+	TAILQ_INIT(&http->wildcard_vhosts);
 
 	return (http);
 }
@@ -2473,6 +5613,7 @@ evhttp_start(const char *address, unsigned short port)
 	struct evhttp *http = evhttp_new_object();
 
 	if (evhttp_bind_socket(http, address, port) == -1) {
+		EVTHREAD_FREE_LOCK(http->stats_lock);
 		mm_free(http);
 		return (NULL);
 	}
@@ -2487,30 +5628,40 @@ evhttp_free(struct evhttp* http)
 	struct evhttp_connection *evcon;
 	struct evhttp_bound_socket *bound;
 	struct evhttp* vhost;
-	evutil_socket_t fd;
+	int i;
 
 	/* Remove the accepting part */
 	while ((bound = TAILQ_FIRST(&http->sockets)) != NULL) {
 		TAILQ_REMOVE(&http->sockets, bound, next);
 
-		fd = bound->bind_ev.ev_fd;
-		event_del(&bound->bind_ev);
-		EVUTIL_CLOSESOCKET(fd);
+		evconnlistener_free(bound->listener);
 
 		mm_free(bound);
 	}
 
+	for (i = 0; i < http->n_workers; ++i)
+		evhttp_worker_free(http->workers[i]);
+	if (http->workers)
+		mm_free(http->workers);
+
 	while ((evcon = TAILQ_FIRST(&http->connections)) != NULL) {
 		/* evhttp_connection_free removes the connection */
 		evhttp_connection_free(evcon);
 	}
+	if (event_initialized(&http->idle.reap_ev))
+		event_del(&http->idle.reap_ev);
 
+	HT_CLEAR(evhttp_cb_map, &http->callbacks_by_uri);
+	if (http->prefix_routes)
+		route_node_free(http->prefix_routes);
 	while ((http_cb = TAILQ_FIRST(&http->callbacks)) != NULL) {
 		TAILQ_REMOVE(&http->callbacks, http_cb, next);
 		mm_free(http_cb->what);
 		mm_free(http_cb);
 	}
 
+	HT_CLEAR(evhttp_vhost_map, &http->vhosts_by_host);
+	HT_CLEAR(evhttp_vhost_map, &http->vhosts_by_suffix);
 	while ((vhost = TAILQ_FIRST(&http->virtualhosts)) != NULL) {
 		TAILQ_REMOVE(&http->virtualhosts, vhost, next);
 
@@ -2520,6 +5671,7 @@ evhttp_free(struct evhttp* http)
 	if (http->vhost_pattern != NULL)
 		mm_free(http->vhost_pattern);
 
+	EVTHREAD_FREE_LOCK(http->stats_lock);
 	mm_free(http);
 }
 
@@ -2527,6 +5679,9 @@ int
 evhttp_add_virtual_host(struct evhttp* http, const char *pattern,
     struct evhttp* vhost)
 {
+	struct evhttp_vhost_map *map = NULL;
+	const char *key;
+
 	/* a vhost can only be a vhost once and should not have bound sockets */
 	if (vhost->vhost_pattern != NULL ||
 	    TAILQ_FIRST(&vhost->sockets) != NULL)
@@ -2538,6 +5693,19 @@ evhttp_add_virtual_host(struct evhttp* http, const char *pattern,
 
 	TAILQ_INSERT_TAIL(&http->virtualhosts, vhost, next);
 
+	/* A pattern we've already indexed gets scanned instead, so that
+	 * the first vhost added for it still wins. */
+	key = vhost_index_key(http, vhost->vhost_pattern, &map);
+	if (key != NULL) {
+		vhost->vhost_key = key;
+		if (HT_FIND(evhttp_vhost_map, map, vhost) == NULL) {
+			HT_INSERT(evhttp_vhost_map, map, vhost);
+			return (0);
+		}
+		vhost->vhost_key = NULL;
+	}
+	TAILQ_INSERT_TAIL(&http->wildcard_vhosts, vhost, next_wildcard);
+
 	return (0);
 }
 
@@ -2549,6 +5717,29 @@ evhttp_remove_virtual_host(struct evhttp* http, struct evhttp* vhost)
 
 	TAILQ_REMOVE(&http->virtualhosts, vhost, next);
 
+	if (vhost->vhost_key != NULL) {
+		struct evhttp_vhost_map *map = NULL;
+		struct evhttp *other;
+		vhost_index_key(http, vhost->vhost_pattern, &map);
+		HT_REMOVE(evhttp_vhost_map, map, vhost);
+		vhost->vhost_key = NULL;
+
+		/* Index the next vhost with the same pattern, if any. */
+		TAILQ_FOREACH(other, &http->wildcard_vhosts, next_wildcard) {
+			if (!evutil_strcasecmp(other->vhost_pattern,
+				vhost->vhost_pattern)) {
+				TAILQ_REMOVE(&http->wildcard_vhosts, other,
+				    next_wildcard);
+				other->vhost_key = vhost_index_key(http,
+				    other->vhost_pattern, &map);
+				HT_INSERT(evhttp_vhost_map, map, other);
+				break;
+			}
+		}
+	} else {
+		TAILQ_REMOVE(&http->wildcard_vhosts, vhost, next_wildcard);
+	}
+
 	mm_free(vhost->vhost_pattern);
 	vhost->vhost_pattern = NULL;
 
@@ -2561,38 +5752,122 @@ evhttp_set_timeout(struct evhttp* http, int timeout_in_secs)
 	http->timeout = timeout_in_secs;
 }
 
-int
-evhttp_set_cb(struct evhttp *http, const char *uri,
-    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+void
+evhttp_set_max_connections(struct evhttp *http, int max_connections)
 {
-	struct evhttp_cb *http_cb;
+	http->max_connections = max_connections < 0 ? -1 : max_connections;
+}
 
-	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
-		if (strcmp(http_cb->what, uri) == 0)
-			return (-1);
-	}
+void
+evhttp_set_max_headers_size(struct evhttp *http, ev_ssize_t max_headers_size)
+{
+	http->max_headers_size = max_headers_size < 0 ? -1 : max_headers_size;
+}
+
+void
+evhttp_set_max_header_count(struct evhttp *http, int max_header_count)
+{
+	http->max_header_count = max_header_count < 0 ? -1 : max_header_count;
+}
+
+void
+evhttp_set_max_body_size(struct evhttp *http, ev_ssize_t max_body_size)
+{
+	http->max_body_size = max_body_size < 0 ? -1 : max_body_size;
+}
+
+void
+evhttp_set_chunk_delivery_size(struct evhttp *http, size_t size)
+{
+	http->chunk_delivery_size = size;
+}
+
+static int
+evhttp_add_cb(struct evhttp *http, const char *uri, int prefix,
+    void (*cb)(struct evhttp_request *, void *),
+    void (*chunk_cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	struct evhttp_cb *http_cb;
+	int res;
 
 	if ((http_cb = mm_calloc(1, sizeof(struct evhttp_cb))) == NULL)
 		event_err(1, "%s: calloc", __func__);
 
 	http_cb->what = mm_strdup(uri);
+	http_cb->prefix = prefix;
 	http_cb->cb = cb;
+	http_cb->chunk_cb = chunk_cb;
 	http_cb->cbarg = cbarg;
 
+	if (prefix) {
+		if (http->prefix_routes == NULL &&
+		    (http->prefix_routes = route_node_new("", 0, NULL, 0)) == NULL)
+			res = -1;
+		else
+			res = route_insert(http->prefix_routes, uri, http_cb);
+	} else if (HT_FIND(evhttp_cb_map, &http->callbacks_by_uri, http_cb)) {
+		res = -1;
+	} else {
+		HT_INSERT(evhttp_cb_map, &http->callbacks_by_uri, http_cb);
+		res = 0;
+	}
+	if (res == -1) {
+		mm_free(http_cb->what);
+		mm_free(http_cb);
+		return (-1);
+	}
+
 	TAILQ_INSERT_TAIL(&http->callbacks, http_cb, next);
 
 	return (0);
 }
 
+int
+evhttp_set_cb(struct evhttp *http, const char *uri,
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	return evhttp_add_cb(http, uri, 0, cb, NULL, cbarg);
+}
+
+int
+evhttp_set_stream_cb(struct evhttp *http, const char *uri,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	return evhttp_add_cb(http, uri, 0, cb, chunk_cb, cbarg);
+}
+
+int
+evhttp_set_prefix_cb(struct evhttp *http, const char *prefix,
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	return evhttp_add_cb(http, prefix, 1, cb, NULL, cbarg);
+}
+
 int
 evhttp_del_cb(struct evhttp *http, const char *uri)
 {
-	struct evhttp_cb *http_cb;
+	struct evhttp_cb *http_cb, key;
 
-	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
-		if (strcmp(http_cb->what, uri) == 0)
-			break;
-	}
+	key.what = (char *)uri;
+	http_cb = HT_REMOVE(evhttp_cb_map, &http->callbacks_by_uri, &key);
+	if (http_cb == NULL)
+		return (-1);
+
+	TAILQ_REMOVE(&http->callbacks, http_cb, next);
+	mm_free(http_cb->what);
+	mm_free(http_cb);
+
+	return (0);
+}
+
+int
+evhttp_del_prefix_cb(struct evhttp *http, const char *prefix)
+{
+	struct evhttp_cb *http_cb = NULL;
+
+	if (http->prefix_routes)
+		http_cb = route_remove(http->prefix_routes, prefix);
 	if (http_cb == NULL)
 		return (-1);
 
@@ -2619,6 +5894,7 @@ struct evhttp_request *
 evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 {
 	struct evhttp_request *req = NULL;
+	struct evhttp_header_store *store;
 
 	/* Allocate request structure */
 	if ((req = mm_calloc(1, sizeof(struct evhttp_request))) == NULL) {
@@ -2627,12 +5903,12 @@ evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 	}
 
 	req->kind = EVHTTP_RESPONSE;
-	req->input_headers = mm_calloc(1, sizeof(struct evkeyvalq));
-	if (req->input_headers == NULL) {
+	if ((store = mm_calloc(1, sizeof(struct evhttp_header_store))) == NULL) {
 		event_warn("%s: calloc", __func__);
 		goto error;
 	}
-	TAILQ_INIT(req->input_headers);
+	TAILQ_INIT(&store->headers);
+	req->input_headers = &store->headers;
 
 	req->output_headers = mm_calloc(1, sizeof(struct evkeyvalq));
 	if (req->output_headers == NULL) {
@@ -2677,8 +5953,16 @@ evhttp_request_free(struct evhttp_request *req)
 	if (req->response_code_line != NULL)
 		mm_free(req->response_code_line);
 
-	evhttp_clear_headers(req->input_headers);
-	mm_free(req->input_headers);
+	if (req->input_headers != NULL) {
+		struct evhttp_header_store *store =
+		    evhttp_request_header_store(req);
+		/* Headers the user added from outside the store go one by
+		 * one; then the store's chunks go, whether or not any of
+		 * its headers are still on the list. */
+		evhttp_clear_unstored_headers(req->input_headers);
+		evhttp_header_store_clear(store);
+		mm_free(store);
+	}
 
 	evhttp_clear_headers(req->output_headers);
 	mm_free(req->output_headers);
@@ -2692,6 +5976,51 @@ evhttp_request_free(struct evhttp_request *req)
 	mm_free(req);
 }
 
+/* Empty out req, a finished request on a server connection, so that it can
+ * take the next request on the connection without allocating anything but
+ * its URI and evbuffer chains.  It keeps its header store's first chunk and
+ * its evbuffers; their chains are freed as they are drained, unless
+ * evbuffer_set_chain_cache_limit() has turned on the chain cache.  Returns
+ * -1 if req can't be reused. */
+static int
+evhttp_request_recycle(struct evhttp_request *req)
+{
+	struct evhttp_request saved = *req;
+	struct evhttp_header_store *store = evhttp_request_header_store(req);
+
+	if ((req->flags & (EVHTTP_REQ_DEFER_FREE|EVHTTP_USER_OWNED)) ||
+	    !TAILQ_EMPTY(&req->input_buffer->callbacks) ||
+	    !TAILQ_EMPTY(&req->output_buffer->callbacks))
+		return (-1);
+
+	if (req->uri != NULL)
+		mm_free(req->uri);
+	if (req->response_code_line != NULL)
+		mm_free(req->response_code_line);
+
+	/* headers allocated one by one have to go one by one */
+	evhttp_clear_unstored_headers(req->input_headers);
+	evhttp_header_store_reset(store);
+	evhttp_clear_headers(req->output_headers);
+
+	evbuffer_drain(req->input_buffer,
+	    evbuffer_get_length(req->input_buffer));
+	evbuffer_drain(req->output_buffer,
+	    evbuffer_get_length(req->output_buffer));
+
+	/* the peer is the same for every request on the connection */
+	memset(req, 0, sizeof(*req));
+	req->input_headers = saved.input_headers;
+	req->output_headers = saved.output_headers;
+	req->input_buffer = saved.input_buffer;
+	req->output_buffer = saved.output_buffer;
+	req->remote_host = saved.remote_host;
+	req->remote_port = saved.remote_port;
+	req->kind = EVHTTP_RESPONSE;
+
+	return (0);
+}
+
 void
 evhttp_request_own(struct evhttp_request *req)
 {
@@ -2711,6 +6040,32 @@ evhttp_request_set_chunked_cb(struct evhttp_request *req,
 	req->chunk_cb = cb;
 }
 
+void
+evhttp_request_pause(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (evcon == NULL || evcon->bufev == NULL)
+		return;
+	evcon->read_paused = 1;
+	bufferevent_disable(evcon->bufev, EV_READ);
+}
+
+void
+evhttp_request_resume(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (evcon == NULL || !evcon->read_paused)
+		return;
+	evcon->read_paused = 0;
+	if (evcon->state != EVCON_READING_BODY)
+		return;
+	bufferevent_enable(evcon->bufev, EV_READ);
+	/* we may have stopped with some of the body already read */
+	evhttp_connection_read_more(evcon);
+}
+
 /*
  * Allows for inspection of the request URI
  */
@@ -2754,7 +6109,7 @@ struct evbuffer *evhttp_request_get_output_buffer(struct evhttp_request *req)
 
 static struct evhttp_connection*
 evhttp_get_request_connection(
-	struct evhttp* http,
+	struct evhttp* http, struct event_base *base,
 	evutil_socket_t fd, struct sockaddr *sa, socklen_t salen)
 {
 	struct evhttp_connection *evcon;
@@ -2772,7 +6127,7 @@ evhttp_get_request_connection(
 
 	/* we need a connection object to put the http request on */
 	evcon = evhttp_connection_base_new(
-		http->base, hostname, atoi(portname));
+		base, hostname, atoi(portname));
 	mm_free(hostname);
 	mm_free(portname);
 	if (evcon == NULL)
@@ -2793,7 +6148,13 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 {
 	struct evhttp *http = evcon->http_server;
 	struct evhttp_request *req;
-	if ((req = evhttp_request_new(evhttp_handle_request, http)) == NULL)
+
+	if ((req = evcon->spare_req) != NULL) {
+		evcon->spare_req = NULL;
+		req->cb = evhttp_handle_request;
+		req->cb_arg = http;
+	} else if ((req = evhttp_request_new(evhttp_handle_request,
+		    http)) == NULL)
 		return (-1);
 
 	req->evcon = evcon;	/* the request ends up owning the connection */
@@ -2803,7 +6164,8 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 
 	req->kind = EVHTTP_REQUEST;
 
-	if ((req->remote_host = mm_strdup(evcon->address)) == NULL)
+	if (req->remote_host == NULL &&
+	    (req->remote_host = mm_strdup(evcon->address)) == NULL)
 		event_err(1, "%s: strdup", __func__);
 	req->remote_port = evcon->port;
 
@@ -2816,9 +6178,33 @@ void
 evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
     struct sockaddr *sa, socklen_t salen)
 {
+	evhttp_get_request_on(http, NULL, fd, sa, salen);
+}
+
+/* As evhttp_get_request, but put the connection on worker's base, if worker
+ * is set.  Call this from the thread of whichever base that is. */
+static void
+evhttp_get_request_on(struct evhttp *http, struct evhttp_worker *worker,
+    evutil_socket_t fd, struct sockaddr *sa, socklen_t salen)
+{
+	struct evhttp_idle_list *idle = worker ? &worker->idle : &http->idle;
 	struct evhttp_connection *evcon;
 
-	evcon = evhttp_get_request_connection(http, fd, sa, salen);
+	if (http->max_connections != -1 &&
+	    idle->n_connections >= http->max_connections) {
+		/* make room by closing the connection that's been idle
+		 * longest, or turn this one away if none of them are */
+		if ((evcon = TAILQ_FIRST(&idle->conns)) == NULL) {
+			event_debug(("%s: too many connections; closing %d",
+				__func__, fd));
+			EVUTIL_CLOSESOCKET(fd);
+			return;
+		}
+		evhttp_connection_free(evcon);
+	}
+
+	evcon = evhttp_get_request_connection(http,
+	    worker ? worker->base : http->base, fd, sa, salen);
 	if (evcon == NULL) {
 		event_sock_warn(fd, "%s: cannot get connection on %d", __func__, fd);
 		EVUTIL_CLOSESOCKET(fd);
@@ -2828,13 +6214,19 @@ evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
 	/* the timeout can be used by the server to close idle connections */
 	if (http->timeout != -1)
 		evhttp_connection_set_timeout(evcon, http->timeout);
+	evcon->chunk_delivery_size = http->chunk_delivery_size;
 
 	/*
 	 * if we want to accept more than one request on a connection,
 	 * we need to know which http server it belongs to.
 	 */
 	evcon->http_server = http;
-	TAILQ_INSERT_TAIL(&http->connections, evcon, next);
+	evcon->http_worker = worker;
+	if (worker)
+		TAILQ_INSERT_TAIL(&worker->connections, evcon, next);
+	else
+		TAILQ_INSERT_TAIL(&http->connections, evcon, next);
+	++idle->n_connections;
 
 	if (evhttp_associate_new_request_with_connection(evcon) == -1)
 		evhttp_connection_free(evcon);
@@ -2906,8 +6298,10 @@ name_from_addr(struct sockaddr *sa, socklen_t salen,
 
 /* Create a non-blocking socket and bind it */
 /* todo: rename this function */
+/* Creates a socket and binds it to ai if that is not NULL; otherwise the
+ * socket is left unbound, and of the given family. */
 static evutil_socket_t
-bind_socket_ai(struct addrinfo *ai, int reuse)
+bind_socket_ai(int family, struct addrinfo *ai, int reuse)
 {
         evutil_socket_t fd;
 
@@ -2915,7 +6309,7 @@ bind_socket_ai(struct addrinfo *ai, int reuse)
 	int serrno;
 
         /* Create listen socket */
-        fd = socket(AF_INET, SOCK_STREAM, 0);
+        fd = socket(ai != NULL ? ai->ai_family : family, SOCK_STREAM, 0);
         if (fd == -1) {
 			event_sock_warn(-1, "socket");
 			return (-1);
@@ -2996,14 +6390,14 @@ bind_socket(const char *address, ev_uint16_t port, int reuse)
 
 	/* just create an unbound socket */
 	if (address == NULL && port == 0)
-		return bind_socket_ai(NULL, 0);
+		return bind_socket_ai(AF_INET, NULL, 0);
 
 	aitop = make_addrinfo(address, port);
 
 	if (aitop == NULL)
 		return (-1);
 
-	fd = bind_socket_ai(aitop, reuse);
+	fd = bind_socket_ai(AF_INET, aitop, reuse);
 
 #ifdef _EVENT_HAVE_GETADDRINFO
 	freeaddrinfo(aitop);
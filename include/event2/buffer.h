@@ -140,6 +140,29 @@ void evbuffer_free(struct evbuffer *buf);
  */
 int evbuffer_enable_locking(struct evbuffer *buf, void *lock);
 
+/**
+   Make an evbuffer safe for one thread to add to while another one removes
+   from it, without a lock.
+
+   This is an alternative to evbuffer_enable_locking() for handing a stream
+   of data from one thread to another.  The adding thread only touches the
+   end of the buffer and the removing thread only touches its start, and
+   the length in between is published with memory barriers, so neither
+   ever waits for the other.
+
+   Only a few functions work on such a buffer: the producer may call
+   evbuffer_add(), the consumer may call evbuffer_remove() and
+   evbuffer_drain(), and either may call evbuffer_get_length().  No
+   callbacks are run.  Don't call any other evbuffer function on it, except
+   evbuffer_free() once neither thread uses it any more.
+
+   @param buf a new evbuffer, with no locking and no data
+   @return 0 on success, -1 on failure or if this platform has no atomic
+     operations.
+   @see evbuffer_enable_locking()
+ */
+int evbuffer_enable_spsc(struct evbuffer *buf);
+
 /**
    Acquire the lock on an evbuffer.  Has no effect if locking was not enabled
    with evbuffer_enable_locking.
@@ -186,6 +209,21 @@ size_t evbuffer_get_contiguous_space(const struct evbuffer *buf);
 */
 int evbuffer_expand(struct evbuffer *buf, size_t datlen);
 
+/**
+  Give back the memory that an evbuffer holds but doesn't use.
+
+  Empty chains are freed, and chains that draining has left mostly
+  empty are copied into smaller ones.  Data that lives in files, in
+  references, or in memory shared with other buffers stays where it is.
+
+  Like evbuffer_pullup(), this moves data around, so it invalidates any
+  evbuffer_ptr and any space reserved with evbuffer_reserve_space().
+
+  @param buf the evbuffer to be shrunk
+  @return 0 if successful, or -1 if we ran out of memory on the way
+ */
+int evbuffer_shrink(struct evbuffer *buf);
+
 /**
    Reserves space in the last chain of an event buffer.
 
@@ -323,6 +361,35 @@ char *evbuffer_readln(struct evbuffer *buffer, size_t *n_read_out,
  */
 int evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf);
 
+/**
+  Add the contents of one evbuffer to another without copying or
+  removing them.
+
+  Unlike evbuffer_add_buffer(), this leaves the data in inbuf, and outbuf
+  gets read-only chains that share inbuf's memory.  The memory is freed
+  once it has been drained from inbuf and from every evbuffer that shares
+  it, so one payload can be put in many output buffers at the cost of one
+  small allocation each.
+
+  The chains that inbuf has when this is called become read-only too:
+  later additions to inbuf go into new chains.  inbuf may be freed while
+  other buffers still share its data; its memory lasts as long as they
+  need it.
+
+  The buffers that share the data lock inbuf when they are done with it.
+  If they are used from more than one thread, inbuf therefore needs a lock
+  of its own, and the shared data must not be moved out of inbuf with
+  evbuffer_add_buffer() or evbuffer_remove_buffer().
+
+  @param outbuf the output buffer
+  @param inbuf the buffer whose data to share
+  @return 0 if successful, or -1 if an error occurred, including when
+    inbuf holds data from evbuffer_add_file() that can't be shared
+  @see evbuffer_add_buffer()
+ */
+int evbuffer_add_buffer_reference(struct evbuffer *outbuf,
+    struct evbuffer *inbuf);
+
 
 typedef void (*evbuffer_ref_cleanup_cb)(const void *data,
     size_t datalen, void *extra);
@@ -368,6 +435,175 @@ int evbuffer_add_reference(struct evbuffer *outbuf,
 int evbuffer_add_file(struct evbuffer *output, int fd, off_t offset,
     size_t length);
 
+/**
+  A part of a file that can be added to any number of evbuffers.
+
+  evbuffer_add_file() opens a new mapping, or takes over an fd, for every
+  evbuffer it is called on.  A file segment is set up once: it is sent with
+  sendfile() where available, and is otherwise mapped with mmap(), or if
+  need be read into memory, just once.  Each evbuffer it is added to gets
+  a chain that only refers to it, so the same file can go out on any number
+  of connections at once for the cost of one fd and one mapping.
+
+  @see evbuffer_file_segment_new(), evbuffer_add_file_segment()
+ */
+struct evbuffer_file_segment;
+
+/** Flag for evbuffer_file_segment_new(): close the fd once the segment and
+    every chain that refers to it have been freed. */
+#define EVBUF_FS_CLOSE_ON_FREE    0x01
+/** Flag for evbuffer_file_segment_new(): don't use sendfile(), so that the
+    data can be read out of the evbuffers it is added to.  Use this when the
+    evbuffers aren't written straight to a socket, as with a filtering or
+    SSL bufferevent. */
+#define EVBUF_FS_DISABLE_SENDFILE 0x02
+/** Flag for evbuffer_file_segment_new(): don't use mmap(); read the data
+    into memory instead, if sendfile() is not being used. */
+#define EVBUF_FS_DISABLE_MMAP     0x04
+/** Flag for evbuffer_file_segment_new(): don't give the segment a lock.
+    Only use this if the segment and every evbuffer it is added to are used
+    from a single thread. */
+#define EVBUF_FS_DISABLE_LOCKING  0x08
+
+/**
+  Create a file segment for length bytes of fd, starting at offset.
+
+  Unless EVBUF_FS_CLOSE_ON_FREE is set, the fd stays the caller's, and must
+  stay open until the segment is gone.  The file must not change while the
+  segment is in use.
+
+  @param fd the file to use
+  @param offset where in the file the segment starts
+  @param length how long the segment is, or -1 for the rest of the file
+  @param flags any number of the EVBUF_FS_* flags
+  @return the new segment, or NULL if an error occurred
+  @see evbuffer_file_segment_free(), evbuffer_add_file_segment()
+ */
+struct evbuffer_file_segment *evbuffer_file_segment_new(
+	int fd, off_t offset, off_t length, unsigned flags);
+
+/**
+  Release a file segment.
+
+  The segment stays alive, still mapped, until the data it added to
+  evbuffers has all been drained or freed.  Then it is unmapped, and its fd
+  closed if it was made with EVBUF_FS_CLOSE_ON_FREE.
+
+  @param seg the segment to release
+ */
+void evbuffer_file_segment_free(struct evbuffer_file_segment *seg);
+
+/**
+  Add part of a file segment to an evbuffer, without copying.
+
+  As with evbuffer_add_file(), if the segment uses sendfile(), the results
+  of using evbuffer_remove() or evbuffer_pullup() on this data are
+  undefined.
+
+  @param buf the evbuffer to add to
+  @param seg the segment to add from
+  @param offset where in the segment to start
+  @param length how much to add, or -1 for the rest of the segment
+  @return 0 if successful, or -1 if an error occurred
+ */
+int evbuffer_add_file_segment(struct evbuffer *buf,
+    struct evbuffer_file_segment *seg, off_t offset, off_t length);
+
+/**
+  Keep at most about threshold bytes of an output buffer in memory.
+
+  Once buf holds more than threshold bytes, the data after its first
+  threshold bytes is written to an unlinked temporary file, and is sent
+  from there with sendfile() or mmap(), as if it had been added with
+  evbuffer_add_file().  Data that is added later goes into memory first and
+  is moved to the file in batches.  A new file is started now and then, so
+  that the disk space of data that has been written out is given back.
+
+  This is meant for output buffers that a slow peer lets grow very large.
+  As with evbuffer_add_file(), the results of using evbuffer_remove() or
+  evbuffer_pullup() on the data in the file are undefined.  If the file
+  can't be written, spilling is turned off and the data stays in memory.
+
+  @param buf the evbuffer to limit
+  @param threshold how many bytes to keep in memory, or 0 to stop spilling
+  @param dir the directory for the file; NULL means $TMPDIR, or /tmp
+  @return 0 if successful, or -1 if an error occurred or spilling is not
+    supported on this platform
+ */
+int evbuffer_set_spill(struct evbuffer *buf, size_t threshold,
+    const char *dir);
+
+struct evbuffer_mem_group;
+
+/**
+  A function called when a memory group crosses one of its thresholds.
+
+  @param group the group
+  @param over 1 if the group's memory just went over its high threshold,
+    0 if it just came back down to its low threshold
+  @param arg the argument given to evbuffer_mem_group_new()
+ */
+typedef void (*evbuffer_mem_group_cb)(struct evbuffer_mem_group *group,
+    int over, void *arg);
+
+/**
+  Make a group whose evbuffers have their memory added up.
+
+  Each evbuffer in the group is charged for the memory its chains take,
+  headers included; chains that are moved to a buffer in another group
+  are charged to that group instead.  Once the group's total goes over
+  high, it is "over" until the total comes back down to low.
+
+  The callback hears of each change, at the end of the evbuffer operation
+  that caused it, with the lock of the evbuffer that did the operation
+  held.  It mustn't free the group.  bufferevent_set_mem_group() uses the
+  same states to stop reading on all of a group's bufferevents.
+
+  @param high the threshold to go over, or 0 for no thresholds
+  @param low the threshold to come back down to; at most high
+  @param cb the function to call on each crossing, or NULL
+  @param arg the last argument to cb
+  @return the new group, or NULL on error
+  @see evbuffer_set_mem_group(), evbuffer_mem_group_free()
+ */
+struct evbuffer_mem_group *evbuffer_mem_group_new(size_t high, size_t low,
+    evbuffer_mem_group_cb cb, void *arg);
+
+/**
+  Give up a memory group made with evbuffer_mem_group_new().
+
+  Its callback is not called again.  The group itself lasts as long as
+  some evbuffer or chain still uses it.
+ */
+void evbuffer_mem_group_free(struct evbuffer_mem_group *group);
+
+/** Return how many bytes of memory the chains in a group hold. */
+size_t evbuffer_mem_group_get_allocated(struct evbuffer_mem_group *group);
+
+/** Return 1 if a group went over its high threshold and hasn't come back
+    down to its low threshold since, and 0 otherwise. */
+int evbuffer_mem_group_is_over(struct evbuffer_mem_group *group);
+
+/**
+  Put an evbuffer in a memory group, or take it out with NULL.
+
+  The memory the buffer already holds moves to the new group.
+
+  @param buf the evbuffer
+  @param group the group to charge buf's memory to, or NULL
+  @return 0 on success, -1 on failure
+ */
+int evbuffer_set_mem_group(struct evbuffer *buf,
+    struct evbuffer_mem_group *group);
+
+/**
+  Return how many bytes of memory the chains of all evbuffers hold.
+
+  Without atomic operations, the total may be off when evbuffers are used
+  from more than one thread.
+ */
+size_t evbuffer_get_total_allocated(void);
+
 /**
   Append a formatted string to the end of an evbuffer.
 
@@ -394,6 +630,55 @@ int evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
  */
 int evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap);
 
+/**
+  Append an unsigned integer to the end of an evbuffer, in decimal.
+
+  This function, evbuffer_add_int(), evbuffer_add_hex() and
+  evbuffer_add_fixed() write their digits straight into space reserved at
+  the end of the buffer, which is a lot cheaper than formatting with
+  evbuffer_add_printf().
+
+  @param buf the evbuffer that will be appended to
+  @param n the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+  @see evbuffer_add_int(), evbuffer_add_hex(), evbuffer_add_fixed()
+ */
+int evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t n);
+
+/**
+  Append a signed integer to the end of an evbuffer, in decimal.
+
+  @param buf the evbuffer that will be appended to
+  @param n the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_int(struct evbuffer *buf, ev_int64_t n);
+
+/**
+  Append an unsigned integer to the end of an evbuffer, in lowercase
+  hexadecimal with no prefix, as printf's "%x" does.
+
+  @param buf the evbuffer that will be appended to
+  @param n the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_hex(struct evbuffer *buf, ev_uint64_t n);
+
+/**
+  Append a fixed-point number to the end of an evbuffer, in decimal.
+
+  The number appended is n / 10^decimals, written with exactly decimals
+  digits after the point: evbuffer_add_fixed(buf, -1234, 3) appends
+  "-1.234", and evbuffer_add_fixed(buf, 5, 2) appends "0.05".  With
+  decimals 0 this is the same as evbuffer_add_int().
+
+  @param buf the evbuffer that will be appended to
+  @param n the number to append, scaled up by 10^decimals
+  @param decimals how many digits to put after the point, from 0 to 19
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+int evbuffer_add_fixed(struct evbuffer *buf, ev_int64_t n, int decimals);
+
 
 /**
   Remove a specified number of bytes data from the beginning of an evbuffer.
@@ -443,6 +728,54 @@ int evbuffer_write_atmost(struct evbuffer *buffer, evutil_socket_t fd,
  */
 int evbuffer_read(struct evbuffer *buffer, evutil_socket_t fd, int howmuch);
 
+/**
+  Choose how much evbuffer_read() asks for from what earlier reads got.
+
+  Normally evbuffer_read() asks the kernel how much data is waiting, with an
+  extra ioctl() call, and then reads at most 4096 bytes into at most two
+  chains.  In adaptive mode it skips the ioctl().  It doubles the size of
+  its reads, up to EVBUFFER_ADAPTIVE_READ_MAX, spreading them over as many
+  chains as it takes, for as long as each read fills the space it was
+  given.  It halves them again, down to EVBUFFER_ADAPTIVE_READ_MIN, after
+  two reads in a row that use less than half.
+
+  Adaptive mode needs readv(); elsewhere this call has no effect.
+
+  @param buf the evbuffer that is read into
+  @param enable 1 to turn adaptive mode on, 0 to turn it off
+  @return 0 on success, -1 on failure
+ */
+int evbuffer_set_adaptive_read(struct evbuffer *buf, int enable);
+
+/** The smallest read that evbuffer_set_adaptive_read() will make. */
+#define EVBUFFER_ADAPTIVE_READ_MIN 1024
+/** The largest read that evbuffer_set_adaptive_read() will make. */
+#define EVBUFFER_ADAPTIVE_READ_MAX (256*1024)
+
+/**
+  Read from a socket into an evbuffer without copying the data into user
+  memory.
+
+  Where splice() is available, the data is moved into a kernel pipe that
+  the evbuffer owns, and it stays there until evbuffer_write() splices it
+  out to another socket.  The evbuffer counts those bytes like any others,
+  so its length, watermarks and callbacks all behave as usual, and its
+  chains can still be moved to another evbuffer with evbuffer_add_buffer().
+  The bytes themselves can't be looked at: don't remove, copy, pull up or
+  search data that was read this way; only move, drain or write it.
+
+  On other systems, or for descriptors that splice() can't read, this is
+  the same as evbuffer_read().
+
+  @param buf the evbuffer to store the result
+  @param fd the socket to read from
+  @param howmuch the number of bytes to be read, or -1 for as many as fit
+  @return the number of bytes read, or -1 if an error occurred
+  @see evbuffer_read()
+ */
+int evbuffer_read_splice(struct evbuffer *buffer, evutil_socket_t fd,
+    int howmuch);
+
 /**
    Search for a string within an evbuffer.
 
@@ -553,6 +886,35 @@ struct evbuffer_cb_entry;
  */
 struct evbuffer_cb_entry *evbuffer_add_cb(struct evbuffer *buffer, evbuffer_cb_func cb, void *cbarg);
 
+/** Add a callback to an evbuffer that only runs when its length crosses a
+    threshold.
+
+  Unlike callbacks from evbuffer_add_cb(), this one is not invoked on every
+  change to the buffer: it runs only when the length goes from below
+  threshold to threshold or more, or from threshold or more back below it.
+  Call evbuffer_get_length() from the callback to tell which way it went.
+  Remove it as with any other callback.
+
+  @param buffer the evbuffer to be monitored
+  @param threshold the length to watch
+  @param cb the callback function to invoke when the length crosses
+            threshold
+  @param cbarg an argument to be provided to the callback function
+  @return a handle to the callback on success, or NULL on failure.
+ */
+struct evbuffer_cb_entry *evbuffer_add_threshold_cb(struct evbuffer *buffer,
+    size_t threshold, evbuffer_cb_func cb, void *cbarg);
+
+/** Change the threshold of a callback added with evbuffer_add_threshold_cb.
+
+    The callback is not invoked for the move itself: later crossings are
+    measured from the buffer's current length.
+
+    @return 0 on success, or -1 if cb is not a threshold callback.
+ */
+int evbuffer_cb_set_threshold(struct evbuffer *buffer,
+    struct evbuffer_cb_entry *cb, size_t threshold);
+
 /** Remove a callback from an evbuffer, given a handle returned from
     evbuffer_add_cb.
 
@@ -685,6 +1047,89 @@ struct event_base;
  */
 int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 
+/**
+   Allocate the chains of an evbuffer from the object pool of an event_base
+   made with EVENT_BASE_FLAG_OBJECT_POOL.  The evbuffers of a bufferevent
+   do this automatically.
+
+   Call this before the buffer is shared between threads.  The buffer may
+   outlive base: the pool stays around until its last chain is freed.
+
+   @param buffer the evbuffer whose chains should come from the pool
+   @param base the event_base that owns the pool
+   @return 0 on success, -1 if base has no object pool
+ */
+int evbuffer_use_base_pool(struct evbuffer *buffer, struct event_base *base);
+
+/**
+   Set how much memory each thread may keep in its cache of freed evbuffer
+   chains.
+
+   When a thread frees an evbuffer chain that didn't come from an object
+   pool (see evbuffer_use_base_pool()), Libevent can keep it in a cache for
+   that thread, up to this many bytes in all, and reuse it the next time
+   the thread needs a chain of the same size.  The limit starts at 0, which
+   turns the cache off.  A few hundred kilobytes is plenty for most uses.
+
+   The limit is a global setting that applies to every thread.  Lowering it
+   trims the calling thread's cache at once; every other thread trims its
+   own cache the next time it frees a chain.  Nothing frees a thread's
+   cache when the thread exits, so once the cache is on, a thread that has
+   used evbuffers should call evbuffer_trim_chain_cache(0) before it exits.
+
+   @param max_bytes the most memory each thread's cache may hold
+   @return 0 on success, or -1 if chains can't be cached on this platform
+   @see evbuffer_trim_chain_cache()
+ */
+int evbuffer_set_chain_cache_limit(size_t max_bytes);
+
+/**
+   Free chains from the calling thread's cache of freed evbuffer chains
+   until it holds at most keep_bytes.
+
+   Each thread's cache is only freed when the thread calls this, or
+   trims it to a lowered evbuffer_set_chain_cache_limit(), so with the
+   cache on, a thread that has used evbuffers should call
+   evbuffer_trim_chain_cache(0) before it exits.
+
+   @param keep_bytes how much memory to leave in the cache
+   @return the number of bytes freed
+ */
+size_t evbuffer_trim_chain_cache(size_t keep_bytes);
+
+/**
+   Return how many bytes of freed chains the calling thread's cache holds.
+ */
+size_t evbuffer_get_chain_cache_size(void);
+
+/**
+   Let large evbuffer chains come from huge pages.
+
+   Chains of 256 KB up to 2 MB, like those that reading into a big buffer
+   or evbuffer_expand() make, are then cut from 2 MB regions that
+   Libevent maps itself: with MAP_HUGETLB if the system has huge pages set
+   aside, or else with madvise(MADV_HUGEPAGE).  Copying or writing out such
+   a chain then misses the TLB far less often.  The regions don't come
+   from the functions given to event_set_mem_functions(), which go on
+   serving every other allocation.
+
+   Freed chains are kept for reuse by any thread, and regions are never
+   unmapped.  Call this after setting up threading (see
+   evthread_use_pthreads()), and before starting any threads.
+
+   @param max_bytes the most memory to map for huge chains, or 0, which is
+     the default, to take no more chains from huge pages.  Lowering it
+     doesn't unmap what is already mapped.
+   @return 0 on success, or -1 if this platform can't map huge chains
+   @see evbuffer_get_huge_chain_mapped()
+ */
+int evbuffer_set_huge_chain_limit(size_t max_bytes);
+
+/**
+   Return how many bytes have been mapped for huge chains.
+ */
+size_t evbuffer_get_huge_chain_mapped(void);
+
 #ifdef __cplusplus
 }
 #endif
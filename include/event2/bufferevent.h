@@ -64,6 +64,8 @@ extern "C" {
 
 /* For int types. */
 #include <event2/util.h>
+/* For struct evbuffer_iovec. */
+#include <event2/buffer.h>
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -127,6 +129,59 @@ enum bufferevent_options {
 
 	/** If set, callbacks are run deferred in the event loop. */
 	BEV_OPT_DEFER_CALLBACKS = (1<<2),
+
+	/** If set, a socket bufferevent reads with evbuffer_read_splice(), so
+	 * that data it is only going to forward to another socket never gets
+	 * copied out of the kernel.  Move its input to the other bufferevent
+	 * with bufferevent_write_buffer(); don't look at it. */
+	BEV_OPT_SPLICE = (1<<3),
+
+	/** If set, a socket bufferevent corks its TCP socket (TCP_CORK or
+	 * TCP_NOPUSH) while it has output to send, and uncorks it at the end
+	 * of the event loop iteration in which the output buffer runs dry.
+	 * A reply put together over several callbacks then goes out in full
+	 * segments, without turning Nagle's algorithm back on.  Does nothing
+	 * on platforms without either socket option. */
+	BEV_OPT_CORK = (1<<4),
+
+	/** If set, a socket bufferevent does not wait for the socket to be
+	 * reported writable before sending new output.  Instead, it tries
+	 * to write directly at the end of the current batch of callbacks,
+	 * and only registers interest in EV_WRITE if the kernel would not
+	 * take everything.  This saves a round of polling (and, with epoll,
+	 * an epoll_ctl() call) per socket when one callback writes to many
+	 * bufferevents at once. */
+	BEV_OPT_OPTIMISTIC_WRITE = (1<<5),
+
+	/** If set, a socket bufferevent adds its events with EV_ET, so that
+	 * the backend reports the socket only when something changes on it,
+	 * not every time it is polled while readable or writable.  The
+	 * bufferevent reads and writes until the socket would block (or a
+	 * watermark or rate limit stops it), and tries again by itself when
+	 * it resumes before that happened.  The write event stays added
+	 * while writing is enabled, even with nothing to write.  Ignored if
+	 * the event_base doesn't support EV_FEATURE_ET. */
+	BEV_OPT_EDGE_TRIGGERED = (1<<6),
+
+	/** If set, bufferevent_socket_connect() uses TCP Fast Open: whatever
+	 * is already in the output buffer (up to the end of its first chain)
+	 * is sent along with the SYN, with sendto(MSG_FASTOPEN) or connectx(),
+	 * instead of a round trip later.  The server must have Fast Open
+	 * enabled (see LEV_OPT_TCP_FASTOPEN), and the data must be safe to
+	 * receive twice, since a duplicated SYN can deliver it again.  Falls
+	 * back to a plain connect() where Fast Open isn't available. */
+	BEV_OPT_TCP_FASTOPEN = (1<<7),
+
+	/** If set, a socket bufferevent sets TCP_NOTSENT_LOWAT on its socket,
+	 * so that the socket is reported writable only while the kernel holds
+	 * less than a threshold of unsent data (16 KB, unless the
+	 * bufferevent_socket_settings say otherwise).  Output then waits in
+	 * the output buffer, where it can still be reordered or dropped,
+	 * rather than in the socket buffer.  The write callback runs only once
+	 * the kernel is under the threshold too, so "the output is drained"
+	 * means the data is on its way, not just copied.  Does nothing on
+	 * platforms without TCP_NOTSENT_LOWAT. */
+	BEV_OPT_NOTSENT_LOWAT = (1<<8),
 };
 
 /**
@@ -143,6 +198,44 @@ enum bufferevent_options {
   */
 struct bufferevent *bufferevent_socket_new(struct event_base *base, evutil_socket_t fd, enum bufferevent_options options);
 
+/**
+   Socket options for bufferevent_socket_new_with_settings().  A field left
+   at 0 leaves the system's default alone.
+ */
+struct bufferevent_socket_settings {
+	/** SO_SNDBUF, in bytes */
+	int sndbuf;
+	/** SO_RCVBUF, in bytes */
+	int rcvbuf;
+	/** If nonzero, set TCP_NODELAY */
+	int nodelay;
+	/** With BEV_OPT_NOTSENT_LOWAT, the TCP_NOTSENT_LOWAT threshold, in
+	 * bytes */
+	int notsent_lowat;
+};
+
+/**
+  Create a new socket bufferevent, as bufferevent_socket_new() does, that
+  applies a set of socket options to its socket.
+
+  The options are applied to fd, and to any socket the bufferevent gets
+  later from bufferevent_setfd() or bufferevent_socket_connect().  Options
+  that the socket doesn't support are skipped.
+
+  @param base the event base to associate with the new bufferevent.
+  @param fd the file descriptor from which data is read and written to,
+	    or -1
+  @param options the options for the bufferevent
+  @param settings the socket options, or NULL for none; they are copied
+  @return a pointer to a newly allocated bufferevent struct, or NULL if an
+          error occurred
+  @see bufferevent_socket_new()
+  */
+struct bufferevent *bufferevent_socket_new_with_settings(
+    struct event_base *base, evutil_socket_t fd,
+    enum bufferevent_options options,
+    const struct bufferevent_socket_settings *settings);
+
 /**
    Launch a connect() attempt with a socket.  When the connect succeeds,
    the eventcb will be invoked with BEV_EVENT_CONNECTED set.
@@ -150,6 +243,9 @@ struct bufferevent *bufferevent_socket_new(struct event_base *base, evutil_socke
    If the bufferevent does not already have a socket set, we allocate a new
    socket here and make it nonblocking before we begin.
 
+   With BEV_OPT_TCP_FASTOPEN, write the request to the bufferevent before
+   calling this, so that it can go out with the SYN.
+
    @param bufev an existing bufferevent allocated with
        bufferevent_socket_new().
    @param addr the address we should connect to
@@ -158,6 +254,39 @@ struct bufferevent *bufferevent_socket_new(struct event_base *base, evutil_socke
  */
 int bufferevent_socket_connect(struct bufferevent *, struct sockaddr *, int);
 
+struct evdns_base;
+/**
+   Resolve the hostname 'hostname' and connect to it as with
+   bufferevent_socket_connect().
+
+   The A and AAAA records are looked up in parallel using 'evdns_base', and
+   connection attempts to the resulting addresses are raced against one
+   another, alternating between IPv6 and IPv4.  The first socket to connect
+   is given to the bufferevent, and the eventcb is invoked with
+   BEV_EVENT_CONNECTED set.  If every lookup or every attempt fails, the
+   eventcb is invoked with BEV_EVENT_ERROR set; use
+   bufferevent_socket_get_dns_error() to see whether resolution failed.
+
+   Numeric addresses are connected to directly, without a lookup.
+
+   @param bufev an existing bufferevent allocated with
+       bufferevent_socket_new().  It must not have a socket set yet.
+   @param evdns_base the evdns_base to use for resolving the hostname
+   @param family AF_INET, AF_INET6, or AF_UNSPEC to accept either.
+   @param hostname the hostname to resolve
+   @param port the port to connect to, in host order
+   @return 0 if the lookup or connect was launched, -1 on failure.
+ */
+int bufferevent_socket_connect_hostname(struct bufferevent *bufev,
+    struct evdns_base *evdns_base, int family, const char *hostname, int port);
+
+/**
+   Return the DNS error (one of the DNS_ERR_* values) that caused the most
+   recent bufferevent_socket_connect_hostname() call on 'bufev' to fail, or 0
+   if resolution did not fail.
+ */
+int bufferevent_socket_get_dns_error(struct bufferevent *bufev);
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -172,6 +301,9 @@ int bufferevent_base_set(struct event_base *base, struct bufferevent *bufev);
 /**
   Assign a priority to a bufferevent.
 
+  Its events, and with BEV_OPT_DEFER_CALLBACKS its deferred callbacks, run
+  at this priority.
+
   @param bufev a bufferevent struct
   @param pri the priority to be assigned
   @return 0 if successful, or -1 if an error occurred
@@ -354,6 +486,133 @@ void bufferevent_set_timeouts(struct bufferevent *bufev,
 void bufferevent_setwatermark(struct bufferevent *bufev, short events,
     size_t lowmark, size_t highmark);
 
+/**
+  Free a bufferevent's buffer memory when it has been idle for a while.
+
+  Once both the input and the output buffer of bufev have stayed empty for
+  idle, the bufferevent gives back all the memory they still hold, as
+  evbuffer_shrink() would, so that an idle connection costs no buffer
+  memory.  The buffers allocate again as soon as there is data to read or
+  write.  Each time either buffer empties or fills up again, the
+  bufferevent only has to reschedule one timer.
+
+  @param bufev the bufferevent to be modified
+  @param idle how long both buffers must be empty before their memory is
+         freed, or NULL to keep the memory
+  @return 0 on success, -1 on failure
+*/
+int bufferevent_set_idle_release(struct bufferevent *bufev,
+    const struct timeval *idle);
+
+struct evbuffer_mem_group;
+
+/**
+  Put a bufferevent's input and output buffers in a memory group.
+
+  While the group is over its high threshold, the bufferevent stops
+  reading from the network, as it does when its input is over its high
+  watermark.  It starts again once the group comes back down to its low
+  threshold, unless a watermark still holds it back.
+
+  @param bufev the bufferevent to be modified
+  @param group the group, or NULL to take the bufferevent out of its group
+  @return 0 on success, -1 on failure
+  @see evbuffer_mem_group_new()
+*/
+int bufferevent_set_mem_group(struct bufferevent *bufev,
+    struct evbuffer_mem_group *group);
+
+struct ev_token_bucket_cfg;
+struct bufferevent_rate_limit_group;
+
+/** Pass this as a rate and burst to ev_token_bucket_cfg_new() for a
+ * direction that should not be limited. */
+#define EV_RATE_LIMIT_MAX EV_SSIZE_MAX
+
+/**
+  Create a configuration for token-bucket rate limiting.
+
+  A token bucket starts out full.  Every byte read or written takes a
+  token from it, and every tick_len it gets back read_rate (or
+  write_rate) tokens, up to read_burst (or write_burst).  A bufferevent
+  whose bucket is empty stops reading or writing until the next tick.
+
+  A configuration can be shared by any number of bufferevents and
+  groups, and must outlive them all.
+
+  @param read_rate bytes we may read per tick, on average
+  @param read_burst the most bytes we may read in one tick
+  @param write_rate bytes we may write per tick, on average
+  @param write_burst the most bytes we may write in one tick
+  @param tick_len how long a tick is, or NULL for one second
+  @return the new configuration, or NULL on failure
+*/
+struct ev_token_bucket_cfg *ev_token_bucket_cfg_new(
+    size_t read_rate, size_t read_burst,
+    size_t write_rate, size_t write_burst,
+    const struct timeval *tick_len);
+
+/** Free a configuration made with ev_token_bucket_cfg_new(). */
+void ev_token_bucket_cfg_free(struct ev_token_bucket_cfg *cfg);
+
+/**
+  Limit the bandwidth of a bufferevent.
+
+  Only socket bufferevents honor the limit so far; with a filter
+  bufferevent, limit the bufferevent underneath it.
+
+  @param bev the bufferevent to be limited
+  @param cfg the rate limit, or NULL to remove the one bev has
+  @return 0 on success, -1 on failure
+*/
+int bufferevent_set_rate_limit(struct bufferevent *bev,
+    struct ev_token_bucket_cfg *cfg);
+
+/**
+  Create a group of bufferevents that share one pair of token buckets.
+
+  On top of any limit of their own, the members of a group together read
+  and write no more than cfg allows.  Every member gets an even share of
+  what the group has left, and the members that had to wait get to go
+  first on the next tick.
+
+  @param base the event base whose timer refills the group's buckets
+  @param cfg the rate limit for the whole group
+  @return the new group, or NULL on failure
+*/
+struct bufferevent_rate_limit_group *bufferevent_rate_limit_group_new(
+    struct event_base *base, const struct ev_token_bucket_cfg *cfg);
+
+/**
+  Free a rate limit group.  Its members are taken out of it first.
+*/
+void bufferevent_rate_limit_group_free(
+    struct bufferevent_rate_limit_group *group);
+
+/**
+  Add a bufferevent to a rate limit group, taking it out of any group it
+  was in before.
+
+  @return 0 on success, -1 on failure
+*/
+int bufferevent_add_to_rate_limit_group(struct bufferevent *bev,
+    struct bufferevent_rate_limit_group *group);
+
+/**
+  Take a bufferevent out of its rate limit group, if it has one.
+
+  @return 0 on success, -1 on failure
+*/
+int bufferevent_remove_from_rate_limit_group(struct bufferevent *bev);
+
+/**
+  Return how many bytes a bufferevent may read or write right now, given
+  its own rate limit and its group's share, or EV_SSIZE_MAX if neither
+  limits it.  The result is negative if the bufferevent has overdrawn.
+*/
+ev_ssize_t bufferevent_get_max_to_read(struct bufferevent *bev);
+ev_ssize_t bufferevent_get_max_to_write(struct bufferevent *bev);
+
 /**
    Flags that can be passed into filters to let them know how to
    deal with the incoming data.
@@ -444,6 +703,48 @@ bufferevent_filter_new(struct bufferevent *underlying,
 		       void (*free_context)(void *),
 		       void *ctx);
 
+/** A callback function to implement a filter that only looks at its data.
+
+    Instead of moving data from one evbuffer to another, an inspecting
+    filter is shown the data at the start of its source buffer in place,
+    and says how many of those bytes may pass through unchanged.  The
+    filtering bufferevent then moves them along with
+    evbuffer_remove_buffer(), which hands over whole chains instead of
+    copying whenever it can.
+
+    @param vec An array of extents pointing to the start of the data in the
+       source buffer.  The filter must not modify them.
+    @param n_vec The number of extents in vec.  Only a bounded number of
+       extents are shown at once; the filter is called again once the
+       bytes it passed are gone.
+    @param n_pass Set this to the number of bytes, counted from the start
+       of vec, to pass through unchanged.
+    @param state As for bufferevent_filter_cb.
+    @param ctx A user-supplied pointer.
+
+    @return BEV_OK if bytes were passed; BEV_NEED_MORE if nothing can pass
+       until more data arrives; and BEV_ERROR on an error.
+ */
+typedef enum bufferevent_filter_result (*bufferevent_inspect_filter_cb)(
+    const struct evbuffer_iovec *vec, int n_vec, size_t *n_pass,
+    enum bufferevent_flush_mode state, void *ctx);
+
+/**
+   Allocate a new filtering bufferevent on top of an existing bufferevent,
+   using filters that inspect data in place rather than copy it.
+
+   A NULL filter passes all data through unchanged.
+
+   @see bufferevent_filter_new(), bufferevent_inspect_filter_cb
+ */
+struct bufferevent *
+bufferevent_filter_new_inspect(struct bufferevent *underlying,
+			       bufferevent_inspect_filter_cb input_filter,
+			       bufferevent_inspect_filter_cb output_filter,
+			       enum bufferevent_options options,
+			       void (*free_context)(void *),
+			       void *ctx);
+
 /**
    Allocate a pair of linked bufferevents.  The bufferevents behave as would
    two bufferevent_sock instances connected to opposite ends of a
@@ -458,6 +759,32 @@ int
 bufferevent_pair_new(struct event_base *base, enum bufferevent_options options,
     struct bufferevent *pair[2]);
 
+/**
+   Allocate a pair of linked bufferevents whose ends belong to different
+   event_bases, so that two threads can talk through them.
+
+   pair[0] must only be used from the thread running base0, and pair[1] only
+   from the thread running base1.  Data written to one end is handed over to
+   the other a batch of chains at a time through a lock-free queue, and the
+   other end's base is only woken when it has nothing left to read.  When
+   one end is freed, or flushed with BEV_FINISHED, the other gets
+   BEV_EVENT_EOF once it has read everything sent before.
+
+   Threading must be set up with evthread_use_pthreads() or
+   evthread_use_windows_threads() before the bases are created.
+
+   @param base0 The event base for pair[0].
+   @param base1 The event base for pair[1].
+   @param options A set of options for both bufferevents
+   @param pair A pointer to an array to hold the two new bufferevent objects.
+   @return 0 on success, -1 on failure or if this platform has no atomic
+     operations.
+ */
+int
+bufferevent_pair_new_xthread(struct event_base *base0,
+    struct event_base *base1, enum bufferevent_options options,
+    struct bufferevent *pair[2]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVENT2_BUFFEREVENT_SSL_H_
+#define _EVENT2_BUFFEREVENT_SSL_H_
+
+/** @file bufferevent_ssl.h
+
+    OpenSSL support for bufferevents.
+
+    A TLS bufferevent runs an OpenSSL session over either a socket, which it
+    reads and writes itself, or another bufferevent, whose evbuffers it
+    reads and writes through a BIO without an intermediate buffer.
+    Decrypted data is read straight into the input evbuffer, and the output
+    evbuffer is encrypted a chain at a time, without copying it out first.
+
+    The session is put in SSL_MODE_RELEASE_BUFFERS, so that OpenSSL frees
+    its read and write buffers whenever a connection goes idle.
+
+    These functions live in libevent_openssl.
+ */
+
+#include <event-config.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* This is what openssl's SSL objects are underneath. */
+struct ssl_st;
+
+/** The state of the TLS session when a bufferevent takes it over. */
+enum bufferevent_ssl_state {
+	/** The handshake is already done. */
+	BUFFEREVENT_SSL_OPEN = 0,
+	/** We need to do the handshake as the client. */
+	BUFFEREVENT_SSL_CONNECTING = 1,
+	/** We need to do the handshake as the server. */
+	BUFFEREVENT_SSL_ACCEPTING = 2
+};
+
+/**
+   Create a new TLS bufferevent that sends its data over another bufferevent.
+
+   The eventcb is invoked with BEV_EVENT_CONNECTED set once the handshake
+   is done, if there was one to do.
+
+   @param base An event_base to use to detect reading and writing.  It
+      must also be the base for the underlying bufferevent.
+   @param underlying A socket to use for this TLS session
+   @param ssl A SSL* object from openssl.
+   @param state The current state of the SSL connection
+   @param options One or more bufferevent_options.  With
+      BEV_OPT_CLOSE_ON_FREE, freeing the bufferevent frees ssl and
+      underlying too.
+   @return A new bufferevent on success, or NULL on failure
+*/
+struct bufferevent *
+bufferevent_openssl_filter_new(struct event_base *base,
+    struct bufferevent *underlying,
+    struct ssl_st *ssl,
+    enum bufferevent_ssl_state state,
+    enum bufferevent_options options);
+
+/**
+   Create a new TLS bufferevent that sends its data over a socket.
+
+   @param base An event_base to use to detect reading and writing
+   @param fd A socket to use for this TLS session, or -1 to use one already
+      set on ssl.
+   @param ssl A SSL* object from openssl.
+   @param state The current state of the SSL connection
+   @param options One or more bufferevent_options.  With
+      BEV_OPT_CLOSE_ON_FREE, freeing the bufferevent frees ssl and closes
+      fd too.
+   @return A new bufferevent on success, or NULL on failure.
+*/
+struct bufferevent *
+bufferevent_openssl_socket_new(struct event_base *base,
+    evutil_socket_t fd,
+    struct ssl_st *ssl,
+    enum bufferevent_ssl_state state,
+    enum bufferevent_options options);
+
+/** Return the underlying openssl SSL * object for a TLS bufferevent, or NULL
+    if bufev is not a TLS bufferevent. */
+struct ssl_st *
+bufferevent_openssl_get_ssl(struct bufferevent *bufev);
+
+/** Return the most recent OpenSSL error reported on a TLS bufferevent, and
+    forget it; or 0 if there is none left. */
+unsigned long
+bufferevent_get_openssl_error(struct bufferevent *bev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVENT2_BUFFEREVENT_SSL_H_ */
@@ -137,6 +137,12 @@
  *  Query: www.abc
  *  Order: www.abc., www.abc.myhome.net
  *
+ * Normally each name is only tried once the one before it has failed. With
+ * the search-parallel option set to N, up to N of them are looked up at
+ * once; the answer is still that of the first name in the order above
+ * that does not fail, and is given as soon as it is known, at which point
+ * the lookups of the names after it are dropped.
+ *
  * Internals:
  *
  * Requests are kept in two queues. The first is the inflight queue. In
@@ -220,7 +226,8 @@ struct event_base;
 
   This function initializes support for non-blocking name resolution by
   calling evdns_resolv_conf_parse() on UNIX and
-  evdns_config_windows_nameservers() on Windows.
+  evdns_config_windows_nameservers() on Windows.  On UNIX it also loads
+  /etc/hosts for evdns_getaddrinfo().
 
   @param event_base the event base to associate the dns client with
   @param initialize_nameservers 1 if resolve.conf processing should occur
@@ -383,6 +390,80 @@ struct evdns_request *evdns_base_resolve_reverse(struct evdns_base *base, const
  */
 struct evdns_request *evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *in, int flags, evdns_callback_type callback, void *ptr);
 
+struct addrinfo;
+struct evdns_getaddrinfo_request;
+
+/**
+   A callback for evdns_getaddrinfo().
+
+   @param result DNS_ERR_NONE on success, or one of the other DNS_ERR_* codes
+   @param res on success, the addresses found, which the callback owns and
+     must free with evdns_freeaddrinfo(); otherwise NULL
+   @param arg the argument that was passed to evdns_getaddrinfo()
+ */
+typedef void (*evdns_getaddrinfo_cb)(int result, struct addrinfo *res, void *arg);
+
+/**
+  Look up the addresses for a host name, in the manner of getaddrinfo(), but
+  without blocking.
+
+  A NULL nodename gives the loopback addresses, or the wildcard ones if
+  hints has AI_PASSIVE set.  A numeric address is answered without any I/O,
+  as is a name listed in the hosts file.  Anything else is looked up with
+  an A and an AAAA query at once, as hints->ai_family allows.  The answer
+  lists IPv4 addresses before IPv6 ones, with one entry per socket type
+  when hints doesn't name one.
+
+  Only ai_family, ai_socktype, ai_protocol and the AI_PASSIVE and
+  AI_NUMERICHOST flags of hints are looked at.  The callback always runs
+  from the event loop, never from within this function.
+
+  @param base the evdns_base to use for lookups
+  @param nodename the host name or numeric address to look up, or NULL
+  @param servname a port number, or NULL for port 0; service names are not
+    looked up
+  @param hints the kind of answer wanted, or NULL for any
+  @param cb the function to call with the answer
+  @param arg an argument to pass to the callback
+  @return a handle to pass to evdns_getaddrinfo_cancel(), or NULL if the
+    arguments were invalid or we ran out of memory, in which case the
+    callback is never run
+  @see evdns_freeaddrinfo()
+ */
+struct evdns_getaddrinfo_request *evdns_getaddrinfo(struct evdns_base *base, const char *nodename, const char *servname, const struct addrinfo *hints, evdns_getaddrinfo_cb cb, void *arg);
+
+/**
+  Cancel an evdns_getaddrinfo() whose callback has not run yet.  The
+  callback will not be run.
+
+  @param req the handle returned by evdns_getaddrinfo()
+ */
+void evdns_getaddrinfo_cancel(struct evdns_getaddrinfo_request *req);
+
+/**
+  Free a list of addresses passed to an evdns_getaddrinfo_cb.
+
+  @param ai the list to free
+ */
+void evdns_freeaddrinfo(struct addrinfo *ai);
+
+/**
+  Replace an evdns_base's hosts file entries with the ones in a file in
+  /etc/hosts format.
+
+  Every lookup consults these entries before asking a nameserver: a name
+  with addresses of the type asked for is answered with them, and a
+  reverse lookup of an address gets the first name listed for it.  The
+  file is read again, at most once a second, when its modification time
+  or size changes.  evdns_base_new() loads /etc/hosts when it is told to
+  initialize nameservers.
+
+  @param base the evdns_base to load the entries into
+  @param hosts_fname the file to read, or NULL for /etc/hosts
+  @return 0 if successful, or -1 if the file could not be read
+ */
+int evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname);
+
 /**
   Cancels a pending DNS resolution request.
 
@@ -392,16 +473,34 @@ struct evdns_request *evdns_base_resolve_reverse_ipv6(struct evdns_base *base, c
 */
 void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
 
+/**
+  Forget every answer cached by an evdns_base.
+
+  @param base the evdns_base whose cache to clear
+  @see evdns_base_set_option()
+*/
+void evdns_base_clear_cache(struct evdns_base *base);
+
 /**
   Set the value of a configuration option.
 
   The currently available configuration options are:
 
     ndots, timeout, max-timeouts, max-inflight, attempts, randomize-case,
-    bind-to.
+    bind-to, cache-size, cache-negative-ttl, search-parallel.
 
   The option name needs to end with a colon.
 
+  cache-size is the number of answers to keep, each for as long as its TTL
+  allows; the least recently used one is dropped when the cache is full.
+  It is 0, and the cache off, by default.  cache-negative-ttl is how many
+  seconds to remember NXDOMAIN and SERVFAIL answers for; with the default
+  of 0 they are not cached.
+
+  search-parallel is how many names of the search list to look up at
+  once.  It is set with DNS_OPTION_SEARCH; 1 or less, the default, tries
+  them one at a time.
+
   @param base the evdns_base to which to apply this operation
   @param option the name of the configuration option to be modified
   @param val the value to be set
@@ -565,6 +664,29 @@ struct evdns_server_port *evdns_add_server_port_with_base(struct event_base *bas
 /** Close down a DNS server port, and free associated structures. */
 void evdns_close_server_port(struct evdns_server_port *port);
 
+/**
+   Make a DNS server port keep the responses it sends, to answer the same
+   question again without calling back.
+
+   A response is kept for a request with exactly one question, under its
+   name (in any case), type and class, and reused with the new request's
+   transaction id, RD and CD flags and spelling of the name.  Only use this
+   when the answer to a question doesn't depend on who asks.
+
+   @param port the server port
+   @param max_answers how many responses to keep at most, dropping the
+     least recently used one when full; 0 keeps none, as by default
+   @param seconds how long to keep each response for
+   @see evdns_server_port_clear_answer_cache()
+ */
+void evdns_server_port_set_answer_cache(struct evdns_server_port *port, int max_answers, int seconds);
+
+/**
+   Forget every response kept by evdns_server_port_set_answer_cache(), as
+   when the data they were built from changes.
+ */
+void evdns_server_port_clear_answer_cache(struct evdns_server_port *port);
+
 /** Sets some flags in a reply we're building.
     Allows setting of the AA or RD flags
  */
@@ -100,6 +100,180 @@ int event_base_dispatch(struct event_base *);
  */
 const char *event_base_get_method(struct event_base *);
 
+/**
+ Get the number of times that a dispatch limit set with
+ event_config_set_max_dispatch_interval() stopped the event loop from running
+ every active callback before checking for new events.
+
+ @param eb the event_base structure returned by event_base_new()
+ @return the number of times a limit was hit since the base was created
+ */
+unsigned long event_base_get_n_dispatch_limit_hits(struct event_base *);
+
+/** Return the clock that an event_base keeps time with. */
+enum event_clock_source event_base_get_clock_source(struct event_base *);
+
+/**
+   Store in *tv the time by base's clock, which is what timeouts are
+   measured against.
+
+   While callbacks are running this is the time the loop cached when it
+   woke up, so it costs no system call, and every callback in the same
+   round sees the same time.  The clock is usually monotonic, counting from
+   some arbitrary point; use event_base_gettimeofday_cached() for the time
+   of day.
+
+   @param base the event_base, or NULL for the current base
+   @param tv the structure to fill in
+   @return 0 on success, -1 on failure
+ */
+int event_base_gettime_cached(struct event_base *base, struct timeval *tv);
+
+/**
+   Like event_base_gettime_cached(), but give the time of day, as
+   gettimeofday() would.
+
+   The loop finds the difference between its clock and the time of day
+   every few seconds, so a change to the system time may take that long to
+   show up here.
+
+   @param base the event_base, or NULL for the current base
+   @param tv the structure to fill in
+   @return 0 on success, -1 on failure
+ */
+int event_base_gettimeofday_cached(struct event_base *base,
+    struct timeval *tv);
+
+/** Number of buckets in event_base_stats.callback_usec_histogram. */
+#define EVENT_STATS_HISTOGRAM_SIZE 32
+
+/**
+  Counters describing where an event_base's loop has spent its time.
+
+  @see event_base_enable_stats(), event_base_get_stats()
+ */
+struct event_base_stats {
+	/** Number of times the loop has called the backend's dispatch. */
+	ev_uint64_t n_iterations;
+	/** Total time spent waiting in the backend. */
+	struct timeval time_in_dispatch;
+	/** Total time spent running callbacks, deferred ones included. */
+	struct timeval time_in_callbacks;
+	/** Number of event callbacks run. */
+	ev_uint64_t n_callbacks;
+	/** Number of deferred callbacks run. */
+	ev_uint64_t n_deferred_callbacks;
+	/** Sum, over all iterations, of the number of active events found
+	    after dispatch; divide by n_iterations for the average. */
+	ev_uint64_t n_active_total;
+	/** The most active events found after any single dispatch. */
+	int max_active_per_iteration;
+	/** Callback durations: bucket 0 counts callbacks that took under
+	    1 usec, and bucket i counts those that took at least 2^(i-1) and
+	    under 2^i usec.  The last bucket also counts everything longer. */
+	ev_uint64_t callback_usec_histogram[EVENT_STATS_HISTOGRAM_SIZE];
+};
+
+/**
+  Turn statistics collection for an event_base on or off.
+
+  Collection is off by default.  While it is on, the loop reads the clock
+  around every dispatch and every callback.
+
+  @param eb the event_base structure returned by event_base_new()
+  @param enable 1 to collect statistics, 0 to stop
+  @return 0 on success, -1 on failure
+  @see event_base_get_stats(), event_base_reset_stats()
+ */
+int event_base_enable_stats(struct event_base *eb, int enable);
+
+/**
+  Copy an event_base's statistics into a caller-supplied structure.
+
+  @param eb the event_base structure returned by event_base_new()
+  @param stats the structure to fill in
+  @return 0 on success, -1 on failure
+ */
+int event_base_get_stats(struct event_base *eb, struct event_base_stats *stats);
+
+/** Reset an event_base's statistics to zero. */
+void event_base_reset_stats(struct event_base *eb);
+
+/**
+  A function to hear about a callback that ran for too long.
+
+  @param base the event_base whose loop ran it
+  @param callback the callback function: the one given to event_assign()
+     or event_new(), or for a deferred callback the internal function that
+     ran it
+  @param fd the event's file descriptor, or -1 for a deferred callback
+  @param duration how long the callback ran
+  @param arg the argument given along with this function
+ */
+typedef void (*event_slow_callback_cb)(struct event_base *base,
+    void *callback, evutil_socket_t fd, const struct timeval *duration,
+    void *arg);
+
+/**
+  Report callbacks that take too long.
+
+  After each event callback and each deferred callback, if it ran for at
+  least threshold, the loop calls cb about it.  cb runs on the loop's
+  thread with no locks held, after the slow callback has returned.  While a
+  cb is set, the loop reads the clock around every callback.
+
+  To hear about a callback while it is still stuck, see
+  evthread_watchdog_new().
+
+  @param eb the event_base structure returned by event_base_new()
+  @param threshold the shortest run that counts as slow
+  @param cb the function to call, or NULL to stop reporting
+  @param arg an argument to pass to cb
+  @return 0 on success, -1 on failure
+ */
+int event_base_set_slow_callback_cb(struct event_base *eb,
+    const struct timeval *threshold, event_slow_callback_cb cb, void *arg);
+
+/** Most size classes that an event_base object pool can have. */
+#define EVENT_POOL_MAX_CLASSES 8
+
+/**
+  Occupancy of the object pool of an event_base created with
+  EVENT_BASE_FLAG_OBJECT_POOL.
+
+  @see event_base_get_pool_stats()
+ */
+struct event_base_pool_stats {
+	/** Number of entries used in classes. */
+	int n_classes;
+	struct {
+		/** Usable bytes in each object of this class. */
+		size_t object_size;
+		/** Number of slabs allocated for this class. */
+		unsigned long n_slabs;
+		/** Number of objects those slabs hold. */
+		unsigned long n_objects;
+		/** Number of those objects currently handed out. */
+		unsigned long n_in_use;
+		/** Number of allocations served by this class so far. */
+		ev_uint64_t n_allocs;
+	} classes[EVENT_POOL_MAX_CLASSES];
+	/** Number of allocations that were too big for any class and went
+	    to the heap instead. */
+	ev_uint64_t n_unpooled;
+};
+
+/**
+  Report how full an event_base's object pool is.
+
+  @param eb the event_base structure returned by event_base_new_with_config()
+  @param stats the structure to fill in
+  @return 0 on success, -1 if eb has no object pool
+  @see EVENT_BASE_FLAG_OBJECT_POOL
+ */
+int event_base_get_pool_stats(struct event_base *eb,
+    struct event_base_pool_stats *stats);
+
 /**
    Gets all event notification mechanisms supported by libevent.
 
@@ -166,6 +340,53 @@ enum event_base_config_flag {
 	/** Do not check the EVENT_NO* environment variables when picking
 	    an event_base. */
 	EVENT_BASE_FLAG_IGNORE_ENV = 0x02,
+	/** Keep pending timeouts in a 4-ary heap that stores each expiry
+	    time inline, instead of in the default binary heap of event
+	    pointers.  This is faster when there are very many timeouts. */
+	EVENT_BASE_FLAG_KEYED_TIMEHEAP = 0x04,
+	/** If we are using the epoll backend, queue changes to the set of
+	    watched fds and apply their combined effect just before we wait
+	    for events.  Disabling and re-enabling an event between two
+	    dispatches then costs at most one epoll_ctl call rather than two.
+
+	    This flag can make the epoll backend report errors late or not
+	    at all for fds that are closed and reopened between two calls
+	    to the event loop, or that are shared with dup() and its
+	    relatives.  Setting the EVENT_EPOLL_USE_CHANGELIST environment
+	    variable has the same effect as this flag. */
+	EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST = 0x08,
+	/** Wait for timeouts with microsecond precision, where the backend
+	    would otherwise round them up to a whole millisecond.  With epoll,
+	    this arms a timerfd for the next timeout, which costs an extra
+	    system call per loop iteration when the timeout changes.
+	    Setting the EVENT_PRECISE_TIMER environment variable has the same
+	    effect as this flag. */
+	EVENT_BASE_FLAG_PRECISE_TIMER = 0x10,
+	/** Keep a pool of slabs for the events that event_new() and
+	    event_base_once() allocate on this base, and for the chains of
+	    evbuffers that belong to bufferevents on this base, so that
+	    freeing and reallocating them does not go through the heap.
+	    Memory in the pool is only returned to the heap when the base
+	    and everything allocated from it are freed.  Events from the pool
+	    must still be freed before their base, like any other event;
+	    only evbuffer chains from it may outlive the base.  Do not call
+	    event_assign() on an event that event_new() returned from such
+	    a base; use event_free() and event_new() instead.
+
+	    @see event_base_get_pool_stats(), evbuffer_use_base_pool() */
+	EVENT_BASE_FLAG_OBJECT_POOL = 0x20,
+	/** On Linux, read signals from a signalfd in the same set as the
+	    other fds, instead of catching them with a signal handler that
+	    writes to a socketpair.  Each signal that has an event is blocked
+	    with sigprocmask() while the event is added.
+
+	    Since a blocked signal can still be delivered to any other thread
+	    that does not block it, this flag should only be used by programs
+	    that run a single thread, or that block the signals in every
+	    thread.  Where signalfd is missing, this flag does nothing.
+	    Setting the EVENT_USE_SIGNALFD environment variable has the same
+	    effect as this flag. */
+	EVENT_BASE_FLAG_SIGNALFD = 0x40,
 };
 
 /**
@@ -202,6 +423,168 @@ int event_config_require_features(struct event_config *cfg,
 int event_config_set_flag(struct event_config *cfg,
     enum event_base_config_flag flag);
 
+/**
+   Bounds how much work the event loop does between checks for new events.
+
+   Normally, once events are active, the event loop runs every callback at
+   the most important active priority before it asks the backend about new
+   events.  A burst of many active events can therefore delay the handling
+   of newly ready sockets for a long time.  With this function, the loop
+   goes back to the backend (without blocking) after running max_callbacks
+   callbacks, or after max_interval has elapsed, whichever comes first; the
+   remaining events stay active and run on the next iteration.
+
+   Time is measured with the base's cached time, which is refreshed after
+   each callback while a time limit is in effect.
+
+   @param cfg the event configuration object
+   @param max_interval the longest time to spend running callbacks, or NULL
+          for no time limit
+   @param max_callbacks the most callbacks to run, or -1 for no limit
+   @param min_priority the limits only apply to events at this priority or
+          less important ones; events at more important priorities always
+          run to completion.  0 applies the limits to every priority.
+   @return 0 on success, -1 on failure.
+   @see event_base_get_n_dispatch_limit_hits()
+ */
+int event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority);
+
+/**
+   Makes the event loop spin before it goes to sleep.
+
+   Normally, when no events are active, the event loop asks the backend to
+   block until an event is ready or a timeout expires.  With a spin
+   interval, the loop instead keeps asking the backend without blocking
+   until spin_interval has passed with no event becoming ready, and only
+   then blocks as usual.  Whenever an event does become ready, the next
+   wait spins again.  This uses a whole CPU while spinning, in exchange
+   for not paying the cost of a wakeup when an event arrives soon.
+
+   The base's cached time is refreshed after every call to the backend, so
+   it stays current while the loop spins.
+
+   If socket_busy_poll_usec is positive, the base also calls
+   evutil_make_socket_busy_poll() with it on every fd when the fd gets its
+   first event, so that the kernel can busy-poll the device queue for the
+   socket.  Fds that are not sockets, and platforms without SO_BUSY_POLL,
+   are left alone.
+
+   @param cfg the event configuration object
+   @param spin_interval how long to spin before blocking, or NULL to never
+          spin
+   @param socket_busy_poll_usec the SO_BUSY_POLL value to give each fd, or
+          0 to leave fds alone
+   @return 0 on success, -1 on failure.
+ */
+int event_config_set_busy_poll(struct event_config *cfg,
+    const struct timeval *spin_interval, int socket_busy_poll_usec);
+
+/**
+   Places an event_base on a CPU or a NUMA node.
+
+   While event_base_new_with_config() builds the base, it binds the calling
+   thread to the given CPU, or to the CPUs of the given NUMA node, and then
+   restores the thread's old affinity.  The memory that the base and its
+   backend allocate and touch during construction therefore comes from
+   that node, as long as the system uses the usual first-touch memory
+   policy.  Memory allocated later, as fds are added, comes from whatever
+   node the loop thread runs on.
+
+   If bind_loop is true, the event loop also binds the thread that runs it
+   to the same CPUs; it does so the first time each thread runs the loop.
+
+   Binding threads needs sched_setaffinity(), so on other platforms
+   event_base_new_with_config() fails for a configuration that asks for
+   this.
+
+   @param cfg the event configuration object
+   @param cpu the CPU to use, or -1 to use numa_node instead
+   @param numa_node the NUMA node whose CPUs to use if cpu is -1, or -1
+   @param bind_loop true to bind the thread that runs the loop too
+   @return 0 on success, -1 on failure.
+ */
+int event_config_set_cpu_affinity(struct event_config *cfg, int cpu,
+    int numa_node, int bind_loop);
+
+/**
+   Tells the event_base how big it is likely to get.
+
+   The tables that map fds to events, the backend's own per-fd arrays, and
+   the heap of pending timeouts all grow by reallocating, which copies
+   them.  When a base is about to acquire many fds or timers at once, such
+   as in a burst of reconnects, each of those copies is a stall.  With
+   these hints, event_base_new_with_config() sizes the tables up front so
+   that the base does not have to grow them until it passes the hints.
+
+   The hints are not limits: a base can still grow past them.
+
+   @param cfg the event configuration object
+   @param max_fds the highest number of fds expected, counting from 0 (that
+          is, one more than the highest fd expected), or 0 for no hint
+   @param max_timers the most events with timeouts expected to be pending
+          at once, or 0 for no hint
+   @return 0 on success, -1 on failure.
+ */
+int event_config_set_size_hints(struct event_config *cfg, int max_fds,
+    int max_timers);
+
+/**
+   Lets the event loop fire timeouts late so that it wakes up less often.
+
+   Normally the loop sleeps exactly until its first pending timeout is due.
+   With a slack, it may sleep up to slack past that, so that one wakeup
+   fires every timeout that falls due in the meantime.  Wakeups are put on
+   multiples of slack by the base's clock, so bases that share a clock, as
+   in one process with a base per thread, tend to wake together as well.
+
+   The slack never makes a timeout fire more than slack late, though a
+   busy loop can still run its callback later than that, as always.  It
+   applies to every timeout on the base, so timers that must be punctual
+   belong on a base without one.
+
+   @param cfg the event configuration object
+   @param slack how late a timeout may fire, or NULL for no slack
+   @return 0 on success, -1 on failure.
+ */
+int event_config_set_timer_slack(struct event_config *cfg,
+    const struct timeval *slack);
+
+/**
+   Clocks that an event_base can keep time with.
+
+   @see event_config_set_clock_source()
+ */
+enum event_clock_source {
+	/** CLOCK_MONOTONIC where there is one, else gettimeofday(). */
+	EVENT_CLOCK_DEFAULT = 0,
+	/** CLOCK_MONOTONIC_COARSE, which is cheaper to read but only
+	    advances once per kernel tick: a few milliseconds at most.
+	    Timeouts may then fire up to a tick late. */
+	EVENT_CLOCK_COARSE = 1,
+	/** The CPU's timestamp counter, scaled to CLOCK_MONOTONIC and
+	    brought back into line with it once a second.  Reading it costs
+	    no system call.  Only used on x86-64 CPUs whose counter runs at a
+	    constant rate, and only as good as the kernel's synchronization
+	    of the counters on different CPUs. */
+	EVENT_CLOCK_TSC = 2
+};
+
+/**
+   Choose the clock that a base measures timeouts, statistics and
+   dispatch limits with.
+
+   If this machine doesn't have the clock, the base uses
+   EVENT_CLOCK_DEFAULT instead; event_base_get_clock_source() tells which
+   it got.
+
+   @param cfg the event configuration object
+   @param source the clock to use
+   @return 0 on success, -1 on failure.
+ */
+int event_config_set_clock_source(struct event_config *cfg,
+    enum event_clock_source source);
+
 /**
   Initialize the event API.
 
@@ -240,6 +623,54 @@ typedef void (*event_log_cb)(int severity, const char *msg);
   */
 void event_set_log_callback(event_log_cb cb);
 
+/** A function to receive a message taken out of the log ring: its severity,
+    when it was logged, and the message. */
+typedef void (*event_log_ring_cb)(int severity, const struct timeval *when,
+    const char *msg);
+
+/**
+  Queue log messages in a ring instead of writing them out as they happen.
+
+  Logging a message then costs a format into a free slot and nothing else:
+  no locks and no I/O, so an error storm can't stall the thread that hits
+  it.  Messages stay in the ring until event_log_ring_drain() (or the
+  thread from evthread_log_drainer_start()) takes them out.  When the ring
+  is full, new messages are dropped and counted, never waited for.
+  Messages longer than 255 bytes are cut short.  _EVENT_LOG_ERR messages
+  are still written out at once, after whatever is in the ring, since
+  libevent exits right after logging them.
+
+  Requires atomic operations.
+
+  @param n_messages how many messages the ring holds; rounded up to a power
+     of two
+  @return 0 on success, -1 on failure or if a ring is already set up
+ */
+int event_enable_log_ring(int n_messages);
+
+/**
+  Take every finished message out of the log ring, oldest first.
+
+  Safe to call from any thread, and from several at once.
+
+  @param cb the function to hand each message to; if NULL, each message
+     goes wherever it would have without the ring, as set by
+     event_set_log_callback()
+  @return the number of messages taken out
+ */
+int event_log_ring_drain(event_log_ring_cb cb);
+
+/**
+  Drain the log ring and go back to writing messages out at once.
+
+  No other thread may log, or drain the ring, while this runs.
+ */
+void event_disable_log_ring(void);
+
+/** Return how many messages have been dropped because the log ring was
+    full. */
+unsigned long event_log_ring_get_dropped(void);
+
 /**
   Associate a different event base with an event.
 
@@ -269,6 +700,28 @@ int event_base_set(struct event_base *, struct event *);
   */
 int event_base_loop(struct event_base *, int);
 
+/**
+  Handle events for at most a given amount of time.
+
+  This works like event_base_loop(), except that it returns once budget
+  has elapsed, even if it would otherwise keep going.  It never waits in
+  the backend for longer than is left of the budget, and once the budget
+  is used up it stops running callbacks, leaving any remaining active
+  events and deferred callbacks for the next call.  The time is checked
+  after each callback, so a single slow callback can overrun the budget.
+
+  Even with a zero budget, the backend is polled once and at least one
+  pending callback, if there are any, gets to run.
+
+  @param eb the event_base structure returned by event_init()
+  @param budget how long to run for, or NULL to run like event_base_loop()
+  @param flags any combination of EVLOOP_ONCE | EVLOOP_NONBLOCK
+  @return 0 if successful, including when the budget ran out, -1 if an
+    error occurred, or 1 if no events were registered.
+  @see event_base_loop()
+  */
+int event_base_loop_timed(struct event_base *, const struct timeval *, int);
+
 /**
   Exit the event loop after the specified time (threadsafe variant).
 
@@ -418,6 +871,33 @@ void event_free(struct event *);
  */
 int event_base_once(struct event_base *, evutil_socket_t, short, void (*)(evutil_socket_t, short, void *), void *, const struct timeval *);
 
+/**
+  Schedule a one-time event in storage that the caller provides.
+
+  This works like event_base_once(), except that the event lives in
+  storage instead of in memory that Libevent allocates, so scheduling it
+  never calls the allocator.  The callback gets arg as its argument.
+
+  The storage must not hold a pending or active event when this is
+  called, and must stay valid until the callback runs or the event is
+  removed with event_del().  Once the callback has started, the storage
+  may be freed or used again, for instance to schedule the next one-time
+  event from inside the callback.
+
+  @param base an event_base returned by event_init()
+  @param storage the struct event to schedule the one-time event in
+  @param fd a file descriptor to monitor
+  @param events event(s) to monitor; can be any of EV_TIMEOUT | EV_READ |
+         EV_WRITE
+  @param callback callback function to be invoked when the event occurs
+  @param arg an argument to be passed to the callback function
+  @param timeout the maximum amount of time to wait for the event, or NULL
+         to wait forever
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_once(), event_assign()
+ */
+int event_base_once_assign(struct event_base *, struct event *, evutil_socket_t, short, void (*)(evutil_socket_t, short, void *), void *, const struct timeval *);
+
 /**
   Add an event to the set of monitored events.
 
@@ -451,6 +931,43 @@ int event_add(struct event *, const struct timeval *);
  */
 int event_del(struct event *);
 
+/**
+  Add many events at once, all with the same timeout.
+
+  This does what calling event_add() on each event would, but it takes the
+  base's lock once for the whole array, and grows the base's timeout heap
+  and fd table once to fit them all.  With a backend that keeps a
+  changelist (kqueue, /dev/poll, or epoll with
+  EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST), the kernel hears about all the
+  new fds in one call, the next time the loop runs.
+
+  All the events must belong to the same event_base.  If adding one of
+  them fails, the others are still added.
+
+  @param events the events to add
+  @param n_events how many events there are
+  @param timeout the maximum amount of time to wait for each event, or
+         NULL to wait forever
+  @return 0 if every event was added, or -1 if an error occurred
+  @see event_add(), event_del_many()
+ */
+int event_add_many(struct event **events, int n_events,
+    const struct timeval *timeout);
+
+/**
+  Remove many events at once.
+
+  This does what calling event_del() on each event would, but it takes the
+  base's lock once for the whole array.  All the events must belong to the
+  same event_base.
+
+  @param events the events to remove
+  @param n_events how many events there are
+  @return 0 if every event was removed, or -1 if an error occurred
+  @see event_del(), event_add_many()
+ */
+int event_del_many(struct event **events, int n_events);
+
 
 /**
   Make an event active.
@@ -570,6 +1087,58 @@ int	event_base_priority_init(struct event_base *, int);
   */
 int	event_priority_set(struct event *, int);
 
+/**
+  Share the event loop between priorities by weight.
+
+  Normally, the event loop only runs the callbacks of the most important
+  priority that has active events, so a busy priority can keep every less
+  important one from running at all.  Once weights are set, each pass of
+  the loop visits every priority in turn, most important first, and runs
+  at most weights[i] active callbacks at priority i before moving on to the
+  next.  More important priorities still go first, but a less important
+  event waits for at most one pass over the others.
+
+  Limits set with event_config_set_max_dispatch_interval() still apply on
+  top of the weights.  Changing the number of priorities with
+  event_base_priority_init() clears the weights.
+
+  @param eb the event_base structure returned by event_base_new()
+  @param weights an array of one positive weight per priority, or NULL to
+     return to strict priorities
+  @param n_weights the number of entries in weights; this must equal the
+     number of priorities in eb
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_priority_init(), event_priority_set()
+  */
+int	event_base_priority_set_weights(struct event_base *eb,
+    const int *weights, int n_weights);
+
+/**
+   Prepare Libevent to use a large number of timeouts with the same duration.
+
+   Libevent's default scheduling algorithm is optimized for having a large
+   number of timeouts with their durations more or less randomly
+   distributed.  If you have a large number of timeouts that all have the
+   same duration (for example, if you have a large number of connections
+   that all have a 10-second timeout), then you can improve Libevent's
+   performance by telling Libevent about it.
+
+   To do this, call this function with the common duration.  It will return
+   a pointer to a different, opaque timeout value.  (Don't depend on its
+   actual contents!)  When you use this timeout value in event_add(),
+   Libevent will schedule the event more efficiently.
+
+   (This optimization probably will not be worthwhile until you have
+   thousands or tens of thousands of events with the same timeout.)
+
+   @param base the event_base that will use the common timeout
+   @param duration the duration shared by the events
+   @return an opaque timeout value to pass to event_add(), or NULL if
+     no more common timeouts can be allocated for this base.
+ */
+const struct timeval *event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration);
+
 #ifndef _EVENT_DISABLE_MM_REPLACEMENT
 /**
  Override the functions that libevent uses for memory management.
@@ -78,28 +78,36 @@ struct {								\
 struct event_base;
 struct event {
 	TAILQ_ENTRY (event) (ev_active_next);
-	TAILQ_ENTRY (event) (ev_next);
-	int min_heap_idx;	/* for managing timeouts */
-	evutil_socket_t ev_fd;
+	/* for managing timeouts */
+	union {
+		TAILQ_ENTRY(event) ev_next_with_common_timeout;
+		int min_heap_idx;
+	} ev_timeout_pos;
 
 	struct event_base *ev_base;
 
 	union {
 		/* used for io events */
 		struct {
-			TAILQ_ENTRY (event) (ev_io_next);
-			struct timeval ev_timeout;
+			/* next event on the same fd */
+			struct event *ev_io_next;
+			/* timeout to re-add a persistent event with: seconds
+			 * in the high 32 bits, tv_usec in the low 32 */
+			ev_uint64_t ev_timeout;
 		} ev_io;
 
 		/* used by signal events */
 		struct {
-			TAILQ_ENTRY (event) (ev_signal_next);
+			/* next event on the same signal */
+			struct event *ev_signal_next;
 			short ev_ncalls;
-			/* Allows deletes in callback */
-			short *ev_pncalls;
 		} ev_signal;
 	} _ev;
 
+	evutil_socket_t ev_fd;
+	/* for event_active() calls from threads other than the loop's */
+	int ev_xthread_res;
+
 	short ev_events;
 	short ev_res;		/* result passed to event callback */
 	short ev_flags;
@@ -110,6 +118,8 @@ struct event {
 	/* allows us to adopt for different types of events */
 	void (*ev_callback)(evutil_socket_t, short, void *arg);
 	void *ev_arg;
+
+	struct event *ev_xthread_next;
 };
 
 #ifdef EVENT_FD
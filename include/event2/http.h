@@ -44,6 +44,8 @@ extern "C" {
 /* In case we haven't included the right headers yet. */
 struct evbuffer;
 struct event_base;
+struct evdns_base;
+struct sockaddr;
 
 /** @file http.h
  *
@@ -69,6 +71,9 @@ struct event_base;
 struct evhttp;
 struct evhttp_request;
 struct evkeyvalq;
+struct evhttp_pool;
+struct evhttp_file_server;
+struct evhttp_header_block;
 
 /** Create a new HTTP server
  *
@@ -109,6 +114,44 @@ int evhttp_bind_socket(struct evhttp *http, const char *address, ev_uint16_t por
  */
 int evhttp_accept_socket(struct evhttp *http, evutil_socket_t fd);
 
+/**
+ * Makes an HTTP server serve a connection that has already been accepted.
+ *
+ * This may be useful when connections are accepted elsewhere, for example
+ * by a listener that spreads them across several event bases, each with an
+ * evhttp of its own.  The socket is made nonblocking, and is closed if the
+ * connection cannot be set up.  Call this from the thread that runs the
+ * http server's event base.
+ *
+ * @param http a pointer to an evhttp object
+ * @param fd the connected socket
+ * @param sa the address of the peer
+ * @param socklen the length of sa
+ * @see evhttp_accept_socket()
+ */
+void evhttp_serve_socket(struct evhttp *http, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen);
+
+/**
+ * Makes an HTTP server serve its connections on another event base too.
+ *
+ * Connections accepted on the server's sockets are handed out to the
+ * worker bases in turn, and each one stays on its base until it closes.
+ * Run every worker base in a thread of its own, after turning on
+ * threading with evthread_use_pthreads() or evthread_use_windows_threads().
+ * Once there are any worker bases, the server's own base only accepts.
+ *
+ * The request callbacks then run in the worker threads, possibly several
+ * at once, so they must be thread-safe.  Set up the callbacks and virtual
+ * hosts before any connection comes in, and stop the worker bases before
+ * calling evhttp_free().
+ *
+ * @param http a pointer to an evhttp object
+ * @param base the event base to serve connections on
+ * @return 0 on success, -1 on failure
+ */
+int evhttp_add_worker_base(struct evhttp *http, struct event_base *base);
+
 /**
  * Free the previously created HTTP server.
  *
@@ -131,9 +174,96 @@ void evhttp_free(struct evhttp* http);
 int evhttp_set_cb(struct evhttp *http, const char *path,
     void (*cb)(struct evhttp_request *, void *), void *cb_arg);
 
+/**
+   Set a callback for a URI that is handed the body of each request as it
+   arrives, rather than all at once when it is complete.
+
+   The request is routed as soon as its headers are in.  chunk_cb is then
+   called each time more of the body has been read; the new data is in the
+   request's input buffer, which is drained when chunk_cb returns.  Once
+   the whole body is in, cb is called to send the reply, as with
+   evhttp_set_cb().  Only a bounded part of the body is in memory at any
+   time, however large it is.  Call evhttp_request_pause() from chunk_cb
+   to stop reading while the data can't be taken.
+
+   If the body turns out to be malformed, cb is called with a request
+   whose uri is NULL, and should reply with an error.  If the client goes
+   away before the body is complete, cb is not called.
+
+   @param http the http server on which to set the callback
+   @param path the path for which to invoke the callbacks
+   @param chunk_cb the callback for each piece of the body
+   @param cb the callback for the end of the body
+   @param cb_arg an additional context argument for both callbacks
+   @return 0 on success, -1 if the path had a callback already
+   @see evhttp_del_cb()
+*/
+int evhttp_set_stream_cb(struct evhttp *http, const char *path,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg);
+
 /** Removes the callback for a specified URI */
 int evhttp_del_cb(struct evhttp *, const char *);
 
+/**
+   Set a callback for every URI whose path starts with a given prefix.
+
+   A callback set with evhttp_set_cb() for the exact path comes first;
+   after that, the callback for the longest prefix of the path wins.  Both
+   are looked up in time that doesn't depend on how many callbacks there
+   are.
+
+   @param http the http server on which to set the callback
+   @param prefix the start of the paths for which to invoke the callback
+   @param cb the callback function that gets invoked on requesting a path
+      that starts with prefix
+   @param cb_arg an additional context argument for the callback
+   @return 0 on success, -1 if the prefix had a callback already
+*/
+int evhttp_set_prefix_cb(struct evhttp *http, const char *prefix,
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg);
+
+/** Removes the callback for a prefix set with evhttp_set_prefix_cb() */
+int evhttp_del_prefix_cb(struct evhttp *http, const char *prefix);
+
+/**
+   Create a handler that serves the files in a directory.
+
+   A request for prefix followed by a path is answered with the file at that
+   path below root, or with the index.html there if the path ends with a
+   slash.  Only GET and HEAD are allowed.  Files are sent with sendfile()
+   where it's available, so their contents are never copied into memory.
+
+   The handler keeps up to max_cached files open, along with their sizes,
+   ETag and Last-Modified headers, so that a request for one of them costs
+   no open() or fstat().  It checks that a file hasn't changed at most once
+   a second.  It answers If-None-Match and If-Modified-Since with 304, and
+   a single byte range in a Range header with 206.
+
+   If compression is on for the server (see evhttp_set_compression()),
+   clients that accept gzip get a gzipped copy of each text file of up to a
+   megabyte, made the first time someone asks for it and kept as long as
+   the file stays open.  Range requests always get the file as it is.
+
+   Install it with evhttp_set_prefix_cb(http, prefix,
+   evhttp_file_server_cb, server).
+
+   @param prefix the start of the URIs to serve
+   @param root the directory to serve them from
+   @param max_cached how many files to keep open; 0 for the default of 64
+   @return a new file server, or NULL on error
+   @see evhttp_file_server_free()
+*/
+struct evhttp_file_server *evhttp_file_server_new(const char *prefix,
+    const char *root, int max_cached);
+
+/** Frees a file server, and closes the files it has open.  Remove its
+    callback first. */
+void evhttp_file_server_free(struct evhttp_file_server *server);
+
+/** The callback that serves the files of the evhttp_file_server in arg. */
+void evhttp_file_server_cb(struct evhttp_request *req, void *arg);
+
 /**
     Set a callback for all requests that are not caught by specific callbacks
 
@@ -165,7 +295,11 @@ void evhttp_set_gencb(struct evhttp *http,
    @param http the evhttp object to which to add a virtual host
    @param pattern the glob pattern against which the hostname is matched.
      The match is case insensitive and follows otherwise regular shell
-     matching.
+     matching.  Exact host names and patterns of the form *.example.com
+     are looked up in hash tables; other patterns are tried in turn.  If
+     several patterns match, an exact host name wins, then the
+     *.example.com pattern with the longest domain, then whichever other
+     pattern was added first.
    @param vhost the virtual host to add the regular http server.
    @return 0 on success, -1 on failure
    @see evhttp_remove_virtual_host()
@@ -191,6 +325,170 @@ int evhttp_remove_virtual_host(struct evhttp* http, struct evhttp* vhost);
  */
 void evhttp_set_timeout(struct evhttp *http, int timeout_in_secs);
 
+/**
+   Limit how many connections the server keeps open at once.
+
+   When a new connection would take the server over the limit, the
+   keep-alive connection that has been waiting longest for its next request
+   is closed to make room; if none are waiting, the new connection is
+   closed instead.  A server with worker bases applies the limit to each
+   base separately.
+
+   Connections waiting for another request are closed once they have waited
+   for the timeout set with evhttp_set_timeout(), if there is one.
+
+   @param http an evhttp object
+   @param max_connections the limit, or -1 for none, which is the default
+*/
+void evhttp_set_max_connections(struct evhttp *http, int max_connections);
+
+/**
+   Limit how many bytes of request line and headers a request may have.
+
+   The limit is checked as the headers come in, so a request that goes
+   over it is answered with 431 before more of it is read.
+
+   @param http an evhttp object
+   @param max_headers_size the limit, or -1 for none, which is the default
+*/
+void evhttp_set_max_headers_size(struct evhttp *http,
+    ev_ssize_t max_headers_size);
+
+/**
+   Limit how many headers a request may have.  A request with more is
+   answered with 431.
+
+   @param http an evhttp object
+   @param max_header_count the limit, or -1 for none, which is the default
+*/
+void evhttp_set_max_header_count(struct evhttp *http, int max_header_count);
+
+/**
+   Limit how large the body of a request may be.
+
+   A request whose Content-Length is over the limit is answered with 413
+   without any of its body being read; a chunked body is turned away as
+   soon as the chunk that takes it over the limit is announced.
+
+   @param http an evhttp object
+   @param max_body_size the limit, or -1 for none, which is the default
+*/
+void evhttp_set_max_body_size(struct evhttp *http, ev_ssize_t max_body_size);
+
+/**
+   Limit how much of a request body a chunk callback is handed at once.
+
+   Whatever has been read of the body is otherwise passed to the callback
+   in one go, which may be a lot after a burst.  With a limit, it is
+   passed in pieces of at most that size, so that a callback that pauses
+   the request takes effect without the rest being handed over first.
+
+   @param http an evhttp object
+   @param size the limit, or 0 for none, which is the default
+   @see evhttp_set_stream_cb(), evhttp_connection_set_chunk_delivery_size()
+*/
+void evhttp_set_chunk_delivery_size(struct evhttp *http, size_t size);
+
+/**
+   Compress the bodies of responses for the clients that accept it.
+
+   A response is sent gzip or deflate encoded if the request's
+   Accept-Encoding allows one of them, its Content-Type is text or some
+   other type that compresses well, and it has no Content-Encoding or
+   Content-Length header of its own.  Responses sent with
+   evhttp_send_reply() are compressed only if they are at least min_size
+   bytes long; those sent with evhttp_send_reply_start() are compressed as
+   they go, and each chunk is flushed so that the client can see it right
+   away.  Responses that might be compressed get "Vary: Accept-Encoding"
+   unless they have a Vary header already.
+
+   Only the settings of the server that accepted a connection count, not
+   those of its virtual hosts.
+
+   @param http an evhttp object
+   @param level the zlib compression level from 1 to 9, or 0 to turn
+     compression off, which is the default
+   @param min_size the smallest body worth compressing
+   @return 0 on success, or -1 if the level is out of range or libevent was
+     built without zlib
+*/
+int evhttp_set_compression(struct evhttp *http, int level, size_t min_size);
+
+/** Number of buckets in evhttp_route_stats.usec_histogram. */
+#define EVHTTP_STATS_HISTOGRAM_SIZE 32
+
+/**
+  What an evhttp server has counted for the requests on one of its routes.
+
+  @see evhttp_enable_stats(), evhttp_get_route_stats()
+ */
+struct evhttp_route_stats {
+	/** Number of requests answered. */
+	ev_uint64_t n_requests;
+	/** Bytes of request lines, headers and bodies read. */
+	ev_uint64_t bytes_in;
+	/** Bytes of responses written, headers included. */
+	ev_uint64_t bytes_out;
+	/** Service times, from the first byte of a request coming in to the
+	    last byte of its response going out: bucket 0 counts requests
+	    that took under 1 usec, and bucket i counts those that took at
+	    least 2^(i-1) and under 2^i usec.  The last bucket also counts
+	    everything longer. */
+	ev_uint64_t usec_histogram[EVHTTP_STATS_HISTOGRAM_SIZE];
+};
+
+/**
+  Turn counting of requests on or off for an evhttp server.
+
+  Counting is off by default.  While it is on, the server reads the clock
+  at the start and end of each request, and counts the bytes in and out,
+  for the route that the request went to.  Turn it on for the server that
+  accepts the connections; requests for its virtual hosts are counted under
+  the virtual host's routes.
+
+  @param http an evhttp object
+  @param enable 1 to count requests, 0 to stop
+  @return 0 on success, -1 on failure
+  @see evhttp_get_route_stats(), evhttp_reset_stats()
+ */
+int evhttp_enable_stats(struct evhttp *http, int enable);
+
+/**
+  Copy the counts for one of an evhttp server's routes.
+
+  @param http an evhttp object
+  @param path the path or prefix the route's callback was set for, or NULL
+     for the requests that no callback took
+  @param stats the structure to fill in
+  @return 0 on success, -1 if there is no such route
+ */
+int evhttp_get_route_stats(struct evhttp *http, const char *path,
+    struct evhttp_route_stats *stats);
+
+/** Reset the counts for all of an evhttp server's routes to zero. */
+void evhttp_reset_stats(struct evhttp *http);
+
+/**
+  Estimate a percentile of the service times that stats have counted.
+
+  @param stats the counts for a route
+  @param percent the percentile to find, from 0 to 100
+  @return the upper bound, in usec, of the histogram bucket that the
+     percentile falls in; or 0 if no requests were counted
+ */
+ev_uint64_t evhttp_route_stats_percentile(
+    const struct evhttp_route_stats *stats, int percent);
+
+/**
+  Answer requests for path with a plain-text report of the server's counts,
+  one route to a line.
+
+  @param http an evhttp object
+  @param path the path to answer at
+  @return 0 on success, -1 if path already has a callback
+ */
+int evhttp_set_stats_cb(struct evhttp *http, const char *path);
+
 /* Request/Response functionality */
 
 /**
@@ -219,6 +517,42 @@ void evhttp_send_error(struct evhttp_request *req, int error,
 void evhttp_send_reply(struct evhttp_request *req, int code,
     const char *reason, struct evbuffer *databuf);
 
+/**
+   Format the start of a common response once, for use with
+   evhttp_send_reply_block().
+
+   The block holds the status line and the given headers exactly as they
+   go out, so sending a reply with it mostly copies them.  Connection,
+   Content-Length, Date and Transfer-Encoding depend on the request and
+   the body, and can't be in a block; they are added as usual.
+
+   @param code the HTTP response code to send
+   @param reason a brief message to send with the response code
+   @param headers the headers to send with every reply, or NULL
+   @return a new block, or NULL if the headers include one of the ones
+     above or aren't valid
+   @see evhttp_header_block_free()
+*/
+struct evhttp_header_block *evhttp_header_block_new(int code,
+    const char *reason, const struct evkeyvalq *headers);
+
+/** Frees a block made with evhttp_header_block_new(). */
+void evhttp_header_block_free(struct evhttp_header_block *block);
+
+/**
+   Send a reply that starts with a preformatted block.
+
+   This is like evhttp_send_reply(), with the response code, reason and
+   headers of block.  Headers in the request's output headers are sent
+   after the ones in the block.
+
+   @param req a request object
+   @param block the start of the reply
+   @param databuf the body of the response
+*/
+void evhttp_send_reply_block(struct evhttp_request *req,
+    const struct evhttp_header_block *block, struct evbuffer *databuf);
+
 /* Low-level response interface, for streaming/chunked replies */
 
 /**
@@ -292,6 +626,21 @@ struct evhttp_request *evhttp_request_new(
 void evhttp_request_set_chunked_cb(struct evhttp_request *,
     void (*cb)(struct evhttp_request *, void *));
 
+/**
+ * Stop reading the body of a request, or of the response to one.
+ *
+ * Nothing more is read from the connection until evhttp_request_resume()
+ * is called, so the peer is held back by TCP flow control instead of the
+ * data piling up in memory.  Meant to be called from a chunk callback.
+ */
+void evhttp_request_pause(struct evhttp_request *req);
+
+/**
+ * Start reading the body again after evhttp_request_pause().  Anything
+ * that was read before the pause is delivered from the event loop.
+ */
+void evhttp_request_resume(struct evhttp_request *req);
+
 /** Frees the request object and removes associated events. */
 void evhttp_request_free(struct evhttp_request *req);
 
@@ -324,6 +673,17 @@ void evhttp_connection_set_local_address(struct evhttp_connection *evcon,
 void evhttp_connection_set_local_port(struct evhttp_connection *evcon,
     ev_uint16_t port);
 
+/**
+   Makes the connection look up its host with an evdns_base, without
+   blocking, instead of with the system resolver.
+
+   @param evcon the connection, which must not be connected
+   @param dns_base the evdns_base to use, or NULL for the system resolver
+   @see evdns_getaddrinfo()
+*/
+void evhttp_connection_set_dns_base(struct evhttp_connection *evcon,
+    struct evdns_base *dns_base);
+
 /** Sets the timeout for events related to this connection */
 void evhttp_connection_set_timeout(struct evhttp_connection *evcon,
     int timeout_in_secs);
@@ -332,6 +692,39 @@ void evhttp_connection_set_timeout(struct evhttp_connection *evcon,
 void evhttp_connection_set_retries(struct evhttp_connection *evcon,
     int retry_max);
 
+/**
+   Limit how much of a response body the chunk callback of a request on
+   this connection is handed at once.
+
+   @param evcon the connection
+   @param size the limit, or 0 for none, which is the default
+   @see evhttp_request_set_chunked_cb(), evhttp_set_chunk_delivery_size()
+*/
+void evhttp_connection_set_chunk_delivery_size(
+    struct evhttp_connection *evcon, size_t size);
+
+/**
+   Sets how many requests may be sent on a connection before their
+   responses come back.
+
+   By default a connection sends one request at a time.  With a depth
+   above one, requests queued with evhttp_make_request() are written
+   back-to-back and their responses are matched up in order.  Nothing is
+   sent behind a POST or PUT, or behind a request that asks for the
+   connection to be closed, until its response arrives.
+
+   If the connection fails, the request whose response we were reading
+   fails as it always has.  The other requests that were sent but not
+   answered are sent again on a new connection, except for POSTs and PUTs,
+   whose callbacks are invoked with a NULL request.
+
+   @param evcon the connection to configure
+   @param depth the most requests to have outstanding; 1 turns pipelining
+     off
+*/
+void evhttp_connection_set_pipeline_depth(struct evhttp_connection *evcon,
+    int depth);
+
 /** Set a callback for connection close. */
 void evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*)(struct evhttp_connection *, void *), void *);
@@ -371,6 +764,94 @@ int evhttp_make_request(struct evhttp_connection *evcon,
 */
 void evhttp_cancel_request(struct evhttp_request *req);
 
+/**
+   Create a pool of keep-alive client connections.
+
+   A pool makes requests to any number of servers.  It keeps the
+   connections it made to each address and port open after their requests
+   are done, so that later requests there don't have to connect again.
+   A connection the server closes while it's idle is dropped from the pool.
+
+   @param base the event base to make the connections on
+   @return a new pool, or NULL on error
+   @see evhttp_pool_make_request(), evhttp_pool_free()
+*/
+struct evhttp_pool *evhttp_pool_new(struct event_base *base);
+
+/**
+   Free a pool and all of its connections.
+
+   Requests that haven't finished yet are freed without their callbacks
+   being invoked.
+*/
+void evhttp_pool_free(struct evhttp_pool *pool);
+
+/** Sets how many idle connections a pool keeps open in all; when there are
+    more, the one idle longest is closed.  The default is 32. */
+void evhttp_pool_set_max_idle(struct evhttp_pool *pool, int max_idle);
+
+/** Sets how many connections a pool opens to one address and port.  The
+    default is 6. */
+void evhttp_pool_set_max_per_host(struct evhttp_pool *pool,
+    int max_per_host);
+
+/** Sets how many seconds a pool keeps a connection open with nothing to
+    do.  The default is 60. */
+void evhttp_pool_set_idle_timeout(struct evhttp_pool *pool,
+    int timeout_in_secs);
+
+/**
+    Make an HTTP request on a connection from a pool.
+
+    The request goes to an idle connection to address and port if there is
+    one.  Otherwise it goes to a new connection if there are fewer than the
+    pool's per-host limit, and to whichever connection has the fewest
+    requests queued if there are not.
+
+    The pool gets ownership of the request.
+
+    @param pool the pool to make the request from
+    @param address the address of the server
+    @param port the port of the server
+    @param req the previously created and configured request object
+    @param type the request type EVHTTP_REQ_GET, EVHTTP_REQ_POST, etc.
+    @param uri the URI associated with the request
+    @return 0 on success, -1 on failure
+*/
+int evhttp_pool_make_request(struct evhttp_pool *pool,
+    const char *address, unsigned short port, struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri);
+
+/**
+    Forward a request that a server received to another server, and stream
+    the response back to the client as it arrives.
+
+    Call this from the callback for req instead of replying to it.  The
+    request goes out on evcon with the same method, headers, and body,
+    leaving out the headers that only concern one connection and adding
+    X-Forwarded-For.  The response comes back the same way: its status and
+    headers are sent on to the client as soon as the body starts arriving,
+    and the body follows chunk by chunk, without being copied or held in
+    memory in full.  When the client can't take the body as fast as the
+    server sends it, reading from the server stops until the client has
+    caught up.
+
+    If the server can't be reached, or closes the connection before it
+    answers, the client gets a 502 reply; if the response was cut off
+    after it started, the connection to the client is closed.  If the
+    client goes away first, the request to the server is canceled.
+
+    evcon must be on the same event base as the connection req came in on.
+
+    @param req a request that was passed to an evhttp callback
+    @param evcon the connection to the server to forward it to
+    @param uri the URI to ask that server for, or NULL to use req's
+    @return 0 on success, or -1 on failure, in which case the caller still
+       has to reply to req
+*/
+int evhttp_proxy_request(struct evhttp_request *req,
+    struct evhttp_connection *evcon, const char *uri);
+
 
 /** Returns the request URI */
 const char *evhttp_request_get_uri(struct evhttp_request *req);
@@ -467,6 +948,66 @@ char *evhttp_decode_uri(const char *uri);
  */
 void evhttp_parse_query(const char *uri, struct evkeyvalq *headers);
 
+/** One key=value parameter of a query string, pointing into the URI it
+    came from.  Neither part is decoded or NUL-terminated. */
+struct evhttp_query_param {
+	const char *key;
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+};
+
+/**
+   Step through the parameters of the query string in a URI, without
+   copying or allocating anything.
+
+   Set *pos to NULL before the first call.  Parameters without an '=' are
+   skipped, as evhttp_parse_query() would.
+
+   @param uri the request URI
+   @param pos where we've got to in the URI; updated on each call
+   @param param set to the next parameter if there is one
+   @return 1 if param was set, or 0 if there are no more parameters
+   @see evhttp_query_decode()
+*/
+int evhttp_query_next(const char *uri, const char **pos,
+    struct evhttp_query_param *param);
+
+/**
+   Decode a value from a query string into a buffer, turning '+' into a
+   space and %-escapes into the characters they stand for.
+
+   Like snprintf(), this writes at most buflen bytes including the
+   terminating NUL, and returns the length of the whole decoded value;
+   if that is buflen or more, the value didn't fit.
+
+   @param value the start of the encoded value
+   @param len the length of the encoded value
+   @param buf the buffer to decode into
+   @param buflen the size of buf
+   @return the length of the decoded value, not counting the NUL
+*/
+size_t evhttp_query_decode(const char *value, size_t len, char *buf,
+    size_t buflen);
+
+/**
+   Look up one parameter in the query string of a URI, and decode its
+   value into a buffer.
+
+   This finds the same value that evhttp_parse_query() followed by
+   evhttp_find_header() would, without allocating anything.
+
+   @param uri the request URI
+   @param key the name of the parameter, which must match exactly
+   @param buf the buffer to decode the value into, as with
+      evhttp_query_decode()
+   @param buflen the size of buf
+   @return the length of the decoded value, or -1 if the query has no
+      such parameter
+*/
+ev_ssize_t evhttp_query_get(const char *uri, const char *key, char *buf,
+    size_t buflen);
+
 
 /**
  * Escape HTML character entities in a string.
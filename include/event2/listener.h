@@ -35,6 +35,10 @@ struct evconnlistener;
 /**
    A callback that we invoke when a listener has a new connection.
 
+   Unless the listener has LEV_OPT_LEAVE_SOCKETS_BLOCKING set, the new socket
+   is already nonblocking, so it can go straight to bufferevent_socket_new();
+   with LEV_OPT_CLOSE_ON_EXEC, it is close-on-exec as well.
+
    @param listener The evconnlistener
    @param fd The new file descriptor
    @param addr The source address of the connection
@@ -49,11 +53,41 @@ typedef void (*evconnlistener_cb)(struct evconnlistener *, evutil_socket_t, stru
 /** Flag: Indicates that freeing the listener should close the underlying
  * socket. */
 #define LEV_OPT_CLOSE_ON_FREE		(1u<<1)
-/** Flag: Indicates that we should set the close-on-exec flag, if possible */
+/** Flag: Indicates that we should set the close-on-exec flag, if possible,
+ * on the listening socket and on every socket it accepts. */
 #define LEV_OPT_CLOSE_ON_EXEC		(1u<<2)
 /** Flag: Indicates that we should disable the timeout (if any) between when
  * this socket is closed and when we can listen again on the same port. */
 #define LEV_OPT_REUSEABLE		(1u<<3)
+/** Flag: Indicates that we should set SO_REUSEPORT on the socket, so that
+ * other sockets can listen on the same address and port, and the kernel
+ * spreads incoming connections among them.  Creating the listener fails
+ * where SO_REUSEPORT doesn't exist. */
+#define LEV_OPT_REUSEABLE_PORT		(1u<<4)
+/** Flag: For an evconnlistener_group, indicates that the kernel should give
+ * each connection to the listener whose index is the number of the CPU
+ * that received it, rather than picking one by hashing the connection.
+ * This only helps if the thread running the event_base of listener i runs
+ * on CPU i; see event_config_set_cpu_affinity().  Only on Linux (with
+ * SO_ATTACH_REUSEPORT_CBPF); elsewhere the kernel goes on hashing. */
+#define LEV_OPT_STEER_BY_CPU		(1u<<5)
+/** Flag: Indicates that the listener should keep a spare file descriptor
+ * open.  When accept() fails for lack of file descriptors, the listener
+ * closes the spare, accepts the oldest pending connection and closes it at
+ * once, so that its client is turned away rather than left waiting.  Not
+ * supported on Windows. */
+#define LEV_OPT_RESERVE_FD		(1u<<6)
+/** Flag: For evconnlistener_new_bind(), indicates that the socket should
+ * take TCP Fast Open connections, whose first data comes with the SYN.  Only
+ * use it for protocols whose first request is safe to get twice.  Ignored
+ * where TCP_FASTOPEN is missing. */
+#define LEV_OPT_TCP_FASTOPEN		(1u<<7)
+/** Flag: For evconnlistener_new_bind(), indicates that the kernel should
+ * hold on to new connections until the client sends something (or 30
+ * seconds pass), so that the callback isn't run for connections with
+ * nothing to read yet.  Only use it for protocols where the client speaks
+ * first.  Ignored where TCP_DEFER_ACCEPT is missing. */
+#define LEV_OPT_DEFER_ACCEPT		(1u<<8)
 
 /**
    Allocate a new evconnlistener object to listen for incoming TCP connections
@@ -95,6 +129,12 @@ struct evconnlistener *evconnlistener_new_bind(struct event_base *base,
 void evconnlistener_free(struct evconnlistener *lev);
 /**
    Re-enable an evconnlistener that has been disabled.
+
+   An evconnlistener that runs out of file descriptors stops listening for a
+   while (10 msec at first, doubling up to a second each time it runs out
+   again), since accept() would otherwise fail every time around the loop.
+   Calling this while it is paused, say after closing some connections,
+   makes it start listening again at once.
  */
 int evconnlistener_enable(struct evconnlistener *lev);
 /**
@@ -105,4 +145,67 @@ int evconnlistener_disable(struct evconnlistener *lev);
 /** Return an evconnlistener's associated event_base. */
 struct event_base *evconnlistener_get_base(struct evconnlistener *lev);
 
+/** Return the socket an evconnlistener is listening on. */
+evutil_socket_t evconnlistener_get_fd(struct evconnlistener *lev);
+
+/** Return how many times an evconnlistener has stopped listening because it
+    ran out of file descriptors. */
+unsigned long evconnlistener_get_n_pauses(struct evconnlistener *lev);
+/** Return how many connections an evconnlistener with LEV_OPT_RESERVE_FD has
+    turned away because it ran out of file descriptors. */
+unsigned long evconnlistener_get_n_dropped(struct evconnlistener *lev);
+
+/**
+   Set how many connections an evconnlistener accepts each time its socket
+   is readable, before it lets the rest of the event loop run.  The
+   connections left over are accepted on the next iteration of the loop.
+   The default is 16.
+
+   @param lev The evconnlistener
+   @param n The most connections to accept at once, or 0 for no limit.
+   @return 0 on success, -1 on failure.
+ */
+int evconnlistener_set_accepts_per_cb(struct evconnlistener *lev, int n);
+
+struct evconnlistener_group;
+
+/**
+   Listen for incoming TCP connections on one address from several
+   event_bases at once, each with its own socket.
+
+   Every listener gets its own socket bound to the same address with
+   SO_REUSEPORT, so the kernel spreads the connections among them, and no
+   base accepts for another.  Run each base in its own thread.  If sa has
+   port 0, all the sockets use whichever port the first one gets.
+
+   To serve HTTP this way, give every base an evhttp of its own, pass them
+   as ptrs, and hand each new connection to evhttp_serve_socket().
+
+   @param bases The event_bases to listen from, one listener per base.
+   @param n_bases How many bases there are.
+   @param cb A callback to be invoked when a new connection arrives.
+   @param ptrs The pointers to give the callback, one per base, or NULL to
+      give it NULL.
+   @param flags Any number of LEV_OPT_* flags.  LEV_OPT_REUSEABLE_PORT and
+      LEV_OPT_CLOSE_ON_FREE are always set.
+   @param backlog As for evconnlistener_new_bind().
+   @param sa The address to listen for connections on.
+   @param socklen The length of the address.
+   @return A new evconnlistener_group, or NULL on failure.
+ */
+struct evconnlistener_group *evconnlistener_group_new_bind(
+    struct event_base **bases, int n_bases, evconnlistener_cb cb,
+    void **ptrs, unsigned flags, int backlog, const struct sockaddr *sa,
+    int socklen);
+/**
+   Free every listener in an evconnlistener_group, and the group.
+ */
+void evconnlistener_group_free(struct evconnlistener_group *group);
+/** Return how many listeners an evconnlistener_group has. */
+int evconnlistener_group_size(struct evconnlistener_group *group);
+/** Return the listener for the i'th base of an evconnlistener_group, or NULL
+    if there is none. */
+struct evconnlistener *evconnlistener_group_get(
+    struct evconnlistener_group *group, int i);
+
 #endif
@@ -63,6 +63,10 @@ extern "C" {
  *
  * To send the reply, call EVRPC_REQUEST_DONE(rpc);
  *
+ * RPCs can also skip HTTP altogether and travel as tagged binary frames
+ * over a bufferevent; see evrpc_add_bufferevent() and
+ * evrpc_pool_add_bufferevent().
+ *
  * See the regression test for an example.
  */
 
@@ -147,6 +151,7 @@ struct evbuffer;
 struct event_base;
 struct evrpc_req_generic;
 struct evrpc_request_wrapper;
+struct evrpc_batch;
 struct evrpc;
 
 /** The type of a specific RPC Message
@@ -180,6 +185,11 @@ EVRPC_STRUCT(rpcname) {	\
 	struct evbuffer* rpc_data; \
 };								     \
 int evrpc_send_request_##rpcname(struct evrpc_pool *, \
+    struct reqstruct *, struct rplystruct *, \
+    void (*)(struct evrpc_status *, \
+	struct reqstruct *, struct rplystruct *, void *cbarg),	\
+    void *);							     \
+int evrpc_batch_add_##rpcname(struct evrpc_batch *, \
     struct reqstruct *, struct rplystruct *, \
     void (*)(struct evrpc_status *, \
 	struct reqstruct *, struct rplystruct *, void *cbarg),	\
@@ -244,6 +254,19 @@ struct evrpc_request_wrapper *evrpc_make_request_ctx(
 	    (void (*)(struct evbuffer *, void *))reqstruct##_marshal,	\
 	    (void (*)(void *))rplystruct##_clear,			\
 	    (int (*)(void *, struct evbuffer *))rplystruct##_unmarshal); \
+}									\
+	int evrpc_batch_add_##rpcname(struct evrpc_batch *batch,	\
+	    struct reqstruct *request, struct rplystruct *reply,	\
+	    void (*cb)(struct evrpc_status *,				\
+		struct reqstruct *, struct rplystruct *, void *cbarg),	\
+	    void *cbarg) {						\
+	return evrpc_batch_add_generic(batch, request, reply,		\
+	    (void (*)(struct evrpc_status *, void *, void *, void *))cb, \
+	    cbarg,							\
+	    #rpcname,							\
+	    (void (*)(struct evbuffer *, void *))reqstruct##_marshal,	\
+	    (void (*)(void *))rplystruct##_clear,			\
+	    (int (*)(void *, struct evbuffer *))rplystruct##_unmarshal); \
 }
 	
 /** Provides access to the HTTP request object underlying an RPC
@@ -253,7 +276,8 @@ struct evrpc_request_wrapper *evrpc_make_request_ctx(
  *
  * @param rpc_req the rpc request structure provided to the server callback
  * @return an struct evhttp_request object that can be inspected for
- * HTTP headers or sender information.
+ * HTTP headers or sender information, or NULL if the rpc arrived over
+ * a bufferevent.
  */
 #define EVRPC_REQUEST_HTTP(rpc_req) (rpc_req)->http_req
 
@@ -281,7 +305,8 @@ struct evhttp;
 
 /** Creates a new rpc base from which RPC requests can be received
  *
- * @param server a pointer to an existing HTTP server
+ * @param server a pointer to an existing HTTP server, or NULL if the
+ *   rpcs are only going to arrive over bufferevents
  * @return a newly allocated evrpc_base struct
  * @see evrpc_free()
  */
@@ -346,6 +371,70 @@ int evrpc_register_rpc(struct evrpc_base *, struct evrpc *,
 
 int evrpc_unregister_rpc(struct evrpc_base *base, const char *name);
 
+struct bufferevent;
+
+/**
+ * Receives rpcs over a bufferevent instead of over HTTP.
+ *
+ * Every request and reply is a single length-prefixed frame built with
+ * event_tagging; it carries an id so that a client can have many
+ * requests outstanding at once, and replies may come back in any order.
+ * The registered rpcs and hooks are the same as for HTTP, except that
+ * hooks get a NULL evhttp_request.  The peer should be an evrpc_pool
+ * that was given the other end with evrpc_pool_add_bufferevent().
+ *
+ * The base takes over the bufferevent and its callbacks, and frees it
+ * when the peer closes the connection or when the base is freed.
+ *
+ * @param base the evrpc_base with the registered rpcs
+ * @param bev a connected bufferevent
+ * @return 0 on success, -1 on failure
+ * @see evrpc_pool_add_bufferevent()
+ */
+int evrpc_add_bufferevent(struct evrpc_base *base, struct bufferevent *bev);
+
+/**
+ * Lets the callbacks of offloaded rpcs run on another event base.
+ *
+ * Offloaded rpcs go to the worker bases in turn.  Run every worker base
+ * in a thread of its own, after turning on threading with
+ * evthread_use_pthreads() or evthread_use_windows_threads(), and create
+ * the bases that receive the rpcs after that, too.
+ *
+ * The base that received an rpc still runs its hooks and parses it.  Only
+ * the callback runs on the worker, possibly at the same time as others,
+ * so it must be thread-safe and treat the http request as read-only.
+ * EVRPC_REQUEST_DONE() may be called from any thread; it marshals the
+ * reply there, and leaves the output hooks and the sending to the base
+ * that received the rpc.  Stop the worker bases, and let every rpc
+ * finish, before calling evrpc_free().
+ *
+ * @param base the evrpc_base with the registered rpcs
+ * @param ev_base the event base to run callbacks on
+ * @return 0 on success, -1 on failure
+ * @see EVRPC_SET_OFFLOAD()
+ */
+int evrpc_add_worker_base(struct evrpc_base *base, struct event_base *ev_base);
+
+/**
+ * Makes a registered rpc run its callback on the worker bases.
+ *
+ * This is meant for rpcs whose callbacks are expensive enough to hold up
+ * the others.  Without worker bases, the callback runs as usual.
+ *
+ * @param base the evrpc_base with the registered rpc
+ * @param name the name of the rpc
+ * @param offload nonzero to run the callback on a worker base, or 0 to run
+ *   it on the base that received the rpc
+ * @return 0 on success, -1 if no such rpc is registered
+ * @see evrpc_add_worker_base()
+ */
+#define EVRPC_SET_OFFLOAD(base, name, offload) \
+	evrpc_set_rpc_offload(base, #name, offload)
+
+int evrpc_set_rpc_offload(struct evrpc_base *base, const char *name,
+    int offload);
+
 /*
  * Client-side RPC support
  */
@@ -384,6 +473,57 @@ struct evrpc_status;
 */
 int evrpc_make_request(struct evrpc_request_wrapper *ctx);
 
+/**
+ * Creates a batch of rpcs to be sent to the server in a single request.
+ *
+ * A batch of small rpcs costs one request, one pass through the hooks on
+ * either side, and one timeout, instead of one of each per rpc.  The rpcs
+ * may be of different types; the server hands each of them to its
+ * registered callback as usual, and answers once all of them have been
+ * answered.  Each rpc still gets its own reply and callback.
+ *
+ * @param pool the evrpc_pool over which to send the batch
+ * @return a new batch, or NULL on failure
+ * @see EVRPC_BATCH_ADD(), evrpc_batch_send()
+ */
+struct evrpc_batch *evrpc_batch_new(struct evrpc_pool *pool);
+
+/**
+ * Adds an rpc to a batch.
+ *
+ * The arguments are those of EVRPC_MAKE_REQUEST(), except that the rpc
+ * waits in the batch until evrpc_batch_send().
+ *
+ * @param name the name of the RPC
+ * @param batch a batch from evrpc_batch_new()
+ * @param request a pointer to the RPC request structure
+ * @param reply a pointer to the RPC reply structure
+ * @param cb the callback to invoke when the RPC has been answered
+ * @param cbarg an additional argument to be passed to the client
+ * @return 0 on success, -1 on failure
+ */
+#define EVRPC_BATCH_ADD(name, batch, request, reply, cb, cbarg)	\
+	evrpc_batch_add_##name(batch, request, reply, cb, cbarg)
+
+/**
+ * Sends a batch and gives up ownership of it.
+ *
+ * When the server answers, or the batch fails or times out, the callback
+ * of every rpc in it is invoked, in the order in which they were added.
+ * A batch without rpcs is freed without sending anything.
+ *
+ * @param batch a batch from evrpc_batch_new()
+ * @return 0 on success, -1 on failure
+ */
+int evrpc_batch_send(struct evrpc_batch *batch);
+
+/**
+ * Frees a batch that has not been sent, without invoking any callbacks.
+ *
+ * @param batch a batch from evrpc_batch_new()
+ */
+void evrpc_batch_free(struct evrpc_batch *batch);
+
 /** creates an rpc connection pool
  * 
  * a pool has a number of connections associated with it.
@@ -424,6 +564,26 @@ void evrpc_pool_add_connection(struct evrpc_pool *pool,
 void evrpc_pool_remove_connection(struct evrpc_pool *pool,
     struct evhttp_connection *evcon);
 
+/**
+ * Adds a bufferevent over which rpcs can be dispatched to the pool.
+ *
+ * Requests sent this way skip HTTP and go out as binary frames as soon
+ * as they are made, without waiting for earlier ones to be answered.
+ * The callbacks see a NULL http_req in their evrpc_status.
+ *
+ * The pool takes over the bufferevent and its callbacks.  If the
+ * connection fails, the requests still waiting on it fail with
+ * EVRPC_STATUS_ERR_TIMEOUT and the bufferevent is freed.
+ *
+ * @param pool the pool to which to add the bufferevent
+ * @param bev a connected bufferevent; the other end must have been
+ *   given to evrpc_add_bufferevent()
+ * @return 0 on success, -1 on failure
+ * @see evrpc_add_bufferevent()
+ */
+int evrpc_pool_add_bufferevent(struct evrpc_pool *pool,
+    struct bufferevent *bev);
+
 /**
  * Sets the timeout in secs after which a request has to complete.  The
  * RPC is completely aborted if it does not complete by then.  Setting
@@ -441,6 +601,27 @@ void evrpc_pool_remove_connection(struct evrpc_pool *pool,
  */
 void evrpc_pool_set_timeout(struct evrpc_pool *pool, int timeout_in_secs);
 
+/**
+ * Sets the most requests that the pool has outstanding on any one of its
+ * connections.
+ *
+ * Each request goes to the connection with the fewest outstanding
+ * requests that has room for another one; the rest wait in the pool.
+ * By default, an evhttp connection takes one request at a time, and a
+ * bufferevent added with evrpc_pool_add_bufferevent() takes any number.
+ *
+ * An evhttp connection never sends an rpc before the previous one has
+ * been answered, since rpcs are POSTs, which are not pipelined; the
+ * requests beyond the first wait on the connection instead, and go out
+ * as soon as it is free.  Only bufferevents have several rpcs in flight
+ * at once.
+ *
+ * @param pool a pointer to a struct evrpc_pool object
+ * @param max_pending the most requests per connection, or 0 or less for
+ *   the defaults
+ */
+void evrpc_pool_set_max_pending(struct evrpc_pool *pool, int max_pending);
+
 /**
  * Hooks for changing the input and output of RPCs; this can be used to
  * implement compression, authentication, encryption, ...
@@ -542,7 +723,8 @@ int evrpc_hook_find_meta(void *ctx, const char *key,
  * returns the connection object associated with the request
  *
  * @param ctx the context provided to the hook call
- * @return a pointer to the evhttp_connection object
+ * @return a pointer to the evhttp_connection object, or NULL if the rpc
+ *   travels over a bufferevent
  */
 struct evhttp_connection *evrpc_hook_get_connection(void *ctx);
 
@@ -562,6 +744,22 @@ int evrpc_send_request_generic(struct evrpc_pool *pool,
     void (*rpl_clear)(void *),
     int (*rpl_unmarshal)(void *, struct evbuffer *));
 
+/**
+   Function for adding a generic RPC request to a batch.
+
+   Do not call this function directly, use EVRPC_BATCH_ADD() instead.
+
+   @see EVRPC_BATCH_ADD()
+ */
+int evrpc_batch_add_generic(struct evrpc_batch *batch,
+    void *request, void *reply,
+    void (*cb)(struct evrpc_status *, void *, void *, void *),
+    void *cb_arg,
+    const char *rpcname,
+    void (*req_marshal)(struct evbuffer *, void *),
+    void (*rpl_clear)(void *),
+    int (*rpl_unmarshal)(void *, struct evbuffer *));
+
 /**
    Function for registering a generic RPC with the RPC base.
     
@@ -89,6 +89,9 @@ struct evrpc {
 
 	/* reference for further configuration */
 	struct evrpc_base *base;
+
+	/* nonzero if the callback runs on one of the base's worker bases */
+	int offload;
 };
 
 #ifdef __cplusplus
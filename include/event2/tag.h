@@ -78,6 +78,32 @@ void evtag_marshal(struct evbuffer *evbuf, ev_uint32_t tag, const void *data,
 void evtag_marshal_buffer(struct evbuffer *evbuf, ev_uint32_t tag,
     struct evbuffer *data);
 
+/**
+   Marshals just the header of a tagged item; exactly len bytes of payload
+   must follow.  This lets data be marshaled straight into evbuf when its
+   length is known up front, instead of through evtag_marshal_buffer().
+
+   @param evbuf the buffer to which to marshal the header
+   @param tag the tag of the item
+   @param len the number of bytes in the payload
+   @see evtag_length()
+*/
+void evtag_marshal_header(struct evbuffer *evbuf, ev_uint32_t tag,
+    ev_uint32_t len);
+
+/**
+   Returns the number of bytes that marshaling a payload of len bytes under
+   tag takes up, header included.
+*/
+ev_uint32_t evtag_length(ev_uint32_t tag, ev_uint32_t len);
+
+/**
+   Returns the number of bytes that encode_int() or evtag_marshal_int()
+   uses to encode integer.
+*/
+ev_uint32_t evtag_int_length(ev_uint32_t integer);
+ev_uint32_t evtag_int64_length(ev_uint64_t integer);
+
 /**
   Encode an integer and store it in an evbuffer.
 
@@ -105,6 +131,26 @@ void evtag_marshal_timeval(struct evbuffer *evbuf, ev_uint32_t tag,
 int evtag_unmarshal(struct evbuffer *src, ev_uint32_t *ptag,
     struct evbuffer *dst);
 int evtag_peek(struct evbuffer *evbuf, ev_uint32_t *ptag);
+
+/**
+   Decodes a whole tagged record in one pass, without draining anything:
+   its tag, the length of its payload, and where the payload is.
+
+   This is cheaper than decoding the tag and the length separately; if the
+   record is in the first chain of evbuf, as it usually is, nothing gets
+   copied.
+
+   @param evbuf the buffer from which to decode the record
+   @param ptag if not NULL, a pointer in which the tag is stored
+   @param plength a pointer in which the length of the payload is stored
+   @param ppayload if not NULL, a pointer in which the start of the
+     contiguous payload is stored; the payload is pulled up if it spans
+     more than one chain
+   @return the number of bytes in the header of the record, or -1 if evbuf
+     does not start with a complete record
+*/
+int evtag_peek_record(struct evbuffer *evbuf, ev_uint32_t *ptag,
+    ev_uint32_t *plength, ev_uint8_t **ppayload);
 int evtag_peek_length(struct evbuffer *evbuf, ev_uint32_t *plength);
 int evtag_payload_length(struct evbuffer *evbuf, ev_uint32_t *plength);
 int evtag_consume(struct evbuffer *evbuf);
@@ -123,6 +169,77 @@ int evtag_unmarshal_string(struct evbuffer *evbuf, ev_uint32_t need_tag,
 int evtag_unmarshal_timeval(struct evbuffer *evbuf, ev_uint32_t need_tag,
     struct timeval *ptv);
 
+struct evtag_arena;
+
+/**
+   Creates an arena for unmarshaled data.
+
+   Memory allocated from an arena is not freed piece by piece; it all goes
+   away with evtag_arena_free().  The structures that event_rpcgen.py
+   generates with --arena keep everything belonging to a message in one.
+
+   @return a new arena, or NULL on failure
+*/
+struct evtag_arena *evtag_arena_new(void);
+
+/**
+   Frees an arena, all memory allocated from it and all buffers pinned
+   to it.
+*/
+void evtag_arena_free(struct evtag_arena *arena);
+
+/**
+   Allocates memory from an arena.
+
+   @return size bytes that stay valid until the arena is freed, or NULL
+     on failure
+*/
+void *evtag_arena_alloc(struct evtag_arena *arena, size_t size);
+
+/**
+   Resizes memory allocated from an arena.  The most recent allocation
+   grows in place when there is room; anything else is copied.
+*/
+void *evtag_arena_realloc(struct evtag_arena *arena, void *ptr,
+    size_t oldsize, size_t size);
+
+/** Copies a string into an arena. */
+char *evtag_arena_strdup(struct evtag_arena *arena, const char *string);
+
+/**
+   Moves the first len bytes of src into memory that the arena keeps until
+   it is freed, and returns a new buffer that refers to them.
+
+   Whole chains move from src without being copied; the data is only
+   copied when it has to be made contiguous.  Data unmarshaled from the
+   returned buffer with evtag_unmarshal_ref() remains valid after the
+   buffer itself has been freed with evbuffer_free().
+
+   @return a buffer holding a reference to the pinned data, or NULL on
+     failure
+*/
+struct evbuffer *evtag_arena_pin(struct evtag_arena *arena,
+    struct evbuffer *src, size_t len);
+
+/**
+   Like evtag_unmarshal_string(), but allocates the string from an arena.
+*/
+int evtag_unmarshal_string_arena(struct evbuffer *evbuf, ev_uint32_t need_tag,
+    struct evtag_arena *arena, char **pstring);
+
+/**
+   Unmarshals a tagged item without copying it: *pdata is pointed at the
+   payload inside evbuf, which must be a buffer from evtag_arena_pin().
+
+   @param evbuf the pinned buffer from which to unmarshal data
+   @param need_tag the tag that the item must have
+   @param pdata a pointer in which the start of the payload is stored
+   @param plen a pointer in which the length of the payload is stored
+   @return 0 on success, -1 on failure
+*/
+int evtag_unmarshal_ref(struct evbuffer *evbuf, ev_uint32_t need_tag,
+    ev_uint8_t **pdata, ev_uint32_t *plen);
+
 #ifdef __cplusplus
 }
 #endif
@@ -58,6 +58,10 @@ extern "C" {
 #endif
 
 #include <event-config.h>
+#include <event2/util.h>
+#include <event2/event.h>
+
+struct event_base;
 
 /* combine (lock|unlock) with (read|write) */
 #define EVTHREAD_LOCK	0x01
@@ -106,6 +110,67 @@ void evthread_set_id_callback(
  */
 int evthread_make_base_notifiable(struct event_base *base);
 
+/** Lock categories for evthread_get_lock_stats(). */
+/** The locks of event_bases */
+#define EVTHREAD_LOCK_CATEGORY_BASE		0
+/** The locks of bufferevents, which their evbuffers share, and of rate
+    limiting groups */
+#define EVTHREAD_LOCK_CATEGORY_BUFFEREVENT	1
+/** The locks of evbuffers that have one of their own */
+#define EVTHREAD_LOCK_CATEGORY_EVBUFFER		2
+/** The locks of evdns_bases and evdns server ports */
+#define EVTHREAD_LOCK_CATEGORY_EVDNS		3
+/** Every other lock */
+#define EVTHREAD_LOCK_CATEGORY_OTHER		4
+#define EVTHREAD_LOCK_N_CATEGORIES		5
+
+/** How often the locks of one category have been taken, and how long
+    threads have waited for them. */
+struct evthread_lock_stats {
+	/** Locks of this category that exist now */
+	int n_locks;
+	/** Times one of them was acquired, counting recursive acquisitions */
+	ev_uint64_t n_acquired;
+	/** Times a thread found one of them held or wanted by another thread
+	    when it asked for it */
+	ev_uint64_t n_contended;
+	/** Total time spent waiting on contended acquisitions, in usec */
+	ev_uint64_t wait_usec;
+};
+
+/**
+   Have libevent count every acquisition of the locks it allocates from now
+   on, by category, so that evthread_get_lock_stats() can tell which locks
+   are contended.
+
+   This must be called after the locking and thread ID callbacks are set
+   up, and before any lock is allocated, which is to say before creating
+   any event_base or other libevent object.  Profiling can't be turned off
+   again.  A lock given to evbuffer_enable_locking() must then be one that
+   libevent allocated.  Counting costs a few instructions per acquisition,
+   and two clock reads per contended one.
+
+   @return 0 on success, -1 if locking isn't set up or if this platform
+     lacks the atomic operations profiling needs.
+   @see evthread_get_lock_stats(), evthread_reset_lock_stats()
+ */
+int evthread_enable_lock_profiling(void);
+
+/**
+   Get the lock statistics of one category of locks, including locks that
+   have since been freed.
+
+   The counts of locks that are in use may be slightly behind.
+
+   @param category one of the EVTHREAD_LOCK_CATEGORY_* values
+   @param stats the structure to fill in
+   @return 0 on success, -1 if profiling is off or category is unknown
+ */
+int evthread_get_lock_stats(int category, struct evthread_lock_stats *stats);
+
+/** Set every lock statistic except n_locks back to zero. */
+void evthread_reset_lock_stats(void);
+
 #ifdef WIN32
 /** Sets up libevent for use with Windows builtin locking and thread ID
 	functions.  Unavailable if libevent is not built for Windows.
@@ -121,6 +186,218 @@ int evthread_use_windows_threads(void);
 
 	@return 0 on success, -1 on failure. */
 int evthread_use_pthreads(void);
+
+/** Like evthread_use_pthreads(), but with locks that spin briefly before
+	going to sleep, and that let any number of threads lock them at once
+	with EVTHREAD_READ.  Read-only calls such as evbuffer_get_length()
+	then no longer wait on each other.
+
+	A thread that holds a lock exclusively may take it again in any mode,
+	but a thread that holds it with EVTHREAD_READ must not ask for it
+	exclusively.  Unavailable without atomic operations.
+
+	@return 0 on success, -1 on failure. */
+int evthread_use_pthreads_rwlocks(void);
+
+struct event_base_group;
+struct event_config;
+struct evconnlistener;
+struct sockaddr;
+
+/**
+   A callback to receive a connection handed to a base group.
+
+   It runs in the thread of the base that the connection was given to.
+
+   @param base the base that should now own the connection
+   @param idx the index of that base within the group
+   @param fd the connection's socket
+   @param addr the peer address, as given to event_base_group_hand_off()
+   @param socklen the length of addr
+   @param arg the pointer passed to event_base_group_hand_off()
+ */
+typedef void (*event_base_group_fd_cb)(struct event_base *base, int idx,
+    evutil_socket_t fd, struct sockaddr *addr, int socklen, void *arg);
+
+/**
+   Create a group of n_bases event_bases, each with a thread of its own
+   running its event loop.
+
+   A typical server creates one base per CPU and spreads its connections
+   across them with event_base_group_new_listener() or
+   event_base_group_hand_off().  Each base stays owned by its thread: once
+   a connection has been handed to a base, only that base's thread should
+   touch the events and bufferevents that use it.
+
+   Locking must already be set up with evthread_use_pthreads().  Requires
+   libraries to link against libevent_pthreads as well as libevent.
+
+   @param n_bases the number of bases and threads to create
+   @param cfg the configuration for each base, or NULL for the default
+   @return the new group, or NULL on failure.
+   @see event_base_group_free()
+ */
+struct event_base_group *event_base_group_new(int n_bases,
+    struct event_config *cfg);
+
+/**
+   Stop every loop in a group, wait for their threads to exit, and free the
+   group, its listeners, and its bases.
+
+   Connections that were handed off but not yet received are closed.
+   Events that the application added to the group's bases must be freed by
+   the application, after this function returns.
+ */
+void event_base_group_free(struct event_base_group *group);
+
+/** Return the number of bases in a group. */
+int event_base_group_get_n_bases(struct event_base_group *group);
+
+/** Return the idx'th base of a group, or NULL if there is no such base. */
+struct event_base *event_base_group_get_base(struct event_base_group *group,
+    int idx);
+
+/** Return the index of the base in a group that has the fewest events
+    (as counted by its event_count) plus pending handoffs.  Ties are broken
+    round-robin. */
+int event_base_group_least_loaded(struct event_base_group *group);
+
+/**
+   Give a connection to one of a group's bases.
+
+   The connection is queued for the chosen base, and that base's loop is
+   woken up to run cb.  Any thread may call this function.
+
+   @param group the group
+   @param idx the index of the base to use, or -1 to use the least loaded
+   @param fd the socket to hand off
+   @param sa the peer address, or NULL
+   @param socklen the length of sa
+   @param cb the function to run in the chosen base's thread
+   @param arg an argument to pass to cb
+   @return the index of the chosen base, or -1 on failure.
+ */
+int event_base_group_hand_off(struct event_base_group *group, int idx,
+    evutil_socket_t fd, const struct sockaddr *sa, int socklen,
+    event_base_group_fd_cb cb, void *arg);
+
+/**
+   Listen for connections on a given address, and give each new connection
+   to the least loaded base of a group.
+
+   The listener itself runs on the group's first base.  It is freed along
+   with the group; do not free it yourself.  To serve HTTP from every base,
+   create an evhttp with evhttp_new() on each of the group's bases, and have
+   cb pass each connection to the one for idx with evhttp_serve_socket().
+
+   @param group the group
+   @param cb the function to run, in the chosen base's thread, for each
+      connection
+   @param arg an argument to pass to cb
+   @param flags Any number of LEV_OPT_* flags
+   @param backlog Passed to the listen() call.  Set to -1 for a reasonable
+      default.
+   @param sa the address to listen for connections on
+   @param socklen the length of sa
+   @return the new listener, or NULL on failure.
+ */
+struct evconnlistener *event_base_group_new_listener(
+    struct event_base_group *group, event_base_group_fd_cb cb, void *arg,
+    unsigned flags, int backlog, const struct sockaddr *sa, int socklen);
+
+struct evthread_workqueue;
+
+/** A function run by an evthread_workqueue, with the argument that was
+    given to evthread_workqueue_submit(). */
+typedef void (*evthread_work_fn)(void *arg);
+
+/**
+   Create a pool of n_threads threads for running blocking work, such as
+   disk reads or compression, away from the event loops.
+
+   Locking must already be set up with evthread_use_pthreads().  Requires
+   libraries to link against libevent_pthreads as well as libevent.
+
+   @param n_threads the number of threads to create
+   @return the new work queue, or NULL on failure.
+   @see evthread_workqueue_submit(), evthread_workqueue_free()
+ */
+struct evthread_workqueue *evthread_workqueue_new(int n_threads);
+
+/**
+   Stop the threads of a work queue and free it.
+
+   Work that is running is waited for; work that has not started yet, and
+   done_fn calls that have not been made yet, are dropped.  Every base
+   that work was submitted for must still exist.  Do not call this from
+   a work_fn or a done_fn.
+ */
+void evthread_workqueue_free(struct evthread_workqueue *wq);
+
+/**
+   Run work_fn on one of a work queue's threads, and then run done_fn on
+   base's loop.
+
+   Work starts in the order it was submitted.  Finished work is handed
+   back to base in batches: however many items finish while the loop is
+   busy, base is woken up only once, and runs the done_fn of each in turn.
+   Any thread may call this function.
+
+   @param wq the work queue
+   @param base the event_base whose loop should run done_fn
+   @param work_fn the function to run on a work queue thread
+   @param done_fn the function to run on base once work_fn has returned,
+      or NULL
+   @param arg an argument to pass to both functions
+   @return 0 on success, -1 on failure.
+ */
+int evthread_workqueue_submit(struct evthread_workqueue *wq,
+    struct event_base *base, evthread_work_fn work_fn,
+    evthread_work_fn done_fn, void *arg);
+
+/**
+   Start a thread that drains the log ring every interval_msec
+   milliseconds, handing each message on as event_log_ring_drain(NULL)
+   does.  Whatever log callback is set then runs on that thread.
+
+   @param interval_msec how long to wait between drains
+   @return 0 on success, -1 on failure or if the thread is already running
+   @see event_enable_log_ring()
+ */
+int evthread_log_drainer_start(int interval_msec);
+
+/** Stop the thread from evthread_log_drainer_start(), after one last
+    drain. */
+void evthread_log_drainer_stop(void);
+
+struct evthread_watchdog;
+
+/**
+   Start a thread that watches base's loop for callbacks that get stuck.
+
+   When one callback has been running for at least limit, cb is called
+   about it once, on the watchdog's thread, while the callback is still
+   running.  The duration cb gets is how long the watchdog has seen it
+   running, which may be up to half a limit short of the truth.  The
+   callback pointer and fd are read without a lock, so if the callback
+   returns just as the watchdog fires they may name the next one instead.
+
+   While any watchdog watches it, the loop does a few more stores around
+   every callback.
+
+   @param base the event_base to watch
+   @param limit how long a callback may run before it counts as stuck
+   @param cb the function to call about a stuck callback
+   @param arg an argument to pass to cb
+   @return a new watchdog, or NULL on failure
+   @see event_base_set_slow_callback_cb()
+ */
+struct evthread_watchdog *evthread_watchdog_new(struct event_base *base,
+    const struct timeval *limit, event_slow_callback_cb cb, void *arg);
+
+/** Stop a watchdog and free it.  Once this returns, its cb won't be
+    called again. */
+void evthread_watchdog_free(struct evthread_watchdog *wd);
 #endif
 
 #ifdef __cplusplus
@@ -118,6 +118,10 @@ extern "C" {
 #define ev_ssize_t ssize_t
 #endif
 
+/** The largest values a size_t and an ev_ssize_t can hold. */
+#define EV_SIZE_MAX ((size_t)-1)
+#define EV_SSIZE_MAX ((ev_ssize_t)(EV_SIZE_MAX >> 1))
+
 #ifdef WIN32
 /** A type wide enough to hold the output of "socket()" or "accept()".  On
  * Windows, this is an intptr_t; elsewhere, it is an int. */
@@ -152,6 +156,18 @@ int evutil_make_socket_nonblocking(evutil_socket_t sock);
  */
 int evutil_make_listen_socket_reuseable(evutil_socket_t);
 
+/** Ask the kernel to busy-poll the device queue of a socket for up to usec
+    microseconds when a read on it would otherwise block, trading CPU time
+    for lower latency.  This uses SO_BUSY_POLL, and so only works on
+    Linux; raising the value above the net.core.busy_read sysctl needs
+    CAP_NET_ADMIN.
+
+    @param sock The socket to busy-poll
+    @param usec How long to busy-poll for; 0 turns busy polling off
+    @return 0 on success, -1 on failure or if busy polling isn't supported
+ */
+int evutil_make_socket_busy_poll(evutil_socket_t sock, int usec);
+
 #ifdef WIN32
 /** Do the platform-specific call needed to close a socket returned from
     socket() or accept(). */
@@ -27,6 +27,8 @@
 #ifndef _EVENT_IOCP_INTERNAL_H
 #define _EVENT_IOCP_INTERNAL_H
 
+#include "event2/bufferevent.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,17 +64,23 @@ struct event_iocp_port {
 	HANDLE port;
 	/* A lock to cover internal structures. */
 	CRITICAL_SECTION lock;
-	/** Number of threads ever open on the port. */
-	short n_threads;
+	/** How many threads we keep open on the port however idle it is;
+	 * also how many Windows lets run at once. */
+	short min_threads;
+	/** How many threads we start at most, when the others are all busy
+	 * running callbacks. */
+	short max_threads;
 	/** True iff we're shutting down all the threads on this port */
 	short shutdown;
 	/** How often the threads on this port check for shutdown and other
 	 * conditions */
 	long ms;
-	/* The threads that are waiting for events. */
-	HANDLE *threads;
+	/** How many completions a thread takes off the port at once. */
+	int batch_size;
 	/** Number of threads currently open on this port. */
 	short n_live_threads;
+	/** Number of threads currently waiting for completions. */
+	short n_waiting;
 	/* A semaphore to signal when we are done shutting down. */
 	HANDLE *shutdownSemaphore;
 };
@@ -100,18 +108,38 @@ struct evbuffer *evbuffer_overlapped_new(evutil_socket_t fd);
 /** XXXX Document (nickm) */
 evutil_socket_t _evbuffer_overlapped_get_fd(struct evbuffer *buf);
 
+/** How many reads an overlapped evbuffer keeps posted at once unless told
+    otherwise, and how many it can be told to keep. */
+#define EVBUFFER_OVERLAPPED_DEFAULT_READS 4
+#define EVBUFFER_OVERLAPPED_MAX_READS 16
+/** How many bytes each of those reads asks for unless told otherwise. */
+#define EVBUFFER_OVERLAPPED_DEFAULT_READ_SIZE 16384
+
 /** Start reading data onto the end of an overlapped evbuffer.
 
-    An evbuffer can only have one read pending at a time.  While the read
-    is in progress, no other data may be added to the end of the buffer.
-    The buffer must be created with event_overlapped_init().
+    Keeps as many reads posted as _evbuffer_overlapped_set_reads() allows,
+    posting more if some have finished, so long as there is room in all of
+    them for no more than n bytes.  Each read goes into a chain of its own,
+    which is added to the buffer once it and the reads before it are done.
+    While any read is in progress, no other data may be added to the end of
+    the buffer.  The buffer must be created with evbuffer_overlapped_new().
 
     @param buf The buffer to read onto
-    @param n The number of bytes to try to read.
+    @param n The most bytes that all the posted reads together may read.
     @return 0 on success, -1 on error.
  */
 int evbuffer_launch_read(struct evbuffer *, size_t n);
 
+/** Set how many reads evbuffer_launch_read() may keep posted on an
+    overlapped evbuffer, and how many bytes each one reads at most.
+
+    Fails if any reads are posted.
+
+    @return 0 on success, -1 on error.
+ */
+int _evbuffer_overlapped_set_reads(struct evbuffer *buf, int n_reads,
+    size_t read_size);
+
 /** Start writing data from the start of an evbuffer.
 
     An evbuffer can only have one write pending at a time.  While the write is
@@ -130,6 +158,19 @@ int evbuffer_launch_write(struct evbuffer *, ev_ssize_t n);
  */
 struct event_iocp_port *event_iocp_port_launch(void);
 
+/** As event_iocp_port_launch(), but with limits other than the defaults.
+
+    @param min_threads How many threads to keep serving the port, and how
+       many Windows lets run at once; 0 for one per CPU (and at least 2).
+    @param max_threads How many threads to grow to when all of them are busy
+       running callbacks; 0 for twice min_threads.  Threads beyond
+       min_threads exit once they've been idle for a while.
+    @param batch_size The most completions a thread takes off the port with
+       one call; 0 for the default of 64.
+ */
+struct event_iocp_port *event_iocp_port_launch_with_limits(int min_threads,
+    int max_threads, int batch_size);
+
 /** Associate a file descriptor with an iocp, such that overlapped IO on the
     fd will happen on one of the iocp's worker threads.
 */
@@ -151,6 +192,24 @@ int event_iocp_activate_overlapped(struct event_iocp_port *port,
 struct event_base;
 struct event_iocp_port *event_base_get_iocp(struct event_base *base);
 
+/** Create a bufferevent that does overlapped IO on fd through the IOCP
+    port of base.  Returns NULL if base has no IOCP port. */
+struct bufferevent *bufferevent_async_new(struct event_base *base,
+    evutil_socket_t fd, enum bufferevent_options options);
+
+/** Set how many overlapped reads a bufferevent from bufferevent_async_new()
+    keeps posted, and how many bytes each one reads at most.  The default
+    is EVBUFFER_OVERLAPPED_DEFAULT_READS reads of
+    EVBUFFER_OVERLAPPED_DEFAULT_READ_SIZE bytes.
+
+    Call this before the bufferevent is first enabled for reading: it fails
+    while any reads are posted.
+
+    @return 0 on success, -1 on error.
+ */
+int bufferevent_async_set_reads(struct bufferevent *bev, int n_reads,
+    size_t read_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,553 @@
+/*
+ * Copyright 2009 Niels Provos, Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_time.h>
+#endif
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "event-internal.h"
+#include "evsignal-internal.h"
+#include "log-internal.h"
+#include "evmap-internal.h"
+#include "event2/thread.h"
+#include "evthread-internal.h"
+
+/*
+ * Readiness is watched with IORING_OP_POLL_ADD requests.  add() and del()
+ * only queue submission entries; dispatch hands all of them to the kernel
+ * in the same io_uring_enter() call that waits for completions, so a loop
+ * iteration costs one system call however many fds changed.
+ *
+ * A poll request completes once, which gives us level-triggered behavior
+ * if we re-arm it after each completion.  Edge-triggered fds use multishot
+ * polls instead, which stay armed and complete again on each new wakeup.
+ */
+
+/* Not all headers that have IORING_ENTER_EXT_ARG know about multishot. */
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI	(1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE	(1U << 1)
+#endif
+
+#define IOURING_ENTRIES	1024
+
+/* user_data for completions we don't need to look at. */
+#define UD_IGNORE ((ev_uint64_t)-1)
+/* user_data for a poll request: which fd, and which request for it. */
+#define UD_MAKE(fd, gen) (((ev_uint64_t)(gen) << 32) | (ev_uint32_t)(fd))
+#define UD_FD(ud) ((int)((ud) & 0xffffffffu))
+#define UD_GEN(ud) ((ev_uint32_t)((ud) >> 32))
+
+/* The rings are shared with the kernel. */
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct iouring_fd {
+	/* Bumped every time we arm or cancel a poll on this fd, so that we
+	 * can tell completions for requests we no longer care about. */
+	ev_uint32_t gen;
+	/* EV_READ, EV_WRITE and EV_ET as the event map wants them. */
+	short events;
+	/* True iff a poll request with the current gen is outstanding. */
+	unsigned armed : 1;
+	/* True iff that request is multishot. */
+	unsigned multishot : 1;
+};
+
+struct iouringop {
+	int ring_fd;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+
+	unsigned *sq_khead;
+	unsigned *sq_ktail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	/* How far we have filled the queue; the kernel only sees entries
+	 * up to *sq_ktail. */
+	unsigned sq_tail;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	unsigned *cq_khead;
+	unsigned *cq_ktail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct iouring_fd *fds;
+	int nfds;
+
+	/* Set if the kernel turned down a multishot poll. */
+	int no_multishot;
+};
+
+static void *iouring_init	(struct event_base *);
+static int iouring_add(struct event_base *, int fd, short old, short events, void *);
+static int iouring_del(struct event_base *, int fd, short old, short events, void *);
+static int iouring_dispatch	(struct event_base *, struct timeval *);
+static void iouring_dealloc	(struct event_base *);
+static int iouring_grow_fds(struct iouringop *op, int fd);
+
+const struct eventop iouringops = {
+	"io_uring",
+	iouring_init,
+	iouring_add,
+	iouring_del,
+	iouring_dispatch,
+	iouring_dealloc,
+	1, /* need reinit */
+	EV_FEATURE_ET|EV_FEATURE_O1,
+	0
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, argsz));
+}
+
+static void
+iouring_unmap(struct iouringop *op)
+{
+	if (op->sqes)
+		munmap(op->sqes, op->sqes_sz);
+	if (op->cq_ring && op->cq_ring != op->sq_ring)
+		munmap(op->cq_ring, op->cq_ring_sz);
+	if (op->sq_ring)
+		munmap(op->sq_ring, op->sq_ring_sz);
+}
+
+static void *
+iouring_init(struct event_base *base)
+{
+	struct iouringop *op;
+	struct io_uring_params p;
+	unsigned *sq_array;
+	unsigned i;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = sys_io_uring_setup(IOURING_ENTRIES, &p)) == -1) {
+		/* Old kernels don't have it, and sandboxes often forbid it:
+		 * either way, some other backend will do. */
+		if (errno != ENOSYS && errno != EPERM)
+			event_warn("io_uring_setup");
+		return (NULL);
+	}
+	if ((p.features & IORING_FEAT_EXT_ARG) == 0 ||
+	    (p.features & IORING_FEAT_NODROP) == 0) {
+		/* We need to pass a timeout to io_uring_enter(), and to never
+		 * lose completions when the queue overflows. */
+		close(fd);
+		return (NULL);
+	}
+
+	if (!(op = mm_calloc(1, sizeof(struct iouringop)))) {
+		close(fd);
+		return (NULL);
+	}
+	op->ring_fd = fd;
+
+	op->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	op->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (op->cq_ring_sz > op->sq_ring_sz)
+			op->sq_ring_sz = op->cq_ring_sz;
+		op->cq_ring_sz = op->sq_ring_sz;
+	}
+	op->sq_ring = mmap(NULL, op->sq_ring_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (op->sq_ring == MAP_FAILED) {
+		op->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		op->cq_ring = op->sq_ring;
+	} else {
+		op->cq_ring = mmap(NULL, op->cq_ring_sz, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (op->cq_ring == MAP_FAILED) {
+			op->cq_ring = NULL;
+			goto err;
+		}
+	}
+	op->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	op->sqes = mmap(NULL, op->sqes_sz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (op->sqes == MAP_FAILED) {
+		op->sqes = NULL;
+		goto err;
+	}
+
+	op->sq_khead = (unsigned *)((char *)op->sq_ring + p.sq_off.head);
+	op->sq_ktail = (unsigned *)((char *)op->sq_ring + p.sq_off.tail);
+	op->sq_mask = *(unsigned *)((char *)op->sq_ring + p.sq_off.ring_mask);
+	op->sq_entries = p.sq_entries;
+	op->sq_tail = *op->sq_ktail;
+	/* We always fill the queue in order, so the index array never
+	 * needs to change. */
+	sq_array = (unsigned *)((char *)op->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i;
+
+	op->cq_khead = (unsigned *)((char *)op->cq_ring + p.cq_off.head);
+	op->cq_ktail = (unsigned *)((char *)op->cq_ring + p.cq_off.tail);
+	op->cq_mask = *(unsigned *)((char *)op->cq_ring + p.cq_off.ring_mask);
+	op->cqes = (struct io_uring_cqe *)((char *)op->cq_ring +
+	    p.cq_off.cqes);
+
+	/* Only a hint; iouring_add() grows the table if this fails. */
+	if (base->size_hint_fds > 0)
+		(void) iouring_grow_fds(op, base->size_hint_fds - 1);
+
+	evsig_init(base);
+
+	return (op);
+err:
+	event_warn("%s: mmap", __func__);
+	iouring_unmap(op);
+	close(fd);
+	mm_free(op);
+	return (NULL);
+}
+
+/* Make every entry we have queued visible to the kernel, and return how
+ * many it hasn't consumed yet.  Every queued entry must be filled in. */
+static unsigned
+iouring_publish(struct iouringop *op)
+{
+	STORE_RELEASE(op->sq_ktail, op->sq_tail);
+	return (op->sq_tail - LOAD_ACQUIRE(op->sq_khead));
+}
+
+/* Submit to_submit published entries, and wait for min_complete
+ * completions (with a timeout, if ts is set). */
+static int
+iouring_enter(struct iouringop *op, unsigned to_submit, unsigned min_complete,
+    struct __kernel_timespec *ts)
+{
+	struct io_uring_getevents_arg arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (ev_uint64_t)(uintptr_t)ts;
+
+	return (sys_io_uring_enter(op->ring_fd, to_submit, min_complete,
+		IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg)));
+}
+
+/* Return a zeroed submission entry, or NULL if the queue is full and we
+ * couldn't empty it. */
+static struct io_uring_sqe *
+iouring_get_sqe(struct iouringop *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (op->sq_tail - LOAD_ACQUIRE(op->sq_khead) >= op->sq_entries) {
+		/* Hand what we have to the kernel now, without waiting. */
+		if (iouring_enter(op, iouring_publish(op), 0, NULL) == -1 &&
+		    errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+			event_warn("io_uring_enter");
+			return (NULL);
+		}
+		if (op->sq_tail - LOAD_ACQUIRE(op->sq_khead) >=
+		    op->sq_entries)
+			return (NULL);
+	}
+
+	sqe = &op->sqes[op->sq_tail & op->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	++op->sq_tail;
+	return (sqe);
+}
+
+/* Queue a poll request for what fd's record says it wants. */
+static int
+iouring_arm(struct iouringop *op, int fd, struct iouring_fd *rec)
+{
+	struct io_uring_sqe *sqe;
+	unsigned short mask = 0;
+
+	if ((sqe = iouring_get_sqe(op)) == NULL)
+		return (-1);
+
+	if (rec->events & EV_READ)
+		mask |= POLLIN;
+	if (rec->events & EV_WRITE)
+		mask |= POLLOUT;
+
+	++rec->gen;
+	rec->armed = 1;
+	rec->multishot = (rec->events & EV_ET) && !op->no_multishot;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	/* The kernel reads this as a 32-bit field on new kernels; the 16-bit
+	 * one lines up with it either way for the bits we use. */
+	sqe->poll_events = mask;
+	if (rec->multishot)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = UD_MAKE(fd, rec->gen);
+	return (0);
+}
+
+/* Queue the cancellation of fd's outstanding poll request, if any. */
+static int
+iouring_disarm(struct iouringop *op, int fd, struct iouring_fd *rec)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!rec->armed)
+		return (0);
+	if ((sqe = iouring_get_sqe(op)) == NULL)
+		return (-1);
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = UD_MAKE(fd, rec->gen);
+	sqe->user_data = UD_IGNORE;
+
+	/* Whatever the old request still reports is stale now. */
+	++rec->gen;
+	rec->armed = 0;
+	return (0);
+}
+
+static int
+iouring_grow_fds(struct iouringop *op, int fd)
+{
+	struct iouring_fd *tmp;
+	int nfds = op->nfds ? op->nfds : 32;
+
+	while (nfds <= fd)
+		nfds <<= 1;
+	tmp = mm_realloc(op->fds, nfds * sizeof(struct iouring_fd));
+	if (tmp == NULL)
+		return (-1);
+	memset(tmp + op->nfds, 0,
+	    (nfds - op->nfds) * sizeof(struct iouring_fd));
+	op->fds = tmp;
+	op->nfds = nfds;
+	return (0);
+}
+
+/* Handle one completion.  Return the events to report for its fd, or 0. */
+static short
+iouring_process_cqe(struct iouringop *op, const struct io_uring_cqe *cqe,
+    int *fd_out)
+{
+	struct iouring_fd *rec;
+	int fd = UD_FD(cqe->user_data);
+	short res = 0;
+
+	if (cqe->user_data == UD_IGNORE || fd < 0 || fd >= op->nfds)
+		return (0);
+	rec = &op->fds[fd];
+	if (!rec->armed || rec->gen != UD_GEN(cqe->user_data))
+		return (0); /* for a request we have since cancelled */
+
+	if (!rec->multishot || !(cqe->flags & IORING_CQE_F_MORE)) {
+		/* The request is finished; ask again for next time.  The new
+		 * request goes in with our next io_uring_enter(), after the
+		 * callbacks have run. */
+		rec->armed = 0;
+		if (cqe->res == -EINVAL && rec->multishot) {
+			/* This kernel can't do multishot polls. */
+			op->no_multishot = 1;
+		}
+		if (iouring_arm(op, fd, rec) < 0)
+			event_warnx("%s: couldn't re-arm poll on %d",
+			    __func__, fd);
+	}
+
+	if (cqe->res < 0) {
+		if (cqe->res != -ECANCELED && cqe->res != -EINVAL)
+			event_debug(("%s: poll on %d failed: %s", __func__,
+				fd, strerror(-cqe->res)));
+		return (0);
+	}
+
+	if (cqe->res & (POLLHUP|POLLERR)) {
+		res = EV_READ | EV_WRITE;
+	} else {
+		if (cqe->res & POLLIN)
+			res |= EV_READ;
+		if (cqe->res & POLLOUT)
+			res |= EV_WRITE;
+	}
+	if (res && (rec->events & EV_ET))
+		res |= EV_ET;
+
+	*fd_out = fd;
+	return (res);
+}
+
+static int
+iouring_dispatch(struct event_base *base, struct timeval *tv)
+{
+	struct iouringop *op = base->evbase;
+	struct __kernel_timespec ts;
+	unsigned head, tail, to_submit, wait_nr = 1;
+	int res;
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (tv != NULL) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		if (!tv->tv_sec && !tv->tv_usec)
+			wait_nr = 0;
+	}
+	if (*op->cq_khead != LOAD_ACQUIRE(op->cq_ktail))
+		wait_nr = 0; /* completions left over from a full queue */
+	/* Entries queued by other threads after this point wait for the
+	 * next iteration; they notify the base, so there will be one. */
+	to_submit = iouring_publish(op);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	res = iouring_enter(op, to_submit, wait_nr, tv ? &ts : NULL);
+
+	if (res == -1) {
+		if (errno == EINTR) {
+			evsig_process(base);
+			return (0);
+		} else if (errno != ETIME && errno != EBUSY &&
+		    errno != EAGAIN) {
+			event_warn("io_uring_enter");
+			return (-1);
+		}
+	}
+	if (base->sig.evsig_caught)
+		evsig_process(base);
+
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	head = *op->cq_khead;
+	tail = LOAD_ACQUIRE(op->cq_ktail);
+	event_debug(("%s: io_uring reports %u", __func__, tail - head));
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &op->cqes[head & op->cq_mask];
+		int fd = -1;
+		short what = iouring_process_cqe(op, cqe, &fd);
+		if (what)
+			evmap_io_active(base, fd, what);
+	}
+	STORE_RELEASE(op->cq_khead, head);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+
+	return (0);
+}
+
+static int
+iouring_add(struct event_base *base, int fd, short old, short events, void *p)
+{
+	struct iouringop *op = base->evbase;
+	struct iouring_fd *rec;
+	short want = (old | events) & (EV_READ|EV_WRITE|EV_ET);
+	(void)p;
+
+	if (fd >= op->nfds && iouring_grow_fds(op, fd) < 0)
+		return (-1);
+	rec = &op->fds[fd];
+
+	if (rec->armed && rec->events == want)
+		return (0);
+	rec->events = want;
+	if (iouring_disarm(op, fd, rec) < 0 || iouring_arm(op, fd, rec) < 0)
+		return (-1);
+	return (0);
+}
+
+static int
+iouring_del(struct event_base *base, int fd, short old, short events, void *p)
+{
+	struct iouringop *op = base->evbase;
+	struct iouring_fd *rec;
+	short want;
+	(void)p;
+
+	if (fd >= op->nfds)
+		return (0);
+	rec = &op->fds[fd];
+
+	/* Whatever is left stays edge-triggered if it was. */
+	want = (old & ~events) & (EV_READ|EV_WRITE);
+	if (want)
+		want |= rec->events & EV_ET;
+	rec->events = want;
+	if (iouring_disarm(op, fd, rec) < 0)
+		return (-1);
+	if (rec->events && iouring_arm(op, fd, rec) < 0)
+		return (-1);
+	return (0);
+}
+
+static void
+iouring_dealloc(struct event_base *base)
+{
+	struct iouringop *op = base->evbase;
+
+	evsig_dealloc(base);
+	iouring_unmap(op);
+	if (op->ring_fd >= 0)
+		close(op->ring_fd);
+	if (op->fds)
+		mm_free(op->fds);
+
+	memset(op, 0, sizeof(struct iouringop));
+	mm_free(op);
+}
@@ -61,12 +61,20 @@
 #include "event-internal.h"
 #include "log-internal.h"
 #include "evmap-internal.h"
+#include "event2/thread.h"
+#include "evthread-internal.h"
+#include "changelist-internal.h"
 
 #define NEVENT		64
+/* We double the result list whenever kevent() fills it, up to this many. */
+#define MAX_NEVENT	4096
+
+/* The ident of the EVFILT_USER event we use to wake up the loop. */
+#define NOTIFY_IDENT	42
 
 struct kqop {
 	struct kevent *changes;
-	int nchanges;
+	int changes_size;
 	struct kevent *events;
 	int nevents;
 	int kq;
@@ -74,24 +82,27 @@ struct kqop {
 };
 
 static void *kq_init	(struct event_base *);
-static int kq_add (struct event_base *, int, short, short, void *);
-static int kq_del (struct event_base *, int, short, short, void *);
 static int kq_sig_add (struct event_base *, int, short, short, void *);
 static int kq_sig_del (struct event_base *, int, short, short, void *);
 static int kq_dispatch	(struct event_base *, struct timeval *);
-static int kq_insert	(struct kqop *, struct kevent *);
 static void kq_dealloc (struct event_base *);
+#ifdef EVFILT_USER
+static int kq_notify_base (struct event_base *);
+#endif
 
+/* fd changes are recorded in base->changelist, so that adding and deleting
+ * the same event before the next dispatch costs nothing, and their net
+ * result is passed to the kevent() call that waits for events. */
 const struct eventop kqops = {
 	"kqueue",
 	kq_init,
-	kq_add,
-	kq_del,
+	event_changelist_add,
+	event_changelist_del,
 	kq_dispatch,
 	kq_dealloc,
 	1 /* need reinit */,
     EV_FEATURE_ET|EV_FEATURE_O1|EV_FEATURE_FDS,
-	0
+	EVENT_CHANGELIST_FDINFO_SIZE
 };
 
 static const struct eventop kqsigops = {
@@ -109,7 +120,7 @@ static const struct eventop kqsigops = {
 static void *
 kq_init(struct event_base *base)
 {
-	int kq;
+	int kq, nevents;
 	struct kqop *kqueueop;
 
 	if (!(kqueueop = mm_calloc(1, sizeof(struct kqop))))
@@ -128,18 +139,20 @@ kq_init(struct event_base *base)
 	kqueueop->pid = getpid();
 
 	/* Initalize fields */
-	kqueueop->changes = mm_malloc(NEVENT * sizeof(struct kevent));
+	nevents = base->size_hint_fds > NEVENT ? base->size_hint_fds : NEVENT;
+	kqueueop->changes = mm_malloc(nevents * sizeof(struct kevent));
 	if (kqueueop->changes == NULL) {
 		mm_free (kqueueop);
 		return (NULL);
 	}
-	kqueueop->events = mm_malloc(NEVENT * sizeof(struct kevent));
+	kqueueop->events = mm_malloc(nevents * sizeof(struct kevent));
 	if (kqueueop->events == NULL) {
 		mm_free (kqueueop->changes);
 		mm_free (kqueueop);
 		return (NULL);
 	}
-	kqueueop->nevents = NEVENT;
+	kqueueop->changes_size = nevents;
+	kqueueop->nevents = nevents;
 
 	/* Check for Mac OS X kqueue bug. */
 	kqueueop->changes[0].ident = -1;
@@ -165,52 +178,117 @@ kq_init(struct event_base *base)
 	base->evsigsel = &kqsigops;
 	base->evsigbase = kqueueop;
 
+#ifdef EVFILT_USER
+	/* If the kernel has user events, wake the loop through the kqueue
+	 * itself rather than making evthread_make_base_notifiable() set up
+	 * a socketpair for us.  If this fails, we fall back to that. */
+	{
+		struct kevent kev;
+		memset(&kev, 0, sizeof(kev));
+		kev.ident = NOTIFY_IDENT;
+		kev.filter = EVFILT_USER;
+		kev.flags = EV_ADD | EV_CLEAR;
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) == 0) {
+			base->th_notify_fn = kq_notify_base;
+			/* After a fork, any wakeup that was pending went to
+			 * the parent's kqueue. */
+			base->is_notify_pending = 0;
+		}
+	}
+#endif
+
 	return (kqueueop);
 }
 
+#ifdef EVFILT_USER
 static int
-kq_insert(struct kqop *kqop, struct kevent *kev)
+kq_notify_base(struct event_base *base)
 {
-	int nevents = kqop->nevents;
+	struct kqop *kqop = base->evbase;
+	struct kevent kev;
+	struct timespec timeout = { 0, 0 };
 
-	if (kqop->nchanges == nevents) {
-		struct kevent *newchange;
-		struct kevent *newresult;
+	memset(&kev, 0, sizeof(kev));
+	kev.ident = NOTIFY_IDENT;
+	kev.filter = EVFILT_USER;
+	kev.fflags = NOTE_TRIGGER;
 
-		nevents *= 2;
+	if (kevent(kqop->kq, &kev, 1, NULL, 0, &timeout) == -1) {
+		event_warn("%s: kevent", __func__);
+		return (-1);
+	}
+	return (0);
+}
+#endif
 
-		newchange = mm_realloc(kqop->changes,
-				    nevents * sizeof(struct kevent));
-		if (newchange == NULL) {
-			event_warn("%s: malloc", __func__);
-			return (-1);
-		}
-		kqop->changes = newchange;
+/* Fill in 'out' to make the change 'change' to filter 'filter' on 'fd'. */
+static void
+kq_setup_kevent(struct kevent *out, evutil_socket_t fd, int filter,
+    short change)
+{
+	memset(out, 0, sizeof(struct kevent));
+	out->ident = fd;
+	out->filter = filter;
+
+	if (change & EV_CHANGE_ADD) {
+		out->flags = EV_ADD;
+		if (change & EV_CHANGE_ET)
+			out->flags |= EV_CLEAR;
+#ifdef NOTE_EOF
+		/* Make it behave like select() and poll() */
+		if (filter == EVFILT_READ)
+			out->fflags = NOTE_EOF;
+#endif
+	} else {
+		assert(change & EV_CHANGE_DEL);
+		out->flags = EV_DELETE;
+	}
 
-		newresult = mm_realloc(kqop->events,
-				    nevents * sizeof(struct kevent));
+	event_debug(("%s: fd %d %s%s%s",
+		 __func__, (int)fd,
+		 filter == EVFILT_READ ? "EVFILT_READ" : "EVFILT_WRITE",
+		 out->flags & EV_DELETE ? " (del)" : "",
+		 out->flags & EV_CLEAR ? " (clear)" : ""));
+}
 
-		/*
-		 * If we fail, we don't have to worry about freeing,
-		 * the next realloc will pick it up.
-		 */
-		if (newresult == NULL) {
-			event_warn("%s: malloc", __func__);
+/* Turn the base's changelist into kevents in kqop->changes, one per
+ * filter whose state changes.  Return the number of kevents, or -1 if
+ * we couldn't make room for them. */
+static int
+kq_build_changes_list(const struct event_changelist *changelist,
+    struct kqop *kqop)
+{
+	int i;
+	int n_changes = 0;
+
+	if (changelist->n_changes * 2 > kqop->changes_size) {
+		int new_size = kqop->changes_size;
+		struct kevent *newchanges;
+
+		while (new_size < changelist->n_changes * 2)
+			new_size *= 2;
+		newchanges = mm_realloc(kqop->changes,
+		    new_size * sizeof(struct kevent));
+		if (newchanges == NULL) {
+			event_warn("%s: realloc", __func__);
 			return (-1);
 		}
-		kqop->events = newresult;
-
-		kqop->nevents = nevents;
+		kqop->changes = newchanges;
+		kqop->changes_size = new_size;
 	}
 
-	memcpy(&kqop->changes[kqop->nchanges++], kev, sizeof(struct kevent));
+	for (i = 0; i < changelist->n_changes; ++i) {
+		const struct event_change *in_ch = &changelist->changes[i];
 
-	event_debug(("%s: fd %d %s%s",
-		 __func__, (int)kev->ident,
-		 kev->filter == EVFILT_READ ? "EVFILT_READ" : "EVFILT_WRITE",
-		 kev->flags == EV_DELETE ? " (del)" : ""));
+		if (in_ch->read_change)
+			kq_setup_kevent(&kqop->changes[n_changes++],
+			    in_ch->fd, EVFILT_READ, in_ch->read_change);
+		if (in_ch->write_change)
+			kq_setup_kevent(&kqop->changes[n_changes++],
+			    in_ch->fd, EVFILT_WRITE, in_ch->write_change);
+	}
 
-	return (0);
+	return (n_changes);
 }
 
 static void
@@ -223,19 +301,46 @@ static int
 kq_dispatch(struct event_base *base, struct timeval *tv)
 {
 	struct kqop *kqop = base->evbase;
-	struct kevent *changes = kqop->changes;
 	struct kevent *events = kqop->events;
 	struct timespec ts, *ts_p = NULL;
-	int i, res;
+	int i, n_changes, res;
 
 	if (tv != NULL) {
 		TIMEVAL_TO_TIMESPEC(tv, &ts);
 		ts_p = &ts;
 	}
 
-	res = kevent(kqop->kq, changes, kqop->nchanges,
+	/* Build the kevents under the lock; kqop->changes is ours alone, so
+	 * other threads can go on queueing changes while we wait. */
+	EVBASE_ACQUIRE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	n_changes = kq_build_changes_list(&base->changelist, kqop);
+	if (n_changes >= 0)
+		event_changelist_remove_all(&base->changelist, base);
+	EVBASE_RELEASE_LOCK(base, EVTHREAD_WRITE, th_base_lock);
+	if (n_changes < 0)
+		return (-1);
+
+	/* Errors in the changes come back as EV_ERROR entries in the result
+	 * list; if it's too short to hold them all, kevent() fails outright
+	 * instead.  So make sure it's at least as long as the change list. */
+	if (n_changes > kqop->nevents) {
+		struct kevent *newresult;
+		int new_nevents = kqop->nevents;
+
+		while (new_nevents < n_changes)
+			new_nevents *= 2;
+		newresult = mm_realloc(kqop->events,
+		    new_nevents * sizeof(struct kevent));
+		if (newresult == NULL) {
+			event_warn("%s: realloc", __func__);
+			return (-1);
+		}
+		kqop->events = events = newresult;
+		kqop->nevents = new_nevents;
+	}
+
+	res = kevent(kqop->kq, kqop->changes, n_changes,
 	    events, kqop->nevents, ts_p);
-	kqop->nchanges = 0;
 	if (res == -1) {
 		if (errno != EINTR) {
                         event_warn("kevent");
@@ -277,6 +382,12 @@ kq_dispatch(struct event_base *base, struct timeval *tv)
 			which |= EV_WRITE;
 		} else if (events[i].filter == EVFILT_SIGNAL) {
 			which |= EV_SIGNAL;
+#ifdef EVFILT_USER
+		} else if (events[i].filter == EVFILT_USER) {
+			/* EV_CLEAR has already reset the trigger; all we
+			 * have to do is allow the next wakeup. */
+			evthread_notify_clear_pending(base);
+#endif
 		}
 
 		if (!which)
@@ -289,83 +400,29 @@ kq_dispatch(struct event_base *base, struct timeval *tv)
 		}
 	}
 
-	return (0);
-}
-
-
-static int
-kq_add(struct event_base *base, int fd, short old, short events, void *p)
-{
-	struct kqop *kqop = base->evbase;
-	struct kevent kev;
-	(void) p;
-
-	if (events & EV_READ) {
- 		memset(&kev, 0, sizeof(kev));
-		kev.ident = fd;
-		kev.filter = EVFILT_READ;
-#ifdef NOTE_EOF
-		/* Make it behave like select() and poll() */
-		kev.fflags = NOTE_EOF;
-#endif
-		kev.flags = EV_ADD;
-		if (events & EV_ET)
-			kev.flags |= EV_CLEAR;
-
-		if (kq_insert(kqop, &kev) == -1)
-			return (-1);
-	}
-
-	if (events & EV_WRITE) {
- 		memset(&kev, 0, sizeof(kev));
-		kev.ident = fd;
-		kev.filter = EVFILT_WRITE;
-		kev.flags = EV_ADD;
-		if (events & EV_ET)
-			kev.flags |= EV_CLEAR;
+	if (res == kqop->nevents && kqop->nevents < MAX_NEVENT) {
+		/* We used all the space we had; next time, ask for more. */
+		int new_nevents = kqop->nevents * 2;
+		struct kevent *newresult;
 
-		if (kq_insert(kqop, &kev) == -1)
-			return (-1);
+		newresult = mm_realloc(kqop->events,
+		    new_nevents * sizeof(struct kevent));
+		if (newresult) {
+			kqop->events = newresult;
+			kqop->nevents = new_nevents;
+		}
 	}
 
 	return (0);
 }
 
-static int
-kq_del(struct event_base *base, int fd, short old, short events, void *p)
-{
-	struct kqop *kqop = base->evbase;
-	struct kevent kev;
-	(void) p;
-
-	if (events & EV_READ) {
- 		memset(&kev, 0, sizeof(kev));
-		kev.ident = fd;
-		kev.filter = EVFILT_READ;
-		kev.flags = EV_DELETE;
-
-		if (kq_insert(kqop, &kev) == -1)
-			return (-1);
-	}
-
-	if (events & EV_WRITE) {
- 		memset(&kev, 0, sizeof(kev));
-		kev.ident = fd;
-		kev.filter = EVFILT_WRITE;
-		kev.flags = EV_DELETE;
-
-		if (kq_insert(kqop, &kev) == -1)
-			return (-1);
-	}
-
-	return (0);
-}
 
 static void
 kq_dealloc(struct event_base *base)
 {
 	struct kqop *kqop = base->evbase;
 
+	event_changelist_freemem(&base->changelist);
 	if (kqop->changes)
 		mm_free(kqop->changes);
 	if (kqop->events)
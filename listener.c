@@ -24,12 +24,18 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/types.h>
-
 #ifdef HAVE_CONFIG_H
 #include "event-config.h"
 #endif
 
+#ifdef _EVENT_HAVE_ACCEPT4
+/* accept4 is only declared with this, and it has to come before any
+ * system header. */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+
 #ifdef WIN32
 #include <winsock2.h>
 #endif
@@ -37,12 +43,22 @@
 #ifdef _EVENT_HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef _EVENT_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
 #ifdef _EVENT_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef _EVENT_HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+#include <string.h>
 
 #include <event2/listener.h>
 #include <event2/util.h>
@@ -52,14 +68,77 @@
 #include "util-internal.h"
 #include "log-internal.h"
 
+/** How many connections a listener accepts per callback unless told
+ * otherwise. */
+#define DEFAULT_ACCEPTS_PER_CB 16
+
+/** How long a listener stays paused the first time it runs out of file
+ * descriptors, and the most it backs off to if it keeps running out. */
+#define PAUSE_MIN_MSEC 10
+#define PAUSE_MAX_MSEC 1000
+
+/** With LEV_OPT_DEFER_ACCEPT, how many seconds a connection can wait for
+ * its first data before we accept it anyway. */
+#define DEFER_ACCEPT_SECS 30
+
+/* True iff err from accept() means that we're out of file descriptors. */
+#ifdef WIN32
+#define ERR_ACCEPT_OUT_OF_FDS(err) ((err) == WSAEMFILE)
+#else
+#define ERR_ACCEPT_OUT_OF_FDS(err) ((err) == EMFILE || (err) == ENFILE)
+#endif
+
 struct evconnlistener {
 	struct event listener;
 	evconnlistener_cb cb;
 	void *user_data;
 	unsigned flags;
+	/** How many connections to accept before we let the rest of the loop
+	 * run, or 0 for no limit. */
+	int accepts_per_cb;
+	/** True iff the user wants the listener enabled. */
+	unsigned enabled : 1;
+	/** True iff we've stopped listening until pause_timer fires, because
+	 * we ran out of file descriptors. */
+	unsigned paused : 1;
+	/** Runs when it's time to try accepting again after a pause. */
+	struct event pause_timer;
+	/** How long to pause next time we run out of file descriptors. */
+	int pause_msec;
+	/** With LEV_OPT_RESERVE_FD, a file descriptor we keep open so that we
+	 * can give it up to accept (and drop) a connection when we're out of
+	 * them; else -1. */
+	int reserve_fd;
+	/** How many times we've paused. */
+	unsigned long n_pauses;
+	/** How many connections we've accepted and closed straight away
+	 * because we were out of file descriptors. */
+	unsigned long n_dropped;
+};
+
+/** A set of listeners on one address, each on its own event_base and with
+ * its own SO_REUSEPORT socket. */
+struct evconnlistener_group {
+	int n_listeners;
+	struct evconnlistener **listeners;
 };
 
 static void listener_read_cb(evutil_socket_t, short, void *);
+static void listener_resume_cb(evutil_socket_t, short, void *);
+
+/* Open a file descriptor to hold in reserve; return it, or -1. */
+static int
+listener_open_reserve(void)
+{
+#ifdef WIN32
+	return -1;
+#else
+	int fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+#endif
+}
 
 struct evconnlistener *
 evconnlistener_new(struct event_base *base,
@@ -80,34 +159,70 @@ evconnlistener_new(struct event_base *base,
 	lev->cb = cb;
 	lev->user_data = ptr;
 	lev->flags = flags;
+	lev->accepts_per_cb = DEFAULT_ACCEPTS_PER_CB;
+	lev->pause_msec = PAUSE_MIN_MSEC;
+	lev->reserve_fd = -1;
+	if (flags & LEV_OPT_RESERVE_FD) {
+		if ((lev->reserve_fd = listener_open_reserve()) < 0) {
+			mm_free(lev);
+			return NULL;
+		}
+	}
 	event_assign(&lev->listener, base, fd, EV_READ|EV_PERSIST,
 	    listener_read_cb, lev);
+	evtimer_assign(&lev->pause_timer, base, listener_resume_cb, lev);
 	evconnlistener_enable(lev);
 	return lev;
 }
 
-struct evconnlistener *
-evconnlistener_new_bind(struct event_base *base, evconnlistener_cb cb, void *ptr,
-    unsigned flags, int backlog, const struct sockaddr *sa, int socklen)
+/* Set the TCP options that flags ask for on a listener's socket.  These only
+ * make things faster, so we go on without them where they're missing. */
+static void
+listener_set_tcp_options(evutil_socket_t fd, unsigned flags, int backlog)
+{
+	int val;
+	if (flags & LEV_OPT_TCP_FASTOPEN) {
+#ifdef TCP_FASTOPEN
+		/* Linux takes the most pending fast-open connections to
+		 * allow; others just want it on. */
+		val = backlog > 0 ? backlog : 128;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (void*)&val,
+			sizeof(val)) < 0)
+			event_debug(("%s: can't enable TCP_FASTOPEN on %d",
+				__func__, (int)fd));
+#endif
+	}
+	if (flags & LEV_OPT_DEFER_ACCEPT) {
+#ifdef TCP_DEFER_ACCEPT
+		val = DEFER_ACCEPT_SECS;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void*)&val,
+			sizeof(val)) < 0)
+			event_debug(("%s: can't enable TCP_DEFER_ACCEPT on %d",
+				__func__, (int)fd));
+#endif
+	}
+}
+
+/* Make a nonblocking socket for a listener with the given flags, and bind
+ * it to sa if sa is set.  Return the socket, or -1 on failure. */
+static evutil_socket_t
+listener_bind_socket(unsigned flags, int backlog, const struct sockaddr *sa,
+    int socklen)
 {
 	evutil_socket_t fd;
 	int on = 1;
 	int family = sa ? sa->sa_family : AF_UNSPEC;
 
-	if (backlog == 0)
-		return NULL;
 	fd = socket(family, SOCK_STREAM, 0);
 	if (fd == -1)
-		return NULL;
+		return -1;
 	if (evutil_make_socket_nonblocking(fd) < 0)
-		return NULL;
+		goto err;
 
 #ifndef WIN32
 	if (flags & LEV_OPT_CLOSE_ON_EXEC) {
-		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
-			EVUTIL_CLOSESOCKET(fd);
-			return NULL;
-		}
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+			goto err;
 	}
 #endif
 
@@ -115,35 +230,188 @@ evconnlistener_new_bind(struct event_base *base, evconnlistener_cb cb, void *ptr
 	if (flags & LEV_OPT_REUSEABLE) {
 		evutil_make_listen_socket_reuseable(fd);
 	}
+	if (flags & LEV_OPT_REUSEABLE_PORT) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&on,
+			sizeof(on)) < 0)
+			goto err;
+#else
+		goto err;
+#endif
+	}
 
 	if (sa) {
-		if (bind(fd, sa, socklen)<0) {
+		if (bind(fd, sa, socklen)<0)
+			goto err;
+	}
+	listener_set_tcp_options(fd, flags, backlog);
+
+	return fd;
+err:
+	EVUTIL_CLOSESOCKET(fd);
+	return -1;
+}
+
+struct evconnlistener *
+evconnlistener_new_bind(struct event_base *base, evconnlistener_cb cb, void *ptr,
+    unsigned flags, int backlog, const struct sockaddr *sa, int socklen)
+{
+	evutil_socket_t fd;
+	struct evconnlistener *lev;
+
+	if (backlog == 0)
+		return NULL;
+	if ((fd = listener_bind_socket(flags, backlog, sa, socklen)) == -1)
+		return NULL;
+	if (!(lev = evconnlistener_new(base, cb, ptr, flags, backlog, fd)))
+		EVUTIL_CLOSESOCKET(fd);
+	return lev;
+}
+
+/* Have the kernel give each connection on fd's SO_REUSEPORT group to the
+ * socket whose place in the group is the number of the CPU that received
+ * it.  Where there is no such socket, it falls back to hashing. */
+static int
+listener_steer_by_cpu(evutil_socket_t fd)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(_EVENT_HAVE_LINUX_FILTER_H)
+	struct sock_filter code[] = {
+		/* A = the current CPU */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* return A */
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+	    sizeof(prog));
+#else
+	return -1;
+#endif
+}
+
+struct evconnlistener_group *
+evconnlistener_group_new_bind(struct event_base **bases, int n_bases,
+    evconnlistener_cb cb, void **ptrs, unsigned flags, int backlog,
+    const struct sockaddr *sa, int socklen)
+{
+	struct evconnlistener_group *group;
+	struct sockaddr_storage ss;
+	int i;
+
+	if (n_bases < 1 || !sa || backlog == 0 ||
+	    socklen > (int)sizeof(ss))
+		return NULL;
+	memcpy(&ss, sa, socklen);
+	/* The group owns the sockets it makes. */
+	flags |= LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE;
+
+	if (!(group = mm_calloc(1, sizeof(struct evconnlistener_group))))
+		return NULL;
+	group->listeners = mm_calloc(n_bases, sizeof(struct evconnlistener *));
+	if (!group->listeners)
+		goto err;
+
+	/* The sockets join the SO_REUSEPORT group in the order they start
+	 * listening, which is the order of bases. */
+	for (i = 0; i < n_bases; ++i) {
+		evutil_socket_t fd;
+		fd = listener_bind_socket(flags, backlog,
+		    (struct sockaddr *)&ss, socklen);
+		if (fd == -1)
+			goto err;
+		if (i == 0) {
+			/* If sa asked for any port, the rest have to bind
+			 * to the one the first one got. */
+			socklen_t len = sizeof(ss);
+			if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0) {
+				EVUTIL_CLOSESOCKET(fd);
+				goto err;
+			}
+		}
+		group->listeners[i] = evconnlistener_new(bases[i], cb,
+		    ptrs ? ptrs[i] : NULL, flags, backlog, fd);
+		if (!group->listeners[i]) {
 			EVUTIL_CLOSESOCKET(fd);
-			return NULL;
+			goto err;
 		}
+		++group->n_listeners;
 	}
 
-	return evconnlistener_new(base, cb, ptr, flags, backlog, fd);
+	if ((flags & LEV_OPT_STEER_BY_CPU) &&
+	    listener_steer_by_cpu(
+		    evconnlistener_get_fd(group->listeners[0])) < 0)
+		event_debug(("%s: can't steer connections by CPU; "
+			"the kernel will hash them instead", __func__));
+
+	return group;
+err:
+	evconnlistener_group_free(group);
+	return NULL;
+}
+
+void
+evconnlistener_group_free(struct evconnlistener_group *group)
+{
+	int i;
+	for (i = 0; i < group->n_listeners; ++i)
+		evconnlistener_free(group->listeners[i]);
+	if (group->listeners)
+		mm_free(group->listeners);
+	mm_free(group);
+}
+
+int
+evconnlistener_group_size(struct evconnlistener_group *group)
+{
+	return group->n_listeners;
+}
+
+struct evconnlistener *
+evconnlistener_group_get(struct evconnlistener_group *group, int i)
+{
+	if (i < 0 || i >= group->n_listeners)
+		return NULL;
+	return group->listeners[i];
 }
 
 void
 evconnlistener_free(struct evconnlistener *lev)
 {
 	event_del(&lev->listener);
+	event_del(&lev->pause_timer);
 	if (lev->flags & LEV_OPT_CLOSE_ON_FREE)
 		EVUTIL_CLOSESOCKET(event_get_fd(&lev->listener));
+#ifndef WIN32
+	if (lev->reserve_fd >= 0)
+		close(lev->reserve_fd);
+#endif
 	mm_free(lev);
 }
 
 int
 evconnlistener_enable(struct evconnlistener *lev)
 {
+	lev->enabled = 1;
+	/* If we were paused, whoever enables us knows best: maybe they've
+	 * just closed some connections. */
+	if (lev->paused) {
+		lev->paused = 0;
+		event_del(&lev->pause_timer);
+	}
 	return event_add(&lev->listener, NULL);
 }
 
 int
 evconnlistener_disable(struct evconnlistener *lev)
 {
+	lev->enabled = 0;
+	if (lev->paused) {
+		lev->paused = 0;
+		event_del(&lev->pause_timer);
+	}
 	return event_del(&lev->listener);
 }
 
@@ -153,21 +421,135 @@ evconnlistener_get_base(struct evconnlistener *lev)
 	return event_get_base(&lev->listener);
 }
 
+evutil_socket_t
+evconnlistener_get_fd(struct evconnlistener *lev)
+{
+	return event_get_fd(&lev->listener);
+}
+
+unsigned long
+evconnlistener_get_n_pauses(struct evconnlistener *lev)
+{
+	return lev->n_pauses;
+}
+
+unsigned long
+evconnlistener_get_n_dropped(struct evconnlistener *lev)
+{
+	return lev->n_dropped;
+}
+
+int
+evconnlistener_set_accepts_per_cb(struct evconnlistener *lev, int n)
+{
+	if (n < 0)
+		return -1;
+	lev->accepts_per_cb = n;
+	return 0;
+}
+
+/* Accept a connection on fd, and make the new socket nonblocking and
+ * close-on-exec as lev->flags say. */
+static evutil_socket_t
+listener_accept(struct evconnlistener *lev, evutil_socket_t fd,
+    struct sockaddr *sa, socklen_t *socklen)
+{
+	evutil_socket_t new_fd;
+#if defined(_EVENT_HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	int flags = 0;
+	if (!(lev->flags & LEV_OPT_LEAVE_SOCKETS_BLOCKING))
+		flags |= SOCK_NONBLOCK;
+	if (lev->flags & LEV_OPT_CLOSE_ON_EXEC)
+		flags |= SOCK_CLOEXEC;
+	/* Saves us a fcntl() or two per connection. */
+	new_fd = accept4(fd, sa, socklen, flags);
+	if (new_fd >= 0 || errno != ENOSYS)
+		return new_fd;
+	/* The kernel is older than the C library; do it the slow way. */
+#endif
+	new_fd = accept(fd, sa, socklen);
+	if (new_fd < 0)
+		return new_fd;
+
+	if (!(lev->flags & LEV_OPT_LEAVE_SOCKETS_BLOCKING))
+		evutil_make_socket_nonblocking(new_fd);
+#ifndef WIN32
+	if (lev->flags & LEV_OPT_CLOSE_ON_EXEC)
+		fcntl(new_fd, F_SETFD, FD_CLOEXEC);
+#endif
+	return new_fd;
+}
+
+/* We're out of file descriptors.  If we have one in reserve, use it to
+ * take the oldest connection off the backlog and close it, so that its
+ * client hears about it now rather than when it times out.  Then stop
+ * listening for a while: the socket stays readable, and accept() would just
+ * fail again every time around the loop. */
+static void
+listener_pause(struct evconnlistener *lev, evutil_socket_t fd)
+{
+	struct timeval tv;
+
+#ifndef WIN32
+	if (lev->reserve_fd >= 0) {
+		evutil_socket_t dropped;
+		close(lev->reserve_fd);
+		dropped = accept(fd, NULL, NULL);
+		if (dropped >= 0) {
+			EVUTIL_CLOSESOCKET(dropped);
+			++lev->n_dropped;
+		}
+		lev->reserve_fd = listener_open_reserve();
+	}
+#endif
+
+	/* Only complain about the first of a run of pauses. */
+	if (lev->pause_msec == PAUSE_MIN_MSEC)
+		event_sock_warn(fd, "Out of file descriptors in accept(); "
+		    "pausing listener");
+
+	event_del(&lev->listener);
+	lev->paused = 1;
+	++lev->n_pauses;
+	tv.tv_sec = lev->pause_msec / 1000;
+	tv.tv_usec = (lev->pause_msec % 1000) * 1000;
+	event_add(&lev->pause_timer, &tv);
+	lev->pause_msec *= 2;
+	if (lev->pause_msec > PAUSE_MAX_MSEC)
+		lev->pause_msec = PAUSE_MAX_MSEC;
+}
+
+static void
+listener_resume_cb(evutil_socket_t fd, short what, void *p)
+{
+	struct evconnlistener *lev = p;
+	lev->paused = 0;
+	if (lev->enabled)
+		event_add(&lev->listener, NULL);
+}
+
 static void
 listener_read_cb(evutil_socket_t fd, short what, void *p)
 {
 	struct evconnlistener *lev = p;
 	int err;
+	int n_accepted = 0;
 	while (1) {
 		struct sockaddr_storage ss;
 		socklen_t socklen = sizeof(ss);
+		evutil_socket_t new_fd;
 
-		evutil_socket_t new_fd = accept(fd, (struct sockaddr*)&ss, &socklen);
+		/* Leave the rest for the next time around the loop, so that
+		 * a flood of connections can't starve everything else. */
+		if (lev->accepts_per_cb && n_accepted == lev->accepts_per_cb)
+			return;
+
+		new_fd = listener_accept(lev, fd, (struct sockaddr*)&ss,
+		    &socklen);
 		if (new_fd < 0)
 			break;
-
-		if (!(lev->flags & LEV_OPT_LEAVE_SOCKETS_BLOCKING))
-			evutil_make_socket_nonblocking(new_fd);
+		++n_accepted;
+		lev->pause_msec = PAUSE_MIN_MSEC;
 
 		lev->cb(lev, new_fd, (struct sockaddr*)&ss, (int)socklen,
 		    lev->user_data);
@@ -175,5 +557,9 @@ listener_read_cb(evutil_socket_t fd, short what, void *p)
 	err = evutil_socket_geterror(fd);
 	if (EVUTIL_ERR_ACCEPT_RETRIABLE(err))
 		return;
+	if (ERR_ACCEPT_OUT_OF_FDS(err)) {
+		listener_pause(lev, fd);
+		return;
+	}
 	event_sock_warn(fd, "Error from accept() call");
 }
@@ -61,10 +61,14 @@
 #include "event2/util.h"
 
 #include "log-internal.h"
+#include "evthread-internal.h"
+#include "mm-internal.h"
 
 static void _warn_helper(int severity, const char *errstr, const char *fmt,
                          va_list ap);
 static void event_log(int severity, const char *msg);
+static int log_ring_put(int severity, const char *errstr, const char *fmt,
+                        va_list ap);
 
 void
 event_err(int eval, const char *fmt, ...)
@@ -152,23 +156,37 @@ _event_debugx(const char *fmt, ...)
 }
 
 static void
-_warn_helper(int severity, const char *errstr, const char *fmt, va_list ap)
+log_format(char *buf, size_t buflen, const char *errstr, const char *fmt,
+    va_list ap)
 {
-	char buf[1024];
 	size_t len;
 
 	if (fmt != NULL)
-		evutil_vsnprintf(buf, sizeof(buf), fmt, ap);
+		evutil_vsnprintf(buf, buflen, fmt, ap);
 	else
 		buf[0] = '\0';
 
 	if (errstr) {
 		len = strlen(buf);
-		if (len < sizeof(buf) - 3) {
-			evutil_snprintf(buf + len, sizeof(buf) - len, ": %s", errstr);
+		if (len < buflen - 3) {
+			evutil_snprintf(buf + len, buflen - len, ": %s", errstr);
 		}
 	}
+}
+
+static void
+_warn_helper(int severity, const char *errstr, const char *fmt, va_list ap)
+{
+	char buf[1024];
+
+	/* Errors are about to exit(), so they can't wait for a drain; let
+	 * everything before them out first. */
+	if (severity == _EVENT_LOG_ERR)
+		event_log_ring_drain(NULL);
+	else if (log_ring_put(severity, errstr, fmt, ap) == 0)
+		return;
 
+	log_format(buf, sizeof(buf), errstr, fmt, ap);
 	event_log(severity, buf);
 }
 
@@ -207,3 +225,158 @@ event_log(int severity, const char *msg)
 		(void)fprintf(stderr, "[%s] %s\n", severity_str, msg);
 	}
 }
+
+/* The longest message the ring keeps; longer ones are cut short. */
+#define LOG_RING_MSG_LEN 256
+
+/* One message in the ring.  Writers and drainers claim slots by moving
+ * log_ring_head and log_ring_tail forward with CAS; seq says whose turn it
+ * is, so that nobody touches a slot that someone else is still filling or
+ * emptying. */
+struct log_ring_slot {
+	/* pos while the slot waits for the writer at position pos; pos+1
+	 * once that writer is done; pos+size once it has been drained. */
+	volatile size_t seq;
+	int severity;
+	struct timeval when;
+	char msg[LOG_RING_MSG_LEN];
+};
+
+static struct log_ring_slot *volatile log_ring = NULL;
+static size_t log_ring_mask;
+static volatile size_t log_ring_head;
+static volatile size_t log_ring_tail;
+static volatile unsigned long log_ring_dropped;
+
+#ifdef EVTHREAD_HAVE_ATOMICS
+
+int
+event_enable_log_ring(int n_messages)
+{
+	struct log_ring_slot *ring;
+	size_t n = 1, i;
+
+	if (log_ring || n_messages < 1)
+		return -1;
+	while (n < (size_t)n_messages)
+		n <<= 1;
+	if ((ring = mm_calloc(n, sizeof(struct log_ring_slot))) == NULL)
+		return -1;
+	for (i = 0; i < n; ++i)
+		ring[i].seq = i;
+	log_ring_mask = n - 1;
+	log_ring_head = log_ring_tail = 0;
+	log_ring_dropped = 0;
+	EVATOMIC_BARRIER();
+	log_ring = ring;
+	return 0;
+}
+
+/* Format a message straight into the next free slot.  Return 0 if it is
+ * in the ring or was dropped, -1 if there is no ring. */
+static int
+log_ring_put(int severity, const char *errstr, const char *fmt, va_list ap)
+{
+	struct log_ring_slot *ring = log_ring, *slot;
+	size_t pos;
+	ev_ssize_t dif;
+
+	if (!ring)
+		return -1;
+	for (;;) {
+		pos = log_ring_head;
+		slot = &ring[pos & log_ring_mask];
+		dif = (ev_ssize_t)(slot->seq - pos);
+		if (dif == 0 && EVATOMIC_CAS(&log_ring_head, pos, pos + 1))
+			break;
+		if (dif < 0) {
+			/* Full: the drainer is a whole ring behind. */
+			EVATOMIC_ADD(&log_ring_dropped, 1);
+			return 0;
+		}
+		/* Another writer got here first; try the next slot. */
+	}
+
+	slot->severity = severity;
+	evutil_gettimeofday(&slot->when, NULL);
+	log_format(slot->msg, sizeof(slot->msg), errstr, fmt, ap);
+	EVATOMIC_BARRIER();
+	slot->seq = pos + 1;
+	return 0;
+}
+
+int
+event_log_ring_drain(event_log_ring_cb cb)
+{
+	struct log_ring_slot *ring = log_ring, *slot;
+	struct timeval when;
+	char msg[LOG_RING_MSG_LEN];
+	int severity, n = 0;
+	size_t pos;
+	ev_ssize_t dif;
+
+	if (!ring)
+		return 0;
+	for (;;) {
+		pos = log_ring_tail;
+		slot = &ring[pos & log_ring_mask];
+		dif = (ev_ssize_t)(slot->seq - (pos + 1));
+		if (dif < 0)
+			break; /* empty, or its writer isn't done with it */
+		if (dif > 0 || !EVATOMIC_CAS(&log_ring_tail, pos, pos + 1))
+			continue; /* another drainer took it */
+
+		severity = slot->severity;
+		when = slot->when;
+		memcpy(msg, slot->msg, sizeof(msg));
+		EVATOMIC_BARRIER();
+		slot->seq = pos + log_ring_mask + 1;
+
+		if (cb)
+			cb(severity, &when, msg);
+		else
+			event_log(severity, msg);
+		++n;
+	}
+	return n;
+}
+
+#else
+
+int
+event_enable_log_ring(int n_messages)
+{
+	return -1;
+}
+
+static int
+log_ring_put(int severity, const char *errstr, const char *fmt, va_list ap)
+{
+	return -1;
+}
+
+int
+event_log_ring_drain(event_log_ring_cb cb)
+{
+	return 0;
+}
+
+#endif
+
+void
+event_disable_log_ring(void)
+{
+	struct log_ring_slot *ring = log_ring;
+
+	if (!ring)
+		return;
+	event_log_ring_drain(NULL);
+	log_ring = NULL;
+	mm_free(ring);
+}
+
+unsigned long
+event_log_ring_get_dropped(void)
+{
+	return log_ring_dropped;
+}
@@ -33,44 +33,85 @@
 #include "event2/event_struct.h"
 #include "event2/util.h"
 #include "util-internal.h"
+#include "mm-internal.h"
 
+/* One slot of a keyed heap: the expiry time is kept next to the event
+ * pointer so that comparisons while sifting never touch the event itself. */
+struct min_heap_entry
+{
+    struct timeval key;
+    struct event* ev;
+};
+
+/* The ordinary heap is binary and stores only event pointers.  A keyed heap
+ * (see min_heap_ctor_keyed) is 4-ary and stores min_heap_entry slots
+ * contiguously, which keeps the working set of a sift to about one cache
+ * line per level when there are hundreds of thousands of timeouts. */
 typedef struct min_heap
 {
     struct event** p;
+    struct min_heap_entry* k;
     unsigned n, a;
+    int keyed;
 } min_heap_t;
 
 static inline void           min_heap_ctor(min_heap_t* s);
+static inline void           min_heap_ctor_keyed(min_heap_t* s);
 static inline void           min_heap_dtor(min_heap_t* s);
 static inline void           min_heap_elem_init(struct event* e);
 static inline int            min_heap_elem_greater(struct event *a, struct event *b);
 static inline int            min_heap_empty(min_heap_t* s);
 static inline unsigned       min_heap_size(min_heap_t* s);
 static inline struct event*  min_heap_top(min_heap_t* s);
+static inline struct event*  min_heap_elt(min_heap_t* s, unsigned idx);
 static inline int            min_heap_reserve(min_heap_t* s, unsigned n);
 static inline int            min_heap_push(min_heap_t* s, struct event* e);
 static inline struct event*  min_heap_pop(min_heap_t* s);
 static inline int            min_heap_erase(min_heap_t* s, struct event* e);
+static inline void           min_heap_shift_keys(min_heap_t* s, const struct timeval* off);
 static inline void           min_heap_shift_up_(min_heap_t* s, unsigned hole_index, struct event* e);
 static inline void           min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e);
+static inline void           min_heap_keyed_shift_up_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e);
+static inline void           min_heap_keyed_shift_down_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e);
+
+#define MIN_HEAP_KEYED_ARITY 4
 
 int min_heap_elem_greater(struct event *a, struct event *b)
 {
     return evutil_timercmp(&a->ev_timeout, &b->ev_timeout, >);
 }
 
-void min_heap_ctor(min_heap_t* s) { s->p = 0; s->n = 0; s->a = 0; }
-void min_heap_dtor(min_heap_t* s) { free(s->p); }
-void min_heap_elem_init(struct event* e) { e->min_heap_idx = -1; }
+#define min_heap_key_greater(a, b) \
+    evutil_timercmp(&(a)->key, &(b)->key, >)
+
+void min_heap_ctor(min_heap_t* s) { s->p = 0; s->k = 0; s->n = 0; s->a = 0; s->keyed = 0; }
+void min_heap_ctor_keyed(min_heap_t* s) { min_heap_ctor(s); s->keyed = 1; }
+void min_heap_dtor(min_heap_t* s) { if (s->p) mm_free(s->p); if (s->k) mm_free(s->k); }
+void min_heap_elem_init(struct event* e) { e->ev_timeout_pos.min_heap_idx = -1; }
 int min_heap_empty(min_heap_t* s) { return 0u == s->n; }
 unsigned min_heap_size(min_heap_t* s) { return s->n; }
-struct event* min_heap_top(min_heap_t* s) { return s->n ? *s->p : 0; }
+struct event* min_heap_top(min_heap_t* s) { return min_heap_elt(s, 0); }
+
+struct event* min_heap_elt(min_heap_t* s, unsigned idx)
+{
+    if (idx >= s->n)
+        return 0;
+    return s->keyed ? s->k[idx].ev : s->p[idx];
+}
 
 int min_heap_push(min_heap_t* s, struct event* e)
 {
     if(min_heap_reserve(s, s->n + 1))
         return -1;
-    min_heap_shift_up_(s, s->n++, e);
+    if (s->keyed)
+    {
+        struct min_heap_entry ent;
+        ent.key = e->ev_timeout;
+        ent.ev = e;
+        min_heap_keyed_shift_up_(s, s->n++, ent);
+    }
+    else
+        min_heap_shift_up_(s, s->n++, e);
     return 0;
 }
 
@@ -78,9 +119,20 @@ struct event* min_heap_pop(min_heap_t* s)
 {
     if(s->n)
     {
-        struct event* e = *s->p;
-        min_heap_shift_down_(s, 0u, s->p[--s->n]);
-        e->min_heap_idx = -1;
+        struct event* e;
+        if (s->keyed)
+        {
+            e = s->k[0].ev;
+            --s->n;
+            if (s->n)
+                min_heap_keyed_shift_down_(s, 0u, s->k[s->n]);
+        }
+        else
+        {
+            e = *s->p;
+            min_heap_shift_down_(s, 0u, s->p[--s->n]);
+        }
+        e->ev_timeout_pos.min_heap_idx = -1;
         return e;
     }
     return 0;
@@ -88,21 +140,41 @@ struct event* min_heap_pop(min_heap_t* s)
 
 int min_heap_erase(min_heap_t* s, struct event* e)
 {
-    if(((unsigned int)-1) != e->min_heap_idx)
+    if(((unsigned int)-1) != e->ev_timeout_pos.min_heap_idx)
     {
-        struct event *last = s->p[--s->n];
-        unsigned parent = (e->min_heap_idx - 1) / 2;
+        unsigned idx = e->ev_timeout_pos.min_heap_idx;
+        if (s->keyed)
+        {
+            struct min_heap_entry last = s->k[--s->n];
+            unsigned parent = (idx - 1) / MIN_HEAP_KEYED_ARITY;
+            /* As below, but if e was the last slot there is nothing left
+               to move into the hole. */
+            if (idx < s->n)
+            {
+                if (idx > 0 && min_heap_key_greater(&s->k[parent], &last))
+                    min_heap_keyed_shift_up_(s, idx, last);
+                else
+                    min_heap_keyed_shift_down_(s, idx, last);
+            }
+            e->ev_timeout_pos.min_heap_idx = -1;
+            return 0;
+        }
+        else
+        {
+            struct event *last = s->p[--s->n];
+            unsigned parent = (idx - 1) / 2;
 	/* we replace e with the last element in the heap.  We might need to
 	   shift it upward if it is less than its parent, or downward if it is
 	   greater than one or both its children. Since the children are known
 	   to be less than the parent, it can't need to shift both up and
 	   down. */
-        if (e->min_heap_idx > 0 && min_heap_elem_greater(s->p[parent], last))
-             min_heap_shift_up_(s, e->min_heap_idx, last);
-        else
-             min_heap_shift_down_(s, e->min_heap_idx, last);
-        e->min_heap_idx = -1;
-        return 0;
+            if (idx > 0 && min_heap_elem_greater(s->p[parent], last))
+                 min_heap_shift_up_(s, idx, last);
+            else
+                 min_heap_shift_down_(s, idx, last);
+            e->ev_timeout_pos.min_heap_idx = -1;
+            return 0;
+        }
     }
     return -1;
 }
@@ -111,28 +183,52 @@ int min_heap_reserve(min_heap_t* s, unsigned n)
 {
     if(s->a < n)
     {
-        struct event** p;
         unsigned a = s->a ? s->a * 2 : 8;
         if(a < n)
             a = n;
-        if(!(p = (struct event**)realloc(s->p, a * sizeof *p)))
-            return -1;
-        s->p = p;
+        if (s->keyed)
+        {
+            struct min_heap_entry* k;
+            if(!(k = (struct min_heap_entry*)mm_realloc(s->k, a * sizeof *k)))
+                return -1;
+            s->k = k;
+        }
+        else
+        {
+            struct event** p;
+            if(!(p = (struct event**)mm_realloc(s->p, a * sizeof *p)))
+                return -1;
+            s->p = p;
+        }
         s->a = a;
     }
     return 0;
 }
 
+/* Subtract 'off' from the timeout of every element.  This does not change
+ * their relative order, so no sifting is needed. */
+void min_heap_shift_keys(min_heap_t* s, const struct timeval* off)
+{
+    unsigned i;
+    for (i = 0; i < s->n; ++i)
+    {
+        struct event* e = min_heap_elt(s, i);
+        evutil_timersub(&e->ev_timeout, off, &e->ev_timeout);
+        if (s->keyed)
+            s->k[i].key = e->ev_timeout;
+    }
+}
+
 void min_heap_shift_up_(min_heap_t* s, unsigned hole_index, struct event* e)
 {
     unsigned parent = (hole_index - 1) / 2;
     while(hole_index && min_heap_elem_greater(s->p[parent], e))
     {
-        (s->p[hole_index] = s->p[parent])->min_heap_idx = hole_index;
+        (s->p[hole_index] = s->p[parent])->ev_timeout_pos.min_heap_idx = hole_index;
         hole_index = parent;
         parent = (hole_index - 1) / 2;
     }
-    (s->p[hole_index] = e)->min_heap_idx = hole_index;
+    (s->p[hole_index] = e)->ev_timeout_pos.min_heap_idx = hole_index;
 }
 
 void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e)
@@ -143,11 +239,48 @@ void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e)
         min_child -= min_child == s->n || min_heap_elem_greater(s->p[min_child], s->p[min_child - 1]);
         if(!(min_heap_elem_greater(e, s->p[min_child])))
             break;
-        (s->p[hole_index] = s->p[min_child])->min_heap_idx = hole_index;
+        (s->p[hole_index] = s->p[min_child])->ev_timeout_pos.min_heap_idx = hole_index;
         hole_index = min_child;
         min_child = 2 * (hole_index + 1);
 	}
     min_heap_shift_up_(s, hole_index,  e);
 }
 
+void min_heap_keyed_shift_up_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e)
+{
+    unsigned parent = (hole_index - 1) / MIN_HEAP_KEYED_ARITY;
+    while(hole_index && min_heap_key_greater(&s->k[parent], &e))
+    {
+        s->k[hole_index] = s->k[parent];
+        s->k[hole_index].ev->ev_timeout_pos.min_heap_idx = hole_index;
+        hole_index = parent;
+        parent = (hole_index - 1) / MIN_HEAP_KEYED_ARITY;
+    }
+    s->k[hole_index] = e;
+    e.ev->ev_timeout_pos.min_heap_idx = hole_index;
+}
+
+void min_heap_keyed_shift_down_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e)
+{
+    unsigned child = MIN_HEAP_KEYED_ARITY * hole_index + 1;
+    while(child < s->n)
+    {
+        unsigned min_child = child, i;
+        unsigned end = child + MIN_HEAP_KEYED_ARITY;
+        if (end > s->n)
+            end = s->n;
+        for (i = child + 1; i < end; ++i)
+            if (min_heap_key_greater(&s->k[min_child], &s->k[i]))
+                min_child = i;
+        if(!(min_heap_key_greater(&e, &s->k[min_child])))
+            break;
+        s->k[hole_index] = s->k[min_child];
+        s->k[hole_index].ev->ev_timeout_pos.min_heap_idx = hole_index;
+        hole_index = min_child;
+        child = MIN_HEAP_KEYED_ARITY * hole_index + 1;
+    }
+    s->k[hole_index] = e;
+    e.ev->ev_timeout_pos.min_heap_idx = hole_index;
+}
+
 #endif /* _MIN_HEAP_H_ */
@@ -87,6 +87,14 @@ poll_init(struct event_base *base)
 	if (!(pollop = mm_calloc(1, sizeof(struct pollop))))
 		return (NULL);
 
+	if (base->size_hint_fds > 0) {
+		/* If this fails, poll_add() will try again. */
+		pollop->event_set = mm_malloc(
+		    (base->size_hint_fds + 1) * sizeof(struct pollfd));
+		if (pollop->event_set)
+			pollop->event_count = base->size_hint_fds + 1;
+	}
+
 	evsig_init(base);
 
 	return (pollop);
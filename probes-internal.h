@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PROBES_INTERNAL_H_
+#define _PROBES_INTERNAL_H_
+
+/*
+ * Static tracepoints for DTrace, SystemTap and bpftrace, in the "libevent"
+ * provider.  They are compiled in only with --enable-usdt; each is then a
+ * single nop until a tracer arms it, and the arguments are only ever
+ * loaded into registers, never computed.  Without --enable-usdt they are
+ * nothing at all.
+ *
+ *   event__add(base, ev, fd, events, tv)   event_add, before anything
+ *   event__del(base, ev, fd)               event_del, before anything
+ *   dispatch__start(base, tv)              about to wait; tv may be NULL
+ *   dispatch__done(base, res)              the backend returned res
+ *   callback__start(base, ev, fd, res)     about to run ev's callback
+ *   callback__done(base, ev)               ev's callback returned; ev may
+ *                                          be gone, so don't look in it
+ *   buffer__read(buf, fd, n)               evbuffer_read read n bytes
+ *   buffer__write(buf, fd, n)              evbuffer_write_atmost wrote n
+ *
+ * For example, to see how long each dispatch takes:
+ *
+ *   bpftrace -e 'usdt:./libevent.so:libevent:dispatch__start
+ *       { @s[tid] = nsecs; }
+ *     usdt:./libevent.so:libevent:dispatch__done /@s[tid]/
+ *       { @ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ */
+
+#include "event-config.h"
+#include "util-internal.h"
+
+#ifdef _EVENT_USE_USDT
+#include <sys/sdt.h>
+#define EV_PROBE2(name, a, b)					\
+	DTRACE_PROBE2(libevent, name, a, b)
+#define EV_PROBE3(name, a, b, c)				\
+	DTRACE_PROBE3(libevent, name, a, b, c)
+#define EV_PROBE4(name, a, b, c, d)				\
+	DTRACE_PROBE4(libevent, name, a, b, c, d)
+#define EV_PROBE5(name, a, b, c, d, e)				\
+	DTRACE_PROBE5(libevent, name, a, b, c, d, e)
+#else
+#define EV_PROBE2(name, a, b) _EVUTIL_NIL_STMT
+#define EV_PROBE3(name, a, b, c) _EVUTIL_NIL_STMT
+#define EV_PROBE4(name, a, b, c, d) _EVUTIL_NIL_STMT
+#define EV_PROBE5(name, a, b, c, d, e) _EVUTIL_NIL_STMT
+#endif
+
+#endif /* _PROBES_INTERNAL_H_ */
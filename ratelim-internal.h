@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RATELIM_INTERNAL_H_
+#define _RATELIM_INTERNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "event2/util.h"
+
+/** A token bucket: how many bytes we may still read and write.  A bucket
+ * can go negative if we let a single operation take more than it held;
+ * then it has to refill past zero before anything happens again. */
+struct ev_token_bucket {
+	ev_ssize_t read_limit;
+	ev_ssize_t write_limit;
+	/** The tick at which we last refilled this bucket. */
+	ev_uint32_t last_updated;
+};
+
+/** How fast token buckets refill, and how full they may get; see
+ * ev_token_bucket_cfg_new(). */
+struct ev_token_bucket_cfg {
+	size_t read_rate;
+	size_t read_maximum;
+	size_t write_rate;
+	size_t write_maximum;
+	/** How long one tick lasts. */
+	struct timeval tick_timeout;
+	/** tick_timeout in milliseconds, at least 1. */
+	unsigned msec_per_tick;
+};
+
+/** Fill bucket to the maximum, and mark it as refilled at current_tick
+ * (if reinitialize is true), or only clip it to the maximum (if not). */
+void ev_token_bucket_init(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, ev_uint32_t current_tick,
+    int reinitialize);
+
+/** Add the tokens for every tick since bucket was last refilled.  Returns
+ * 1 if anything changed, 0 if no tick has passed. */
+int ev_token_bucket_update(struct ev_token_bucket *bucket,
+    const struct ev_token_bucket_cfg *cfg, ev_uint32_t current_tick);
+
+/** Return the tick that the time tv falls in. */
+ev_uint32_t ev_token_bucket_get_tick(const struct timeval *tv,
+    const struct ev_token_bucket_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RATELIM_INTERNAL_H_ */
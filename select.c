@@ -90,11 +90,13 @@ static void *
 select_init(struct event_base *base)
 {
 	struct selectop *sop;
+	int n;
 
 	if (!(sop = mm_calloc(1, sizeof(struct selectop))))
 		return (NULL);
 
-	select_resize(sop, howmany(32 + 1, NFDBITS)*sizeof(fd_mask));
+	n = base->size_hint_fds > 32 ? base->size_hint_fds : 32;
+	select_resize(sop, howmany(n + 1, NFDBITS)*sizeof(fd_mask));
 
 	evsig_init(base);
 
@@ -55,6 +55,9 @@
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef _EVENT_HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 #include <assert.h>
 
 #include "event2/event.h"
@@ -82,6 +85,21 @@ struct event_base *evsig_base = NULL;
 
 static void evsig_handler(int sig);
 
+#ifdef EVSIG_USE_SIGNALFD
+static int evsig_signalfd_add(struct event_base *, int, short, short, void *);
+static int evsig_signalfd_del(struct event_base *, int, short, short, void *);
+
+static const struct eventop evsig_signalfd_ops = {
+	"signalfd",
+	NULL,
+	evsig_signalfd_add,
+	evsig_signalfd_del,
+	NULL,
+	NULL,
+	0, 0, 0
+};
+#endif
+
 /* Callback for when the signal handler write a byte to our signaling socket */
 static void
 evsig_cb(evutil_socket_t fd, short what, void *arg)
@@ -105,9 +123,85 @@ evsig_cb(evutil_socket_t fd, short what, void *arg)
 #define FD_CLOSEONEXEC(x)
 #endif
 
+#ifdef EVSIG_USE_SIGNALFD
+/* Callback for when the signalfd has signals for us to read. */
+static void
+evsig_signalfd_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	struct signalfd_siginfo info[16];
+	ev_ssize_t n;
+	int i;
+
+	for (;;) {
+		n = read(fd, info, sizeof(info));
+		if (n <= 0) {
+			if (n == -1 && errno != EAGAIN && errno != EINTR)
+				event_warn("%s: read", __func__);
+			return;
+		}
+		for (i = 0; i < (int)(n / sizeof(info[0])); ++i) {
+			int signo = (int)info[i].ssi_signo;
+			if (signo > 0 && signo < NSIG)
+				evmap_signal_active(base, signo, 1);
+		}
+		if (n < (ev_ssize_t)sizeof(info))
+			return;
+	}
+}
+
+/* Try to set up base to read signals from a signalfd.  Returns 0 on
+ * success, or -1 if we should use a signal handler instead. */
+static int
+evsig_init_signalfd(struct event_base *base)
+{
+	struct evsig_info *sig = &base->sig;
+	int fd;
+
+	sigemptyset(&sig->signalfd_mask);
+	sigemptyset(&sig->signalfd_preblocked);
+
+	/* Start out watching no signals; evsig_signalfd_add() adds them. */
+	fd = signalfd(-1, &sig->signalfd_mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (fd < 0) {
+		/* EINVAL and ENOSYS mean that the kernel is too old for
+		 * signalfd or its flags. */
+		if (errno != EINVAL && errno != ENOSYS)
+			event_warn("signalfd");
+		return (-1);
+	}
+
+	sig->ev_signal_pair[0] = -1;
+	sig->ev_signal_pair[1] = fd;
+	sig->use_signalfd = 1;
+	sig->sh_old = NULL;
+	sig->sh_old_max = 0;
+	sig->evsig_caught = 0;
+	memset(&sig->evsigcaught, 0, sizeof(sig_atomic_t)*NSIG);
+
+	event_assign(&sig->ev_signal, base, fd, EV_READ | EV_PERSIST,
+	    evsig_signalfd_cb, base);
+	sig->ev_signal.ev_flags |= EVLIST_INTERNAL;
+
+	base->evsigsel = &evsig_signalfd_ops;
+	base->evsigbase = sig;
+
+	return (0);
+}
+#endif
+
 int
 evsig_init(struct event_base *base)
 {
+#ifdef EVSIG_USE_SIGNALFD
+	base->sig.use_signalfd = 0;
+	if (((base->flags & EVENT_BASE_FLAG_SIGNALFD) != 0 ||
+		((base->flags & EVENT_BASE_FLAG_IGNORE_ENV) == 0 &&
+		    getenv("EVENT_USE_SIGNALFD") != NULL)) &&
+	    evsig_init_signalfd(base) == 0)
+		return 0;
+#endif
+
 	/*
 	 * Our signal handler is going to write to one end of the socket
 	 * pair to wake up our event loop.  The event loop then scans for
@@ -235,6 +329,95 @@ evsig_add(struct event_base *base, int evsignal, short old, short events, void *
 	return (0);
 }
 
+#ifdef EVSIG_USE_SIGNALFD
+static int
+evsig_signalfd_add(struct event_base *base, int evsignal, short old,
+    short events, void *p)
+{
+	struct evsig_info *sig = &base->sig;
+	sigset_t mask, oldmask;
+	(void)p;
+
+	assert(evsignal >= 0 && evsignal < NSIG);
+
+	event_debug(("%s: %d: blocking signal", __func__, evsignal));
+	sigemptyset(&mask);
+	sigaddset(&mask, evsignal);
+	if (sigprocmask(SIG_BLOCK, &mask, &oldmask) == -1) {
+		event_warn("sigprocmask");
+		return (-1);
+	}
+	if (sigismember(&oldmask, evsignal))
+		sigaddset(&sig->signalfd_preblocked, evsignal);
+
+	sigaddset(&sig->signalfd_mask, evsignal);
+	if (signalfd(sig->ev_signal_pair[1], &sig->signalfd_mask, 0) == -1) {
+		event_warn("signalfd");
+		sigdelset(&sig->signalfd_mask, evsignal);
+		if (!sigismember(&sig->signalfd_preblocked, evsignal))
+			sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		sigdelset(&sig->signalfd_preblocked, evsignal);
+		return (-1);
+	}
+
+	if (!sig->ev_signal_added) {
+		if (event_add(&sig->ev_signal, NULL))
+			return (-1);
+		sig->ev_signal_added = 1;
+	}
+
+	return (0);
+}
+
+/* Stop watching evsignal, and unblock it unless it was blocked before.
+ * If update_fd is false, leave the signalfd's own mask alone: we are
+ * about to close it, and after a fork our parent shares it with us. */
+static int
+evsig_signalfd_restore(struct event_base *base, int evsignal, int update_fd)
+{
+	struct evsig_info *sig = &base->sig;
+	sigset_t mask;
+	int ret = 0;
+
+	sigdelset(&sig->signalfd_mask, evsignal);
+	if (update_fd &&
+	    signalfd(sig->ev_signal_pair[1], &sig->signalfd_mask, 0) == -1) {
+		event_warn("signalfd");
+		ret = -1;
+	}
+
+	if (sigismember(&sig->signalfd_preblocked, evsignal)) {
+		sigdelset(&sig->signalfd_preblocked, evsignal);
+	} else {
+		struct timespec zero = { 0, 0 };
+		sigemptyset(&mask);
+		sigaddset(&mask, evsignal);
+		/* Throw away any instance that arrived since we last read the
+		 * signalfd; otherwise unblocking would deliver it with the
+		 * default action, which usually kills the process. */
+		while (sigtimedwait(&mask, NULL, &zero) > 0)
+			;
+		if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1) {
+			event_warn("sigprocmask");
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+static int
+evsig_signalfd_del(struct event_base *base, int evsignal, short old,
+    short events, void *p)
+{
+	assert(evsignal >= 0 && evsignal < NSIG);
+
+	event_debug(("%s: %d: unblocking signal", __func__, evsignal));
+
+	return (evsig_signalfd_restore(base, evsignal, 1));
+}
+#endif
+
 int
 _evsig_restore_handler(struct event_base *base, int evsignal)
 {
@@ -332,6 +515,18 @@ evsig_dealloc(struct event_base *base)
 		event_del(&base->sig.ev_signal);
 		base->sig.ev_signal_added = 0;
 	}
+#ifdef EVSIG_USE_SIGNALFD
+	if (base->sig.use_signalfd) {
+		for (i = 1; i < NSIG; ++i) {
+			if (sigismember(&base->sig.signalfd_mask, i))
+				evsig_signalfd_restore(base, i, 0);
+		}
+		close(base->sig.ev_signal_pair[1]);
+		base->sig.ev_signal_pair[1] = -1;
+		base->sig.use_signalfd = 0;
+		return;
+	}
+#endif
 	for (i = 0; i < NSIG; ++i) {
 		if (i < base->sig.sh_old_max && base->sig.sh_old[i] != NULL)
 			_evsig_restore_handler(base, i);
@@ -33,6 +33,25 @@
  *
  */
 
+/*
+ * Run the same workloads on every backend this build supports, and print
+ * what each took as JSON, so that runs from different releases can be
+ * compared by a script.
+ *
+ * The scenarios are:
+ *
+ *   idle     -n socketpairs, all watched, with -w writes passed along a
+ *            chain started on -a of them; most fds stay idle.
+ *   active   the same chain, but started on every socketpair.
+ *   timers   -t timers at zero timeout; each one that fires re-adds itself
+ *            and pushes another out to a far timeout, until -w * 10 fire.
+ *   xthread  -w round trips of event_active() between two threads, each
+ *            running its own base.
+ *
+ * Each scenario runs -r times on each backend.  -m and -s restrict the run
+ * to one method or scenario.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "event-config.h"
 #endif
@@ -47,6 +66,9 @@
 #include <signal.h>
 #include <sys/resource.h>
 #endif
+#ifdef _EVENT_HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -54,69 +76,297 @@
 #include <unistd.h>
 #include <errno.h>
 
-#include <event.h>
-#include <evutil.h>
+#include <event2/event.h>
+#include <event2/event_struct.h>
+#include <event2/util.h>
+#ifdef _EVENT_HAVE_PTHREADS
+#include <event2/thread.h>
+#endif
 
 static int count, writes, fired;
-static int *pipes;
-static int num_pipes, num_active, num_writes;
+static evutil_socket_t *pipes;
+static int num_pipes, num_active, num_writes, num_timers, num_rounds;
 static struct event *events;
 
-
-
 static void
-read_cb(int fd, short which, void *arg)
+read_cb(evutil_socket_t fd, short which, void *arg)
 {
 	long idx = (long) arg, widx = idx + 1;
 	u_char ch;
 
-	count += read(fd, &ch, sizeof(ch));
+	count += recv(fd, (void *)&ch, sizeof(ch), 0);
 	if (writes) {
 		if (widx >= num_pipes)
 			widx -= num_pipes;
-		write(pipes[2 * widx + 1], "e", 1);
+		send(pipes[2 * widx + 1], "e", 1, 0);
 		writes--;
 		fired++;
 	}
 }
 
-static struct timeval *
-run_once(void)
+/* Pass num_writes writes along the chain of socketpairs, starting on
+ * n_active of them; return how long it took in usec. */
+static long
+run_chain(struct event_base *base, int n_active)
 {
-	int *cp, space;
+	evutil_socket_t *cp;
+	int space;
 	long i;
-	static struct timeval ts, te;
+	struct timeval ts, te;
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
-		event_del(&events[i]);
-		event_set(&events[i], cp[0], EV_READ | EV_PERSIST, read_cb, (void *) i);
+		event_assign(&events[i], base, cp[0], EV_READ | EV_PERSIST,
+		    read_cb, (void *) i);
 		event_add(&events[i], NULL);
 	}
 
-	event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
 
 	fired = 0;
-	space = num_pipes / num_active;
+	space = num_pipes / n_active;
 	space = space * 2;
-	for (i = 0; i < num_active; i++, fired++)
-		write(pipes[i * space + 1], "e", 1);
+	for (i = 0; i < n_active; i++, fired++)
+		send(pipes[i * space + 1], "e", 1, 0);
 
 	count = 0;
 	writes = num_writes;
-	{ int xcount = 0;
-	gettimeofday(&ts, NULL);
+	evutil_gettimeofday(&ts, NULL);
 	do {
-		event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
-		xcount++;
+		event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
 	} while (count != fired);
-	gettimeofday(&te, NULL);
+	evutil_gettimeofday(&te, NULL);
+
+	for (i = 0; i < num_pipes; i++)
+		event_del(&events[i]);
+
+	evutil_timersub(&te, &ts, &te);
+	return te.tv_sec * 1000000L + te.tv_usec;
+}
+
+static long
+run_idle(struct event_base *base)
+{
+	return run_chain(base, num_active);
+}
+
+static long
+run_active(struct event_base *base)
+{
+	return run_chain(base, num_pipes);
+}
+
+static struct event *timers;
+static int timers_fired, timers_target;
 
-	if (xcount != count) fprintf(stderr, "Xcount: %d, Rcount: %d\n", xcount, count);
+static void
+timer_cb(evutil_socket_t fd, short which, void *arg)
+{
+	static const struct timeval zero = { 0, 0 };
+	struct timeval far;
+	long idx = (long) arg;
+	int other;
+
+	if (++timers_fired >= timers_target)
+		return;
+	other = (int)((idx * 7 + timers_fired) % num_timers);
+	if (other != idx) {
+		far.tv_sec = 100 + timers_fired % 1000;
+		far.tv_usec = timers_fired % 1000000;
+		event_add(&timers[other], &far);
 	}
+	event_add(&timers[idx], &zero);
+}
+
+static long
+run_timers(struct event_base *base)
+{
+	struct timeval zero = { 0, 0 }, ts, te;
+	long i;
+
+	for (i = 0; i < num_timers; i++) {
+		evtimer_assign(&timers[i], base, timer_cb, (void *) i);
+		event_add(&timers[i], &zero);
+	}
+
+	timers_fired = 0;
+	timers_target = num_writes * 10;
+	evutil_gettimeofday(&ts, NULL);
+	while (timers_fired < timers_target)
+		event_base_loop(base, EVLOOP_ONCE);
+	evutil_gettimeofday(&te, NULL);
+
+	for (i = 0; i < num_timers; i++)
+		event_del(&timers[i]);
 
 	evutil_timersub(&te, &ts, &te);
+	return te.tv_sec * 1000000L + te.tv_usec;
+}
 
-	return (&te);
+#ifdef _EVENT_HAVE_PTHREADS
+struct xthread_pair {
+	struct event_base *main_base, *thread_base;
+	struct event ping, pong;
+	int trips;
+};
+
+static void
+ping_cb(evutil_socket_t fd, short which, void *arg)
+{
+	struct xthread_pair *p = arg;
+
+	if (++p->trips >= num_writes) {
+		event_base_loopbreak(p->thread_base);
+		event_base_loopbreak(p->main_base);
+	} else {
+		event_active(&p->pong, EV_READ, 1);
+	}
+}
+
+static void
+pong_cb(evutil_socket_t fd, short which, void *arg)
+{
+	struct xthread_pair *p = arg;
+
+	event_active(&p->ping, EV_READ, 1);
+}
+
+static void *
+xthread_loop(void *arg)
+{
+	event_base_dispatch(arg);
+	return NULL;
+}
+
+static long
+run_xthread(struct event_base *base, struct event_base *thread_base)
+{
+	struct xthread_pair p;
+	struct event keep_main, keep_thread;
+	struct timeval forever = { 3600, 0 }, ts, te;
+	pthread_t thread;
+
+	memset(&p, 0, sizeof(p));
+	p.main_base = base;
+	p.thread_base = thread_base;
+	event_assign(&p.ping, base, -1, 0, ping_cb, &p);
+	event_assign(&p.pong, thread_base, -1, 0, pong_cb, &p);
+	/* Give each loop something to wait for, so it doesn't exit early. */
+	evtimer_assign(&keep_main, base, ping_cb, &p);
+	evtimer_assign(&keep_thread, thread_base, pong_cb, &p);
+	event_add(&keep_main, &forever);
+	event_add(&keep_thread, &forever);
+
+	if (pthread_create(&thread, NULL, xthread_loop, thread_base)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	evutil_gettimeofday(&ts, NULL);
+	event_active(&p.pong, EV_READ, 1);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&te, NULL);
+	pthread_join(thread, NULL);
+
+	event_del(&keep_main);
+	event_del(&keep_thread);
+
+	evutil_timersub(&te, &ts, &te);
+	return te.tv_sec * 1000000L + te.tv_usec;
+}
+#endif
+
+/* event_get_supported_methods() frees what it returned last time, so we
+ * only call it once. */
+static const char **methods;
+
+static struct event_base *
+base_for_method(const char *method)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	int i;
+
+	if ((cfg = event_config_new()) == NULL)
+		return NULL;
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_IGNORE_ENV);
+	for (i = 0; methods[i] != NULL; ++i) {
+		if (strcmp(methods[i], method))
+			event_config_avoid_method(cfg, methods[i]);
+	}
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (base && strcmp(event_base_get_method(base), method)) {
+		event_base_free(base);
+		base = NULL;
+	}
+	return base;
+}
+
+static int
+cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+enum scenario { SC_IDLE, SC_ACTIVE, SC_TIMERS, SC_XTHREAD };
+static const char *scenario_names[] = { "idle", "active", "timers", "xthread" };
+#define N_SCENARIOS 4
+
+static int n_results;
+
+/* Run one scenario on one method num_rounds times, and print a JSON
+ * object describing how long it took. */
+static void
+bench_method(enum scenario sc, const char *method)
+{
+	struct event_base *base, *thread_base = NULL;
+	long *usec, total = 0;
+	int i;
+
+	if ((base = base_for_method(method)) == NULL)
+		return;
+	if (sc == SC_XTHREAD && (thread_base = base_for_method(method)) == NULL) {
+		event_base_free(base);
+		return;
+	}
+	if ((usec = calloc(num_rounds, sizeof(long))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < num_rounds; i++) {
+		switch (sc) {
+		case SC_IDLE:
+			usec[i] = run_idle(base);
+			break;
+		case SC_ACTIVE:
+			usec[i] = run_active(base);
+			break;
+		case SC_TIMERS:
+			usec[i] = run_timers(base);
+			break;
+		case SC_XTHREAD:
+#ifdef _EVENT_HAVE_PTHREADS
+			usec[i] = run_xthread(base, thread_base);
+#endif
+			break;
+		}
+		total += usec[i];
+	}
+	qsort(usec, num_rounds, sizeof(long), cmp_long);
+
+	printf("%s    { \"scenario\": \"%s\", \"method\": \"%s\", "
+	    "\"rounds\": %d,\n"
+	    "      \"min_usec\": %ld, \"median_usec\": %ld, "
+	    "\"mean_usec\": %ld, \"max_usec\": %ld }",
+	    n_results++ ? ",\n" : "", scenario_names[sc], method, num_rounds,
+	    usec[0], usec[num_rounds / 2], total / num_rounds,
+	    usec[num_rounds - 1]);
+
+	free(usec);
+	if (thread_base)
+		event_base_free(thread_base);
+	event_base_free(base);
 }
 
 int
@@ -125,9 +375,9 @@ main (int argc, char **argv)
 #ifndef WIN32
 	struct rlimit rl;
 #endif
-	int i, c;
-	struct timeval *tv;
-	int *cp;
+	int i, c, sc;
+	evutil_socket_t *cp;
+	const char *only_method = NULL, *only_scenario = NULL;
 
 #ifdef WIN32
 	WSADATA WSAData;
@@ -136,7 +386,9 @@ main (int argc, char **argv)
 	num_pipes = 100;
 	num_active = 1;
 	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+	num_timers = 1000;
+	num_rounds = 25;
+	while ((c = getopt(argc, argv, "n:a:w:t:r:m:s:")) != -1) {
 		switch (c) {
 		case 'n':
 			num_pipes = atoi(optarg);
@@ -147,47 +399,82 @@ main (int argc, char **argv)
 		case 'w':
 			num_writes = atoi(optarg);
 			break;
+		case 't':
+			num_timers = atoi(optarg);
+			break;
+		case 'r':
+			num_rounds = atoi(optarg);
+			break;
+		case 'm':
+			only_method = optarg;
+			break;
+		case 's':
+			only_scenario = optarg;
+			break;
 		default:
 			fprintf(stderr, "Illegal argument \"%c\"\n", c);
 			exit(1);
 		}
 	}
+	if (num_pipes < 1 || num_active < 1 || num_active > num_pipes ||
+	    num_writes < 1 || num_timers < 1 || num_rounds < 1) {
+		fprintf(stderr, "Counts must be positive, and -a at most -n\n");
+		exit(1);
+	}
 
 #ifndef WIN32
-	rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 50;
-	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
-		perror("setrlimit");
-		exit(1);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)(num_pipes * 2 + 50)) {
+		rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 50;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			perror("setrlimit");
+			exit(1);
+		}
 	}
 #endif
 
 	events = calloc(num_pipes, sizeof(struct event));
-	pipes = calloc(num_pipes * 2, sizeof(int));
-	if (events == NULL || pipes == NULL) {
+	pipes = calloc(num_pipes * 2, sizeof(evutil_socket_t));
+	timers = calloc(num_timers, sizeof(struct event));
+	if (events == NULL || pipes == NULL || timers == NULL) {
 		perror("malloc");
 		exit(1);
 	}
 
-	event_init();
-
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
-#ifdef USE_PIPES
-		if (pipe(cp) == -1) {
-#else
 		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, cp) == -1) {
-#endif
-			perror("pipe");
+			perror("socketpair");
 			exit(1);
 		}
 	}
 
-	for (i = 0; i < 25; i++) {
-		tv = run_once();
-		if (tv == NULL)
-			exit(1);
-		fprintf(stdout, "%ld\n",
-			tv->tv_sec * 1000000L + tv->tv_usec);
+	methods = event_get_supported_methods();
+	printf("{\n  \"version\": \"%s\",\n"
+	    "  \"fds\": %d, \"active\": %d, \"writes\": %d, \"timers\": %d,\n"
+	    "  \"results\": [\n",
+	    event_get_version(), num_pipes, num_active, num_writes,
+	    num_timers);
+
+	for (sc = 0; sc < N_SCENARIOS; sc++) {
+		if (only_scenario && strcmp(only_scenario, scenario_names[sc]))
+			continue;
+		if (sc == SC_XTHREAD) {
+#ifdef _EVENT_HAVE_PTHREADS
+			/* Locking slows everything down a little, so only
+			 * turn it on once the other scenarios are done. */
+			evthread_use_pthreads();
+#else
+			continue;
+#endif
+		}
+		for (i = 0; methods[i] != NULL; ++i) {
+			if (only_method && strcmp(only_method, methods[i]))
+				continue;
+			bench_method(sc, methods[i]);
+		}
 	}
 
+	printf("\n  ]\n}\n");
+
 	exit(0);
 }
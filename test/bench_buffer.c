@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for buffer.c.  Each case repeats one evbuffer operation
+ * -n times, -r times over, and reports the best run in nanoseconds and in
+ * calls to malloc() or realloc() per operation.  The allocation counts
+ * show what the chain cache and chain coalescing save; the times show the
+ * rest.  The buffers that get searched or read line by line have chains
+ * of -c bytes, so that matches straddle chains.
+ *
+ * With -s, only the cases whose names start with the given string run.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+static int num_ops = 100000;
+static int chain_len = 4000;
+static unsigned long n_allocs;
+static char data[65536];
+static evutil_socket_t pair[2];
+
+static void *
+counting_malloc(size_t sz)
+{
+	++n_allocs;
+	return malloc(sz);
+}
+
+static void *
+counting_realloc(void *p, size_t sz)
+{
+	++n_allocs;
+	return realloc(p, sz);
+}
+
+static void
+nil_cleanup(const void *data, size_t len, void *arg)
+{
+}
+
+static struct evbuffer *
+new_buffer(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	if (buf == NULL) {
+		perror("evbuffer_new");
+		exit(1);
+	}
+	return buf;
+}
+
+/* Append len bytes to buf in chains of chain_len bytes, with a CRLF-ended
+ * line every line_len bytes or so. */
+static void
+fill_chains(struct evbuffer *buf, size_t len, int line_len)
+{
+	struct evbuffer *chunk = new_buffer();
+	char *text;
+	size_t off, n;
+
+	if ((text = malloc(len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(text, 'x', len);
+	if (line_len) {
+		for (off = line_len; off < len; off += line_len) {
+			text[off - 1] = '\r';
+			text[off] = '\n';
+		}
+	}
+	for (off = 0; off < len; off += n) {
+		n = len - off < (size_t)chain_len ? len - off : (size_t)chain_len;
+		/* adding a whole buffer moves its chains over as they are */
+		evbuffer_add(chunk, text + off, n);
+		evbuffer_add_buffer(buf, chunk);
+	}
+	evbuffer_free(chunk);
+	free(text);
+}
+
+/* Add size bytes at a time, emptying the buffer whenever it passes 1MB,
+ * the way a proxy's output buffer fills and gets written out. */
+static void
+run_add(int size)
+{
+	struct evbuffer *buf = new_buffer();
+	int i;
+
+	for (i = 0; i < num_ops; ++i) {
+		evbuffer_add(buf, data, size);
+		if (evbuffer_get_length(buf) > 1024*1024)
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+	}
+	evbuffer_free(buf);
+}
+
+static void run_add_16(void) { run_add(16); }
+static void run_add_256(void) { run_add(256); }
+static void run_add_4096(void) { run_add(4096); }
+static void run_add_65536(void) { run_add(65536); }
+
+/* Add a read's worth and drain it again: the chain should be reused. */
+static void
+run_add_drain(void)
+{
+	struct evbuffer *buf = new_buffer();
+	int i;
+
+	for (i = 0; i < num_ops; ++i) {
+		evbuffer_add(buf, data, 4096);
+		evbuffer_drain(buf, 4096);
+	}
+	evbuffer_free(buf);
+}
+
+/* Drain 512 bytes at a time from a buffer made of many chains. */
+static void
+run_drain(void)
+{
+	struct evbuffer *buf = new_buffer();
+	int i;
+
+	fill_chains(buf, 512, 0);
+	for (i = 0; i < num_ops; ++i) {
+		if (evbuffer_get_length(buf) < 512)
+			fill_chains(buf, (size_t)chain_len * 64, 0);
+		evbuffer_drain(buf, 512);
+	}
+	evbuffer_free(buf);
+}
+
+/* Move 1000 bytes at a time between buffers, which splits chains. */
+static void
+run_remove_buffer(void)
+{
+	struct evbuffer *src = new_buffer(), *dst = new_buffer();
+	int i;
+
+	for (i = 0; i < num_ops; ++i) {
+		if (evbuffer_get_length(src) < 1000)
+			fill_chains(src, (size_t)chain_len * 64, 0);
+		evbuffer_remove_buffer(src, dst, 1000);
+		if (evbuffer_get_length(dst) > 64*1024)
+			evbuffer_drain(dst, evbuffer_get_length(dst));
+	}
+	evbuffer_free(src);
+	evbuffer_free(dst);
+}
+
+/* Make 4KB contiguous out of 16 chains of 256 bytes. */
+static void
+run_pullup(void)
+{
+	struct evbuffer *buf = new_buffer();
+	int i, j;
+
+	for (i = 0; i < num_ops; ++i) {
+		for (j = 0; j < 16; ++j)
+			evbuffer_add_reference(buf, data + j * 256, 256,
+			    nil_cleanup, NULL);
+		if (evbuffer_pullup(buf, 4096) == NULL) {
+			fprintf(stderr, "pullup failed\n");
+			exit(1);
+		}
+		evbuffer_drain(buf, 4096);
+	}
+	evbuffer_free(buf);
+}
+
+/* Look for a string at the end of 64KB of chains. */
+static void
+run_search(void)
+{
+	static const char needle[] = "Content-Length:";
+	struct evbuffer *buf = new_buffer();
+	struct evbuffer_ptr pos;
+	int i;
+
+	fill_chains(buf, 64*1024, 0);
+	evbuffer_add(buf, needle, sizeof(needle) - 1);
+	for (i = 0; i < num_ops / 100; ++i) {
+		pos = evbuffer_search(buf, needle, sizeof(needle) - 1, NULL);
+		if (pos.pos != 64*1024) {
+			fprintf(stderr, "search failed\n");
+			exit(1);
+		}
+	}
+	evbuffer_free(buf);
+}
+
+/* Read 100-byte lines from chains, refilling by reference. */
+static void
+run_readln(void)
+{
+	struct evbuffer *lines = new_buffer(), *buf = new_buffer();
+	char *line;
+	size_t len;
+	int i;
+
+	fill_chains(lines, (size_t)chain_len * 64, 100);
+	for (i = 0; i < num_ops; ++i) {
+		if ((line = evbuffer_readln(buf, &len,
+			    EVBUFFER_EOL_CRLF_STRICT)) == NULL) {
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+			evbuffer_add_buffer_reference(buf, lines);
+			line = evbuffer_readln(buf, &len,
+			    EVBUFFER_EOL_CRLF_STRICT);
+		}
+		free(line);
+	}
+	evbuffer_free(buf);
+	evbuffer_free(lines);
+}
+
+/* Write size bytes into a socketpair and read them out the other end. */
+static void
+run_write_read(int size)
+{
+	struct evbuffer *out = new_buffer(), *in = new_buffer();
+	int i, n;
+
+	for (i = 0; i < num_ops; ++i) {
+		evbuffer_add(out, data, size);
+		while (evbuffer_get_length(out)) {
+			if (evbuffer_write(out, pair[0]) < 0) {
+				perror("evbuffer_write");
+				exit(1);
+			}
+		}
+		for (n = 0; n < size; ) {
+			int r = evbuffer_read(in, pair[1], size - n);
+			if (r <= 0) {
+				perror("evbuffer_read");
+				exit(1);
+			}
+			n += r;
+		}
+		evbuffer_drain(in, size);
+	}
+	evbuffer_free(out);
+	evbuffer_free(in);
+}
+
+static void run_write_read_256(void) { run_write_read(256); }
+static void run_write_read_16384(void) { run_write_read(16384); }
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+	/* How many operations a run does, as a fraction of num_ops. */
+	int divisor;
+} cases[] = {
+	{ "add_16", run_add_16, 1 },
+	{ "add_256", run_add_256, 1 },
+	{ "add_4096", run_add_4096, 1 },
+	{ "add_65536", run_add_65536, 1 },
+	{ "add_drain_4096", run_add_drain, 1 },
+	{ "drain_512", run_drain, 1 },
+	{ "remove_buffer_1000", run_remove_buffer, 1 },
+	{ "pullup_16x256", run_pullup, 1 },
+	{ "search_64k", run_search, 100 },
+	{ "readln_100", run_readln, 1 },
+	{ "write_read_256", run_write_read_256, 1 },
+	{ "write_read_16384", run_write_read_16384, 1 },
+	{ NULL, NULL, 0 }
+};
+
+int
+main(int argc, char **argv)
+{
+	struct timeval start, end;
+	const char *only = NULL;
+	int i, run, c, num_runs = 3;
+	double best_ns, allocs;
+
+	while ((c = getopt(argc, argv, "n:c:r:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_ops = atoi(optarg);
+			break;
+		case 'c':
+			chain_len = atoi(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		case 's':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_ops < 100 || chain_len < 1 || num_runs < 1) {
+		fprintf(stderr, "Need at least 100 operations, one byte per "
+		    "chain and one run\n");
+		exit(1);
+	}
+
+	event_set_mem_functions(counting_malloc, counting_realloc, free);
+	evbuffer_set_chain_cache_limit(256*1024);
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		perror("socketpair");
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	fprintf(stdout, "%-20s %12s %12s\n", "case", "ns/op", "allocs/op");
+	for (i = 0; cases[i].name; ++i) {
+		int n = num_ops / cases[i].divisor;
+		if (only && strncmp(cases[i].name, only, strlen(only)))
+			continue;
+		best_ns = -1;
+		allocs = 0;
+		for (run = 0; run < num_runs; ++run) {
+			double ns;
+			/* Start each run from an empty chain cache, so
+			 * that every run pays for filling it. */
+			evbuffer_trim_chain_cache(0);
+			n_allocs = 0;
+			evutil_gettimeofday(&start, NULL);
+			cases[i].run();
+			evutil_gettimeofday(&end, NULL);
+			evutil_timersub(&end, &start, &end);
+			ns = (end.tv_sec * 1e9 + end.tv_usec * 1e3) / n;
+			if (best_ns < 0 || ns < best_ns) {
+				best_ns = ns;
+				allocs = (double)n_allocs / n;
+			}
+		}
+		fprintf(stdout, "%-20s %12.1f %12.3f\n", cases[i].name,
+		    best_ns, allocs);
+	}
+
+	EVUTIL_CLOSESOCKET(pair[0]);
+	EVUTIL_CLOSESOCKET(pair[1]);
+	exit(0);
+}
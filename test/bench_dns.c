@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This benchmark measures the evdns resolver against nameservers that run
+ * in the same process, on the same event_base, as evdns_server_ports on
+ * loopback.  For each nameserver configuration it launches lookups at -q
+ * per second for -d seconds, -a percent of them for AAAA records and -x
+ * percent for names that do not exist, and then reports the rate it got,
+ * the spread of lookup latencies, how the lookups ended, and how many
+ * queries were retransmitted.
+ *
+ * Every lookup asks for a name of its own, so that no two lookups share a
+ * query; a nameserver that sees a name for the second time is looking at
+ * a retransmit.  -c runs only the named configuration.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/util.h>
+
+/* How one nameserver behaves. */
+struct server_conf {
+	int loss_pct;  /* how many queries in a hundred it ignores */
+	int delay_msec;  /* how long it takes to answer the rest */
+};
+
+struct bench_conf {
+	const char *name;
+	const char *desc;
+	int n_servers;
+	struct server_conf servers[3];
+};
+
+static const struct bench_conf confs[] = {
+	{ "one", "one quick nameserver", 1, { { 0, 0 } } },
+	{ "two", "two quick nameservers", 2, { { 0, 0 }, { 0, 0 } } },
+	{ "lossy", "a quick nameserver and a slow one that drops 20% of "
+	  "queries", 2, { { 0, 0 }, { 20, 50 } } },
+	{ "slow", "one slow nameserver that drops 5% of queries", 1,
+	  { { 5, 20 } } },
+};
+
+struct server {
+	const struct server_conf *conf;
+	evutil_socket_t sock;
+	struct evdns_server_port *port;
+	char addr[32];
+};
+
+/* One lookup in flight. */
+struct lookup {
+	struct timeval started;
+};
+
+static struct event_base *base;
+static struct evdns_base *dns;
+
+static int target_qps = 2000;
+static int duration = 5;
+static int aaaa_pct = 20;
+static int nxdomain_pct = 10;
+
+static struct timeval started;
+static struct event *launch_ev;
+static int done_launching;
+static long launch_usec;  /* how long launching took */
+static long n_launched, n_outstanding;
+static long n_answers, n_nxdomain, n_timeouts, n_errors;
+
+/* Latencies of finished lookups, in usec. */
+static long *latencies;
+static long n_latencies, latencies_alloc;
+
+/* How often the nameservers saw the name of each lookup. */
+static unsigned char *seen;
+static long seen_alloc;
+static long n_queries, n_retransmits;
+/* Answers the nameservers have yet to send. */
+static long n_delayed;
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+static void
+note_seen(long serial)
+{
+	if (serial >= seen_alloc) {
+		long n = seen_alloc ? seen_alloc : 4096;
+		while (n <= serial)
+			n *= 2;
+		if (!(seen = realloc(seen, n))) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(seen + seen_alloc, 0, n - seen_alloc);
+		seen_alloc = n;
+	}
+	++n_queries;
+	if (seen[serial]++)
+		++n_retransmits;
+}
+
+static void
+answer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	struct evdns_server_question *q = req->questions[0];
+	const char *kind = strchr(q->name, '.');
+	int err = 0;
+
+	--n_delayed;
+	/* Names are q<serial>.a.example or q<serial>.x.example, in any
+	 * case; the x ones do not exist. */
+	if (!kind || (kind[1] | 0x20) == 'x')
+		err = 3;
+	else if (q->type == EVDNS_TYPE_A) {
+		ev_uint32_t a = htonl(0x0a000001UL);
+		evdns_server_request_add_a_reply(req, q->name, 1, &a, 300);
+	} else if (q->type == EVDNS_TYPE_AAAA) {
+		unsigned char a[16];
+		memset(a, 0, sizeof(a));
+		a[0] = 0x20;
+		a[1] = 0x01;
+		a[15] = 1;
+		evdns_server_request_add_aaaa_reply(req, q->name, 1, a, 300);
+	}
+	evdns_server_request_respond(req, err);
+}
+
+static void
+server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct server *s = arg;
+
+	if (req->nquestions != 1) {
+		evdns_server_request_respond(req, 1);
+		return;
+	}
+	note_seen(atol(req->questions[0]->name + 1));
+	if (s->conf->loss_pct && rand() % 100 < s->conf->loss_pct) {
+		evdns_server_request_drop(req);
+	} else if (s->conf->delay_msec) {
+		struct timeval tv;
+		tv.tv_sec = s->conf->delay_msec / 1000;
+		tv.tv_usec = (s->conf->delay_msec % 1000) * 1000;
+		++n_delayed;
+		event_base_once(base, -1, EV_TIMEOUT, answer_cb, req, &tv);
+	} else {
+		++n_delayed;
+		answer_cb(-1, 0, req);
+	}
+}
+
+static int
+server_start(struct server *s, const struct server_conf *conf)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	s->conf = conf;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	if ((s->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -1;
+	evutil_make_socket_nonblocking(s->sock);
+	if (bind(s->sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    getsockname(s->sock, (struct sockaddr *)&sin, &len) < 0)
+		return -1;
+	evutil_snprintf(s->addr, sizeof(s->addr), "127.0.0.1:%d",
+	    (int)ntohs(sin.sin_port));
+	s->port = evdns_add_server_port_with_base(base, s->sock, 0,
+	    server_cb, s);
+	return s->port ? 0 : -1;
+}
+
+/* The port closes the socket once it is done with it. */
+static void
+server_stop(struct server *s)
+{
+	evdns_close_server_port(s->port);
+}
+
+static void
+lookup_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct lookup *l = arg;
+
+	if (n_latencies == latencies_alloc) {
+		latencies_alloc = latencies_alloc ? latencies_alloc * 2 : 4096;
+		latencies = realloc(latencies,
+		    latencies_alloc * sizeof(long));
+		if (!latencies) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies[n_latencies++] = usec_since(&l->started);
+	free(l);
+
+	if (result == DNS_ERR_NONE)
+		++n_answers;
+	else if (result == DNS_ERR_NOTEXIST)
+		++n_nxdomain;
+	else if (result == DNS_ERR_TIMEOUT)
+		++n_timeouts;
+	else
+		++n_errors;
+
+	if (--n_outstanding == 0 && done_launching)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+launch_one(void)
+{
+	struct lookup *l = malloc(sizeof(*l));
+	char name[64];
+	int nx = rand() % 100 < nxdomain_pct;
+
+	if (!l) {
+		perror("malloc");
+		exit(1);
+	}
+	evutil_snprintf(name, sizeof(name), "q%ld.%s.example", n_launched,
+	    nx ? "x" : "a");
+	evutil_gettimeofday(&l->started, NULL);
+	++n_launched;
+	++n_outstanding;
+	if (rand() % 100 < aaaa_pct)
+		evdns_base_resolve_ipv6(dns, name, DNS_QUERY_NO_SEARCH,
+		    lookup_cb, l);
+	else
+		evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		    lookup_cb, l);
+}
+
+/* Launch however many lookups we owe to keep up with target_qps. */
+static void
+launch_cb(evutil_socket_t fd, short what, void *arg)
+{
+	long elapsed = usec_since(&started);
+	long want;
+
+	if (elapsed >= duration * 1000000L) {
+		event_del(launch_ev);
+		done_launching = 1;
+		launch_usec = elapsed;
+		if (n_outstanding == 0)
+			event_base_loopexit(base, NULL);
+		return;
+	}
+	want = (long)((double)target_qps * elapsed / 1000000.0) + 1;
+	while (n_launched < want)
+		launch_one();
+}
+
+static int
+compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static long
+percentile(double p)
+{
+	long i = (long)(p * (n_latencies - 1) / 100.0 + 0.5);
+	return latencies[i];
+}
+
+static void
+give_up_cb(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak(base);
+}
+
+static void
+run(const struct bench_conf *conf)
+{
+	struct server servers[3];
+	struct timeval tick = { 0, 5000 }, grace;
+	struct event *give_up_ev;
+	long usec;
+	int i;
+
+	n_launched = n_outstanding = n_latencies = 0;
+	n_answers = n_nxdomain = n_timeouts = n_errors = 0;
+	n_queries = n_retransmits = 0;
+	done_launching = 0;
+	launch_usec = 0;
+	if (seen)
+		memset(seen, 0, seen_alloc);
+
+	dns = evdns_base_new(base, 0);
+	evdns_base_set_option(dns, "timeout:", "2", DNS_OPTION_MISC);
+	evdns_base_set_option(dns, "max-inflight:", "4096", DNS_OPTION_MISC);
+	for (i = 0; i < conf->n_servers; ++i) {
+		if (server_start(&servers[i], &conf->servers[i]) < 0 ||
+		    evdns_base_nameserver_ip_add(dns, servers[i].addr)) {
+			perror("Can't start a nameserver");
+			exit(1);
+		}
+	}
+
+	launch_ev = event_new(base, -1, EV_PERSIST, launch_cb, NULL);
+	event_add(launch_ev, &tick);
+	/* Don't wait forever on lookups that never end. */
+	give_up_ev = evtimer_new(base, give_up_cb, NULL);
+	grace.tv_sec = duration + 30;
+	grace.tv_usec = 0;
+	evtimer_add(give_up_ev, &grace);
+
+	evutil_gettimeofday(&started, NULL);
+	event_base_dispatch(base);
+	usec = usec_since(&started);
+
+	event_free(launch_ev);
+	event_free(give_up_ev);
+	/* Whatever is still out now counts as an error. */
+	done_launching = 0;
+	evdns_base_free(dns, 1);
+	while (n_delayed)
+		event_base_loop(base, EVLOOP_ONCE);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	for (i = 0; i < conf->n_servers; ++i)
+		server_stop(&servers[i]);
+
+	printf("%s: %s\n", conf->name, conf->desc);
+	if (!launch_usec)
+		launch_usec = usec;
+	printf("  %ld lookups in %ld.%03ld sec: %.1f per sec "
+	    "(asked for %d)\n", n_launched, launch_usec / 1000000,
+	    (launch_usec / 1000) % 1000, n_launched * 1000000.0 / launch_usec,
+	    target_qps);
+	usec -= launch_usec;
+	printf("  the last of them ended %ld.%03ld sec later\n",
+	    usec / 1000000, (usec / 1000) % 1000);
+	if (n_latencies) {
+		qsort(latencies, n_latencies, sizeof(long), compare_long);
+		printf("  latency in usec: 50%% %ld, 90%% %ld, 99%% %ld, "
+		    "99.9%% %ld, max %ld\n", percentile(50), percentile(90),
+		    percentile(99), percentile(99.9),
+		    latencies[n_latencies - 1]);
+	}
+	printf("  %ld answered, %ld nonexistent, %ld timed out, "
+	    "%ld other errors\n", n_answers, n_nxdomain, n_timeouts,
+	    n_errors);
+	printf("  %ld queries reached a nameserver, %ld of them "
+	    "retransmits\n", n_queries, n_retransmits);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int c, ran = 0;
+	size_t i;
+
+	while ((c = getopt(argc, argv, "q:d:a:x:c:")) != -1) {
+		switch (c) {
+		case 'q':
+			target_qps = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'a':
+			aaaa_pct = atoi(optarg);
+			break;
+		case 'x':
+			nxdomain_pct = atoi(optarg);
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (target_qps < 1 || duration < 1) {
+		fprintf(stderr, "Need at least one lookup a second, for at "
+		    "least a second\n");
+		exit(1);
+	}
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	srand(1);
+	base = event_base_new();
+
+	for (i = 0; i < sizeof(confs)/sizeof(confs[0]); ++i) {
+		if (only && strcmp(only, confs[i].name))
+			continue;
+		run(&confs[i]);
+		++ran;
+	}
+	if (!ran) {
+		fprintf(stderr, "No configuration named \"%s\"\n", only);
+		exit(1);
+	}
+
+	event_base_free(base);
+	free(latencies);
+	free(seen);
+	exit(0);
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This benchmark measures the part of the dispatch path that turns a
+ * readiness report for an fd into active events: evmap_io_active().  It
+ * puts -e events on each of -n fds, then reports every fd ready in a
+ * random order, -r times, the way a backend would after a busy poll.
+ *
+ * We want far more fds than the process is likely to be allowed to open,
+ * so the fds are made up.  That works because the backends that keep a
+ * changelist (kqueue, and epoll when asked to) don't tell the kernel about
+ * new events until the next dispatch, and we never dispatch.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "event-internal.h"
+#include "evmap-internal.h"
+
+/* Start the made-up fds well past anything we really have open. */
+#define FIRST_FD 1000
+
+static void
+nil_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	struct event **events;
+	int *order;
+	int i, j, c;
+	int num_fds = 100000;
+	int num_per_fd = 1;
+	int num_runs = 20;
+
+	while ((c = getopt(argc, argv, "n:e:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_fds = atoi(optarg);
+			break;
+		case 'e':
+			num_per_fd = atoi(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_fds < 1 || num_per_fd < 1) {
+		fprintf(stderr, "Need at least one fd and one event per fd\n");
+		exit(1);
+	}
+
+	cfg = event_config_new();
+	event_config_require_features(cfg, EV_FEATURE_O1);
+	/* io_uring submits its polls as soon as its queue fills up. */
+	event_config_avoid_method(cfg, "io_uring");
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (base == NULL) {
+		fprintf(stderr, "No changelist-based backend available\n");
+		exit(1);
+	}
+
+	events = calloc(num_fds * num_per_fd, sizeof(struct event *));
+	order = calloc(num_fds, sizeof(int));
+	if (events == NULL || order == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < num_fds; ++i) {
+		for (j = 0; j < num_per_fd; ++j) {
+			struct event *ev = event_new(base, FIRST_FD + i,
+			    EV_READ|EV_PERSIST, nil_cb, NULL);
+			if (ev == NULL || event_add(ev, NULL) == -1) {
+				fprintf(stderr, "Couldn't add event %d\n", i);
+				exit(1);
+			}
+			events[i * num_per_fd + j] = ev;
+		}
+	}
+
+	/* report fds in a random order so that we don't just measure the
+	 * prefetcher */
+	for (i = 0; i < num_fds; ++i)
+		order[i] = i;
+	for (i = num_fds - 1; i > 0; --i) {
+		int k = rand() % (i + 1);
+		int tmp = order[i];
+		order[i] = order[k];
+		order[k] = tmp;
+	}
+
+	fprintf(stdout, "%s: %d fds, %d event(s) per fd\n",
+	    event_base_get_method(base), num_fds, num_per_fd);
+
+	for (i = 0; i < num_runs; ++i) {
+		struct timeval ts;
+		long t;
+		evutil_gettimeofday(&ts, NULL);
+		/* After the first run every event is already active, so the
+		 * later runs only pay for finding the events. */
+		for (j = 0; j < num_fds; ++j)
+			evmap_io_active(base, FIRST_FD + order[j], EV_READ);
+		t = usec_since(&ts);
+		fprintf(stdout, "run %2d: %8ld usec  %6.1f nsec/fd\n",
+		    i, t, t * 1000.0 / num_fds);
+	}
+
+	for (i = 0; i < num_fds * num_per_fd; ++i)
+		event_free(events[i]);
+	event_base_free(base);
+	free(order);
+	free(events);
+	exit(0);
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This benchmark measures how much memory an idle connection costs.  It
+ * opens -n loopback TCP connections, and then, for each way of handling
+ * them, sets up the server side of every connection one step at a time:
+ *
+ *   event        event_new(), event_add() for reading, then a timeout
+ *   bufferevent  bufferevent_socket_new(), enabling reading, then a read
+ *                timeout
+ *   filtered     the same, with a pass-through filtering bufferevent on
+ *                top
+ *   evhttp       evhttp_serve_socket() and one request answered with
+ *                keep-alive, after which the connection sits idle
+ *
+ * After each step it reports how many bytes per connection Libevent
+ * allocated, and the sizes of the blocks it allocated for them, so each
+ * structure (struct event, struct bufferevent_private, the evbuffers, the
+ * evmap entry for the fd, ...) can be seen.  Arrays that grow by
+ * reallocation, such as the fd table and the timer heap, show up as
+ * "arrays".  Finally it reports the growth of the resident set per
+ * connection, where the system lets us find that out; that can come out
+ * lower than what was allocated when memory freed by an earlier
+ * configuration gets reused.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/util.h>
+
+/* Every block we hand out is preceded by its size. */
+union alloc_hdr {
+	size_t size;
+	double _align_d;
+	void *_align_p;
+};
+
+static size_t live_bytes;
+
+/* Blocks allocated during the current step and not yet freed, by size.
+ * (Freeing a block from an earlier step can make a count too low.) */
+#define N_SIZES 64
+static struct {
+	size_t size;
+	long count;
+} sizes[N_SIZES];
+static long n_other_sizes;
+static size_t realloc_bytes;
+
+static void
+note_size(size_t size)
+{
+	int i;
+	for (i = 0; i < N_SIZES; ++i) {
+		if (sizes[i].size == size || (sizes[i].count == 0 &&
+			sizes[i].size == 0)) {
+			sizes[i].size = size;
+			++sizes[i].count;
+			return;
+		}
+	}
+	++n_other_sizes;
+}
+
+static void
+forget_size(size_t size)
+{
+	int i;
+	for (i = 0; i < N_SIZES && sizes[i].size; ++i) {
+		if (sizes[i].size == size && sizes[i].count) {
+			--sizes[i].count;
+			return;
+		}
+	}
+}
+
+static void *
+counting_malloc(size_t sz)
+{
+	union alloc_hdr *h = malloc(sizeof(*h) + sz);
+	if (h == NULL)
+		return NULL;
+	h->size = sz;
+	live_bytes += sz;
+	note_size(sz);
+	return h + 1;
+}
+
+static void *
+counting_realloc(void *p, size_t sz)
+{
+	union alloc_hdr *h = p ? (union alloc_hdr *)p - 1 : NULL;
+	size_t old = h ? h->size : 0;
+
+	if ((h = realloc(h, sizeof(*h) + sz)) == NULL)
+		return NULL;
+	h->size = sz;
+	live_bytes += sz - old;
+	if (sz > old)
+		realloc_bytes += sz - old;
+	return h + 1;
+}
+
+static void
+counting_free(void *p)
+{
+	union alloc_hdr *h;
+	if (p == NULL)
+		return;
+	h = (union alloc_hdr *)p - 1;
+	live_bytes -= h->size;
+	forget_size(h->size);
+	free(h);
+}
+
+static long
+resident_bytes(void)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident = -1;
+	if (f) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+			resident = -1;
+		fclose(f);
+	}
+	return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+#else
+	return -1;
+#endif
+}
+
+static int num_conns = 100000;
+static evutil_socket_t *clients, *servers;
+static size_t step_start, config_start;
+static long rss_start;
+
+static void
+begin_config(const char *name)
+{
+	fprintf(stdout, "%s (%d connections)\n", name, num_conns);
+	config_start = live_bytes;
+	rss_start = resident_bytes();
+}
+
+static void
+begin_step(void)
+{
+	memset(sizes, 0, sizeof(sizes));
+	n_other_sizes = 0;
+	realloc_bytes = 0;
+	step_start = live_bytes;
+}
+
+static void
+end_step(const char *what)
+{
+	char detail[256];
+	size_t off = 0;
+	int i;
+
+	detail[0] = '\0';
+	for (i = 0; i < N_SIZES && sizes[i].size; ++i) {
+		/* Only the blocks that most connections got. */
+		if (sizes[i].count * 2 < num_conns)
+			continue;
+		off += evutil_snprintf(detail + off, sizeof(detail) - off,
+		    "%s%.1f x %lu", off ? " + " : "",
+		    (double)sizes[i].count / num_conns,
+		    (unsigned long)sizes[i].size);
+		if (off >= sizeof(detail))
+			break;
+	}
+	if (realloc_bytes && off < sizeof(detail))
+		evutil_snprintf(detail + off, sizeof(detail) - off,
+		    "%sarrays %.1f", off ? " + " : "",
+		    (double)realloc_bytes / num_conns);
+	fprintf(stdout, "  %-36s %8.1f B/conn  %s\n", what,
+	    ((double)live_bytes - (double)step_start) / num_conns, detail);
+}
+
+static void
+end_config(void)
+{
+	long rss = resident_bytes();
+
+	fprintf(stdout, "  %-36s %8.1f B/conn\n", "total allocated",
+	    ((double)live_bytes - (double)config_start) / num_conns);
+	if (rss >= 0 && rss_start >= 0)
+		fprintf(stdout, "  %-36s %8.1f B/conn\n", "resident set growth",
+		    (double)(rss - rss_start) / num_conns);
+}
+
+static void
+nil_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static const struct timeval idle_timeout = { 60, 0 };
+
+static void
+run_events(void)
+{
+	struct event_base *base = event_base_new();
+	struct event **evs = calloc(num_conns, sizeof(struct event *));
+	int i;
+
+	if (!base || !evs) {
+		perror("setup");
+		exit(1);
+	}
+	begin_config("event");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		evs[i] = event_new(base, servers[i], EV_READ|EV_PERSIST,
+		    nil_cb, NULL);
+	end_step("event_new (struct event)");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		event_add(evs[i], NULL);
+	end_step("event_add (evmap entry, fd table)");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		event_add(evs[i], &idle_timeout);
+	end_step("timeout (timer heap slot)");
+
+	end_config();
+
+	for (i = 0; i < num_conns; ++i)
+		event_free(evs[i]);
+	free(evs);
+	event_base_free(base);
+}
+
+static void
+run_bufferevents(int filtered)
+{
+	struct event_base *base = event_base_new();
+	struct bufferevent **bevs = calloc(num_conns, sizeof(*bevs));
+	struct bufferevent **top = calloc(num_conns, sizeof(*top));
+	int i;
+
+	if (!base || !bevs || !top) {
+		perror("setup");
+		exit(1);
+	}
+	begin_config(filtered ? "filtered bufferevent" : "bufferevent");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		top[i] = bevs[i] = bufferevent_socket_new(base, servers[i], 0);
+	end_step("bufferevent_socket_new (+ evbuffers)");
+
+	if (filtered) {
+		begin_step();
+		for (i = 0; i < num_conns; ++i)
+			top[i] = bufferevent_filter_new(bevs[i], NULL, NULL,
+			    BEV_OPT_CLOSE_ON_FREE, NULL, NULL);
+		end_step("bufferevent_filter_new (+ evbuffers)");
+	}
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		bufferevent_enable(top[i], EV_READ);
+	end_step("enable reading (evmap entry, fd table)");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i)
+		bufferevent_set_timeouts(top[i], &idle_timeout, NULL);
+	end_step("read timeout (timer heap slot)");
+
+	end_config();
+
+	for (i = 0; i < num_conns; ++i)
+		bufferevent_free(top[i]);
+	free(bevs);
+	free(top);
+	event_base_free(base);
+}
+
+static int n_served;
+
+static void
+http_cb(struct evhttp_request *req, void *arg)
+{
+	++n_served;
+	evhttp_send_reply(req, 200, "OK", NULL);
+}
+
+/* This hands the server sockets to evhttp, which closes them when it's
+ * freed, so it must go last. */
+static void
+run_evhttp(void)
+{
+	static const char request[] = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+	struct event_base *base = event_base_new();
+	struct evhttp *http;
+	struct sockaddr_in sin;
+	int i;
+
+	if (!base || !(http = evhttp_new(base))) {
+		perror("setup");
+		exit(1);
+	}
+	evhttp_set_gencb(http, http_cb, NULL);
+	evhttp_set_timeout(http, idle_timeout.tv_sec);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	begin_config("evhttp keep-alive");
+
+	begin_step();
+	for (i = 0; i < num_conns; ++i) {
+		evhttp_serve_socket(http, servers[i],
+		    (struct sockaddr *)&sin, sizeof(sin));
+		if (send(clients[i], request, sizeof(request) - 1, 0) < 0) {
+			perror("send");
+			exit(1);
+		}
+	}
+	while (n_served < num_conns)
+		event_base_loop(base, EVLOOP_ONCE);
+	/* Let the replies go out. */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	end_step("serve one request, then idle");
+
+	end_config();
+
+	evhttp_free(http);
+	event_base_free(base);
+}
+
+static void
+open_connections(void)
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	evutil_socket_t listener;
+	int i;
+
+	clients = calloc(num_conns, sizeof(evutil_socket_t));
+	servers = calloc(num_conns, sizeof(evutil_socket_t));
+	if (!clients || !servers) {
+		perror("malloc");
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(listener, 128) < 0 ||
+	    getsockname(listener, (struct sockaddr *)&sin, &slen) < 0) {
+		perror("listener");
+		exit(1);
+	}
+	for (i = 0; i < num_conns; ++i) {
+		if ((clients[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    connect(clients[i], (struct sockaddr *)&sin,
+			sizeof(sin)) < 0 ||
+		    (servers[i] = accept(listener, NULL, NULL)) < 0) {
+			perror("connect");
+			exit(1);
+		}
+		evutil_make_socket_nonblocking(servers[i]);
+	}
+	EVUTIL_CLOSESOCKET(listener);
+}
+
+int
+main(int argc, char **argv)
+{
+#ifndef WIN32
+	struct rlimit rl;
+#endif
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_conns = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_conns < 1) {
+		fprintf(stderr, "Need at least one connection\n");
+		exit(1);
+	}
+
+#ifndef WIN32
+	/* Two fds per connection, and a few to spare. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rlim_t want = (rlim_t)num_conns * 2 + 50;
+		if (rl.rlim_cur < want) {
+			rl.rlim_cur = want < rl.rlim_max ? want : rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+		if (rl.rlim_cur < want) {
+			num_conns = (int)((rl.rlim_cur - 50) / 2);
+			fprintf(stderr, "Only allowed enough fds for %d "
+			    "connections.\n", num_conns);
+		}
+	}
+#endif
+
+	event_set_mem_functions(counting_malloc, counting_realloc,
+	    counting_free);
+
+	open_connections();
+	run_events();
+	run_bufferevents(0);
+	run_bufferevents(1);
+	run_evhttp();
+
+	exit(0);
+}
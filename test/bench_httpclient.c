@@ -25,14 +25,44 @@
  *
  */
 
+/*
+ * A load generator for HTTP servers such as test/bench_http.
+ *
+ * Each of -t threads runs its own event_base with -c connections, and
+ * between them they make -n requests for -u from -a:-p.  Each connection
+ * makes up to -k requests before closing (0 means no limit), with up to -P
+ * of them in flight at once.  A request that gets no answer within -T
+ * seconds counts as an error.
+ *
+ * By default each connection sends its next request as soon as it has room
+ * for it.  With -r, requests are instead due at a fixed total rate.  A
+ * request's latency is then counted from when it was due, not from when a
+ * connection got around to sending it.  That way a stalled server shows
+ * up in the latencies of every request that stall held up, instead of just
+ * the one it was serving.
+ *
+ * Latencies go into histograms that keep about 1.5% precision from a
+ * microsecond up, and the percentiles come from those.
+ */
+
+#include "event-config.h"
+
 #include <sys/types.h>
 #ifdef WIN32
 #include <winsock2.h>
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
 #endif
+#ifdef _EVENT_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <event2/event.h>
@@ -40,169 +70,532 @@
 #include <event2/buffer.h>
 #include <event2/util.h>
 
-/* for EVUTIL_ERR_CONNECT_RETRIABLE macro */
+/* for evutil_strncasecmp */
 #include "util-internal.h"
 
-const char *resource = NULL;
-struct event_base *base = NULL;
+static const char *resource = "/ref";
+static const char *host = "127.0.0.1";
+static struct sockaddr_in server_addr;
+static int n_threads = 1;
+static int n_conns = 200;
+static int n_requests = 20000;
+static int per_conn = 1;
+static int pipeline = 1;
+static double rate = 0;
+static struct timeval timeout = { 10, 0 };
+
+/* Latency histogram.  Values under 2*HALF_BUCKET usec get a bucket each;
+ * past that, each doubling of the value is split into HALF_BUCKET buckets. */
+#define HALF_BUCKET 64
+#define N_SHIFTS 40
+struct histogram {
+	ev_uint64_t counts[N_SHIFTS][2*HALF_BUCKET];
+	ev_uint64_t total;
+	ev_uint64_t max;
+};
+
+static void
+hist_record(struct histogram *h, ev_uint64_t usec)
+{
+	int shift = 0;
+	while ((usec >> shift) >= 2*HALF_BUCKET && shift < N_SHIFTS - 1)
+		++shift;
+	if ((usec >> shift) >= 2*HALF_BUCKET)
+		usec = ((ev_uint64_t)2*HALF_BUCKET << shift) - 1;
+	++h->counts[shift][usec >> shift];
+	++h->total;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+static void
+hist_merge(struct histogram *to, const struct histogram *from)
+{
+	int i, j;
+	for (i = 0; i < N_SHIFTS; ++i)
+		for (j = 0; j < 2*HALF_BUCKET; ++j)
+			to->counts[i][j] += from->counts[i][j];
+	to->total += from->total;
+	if (from->max > to->max)
+		to->max = from->max;
+}
 
-int total_n_handled = 0;
-int total_n_errors = 0;
-int total_n_launched = 0;
-size_t total_n_bytes = 0;
-struct timeval total_time = {0,0};
-int n_errors = 0;
+/* Return the largest value that lands in the same bucket as the value at
+ * the given fraction of the way through h. */
+static ev_uint64_t
+hist_percentile(const struct histogram *h, double fraction)
+{
+	ev_uint64_t want = (ev_uint64_t)(fraction * h->total), seen = 0;
+	ev_uint64_t top;
+	int i, j;
+	if (want >= h->total)
+		return h->max;
+	for (i = 0; i < N_SHIFTS; ++i) {
+		for (j = i ? HALF_BUCKET : 0; j < 2*HALF_BUCKET; ++j) {
+			seen += h->counts[i][j];
+			if (seen > want) {
+				top = (((ev_uint64_t)j + 1) << i) - 1;
+				return top < h->max ? top : h->max;
+			}
+		}
+	}
+	return h->max;
+}
 
-const int PARALLELISM = 200;
-const int N_REQUESTS = 20000;
+struct worker;
+
+struct conn {
+	struct worker *w;
+	struct bufferevent *bev;
+	int connected;
+	/* Requests sent on this connection so far. */
+	int n_sent;
+	/* When each request in flight was started, oldest first. */
+	struct timeval *started;
+	int head, in_flight;
+	/* Where we are in the oldest response: its headers, or its body, of
+	 * which body_left bytes remain (-1 for "until EOF"). */
+	int in_body;
+	long body_left;
+	int server_closes;
+};
 
-struct request_info {
-	size_t n_read;
-	struct timeval started;
+struct worker {
+	struct event_base *base;
+	struct event *tick;
+	struct conn *conns;
+	int n_conns;
+	/* This worker's share of the requests. */
+	int n_target;
+	int n_sent, n_done, n_due;
+	int n_errors;
+	size_t n_bytes;
+	struct timeval start, end;
+	struct histogram hist;
 };
 
-static int launch_request(void);
-static void readcb(struct bufferevent *b, void *arg);
-static void errorcb(struct bufferevent *b, short what, void *arg);
+static void conn_open(struct conn *c);
 
 static void
-readcb(struct bufferevent *b, void *arg)
+usec_to_timeval(double usec, struct timeval *tv)
 {
-	struct request_info *ri = arg;
-	struct evbuffer *input = bufferevent_get_input(b);
-	size_t n = evbuffer_get_length(input);
+	tv->tv_sec = (long)(usec / 1000000);
+	tv->tv_usec = (long)(usec - tv->tv_sec * 1000000.0);
+}
 
-	ri->n_read += n;
-	evbuffer_drain(input, n);
+/* Return true iff w may send another request now. */
+static int
+may_send(struct worker *w)
+{
+	if (rate > 0)
+		return w->n_sent < w->n_due;
+	return w->n_sent < w->n_target;
 }
 
 static void
-errorcb(struct bufferevent *b, short what, void *arg)
+finish_one(struct worker *w)
 {
-	struct request_info *ri = arg;
-	struct timeval now, diff;
-	if (what & BEV_EVENT_EOF) {
-		++total_n_handled;
-		total_n_bytes += ri->n_read;
-		gettimeofday(&now, NULL);
-		evutil_timersub(&now, &ri->started, &diff);
-		evutil_timeradd(&diff, &total_time, &total_time);
-
-		if (total_n_handled && (total_n_handled%1000)==0)
-			printf("%d requests done\n",total_n_handled);
-
-		if (total_n_launched < N_REQUESTS) {
-			if (launch_request() < 0)
-				perror("Can't launch");
+	if (++w->n_done >= w->n_target) {
+		evutil_gettimeofday(&w->end, NULL);
+		event_base_loopbreak(w->base);
+	}
+}
+
+static void
+send_requests(struct conn *c)
+{
+	struct worker *w = c->w;
+	struct evbuffer *out;
+	struct timeval *tv;
+	int last;
+
+	if (!c->connected || c->server_closes)
+		return;
+	out = bufferevent_get_output(c->bev);
+	while (c->in_flight < pipeline && may_send(w) &&
+	    (!per_conn || c->n_sent < per_conn)) {
+		tv = &c->started[(c->head + c->in_flight) % pipeline];
+		if (rate > 0) {
+			/* Due at start + n_sent / rate per worker. */
+			usec_to_timeval(w->n_sent * 1000000.0 * n_threads / rate,
+			    tv);
+			evutil_timeradd(&w->start, tv, tv);
+		} else {
+			evutil_gettimeofday(tv, NULL);
 		}
-	} else {
-		++total_n_errors;
-		perror("Unexpected error");
+		last = per_conn && c->n_sent + 1 == per_conn;
+		evbuffer_add_printf(out,
+		    "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", resource, host,
+		    last ? "Connection: close\r\n" : "");
+		++c->in_flight;
+		++c->n_sent;
+		++w->n_sent;
 	}
+}
 
-	bufferevent_setcb(b, NULL, NULL, NULL, NULL);
-	free(ri);
-	bufferevent_disable(b, EV_READ|EV_WRITE);
-	bufferevent_free(b);
+static void
+conn_close(struct conn *c)
+{
+	if (c->bev) {
+		bufferevent_free(c->bev);
+		c->bev = NULL;
+	}
+	c->connected = 0;
+	c->in_flight = c->head = 0;
+	c->n_sent = 0;
+	c->in_body = 0;
+	c->server_closes = 0;
 }
 
+/* Replace c with a fresh connection if there's more to send. */
 static void
-frob_socket(int sock)
+conn_recycle(struct conn *c)
 {
-	struct linger l;
-	int one = 1;
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&one, sizeof(one));
-	l.l_onoff = 1;
-	l.l_linger = 0;
-	if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void*)&l, sizeof(l))<0)
-		perror("setsockopt");
+	conn_close(c);
+	if (c->w->n_sent < c->w->n_target)
+		conn_open(c);
 }
 
-static int
-launch_request(void)
+/* Count the oldest request on c as done, and record its latency if it
+ * succeeded. */
+static void
+response_done(struct conn *c, int ok)
 {
-	int sock;
-	struct sockaddr_in sin;
-	struct bufferevent *b;
+	struct worker *w = c->w;
+	struct timeval now, diff;
 
-	struct request_info *ri;
+	if (ok) {
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &c->started[c->head], &diff);
+		if (diff.tv_sec < 0)
+			evutil_timerclear(&diff);
+		hist_record(&w->hist,
+		    (ev_uint64_t)diff.tv_sec * 1000000 + diff.tv_usec);
+	} else {
+		++w->n_errors;
+	}
+	c->head = (c->head + 1) % pipeline;
+	--c->in_flight;
+	c->in_body = 0;
+	finish_one(w);
+}
 
-	++total_n_launched;
+/* Read as much of the status line and headers of the oldest response as
+ * there is.  Return 1 once they're all in, 0 if we need more, -1 on
+ * error. */
+static int
+read_headers(struct conn *c, struct evbuffer *in)
+{
+	struct evbuffer_ptr end;
+	char *line;
+	int first = 1, ok = 1;
 
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = htonl(0x7f000001);
-	sin.sin_port = htons(8080);
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-		return -1;
-	if (evutil_make_socket_nonblocking(sock) < 0)
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+	if (end.pos < 0)
+		return 0;
+
+	c->body_left = -1;
+	while ((line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF)) != NULL) {
+		if (!*line) {
+			free(line);
+			break;
+		}
+		if (first) {
+			/* We only want a "HTTP/1.x 2xx" status line. */
+			ok = !strncmp(line, "HTTP/1.", 7) &&
+			    strlen(line) >= 12 && line[9] == '2';
+			first = 0;
+		} else if (!evutil_strncasecmp(line, "Content-Length:", 15)) {
+			c->body_left = strtol(line + 15, NULL, 10);
+		} else if (!evutil_strncasecmp(line, "Connection:", 11) &&
+		    strstr(line + 11, "close")) {
+			c->server_closes = 1;
+		} else if (!evutil_strncasecmp(line,
+			"Transfer-Encoding:", 18)) {
+			/* We don't speak chunked. */
+			ok = 0;
+		}
+		free(line);
+	}
+	if (!ok)
 		return -1;
-	frob_socket(sock);
-	if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-		int e = errno;
-		if (! EVUTIL_ERR_CONNECT_RETRIABLE(e)) {
-			return -1;
+	c->in_body = 1;
+	return 1;
+}
+
+static void
+readcb(struct bufferevent *bev, void *arg)
+{
+	struct conn *c = arg;
+	struct worker *w = c->w;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t n;
+	int r;
+
+	while (c->in_flight) {
+		if (!c->in_body) {
+			r = read_headers(c, in);
+			if (r == 0)
+				break;
+			if (r < 0) {
+				while (c->in_flight)
+					response_done(c, 0);
+				conn_recycle(c);
+				return;
+			}
 		}
+		n = evbuffer_get_length(in);
+		if (c->body_left >= 0 && n > (size_t)c->body_left)
+			n = c->body_left;
+		evbuffer_drain(in, n);
+		w->n_bytes += n;
+		if (c->body_left < 0)
+			return; /* until EOF */
+		c->body_left -= n;
+		if (c->body_left)
+			return;
+		response_done(c, 1);
 	}
 
-	ri = malloc(sizeof(*ri));
-	ri->n_read = 0;
-	gettimeofday(&ri->started, NULL);
+	if (!c->in_flight && (c->server_closes ||
+		(per_conn && c->n_sent >= per_conn)))
+		conn_recycle(c);
+	else
+		send_requests(c);
+}
 
-	b = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
+static void
+eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct conn *c = arg;
+	struct worker *w = c->w;
 
-	bufferevent_setcb(b, readcb, NULL, errorcb, ri);
-	bufferevent_enable(b, EV_READ|EV_WRITE);
+	if (what & BEV_EVENT_CONNECTED) {
+		c->connected = 1;
+		send_requests(c);
+		return;
+	}
 
-	evbuffer_add_printf(bufferevent_get_output(b),
-	    "GET %s HTTP/1.0\r\n\r\n", resource);
+	if ((what & BEV_EVENT_EOF) && c->in_flight && c->in_body &&
+	    c->body_left < 0) {
+		/* A response that ran until the server closed. */
+		response_done(c, 1);
+	}
+	if (!c->connected && !c->in_flight && w->n_sent < w->n_target) {
+		/* We never got connected: count that as a failed request, so
+		 * that we give up eventually if nobody is listening. */
+		++w->n_sent;
+		++w->n_errors;
+		finish_one(w);
+	}
+	while (c->in_flight)
+		response_done(c, 0);
+	conn_recycle(c);
+}
 
-	return 0;
+static void
+conn_open(struct conn *c)
+{
+	c->bev = bufferevent_socket_new(c->w->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (!c->bev)
+		return;
+	bufferevent_setcb(c->bev, readcb, NULL, eventcb, c);
+	if (bufferevent_socket_connect(c->bev, (struct sockaddr *)&server_addr,
+		sizeof(server_addr)) < 0) {
+		conn_close(c);
+		return;
+	}
+	bufferevent_set_timeouts(c->bev, &timeout, &timeout);
+	bufferevent_enable(c->bev, EV_READ|EV_WRITE);
 }
 
+/* Open-loop mode: work out how many requests are due, and send them on
+ * whichever connections have room. */
+static void
+tickcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct worker *w = arg;
+	struct timeval now, diff;
+	double due;
+	int i;
 
-int
-main(int argc, char **argv)
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &w->start, &diff);
+	due = (diff.tv_sec + diff.tv_usec / 1000000.0) * rate / n_threads;
+	w->n_due = due >= w->n_target ? w->n_target : (int)due + 1;
+	for (i = 0; i < w->n_conns && may_send(w); ++i)
+		send_requests(&w->conns[i]);
+}
+
+static void *
+run_worker(void *arg)
 {
+	struct worker *w = arg;
+	struct timeval msec = { 0, 1000 };
 	int i;
-	struct timeval start, end, total;
-	long long usec;
-	double throughput;
-	resource = "/ref";
 
-	setvbuf(stdout, NULL, _IONBF, 0);
+	evutil_gettimeofday(&w->start, NULL);
+	if (rate > 0) {
+		w->tick = event_new(w->base, -1, EV_PERSIST, tickcb, w);
+		event_add(w->tick, &msec);
+		tickcb(-1, 0, w);
+	}
+	for (i = 0; i < w->n_conns; ++i)
+		conn_open(&w->conns[i]);
+
+	event_base_dispatch(w->base);
+
+	for (i = 0; i < w->n_conns; ++i)
+		conn_close(&w->conns[i]);
+	if (w->tick)
+		event_free(w->tick);
+	/* Don't leave chains in this thread's cache when it exits. */
+	evbuffer_trim_chain_cache(0);
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: bench_httpclient [-a addr] [-p port] [-u path] [-t threads]\n"
+	    "    [-c connections] [-n requests] [-k requests/connection]\n"
+	    "    [-P pipeline depth] [-r requests/sec] [-T timeout secs]\n");
+	exit(1);
+}
 
-	base = event_base_new();
+int
+main(int argc, char **argv)
+{
+	struct worker *workers;
+	struct histogram *hist;
+	struct timeval start, end, total;
+	double secs;
+	size_t n_bytes = 0;
+	int i, j, c, n_done = 0, n_errors = 0;
+	int port = 8080;
+#ifdef _EVENT_HAVE_PTHREADS
+	pthread_t *threads;
+#endif
 
-	for (i=0; i < PARALLELISM; ++i) {
-		if (launch_request() < 0)
-			perror("launch");
+	while ((c = getopt(argc, argv, "a:p:u:t:c:n:k:P:r:T:")) != -1) {
+		switch (c) {
+		case 'a': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'u': resource = optarg; break;
+		case 't': n_threads = atoi(optarg); break;
+		case 'c': n_conns = atoi(optarg); break;
+		case 'n': n_requests = atoi(optarg); break;
+		case 'k': per_conn = atoi(optarg); break;
+		case 'P': pipeline = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'T': timeout.tv_sec = atoi(optarg); break;
+		default: usage();
+		}
+	}
+#ifndef _EVENT_HAVE_PTHREADS
+	if (n_threads != 1) {
+		fprintf(stderr, "No threads here; using one.\n");
+		n_threads = 1;
+	}
+#endif
+	if (n_threads < 1 || n_conns < n_threads || n_requests < n_threads ||
+	    per_conn < 0 || pipeline < 1 || rate < 0 || timeout.tv_sec < 1)
+		usage();
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	if (evutil_inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+		fprintf(stderr, "Bad address %s\n", host);
+		return 1;
 	}
 
-	gettimeofday(&start, NULL);
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
 
-	event_base_dispatch(base);
+	workers = calloc(n_threads, sizeof(struct worker));
+	hist = calloc(1, sizeof(struct histogram));
+	if (!workers || !hist) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < n_threads; ++i) {
+		struct worker *w = &workers[i];
+		w->n_conns = n_conns / n_threads +
+		    (i < n_conns % n_threads);
+		w->n_target = n_requests / n_threads +
+		    (i < n_requests % n_threads);
+		w->base = event_base_new();
+		w->conns = calloc(w->n_conns, sizeof(struct conn));
+		if (!w->base || !w->conns) {
+			perror("setup");
+			return 1;
+		}
+		for (j = 0; j < w->n_conns; ++j) {
+			w->conns[j].w = w;
+			w->conns[j].started =
+			    calloc(pipeline, sizeof(struct timeval));
+			if (!w->conns[j].started) {
+				perror("malloc");
+				return 1;
+			}
+		}
+	}
 
-	gettimeofday(&end, NULL);
-	evutil_timersub(&end, &start, &total);
-	usec = total_time.tv_sec * 1000000 + total_time.tv_usec;
+	evutil_gettimeofday(&start, NULL);
+#ifdef _EVENT_HAVE_PTHREADS
+	threads = calloc(n_threads, sizeof(pthread_t));
+	for (i = 1; i < n_threads; ++i) {
+		if (pthread_create(&threads[i], NULL, run_worker, &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+#endif
+	run_worker(&workers[0]);
+#ifdef _EVENT_HAVE_PTHREADS
+	for (i = 1; i < n_threads; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#endif
+	evutil_gettimeofday(&end, NULL);
+
+	for (i = 0; i < n_threads; ++i) {
+		struct worker *w = &workers[i];
+		n_done += w->n_done;
+		n_errors += w->n_errors;
+		n_bytes += w->n_bytes;
+		hist_merge(hist, &w->hist);
+		for (j = 0; j < w->n_conns; ++j)
+			free(w->conns[j].started);
+		free(w->conns);
+		event_base_free(w->base);
+	}
+	free(workers);
 
-	if (!total_n_handled) {
+	if (n_done == n_errors) {
 		puts("Nothing worked.  You probably did something dumb.");
+		free(hist);
 		return 0;
 	}
 
-
-	throughput = total_n_handled /
-	    (total.tv_sec+ ((double)total.tv_usec)/1000000.0);
-
-	printf("\n%d requests in %d.%06d sec. (%.2f throughput)\n"
-	    "Each took about %.02f msec latency\n"
+	evutil_timersub(&end, &start, &total);
+	secs = total.tv_sec + total.tv_usec / 1000000.0;
+	printf("%d requests in %d.%06d sec. (%.2f throughput)\n"
+	    "Latency in msec: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f"
+	    "  max %.3f\n"
 	    "%lld bytes read. %d errors.\n",
-	    total_n_handled,
-	    (int)total.tv_sec, (int)total.tv_usec,
-	    throughput,
-	    (double)(usec/1000) / total_n_handled,
-	    (long long)total_n_bytes, n_errors);
-
+	    n_done, (int)total.tv_sec, (int)total.tv_usec,
+	    (n_done - n_errors) / secs,
+	    hist_percentile(hist, .5) / 1000.0,
+	    hist_percentile(hist, .9) / 1000.0,
+	    hist_percentile(hist, .99) / 1000.0,
+	    hist_percentile(hist, .999) / 1000.0,
+	    hist->max / 1000.0,
+	    (long long)n_bytes, n_errors);
+
+	free(hist);
 	return 0;
 }
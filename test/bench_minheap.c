@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This benchmark compares the binary heap of event pointers with the keyed
+ * 4-ary heap (EVENT_BASE_FLAG_KEYED_TIMEHEAP).  For each layout it pushes
+ * n timeouts with random expiry times, erases half of them in random order,
+ * and pops the rest, reporting the time spent in each phase.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <event2/event_struct.h>
+#include <event2/util.h>
+
+#include "minheap-internal.h"
+
+static struct event *events;
+static int *order;
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+static void
+run_once(const char *name, int keyed, int num_timers)
+{
+	struct min_heap heap;
+	struct timeval ts;
+	long t_push, t_erase, t_pop;
+	int i;
+
+	if (keyed)
+		min_heap_ctor_keyed(&heap);
+	else
+		min_heap_ctor(&heap);
+
+	for (i = 0; i < num_timers; ++i) {
+		events[i].ev_timeout.tv_sec = rand() % 3600;
+		events[i].ev_timeout.tv_usec = rand() % 1000000;
+		min_heap_elem_init(&events[i]);
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; ++i)
+		min_heap_push(&heap, &events[i]);
+	t_push = usec_since(&ts);
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers / 2; ++i)
+		min_heap_erase(&heap, &events[order[i]]);
+	t_erase = usec_since(&ts);
+
+	evutil_gettimeofday(&ts, NULL);
+	while (min_heap_pop(&heap))
+		;
+	t_pop = usec_since(&ts);
+
+	fprintf(stdout, "%-7s push %8ld  erase %8ld  pop %8ld  (usec)\n",
+	    name, t_push, t_erase, t_pop);
+
+	min_heap_dtor(&heap);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, c;
+	int num_timers = 1000000;
+	int num_runs = 5;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_timers = atoi(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+
+	events = calloc(num_timers, sizeof(struct event));
+	order = calloc(num_timers, sizeof(int));
+	if (events == NULL || order == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* erase in a random order so that removals hit the whole heap */
+	for (i = 0; i < num_timers; ++i)
+		order[i] = i;
+	for (i = num_timers - 1; i > 0; --i) {
+		int j = rand() % (i + 1);
+		int tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (i = 0; i < num_runs; ++i) {
+		run_once("binary", 0, num_timers);
+		run_once("keyed", 1, num_timers);
+	}
+
+	free(order);
+	free(events);
+	exit(0);
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This benchmark measures evrpc with the Message rpc from regress.rpc, with
+ * the server and the client in the same process, on the same event_base,
+ * talking over loopback.  For each transport it keeps -c calls outstanding
+ * over -p connections for -d seconds: as soon as a call returns, another
+ * takes its place.  Each request carries -s bytes of payload, which the
+ * reply carries back, and the server and the client each run -k input and
+ * -k output hooks that do nothing.  It reports the calls made per second,
+ * the CPU time per call of client and server together, and the spread of
+ * call latencies.
+ *
+ * The transports are "http", where each call is an HTTP request on an
+ * evhttp_connection, and "frame", where calls go out as binary frames on
+ * a bufferevent without waiting for earlier ones.  -t runs only the named
+ * one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/rpc.h>
+#include <event2/rpc_struct.h>
+#include <event2/util.h>
+
+#include "regress.gen.h"
+
+EVRPC_HEADER(Message, msg, kill);
+EVRPC_GENERATE(Message, msg, kill);
+
+enum transport { TRANSPORT_HTTP, TRANSPORT_FRAME };
+
+static const struct {
+	const char *name;
+	enum transport transport;
+	const char *desc;
+} transports[] = {
+	{ "http", TRANSPORT_HTTP, "one HTTP request per call" },
+	{ "frame", TRANSPORT_FRAME, "binary frames on a bufferevent" },
+};
+
+/* One call slot; it always has a call outstanding until time is up. */
+struct call {
+	struct kill *reply;
+	struct timeval started;
+};
+
+static struct event_base *base;
+static struct evrpc_pool *pool;
+static struct evrpc_base *rpc_base;
+static struct msg *request;
+
+static int concurrency = 16;
+static int n_conns = 4;
+static int duration = 3;
+static int payload_size = 64;
+static int n_hooks = 0;
+
+static struct timeval started;
+static int done_calling;
+static long n_outstanding;
+static long n_calls, n_errors;
+
+/* Latencies of finished calls, in usec. */
+static long *latencies;
+static long n_latencies, latencies_alloc;
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+static long
+cpu_usec(void)
+{
+#ifdef WIN32
+	return 0;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
+
+static int
+nop_hook(void *ctx, struct evhttp_request *req, struct evbuffer *evbuf,
+    void *arg)
+{
+	return (EVRPC_CONTINUE);
+}
+
+static void
+add_hooks(void *vbase)
+{
+	int i;
+	for (i = 0; i < n_hooks; ++i) {
+		if (!evrpc_add_hook(vbase, EVRPC_INPUT, nop_hook, NULL) ||
+		    !evrpc_add_hook(vbase, EVRPC_OUTPUT, nop_hook, NULL)) {
+			fprintf(stderr, "Can't add a hook\n");
+			exit(1);
+		}
+	}
+}
+
+static void
+MessageCb(EVRPC_STRUCT(Message)* rpc, void *arg)
+{
+	char *payload;
+
+	EVTAG_GET(rpc->request, from_name, &payload);
+	EVTAG_ASSIGN(rpc->reply, weapon, "dagger");
+	EVTAG_ASSIGN(rpc->reply, action, payload);
+	EVRPC_REQUEST_DONE(rpc);
+}
+
+static void call_one(struct call *c);
+
+static void
+reply_cb(struct evrpc_status *status, struct msg *msg, struct kill *kill,
+    void *arg)
+{
+	struct call *c = arg;
+
+	if (n_latencies == latencies_alloc) {
+		latencies_alloc = latencies_alloc ? latencies_alloc * 2 : 4096;
+		latencies = realloc(latencies,
+		    latencies_alloc * sizeof(long));
+		if (!latencies) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies[n_latencies++] = usec_since(&c->started);
+	++n_calls;
+	if (status->error != EVRPC_STATUS_ERR_NONE)
+		++n_errors;
+
+	if (!done_calling && usec_since(&started) >= duration * 1000000L)
+		done_calling = 1;
+	if (!done_calling) {
+		call_one(c);
+		return;
+	}
+	if (--n_outstanding == 0)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+call_one(struct call *c)
+{
+	kill_clear(c->reply);
+	evutil_gettimeofday(&c->started, NULL);
+	if (EVRPC_MAKE_REQUEST(Message, pool, request, c->reply,
+		reply_cb, c) == -1) {
+		fprintf(stderr, "Can't make a request\n");
+		exit(1);
+	}
+}
+
+static int
+compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static long
+percentile(double p)
+{
+	long i = (long)(p * (n_latencies - 1) / 100.0 + 0.5);
+	return latencies[i];
+}
+
+/* Return a listening socket on loopback, and its port in *pport. */
+static evutil_socket_t
+listen_on_loopback(unsigned short *pport)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	evutil_socket_t fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &len) < 0 ||
+	    listen(fd, 128) < 0) {
+		perror("Can't listen on loopback");
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(fd);
+	*pport = ntohs(sin.sin_port);
+	return fd;
+}
+
+static void
+frame_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev || evrpc_add_bufferevent(rpc_base, bev) == -1) {
+		fprintf(stderr, "Can't accept a connection\n");
+		exit(1);
+	}
+}
+
+static void
+run(const char *name, enum transport transport, const char *desc)
+{
+	struct evhttp *http = NULL;
+	struct evconnlistener *listener = NULL;
+	struct call *calls;
+	struct sockaddr_in sin;
+	unsigned short port;
+	evutil_socket_t fd;
+	long usec, cpu;
+	int i;
+
+	n_outstanding = n_calls = n_errors = n_latencies = 0;
+	done_calling = 0;
+
+	fd = listen_on_loopback(&port);
+	if (transport == TRANSPORT_HTTP) {
+		http = evhttp_new(base);
+		if (!http || evhttp_accept_socket(http, fd) == -1) {
+			fprintf(stderr, "Can't start the HTTP server\n");
+			exit(1);
+		}
+	} else {
+		listener = evconnlistener_new(base, frame_accept_cb, NULL,
+		    LEV_OPT_CLOSE_ON_FREE, 0, fd);
+		if (!listener) {
+			fprintf(stderr, "Can't start the listener\n");
+			exit(1);
+		}
+	}
+	rpc_base = evrpc_init(http);
+	EVRPC_REGISTER(rpc_base, Message, msg, kill, MessageCb, NULL);
+	add_hooks(rpc_base);
+
+	pool = evrpc_pool_new(base);
+	add_hooks(pool);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sin.sin_port = htons(port);
+	for (i = 0; i < n_conns; ++i) {
+		if (transport == TRANSPORT_HTTP) {
+			struct evhttp_connection *evcon;
+			/* the pool gives it our base */
+			evcon = evhttp_connection_base_new(NULL, "127.0.0.1",
+			    port);
+			if (!evcon) {
+				fprintf(stderr, "Can't connect\n");
+				exit(1);
+			}
+			evrpc_pool_add_connection(pool, evcon);
+		} else {
+			struct bufferevent *bev;
+			bev = bufferevent_socket_new(base, -1,
+			    BEV_OPT_CLOSE_ON_FREE);
+			if (!bev || bufferevent_socket_connect(bev,
+				(struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+			    evrpc_pool_add_bufferevent(pool, bev) == -1) {
+				fprintf(stderr, "Can't connect\n");
+				exit(1);
+			}
+		}
+	}
+
+	if (!(calls = calloc(concurrency, sizeof(struct call)))) {
+		perror("calloc");
+		exit(1);
+	}
+	cpu = cpu_usec();
+	evutil_gettimeofday(&started, NULL);
+	for (i = 0; i < concurrency; ++i) {
+		calls[i].reply = kill_new();
+		++n_outstanding;
+		call_one(&calls[i]);
+	}
+	event_base_dispatch(base);
+	usec = usec_since(&started);
+	cpu = cpu_usec() - cpu;
+
+	evrpc_pool_free(pool);
+	EVRPC_UNREGISTER(rpc_base, Message);
+	evrpc_free(rpc_base);
+	if (http)
+		evhttp_free(http);
+	if (listener)
+		evconnlistener_free(listener);
+	/* Let the server see its connections close. */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	for (i = 0; i < concurrency; ++i)
+		kill_free(calls[i].reply);
+	free(calls);
+
+	printf("%s: %s\n", name, desc);
+	printf("  %ld calls in %ld.%03ld sec: %.1f per sec, %ld errors\n",
+	    n_calls, usec / 1000000, (usec / 1000) % 1000,
+	    n_calls * 1000000.0 / usec, n_errors);
+#ifndef WIN32
+	if (n_calls)
+		printf("  %.1f usec of CPU per call\n", (double)cpu / n_calls);
+#endif
+	if (n_latencies) {
+		qsort(latencies, n_latencies, sizeof(long), compare_long);
+		printf("  latency in usec: 50%% %ld, 90%% %ld, 99%% %ld, "
+		    "99.9%% %ld, max %ld\n", percentile(50), percentile(90),
+		    percentile(99), percentile(99.9),
+		    latencies[n_latencies - 1]);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *only = NULL;
+	char *payload;
+	int c, ran = 0;
+	size_t i;
+
+	while ((c = getopt(argc, argv, "c:p:d:s:k:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'p':
+			n_conns = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			payload_size = atoi(optarg);
+			break;
+		case 'k':
+			n_hooks = atoi(optarg);
+			break;
+		case 't':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (concurrency < 1 || n_conns < 1 || duration < 1 ||
+	    payload_size < 0 || n_hooks < 0) {
+		fprintf(stderr, "Need at least one call on one connection, "
+		    "for at least a second\n");
+		exit(1);
+	}
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	setvbuf(stdout, NULL, _IONBF, 0);
+	base = event_base_new();
+
+	if (!(payload = malloc(payload_size + 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(payload, 'x', payload_size);
+	payload[payload_size] = '\0';
+	request = msg_new();
+	EVTAG_ASSIGN(request, from_name, payload);
+	EVTAG_ASSIGN(request, to_name, "bench");
+	free(payload);
+
+	printf("%d calls outstanding on %d connections, %d bytes of "
+	    "payload, %d hooks of each kind\n", concurrency, n_conns,
+	    payload_size, n_hooks);
+	for (i = 0; i < sizeof(transports)/sizeof(transports[0]); ++i) {
+		if (only && strcmp(only, transports[i].name))
+			continue;
+		run(transports[i].name, transports[i].transport,
+		    transports[i].desc);
+		++ran;
+	}
+	if (!ran) {
+		fprintf(stderr, "No transport named \"%s\"\n", only);
+		exit(1);
+	}
+
+	msg_free(request);
+	event_base_free(base);
+	free(latencies);
+	exit(0);
+}
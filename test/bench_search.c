@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * This benchmark measures how fast an evbuffer can be scanned for line
+ * ends and for short strings.  It fills a buffer with -n lines of about -l
+ * bytes each, split over chains of -c bytes so that plenty of line ends
+ * and needles straddle two chains, and then times evbuffer_readln() and
+ * evbuffer_search() over it -r times.
+ *
+ * For comparison it also times the way the library used to look for line
+ * ends and strings: one byte at a time, through evbuffer_peek().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+static const char needle[] = "Content-Length:";
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+/* Build a buffer of num_lines lines out of chains of chain_len bytes. */
+static struct evbuffer *
+make_buffer(int num_lines, int line_len, int chain_len, int *n_chains)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *chunk = evbuffer_new();
+	char *text;
+	size_t total, off;
+	int i;
+
+	total = (size_t)num_lines * (line_len + 2);
+	if (buf == NULL || chunk == NULL || (text = malloc(total)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0, off = 0; i < num_lines; ++i) {
+		int n = line_len / 2 + rand() % (line_len / 2 + 1);
+		memset(text + off, 'a' + i % 26, n);
+		/* put a needle in every hundredth line */
+		if (i % 100 == 99 && n > (int)sizeof(needle))
+			memcpy(text + off, needle, sizeof(needle) - 1);
+		off += n;
+		text[off++] = '\r';
+		text[off++] = '\n';
+	}
+	total = off;
+
+	*n_chains = 0;
+	for (off = 0; off < total; off += chain_len) {
+		size_t n = total - off < (size_t)chain_len ?
+		    total - off : (size_t)chain_len;
+		/* adding a whole buffer moves its chains over as they are */
+		evbuffer_add(chunk, text + off, n);
+		evbuffer_add_buffer(buf, chunk);
+		++*n_chains;
+	}
+
+	evbuffer_free(chunk);
+	free(text);
+	return buf;
+}
+
+/* The old line finder: look at every byte until one is a '\n'. */
+static int
+bytewise_find_lf(struct evbuffer *buf, struct evbuffer_ptr *start)
+{
+	struct evbuffer_iovec v[64];
+	int n, i;
+	size_t j, pos = start->pos;
+
+	n = evbuffer_peek(buf, -1, start, v, 64);
+	if (n > 64)
+		n = 64;
+	for (i = 0; i < n; ++i) {
+		const char *p = v[i].iov_base;
+		/* the first vector starts at start itself */
+		for (j = 0; j < v[i].iov_len; ++j, ++pos)
+			if (p[j] == '\n')
+				return (int)(pos - start->pos);
+	}
+	return -1;
+}
+
+static void
+flatten(struct evbuffer *buf, unsigned char *out)
+{
+	struct evbuffer_iovec *v;
+	ev_ssize_t len = evbuffer_get_length(buf);
+	int i, n = evbuffer_peek(buf, len, NULL, NULL, 0);
+
+	if ((v = calloc(n, sizeof(*v))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	evbuffer_peek(buf, len, NULL, v, n);
+	for (i = 0; i < n; ++i) {
+		memcpy(out, v[i].iov_base, v[i].iov_len);
+		out += v[i].iov_len;
+	}
+	free(v);
+}
+
+/* A plain search: flatten the buffer, then compare the needle at every
+ * offset one byte at a time. */
+static long
+bytewise_count_needles(struct evbuffer *buf)
+{
+	size_t len = strlen(needle), total = evbuffer_get_length(buf);
+	long found = 0;
+	unsigned char *p;
+	size_t i, j;
+
+	if ((p = malloc(total)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	flatten(buf, p);
+	for (i = 0; i + len <= total; ++i) {
+		for (j = 0; j < len; ++j)
+			if (p[i + j] != (unsigned char)needle[j])
+				break;
+		if (j == len)
+			++found;
+	}
+	free(p);
+	return found;
+}
+
+static long
+count_needles(struct evbuffer *buf)
+{
+	struct evbuffer_ptr pos;
+	size_t len = strlen(needle);
+	long found = 0;
+
+	pos = evbuffer_search(buf, needle, len, NULL);
+	while (pos.pos >= 0) {
+		++found;
+		if (evbuffer_ptr_set(buf, &pos, 1, EVBUFFER_PTR_ADD) < 0)
+			break;
+		pos = evbuffer_search(buf, needle, len, &pos);
+	}
+	return found;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evbuffer *buf;
+	int i, c, n_chains;
+	int num_lines = 20000;
+	int line_len = 200;
+	int chain_len = 4000;
+	int num_runs = 5;
+	size_t total;
+
+	while ((c = getopt(argc, argv, "n:l:c:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_lines = atoi(optarg);
+			break;
+		case 'l':
+			line_len = atoi(optarg);
+			break;
+		case 'c':
+			chain_len = atoi(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_lines < 1 || line_len < 2 || chain_len < 1) {
+		fprintf(stderr, "Need at least one line and one byte per chain\n");
+		exit(1);
+	}
+
+	buf = make_buffer(num_lines, line_len, chain_len, &n_chains);
+	total = evbuffer_get_length(buf);
+	fprintf(stdout, "%lu bytes in %d lines and %d chains\n",
+	    (unsigned long)total, num_lines, n_chains);
+
+	for (i = 0; i < num_runs; ++i) {
+		struct evbuffer *copy = evbuffer_new();
+		struct evbuffer_ptr pos;
+		struct timeval ts;
+		long t_old, t_new, n_old = 0, n_new = 0;
+		int r;
+
+		/* evbuffer_readln drains what it reads, so scan a copy that
+		 * shares the original's bytes. */
+		evbuffer_add_buffer_reference(copy, buf);
+		evutil_gettimeofday(&ts, NULL);
+		evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+		while ((r = bytewise_find_lf(buf, &pos)) >= 0) {
+			++n_old;
+			if (evbuffer_ptr_set(buf, &pos, r + 1,
+				EVBUFFER_PTR_ADD) < 0)
+				break;
+		}
+		t_old = usec_since(&ts);
+		evutil_gettimeofday(&ts, NULL);
+		for (;;) {
+			char *line = evbuffer_readln(copy, NULL,
+			    EVBUFFER_EOL_CRLF);
+			if (line == NULL)
+				break;
+			free(line);
+			++n_new;
+		}
+		t_new = usec_since(&ts);
+		fprintf(stdout, "run %d: lines  %ld bytewise %8ld usec, "
+		    "%ld readln %8ld usec\n", i, n_old, t_old, n_new, t_new);
+		evbuffer_free(copy);
+
+		evutil_gettimeofday(&ts, NULL);
+		n_old = bytewise_count_needles(buf);
+		t_old = usec_since(&ts);
+		evutil_gettimeofday(&ts, NULL);
+		n_new = count_needles(buf);
+		t_new = usec_since(&ts);
+		fprintf(stdout, "run %d: search %ld bytewise %8ld usec, "
+		    "%ld search %8ld usec\n", i, n_old, t_old, n_new, t_new);
+	}
+
+	evbuffer_free(buf);
+	exit(0);
+}
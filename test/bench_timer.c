@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This benchmark keeps -n timeouts pending on an event_base and measures
+ * how fast they can be added, rescheduled, fired and deleted, and how long
+ * each pass through the loop takes while they are.  It runs two patterns:
+ *
+ *   idle     Every timeout is 30 seconds, like a bufferevent's read
+ *            timeout, and -o times a random one is pushed back by another
+ *            30 seconds, as if data had arrived.  One push in 1024 is a
+ *            zero timeout instead, so timeouts fire now and then.  The
+ *            loop runs once every 256 pushes.
+ *   uniform  Every timeout is due at a uniformly random time, and is
+ *            re-added the same way when it fires, until -o have fired.
+ *            They come due at ten million a second, more than the loop
+ *            can keep up with, so this measures how fast it fires them.
+ *
+ * Each pattern runs on each way of keeping timeouts: the default binary
+ * heap, the keyed 4-ary heap, and, for the idle pattern where all the
+ * timeouts are the same, a common timeout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef _EVENT_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/event_struct.h>
+#include <event2/util.h>
+
+enum layout { BINARY, KEYED, COMMON };
+static const char *layout_names[] = { "binary", "keyed", "common" };
+
+static struct event *timers;
+static int num_timers = 100000;
+static int num_ops = 1000000;
+static long n_fired;
+static const struct timeval *idle_tv;
+static long uniform_span_usec;
+static ev_uint32_t rng_state = 2463534242U;
+
+/* Loop pass times, in usec. */
+static double loop_total, loop_max;
+static long loop_count;
+
+static ev_uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static long
+usec_since(const struct timeval *start)
+{
+	struct timeval now, diff;
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, start, &diff);
+	return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+static void
+timed_loop(struct event_base *base)
+{
+	struct timeval ts;
+	long usec;
+
+	evutil_gettimeofday(&ts, NULL);
+	event_base_loop(base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	usec = usec_since(&ts);
+	loop_total += usec;
+	if (usec > loop_max)
+		loop_max = usec;
+	++loop_count;
+}
+
+static void
+uniform_tv(struct timeval *tv)
+{
+	long usec = (long)(rng() % (ev_uint32_t)uniform_span_usec);
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+static void
+idle_cb(evutil_socket_t fd, short what, void *arg)
+{
+	++n_fired;
+	event_add(arg, idle_tv);
+}
+
+static void
+uniform_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval tv;
+	++n_fired;
+	uniform_tv(&tv);
+	event_add(arg, &tv);
+}
+
+static struct event_base *
+new_base(enum layout layout)
+{
+	struct event_config *cfg = event_config_new();
+	struct event_base *base;
+
+	if (cfg == NULL) {
+		perror("event_config_new");
+		exit(1);
+	}
+	if (layout == KEYED)
+		event_config_set_flag(cfg, EVENT_BASE_FLAG_KEYED_TIMEHEAP);
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (base == NULL) {
+		fprintf(stderr, "Couldn't make a base\n");
+		exit(1);
+	}
+	return base;
+}
+
+static void
+run_once(int uniform, enum layout layout)
+{
+	static const struct timeval thirty = { 30, 0 }, zero = { 0, 0 };
+	struct event_base *base = new_base(layout);
+	struct timeval ts, tv;
+	long t_add, t_ops, t_del;
+	int i;
+
+	idle_tv = layout == COMMON ?
+	    event_base_init_common_timeout(base, &thirty) : &thirty;
+	n_fired = 0;
+	loop_total = loop_max = 0;
+	loop_count = 0;
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; ++i) {
+		evtimer_assign(&timers[i], base, uniform ? uniform_cb : idle_cb,
+		    &timers[i]);
+		if (uniform) {
+			uniform_tv(&tv);
+			event_add(&timers[i], &tv);
+		} else {
+			event_add(&timers[i], idle_tv);
+		}
+	}
+	t_add = usec_since(&ts);
+
+	evutil_gettimeofday(&ts, NULL);
+	if (uniform) {
+		while (n_fired < num_ops)
+			timed_loop(base);
+	} else {
+		for (i = 0; i < num_ops; ++i) {
+			struct event *ev = &timers[rng() % num_timers];
+			event_add(ev, (i & 1023) ? idle_tv : &zero);
+			if ((i & 255) == 255)
+				timed_loop(base);
+		}
+	}
+	t_ops = usec_since(&ts);
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; ++i)
+		event_del(&timers[rng() % num_timers]);
+	for (i = 0; i < num_timers; ++i)
+		event_del(&timers[i]);
+	t_del = usec_since(&ts);
+
+	if (uniform) {
+		fprintf(stdout, "%-7s %-6s add %6.0f ns  fire %10.0f/s  "
+		    "del %6.0f ns  loop avg %8.1f max %8ld usec\n",
+		    "uniform", layout_names[layout],
+		    t_add * 1000.0 / num_timers,
+		    n_fired * 1000000.0 / (t_ops ? t_ops : 1),
+		    t_del * 1000.0 / num_timers,
+		    loop_count ? loop_total / loop_count : 0.0,
+		    (long)loop_max);
+	} else {
+		fprintf(stdout, "%-7s %-6s add %6.0f ns  push %6.0f ns  "
+		    "fired %6ld  del %6.0f ns  loop avg %8.1f max %8ld usec\n",
+		    "idle", layout_names[layout],
+		    t_add * 1000.0 / num_timers,
+		    t_ops * 1000.0 / num_ops, n_fired,
+		    t_del * 1000.0 / num_timers,
+		    loop_count ? loop_total / loop_count : 0.0,
+		    (long)loop_max);
+	}
+
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, c, layout;
+	int num_runs = 3;
+
+	while ((c = getopt(argc, argv, "n:o:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_timers = atoi(optarg);
+			break;
+		case 'o':
+			num_ops = atoi(optarg);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_timers < 1 || num_ops < 1) {
+		fprintf(stderr, "Need at least one timer and one operation\n");
+		exit(1);
+	}
+
+	timers = calloc(num_timers, sizeof(struct event));
+	if (timers == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	/* Ten million a second, and at least a millisecond. */
+	uniform_span_usec = num_timers / 10;
+	if (uniform_span_usec < 1000)
+		uniform_span_usec = 1000;
+
+	for (i = 0; i < num_runs; ++i) {
+		for (layout = BINARY; layout <= COMMON; ++layout)
+			run_once(0, layout);
+		for (layout = BINARY; layout <= KEYED; ++layout)
+			run_once(1, layout);
+	}
+
+	free(timers);
+	exit(0);
+}
@@ -64,6 +64,8 @@
 #include "event2/buffer_compat.h"
 #include "event2/util.h"
 #include "event-internal.h"
+#include "defer-internal.h"
+#include "changelist-internal.h"
 #include "log-internal.h"
 
 #include "regress.h"
@@ -890,6 +892,107 @@ test_signal_while_processing(void)
 	cleanup_test();
 	return;
 }
+
+static void
+signalfd_cb(evutil_socket_t fd, short what, void *arg)
+{
+	int *n_called = arg;
+	++*n_called;
+}
+
+static int
+signal_is_blocked(int signo)
+{
+	sigset_t mask;
+	sigprocmask(SIG_BLOCK, NULL, &mask);
+	return sigismember(&mask, signo);
+}
+
+static void
+test_signalfd(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event *ev = NULL;
+	int n_called = 0;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_SIGNALFD);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	tt_assert(!signal_is_blocked(SIGUSR1));
+	ev = evsignal_new(base, SIGUSR1, signalfd_cb, &n_called);
+	tt_assert(ev);
+	event_add(ev, NULL);
+#if defined(_EVENT_HAVE_SIGNALFD) && defined(_EVENT_HAVE_SYS_SIGNALFD_H)
+	/* With signalfd the signal waits, blocked, for us to read it. */
+	if (strcmp(event_base_get_method(base), "kqueue"))
+		tt_assert(signal_is_blocked(SIGUSR1));
+#endif
+
+	raise(SIGUSR1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, 1);
+
+	raise(SIGUSR1);
+	raise(SIGUSR1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, >=, 2);
+
+	/* Deleting the event puts the signal back the way it was. */
+	event_del(ev);
+	tt_assert(!signal_is_blocked(SIGUSR1));
+
+end:
+	if (ev)
+		event_free(ev);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+signal_del_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event *ev = arg;
+	if (++called == 2)
+		event_del(ev);
+}
+
+static void
+test_signal_del_in_callback(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event ev;
+
+	base = event_base_new();
+	tt_assert(base);
+	evsignal_assign(&ev, base, SIGUSR1, signal_del_cb, &ev);
+	event_add(&ev, NULL);
+
+	/* The signal arrived five times, but deleting the event from its
+	 * callback stops the rest of the calls. */
+	called = 0;
+	event_active(&ev, EV_SIGNAL, 5);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(called, ==, 2);
+	tt_assert(!event_pending(&ev, EV_SIGNAL, NULL));
+
+	/* Without the delete, every call happens. */
+	called = 10;
+	event_add(&ev, NULL);
+	event_active(&ev, EV_SIGNAL, 3);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(called, ==, 13);
+	event_del(&ev);
+
+end:
+	if (base)
+		event_base_free(base);
+}
 #endif
 
 static void
@@ -1341,6 +1444,58 @@ end:
 	evbuffer_free(tmp);
 }
 
+static void
+evtag_record_test(void)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	struct evbuffer *split = evbuffer_new();
+	u_char data[64];
+	ev_uint8_t *payload;
+	ev_uint32_t tag, len, integer;
+	char *string = NULL;
+	int i, n;
+
+	evtag_marshal_int(tmp, 0xdeadbeef, 0xcafebabe);
+	evtag_marshal_string(tmp, 1, "hello");
+
+	/* in one chain, the payload is found in place */
+	tt_int_op(evtag_peek_record(tmp, &tag, &len, &payload), ==, 6);
+	tt_uint_op(tag, ==, 0xdeadbeef);
+	tt_uint_op(len, ==, 5);
+	tt_assert(payload == EVBUFFER_DATA(tmp) + 6);
+
+	/* with every byte in a chain of its own, every number straddles
+	 * chains and has to be pulled up */
+	n = evbuffer_remove(tmp, data, sizeof(data));
+	for (i = 0; i < n; ++i)
+		evbuffer_add_reference(split, data + i, 1, NULL, NULL);
+	tt_int_op(evtag_peek_record(split, &tag, &len, NULL), ==, 6);
+	tt_uint_op(tag, ==, 0xdeadbeef);
+	tt_uint_op(len, ==, 5);
+	tt_int_op(evtag_unmarshal_int(split, 0xdeadbeef, &integer), ==, 5);
+	tt_uint_op(integer, ==, 0xcafebabe);
+	tt_int_op(evtag_peek_record(split, &tag, &len, &payload), ==, 2);
+	tt_uint_op(tag, ==, 1);
+	tt_assert(!memcmp(payload, "hello", 5));
+	tt_int_op(evtag_unmarshal_string(split, 1, &string), ==, 0);
+	tt_str_op(string, ==, "hello");
+	tt_int_op(EVBUFFER_LENGTH(split), ==, 0);
+
+	/* a record whose payload is not all there yet */
+	evtag_marshal_string(tmp, 1, "hello");
+	evbuffer_remove(tmp, data, 6);
+	evbuffer_add(split, data, 6);
+	tt_int_op(evtag_peek_record(split, &tag, &len, NULL), ==, -1);
+	tt_int_op(evtag_payload_length(split, &len), ==, 0);
+	tt_uint_op(len, ==, 5);
+
+end:
+	if (string)
+		free(string);
+	evbuffer_free(tmp);
+	evbuffer_free(split);
+}
+
 static void
 test_evtag(void)
 {
@@ -1348,6 +1503,7 @@ test_evtag(void)
 	evtag_int_test();
 	evtag_fuzz();
 	evtag_tag_encoding();
+	evtag_record_test();
         test_ok = 1;
 }
 
@@ -1444,6 +1600,12 @@ methodname_to_envvar(const char *mname, char *buf, size_t buflen)
 	char *cp;
 	evutil_snprintf(buf, buflen, "EVENT_NO%s", mname);
 	for (cp = buf; *cp; ++cp) {
+		/* Variants like "epoll (with changelist)" share the
+		 * environment variable of the underlying method. */
+		if (*cp == ' ') {
+			*cp = '\0';
+			break;
+		}
 		*cp = toupper(*cp);
 	}
 }
@@ -1467,7 +1629,7 @@ static void
 test_base_environ(void *arg)
 {
 	const char **basenames;
-	char varbuf[128];
+	char varbuf[128], varbuf2[128];
 	int i, n_methods=0;
 	struct event_base *base = NULL;
 	struct event_config *cfg = NULL;
@@ -1510,7 +1672,9 @@ test_base_environ(void *arg)
 	event_config_set_flag(cfg, EVENT_BASE_FLAG_IGNORE_ENV);
 	base = event_base_new_with_config(cfg);
 	tt_assert(base);
-	tt_str_op(defaultname, ==, event_base_get_method(base));
+	methodname_to_envvar(event_base_get_method(base), varbuf2,
+	    sizeof(varbuf2));
+	tt_str_op(varbuf, ==, varbuf2);
 
 end:
 	if (base)
@@ -1566,6 +1730,115 @@ end:
 	;
 }
 
+static void
+once_reuse_cb(int fd, short event, void *arg)
+{
+	called += 1;
+}
+
+static void
+test_event_once_freelist(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event_once *first;
+	int i, r;
+
+	called = 0;
+	tt_int_op(base->n_once_free, ==, 0);
+
+	/* A structure that's done with goes on the freelist... */
+	r = event_base_once(base, -1, EV_TIMEOUT, once_reuse_cb, NULL, NULL);
+	tt_int_op(r, ==, 0);
+	event_base_dispatch(base);
+	tt_int_op(called, ==, 1);
+	tt_int_op(base->n_once_free, ==, 1);
+	first = base->once_freelist;
+
+	/* ...and the next call takes it back. */
+	r = event_base_once(base, -1, EV_TIMEOUT, once_reuse_cb, NULL, NULL);
+	tt_int_op(r, ==, 0);
+	tt_int_op(base->n_once_free, ==, 0);
+	tt_assert(base->once_freelist == NULL);
+	event_base_dispatch(base);
+	tt_int_op(called, ==, 2);
+	tt_assert(base->once_freelist == first);
+
+	/* So does a failed call. */
+	r = event_base_once(base, -1, EV_SIGNAL, once_reuse_cb, NULL, NULL);
+	tt_int_op(r, <, 0);
+	tt_int_op(base->n_once_free, ==, 1);
+
+	/* The freelist doesn't grow without bound. */
+	for (i = 0; i < EVENT_ONCE_FREELIST_MAX + 10; ++i) {
+		r = event_base_once(base, -1, EV_TIMEOUT, once_reuse_cb,
+		    NULL, NULL);
+		tt_int_op(r, ==, 0);
+	}
+	event_base_dispatch(base);
+	tt_int_op(called, ==, 2 + EVENT_ONCE_FREELIST_MAX + 10);
+	tt_int_op(base->n_once_free, ==, EVENT_ONCE_FREELIST_MAX);
+end:
+	;
+}
+
+struct once_assign_ctx {
+	struct event ev;
+	struct event_base *base;
+	int n;
+};
+
+static void
+once_assign_cb(int fd, short event, void *arg)
+{
+	struct once_assign_ctx *ctx = arg;
+	struct timeval tv = { 0, 0 };
+
+	/* The storage is free for the next one-time event already. */
+	if (++ctx->n < 3)
+		event_base_once_assign(ctx->base, &ctx->ev, -1, EV_TIMEOUT,
+		    once_assign_cb, ctx, &tv);
+}
+
+static void
+test_event_once_assign(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct once_assign_ctx ctx;
+	struct event ev;
+	int r;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.base = data->base;
+	called = 0;
+
+	r = event_base_once_assign(data->base, &ctx.ev, -1, EV_TIMEOUT,
+	    once_assign_cb, &ctx, NULL);
+	tt_int_op(r, ==, 0);
+	r = event_base_once_assign(data->base, &ev, data->pair[0], EV_READ,
+	    read_called_once_cb, NULL, NULL);
+	tt_int_op(r, ==, 0);
+	r = event_base_once_assign(data->base, &ev, -1, EV_PERSIST,
+	    read_called_once_cb, NULL, NULL);
+	tt_int_op(r, <, 0);
+	r = event_base_once_assign(data->base, &ev, -1, 0,
+	    read_called_once_cb, NULL, NULL);
+	tt_int_op(r, <, 0);
+
+	write(data->pair[1], TEST1, strlen(TEST1)+1);
+	shutdown(data->pair[1], SHUT_WR);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(ctx.n, ==, 3);
+	tt_int_op(called, ==, 1);
+	tt_assert(!event_pending(&ev, EV_READ|EV_TIMEOUT, NULL));
+	/* Nothing went through event_base_once()'s freelist. */
+	tt_int_op(data->base->n_once_free, ==, 0);
+end:
+	;
+}
+
 static void
 test_event_pending(void *ptr)
 {
@@ -1614,92 +1887,1597 @@ end:
 	}
 }
 
-static int
-check_dummy_mem_ok(void *_mem)
+struct common_timeout_info {
+	struct event ev;
+	struct timeval called_at;
+	int which;
+	int count;
+};
+
+static void
+common_timeout_cb(int fd, short event, void *arg)
 {
-	char *mem = _mem;
-	mem -= 16;
-	return !memcmp(mem, "{[<guardedram>]}", 16);
+	struct common_timeout_info *ti = arg;
+	++ti->count;
+	evutil_gettimeofday(&ti->called_at, NULL);
+	if (ti->count >= 6)
+		event_del(&ti->ev);
 }
 
-static void *
-dummy_malloc(size_t len)
+static void
+test_common_timeout(void *ptr)
 {
-	char *mem = malloc(len+16);
-	memcpy(mem, "{[<guardedram>]}", 16);
-	return mem+16;
+	struct basic_test_data *data = ptr;
+
+	struct event_base *base = data->base;
+	int i;
+	struct common_timeout_info info[100];
+
+	struct timeval now;
+	struct timeval tmp_100_ms = { 0, 100*1000 };
+	struct timeval tmp_200_ms = { 0, 200*1000 };
+
+	const struct timeval *ms_100, *ms_200;
+
+	ms_100 = event_base_init_common_timeout(base, &tmp_100_ms);
+	ms_200 = event_base_init_common_timeout(base, &tmp_200_ms);
+	tt_assert(ms_100);
+	tt_assert(ms_200);
+	tt_assert(event_base_init_common_timeout(base, &tmp_200_ms) == ms_200);
+	tt_int_op(ms_100->tv_sec, ==, 0);
+	tt_int_op(ms_200->tv_sec, ==, 0);
+	tt_int_op(ms_100->tv_usec, ==, 100000|0x50000000);
+	tt_int_op(ms_200->tv_usec, ==, 200000|0x50100000);
+
+	memset(info, 0, sizeof(info));
+
+	for (i=0; i<100; ++i) {
+		info[i].which = i;
+		event_assign(&info[i].ev, base, -1, EV_TIMEOUT|EV_PERSIST,
+		    common_timeout_cb, &info[i]);
+		if (i % 2) {
+			event_add(&info[i].ev, ms_100);
+		} else {
+			event_add(&info[i].ev, ms_200);
+		}
+	}
+
+	event_base_dispatch(base);
+
+	evutil_gettimeofday(&now, NULL);
+
+	for (i=0; i<10; ++i) {
+		struct timeval tmp;
+		int ms_diff;
+		tt_int_op(info[i].count, ==, 6);
+		evutil_timersub(&now, &info[i].called_at, &tmp);
+		ms_diff = tmp.tv_usec/1000 + tmp.tv_sec*1000;
+		if (i % 2) {
+			tt_int_op(ms_diff, >, 500);
+			tt_int_op(ms_diff, <, 700);
+		} else {
+			tt_int_op(ms_diff, >, -100);
+			tt_int_op(ms_diff, <, 100);
+		}
+	}
+
+	/* Make sure we can free the base with some events in. */
+	for (i=0; i<100; ++i) {
+		if (i % 2) {
+			event_add(&info[i].ev, ms_100);
+		} else {
+			event_add(&info[i].ev, ms_200);
+		}
+	}
+
+	event_base_free(data->base);
+	data->base = NULL;
+end:
+	;
 }
 
-static void *
-dummy_realloc(void *_mem, size_t len)
+static int keyed_timeheap_order[8];
+static int keyed_timeheap_count;
+
+static void
+keyed_timeheap_cb(int fd, short event, void *arg)
 {
-	char *mem = _mem;
-	if (!mem)
-		return dummy_malloc(len);
-	tt_want(check_dummy_mem_ok(_mem));
-	mem -= 16;
-	mem = realloc(mem, len+16);
-	return mem+16;
+	keyed_timeheap_order[keyed_timeheap_count++] = (int)(long)arg;
 }
 
 static void
-dummy_free(void *_mem)
+test_keyed_timeheap(void *ptr)
 {
-	char *mem = _mem;
-	tt_want(check_dummy_mem_ok(_mem));
-	mem -= 16;
-	free(mem);
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev[8];
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_KEYED_TIMEHEAP);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	keyed_timeheap_count = 0;
+	for (i = 0; i < 8; ++i) {
+		/* Schedule them in the reverse of their firing order. */
+		struct timeval tv = { 0, (8 - i) * 10 * 1000 };
+		evtimer_assign(&ev[i], base, keyed_timeheap_cb, (void*)(long)i);
+		event_add(&ev[i], &tv);
+	}
+	/* Removing one from the middle shouldn't disturb the others. */
+	event_del(&ev[3]);
+
+	event_base_dispatch(base);
+
+	tt_int_op(keyed_timeheap_count, ==, 7);
+	tt_int_op(keyed_timeheap_order[0], ==, 7);
+	tt_int_op(keyed_timeheap_order[3], ==, 4);
+	tt_int_op(keyed_timeheap_order[4], ==, 2);
+	tt_int_op(keyed_timeheap_order[6], ==, 0);
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
 }
 
 static void
-test_mm_functions(void *arg)
+changelist_read_cb(int fd, short event, void *arg)
+{
+	char buf[64];
+	int *n_called = arg;
+	read(fd, buf, sizeof(buf));
+	++*n_called;
+}
+
+static void
+test_changelist(void *ptr)
 {
-	struct event_base *b = NULL;
 	struct event_config *cfg = NULL;
-	event_set_mem_functions(dummy_malloc, dummy_realloc, dummy_free);
+	struct event_base *base = NULL;
+	struct event *ev = NULL;
+	evutil_socket_t fds[2] = { -1, -1 };
+	evutil_socket_t old_fd;
+	int n_called = 0;
+
 	cfg = event_config_new();
-	event_config_avoid_method(cfg, "Nonesuch");
-	b = event_base_new_with_config(cfg);
-	tt_assert(b);
-	tt_assert(check_dummy_mem_ok(b));
+	tt_assert(cfg);
+	event_config_avoid_method(cfg, "kqueue");
+	event_config_avoid_method(cfg, "devpoll");
+	event_config_avoid_method(cfg, "evport");
+	event_config_avoid_method(cfg, "poll");
+	event_config_avoid_method(cfg, "select");
+	event_config_avoid_method(cfg, "io_uring");
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	base = event_base_new_with_config(cfg);
+	if (!base)
+		tt_skip();
+	tt_str_op(event_base_get_method(base), ==, "epoll (with changelist)");
+
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+	ev = event_new(base, fds[0], EV_READ|EV_PERSIST, changelist_read_cb,
+	    &n_called);
+
+	/* A delete and re-add between two dispatches must leave the fd
+	 * watched. */
+	event_add(ev, NULL);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_del(ev);
+	event_add(ev, NULL);
+	write(fds[1], "x", 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, 1);
+
+	/* An add followed by a delete should do nothing at all. */
+	event_del(ev);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_add(ev, NULL);
+	event_del(ev);
+	write(fds[1], "x", 1);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(n_called, ==, 1);
+
+	/* Close the fd while it's watched and reuse the same number before
+	 * the next dispatch: the new socket must get watched. */
+	event_add(ev, NULL);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(n_called, ==, 2);
+	event_del(ev);
+	old_fd = fds[0];
+	EVUTIL_CLOSESOCKET(fds[0]);
+	EVUTIL_CLOSESOCKET(fds[1]);
+	fds[0] = fds[1] = -1;
+	event_free(ev);
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+	if (fds[0] != old_fd && fds[1] == old_fd) {
+		evutil_socket_t tmp = fds[0];
+		fds[0] = fds[1];
+		fds[1] = tmp;
+	}
+	ev = event_new(base, fds[0], EV_READ|EV_PERSIST, changelist_read_cb,
+	    &n_called);
+	event_add(ev, NULL);
+	write(fds[1], "x", 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, 3);
+
 end:
+	if (ev)
+		event_free(ev);
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+	if (base)
+		event_base_free(base);
 	if (cfg)
 		event_config_free(cfg);
-	if (b)
-		event_base_free(b);
 }
 
-struct testcase_t main_testcases[] = {
-        /* Some converted-over tests */
-        { "methods", test_methods, TT_FORK, NULL, NULL },
-	{ "version", test_version, 0, NULL, NULL },
-	{ "base_features", test_base_features, TT_FORK, NULL, NULL },
-	{ "base_environ", test_base_environ, TT_FORK, NULL, NULL },
+static int dispatch_limit_n_bulk;
+static int dispatch_limit_bulk_at_read;
+static evutil_socket_t dispatch_limit_wfd;
 
-        /* These are still using the old API */
-        LEGACY(persistent_timeout, TT_FORK|TT_NEED_BASE),
-        LEGACY(priorities, TT_FORK|TT_NEED_BASE),
+static void
+dispatch_limit_bulk_cb(int fd, short event, void *arg)
+{
+	/* Make the socket readable partway through the burst. */
+	if (++dispatch_limit_n_bulk == 2 && dispatch_limit_wfd >= 0)
+		write(dispatch_limit_wfd, "x", 1);
+}
 
-        LEGACY(free_active_base, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
-        LEGACY(event_base_new, TT_FORK|TT_NEED_SOCKETPAIR),
+static void
+dispatch_limit_read_cb(int fd, short event, void *arg)
+{
+	char buf[16];
+	read(fd, buf, sizeof(buf));
+	dispatch_limit_bulk_at_read = dispatch_limit_n_bulk;
+}
 
-        /* These legacy tests may not all need all of these flags. */
-        LEGACY(simpleread, TT_ISOLATED),
-        LEGACY(simpleread_multiple, TT_ISOLATED),
-        LEGACY(simplewrite, TT_ISOLATED),
-        LEGACY(multiple, TT_ISOLATED),
-        LEGACY(persistent, TT_ISOLATED),
-        LEGACY(combined, TT_ISOLATED),
-        LEGACY(simpletimeout, TT_ISOLATED),
-        LEGACY(loopbreak, TT_ISOLATED),
-        LEGACY(loopexit, TT_ISOLATED),
-	LEGACY(loopexit_multiple, TT_ISOLATED),
-	LEGACY(nonpersist_readd, TT_ISOLATED),
-	LEGACY(multiple_events_for_same_fd, TT_ISOLATED),
-	LEGACY(want_only_once, TT_ISOLATED),
-	{ "event_once", test_event_once, TT_ISOLATED, &basic_setup, NULL },
-	{ "event_pending", test_event_pending, TT_ISOLATED, &basic_setup,
+#define IOURING_N_PAIRS 300
+
+static void
+iouring_count_cb(int fd, short event, void *arg)
+{
+	int *n_called = arg;
+	++*n_called;
+}
+
+static void
+test_iouring(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event *ev[IOURING_N_PAIRS];
+	evutil_socket_t fds[IOURING_N_PAIRS][2];
+	char buf[16];
+	int i, n_called = 0;
+
+	memset(ev, 0, sizeof(ev));
+	for (i = 0; i < IOURING_N_PAIRS; ++i)
+		fds[i][0] = fds[i][1] = -1;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_avoid_method(cfg, "kqueue");
+	event_config_avoid_method(cfg, "devpoll");
+	event_config_avoid_method(cfg, "evport");
+	event_config_avoid_method(cfg, "epoll");
+	event_config_avoid_method(cfg, "poll");
+	event_config_avoid_method(cfg, "select");
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_IGNORE_ENV);
+	base = event_base_new_with_config(cfg);
+	if (!base)
+		tt_skip();
+	tt_str_op(event_base_get_method(base), ==, "io_uring");
+
+	for (i = 0; i < IOURING_N_PAIRS; ++i) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]),
+		    ==, 0);
+		ev[i] = event_new(base, fds[i][0], EV_READ|EV_PERSIST,
+		    iouring_count_cb, &n_called);
+		event_add(ev[i], NULL);
+	}
+	/* Enough changes between dispatches to fill the submission queue
+	 * more than once. */
+	for (i = 0; i < IOURING_N_PAIRS; ++i) {
+		event_del(ev[i]);
+		event_add(ev[i], NULL);
+		event_del(ev[i]);
+		event_add(ev[i], NULL);
+	}
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(n_called, ==, 0);
+
+	for (i = 0; i < IOURING_N_PAIRS; i += 3)
+		write(fds[i][1], "x", 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, IOURING_N_PAIRS / 3);
+
+	/* Level-triggered: nobody read, so they all fire again. */
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, 2 * (IOURING_N_PAIRS / 3));
+
+	/* Once the data is gone, nothing fires. */
+	for (i = 0; i < IOURING_N_PAIRS; i += 3)
+		read(fds[i][0], buf, sizeof(buf));
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(n_called, ==, 2 * (IOURING_N_PAIRS / 3));
+
+	/* Deleted events stay quiet even though their fds are readable. */
+	for (i = 0; i < IOURING_N_PAIRS; ++i) {
+		if (i % 2)
+			event_del(ev[i]);
+		write(fds[i][1], "x", 1);
+	}
+	n_called = 0;
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_called, ==, IOURING_N_PAIRS / 2);
+
+end:
+	for (i = 0; i < IOURING_N_PAIRS; ++i) {
+		if (ev[i])
+			event_free(ev[i]);
+		if (fds[i][0] >= 0)
+			EVUTIL_CLOSESOCKET(fds[i][0]);
+		if (fds[i][1] >= 0)
+			EVUTIL_CLOSESOCKET(fds[i][1]);
+	}
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+test_dispatch_limits(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev[10], ev_read;
+	struct timeval tv = { 0, 0 };
+	evutil_socket_t fds[2] = { -1, -1 };
+	int i;
+
+	/* Callback limit on priority 1 only: the socket at priority 0 gets
+	 * looked at again after every 3 bulk callbacks. */
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, NULL, 3, 1),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	event_base_priority_init(base, 2);
+
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+	dispatch_limit_wfd = fds[1];
+	dispatch_limit_n_bulk = 0;
+	dispatch_limit_bulk_at_read = -1;
+
+	event_assign(&ev_read, base, fds[0], EV_READ, dispatch_limit_read_cb,
+	    NULL);
+	event_priority_set(&ev_read, 0);
+	event_add(&ev_read, NULL);
+	for (i = 0; i < 10; ++i) {
+		event_assign(&ev[i], base, -1, 0, dispatch_limit_bulk_cb, NULL);
+		event_priority_set(&ev[i], 1);
+		event_active(&ev[i], EV_TIMEOUT, 1);
+	}
+
+	event_base_dispatch(base);
+
+	tt_int_op(dispatch_limit_n_bulk, ==, 10);
+	tt_int_op(dispatch_limit_bulk_at_read, ==, 3);
+	/* Rounds of 3, 3, 3 and 1: three were cut short. */
+	tt_int_op(event_base_get_n_dispatch_limit_hits(base), ==, 3);
+
+	event_base_free(base);
+	event_config_free(cfg);
+	base = NULL;
+
+	/* A zero-length interval allows one callback per iteration. */
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_max_dispatch_interval(cfg, &tv, -1, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	dispatch_limit_wfd = -1;
+	dispatch_limit_n_bulk = 0;
+	for (i = 0; i < 5; ++i) {
+		event_assign(&ev[i], base, -1, 0, dispatch_limit_bulk_cb, NULL);
+		event_active(&ev[i], EV_TIMEOUT, 1);
+	}
+	event_base_dispatch(base);
+	tt_int_op(dispatch_limit_n_bulk, ==, 5);
+	tt_int_op(event_base_get_n_dispatch_limit_hits(base), ==, 4);
+
+	/* Without limits nothing is counted. */
+	event_base_free(base);
+	base = event_base_new();
+	tt_assert(base);
+	for (i = 0; i < 5; ++i) {
+		event_assign(&ev[i], base, -1, 0, dispatch_limit_bulk_cb, NULL);
+		event_active(&ev[i], EV_TIMEOUT, 1);
+	}
+	event_base_dispatch(base);
+	tt_int_op(dispatch_limit_n_bulk, ==, 10);
+	tt_int_op(event_base_get_n_dispatch_limit_hits(base), ==, 0);
+
+end:
+	if (fds[0] >= 0)
+		EVUTIL_CLOSESOCKET(fds[0]);
+	if (fds[1] >= 0)
+		EVUTIL_CLOSESOCKET(fds[1]);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static int precise_timer_n_left;
+
+static void
+precise_timer_cb(int fd, short event, void *arg)
+{
+	struct event *ev = arg;
+	struct timeval tv = { 0, 300 };
+
+	if (--precise_timer_n_left > 0)
+		event_add(ev, &tv);
+}
+
+static void
+test_precise_timer(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev;
+	struct timeval tv = { 0, 300 }, start, end, diff;
+	long msec;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	/* 50 timers of 300 usec, back to back.  Rounding each one up to a
+	 * millisecond would take 50 msec at least. */
+	precise_timer_n_left = 50;
+	evtimer_assign(&ev, base, precise_timer_cb, &ev);
+	evutil_gettimeofday(&start, NULL);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	tt_int_op(precise_timer_n_left, ==, 0);
+
+	evutil_timersub(&end, &start, &diff);
+	msec = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	TT_BLATHER(("50 300-usec timers took %ld msec with %s", msec,
+		event_base_get_method(base)));
+#if defined(_EVENT_HAVE_SYS_TIMERFD_H) && defined(_EVENT_HAVE_TIMERFD_CREATE)
+	if (!strncmp(event_base_get_method(base), "epoll", 5))
+		tt_int_op(msec, <, 50);
+#endif
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+timer_slack_cb(int fd, short event, void *arg)
+{
+	struct timeval *fired = arg;
+	evutil_gettimeofday(fired, NULL);
+}
+
+static void
+test_timer_slack(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev[5];
+	struct timeval fired[5], start, tv, slack = { 0, 100000 };
+	int i, n_loops = 0;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_timer_slack(cfg, &slack), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	/* Five timers 10 msec apart all fit in one slack, so at most two
+	 * wakeups, on either side of a multiple of the slack, fire them. */
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 5; ++i) {
+		tv.tv_sec = 0;
+		tv.tv_usec = (i + 1) * 10000;
+		evutil_timerclear(&fired[i]);
+		evtimer_assign(&ev[i], base, timer_slack_cb, &fired[i]);
+		event_add(&ev[i], &tv);
+	}
+	while (event_base_loop(base, EVLOOP_ONCE) == 0)
+		++n_loops;
+	tt_int_op(n_loops, <=, 2);
+
+	/* None fired early, or much more than the slack late. */
+	for (i = 0; i < 5; ++i) {
+		long msec;
+		evutil_timersub(&fired[i], &start, &tv);
+		msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		tt_int_op(msec, >=, (i + 1) * 10);
+		tt_int_op(msec, <, (i + 1) * 10 + 100 + 50);
+	}
+
+	/* Slack has to be a real interval. */
+	slack.tv_sec = -1;
+	tt_int_op(event_config_set_timer_slack(cfg, &slack), ==, -1);
+	tt_int_op(event_config_set_timer_slack(cfg, NULL), ==, 0);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+stats_sleep_cb(int fd, short event, void *arg)
+{
+	if (arg)
+		usleep(2000);
+}
+
+static void
+busy_poll_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	char buf[16];
+	int *n_read = arg;
+	if (read(fd, buf, sizeof(buf)) > 0)
+		++*n_read;
+}
+
+static void
+test_busy_poll(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event_base_stats st;
+	struct event timer, rev;
+	struct timeval spin = { 0, 30000 }, tv = { 0, 100000 };
+	struct timeval start, end, diff;
+	int n_read = 0;
+
+	/* Without a spin interval, a lone timer takes one iteration. */
+	tt_int_op(event_base_enable_stats(data->base, 1), ==, 0);
+	evtimer_assign(&timer, data->base, stats_sleep_cb, NULL);
+	event_add(&timer, &tv);
+	event_base_dispatch(data->base);
+	event_base_get_stats(data->base, &st);
+	tt_assert(st.n_iterations == 1);
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_busy_poll(cfg, &spin, -1), ==, -1);
+	tt_int_op(event_config_set_busy_poll(cfg, &spin, 50), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_int_op(event_base_enable_stats(base, 1), ==, 0);
+
+	/* With one, the loop polls many times before it blocks, and the
+	 * timer still fires on time. */
+	evtimer_assign(&timer, base, stats_sleep_cb, NULL);
+	event_add(&timer, &tv);
+	evutil_gettimeofday(&start, NULL);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &diff);
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_iterations > 10);
+	tt_assert(diff.tv_sec > 0 || diff.tv_usec >= 90000);
+	tt_assert(st.n_callbacks == 1);
+
+	/* Sockets still work when the base also asks for SO_BUSY_POLL. */
+	event_assign(&rev, base, data->pair[0], EV_READ|EV_PERSIST,
+	    busy_poll_read_cb, &n_read);
+	tt_int_op(event_add(&rev, NULL), ==, 0);
+	tt_int_op(write(data->pair[1], "x", 1), ==, 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_read, ==, 1);
+	event_del(&rev);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+struct slow_cb_report {
+	int n;
+	void *callback;
+	evutil_socket_t fd;
+	struct timeval duration;
+};
+
+static void
+slow_cb_hook(struct event_base *base, void *callback, evutil_socket_t fd,
+    const struct timeval *duration, void *arg)
+{
+	struct slow_cb_report *r = arg;
+	++r->n;
+	r->callback = callback;
+	r->fd = fd;
+	r->duration = *duration;
+}
+
+static void
+slow_cb_sleep(evutil_socket_t fd, short what, void *arg)
+{
+	usleep(*(int *)arg);
+}
+
+static void
+slow_deferred_sleep(struct deferred_cb *cb, void *arg)
+{
+	usleep(*(int *)arg);
+}
+
+static void
+test_slow_callback(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct slow_cb_report r;
+	struct deferred_cb dcb;
+	struct event ev;
+	struct timeval threshold = { 0, 30000 }, tv = { 0, 0 };
+	int fast = 0, slow = 60000;
+
+	memset(&r, 0, sizeof(r));
+	tt_int_op(event_base_set_slow_callback_cb(base, NULL, slow_cb_hook,
+		    &r), ==, -1);
+	tt_int_op(event_base_set_slow_callback_cb(base, &threshold,
+		    slow_cb_hook, &r), ==, 0);
+
+	/* Quick callbacks don't count. */
+	event_assign(&ev, base, data->pair[0], EV_READ, slow_cb_sleep, &fast);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(r.n, ==, 0);
+
+	/* A slow one does, and we hear which it was. */
+	event_assign(&ev, base, data->pair[0], EV_READ, slow_cb_sleep, &slow);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(r.n, ==, 1);
+	tt_assert(r.callback == (void *)slow_cb_sleep);
+	tt_int_op(r.fd, ==, data->pair[0]);
+	tt_assert(r.duration.tv_sec > 0 || r.duration.tv_usec >= 50000);
+
+	/* So does a slow deferred callback. */
+	event_deferred_cb_init(&dcb, slow_deferred_sleep, &slow);
+	event_deferred_cb_schedule(base, &dcb);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(r.n, ==, 2);
+	tt_assert(r.callback == (void *)slow_deferred_sleep);
+	tt_int_op(r.fd, ==, -1);
+
+	/* And once we stop asking, we stop hearing. */
+	tt_int_op(event_base_set_slow_callback_cb(base, NULL, NULL, NULL),
+	    ==, 0);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(r.n, ==, 2);
+
+end:
+	;
+}
+
+struct clock_source_check {
+	struct event_base *base;
+	struct timeval scheduled, fired, cached_tod, tod;
+};
+
+static void
+clock_source_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct clock_source_check *c = arg;
+	event_base_gettime_cached(c->base, &c->fired);
+	event_base_gettimeofday_cached(c->base, &c->cached_tod);
+	evutil_gettimeofday(&c->tod, NULL);
+}
+
+static void
+test_clock_source(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL, *dflt = NULL;
+	struct clock_source_check c;
+	struct event timer;
+	struct timeval tv = { 0, 50000 }, prev, now, ref, diff;
+	int source, i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_clock_source(cfg, -1), ==, -1);
+	tt_int_op(event_config_set_clock_source(cfg, 3), ==, -1);
+	dflt = event_base_new_with_config(cfg);
+	tt_assert(dflt);
+	tt_int_op(event_base_get_clock_source(dflt), ==, EVENT_CLOCK_DEFAULT);
+
+	for (source = EVENT_CLOCK_DEFAULT; source <= EVENT_CLOCK_TSC;
+	     ++source) {
+		tt_int_op(event_config_set_clock_source(cfg, source), ==, 0);
+		base = event_base_new_with_config(cfg);
+		tt_assert(base);
+		/* We get what we asked for, or the default. */
+		tt_assert(event_base_get_clock_source(base) == source ||
+		    event_base_get_clock_source(base) == EVENT_CLOCK_DEFAULT);
+
+		/* Outside the loop, every reading is fresh, never goes
+		 * backwards, and agrees with the default clock. */
+		event_base_gettime_cached(base, &prev);
+		for (i = 0; i < 1000; ++i) {
+			event_base_gettime_cached(base, &now);
+			tt_assert(evutil_timercmp(&now, &prev, >=));
+			prev = now;
+		}
+		event_base_gettime_cached(dflt, &ref);
+		if (evutil_timercmp(&now, &ref, >))
+			evutil_timersub(&now, &ref, &diff);
+		else
+			evutil_timersub(&ref, &now, &diff);
+		tt_int_op(diff.tv_sec, ==, 0);
+		tt_int_op(diff.tv_usec, <, 20000);
+
+		/* Timers fire on time by it. */
+		memset(&c, 0, sizeof(c));
+		c.base = base;
+		evtimer_assign(&timer, base, clock_source_timer_cb, &c);
+		event_base_gettime_cached(base, &c.scheduled);
+		evtimer_add(&timer, &tv);
+		event_base_dispatch(base);
+		tt_assert(evutil_timerisset(&c.fired));
+		evutil_timersub(&c.fired, &c.scheduled, &diff);
+		tt_int_op(diff.tv_sec, ==, 0);
+		tt_int_op(diff.tv_usec, >=, 50000);
+		tt_int_op(diff.tv_usec, <, 200000);
+
+		/* The cached time of day is close to the real one. */
+		if (evutil_timercmp(&c.tod, &c.cached_tod, >))
+			evutil_timersub(&c.tod, &c.cached_tod, &diff);
+		else
+			evutil_timersub(&c.cached_tod, &c.tod, &diff);
+		tt_int_op(diff.tv_sec, ==, 0);
+		tt_int_op(diff.tv_usec, <, 20000);
+
+		event_base_free(base);
+		base = NULL;
+	}
+
+end:
+	if (base)
+		event_base_free(base);
+	if (dflt)
+		event_base_free(dflt);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+test_cpu_affinity(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event timer;
+	struct timeval tv = { 0, 1000 };
+	FILE *f;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_cpu_affinity(cfg, -2, -1, 0), ==, -1);
+	tt_int_op(event_config_set_cpu_affinity(cfg, -1, -2, 0), ==, -1);
+
+	/* No such CPU or node: no base. */
+	tt_int_op(event_config_set_cpu_affinity(cfg, 1<<20, -1, 0), ==, 0);
+	tt_assert(event_base_new_with_config(cfg) == NULL);
+	tt_int_op(event_config_set_cpu_affinity(cfg, -1, 1<<20, 0), ==, 0);
+	tt_assert(event_base_new_with_config(cfg) == NULL);
+
+	/* Node 0 exists wherever there are NUMA nodes at all. */
+	if ((f = fopen("/sys/devices/system/node/node0/cpulist", "r")) == NULL) {
+		tt_skip();
+	}
+	fclose(f);
+
+	tt_int_op(event_config_set_cpu_affinity(cfg, -1, 0, 1), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_assert(base->loop_affinity);
+	tt_assert(!base->loop_affinity_bound);
+
+	evtimer_assign(&timer, base, stats_sleep_cb, NULL);
+	event_add(&timer, &tv);
+	event_base_dispatch(base);
+	tt_assert(base->loop_affinity_bound);
+	event_base_free(base);
+
+	/* Without bind_loop, only construction is placed. */
+	tt_int_op(event_config_set_cpu_affinity(cfg, -1, 0, 0), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_assert(base->loop_affinity == NULL);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+test_size_hints(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event ev[100];
+	struct timeval tv = { 1000, 0 };
+	void *heap;
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_size_hints(cfg, -1, 0), ==, -1);
+	tt_int_op(event_config_set_size_hints(cfg, 0, -1), ==, -1);
+	tt_int_op(event_config_set_size_hints(cfg, 5000, 100), ==, 0);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+#ifndef EVMAP_USE_HT
+	tt_int_op(base->io.nentries, >=, 5000);
+#endif
+	if (base->evsel->add == event_changelist_add)
+		tt_int_op(base->changelist.changes_size, >=, 5000);
+
+	/* The timer heap has room for all the timers up front. */
+	tt_int_op(base->timeheap.a, >=, 100);
+	heap = base->timeheap.keyed ? (void*)base->timeheap.k :
+	    (void*)base->timeheap.p;
+	for (i = 0; i < 100; ++i) {
+		evtimer_assign(&ev[i], base, stats_sleep_cb, NULL);
+		event_add(&ev[i], &tv);
+	}
+	tt_assert(heap == (base->timeheap.keyed ? (void*)base->timeheap.k :
+		(void*)base->timeheap.p));
+	for (i = 0; i < 100; ++i)
+		event_del(&ev[i]);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static void
+loop_timed_cb(evutil_socket_t fd, short what, void *arg)
+{
+	int *n = arg;
+	++*n;
+	usleep(10000);
+}
+
+static void
+test_loop_timed(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event ev[10], timer;
+	struct timeval budget = { 0, 35000 }, tv = { 10, 0 };
+	struct timeval start, end, diff;
+	int i, n = 0, r;
+
+	/* With nothing to do, we wait out the budget and no more. */
+	evtimer_assign(&timer, base, loop_timed_cb, &n);
+	event_add(&timer, &tv);
+	evutil_gettimeofday(&start, NULL);
+	r = event_base_loop_timed(base, &budget, 0);
+	evutil_gettimeofday(&end, NULL);
+	tt_int_op(r, ==, 0);
+	tt_int_op(n, ==, 0);
+	evutil_timersub(&end, &start, &diff);
+	tt_assert(diff.tv_sec == 0);
+	tt_int_op(diff.tv_usec, >=, 30000);
+	tt_int_op(diff.tv_usec, <, 500000);
+
+	/* Ten active 10-msec callbacks don't all fit in 35 msec; the rest
+	 * wait for the next call. */
+	for (i = 0; i < 10; ++i) {
+		event_assign(&ev[i], base, -1, 0, loop_timed_cb, &n);
+		event_active(&ev[i], EV_TIMEOUT, 1);
+	}
+	r = event_base_loop_timed(base, &budget, 0);
+	tt_int_op(r, ==, 0);
+	tt_int_op(n, >=, 1);
+	tt_int_op(n, <=, 5);
+	tt_int_op(base->event_count_active, ==, 10 - n);
+
+	/* A zero budget still polls and runs a callback. */
+	budget.tv_usec = 0;
+	i = n;
+	r = event_base_loop_timed(base, &budget, 0);
+	tt_int_op(r, ==, 0);
+	tt_int_op(n, ==, i + 1);
+
+	/* EVLOOP_ONCE still returns as soon as the active events are
+	 * done, well within a generous budget. */
+	budget.tv_sec = 10;
+	r = event_base_loop_timed(base, &budget, EVLOOP_ONCE);
+	tt_int_op(r, ==, 0);
+	tt_int_op(n, ==, 10);
+
+	budget.tv_usec = -1;
+	tt_int_op(event_base_loop_timed(base, &budget, 0), ==, -1);
+
+	event_del(&timer);
+end:
+	;
+}
+
+static void
+test_stats(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event_base_stats st;
+	struct event ev[5], timer;
+	struct timeval tv = { 0, 10000 };
+	int i, total;
+
+	/* Nothing is collected by default. */
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_iterations == 0);
+	evtimer_assign(&timer, base, stats_sleep_cb, NULL);
+	event_add(&timer, &tv);
+	event_base_dispatch(base);
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_iterations == 0);
+	tt_assert(st.n_callbacks == 0);
+
+	tt_int_op(event_base_enable_stats(base, 1), ==, 0);
+
+	/* One iteration that blocks for ~10 msec. */
+	event_add(&timer, &tv);
+	event_base_dispatch(base);
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_iterations == 1);
+	tt_assert(st.n_callbacks == 1);
+	tt_assert(st.n_active_total == 1);
+	tt_int_op(st.max_active_per_iteration, ==, 1);
+	tt_assert(st.time_in_dispatch.tv_sec > 0 ||
+	    st.time_in_dispatch.tv_usec >= 5000);
+
+	/* Five callbacks at once, one of which is slow. */
+	event_base_reset_stats(base);
+	for (i = 0; i < 5; ++i) {
+		event_assign(&ev[i], base, -1, 0, stats_sleep_cb,
+		    i == 0 ? &ev[i] : NULL);
+		event_active(&ev[i], EV_TIMEOUT, 1);
+	}
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_callbacks == 5);
+	tt_int_op(st.max_active_per_iteration, ==, 5);
+	tt_assert(st.time_in_callbacks.tv_sec > 0 ||
+	    st.time_in_callbacks.tv_usec >= 2000);
+	total = 0;
+	for (i = 0; i < EVENT_STATS_HISTOGRAM_SIZE; ++i)
+		total += (int)st.callback_usec_histogram[i];
+	tt_int_op(total, ==, 5);
+	/* 2000 usec or more lands in bucket 11 or above. */
+	total = 0;
+	for (i = 11; i < EVENT_STATS_HISTOGRAM_SIZE; ++i)
+		total += (int)st.callback_usec_histogram[i];
+	tt_int_op(total, >=, 1);
+
+	/* Turning it off stops collection. */
+	event_base_enable_stats(base, 0);
+	event_active(&ev[1], EV_TIMEOUT, 1);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_base_get_stats(base, &st);
+	tt_assert(st.n_callbacks == 5);
+end:
+	;
+}
+
+static void
+evmap_count_cb(evutil_socket_t fd, short what, void *arg)
+{
+	int *count = arg;
+	++*count;
+}
+
+struct deferred_order_ctx {
+	struct event_base *base;
+	struct deferred_cb cbs[4];
+	/* Which callbacks ran, each followed by the loop iteration it ran
+	 * in. */
+	char order[16];
+	int n;
+};
+
+static void
+deferred_order_cb(struct deferred_cb *cb, void *arg)
+{
+	struct deferred_order_ctx *ctx = arg;
+	struct event_base_stats st;
+	int idx = cb - ctx->cbs;
+
+	event_base_get_stats(ctx->base, &st);
+	ctx->order[ctx->n++] = 'a' + idx;
+	ctx->order[ctx->n++] = '0' + (int)st.n_iterations;
+	if (idx == 0 && ctx->n == 2) {
+		/* Deferred from inside a round: these wait for the next one,
+		 * behind anything the current round doesn't get to. */
+		event_deferred_cb_schedule(ctx->base, &ctx->cbs[3]);
+		event_deferred_cb_schedule(ctx->base, &ctx->cbs[0]);
+		/* Cancelling works on callbacks that the round has taken
+		 * but not yet run. */
+		event_deferred_cb_cancel(ctx->base, &ctx->cbs[1]);
+	}
+}
+
+static void
+test_deferred_order(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct deferred_order_ctx ctx;
+	int i, limit;
+
+	for (limit = 0; limit < 2; ++limit) {
+		cfg = event_config_new();
+		tt_assert(cfg);
+		if (limit)
+			event_config_set_max_dispatch_interval(cfg, NULL, 1, 0);
+		base = event_base_new_with_config(cfg);
+		tt_assert(base);
+
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.base = base;
+		for (i = 0; i < 4; ++i)
+			event_deferred_cb_init(&ctx.cbs[i], deferred_order_cb,
+			    &ctx);
+		for (i = 0; i < 3; ++i)
+			event_deferred_cb_schedule(base, &ctx.cbs[i]);
+
+		event_base_enable_stats(base, 1);
+
+		event_base_loop(base, EVLOOP_NONBLOCK);
+		if (limit)
+			tt_str_op(ctx.order, ==, "a1c2d3a4");
+		else
+			tt_str_op(ctx.order, ==, "a1c1d2a2");
+		tt_assert(!ctx.cbs[0].queued && !ctx.cbs[1].queued);
+
+		event_base_free(base);
+		base = NULL;
+		event_config_free(cfg);
+		cfg = NULL;
+	}
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+struct deferred_prio_ctx {
+	struct event_base *base;
+	struct deferred_cb cbs[5];
+	/* Which callbacks ran, each followed by the loop iteration it ran
+	 * in; 'x' is the active event. */
+	char order[32];
+	int n;
+};
+
+static void
+deferred_prio_note(struct deferred_prio_ctx *ctx, char what)
+{
+	struct event_base_stats st;
+
+	event_base_get_stats(ctx->base, &st);
+	ctx->order[ctx->n++] = what;
+	ctx->order[ctx->n++] = '0' + (int)st.n_iterations;
+}
+
+static void
+deferred_prio_cb(struct deferred_cb *cb, void *arg)
+{
+	struct deferred_prio_ctx *ctx = arg;
+	deferred_prio_note(ctx, 'a' + (cb - ctx->cbs));
+}
+
+static void
+deferred_prio_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+	deferred_prio_note(arg, 'x');
+}
+
+static void
+test_deferred_priority(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event *ev = NULL;
+	struct deferred_prio_ctx ctx;
+	static const int weights[3] = { 1, 1, 1 };
+	int i, weighted;
+
+	for (weighted = 0; weighted < 2; ++weighted) {
+		base = event_base_new();
+		tt_assert(base);
+		tt_int_op(event_base_priority_init(base, 3), ==, 0);
+		if (weighted)
+			tt_int_op(event_base_priority_set_weights(base,
+				weights, 3), ==, 0);
+
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.base = base;
+		for (i = 0; i < 5; ++i)
+			event_deferred_cb_init(&ctx.cbs[i], deferred_prio_cb,
+			    &ctx);
+		/* Low-priority bulk, queued first. */
+		for (i = 0; i < 3; ++i) {
+			event_deferred_cb_set_priority(base, &ctx.cbs[i], 2);
+			event_deferred_cb_schedule(base, &ctx.cbs[i]);
+		}
+		/* Moved up to the highest priority after it was queued. */
+		event_deferred_cb_schedule(base, &ctx.cbs[3]);
+		event_deferred_cb_set_priority(base, &ctx.cbs[3], 0);
+		/* The default priority, after an active event there. */
+		ev = event_new(base, -1, 0, deferred_prio_event_cb, &ctx);
+		tt_assert(ev);
+		tt_int_op(event_priority_set(ev, 1), ==, 0);
+		event_active(ev, EV_TIMEOUT, 1);
+		event_deferred_cb_schedule(base, &ctx.cbs[4]);
+
+		event_base_enable_stats(base, 1);
+		event_base_loop(base, EVLOOP_NONBLOCK);
+		if (weighted)
+			tt_str_op(ctx.order, ==, "d1x1a1e2b2c3");
+		else
+			tt_str_op(ctx.order, ==, "d1x2e2a3b3c3");
+
+		event_free(ev);
+		ev = NULL;
+		event_base_free(base);
+		base = NULL;
+	}
+
+end:
+	if (ev)
+		event_free(ev);
+	if (base)
+		event_base_free(base);
+}
+
+struct weights_ctx {
+	struct event *hi, *lo;
+	char order[32];
+	int n;
+	int n_hi_left;
+};
+
+static void
+weights_hi_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct weights_ctx *ctx = arg;
+	ctx->order[ctx->n++] = 'h';
+	if (--ctx->n_hi_left > 0)
+		event_active(ctx->hi, EV_READ, 1);
+}
+
+static void
+weights_lo_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct weights_ctx *ctx = arg;
+	ctx->order[ctx->n++] = 'l';
+	if (ctx->n < 9)
+		event_active(ctx->lo, EV_READ, 1);
+	else
+		event_base_loopbreak(event_get_base(ctx->lo));
+}
+
+static void
+test_priority_weights(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct weights_ctx ctx;
+	int weights[3] = { 2, 1, 1 };
+
+	memset(&ctx, 0, sizeof(ctx));
+	base = event_base_new();
+	tt_assert(base);
+	tt_int_op(event_base_priority_init(base, 2), ==, 0);
+	ctx.hi = event_new(base, -1, 0, weights_hi_cb, &ctx);
+	ctx.lo = event_new(base, -1, 0, weights_lo_cb, &ctx);
+	event_priority_set(ctx.hi, 0);
+	event_priority_set(ctx.lo, 1);
+
+	/* Bad weights are refused. */
+	tt_int_op(event_base_priority_set_weights(base, weights, 3), ==, -1);
+	weights[1] = 0;
+	tt_int_op(event_base_priority_set_weights(base, weights, 2), ==, -1);
+	weights[1] = 1;
+
+	/* With strict priorities, the busy high priority goes until it is
+	 * done. */
+	ctx.n_hi_left = 5;
+	event_active(ctx.hi, EV_READ, 1);
+	event_active(ctx.lo, EV_READ, 1);
+	event_base_dispatch(base);
+	tt_str_op(ctx.order, ==, "hhhhhllll");
+
+	/* With weights, the low priority gets a turn on every pass. */
+	memset(ctx.order, 0, sizeof(ctx.order));
+	ctx.n = 0;
+	ctx.n_hi_left = 100;
+	tt_int_op(event_base_priority_set_weights(base, weights, 2), ==, 0);
+	event_active(ctx.hi, EV_READ, 1);
+	event_active(ctx.lo, EV_READ, 1);
+	event_base_dispatch(base);
+	tt_str_op(ctx.order, ==, "hhlhhlhhl");
+
+	/* Changing the number of priorities clears the weights. */
+	event_del(ctx.hi);
+	event_del(ctx.lo);
+	tt_int_op(event_base_priority_init(base, 3), ==, 0);
+	tt_int_op(event_base_priority_set_weights(base, weights, 2), ==, -1);
+	tt_int_op(event_base_priority_set_weights(base, weights, 3), ==, 0);
+	tt_int_op(event_base_priority_set_weights(base, NULL, 0), ==, 0);
+
+end:
+	if (ctx.hi)
+		event_free(ctx.hi);
+	if (ctx.lo)
+		event_free(ctx.lo);
+	if (base)
+		event_base_free(base);
+}
+
+static void
+test_evmap_fd_events(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base;
+	struct event *ev[3] = { NULL, NULL, NULL };
+	int count[3] = { 0, 0, 0 };
+	int i;
+
+	/* Go from one event on an fd to several and back, making sure the
+	 * right ones keep firing at each step. */
+	for (i = 0; i < 3; ++i) {
+		ev[i] = event_new(base, data->pair[0], EV_READ|EV_PERSIST,
+		    evmap_count_cb, &count[i]);
+		tt_assert(ev[i]);
+	}
+	write(data->pair[1], "x", 1);
+
+	event_add(ev[0], NULL);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 1);
+
+	event_add(ev[1], NULL);
+	event_add(ev[2], NULL);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 2);
+	tt_int_op(count[1], ==, 1);
+	tt_int_op(count[2], ==, 1);
+
+	event_del(ev[1]);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 3);
+	tt_int_op(count[1], ==, 1);
+	tt_int_op(count[2], ==, 2);
+
+	event_del(ev[0]);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 3);
+	tt_int_op(count[2], ==, 3);
+
+	event_del(ev[2]);
+	event_add(ev[1], NULL);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[1], ==, 2);
+	tt_int_op(count[2], ==, 3);
+
+end:
+	for (i = 0; i < 3; ++i)
+		if (ev[i])
+			event_free(ev[i]);
+}
+
+static void
+test_event_add_many(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = data->base, *other = NULL;
+	struct event *ev[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
+	struct event *mixed[2] = { NULL, NULL };
+	struct timeval tv = { 10, 0 };
+	int count[6] = { 0, 0, 0, 0, 0, 0 };
+	int i;
+
+	/* A reader and a writer on one fd, and four timers. */
+	ev[0] = event_new(base, data->pair[0], EV_READ|EV_PERSIST,
+	    evmap_count_cb, &count[0]);
+	ev[1] = event_new(base, data->pair[0], EV_WRITE|EV_PERSIST,
+	    evmap_count_cb, &count[1]);
+	for (i = 2; i < 6; ++i)
+		ev[i] = evtimer_new(base, evmap_count_cb, &count[i]);
+	for (i = 0; i < 6; ++i)
+		tt_assert(ev[i]);
+
+	tt_int_op(event_add_many(ev, 6, &tv), ==, 0);
+	for (i = 0; i < 6; ++i)
+		tt_assert(event_pending(ev[i], EV_TIMEOUT, NULL));
+	write(data->pair[1], "x", 1);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 1);
+	tt_int_op(count[1], ==, 1);
+
+	tt_int_op(event_del_many(ev, 6), ==, 0);
+	for (i = 0; i < 6; ++i)
+		tt_assert(!event_pending(ev[i], EV_READ|EV_WRITE|EV_TIMEOUT,
+			NULL));
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(count[0], ==, 1);
+	tt_int_op(count[1], ==, 1);
+
+	/* Events from two bases are refused, and none get added. */
+	other = event_base_new();
+	tt_assert(other);
+	mixed[0] = ev[2];
+	mixed[1] = evtimer_new(other, evmap_count_cb, NULL);
+	tt_assert(mixed[1]);
+	tt_int_op(event_add_many(mixed, 2, &tv), ==, -1);
+	tt_int_op(event_del_many(mixed, 2), ==, -1);
+	tt_assert(!event_pending(mixed[0], EV_TIMEOUT, NULL));
+	tt_assert(!event_pending(mixed[1], EV_TIMEOUT, NULL));
+	tt_int_op(event_add_many(ev, 0, NULL), ==, 0);
+
+end:
+	for (i = 0; i < 6; ++i)
+		if (ev[i])
+			event_free(ev[i]);
+	if (mixed[1])
+		event_free(mixed[1]);
+	if (other)
+		event_base_free(other);
+}
+
+static void
+test_object_pool(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct event_base_pool_stats st;
+	struct evbuffer *buf = NULL;
+	struct event *ev[10];
+	struct timeval tv = { 0, 0 };
+	char data[512];
+	int i;
+
+	/* Bases don't get a pool unless they ask for one. */
+	base = event_base_new();
+	tt_int_op(event_base_get_pool_stats(base, &st), ==, -1);
+	event_base_free(base);
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_OBJECT_POOL);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	tt_int_op(event_base_get_pool_stats(base, &st), ==, 0);
+	tt_int_op(st.n_classes, >=, 1);
+	tt_assert(st.classes[0].object_size >= sizeof(struct event));
+	tt_assert(st.classes[0].n_in_use == 0);
+
+	for (i = 0; i < 10; ++i) {
+		ev[i] = event_new(base, -1, 0, NULL, NULL);
+		tt_assert(ev[i]);
+	}
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use, ==, 10);
+	tt_assert(st.classes[0].n_allocs == 10);
+	tt_assert(st.classes[0].n_slabs == 1);
+	tt_assert(st.classes[0].n_objects >= 10);
+
+	/* Freed events go back to the pool and get reused. */
+	for (i = 0; i < 10; ++i)
+		event_free(ev[i]);
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use, ==, 0);
+	for (i = 0; i < 10; ++i)
+		ev[i] = event_new(base, -1, 0, NULL, NULL);
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use, ==, 10);
+	tt_assert(st.classes[0].n_slabs == 1);
+	for (i = 0; i < 10; ++i)
+		event_free(ev[i]);
+
+	/* event_base_once uses the pool too. */
+	event_base_once(base, -1, EV_TIMEOUT, stats_sleep_cb, NULL, &tv);
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use, ==, 1);
+	event_base_dispatch(base);
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use, ==, 0);
+
+	/* So do evbuffers that ask for it. */
+	buf = evbuffer_new();
+	tt_assert(buf);
+	tt_int_op(evbuffer_use_base_pool(buf, base), ==, 0);
+	memset(data, 'x', sizeof(data));
+	evbuffer_add(buf, data, sizeof(data));
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use + st.classes[1].n_in_use +
+	    st.classes[2].n_in_use + st.classes[3].n_in_use, ==, 1);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+	evbuffer_drain(buf, sizeof(data));
+	event_base_get_pool_stats(base, &st);
+	tt_int_op(st.classes[0].n_in_use + st.classes[1].n_in_use +
+	    st.classes[2].n_in_use + st.classes[3].n_in_use, ==, 0);
+
+	/* Too big for any class: falls back to the heap. */
+	evbuffer_expand(buf, 100000);
+	event_base_get_pool_stats(base, &st);
+	tt_assert(st.n_unpooled == 1);
+
+	/* Chains from the pool may outlive the base. */
+	evbuffer_add(buf, data, sizeof(data));
+	event_base_free(base);
+	base = NULL;
+	evbuffer_add(buf, data, sizeof(data));
+	tt_int_op(evbuffer_get_length(buf), ==, 2 * sizeof(data));
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+static int
+check_dummy_mem_ok(void *_mem)
+{
+	char *mem = _mem;
+	mem -= 16;
+	return !memcmp(mem, "{[<guardedram>]}", 16);
+}
+
+static void *
+dummy_malloc(size_t len)
+{
+	char *mem = malloc(len+16);
+	memcpy(mem, "{[<guardedram>]}", 16);
+	return mem+16;
+}
+
+static void *
+dummy_realloc(void *_mem, size_t len)
+{
+	char *mem = _mem;
+	if (!mem)
+		return dummy_malloc(len);
+	tt_want(check_dummy_mem_ok(_mem));
+	mem -= 16;
+	mem = realloc(mem, len+16);
+	return mem+16;
+}
+
+static void
+dummy_free(void *_mem)
+{
+	char *mem = _mem;
+	tt_want(check_dummy_mem_ok(_mem));
+	mem -= 16;
+	free(mem);
+}
+
+static void
+test_mm_functions(void *arg)
+{
+	struct event_base *b = NULL;
+	struct event_config *cfg = NULL;
+	event_set_mem_functions(dummy_malloc, dummy_realloc, dummy_free);
+	cfg = event_config_new();
+	event_config_avoid_method(cfg, "Nonesuch");
+	b = event_base_new_with_config(cfg);
+	tt_assert(b);
+	tt_assert(check_dummy_mem_ok(b));
+end:
+	if (cfg)
+		event_config_free(cfg);
+	if (b)
+		event_base_free(b);
+}
+
+struct testcase_t main_testcases[] = {
+        /* Some converted-over tests */
+        { "methods", test_methods, TT_FORK, NULL, NULL },
+	{ "version", test_version, 0, NULL, NULL },
+	{ "base_features", test_base_features, TT_FORK, NULL, NULL },
+	{ "base_environ", test_base_environ, TT_FORK, NULL, NULL },
+
+        /* These are still using the old API */
+        LEGACY(persistent_timeout, TT_FORK|TT_NEED_BASE),
+        LEGACY(priorities, TT_FORK|TT_NEED_BASE),
+
+        LEGACY(free_active_base, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
+        LEGACY(event_base_new, TT_FORK|TT_NEED_SOCKETPAIR),
+
+        /* These legacy tests may not all need all of these flags. */
+        LEGACY(simpleread, TT_ISOLATED),
+        LEGACY(simpleread_multiple, TT_ISOLATED),
+        LEGACY(simplewrite, TT_ISOLATED),
+        LEGACY(multiple, TT_ISOLATED),
+        LEGACY(persistent, TT_ISOLATED),
+        LEGACY(combined, TT_ISOLATED),
+        LEGACY(simpletimeout, TT_ISOLATED),
+        LEGACY(loopbreak, TT_ISOLATED),
+        LEGACY(loopexit, TT_ISOLATED),
+	LEGACY(loopexit_multiple, TT_ISOLATED),
+	LEGACY(nonpersist_readd, TT_ISOLATED),
+	LEGACY(multiple_events_for_same_fd, TT_ISOLATED),
+	LEGACY(want_only_once, TT_ISOLATED),
+	{ "event_once", test_event_once, TT_ISOLATED, &basic_setup, NULL },
+	{ "event_once_freelist", test_event_once_freelist, TT_ISOLATED,
+	  &basic_setup, NULL },
+	{ "event_once_assign", test_event_once_assign, TT_ISOLATED,
+	  &basic_setup, NULL },
+	{ "event_pending", test_event_pending, TT_ISOLATED, &basic_setup,
+	  NULL },
+	{ "common_timeout", test_common_timeout, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "keyed_timeheap", test_keyed_timeheap, TT_FORK, NULL, NULL },
+#ifndef WIN32
+	{ "changelist", test_changelist, TT_FORK, NULL, NULL },
+	{ "io_uring", test_iouring, TT_FORK, NULL, NULL },
+#endif
+	{ "dispatch_limits", test_dispatch_limits, TT_FORK, NULL, NULL },
+	{ "precise_timer", test_precise_timer, TT_FORK, NULL, NULL },
+	{ "timer_slack", test_timer_slack, TT_FORK, NULL, NULL },
+	{ "stats", test_stats, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "busy_poll", test_busy_poll,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "slow_callback", test_slow_callback,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "clock_source", test_clock_source, TT_FORK, NULL, NULL },
+	{ "cpu_affinity", test_cpu_affinity, TT_FORK, NULL, NULL },
+	{ "size_hints", test_size_hints, TT_FORK, NULL, NULL },
+	{ "loop_timed", test_loop_timed, TT_FORK|TT_NEED_BASE, &basic_setup,
 	  NULL },
+	{ "priority_weights", test_priority_weights, TT_FORK, NULL, NULL },
+	{ "deferred_order", test_deferred_order, TT_FORK, NULL, NULL },
+	{ "deferred_priority", test_deferred_priority, TT_FORK, NULL, NULL },
+	{ "evmap_fd_events", test_evmap_fd_events,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "event_add_many", test_event_add_many,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "object_pool", test_object_pool, TT_FORK, NULL, NULL },
 	{ "mm_functions", test_mm_functions, TT_FORK, NULL, NULL },
 
 #ifndef WIN32
@@ -1722,6 +3500,9 @@ struct testcase_t signal_testcases[] = {
 	LEGACY(signal_restore, TT_ISOLATED),
 	LEGACY(signal_assert, TT_ISOLATED),
 	LEGACY(signal_while_processing, TT_ISOLATED),
+	{ "signalfd", test_signalfd, TT_FORK, NULL, NULL },
+	{ "signal_del_in_callback", test_signal_del_in_callback, TT_FORK,
+	  NULL, NULL },
 #endif
         END_OF_TESTCASES
 };
@@ -45,8 +45,19 @@ extern struct testcase_t rpc_testcases[];
 extern struct testcase_t edgetriggered_testcases[];
 extern struct testcase_t minheap_testcases[];
 extern struct testcase_t iocp_testcases[];
+extern struct testcase_t ssl_testcases[];
 
 void regress_threads(void *);
+void regress_base_group(void *);
+void regress_workqueue(void *);
+void regress_lock_profiling(void *);
+void regress_rwlocks(void *);
+void regress_log_drainer(void *);
+void regress_watchdog(void *);
+void regress_xthread_active(void *);
+void regress_deferred_xthread(void *);
+void regress_evbuffer_spsc(void *);
+void regress_bufferevent_pair_xthread(void *);
 void test_bufferevent_zlib(void *);
 
 /* Helpers to wrap old testcases */
@@ -46,6 +46,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -401,8 +402,551 @@ test_evbuffer_add_file(void *ptr)
 	EVUTIL_CLOSESOCKET(pair[1]);
 	evbuffer_free(src);
 }
+
+static void
+test_evbuffer_file_segment(void *ptr)
+{
+	const char *data = "this is what we add to two buffers from one file.";
+	struct evbuffer *bufs[2] = { NULL, NULL };
+	struct evbuffer *dst = NULL;
+	struct evbuffer_file_segment *seg = NULL;
+	evutil_socket_t pair[2] = { -1, -1 };
+	const char *compare;
+	size_t len;
+	/* sendfile if we have it, then mmap, then memory */
+	static const unsigned modes[3] = {
+		0, EVBUF_FS_DISABLE_SENDFILE,
+		EVBUF_FS_DISABLE_SENDFILE|EVBUF_FS_DISABLE_MMAP
+	};
+	int fd = -1, i, mode;
+
+	for (mode = 0; mode < 3; ++mode) {
+		fd = regress_make_tmpfile(data, strlen(data));
+		tt_assert(fd != -1);
+		seg = evbuffer_file_segment_new(fd, 5, -1,
+		    EVBUF_FS_CLOSE_ON_FREE | modes[mode]);
+		tt_assert(seg);
+		tt_int_op(seg->length, ==, strlen(data) - 5);
+
+		for (i = 0; i < 2; ++i) {
+			bufs[i] = evbuffer_new();
+			tt_assert(bufs[i]);
+			tt_int_op(evbuffer_add_file_segment(bufs[i], seg, 0,
+				seg->length + 1), ==, -1);
+			tt_int_op(evbuffer_add_file_segment(bufs[i], seg,
+				i * 8, -1), ==, 0);
+			evbuffer_validate(bufs[i]);
+		}
+		/* Both buffers share the segment's one copy of the file. */
+		tt_int_op(seg->refcnt, ==, 3);
+		if (mode) {
+			tt_assert(!seg->can_sendfile);
+			tt_assert(bufs[0]->first->buffer ==
+			    bufs[1]->first->buffer);
+		}
+		evbuffer_file_segment_free(seg);
+		tt_int_op(seg->refcnt, ==, 2);
+
+		for (i = 0; i < 2; ++i) {
+			len = strlen(data) - 5 - i * 8;
+			tt_int_op(evbuffer_get_length(bufs[i]), ==, len);
+			if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0,
+				pair) == -1)
+				tt_abort_msg("socketpair failed");
+			while (evbuffer_get_length(bufs[i]))
+				tt_assert(evbuffer_write(bufs[i], pair[0]) > 0);
+			dst = evbuffer_new();
+			tt_assert(dst);
+			tt_int_op(evbuffer_read(dst, pair[1], len), ==, len);
+			compare = (char *)evbuffer_pullup(dst, len);
+			tt_assert(compare != NULL);
+			tt_assert(!memcmp(compare, data + 5 + i * 8, len));
+			evbuffer_free(dst);
+			dst = NULL;
+			EVUTIL_CLOSESOCKET(pair[0]);
+			EVUTIL_CLOSESOCKET(pair[1]);
+			pair[0] = pair[1] = -1;
+			if (i == 0) {
+				/* The other buffer still needs it. */
+				tt_int_op(seg->refcnt, ==, 1);
+				tt_int_op(fcntl(fd, F_GETFD), !=, -1);
+			}
+		}
+		/* Draining the last of its data released the segment. */
+		seg = NULL;
+		tt_int_op(fcntl(fd, F_GETFD), ==, -1);
+		fd = -1;
+		for (i = 0; i < 2; ++i) {
+			evbuffer_free(bufs[i]);
+			bufs[i] = NULL;
+		}
+	}
+
+ end:
+	if (pair[0] != -1)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] != -1)
+		EVUTIL_CLOSESOCKET(pair[1]);
+	if (dst)
+		evbuffer_free(dst);
+	for (i = 0; i < 2; ++i) {
+		if (bufs[i])
+			evbuffer_free(bufs[i]);
+	}
+	if (seg)
+		evbuffer_file_segment_free(seg);
+}
+
+/* Count the chains in buf that hold data. */
+static int
+count_full_chains(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	int n = 0;
+	for (chain = buf->first; chain; chain = chain->next)
+		if (chain->off)
+			++n;
+	return n;
+}
+
+static void
+test_evbuffer_adaptive_read(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	evutil_socket_t pair[2] = { -1, -1 };
+	static char data[1 << 20];
+	size_t written = 0, used = 0;
+	int i, n, max_chains = 0;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = i % 253;
+
+	tt_int_op(evbuffer_set_adaptive_read(buf, 1), ==, 0);
+	tt_int_op(buf->read_estimate, ==, 4096);
+
+	/* A streaming peer: every read fills its space, so reads grow. */
+	for (i = 0; i < 40 && used < sizeof(data); ++i) {
+		while (written < sizeof(data)) {
+			n = write(pair[0], data + written,
+			    sizeof(data) - written);
+			if (n <= 0)
+				break;
+			written += n;
+		}
+		n = evbuffer_read(buf, pair[1], -1);
+		if (n == -1 && EVUTIL_ERR_RW_RETRIABLE(errno))
+			continue;
+		tt_int_op(n, >, 0);
+		evbuffer_validate(buf);
+		if (count_full_chains(buf) > max_chains)
+			max_chains = count_full_chains(buf);
+		tt_assert(!memcmp(evbuffer_pullup(buf, -1), data + used, n));
+		used += n;
+		evbuffer_drain(buf, n);
+	}
+	tt_int_op(buf->read_estimate, >, 64 * 1024);
+	tt_int_op(buf->read_estimate, <=, EVBUFFER_ADAPTIVE_READ_MAX);
+	tt_int_op(max_chains, >, 2);
+
+	/* Empty the socket before the small reads. */
+	while ((n = evbuffer_read(buf, pair[1], -1)) > 0)
+		evbuffer_drain(buf, n);
+
+	/* RPC-sized traffic: the short reads bring the size back down. */
+	for (i = 0; i < 40; ++i) {
+		tt_int_op(write(pair[0], "ping", 4), ==, 4);
+		tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 4);
+		evbuffer_validate(buf);
+		tt_int_op(count_full_chains(buf), ==, 1);
+		evbuffer_drain(buf, 4);
+	}
+	tt_int_op(buf->read_estimate, ==, EVBUFFER_ADAPTIVE_READ_MIN);
+
+	/* A caller's limit holds, and doesn't count as a full read. */
+	tt_int_op(write(pair[0], data, 4000), ==, 4000);
+	tt_int_op(evbuffer_read(buf, pair[1], 700), ==, 700);
+	tt_int_op(buf->read_estimate, ==, EVBUFFER_ADAPTIVE_READ_MIN);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 1024);
+	tt_int_op(evbuffer_get_length(buf), ==, 1724);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), data, 1724));
+	evbuffer_validate(buf);
+
+ end:
+	if (pair[0] != -1) {
+		EVUTIL_CLOSESOCKET(pair[0]);
+		EVUTIL_CLOSESOCKET(pair[1]);
+	}
+	evbuffer_free(buf);
+}
+
+/* Count the bytes in buf that are held in memory. */
+static size_t
+count_mem_bytes(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	size_t n = 0;
+	for (chain = buf->first; chain; chain = chain->next)
+		if (!(chain->flags & EVBUFFER_SPILL))
+			n += chain->off;
+	return n;
+}
+
+static void
+test_evbuffer_spill(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	evutil_socket_t pair[2] = { -1, -1 };
+	static char data[100000], out[100000];
+	struct evbuffer_chain *chain;
+	size_t got = 0;
+	int i, n, n_spill = 0;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (i / 1000) + (i % 7);
+
+	if (evbuffer_set_spill(buf, 4096, NULL) == -1)
+		tt_skip();
+
+	/* Nothing spills until there is more than the threshold. */
+	tt_int_op(evbuffer_add(buf, data, 4000), ==, 0);
+	tt_int_op(count_mem_bytes(buf), ==, 4000);
+	for (i = 4; i < 100; ++i) {
+		tt_int_op(evbuffer_add(buf, data + i * 1000, 1000), ==, 0);
+		evbuffer_validate(buf);
+		/* the head stays in memory, and at most a batch after it */
+		tt_int_op(count_mem_bytes(buf), <=, 4096 + 4096 + 1000);
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+	tt_int_op(count_mem_bytes(buf), <, 10000);
+	for (chain = buf->first; chain; chain = chain->next)
+		if (chain->flags & EVBUFFER_SPILL)
+			++n_spill;
+	tt_int_op(n_spill, >=, 1);
+	tt_int_op(n_spill, <, 30);
+
+	/* What comes out the other end is what went in, in order. */
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	while (evbuffer_get_length(buf) || got < sizeof(out)) {
+		if (evbuffer_get_length(buf)) {
+			n = evbuffer_write(buf, pair[0]);
+			tt_assert(n > 0 || EVUTIL_ERR_RW_RETRIABLE(errno));
+			evbuffer_validate(buf);
+		}
+		n = read(pair[1], out + got, sizeof(out) - got);
+		tt_assert(n > 0 || EVUTIL_ERR_RW_RETRIABLE(errno));
+		if (n > 0)
+			got += n;
+	}
+	tt_int_op(got, ==, sizeof(data));
+	tt_assert(!memcmp(out, data, sizeof(data)));
+
+	/* With the file data gone, the buffer is usable as before. */
+	tt_int_op(evbuffer_add(buf, "hello", 5), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 5);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), "hello", 5));
+	evbuffer_validate(buf);
+
+ end:
+	if (pair[0] != -1) {
+		EVUTIL_CLOSESOCKET(pair[0]);
+		EVUTIL_CLOSESOCKET(pair[1]);
+	}
+	evbuffer_free(buf);
+}
+
+static void
+test_evbuffer_read_splice(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *dst = evbuffer_new();
+	char data[10000], out[10000];
+	evutil_socket_t in[2] = { -1, -1 }, fwd[2] = { -1, -1 };
+	int i, n, total;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, in) == -1 ||
+	    evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fwd) == -1)
+		tt_abort_msg("socketpair failed");
+	evutil_make_socket_nonblocking(in[1]);
+	evutil_make_socket_nonblocking(fwd[0]);
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = i * 7;
+	tt_int_op(write(in[0], data, 6000), ==, 6000);
+
+	/* read in two goes, so the second one adds to the same pipe */
+	tt_int_op(evbuffer_read_splice(src, in[1], 1000), ==, 1000);
+	tt_int_op(evbuffer_read_splice(src, in[1], -1), ==, 5000);
+	tt_int_op(evbuffer_read_splice(src, in[1], -1), ==, -1);
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_length(src), ==, 6000);
+#if defined(_EVENT_HAVE_SPLICE) && defined(__linux__)
+	tt_assert(src->first == src->last);
+	tt_assert(src->first->flags & EVBUFFER_SPLICE);
 #endif
 
+	/* drained bytes must not come out the other end */
+	evbuffer_drain(src, 100);
+	evbuffer_validate(src);
+	tt_int_op(evbuffer_get_length(src), ==, 5900);
+
+	/* moving the chain keeps the data in the pipe */
+	evbuffer_add_buffer(dst, src);
+	tt_int_op(evbuffer_get_length(src), ==, 0);
+	tt_int_op(evbuffer_add(dst, "xyz", 3), ==, 0);
+	evbuffer_validate(dst);
+
+	total = 0;
+	while (evbuffer_get_length(dst)) {
+		n = evbuffer_write_atmost(dst, fwd[0], 2000);
+		tt_assert(n > 0);
+		evbuffer_validate(dst);
+		n = read(fwd[1], out + total, sizeof(out) - total);
+		tt_assert(n > 0);
+		total += n;
+	}
+	tt_int_op(total, ==, 5903);
+	tt_assert(!memcmp(out, data + 100, 5900));
+	tt_assert(!memcmp(out + 5900, "xyz", 3));
+
+ end:
+	if (in[0] != -1) {
+		EVUTIL_CLOSESOCKET(in[0]);
+		EVUTIL_CLOSESOCKET(in[1]);
+	}
+	if (fwd[0] != -1) {
+		EVUTIL_CLOSESOCKET(fwd[0]);
+		EVUTIL_CLOSESOCKET(fwd[1]);
+	}
+	evbuffer_free(src);
+	evbuffer_free(dst);
+}
+#endif
+
+struct mem_group_state {
+	int n_over, n_under;
+};
+
+static void
+mem_group_cb(struct evbuffer_mem_group *group, int over, void *arg)
+{
+	struct mem_group_state *st = arg;
+	if (over)
+		++st->n_over;
+	else
+		++st->n_under;
+}
+
+static void
+test_evbuffer_mem_group(void *ptr)
+{
+	struct evbuffer *a = evbuffer_new(), *b = evbuffer_new();
+	struct evbuffer_mem_group *group = NULL;
+	struct mem_group_state st = { 0, 0 };
+	static char data[6000];
+	size_t total = evbuffer_get_total_allocated();
+
+	tt_assert(!evbuffer_mem_group_new(100, 200, NULL, NULL));
+	group = evbuffer_mem_group_new(4096, 1024, mem_group_cb, &st);
+	tt_assert(group);
+	tt_int_op(evbuffer_set_mem_group(a, group), ==, 0);
+
+	/* Chains are charged for what they take, headers included. */
+	evbuffer_add(a, data, 1000);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), >, 1000);
+	tt_int_op(evbuffer_get_total_allocated(), >=,
+	    total + evbuffer_mem_group_get_allocated(group));
+	tt_assert(!evbuffer_mem_group_is_over(group));
+	tt_int_op(st.n_over, ==, 0);
+
+	evbuffer_add(a, data, 5000);
+	tt_assert(evbuffer_mem_group_is_over(group));
+	tt_int_op(st.n_over, ==, 1);
+	tt_int_op(st.n_under, ==, 0);
+
+	/* Moving the chains out of the group takes their charge along. */
+	evbuffer_add_buffer(b, a);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), ==, 0);
+	tt_assert(!evbuffer_mem_group_is_over(group));
+	tt_int_op(st.n_under, ==, 1);
+
+	/* So does putting a buffer in the group. */
+	tt_int_op(evbuffer_set_mem_group(b, group), ==, 0);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), >, 6000);
+	tt_int_op(st.n_over, ==, 2);
+
+	/* Draining down to the low threshold, not below high, clears it. */
+	evbuffer_drain(b, 3000);
+	tt_assert(evbuffer_mem_group_is_over(group));
+	evbuffer_drain(b, 3000);
+	tt_assert(!evbuffer_mem_group_is_over(group));
+	tt_int_op(st.n_under, ==, 2);
+
+	/* The group outlives evbuffer_mem_group_free() while a is in it,
+	 * but says nothing more. */
+	evbuffer_add(a, data, 6000);
+	evbuffer_mem_group_free(group);
+	group = NULL;
+	evbuffer_drain(a, 6000);
+	tt_int_op(st.n_over, ==, 3);
+	tt_int_op(st.n_under, ==, 2);
+
+	evbuffer_free(a);
+	evbuffer_free(b);
+	a = b = NULL;
+	tt_int_op(evbuffer_get_total_allocated(), ==, total);
+
+ end:
+	if (group)
+		evbuffer_mem_group_free(group);
+	if (a)
+		evbuffer_free(a);
+	if (b)
+		evbuffer_free(b);
+}
+
+static void
+test_evbuffer_add_int(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char expect[128];
+	int i;
+
+#define CHECK_ADD(call, str) do {					\
+		evbuffer_drain(buf, evbuffer_get_length(buf));		\
+		tt_int_op((call), ==, (int)strlen(str));		\
+		tt_int_op(evbuffer_get_length(buf), ==, strlen(str));	\
+		tt_assert(!memcmp(evbuffer_pullup(buf, -1), (str),	\
+			strlen(str)));					\
+	} while (0)
+
+	CHECK_ADD(evbuffer_add_uint(buf, 0), "0");
+	CHECK_ADD(evbuffer_add_uint(buf, 9), "9");
+	CHECK_ADD(evbuffer_add_uint(buf, 10), "10");
+	CHECK_ADD(evbuffer_add_uint(buf, ~(ev_uint64_t)0),
+	    "18446744073709551615");
+	CHECK_ADD(evbuffer_add_int(buf, -1), "-1");
+	CHECK_ADD(evbuffer_add_int(buf, 200), "200");
+	CHECK_ADD(evbuffer_add_int(buf,
+		-(ev_int64_t)(~(ev_uint64_t)0 >> 1) - 1),
+	    "-9223372036854775808");
+	CHECK_ADD(evbuffer_add_hex(buf, 0), "0");
+	CHECK_ADD(evbuffer_add_hex(buf, 0xdeadbeef), "deadbeef");
+	CHECK_ADD(evbuffer_add_hex(buf, ~(ev_uint64_t)0), "ffffffffffffffff");
+	CHECK_ADD(evbuffer_add_fixed(buf, 12345, 2), "123.45");
+	CHECK_ADD(evbuffer_add_fixed(buf, -1234, 3), "-1.234");
+	CHECK_ADD(evbuffer_add_fixed(buf, 5, 2), "0.05");
+	CHECK_ADD(evbuffer_add_fixed(buf, -5, 3), "-0.005");
+	CHECK_ADD(evbuffer_add_fixed(buf, 0, 1), "0.0");
+	CHECK_ADD(evbuffer_add_fixed(buf, 42, 0), "42");
+	tt_int_op(evbuffer_add_fixed(buf, 1, 20), ==, -1);
+	tt_int_op(evbuffer_add_fixed(buf, 1, -1), ==, -1);
+#undef CHECK_ADD
+
+	/* Appending goes after what is there, across chains, and agrees
+	 * with printf. */
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	for (i = 0; i < 2000; ++i) {
+		tt_int_op(evbuffer_add_int(buf, i * 7919 - 5000000), >, 0);
+		evbuffer_add(buf, " ", 1);
+		tt_int_op(evbuffer_add_hex(buf, (unsigned)i * 40503u), >, 0);
+		evbuffer_add(buf, "\n", 1);
+	}
+	evbuffer_validate(buf);
+	for (i = 0; i < 2000; ++i) {
+		char *line = evbuffer_readln(buf, NULL, EVBUFFER_EOL_LF);
+		tt_assert(line);
+		evutil_snprintf(expect, sizeof(expect), "%d %x",
+		    i * 7919 - 5000000, (unsigned)i * 40503u);
+		tt_str_op(line, ==, expect);
+		free(line);
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	/* A frozen end refuses. */
+	evbuffer_freeze(buf, 0);
+	tt_int_op(evbuffer_add_uint(buf, 1), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+ end:
+	evbuffer_free(buf);
+}
+
+static int
+count_chains(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	int n = 0;
+	for (chain = buf->first; chain; chain = chain->next)
+		++n;
+	return n;
+}
+
+static void
+test_evbuffer_coalesce(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *tmp = evbuffer_new();
+	evutil_socket_t pair[2] = { -1, -1 };
+	static char data[300 * 20], out[300 * 20];
+	size_t total, got = 0;
+	int i, n;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = i % 251;
+
+	/* Lots of tiny chains go out in one writev(). */
+	for (i = 0; i < 300; ++i)
+		evbuffer_add_reference(buf, data + i * 20, 20, NULL, NULL);
+	tt_int_op(count_chains(buf), >=, 300);
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair failed");
+	n = evbuffer_write(buf, pair[0]);
+	tt_int_op(n, ==, sizeof(data));
+	evbuffer_validate(buf);
+	while (got < sizeof(out)) {
+		n = read(pair[1], out + got, sizeof(out) - got);
+		tt_int_op(n, >, 0);
+		got += n;
+	}
+	tt_assert(!memcmp(out, data, sizeof(data)));
+
+	/* Shrinking gives back what draining left behind. */
+	for (i = 0; i < 10; ++i)
+		evbuffer_add(tmp, data, sizeof(data));
+	evbuffer_add(buf, evbuffer_pullup(tmp, -1), 10 * sizeof(data));
+	evbuffer_drain(tmp, 10 * sizeof(data));
+	evbuffer_drain(buf, 9 * sizeof(data) + 1000);
+	total = evbuffer_get_total_allocated();
+	tt_int_op(evbuffer_shrink(buf), ==, 0);
+	evbuffer_validate(buf);
+	tt_int_op(evbuffer_get_total_allocated(), <=, total - 32768);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data) - 1000);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), data + 1000,
+		sizeof(data) - 1000));
+	/* An empty buffer holds nothing afterwards. */
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	tt_int_op(evbuffer_shrink(buf), ==, 0);
+	evbuffer_validate(buf);
+	tt_assert(buf->first == NULL);
+	tt_int_op(evbuffer_add(buf, "x", 1), ==, 0);
+	evbuffer_validate(buf);
+
+ end:
+	if (pair[0] != -1) {
+		EVUTIL_CLOSESOCKET(pair[0]);
+		EVUTIL_CLOSESOCKET(pair[1]);
+	}
+	evbuffer_free(buf);
+	evbuffer_free(tmp);
+}
+
 static void
 test_evbuffer_readln(void *ptr)
 {
@@ -737,6 +1281,113 @@ end:
 		evbuffer_free(tmp);
 }
 
+/* Append each string to buf as a chain of its own. */
+static void
+add_chains(struct evbuffer *buf, const char **parts)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	for (; *parts; ++parts) {
+		evbuffer_add(tmp, *parts, strlen(*parts));
+		evbuffer_add_buffer(buf, tmp);
+	}
+	evbuffer_free(tmp);
+}
+
+static void
+test_evbuffer_search_chains(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_ptr pos;
+	char needle[40], hay[120];
+	const char *parts[] = { "GET / HTTP/1.1\r", "\nHost: x\r\nContent-Le",
+				"ngth: 12\r", "\n\r", "\n", NULL };
+	const char *lines[] = { "GET / HTTP/1.1", "Host: x",
+				"Content-Length: 12", "", NULL };
+	unsigned char *p, *first_chain;
+	size_t sz, len;
+	char *cp;
+	int i, j;
+
+	add_chains(buf, parts);
+	evbuffer_validate(buf);
+
+	/* a needle that runs over three chains */
+	pos = evbuffer_search(buf, "x\r\nContent-Length: 1", 20, NULL);
+	tt_int_op(pos.pos, ==, 22);
+	pos = evbuffer_search(buf, "\r\n\r\n", 4, NULL);
+	tt_int_op(pos.pos, ==, 43);
+	pos = evbuffer_search(buf, "\r\n\r\n!", 5, NULL);
+	tt_int_op(pos.pos, ==, -1);
+
+	/* a match that fits in one chain comes back without a pullup */
+	first_chain = evbuffer_pullup(buf, 1);
+	p = evbuffer_find(buf, (unsigned char *)"HTTP", 4);
+	tt_assert(p == first_chain + 6);
+	tt_int_op(evbuffer_get_contiguous_space(buf), ==, 15);
+	/* one that straddles two chains gets made contiguous */
+	p = evbuffer_find(buf, (unsigned char *)"Length", 6);
+	tt_assert(p);
+	tt_assert(!memcmp(p, "Length", 6));
+
+	/* line ends split over chains, in every style */
+	for (i = 0; lines[i]; ++i) {
+		cp = evbuffer_readln(buf, &sz, EVBUFFER_EOL_CRLF_STRICT);
+		tt_assert(cp);
+		tt_str_op(cp, ==, lines[i]);
+		tt_int_op(sz, ==, strlen(lines[i]));
+		free(cp);
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	add_chains(buf, parts);
+	for (i = 0; lines[i]; ++i) {
+		cp = evbuffer_readln(buf, &sz, EVBUFFER_EOL_CRLF);
+		tt_assert(cp);
+		tt_str_op(cp, ==, lines[i]);
+		free(cp);
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	add_chains(buf, parts);
+	cp = evbuffer_readln(buf, &sz, EVBUFFER_EOL_ANY);
+	tt_str_op(cp, ==, "GET / HTTP/1.1");
+	free(cp);
+	cp = evbuffer_readln(buf, &sz, EVBUFFER_EOL_ANY);
+	tt_str_op(cp, ==, "Host: x");
+	free(cp);
+	cp = evbuffer_readln(buf, &sz, EVBUFFER_EOL_ANY);
+	tt_str_op(cp, ==, "Content-Length: 12");
+	free(cp);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_assert(evbuffer_readln(buf, &sz, EVBUFFER_EOL_ANY) == NULL);
+
+	/* Put a needle at every offset of a long chain, so that the vector
+	 * loop, its tail, and the chain boundary all get a turn. */
+	for (i = 0; i < (int)sizeof(needle); ++i)
+		needle[i] = 'A' + i % 26;
+	for (len = 1; len <= sizeof(needle); len = len * 2 + 1) {
+		for (i = 0; i < (int)sizeof(hay); ++i) {
+			memset(hay, '-', sizeof(hay));
+			memcpy(hay + i, needle, len > sizeof(hay) - i ?
+			    sizeof(hay) - i : len);
+			for (j = 63; j < 66; ++j) {
+				evbuffer_drain(buf, evbuffer_get_length(buf));
+				evbuffer_add(buf, hay, j);
+				evbuffer_add_reference(buf, hay + j,
+				    sizeof(hay) - j, NULL, NULL);
+				pos = evbuffer_search(buf, needle, len, NULL);
+				if (i + len <= sizeof(hay))
+					tt_int_op(pos.pos, ==, i);
+				else
+					tt_int_op(pos.pos, ==, -1);
+			}
+		}
+	}
+
+end:
+	evbuffer_free(buf);
+}
+
 static void
 log_change_callback(struct evbuffer *buffer,
     const struct evbuffer_cb_info *cbinfo,
@@ -834,6 +1485,55 @@ test_evbuffer_callbacks(void *ptr)
 		evbuffer_free(buf_out2);
 }
 
+static void
+test_evbuffer_threshold_callbacks(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *buf_out = evbuffer_new();
+	struct evbuffer_cb_entry *cb;
+
+	/* Only crossings of the 10-byte mark should get logged. */
+	cb = evbuffer_add_threshold_cb(buf, 10, log_change_callback, buf_out);
+	tt_assert(cb);
+	evbuffer_add(buf, "abcd", 4); /* 0->4 */
+	evbuffer_add(buf, "efgh", 4); /* 4->8 */
+	evbuffer_add(buf, "ijkl", 4); /* 8->12 */
+	evbuffer_add(buf, "mnop", 4); /* 12->16 */
+	evbuffer_drain(buf, 6); /* 16->10 */
+	evbuffer_drain(buf, 1); /* 10->9 */
+	evbuffer_drain(buf, 9); /* 9->0 */
+	tt_str_op(evbuffer_pullup(buf_out, -1), ==, "8->12; 10->9; ");
+	evbuffer_drain(buf_out, evbuffer_get_length(buf_out));
+
+	/* Moving the threshold doesn't count as a crossing. */
+	evbuffer_add(buf, "abcdef", 6); /* 0->6 */
+	tt_int_op(evbuffer_cb_set_threshold(buf, cb, 4), ==, 0);
+	evbuffer_add(buf, "g", 1); /* 6->7 */
+	evbuffer_drain(buf, 3); /* 7->4 */
+	evbuffer_drain(buf, 1); /* 4->3 */
+	tt_str_op(evbuffer_pullup(buf_out, -1), ==, "4->3; ");
+	evbuffer_drain(buf_out, evbuffer_get_length(buf_out));
+
+	/* Crossings made while disabled are forgotten on re-enable. */
+	evbuffer_cb_clear_flags(buf, cb, EVBUFFER_CB_ENABLED);
+	evbuffer_add(buf, "hij", 3); /* 3->6 */
+	evbuffer_cb_set_flags(buf, cb, EVBUFFER_CB_ENABLED);
+	evbuffer_add(buf, "k", 1); /* 6->7 */
+	evbuffer_drain(buf, 7); /* 7->0 */
+	tt_str_op(evbuffer_pullup(buf_out, -1), ==, "7->0; ");
+
+	/* Only threshold callbacks have a threshold to set. */
+	evbuffer_remove_cb_entry(buf, cb);
+	cb = evbuffer_add_cb(buf, log_change_callback, buf_out);
+	tt_int_op(evbuffer_cb_set_threshold(buf, cb, 4), ==, -1);
+
+ end:
+	if (buf)
+		evbuffer_free(buf);
+	if (buf_out)
+		evbuffer_free(buf_out);
+}
+
 static int ref_done_cb_called_count = 0;
 static void *ref_done_cb_called_with = NULL;
 static const void *ref_done_cb_called_with_data = NULL;
@@ -1166,6 +1866,198 @@ end:
 		evbuffer_free(tmp_buf);
 }
 
+static void
+test_evbuffer_add_buffer_reference(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new();
+	struct evbuffer *dst[3] = { NULL, NULL, NULL };
+	struct evbuffer_chain *chain;
+	char data[8192], out[8192];
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); ++i)
+		data[i] = i & 0xff;
+	evbuffer_add(src, data, sizeof(data));
+	for (i = 0; i < 3; ++i) {
+		dst[i] = evbuffer_new();
+		tt_int_op(evbuffer_add_buffer_reference(dst[i], src), ==, 0);
+		tt_int_op(evbuffer_get_length(dst[i]), ==, sizeof(data));
+	}
+	/* Nothing was removed or copied. */
+	tt_int_op(evbuffer_get_length(src), ==, sizeof(data));
+	chain = src->first;
+	tt_assert(dst[0]->first->buffer == chain->buffer);
+	tt_int_op(chain->refcnt, ==, 4);
+	tt_assert(chain->flags & EVBUFFER_IMMUTABLE);
+
+	/* Adding to the source doesn't touch the shared memory. */
+	evbuffer_add(src, "abc", 3);
+	tt_assert(src->last != chain);
+	tt_int_op(evbuffer_get_length(dst[0]), ==, sizeof(data));
+
+	/* Each reader drains at its own pace. */
+	tt_int_op(evbuffer_remove(dst[0], out, 100), ==, 100);
+	tt_assert(!memcmp(out, data, 100));
+	tt_int_op(evbuffer_remove(dst[1], out, sizeof(out)), ==, sizeof(data));
+	tt_assert(!memcmp(out, data, sizeof(data)));
+	tt_int_op(chain->refcnt, ==, 3);
+
+	/* The source may go away while others still share its data. */
+	evbuffer_free(src);
+	src = NULL;
+	tt_int_op(evbuffer_remove(dst[0], out, sizeof(out)), ==,
+	    sizeof(data) - 100);
+	tt_assert(!memcmp(out, data + 100, sizeof(data) - 100));
+
+	/* A sharing buffer can be added to as usual, and pulled up. */
+	evbuffer_add(dst[2], "tail", 4);
+	tt_int_op(evbuffer_get_length(dst[2]), ==, sizeof(data) + 4);
+	tt_assert(!memcmp(evbuffer_pullup(dst[2], -1), data, sizeof(data)));
+	tt_assert(!memcmp(evbuffer_pullup(dst[2], -1) + sizeof(data),
+		"tail", 4));
+
+	/* Sharing with yourself makes no sense. */
+	tt_int_op(evbuffer_add_buffer_reference(dst[2], dst[2]), ==, -1);
+
+end:
+	if (src)
+		evbuffer_free(src);
+	for (i = 0; i < 3; ++i)
+		if (dst[i])
+			evbuffer_free(dst[i]);
+}
+
+static void
+test_evbuffer_chain_cache(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new(), *bufs[8];
+	struct evbuffer_chain *chain;
+	char data[100];
+	int i;
+
+	memset(data, 'x', sizeof(data));
+	memset(bufs, 0, sizeof(bufs));
+	tt_assert(buf);
+	/* The cache is off unless we ask for it. */
+	evbuffer_add(buf, data, sizeof(data));
+	evbuffer_drain(buf, sizeof(data));
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 0);
+	if (evbuffer_set_chain_cache_limit(256*1024) < 0)
+		tt_skip();
+
+	/* A drained chain goes into the cache... */
+	evbuffer_add(buf, data, sizeof(data));
+	chain = buf->first;
+	tt_assert(chain);
+	evbuffer_drain(buf, sizeof(data));
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, MIN_BUFFER_SIZE);
+
+	/* ...and comes back out for the next chain of its size. */
+	evbuffer_add(buf, data, sizeof(data));
+	tt_assert(buf->first == chain);
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 0);
+
+	/* Bigger chains get a class of their own. */
+	evbuffer_expand(buf, 3000);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	tt_int_op(evbuffer_get_chain_cache_size(), >, MIN_BUFFER_SIZE);
+	tt_int_op(evbuffer_trim_chain_cache(0), >, MIN_BUFFER_SIZE);
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 0);
+
+	/* The cache never holds more than its limit. */
+	tt_int_op(evbuffer_set_chain_cache_limit(2 * MIN_BUFFER_SIZE), ==, 0);
+	for (i = 0; i < 8; ++i) {
+		bufs[i] = evbuffer_new();
+		evbuffer_add(bufs[i], data, sizeof(data));
+	}
+	for (i = 0; i < 8; ++i) {
+		evbuffer_free(bufs[i]);
+		bufs[i] = NULL;
+	}
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 2 * MIN_BUFFER_SIZE);
+
+	/* Lowering the limit trims, and 0 turns caching off. */
+	tt_int_op(evbuffer_set_chain_cache_limit(0), ==, 0);
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 0);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	tt_int_op(evbuffer_get_chain_cache_size(), ==, 0);
+
+end:
+	for (i = 0; i < 8; ++i)
+		if (bufs[i])
+			evbuffer_free(bufs[i]);
+	if (buf)
+		evbuffer_free(buf);
+	evbuffer_set_chain_cache_limit(0);
+}
+
+static void
+test_evbuffer_huge_chains(void *ptr)
+{
+	struct evbuffer *bufs[9];
+	struct evbuffer_chain *chain;
+	const size_t big = 300*1024;
+	char *data = NULL;
+	size_t i;
+
+	memset(bufs, 0, sizeof(bufs));
+	if (evbuffer_set_huge_chain_limit(4*1024*1024) < 0)
+		tt_skip();
+	tt_assert(data = malloc(big));
+	for (i = 0; i < big; ++i)
+		data[i] = (char)(i * 7);
+	tt_int_op(evbuffer_get_huge_chain_mapped(), ==, 0);
+
+	/* Small chains come from the heap as ever. */
+	tt_assert(bufs[0] = evbuffer_new());
+	evbuffer_add(bufs[0], data, 100);
+	tt_assert(!(bufs[0]->first->flags & EVBUFFER_HUGE));
+	tt_int_op(evbuffer_get_huge_chain_mapped(), ==, 0);
+	evbuffer_free(bufs[0]);
+
+	/* A big one comes from a huge page region, and works like any
+	 * other. */
+	tt_assert(bufs[0] = evbuffer_new());
+	evbuffer_add(bufs[0], data, big);
+	chain = bufs[0]->first;
+	tt_assert(chain->flags & EVBUFFER_HUGE);
+	tt_int_op(chain->mem_len, ==, 512*1024);
+	tt_int_op((size_t)chain % (2*1024*1024), ==, 0);
+	tt_int_op(evbuffer_get_huge_chain_mapped(), ==, 2*1024*1024);
+	tt_assert(!memcmp(evbuffer_pullup(bufs[0], -1), data, big));
+
+	/* Once freed, it's the next one handed out. */
+	evbuffer_free(bufs[0]);
+	tt_assert(bufs[0] = evbuffer_new());
+	evbuffer_add(bufs[0], data, big);
+	tt_assert(bufs[0]->first == chain);
+
+	/* A region holds four of them, and we map no more than the
+	 * limit. */
+	for (i = 1; i < 9; ++i) {
+		tt_assert(bufs[i] = evbuffer_new());
+		evbuffer_add(bufs[i], data, big);
+	}
+	tt_int_op(evbuffer_get_huge_chain_mapped(), ==, 4*1024*1024);
+	tt_assert(bufs[7]->first->flags & EVBUFFER_HUGE);
+	tt_assert(!(bufs[8]->first->flags & EVBUFFER_HUGE));
+	tt_assert(!memcmp(evbuffer_pullup(bufs[7], -1), data, big));
+
+	/* A limit of 0 stops handing them out. */
+	tt_int_op(evbuffer_set_huge_chain_limit(0), ==, 0);
+	evbuffer_free(bufs[1]);
+	tt_assert(bufs[1] = evbuffer_new());
+	evbuffer_add(bufs[1], data, big);
+	tt_assert(!(bufs[1]->first->flags & EVBUFFER_HUGE));
+
+end:
+	for (i = 0; i < 9; ++i)
+		if (bufs[i])
+			evbuffer_free(bufs[i]);
+	if (data)
+		free(data);
+}
+
 static void *
 setup_passthrough(const struct testcase_t *testcase)
 {
@@ -1189,18 +2081,31 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "reference", test_evbuffer_reference, 0, NULL, NULL },
 	{ "iterative", test_evbuffer_iterative, 0, NULL, NULL },
 	{ "readln", test_evbuffer_readln, 0, NULL, NULL },
+	{ "add_int", test_evbuffer_add_int, 0, NULL, NULL },
+	{ "coalesce", test_evbuffer_coalesce, 0, NULL, NULL },
 	{ "find", test_evbuffer_find, 0, NULL, NULL },
 	{ "ptr_set", test_evbuffer_ptr_set, 0, NULL, NULL },
 	{ "search", test_evbuffer_search, 0, NULL, NULL },
+	{ "search_chains", test_evbuffer_search_chains, 0, NULL, NULL },
 	{ "callbacks", test_evbuffer_callbacks, 0, NULL, NULL },
+	{ "threshold_callbacks", test_evbuffer_threshold_callbacks, 0, NULL, NULL },
 	{ "add_reference", test_evbuffer_add_reference, 0, NULL, NULL },
 	{ "prepend", test_evbuffer_prepend, 0, NULL, NULL },
 	{ "peek", test_evbuffer_peek, 0, NULL, NULL },
 	{ "freeze_start", test_evbuffer_freeze, 0, &nil_setup, (void*)"start" },
 	{ "freeze_end", test_evbuffer_freeze, 0, &nil_setup, (void*)"end" },
+	{ "add_buffer_reference", test_evbuffer_add_buffer_reference, 0,
+	  NULL, NULL },
+	{ "chain_cache", test_evbuffer_chain_cache, 0, NULL, NULL },
+	{ "huge_chains", test_evbuffer_huge_chains, TT_FORK, NULL, NULL },
+	{ "mem_group", test_evbuffer_mem_group, 0, NULL, NULL },
 #ifndef WIN32
 	/* TODO: need a temp file implementation for Windows */
 	{ "add_file", test_evbuffer_add_file, 0, NULL, NULL },
+	{ "file_segment", test_evbuffer_file_segment, 0, NULL, NULL },
+	{ "read_splice", test_evbuffer_read_splice, 0, NULL, NULL },
+	{ "adaptive_read", test_evbuffer_adaptive_read, 0, NULL, NULL },
+	{ "spill", test_evbuffer_spill, 0, NULL, NULL },
 #endif
 
 	END_OF_TESTCASES
@@ -43,6 +43,7 @@
 #ifndef WIN32
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -58,6 +59,13 @@
 #ifdef _EVENT_HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifdef _EVENT_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
 
 #include "event-config.h"
 #include "event2/event.h"
@@ -357,6 +365,77 @@ end:
 
 }
 
+/* Pass only whole frames: a length byte, then that many bytes. */
+static enum bufferevent_filter_result
+frame_inspect_filter(const struct evbuffer_iovec *vec, int n_vec,
+    size_t *n_pass, enum bufferevent_flush_mode state, void *ctx)
+{
+	size_t pos = 0, next_frame = 0, boundary = 0, j;
+	int i;
+
+	for (i = 0; i < n_vec; ++i) {
+		const unsigned char *p = vec[i].iov_base;
+		for (j = 0; j < vec[i].iov_len; ++j, ++pos) {
+			if (pos == next_frame) {
+				boundary = pos;
+				next_frame = pos + 1 + p[j];
+			}
+		}
+	}
+	if (pos == next_frame)
+		boundary = pos;
+	*n_pass = boundary;
+	return boundary ? BEV_OK : BEV_NEED_MORE;
+}
+
+static void
+test_bufferevent_inspect_filter(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	struct bufferevent *bev_out = NULL, *bev_in = NULL;
+	struct evbuffer *input;
+
+	tt_assert(0 == bufferevent_pair_new(data->base, 0, pair));
+	bev_out = bufferevent_filter_new_inspect(pair[0], NULL, NULL,
+	    BEV_OPT_CLOSE_ON_FREE, NULL, NULL);
+	bev_in = bufferevent_filter_new_inspect(pair[1],
+	    frame_inspect_filter, NULL, BEV_OPT_CLOSE_ON_FREE, NULL, NULL);
+	tt_assert(bev_out);
+	tt_assert(bev_in);
+	pair[0] = pair[1] = NULL;
+	bufferevent_enable(bev_out, EV_WRITE);
+	bufferevent_enable(bev_in, EV_READ);
+	input = bufferevent_get_input(bev_in);
+
+	/* Half a frame doesn't get through. */
+	bufferevent_write(bev_out, "\x05" "ab", 3);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 0);
+
+	/* Two whole frames do; the start of the third waits. */
+	bufferevent_write(bev_out, "cde\x02" "fg\x01", 7);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 9);
+	tt_assert(!memcmp(evbuffer_pullup(input, 9), "\x05" "abcde\x02" "fg", 9));
+
+	bufferevent_write(bev_out, "h", 1);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(input), ==, 11);
+	tt_assert(!memcmp(evbuffer_pullup(input, 11),
+		"\x05" "abcde\x02" "fg\x01" "h", 11));
+
+end:
+	if (bev_out)
+		bufferevent_free(bev_out);
+	if (bev_in)
+		bufferevent_free(bev_in);
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (pair[1])
+		bufferevent_free(pair[1]);
+}
+
 static void
 test_bufferevent_filters(void)
 {
@@ -472,6 +551,1193 @@ end:
 		bufferevent_free(bev2);
 }
 
+static int n_accepted = 0;
+static int n_accepted_wrong = 0;
+
+static void
+accept_limit_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+#ifndef WIN32
+	/* The listener promised us these. */
+	if (!(fcntl(fd, F_GETFL) & O_NONBLOCK))
+		++n_accepted_wrong;
+	if (!(fcntl(fd, F_GETFD) & FD_CLOEXEC))
+		++n_accepted_wrong;
+#endif
+	++n_accepted;
+	EVUTIL_CLOSESOCKET(fd);
+}
+
+static void
+test_listener_accept_limit(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *lev = NULL;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	evutil_socket_t fd, clients[5];
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		clients[i] = -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(fd >= 0);
+	evutil_make_socket_nonblocking(fd);
+	tt_int_op(bind(fd, (struct sockaddr*)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(getsockname(fd, (struct sockaddr*)&sin, &slen), ==, 0);
+	lev = evconnlistener_new(data->base, accept_limit_cb, NULL,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC, 16, fd);
+	tt_assert(lev);
+	tt_int_op(evconnlistener_set_accepts_per_cb(lev, -1), ==, -1);
+	tt_int_op(evconnlistener_set_accepts_per_cb(lev, 2), ==, 0);
+
+	/* These all land in the backlog before the listener looks. */
+	for (i = 0; i < 5; ++i) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(clients[i] >= 0);
+		tt_int_op(connect(clients[i], (struct sockaddr*)&sin,
+			sizeof(sin)), ==, 0);
+	}
+
+	/* Two at a time, one loop iteration after another. */
+	event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(n_accepted, ==, 2);
+	event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(n_accepted, ==, 4);
+	event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(n_accepted, ==, 5);
+	tt_int_op(n_accepted_wrong, ==, 0);
+
+end:
+	for (i = 0; i < 5; ++i)
+		if (clients[i] >= 0)
+			EVUTIL_CLOSESOCKET(clients[i]);
+	if (lev)
+		evconnlistener_free(lev);
+}
+
+#ifdef SO_REUSEPORT
+static int n_group_accepted[2];
+
+static void
+group_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	int *idx = arg;
+	++n_group_accepted[*idx];
+	EVUTIL_CLOSESOCKET(fd);
+}
+
+static void
+test_listener_group(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *bases[2] = { NULL, NULL };
+	struct evconnlistener_group *group = NULL;
+	struct sockaddr_in sin, sin2;
+	socklen_t slen = sizeof(sin);
+	evutil_socket_t clients[8];
+	int idx[2] = { 0, 1 };
+	void *ptrs[2] = { &idx[0], &idx[1] };
+	int i;
+
+	for (i = 0; i < 8; ++i)
+		clients[i] = -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+
+	bases[0] = data->base;
+	tt_assert(bases[1] = event_base_new());
+	group = evconnlistener_group_new_bind(bases, 2, group_accept_cb, ptrs,
+	    LEV_OPT_STEER_BY_CPU, 16, (struct sockaddr*)&sin, sizeof(sin));
+	tt_assert(group);
+	tt_int_op(evconnlistener_group_size(group), ==, 2);
+	tt_assert(evconnlistener_group_get(group, 2) == NULL);
+	for (i = 0; i < 2; ++i) {
+		struct evconnlistener *lev = evconnlistener_group_get(group, i);
+		tt_assert(lev);
+		tt_assert(evconnlistener_get_base(lev) == bases[i]);
+	}
+
+	/* Both listeners ended up on the same port. */
+	tt_int_op(getsockname(evconnlistener_get_fd(
+		    evconnlistener_group_get(group, 0)),
+		(struct sockaddr*)&sin, &slen), ==, 0);
+	slen = sizeof(sin2);
+	tt_int_op(getsockname(evconnlistener_get_fd(
+		    evconnlistener_group_get(group, 1)),
+		(struct sockaddr*)&sin2, &slen), ==, 0);
+	tt_int_op(sin.sin_port, !=, 0);
+	tt_int_op(sin.sin_port, ==, sin2.sin_port);
+
+	for (i = 0; i < 8; ++i) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(clients[i] >= 0);
+		tt_int_op(connect(clients[i], (struct sockaddr*)&sin,
+			sizeof(sin)), ==, 0);
+	}
+
+	/* Each connection is accepted once, by one base or the other. */
+	event_base_loop(bases[0], EVLOOP_NONBLOCK);
+	event_base_loop(bases[1], EVLOOP_NONBLOCK);
+	tt_int_op(n_group_accepted[0] + n_group_accepted[1], ==, 8);
+
+end:
+	for (i = 0; i < 8; ++i)
+		if (clients[i] >= 0)
+			EVUTIL_CLOSESOCKET(clients[i]);
+	if (group)
+		evconnlistener_group_free(group);
+	if (bases[1])
+		event_base_free(bases[1]);
+}
+#endif
+
+#ifndef WIN32
+static void
+emfile_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	++n_accepted;
+	EVUTIL_CLOSESOCKET(fd);
+	event_base_loopexit(arg, NULL);
+}
+
+static void
+test_listener_emfile(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *lev = NULL;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	struct rlimit rl;
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t clients[2] = { -1, -1 };
+	int fillers[128];
+	int n_fillers = 0, i;
+	char c;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	n_accepted = 0;
+
+	lev = evconnlistener_new_bind(data->base, emfile_accept_cb, data->base,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_RESERVE_FD, 16,
+	    (struct sockaddr*)&sin, sizeof(sin));
+	tt_assert(lev);
+	tt_int_op(getsockname(evconnlistener_get_fd(lev),
+		(struct sockaddr*)&sin, &slen), ==, 0);
+	for (i = 0; i < 2; ++i) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(clients[i] >= 0);
+		tt_int_op(connect(clients[i], (struct sockaddr*)&sin,
+			sizeof(sin)), ==, 0);
+	}
+
+	/* Use up every file descriptor we're allowed. */
+	tt_int_op(getrlimit(RLIMIT_NOFILE, &rl), ==, 0);
+	rl.rlim_cur = 128;
+	tt_int_op(setrlimit(RLIMIT_NOFILE, &rl), ==, 0);
+	while (n_fillers < 128 && (fillers[n_fillers] = dup(0)) >= 0)
+		++n_fillers;
+	tt_int_op(errno, ==, EMFILE);
+
+	/* The listener drops the first connection and pauses, rather than
+	 * failing to accept every time around the loop. */
+	event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(n_accepted, ==, 0);
+	tt_int_op(evconnlistener_get_n_pauses(lev), ==, 1);
+	tt_int_op(evconnlistener_get_n_dropped(lev), ==, 1);
+	tt_int_op(recv(clients[0], &c, 1, 0), ==, 0);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(evconnlistener_get_n_pauses(lev), ==, 1);
+
+	/* Once there are file descriptors again, it picks up where it left
+	 * off. */
+	while (n_fillers)
+		close(fillers[--n_fillers]);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(n_accepted, ==, 1);
+	tt_int_op(evconnlistener_get_n_pauses(lev), ==, 1);
+	tt_int_op(evconnlistener_get_n_dropped(lev), ==, 1);
+
+end:
+	while (n_fillers)
+		close(fillers[--n_fillers]);
+	for (i = 0; i < 2; ++i)
+		if (clients[i] >= 0)
+			EVUTIL_CLOSESOCKET(clients[i]);
+	if (lev)
+		evconnlistener_free(lev);
+}
+#endif
+
+static int n_fastopen_read = 0;
+
+static void
+fastopen_server_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	if (evbuffer_get_length(input) < 5)
+		return;
+	if (!memcmp(evbuffer_pullup(input, 5), "hello", 5))
+		++n_fastopen_read;
+	bufferevent_free(bev);
+	if (n_fastopen_read == 2)
+		event_base_loopexit(arg, NULL);
+}
+
+static void
+fastopen_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct bufferevent *bev;
+	bev = bufferevent_socket_new(arg, fd, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, fastopen_server_readcb, NULL, NULL, arg);
+	bufferevent_enable(bev, EV_READ);
+	/* It may all be here already. */
+	fastopen_server_readcb(bev, arg);
+}
+
+static void
+fastopen_client_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & BEV_EVENT_ERROR) {
+		TT_FAIL(("Client got an error"));
+		event_base_loopexit(arg, NULL);
+	}
+}
+
+static void
+test_listener_fastopen(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *lev = NULL;
+	struct bufferevent *bevs[2] = { NULL, NULL };
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	struct timeval tv = { 5, 0 };
+	int i;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+
+	lev = evconnlistener_new_bind(data->base, fastopen_accept_cb,
+	    data->base, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_TCP_FASTOPEN|
+	    LEV_OPT_DEFER_ACCEPT, 16, (struct sockaddr*)&sin, sizeof(sin));
+	tt_assert(lev);
+	tt_int_op(getsockname(evconnlistener_get_fd(lev),
+		(struct sockaddr*)&sin, &slen), ==, 0);
+#ifdef TCP_DEFER_ACCEPT
+	{
+		int val = 0;
+		slen = sizeof(val);
+		tt_int_op(getsockopt(evconnlistener_get_fd(lev), IPPROTO_TCP,
+			TCP_DEFER_ACCEPT, (void*)&val, &slen), ==, 0);
+		tt_int_op(val, >, 0);
+	}
+#endif
+
+	/* Whether or not the data can go in the SYN (the first connection
+	 * has no cookie yet), it has to get there. */
+	for (i = 0; i < 2; ++i) {
+		bevs[i] = bufferevent_socket_new(data->base, -1,
+		    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_TCP_FASTOPEN);
+		tt_assert(bevs[i]);
+		bufferevent_setcb(bevs[i], NULL, NULL, fastopen_client_eventcb,
+		    data->base);
+		bufferevent_write(bevs[i], "hello", 5);
+		tt_int_op(bufferevent_socket_connect(bevs[i],
+			(struct sockaddr*)&sin, sizeof(sin)), ==, 0);
+		bufferevent_enable(bevs[i], EV_READ);
+	}
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(n_fastopen_read, ==, 2);
+
+end:
+	for (i = 0; i < 2; ++i)
+		if (bevs[i])
+			bufferevent_free(bevs[i]);
+	if (lev)
+		evconnlistener_free(lev);
+}
+
+static evutil_socket_t notsent_peer_fd = -1;
+static int n_notsent_writecb = 0;
+
+static void
+notsent_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	notsent_peer_fd = fd;
+}
+
+static int notsent_unsent = -1;
+
+static void
+notsent_writecb(struct bufferevent *bev, void *arg)
+{
+	++n_notsent_writecb;
+#ifdef SIOCOUTQNSD
+	/* how much the kernel hasn't sent yet */
+	if (ioctl(bufferevent_getfd(bev), SIOCOUTQNSD, &notsent_unsent) < 0)
+		notsent_unsent = -1;
+#endif
+	event_base_loopexit(arg, NULL);
+}
+
+static void
+notsent_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF))
+		TT_FAIL(("Got event %d", (int)what));
+}
+
+static void
+notsent_peer_readcb(struct bufferevent *bev, void *arg)
+{
+	evbuffer_drain(bufferevent_get_input(bev),
+	    evbuffer_get_length(bufferevent_get_input(bev)));
+}
+
+static void
+test_bufferevent_notsent_lowat(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *lev = NULL;
+	struct bufferevent *bev = NULL, *peer = NULL;
+	struct bufferevent_socket_settings settings;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	struct timeval tv = { 0, 300*1000 }, long_tv = { 5, 0 };
+	static char payload[256*1024];
+	int val;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	lev = evconnlistener_new_bind(data->base, notsent_accept_cb, NULL,
+	    LEV_OPT_CLOSE_ON_FREE, 16, (struct sockaddr*)&sin, sizeof(sin));
+	tt_assert(lev);
+	tt_int_op(getsockname(evconnlistener_get_fd(lev),
+		(struct sockaddr*)&sin, &slen), ==, 0);
+	/* Keep the receiver's window small, so that most of what we send
+	 * has to stay in our kernel until it reads. */
+	val = 4096;
+	setsockopt(evconnlistener_get_fd(lev), SOL_SOCKET, SO_RCVBUF,
+	    (void*)&val, sizeof(val));
+
+	memset(&settings, 0, sizeof(settings));
+	settings.sndbuf = 1024*1024;
+	settings.nodelay = 1;
+	settings.notsent_lowat = 4096;
+	bev = bufferevent_socket_new_with_settings(data->base, -1,
+	    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_NOTSENT_LOWAT, &settings);
+	tt_assert(bev);
+	bufferevent_setcb(bev, NULL, notsent_writecb, notsent_eventcb,
+	    data->base);
+	tt_int_op(bufferevent_socket_connect(bev, (struct sockaddr*)&sin,
+		sizeof(sin)), ==, 0);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(notsent_peer_fd >= 0);
+
+	/* The settings were applied to the socket connect() made. */
+	slen = sizeof(val);
+	tt_int_op(getsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY,
+		(void*)&val, &slen), ==, 0);
+	tt_int_op(val, !=, 0);
+#ifdef TCP_NOTSENT_LOWAT
+	slen = sizeof(val);
+	tt_int_op(getsockopt(bufferevent_getfd(bev), IPPROTO_TCP,
+		TCP_NOTSENT_LOWAT, (void*)&val, &slen), ==, 0);
+	tt_int_op(val, ==, 4096);
+
+	/* The peer isn't reading, so most of the output stays ours. */
+	n_notsent_writecb = 0;
+	bufferevent_write(bev, payload, sizeof(payload));
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(n_notsent_writecb, ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), >,
+	    sizeof(payload) / 2);
+
+	/* Once it reads, the output drains, but we hear about it only once
+	 * the kernel has sent most of it too. */
+	peer = bufferevent_socket_new(data->base, notsent_peer_fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+	notsent_peer_fd = -1;
+	tt_assert(peer);
+	bufferevent_setcb(peer, notsent_peer_readcb, NULL, notsent_eventcb,
+	    NULL);
+	bufferevent_enable(peer, EV_READ);
+	event_base_loopexit(data->base, &long_tv);
+	event_base_dispatch(data->base);
+	tt_int_op(n_notsent_writecb, ==, 1);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+#ifdef SIOCOUTQNSD
+	tt_int_op(notsent_unsent, >=, 0);
+	tt_int_op(notsent_unsent, <, 4096);
+#endif
+#endif
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (peer)
+		bufferevent_free(peer);
+	if (notsent_peer_fd >= 0)
+		EVUTIL_CLOSESOCKET(notsent_peer_fd);
+	notsent_peer_fd = -1;
+	if (lev)
+		evconnlistener_free(lev);
+}
+
+/* A two-socket forwarder: whatever arrives on "in" goes out on "out". */
+struct splice_proxy {
+	struct event_base *base;
+	struct bufferevent *in, *out, *sink;
+	struct evbuffer *received;
+	size_t expect;
+	size_t max_input;
+};
+
+#define SPLICE_PROXY_HIGH 4096
+#define SPLICE_PROXY_OUT_MAX 16384
+
+static void
+splice_proxy_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct splice_proxy *px = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	if (evbuffer_get_length(input) > px->max_input)
+		px->max_input = evbuffer_get_length(input);
+	bufferevent_write_buffer(px->out, input);
+	/* stop reading until the other side catches up */
+	if (evbuffer_get_length(bufferevent_get_output(px->out)) >=
+	    SPLICE_PROXY_OUT_MAX)
+		bufferevent_disable(bev, EV_READ);
+}
+
+static void
+splice_proxy_writecb(struct bufferevent *bev, void *ctx)
+{
+	struct splice_proxy *px = ctx;
+	bufferevent_enable(px->in, EV_READ);
+}
+
+static void
+splice_sink_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct splice_proxy *px = ctx;
+	bufferevent_read_buffer(bev, px->received);
+	if (evbuffer_get_length(px->received) >= px->expect)
+		event_base_loopexit(px->base, NULL);
+}
+
+static void
+splice_proxy_errorcb(struct bufferevent *bev, short what, void *ctx)
+{
+	TT_FAIL(("Got proxy error %d", (int)what));
+}
+
+static void
+test_bufferevent_splice(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct splice_proxy px;
+	struct bufferevent *src = NULL;
+	evutil_socket_t in[2] = { -1, -1 }, out[2] = { -1, -1 };
+	struct timeval tv = { 10, 0 };
+	char *payload = NULL;
+	size_t i, len = 300000;
+
+	memset(&px, 0, sizeof(px));
+	px.base = data->base;
+	px.expect = len;
+	px.received = evbuffer_new();
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, in) == 0);
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, out) == 0);
+	for (i = 0; i < 2; ++i) {
+		evutil_make_socket_nonblocking(in[i]);
+		evutil_make_socket_nonblocking(out[i]);
+	}
+
+	payload = malloc(len);
+	tt_assert(payload);
+	for (i = 0; i < len; ++i)
+		payload[i] = (char)(i % 251);
+
+	src = bufferevent_socket_new(data->base, in[0], 0);
+	px.in = bufferevent_socket_new(data->base, in[1], BEV_OPT_SPLICE);
+	px.out = bufferevent_socket_new(data->base, out[0], 0);
+	px.sink = bufferevent_socket_new(data->base, out[1], 0);
+	tt_assert(src && px.in && px.out && px.sink);
+
+	bufferevent_setcb(px.in, splice_proxy_readcb, NULL,
+	    splice_proxy_errorcb, &px);
+	bufferevent_setcb(px.out, NULL, splice_proxy_writecb,
+	    splice_proxy_errorcb, &px);
+	bufferevent_setcb(px.sink, splice_sink_readcb, NULL,
+	    splice_proxy_errorcb, &px);
+	bufferevent_setwatermark(px.in, EV_READ, 0, SPLICE_PROXY_HIGH);
+	bufferevent_setwatermark(px.out, EV_WRITE, SPLICE_PROXY_OUT_MAX / 2, 0);
+	bufferevent_enable(px.in, EV_READ);
+	bufferevent_enable(px.out, EV_WRITE);
+	bufferevent_enable(px.sink, EV_READ);
+
+	bufferevent_write(src, payload, len);
+	bufferevent_enable(src, EV_WRITE);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(evbuffer_get_length(px.received), ==, len);
+	tt_assert(!memcmp(evbuffer_pullup(px.received, -1), payload, len));
+	/* the watermark held even though the data never left the kernel */
+	tt_int_op(px.max_input, <=, SPLICE_PROXY_HIGH);
+	tt_int_op(px.max_input, >, 0);
+
+end:
+	if (src)
+		bufferevent_free(src);
+	if (px.in)
+		bufferevent_free(px.in);
+	if (px.out)
+		bufferevent_free(px.out);
+	if (px.sink)
+		bufferevent_free(px.sink);
+	if (px.received)
+		evbuffer_free(px.received);
+	if (payload)
+		free(payload);
+	for (i = 0; i < 2; ++i) {
+		if (in[i] != -1)
+			EVUTIL_CLOSESOCKET(in[i]);
+		if (out[i] != -1)
+			EVUTIL_CLOSESOCKET(out[i]);
+	}
+}
+
+static void
+test_bufferevent_mem_group(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *src = NULL, *dst = NULL;
+	struct evbuffer_mem_group *group = NULL;
+	struct evbuffer *input;
+	struct timeval tv = { 0, 200*1000 };
+	evutil_socket_t pair[2] = { -1, -1 };
+	static char payload[65536];
+	size_t len;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	group = evbuffer_mem_group_new(8192, 2048, NULL, NULL);
+	tt_assert(group);
+	src = bufferevent_socket_new(data->base, pair[0], 0);
+	dst = bufferevent_socket_new(data->base, pair[1], 0);
+	tt_assert(src && dst);
+	tt_int_op(bufferevent_set_mem_group(dst, group), ==, 0);
+	input = bufferevent_get_input(dst);
+
+	/* Nobody drains dst, so it reads until the group is over. */
+	bufferevent_write(src, payload, sizeof(payload));
+	bufferevent_enable(dst, EV_READ);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_assert(evbuffer_mem_group_is_over(group));
+	tt_int_op(BEV_UPCAST(dst)->read_suspended, ==, BEV_SUSPEND_MEM);
+	len = evbuffer_get_length(input);
+	tt_int_op(len, >, 0);
+	tt_int_op(len, <, sizeof(payload));
+
+	/* Once the group comes back down, reading starts again. */
+	evbuffer_drain(input, len);
+	tt_assert(!evbuffer_mem_group_is_over(group));
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evbuffer_get_length(input), >, 0);
+
+	/* Leaving the group lifts the suspension. */
+	tt_int_op(bufferevent_set_mem_group(dst, NULL), ==, 0);
+	tt_int_op(BEV_UPCAST(dst)->read_suspended, ==, 0);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), ==, 0);
+
+end:
+	if (src)
+		bufferevent_free(src);
+	if (dst)
+		bufferevent_free(dst);
+	if (group)
+		evbuffer_mem_group_free(group);
+	if (pair[0] != -1)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] != -1)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+static void
+test_bufferevent_idle_release(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer_mem_group *group = NULL;
+	struct timeval idle = { 0, 50*1000 }, tv = { 0, 150*1000 };
+	static char payload[4096];
+	size_t allocated;
+
+	group = evbuffer_mem_group_new((size_t)1 << 30, 0, NULL, NULL);
+	tt_assert(group);
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	tt_int_op(bufferevent_set_mem_group(bev, group), ==, 0);
+
+	/* Room that a read reserved, and data waiting to be written. */
+	tt_int_op(evbuffer_expand(bufferevent_get_input(bev), 16384), ==, 0);
+	bufferevent_write(bev, payload, sizeof(payload));
+	allocated = evbuffer_mem_group_get_allocated(group);
+	tt_int_op(allocated, >=, 16384 + sizeof(payload));
+	tt_int_op(bufferevent_set_idle_release(bev, &idle), ==, 0);
+
+	/* While the output holds data, nothing is given back. */
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), ==, allocated);
+
+	/* Once both are empty for the interval, everything is. */
+	bufferevent_enable(bev, EV_WRITE);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), ==, 0);
+
+	/* New data gets new memory, which it keeps while it isn't idle. */
+	tt_int_op(send(data->pair[1], payload, 100, 0), ==, 100);
+	bufferevent_enable(bev, EV_READ);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev)), ==, 100);
+	tt_int_op(evbuffer_mem_group_get_allocated(group), >, 0);
+
+	tt_int_op(bufferevent_set_idle_release(bev, NULL), ==, 0);
+	tt_assert(BEV_UPCAST(bev)->idle_release == NULL);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (group)
+		evbuffer_mem_group_free(group);
+}
+
+struct cork_test {
+	struct evbuffer *body;
+	int n_writecb;
+	int corked_in_writecb;
+};
+
+static void
+cork_writecb(struct bufferevent *bev, void *ctx)
+{
+	struct cork_test *ct = ctx;
+
+	/* the header is in the kernel; send the body after it */
+	if (ct->n_writecb++ == 0) {
+		ct->corked_in_writecb = BEV_UPCAST(bev)->corked;
+		bufferevent_write_buffer(bev, ct->body);
+	}
+}
+
+static void
+test_bufferevent_cork(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct cork_test ct;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *received = evbuffer_new();
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	evutil_socket_t lfd = -1, cfd = -1, sfd = -1;
+	struct timeval tv = { 0, 100*1000 };
+	char buf[1024];
+	size_t body_len;
+	int i, n;
+
+	memset(&ct, 0, sizeof(ct));
+	ct.body = evbuffer_new();
+	for (i = 0; i < 100; ++i)
+		evbuffer_add_printf(ct.body, "line %d of the body\n", i);
+	body_len = evbuffer_get_length(ct.body);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001L);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(lfd >= 0);
+	tt_assert(bind(lfd, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	tt_assert(listen(lfd, 1) == 0);
+	tt_assert(getsockname(lfd, (struct sockaddr*)&sin, &slen) == 0);
+	cfd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(cfd >= 0);
+	tt_assert(connect(cfd, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	sfd = accept(lfd, NULL, NULL);
+	tt_assert(sfd >= 0);
+	evutil_make_socket_nonblocking(cfd);
+
+	bev = bufferevent_socket_new(data->base, cfd,
+	    BEV_OPT_CORK|BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	bufferevent_setcb(bev, NULL, cork_writecb, NULL, &ct);
+	bufferevent_write(bev, "HEADER\r\n\r\n", 10);
+	bufferevent_enable(bev, EV_WRITE);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	/* We stayed corked between the header and the body, and let go
+	 * once there was nothing left to send. */
+	tt_int_op(ct.n_writecb, ==, 2);
+	tt_int_op(ct.corked_in_writecb, ==, 1);
+	tt_int_op(BEV_UPCAST(bev)->corked, ==, 0);
+#ifdef TCP_CORK
+	{
+		int on = -1;
+		socklen_t olen = sizeof(on);
+		tt_assert(getsockopt(cfd, IPPROTO_TCP, TCP_CORK, (void*)&on,
+			&olen) == 0);
+		tt_int_op(on, ==, 0);
+	}
+#endif
+
+	bufferevent_free(bev);
+	bev = NULL;
+	cfd = -1;
+	while ((n = recv(sfd, buf, sizeof(buf), 0)) > 0)
+		evbuffer_add(received, buf, n);
+	tt_int_op(evbuffer_get_length(received), ==, 10 + body_len);
+	tt_assert(!memcmp(evbuffer_pullup(received, 10), "HEADER\r\n\r\n", 10));
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (cfd != -1)
+		EVUTIL_CLOSESOCKET(cfd);
+	if (sfd != -1)
+		EVUTIL_CLOSESOCKET(sfd);
+	if (lfd != -1)
+		EVUTIL_CLOSESOCKET(lfd);
+	evbuffer_free(ct.body);
+	evbuffer_free(received);
+}
+
+static void
+test_bufferevent_rate_limit(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *src = NULL, *dst = NULL;
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct timeval tick = { 0, 50*1000 };
+	struct timeval tv = { 0, 300*1000 };
+	evutil_socket_t pair[2] = { -1, -1 };
+	static char payload[65536];
+	size_t len;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	/* a rate above the burst makes no sense */
+	tt_assert(!ev_token_bucket_cfg_new(8192, 4096, 1, 1, &tick));
+	cfg = ev_token_bucket_cfg_new(2048, 4096,
+	    EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, &tick);
+	tt_assert(cfg);
+
+	src = bufferevent_socket_new(data->base, pair[0], 0);
+	dst = bufferevent_socket_new(data->base, pair[1], 0);
+	tt_assert(src && dst);
+	tt_int_op(bufferevent_get_max_to_read(dst), ==, EV_SSIZE_MAX);
+	tt_int_op(bufferevent_set_rate_limit(dst, cfg), ==, 0);
+	tt_int_op(bufferevent_get_max_to_read(dst), ==, 4096);
+
+	bufferevent_write(src, payload, sizeof(payload));
+	bufferevent_enable(dst, EV_READ);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	/* One full bucket, then 2048 bytes a tick for about six ticks. */
+	len = evbuffer_get_length(bufferevent_get_input(dst));
+	tt_int_op(len, >=, 4096 + 2048);
+	tt_int_op(len, <=, 4096 + 2048 * 8);
+	tt_int_op(bufferevent_get_max_to_read(dst), <=, 4096);
+
+	/* Without the limit, the rest arrives at once. */
+	tt_int_op(bufferevent_set_rate_limit(dst, NULL), ==, 0);
+	tt_int_op(BEV_UPCAST(dst)->read_suspended, ==, 0);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(dst)), ==,
+	    sizeof(payload));
+
+end:
+	if (src)
+		bufferevent_free(src);
+	if (dst)
+		bufferevent_free(dst);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+	if (pair[0] != -1)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] != -1)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+#define N_RATELIM_GROUP 3
+
+static void
+test_bufferevent_rate_limit_group(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *src[N_RATELIM_GROUP], *dst[N_RATELIM_GROUP];
+	struct bufferevent_rate_limit_group *group = NULL;
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct timeval tick = { 0, 50*1000 };
+	struct timeval tv = { 0, 300*1000 };
+	evutil_socket_t pair[N_RATELIM_GROUP][2];
+	static char payload[32768];
+	size_t len, total = 0, least = sizeof(payload), most = 0;
+	int i;
+
+	memset(src, 0, sizeof(src));
+	memset(dst, 0, sizeof(dst));
+	memset(pair, -1, sizeof(pair));
+
+	cfg = ev_token_bucket_cfg_new(3000, 3000,
+	    EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, &tick);
+	tt_assert(cfg);
+	group = bufferevent_rate_limit_group_new(data->base, cfg);
+	tt_assert(group);
+
+	for (i = 0; i < N_RATELIM_GROUP; ++i) {
+		tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0,
+			pair[i]) == 0);
+		evutil_make_socket_nonblocking(pair[i][0]);
+		evutil_make_socket_nonblocking(pair[i][1]);
+		src[i] = bufferevent_socket_new(data->base, pair[i][0], 0);
+		dst[i] = bufferevent_socket_new(data->base, pair[i][1], 0);
+		tt_assert(src[i] && dst[i]);
+		tt_int_op(bufferevent_add_to_rate_limit_group(dst[i], group),
+		    ==, 0);
+		bufferevent_write(src[i], payload, sizeof(payload));
+		bufferevent_enable(dst[i], EV_READ);
+	}
+	tt_int_op(bufferevent_get_max_to_read(dst[0]), ==,
+	    3000 / N_RATELIM_GROUP);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	for (i = 0; i < N_RATELIM_GROUP; ++i) {
+		len = evbuffer_get_length(bufferevent_get_input(dst[i]));
+		total += len;
+		if (len < least)
+			least = len;
+		if (len > most)
+			most = len;
+	}
+	/* The group as a whole kept to its limit, and nobody starved. */
+	tt_int_op(total, >=, 3000 * 2);
+	tt_int_op(total, <=, 3000 * 8 + 64 * N_RATELIM_GROUP);
+	tt_int_op(least, >, 0);
+	tt_int_op(least * 3, >=, most);
+
+	/* Freeing the group sets its members free. */
+	bufferevent_rate_limit_group_free(group);
+	group = NULL;
+	for (i = 0; i < N_RATELIM_GROUP; ++i)
+		tt_int_op(BEV_UPCAST(dst[i])->read_suspended, ==, 0);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	for (i = 0; i < N_RATELIM_GROUP; ++i)
+		tt_int_op(evbuffer_get_length(bufferevent_get_input(dst[i])),
+		    ==, sizeof(payload));
+
+end:
+	for (i = 0; i < N_RATELIM_GROUP; ++i) {
+		if (src[i])
+			bufferevent_free(src[i]);
+		if (dst[i])
+			bufferevent_free(dst[i]);
+		if (pair[i][0] != -1)
+			EVUTIL_CLOSESOCKET(pair[i][0]);
+		if (pair[i][1] != -1)
+			EVUTIL_CLOSESOCKET(pair[i][1]);
+	}
+	if (group)
+		bufferevent_rate_limit_group_free(group);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+struct lazy_timeout_test {
+	struct event_base *base;
+	struct bufferevent *src;
+	struct event *ticker;
+	int n_written;
+	short what;
+	struct timeval fired_at;
+};
+
+static void
+lazy_timeout_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct lazy_timeout_test *lt = arg;
+
+	if (lt->n_written++ < 8)
+		bufferevent_write(lt->src, "x", 1);
+	else
+		event_del(lt->ticker);
+}
+
+static void
+lazy_timeout_readcb(struct bufferevent *bev, void *arg)
+{
+	evbuffer_drain(bufferevent_get_input(bev), -1);
+}
+
+static void
+lazy_timeout_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct lazy_timeout_test *lt = arg;
+
+	lt->what = what;
+	evutil_gettimeofday(&lt->fired_at, NULL);
+	event_base_loopexit(lt->base, NULL);
+}
+
+static void
+test_bufferevent_lazy_timeout(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct lazy_timeout_test lt;
+	struct bufferevent *dst = NULL;
+	struct timeval tick = { 0, 50*1000 };
+	struct timeval timeout = { 0, 200*1000 };
+	struct timeval limit = { 3, 0 };
+	struct timeval start, elapsed;
+	evutil_socket_t pair[2] = { -1, -1 };
+
+	memset(&lt, 0, sizeof(lt));
+	lt.base = data->base;
+
+	tt_assert(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	lt.src = bufferevent_socket_new(data->base, pair[0], 0);
+	dst = bufferevent_socket_new(data->base, pair[1], 0);
+	tt_assert(lt.src && dst);
+	bufferevent_setcb(dst, lazy_timeout_readcb, NULL,
+	    lazy_timeout_eventcb, &lt);
+	bufferevent_set_timeouts(dst, &timeout, NULL);
+	bufferevent_enable(dst, EV_READ);
+
+	/* A byte every 50 msec keeps the 200 msec timeout away for as long
+	 * as it lasts. */
+	lt.ticker = event_new(data->base, -1, EV_PERSIST,
+	    lazy_timeout_tick_cb, &lt);
+	event_add(lt.ticker, &tick);
+
+	evutil_gettimeofday(&start, NULL);
+	event_base_loopexit(data->base, &limit);
+	event_base_dispatch(data->base);
+
+	tt_int_op(lt.what, ==, BEV_EVENT_READING|BEV_EVENT_TIMEOUT);
+	tt_int_op(lt.n_written, ==, 9);
+	evutil_timersub(&lt.fired_at, &start, &elapsed);
+	tt_int_op(elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000, >=, 550);
+	tt_int_op(elapsed.tv_sec, <, 2);
+	tt_assert(!event_pending(&dst->ev_read, EV_READ, NULL));
+
+end:
+	if (lt.ticker)
+		event_free(lt.ticker);
+	if (lt.src)
+		bufferevent_free(lt.src);
+	if (dst)
+		bufferevent_free(dst);
+	if (pair[0] != -1)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] != -1)
+		EVUTIL_CLOSESOCKET(pair[1]);
+}
+
+static void
+test_bufferevent_optimistic_write(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	const size_t big_len = 4*1024*1024;
+	char *big = NULL;
+	char buf[8192];
+	size_t got = 0;
+	int n;
+
+	evutil_make_socket_nonblocking(data->pair[1]);
+	bev = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_OPTIMISTIC_WRITE);
+	tt_assert(bev);
+	bufferevent_enable(bev, EV_WRITE);
+
+	/* A small write goes out at the end of the batch, without ever
+	 * waiting for the socket to be writable. */
+	bufferevent_write(bev, "hello", 5);
+	tt_assert(!event_pending(&bev->ev_write, EV_WRITE, NULL));
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_assert(!event_pending(&bev->ev_write, EV_WRITE, NULL));
+	n = recv(data->pair[1], buf, sizeof(buf), 0);
+	tt_int_op(n, ==, 5);
+
+	/* More than the socket will take: the rest waits for EV_WRITE. */
+	big = malloc(big_len);
+	tt_assert(big);
+	memset(big, 'x', big_len);
+	bufferevent_write(bev, big, big_len);
+	event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_assert(evbuffer_get_length(bufferevent_get_output(bev)) > 0);
+	tt_assert(event_pending(&bev->ev_write, EV_WRITE, NULL));
+
+	while (got < big_len) {
+		while ((n = recv(data->pair[1], buf, sizeof(buf), 0)) > 0)
+			got += n;
+		event_base_loop(data->base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	}
+	tt_int_op(got, ==, big_len);
+	tt_assert(!event_pending(&bev->ev_write, EV_WRITE, NULL));
+
+end:
+	if (big)
+		free(big);
+	if (bev)
+		bufferevent_free(bev);
+}
+
+#define ET_TOTAL (1024*1024)
+static size_t et_got = 0;
+static size_t et_want = 0;
+static int et_wrong = 0;
+
+static void
+edge_triggered_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t i, len = evbuffer_get_length(input);
+	unsigned char *mem = evbuffer_pullup(input, len);
+
+	/* The watermark should keep us from reading more than this. */
+	if (len > 1000)
+		++et_wrong;
+	for (i = 0; i < len; ++i)
+		if (mem[i] != (unsigned char)(et_got + i))
+			++et_wrong;
+	evbuffer_drain(input, len);
+	et_got += len;
+	if (et_got == et_want)
+		event_base_loopexit(bev->ev_base, NULL);
+}
+
+static void
+test_bufferevent_edge_triggered(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_config *cfg = NULL;
+	struct event_base *base = NULL;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	unsigned char *out = NULL;
+	struct timeval tv = { 5, 0 };
+	int i;
+
+	/* With a changelist, a read event we delete and add back in one
+	 * loop iteration never leaves the kernel, so no new edge comes from
+	 * re-adding it. */
+	cfg = event_config_new();
+	tt_assert(cfg);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	event_config_require_features(cfg, EV_FEATURE_ET);
+	if (!(base = event_base_new_with_config(cfg)))
+		tt_skip();
+
+	bev1 = bufferevent_socket_new(base, data->pair[0],
+	    BEV_OPT_EDGE_TRIGGERED);
+	bev2 = bufferevent_socket_new(base, data->pair[1],
+	    BEV_OPT_EDGE_TRIGGERED);
+	tt_assert(bev1);
+	tt_assert(bev2);
+	tt_assert(bev1->ev_write.ev_events & EV_ET);
+	tt_assert(bev2->ev_read.ev_events & EV_ET);
+
+	out = malloc(ET_TOTAL);
+	tt_assert(out);
+	for (i = 0; i < ET_TOTAL; ++i)
+		out[i] = (unsigned char)i;
+
+	/* Each time the reader hits its watermark, it stops reading with
+	 * data left in the socket.  Put it all there up front, so that
+	 * nothing new shows up to wake the reader: it has to go on by itself
+	 * once the callback drains its input. */
+	tt_int_op(send(data->pair[0], (void*)out, 16384, 0), ==, 16384);
+	et_want = 16384;
+	bufferevent_setwatermark(bev2, EV_READ, 0, 1000);
+	bufferevent_setcb(bev2, edge_triggered_readcb, NULL, NULL, NULL);
+	bufferevent_enable(bev2, EV_READ);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(et_got, ==, 16384);
+
+	/* Now more than the sockets hold, through the other bufferevent. */
+	et_want = ET_TOTAL;
+	bufferevent_enable(bev1, EV_WRITE);
+	bufferevent_write(bev1, out + 16384, ET_TOTAL - 16384);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+	tt_int_op(et_got, ==, ET_TOTAL);
+	tt_int_op(et_wrong, ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev1)), ==, 0);
+	/* Edge-triggered, the write event stays added with nothing to
+	 * write. */
+	tt_assert(event_pending(&bev1->ev_write, EV_WRITE, NULL));
+
+end:
+	if (out)
+		free(out);
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
         LEGACY(bufferevent, TT_ISOLATED),
@@ -482,6 +1748,40 @@ struct testcase_t bufferevent_testcases[] = {
         LEGACY(bufferevent_pair_filters, TT_ISOLATED),
 	{ "bufferevent_connect", test_bufferevent_connect, TT_FORK|TT_NEED_BASE,
 	  &basic_setup, NULL },
+	{ "listener_accept_limit", test_listener_accept_limit,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "listener_fastopen", test_listener_fastopen, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "bufferevent_notsent_lowat", test_bufferevent_notsent_lowat,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#ifndef WIN32
+	{ "listener_emfile", test_listener_emfile, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+#ifdef SO_REUSEPORT
+	{ "listener_group", test_listener_group, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+	{ "bufferevent_splice", test_bufferevent_splice, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "bufferevent_mem_group", test_bufferevent_mem_group,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_idle_release", test_bufferevent_idle_release,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "bufferevent_cork", test_bufferevent_cork, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "bufferevent_rate_limit", test_bufferevent_rate_limit,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_rate_limit_group", test_bufferevent_rate_limit_group,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_lazy_timeout", test_bufferevent_lazy_timeout,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_optimistic_write", test_bufferevent_optimistic_write,
+	  TT_ISOLATED, &basic_setup, NULL },
+	{ "bufferevent_inspect_filter", test_bufferevent_inspect_filter,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_edge_triggered", test_bufferevent_edge_triggered,
+	  TT_FORK|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
 #ifdef _EVENT_HAVE_LIBZ
         LEGACY(bufferevent_zlib, TT_ISOLATED),
 #else
@@ -45,14 +45,14 @@
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
+#else
+#include <ws2tcpip.h>
 #endif
 #ifdef _EVENT_HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
-#ifdef HAVE_NETDB_H
-#include <netdb.h>
-#endif
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -61,8 +61,11 @@
 
 #include "event2/event.h"
 #include "event2/event_compat.h"
+#include "event2/bufferevent.h"
+#include "event2/listener.h"
 #include "evdns.h"
 #include "log-internal.h"
+#include "util-internal.h"
 #include "regress.h"
 
 static int dns_ok = 0;
@@ -399,6 +402,1195 @@ end:
 }
 
 
+static void
+be_connect_server_cb(struct evdns_server_request *req, void *data)
+{
+	int i, r, err = 0;
+	for (i = 0; i < req->nquestions; ++i) {
+		const char *name = req->questions[i]->name;
+		if (!strcasecmp(name, "nobodaddy.example.com") &&
+		    req->questions[i]->type == EVDNS_TYPE_A) {
+			ev_uint32_t ans = htonl(0x7f000001UL);
+			r = evdns_server_request_add_a_reply(req, name,
+			    1, &ans, 10);
+			if (r<0)
+				dns_ok = 0;
+		} else if (!strcasecmp(name, "nobodaddy.example.com") &&
+		    req->questions[i]->type == EVDNS_TYPE_AAAA) {
+			/* Nobody listens on ::1 here, so this attempt must
+			 * fail and fall back to IPv4. */
+			char addr6[17] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\1";
+			r = evdns_server_request_add_aaaa_reply(req, name,
+			    1, addr6, 10);
+			if (r<0)
+				dns_ok = 0;
+		} else {
+			err = 3; /* NXDOMAIN */
+		}
+	}
+	r = evdns_server_request_respond(req, err);
+	if (r<0)
+		dns_ok = 0;
+}
+
+static int be_connect_n_done = 0;
+static struct event_base *be_connect_base = NULL;
+
+static void
+be_connect_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	EVUTIL_CLOSESOCKET(fd);
+}
+
+static void
+be_connect_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+	short *result = arg;
+	*result = what;
+	if (++be_connect_n_done == 3)
+		event_base_loopexit(be_connect_base, NULL);
+}
+
+static void
+test_bufferevent_connect_hostname(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct bufferevent *be_name = NULL, *be_numeric = NULL,
+	    *be_missing = NULL;
+	short name_what = 0, numeric_what = 0, missing_what = 0;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+
+	dns_ok = 1;
+	be_connect_base = data->base;
+
+	/* A nameserver that knows one name. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35354);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    be_connect_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35354"));
+
+	/* Something to connect to. */
+	sin.sin_port = htons(27016);
+	listener = evconnlistener_new_bind(data->base, be_connect_accept_cb,
+	    NULL, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+	    (struct sockaddr*)&sin, sizeof(sin));
+	tt_assert(listener);
+
+	be_name = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	be_numeric = bufferevent_socket_new(data->base, -1,
+	    BEV_OPT_CLOSE_ON_FREE);
+	be_missing = bufferevent_socket_new(data->base, -1,
+	    BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(be_name, NULL, NULL, be_connect_event_cb,
+	    &name_what);
+	bufferevent_setcb(be_numeric, NULL, NULL, be_connect_event_cb,
+	    &numeric_what);
+	bufferevent_setcb(be_missing, NULL, NULL, be_connect_event_cb,
+	    &missing_what);
+
+	tt_assert(!bufferevent_socket_connect_hostname(be_name, dns,
+		AF_UNSPEC, "nobodaddy.example.com", 27016));
+	tt_assert(!bufferevent_socket_connect_hostname(be_numeric, dns,
+		AF_UNSPEC, "127.0.0.1", 27016));
+	tt_assert(!bufferevent_socket_connect_hostname(be_missing, dns,
+		AF_UNSPEC, "nosuchplace.example.com", 27016));
+	/* We refuse to replace a socket that is already set. */
+	tt_int_op(bufferevent_socket_connect_hostname(be_numeric, dns,
+		AF_UNSPEC, "127.0.0.1", 27016), ==, -1);
+
+	event_base_dispatch(data->base);
+
+	tt_assert(dns_ok);
+	tt_int_op(name_what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(numeric_what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(missing_what, ==, BEV_EVENT_ERROR);
+	tt_int_op(bufferevent_socket_get_dns_error(be_name), ==, 0);
+	tt_int_op(bufferevent_socket_get_dns_error(be_missing), ==,
+	    DNS_ERR_NOTEXIST);
+
+end:
+	if (be_name)
+		bufferevent_free(be_name);
+	if (be_numeric)
+		bufferevent_free(be_numeric);
+	if (be_missing)
+		bufferevent_free(be_missing);
+	if (listener)
+		evconnlistener_free(listener);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static int dns_cache_n_queries = 0;
+
+static void
+dns_cache_server_cb(struct evdns_server_request *req, void *data)
+{
+	int i, err = 0;
+	++dns_cache_n_queries;
+	for (i = 0; i < req->nquestions; ++i) {
+		const char *name = req->questions[i]->name;
+		if (!strcasecmp(name, "cached.example.com") &&
+		    req->questions[i]->type == EVDNS_TYPE_A) {
+			ev_uint32_t ans = htonl(0x7f000001UL);
+			if (evdns_server_request_add_a_reply(req, name,
+				1, &ans, 10) < 0)
+				dns_ok = 0;
+		} else {
+			err = 3; /* NXDOMAIN */
+		}
+	}
+	if (evdns_server_request_respond(req, err) < 0)
+		dns_ok = 0;
+}
+
+struct dns_cache_result {
+	struct event_base *base;
+	int result;
+	int count;
+	int ttl;
+	ev_uint32_t addr;
+};
+
+static void
+dns_cache_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct dns_cache_result *r = arg;
+	r->result = result;
+	r->count = count;
+	r->ttl = ttl;
+	if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count > 0)
+		r->addr = ((ev_uint32_t *)addresses)[0];
+	event_base_loopbreak(r->base);
+}
+
+static void
+dns_cache_resolve(struct evdns_base *dns, const char *name,
+    struct dns_cache_result *r)
+{
+	r->result = -1;
+	r->count = r->ttl = 0;
+	r->addr = 0;
+	if (!evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		dns_cache_cb, r))
+		dns_ok = 0;
+	else
+		event_base_dispatch(r->base);
+}
+
+static void
+test_dns_cache(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_request *req;
+	struct dns_cache_result r;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+
+	dns_ok = 1;
+	dns_cache_n_queries = 0;
+	r.base = data->base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35355);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_cache_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35355"));
+	tt_assert(!evdns_base_set_option(dns, "cache-size:", "16",
+		DNS_OPTION_MISC));
+	tt_assert(!evdns_base_set_option(dns, "cache-negative-ttl:", "30",
+		DNS_OPTION_MISC));
+
+	/* The first lookup goes to the server... */
+	dns_cache_resolve(dns, "cached.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, ==, 10);
+	tt_int_op(dns_cache_n_queries, ==, 1);
+
+	/* ...and the second, in any case, does not. */
+	dns_cache_resolve(dns, "CACHED.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_int_op(r.addr, ==, htonl(0x7f000001UL));
+	tt_assert(r.ttl > 0 && r.ttl <= 10);
+	tt_int_op(dns_cache_n_queries, ==, 1);
+
+	/* Failures are remembered too. */
+	dns_cache_resolve(dns, "missing.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	dns_cache_resolve(dns, "missing.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 2);
+
+	/* An answer from the cache can still be canceled. */
+	r.result = -1;
+	req = evdns_base_resolve_ipv4(dns, "cached.example.com",
+	    DNS_QUERY_NO_SEARCH, dns_cache_cb, &r);
+	tt_assert(req);
+	evdns_cancel_request(dns, req);
+	event_base_dispatch(data->base);
+	tt_int_op(r.result, ==, DNS_ERR_CANCEL);
+
+	evdns_base_clear_cache(dns);
+	dns_cache_resolve(dns, "cached.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(dns_cache_n_queries, ==, 3);
+
+	tt_assert(dns_ok);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static int dns_coalesce_n_left = 0;
+
+static void
+dns_coalesce_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct dns_cache_result *r = arg;
+	r->result = result;
+	r->count = count;
+	if (--dns_coalesce_n_left == 0)
+		event_base_loopbreak(r->base);
+}
+
+static void
+test_dns_coalesce(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_request *reqs[4];
+	struct dns_cache_result r[4];
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	int i;
+
+	dns_ok = 1;
+	dns_cache_n_queries = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35356);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_cache_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35356"));
+
+	/* Four lookups of one name share a single query, even once the
+	 * first caller and one of the others cancel theirs. */
+	for (i = 0; i < 4; ++i) {
+		r[i].base = data->base;
+		r[i].result = -1;
+		reqs[i] = evdns_base_resolve_ipv4(dns, "Cached.example.com",
+		    DNS_QUERY_NO_SEARCH, dns_coalesce_cb, &r[i]);
+		tt_assert(reqs[i]);
+	}
+	evdns_cancel_request(dns, reqs[0]);
+	evdns_cancel_request(dns, reqs[2]);
+	dns_coalesce_n_left = 4;
+	event_base_dispatch(data->base);
+
+	tt_int_op(dns_cache_n_queries, ==, 1);
+	tt_int_op(r[0].result, ==, DNS_ERR_CANCEL);
+	tt_int_op(r[1].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[1].count, ==, 1);
+	tt_int_op(r[2].result, ==, DNS_ERR_CANCEL);
+	tt_int_op(r[3].result, ==, DNS_ERR_NONE);
+
+	/* Once that query is answered, the next lookup sends its own. */
+	dns_coalesce_n_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "cached.example.com",
+		DNS_QUERY_NO_SEARCH, dns_coalesce_cb, &r[0]));
+	event_base_dispatch(data->base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(dns_cache_n_queries, ==, 2);
+
+	tt_assert(dns_ok);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static void
+test_dns_many_inflight(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct dns_cache_result r;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	char name[64];
+	int i;
+
+	dns_ok = 1;
+	dns_cache_n_queries = 0;
+	r.base = data->base;
+	r.result = -1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35357);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_cache_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35357"));
+	tt_assert(!evdns_base_set_option(dns, "max-inflight:", "100000",
+		DNS_OPTION_MISC));
+
+	/* Each of these holds its own transaction id while it waits. */
+	dns_coalesce_n_left = 200;
+	for (i = 0; i < 200; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, name,
+			DNS_QUERY_NO_SEARCH, dns_coalesce_cb, &r));
+	}
+	event_base_dispatch(data->base);
+
+	tt_int_op(dns_coalesce_n_left, ==, 0);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 200);
+	tt_assert(dns_ok);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static int dns_rtt_n_fast = 0, dns_rtt_n_slow = 0;
+
+static void
+dns_rtt_respond_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	if (evdns_server_request_respond(req, 3) < 0)
+		dns_ok = 0;
+}
+
+static void
+dns_rtt_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct event_base *base = data;
+	struct timeval tv = { 0, 50000 };
+
+	if (base) {
+		/* The slow server takes 50 msec to answer. */
+		++dns_rtt_n_slow;
+		event_base_once(base, -1, EV_TIMEOUT, dns_rtt_respond_cb,
+		    req, &tv);
+	} else {
+		++dns_rtt_n_fast;
+		dns_rtt_respond_cb(-1, EV_TIMEOUT, req);
+	}
+}
+
+static void
+test_dns_rtt_pick(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *slow_port = NULL, *fast_port = NULL;
+	struct dns_cache_result r;
+	evutil_socket_t slow_sock = -1, fast_sock = -1;
+	struct sockaddr_in sin;
+	char name[64];
+	int i;
+
+	dns_ok = 1;
+	r.base = data->base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sin.sin_port = htons(35358);
+	slow_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(slow_sock >= 0);
+	evutil_make_socket_nonblocking(slow_sock);
+	tt_assert(bind(slow_sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	slow_port = evdns_add_server_port_with_base(data->base, slow_sock, 0,
+	    dns_rtt_server_cb, data->base);
+	tt_assert(slow_port);
+	sin.sin_port = htons(35359);
+	fast_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fast_sock >= 0);
+	evutil_make_socket_nonblocking(fast_sock);
+	tt_assert(bind(fast_sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	fast_port = evdns_add_server_port_with_base(data->base, fast_sock, 0,
+	    dns_rtt_server_cb, NULL);
+	tt_assert(fast_port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35358"));
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35359"));
+
+	/* Once both have been timed, most lookups go to the fast one, and
+	 * only now and then one to the slow one. */
+	for (i = 0; i < 48; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com", i);
+		dns_cache_resolve(dns, name, &r);
+		tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	}
+	tt_int_op(dns_rtt_n_fast + dns_rtt_n_slow, ==, 48);
+	tt_int_op(dns_rtt_n_slow, >=, 2);
+	tt_int_op(dns_rtt_n_slow, <=, 6);
+	tt_assert(dns_ok);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (slow_port)
+		evdns_close_server_port(slow_port);
+	if (fast_port)
+		evdns_close_server_port(fast_port);
+	if (slow_sock >= 0)
+		EVUTIL_CLOSESOCKET(slow_sock);
+	if (fast_sock >= 0)
+		EVUTIL_CLOSESOCKET(fast_sock);
+}
+
+struct dns_getaddrinfo_result {
+	struct event_base *base;
+	int called;
+	int result;
+	struct addrinfo *ai;
+};
+
+static void
+dns_getaddrinfo_cb(int result, struct addrinfo *ai, void *arg)
+{
+	struct dns_getaddrinfo_result *r = arg;
+	++r->called;
+	r->result = result;
+	r->ai = ai;
+	event_base_loopbreak(r->base);
+}
+
+static void
+dns_getaddrinfo_run(struct evdns_base *dns, const char *node,
+    const char *serv, const struct addrinfo *hints,
+    struct dns_getaddrinfo_result *r)
+{
+	evdns_freeaddrinfo(r->ai);
+	r->ai = NULL;
+	r->called = 0;
+	r->result = -1;
+	if (!evdns_getaddrinfo(dns, node, serv, hints, dns_getaddrinfo_cb, r))
+		dns_ok = 0;
+	else
+		event_base_dispatch(r->base);
+}
+
+static void
+test_dns_getaddrinfo(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_getaddrinfo_request *req;
+	struct dns_getaddrinfo_result r;
+	struct addrinfo hints;
+	struct sockaddr_in *sin4;
+	struct sockaddr_in6 *sin6;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	struct timeval tv = { 0, 200000 };
+	char hosts_fname[32];
+	const char hosts[] =
+	    "# a comment\n"
+	    "10.0.0.1\tmyhost alias # trailing comment\n"
+	    "::2 myhost\n"
+	    "not-an-address otherhost\n";
+	int fd = -1;
+
+	dns_ok = 1;
+	dns_cache_n_queries = 0;
+	memset(&r, 0, sizeof(r));
+	r.base = data->base;
+	hosts_fname[0] = '\0';
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35360);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_cache_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35360"));
+
+	strcpy(hosts_fname, "/tmp/eventtmp.XXXXXX");
+	fd = mkstemp(hosts_fname);
+	tt_assert(fd >= 0);
+	tt_int_op(write(fd, hosts, sizeof(hosts)-1), ==, sizeof(hosts)-1);
+	close(fd);
+	tt_int_op(evdns_base_load_hosts(dns, hosts_fname), ==, 0);
+
+	/* Numeric addresses need no lookup, and give an entry for each
+	 * socket type unless asked for one. */
+	dns_getaddrinfo_run(dns, "127.0.0.1", "80", NULL, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_assert(r.ai);
+	tt_int_op(r.ai->ai_family, ==, AF_INET);
+	tt_int_op(r.ai->ai_socktype, ==, SOCK_STREAM);
+	sin4 = (struct sockaddr_in *)r.ai->ai_addr;
+	tt_int_op(sin4->sin_addr.s_addr, ==, htonl(0x7f000001UL));
+	tt_int_op(sin4->sin_port, ==, htons(80));
+	tt_assert(r.ai->ai_next);
+	tt_int_op(r.ai->ai_next->ai_socktype, ==, SOCK_DGRAM);
+	tt_assert(!r.ai->ai_next->ai_next);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	dns_getaddrinfo_run(dns, "::1", NULL, &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_assert(!r.ai);
+
+	hints.ai_flags = AI_PASSIVE;
+	dns_getaddrinfo_run(dns, NULL, "8080", &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_assert(r.ai && !r.ai->ai_next);
+	sin4 = (struct sockaddr_in *)r.ai->ai_addr;
+	tt_int_op(sin4->sin_addr.s_addr, ==, htonl(INADDR_ANY));
+	tt_int_op(sin4->sin_port, ==, htons(8080));
+
+	/* Names in the hosts file need none either. */
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = 0;
+	dns_getaddrinfo_run(dns, "MyHost", NULL, &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_assert(r.ai);
+	tt_int_op(r.ai->ai_family, ==, AF_INET);
+	sin4 = (struct sockaddr_in *)r.ai->ai_addr;
+	tt_int_op(sin4->sin_addr.s_addr, ==, htonl(0x0a000001UL));
+	tt_assert(r.ai->ai_next && !r.ai->ai_next->ai_next);
+	tt_int_op(r.ai->ai_next->ai_family, ==, AF_INET6);
+	sin6 = (struct sockaddr_in6 *)r.ai->ai_next->ai_addr;
+	tt_int_op(sin6->sin6_addr.s6_addr[15], ==, 2);
+
+	dns_getaddrinfo_run(dns, "alias", NULL, &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_assert(r.ai && !r.ai->ai_next);
+
+	hints.ai_flags = AI_NUMERICHOST;
+	dns_getaddrinfo_run(dns, "myhost", NULL, &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 0);
+
+	/* Anything else asks for A and AAAA records at once. */
+	hints.ai_flags = 0;
+	dns_getaddrinfo_run(dns, "cached.example.com", "443", &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_assert(r.ai && !r.ai->ai_next);
+	sin4 = (struct sockaddr_in *)r.ai->ai_addr;
+	tt_int_op(sin4->sin_addr.s_addr, ==, htonl(0x7f000001UL));
+	tt_int_op(sin4->sin_port, ==, htons(443));
+	tt_int_op(dns_cache_n_queries, ==, 2);
+
+	dns_getaddrinfo_run(dns, "otherhost", NULL, &hints, &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 4);
+
+	/* Bad service names are refused at once. */
+	tt_assert(!evdns_getaddrinfo(dns, "127.0.0.1", "http", NULL,
+		dns_getaddrinfo_cb, &r));
+
+	/* A canceled lookup never calls back, whether it needed a
+	 * nameserver or not. */
+	evdns_freeaddrinfo(r.ai);
+	r.ai = NULL;
+	r.called = 0;
+	req = evdns_getaddrinfo(dns, "127.0.0.1", NULL, NULL,
+	    dns_getaddrinfo_cb, &r);
+	tt_assert(req);
+	evdns_getaddrinfo_cancel(req);
+	req = evdns_getaddrinfo(dns, "cached.example.com", NULL, NULL,
+	    dns_getaddrinfo_cb, &r);
+	tt_assert(req);
+	evdns_getaddrinfo_cancel(req);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(r.called, ==, 0);
+	tt_assert(dns_ok);
+
+end:
+	evdns_freeaddrinfo(r.ai);
+	if (hosts_fname[0])
+		unlink(hosts_fname);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static int dns_batch_n_asked, dns_batch_n_answered;
+static char dns_batch_seen[40];
+
+static void
+dns_batch_respond_cb(evutil_socket_t fd, short what, void *arg)
+{
+	if (evdns_server_request_respond(arg, 0) < 0)
+		dns_ok = 0;
+}
+
+static void
+dns_batch_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct event_base *base = data;
+	const char *name = req->questions[0]->name;
+	ev_uint32_t ans = htonl(0x7f000001UL);
+
+	if (evdns_server_request_add_a_reply(req, name, 1, &ans, 10) < 0)
+		dns_ok = 0;
+	/* Answer half at once, and half from outside the read. */
+	if (++dns_batch_n_asked % 2)
+		dns_batch_respond_cb(-1, EV_TIMEOUT, req);
+	else
+		event_base_once(base, -1, EV_TIMEOUT, dns_batch_respond_cb,
+		    req, NULL);
+}
+
+static void
+dns_batch_client_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	unsigned char buf[512];
+	int r;
+
+	while ((r = recv(fd, (void*)buf, sizeof(buf), 0)) >= 12) {
+		int id = (buf[0] << 8) | buf[1];
+		if (id >= 40 || dns_batch_seen[id] || !(buf[2] & 0x80))
+			dns_ok = 0;
+		else
+			dns_batch_seen[id] = 1;
+		if (++dns_batch_n_answered == 40)
+			event_base_loopexit(base, NULL);
+	}
+}
+
+static void
+test_dns_server_batch(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_server_port *port = NULL;
+	struct event *ev = NULL;
+	evutil_socket_t sock = -1, client = -1;
+	struct sockaddr_in sin;
+	struct timeval tv = { 5, 0 };
+	/* a query for the A record of a.example.com */
+	unsigned char query[] = {
+		0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+		1, 'a', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm',
+		0, 0, 1, 0, 1 };
+	int i;
+
+	dns_ok = 1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35361);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_batch_server_cb, data->base);
+	tt_assert(port);
+
+	client = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(client >= 0);
+	tt_assert(connect(client, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	evutil_make_socket_nonblocking(client);
+	ev = event_new(data->base, client, EV_READ|EV_PERSIST,
+	    dns_batch_client_cb, data->base);
+	tt_assert(ev);
+	event_add(ev, NULL);
+
+	/* More queries than fit in one batch are waiting by the time the
+	 * server port first reads. */
+	for (i = 0; i < 40; ++i) {
+		query[1] = (unsigned char)i;
+		tt_int_op(send(client, (void*)query, sizeof(query), 0), ==,
+		    sizeof(query));
+	}
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(dns_batch_n_asked, ==, 40);
+	tt_int_op(dns_batch_n_answered, ==, 40);
+	tt_assert(dns_ok);
+
+end:
+	if (ev)
+		event_free(ev);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+	if (client >= 0)
+		EVUTIL_CLOSESOCKET(client);
+}
+
+static int dns_answers_n_asked;
+
+static void
+dns_answers_server_cb(struct evdns_server_request *req, void *data)
+{
+	const char *name = req->questions[0]->name;
+	ev_uint32_t ans = htonl(0x7f000001UL);
+	int i, err = 0;
+
+	++dns_answers_n_asked;
+	if (!evutil_strcasecmp(name, "cached.example.com")) {
+		evdns_server_request_set_flags(req, EVDNS_FLAGS_AA);
+		if (evdns_server_request_add_a_reply(req, name, 1, &ans, 10) < 0)
+			dns_ok = 0;
+	} else if (!evutil_strcasecmp(name, "big.example.com")) {
+		/* 40 records are far more than fit in 512 bytes. */
+		for (i = 0; i < 40; ++i) {
+			if (evdns_server_request_add_a_reply(req, name, 1,
+				&ans, 10) < 0)
+				dns_ok = 0;
+		}
+	} else {
+		err = 3; /* NXDOMAIN */
+	}
+	if (evdns_server_request_respond(req, err) < 0)
+		dns_ok = 0;
+}
+
+static void
+test_dns_server_answer_cache(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct dns_cache_result r;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	int i;
+
+	dns_ok = 1;
+	r.base = data->base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35362);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_answers_server_cb, NULL);
+	tt_assert(port);
+	evdns_server_port_set_answer_cache(port, 16, 60);
+
+	/* The client spells each name differently, with randomize-case,
+	 * and only accepts an answer that spells it back the same way. */
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35362"));
+
+	for (i = 0; i < 3; ++i) {
+		dns_cache_resolve(dns, "cached.example.com", &r);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+		tt_int_op(r.count, ==, 1);
+		tt_int_op(r.ttl, ==, 10);
+		tt_int_op(r.addr, ==, htonl(0x7f000001UL));
+	}
+	tt_int_op(dns_answers_n_asked, ==, 1);
+
+	for (i = 0; i < 2; ++i) {
+		dns_cache_resolve(dns, "missing.example.com", &r);
+		tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	}
+	tt_int_op(dns_answers_n_asked, ==, 2);
+
+	/* An answer too big for a datagram is cut short and says so. */
+	dns_cache_resolve(dns, "big.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_TRUNCATED);
+	tt_int_op(dns_answers_n_asked, ==, 3);
+
+	evdns_server_port_clear_answer_cache(port);
+	dns_cache_resolve(dns, "cached.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(dns_answers_n_asked, ==, 4);
+
+	/* With no room kept, every question is asked again. */
+	evdns_server_port_set_answer_cache(port, 0, 60);
+	dns_cache_resolve(dns, "cached.example.com", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(dns_answers_n_asked, ==, 5);
+	tt_assert(dns_ok);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static int dns_search_n_asked;
+
+static void
+dns_search_reply_late(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	/* every other name of the search went out before this reply */
+	if (dns_search_n_asked != 3)
+		dns_ok = 0;
+	evdns_server_request_respond(req, 3);
+}
+
+static void
+dns_search_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct event_base *base = data;
+	const char *name = req->questions[0]->name;
+	struct timeval tv = { 0, 100*1000 };
+	ev_uint32_t ans;
+
+	++dns_search_n_asked;
+	if (!evutil_strcasecmp(name, "host.one.example")) {
+		/* the best name is the slowest to say it does not exist */
+		event_base_once(base, -1, EV_TIMEOUT, dns_search_reply_late,
+		    req, &tv);
+	} else if (!evutil_strcasecmp(name, "host.two.example") ||
+	    !evutil_strcasecmp(name, "host.three.example")) {
+		ans = htonl(evutil_strcasecmp(name, "host.two.example") ?
+		    0x0a000003UL : 0x0a000002UL);
+		evdns_server_request_add_a_reply(req, name, 1, &ans, 10);
+		evdns_server_request_respond(req, 0);
+	} else if (!evutil_strncasecmp(name, "slow", 4)) {
+		evdns_server_request_drop(req);
+	} else {
+		evdns_server_request_respond(req, 3);
+	}
+}
+
+static void
+dns_search_resolve(struct evdns_base *dns, const char *name,
+    struct dns_cache_result *r)
+{
+	r->result = -1;
+	r->count = r->ttl = 0;
+	r->addr = 0;
+	if (!evdns_base_resolve_ipv4(dns, name, 0, dns_cache_cb, r))
+		dns_ok = 0;
+	else
+		event_base_dispatch(r->base);
+}
+
+static void
+dns_search_cancel_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	int *r = arg;
+	*r = result;
+}
+
+static void
+test_dns_search_parallel(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_request *req;
+	struct dns_cache_result r;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	int canceled = -1, shut_down = -1;
+
+	dns_ok = 1;
+	dns_search_n_asked = 0;
+	r.base = data->base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35363);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_search_server_cb, data->base);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35363"));
+	/* Domains added later are searched first. */
+	evdns_base_search_add(dns, "three.example");
+	evdns_base_search_add(dns, "two.example");
+	evdns_base_search_add(dns, "one.example");
+	tt_assert(!evdns_base_set_option(dns, "search-parallel:", "3",
+		DNS_OPTION_SEARCH));
+
+	/* All three domains are asked about at once; the answer for the
+	 * second comes first, but is only used once the first misses.
+	 * Nothing after it is tried. */
+	dns_search_resolve(dns, "host", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.addr, ==, htonl(0x0a000002UL));
+	tt_int_op(dns_search_n_asked, ==, 3);
+	tt_assert(dns_ok);
+
+	/* When every name misses, every name is tried, the bare one last. */
+	dns_search_n_asked = 0;
+	dns_search_resolve(dns, "other", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_search_n_asked, ==, 4);
+
+	/* Canceling the search stops all of its lookups. */
+	req = evdns_base_resolve_ipv4(dns, "slow", 0, dns_search_cancel_cb,
+	    &canceled);
+	tt_assert(req);
+	evdns_cancel_request(dns, req);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(canceled, ==, DNS_ERR_CANCEL);
+
+	/* So does freeing the base, which tells whoever is waiting. */
+	tt_assert(evdns_base_resolve_ipv4(dns, "slow", 0,
+		dns_search_cancel_cb, &shut_down));
+	evdns_base_free(dns, 1);
+	dns = NULL;
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(shut_down, ==, DNS_ERR_SHUTDOWN);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+}
+
+static char dns_hosts_ptr_name[256];
+static struct in6_addr dns_hosts_ipv6_addr;
+
+static void
+dns_hosts_ptr_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct dns_cache_result *r = arg;
+	r->result = result;
+	r->count = count;
+	if (result == DNS_ERR_NONE && type == DNS_PTR && count == 1)
+		evutil_snprintf(dns_hosts_ptr_name,
+		    sizeof(dns_hosts_ptr_name), "%s", *(char **)addresses);
+	event_base_loopbreak(r->base);
+}
+
+static void
+dns_hosts_ipv6_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct dns_cache_result *r = arg;
+	r->result = result;
+	r->count = count;
+	if (result == DNS_ERR_NONE && type == DNS_IPv6_AAAA && count > 0)
+		memcpy(&dns_hosts_ipv6_addr, addresses,
+		    sizeof(dns_hosts_ipv6_addr));
+	event_base_loopbreak(r->base);
+}
+
+static void
+test_dns_hosts(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct dns_cache_result r;
+	evutil_socket_t sock = -1;
+	struct sockaddr_in sin;
+	struct in_addr in;
+	struct in6_addr in6;
+	char hosts_fname[32];
+	const char hosts[] =
+	    "# a comment\n"
+	    "10.1.2.3   Web.Example.Test web\n"
+	    "10.1.2.4\tweb.example.test # another\n"
+	    "::1 localhost6\n"
+	    "fe80::1 v6only.example.test\n";
+	const char hosts2[] = "10.9.9.9 web.example.test\n";
+	int fd;
+
+	dns_ok = 1;
+	dns_cache_n_queries = 0;
+	r.base = data->base;
+	hosts_fname[0] = '\0';
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35364);
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == 0);
+	port = evdns_add_server_port_with_base(data->base, sock, 0,
+	    dns_cache_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35364"));
+
+	strcpy(hosts_fname, "/tmp/eventtmp.XXXXXX");
+	fd = mkstemp(hosts_fname);
+	tt_assert(fd >= 0);
+	tt_int_op(write(fd, hosts, sizeof(hosts)-1), ==, sizeof(hosts)-1);
+	close(fd);
+	tt_int_op(evdns_base_load_hosts(dns, hosts_fname), ==, 0);
+
+	/* Names in the file are answered without asking anyone, whatever
+	 * their case, with every address they have. */
+	dns_cache_resolve(dns, "WEB.example.test", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 2);
+	tt_int_op(r.addr, ==, htonl(0x0a010203UL));
+	dns_cache_resolve(dns, "web", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+
+	r.result = -1;
+	tt_assert(evdns_base_resolve_ipv6(dns, "localhost6", 0,
+		dns_hosts_ipv6_cb, &r));
+	event_base_dispatch(data->base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_assert(IN6_IS_ADDR_LOOPBACK(&dns_hosts_ipv6_addr));
+
+	/* Reverse lookups find the first name given for the address. */
+	in.s_addr = htonl(0x0a010203UL);
+	r.result = -1;
+	tt_assert(evdns_base_resolve_reverse(dns, &in, 0, dns_hosts_ptr_cb,
+		&r));
+	event_base_dispatch(data->base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_str_op(dns_hosts_ptr_name, ==, "Web.Example.Test");
+	memset(&in6, 0, sizeof(in6));
+	in6.s6_addr[0] = 0xfe;
+	in6.s6_addr[1] = 0x80;
+	in6.s6_addr[15] = 1;
+	r.result = -1;
+	tt_assert(evdns_base_resolve_reverse_ipv6(dns, &in6, 0,
+		dns_hosts_ptr_cb, &r));
+	event_base_dispatch(data->base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_str_op(dns_hosts_ptr_name, ==, "v6only.example.test");
+	tt_int_op(dns_cache_n_queries, ==, 0);
+
+	/* A name with no address of the type asked for goes to the
+	 * nameservers. */
+	dns_cache_resolve(dns, "v6only.example.test", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 1);
+
+	/* Once the file changes, it is read again. */
+	sleep(1);
+	fd = open(hosts_fname, O_WRONLY|O_TRUNC);
+	tt_assert(fd >= 0);
+	tt_int_op(write(fd, hosts2, sizeof(hosts2)-1), ==, sizeof(hosts2)-1);
+	close(fd);
+	dns_cache_resolve(dns, "web.example.test", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_int_op(r.addr, ==, htonl(0x0a090909UL));
+	dns_cache_resolve(dns, "web", &r);
+	tt_int_op(r.result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(dns_cache_n_queries, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+	if (hosts_fname[0])
+		unlink(hosts_fname);
+}
+
 #define DNS_LEGACY(name, flags)                                        \
 	{ #name, run_legacy_test_fn, flags|TT_LEGACY, &legacy_setup,   \
                     dns_##name }
@@ -409,6 +1601,24 @@ struct testcase_t dns_testcases[] = {
         DNS_LEGACY(gethostbyname6, TT_FORK|TT_NEED_BASE|TT_NEED_DNS),
         DNS_LEGACY(gethostbyaddr, TT_FORK|TT_NEED_BASE|TT_NEED_DNS),
         { "resolve_reverse", dns_resolve_reverse, TT_FORK, NULL, NULL },
+	{ "bufferevent_connect_hostname", test_bufferevent_connect_hostname,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache", test_dns_cache, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "coalesce", test_dns_coalesce, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
+	{ "many_inflight", test_dns_many_inflight, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "rtt_pick", test_dns_rtt_pick, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
+	{ "getaddrinfo", test_dns_getaddrinfo, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "server_batch", test_dns_server_batch, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "server_answer_cache", test_dns_server_answer_cache,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "search_parallel", test_dns_search_parallel,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "hosts", test_dns_hosts, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 
         END_OF_TESTCASES
 };
@@ -52,8 +52,15 @@
 #include <string.h>
 #include <errno.h>
 
+#ifdef _EVENT_HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "event.h"
 #include "evhttp.h"
+#include "event2/listener.h"
+#include "event2/dns.h"
+#include "event2/dns_struct.h"
 #include "log-internal.h"
 #include "util-internal.h"
 #include "http-internal.h"
@@ -390,6 +397,53 @@ http_basic_test(void)
 	;
 }
 
+static void
+http_serve_socket_test(void)
+{
+	struct bufferevent *bev;
+	struct sockaddr_in sin;
+	evutil_socket_t pair[2] = { -1, -1 };
+	const char *http_request;
+
+	test_ok = 0;
+
+	http = evhttp_new(NULL);
+	evhttp_set_cb(http, "/test", http_basic_cb, NULL);
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		tt_abort_msg("socketpair");
+
+	/* Hand the server one end, as if we had accepted it ourselves. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = htons(8080);
+	evhttp_serve_socket(http, pair[0], (struct sockaddr *)&sin,
+	    sizeof(sin));
+
+	bev = bufferevent_new(pair[1], http_readcb, http_writecb,
+	    http_errorcb, NULL);
+
+	http_request =
+	    "GET /test HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Connection: close\r\n"
+	    "\r\n";
+
+	bufferevent_write(bev, http_request, strlen(http_request));
+
+	event_dispatch();
+
+	bufferevent_free(bev);
+	EVUTIL_CLOSESOCKET(pair[1]);
+
+	evhttp_free(http);
+
+	tt_int_op(test_ok, ==, 2);
+ end:
+	;
+}
+
 static void
 http_delay_reply(evutil_socket_t fd, short what, void *arg)
 {
@@ -1400,6 +1454,48 @@ http_parse_query_test(void *ptr)
 	evhttp_clear_headers(&headers);
 }
 
+static void
+http_query_get_test(void *ptr)
+{
+	const char *uri = "/path?q=test+foo&empty=&bare&&pct=a%2Fb%zz%4&q=2";
+	struct evhttp_query_param param;
+	const char *pos = NULL;
+	char buf[16], small[4];
+
+	/* The first match wins, decoded. */
+	tt_int_op(evhttp_query_get(uri, "q", buf, sizeof(buf)), ==, 8);
+	tt_str_op(buf, ==, "test foo");
+	tt_int_op(evhttp_query_get(uri, "empty", buf, sizeof(buf)), ==, 0);
+	tt_str_op(buf, ==, "");
+	tt_int_op(evhttp_query_get(uri, "pct", buf, sizeof(buf)), ==, 8);
+	tt_str_op(buf, ==, "a/b%zz%4");
+	tt_int_op(evhttp_query_get(uri, "bare", buf, sizeof(buf)), ==, -1);
+	tt_int_op(evhttp_query_get(uri, "Q", buf, sizeof(buf)), ==, -1);
+	tt_int_op(evhttp_query_get("/path", "q", buf, sizeof(buf)), ==, -1);
+
+	/* A value that doesn't fit is cut short, like snprintf(). */
+	tt_int_op(evhttp_query_get(uri, "q", small, sizeof(small)), ==, 8);
+	tt_str_op(small, ==, "tes");
+
+	/* The iterator hands back the raw spans. */
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 1);
+	tt_int_op(param.key_len, ==, 1);
+	tt_assert(!memcmp(param.key, "q", 1));
+	tt_int_op(param.value_len, ==, 8);
+	tt_assert(!memcmp(param.value, "test+foo", 8));
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 1);
+	tt_assert(param.key_len == 5 && param.value_len == 0);
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 1);
+	tt_assert(param.key_len == 3 && !memcmp(param.key, "pct", 3));
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 1);
+	tt_assert(param.value_len == 1 && *param.value == '2');
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 0);
+	tt_int_op(evhttp_query_next(uri, &pos, &param), ==, 0);
+
+ end:
+	;
+}
+
 static void
 http_base_test(void)
 {
@@ -2194,36 +2290,2258 @@ http_negative_content_length_test(void)
 	{ #name, run_legacy_test_fn, TT_ISOLATED|TT_LEGACY, &legacy_setup, \
                     http_##name##_test }
 
-struct testcase_t http_testcases[] = {
-	{ "primitives", http_primitives, 0, NULL, NULL },
-	HTTP_LEGACY(base),
-	{ "bad_headers", http_bad_header_test, 0, NULL, NULL },
-	{ "parse_query", http_parse_query_test, 0, NULL, NULL },
-	HTTP_LEGACY(basic),
-	HTTP_LEGACY(cancel),
-	HTTP_LEGACY(virtual_host),
-	HTTP_LEGACY(post),
-	HTTP_LEGACY(put),
-	HTTP_LEGACY(delete),
-	HTTP_LEGACY(failure),
-	HTTP_LEGACY(connection),
-	HTTP_LEGACY(persist_connection),
-	HTTP_LEGACY(close_detection),
-	HTTP_LEGACY(close_detection_delay),
-	HTTP_LEGACY(incomplete),
-	HTTP_LEGACY(incomplete_timeout),
+static int route_hit = -1;
 
-	HTTP_LEGACY(highport),
-	HTTP_LEGACY(dispatcher),
-	HTTP_LEGACY(multi_line_header),
-	HTTP_LEGACY(negative_content_length),
-	HTTP_LEGACY(chunk_out),
-	HTTP_LEGACY(stream_out),
+static void
+http_route_cb(struct evhttp_request *req, void *arg)
+{
+	route_hit = (int)(ev_ssize_t)arg;
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", NULL);
+	event_base_loopexit(base, NULL);
+}
 
-	HTTP_LEGACY(stream_in),
-	HTTP_LEGACY(stream_in_cancel),
+/* Send a request for uri on host to http over a socketpair, and return the
+ * number of the callback that got it. */
+static int
+http_route_request_host(struct evhttp *http, const char *host,
+    const char *uri)
+{
+	struct sockaddr_in sin;
+	evutil_socket_t pair[2];
+	char request[256];
 
-	HTTP_LEGACY(connection_retry),
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		return (-2);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	evhttp_serve_socket(http, pair[0], (struct sockaddr *)&sin,
+	    sizeof(sin));
+
+	evutil_snprintf(request, sizeof(request),
+	    "GET %s HTTP/1.1\r\nHost: %s\r\n"
+	    "Connection: close\r\n\r\n", uri, host);
+	if (send(pair[1], request, strlen(request), 0) < 0) {
+		EVUTIL_CLOSESOCKET(pair[1]);
+		return (-2);
+	}
+	route_hit = -1;
+	event_base_dispatch(base);
+	EVUTIL_CLOSESOCKET(pair[1]);
+	return (route_hit);
+}
+
+static int
+http_route_request(struct evhttp *http, const char *uri)
+{
+	return http_route_request_host(http, "somehost", uri);
+}
+
+#define ROUTE(x) ((void *)(ev_ssize_t)(x))
+
+static void
+http_routing_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	char uri[32];
+	int i;
+
+	base = data->base;
+	http = evhttp_new(base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_route_cb, ROUTE(0));
+
+	for (i = 0; i < 400; ++i) {
+		evutil_snprintf(uri, sizeof(uri), "/r%d", i);
+		tt_int_op(evhttp_set_cb(http, uri, http_route_cb,
+			ROUTE(1000 + i)), ==, 0);
+	}
+	tt_int_op(evhttp_set_cb(http, "/exact", http_route_cb, ROUTE(1)), ==, 0);
+	tt_int_op(evhttp_set_cb(http, "/exact", http_route_cb, ROUTE(1)), ==, -1);
+	tt_int_op(evhttp_set_prefix_cb(http, "/static/", http_route_cb,
+		ROUTE(2)), ==, 0);
+	tt_int_op(evhttp_set_prefix_cb(http, "/static/img/", http_route_cb,
+		ROUTE(3)), ==, 0);
+	tt_int_op(evhttp_set_prefix_cb(http, "/st", http_route_cb,
+		ROUTE(4)), ==, 0);
+	tt_int_op(evhttp_set_prefix_cb(http, "/st", http_route_cb,
+		ROUTE(4)), ==, -1);
+	tt_int_op(evhttp_set_prefix_cb(http, "/api", http_route_cb,
+		ROUTE(5)), ==, 0);
+	tt_int_op(evhttp_set_cb(http, "/api/v1", http_route_cb, ROUTE(6)), ==, 0);
+	/* An exact callback and a prefix callback can share a path. */
+	tt_int_op(evhttp_set_prefix_cb(http, "/exact", http_route_cb,
+		ROUTE(7)), ==, 0);
+
+	tt_int_op(http_route_request(http, "/exact"), ==, 1);
+	tt_int_op(http_route_request(http, "/exact/x"), ==, 7);
+	tt_int_op(http_route_request(http, "/static/a.css"), ==, 2);
+	tt_int_op(http_route_request(http, "/static/img/x.png"), ==, 3);
+	tt_int_op(http_route_request(http, "/%73tatic/img/"), ==, 3);
+	tt_int_op(http_route_request(http, "/stx"), ==, 4);
+	tt_int_op(http_route_request(http, "/api/v1?q=1"), ==, 6);
+	tt_int_op(http_route_request(http, "/api/v2"), ==, 5);
+	tt_int_op(http_route_request(http, "/r399"), ==, 1399);
+	tt_int_op(http_route_request(http, "/r400"), ==, 0);
+	tt_int_op(http_route_request(http, "/exact%00"), ==, 0);
+
+	/* Taking prefixes away leaves the others alone. */
+	tt_int_op(evhttp_del_prefix_cb(http, "/st"), ==, 0);
+	tt_int_op(evhttp_del_prefix_cb(http, "/st"), ==, -1);
+	tt_int_op(evhttp_del_prefix_cb(http, "/sta"), ==, -1);
+	tt_int_op(http_route_request(http, "/stx"), ==, 0);
+	tt_int_op(http_route_request(http, "/static/img/x.png"), ==, 3);
+	tt_int_op(evhttp_del_prefix_cb(http, "/static/"), ==, 0);
+	tt_int_op(http_route_request(http, "/static/a.css"), ==, 0);
+	tt_int_op(http_route_request(http, "/static/img/x.png"), ==, 3);
+	tt_int_op(evhttp_del_cb(http, "/exact"), ==, 0);
+	tt_int_op(evhttp_del_cb(http, "/exact"), ==, -1);
+	tt_int_op(http_route_request(http, "/exact"), ==, 7);
+
+ end:
+	if (http)
+		evhttp_free(http);
+	http = NULL;
+}
+
+/* Give http a new vhost for pattern that answers everything with route. */
+static struct evhttp *
+http_add_route_vhost(struct evhttp *http, const char *pattern, int route)
+{
+	struct evhttp *vhost = evhttp_new(NULL);
+
+	if (vhost == NULL)
+		return (NULL);
+	evhttp_set_gencb(vhost, http_route_cb, ROUTE(route));
+	if (evhttp_add_virtual_host(http, pattern, vhost) == -1) {
+		evhttp_free(vhost);
+		return (NULL);
+	}
+	return (vhost);
+}
+
+static void
+http_vhost_lookup_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *first = NULL, *vhost;
+	char host[32];
+	int i;
+
+	base = data->base;
+	http = evhttp_new(base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_route_cb, ROUTE(0));
+
+	for (i = 0; i < 2000; ++i) {
+		evutil_snprintf(host, sizeof(host), "h%d.example.com", i);
+		tt_assert(http_add_route_vhost(http, host, 10000 + i));
+	}
+	tt_assert(http_add_route_vhost(http, "*.example.com", 1));
+	tt_assert(http_add_route_vhost(http, "*.deep.example.com", 2));
+	tt_assert(http_add_route_vhost(http, "www.*", 3));
+	tt_assert(http_add_route_vhost(http, "*.org", 4));
+	tt_assert(first = http_add_route_vhost(http, "dup.example.net", 5));
+	tt_assert(http_add_route_vhost(http, "DUP.example.net", 6));
+
+	tt_int_op(http_route_request_host(http, "h0.example.com", "/"), ==,
+	    10000);
+	tt_int_op(http_route_request_host(http, "H1999.Example.COM", "/"), ==,
+	    11999);
+	tt_int_op(http_route_request_host(http, "h2000.example.com", "/"), ==,
+	    1);
+	tt_int_op(http_route_request_host(http, "a.b.example.com", "/"), ==, 1);
+	tt_int_op(http_route_request_host(http, "a.deep.example.com", "/"), ==,
+	    2);
+	tt_int_op(http_route_request_host(http, "example.com", "/"), ==, 0);
+	tt_int_op(http_route_request_host(http, "www.x.org", "/"), ==, 4);
+	tt_int_op(http_route_request_host(http, "wwwxorg", "/"), ==, 0);
+	tt_int_op(http_route_request_host(http, "www.x.orgy", "/"), ==, 3);
+	tt_int_op(http_route_request_host(http, "dup.example.net", "/"), ==, 5);
+
+	/* Removing a vhost lets the next one with its pattern take over. */
+	tt_int_op(evhttp_remove_virtual_host(http, first), ==, 0);
+	evhttp_free(first);
+	tt_int_op(http_route_request_host(http, "dup.example.net", "/"), ==, 6);
+	tt_int_op(evhttp_remove_virtual_host(http, first = TAILQ_LAST(
+		    &http->virtualhosts, vhostsq)), ==, 0);
+	evhttp_free(first);
+	tt_int_op(http_route_request_host(http, "dup.example.net", "/"), ==, 0);
+
+	vhost = TAILQ_FIRST(&http->virtualhosts);
+	tt_int_op(evhttp_remove_virtual_host(http, vhost), ==, 0);
+	evhttp_free(vhost);
+	tt_int_op(http_route_request_host(http, "h0.example.com", "/"), ==, 1);
+
+ end:
+	if (http)
+		evhttp_free(http);
+	http = NULL;
+}
+
+static int n_header_mallocs;
+
+static void *
+http_counting_malloc(size_t sz)
+{
+	++n_header_mallocs;
+	return malloc(sz);
+}
+
+static void *
+http_counting_realloc(void *p, size_t sz)
+{
+	++n_header_mallocs;
+	return realloc(p, sz);
+}
+
+static void
+http_header_store_test(void *arg)
+{
+	struct evhttp_request *req = NULL;
+	struct evbuffer *buf = NULL;
+	struct evkeyvalq user_headers;
+	struct evkeyval user_header;
+	int i;
+
+	tt_assert(req = evhttp_request_new(NULL, NULL));
+	tt_assert(buf = evbuffer_new());
+
+	evbuffer_add_printf(buf,
+	    "Host: www.example.com\r\n"
+	    "User-Agent: regress/1.0\r\n"
+	    "Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n"
+	    "Accept-Language: en-US,en;q=0.5\r\n"
+	    "Accept-Encoding: gzip, deflate\r\n"
+	    "Connection: keep-alive\r\n"
+	    "Cookie: session=0123456789abcdef\r\n"
+	    "Cache-Control: max-age=0\r\n"
+	    "X-Folded: first\r\n"
+	    "\tsecond\r\n"
+	    "host: second.example.com\r\n"
+	    "Content-Type: text/plain\r\n"
+	    "Content-Length:    0\n"
+	    "\r\n"
+	    "body");
+
+	/* Twelve headers, one chunk. */
+	event_set_mem_functions(http_counting_malloc, http_counting_realloc,
+	    free);
+	tt_int_op(evhttp_parse_headers(req, buf), ==, ALL_DATA_READ);
+	event_set_mem_functions(NULL, NULL, NULL);
+	tt_int_op(n_header_mallocs, <=, 1);
+	tt_int_op(evbuffer_get_length(buf), ==, 4);
+
+	tt_str_op(evhttp_find_header(req->input_headers, "HOST"), ==,
+	    "www.example.com");
+	tt_str_op(evhttp_find_header(req->input_headers, "content-length"),
+	    ==, "0");
+	tt_str_op(evhttp_find_header(req->input_headers, "X-Folded"), ==,
+	    "first\tsecond");
+	tt_assert(evhttp_find_header(req->input_headers, "Hostx") == NULL);
+
+	/* Removing a header uncovers the next one with its name. */
+	tt_int_op(evhttp_remove_header(req->input_headers, "Host"), ==, 0);
+	tt_str_op(evhttp_find_header(req->input_headers, "Host"), ==,
+	    "second.example.com");
+	tt_int_op(evhttp_add_header(req->input_headers, "X-Added", "yes"),
+	    ==, 0);
+	tt_str_op(evhttp_find_header(req->input_headers, "x-added"), ==,
+	    "yes");
+
+	evhttp_clear_headers(req->input_headers);
+	tt_assert(TAILQ_EMPTY(req->input_headers));
+	tt_assert(evhttp_find_header(req->input_headers, "Host") == NULL);
+
+	/* More names than the index holds. */
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	for (i = 0; i < 64; ++i)
+		evbuffer_add_printf(buf, "X-Header-%d: %d\r\n", i, i);
+	evbuffer_add_printf(buf, "\r\n");
+	tt_int_op(evhttp_parse_headers(req, buf), ==, ALL_DATA_READ);
+	tt_str_op(evhttp_find_header(req->input_headers, "x-header-0"), ==,
+	    "0");
+	tt_str_op(evhttp_find_header(req->input_headers, "X-HEADER-63"), ==,
+	    "63");
+	tt_assert(evhttp_find_header(req->input_headers, "X-Header-64") ==
+	    NULL);
+
+	/* A header line needs a colon. */
+	evbuffer_add_printf(buf, "Broken\r\n");
+	tt_int_op(evhttp_parse_headers(req, buf), ==, DATA_CORRUPTED);
+	evbuffer_add_printf(buf, "Partial: line");
+	tt_int_op(evhttp_parse_headers(req, buf), ==, MORE_DATA_EXPECTED);
+
+	/* A list the user built may hold evkeyvals that evhttp didn't
+	 * allocate. */
+	TAILQ_INIT(&user_headers);
+	user_header.key = (char *)"Host";
+	user_header.value = (char *)"www.example.com";
+	TAILQ_INSERT_TAIL(&user_headers, &user_header, next);
+	tt_str_op(evhttp_find_header(&user_headers, "host"), ==,
+	    "www.example.com");
+	tt_int_op(evhttp_add_header(&user_headers, "X-Added", "yes"), ==, 0);
+	tt_str_op(evhttp_find_header(&user_headers, "x-added"), ==, "yes");
+	TAILQ_REMOVE(&user_headers, &user_header, next);
+	evhttp_clear_headers(&user_headers);
+	tt_assert(TAILQ_EMPTY(&user_headers));
+
+ end:
+	event_set_mem_functions(NULL, NULL, NULL);
+	if (req)
+		evhttp_request_free(req);
+	if (buf)
+		evbuffer_free(buf);
+}
+
+static void
+http_parse_incremental_test(void *arg)
+{
+	const char request[] =
+	    "GET /index.html?a=b HTTP/1.1\r\n"
+	    "Host: www.example.com\r\n"
+	    "Accept: */*\r\n"
+	    "\r\n";
+	struct evhttp_request *req = NULL;
+	struct evbuffer *buf = NULL;
+	struct evhttp_header_store *store;
+	enum message_read_status status = MORE_DATA_EXPECTED;
+	size_t i;
+	int in_headers = 0;
+
+	tt_assert(req = evhttp_request_new(NULL, NULL));
+	tt_assert(buf = evbuffer_new());
+	req->kind = EVHTTP_REQUEST;
+	store = EVUTIL_UPCAST(req->input_headers, struct evhttp_header_store,
+	    headers);
+
+	/* Feed the request in a byte at a time. */
+	for (i = 0; i < sizeof(request) - 1; ++i) {
+		evbuffer_add(buf, request + i, 1);
+		if (!in_headers) {
+			status = evhttp_parse_firstline(req, buf);
+			if (status == ALL_DATA_READ) {
+				in_headers = 1;
+				continue;
+			}
+		} else {
+			status = evhttp_parse_headers(req, buf);
+			if (status == ALL_DATA_READ)
+				break;
+		}
+		tt_int_op(status, ==, MORE_DATA_EXPECTED);
+		/* Nothing got searched twice. */
+		tt_int_op(store->scan_off, ==, evbuffer_get_length(buf));
+	}
+	tt_int_op(status, ==, ALL_DATA_READ);
+	tt_int_op(i, ==, sizeof(request) - 2);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(req->type, ==, EVHTTP_REQ_GET);
+	tt_int_op(req->major, ==, 1);
+	tt_int_op(req->minor, ==, 1);
+	tt_str_op(req->uri, ==, "/index.html?a=b");
+	tt_str_op(evhttp_find_header(req->input_headers, "Accept"), ==,
+	    "*/*");
+	evhttp_request_free(req);
+	req = NULL;
+
+	/* A response line, which may have spaces in its reason phrase. */
+	tt_assert(req = evhttp_request_new(NULL, NULL));
+	evbuffer_add_printf(buf, "HTTP/1.0 404 Not Found\r\n");
+	tt_int_op(evhttp_parse_firstline(req, buf), ==, ALL_DATA_READ);
+	tt_int_op(req->response_code, ==, 404);
+	tt_str_op(req->response_code_line, ==, "Not Found");
+	tt_int_op(req->minor, ==, 0);
+	evhttp_request_free(req);
+	req = NULL;
+
+	tt_assert(req = evhttp_request_new(NULL, NULL));
+	req->kind = EVHTTP_REQUEST;
+	evbuffer_add_printf(buf, "GET / HTTP/1.1 extra\r\n");
+	tt_int_op(evhttp_parse_firstline(req, buf), ==, DATA_CORRUPTED);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	evbuffer_add_printf(buf, "GETS / HTTP/1.1\r\n");
+	tt_int_op(evhttp_parse_firstline(req, buf), ==, DATA_CORRUPTED);
+
+ end:
+	if (req)
+		evhttp_request_free(req);
+	if (buf)
+		evbuffer_free(buf);
+}
+
+/* A server for checking pipelining.  Once connection i has
+ * pipe_expect[i] requests waiting, it answers up to pipe_answer[i] of them
+ * in one write, each with the last letter of its path as the body; if that
+ * leaves any unanswered, it hangs up.  pipe_seen gets the letters of the
+ * requests it sees, with a '.' after each batch it answers and a '|' before
+ * each connection after the first. */
+struct pipe_conn {
+	struct bufferevent *bev;
+	int which;
+	char pending[8];
+	int n_pending;
+};
+static struct pipe_conn pipe_conns[2];
+static int pipe_n_conns;
+static int pipe_expect[2], pipe_answer[2];
+static char pipe_seen[32], pipe_got[16];
+static int pipe_n_done, pipe_n_wanted;
+
+static void
+http_pipe_append(char *s, size_t size, char c)
+{
+	size_t len = strlen(s);
+	if (len + 1 < size) {
+		s[len] = c;
+		s[len + 1] = '\0';
+	}
+}
+
+static void
+http_pipe_server_writecb(struct bufferevent *bev, void *arg)
+{
+	struct pipe_conn *conn = arg;
+
+	/* We said all we're going to; hang up. */
+	bufferevent_free(bev);
+	conn->bev = NULL;
+}
+
+static void
+http_pipe_server_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct pipe_conn *conn = arg;
+
+	bufferevent_free(bev);
+	conn->bev = NULL;
+}
+
+static void
+http_pipe_server_readcb(struct bufferevent *bev, void *arg)
+{
+	struct pipe_conn *conn = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer_ptr end;
+	int i, n;
+
+	while ((end = evbuffer_search(input, "\r\n\r\n", 4, NULL)).pos >= 0) {
+		const char *req = (const char *)evbuffer_pullup(input,
+		    end.pos + 4);
+		const char *path = memchr(req, '/', end.pos);
+		if (path != NULL &&
+		    conn->n_pending < (int)sizeof(conn->pending)) {
+			conn->pending[conn->n_pending++] = path[1];
+			http_pipe_append(pipe_seen, sizeof(pipe_seen), path[1]);
+		}
+		evbuffer_drain(input, end.pos + 4);
+	}
+
+	if (conn->n_pending < pipe_expect[conn->which])
+		return;
+	n = conn->n_pending;
+	if (n > pipe_answer[conn->which])
+		n = pipe_answer[conn->which];
+	for (i = 0; i < n; ++i)
+		evbuffer_add_printf(bufferevent_get_output(bev),
+		    "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n%c",
+		    conn->pending[i]);
+	http_pipe_append(pipe_seen, sizeof(pipe_seen), '.');
+	if (n < conn->n_pending)
+		bufferevent_setcb(bev, NULL, http_pipe_server_writecb,
+		    http_pipe_server_eventcb, conn);
+	conn->n_pending = 0;
+}
+
+static void
+http_pipe_accept_cb(struct evconnlistener *lev, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct pipe_conn *conn;
+
+	if (pipe_n_conns == 2) {
+		EVUTIL_CLOSESOCKET(fd);
+		return;
+	}
+	if (pipe_n_conns > 0)
+		http_pipe_append(pipe_seen, sizeof(pipe_seen), '|');
+	conn = &pipe_conns[pipe_n_conns];
+	conn->which = pipe_n_conns++;
+	conn->n_pending = 0;
+	conn->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(conn->bev, http_pipe_server_readcb, NULL,
+	    http_pipe_server_eventcb, conn);
+	bufferevent_enable(conn->bev, EV_READ|EV_WRITE);
+}
+
+/* Note what a request got: its letter if the right body came back, or the
+ * letter in upper case if it failed. */
+static void
+http_pipe_request_done(struct evhttp_request *req, void *arg)
+{
+	char c = (char)(ev_ssize_t)arg;
+
+	if (req == NULL)
+		c = EVUTIL_TOUPPER(c);
+	else if (req->response_code != HTTP_OK ||
+	    evbuffer_get_length(req->input_buffer) != 1 ||
+	    *evbuffer_pullup(req->input_buffer, 1) != c)
+		c = '?';
+	http_pipe_append(pipe_got, sizeof(pipe_got), c);
+	if (++pipe_n_done == pipe_n_wanted)
+		event_base_loopexit(base, NULL);
+}
+
+/* Start a new round of the pipelining test, with the server behaving as
+ * described above, and the client making the requests in paths (upper case
+ * for POST) on a new connection with the given depth. */
+static struct evhttp_connection *
+http_pipe_round(ev_uint16_t port, int depth, const char *paths,
+    int expect0, int answer0, int expect1, int answer1)
+{
+	struct evhttp_connection *evcon;
+	struct timeval tv = { 10, 0 };
+	char uri[3] = "/x";
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (pipe_conns[i].bev != NULL)
+			bufferevent_free(pipe_conns[i].bev);
+		pipe_conns[i].bev = NULL;
+	}
+	pipe_n_conns = pipe_n_done = 0;
+	pipe_seen[0] = pipe_got[0] = '\0';
+	pipe_expect[0] = expect0;
+	pipe_answer[0] = answer0;
+	pipe_expect[1] = expect1;
+	pipe_answer[1] = answer1;
+	pipe_n_wanted = (int)strlen(paths);
+
+	evcon = evhttp_connection_base_new(base, "127.0.0.1", port);
+	if (evcon == NULL)
+		return (NULL);
+	evhttp_connection_set_pipeline_depth(evcon, depth);
+	for (i = 0; paths[i]; ++i) {
+		char c = EVUTIL_TOLOWER(paths[i]);
+		struct evhttp_request *req = evhttp_request_new(
+			http_pipe_request_done, (void *)(ev_ssize_t)c);
+		uri[1] = c;
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		evhttp_make_request(evcon, req,
+		    c == paths[i] ? EVHTTP_REQ_GET : EVHTTP_REQ_POST, uri);
+	}
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	return (evcon);
+}
+
+static void
+http_pipelining_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *lev = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	int i;
+
+	base = data->base;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	lev = evconnlistener_new_bind(base, http_pipe_accept_cb, NULL,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, 16,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(lev);
+	tt_int_op(getsockname(evconnlistener_get_fd(lev),
+		(struct sockaddr *)&sin, &slen), ==, 0);
+
+	/* All three go out before any answer comes back, and the answers,
+	 * which arrive together, get matched up in order. */
+	evcon = http_pipe_round(ntohs(sin.sin_port), 3, "abc", 3, 3, 1, 1);
+	tt_assert(evcon);
+	tt_str_op(pipe_seen, ==, "abc.");
+	tt_str_op(pipe_got, ==, "abc");
+	evhttp_connection_free(evcon);
+
+	/* Once the server hangs up, the request we were waiting on fails,
+	 * the GET behind it goes out again, and the POST fails. */
+	evcon = http_pipe_round(ntohs(sin.sin_port), 4, "abcD", 4, 1, 1, 1);
+	tt_assert(evcon);
+	tt_str_op(pipe_seen, ==, "abcd.|c.");
+	tt_str_op(pipe_got, ==, "aBDc");
+	evhttp_connection_free(evcon);
+
+	/* Nothing goes out behind a POST until it's answered. */
+	evcon = http_pipe_round(ntohs(sin.sin_port), 4, "Efg", 1, 4, 1, 1);
+	tt_assert(evcon);
+	tt_assert(!strncmp(pipe_seen, "e.f", 3));
+	tt_str_op(pipe_got, ==, "efg");
+
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	for (i = 0; i < 2; ++i) {
+		if (pipe_conns[i].bev != NULL)
+			bufferevent_free(pipe_conns[i].bev);
+		pipe_conns[i].bev = NULL;
+	}
+	if (lev)
+		evconnlistener_free(lev);
+}
+
+static int pool_n_done, pool_n_wanted;
+
+static void
+http_pool_request_done(struct evhttp_request *req, void *arg)
+{
+	if (req != NULL && req->response_code == HTTP_OK)
+		++pool_n_done;
+	if (pool_n_done == pool_n_wanted)
+		event_base_loopexit(base, NULL);
+}
+
+/* Make n requests to /test on pool at once, and wait for them. */
+static int
+http_pool_requests(struct evhttp_pool *pool, short port, int n)
+{
+	struct timeval tv = { 10, 0 };
+	int i;
+
+	pool_n_done = 0;
+	pool_n_wanted = n;
+	for (i = 0; i < n; ++i) {
+		struct evhttp_request *req = evhttp_request_new(
+			http_pool_request_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (evhttp_pool_make_request(pool, "127.0.0.1", port, req,
+			EVHTTP_REQ_GET, "/test") == -1)
+			return (-1);
+	}
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	return (pool_n_done);
+}
+
+static void
+http_connection_pool_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_pool *pool = NULL;
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
+	struct timeval tv = { 0, 100*1000 };
+	evutil_socket_t fd0, fd1;
+	short port = -1;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	tt_assert(pool = evhttp_pool_new(base));
+	evhttp_pool_set_max_per_host(pool, 2);
+
+	/* Three requests at once share two connections, which stay open. */
+	tt_int_op(http_pool_requests(pool, port, 3), ==, 3);
+	tt_int_op(HT_SIZE(&pool->hosts), ==, 1);
+	tt_assert(evcon = TAILQ_FIRST(&pool->idle));
+	host = evcon->pool_host;
+	tt_int_op(host->n_connections, ==, 2);
+	tt_int_op(pool->n_idle, ==, 2);
+
+	/* The next request goes out on one of them without reconnecting. */
+	fd0 = TAILQ_FIRST(&pool->idle)->fd;
+	fd1 = TAILQ_LAST(&pool->idle, evconq)->fd;
+	tt_int_op(http_pool_requests(pool, port, 1), ==, 1);
+	tt_int_op(host->n_connections, ==, 2);
+	tt_int_op(pool->n_idle, ==, 2);
+	evcon = TAILQ_FIRST(&pool->idle);
+	tt_assert(evcon->fd == fd0 || evcon->fd == fd1);
+	evcon = TAILQ_LAST(&pool->idle, evconq);
+	tt_assert(evcon->fd == fd0 || evcon->fd == fd1);
+
+	/* With room for one idle connection, the older one gets closed. */
+	evhttp_pool_set_max_idle(pool, 1);
+	tt_int_op(http_pool_requests(pool, port, 1), ==, 1);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(host->n_connections, ==, 1);
+	tt_int_op(pool->n_idle, ==, 1);
+	evcon = TAILQ_FIRST(&pool->idle);
+	tt_assert(evcon->fd == fd0 || evcon->fd == fd1);
+
+	/* When the server hangs up, the pool lets go of the connection. */
+	evhttp_free(http);
+	http = NULL;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(pool->n_idle, ==, 0);
+	tt_assert(HT_EMPTY(&pool->hosts));
+
+ end:
+	if (pool)
+		evhttp_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+#ifndef WIN32
+static int file_code;
+static char file_body[64], file_etag[40], file_range[40], file_length[16];
+
+static void
+http_file_request_done(struct evhttp_request *req, void *arg)
+{
+	const char *h;
+	size_t n;
+
+	file_code = req ? req->response_code : -1;
+	file_body[0] = file_etag[0] = file_range[0] = file_length[0] = '\0';
+	if (req != NULL) {
+		n = evbuffer_get_length(req->input_buffer);
+		if (n >= sizeof(file_body))
+			n = sizeof(file_body) - 1;
+		evbuffer_remove(req->input_buffer, file_body, n);
+		file_body[n] = '\0';
+		if ((h = evhttp_find_header(req->input_headers, "ETag")))
+			evutil_snprintf(file_etag, sizeof(file_etag), "%s", h);
+		if ((h = evhttp_find_header(req->input_headers,
+			    "Content-Range")))
+			evutil_snprintf(file_range, sizeof(file_range), "%s",
+			    h);
+		if ((h = evhttp_find_header(req->input_headers,
+			    "Content-Length")))
+			evutil_snprintf(file_length, sizeof(file_length), "%s",
+			    h);
+	}
+	event_base_loopexit(base, NULL);
+}
+
+/* Make one request to the file server, with up to one extra header, and
+ * wait for the answer. */
+static int
+http_file_request(struct evhttp_connection *evcon, enum evhttp_cmd_type type,
+    const char *uri, const char *key, const char *value)
+{
+	struct evhttp_request *req;
+
+	file_code = 0;
+	req = evhttp_request_new(http_file_request_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (key != NULL)
+		evhttp_add_header(req->output_headers, key, value);
+	if (evhttp_make_request(evcon, req, type, uri) == -1)
+		return (-1);
+	event_base_dispatch(base);
+	return (file_code);
+}
+
+static int
+http_write_file(const char *dir, const char *name, const char *contents)
+{
+	char path[256];
+	FILE *f;
+
+	evutil_snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((f = fopen(path, "w")) == NULL)
+		return (-1);
+	fputs(contents, f);
+	fclose(f);
+	return (0);
+}
+
+static void
+http_file_server_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_file_server *fs = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_file *file;
+	char dir[] = "/tmp/regress-http-XXXXXX", path[256], etag[40];
+	short port = -1;
+	int fd;
+
+	base = data->base;
+	tt_assert(mkdtemp(dir));
+	evutil_snprintf(path, sizeof(path), "%s/sub", dir);
+	tt_int_op(mkdir(path, 0700), ==, 0);
+	tt_int_op(http_write_file(dir, "a.txt",
+		"abcdefghijklmnopqrstuvwxyz"), ==, 0);
+	tt_int_op(http_write_file(dir, "sub/index.html", "<p>hi</p>"), ==, 0);
+
+	http = http_setup(&port, base);
+	tt_assert(fs = evhttp_file_server_new("/static/", dir, 0));
+	tt_int_op(evhttp_set_prefix_cb(http, "/static/",
+		evhttp_file_server_cb, fs), ==, 0);
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a.txt",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(file_body, ==, "abcdefghijklmnopqrstuvwxyz");
+	tt_assert(file_etag[0] == '"');
+	evutil_snprintf(etag, sizeof(etag), "%s", file_etag);
+	tt_int_op(fs->n_files, ==, 1);
+	file = TAILQ_FIRST(&fs->lru);
+	fd = file->fd;
+
+	/* After that, the file is served from the one we have open. */
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a.txt",
+		"If-None-Match", etag), ==, HTTP_NOTMODIFIED);
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a%2etxt",
+		"Range", "bytes=2-4"), ==, 206);
+	tt_str_op(file_body, ==, "cde");
+	tt_str_op(file_range, ==, "bytes 2-4/26");
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a.txt",
+		"Range", "bytes=-3"), ==, 206);
+	tt_str_op(file_body, ==, "xyz");
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a.txt",
+		"Range", "bytes=26-"), ==, 416);
+	tt_str_op(file_range, ==, "bytes */26");
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_HEAD, "/static/a.txt",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(file_length, ==, "26");
+	tt_str_op(file_body, ==, "");
+	tt_int_op(fs->n_files, ==, 1);
+	tt_assert(TAILQ_FIRST(&fs->lru) == file);
+	tt_int_op(file->fd, ==, fd);
+
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/sub/",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(file_body, ==, "<p>hi</p>");
+	tt_int_op(fs->n_files, ==, 2);
+
+	/* Once it's time to check again, a changed file gets reopened. */
+	tt_int_op(http_write_file(dir, "a.txt", "changed"), ==, 0);
+	file->checked -= HTTP_FILE_RECHECK;
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/a.txt",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(file_body, ==, "changed");
+	tt_str_op(file_etag, !=, etag);
+
+	/* Nothing outside the root, and nothing that isn't there. */
+	evhttp_connection_free(evcon);
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET,
+		"/static/sub/../../etc/passwd", NULL, NULL), ==, HTTP_NOTFOUND);
+	evhttp_connection_free(evcon);
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+	tt_int_op(http_file_request(evcon, EVHTTP_REQ_GET, "/static/b.txt",
+		NULL, NULL), ==, HTTP_NOTFOUND);
+
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (fs)
+		evhttp_file_server_free(fs);
+	evutil_snprintf(path, sizeof(path), "%s/a.txt", dir);
+	unlink(path);
+	evutil_snprintf(path, sizeof(path), "%s/sub/index.html", dir);
+	unlink(path);
+	evutil_snprintf(path, sizeof(path), "%s/sub", dir);
+	rmdir(path);
+	rmdir(dir);
+}
+#endif
+
+static struct evhttp_header_block *test_block;
+static char block_type[32], block_fixed[8], block_date[40];
+static int block_minor;
+
+static void
+http_block_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	evbuffer_add_printf(evb, "plain");
+	evhttp_add_header(req->output_headers, "X-Late", "1");
+	evhttp_send_reply_block(req, test_block, evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_block_request_done(struct evhttp_request *req, void *arg)
+{
+	const char *h;
+
+	block_type[0] = block_fixed[0] = block_date[0] = '\0';
+	block_minor = -1;
+	if (req != NULL && req->response_code == HTTP_OK &&
+	    evbuffer_get_length(req->input_buffer) == 5 &&
+	    evhttp_find_header(req->input_headers, "X-Late") != NULL) {
+		block_minor = req->minor;
+		if ((h = evhttp_find_header(req->input_headers,
+			    "Content-Type")))
+			evutil_snprintf(block_type, sizeof(block_type), "%s",
+			    h);
+		if ((h = evhttp_find_header(req->input_headers, "X-Fixed")))
+			evutil_snprintf(block_fixed, sizeof(block_fixed), "%s",
+			    h);
+		if ((h = evhttp_find_header(req->input_headers, "Date")))
+			evutil_snprintf(block_date, sizeof(block_date), "%s",
+			    h);
+	}
+	event_base_loopexit(base, NULL);
+}
+
+static void
+http_header_block_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct evkeyvalq headers;
+	short port = -1;
+	int minor;
+
+	base = data->base;
+	TAILQ_INIT(&headers);
+	evhttp_add_header(&headers, "Content-Length", "5");
+	tt_assert(evhttp_header_block_new(HTTP_OK, "OK", &headers) == NULL);
+	evhttp_clear_headers(&headers);
+	evhttp_add_header(&headers, "Content-Type", "text/plain");
+	evhttp_add_header(&headers, "X-Fixed", "yes");
+	tt_assert(test_block = evhttp_header_block_new(HTTP_OK, "OK",
+		&headers));
+
+	http = http_setup(&port, base);
+	evhttp_set_cb(http, "/block", http_block_cb, NULL);
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+
+	/* The block goes out as is for HTTP/1.1, and behind a status line
+	 * of the right version for HTTP/1.0. */
+	for (minor = 1; minor >= 0; --minor) {
+		req = evhttp_request_new(http_block_request_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		req->major = 1;
+		req->minor = minor;
+		tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+			"/block"), ==, 0);
+		event_base_dispatch(base);
+		tt_int_op(block_minor, ==, minor);
+		tt_str_op(block_type, ==, "text/plain");
+		tt_str_op(block_fixed, ==, "yes");
+		if (minor == 1) {
+			/* the Date came from the server's cache */
+			tt_assert(block_date[0]);
+			tt_str_op(block_date, ==, http->date.date);
+		}
+	}
+
+ end:
+	evhttp_clear_headers(&headers);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (test_block)
+		evhttp_header_block_free(test_block);
+}
+
+#if defined(_EVENT_HAVE_LIBZ) && !defined(WIN32)
+#define COMPRESS_TEXT "all work and no play makes jack a dull boy\n"
+
+static char compress_encoding[16], compress_vary[32], compress_etag[40];
+static struct evbuffer *compress_body;
+static size_t compress_raw_len;
+static int compress_code;
+
+static void
+http_compress_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int i, n = !strcmp(req->uri, "/small") ? 1 : 50;
+
+	for (i = 0; i < n; ++i)
+		evbuffer_add_printf(evb, COMPRESS_TEXT);
+	if (!strcmp(req->uri, "/image"))
+		evhttp_add_header(req->output_headers, "Content-Type",
+		    "image/png");
+	evhttp_send_reply(req, HTTP_OK, "OK", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_compress_stream_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int i, j;
+
+	evhttp_send_reply_start(req, HTTP_OK, "OK");
+	for (i = 0; i < 5; ++i) {
+		for (j = 0; j < 10; ++j)
+			evbuffer_add_printf(evb, COMPRESS_TEXT);
+		evhttp_send_reply_chunk(req, evb);
+	}
+	evhttp_send_reply_end(req);
+	evbuffer_free(evb);
+}
+
+/* Undo whichever of gzip or deflate was used on in. */
+static int
+http_inflate(struct evbuffer *in, struct evbuffer *out)
+{
+	unsigned char buf[1024];
+	z_stream z;
+	int r;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, MAX_WBITS + 32) != Z_OK)
+		return (-1);
+	z.avail_in = (uInt)evbuffer_get_length(in);
+	z.next_in = evbuffer_pullup(in, -1);
+	do {
+		z.next_out = buf;
+		z.avail_out = sizeof(buf);
+		r = inflate(&z, Z_NO_FLUSH);
+		evbuffer_add(out, buf, sizeof(buf) - z.avail_out);
+	} while (r == Z_OK);
+	inflateEnd(&z);
+	return (r == Z_STREAM_END && z.avail_in == 0 ? 0 : -1);
+}
+
+static void
+http_compress_request_done(struct evhttp_request *req, void *arg)
+{
+	const char *h;
+
+	compress_code = req ? req->response_code : -1;
+	compress_encoding[0] = compress_vary[0] = compress_etag[0] = '\0';
+	evbuffer_drain(compress_body, evbuffer_get_length(compress_body));
+	compress_raw_len = 0;
+	if (req != NULL) {
+		compress_raw_len = evbuffer_get_length(req->input_buffer);
+		if ((h = evhttp_find_header(req->input_headers,
+			    "Content-Encoding")) != NULL) {
+			evutil_snprintf(compress_encoding,
+			    sizeof(compress_encoding), "%s", h);
+			if (compress_raw_len > 0 &&
+			    http_inflate(req->input_buffer, compress_body))
+				compress_code = -1;
+		} else {
+			evbuffer_add_buffer(compress_body, req->input_buffer);
+		}
+		if ((h = evhttp_find_header(req->input_headers, "Vary")))
+			evutil_snprintf(compress_vary, sizeof(compress_vary),
+			    "%s", h);
+		if ((h = evhttp_find_header(req->input_headers, "ETag")))
+			evutil_snprintf(compress_etag, sizeof(compress_etag),
+			    "%s", h);
+	}
+	event_base_loopexit(base, NULL);
+}
+
+/* Make one request, with up to two extra headers, and wait for the
+ * answer. */
+static int
+http_compress_request(struct evhttp_connection *evcon, const char *uri,
+    const char *accept, const char *key, const char *value)
+{
+	struct evhttp_request *req;
+
+	compress_code = 0;
+	req = evhttp_request_new(http_compress_request_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (accept != NULL)
+		evhttp_add_header(req->output_headers, "Accept-Encoding",
+		    accept);
+	if (key != NULL)
+		evhttp_add_header(req->output_headers, key, value);
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, uri) == -1)
+		return (-1);
+	event_base_dispatch(base);
+	return (compress_code);
+}
+
+/* Return true iff compress_body is n copies of COMPRESS_TEXT. */
+static int
+http_compress_body_is(int n)
+{
+	size_t len = strlen(COMPRESS_TEXT);
+	char *p;
+	int i;
+
+	if (evbuffer_get_length(compress_body) != n * len)
+		return (0);
+	p = (char *)evbuffer_pullup(compress_body, -1);
+	for (i = 0; i < n; ++i)
+		if (memcmp(p + i * len, COMPRESS_TEXT, len))
+			return (0);
+	return (1);
+}
+
+static void
+http_compression_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_file_server *fs = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_file *file;
+	struct evbuffer *gzipped;
+	char dir[] = "/tmp/regress-http-XXXXXX", path[256];
+	short port = -1;
+	int i;
+	FILE *f;
+
+	base = data->base;
+	tt_assert(compress_body = evbuffer_new());
+	tt_assert(mkdtemp(dir));
+	evutil_snprintf(path, sizeof(path), "%s/a.txt", dir);
+	tt_assert(f = fopen(path, "w"));
+	for (i = 0; i < 50; ++i)
+		fputs(COMPRESS_TEXT, f);
+	fclose(f);
+
+	http = http_setup(&port, base);
+	tt_int_op(evhttp_set_compression(http, 10, 0), ==, -1);
+	tt_int_op(evhttp_set_compression(http, 6, 100), ==, 0);
+	evhttp_set_cb(http, "/text", http_compress_cb, NULL);
+	evhttp_set_cb(http, "/small", http_compress_cb, NULL);
+	evhttp_set_cb(http, "/image", http_compress_cb, NULL);
+	evhttp_set_cb(http, "/stream", http_compress_stream_cb, NULL);
+	tt_assert(fs = evhttp_file_server_new("/static/", dir, 0));
+	tt_int_op(evhttp_set_prefix_cb(http, "/static/",
+		evhttp_file_server_cb, fs), ==, 0);
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+
+	tt_int_op(http_compress_request(evcon, "/text", "gzip, deflate",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "gzip");
+	tt_str_op(compress_vary, ==, "Accept-Encoding");
+	tt_assert(http_compress_body_is(50));
+	tt_assert(compress_raw_len < 50 * strlen(COMPRESS_TEXT) / 4);
+
+	tt_int_op(http_compress_request(evcon, "/text",
+		"gzip;q=0, deflate;q=0.5", NULL, NULL), ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "deflate");
+	tt_assert(http_compress_body_is(50));
+
+	/* The Vary header goes out whether we compress or not. */
+	tt_int_op(http_compress_request(evcon, "/text", NULL, NULL, NULL),
+	    ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "");
+	tt_str_op(compress_vary, ==, "Accept-Encoding");
+	tt_assert(http_compress_body_is(50));
+	tt_int_op(http_compress_request(evcon, "/text", "*;q=0", NULL, NULL),
+	    ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "");
+
+	/* Too small, or not worth it. */
+	tt_int_op(http_compress_request(evcon, "/small", "gzip", NULL, NULL),
+	    ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "");
+	tt_assert(http_compress_body_is(1));
+	tt_int_op(http_compress_request(evcon, "/image", "gzip", NULL, NULL),
+	    ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "");
+	tt_str_op(compress_vary, ==, "");
+
+	/* Chunked replies are compressed as they go. */
+	tt_int_op(http_compress_request(evcon, "/stream", "gzip", NULL, NULL),
+	    ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "gzip");
+	tt_assert(http_compress_body_is(50));
+	tt_assert(evcon->compressor == NULL);
+
+	/* The file server makes the gzipped copy once and keeps it. */
+	tt_int_op(http_compress_request(evcon, "/static/a.txt", "gzip",
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "gzip");
+	tt_assert(strstr(compress_etag, "-gz\""));
+	tt_assert(http_compress_body_is(50));
+	file = TAILQ_FIRST(&fs->lru);
+	tt_assert(gzipped = file->gzipped);
+	tt_int_op(http_compress_request(evcon, "/static/a.txt", "gzip",
+		"If-None-Match", compress_etag), ==, HTTP_NOTMODIFIED);
+	tt_int_op(http_compress_request(evcon, "/static/a.txt", "gzip",
+		NULL, NULL), ==, HTTP_OK);
+	tt_assert(http_compress_body_is(50));
+	tt_assert(file->gzipped == gzipped);
+
+	/* but ranges are of the file itself. */
+	tt_int_op(http_compress_request(evcon, "/static/a.txt", "gzip",
+		"Range", "bytes=0-2"), ==, 206);
+	tt_str_op(compress_encoding, ==, "");
+	tt_int_op(compress_raw_len, ==, 3);
+	tt_int_op(http_compress_request(evcon, "/static/a.txt", NULL,
+		NULL, NULL), ==, HTTP_OK);
+	tt_str_op(compress_encoding, ==, "");
+	tt_str_op(compress_vary, ==, "Accept-Encoding");
+	tt_assert(http_compress_body_is(50));
+
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (fs)
+		evhttp_file_server_free(fs);
+	if (compress_body)
+		evbuffer_free(compress_body);
+	evutil_snprintf(path, sizeof(path), "%s/a.txt", dir);
+	unlink(path);
+	rmdir(dir);
+}
+#endif
+
+#define STREAM_BODY_SIZE (1024*1024)
+
+static size_t stream_total, stream_max;
+static int stream_calls, stream_calls_paused, stream_done, stream_paused;
+static struct event stream_resume_ev;
+
+static void
+http_stream_resume_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_request *req = arg;
+
+	/* nothing was delivered while we were paused */
+	stream_calls_paused = stream_calls;
+	evhttp_request_resume(req);
+}
+
+static void
+http_stream_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	size_t n = evbuffer_get_length(req->input_buffer);
+	struct timeval tv = { 0, 100000 };
+
+	++stream_calls;
+	stream_total += n;
+	if (n > stream_max)
+		stream_max = n;
+
+	if (!stream_paused) {
+		stream_paused = 1;
+		evhttp_request_pause(req);
+		evtimer_assign(&stream_resume_ev, base, http_stream_resume_cb,
+		    req);
+		evtimer_add(&stream_resume_ev, &tv);
+	}
+}
+
+static void
+http_stream_done_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	++stream_done;
+	evbuffer_add_printf(evb, "%u", (unsigned)stream_total);
+	evhttp_send_reply(req, HTTP_OK, "OK", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_stream_request_done(struct evhttp_request *req, void *arg)
+{
+	event_base_loopexit(base, NULL);
+}
+
+static void
+http_stream_readcb(struct bufferevent *bev, void *arg)
+{
+	if (evbuffer_find(bufferevent_get_input(bev),
+		(const unsigned char *)"\r\n\r\n", 4) != NULL)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+http_stream_request_body_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct bufferevent *bev = NULL;
+	char *body = NULL;
+	short port = -1;
+	int fd;
+
+	base = data->base;
+	tt_assert(body = malloc(STREAM_BODY_SIZE));
+	memset(body, 'x', STREAM_BODY_SIZE);
+
+	http = http_setup(&port, base);
+	tt_int_op(evhttp_set_stream_cb(http, "/upload", http_stream_chunk_cb,
+		http_stream_done_cb, NULL), ==, 0);
+	tt_int_op(evhttp_set_stream_cb(http, "/upload", http_stream_chunk_cb,
+		http_stream_done_cb, NULL), ==, -1);
+
+	/* A body with a Content-Length comes in pieces, and none of them
+	 * while we're paused. */
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1", port));
+	req = evhttp_request_new(http_stream_request_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	evbuffer_add(req->output_buffer, body, STREAM_BODY_SIZE);
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/upload"),
+	    ==, 0);
+	event_base_dispatch(base);
+
+	tt_int_op(stream_done, ==, 1);
+	tt_int_op(stream_total, ==, STREAM_BODY_SIZE);
+	tt_int_op(stream_calls_paused, ==, 1);
+	tt_int_op(stream_calls, >, 2);
+	tt_assert(stream_max < STREAM_BODY_SIZE / 4);
+
+	/* So does one big chunk of a chunked body. */
+	stream_total = stream_max = 0;
+	stream_calls = stream_calls_paused = stream_done = stream_paused = 0;
+	fd = http_connect("127.0.0.1", port);
+	tt_assert(bev = bufferevent_socket_new(base, fd,
+		BEV_OPT_CLOSE_ON_FREE));
+	bufferevent_setcb(bev, http_stream_readcb, NULL, NULL, NULL);
+	bufferevent_enable(bev, EV_READ);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "POST /upload HTTP/1.1\r\nHost: somehost\r\n"
+	    "Transfer-Encoding: chunked\r\n\r\n%x\r\n", STREAM_BODY_SIZE);
+	bufferevent_write(bev, body, STREAM_BODY_SIZE);
+	evbuffer_add_printf(bufferevent_get_output(bev), "\r\n0\r\n\r\n");
+	event_base_dispatch(base);
+
+	tt_int_op(stream_done, ==, 1);
+	tt_int_op(stream_total, ==, STREAM_BODY_SIZE);
+	tt_int_op(stream_calls_paused, ==, 1);
+	tt_int_op(stream_calls, >, 2);
+	tt_assert(stream_max < STREAM_BODY_SIZE / 4);
+
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (body)
+		free(body);
+}
+
+static void
+http_chunk_delivery_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct timeval tv = { 0, 500000 };
+	char *body = NULL;
+	short port = -1;
+	int fd;
+
+	base = data->base;
+	tt_assert(body = malloc(STREAM_BODY_SIZE));
+	memset(body, 'x', STREAM_BODY_SIZE);
+
+	http = http_setup(&port, base);
+	evhttp_set_chunk_delivery_size(http, 1000);
+	tt_int_op(evhttp_set_stream_cb(http, "/upload", http_stream_chunk_cb,
+		http_stream_done_cb, NULL), ==, 0);
+
+	stream_total = stream_max = 0;
+	stream_calls = stream_calls_paused = stream_done = stream_paused = 0;
+	fd = http_connect("127.0.0.1", port);
+	tt_assert(bev = bufferevent_socket_new(base, fd,
+		BEV_OPT_CLOSE_ON_FREE));
+	bufferevent_setcb(bev, http_stream_readcb, NULL, NULL, NULL);
+	bufferevent_enable(bev, EV_READ);
+
+	/* Half of a chunk is handed over without waiting for the rest. */
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "POST /upload HTTP/1.1\r\nHost: somehost\r\n"
+	    "Transfer-Encoding: chunked\r\n\r\n%X;name=value\r\n",
+	    STREAM_BODY_SIZE);
+	bufferevent_write(bev, body, STREAM_BODY_SIZE / 2);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+	tt_int_op(stream_done, ==, 0);
+	tt_int_op(stream_total, ==, STREAM_BODY_SIZE / 2);
+	tt_int_op(stream_calls_paused, ==, 1);
+	tt_int_op(stream_max, ==, 1000);
+
+	bufferevent_write(bev, body, STREAM_BODY_SIZE / 2);
+	evbuffer_add_printf(bufferevent_get_output(bev), "\r\n0\r\n\r\n");
+	event_base_dispatch(base);
+
+	tt_int_op(stream_done, ==, 1);
+	tt_int_op(stream_total, ==, STREAM_BODY_SIZE);
+	tt_int_op(stream_max, ==, 1000);
+	tt_int_op(stream_calls, >=, STREAM_BODY_SIZE / 1000);
+
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (http)
+		evhttp_free(http);
+	if (body)
+		free(body);
+}
+
+static void
+http_limits_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+/* These break rather than exit the loop, since more than one of them
+ * can fire for the same request. */
+static void
+http_limits_readcb(struct bufferevent *bev, void *arg)
+{
+	if (evbuffer_find(bufferevent_get_input(bev),
+		(const unsigned char *)"\r\n\r\n", 4) != NULL)
+		event_base_loopbreak(base);
+}
+
+static void
+http_limits_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	event_base_loopbreak(base);
+}
+
+static void
+http_limits_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak(base);
+}
+
+/* Send request on a new connection, and return the status code of the
+ * reply, or -1 if there isn't one soon. */
+static int
+http_limits_request(short port, const char *request)
+{
+	struct bufferevent *bev;
+	struct event timeout;
+	struct timeval tv = { 0, 200000 };
+	char *line;
+	int code = -1;
+
+	bev = bufferevent_socket_new(base, http_connect("127.0.0.1", port),
+	    BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, http_limits_readcb, NULL, http_limits_eventcb,
+	    NULL);
+	bufferevent_enable(bev, EV_READ);
+	bufferevent_write(bev, request, strlen(request));
+	evtimer_assign(&timeout, base, http_limits_timeout_cb, NULL);
+	evtimer_add(&timeout, &tv);
+	event_base_dispatch(base);
+	evtimer_del(&timeout);
+
+	line = evbuffer_readln(bufferevent_get_input(bev), NULL,
+	    EVBUFFER_EOL_CRLF);
+	if (line != NULL && !strncmp(line, "HTTP/1.1 ", 9))
+		code = atoi(line + 9);
+	free(line);
+	bufferevent_free(bev);
+	return (code);
+}
+
+static void
+http_request_limits_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	char request[2048];
+	short port = -1;
+	int i;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	evhttp_set_cb(http, "/limits", http_limits_cb, NULL);
+	evhttp_set_max_headers_size(http, 256);
+	evhttp_set_max_header_count(http, 5);
+	evhttp_set_max_body_size(http, 1000);
+
+	tt_int_op(http_limits_request(port,
+		"POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+		"Content-Length: 1000\r\n\r\n"), ==, -1);
+	evutil_snprintf(request, sizeof(request),
+	    "POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+	    "Content-Length: 10\r\n\r\n0123456789");
+	tt_int_op(http_limits_request(port, request), ==, HTTP_OK);
+
+	/* A header that doesn't end is turned away once it's too long. */
+	evutil_snprintf(request, sizeof(request),
+	    "GET /limits HTTP/1.1\r\nX-Big: ");
+	memset(request + strlen(request), 'a', 300);
+	request[sizeof("GET /limits HTTP/1.1\r\nX-Big: ") - 1 + 300] = '\0';
+	tt_int_op(http_limits_request(port, request), ==, 431);
+
+	/* So is a request line. */
+	evutil_snprintf(request, sizeof(request), "GET /");
+	memset(request + 5, 'a', 300);
+	request[305] = '\0';
+	tt_int_op(http_limits_request(port, request), ==, 431);
+
+	/* And too many headers, each of them small. */
+	evutil_snprintf(request, sizeof(request),
+	    "GET /limits HTTP/1.1\r\n");
+	for (i = 0; i < 6; ++i)
+		evutil_snprintf(request + strlen(request),
+		    sizeof(request) - strlen(request), "X-%d: 1\r\n", i);
+	evutil_snprintf(request + strlen(request),
+	    sizeof(request) - strlen(request), "\r\n");
+	tt_int_op(http_limits_request(port, request), ==, 431);
+
+	/* A body that's too long is turned away before it's read. */
+	tt_int_op(http_limits_request(port,
+		"POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+		"Content-Length: 1001\r\n\r\n"), ==, 413);
+	tt_int_op(http_limits_request(port,
+		"POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n"
+		"200\r\n"), ==, -1);
+	tt_int_op(http_limits_request(port,
+		"POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n"
+		"3e8\r\n"), ==, -1);
+	tt_int_op(http_limits_request(port,
+		"POST /limits HTTP/1.1\r\nHost: somehost\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n"
+		"3e9\r\n"), ==, 413);
+
+ end:
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_max_connections_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	*(int *)arg = 1;
+	event_base_loopbreak(base);
+}
+
+/* Run the loop until something happens on one of our connections, or for
+ * msec milliseconds if nothing does. */
+static void
+http_max_connections_wait(int msec)
+{
+	struct event timeout;
+	struct timeval tv;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	evtimer_assign(&timeout, base, http_limits_timeout_cb, NULL);
+	evtimer_add(&timeout, &tv);
+	event_base_dispatch(base);
+	evtimer_del(&timeout);
+}
+
+static struct bufferevent *
+http_max_connections_connect(short port, int *closed)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, http_connect("127.0.0.1", port),
+	    BEV_OPT_CLOSE_ON_FREE);
+	*closed = 0;
+	bufferevent_setcb(bev, http_limits_readcb, NULL,
+	    http_max_connections_eventcb, closed);
+	bufferevent_enable(bev, EV_READ);
+	return (bev);
+}
+
+static void
+http_max_connections_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bevs[3] = { NULL, NULL, NULL };
+	int closed[3];
+	const char *request = "GET /test HTTP/1.1\r\nHost: somehost\r\n\r\n";
+	short port = -1;
+	int i;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	evhttp_set_max_connections(http, 2);
+
+	/* Three keep-alive connections, one after the other: the third
+	 * pushes out the first, which has been idle longest. */
+	for (i = 0; i < 3; ++i) {
+		bevs[i] = http_max_connections_connect(port, &closed[i]);
+		bufferevent_write(bevs[i], request, strlen(request));
+		http_max_connections_wait(500);
+		/* the first one closing may have woken us */
+		if (i == 2)
+			http_max_connections_wait(500);
+		tt_assert(evbuffer_find(bufferevent_get_input(bevs[i]),
+			(const unsigned char *)"HTTP/1.1 200", 12) != NULL);
+	}
+	tt_int_op(closed[0], ==, 1);
+	tt_int_op(closed[1], ==, 0);
+	tt_int_op(closed[2], ==, 0);
+
+	/* A connection that's started on another request isn't idle, so the
+	 * third goes next even though the second has waited longer. */
+	bufferevent_free(bevs[0]);
+	bufferevent_write(bevs[1], "GET /test", 9);
+	http_max_connections_wait(200);
+	bevs[0] = http_max_connections_connect(port, &closed[0]);
+	bufferevent_write(bevs[0], request, strlen(request));
+	http_max_connections_wait(500);
+	if (!closed[2])
+		http_max_connections_wait(500);
+	tt_int_op(closed[1], ==, 0);
+	tt_int_op(closed[2], ==, 1);
+
+	/* With no idle connection to close, a new one is turned away. */
+	bufferevent_free(bevs[2]);
+	bufferevent_write(bevs[0], "GET /test", 9);
+	http_max_connections_wait(200);
+	bevs[2] = http_max_connections_connect(port, &closed[2]);
+	http_max_connections_wait(500);
+	tt_int_op(closed[2], ==, 1);
+	tt_int_op(closed[0], ==, 0);
+	tt_int_op(closed[1], ==, 0);
+
+	/* Idle connections are closed once the server's timeout runs out. */
+	evhttp_set_timeout(http, 1);
+	bufferevent_write(bevs[0], request + 9, strlen(request) - 9);
+	bufferevent_write(bevs[1], request + 9, strlen(request) - 9);
+	http_max_connections_wait(200);
+	tt_int_op(closed[0], ==, 0);
+	tt_int_op(closed[1], ==, 0);
+	for (i = 0; i < 4 && !(closed[0] && closed[1]); ++i)
+		http_max_connections_wait(1000);
+	tt_int_op(closed[0], ==, 1);
+	tt_int_op(closed[1], ==, 1);
+
+ end:
+	for (i = 0; i < 3; ++i)
+		if (bevs[i])
+			bufferevent_free(bevs[i]);
+	if (http)
+		evhttp_free(http);
+}
+
+static struct evhttp_request *recycle_reqs[2];
+static int recycle_stale[2];
+static int n_recycled;
+
+static void
+http_recycle_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb;
+
+	/* nothing of the last request should be left */
+	if (n_recycled < 2) {
+		const char *uri = n_recycled ?
+		    "/recycle?second" : "/recycle?first";
+		recycle_reqs[n_recycled] = req;
+		recycle_stale[n_recycled] = strcmp(req->uri, uri) ||
+		    evhttp_find_header(req->output_headers, "X-Reply") ||
+		    (n_recycled > 0 && (evhttp_find_header(req->input_headers,
+			"X-First") || evbuffer_get_length(req->input_buffer)));
+		++n_recycled;
+	}
+	if (n_recycled == 1) {
+		evb = evbuffer_new();
+		evhttp_add_header(req->output_headers, "X-Reply", "yes");
+		evbuffer_add_printf(evb, "%s", req->uri);
+		evhttp_send_reply(req, HTTP_OK, "OK", evb);
+		evbuffer_free(evb);
+	} else {
+		evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+	}
+}
+
+static void
+http_request_recycle_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *input;
+	int closed;
+	short port = -1;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	evhttp_set_cb(http, "/recycle", http_recycle_cb, NULL);
+	n_recycled = 0;
+
+	bev = http_max_connections_connect(port, &closed);
+	input = bufferevent_get_input(bev);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "POST /recycle?first HTTP/1.1\r\nHost: somehost\r\n"
+	    "X-First: 1\r\nContent-Length: 5\r\n\r\nhello");
+	http_max_connections_wait(500);
+	tt_int_op(n_recycled, ==, 1);
+	tt_assert(evbuffer_find(input,
+		(const unsigned char *)"/recycle?first", 14) != NULL);
+	evbuffer_drain(input, evbuffer_get_length(input));
+
+	/* Once the connection has a request to reuse, the next exchange
+	 * needs little more than the request's URI and the evbuffer chains
+	 * that carry it in and the reply out, which are freed as they drain
+	 * unless the chain cache is on. */
+	n_header_mallocs = 0;
+	event_set_mem_functions(http_counting_malloc, http_counting_realloc,
+	    free);
+	evbuffer_add_printf(bufferevent_get_output(bev),
+	    "GET /recycle?second HTTP/1.1\r\nHost: somehost\r\n\r\n");
+	http_max_connections_wait(500);
+	event_set_mem_functions(NULL, NULL, NULL);
+	tt_int_op(n_header_mallocs, <, 10);
+	tt_int_op(n_recycled, ==, 2);
+	tt_assert(evbuffer_find(input,
+		(const unsigned char *)"HTTP/1.1 200", 12) != NULL);
+	tt_int_op(closed, ==, 0);
+
+	/* the connection reused its first request for its second */
+	tt_assert(recycle_reqs[0] == recycle_reqs[1]);
+	tt_int_op(recycle_stale[0], ==, 0);
+	tt_int_op(recycle_stale[1], ==, 0);
+
+ end:
+	event_set_mem_functions(NULL, NULL, NULL);
+	if (bev)
+		bufferevent_free(bev);
+	if (http)
+		evhttp_free(http);
+}
+
+/* Send request on bev and return how many bytes of response came back. */
+static size_t
+http_route_stats_exchange(struct bufferevent *bev, const char *request)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t len;
+
+	bufferevent_write(bev, request, strlen(request));
+	http_max_connections_wait(500);
+	len = evbuffer_get_length(input);
+	evbuffer_drain(input, len);
+	return (len);
+}
+
+static void
+http_route_stats_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_route_stats st;
+	struct bufferevent *bev = NULL;
+	const char *get = "GET /test HTTP/1.1\r\nHost: somehost\r\n\r\n";
+	const char *post = "POST /test HTTP/1.1\r\nHost: somehost\r\n"
+	    "Content-Length: 5\r\n\r\nhello";
+	const char *missing = "GET /nothere HTTP/1.1\r\nHost: somehost\r\n\r\n";
+	size_t out_test, out_missing;
+	ev_uint64_t total;
+	int closed, i;
+	short port = -1;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	tt_int_op(evhttp_enable_stats(http, 1), ==, 0);
+	tt_int_op(evhttp_set_stats_cb(http, "/stats"), ==, 0);
+
+	bev = http_max_connections_connect(port, &closed);
+	out_test = http_route_stats_exchange(bev, get);
+	out_test += http_route_stats_exchange(bev, post);
+	tt_int_op(closed, ==, 0);
+	/* a 404 closes the connection */
+	out_missing = http_route_stats_exchange(bev, missing);
+
+	tt_int_op(evhttp_get_route_stats(http, "/test", &st), ==, 0);
+	tt_int_op(st.n_requests, ==, 2);
+	tt_int_op(st.bytes_in, ==, strlen(get) + strlen(post));
+	tt_int_op(st.bytes_out, ==, out_test);
+	for (i = 0, total = 0; i < EVHTTP_STATS_HISTOGRAM_SIZE; ++i)
+		total += st.usec_histogram[i];
+	tt_int_op(total, ==, 2);
+	tt_assert(evhttp_route_stats_percentile(&st, 50) > 0);
+	tt_assert(evhttp_route_stats_percentile(&st, 99) >=
+	    evhttp_route_stats_percentile(&st, 50));
+
+	/* The 404 counts for no route at all. */
+	tt_int_op(evhttp_get_route_stats(http, NULL, &st), ==, 0);
+	tt_int_op(st.n_requests, ==, 1);
+	tt_int_op(st.bytes_in, ==, strlen(missing));
+	tt_int_op(st.bytes_out, ==, out_missing);
+	tt_int_op(evhttp_get_route_stats(http, "/postit", &st), ==, 0);
+	tt_int_op(st.n_requests, ==, 0);
+	tt_int_op(evhttp_route_stats_percentile(&st, 50), ==, 0);
+	tt_int_op(evhttp_get_route_stats(http, "/nothere", &st), ==, -1);
+
+	/* The report has a line for each route. */
+	bufferevent_free(bev);
+	bev = http_max_connections_connect(port, &closed);
+	bufferevent_write(bev, "GET /stats HTTP/1.1\r\nHost: somehost\r\n\r\n",
+	    39);
+	http_max_connections_wait(500);
+	tt_assert(evbuffer_find(bufferevent_get_input(bev),
+		(const unsigned char *)"/test requests=2 ", 17) != NULL);
+	tt_assert(evbuffer_find(bufferevent_get_input(bev),
+		(const unsigned char *)"- requests=1 ", 13) != NULL);
+
+	evhttp_reset_stats(http);
+	tt_int_op(evhttp_get_route_stats(http, "/test", &st), ==, 0);
+	tt_int_op(st.n_requests, ==, 0);
+	tt_int_op(st.bytes_out, ==, 0);
+
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_dns_server_cb(struct evdns_server_request *req, void *arg)
+{
+	const char *name = req->questions[0]->name;
+	ev_uint32_t ans = htonl(0x7f000001);
+
+	if (req->questions[0]->type == EVDNS_TYPE_A &&
+	    !evutil_strcasecmp(name, "web.example.com")) {
+		evdns_server_request_add_a_reply(req, name, 1, &ans, 10);
+		evdns_server_request_respond(req, 0);
+	} else {
+		evdns_server_request_respond(req, 3 /* NXDOMAIN */);
+	}
+}
+
+static int dns_connect_n_done, dns_connect_n_ok;
+
+static void
+http_dns_connect_done(struct evhttp_request *req, void *arg)
+{
+	++dns_connect_n_done;
+	if (req != NULL && req->response_code == HTTP_OK)
+		++dns_connect_n_ok;
+	event_base_loopexit(base, NULL);
+}
+
+static void
+http_dns_connect_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *dns_port = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct sockaddr_in sin;
+	struct timeval tv = { 10, 0 };
+	evutil_socket_t sock = -1;
+	short port = -1;
+
+	base = data->base;
+	http = http_setup(&port, base);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(35361);
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(sock >= 0);
+	evutil_make_socket_nonblocking(sock);
+	tt_assert(bind(sock, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	dns_port = evdns_add_server_port_with_base(base, sock, 0,
+	    http_dns_server_cb, NULL);
+	tt_assert(dns_port);
+	dns = evdns_base_new(base, 0);
+	tt_assert(dns);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, "127.0.0.1:35361"));
+
+	/* The name is looked up on the loop, and the request goes out. */
+	evcon = evhttp_connection_base_new(base, "web.example.com", port);
+	tt_assert(evcon);
+	evhttp_connection_set_dns_base(evcon, dns);
+	req = evhttp_request_new(http_dns_connect_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test"),
+	    ==, 0);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(dns_connect_n_done, ==, 1);
+	tt_int_op(dns_connect_n_ok, ==, 1);
+	evhttp_connection_free(evcon);
+
+	/* A name that doesn't resolve fails the request. */
+	evcon = evhttp_connection_base_new(base, "nowhere.example.com", port);
+	tt_assert(evcon);
+	evhttp_connection_set_dns_base(evcon, dns);
+	req = evhttp_request_new(http_dns_connect_done, NULL);
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test"),
+	    ==, 0);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(dns_connect_n_done, ==, 2);
+	tt_int_op(dns_connect_n_ok, ==, 1);
+	evhttp_connection_free(evcon);
+
+	/* A connection can go away while its lookup is pending. */
+	evcon = evhttp_connection_base_new(base, "web.example.com", port);
+	tt_assert(evcon);
+	evhttp_connection_set_dns_base(evcon, dns);
+	req = evhttp_request_new(http_dns_connect_done, NULL);
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test"),
+	    ==, 0);
+	evhttp_connection_free(evcon);
+	evcon = NULL;
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(dns_connect_n_done, ==, 2);
+
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (dns_port)
+		evdns_close_server_port(dns_port);
+	if (sock >= 0)
+		EVUTIL_CLOSESOCKET(sock);
+	if (http)
+		evhttp_free(http);
+}
+
+#define PROXY_BODY_SIZE (8*1024*1024)
+
+static struct evhttp *proxy_front;
+static struct event proxy_ev;
+static size_t proxy_total, proxy_max_buffered;
+static int proxy_code, proxy_done, proxy_saw_header, proxy_paused;
+static char proxy_body[64];
+
+/* The server behind the proxy. */
+static void
+http_proxy_backend_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	const char *xff = evhttp_find_header(req->input_headers,
+	    "X-Forwarded-For");
+
+	if (!strcmp(evhttp_request_get_uri(req), "/big")) {
+		char *body = malloc(PROXY_BODY_SIZE);
+		memset(body, 'x', PROXY_BODY_SIZE);
+		evbuffer_add(evb, body, PROXY_BODY_SIZE);
+		free(body);
+		evhttp_send_reply_start(req, HTTP_OK, "OK");
+		evhttp_send_reply_chunk(req, evb);
+		evhttp_send_reply_end(req);
+	} else {
+		evhttp_add_header(req->output_headers, "X-Backend", "yes");
+		evbuffer_add_printf(evb, "%s %s", xff ? xff : "none",
+		    evhttp_find_header(req->input_headers, "Connection") ?
+		    "connection" : "");
+		evhttp_send_reply(req, HTTP_OK, "Proxied", evb);
+	}
+	evbuffer_free(evb);
+}
+
+static void
+http_proxy_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	/* /proxy/x goes to /x */
+	const char *uri = evhttp_request_get_uri(req) + strlen("/proxy");
+
+	if (evhttp_proxy_request(req, evcon, uri) == -1)
+		evhttp_send_error(req, HTTP_SERVUNAVAIL, "No proxy");
+}
+
+static void
+http_proxy_chunk(struct evhttp_request *req, void *arg)
+{
+	proxy_total += evbuffer_get_length(req->input_buffer);
+	if (!proxy_paused) {
+		/* stop reading, and see how much the proxy holds for us */
+		struct timeval tv = { 0, 300*1000 };
+		proxy_paused = 1;
+		evhttp_request_pause(req);
+		evtimer_add(&proxy_ev, &tv);
+	}
+}
+
+static void
+http_proxy_done(struct evhttp_request *req, void *arg)
+{
+	++proxy_done;
+	proxy_code = req ? req->response_code : 0;
+	if (req != NULL && req->chunk_cb == NULL) {
+		size_t n = evbuffer_get_length(req->input_buffer);
+		if (n >= sizeof(proxy_body))
+			n = sizeof(proxy_body) - 1;
+		evbuffer_remove(req->input_buffer, proxy_body, n);
+		proxy_body[n] = '\0';
+		proxy_saw_header = evhttp_find_header(req->input_headers,
+		    "X-Backend") != NULL;
+	}
+	event_base_loopexit(base, NULL);
+}
+
+/* Looks at what the proxy has buffered for the paused client, and then
+ * either lets the client go on, or hangs it up. */
+static void
+http_proxy_slow_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evhttp_connection *evcon = TAILQ_FIRST(&proxy_front->connections);
+
+	if (evcon != NULL)
+		proxy_max_buffered = evbuffer_get_length(
+			bufferevent_get_output(evcon->bufev));
+	if (req != NULL)
+		evhttp_request_resume(req);
+	else
+		event_base_loopexit(base, NULL);
+}
+
+static void
+http_proxy_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *backend = NULL, *dead = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct evhttp *gone;
+	struct timeval tv = { 10, 0 };
+	short port = -1, front_port = -1, gone_port = -1;
+
+	base = data->base;
+	http = http_setup(&port, base);
+	evhttp_set_cb(http, "/headers", http_proxy_backend_cb, NULL);
+	evhttp_set_cb(http, "/big", http_proxy_backend_cb, NULL);
+	proxy_front = http_setup(&front_port, base);
+	gone = http_setup(&gone_port, base);
+	evhttp_free(gone);
+
+	tt_assert(backend = evhttp_connection_base_new(base, "127.0.0.1",
+		port));
+	tt_assert(dead = evhttp_connection_base_new(base, "127.0.0.1",
+		gone_port));
+	evhttp_set_prefix_cb(proxy_front, "/proxy/", http_proxy_cb, backend);
+	evhttp_set_prefix_cb(proxy_front, "/dead/", http_proxy_cb, dead);
+
+	/* Headers go both ways, without the ones for one connection, and
+	 * the server learns who the client was. */
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1",
+		front_port));
+	req = evhttp_request_new(http_proxy_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	evhttp_add_header(req->output_headers, "Connection", "keep-alive");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+		"/proxy/headers"), ==, 0);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(proxy_done, ==, 1);
+	tt_int_op(proxy_code, ==, HTTP_OK);
+	tt_assert(proxy_saw_header);
+	tt_str_op(proxy_body, ==, "127.0.0.1 ");
+
+	/* A big body streams through, but while the client isn't reading,
+	 * the proxy holds only a little of it. */
+	proxy_total = 0;
+	proxy_paused = 0;
+	req = evhttp_request_new(http_proxy_done, NULL);
+	evtimer_assign(&proxy_ev, base, http_proxy_slow_cb, req);
+	evhttp_request_set_chunked_cb(req, http_proxy_chunk);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+		"/proxy/big"), ==, 0);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(proxy_done, ==, 2);
+	tt_int_op(proxy_code, ==, HTTP_OK);
+	tt_int_op(proxy_total, ==, PROXY_BODY_SIZE);
+	tt_assert(proxy_max_buffered <= 2 * HTTP_PROXY_MAX_BUFFERED);
+
+	/* If the client hangs up, the request to the server is dropped. */
+	proxy_total = 0;
+	proxy_paused = 0;
+	req = evhttp_request_new(http_proxy_done, NULL);
+	evtimer_assign(&proxy_ev, base, http_proxy_slow_cb, NULL);
+	evhttp_request_set_chunked_cb(req, http_proxy_chunk);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+		"/proxy/big"), ==, 0);
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(proxy_done, ==, 2);
+	evhttp_connection_free(evcon);
+	evcon = NULL;
+	tv.tv_sec = 0;
+	tv.tv_usec = 300*1000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_assert(TAILQ_FIRST(&proxy_front->connections) == NULL);
+	tt_assert(TAILQ_FIRST(&http->connections) == NULL);
+
+	/* A server that can't be reached gets the client a 502. */
+	tt_assert(evcon = evhttp_connection_base_new(base, "127.0.0.1",
+		front_port));
+	req = evhttp_request_new(http_proxy_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+		"/dead/headers"), ==, 0);
+	tv.tv_sec = 10;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_int_op(proxy_done, ==, 3);
+	tt_int_op(proxy_code, ==, 502);
+
+ end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (backend)
+		evhttp_connection_free(backend);
+	if (dead)
+		evhttp_connection_free(dead);
+	if (proxy_front)
+		evhttp_free(proxy_front);
+	if (http)
+		evhttp_free(http);
+}
+
+static struct event_base *worker_bases[2];
+static int n_worker_served[2];
+static int n_worker_done;
+
+static void
+http_worker_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int i;
+
+	for (i = 0; i < 2; ++i)
+		if (req->evcon->base == worker_bases[i])
+			++n_worker_served[i];
+	evbuffer_add_printf(evb, BASIC_REQUEST_BODY);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_worker_request_done(struct evhttp_request *req, void *arg)
+{
+	if (req && req->response_code == HTTP_OK)
+		++n_worker_done;
+}
+
+static void
+http_worker_bases_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcons[4] = { NULL, NULL, NULL, NULL };
+	struct evhttp_request *req;
+	struct timeval start, now;
+	short port = -1;
+	int i;
+
+	http = http_setup(&port, data->base);
+	evhttp_set_cb(http, "/worker", http_worker_cb, NULL);
+	for (i = 0; i < 2; ++i) {
+		tt_assert(worker_bases[i] = event_base_new());
+		tt_int_op(evhttp_add_worker_base(http, worker_bases[i]), ==, 0);
+	}
+
+	for (i = 0; i < 4; ++i) {
+		evcons[i] = evhttp_connection_base_new(data->base,
+		    "127.0.0.1", port);
+		tt_assert(evcons[i]);
+		req = evhttp_request_new(http_worker_request_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		tt_int_op(evhttp_make_request(evcons[i], req, EVHTTP_REQ_GET,
+			"/worker"), ==, 0);
+	}
+
+	/* One thread stands in for the three: the client and the listener
+	 * on data->base, and the connections on the worker bases. */
+	evutil_gettimeofday(&start, NULL);
+	while (n_worker_done < 4) {
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+		for (i = 0; i < 2; ++i)
+			event_base_loop(worker_bases[i], EVLOOP_NONBLOCK);
+		evutil_gettimeofday(&now, NULL);
+		if (now.tv_sec - start.tv_sec > 5)
+			break;
+	}
+
+	tt_int_op(n_worker_done, ==, 4);
+	/* The connections went to the workers in turn. */
+	tt_int_op(n_worker_served[0], ==, 2);
+	tt_int_op(n_worker_served[1], ==, 2);
+	tt_assert(TAILQ_FIRST(&http->connections) == NULL);
+
+ end:
+	for (i = 0; i < 4; ++i)
+		if (evcons[i])
+			evhttp_connection_free(evcons[i]);
+	if (http)
+		evhttp_free(http);
+	for (i = 0; i < 2; ++i)
+		if (worker_bases[i])
+			event_base_free(worker_bases[i]);
+}
+
+struct testcase_t http_testcases[] = {
+	{ "primitives", http_primitives, 0, NULL, NULL },
+	HTTP_LEGACY(base),
+	{ "bad_headers", http_bad_header_test, 0, NULL, NULL },
+	{ "parse_query", http_parse_query_test, 0, NULL, NULL },
+	{ "query_get", http_query_get_test, 0, NULL, NULL },
+	HTTP_LEGACY(basic),
+	HTTP_LEGACY(serve_socket),
+	HTTP_LEGACY(cancel),
+	HTTP_LEGACY(virtual_host),
+	HTTP_LEGACY(post),
+	HTTP_LEGACY(put),
+	HTTP_LEGACY(delete),
+	HTTP_LEGACY(failure),
+	HTTP_LEGACY(connection),
+	HTTP_LEGACY(persist_connection),
+	HTTP_LEGACY(close_detection),
+	HTTP_LEGACY(close_detection_delay),
+	HTTP_LEGACY(incomplete),
+	HTTP_LEGACY(incomplete_timeout),
+
+	HTTP_LEGACY(highport),
+	HTTP_LEGACY(dispatcher),
+	HTTP_LEGACY(multi_line_header),
+	HTTP_LEGACY(negative_content_length),
+	HTTP_LEGACY(chunk_out),
+	HTTP_LEGACY(stream_out),
+
+	HTTP_LEGACY(stream_in),
+	HTTP_LEGACY(stream_in_cancel),
+
+	HTTP_LEGACY(connection_retry),
+
+	{ "routing", http_routing_test, TT_FORK|TT_NEED_BASE, &basic_setup,
+	  NULL },
+	{ "worker_bases", http_worker_bases_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "vhost_lookup", http_vhost_lookup_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "header_store", http_header_store_test, TT_FORK, NULL, NULL },
+	{ "parse_incremental", http_parse_incremental_test, TT_FORK, NULL,
+	  NULL },
+	{ "pipelining", http_pipelining_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "connection_pool", http_connection_pool_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#ifndef WIN32
+	{ "file_server", http_file_server_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+	{ "header_block", http_header_block_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#if defined(_EVENT_HAVE_LIBZ) && !defined(WIN32)
+	{ "compression", http_compression_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+	{ "stream_request_body", http_stream_request_body_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "chunk_delivery", http_chunk_delivery_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "request_limits", http_request_limits_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "max_connections", http_max_connections_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "request_recycle", http_request_recycle_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "route_stats", http_route_stats_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "dns_connect", http_dns_connect_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "proxy", http_proxy_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 
 	END_OF_TESTCASES
 };
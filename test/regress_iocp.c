@@ -144,6 +144,60 @@ end:
 	;
 }
 
+static void
+slow_cb(struct event_overlapped *eo, uintptr_t key, ev_ssize_t n)
+{
+	struct dummy_overlapped *d_o =
+	    EVUTIL_UPCAST(eo, struct dummy_overlapped, eo);
+
+#ifdef WIN32
+	/* Hog the thread, as a callback that blocks would. */
+	Sleep(20);
+#endif
+	EVLOCK_LOCK(d_o->lock, EVTHREAD_WRITE);
+	d_o->call_count++;
+	EVLOCK_UNLOCK(d_o->lock, EVTHREAD_WRITE);
+}
+
+static void
+test_iocp_port_threads(void *ptr)
+{
+	struct event_iocp_port *port = NULL;
+	struct dummy_overlapped o;
+	int i;
+
+#ifdef WIN32
+	evthread_use_windows_threads();
+#endif
+	memset(&o, 0, sizeof(o));
+	EVTHREAD_ALLOC_LOCK(o.lock);
+	tt_assert(o.lock);
+	event_overlapped_init(&o.eo, slow_cb);
+
+	/* One thread to start with, taking two completions at a time. */
+	port = event_iocp_port_launch_with_limits(1, 4, 2);
+	tt_assert(port);
+	tt_int_op(port->n_live_threads, ==, 1);
+	tt_int_op(port->batch_size, ==, 2);
+
+	for (i = 0; i < 32; ++i)
+		tt_assert(!event_iocp_activate_overlapped(port, &o.eo, i, i));
+
+#ifdef WIN32
+	Sleep(1000);
+#endif
+	/* With every thread stuck in slow_cb, the port should have started
+	 * more, but no more than it may. */
+	tt_int_op(port->n_live_threads, >, 1);
+	tt_int_op(port->n_live_threads, <=, 4);
+
+	tt_want(!event_iocp_shutdown(port, 2000));
+	tt_int_op(o.call_count, ==, 32);
+
+end:
+	;
+}
+
 static void
 test_iocp_evbuffer(void *ptr)
 {
@@ -196,10 +250,63 @@ end:
 	evbuffer_free(wbuf);
 }
 
-/*FIXME get this from a header once it's in one. */
-struct bufferevent *
-bufferevent_async_new(struct event_base *base,
-    evutil_socket_t fd, enum bufferevent_options options);
+static void
+test_iocp_evbuffer_reads(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_iocp_port *port = NULL;
+	struct evbuffer *rbuf = NULL, *wbuf = NULL;
+	char junk[1024];
+	unsigned char *mem;
+	int i;
+
+#ifdef WIN32
+	evthread_use_windows_threads();
+#endif
+
+	rbuf = evbuffer_overlapped_new(data->pair[0]);
+	wbuf = evbuffer_overlapped_new(data->pair[1]);
+	tt_assert(rbuf);
+	tt_assert(wbuf);
+	evbuffer_enable_locking(rbuf, NULL);
+	evbuffer_enable_locking(wbuf, NULL);
+
+	port = event_iocp_port_launch();
+	tt_assert(port);
+	tt_assert(!event_iocp_port_associate(port, data->pair[0], 100));
+	tt_assert(!event_iocp_port_associate(port, data->pair[1], 100));
+
+	tt_int_op(_evbuffer_overlapped_set_reads(rbuf, 0, 1024), ==, -1);
+	tt_int_op(_evbuffer_overlapped_set_reads(rbuf,
+		EVBUFFER_OVERLAPPED_MAX_READS+1, 1024), ==, -1);
+	tt_int_op(_evbuffer_overlapped_set_reads(rbuf, 4, 1024), ==, 0);
+
+	for (i=0;i<4;++i) {
+		memset(junk, 'a'+i, sizeof(junk));
+		evbuffer_add(wbuf, junk, sizeof(junk));
+	}
+
+	/* Four reads of 1024 go up at once; the data has to come out of them
+	 * in order. */
+	tt_assert(!evbuffer_launch_read(rbuf, 4096));
+	tt_int_op(_evbuffer_overlapped_set_reads(rbuf, 2, 1024), ==, -1);
+	tt_assert(!evbuffer_launch_write(wbuf, -1));
+
+#ifdef WIN32
+	/* FIXME this is stupid. */
+	Sleep(1000);
+#endif
+
+	tt_int_op(evbuffer_get_length(rbuf),==,4096);
+	mem = evbuffer_pullup(rbuf, -1);
+	for (i=0;i<4096;++i)
+		tt_int_op(mem[i],==,'a'+i/1024);
+
+	tt_want(!event_iocp_shutdown(port, 2000));
+end:
+	evbuffer_free(rbuf);
+	evbuffer_free(wbuf);
+}
 
 static void
 test_iocp_bufferevent_async(void *ptr)
@@ -232,6 +339,10 @@ test_iocp_bufferevent_async(void *ptr)
 	tt_assert(bea1);
 	tt_assert(bea2);
 
+	/* Read with two small overlapped reads posted at a time. */
+	tt_int_op(bufferevent_async_set_reads(bea2, 0, 1024), ==, -1);
+	tt_int_op(bufferevent_async_set_reads(bea2, 2, 1024), ==, 0);
+
 	/*FIXME set some callbacks */
 	bufferevent_enable(bea1, EV_WRITE);
 	bufferevent_enable(bea2, EV_READ);
@@ -253,8 +364,11 @@ end:
 
 struct testcase_t iocp_testcases[] = {
 	{ "port", test_iocp_port, TT_FORK, NULL, NULL },
+	{ "port_threads", test_iocp_port_threads, TT_FORK, NULL, NULL },
 	{ "evbuffer", test_iocp_evbuffer, TT_FORK|TT_NEED_SOCKETPAIR,
 	  &basic_setup, NULL },
+	{ "evbuffer_reads", test_iocp_evbuffer_reads,
+	  TT_FORK|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
 	{ "bufferevent_async", test_iocp_bufferevent_async,
 	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
 	END_OF_TESTCASES
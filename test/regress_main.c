@@ -174,7 +174,8 @@ basic_test_cleanup(const struct testcase_t *testcase, void *ptr)
         }
 
         if (testcase->flags & TT_NEED_BASE) {
-                event_base_free(data->base);
+		if (data->base)
+			event_base_free(data->base);
         }
 
         if (testcase->flags & TT_NEED_DNS) {
@@ -219,6 +220,8 @@ run_legacy_test_fn(void *ptr)
         in_legacy_test_wrapper = 1;
 	data->legacy_test_fn(); /* This part actually calls the test */
         in_legacy_test_wrapper = 0;
+	/* The test may have replaced global_base; free the one it left. */
+	data->base = global_base;
 
 	if (!test_ok)
 		tt_abort_msg("Legacy unit test failed");
@@ -250,8 +253,29 @@ const struct testcase_setup_t legacy_setup = {
 struct testcase_t thread_testcases[] = {
 #if defined(_EVENT_HAVE_PTHREADS) && !defined(_EVENT_DISABLE_THREAD_SUPPORT)
 	{ "pthreads", regress_threads, TT_FORK, NULL, NULL, },
+	{ "base_group", regress_base_group, TT_FORK, NULL, NULL, },
+	{ "workqueue", regress_workqueue, TT_FORK, NULL, NULL, },
+	{ "lock_profiling", regress_lock_profiling, TT_FORK, NULL, NULL, },
+	{ "rwlocks", regress_rwlocks, TT_FORK, NULL, NULL, },
+	{ "log_drainer", regress_log_drainer, TT_FORK, NULL, NULL, },
+	{ "watchdog", regress_watchdog, TT_FORK, NULL, NULL, },
+	{ "xthread_active", regress_xthread_active, TT_FORK, NULL, NULL, },
+	{ "deferred_xthread", regress_deferred_xthread, TT_FORK, NULL, NULL, },
+	{ "evbuffer_spsc", regress_evbuffer_spsc, TT_FORK, NULL, NULL, },
+	{ "bufferevent_pair_xthread", regress_bufferevent_pair_xthread,
+	  TT_FORK, NULL, NULL, },
 #else
 	{ "pthreads", NULL, TT_SKIP, NULL, NULL },
+	{ "base_group", NULL, TT_SKIP, NULL, NULL },
+	{ "workqueue", NULL, TT_SKIP, NULL, NULL },
+	{ "lock_profiling", NULL, TT_SKIP, NULL, NULL },
+	{ "rwlocks", NULL, TT_SKIP, NULL, NULL },
+	{ "log_drainer", NULL, TT_SKIP, NULL, NULL },
+	{ "watchdog", NULL, TT_SKIP, NULL, NULL },
+	{ "xthread_active", NULL, TT_SKIP, NULL, NULL },
+	{ "deferred_xthread", NULL, TT_SKIP, NULL, NULL },
+	{ "evbuffer_spsc", NULL, TT_SKIP, NULL, NULL },
+	{ "bufferevent_pair_xthread", NULL, TT_SKIP, NULL, NULL },
 #endif
 	END_OF_TESTCASES
 };
@@ -268,6 +292,9 @@ struct testgroup_t testgroups[] = {
 	{ "dns/", dns_testcases },
 	{ "rpc/", rpc_testcases },
 	{ "thread/", thread_testcases },
+#ifdef _EVENT_HAVE_OPENSSL
+	{ "ssl/", ssl_testcases },
+#endif
 #ifdef WIN32
 	{ "iocp/", iocp_testcases },
 #endif
@@ -36,7 +36,7 @@ set_random_timeout(struct event *ev)
 {
 	ev->ev_timeout.tv_sec = rand();
 	ev->ev_timeout.tv_usec = rand();
-	ev->min_heap_idx = -1;
+	ev->ev_timeout_pos.min_heap_idx = -1;
 }
 
 static void
@@ -44,21 +44,34 @@ check_heap(struct min_heap *heap)
 {
 	unsigned i;
 	for (i = 1; i < heap->n; ++i) {
-		unsigned parent_idx = (i-1)/2;
-		tt_want(evutil_timercmp(&heap->p[i]->ev_timeout,
-			&heap->p[parent_idx]->ev_timeout, >=));
+		if (heap->keyed) {
+			unsigned parent_idx = (i-1)/MIN_HEAP_KEYED_ARITY;
+			tt_want(evutil_timercmp(&heap->k[i].key,
+				&heap->k[parent_idx].key, >=));
+			tt_want(evutil_timercmp(&heap->k[i].key,
+				&heap->k[i].ev->ev_timeout, ==));
+			tt_want(heap->k[i].ev->ev_timeout_pos.min_heap_idx ==
+			    (int)i);
+		} else {
+			unsigned parent_idx = (i-1)/2;
+			tt_want(evutil_timercmp(&heap->p[i]->ev_timeout,
+				&heap->p[parent_idx]->ev_timeout, >=));
+		}
 	}
 }
 
 static void
-test_heap_randomized(void *ptr)
+heap_randomized_impl(int keyed)
 {
 	struct min_heap heap;
 	struct event *inserted[1024];
 	struct event *e, *last_e;
 	int i;
 
-	min_heap_ctor(&heap);
+	if (keyed)
+		min_heap_ctor_keyed(&heap);
+	else
+		min_heap_ctor(&heap);
 
 	for (i = 0; i < 1024; ++i) {
 		inserted[i] = malloc(sizeof(struct event));
@@ -83,6 +96,7 @@ test_heap_randomized(void *ptr)
 			break;
 		tt_want(evutil_timercmp(&last_e->ev_timeout,
 			&e->ev_timeout, <=));
+		last_e = e;
 	}
 	tt_assert(min_heap_size(&heap) == 0);
 end:
@@ -92,7 +106,56 @@ end:
 	min_heap_dtor(&heap);
 }
 
+static void
+test_heap_randomized(void *ptr)
+{
+	heap_randomized_impl(0);
+}
+
+static void
+test_heap_keyed_randomized(void *ptr)
+{
+	heap_randomized_impl(1);
+}
+
+static void
+test_heap_shift_keys(void *ptr)
+{
+	struct min_heap heap;
+	struct event *inserted[64];
+	struct timeval off = { 1000, 0 };
+	struct event *e, *last_e;
+	int i;
+
+	min_heap_ctor_keyed(&heap);
+	for (i = 0; i < 64; ++i) {
+		inserted[i] = malloc(sizeof(struct event));
+		set_random_timeout(inserted[i]);
+		inserted[i]->ev_timeout.tv_sec %= 100000;
+		inserted[i]->ev_timeout.tv_sec += 1000;
+		inserted[i]->ev_timeout.tv_usec %= 1000000;
+		min_heap_push(&heap, inserted[i]);
+	}
+	min_heap_shift_keys(&heap, &off);
+	check_heap(&heap);
+	tt_assert(min_heap_top(&heap)->ev_timeout.tv_sec < 100000);
+
+	last_e = min_heap_pop(&heap);
+	while ((e = min_heap_pop(&heap))) {
+		tt_want(evutil_timercmp(&last_e->ev_timeout,
+			&e->ev_timeout, <=));
+		last_e = e;
+	}
+end:
+	for (i = 0; i < 64; ++i)
+		free(inserted[i]);
+
+	min_heap_dtor(&heap);
+}
+
 struct testcase_t minheap_testcases[] = {
 	{ "randomized", test_heap_randomized, 0, NULL, NULL },
+	{ "keyed_randomized", test_heap_keyed_randomized, 0, NULL, NULL },
+	{ "keyed_shift_keys", test_heap_shift_keys, 0, NULL, NULL },
 	END_OF_TESTCASES
 };
@@ -34,11 +34,22 @@
 
 #include <pthread.h>
 #include <assert.h>
+#ifdef _EVENT_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef _EVENT_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "event2/util.h"
 #include "event2/event.h"
 #include "event2/event_struct.h"
 #include "event2/thread.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "defer-internal.h"
+#include "evthread-internal.h"
+#include "log-internal.h"
 #include "regress.h"
 #include "tinytest_macros.h"
 
@@ -75,9 +86,10 @@ basic_thread(void *arg)
 	for (i = 0; i < 100; i++) {
 		struct timeval tv;
 		evutil_timerclear(&tv);
-		assert(evtimer_add(&ev, &tv) == 0);
-
+		/* Hold the lock while adding the timer, so that the callback
+		 * can't broadcast before we start waiting. */
 		assert(pthread_mutex_lock(&cw.lock) == 0);
+		assert(evtimer_add(&ev, &tv) == 0);
 		assert(pthread_cond_wait(&cw.cond, &cw.lock) == 0);
 		assert(pthread_mutex_unlock(&cw.lock) == 0);
 
@@ -122,6 +134,872 @@ pthread_basic(struct event_base *base)
 	event_del(&ev);
 }
 
+#define XTHREAD_N_THREADS 4
+#define XTHREAD_N_ROUNDS 200
+struct xthread_state {
+	struct event ev;
+	int n_seen;
+	int n_sent;
+};
+static struct xthread_state xthread_states[XTHREAD_N_THREADS];
+static pthread_mutex_t xthread_lock;
+static pthread_cond_t xthread_cond;
+static int xthread_n_done;
+
+static void
+xthread_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct xthread_state *st = arg;
+	assert(pthread_mutex_lock(&xthread_lock) == 0);
+	st->n_seen = st->n_sent;
+	assert(pthread_cond_broadcast(&xthread_cond) == 0);
+	if (xthread_n_done == XTHREAD_N_THREADS)
+		event_base_loopbreak(event_get_base(&st->ev));
+	assert(pthread_mutex_unlock(&xthread_lock) == 0);
+}
+
+static void *
+xthread_producer(void *arg)
+{
+	struct xthread_state *st = arg;
+	int i;
+
+	/* Every activation must eventually be seen: if a wakeup gets lost,
+	 * we wait here forever. */
+	for (i = 1; i <= XTHREAD_N_ROUNDS; ++i) {
+		assert(pthread_mutex_lock(&xthread_lock) == 0);
+		st->n_sent = i;
+		assert(pthread_mutex_unlock(&xthread_lock) == 0);
+		event_active(&st->ev, EV_READ, 1);
+		/* Activating it again before it runs should coalesce. */
+		if (i % 2)
+			event_active(&st->ev, EV_WRITE, 1);
+
+		assert(pthread_mutex_lock(&xthread_lock) == 0);
+		while (st->n_seen < i)
+			assert(pthread_cond_wait(&xthread_cond,
+				&xthread_lock) == 0);
+		if (i == XTHREAD_N_ROUNDS)
+			++xthread_n_done;
+		assert(pthread_mutex_unlock(&xthread_lock) == 0);
+	}
+	/* Make sure the loop gets to notice that we're all done. */
+	event_active(&st->ev, EV_READ, 1);
+	return NULL;
+}
+
+void
+regress_xthread_active(void *arg)
+{
+	struct event_base *base;
+	pthread_t threads[XTHREAD_N_THREADS];
+	struct event keepalive;
+	struct timeval tv = { 1000, 0 };
+	int i;
+	(void) arg;
+
+	pthread_mutex_init(&xthread_lock, NULL);
+	pthread_cond_init(&xthread_cond, NULL);
+
+	evthread_use_pthreads();
+	base = event_base_new();
+	tt_assert(base);
+
+	evtimer_assign(&keepalive, base, NULL, NULL);
+	event_add(&keepalive, &tv);
+	for (i = 0; i < XTHREAD_N_THREADS; ++i) {
+		event_assign(&xthread_states[i].ev, base, -1, 0, xthread_cb,
+		    &xthread_states[i]);
+		pthread_create(&threads[i], NULL, xthread_producer,
+		    &xthread_states[i]);
+	}
+
+	event_base_dispatch(base);
+
+	for (i = 0; i < XTHREAD_N_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < XTHREAD_N_THREADS; ++i) {
+		tt_int_op(xthread_states[i].n_seen, ==, XTHREAD_N_ROUNDS);
+		event_del(&xthread_states[i].ev);
+		tt_assert(!event_pending(&xthread_states[i].ev,
+			EV_READ|EV_WRITE, NULL));
+	}
+	event_del(&keepalive);
+	event_base_free(base);
+end:
+	pthread_cond_destroy(&xthread_cond);
+	pthread_mutex_destroy(&xthread_lock);
+}
+
+#define DEFER_N_THREADS 4
+#define DEFER_N_ROUNDS 500
+struct defer_state {
+	struct deferred_cb cb;
+	struct event_base *base;
+	int n_seen;
+	int n_sent;
+};
+static struct defer_state defer_states[DEFER_N_THREADS];
+static pthread_mutex_t defer_lock;
+static pthread_cond_t defer_cond;
+static int defer_n_done;
+
+static void
+defer_cb(struct deferred_cb *cb, void *arg)
+{
+	struct defer_state *st = arg;
+	assert(pthread_mutex_lock(&defer_lock) == 0);
+	st->n_seen = st->n_sent;
+	assert(pthread_cond_broadcast(&defer_cond) == 0);
+	if (defer_n_done == DEFER_N_THREADS)
+		event_base_loopbreak(st->base);
+	assert(pthread_mutex_unlock(&defer_lock) == 0);
+}
+
+static void *
+defer_producer(void *arg)
+{
+	struct defer_state *st = arg;
+	int i;
+
+	for (i = 1; i <= DEFER_N_ROUNDS; ++i) {
+		assert(pthread_mutex_lock(&defer_lock) == 0);
+		st->n_sent = i;
+		assert(pthread_mutex_unlock(&defer_lock) == 0);
+		event_deferred_cb_schedule(st->base, &st->cb);
+		/* Cancel it some of the time, wherever the loop has got to
+		 * with it, and schedule it again. */
+		if (i % 3 == 0) {
+			event_deferred_cb_cancel(st->base, &st->cb);
+			event_deferred_cb_schedule(st->base, &st->cb);
+		}
+
+		assert(pthread_mutex_lock(&defer_lock) == 0);
+		while (st->n_seen < i)
+			assert(pthread_cond_wait(&defer_cond,
+				&defer_lock) == 0);
+		if (i == DEFER_N_ROUNDS)
+			++defer_n_done;
+		assert(pthread_mutex_unlock(&defer_lock) == 0);
+	}
+	/* Make sure the loop gets to notice that we're all done. */
+	event_deferred_cb_schedule(st->base, &st->cb);
+	return NULL;
+}
+
+void
+regress_deferred_xthread(void *arg)
+{
+	struct event_base *base;
+	pthread_t threads[DEFER_N_THREADS];
+	struct event keepalive;
+	struct timeval tv = { 1000, 0 };
+	int i;
+	(void) arg;
+
+	pthread_mutex_init(&defer_lock, NULL);
+	pthread_cond_init(&defer_cond, NULL);
+
+	evthread_use_pthreads();
+	base = event_base_new();
+	tt_assert(base);
+
+	evtimer_assign(&keepalive, base, NULL, NULL);
+	event_add(&keepalive, &tv);
+	for (i = 0; i < DEFER_N_THREADS; ++i) {
+		defer_states[i].base = base;
+		event_deferred_cb_init(&defer_states[i].cb, defer_cb,
+		    &defer_states[i]);
+		pthread_create(&threads[i], NULL, defer_producer,
+		    &defer_states[i]);
+	}
+
+	event_base_dispatch(base);
+
+	for (i = 0; i < DEFER_N_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < DEFER_N_THREADS; ++i) {
+		tt_int_op(defer_states[i].n_seen, ==, DEFER_N_ROUNDS);
+		event_deferred_cb_cancel(base, &defer_states[i].cb);
+	}
+	event_del(&keepalive);
+	event_base_free(base);
+end:
+	pthread_cond_destroy(&defer_cond);
+	pthread_mutex_destroy(&defer_lock);
+}
+
+#define GROUP_SIZE 3
+static pthread_mutex_t group_lock;
+static pthread_cond_t group_cond;
+static int group_n_received;
+static int group_per_base[GROUP_SIZE];
+static pthread_t group_thread[GROUP_SIZE];
+static int group_wrong_thread;
+
+static void
+group_fd_cb(struct event_base *base, int idx, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct event_base_group *group = arg;
+
+	assert(pthread_mutex_lock(&group_lock) == 0);
+	if (base != event_base_group_get_base(group, idx))
+		group_wrong_thread = 1;
+	if (group_per_base[idx]++ == 0)
+		group_thread[idx] = pthread_self();
+	else if (!pthread_equal(group_thread[idx], pthread_self()))
+		group_wrong_thread = 1;
+	++group_n_received;
+	assert(pthread_cond_broadcast(&group_cond) == 0);
+	assert(pthread_mutex_unlock(&group_lock) == 0);
+
+	EVUTIL_CLOSESOCKET(fd);
+}
+
+static void
+group_wait_for(int n)
+{
+	assert(pthread_mutex_lock(&group_lock) == 0);
+	while (group_n_received < n)
+		assert(pthread_cond_wait(&group_cond, &group_lock) == 0);
+	assert(pthread_mutex_unlock(&group_lock) == 0);
+}
+
+static void
+group_noop_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+void
+regress_base_group(void *arg)
+{
+	struct event_base_group *group = NULL;
+	struct event busy[5];
+	evutil_socket_t pair[2] = { -1, -1 };
+	int i;
+	(void) arg;
+
+	pthread_mutex_init(&group_lock, NULL);
+	pthread_cond_init(&group_cond, NULL);
+
+	evthread_use_pthreads();
+
+	group = event_base_group_new(GROUP_SIZE, NULL);
+	tt_assert(group);
+	tt_int_op(event_base_group_get_n_bases(group), ==, GROUP_SIZE);
+	tt_assert(event_base_group_get_base(group, GROUP_SIZE) == NULL);
+
+	/* With nothing else going on, handoffs go round-robin. */
+	for (i = 0; i < 2 * GROUP_SIZE; ++i) {
+		evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(fd >= 0);
+		tt_int_op(event_base_group_hand_off(group, -1, fd, NULL, 0,
+			group_fd_cb, group), >=, 0);
+		group_wait_for(i + 1);
+	}
+	for (i = 0; i < GROUP_SIZE; ++i)
+		tt_int_op(group_per_base[i], ==, 2);
+	tt_assert(!pthread_equal(group_thread[0], group_thread[1]));
+	tt_assert(!pthread_equal(group_thread[0], pthread_self()));
+
+	/* A busy base gets passed over. */
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+	for (i = 0; i < 5; ++i) {
+		event_assign(&busy[i], event_base_group_get_base(group, 0),
+		    pair[0], EV_READ|EV_PERSIST, group_noop_cb, NULL);
+		event_add(&busy[i], NULL);
+	}
+	for (i = 0; i < 2 * GROUP_SIZE; ++i)
+		tt_int_op(event_base_group_least_loaded(group), !=, 0);
+	for (i = 0; i < 2 * GROUP_SIZE; ++i) {
+		evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(fd >= 0);
+		tt_int_op(event_base_group_hand_off(group, -1, fd, NULL, 0,
+			group_fd_cb, group), !=, 0);
+	}
+	group_wait_for(4 * GROUP_SIZE);
+	tt_int_op(group_per_base[0], ==, 2);
+
+	/* Asking for a base by index always works. */
+	tt_int_op(event_base_group_hand_off(group, 0, socket(AF_INET,
+		    SOCK_STREAM, 0), NULL, 0, group_fd_cb, group), ==, 0);
+	group_wait_for(4 * GROUP_SIZE + 1);
+	tt_int_op(group_per_base[0], ==, 3);
+	tt_assert(!group_wrong_thread);
+
+	for (i = 0; i < 5; ++i)
+		event_del(&busy[i]);
+	event_base_group_free(group);
+	group = NULL;
+end:
+	if (group)
+		event_base_group_free(group);
+	if (pair[0] >= 0)
+		EVUTIL_CLOSESOCKET(pair[0]);
+	if (pair[1] >= 0)
+		EVUTIL_CLOSESOCKET(pair[1]);
+	pthread_cond_destroy(&group_cond);
+	pthread_mutex_destroy(&group_lock);
+}
+
+#define WORKQ_N_ITEMS 100
+static pthread_mutex_t workq_lock;
+static pthread_cond_t workq_cond;
+static int workq_state[2 * WORKQ_N_ITEMS];
+static int workq_n_worked;
+static int workq_n_done;
+static int workq_wrong_thread;
+static pthread_t workq_main_thread;
+static struct event_base *workq_base;
+
+static void
+workq_work(void *arg)
+{
+	int *state = arg;
+
+	assert(pthread_mutex_lock(&workq_lock) == 0);
+	if (pthread_equal(pthread_self(), workq_main_thread))
+		workq_wrong_thread = 1;
+	*state = 1;
+	++workq_n_worked;
+	assert(pthread_cond_broadcast(&workq_cond) == 0);
+	assert(pthread_mutex_unlock(&workq_lock) == 0);
+}
+
+static void
+workq_done(void *arg)
+{
+	int *state = arg;
+
+	if (!pthread_equal(pthread_self(), workq_main_thread) || *state != 1)
+		workq_wrong_thread = 1;
+	*state = 2;
+	if (++workq_n_done == 2 * WORKQ_N_ITEMS)
+		event_base_loopbreak(workq_base);
+}
+
+void
+regress_workqueue(void *arg)
+{
+	struct evthread_workqueue *wq = NULL;
+	struct event_base *base = NULL;
+	struct event_base_stats stats;
+	struct event keepalive;
+	struct timeval tv = { 1000, 0 };
+	int i;
+	(void) arg;
+
+	pthread_mutex_init(&workq_lock, NULL);
+	pthread_cond_init(&workq_cond, NULL);
+
+	evthread_use_pthreads();
+	workq_main_thread = pthread_self();
+	base = workq_base = event_base_new();
+	tt_assert(base);
+	event_base_enable_stats(base, 1);
+	tt_assert(evthread_workqueue_new(0) == NULL);
+	wq = evthread_workqueue_new(4);
+	tt_assert(wq);
+
+	/* All of it finishes before the loop looks, so it all comes back
+	 * in one batch. */
+	for (i = 0; i < WORKQ_N_ITEMS; ++i)
+		tt_int_op(evthread_workqueue_submit(wq, base, workq_work,
+			workq_done, &workq_state[i]), ==, 0);
+	assert(pthread_mutex_lock(&workq_lock) == 0);
+	while (workq_n_worked < WORKQ_N_ITEMS)
+		assert(pthread_cond_wait(&workq_cond, &workq_lock) == 0);
+	assert(pthread_mutex_unlock(&workq_lock) == 0);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(workq_n_done, ==, WORKQ_N_ITEMS);
+	tt_int_op(event_base_get_stats(base, &stats), ==, 0);
+	tt_int_op(stats.n_deferred_callbacks, ==, 1);
+
+	/* And while the loop is waiting for it. */
+	evtimer_assign(&keepalive, base, NULL, NULL);
+	event_add(&keepalive, &tv);
+	for (i = WORKQ_N_ITEMS; i < 2 * WORKQ_N_ITEMS; ++i)
+		tt_int_op(evthread_workqueue_submit(wq, base, workq_work,
+			workq_done, &workq_state[i]), ==, 0);
+	event_base_dispatch(base);
+	event_del(&keepalive);
+
+	tt_int_op(workq_n_done, ==, 2 * WORKQ_N_ITEMS);
+	for (i = 0; i < 2 * WORKQ_N_ITEMS; ++i)
+		tt_int_op(workq_state[i], ==, 2);
+	tt_assert(!workq_wrong_thread);
+
+end:
+	if (wq)
+		evthread_workqueue_free(wq);
+	if (base)
+		event_base_free(base);
+	pthread_cond_destroy(&workq_cond);
+	pthread_mutex_destroy(&workq_lock);
+}
+
+static volatile int lockprof_started;
+
+static void *
+lockprof_adder(void *arg)
+{
+	struct evbuffer *buf = arg;
+	lockprof_started = 1;
+	evbuffer_add(buf, "x", 1);
+	return NULL;
+}
+
+void
+regress_lock_profiling(void *arg)
+{
+	struct evthread_lock_stats st, st2;
+	struct event_base *base = NULL;
+	struct evbuffer *buf = NULL;
+	struct event ev;
+	struct timeval tv = { 1000, 0 };
+	pthread_t thread;
+	(void) arg;
+
+	/* There's nothing to wrap yet. */
+	tt_int_op(evthread_enable_lock_profiling(), ==, -1);
+	evthread_use_pthreads();
+	if (evthread_enable_lock_profiling() < 0)
+		tt_skip();
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_N_CATEGORIES, &st),
+	    ==, -1);
+
+	base = event_base_new();
+	tt_assert(base);
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_BASE, &st),
+	    ==, 0);
+	tt_int_op(st.n_locks, ==, 2);
+	evtimer_assign(&ev, base, NULL, NULL);
+	event_add(&ev, &tv);
+	event_del(&ev);
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_BASE, &st2),
+	    ==, 0);
+	tt_assert(st2.n_acquired > st.n_acquired);
+
+	buf = evbuffer_new();
+	tt_int_op(evbuffer_enable_locking(buf, NULL), ==, 0);
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_EVBUFFER,
+		    &st), ==, 0);
+	tt_int_op(st.n_locks, ==, 1);
+
+	/* Taking it again ourselves isn't contention; another thread
+	 * waiting for it is. */
+	evbuffer_lock(buf);
+	evbuffer_lock(buf);
+	pthread_create(&thread, NULL, lockprof_adder, buf);
+	while (!lockprof_started)
+		usleep(1000);
+	usleep(100000);
+	evbuffer_unlock(buf);
+	evbuffer_unlock(buf);
+	pthread_join(thread, NULL);
+
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_EVBUFFER,
+		    &st2), ==, 0);
+	tt_assert(st2.n_acquired - st.n_acquired >= 3);
+	tt_int_op(st2.n_contended - st.n_contended, ==, 1);
+	tt_assert(st2.wait_usec - st.wait_usec >= 50000);
+
+	/* Freed locks still count, until the next reset. */
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_EVBUFFER,
+		    &st), ==, 0);
+	tt_int_op(st.n_locks, ==, 0);
+	tt_assert(st.n_acquired >= st2.n_acquired);
+	tt_int_op(st.n_contended, ==, st2.n_contended);
+	evthread_reset_lock_stats();
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_EVBUFFER,
+		    &st), ==, 0);
+	tt_int_op(st.n_acquired, ==, 0);
+	tt_int_op(st.n_contended, ==, 0);
+	tt_int_op(evthread_get_lock_stats(EVTHREAD_LOCK_CATEGORY_BASE, &st),
+	    ==, 0);
+	tt_int_op(st.n_locks, ==, 2);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (base)
+		event_base_free(base);
+}
+
+static volatile int rwlock_got;
+
+static void *
+rwlock_reader(void *lock)
+{
+	EVLOCK_LOCK(lock, EVTHREAD_READ);
+	rwlock_got = 1;
+	EVLOCK_UNLOCK(lock, EVTHREAD_READ);
+	return NULL;
+}
+
+#define RWLOCK_N_READERS 4
+#define RWLOCK_N_ROUNDS 100000
+static int rwlock_bad_length;
+
+static void *
+rwlock_length_reader(void *arg)
+{
+	struct evbuffer *buf = arg;
+	size_t len;
+	int i;
+	for (i = 0; i < RWLOCK_N_ROUNDS; ++i) {
+		len = evbuffer_get_length(buf);
+		if (len != 0 && len != 1)
+			rwlock_bad_length = 1;
+	}
+	return NULL;
+}
+
+void
+regress_rwlocks(void *arg)
+{
+	void *lock = NULL;
+	struct evbuffer *buf = NULL;
+	pthread_t thread, readers[RWLOCK_N_READERS];
+	int i;
+	(void) arg;
+
+	if (evthread_use_pthreads_rwlocks() < 0)
+		tt_skip();
+	EVTHREAD_ALLOC_LOCK(lock, EVTHREAD_LOCK_CATEGORY_OTHER);
+	tt_assert(lock);
+
+	/* Readers share. */
+	EVLOCK_LOCK(lock, EVTHREAD_READ);
+	pthread_create(&thread, NULL, rwlock_reader, lock);
+	for (i = 0; i < 1000 && !rwlock_got; ++i)
+		usleep(1000);
+	EVLOCK_UNLOCK(lock, EVTHREAD_READ);
+	pthread_join(thread, NULL);
+	tt_assert(rwlock_got);
+
+	/* A writer keeps readers out, but may read itself. */
+	rwlock_got = 0;
+	EVLOCK_LOCK(lock, EVTHREAD_WRITE);
+	EVLOCK_LOCK(lock, EVTHREAD_READ);
+	pthread_create(&thread, NULL, rwlock_reader, lock);
+	usleep(100000);
+	EVLOCK_UNLOCK(lock, EVTHREAD_READ);
+	usleep(50000);
+	tt_assert(!rwlock_got);
+	EVLOCK_UNLOCK(lock, EVTHREAD_WRITE);
+	pthread_join(thread, NULL);
+	tt_assert(rwlock_got);
+
+	/* Lengths read during a stream of writes are always whole. */
+	buf = evbuffer_new();
+	tt_int_op(evbuffer_enable_locking(buf, NULL), ==, 0);
+	for (i = 0; i < RWLOCK_N_READERS; ++i)
+		pthread_create(&readers[i], NULL, rwlock_length_reader, buf);
+	for (i = 0; i < RWLOCK_N_ROUNDS; ++i) {
+		evbuffer_add(buf, "x", 1);
+		evbuffer_drain(buf, 1);
+	}
+	for (i = 0; i < RWLOCK_N_READERS; ++i)
+		pthread_join(readers[i], NULL);
+	tt_assert(!rwlock_bad_length);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	EVTHREAD_FREE_LOCK(lock);
+}
+
+static pthread_t log_drainer_thread;
+static int log_drainer_n;
+static int log_drainer_wrong_thread;
+
+static void
+log_drainer_cb(int severity, const char *msg)
+{
+	if (pthread_equal(pthread_self(), log_drainer_thread))
+		log_drainer_wrong_thread = 1;
+	++log_drainer_n;
+}
+
+void
+regress_log_drainer(void *arg)
+{
+	int i;
+	(void) arg;
+
+	if (event_enable_log_ring(16) < 0)
+		tt_skip();
+	event_set_log_callback(log_drainer_cb);
+	log_drainer_thread = pthread_self();
+	tt_int_op(evthread_log_drainer_start(0), ==, -1);
+	tt_int_op(evthread_log_drainer_start(10), ==, 0);
+	tt_int_op(evthread_log_drainer_start(10), ==, -1);
+
+	for (i = 0; i < 3; ++i)
+		event_warnx("drain me %d", i);
+	for (i = 0; i < 1000 && log_drainer_n < 3; ++i)
+		usleep(1000);
+	tt_int_op(log_drainer_n, ==, 3);
+
+	/* Stopping drains whatever is still there. */
+	event_warnx("one more");
+	evthread_log_drainer_stop();
+	tt_int_op(log_drainer_n, ==, 4);
+	tt_assert(!log_drainer_wrong_thread);
+
+end:
+	evthread_log_drainer_stop();
+	event_disable_log_ring();
+	event_set_log_callback(NULL);
+}
+
+static volatile int watchdog_in_cb;
+static int watchdog_n;
+static int watchdog_while_running;
+static void *watchdog_callback;
+static struct timeval watchdog_duration;
+
+static void
+watchdog_hook(struct event_base *base, void *callback, evutil_socket_t fd,
+    const struct timeval *duration, void *arg)
+{
+	++watchdog_n;
+	watchdog_while_running = watchdog_in_cb;
+	watchdog_callback = callback;
+	watchdog_duration = *duration;
+}
+
+static void
+watchdog_stuck_cb(evutil_socket_t fd, short what, void *arg)
+{
+	watchdog_in_cb = 1;
+	usleep(*(int *)arg);
+	watchdog_in_cb = 0;
+}
+
+void
+regress_watchdog(void *arg)
+{
+	struct event_base *base = NULL;
+	struct evthread_watchdog *wd = NULL;
+	struct event ev;
+	struct timeval limit = { 0, 100000 }, tv = { 0, 0 };
+	int quick = 10000, stuck = 400000;
+	(void) arg;
+
+	evthread_use_pthreads();
+	base = event_base_new();
+	tt_assert(base);
+	tt_assert(evthread_watchdog_new(base, &tv, watchdog_hook, NULL) ==
+	    NULL);
+	wd = evthread_watchdog_new(base, &limit, watchdog_hook, NULL);
+	tt_assert(wd);
+
+	evtimer_assign(&ev, base, watchdog_stuck_cb, &quick);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(watchdog_n, ==, 0);
+
+	/* We hear about a stuck callback once, while it is still stuck. */
+	evtimer_assign(&ev, base, watchdog_stuck_cb, &stuck);
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(watchdog_n, ==, 1);
+	tt_assert(watchdog_while_running);
+	tt_assert(watchdog_callback == (void *)watchdog_stuck_cb);
+	tt_assert(watchdog_duration.tv_sec > 0 ||
+	    watchdog_duration.tv_usec >= 100000);
+
+	evthread_watchdog_free(wd);
+	wd = NULL;
+	event_add(&ev, &tv);
+	event_base_dispatch(base);
+	tt_int_op(watchdog_n, ==, 1);
+
+end:
+	if (wd)
+		evthread_watchdog_free(wd);
+	if (base)
+		event_base_free(base);
+}
+
+#define SPSC_TOTAL (4*1024*1024)
+
+static unsigned char
+spsc_byte(size_t i)
+{
+	return (unsigned char)(i * 7 + i / 251);
+}
+
+static void *
+spsc_producer(void *arg)
+{
+	struct evbuffer *buf = arg;
+	unsigned char chunk[3000];
+	size_t i = 0, n, j;
+
+	while (i < SPSC_TOTAL) {
+		n = 1 + (i * 13) % sizeof(chunk);
+		if (n > SPSC_TOTAL - i)
+			n = SPSC_TOTAL - i;
+		for (j = 0; j < n; ++j)
+			chunk[j] = spsc_byte(i + j);
+		assert(evbuffer_add(buf, chunk, n) == 0);
+		i += n;
+	}
+	return NULL;
+}
+
+void
+regress_evbuffer_spsc(void *arg)
+{
+	struct evbuffer *buf = evbuffer_new();
+	unsigned char chunk[5000];
+	pthread_t thread;
+	size_t i = 0, j;
+	int n, bad = 0;
+	(void) arg;
+
+	evthread_use_pthreads();
+
+	/* It's one mode or the other. */
+	tt_int_op(evbuffer_enable_locking(buf, NULL), ==, 0);
+	tt_int_op(evbuffer_enable_spsc(buf), ==, -1);
+	evbuffer_free(buf);
+	buf = evbuffer_new();
+	if (evbuffer_enable_spsc(buf) < 0)
+		tt_skip();
+	tt_int_op(evbuffer_enable_locking(buf, NULL), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	pthread_create(&thread, NULL, spsc_producer, buf);
+	while (i < SPSC_TOTAL) {
+		/* Take it in pieces that don't line up with the adds; drain
+		 * some of it instead of copying it out. */
+		if (i % 7 == 3) {
+			size_t len = evbuffer_get_length(buf);
+			if (len > 100)
+				len = 100;
+			evbuffer_drain(buf, len);
+			i += len;
+			continue;
+		}
+		n = evbuffer_remove(buf, chunk, 1 + (i * 17) % sizeof(chunk));
+		tt_assert(n >= 0);
+		for (j = 0; j < (size_t)n; ++j)
+			if (chunk[j] != spsc_byte(i + j))
+				++bad;
+		i += n;
+	}
+	pthread_join(thread, NULL);
+
+	tt_int_op(bad, ==, 0);
+	tt_int_op(i, ==, SPSC_TOTAL);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(evbuffer_remove(buf, chunk, sizeof(chunk)), ==, 0);
+
+	/* What's left in the buffer is freed with it. */
+	tt_int_op(evbuffer_add(buf, chunk, sizeof(chunk)), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(chunk));
+end:
+	evbuffer_free(buf);
+}
+
+#define PAIR_XT_N_MSGS 2000
+
+/* The worker echoes everything back and goes away at EOF. */
+static void
+pair_xt_echo_readcb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void
+pair_xt_echo_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct event_base *base = arg;
+	if (what & BEV_EVENT_EOF) {
+		bufferevent_free(bev);
+		event_base_loopexit(base, NULL);
+	}
+}
+
+static void *
+pair_xt_worker(void *arg)
+{
+	event_base_dispatch(arg);
+	return NULL;
+}
+
+static size_t pair_xt_n_received;
+
+static void
+pair_xt_main_readcb(struct bufferevent *bev, void *arg)
+{
+	struct event_base *base = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	pair_xt_n_received += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (pair_xt_n_received == PAIR_XT_N_MSGS * 10)
+		event_base_loopexit(base, NULL);
+}
+
+void
+regress_bufferevent_pair_xthread(void *arg)
+{
+	struct event_base *base0 = NULL, *base1 = NULL;
+	struct bufferevent *pair[2] = { NULL, NULL };
+	struct event keepalive0, keepalive1;
+	struct timeval tv = { 1000, 0 };
+	pthread_t thread;
+	int i;
+	(void) arg;
+
+	evthread_use_pthreads();
+	base0 = event_base_new();
+	base1 = event_base_new();
+	tt_assert(base0 && base1);
+
+	if (bufferevent_pair_new_xthread(base0, base1, 0, pair) < 0)
+		tt_skip();
+	evtimer_assign(&keepalive0, base0, NULL, NULL);
+	event_add(&keepalive0, &tv);
+	evtimer_assign(&keepalive1, base1, NULL, NULL);
+	event_add(&keepalive1, &tv);
+
+	bufferevent_setcb(pair[1], pair_xt_echo_readcb, NULL,
+	    pair_xt_echo_eventcb, base1);
+	bufferevent_enable(pair[1], EV_READ|EV_WRITE);
+	bufferevent_setcb(pair[0], pair_xt_main_readcb, NULL, NULL, base0);
+	bufferevent_enable(pair[0], EV_READ|EV_WRITE);
+
+	pthread_create(&thread, NULL, pair_xt_worker, base1);
+	for (i = 0; i < PAIR_XT_N_MSGS; ++i)
+		bufferevent_write(pair[0], "0123456789", 10);
+	event_base_dispatch(base0);
+	tt_int_op(pair_xt_n_received, ==, PAIR_XT_N_MSGS * 10);
+
+	/* Freeing our end sends EOF, which stops the worker. */
+	bufferevent_free(pair[0]);
+	pair[0] = NULL;
+	pthread_join(thread, NULL);
+
+	event_del(&keepalive0);
+	event_del(&keepalive1);
+end:
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (base0)
+		event_base_free(base0);
+	if (base1)
+		event_base_free(base1);
+}
+
 void
 regress_threads(void *arg)
 {
@@ -54,12 +54,14 @@
 #include <assert.h>
 
 #include "event2/event.h"
+#include "event2/bufferevent.h"
 #include "evhttp.h"
 #include "log-internal.h"
 #include "event2/rpc.h"
 #include "event2/rpc_struct.h"
 
 #include "regress.gen.h"
+#include "regress_arena.gen.h"
 
 #include "regress.h"
 
@@ -858,6 +860,761 @@ end:
                 evbuffer_free(tmp);
 }
 
+static void
+rpc_arena(void *arg)
+{
+	struct arena_msg *msg = NULL, *msg2 = NULL;
+	struct arena_kill *kill = NULL;
+	struct evbuffer *tmp = evbuffer_new();
+	ev_uint8_t *data, *start;
+	ev_uint32_t len;
+	ev_uint64_t number;
+	char *weapon;
+	size_t size;
+	int i;
+
+	tt_assert(tmp);
+	msg = arena_msg_new();
+	tt_assert(msg);
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	tt_int_op(EVTAG_ASSIGN_WITH_LEN(msg, payload,
+		    (ev_uint8_t *)"some payload", 12), ==, 0);
+	tt_int_op(EVTAG_GET(msg, attack, &kill), ==, 0);
+	EVTAG_ASSIGN(kill, weapon, "feather");
+	for (i = 0; i < 100; ++i) {
+		tt_assert(kill = EVTAG_ARRAY_ADD(msg, kills));
+		EVTAG_ASSIGN(kill, weapon, "tickle");
+		tt_int_op(EVTAG_ASSIGN_WITH_LEN(kill, blob,
+			    (ev_uint8_t *)&i, sizeof(i)), ==, 0);
+		tt_assert(EVTAG_ARRAY_ADD_VALUE(kill, how_often,
+			    0xdead0a0bcafebeefLL + i));
+		tt_assert(EVTAG_ARRAY_ADD_VALUE(msg, notes, "a note"));
+	}
+	tt_int_op(arena_msg_complete(msg), ==, 0);
+
+	/* nested structs are marshaled without any intermediate buffer */
+	evtag_marshal_arena_msg(tmp, 0xdeaf, msg);
+	tt_int_op(evbuffer_get_length(tmp), ==,
+	    evtag_length(0xdeaf, arena_msg_marshal_length(msg)));
+
+	msg2 = arena_msg_new();
+	tt_int_op(evtag_unmarshal_arena_msg(tmp, 0xdeaf, msg2), ==, 0);
+	tt_int_op(evbuffer_get_length(tmp), ==, 0);
+	evbuffer_free(tmp);
+	tmp = NULL;
+
+	/* everything unmarshaled outlives the buffer it came from */
+	tt_int_op(EVTAG_GET_WITH_LEN(msg2, payload, &data, &len), ==, 0);
+	tt_int_op(len, ==, 12);
+	tt_assert(!memcmp(data, "some payload", 12));
+	tt_int_op(EVTAG_GET(msg2, attack, &kill), ==, 0);
+	tt_int_op(EVTAG_GET(kill, weapon, &weapon), ==, 0);
+	tt_str_op(weapon, ==, "feather");
+	tt_int_op(EVTAG_ARRAY_LEN(msg2, kills), ==, 100);
+	tt_int_op(EVTAG_ARRAY_LEN(msg2, notes), ==, 100);
+	for (i = 0; i < 100; ++i) {
+		tt_int_op(EVTAG_ARRAY_GET(msg2, kills, i, &kill), ==, 0);
+		tt_int_op(EVTAG_GET(kill, weapon, &weapon), ==, 0);
+		tt_str_op(weapon, ==, "tickle");
+		tt_int_op(EVTAG_GET_WITH_LEN(kill, blob, &data, &len), ==, 0);
+		tt_int_op(len, ==, sizeof(i));
+		tt_assert(!memcmp(data, &i, sizeof(i)));
+		tt_int_op(EVTAG_ARRAY_GET(kill, how_often, 0, &number), ==, 0);
+		tt_assert(number == 0xdead0a0bcafebeefLL + i);
+	}
+
+	/* bytes point right into contiguous input instead of being copied */
+	arena_msg_free(msg2);
+	msg2 = arena_msg_new();
+	tt_assert(tmp = evbuffer_new());
+	arena_msg_marshal(tmp, msg);
+	size = evbuffer_get_length(tmp);
+	start = evbuffer_pullup(tmp, -1);
+	tt_int_op(arena_msg_unmarshal(msg2, tmp), ==, 0);
+	tt_int_op(EVTAG_GET_WITH_LEN(msg2, payload, &data, &len), ==, 0);
+	tt_assert(data >= start && data + len <= start + size);
+
+	/* a nested struct may not run past its own length */
+	arena_msg_free(msg2);
+	msg2 = arena_msg_new();
+	tt_int_op(EVTAG_GET(msg, attack, &kill), ==, 0);
+	evtag_marshal_header(tmp, 3, arena_kill_marshal_length(kill) - 1);
+	arena_kill_marshal(tmp, kill);
+	evtag_marshal_string(tmp, 1, "x");
+	tt_int_op(arena_msg_unmarshal(msg2, tmp), ==, -1);
+
+end:
+	if (msg)
+		arena_msg_free(msg);
+	if (msg2)
+		arena_msg_free(msg2);
+	if (tmp)
+		evbuffer_free(tmp);
+}
+
+static int
+stream_run_cb(struct msg *msg, struct run *run, void *arg)
+{
+	int *count = arg;
+	char *how;
+
+	if (EVTAG_GET(run, how, &how) == -1 || strcmp(how, "very fast"))
+		return (-1);
+	/* the array never holds more than the run being handed over */
+	if (EVTAG_ARRAY_LEN(msg, run) != 1)
+		return (-1);
+	++*count;
+	return (0);
+}
+
+static void
+rpc_stream(void *arg)
+{
+	struct msg_stream_cbs cbs;
+	struct msg *msg = NULL, *msg2 = NULL;
+	struct run *run;
+	struct evbuffer *tmp = evbuffer_new(), *input = evbuffer_new();
+	ev_uint8_t fixed[24];
+	char *name;
+	int count = 0;
+	int i;
+
+	tt_assert(tmp && input);
+	memset(fixed, 0, sizeof(fixed));
+	msg = msg_new();
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	EVTAG_ASSIGN(msg, to_name, "tester");
+	for (i = 0; i < 1000; ++i) {
+		tt_assert(run = EVTAG_ARRAY_ADD(msg, run));
+		EVTAG_ASSIGN(run, how, "very fast");
+		EVTAG_ASSIGN(run, fixed_bytes, fixed);
+	}
+	msg_marshal(tmp, msg);
+
+	/* the input trickles in, a few bytes at a time */
+	memset(&cbs, 0, sizeof(cbs));
+	cbs.run = stream_run_cb;
+	msg2 = msg_new();
+	while (evbuffer_get_length(tmp)) {
+		evbuffer_remove_buffer(tmp, input, 7);
+		tt_int_op(msg_unmarshal_stream(msg2, input, &cbs, &count), ==, 0);
+	}
+	tt_int_op(evbuffer_get_length(input), ==, 0);
+	tt_int_op(count, ==, 1000);
+	tt_int_op(EVTAG_ARRAY_LEN(msg2, run), ==, 0);
+	tt_int_op(msg_complete(msg2), ==, 0);
+	tt_int_op(EVTAG_GET(msg2, to_name, &name), ==, 0);
+	tt_str_op(name, ==, "tester");
+
+	/* without a callback, the array is filled in as usual */
+	msg_free(msg2);
+	msg2 = msg_new();
+	msg_marshal(input, msg);
+	cbs.run = NULL;
+	tt_int_op(msg_unmarshal_stream(msg2, input, &cbs, &count), ==, 0);
+	tt_int_op(EVTAG_ARRAY_LEN(msg2, run), ==, 1000);
+
+	/* a callback can give up */
+	msg_free(msg2);
+	msg2 = msg_new();
+	tt_int_op(EVTAG_ARRAY_GET(msg, run, 500, &run), ==, 0);
+	EVTAG_ASSIGN(run, how, "slow");
+	msg_marshal(tmp, msg);
+	cbs.run = stream_run_cb;
+	tt_int_op(msg_unmarshal_stream(msg2, tmp, &cbs, &count), ==, -1);
+
+end:
+	if (msg)
+		msg_free(msg);
+	if (msg2)
+		msg_free(msg2);
+	if (tmp)
+		evbuffer_free(tmp);
+	if (input)
+		evbuffer_free(input);
+}
+
+static struct evhttp_connection *dispatch_evcon[2];
+static int dispatch_hooks[2];
+static int dispatch_done;
+
+static int
+rpc_hook_count_dispatch(void *ctx, struct evhttp_request *req,
+    struct evbuffer *evbuf, void *arg)
+{
+	struct evhttp_connection *evcon = evrpc_hook_get_connection(ctx);
+
+	assert(evcon == dispatch_evcon[0] || evcon == dispatch_evcon[1]);
+	++dispatch_hooks[evcon == dispatch_evcon[1]];
+
+	return (EVRPC_CONTINUE);
+}
+
+static void
+GotKillDispatchCb(struct evrpc_status *status,
+    struct msg *msg, struct kill *kill, void *arg)
+{
+	if (status->error == EVRPC_STATUS_ERR_NONE)
+		test_ok += 1;
+
+	if (++dispatch_done == 6)
+		event_loopexit(NULL);
+}
+
+static void
+rpc_pool_dispatch(void)
+{
+	short port;
+	struct evhttp *http = NULL;
+	struct evrpc_base *base = NULL;
+	struct evrpc_pool *pool = NULL;
+	struct msg *msg = NULL;
+	struct kill *kill[6];
+	int i;
+
+	memset(kill, 0, sizeof(kill));
+	memset(dispatch_hooks, 0, sizeof(dispatch_hooks));
+	dispatch_done = 0;
+
+	rpc_setup(&http, &port, &base);
+
+	pool = evrpc_pool_new(NULL);
+	assert(pool != NULL);
+	for (i = 0; i < 2; ++i) {
+		dispatch_evcon[i] = evhttp_connection_new("127.0.0.1", port);
+		assert(dispatch_evcon[i] != NULL);
+		evrpc_pool_add_connection(pool, dispatch_evcon[i]);
+	}
+	assert(evrpc_add_hook(pool, EVRPC_OUTPUT,
+		rpc_hook_count_dispatch, NULL));
+
+	msg = msg_new();
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	EVTAG_ASSIGN(msg, to_name, "tester");
+	for (i = 0; i < 6; ++i)
+		kill[i] = kill_new();
+
+	test_ok = 0;
+
+	/* one request per connection; the third waits in the pool */
+	for (i = 0; i < 3; ++i)
+		EVRPC_MAKE_REQUEST(Message, pool, msg, kill[i],
+		    GotKillDispatchCb, NULL);
+	tt_int_op(dispatch_hooks[0], ==, 1);
+	tt_int_op(dispatch_hooks[1], ==, 1);
+
+	/* with room for two, it goes to the first connection, and the
+	 * next one to the second, which has less to do */
+	evrpc_pool_set_max_pending(pool, 2);
+	tt_int_op(dispatch_hooks[0], ==, 2);
+	tt_int_op(dispatch_hooks[1], ==, 1);
+	for (i = 3; i < 6; ++i)
+		EVRPC_MAKE_REQUEST(Message, pool, msg, kill[i],
+		    GotKillDispatchCb, NULL);
+	tt_int_op(dispatch_hooks[0], ==, 2);
+	tt_int_op(dispatch_hooks[1], ==, 2);
+
+	event_dispatch();
+
+	tt_int_op(test_ok, ==, 6);
+	tt_int_op(dispatch_hooks[0] + dispatch_hooks[1], ==, 6);
+
+end:
+	if (pool)
+		evrpc_pool_free(pool);
+	if (base)
+		rpc_teardown(base);
+	if (http)
+		evhttp_free(http);
+	if (msg)
+		msg_free(msg);
+	for (i = 0; i < 6; ++i) {
+		if (kill[i])
+			kill_free(kill[i]);
+	}
+}
+
+static int batch_hooks_called;
+static int batch_ids[7] = { 0, 1, 2, 3, 4, 5, 6 };
+static int batch_order[7];
+static int batch_done;
+
+static int
+rpc_hook_count_batch(void *ctx, struct evhttp_request *req,
+    struct evbuffer *evbuf, void *arg)
+{
+	++batch_hooks_called;
+	return (EVRPC_CONTINUE);
+}
+
+static void
+GotBatchCb(struct evrpc_status *status,
+    struct msg *msg, struct kill *kill, void *arg)
+{
+	char *weapon;
+
+	/* the callbacks run in the order in which the rpcs were added */
+	if (status->error == EVRPC_STATUS_ERR_NONE &&
+	    EVTAG_GET(kill, weapon, &weapon) == 0 &&
+	    strcmp(weapon, "dagger") == 0) {
+		batch_order[batch_done] = *(int *)arg;
+		test_ok += 1;
+	} else
+		batch_order[batch_done] = -status->error;
+
+	if (++batch_done == 7)
+		event_loopexit(NULL);
+}
+
+EVRPC_HEADER(NoSuchBatchRpc, msg, kill);
+EVRPC_GENERATE(NoSuchBatchRpc, msg, kill);
+
+static void
+rpc_batch_client(void)
+{
+	short port;
+	struct evhttp *http = NULL;
+	struct evrpc_base *base = NULL;
+	struct evrpc_pool *pool = NULL;
+	struct evrpc_batch *batch = NULL;
+	struct msg *msg = NULL;
+	struct kill *kill[7];
+	int i;
+
+	memset(kill, 0, sizeof(kill));
+	memset(batch_order, 0, sizeof(batch_order));
+	batch_hooks_called = batch_done = 0;
+
+	rpc_setup(&http, &port, &base);
+
+	/* the rpcs in a batch see the headers that the hooks set on it */
+	need_input_hook = 1;
+	assert(evrpc_add_hook(base, EVRPC_INPUT, rpc_hook_add_header,
+		(void*)"input") != NULL);
+	assert(evrpc_add_hook(base, EVRPC_INPUT, rpc_hook_count_batch, NULL));
+	assert(evrpc_add_hook(base, EVRPC_OUTPUT, rpc_hook_count_batch, NULL));
+
+	pool = rpc_pool_with_connection(port);
+	assert(evrpc_add_hook(pool, EVRPC_INPUT, rpc_hook_count_batch, NULL));
+	assert(evrpc_add_hook(pool, EVRPC_OUTPUT, rpc_hook_count_batch, NULL));
+
+	msg = msg_new();
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	EVTAG_ASSIGN(msg, to_name, "tester");
+
+	batch = evrpc_batch_new(pool);
+	tt_assert(batch);
+	for (i = 0; i < 7; ++i) {
+		kill[i] = kill_new();
+		if (i == 3) {
+			/* one bad call does not spoil the others */
+			tt_int_op(EVRPC_BATCH_ADD(NoSuchBatchRpc, batch, msg,
+				kill[i], GotBatchCb, &batch_ids[i]),
+			    ==, 0);
+		} else {
+			tt_int_op(EVRPC_BATCH_ADD(Message, batch, msg,
+				kill[i], GotBatchCb, &batch_ids[i]),
+			    ==, 0);
+		}
+	}
+	test_ok = 0;
+	tt_int_op(evrpc_batch_send(batch), ==, 0);
+	batch = NULL;
+
+	event_dispatch();
+
+	tt_int_op(batch_done, ==, 7);
+	tt_int_op(test_ok, ==, 6);
+	for (i = 0; i < 7; ++i) {
+		if (i == 3)
+			tt_int_op(batch_order[i], ==,
+			    -EVRPC_STATUS_ERR_BADPAYLOAD);
+		else
+			tt_int_op(batch_order[i], ==, i);
+	}
+	/* one pass through each of the four kinds of hooks */
+	tt_int_op(batch_hooks_called, ==, 4);
+
+	/* a batch that is never sent calls nobody back */
+	batch = evrpc_batch_new(pool);
+	tt_assert(batch);
+	EVRPC_BATCH_ADD(Message, batch, msg, kill[0], GotBatchCb, NULL);
+	evrpc_batch_free(batch);
+	batch = NULL;
+	tt_int_op(batch_done, ==, 7);
+
+end:
+	if (batch)
+		evrpc_batch_free(batch);
+	if (pool)
+		evrpc_pool_free(pool);
+	if (base)
+		rpc_teardown(base);
+	if (http)
+		evhttp_free(http);
+	if (msg)
+		msg_free(msg);
+	for (i = 0; i < 7; ++i) {
+		if (kill[i])
+			kill_free(kill[i]);
+	}
+	need_input_hook = 0;
+}
+
+/* framed rpcs over a bufferevent; the hooks pause every rpc once */
+
+static struct event_base *frame_base;
+static int frame_hooks_called;
+static int frame_replies;
+static int frame_errors;
+static int frame_expected;
+
+static void
+rpc_frame_resume_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct _rpc_hook_ctx *ctx = arg;
+	evrpc_resume_request(ctx->vbase, ctx->ctx, EVRPC_CONTINUE);
+	free(ctx);
+}
+
+static int
+rpc_frame_hook(void *ctx, struct evhttp_request *req, struct evbuffer *evbuf,
+    void *arg)
+{
+	struct _rpc_hook_ctx *tmp = malloc(sizeof(*tmp));
+	struct timeval tv;
+
+	assert(tmp != NULL);
+	assert(req == NULL);
+	assert(evrpc_hook_get_connection(ctx) == NULL);
+	++frame_hooks_called;
+
+	tmp->vbase = arg;
+	tmp->ctx = ctx;
+	evutil_timerclear(&tv);
+	event_base_once(frame_base, -1, EV_TIMEOUT, rpc_frame_resume_cb,
+	    tmp, &tv);
+	return EVRPC_PAUSE;
+}
+
+static void
+GotFrameCb(struct evrpc_status *status,
+    struct msg *msg, struct kill *kill, void *arg)
+{
+	char *weapon;
+
+	assert(status->http_req == NULL);
+	if (status->error == EVRPC_STATUS_ERR_NONE &&
+	    EVTAG_GET(kill, weapon, &weapon) == 0 &&
+	    strcmp(weapon, "dagger") == 0)
+		++frame_replies;
+	else
+		frame_errors |= 1 << status->error;
+
+	if (frame_replies + (frame_errors != 0) == frame_expected)
+		event_base_loopexit(frame_base, NULL);
+}
+
+EVRPC_HEADER(NoSuchRpc, msg, kill);
+EVRPC_GENERATE(NoSuchRpc, msg, kill);
+
+static void
+rpc_frame_client(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev[2] = { NULL, NULL };
+	struct evrpc_base *base = NULL;
+	struct evrpc_pool *pool = NULL;
+	struct evrpc_batch *batch;
+	struct msg *msg[10];
+	struct kill *kill[11];
+	int i;
+
+	memset(msg, 0, sizeof(msg));
+	memset(kill, 0, sizeof(kill));
+	frame_base = data->base;
+	frame_hooks_called = frame_replies = frame_errors = 0;
+	need_input_hook = need_output_hook = 0;
+
+	bev[0] = bufferevent_socket_new(data->base, data->pair[0], 0);
+	bev[1] = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_assert(bev[0] && bev[1]);
+
+	/* no http server at all */
+	base = evrpc_init(NULL);
+	tt_assert(base);
+	EVRPC_REGISTER(base, Message, msg, kill, MessageCb, NULL);
+	tt_assert(evrpc_add_hook(base, EVRPC_INPUT, rpc_frame_hook, base));
+	tt_assert(evrpc_add_hook(base, EVRPC_OUTPUT, rpc_frame_hook, base));
+	tt_int_op(evrpc_add_bufferevent(base, bev[0]), ==, 0);
+	bev[0] = NULL;
+
+	pool = evrpc_pool_new(data->base);
+	tt_assert(pool);
+	tt_assert(evrpc_add_hook(pool, EVRPC_INPUT, rpc_frame_hook, pool));
+	tt_assert(evrpc_add_hook(pool, EVRPC_OUTPUT, rpc_frame_hook, pool));
+	tt_int_op(evrpc_pool_add_bufferevent(pool, bev[1]), ==, 0);
+	bev[1] = NULL;
+
+	/* all of these are outstanding on the one connection at once */
+	for (i = 0; i < 10; ++i) {
+		msg[i] = msg_new();
+		EVTAG_ASSIGN(msg[i], from_name, "niels");
+		EVTAG_ASSIGN(msg[i], to_name, "tester");
+		kill[i] = kill_new();
+		EVRPC_MAKE_REQUEST(Message, pool, msg[i], kill[i],
+		    GotFrameCb, NULL);
+	}
+	kill[10] = kill_new();
+	EVRPC_MAKE_REQUEST(NoSuchRpc, pool, msg[0], kill[10],
+	    GotFrameCb, NULL);
+	frame_expected = 11;
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(frame_replies, ==, 10);
+	tt_int_op(frame_errors, ==, 1 << EVRPC_STATUS_ERR_BADPAYLOAD);
+	/* four hooks per rpc; the unknown one never reaches the server's */
+	tt_int_op(frame_hooks_called, ==, 4 * 10 + 2);
+
+	/* a batch is a single frame, and goes through the hooks once */
+	frame_hooks_called = frame_replies = 0;
+	batch = evrpc_batch_new(pool);
+	tt_assert(batch);
+	for (i = 0; i < 2; ++i) {
+		kill_clear(kill[i]);
+		EVRPC_BATCH_ADD(Message, batch, msg[i], kill[i],
+		    GotFrameCb, NULL);
+	}
+	frame_expected = 2;
+	tt_int_op(evrpc_batch_send(batch), ==, 0);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(frame_replies, ==, 2);
+	tt_int_op(frame_hooks_called, ==, 4);
+
+end:
+	if (pool)
+		evrpc_pool_free(pool);
+	if (base) {
+		EVRPC_UNREGISTER(base, Message);
+		evrpc_free(base);
+	}
+	for (i = 0; i < 2; ++i) {
+		if (bev[i])
+			bufferevent_free(bev[i]);
+	}
+	for (i = 0; i < 10; ++i) {
+		if (msg[i])
+			msg_free(msg[i]);
+	}
+	for (i = 0; i < 11; ++i) {
+		if (kill[i])
+			kill_free(kill[i]);
+	}
+}
+
+static void
+rpc_frame_timeout(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evrpc_base *base = NULL;
+	struct evrpc_pool *pool = NULL;
+	struct bufferevent *bev;
+	struct msg *msg = NULL;
+	struct kill *kill[3] = { NULL, NULL, NULL };
+	struct timeval tv;
+	int i;
+
+	frame_base = data->base;
+	frame_replies = frame_errors = 0;
+	need_input_hook = need_output_hook = 0;
+
+	base = evrpc_init(NULL);
+	tt_assert(base);
+	EVRPC_REGISTER(base, Message, msg, kill, MessageCb, NULL);
+	EVRPC_REGISTER(base, NeverReply, msg, kill, NeverReplyCb, NULL);
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	tt_int_op(evrpc_add_bufferevent(base, bev), ==, 0);
+
+	pool = evrpc_pool_new(data->base);
+	tt_assert(pool);
+	bev = bufferevent_socket_new(data->base, data->pair[1],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	data->pair[1] = -1;
+	tt_int_op(evrpc_pool_add_bufferevent(pool, bev), ==, 0);
+	evrpc_pool_set_timeout(pool, 1);
+
+	msg = msg_new();
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	EVTAG_ASSIGN(msg, to_name, "tester");
+	for (i = 0; i < 3; ++i)
+		kill[i] = kill_new();
+
+	/* a request that hangs does not hold up the one behind it */
+	saved_rpc = NULL;
+	EVRPC_MAKE_REQUEST(NeverReply, pool, msg, kill[0], GotFrameCb, NULL);
+	EVRPC_MAKE_REQUEST(Message, pool, msg, kill[1], GotFrameCb, NULL);
+	frame_expected = 2;
+	event_base_dispatch(data->base);
+	tt_int_op(frame_replies, ==, 1);
+	tt_int_op(frame_errors, ==, 1 << EVRPC_STATUS_ERR_TIMEOUT);
+	tt_assert(saved_rpc != NULL);
+
+	/* a late reply finds nobody waiting for it */
+	EVRPC_REQUEST_DONE(saved_rpc);
+	saved_rpc = NULL;
+	tv.tv_sec = 0;
+	tv.tv_usec = 100 * 1000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(frame_replies, ==, 1);
+
+	/* when the server goes away, outstanding requests fail */
+	evrpc_pool_set_timeout(pool, 0);
+	frame_errors = 0;
+	frame_replies = 0;
+	frame_expected = 1;
+	EVRPC_MAKE_REQUEST(NeverReply, pool, msg, kill[2], GotFrameCb, NULL);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(saved_rpc != NULL);
+	shutdown(data->pair[0], SHUT_WR);
+	event_base_dispatch(data->base);
+	tt_int_op(frame_errors, ==, 1 << EVRPC_STATUS_ERR_TIMEOUT);
+
+	/* the pool closed its end; the server notices, but the request
+	 * it is still working on can be finished safely */
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	EVRPC_REQUEST_DONE(saved_rpc);
+	saved_rpc = NULL;
+
+end:
+	if (pool)
+		evrpc_pool_free(pool);
+	if (base) {
+		EVRPC_UNREGISTER(base, Message);
+		EVRPC_UNREGISTER(base, NeverReply);
+		evrpc_free(base);
+	}
+	if (msg)
+		msg_free(msg);
+	for (i = 0; i < 3; ++i) {
+		if (kill[i])
+			kill_free(kill[i]);
+	}
+}
+
+static int offload_in_worker;
+static int offload_served[2];
+
+static void
+MessageOffloadCb(EVRPC_STRUCT(Message)* rpc, void *arg)
+{
+	++offload_served[offload_in_worker];
+	MessageCb(rpc, arg);
+}
+
+static void
+rpc_offload(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *worker = NULL;
+	struct evrpc_base *base = NULL;
+	struct evrpc_pool *pool = NULL;
+	struct bufferevent *bev[2] = { NULL, NULL };
+	struct msg *msg = NULL;
+	struct kill *kill[3] = { NULL, NULL, NULL };
+	struct timeval start, now;
+	int i;
+
+	frame_base = data->base;
+	frame_replies = frame_errors = 0;
+	frame_expected = -1;
+	offload_served[0] = offload_served[1] = 0;
+	need_input_hook = need_output_hook = 0;
+
+	worker = event_base_new();
+	tt_assert(worker);
+
+	base = evrpc_init(NULL);
+	tt_assert(base);
+	EVRPC_REGISTER(base, Message, msg, kill, MessageOffloadCb, NULL);
+	tt_int_op(EVRPC_SET_OFFLOAD(base, Message, 1), ==, 0);
+	tt_int_op(EVRPC_SET_OFFLOAD(base, NoSuchRpc, 1), ==, -1);
+	tt_int_op(evrpc_add_worker_base(base, worker), ==, 0);
+
+	bev[0] = bufferevent_socket_new(data->base, data->pair[0], 0);
+	bev[1] = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_assert(bev[0] && bev[1]);
+	tt_int_op(evrpc_add_bufferevent(base, bev[0]), ==, 0);
+	bev[0] = NULL;
+	pool = evrpc_pool_new(data->base);
+	tt_assert(pool);
+	tt_int_op(evrpc_pool_add_bufferevent(pool, bev[1]), ==, 0);
+	bev[1] = NULL;
+
+	msg = msg_new();
+	EVTAG_ASSIGN(msg, from_name, "niels");
+	EVTAG_ASSIGN(msg, to_name, "tester");
+	for (i = 0; i < 3; ++i) {
+		kill[i] = kill_new();
+		EVRPC_MAKE_REQUEST(Message, pool, msg, kill[i],
+		    GotFrameCb, NULL);
+	}
+
+	/* One thread stands in for both: the rpcs come in on data->base,
+	 * and their callbacks run on the worker. */
+	evutil_gettimeofday(&start, NULL);
+	while (frame_replies < 3 && frame_errors == 0) {
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+		offload_in_worker = 1;
+		event_base_loop(worker, EVLOOP_NONBLOCK);
+		offload_in_worker = 0;
+		evutil_gettimeofday(&now, NULL);
+		if (now.tv_sec - start.tv_sec > 5)
+			break;
+	}
+
+	tt_int_op(frame_replies, ==, 3);
+	tt_int_op(offload_served[0], ==, 0);
+	tt_int_op(offload_served[1], ==, 3);
+
+	/* without offloading, the callback runs where the rpc came in */
+	tt_int_op(EVRPC_SET_OFFLOAD(base, Message, 0), ==, 0);
+	kill_clear(kill[0]);
+	frame_replies = 0;
+	frame_expected = 1;
+	EVRPC_MAKE_REQUEST(Message, pool, msg, kill[0], GotFrameCb, NULL);
+	event_base_dispatch(data->base);
+	tt_int_op(frame_replies, ==, 1);
+	tt_int_op(offload_served[0], ==, 1);
+
+end:
+	if (pool)
+		evrpc_pool_free(pool);
+	if (base) {
+		EVRPC_UNREGISTER(base, Message);
+		evrpc_free(base);
+	}
+	if (worker)
+		event_base_free(worker);
+	for (i = 0; i < 2; ++i) {
+		if (bev[i])
+			bufferevent_free(bev[i]);
+	}
+	if (msg)
+		msg_free(msg);
+	for (i = 0; i < 3; ++i) {
+		if (kill[i])
+			kill_free(kill[i]);
+	}
+}
+
 #define RPC_LEGACY(name)						\
 	{ #name, run_legacy_test_fn, TT_FORK|TT_NEED_BASE|TT_LEGACY,	\
 		    &legacy_setup,				    \
@@ -871,6 +1628,16 @@ struct testcase_t rpc_testcases[] = {
         RPC_LEGACY(basic_client_with_pause),
         RPC_LEGACY(client_timeout),
         RPC_LEGACY(test),
+        RPC_LEGACY(pool_dispatch),
+        RPC_LEGACY(batch_client),
+	{ "frame_client", rpc_frame_client, TT_FORK|TT_NEED_BASE|
+	  TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "frame_timeout", rpc_frame_timeout, TT_FORK|TT_NEED_BASE|
+	  TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "offload", rpc_offload, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "arena", rpc_arena, 0, NULL, NULL },
+	{ "stream", rpc_stream, 0, NULL, NULL },
 
         END_OF_TESTCASES,
 };
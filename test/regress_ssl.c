@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2009 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "event-config.h"
+#endif
+
+#include <sys/types.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event2/util.h"
+#include "event2/event.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_ssl.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "regress.h"
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+/* How much the client sends, and expects to get back. */
+#define N_ECHO (256*1024)
+
+static EVP_PKEY *the_key = NULL;
+static X509 *the_cert = NULL;
+
+/* Make up a throwaway key and a self-signed certificate for it, so that we
+ * don't need to ship any. */
+static void
+init_ssl(void)
+{
+	X509_NAME *name;
+
+	SSL_library_init();
+	ERR_load_crypto_strings();
+	SSL_load_error_strings();
+
+	the_key = EVP_EC_gen("P-256");
+	if (!the_key)
+		return;
+	the_cert = X509_new();
+	X509_set_version(the_cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(the_cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(the_cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(the_cert), 3600);
+	name = X509_get_subject_name(the_cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(the_cert, name);
+	X509_set_pubkey(the_cert, the_key);
+	if (!X509_sign(the_cert, the_key, EVP_sha256())) {
+		X509_free(the_cert);
+		the_cert = NULL;
+	}
+}
+
+static SSL_CTX *
+get_ssl_ctx(void)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_method());
+	if (!ctx)
+		return NULL;
+	if (!SSL_CTX_use_certificate(ctx, the_cert) ||
+	    !SSL_CTX_use_PrivateKey(ctx, the_key)) {
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static struct event_base *exit_base = NULL;
+static int n_connected = 0;
+static int n_echoed = 0;
+static int got_eof = 0;
+static int got_error = 0;
+
+/* Send everything the client sends us straight back. */
+static void
+server_readcb(struct bufferevent *bev, void *ctx)
+{
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+/* Check that what came back is what we sent; once it all has, hang up. */
+static void
+client_readcb(struct bufferevent *bev, void *ctx)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t i, len = evbuffer_get_length(input);
+	unsigned char *data = evbuffer_pullup(input, len);
+
+	for (i = 0; i < len; ++i) {
+		if (data[i] != (unsigned char)((n_echoed + i) * 7)) {
+			TT_FAIL(("Byte %d came back wrong",
+				(int)(n_echoed + i)));
+			event_base_loopexit(exit_base, NULL);
+			return;
+		}
+	}
+	evbuffer_drain(input, len);
+	n_echoed += (int)len;
+	if (n_echoed == N_ECHO)
+		bufferevent_free(bev);
+}
+
+static void
+client_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & BEV_EVENT_CONNECTED) {
+		++n_connected;
+	} else {
+		TT_FAIL(("Client got unexpected event %d", (int)what));
+		event_base_loopexit(exit_base, NULL);
+	}
+}
+
+static void
+server_eventcb(struct bufferevent *bev, short what, void *ctx)
+{
+	if (what & BEV_EVENT_CONNECTED) {
+		++n_connected;
+	} else {
+		if (what & BEV_EVENT_EOF)
+			++got_eof;
+		else
+			++got_error;
+		bufferevent_free(bev);
+		event_base_loopexit(exit_base, NULL);
+	}
+}
+
+/* Have a client send N_ECHO bytes to an echo server over TLS, either over
+ * a socket directly or (if filter is set) over socket bufferevents. */
+static void
+regress_bufferevent_openssl_impl(struct basic_test_data *data, int filter)
+{
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	struct bufferevent *under1 = NULL, *under2 = NULL;
+	SSL_CTX *ctx = NULL;
+	SSL *ssl1 = NULL, *ssl2 = NULL;
+	char buf[4096];
+	int i, j;
+	struct timeval tv = { 10, 0 };
+
+	exit_base = data->base;
+	init_ssl();
+	tt_assert(the_key);
+	tt_assert(the_cert);
+	tt_assert(ctx = get_ssl_ctx());
+	tt_assert(ssl1 = SSL_new(ctx));
+	tt_assert(ssl2 = SSL_new(ctx));
+
+	if (filter) {
+		under1 = bufferevent_socket_new(data->base, data->pair[0],
+		    BEV_OPT_CLOSE_ON_FREE);
+		under2 = bufferevent_socket_new(data->base, data->pair[1],
+		    BEV_OPT_CLOSE_ON_FREE);
+		tt_assert(under1);
+		tt_assert(under2);
+		bev1 = bufferevent_openssl_filter_new(data->base, under1,
+		    ssl1, BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+		bev2 = bufferevent_openssl_filter_new(data->base, under2,
+		    ssl2, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	} else {
+		bev1 = bufferevent_openssl_socket_new(data->base,
+		    data->pair[0], ssl1, BUFFEREVENT_SSL_CONNECTING,
+		    BEV_OPT_CLOSE_ON_FREE);
+		bev2 = bufferevent_openssl_socket_new(data->base,
+		    data->pair[1], ssl2, BUFFEREVENT_SSL_ACCEPTING,
+		    BEV_OPT_CLOSE_ON_FREE);
+	}
+	tt_assert(bev1);
+	tt_assert(bev2);
+	/* The bufferevents own the sockets and the SSLs now. */
+	data->pair[0] = data->pair[1] = -1;
+
+	tt_assert(bufferevent_openssl_get_ssl(bev1) == ssl1);
+	tt_assert(bufferevent_openssl_get_ssl(bev2) == ssl2);
+	if (filter) {
+		tt_assert(bufferevent_get_underlying(bev1) == under1);
+		tt_assert(bufferevent_openssl_get_ssl(under1) == NULL);
+	} else {
+		tt_int_op(bufferevent_getfd(bev1), >=, 0);
+	}
+	/* Idle connections shouldn't hang on to OpenSSL's buffers. */
+	tt_assert(SSL_get_mode(ssl1) & SSL_MODE_RELEASE_BUFFERS);
+	tt_assert(SSL_get_mode(ssl2) & SSL_MODE_RELEASE_BUFFERS);
+
+	bufferevent_setcb(bev1, client_readcb, NULL, client_eventcb, NULL);
+	bufferevent_setcb(bev2, server_readcb, NULL, server_eventcb, NULL);
+	/* Make the client stop and start reading on the way. */
+	bufferevent_setwatermark(bev1, EV_READ, 0, 10000);
+	bufferevent_enable(bev1, EV_READ|EV_WRITE);
+	bufferevent_enable(bev2, EV_READ|EV_WRITE);
+
+	/* Queue it all up before the handshake is even done. */
+	for (i = 0; i < N_ECHO; i += sizeof(buf)) {
+		for (j = 0; j < (int)sizeof(buf); ++j)
+			buf[j] = (char)((i + j) * 7);
+		bufferevent_write(bev1, buf, sizeof(buf));
+	}
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(n_connected, ==, 2);
+	tt_int_op(n_echoed, ==, N_ECHO);
+	/* The client just closed the connection; that's an EOF for us. */
+	tt_int_op(got_eof, ==, 1);
+	tt_int_op(got_error, ==, 0);
+
+end:
+	if (ctx)
+		SSL_CTX_free(ctx);
+}
+
+static void
+regress_bufferevent_openssl_socketpair(void *arg)
+{
+	regress_bufferevent_openssl_impl(arg, 0);
+}
+
+static void
+regress_bufferevent_openssl_filter(void *arg)
+{
+	regress_bufferevent_openssl_impl(arg, 1);
+}
+
+struct testcase_t ssl_testcases[] = {
+	{ "bufferevent_socketpair", regress_bufferevent_openssl_socketpair,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_filter", regress_bufferevent_openssl_filter,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+
+	END_OF_TESTCASES,
+};
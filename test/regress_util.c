@@ -46,8 +46,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "event2/event.h"
 #include "event2/util.h"
 #include "../ipv6-internal.h"
+#include "../log-internal.h"
 
 #include "regress.h"
 
@@ -300,12 +302,83 @@ test_evutil_snprintf(void *ptr)
 	;
 }
 
+static int logsink_n;
+static int logsink_severity;
+static char logsink_msg[256];
+
+static void
+logsink_cb(int severity, const char *msg)
+{
+	++logsink_n;
+	logsink_severity = severity;
+	evutil_snprintf(logsink_msg, sizeof(logsink_msg), "%s", msg);
+}
+
+static int ringsink_n;
+static int ringsink_in_order;
+
+static void
+ringsink_cb(int severity, const struct timeval *when, const char *msg)
+{
+	char expect[32];
+	evutil_snprintf(expect, sizeof(expect), "message %d", ringsink_n);
+	if (strcmp(msg, expect) || severity != _EVENT_LOG_WARN ||
+	    !when->tv_sec)
+		ringsink_in_order = 0;
+	++ringsink_n;
+}
+
+static void
+test_log_ring(void *ptr)
+{
+	int i;
+
+	event_set_log_callback(logsink_cb);
+	tt_int_op(event_enable_log_ring(0), ==, -1);
+	if (event_enable_log_ring(3) < 0)
+		tt_skip();
+	tt_int_op(event_enable_log_ring(3), ==, -1);
+
+	/* The ring holds four; the rest are dropped, not waited for. */
+	for (i = 0; i < 6; ++i)
+		event_warnx("message %d", i);
+	tt_int_op(logsink_n, ==, 0);
+	tt_int_op(event_log_ring_get_dropped(), ==, 2);
+
+	ringsink_in_order = 1;
+	tt_int_op(event_log_ring_drain(ringsink_cb), ==, 4);
+	tt_int_op(ringsink_n, ==, 4);
+	tt_assert(ringsink_in_order);
+	tt_int_op(event_log_ring_drain(ringsink_cb), ==, 0);
+
+	/* Round again, past the end of the ring, into the usual sink. */
+	for (i = 0; i < 3; ++i)
+		event_msgx("again %d", i);
+	tt_int_op(event_log_ring_drain(NULL), ==, 3);
+	tt_int_op(logsink_n, ==, 3);
+	tt_int_op(logsink_severity, ==, _EVENT_LOG_MSG);
+	tt_str_op(logsink_msg, ==, "again 2");
+
+	/* Whatever is left goes out when the ring goes away. */
+	event_warnx("last");
+	event_disable_log_ring();
+	tt_int_op(logsink_n, ==, 4);
+	tt_str_op(logsink_msg, ==, "last");
+	event_warnx("direct");
+	tt_int_op(logsink_n, ==, 5);
+
+end:
+	event_disable_log_ring();
+	event_set_log_callback(NULL);
+}
+
 struct testcase_t util_testcases[] = {
 	{ "ipv4_parse", regress_ipv4_parse, 0, NULL, NULL },
 	{ "ipv6_parse", regress_ipv6_parse, 0, NULL, NULL },
 	{ "sockaddr_port_parse", regress_sockaddr_port_parse, 0, NULL, NULL },
 	{ "evutil_snprintf", test_evutil_snprintf, 0, NULL, NULL },
 	{ "evutil_strtoll", test_evutil_strtoll, 0, NULL, NULL },
+	{ "log_ring", test_log_ring, TT_FORK, NULL, NULL },
 	END_OF_TESTCASES,
 };
 
@@ -7,6 +7,7 @@ setup () {
 	 EVENT_NOSELECT=yes; export EVENT_NOSELECT
 	 EVENT_NOEPOLL=yes; export EVENT_NOEPOLL
 	 EVENT_NOEVPORT=yes; export EVENT_NOEVPORT
+	 EVENT_NOIO_URING=yes; export EVENT_NOIO_URING
 }
 
 test () {
@@ -81,6 +82,28 @@ export EVENT_NOEPOLL
 echo "EPOLL"
 test
 
+setup
+unset EVENT_NOEPOLL
+export EVENT_NOEPOLL
+EVENT_EPOLL_USE_CHANGELIST=yes; export EVENT_EPOLL_USE_CHANGELIST
+echo "EPOLL (changelist)"
+test
+unset EVENT_EPOLL_USE_CHANGELIST
+
+setup
+unset EVENT_NOEPOLL
+export EVENT_NOEPOLL
+EVENT_USE_SIGNALFD=yes; export EVENT_USE_SIGNALFD
+echo "EPOLL (signalfd)"
+test
+unset EVENT_USE_SIGNALFD
+
+setup
+unset EVENT_NOIO_URING
+export EVENT_NOIO_URING
+echo "IO_URING"
+test
+
 setup
 unset EVENT_NOEVPORT
 export EVENT_NOEVPORT